@@ -0,0 +1,108 @@
+#include "base/lock_contention.h"
+
+#include <map>
+#include <memory>
+#include <sstream>
+
+#include "monitoring/histogram.h"
+
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+using std::chrono::milliseconds;
+using std::chrono::nanoseconds;
+using std::chrono::steady_clock;
+using std::lock_guard;
+using std::map;
+using std::memory_order_relaxed;
+using std::mutex;
+using std::ostringstream;
+using std::string;
+using std::unique_ptr;
+
+namespace cert_trans {
+namespace {
+
+
+mutex* ContentionsLock() {
+  static mutex* const lock(new mutex);
+  return lock;
+}
+
+
+Histogram<string>* LockWaitUs() {
+  static Histogram<string>* const histogram(Histogram<string>::New(
+      "lock_wait_us", "lock",
+      "Time spent waiting for the main locks, when they were contended, "
+      "in microseconds."));
+  return histogram;
+}
+
+
+Histogram<string>* LockHoldUs() {
+  static Histogram<string>* const histogram(Histogram<string>::New(
+      "lock_hold_us", "lock",
+      "Time the main locks were held, sampled, in microseconds."));
+  return histogram;
+}
+
+
+map<string, unique_ptr<LockContention>>* Contentions() {
+  static map<string, unique_ptr<LockContention>>* const registry(
+      new map<string, unique_ptr<LockContention>>);
+  return registry;
+}
+
+
+}  // namespace
+
+
+// static
+LockContention* LockContention::Get(const string& name) {
+  lock_guard<mutex> lock(*ContentionsLock());
+  unique_ptr<LockContention>& contention((*Contentions())[name]);
+  if (!contention) {
+    contention.reset(new LockContention(name));
+  }
+  return contention.get();
+}
+
+
+// static
+string LockContention::Report() {
+  ostringstream out;
+  lock_guard<mutex> lock(*ContentionsLock());
+  for (const auto& entry : *Contentions()) {
+    const LockContention& c(*entry.second);
+    out << c.name_ << ": " << c.contentions_.load(memory_order_relaxed)
+        << " contentions, "
+        << duration_cast<milliseconds>(
+               nanoseconds(c.wait_ns_.load(memory_order_relaxed))).count()
+        << " ms waited\n";
+  }
+  return out.str();
+}
+
+
+LockContention::LockContention(const string& name)
+    : name_(name),
+      contentions_(0),
+      wait_ns_(0),
+      wait_us_(LockWaitUs()->GetCell(name)),
+      hold_us_(LockHoldUs()->GetCell(name)) {
+}
+
+
+void LockContention::Waited(steady_clock::duration wait) {
+  contentions_.fetch_add(1, memory_order_relaxed);
+  wait_ns_.fetch_add(duration_cast<nanoseconds>(wait).count(),
+                     memory_order_relaxed);
+  wait_us_->Record(duration_cast<microseconds>(wait).count());
+}
+
+
+void LockContention::Held(steady_clock::duration hold) {
+  hold_us_->Record(duration_cast<microseconds>(hold).count());
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,139 @@
+#ifndef CERT_TRANS_BASE_LOCK_CONTENTION_H_
+#define CERT_TRANS_BASE_LOCK_CONTENTION_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+
+namespace cert_trans {
+
+
+class HistogramCell;
+
+
+// Counts how often threads had to wait for a lock, and for how long.
+// Objects of this class are never destroyed, get them with Get().
+//
+// The waits, and a sample of how long the lock was held, are also
+// exported as the "lock_wait_us" and "lock_hold_us" histograms,
+// labelled by the name of the lock.
+//
+// Locking goes through try_lock() first, and the clock is only read
+// when that fails, or for the holds sampled, so taking a free lock
+// costs about the same as usual.
+//
+// This class is thread-safe.
+class LockContention {
+ public:
+  // Each thread times one in this many of the locks it takes.
+  static const uint32_t kHoldSampleInterval = 64;
+
+  // Returns the LockContention for |name|, creating it if needed.
+  // Several locks can share a name (e.g. one per database object).
+  static LockContention* Get(const std::string& name);
+
+  // Writes a line per lock, with how many times it was contended and
+  // the total time spent waiting for it.
+  static std::string Report();
+
+  // Whether the calling thread should time how long it holds the lock
+  // it just took, and report it with Held().
+  static bool SampleHold() {
+    static thread_local uint32_t acquisitions(0);
+    return ++acquisitions % kHoldSampleInterval == 0;
+  }
+
+  const std::string& name() const {
+    return name_;
+  }
+
+  void Waited(std::chrono::steady_clock::duration wait);
+  void Held(std::chrono::steady_clock::duration hold);
+
+ private:
+  explicit LockContention(const std::string& name);
+  LockContention(const LockContention&) = delete;
+  LockContention& operator=(const LockContention&) = delete;
+
+  const std::string name_;
+  std::atomic<int64_t> contentions_;
+  std::atomic<int64_t> wait_ns_;
+  HistogramCell* const wait_us_;
+  HistogramCell* const hold_us_;
+};
+
+
+// Locks |mutex| (which can be anything with lock() and try_lock()),
+// recording the wait in |contention| if it was held.
+template <class Mutex>
+std::unique_lock<Mutex> ContendedLock(Mutex* mutex,
+                                      LockContention* contention) {
+  std::unique_lock<Mutex> lock(*mutex, std::try_to_lock);
+  if (!lock.owns_lock()) {
+    const std::chrono::steady_clock::time_point start(
+        std::chrono::steady_clock::now());
+    lock.lock();
+    contention->Waited(std::chrono::steady_clock::now() - start);
+  }
+  return lock;
+}
+
+
+// A drop-in replacement for std::mutex which records in |contention|
+// how long threads waited for it, and how long it was held (sampled).
+// Use std::condition_variable_any to wait on it.
+class ContendedMutex {
+ public:
+  explicit ContendedMutex(LockContention* contention)
+      : contention_(contention), hold_sampled_(false) {
+  }
+  ContendedMutex(const ContendedMutex&) = delete;
+  ContendedMutex& operator=(const ContendedMutex&) = delete;
+
+  void lock() {
+    if (!mutex_.try_lock()) {
+      const std::chrono::steady_clock::time_point start(
+          std::chrono::steady_clock::now());
+      mutex_.lock();
+      contention_->Waited(std::chrono::steady_clock::now() - start);
+    }
+    StartHold();
+  }
+
+  bool try_lock() {
+    if (!mutex_.try_lock()) {
+      return false;
+    }
+    StartHold();
+    return true;
+  }
+
+  void unlock() {
+    if (hold_sampled_) {
+      hold_sampled_ = false;
+      contention_->Held(std::chrono::steady_clock::now() - held_since_);
+    }
+    mutex_.unlock();
+  }
+
+ private:
+  void StartHold() {
+    hold_sampled_ = LockContention::SampleHold();
+    if (hold_sampled_) {
+      held_since_ = std::chrono::steady_clock::now();
+    }
+  }
+
+  std::mutex mutex_;
+  LockContention* const contention_;
+  // Only used by the thread holding |mutex_|.
+  bool hold_sampled_;
+  std::chrono::steady_clock::time_point held_since_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_BASE_LOCK_CONTENTION_H_
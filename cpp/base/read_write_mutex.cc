@@ -0,0 +1,82 @@
+#include "base/read_write_mutex.h"
+
+#include <errno.h>
+#include <glog/logging.h>
+#include <chrono>
+
+#include "base/lock_contention.h"
+
+using std::chrono::steady_clock;
+
+namespace cert_trans {
+
+
+ReadWriteMutex::ReadWriteMutex(LockContention* contention)
+    : contention_(contention), hold_sampled_(false) {
+  pthread_rwlockattr_t attr;
+  CHECK_EQ(0, pthread_rwlockattr_init(&attr));
+#ifdef __GLIBC__
+  // glibc prefers readers by default.
+  CHECK_EQ(0, pthread_rwlockattr_setkind_np(
+                  &attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP));
+#endif
+  CHECK_EQ(0, pthread_rwlock_init(&rwlock_, &attr));
+  CHECK_EQ(0, pthread_rwlockattr_destroy(&attr));
+}
+
+
+ReadWriteMutex::~ReadWriteMutex() {
+  CHECK_EQ(0, pthread_rwlock_destroy(&rwlock_));
+}
+
+
+void ReadWriteMutex::lock() {
+  if (!contention_) {
+    CHECK_EQ(0, pthread_rwlock_wrlock(&rwlock_));
+    return;
+  }
+  if (pthread_rwlock_trywrlock(&rwlock_) != 0) {
+    const steady_clock::time_point start(steady_clock::now());
+    CHECK_EQ(0, pthread_rwlock_wrlock(&rwlock_));
+    contention_->Waited(steady_clock::now() - start);
+  }
+  hold_sampled_ = LockContention::SampleHold();
+  if (hold_sampled_) {
+    held_since_ = steady_clock::now();
+  }
+}
+
+
+void ReadWriteMutex::unlock() {
+  if (hold_sampled_) {
+    hold_sampled_ = false;
+    contention_->Held(steady_clock::now() - held_since_);
+  }
+  CHECK_EQ(0, pthread_rwlock_unlock(&rwlock_));
+}
+
+
+void ReadWriteMutex::lock_shared() {
+  if (contention_ && pthread_rwlock_tryrdlock(&rwlock_) == 0) {
+    return;
+  }
+  const steady_clock::time_point start(contention_ ? steady_clock::now()
+                                                  : steady_clock::time_point());
+  int ret;
+  // This can fail transiently if the maximum number of readers is
+  // reached.
+  while ((ret = pthread_rwlock_rdlock(&rwlock_)) == EAGAIN) {
+  }
+  CHECK_EQ(0, ret);
+  if (contention_) {
+    contention_->Waited(steady_clock::now() - start);
+  }
+}
+
+
+void ReadWriteMutex::unlock_shared() {
+  CHECK_EQ(0, pthread_rwlock_unlock(&rwlock_));
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,66 @@
+#ifndef CERT_TRANS_BASE_READ_WRITE_MUTEX_H_
+#define CERT_TRANS_BASE_READ_WRITE_MUTEX_H_
+
+#include <pthread.h>
+#include <chrono>
+
+namespace cert_trans {
+
+class LockContention;
+
+
+// A mutex that can be held either exclusively, or shared by any
+// number of readers. It has the interface of std::mutex for the
+// exclusive case, so std::lock_guard and std::unique_lock can be used
+// by writers, and ReaderLock below for readers.
+//
+// Waiting writers are preferred over new readers where the platform
+// allows it, so that a steady stream of readers cannot starve them.
+//
+// If |contention| is set, the time spent waiting for the mutex (either
+// way) is recorded there, as is how long it was held exclusively
+// (sampled).
+class ReadWriteMutex {
+ public:
+  ReadWriteMutex() : ReadWriteMutex(nullptr) {
+  }
+  explicit ReadWriteMutex(LockContention* contention);
+  ~ReadWriteMutex();
+  ReadWriteMutex(const ReadWriteMutex&) = delete;
+  ReadWriteMutex& operator=(const ReadWriteMutex&) = delete;
+
+  void lock();
+  void unlock();
+
+  void lock_shared();
+  void unlock_shared();
+
+ private:
+  pthread_rwlock_t rwlock_;
+  LockContention* const contention_;
+  // Only used by the writer holding |rwlock_|.
+  bool hold_sampled_;
+  std::chrono::steady_clock::time_point held_since_;
+};
+
+
+// Holds a ReadWriteMutex shared for its lifetime.
+class ReaderLock {
+ public:
+  explicit ReaderLock(ReadWriteMutex* mutex) : mutex_(mutex) {
+    mutex_->lock_shared();
+  }
+  ~ReaderLock() {
+    mutex_->unlock_shared();
+  }
+  ReaderLock(const ReaderLock&) = delete;
+  ReaderLock& operator=(const ReaderLock&) = delete;
+
+ private:
+  ReadWriteMutex* const mutex_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_BASE_READ_WRITE_MUTEX_H_
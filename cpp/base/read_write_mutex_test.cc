@@ -0,0 +1,168 @@
+#include <gtest/gtest.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "base/lock_contention.h"
+#include "base/notification.h"
+#include "base/read_write_mutex.h"
+#include "monitoring/metric.h"
+#include "monitoring/registry.h"
+#include "util/testing.h"
+
+using cert_trans::ContendedMutex;
+using cert_trans::LockContention;
+using cert_trans::Metric;
+using cert_trans::Notification;
+using cert_trans::ReadWriteMutex;
+using cert_trans::ReaderLock;
+using cert_trans::Registry;
+using std::chrono::milliseconds;
+using std::lock_guard;
+using std::string;
+using std::thread;
+using std::vector;
+
+namespace {
+
+
+TEST(ReadWriteMutexTest, ReadersShare) {
+  ReadWriteMutex mutex;
+  ReaderLock lock(&mutex);
+
+  Notification other_reader;
+  thread reader([&mutex, &other_reader]() {
+    ReaderLock lock(&mutex);
+    other_reader.Notify();
+  });
+  // This would deadlock if readers excluded each other.
+  other_reader.WaitForNotification();
+  reader.join();
+}
+
+
+TEST(ReadWriteMutexTest, WriterExcludesReaders) {
+  ReadWriteMutex mutex;
+  Notification reader_done;
+  thread reader;
+  {
+    lock_guard<ReadWriteMutex> lock(mutex);
+    reader = thread([&mutex, &reader_done]() {
+      ReaderLock lock(&mutex);
+      reader_done.Notify();
+    });
+    EXPECT_FALSE(reader_done.WaitForNotificationWithTimeout(milliseconds(50)));
+  }
+  reader_done.WaitForNotification();
+  reader.join();
+}
+
+
+TEST(ReadWriteMutexTest, ConcurrentReadersAndWriters) {
+  const int kThreads = 8;
+  const int kIterations = 10000;
+  ReadWriteMutex mutex;
+  // Both halves are always equal when read under the lock.
+  int first(0), second(0);
+  std::atomic<int> torn_reads(0);
+
+  vector<thread> threads;
+  for (int t = 0; t < kThreads; ++t) {
+    threads.emplace_back([&, t]() {
+      for (int i = 0; i < kIterations; ++i) {
+        if (t % 2 == 0) {
+          lock_guard<ReadWriteMutex> lock(mutex);
+          ++first;
+          ++second;
+        } else {
+          ReaderLock lock(&mutex);
+          if (first != second) {
+            ++torn_reads;
+          }
+        }
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(0, torn_reads.load());
+  EXPECT_EQ(kThreads / 2 * kIterations, first);
+}
+
+
+TEST(ReadWriteMutexTest, RecordsContention) {
+  ReadWriteMutex mutex(LockContention::Get("rw_test"));
+  {
+    // Not contended.
+    ReaderLock lock(&mutex);
+  }
+  Notification reader_waiting;
+  thread reader;
+  {
+    lock_guard<ReadWriteMutex> lock(mutex);
+    reader = thread([&mutex, &reader_waiting]() {
+      reader_waiting.Notify();
+      ReaderLock lock(&mutex);
+    });
+    reader_waiting.WaitForNotification();
+    std::this_thread::sleep_for(milliseconds(20));
+  }
+  reader.join();
+
+  const string report(LockContention::Report());
+  EXPECT_NE(string::npos, report.find("rw_test: 1 contentions, "))
+      << report;
+}
+
+
+// Returns the number of values recorded by the histogram |name| for
+// the lock |lock|.
+uint64_t Recorded(const string& name, const string& lock) {
+  for (const Metric* metric : Registry::Instance()->GetMetrics()) {
+    if (metric->Name() == name) {
+      const auto distributions(metric->CurrentDistributions());
+      const auto it(distributions.find({lock}));
+      return it == distributions.end() ? 0 : it->second.count;
+    }
+  }
+  return 0;
+}
+
+
+TEST(ContendedMutexTest, RecordsWaitsAndHolds) {
+  ContendedMutex mutex(LockContention::Get("contended_test"));
+  // Whichever of them the thread is at, one of these holds is timed.
+  for (uint32_t i = 0; i < LockContention::kHoldSampleInterval; ++i) {
+    lock_guard<ContendedMutex> lock(mutex);
+  }
+  EXPECT_EQ(1U, Recorded("lock_hold_us", "contended_test"));
+  EXPECT_EQ(0U, Recorded("lock_wait_us", "contended_test"));
+
+  Notification other_waiting;
+  thread other;
+  {
+    lock_guard<ContendedMutex> lock(mutex);
+    other = thread([&mutex, &other_waiting]() {
+      other_waiting.Notify();
+      lock_guard<ContendedMutex> lock(mutex);
+    });
+    other_waiting.WaitForNotification();
+    std::this_thread::sleep_for(milliseconds(20));
+  }
+  other.join();
+  EXPECT_EQ(1U, Recorded("lock_wait_us", "contended_test"));
+  const string report(LockContention::Report());
+  EXPECT_NE(string::npos, report.find("contended_test: 1 contentions, "))
+      << report;
+}
+
+
+}  // namespace
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -1,39 +1,67 @@
 #include "client/async_log_client.h"
 
+#include <event2/buffer.h>
 #include <event2/http.h>
 #include <glog/logging.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+#include <string.h>
+#include <zlib.h>
 #include <algorithm>
+#include <climits>
+#include <deque>
 #include <iterator>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <utility>
 
 #include "log/cert.h"
 #include "proto/cert_serializer.h"
 #include "proto/serializer.h"
+#include "util/json_reader.h"
 #include "util/json_wrapper.h"
+#include "util/protobuf_util.h"
 
 using cert_trans::AsyncLogClient;
 using cert_trans::Cert;
 using cert_trans::CertChain;
 using cert_trans::PreCertChain;
+using cert_trans::ReadDelimitedFrom;
 using cert_trans::URL;
 using cert_trans::UrlFetcher;
 using cert_trans::serialization::DeserializeResult;
 using ct::DigitallySigned;
+using ct::LoggedEntryPB;
 using ct::MerkleAuditProof;
 using ct::SignedCertificateTimestamp;
 using ct::SignedTreeHead;
 using std::back_inserter;
 using std::bind;
+using std::deque;
+using std::enable_shared_from_this;
+using std::make_pair;
+using std::make_shared;
+using std::map;
+using std::min;
 using std::move;
+using std::mutex;
+using std::pair;
 using std::placeholders::_1;
+using std::shared_ptr;
 using std::string;
 using std::to_string;
+using std::unique_lock;
 using std::unique_ptr;
 using std::vector;
+using util::JsonReader;
 
 namespace {
 
 
+// The most a compressed get-entries-binary reply may inflate to.
+const size_t kMaxInflatedSize = 256 << 20;
+
+
 string UriEncode(const string& input) {
   const unique_ptr<char, void (*)(void*)> output(
       evhttp_uriencode(input.data(), input.size(), false), &free);
@@ -142,7 +170,48 @@ void DoneGetRoots(UrlFetcher::Response* resp, vector<unique_ptr<Cert>>* roots,
 }
 
 
+// Parses the encodings of an entry served by get-entries into |entry|,
+// |sct_data| being optional.
+bool ParseEntry(const string& leaf_input, const string& extra_data,
+                const string* sct_data, AsyncLogClient::Entry* entry) {
+  if (Deserializer::DeserializeMerkleTreeLeaf(leaf_input, &entry->leaf) !=
+      DeserializeResult::OK) {
+    return false;
+  }
+
+  if (sct_data) {
+    unique_ptr<SignedCertificateTimestamp> sct(
+        new SignedCertificateTimestamp);
+    if (Deserializer::DeserializeSCT(*sct_data, sct.get()) !=
+        DeserializeResult::OK) {
+      return false;
+    }
+    entry->sct = move(sct);
+  }
+
+  switch (entry->leaf.timestamped_entry().entry_type()) {
+    case ct::X509_ENTRY:
+      DeserializeX509Chain(extra_data, entry->entry.mutable_x509_entry());
+      break;
+    case ct::PRECERT_ENTRY:
+      DeserializePrecertChainEntry(extra_data,
+                                   entry->entry.mutable_precert_entry());
+      break;
+    case ct::X_JSON_ENTRY:
+      // nothing to do
+      break;
+    default:
+      LOG(FATAL) << "Don't understand entry type: "
+                 << entry->leaf.timestamped_entry().entry_type();
+  }
+
+  return true;
+}
+
+
+// The body of |resp| is in |body|.
 void DoneGetEntries(UrlFetcher::Response* resp,
+                    const shared_ptr<evbuffer>& body,
                     vector<AsyncLogClient::Entry>* entries,
                     const AsyncLogClient::Callback& done, util::Task* task) {
   unique_ptr<UrlFetcher::Response> resp_deleter(CHECK_NOTNULL(resp));
@@ -152,71 +221,142 @@ void DoneGetEntries(UrlFetcher::Response* resp,
     return;
   }
 
-  JsonObject jresponse(resp->body);
-  if (!jresponse.Ok())
-    return done(AsyncLogClient::BAD_RESPONSE);
-
-  JsonArray jentries(jresponse, "entries");
-  if (!jentries.Ok())
+  // Pages can be large and only a few fields of each entry are used,
+  // so they are read in place rather than built into a json-c tree.
+  const size_t length(evbuffer_get_length(body.get()));
+  JsonReader reader(reinterpret_cast<const char*>(
+                        evbuffer_pullup(body.get(), -1)),
+                    length);
+  vector<AsyncLogClient::Entry> new_entries;
+  bool has_entries(false);
+  string name;
+  if (!reader.EnterObject()) {
     return done(AsyncLogClient::BAD_RESPONSE);
+  }
+  while (reader.NextMember(&name)) {
+    if (name != "entries") {
+      reader.Skip();
+      continue;
+    }
+    has_entries = reader.EnterArray();
+    while (reader.NextElement()) {
+      bool has_leaf_input(false);
+      string leaf_input;
+      bool has_extra_data(false);
+      string extra_data;
+      bool has_sct(false);
+      string sct;
+
+      reader.EnterObject();
+      while (reader.NextMember(&name)) {
+        if (name == "leaf_input") {
+          has_leaf_input = reader.ReadString(&leaf_input);
+        } else if (name == "extra_data") {
+          has_extra_data = reader.ReadString(&extra_data);
+        } else if (name == "sct") {
+          // This is an optional non-standard extension, used only by
+          // the log internally when running in clustered mode.
+          has_sct = reader.ReadString(&sct);
+        } else {
+          reader.Skip();
+        }
+      }
+      if (!reader.ok() || !has_leaf_input || !has_extra_data) {
+        return done(AsyncLogClient::BAD_RESPONSE);
+      }
 
-  vector<AsyncLogClient::Entry> new_entries;
-  new_entries.reserve(jentries.Length());
+      if (has_sct) {
+        sct = util::FromBase64(sct.c_str());
+      }
+      AsyncLogClient::Entry log_entry;
+      if (!ParseEntry(util::FromBase64(leaf_input.c_str()),
+                      util::FromBase64(extra_data.c_str()),
+                      has_sct ? &sct : nullptr, &log_entry)) {
+        return done(AsyncLogClient::BAD_RESPONSE);
+      }
 
-  for (int n = 0; n < jentries.Length(); ++n) {
-    JsonObject entry(jentries, n);
-    if (!entry.Ok()) {
-      return done(AsyncLogClient::BAD_RESPONSE);
+      new_entries.emplace_back(move(log_entry));
     }
+  }
+  if (!reader.Finish() || !has_entries) {
+    return done(AsyncLogClient::BAD_RESPONSE);
+  }
 
-    JsonString leaf_input(entry, "leaf_input");
-    if (!leaf_input.Ok()) {
-      return done(AsyncLogClient::BAD_RESPONSE);
-    }
+  entries->reserve(entries->size() + new_entries.size());
+  move(new_entries.begin(), new_entries.end(), back_inserter(*entries));
 
-    AsyncLogClient::Entry log_entry;
-    if (Deserializer::DeserializeMerkleTreeLeaf(leaf_input.FromBase64(),
-                                                &log_entry.leaf) !=
-        DeserializeResult::OK) {
-      return done(AsyncLogClient::BAD_RESPONSE);
-    }
+  return done(AsyncLogClient::OK);
+}
 
-    JsonString extra_data(entry, "extra_data");
-    if (!extra_data.Ok()) {
-      return done(AsyncLogClient::BAD_RESPONSE);
-    }
 
-    // This is an optional non-standard extension, used only by the log
-    // internally when running in clustered mode.
-    JsonString sct_data(entry, "sct");
-    if (sct_data.Ok()) {
-      unique_ptr<SignedCertificateTimestamp> sct(
-          new SignedCertificateTimestamp);
-      if (Deserializer::DeserializeSCT(sct_data.FromBase64(), sct.get()) !=
-          DeserializeResult::OK) {
-        return done(AsyncLogClient::BAD_RESPONSE);
+// Inflates the zlib format |data|, returning false if it is corrupt
+// or inflates to more than kMaxInflatedSize.
+bool Inflate(const string& data, string* result) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  CHECK_EQ(Z_OK, inflateInit(&stream));
+
+  stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+  stream.avail_in = data.size();
+  result->resize(std::max<size_t>(4 * data.size(), 4096));
+  int ret(Z_OK);
+  while (ret == Z_OK) {
+    if (stream.total_out == result->size()) {
+      if (result->size() >= kMaxInflatedSize) {
+        break;
       }
-      log_entry.sct = move(sct);
+      result->resize(std::min(2 * result->size(), kMaxInflatedSize));
     }
+    stream.next_out = reinterpret_cast<Bytef*>(&(*result)[stream.total_out]);
+    stream.avail_out = result->size() - stream.total_out;
+    ret = inflate(&stream, Z_NO_FLUSH);
+  }
+  result->resize(stream.total_out);
+  const bool complete(ret == Z_STREAM_END && stream.avail_in == 0);
+  CHECK_EQ(Z_OK, inflateEnd(&stream));
 
-    switch (log_entry.leaf.timestamped_entry().entry_type()) {
-      case ct::X509_ENTRY:
-        DeserializeX509Chain(extra_data.FromBase64(),
-                             log_entry.entry.mutable_x509_entry());
-        break;
-      case ct::PRECERT_ENTRY:
-        DeserializePrecertChainEntry(extra_data.FromBase64(),
-                                     log_entry.entry.mutable_precert_entry());
-        break;
-      case ct::X_JSON_ENTRY:
-        // nothing to do
-        break;
-      default:
-        LOG(FATAL) << "Don't understand entry type: "
-                   << log_entry.leaf.timestamped_entry().entry_type();
+  return complete;
+}
+
+
+void DoneGetEntriesBinary(UrlFetcher::Response* resp,
+                          vector<AsyncLogClient::Entry>* entries,
+                          const AsyncLogClient::Callback& done,
+                          util::Task* task) {
+  unique_ptr<UrlFetcher::Response> resp_deleter(CHECK_NOTNULL(resp));
+  unique_ptr<util::Task> task_deleter(CHECK_NOTNULL(task));
+
+  if (!SanityCheck(resp, done, task)) {
+    return;
+  }
+
+  // The server may not have compressed the reply, even if asked to.
+  const auto encoding(resp->headers.find("Content-Encoding"));
+  string inflated;
+  if (encoding != resp->headers.end()) {
+    if (encoding->second != "deflate" || !Inflate(resp->body, &inflated)) {
+      return done(AsyncLogClient::BAD_RESPONSE);
     }
+  }
+  const string& body(encoding != resp->headers.end() ? inflated
+                                                      : resp->body);
 
+  vector<AsyncLogClient::Entry> new_entries;
+  google::protobuf::io::ArrayInputStream input(body.data(), body.size());
+  LoggedEntryPB::Serialized serialized;
+  bool clean_eof;
+  while (ReadDelimitedFrom(&input, &serialized, &clean_eof)) {
+    AsyncLogClient::Entry log_entry;
+    if (!ParseEntry(serialized.leaf_input(), serialized.extra_data(),
+                    serialized.has_sct() ? &serialized.sct() : nullptr,
+                    &log_entry)) {
+      return done(AsyncLogClient::BAD_RESPONSE);
+    }
     new_entries.emplace_back(move(log_entry));
+    serialized.Clear();
+  }
+  if (!clean_eof) {
+    return done(AsyncLogClient::BAD_RESPONSE);
   }
 
   entries->reserve(entries->size() + new_entries.size());
@@ -306,45 +446,33 @@ void DoneGetSTHConsistency(UrlFetcher::Response* resp, vector<string>* proof,
 }
 
 
-void DoneInternalAddChain(UrlFetcher::Response* resp,
-                          SignedCertificateTimestamp* sct,
-                          const AsyncLogClient::Callback& done,
-                          util::Task* task) {
-  unique_ptr<UrlFetcher::Response> resp_deleter(CHECK_NOTNULL(resp));
-  unique_ptr<util::Task> task_deleter(CHECK_NOTNULL(task));
-
-  if (!SanityCheck(resp, done, task)) {
-    return;
-  }
-
-  JsonObject jresponse(resp->body);
-  if (!jresponse.Ok())
-    return done(AsyncLogClient::BAD_RESPONSE);
-
+// Parses the SCT fields of an add-chain reply.
+bool ParseSCTReply(const JsonObject& jresponse,
+                   SignedCertificateTimestamp* sct) {
   if (!jresponse.IsType(json_type_object))
-    return done(AsyncLogClient::BAD_RESPONSE);
+    return false;
 
   JsonString id(jresponse, "id");
   if (!id.Ok())
-    return done(AsyncLogClient::BAD_RESPONSE);
+    return false;
 
   JsonInt timestamp(jresponse, "timestamp");
   if (!timestamp.Ok() || timestamp.Value() < 0)
-    return done(AsyncLogClient::BAD_RESPONSE);
+    return false;
 
   JsonString extensions(jresponse, "extensions");
   if (!extensions.Ok())
-    return done(AsyncLogClient::BAD_RESPONSE);
+    return false;
 
   JsonString jsignature(jresponse, "signature");
   if (!jsignature.Ok())
-    return done(AsyncLogClient::BAD_RESPONSE);
+    return false;
 
   DigitallySigned signature;
   if (Deserializer::DeserializeDigitallySigned(jsignature.FromBase64(),
                                                &signature) !=
       DeserializeResult::OK)
-    return done(AsyncLogClient::BAD_RESPONSE);
+    return false;
 
   sct->Clear();
   sct->set_version(ct::V1);
@@ -352,11 +480,249 @@ void DoneInternalAddChain(UrlFetcher::Response* resp,
   sct->set_timestamp(timestamp.Value());
   sct->set_extensions(extensions.FromBase64());
   sct->mutable_signature()->CopyFrom(signature);
+  return true;
+}
+
+
+void DoneInternalAddChain(UrlFetcher::Response* resp,
+                          SignedCertificateTimestamp* sct,
+                          const AsyncLogClient::Callback& done,
+                          util::Task* task) {
+  unique_ptr<UrlFetcher::Response> resp_deleter(CHECK_NOTNULL(resp));
+  unique_ptr<util::Task> task_deleter(CHECK_NOTNULL(task));
+
+  if (!SanityCheck(resp, done, task)) {
+    return;
+  }
+
+  JsonObject jresponse(resp->body);
+  if (!jresponse.Ok())
+    return done(AsyncLogClient::BAD_RESPONSE);
+
+  if (!ParseSCTReply(jresponse, sct))
+    return done(AsyncLogClient::BAD_RESPONSE);
+
+  return done(AsyncLogClient::OK);
+}
+
+
+void DoneAddChains(UrlFetcher::Response* resp, size_t num_chains,
+                   vector<AsyncLogClient::AddChainResult>* results,
+                   const AsyncLogClient::Callback& done, util::Task* task) {
+  unique_ptr<UrlFetcher::Response> resp_deleter(CHECK_NOTNULL(resp));
+  unique_ptr<util::Task> task_deleter(CHECK_NOTNULL(task));
+
+  if (task->status().ok() && resp->status_code == HTTP_NOTFOUND) {
+    return done(AsyncLogClient::NOT_SUPPORTED);
+  }
+  if (!SanityCheck(resp, done, task)) {
+    return;
+  }
+
+  JsonObject jresponse(resp->body);
+  if (!jresponse.Ok())
+    return done(AsyncLogClient::BAD_RESPONSE);
+
+  JsonArray jresults(jresponse, "results");
+  if (!jresults.Ok() || static_cast<size_t>(jresults.Length()) != num_chains)
+    return done(AsyncLogClient::BAD_RESPONSE);
+
+  results->clear();
+  results->resize(num_chains);
+  for (int i = 0; i < jresults.Length(); ++i) {
+    JsonObject jresult(jresults, i);
+    if (!jresult.Ok())
+      return done(AsyncLogClient::BAD_RESPONSE);
+
+    AsyncLogClient::AddChainResult* const result(&(*results)[i]);
+    JsonString error_message(jresult, "error_message");
+    if (error_message.Ok()) {
+      result->error_message = error_message.Value();
+    } else if (ParseSCTReply(jresult, &result->sct)) {
+      result->ok = true;
+    } else {
+      return done(AsyncLogClient::BAD_RESPONSE);
+    }
+  }
 
   return done(AsyncLogClient::OK);
 }
 
 
+// The state of a GetEntryRange() call. It is kept alive by the
+// callbacks of its requests.
+class RangeFetch : public enable_shared_from_this<RangeFetch> {
+ public:
+  RangeFetch(AsyncLogClient* client, int64_t first, int64_t last,
+             const AsyncLogClient::RangeOptions& options,
+             const AsyncLogClient::EntriesCallback& entries,
+             const AsyncLogClient::Callback& done)
+      : client_(client),
+        last_(last),
+        options_(options),
+        entries_cb_(entries),
+        done_cb_(done),
+        chunk_size_(std::max(options.chunk_size, 1)),
+        next_start_(first),
+        next_delivery_(first),
+        in_flight_(0),
+        delivering_(false),
+        finished_(false),
+        status_(AsyncLogClient::OK) {
+  }
+
+  void Start() {
+    unique_lock<mutex> lock(lock_);
+    StartFetches(&lock);
+    MaybeFinish(&lock);
+  }
+
+ private:
+  struct Chunk {
+    int64_t start;
+    int64_t end;
+    int attempt;
+  };
+
+  void StartFetches(unique_lock<mutex>* lock) {
+    const int max_in_flight(std::max(options_.max_in_flight, 1));
+    // Bounds what is kept waiting for an earlier request to complete.
+    const int64_t max_ahead(2 * max_in_flight * chunk_size_);
+    while (status_ == AsyncLogClient::OK && in_flight_ < max_in_flight) {
+      Chunk chunk;
+      if (!retries_.empty()) {
+        chunk = retries_.front();
+        retries_.pop_front();
+      } else if (next_start_ <= last_ &&
+                 next_start_ - next_delivery_ < max_ahead) {
+        chunk.start = next_start_;
+        chunk.end = min(last_, next_start_ + chunk_size_ - 1);
+        chunk.attempt = 0;
+        next_start_ = chunk.end + 1;
+      } else {
+        break;
+      }
+      ++in_flight_;
+      Fetch(chunk, lock);
+    }
+  }
+
+  // |lock| is released during the call, as the completion may run
+  // before it returns.
+  void Fetch(const Chunk& chunk, unique_lock<mutex>* lock) {
+    const shared_ptr<vector<AsyncLogClient::Entry>> received(
+        make_shared<vector<AsyncLogClient::Entry>>());
+    const shared_ptr<RangeFetch> self(shared_from_this());
+    const AsyncLogClient::Callback done(
+        [self, chunk, received](AsyncLogClient::Status status) {
+          self->FetchDone(chunk, received.get(), status);
+        });
+    lock->unlock();
+    if (options_.request_scts) {
+      client_->GetEntriesAndSCTs(chunk.start, chunk.end, received.get(),
+                                 done);
+    } else {
+      client_->GetEntries(chunk.start, chunk.end, received.get(), done);
+    }
+    lock->lock();
+  }
+
+  void FetchDone(const Chunk& chunk, vector<AsyncLogClient::Entry>* received,
+                 AsyncLogClient::Status status) {
+    unique_lock<mutex> lock(lock_);
+    --in_flight_;
+    const int64_t requested(chunk.end - chunk.start + 1);
+    if (status == AsyncLogClient::OK &&
+        static_cast<int64_t>(received->size()) > requested) {
+      status = AsyncLogClient::BAD_RESPONSE;
+    }
+    if (status != AsyncLogClient::OK || received->empty()) {
+      if (chunk.attempt < options_.max_retries) {
+        LOG(INFO) << "Retrying entries " << chunk.start << "-" << chunk.end;
+        retries_.push_front(Chunk{chunk.start, chunk.end, chunk.attempt + 1});
+      } else if (status_ == AsyncLogClient::OK) {
+        LOG(WARNING) << "Failed to get entries " << chunk.start << "-"
+                     << chunk.end << ": " << status;
+        status_ = status != AsyncLogClient::OK ? status
+                                               : AsyncLogClient::BAD_RESPONSE;
+      }
+    } else {
+      const int64_t count(received->size());
+      if (count < requested) {
+        // The server returned what it could, ask for the rest, and
+        // for no more than that at a time from now on.
+        chunk_size_ = min(chunk_size_, count);
+        retries_.push_front(Chunk{chunk.start + count, chunk.end, 0});
+      }
+      CHECK(ready_.insert(make_pair(chunk.start, move(*received))).second);
+    }
+
+    StartFetches(&lock);
+    Deliver(&lock);
+    MaybeFinish(&lock);
+  }
+
+  // Passes the entries which are next in order to |entries_cb_|, one
+  // caller at a time.
+  void Deliver(unique_lock<mutex>* lock) {
+    if (delivering_) {
+      return;
+    }
+    delivering_ = true;
+    while (status_ == AsyncLogClient::OK) {
+      const auto it(ready_.find(next_delivery_));
+      if (it == ready_.end()) {
+        break;
+      }
+      const int64_t start(it->first);
+      vector<AsyncLogClient::Entry> entries(move(it->second));
+      ready_.erase(it);
+      next_delivery_ += entries.size();
+      lock->unlock();
+      entries_cb_(start, &entries);
+      lock->lock();
+      StartFetches(lock);
+    }
+    delivering_ = false;
+  }
+
+  // Calls |done_cb_| once everything is over.
+  void MaybeFinish(unique_lock<mutex>* lock) {
+    if (finished_ || delivering_ || in_flight_ > 0) {
+      return;
+    }
+    if (status_ == AsyncLogClient::OK && next_delivery_ <= last_) {
+      return;
+    }
+    finished_ = true;
+    const AsyncLogClient::Status status(status_);
+    lock->unlock();
+    done_cb_(status);
+  }
+
+  AsyncLogClient* const client_;
+  const int64_t last_;
+  const AsyncLogClient::RangeOptions options_;
+  const AsyncLogClient::EntriesCallback entries_cb_;
+  const AsyncLogClient::Callback done_cb_;
+
+  mutex lock_;
+  int64_t chunk_size_;
+  // The first entry not requested yet.
+  int64_t next_start_;
+  // The first entry not passed to |entries_cb_| yet.
+  int64_t next_delivery_;
+  int in_flight_;
+  // Ranges to request again, before moving on.
+  deque<Chunk> retries_;
+  // Received entries, by index of the first one.
+  map<int64_t, vector<AsyncLogClient::Entry>> ready_;
+  bool delivering_;
+  bool finished_;
+  AsyncLogClient::Status status_;
+};
+
+
 URL NormalizeURL(const string& server_url) {
   URL retval(server_url);
   string newpath(retval.Path());
@@ -410,6 +776,24 @@ void AsyncLogClient::GetEntries(int first, int last, vector<Entry>* entries,
 }
 
 
+void AsyncLogClient::GetEntryRange(int64_t first, int64_t last,
+                                   const RangeOptions& options,
+                                   const EntriesCallback& entries,
+                                   const Callback& done) {
+  CHECK_GE(first, 0);
+  CHECK_LE(last, INT_MAX);
+  CHECK(entries);
+
+  if (last < first) {
+    done(INVALID_INPUT);
+    return;
+  }
+
+  make_shared<RangeFetch>(this, first, last, options, entries, done)
+      ->Start();
+}
+
+
 void AsyncLogClient::GetEntriesAndSCTs(int first, int last,
                                        vector<Entry>* entries,
                                        const Callback& done) {
@@ -434,9 +818,40 @@ void AsyncLogClient::InternalGetEntries(int first, int last,
   url.SetQuery("start=" + to_string(first) + "&end=" + to_string(last) +
                (request_scts ? "&include_scts=true" : ""));
 
+  UrlFetcher::Response* const resp(new UrlFetcher::Response);
+  // Pages of entries can be large: they are not copied into one
+  // string before being parsed.
+  const shared_ptr<evbuffer> body(CHECK_NOTNULL(evbuffer_new()),
+                                  evbuffer_free);
+  resp->body_chunk = [body](evbuffer* chunk) {
+    CHECK_EQ(evbuffer_add_buffer(body.get(), chunk), 0);
+  };
+  fetcher_->Fetch(url, resp, new util::Task(bind(DoneGetEntries, resp, body,
+                                                 entries, done, _1),
+                                            executor_));
+}
+
+
+void AsyncLogClient::GetEntriesBinary(int first, int last, bool request_scts,
+                                      bool compress, vector<Entry>* entries,
+                                      const Callback& done) {
+  CHECK_GE(first, 0);
+  CHECK_GE(last, 0);
+
+  if (last < first) {
+    done(INVALID_INPUT);
+    return;
+  }
+
+  URL url(GetURL("get-entries-binary"));
+  url.SetQuery("start=" + to_string(first) + "&end=" + to_string(last) +
+               (request_scts ? "&include_scts=true" : "") +
+               (compress ? "&compress=true" : ""));
+
   UrlFetcher::Response* const resp(new UrlFetcher::Response);
   fetcher_->Fetch(url, resp,
-                  new util::Task(bind(DoneGetEntries, resp, entries, done, _1),
+                  new util::Task(bind(DoneGetEntriesBinary, resp, entries,
+                                      done, _1),
                                  executor_));
 }
 
@@ -488,6 +903,43 @@ void AsyncLogClient::AddPreCertChain(const PreCertChain& pre_cert_chain,
 }
 
 
+void AsyncLogClient::AddChains(const vector<const CertChain*>& chains,
+                               bool pre_cert, vector<AddChainResult>* results,
+                               const Callback& done) {
+  if (chains.empty())
+    return done(INVALID_INPUT);
+
+  JsonArray jchains;
+  for (const CertChain* cert_chain : chains) {
+    if (!cert_chain->IsLoaded())
+      return done(INVALID_INPUT);
+
+    JsonArray jchain;
+    for (size_t n = 0; n < cert_chain->Length(); ++n) {
+      string cert;
+      CHECK_EQ(::util::OkStatus(), cert_chain->CertAt(n)->DerEncoding(&cert));
+      jchain.AddBase64(cert);
+    }
+    JsonObject jentry;
+    jentry.Add("chain", jchain);
+    jchains.Add(&jentry);
+  }
+
+  JsonObject jsend;
+  jsend.Add("chains", jchains);
+
+  UrlFetcher::Request req(GetURL(pre_cert ? "add-pre-chains" : "add-chains"));
+  req.verb = UrlFetcher::Verb::POST;
+  req.body = jsend.ToString();
+
+  UrlFetcher::Response* const resp(new UrlFetcher::Response);
+  fetcher_->Fetch(req, resp,
+                  new util::Task(bind(DoneAddChains, resp, chains.size(),
+                                      results, done, _1),
+                                 executor_));
+}
+
+
 URL AsyncLogClient::GetURL(const std::string& subpath) const {
   URL retval(server_url_);
   CHECK(!retval.Path().empty());
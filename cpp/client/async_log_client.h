@@ -30,6 +30,8 @@ class AsyncLogClient {
     BAD_RESPONSE,
     UNKNOWN_ERROR,
     INVALID_INPUT,
+    // The server does not have the endpoint (see AddChains()).
+    NOT_SUPPORTED,
   };
 
   struct Entry {
@@ -45,6 +47,32 @@ class AsyncLogClient {
 
   typedef std::function<void(Status)> Callback;
 
+  // The outcome of each chain submitted with AddChains().
+  struct AddChainResult {
+    bool ok = false;
+    ct::SignedCertificateTimestamp sct;
+    // Set if the log did not accept the chain.
+    std::string error_message;
+  };
+
+  // Options for GetEntryRange().
+  struct RangeOptions {
+    // The number of entries asked for by each request. It is lowered to
+    // what the server returns, if it returns fewer (servers cap the
+    // size of their replies).
+    int chunk_size = 1000;
+    // The number of requests kept in flight at once.
+    int max_in_flight = 4;
+    // How many times a request is retried before giving up.
+    int max_retries = 3;
+    bool request_scts = false;
+  };
+
+  // Called with entries starting at index |first|. The callee may
+  // take the contents of |entries|.
+  typedef std::function<void(int64_t first, std::vector<Entry>* entries)>
+      EntriesCallback;
+
   // The "executor" will be used to run callbacks.
   // TODO(pphaneuf): The executor would not be necessary if we
   // converted this API to use util::Task.
@@ -55,6 +83,10 @@ class AsyncLogClient {
   AsyncLogClient(const AsyncLogClient&) = delete;
   AsyncLogClient& operator=(const AsyncLogClient&) = delete;
 
+  const URL& server_url() const {
+    return server_url_;
+  }
+
   void GetSTH(ct::SignedTreeHead* sth, const Callback& done);
 
   // This does not clear "roots" before appending to it.
@@ -66,6 +98,16 @@ class AsyncLogClient {
   void GetEntries(int first, int last, std::vector<Entry>* entries,
                   const Callback& done);
 
+  // Downloads the entries |first| to |last| (inclusive), splitting
+  // the range in several requests and keeping a few of them in flight
+  // at once (see RangeOptions). The entries are passed to |entries| as
+  // they arrive, in order, and one call at a time. Requests which fail
+  // or return fewer entries than asked for are retried, or requested
+  // again for the remainder. Finally, "done" is called, with OK if all
+  // the entries were passed to |entries|.
+  void GetEntryRange(int64_t first, int64_t last, const RangeOptions& options,
+                     const EntriesCallback& entries, const Callback& done);
+
   // This is NON-standard, and only works with this log implementation.
   // It's intended for internal use when running in a clustered configuration.
   // This does not clear "entries" before appending the retrieved
@@ -73,6 +115,13 @@ class AsyncLogClient {
   void GetEntriesAndSCTs(int first, int last, std::vector<Entry>* entries,
                          const Callback& done);
 
+  // As above, through the binary get-entries-binary endpoint, which
+  // is also NON-standard, and cheaper to serve and parse. With
+  // "compress", the server deflates the reply.
+  void GetEntriesBinary(int first, int last, bool request_scts,
+                        bool compress, std::vector<Entry>* entries,
+                        const Callback& done);
+
   void QueryInclusionProof(const ct::SignedTreeHead& sth,
                            const std::string& merkle_leaf_hash,
                            ct::MerkleAuditProof* proof, const Callback& done);
@@ -90,6 +139,14 @@ class AsyncLogClient {
                        ct::SignedCertificateTimestamp* sct,
                        const Callback& done);
 
+  // Submits several chains (precertificate chains if "pre_cert") in a
+  // single request, through the add-chains and add-pre-chains
+  // endpoints, which are NON-standard. "results" is set to one entry
+  // per chain, and "done" is called with NOT_SUPPORTED if the server
+  // does not have these endpoints. This can call "done" inline.
+  void AddChains(const std::vector<const CertChain*>& chains, bool pre_cert,
+                 std::vector<AddChainResult>* results, const Callback& done);
+
  private:
   URL GetURL(const std::string& subpath) const;
 
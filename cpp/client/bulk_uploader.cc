@@ -0,0 +1,258 @@
+#include "client/bulk_uploader.h"
+
+#include <glog/logging.h>
+#include <algorithm>
+
+#include "log/cert.h"
+#include "util/executor.h"
+#include "util/task.h"
+
+using std::bind;
+using std::chrono::duration;
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+using std::make_shared;
+using std::min;
+using std::placeholders::_1;
+using std::shared_ptr;
+using std::string;
+using std::to_string;
+using std::unique_ptr;
+using std::vector;
+using util::Status;
+using util::Task;
+
+namespace cert_trans {
+
+
+struct BulkUploader::Pending {
+  string name;
+  unique_ptr<CertChain> chain;
+  int attempts = 0;
+  ct::SignedCertificateTimestamp sct;
+};
+
+
+BulkUploader::BulkUploader(util::Executor* executor, AsyncLogClient* client,
+                           bool precert, const Options& options,
+                           const Source& source, const ResultCallback& result)
+    : executor_(CHECK_NOTNULL(executor)),
+      client_(CHECK_NOTNULL(client)),
+      precert_(precert),
+      options_(options),
+      source_(source),
+      result_(result),
+      rng_(std::random_device()()),
+      task_(nullptr),
+      source_done_(false),
+      use_batches_(options.batch_size > 1),
+      in_flight_(0),
+      waiting_(0),
+      next_send_(steady_clock::now()),
+      pump_scheduled_(false) {
+  CHECK(source_);
+  CHECK(result_);
+}
+
+
+void BulkUploader::Run(Task* task) {
+  CHECK(!task_);
+  task_ = CHECK_NOTNULL(task);
+  Pump();
+  MaybeFinish();
+}
+
+
+shared_ptr<BulkUploader::Pending> BulkUploader::Next() {
+  if (!ready_.empty()) {
+    const shared_ptr<Pending> pending(ready_.front());
+    ready_.pop_front();
+    return pending;
+  }
+  Submission submission;
+  while (!source_done_ && !task_->CancelRequested()) {
+    if (!source_(&submission)) {
+      source_done_ = true;
+      break;
+    }
+    const shared_ptr<Pending> pending(make_shared<Pending>());
+    pending->name = submission.name;
+    pending->chain.reset(precert_ ? new PreCertChain(submission.pem_chain)
+                                  : new CertChain(submission.pem_chain));
+    if (pending->chain->IsLoaded()) {
+      return pending;
+    }
+    result_(pending->name, Status(util::error::INVALID_ARGUMENT,
+                                  "could not parse the chain"),
+            pending->sct);
+  }
+  return nullptr;
+}
+
+
+void BulkUploader::Pump() {
+  const int max_in_flight(std::max(options_.max_in_flight, 1));
+  while (in_flight_ < max_in_flight && !task_->CancelRequested()) {
+    const steady_clock::time_point now(steady_clock::now());
+    if (options_.max_rate > 0 && now < next_send_) {
+      // Come back when the next request can go.
+      if (!pump_scheduled_) {
+        pump_scheduled_ = true;
+        executor_->Delay(next_send_ - now, task_->AddChild([this](Task*) {
+          pump_scheduled_ = false;
+          Pump();
+          MaybeFinish();
+        }));
+      }
+      return;
+    }
+
+    vector<shared_ptr<Pending>> batch;
+    const size_t batch_size(use_batches_ ? options_.batch_size : 1);
+    while (batch.size() < batch_size) {
+      const shared_ptr<Pending> pending(Next());
+      if (!pending) {
+        break;
+      }
+      batch.emplace_back(pending);
+    }
+    if (batch.empty()) {
+      return;
+    }
+
+    if (options_.max_rate > 0) {
+      next_send_ = std::max(next_send_, now) +
+                   std::chrono::duration_cast<steady_clock::duration>(
+                       duration<double>(batch.size() / options_.max_rate));
+    }
+    ++in_flight_;
+    if (batch.size() == 1 && !use_batches_) {
+      SendOne(batch.front());
+    } else {
+      SendBatch(batch);
+    }
+  }
+}
+
+
+void BulkUploader::SendOne(const shared_ptr<Pending>& pending) {
+  const AsyncLogClient::Callback done(
+      bind(&BulkUploader::OneDone, this, pending, _1));
+  if (precert_) {
+    client_->AddPreCertChain(static_cast<const PreCertChain&>(
+                                 *pending->chain),
+                             &pending->sct, done);
+  } else {
+    client_->AddCertChain(*pending->chain, &pending->sct, done);
+  }
+}
+
+
+void BulkUploader::SendBatch(const vector<shared_ptr<Pending>>& batch) {
+  vector<const CertChain*> chains;
+  for (const auto& pending : batch) {
+    chains.push_back(pending->chain.get());
+  }
+  const shared_ptr<vector<AsyncLogClient::AddChainResult>> results(
+      make_shared<vector<AsyncLogClient::AddChainResult>>());
+  // This can call back inline, let the caller finish first.
+  executor_->Add([this, batch, chains, results]() {
+    client_->AddChains(chains, precert_, results.get(),
+                       bind(&BulkUploader::BatchDone, this, batch, results,
+                            _1));
+  });
+}
+
+
+void BulkUploader::OneDone(const shared_ptr<Pending>& pending,
+                           AsyncLogClient::Status status) {
+  --in_flight_;
+  if (status == AsyncLogClient::OK) {
+    result_(pending->name, ::util::OkStatus(), pending->sct);
+  } else {
+    RetryOrFail(pending, "add-chain failed: " + to_string(status));
+  }
+  Pump();
+  MaybeFinish();
+}
+
+
+void BulkUploader::BatchDone(
+    const vector<shared_ptr<Pending>>& batch,
+    const shared_ptr<vector<AsyncLogClient::AddChainResult>>& results,
+    AsyncLogClient::Status status) {
+  --in_flight_;
+  if (status == AsyncLogClient::NOT_SUPPORTED) {
+    LOG(INFO) << "The log does not have add-chains, using add-chain";
+    use_batches_ = false;
+    // This does not count as an attempt.
+    ready_.insert(ready_.begin(), batch.begin(), batch.end());
+  } else if (status != AsyncLogClient::OK) {
+    for (const auto& pending : batch) {
+      RetryOrFail(pending, "add-chains failed: " + to_string(status));
+    }
+  } else {
+    CHECK_EQ(batch.size(), results->size());
+    for (size_t i = 0; i < batch.size(); ++i) {
+      const AsyncLogClient::AddChainResult& result((*results)[i]);
+      // The log rejected the chain, which would not change on a retry.
+      result_(batch[i]->name,
+              result.ok ? ::util::OkStatus()
+                        : Status(util::error::FAILED_PRECONDITION,
+                                 result.error_message),
+              result.sct);
+    }
+  }
+  Pump();
+  MaybeFinish();
+}
+
+
+void BulkUploader::RetryOrFail(const shared_ptr<Pending>& pending,
+                               const string& error) {
+  if (pending->attempts >= options_.max_retries ||
+      task_->CancelRequested()) {
+    result_(pending->name, Status(util::error::UNAVAILABLE, error),
+            pending->sct);
+    return;
+  }
+  ++pending->attempts;
+  const milliseconds backoff(
+      min<milliseconds::rep>(options_.initial_backoff.count()
+                                 << min(pending->attempts - 1, 20),
+                             options_.max_backoff.count()));
+  // Between half and one and a half times the backoff, so that the
+  // retries of a failed batch are spread out.
+  const duration<double> delay(
+      backoff * std::uniform_real_distribution<double>(0.5, 1.5)(rng_));
+  VLOG(1) << "Retrying " << pending->name << " in " << delay.count()
+          << "s: " << error;
+  ++waiting_;
+  executor_->Delay(delay, task_->AddChild([this, pending](Task*) {
+    --waiting_;
+    ready_.push_back(pending);
+    Pump();
+    MaybeFinish();
+  }));
+}
+
+
+void BulkUploader::MaybeFinish() {
+  if (in_flight_ > 0 || waiting_ > 0 || pump_scheduled_) {
+    return;
+  }
+  if (task_->CancelRequested()) {
+    for (const auto& pending : ready_) {
+      result_(pending->name, Status::CANCELLED, pending->sct);
+    }
+    ready_.clear();
+    task_->Return(Status::CANCELLED);
+    return;
+  }
+  if (source_done_ && ready_.empty()) {
+    task_->Return();
+  }
+}
+
+
+}  // namespace cert_trans
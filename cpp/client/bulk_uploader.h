@@ -0,0 +1,127 @@
+#ifndef CERT_TRANS_CLIENT_BULK_UPLOADER_H_
+#define CERT_TRANS_CLIENT_BULK_UPLOADER_H_
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "client/async_log_client.h"
+#include "proto/ct.pb.h"
+#include "util/status.h"
+
+namespace util {
+class Executor;
+class Task;
+}  // namespace util
+
+namespace cert_trans {
+
+class CertChain;
+
+
+// Submits a large number of (pre-)certificate chains to a log, keeping
+// several requests in flight, retrying failed requests with
+// exponential backoff, and optionally pacing the submissions. Chains
+// are grouped in add-chains requests if asked to, falling back to
+// add-chain if the log does not have that endpoint.
+//
+// The chains are pulled from the source as they are needed, so that
+// they need not all be in memory at once.
+class BulkUploader {
+ public:
+  struct Options {
+    // The number of requests kept in flight at once.
+    int max_in_flight = 16;
+    // How many times a failed submission is retried.
+    int max_retries = 5;
+    // The delay before the first retry, which doubles with each retry
+    // up to |max_backoff|. A random jitter is added.
+    std::chrono::milliseconds initial_backoff = std::chrono::milliseconds(500);
+    std::chrono::milliseconds max_backoff = std::chrono::seconds(30);
+    // The number of chains submitted per second, 0 for no limit.
+    double max_rate = 0;
+    // The number of chains per add-chains request. With 1, add-chain is
+    // used.
+    int batch_size = 1;
+  };
+
+  // A chain to submit, as concatenated PEM certificates. |name| is
+  // only used to report the result.
+  struct Submission {
+    std::string name;
+    std::string pem_chain;
+  };
+
+  // Sets |submission| to the next chain and returns true, or returns
+  // false once there are no more.
+  typedef std::function<bool(Submission* submission)> Source;
+
+  // Called once per submission, with the SCT if |status| is OK.
+  typedef std::function<void(const std::string& name,
+                             const util::Status& status,
+                             const ct::SignedCertificateTimestamp& sct)>
+      ResultCallback;
+
+  // |executor| must run one closure at a time (e.g. a libevent::Base),
+  // and be the one |client| runs its callbacks on, as that is where
+  // everything happens.
+  BulkUploader(util::Executor* executor, AsyncLogClient* client,
+               bool precert, const Options& options, const Source& source,
+               const ResultCallback& result);
+  BulkUploader(const BulkUploader&) = delete;
+  BulkUploader& operator=(const BulkUploader&) = delete;
+
+  // Submits every chain from the source, and then returns on |task|.
+  // Must be called on |executor|.
+  void Run(util::Task* task);
+
+ private:
+  struct Pending;
+
+  void Pump();
+  // Returns the next submission to send, either one to retry or a new
+  // one from the source, or nullptr.
+  std::shared_ptr<Pending> Next();
+  void SendOne(const std::shared_ptr<Pending>& pending);
+  void SendBatch(const std::vector<std::shared_ptr<Pending>>& batch);
+  void OneDone(const std::shared_ptr<Pending>& pending,
+               AsyncLogClient::Status status);
+  void BatchDone(
+      const std::vector<std::shared_ptr<Pending>>& batch,
+      const std::shared_ptr<std::vector<AsyncLogClient::AddChainResult>>&
+          results,
+      AsyncLogClient::Status status);
+  // Retries |pending| after a delay, or reports |error| if it was
+  // retried enough.
+  void RetryOrFail(const std::shared_ptr<Pending>& pending,
+                   const std::string& error);
+  void MaybeFinish();
+
+  util::Executor* const executor_;
+  AsyncLogClient* const client_;
+  const bool precert_;
+  const Options options_;
+  const Source source_;
+  const ResultCallback result_;
+  std::mt19937 rng_;
+
+  util::Task* task_;
+  bool source_done_;
+  // Whether to use add-chains, until the log says it does not have it.
+  bool use_batches_;
+  std::deque<std::shared_ptr<Pending>> ready_;
+  int in_flight_;
+  // Submissions waiting for their retry.
+  int waiting_;
+  std::chrono::steady_clock::time_point next_send_;
+  bool pump_scheduled_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_CLIENT_BULK_UPLOADER_H_
@@ -1,4 +1,5 @@
 /* -*- indent-tabs-mode: nil -*- */
+#include <dirent.h>
 #include <event2/thread.h>
 #include <fcntl.h>
 #include <gflags/gflags.h>
@@ -13,19 +14,28 @@
 #include <openssl/x509.h>
 #include <openssl/x509v3.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
 #include <fstream>
+#include <functional>
+#include <future>
 #include <iostream>
 #include <memory>
 #include <sstream>
 #include <string>
+#include <vector>
 
 #include "client/http_log_client.h"
 #include "client/ssl_client.h"
 #include "log/cert.h"
 #include "log/cert_submission_handler.h"
 #include "log/ct_extensions.h"
+#include "log/leveldb_db.h"
 #include "log/log_signer.h"
 #include "log/log_verifier.h"
+#include "log/logged_entry.h"
+#include "merkletree/compact_merkle_tree.h"
 #include "merkletree/merkle_tree.h"
 #include "merkletree/merkle_verifier.h"
 #include "merkletree/serial_hasher.h"
@@ -90,6 +100,47 @@ DEFINE_string(sth2, "", "File containing second STH");
 DEFINE_uint64(monitor_sleep_time_secs, 60,
               "Amount of time the monitor shall "
               "sleep between probing for a new STH.");
+DEFINE_string(monitor_db, "",
+              "LevelDB database keeping the local copy of the log for the "
+              "'monitor' command. It is created if needed, and the download "
+              "resumes from where it stopped otherwise.");
+DEFINE_bool(monitor_once, false,
+            "Make the 'monitor' command exit once it has caught up with "
+            "the current STH, rather than keep following the log.");
+DEFINE_int32(monitor_fetch_chunk_size, 1000,
+             "Number of entries the 'monitor' command asks for in each "
+             "request (the server may return fewer).");
+DEFINE_int32(monitor_fetches_in_flight, 8,
+             "Number of requests for entries the 'monitor' command keeps "
+             "in flight at once.");
+DEFINE_int32(monitor_write_batch_size, 10000,
+             "Number of entries the 'monitor' command writes to its "
+             "database at once.");
+DEFINE_int32(monitor_report_interval_secs, 10,
+             "Seconds between the progress reports of the 'monitor' "
+             "command.");
+DEFINE_string(bulk_upload_in, "-",
+              "Chains to submit with the 'bulk_upload' command: either a "
+              "directory, with a PEM chain per file, or a file (\"-\" for "
+              "stdin) of PEM chains separated by blank lines.");
+DEFINE_string(bulk_upload_sct_out, "",
+              "File the 'bulk_upload' command writes a line per chain to: "
+              "its name, a tab, and either the base64 SCT or \"ERROR\", a "
+              "tab and the reason.");
+DEFINE_int32(bulk_upload_concurrency, 16,
+             "Number of requests the 'bulk_upload' command keeps in flight.");
+DEFINE_int32(bulk_upload_max_retries, 5,
+             "Number of times the 'bulk_upload' command retries a failed "
+             "submission.");
+DEFINE_int32(bulk_upload_retry_delay_ms, 500,
+             "Delay before the first retry of the 'bulk_upload' command, "
+             "doubled on every further retry.");
+DEFINE_double(bulk_upload_max_qps, 0,
+              "Chains per second the 'bulk_upload' command submits at "
+              "most, 0 for no limit.");
+DEFINE_int32(bulk_upload_batch_size, 1,
+             "Number of chains the 'bulk_upload' command submits per "
+             "request, using the add-chains endpoint if more than 1.");
 
 
 static const char kUsage[] =
@@ -109,13 +160,20 @@ static const char kUsage[] =
     "get_entries - get entries from the log\n"
     "sth - get the current STH from the log\n"
     "consistency - get and check consistency of two STHs\n"
+    "monitor - download the log into a local database, checking it\n"
+    "          against the STHs as they come\n"
+    "bulk_upload - upload many chains to a CT log server\n"
     "Use --help to display command-line flag options\n";
 
 using cert_trans::AsyncLogClient;
+using cert_trans::BulkUploader;
 using cert_trans::Cert;
 using cert_trans::CertChain;
 using cert_trans::CertSubmissionHandler;
+using cert_trans::Database;
 using cert_trans::HTTPLogClient;
+using cert_trans::LevelDB;
+using cert_trans::LoggedEntry;
 using cert_trans::PreCertChain;
 using cert_trans::ReadPublicKey;
 using cert_trans::SSLClient;
@@ -135,6 +193,13 @@ using ct::SSLClientCTData;
 using ct::SignedCertificateTimestamp;
 using ct::SignedCertificateTimestampList;
 using ct::SignedTreeHead;
+using std::bind;
+using std::chrono::duration;
+using std::chrono::seconds;
+using std::chrono::steady_clock;
+using std::future;
+using std::placeholders::_1;
+using std::placeholders::_2;
 using std::shared_ptr;
 using std::string;
 using std::unique_ptr;
@@ -738,29 +803,40 @@ static void DiagnoseCertChain() {
   }
 
   LOG(INFO) << "Certificate has " << sct_list.sct_list_size() << " SCTs";
+  vector<SignedCertificateTimestamp> scts(sct_list.sct_list_size());
+  // The SCTs to verify, and their numbers.
+  vector<LogVerifier::SCTToVerify> to_verify;
+  vector<int> to_verify_numbers;
   for (int i = 0; i < sct_list.sct_list_size(); ++i) {
-    SignedCertificateTimestamp sct;
-    if (Deserializer::DeserializeSCT(sct_list.sct_list(i), &sct) !=
+    SignedCertificateTimestamp* const sct(&scts[i]);
+    if (Deserializer::DeserializeSCT(sct_list.sct_list(i), sct) !=
         DeserializeResult::OK) {
       LOG(ERROR) << "Failed to parse SCT number " << i + 1;
       continue;
     }
-    LOG(INFO) << "SCT number " << i + 1 << ":\n" << sct.DebugString();
+    LOG(INFO) << "SCT number " << i + 1 << ":\n" << sct->DebugString();
     if (verifier) {
-      if (sct.id().key_id() != verifier->KeyID()) {
+      if (sct->id().key_id() != verifier->KeyID()) {
         LOG(WARNING) << "SCT key ID does not match verifier's ID, skipping";
-        continue;
       } else {
-        LogVerifier::LogVerifyResult res =
-            verifier->VerifySignedCertificateTimestamp(entry, sct);
-        if (res == LogVerifier::VERIFY_OK)
-          LOG(INFO) << "SCT verified";
-        else
-          LOG(ERROR) << "SCT verification failed: "
-                     << LogVerifier::VerifyResultString(res);
+        to_verify.push_back(LogVerifier::SCTToVerify{&entry, sct});
+        to_verify_numbers.push_back(i + 1);
       }
     }
   }
+
+  if (!to_verify.empty()) {
+    const vector<LogVerifier::LogVerifyResult> results(
+        verifier->VerifySignedCertificateTimestamps(to_verify));
+    for (size_t i = 0; i < results.size(); ++i) {
+      if (results[i] == LogVerifier::VERIFY_OK)
+        LOG(INFO) << "SCT number " << to_verify_numbers[i] << " verified";
+      else
+        LOG(ERROR) << "SCT number " << to_verify_numbers[i]
+                   << " verification failed: "
+                   << LogVerifier::VerifyResultString(results[i]);
+    }
+  }
 }
 
 // Wrap an SCT in an SSLClientCTData as if it came from an SSL server.
@@ -929,6 +1005,365 @@ int GetSTH() {
 }
 
 
+namespace {
+
+
+// Adds the entries downloaded by the 'monitor' command to the tree,
+// and writes them to the database in batches, on the database's own
+// thread, while the next ones are downloaded.
+class MonitorWriter {
+ public:
+  MonitorWriter(Database* db, CompactMerkleTree* tree)
+      : db_(CHECK_NOTNULL(db)),
+        tree_(CHECK_NOTNULL(tree)),
+        failed_(false),
+        started_at_(steady_clock::now()),
+        reported_at_(started_at_),
+        first_index_(tree_->LeafCount()),
+        reported_index_(first_index_) {
+  }
+
+  ~MonitorWriter() {
+    CHECK(!write_.valid()) << "Finish() was not called";
+  }
+
+  // Takes consecutive entries, starting at |first|.
+  void Add(int64_t first, vector<AsyncLogClient::Entry>* entries) {
+    if (failed_) {
+      return;
+    }
+    CHECK_EQ(static_cast<int64_t>(tree_->LeafCount()), first);
+    vector<string> leaves;
+    leaves.reserve(entries->size());
+    for (const AsyncLogClient::Entry& entry : *entries) {
+      LoggedEntry logged;
+      if (!logged.CopyFromClientLogEntry(entry)) {
+        LOG(ERROR) << "Invalid entry " << first + leaves.size();
+        failed_ = true;
+        break;
+      }
+      logged.set_sequence_number(first + leaves.size());
+      leaves.emplace_back();
+      CHECK(logged.SerializeForLeaf(&leaves.back()));
+      batch_.emplace_back(std::move(logged));
+    }
+    tree_->AddLeaves(leaves);
+
+    if (failed_ ||
+        batch_.size() >=
+            static_cast<size_t>(FLAGS_monitor_write_batch_size)) {
+      Write();
+    }
+    Report(false);
+  }
+
+  // Writes what is left, and waits for the writes to complete. Returns
+  // false if anything went wrong.
+  bool Finish() {
+    Write();
+    WaitForWrite();
+    Report(true);
+    return !failed_;
+  }
+
+ private:
+  void Write() {
+    WaitForWrite();
+    if (!batch_.empty()) {
+      write_ = db_->CreateSequencedEntriesAsync(std::move(batch_));
+      batch_.clear();
+    }
+  }
+
+  void WaitForWrite() {
+    if (!write_.valid()) {
+      return;
+    }
+    for (Database::WriteResult result : write_.get()) {
+      if (result != Database::OK) {
+        LOG(ERROR) << "Failed to write entry to the database: " << result;
+        failed_ = true;
+      }
+    }
+  }
+
+  void Report(bool last) {
+    const steady_clock::time_point now(steady_clock::now());
+    if (!last &&
+        now - reported_at_ < seconds(FLAGS_monitor_report_interval_secs)) {
+      return;
+    }
+    const int64_t index(tree_->LeafCount());
+    const duration<double> since_report(now - reported_at_);
+    const duration<double> since_start(now - started_at_);
+    LOG(INFO) << "At entry " << index << ", "
+              << (index - reported_index_) /
+                     std::max(since_report.count(), 1e-3)
+              << " entries/s (" << (index - first_index_) /
+                                       std::max(since_start.count(), 1e-3)
+              << " entries/s overall)";
+    reported_at_ = now;
+    reported_index_ = index;
+  }
+
+  Database* const db_;
+  CompactMerkleTree* const tree_;
+  vector<LoggedEntry> batch_;
+  future<vector<Database::WriteResult>> write_;
+  bool failed_;
+  const steady_clock::time_point started_at_;
+  steady_clock::time_point reported_at_;
+  const int64_t first_index_;
+  int64_t reported_index_;
+};
+
+
+// Adds the entries in |db| to |tree|, checking them against the tree
+// head stored with them, which is returned in |sth|.
+bool LoadMonitorTree(const Database& db, CompactMerkleTree* tree,
+                     SignedTreeHead* sth) {
+  if (db.LatestTreeHead(sth) != Database::LOOKUP_OK) {
+    sth->Clear();
+  }
+  const int64_t tree_size(db.TreeSize());
+  if (tree_size < static_cast<int64_t>(sth->tree_size())) {
+    LOG(ERROR) << "The database has fewer entries than its tree head covers";
+    return false;
+  }
+  LOG(INFO) << "Loading " << tree_size << " entries from the database";
+
+  const unique_ptr<Database::Iterator> it(db.ScanEntries(0));
+  vector<LoggedEntry> entries;
+  vector<string> leaves;
+  while (static_cast<int64_t>(tree->LeafCount()) < tree_size) {
+    // Stop at the tree head, to check its root hash.
+    const int64_t until(static_cast<int64_t>(tree->LeafCount()) <
+                                static_cast<int64_t>(sth->tree_size())
+                            ? sth->tree_size()
+                            : tree_size);
+    const size_t max_entries(std::min<int64_t>(
+        until - tree->LeafCount(), FLAGS_monitor_write_batch_size));
+    CHECK_GT(it->GetNextEntries(max_entries, &entries), 0U);
+    leaves.clear();
+    for (const LoggedEntry& logged : entries) {
+      CHECK_EQ(static_cast<int64_t>(tree->LeafCount() + leaves.size()),
+               logged.sequence_number());
+      leaves.emplace_back();
+      CHECK(logged.SerializeForLeaf(&leaves.back()));
+    }
+    tree->AddLeaves(leaves);
+    if (tree->LeafCount() == sth->tree_size() &&
+        tree->CurrentRoot() != sth->sha256_root_hash()) {
+      LOG(ERROR) << "The entries in the database do not match its tree head";
+      return false;
+    }
+  }
+  return true;
+}
+
+
+}  // namespace
+
+
+// Keeps a local copy of the log in --monitor_db, checking that it
+// matches the STHs of the log as it grows.
+static int Monitor() {
+  CHECK_NE(FLAGS_ct_server, "");
+  CHECK(!FLAGS_monitor_db.empty()) << "Please give a database with "
+                                   << "--monitor_db";
+  const unique_ptr<LogVerifier> verifier(GetLogVerifierFromFlags());
+  HTTPLogClient client(FLAGS_ct_server);
+  LevelDB db(FLAGS_monitor_db);
+
+  CompactMerkleTree tree(unique_ptr<SerialHasher>(new Sha256Hasher));
+  SignedTreeHead verified_sth;
+  if (!LoadMonitorTree(db, &tree, &verified_sth)) {
+    return 1;
+  }
+
+  AsyncLogClient::RangeOptions options;
+  options.chunk_size = FLAGS_monitor_fetch_chunk_size;
+  options.max_in_flight = FLAGS_monitor_fetches_in_flight;
+
+  while (true) {
+    bool caught_up(false);
+    const StatusOr<SignedTreeHead> sth_or(client.GetSTH());
+    if (!sth_or.ok()) {
+      LOG(WARNING) << "Failed to get STH: " << sth_or.status();
+    } else {
+      const SignedTreeHead& sth(sth_or.ValueOrDie());
+      const LogVerifier::LogVerifyResult result(
+          verifier->VerifySignedTreeHead(sth));
+      if (result != LogVerifier::VERIFY_OK) {
+        LOG(ERROR) << "STH does not verify: "
+                   << LogVerifier::VerifyResultString(result);
+        return 1;
+      }
+      if (sth.tree_size() < tree.LeafCount()) {
+        LOG(ERROR) << "STH for " << sth.tree_size() << " entries, but "
+                   << tree.LeafCount() << " were already verified";
+        return 1;
+      }
+
+      if (sth.tree_size() > tree.LeafCount()) {
+        LOG(INFO) << "Getting entries " << tree.LeafCount() << " to "
+                  << sth.tree_size() - 1;
+        MonitorWriter writer(&db, &tree);
+        const Status status(
+            client.GetEntryRange(tree.LeafCount(), sth.tree_size() - 1,
+                                 options, bind(&MonitorWriter::Add, &writer,
+                                               _1, _2)));
+        // What was received is kept either way, to resume from.
+        if (!writer.Finish()) {
+          return 1;
+        }
+        LOG_IF(WARNING, !status.ok()) << "Failed to get entries: " << status;
+      }
+
+      if (tree.LeafCount() == sth.tree_size()) {
+        if (tree.CurrentRoot() != sth.sha256_root_hash()) {
+          LOG(ERROR) << "Root hash mismatch for the STH at tree size "
+                     << sth.tree_size() << ", timestamp " << sth.timestamp();
+          return 1;
+        }
+        if (sth.timestamp() > verified_sth.timestamp()) {
+          CHECK_EQ(Database::OK, db.WriteTreeHead(sth));
+          verified_sth = sth;
+          LOG(INFO) << "Verified STH for " << sth.tree_size()
+                    << " entries, timestamp " << sth.timestamp();
+        }
+        caught_up = true;
+      }
+    }
+
+    if (FLAGS_monitor_once && caught_up) {
+      return 0;
+    }
+    sleep(FLAGS_monitor_sleep_time_secs);
+  }
+}
+
+
+namespace {
+
+
+// Reads the chains for the 'bulk_upload' command, one at a time.
+class ChainReader {
+ public:
+  explicit ChainReader(const string& path) : path_(path), next_(0) {
+    DIR* const dir(opendir(path.c_str()));
+    if (dir) {
+      while (const struct dirent* const entry = readdir(dir)) {
+        if (entry->d_name[0] != '.') {
+          files_.emplace_back(path + "/" + entry->d_name);
+        }
+      }
+      closedir(dir);
+      std::sort(files_.begin(), files_.end());
+    } else if (path == "-") {
+      in_ = &std::cin;
+    } else {
+      file_.open(path);
+      PCHECK(file_.good()) << "Could not open " << path;
+      in_ = &file_;
+    }
+  }
+
+  bool Next(BulkUploader::Submission* submission) {
+    if (!in_) {
+      if (next_ >= files_.size()) {
+        return false;
+      }
+      submission->name = files_[next_++];
+      PCHECK(util::ReadBinaryFile(submission->name, &submission->pem_chain))
+          << "Could not read " << submission->name;
+      return true;
+    }
+
+    submission->pem_chain.clear();
+    string line;
+    while (std::getline(*in_, line)) {
+      if (line.empty() || line == "\r") {
+        if (!submission->pem_chain.empty()) {
+          break;
+        }
+        continue;
+      }
+      submission->pem_chain += line + "\n";
+    }
+    if (submission->pem_chain.empty()) {
+      return false;
+    }
+    submission->name = path_ + ":" + std::to_string(next_++);
+    return true;
+  }
+
+ private:
+  const string path_;
+  vector<string> files_;
+  std::ifstream file_;
+  std::istream* in_ = nullptr;
+  size_t next_;
+};
+
+
+}  // namespace
+
+
+// Submits all the chains in --bulk_upload_in, writing their SCTs to
+// --bulk_upload_sct_out. Returns 1 if any of them failed.
+static int BulkUpload() {
+  CHECK_NE(FLAGS_ct_server, "");
+  CHECK(!FLAGS_bulk_upload_sct_out.empty())
+      << "Please give a file for the SCTs with --bulk_upload_sct_out";
+  ChainReader reader(FLAGS_bulk_upload_in);
+  std::ofstream out(FLAGS_bulk_upload_sct_out);
+  PCHECK(out.good()) << "Could not open " << FLAGS_bulk_upload_sct_out;
+
+  BulkUploader::Options options;
+  options.max_in_flight = FLAGS_bulk_upload_concurrency;
+  options.max_retries = FLAGS_bulk_upload_max_retries;
+  options.initial_backoff =
+      std::chrono::milliseconds(FLAGS_bulk_upload_retry_delay_ms);
+  options.max_rate = FLAGS_bulk_upload_max_qps;
+  options.batch_size = FLAGS_bulk_upload_batch_size;
+
+  int64_t num_ok(0);
+  int64_t num_failed(0);
+  steady_clock::time_point next_report(steady_clock::now());
+  HTTPLogClient client(FLAGS_ct_server);
+  const Status status(client.BulkUpload(
+      FLAGS_precert, options,
+      bind(&ChainReader::Next, &reader, _1),
+      [&](const string& name, const Status& status,
+          const SignedCertificateTimestamp& sct) {
+        out << name << "\t";
+        string serialized;
+        if (status.ok() && Serializer::SerializeSCT(sct, &serialized) ==
+                               SerializeResult::OK) {
+          out << util::ToBase64(serialized) << "\n";
+          ++num_ok;
+        } else {
+          out << "ERROR\t" << status.error_message() << "\n";
+          ++num_failed;
+        }
+        if (steady_clock::now() >= next_report) {
+          LOG(INFO) << num_ok << " chains submitted, " << num_failed
+                    << " failed";
+          next_report = steady_clock::now() + seconds(10);
+        }
+      }));
+
+  out.close();
+  LOG(INFO) << num_ok << " chains submitted, " << num_failed << " failed";
+  if (!status.ok()) {
+    LOG(ERROR) << "Bulk upload failed: " << status;
+    return 1;
+  }
+  return num_failed == 0 ? 0 : 1;
+}
+
+
 // Exit code upon normal exit:
 // 0: success
 // 1: failure
@@ -982,6 +1417,10 @@ int main(int argc, char** argv) {
     ret = GetRoots();
   } else if (cmd == "sth") {
     ret = GetSTH();
+  } else if (cmd == "monitor") {
+    ret = Monitor();
+  } else if (cmd == "bulk_upload") {
+    ret = BulkUpload();
   } else {
     std::cout << google::ProgramUsage();
     ret = 1;
@@ -3,18 +3,22 @@
 
 #include <event2/buffer.h>
 #include <glog/logging.h>
+#include <algorithm>
 #include <functional>
+#include <iterator>
 #include <memory>
 
 #include "log/cert.h"
 #include "proto/ct.pb.h"
 #include "proto/serializer.h"
 #include "util/json_wrapper.h"
+#include "util/task.h"
 #include "util/util.h"
 
 namespace libevent = cert_trans::libevent;
 
 using cert_trans::AsyncLogClient;
+using cert_trans::BulkUploader;
 using cert_trans::Cert;
 using cert_trans::CertChain;
 using cert_trans::HTTPLogClient;
@@ -23,8 +27,10 @@ using cert_trans::ThreadPool;
 using ct::MerkleAuditProof;
 using ct::SignedCertificateTimestamp;
 using ct::SignedTreeHead;
+using std::back_inserter;
 using std::bind;
 using std::placeholders::_1;
+using std::placeholders::_2;
 using std::string;
 using std::unique_ptr;
 using std::vector;
@@ -41,6 +47,13 @@ void DoneRequest(AsyncLogClient::Status status, AsyncLogClient::Status* retval,
 }
 
 
+void AppendEntries(vector<AsyncLogClient::Entry>* received,
+                   vector<AsyncLogClient::Entry>* entries) {
+  entries->reserve(entries->size() + received->size());
+  std::move(received->begin(), received->end(), back_inserter(*entries));
+}
+
+
 }  // namespace
 
 HTTPLogClient::HTTPLogClient(const string& server)
@@ -143,8 +156,11 @@ StatusOr<vector<AsyncLogClient::Entry>> HTTPLogClient::GetEntries(int first,
   AsyncLogClient::Status status(AsyncLogClient::UNKNOWN_ERROR);
   bool done(false);
 
-  client_.GetEntries(first, last, &entries,
-                     bind(&DoneRequest, _1, &status, &done));
+  // Large ranges are split over several requests, kept in flight at
+  // the same time.
+  client_.GetEntryRange(first, last, AsyncLogClient::RangeOptions(),
+                        bind(&AppendEntries, _2, &entries),
+                        bind(&DoneRequest, _1, &status, &done));
   while (!done) {
     base_->DispatchOnce();
   }
@@ -156,6 +172,41 @@ StatusOr<vector<AsyncLogClient::Entry>> HTTPLogClient::GetEntries(int first,
   return Status::UNKNOWN;
 }
 
+Status HTTPLogClient::GetEntryRange(
+    int64_t first, int64_t last, const AsyncLogClient::RangeOptions& options,
+    const AsyncLogClient::EntriesCallback& entries) {
+  AsyncLogClient::Status status(AsyncLogClient::UNKNOWN_ERROR);
+  bool done(false);
+
+  client_.GetEntryRange(first, last, options, entries,
+                        bind(&DoneRequest, _1, &status, &done));
+  while (!done) {
+    base_->DispatchOnce();
+  }
+
+  if (status == AsyncLogClient::OK) {
+    return ::util::OkStatus();
+  }
+
+  return Status::UNKNOWN;
+}
+
+Status HTTPLogClient::BulkUpload(bool pre,
+                                 const BulkUploader::Options& options,
+                                 const BulkUploader::Source& source,
+                                 const BulkUploader::ResultCallback& result) {
+  BulkUploader uploader(base_.get(), &client_, pre, options, source, result);
+  bool done(false);
+  util::Task task([&done](util::Task*) { done = true; }, base_.get());
+
+  base_->Add(bind(&BulkUploader::Run, &uploader, &task));
+  while (!done) {
+    base_->DispatchOnce();
+  }
+
+  return task.status();
+}
+
 StatusOr<vector<string>> HTTPLogClient::GetSTHConsistency(int64_t size1,
                                                           int64_t size2) {
   vector<string> proof;
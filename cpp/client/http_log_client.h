@@ -6,6 +6,7 @@
 #include <string>
 
 #include "client/async_log_client.h"
+#include "client/bulk_uploader.h"
 #include "proto/ct.pb.h"
 #include "util/libevent_wrapper.h"
 #include "util/statusor.h"
@@ -38,6 +39,18 @@ class HTTPLogClient {
   util::StatusOr<std::vector<AsyncLogClient::Entry>> GetEntries(int first,
                                                                 int last);
 
+  // Passes the entries |first| to |last| to |entries| as they are
+  // downloaded, in order (see AsyncLogClient::GetEntryRange()).
+  util::Status GetEntryRange(int64_t first, int64_t last,
+                             const AsyncLogClient::RangeOptions& options,
+                             const AsyncLogClient::EntriesCallback& entries);
+
+  // Submits every chain from |source| (see BulkUploader), returning
+  // once they have all been reported to |result|.
+  util::Status BulkUpload(bool pre, const BulkUploader::Options& options,
+                          const BulkUploader::Source& source,
+                          const BulkUploader::ResultCallback& result);
+
  private:
   const std::unique_ptr<libevent::Base> base_;
   ThreadPool pool_;
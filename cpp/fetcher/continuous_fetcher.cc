@@ -21,7 +21,9 @@ using std::unique_ptr;
 using util::Executor;
 using util::Task;
 
-DEFINE_int32(delay_between_fetches_seconds, 30, "delay between fetches");
+DEFINE_int32(delay_between_fetches_seconds, 30,
+             "delay between fetches, when not triggered by a peer getting "
+             "more entries");
 
 namespace cert_trans {
 
@@ -37,6 +39,7 @@ class ContinuousFetcherImpl : public ContinuousFetcher {
 
   void AddPeer(const string& node_id, const shared_ptr<Peer>& peer) override;
   void RemovePeer(const string& node_id) override;
+  void TriggerFetch() override;
 
  private:
   void StartFetch(const unique_lock<mutex>& lock);
@@ -53,6 +56,8 @@ class ContinuousFetcherImpl : public ContinuousFetcher {
   map<string, shared_ptr<Peer>> peers_;
 
   bool restart_fetch_;
+  // Whether to start another fetch as soon as the current one is done.
+  bool fetch_again_;
   unique_ptr<Task> fetch_task_;
 };
 
@@ -65,7 +70,8 @@ ContinuousFetcherImpl::ContinuousFetcherImpl(
       db_(CHECK_NOTNULL(db)),
       log_verifier_(CHECK_NOTNULL(log_verifier)),
       fetch_scts_(fetch_scts),
-      restart_fetch_(false) {
+      restart_fetch_(false),
+      fetch_again_(false) {
 }
 
 
@@ -105,11 +111,25 @@ void ContinuousFetcherImpl::RemovePeer(const string& node_id) {
 }
 
 
+void ContinuousFetcherImpl::TriggerFetch() {
+  unique_lock<mutex> lock(lock_);
+
+  if (fetch_task_) {
+    // The running fetch only goes up to the tree size it started with.
+    fetch_again_ = true;
+  } else {
+    VLOG(1) << "fetch triggered";
+    StartFetch(lock);
+  }
+}
+
+
 void ContinuousFetcherImpl::StartFetch(const unique_lock<mutex>& lock) {
   CHECK(lock.owns_lock());
   CHECK(!fetch_task_);
 
   restart_fetch_ = false;
+  fetch_again_ = false;
 
   unique_ptr<PeerGroup> peer_group(new PeerGroup(fetch_scts_));
   for (const auto& peer : peers_) {
@@ -132,10 +152,12 @@ void ContinuousFetcherImpl::FetchDone(Task* task) {
   lock_guard<mutex> lock(lock_);
   fetch_task_.reset();
 
-  if (restart_fetch_) {
+  if (restart_fetch_ || fetch_again_) {
     executor_->Add(
         bind(&ContinuousFetcherImpl::FetchDelayDone, this, nullptr));
   } else {
+    // This is only a fallback, fetches are normally started by
+    // TriggerFetch().
     base_->Delay(seconds(FLAGS_delay_between_fetches_seconds),
                  new Task(bind(&ContinuousFetcherImpl::FetchDelayDone, this,
                                _1),
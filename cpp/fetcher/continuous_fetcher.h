@@ -34,6 +34,12 @@ class ContinuousFetcher {
 
   virtual void RemovePeer(const std::string& node_id) = 0;
 
+  // Signals that a peer has more entries than before, so that they
+  // are fetched right away rather than after the delay between
+  // fetches. If a fetch is already running, another one is started as
+  // soon as it completes.
+  virtual void TriggerFetch() = 0;
+
  protected:
   ContinuousFetcher() = default;
 };
@@ -0,0 +1,203 @@
+#include "fetcher/fetch_window.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <algorithm>
+
+#include "monitoring/latency.h"
+#include "monitoring/monitoring.h"
+
+DEFINE_int32(fetcher_concurrent_fetches, 2,
+             "initial number of concurrent fetch requests per peer");
+DEFINE_int32(fetcher_max_concurrent_fetches, 16,
+             "maximum number of concurrent fetch requests per peer");
+DEFINE_int32(fetcher_batch_size, 1000,
+             "initial maximum number of entries to fetch per request");
+DEFINE_int32(fetcher_max_batch_size, 10000,
+             "maximum number of entries to fetch per request");
+DEFINE_int32(fetcher_peer_max_consecutive_failures, 3,
+             "number of failed fetch requests in a row after which a peer "
+             "is not used for --fetcher_peer_circuit_open_seconds");
+DEFINE_int32(fetcher_peer_circuit_open_seconds, 10,
+             "how long a peer is not used for after failing too many "
+             "fetch requests in a row");
+
+using std::chrono::duration;
+using std::chrono::milliseconds;
+using std::chrono::seconds;
+using std::chrono::steady_clock;
+using std::lock_guard;
+using std::max;
+using std::min;
+using std::mutex;
+using std::string;
+
+namespace cert_trans {
+namespace {
+
+
+static Gauge<string>* fetcher_peer_batch_size =
+    Gauge<string>::New("fetcher_peer_batch_size", "peer",
+                       "Number of entries requested at once from each peer.");
+
+static Gauge<string>* fetcher_peer_concurrent_fetches =
+    Gauge<string>::New("fetcher_peer_concurrent_fetches", "peer",
+                       "Number of fetch requests kept in flight to each "
+                       "peer.");
+
+static Counter<string, string>* fetcher_peer_fetches =
+    Counter<string, string>::New("fetcher_peer_fetches", "peer", "result",
+                                 "Number of fetch requests to each peer, "
+                                 "broken down by result.");
+
+static Counter<string>* fetcher_peer_entries_fetched =
+    Counter<string>::New("fetcher_peer_entries_fetched", "peer",
+                         "Number of entries fetched from each peer.");
+
+static Latency<milliseconds, string> fetcher_peer_fetch_latency_ms(
+    "fetcher_peer_fetch_latency_ms", "peer",
+    "Latency of fetch requests in ms, broken down by peer.");
+
+// How much slower per entry than the fastest recent request a request
+// can be before it is considered to have been queued somewhere.
+const double kCongestionFactor = 2.0;
+
+// How quickly the fastest latency seen is forgotten, per request, so
+// that it follows the peer getting slower for good.
+const double kMinLatencyDecay = 1.01;
+
+// How much the batch size grows after a fast request.
+const double kBatchSizeGrowth = 1.125;
+
+// The weight of a new sample in the latency moving average.
+const double kLatencyEwmaWeight = 0.2;
+
+
+}  // namespace
+
+
+FetchWindow::FetchWindow(const string& peer_name)
+    : peer_name_(peer_name),
+      batch_size_(FLAGS_fetcher_batch_size),
+      concurrent_fetches_(FLAGS_fetcher_concurrent_fetches),
+      in_flight_(0),
+      min_latency_per_entry_(0),
+      latency_ewma_(0),
+      consecutive_failures_(0) {
+  CHECK_GT(FLAGS_fetcher_batch_size, 0);
+  CHECK_GE(FLAGS_fetcher_max_batch_size, FLAGS_fetcher_batch_size);
+  CHECK_GT(FLAGS_fetcher_concurrent_fetches, 0);
+  CHECK_GE(FLAGS_fetcher_max_concurrent_fetches,
+           FLAGS_fetcher_concurrent_fetches);
+  fetcher_peer_batch_size->Set(peer_name_, batch_size_);
+  fetcher_peer_concurrent_fetches->Set(peer_name_, concurrent_fetches_);
+}
+
+
+int64_t FetchWindow::BatchSize() const {
+  lock_guard<mutex> lock(lock_);
+  return static_cast<int64_t>(batch_size_);
+}
+
+
+int FetchWindow::ConcurrentFetches() const {
+  lock_guard<mutex> lock(lock_);
+  return static_cast<int>(concurrent_fetches_);
+}
+
+
+int FetchWindow::InFlight() const {
+  lock_guard<mutex> lock(lock_);
+  return in_flight_;
+}
+
+
+duration<double> FetchWindow::LatencyEwma() const {
+  lock_guard<mutex> lock(lock_);
+  return latency_ewma_;
+}
+
+
+bool FetchWindow::IsAvailable() const {
+  lock_guard<mutex> lock(lock_);
+  if (consecutive_failures_ < FLAGS_fetcher_peer_max_consecutive_failures) {
+    return true;
+  }
+  // Half-open: let a single request through once the delay has passed.
+  return steady_clock::now() >= open_until_ && in_flight_ == 0;
+}
+
+
+void FetchWindow::FetchStarted() {
+  lock_guard<mutex> lock(lock_);
+  ++in_flight_;
+}
+
+
+void FetchWindow::FetchDone(bool ok, int64_t requested, int64_t received,
+                            steady_clock::duration latency) {
+  CHECK_GT(requested, 0);
+  fetcher_peer_fetch_latency_ms.RecordLatency(peer_name_, latency);
+  fetcher_peer_fetches->Increment(peer_name_, ok ? "ok" : "error");
+
+  lock_guard<mutex> lock(lock_);
+  CHECK_GT(in_flight_, 0);
+  --in_flight_;
+
+  if (!ok || received <= 0) {
+    batch_size_ = max(1.0, batch_size_ / 2);
+    concurrent_fetches_ = max(1.0, concurrent_fetches_ / 2);
+    if (++consecutive_failures_ >=
+        FLAGS_fetcher_peer_max_consecutive_failures) {
+      LOG_IF(WARNING, consecutive_failures_ ==
+                          FLAGS_fetcher_peer_max_consecutive_failures)
+          << peer_name_ << ": too many failed fetches, backing off";
+      open_until_ = steady_clock::now() +
+                    seconds(FLAGS_fetcher_peer_circuit_open_seconds);
+    }
+  } else {
+    fetcher_peer_entries_fetched->IncrementBy(peer_name_, received);
+    consecutive_failures_ = 0;
+    if (latency_ewma_.count() == 0) {
+      latency_ewma_ = latency;
+    } else {
+      latency_ewma_ += (duration<double>(latency) - latency_ewma_) *
+                       kLatencyEwmaWeight;
+    }
+    const duration<double> latency_per_entry(
+        duration<double>(latency) / received);
+    if (min_latency_per_entry_.count() == 0) {
+      min_latency_per_entry_ = latency_per_entry;
+    } else {
+      min_latency_per_entry_ = min(latency_per_entry,
+                                   min_latency_per_entry_ * kMinLatencyDecay);
+    }
+
+    if (received < requested) {
+      batch_size_ = received;
+    }
+
+    if (latency_per_entry > min_latency_per_entry_ * kCongestionFactor) {
+      concurrent_fetches_ =
+          max(1.0, concurrent_fetches_ - 1 / concurrent_fetches_);
+    } else {
+      concurrent_fetches_ =
+          min<double>(FLAGS_fetcher_max_concurrent_fetches,
+                      concurrent_fetches_ + 1 / concurrent_fetches_);
+      // Only grow the batch size if a whole batch came back.
+      if (received == requested &&
+          received >= static_cast<int64_t>(batch_size_)) {
+        batch_size_ = min<double>(FLAGS_fetcher_max_batch_size,
+                                  batch_size_ * kBatchSizeGrowth);
+      }
+    }
+  }
+
+  VLOG(2) << peer_name_ << ": batch size " << batch_size_
+          << ", concurrent fetches " << concurrent_fetches_;
+  fetcher_peer_batch_size->Set(peer_name_, batch_size_);
+  fetcher_peer_concurrent_fetches->Set(peer_name_, concurrent_fetches_);
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,78 @@
+#ifndef CERT_TRANS_FETCHER_FETCH_WINDOW_H_
+#define CERT_TRANS_FETCHER_FETCH_WINDOW_H_
+
+#include <stdint.h>
+#include <chrono>
+#include <mutex>
+#include <string>
+
+namespace cert_trans {
+
+
+// Tunes how many entries are requested from a peer at once, and how
+// many of these requests are kept in flight to it, from how its
+// previous requests went:
+//  - a failed request halves both;
+//  - a peer returning fewer entries than requested caps the batch size
+//    at what it returned (it probably has a limit of its own);
+//  - a successful request which took more than twice as long per entry
+//    as the fastest one seen recently backs off the concurrency by a
+//    little;
+//  - otherwise, the concurrency and (if the whole batch came back) the
+//    batch size grow by a little, up to their configured maximums.
+//
+// This lets replicas fetching over high latency links keep more
+// entries in flight than the starting values would.
+//
+// It also acts as a circuit breaker: after a number of failed requests
+// in a row, IsAvailable() returns false for a while, after which a
+// single request is let through to find out whether the peer is back.
+//
+// This class is thread-safe.
+class FetchWindow {
+ public:
+  // |peer_name| is used to label the metrics.
+  explicit FetchWindow(const std::string& peer_name);
+  FetchWindow(const FetchWindow&) = delete;
+  FetchWindow& operator=(const FetchWindow&) = delete;
+
+  // The number of entries to request at once.
+  int64_t BatchSize() const;
+
+  // The number of requests which should be kept in flight.
+  int ConcurrentFetches() const;
+
+  // The number of requests currently in flight.
+  int InFlight() const;
+
+  // Moving average of the latency of successful requests, zero until
+  // the first one.
+  std::chrono::duration<double> LatencyEwma() const;
+
+  // Returns false while the circuit breaker is open.
+  bool IsAvailable() const;
+
+  // Must be called when sending a request, and followed by a call to
+  // FetchDone() once it completes. |received| is ignored if !|ok|.
+  void FetchStarted();
+  void FetchDone(bool ok, int64_t requested, int64_t received,
+                 std::chrono::steady_clock::duration latency);
+
+ private:
+  const std::string peer_name_;
+
+  mutable std::mutex lock_;
+  double batch_size_;
+  double concurrent_fetches_;
+  int in_flight_;
+  // Zero until the first successful request.
+  std::chrono::duration<double> min_latency_per_entry_;
+  std::chrono::duration<double> latency_ewma_;
+  int consecutive_failures_;
+  std::chrono::steady_clock::time_point open_until_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_FETCHER_FETCH_WINDOW_H_
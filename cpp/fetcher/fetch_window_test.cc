@@ -0,0 +1,155 @@
+#include "fetcher/fetch_window.h"
+
+#include <gflags/gflags.h>
+#include <gtest/gtest.h>
+
+#include "util/testing.h"
+
+DECLARE_int32(fetcher_batch_size);
+DECLARE_int32(fetcher_concurrent_fetches);
+DECLARE_int32(fetcher_max_batch_size);
+DECLARE_int32(fetcher_max_concurrent_fetches);
+DECLARE_int32(fetcher_peer_circuit_open_seconds);
+DECLARE_int32(fetcher_peer_max_consecutive_failures);
+
+namespace cert_trans {
+
+using std::chrono::milliseconds;
+
+namespace {
+
+
+const char kPeerName[] = "peer.example.net:80";
+
+
+class FetchWindowTest : public ::testing::Test {
+ public:
+  FetchWindowTest() : window_(kPeerName) {
+  }
+
+ protected:
+  // Runs a request of a whole batch through |window_|, returning
+  // |received| entries in |latency|.
+  void Fetch(bool ok, int64_t received, milliseconds latency) {
+    const int64_t requested(window_.BatchSize());
+    window_.FetchStarted();
+    window_.FetchDone(ok, requested, received, latency);
+  }
+
+  void FetchAll(milliseconds latency) {
+    Fetch(true, window_.BatchSize(), latency);
+  }
+
+  FetchWindow window_;
+};
+
+
+TEST_F(FetchWindowTest, StartsWithFlags) {
+  EXPECT_EQ(FLAGS_fetcher_batch_size, window_.BatchSize());
+  EXPECT_EQ(FLAGS_fetcher_concurrent_fetches, window_.ConcurrentFetches());
+  EXPECT_EQ(0, window_.InFlight());
+}
+
+
+TEST_F(FetchWindowTest, TracksInFlight) {
+  window_.FetchStarted();
+  window_.FetchStarted();
+  EXPECT_EQ(2, window_.InFlight());
+  window_.FetchDone(true, 10, 10, milliseconds(10));
+  EXPECT_EQ(1, window_.InFlight());
+}
+
+
+TEST_F(FetchWindowTest, GrowsWhileFast) {
+  for (int i = 0; i < 1000; ++i) {
+    FetchAll(milliseconds(100));
+  }
+  EXPECT_EQ(FLAGS_fetcher_max_batch_size, window_.BatchSize());
+  EXPECT_EQ(FLAGS_fetcher_max_concurrent_fetches,
+            window_.ConcurrentFetches());
+}
+
+
+TEST_F(FetchWindowTest, ErrorsHalve) {
+  for (int i = 0; i < 1000; ++i) {
+    FetchAll(milliseconds(100));
+  }
+  Fetch(false, 0, milliseconds(100));
+  EXPECT_EQ(FLAGS_fetcher_max_batch_size / 2, window_.BatchSize());
+  EXPECT_EQ(FLAGS_fetcher_max_concurrent_fetches / 2,
+            window_.ConcurrentFetches());
+
+  for (int i = 0; i < 100; ++i) {
+    Fetch(false, 0, milliseconds(100));
+  }
+  EXPECT_EQ(1, window_.BatchSize());
+  EXPECT_EQ(1, window_.ConcurrentFetches());
+}
+
+
+TEST_F(FetchWindowTest, ShortRepliesCapBatchSize) {
+  Fetch(true, 256, milliseconds(100));
+  EXPECT_EQ(256, window_.BatchSize());
+}
+
+
+TEST_F(FetchWindowTest, BacksOffWhenSlow) {
+  for (int i = 0; i < 100; ++i) {
+    FetchAll(milliseconds(100));
+  }
+  const int concurrent_fetches(window_.ConcurrentFetches());
+  const int64_t batch_size(window_.BatchSize());
+  ASSERT_GT(concurrent_fetches, FLAGS_fetcher_concurrent_fetches);
+
+  for (int i = 0; i < 100; ++i) {
+    FetchAll(milliseconds(10000));
+  }
+  EXPECT_LT(window_.ConcurrentFetches(), concurrent_fetches);
+  EXPECT_EQ(batch_size, window_.BatchSize());
+}
+
+
+TEST_F(FetchWindowTest, TracksLatency) {
+  EXPECT_EQ(0, window_.LatencyEwma().count());
+  FetchAll(milliseconds(100));
+  EXPECT_DOUBLE_EQ(0.1, window_.LatencyEwma().count());
+  FetchAll(milliseconds(200));
+  EXPECT_GT(window_.LatencyEwma().count(), 0.1);
+  EXPECT_LT(window_.LatencyEwma().count(), 0.2);
+}
+
+
+TEST_F(FetchWindowTest, CircuitBreaker) {
+  for (int i = 1; i < FLAGS_fetcher_peer_max_consecutive_failures; ++i) {
+    Fetch(false, 0, milliseconds(100));
+    EXPECT_TRUE(window_.IsAvailable());
+  }
+  Fetch(false, 0, milliseconds(100));
+  EXPECT_FALSE(window_.IsAvailable());
+}
+
+
+TEST_F(FetchWindowTest, CircuitBreakerLetsOneRequestThrough) {
+  const int old_open_seconds(FLAGS_fetcher_peer_circuit_open_seconds);
+  FLAGS_fetcher_peer_circuit_open_seconds = 0;
+  for (int i = 0; i < FLAGS_fetcher_peer_max_consecutive_failures; ++i) {
+    Fetch(false, 0, milliseconds(100));
+  }
+  FLAGS_fetcher_peer_circuit_open_seconds = old_open_seconds;
+
+  EXPECT_TRUE(window_.IsAvailable());
+  window_.FetchStarted();
+  EXPECT_FALSE(window_.IsAvailable());
+  window_.FetchDone(true, 10, 10, milliseconds(100));
+  EXPECT_TRUE(window_.IsAvailable());
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -1,7 +1,8 @@
 #include "fetcher/fetcher.h"
 
-#include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <algorithm>
+#include <atomic>
 #include <memory>
 #include <mutex>
 
@@ -11,11 +12,16 @@
 using cert_trans::AsyncLogClient;
 using cert_trans::LoggedEntry;
 using cert_trans::PeerGroup;
+using std::atomic;
 using std::bind;
 using std::lock_guard;
+using std::make_shared;
+using std::max;
+using std::min;
 using std::move;
 using std::mutex;
 using std::placeholders::_1;
+using std::shared_ptr;
 using std::string;
 using std::to_string;
 using std::unique_lock;
@@ -25,11 +31,6 @@ using util::Status;
 using util::Task;
 using util::TaskHold;
 
-DEFINE_int32(fetcher_concurrent_fetches, 2,
-             "number of concurrent fetch requests");
-DEFINE_int32(fetcher_batch_size, 1000,
-             "maximum number of entries to fetch per request");
-
 namespace cert_trans {
 
 Counter<string>* num_invalid_entries_fetched =
@@ -41,6 +42,11 @@ Counter<string>* num_invalid_entries_fetched =
 namespace {
 
 
+// Number of fetched entries converted and verified at a time on a
+// thread of the executor.
+const size_t kVerifyChunkSize = 64;
+
+
 struct Range {
   enum State {
     HAVE,
@@ -60,6 +66,47 @@ struct Range {
 };
 
 
+// Sets *|tail| to a new Range, and returns where to append the next one.
+unique_ptr<Range>* AppendRange(unique_ptr<Range>* tail, Range::State state,
+                               int64_t size) {
+  tail->reset(new Range(state, size));
+  return &(*tail)->next_;
+}
+
+
+// The entries fetched for a range, on their way to the database.
+struct PendingWrite {
+  PendingWrite(int64_t index, Range* range,
+               const vector<AsyncLogClient::Entry>* retval, Task* range_task)
+      : index_(index),
+        range_(range),
+        retval_(retval),
+        range_task_(range_task),
+        certs_(retval->size()),
+        statuses_(retval->size()),
+        remaining_chunks_(0),
+        processed_(0) {
+  }
+
+  const int64_t index_;
+  Range* const range_;
+  const vector<AsyncLogClient::Entry>* const retval_;
+  Task* const range_task_;
+  vector<LoggedEntry> certs_;
+  vector<Status> statuses_;
+  atomic<size_t> remaining_chunks_;
+  int64_t processed_;
+};
+
+
+// Fetched ranges go through a pipeline: once a range is received, its
+// entries are converted and verified in chunks, in parallel on the
+// executor. The verified ranges are then queued for writing, and a
+// single thread at a time writes all the queued ranges to the database
+// in one batch, while other ranges are still being fetched and
+// verified. A range stays FETCHING until it is written, so that the
+// ranges waiting to be written count against the fetch concurrency,
+// which bounds the memory used.
 struct FetchState {
   FetchState(Database* db, unique_ptr<PeerGroup> peer_group,
              const LogVerifier* log_verifier, Task* task);
@@ -69,9 +116,14 @@ struct FetchState {
   void WalkEntries();
   void FetchRange(const unique_lock<mutex>& lock, Range* current,
                   int64_t index, Task* range_task);
-  void WriteToDatabase(int64_t index, Range* range,
-                       const vector<AsyncLogClient::Entry>* retval,
-                       Task* range_task, Task* fetch_task);
+  void FetchDone(int64_t index, Range* range,
+                 const vector<AsyncLogClient::Entry>* retval,
+                 Task* range_task, Task* fetch_task);
+  Status ConvertEntry(int64_t index, const AsyncLogClient::Entry& entry,
+                      LoggedEntry* cert) const;
+  void VerifyChunk(const shared_ptr<PendingWrite>& write, size_t chunk);
+  void EntriesVerified(const shared_ptr<PendingWrite>& write);
+  void WriteToDatabase(const shared_ptr<PendingWrite>& write);
 
   Database* const db_;
   const unique_ptr<PeerGroup> peer_group_;
@@ -81,6 +133,9 @@ struct FetchState {
   mutex lock_;
   int64_t start_;
   unique_ptr<Range> entries_;
+  // Whether a thread is currently writing to the database.
+  bool writing_;
+  vector<shared_ptr<PendingWrite>> pending_writes_;
 };
 
 
@@ -90,7 +145,8 @@ FetchState::FetchState(Database* db, unique_ptr<PeerGroup> peer_group,
       peer_group_(move(peer_group)),
       log_verifier_(CHECK_NOTNULL(log_verifier)),
       task_(CHECK_NOTNULL(task)),
-      start_(db_->TreeSize()) {
+      start_(db_->TreeSize()),
+      writing_(false) {
   // TODO(pphaneuf): Might be better to get that as a parameter?
   const int64_t remote_tree_size(peer_group_->TreeSize());
   CHECK_GE(start_, 0);
@@ -103,7 +159,25 @@ FetchState::FetchState(Database* db, unique_ptr<PeerGroup> peer_group,
     return;
   }
 
-  entries_.reset(new Range(Range::WANT, remote_tree_size - start_));
+  // Skip the entries already written out of order beyond the
+  // contiguous ones, e.g. by a fetch interrupted by a restart.
+  unique_ptr<Range>* next(&entries_);
+  int64_t index(start_);
+  for (const auto& sparse_range : db_->SparseRanges()) {
+    const int64_t begin(max(sparse_range.first, index));
+    const int64_t end(min(sparse_range.second, remote_tree_size));
+    if (begin >= end) {
+      continue;
+    }
+    if (begin > index) {
+      next = AppendRange(next, Range::WANT, begin - index);
+    }
+    next = AppendRange(next, Range::HAVE, end - begin);
+    index = end;
+  }
+  if (index < remote_tree_size) {
+    AppendRange(next, Range::WANT, remote_tree_size - index);
+  }
 
   WalkEntries();
 }
@@ -128,6 +202,8 @@ void FetchState::WalkEntries() {
 
   // Prune fetched and unavailable sequences at the beginning.
   const int64_t remote_tree_size(peer_group_->TreeSize());
+  const int64_t batch_size(peer_group_->BatchSize());
+  const int concurrent_fetches(peer_group_->ConcurrentFetches());
   while (entries_ &&
          (entries_->state_ == Range::HAVE ||
           (entries_->state_ == Range::WANT && remote_tree_size < start_))) {
@@ -177,11 +253,11 @@ void FetchState::WalkEntries() {
         }
 
         // If the range is bigger than the maximum batch size, split it.
-        if (current->size_ > FLAGS_fetcher_batch_size) {
-          current->next_.reset(
-              new Range(Range::WANT, current->size_ - FLAGS_fetcher_batch_size,
-                        move(current->next_)));
-          current->size_ = FLAGS_fetcher_batch_size;
+        if (current->size_ > batch_size) {
+          current->next_.reset(new Range(Range::WANT,
+                                         current->size_ - batch_size,
+                                         move(current->next_)));
+          current->size_ = batch_size;
         }
 
         FetchRange(lock, current, index,
@@ -191,7 +267,7 @@ void FetchState::WalkEntries() {
         break;
     }
 
-    if (num_fetch >= FLAGS_fetcher_concurrent_fetches ||
+    if (num_fetch >= concurrent_fetches ||
         index >= remote_tree_size) {
       break;
     }
@@ -213,14 +289,14 @@ void FetchState::FetchRange(const unique_lock<mutex>& lock, Range* current,
 
   peer_group_->FetchEntries(index, end_index, retval,
                             range_task->AddChild(
-                                bind(&FetchState::WriteToDatabase, this, index,
+                                bind(&FetchState::FetchDone, this, index,
                                      current, retval, range_task, _1)));
 }
 
 
-void FetchState::WriteToDatabase(int64_t index, Range* range,
-                                 const vector<AsyncLogClient::Entry>* retval,
-                                 Task* range_task, Task* fetch_task) {
+void FetchState::FetchDone(int64_t index, Range* range,
+                           const vector<AsyncLogClient::Entry>* retval,
+                           Task* range_task, Task* fetch_task) {
   if (!fetch_task->status().ok()) {
     LOG(INFO) << "error fetching entries at index " << index << ": "
               << fetch_task->status();
@@ -233,72 +309,168 @@ void FetchState::WriteToDatabase(int64_t index, Range* range,
   CHECK_GT(retval->size(), static_cast<size_t>(0));
 
   VLOG(1) << "received " << retval->size() << " entries at offset " << index;
-  int64_t processed(0);
-  for (const auto& entry : *retval) {
-    LoggedEntry cert;
-    if (!cert.CopyFromClientLogEntry(entry)) {
-      LOG(WARNING) << "could not convert entry to a LoggedEntry";
-      num_invalid_entries_fetched->Increment("format");
-      break;
+  const shared_ptr<PendingWrite> write(
+      make_shared<PendingWrite>(index, range, retval, range_task));
+  const size_t num_chunks((retval->size() + kVerifyChunkSize - 1) /
+                          kVerifyChunkSize);
+  write->remaining_chunks_ = num_chunks;
+  for (size_t chunk = 1; chunk < num_chunks; ++chunk) {
+    range_task->executor()->Add(
+        bind(&FetchState::VerifyChunk, this, write, chunk));
+  }
+  VerifyChunk(write, 0);
+}
+
+
+Status FetchState::ConvertEntry(int64_t index,
+                                const AsyncLogClient::Entry& entry,
+                                LoggedEntry* cert) const {
+  if (!cert->CopyFromClientLogEntry(entry)) {
+    return Status(util::error::INVALID_ARGUMENT,
+                  "could not convert entry to a LoggedEntry");
+  }
+  if (entry.sct) {
+    *cert->mutable_sct() = *entry.sct;
+    // If we have the full SCT (because this LogEntry came from another
+    // internal node which supports our private "give me the SCT too"
+    // option), then verify that the signature is good.
+    const LogVerifier::LogVerifyResult verify_result(
+        log_verifier_->VerifySignedCertificateTimestamp(
+            cert->contents().entry(), cert->sct()));
+    VLOG(1) << "SCT verify entry #" << index << ": "
+            << LogVerifier::VerifyResultString(verify_result);
+    if (verify_result != LogVerifier::VERIFY_OK) {
+      return Status(util::error::FAILED_PRECONDITION,
+                    "Failed to verify SCT signature for entry# " +
+                        to_string(index) + " : " +
+                        LogVerifier::VerifyResultString(verify_result));
     }
-    if (entry.sct) {
-      *cert.mutable_sct() = *entry.sct;
-      // If we have the full SCT (because this LogEntry came from another
-      // internal node which supports our private "give me the SCT too"
-      // option), then verify that the signature is good.
-      const LogVerifier::LogVerifyResult verify_result(
-          log_verifier_->VerifySignedCertificateTimestamp(
-              cert.contents().entry(), cert.sct()));
-      VLOG(1) << "SCT verify entry #" << index << ": "
-              << LogVerifier::VerifyResultString(verify_result);
-      if (verify_result != LogVerifier::VERIFY_OK) {
-        num_invalid_entries_fetched->Increment("sct_verify_failed");
-        const string msg("Failed to verify SCT signature for entry# " +
-                         to_string(index) + " : " +
-                         LogVerifier::VerifyResultString(verify_result));
-        LOG(WARNING) << msg;
-        task_->Return(Status(util::error::FAILED_PRECONDITION, msg));
-        return;
-      }
+  }
+  cert->set_sequence_number(index);
+  return ::util::OkStatus();
+}
+
+
+void FetchState::VerifyChunk(const shared_ptr<PendingWrite>& write,
+                             size_t chunk) {
+  const size_t begin(chunk * kVerifyChunkSize);
+  const size_t end(min(begin + kVerifyChunkSize, write->retval_->size()));
+  for (size_t i = begin; i < end; ++i) {
+    write->statuses_[i] = ConvertEntry(write->index_ + i,
+                                       (*write->retval_)[i],
+                                       &write->certs_[i]);
+  }
+
+  if (--write->remaining_chunks_ == 0) {
+    EntriesVerified(write);
+  }
+}
+
+
+void FetchState::EntriesVerified(const shared_ptr<PendingWrite>& write) {
+  // Keep the entries up to the first invalid one.
+  for (size_t i = 0; i < write->statuses_.size(); ++i) {
+    const Status& status(write->statuses_[i]);
+    if (status.ok()) {
+      continue;
     }
-    cert.set_sequence_number(index++);
-    if (db_->CreateSequencedEntry(cert) == Database::OK) {
-      ++processed;
-    } else {
-      LOG(WARNING) << "could not insert entry into the database:\n"
-                   << cert.DebugString();
-      break;
+
+    LOG(WARNING) << status;
+    if (status.CanonicalCode() == util::error::FAILED_PRECONDITION) {
+      num_invalid_entries_fetched->Increment("sct_verify_failed");
+      task_->Return(status);
+      return;
     }
+    num_invalid_entries_fetched->Increment("format");
+    write->certs_.resize(i);
+    break;
   }
 
-  {
-    lock_guard<mutex> lock(lock_);
-    // TODO(pphaneuf): If we have problems fetching entries, to what
-    // point should we retry? Or should we just return on the task
-    // with an error?
-    if (processed > 0) {
-      // If we don't receive everything, split up the range.
-      if (range->size_ > processed) {
-        range->next_.reset(new Range(Range::WANT, range->size_ - processed,
-                                     move(range->next_)));
-        range->size_ = processed;
-      }
+  WriteToDatabase(write);
+}
+
+
+void FetchState::WriteToDatabase(const shared_ptr<PendingWrite>& write) {
+  // Returning the range tasks could otherwise let the task finish (and
+  // delete us) while we are still going.
+  TaskHold hold(task_);
+  unique_lock<mutex> lock(lock_);
+  pending_writes_.push_back(write);
+  if (writing_) {
+    // The thread already writing will pick it up.
+    return;
+  }
 
-      range->state_ = Range::HAVE;
+  writing_ = true;
+  while (!pending_writes_.empty()) {
+    vector<shared_ptr<PendingWrite>> batch;
+    batch.swap(pending_writes_);
+    lock.unlock();
+
+    // Write all the ranges queued so far in a single batch.
+    vector<Database::WriteResult> results;
+    if (batch.size() == 1) {
+      results = db_->CreateSequencedEntries(batch.front()->certs_);
     } else {
-      range->state_ = Range::WANT;
+      vector<LoggedEntry> certs;
+      for (const auto& pending : batch) {
+        certs.insert(certs.end(), pending->certs_.begin(),
+                     pending->certs_.end());
+      }
+      results = db_->CreateSequencedEntries(certs);
     }
-  }
+    VLOG(1) << "wrote " << results.size() << " entries from " << batch.size()
+            << " range(s)";
+
+    lock.lock();
+    size_t offset(0);
+    for (const auto& pending : batch) {
+      const vector<LoggedEntry>& certs(pending->certs_);
+      while (pending->processed_ < static_cast<int64_t>(certs.size()) &&
+             results[offset + pending->processed_] == Database::OK) {
+        ++pending->processed_;
+      }
+      LOG_IF(WARNING, pending->processed_ < static_cast<int64_t>(certs.size()))
+          << "could not insert entry into the database:\n"
+          << certs[pending->processed_].DebugString();
+      offset += certs.size();
+
+      // TODO(pphaneuf): If we have problems fetching entries, to what
+      // point should we retry? Or should we just return on the task
+      // with an error?
+      Range* const range(pending->range_);
+      if (pending->processed_ > 0) {
+        // If we don't receive everything, split up the range.
+        if (range->size_ > pending->processed_) {
+          range->next_.reset(new Range(Range::WANT,
+                                       range->size_ - pending->processed_,
+                                       move(range->next_)));
+          range->size_ = pending->processed_;
+        }
 
-  if (static_cast<uint64_t>(processed) < retval->size()) {
-    // We couldn't insert everything that we received into the
-    // database, this is fairly serious, return an error for the
-    // overall operation and let the higher level deal with it.
-    task_->Return(Status(util::error::INTERNAL,
-                         "could not write some entries to the database"));
-  }
+        range->state_ = Range::HAVE;
+      } else {
+        range->state_ = Range::WANT;
+      }
+    }
+    lock.unlock();
+
+    for (const auto& pending : batch) {
+      if (static_cast<uint64_t>(pending->processed_) <
+          pending->retval_->size()) {
+        // We couldn't insert everything that we received into the
+        // database, this is fairly serious, return an error for the
+        // overall operation and let the higher level deal with it.
+        task_->Return(Status(util::error::INTERNAL,
+                             "could not write some entries to the database"));
+      }
 
-  range_task->Return();
+      pending->range_task_->Return();
+    }
+
+    lock.lock();
+  }
+  writing_ = false;
 }
 
 
@@ -13,6 +13,7 @@ class MockContinuousFetcher : public ContinuousFetcher {
   MOCK_METHOD2(AddPeer, void(const std::string& node_id,
                              const std::shared_ptr<Peer>& peer));
   MOCK_METHOD1(RemovePeer, void(const std::string& node_id));
+  MOCK_METHOD0(TriggerFetch, void());
 };
 
 
@@ -2,13 +2,27 @@
 
 #include <glog/logging.h>
 
+using std::string;
+using std::to_string;
 using std::unique_ptr;
 
 namespace cert_trans {
 
+namespace {
 
-Peer::Peer(unique_ptr<AsyncLogClient> client) : client_(move(client)) {
-  CHECK_NOTNULL(client_.get());
+
+string PeerName(const AsyncLogClient& client) {
+  return client.server_url().Host() + ":" +
+         to_string(client.server_url().Port());
+}
+
+
+}  // namespace
+
+
+Peer::Peer(unique_ptr<AsyncLogClient> client)
+    : client_(move(client)),
+      fetch_window_(PeerName(*CHECK_NOTNULL(client_.get()))) {
 }
 
 
@@ -4,6 +4,7 @@
 #include <memory>
 
 #include "client/async_log_client.h"
+#include "fetcher/fetch_window.h"
 
 namespace cert_trans {
 
@@ -19,11 +20,16 @@ class Peer {
     return *client_;
   }
 
+  FetchWindow& fetch_window() {
+    return fetch_window_;
+  }
+
   // Returns -1 if we do not know yet.
   virtual int64_t TreeSize() const = 0;
 
  protected:
   const std::unique_ptr<AsyncLogClient> client_;
+  FetchWindow fetch_window_;
 };
 
 
@@ -1,12 +1,36 @@
 #include "fetcher/peer_group.h"
 
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 
+#include "monitoring/monitoring.h"
+
+DEFINE_bool(fetch_binary_entries, false,
+            "Fetch the entries from the other nodes of the cluster through "
+            "the get-entries-binary endpoint, rather than get-entries. All "
+            "the nodes must serve it.");
+DEFINE_bool(compress_fetched_entries, true,
+            "With --fetch_binary_entries, have the other nodes deflate the "
+            "entries they send.");
+DEFINE_double(fetcher_hedge_delay_factor, 3,
+              "A fetch which takes this many times longer than the average "
+              "latency of its peer is also sent to another peer, the first "
+              "reply being used. 0 disables this.");
+
+DECLARE_int32(fetcher_batch_size);
+
+using std::chrono::duration;
+using std::chrono::steady_clock;
 using std::lock_guard;
+using std::make_shared;
 using std::max;
+using std::min;
+using std::move;
 using std::mutex;
 using std::placeholders::_1;
 using std::shared_ptr;
+using std::string;
+using std::unique_lock;
 using std::vector;
 using util::Status;
 using util::Task;
@@ -16,8 +40,68 @@ namespace cert_trans {
 namespace {
 
 
-void GetEntriesDone(AsyncLogClient::Status client_status,
-                    const vector<AsyncLogClient::Entry>* entries, Task* task) {
+static Counter<string>* fetcher_hedged_fetches =
+    Counter<string>::New("fetcher_hedged_fetches", "outcome",
+                         "Number of fetches sent again to another peer "
+                         "(sent), and how many of these were answered "
+                         "first by the other peer (won).");
+
+
+// Returns how long a new request to |peer| could be expected to take.
+double Load(const shared_ptr<Peer>& peer) {
+  const FetchWindow& window(peer->fetch_window());
+  return (window.InFlight() + 1) * window.LatencyEwma().count();
+}
+
+
+// Returns the less loaded of two of |peers| picked at random.
+shared_ptr<Peer> PickLessLoaded(const vector<shared_ptr<Peer>>& peers) {
+  CHECK(!peers.empty());
+  const shared_ptr<Peer>& first(peers[std::rand() % peers.size()]);
+  const shared_ptr<Peer>& second(peers[std::rand() % peers.size()]);
+  return Load(second) < Load(first) ? second : first;
+}
+
+
+}  // namespace
+
+
+// A call to FetchEntries(), which can be sent to more than one peer.
+struct PeerGroup::Fetch {
+  Fetch(int64_t start_index, int64_t end_index,
+        vector<AsyncLogClient::Entry>* entries, Task* task)
+      : start_index_(start_index),
+        end_index_(end_index),
+        entries_(CHECK_NOTNULL(entries)),
+        task_(CHECK_NOTNULL(task)),
+        in_flight_(0),
+        done_(false) {
+  }
+
+  // Called when a request to |peer| for |requested| entries completes,
+  // with what it returned in |received|.
+  void RequestDone(const shared_ptr<Peer>& peer, int64_t requested,
+                   steady_clock::time_point started_at, bool hedge,
+                   const shared_ptr<vector<AsyncLogClient::Entry>>& received,
+                   AsyncLogClient::Status client_status);
+
+  const int64_t start_index_;
+  const int64_t end_index_;
+  vector<AsyncLogClient::Entry>* const entries_;
+  Task* const task_;
+
+  mutex lock_;
+  int in_flight_;
+  // Once set, |entries_| and |task_| must not be used anymore.
+  bool done_;
+};
+
+
+void PeerGroup::Fetch::RequestDone(
+    const shared_ptr<Peer>& peer, int64_t requested,
+    steady_clock::time_point started_at, bool hedge,
+    const shared_ptr<vector<AsyncLogClient::Entry>>& received,
+    AsyncLogClient::Status client_status) {
   Status status;
 
   switch (client_status) {
@@ -30,17 +114,40 @@ void GetEntriesDone(AsyncLogClient::Status client_status,
       status = util::Status::UNKNOWN;
   }
 
-  if (status.ok() && entries->empty()) {
+  if (status.ok() && received->empty()) {
     // This should never happen.
     status =
         Status(util::error::INTERNAL, "log server did not return any entries");
   }
 
-  task->Return(status);
-}
+  peer->fetch_window().FetchDone(status.ok(), requested, received->size(),
+                                 steady_clock::now() - started_at);
 
+  unique_lock<mutex> lock(lock_);
+  CHECK_GT(in_flight_, 0);
+  --in_flight_;
+  if (done_) {
+    // Another request got there first.
+    return;
+  }
+  if (!status.ok() && in_flight_ > 0) {
+    // Wait and see how the other request does.
+    return;
+  }
 
-}  // namespace
+  done_ = true;
+  if (status.ok()) {
+    if (hedge) {
+      fetcher_hedged_fetches->Increment("won");
+    }
+    for (auto& entry : *received) {
+      entries_->emplace_back(move(entry));
+    }
+  }
+  lock.unlock();
+
+  task_->Return(status);
+}
 
 
 PeerGroup::PeerGroup(bool fetch_scts) : fetch_scts_(fetch_scts) {
@@ -66,53 +173,165 @@ int64_t PeerGroup::TreeSize() const {
 }
 
 
+int64_t PeerGroup::BatchSize() const {
+  lock_guard<mutex> lock(lock_);
+
+  int64_t batch_size(0);
+  for (const auto& peer : peers_) {
+    batch_size = max(batch_size, peer.first->fetch_window().BatchSize());
+  }
+
+  return batch_size > 0 ? batch_size : FLAGS_fetcher_batch_size;
+}
+
+
+int PeerGroup::ConcurrentFetches() const {
+  lock_guard<mutex> lock(lock_);
+
+  int concurrent_fetches(0);
+  for (const auto& peer : peers_) {
+    concurrent_fetches += peer.first->fetch_window().ConcurrentFetches();
+  }
+
+  return max(concurrent_fetches, 1);
+}
+
+
 void PeerGroup::FetchEntries(int64_t start_index, int64_t end_index,
                              vector<AsyncLogClient::Entry>* entries,
                              Task* task) {
   CHECK_GE(start_index, 0);
   CHECK_GE(end_index, start_index);
 
-  const shared_ptr<Peer> peer(PickPeer(end_index + 1));
+  const shared_ptr<Peer> peer(PickPeer(end_index + 1, nullptr));
   if (!peer) {
     task->Return(Status(util::error::UNAVAILABLE,
                         "requested entries not available in the peer group"));
     return;
   }
 
+  // Don't ask the peer for more than it is likely to manage.
+  end_index =
+      min(end_index, start_index + peer->fetch_window().BatchSize() - 1);
+  const shared_ptr<Fetch> fetch(
+      make_shared<Fetch>(start_index, end_index, entries, task));
+  StartFetch(fetch, peer, false /* hedge */);
+
+  const duration<double> latency(peer->fetch_window().LatencyEwma());
+  if (FLAGS_fetcher_hedge_delay_factor > 0 && latency.count() > 0) {
+    // This timer is cancelled when |task| completes.
+    task->executor()->Delay(latency * FLAGS_fetcher_hedge_delay_factor,
+                            task->AddChild(bind(&PeerGroup::MaybeHedge, this,
+                                                fetch, peer, _1)));
+  }
+}
+
+
+void PeerGroup::StartFetch(const shared_ptr<Fetch>& fetch,
+                           const shared_ptr<Peer>& peer, bool hedge) {
+  const int64_t end_index(
+      min(fetch->end_index_,
+          fetch->start_index_ + peer->fetch_window().BatchSize() - 1));
+  // Each request gets its own vector, only the first reply to come
+  // back goes to the caller.
+  const shared_ptr<vector<AsyncLogClient::Entry>> received(
+      make_shared<vector<AsyncLogClient::Entry>>());
+  const AsyncLogClient::Callback done(
+      bind(&Fetch::RequestDone, fetch, peer,
+           end_index - fetch->start_index_ + 1, steady_clock::now(), hedge,
+           received, _1));
+  {
+    lock_guard<mutex> lock(fetch->lock_);
+    ++fetch->in_flight_;
+  }
+  peer->fetch_window().FetchStarted();
+
   // TODO(pphaneuf): Handle the case where we have no peer more cleanly.
-  if (fetch_scts_) {
-    peer->client().GetEntriesAndSCTs(start_index, end_index,
-                                     CHECK_NOTNULL(entries),
-                                     bind(GetEntriesDone, _1, entries, task));
+  // Only the nodes of the cluster serve get-entries-binary, and these
+  // are the peers SCTs are fetched from.
+  if (fetch_scts_ && FLAGS_fetch_binary_entries) {
+    peer->client().GetEntriesBinary(fetch->start_index_, end_index,
+                                    true /* request_scts */,
+                                    FLAGS_compress_fetched_entries,
+                                    received.get(), done);
+  } else if (fetch_scts_) {
+    peer->client().GetEntriesAndSCTs(fetch->start_index_, end_index,
+                                     received.get(), done);
   } else {
-    peer->client().GetEntries(start_index, end_index, CHECK_NOTNULL(entries),
-                              bind(GetEntriesDone, _1, entries, task));
+    peer->client().GetEntries(fetch->start_index_, end_index, received.get(),
+                              done);
   }
 }
 
 
-shared_ptr<Peer> PeerGroup::PickPeer(const int64_t needed_size) const {
+void PeerGroup::MaybeHedge(const shared_ptr<Fetch>& fetch,
+                           const shared_ptr<Peer>& first_peer, Task* timer) {
+  if (!timer->status().ok()) {
+    // Cancelled, the fetch is done.
+    return;
+  }
+
+  {
+    lock_guard<mutex> lock(fetch->lock_);
+    if (fetch->done_) {
+      return;
+    }
+  }
+
+  const shared_ptr<Peer> peer(
+      PickPeer(fetch->end_index_ + 1, first_peer.get()));
+  if (!peer) {
+    return;
+  }
+
+  VLOG(1) << "fetch of entries " << fetch->start_index_ << " to "
+          << fetch->end_index_ << " is slow, sending it to another peer";
+  fetcher_hedged_fetches->Increment("sent");
+  StartFetch(fetch, peer, true /* hedge */);
+}
+
+
+shared_ptr<Peer> PeerGroup::PickPeer(const int64_t needed_size,
+                                     const Peer* exclude) const {
   lock_guard<mutex> lock(lock_);
 
-  // TODO(pphaneuf): We should pick peers a bit more cleverly, to
-  // spread the load somewhat.
   int64_t group_tree_size(-1);
+  // The peers which have the entries, those of them which are not
+  // failing, and those of them which have room for another request.
   vector<shared_ptr<Peer>> capable_peers;
+  vector<shared_ptr<Peer>> healthy_peers;
+  vector<shared_ptr<Peer>> idle_peers;
   for (const auto& peer : peers_) {
     const int64_t tree_size(peer.first->TreeSize());
     group_tree_size = max(group_tree_size, tree_size);
-    if (tree_size >= needed_size) {
-      capable_peers.push_back(peer.first);
+    if (tree_size < needed_size || peer.first.get() == exclude) {
+      continue;
+    }
+    capable_peers.push_back(peer.first);
+    const FetchWindow& window(peer.first->fetch_window());
+    if (window.IsAvailable()) {
+      healthy_peers.push_back(peer.first);
+      if (window.InFlight() < window.ConcurrentFetches()) {
+        idle_peers.push_back(peer.first);
+      }
     }
   }
 
-  if (!capable_peers.empty()) {
-    return capable_peers[std::rand() % capable_peers.size()];
+  if (!idle_peers.empty()) {
+    return PickLessLoaded(idle_peers);
+  }
+  if (!healthy_peers.empty()) {
+    return PickLessLoaded(healthy_peers);
+  }
+  // Rather than failing the fetch, give a failing peer another go (but
+  // not as a hedge, which is only worth it with a healthy peer).
+  if (!capable_peers.empty() && !exclude) {
+    return PickLessLoaded(capable_peers);
   }
 
-  LOG(INFO) << "requested a peer with " << needed_size
-            << " entries but the peer group only has " << group_tree_size
-            << " entries";
+  LOG_IF(INFO, !exclude) << "requested a peer with " << needed_size
+                         << " entries but the peer group only has "
+                         << group_tree_size << " entries";
 
   return nullptr;
 }
@@ -15,10 +15,14 @@ namespace cert_trans {
 
 
 // A PeerGroup is a set of peers used for a fetch operation, providing
-// a slightly higher level abstraction for fetching entries. Fetch
-// errors will be retried, and unhealthy peers will be dropped (so the
-// available tree size can get smaller).
-// TODO(pphaneuf): Make that last sentence true!
+// a slightly higher level abstraction for fetching entries.
+//
+// Each fetch goes to the less loaded of two peers picked at random
+// among those which have the entries, where the load of a peer is its
+// requests in flight weighted by its latency. Peers whose circuit
+// breaker is open (see FetchWindow) are avoided. A fetch which takes
+// much longer than usual for its peer is sent again to another peer,
+// and whichever reply comes first is used.
 class PeerGroup {
  public:
   explicit PeerGroup(bool fetch_scts_);
@@ -31,17 +35,36 @@ class PeerGroup {
   // Returns the highest tree size of the peer group.
   int64_t TreeSize() const;
 
+  // Returns the largest number of entries worth requesting in one
+  // FetchEntries() call. Each peer is only asked for as many as its
+  // FetchWindow allows, so that fewer entries might be returned.
+  int64_t BatchSize() const;
+
+  // Returns the number of FetchEntries() calls worth keeping in flight,
+  // over all the peers.
+  int ConcurrentFetches() const;
+
   void FetchEntries(int64_t start_offset, int64_t end_offset,
                     std::vector<AsyncLogClient::Entry>* entries,
                     util::Task* task);
 
  private:
-  struct PeerState {
-    // TODO(pphaneuf): Keep a count of errors here, to prune away
-    // unhealthy peers.
-  };
+  struct PeerState {};
+  struct Fetch;
+
+  // Returns a peer with at least |needed_size| entries, other than
+  // |exclude|, or nullptr if there is none.
+  std::shared_ptr<Peer> PickPeer(const int64_t needed_size,
+                                 const Peer* exclude) const;
+
+  // Sends a request for the entries of |fetch| to |peer|.
+  void StartFetch(const std::shared_ptr<Fetch>& fetch,
+                  const std::shared_ptr<Peer>& peer, bool hedge);
 
-  std::shared_ptr<Peer> PickPeer(const int64_t needed_size) const;
+  // Called after the hedging delay of |fetch|, sends it to another peer
+  // if it has not completed yet.
+  void MaybeHedge(const std::shared_ptr<Fetch>& fetch,
+                  const std::shared_ptr<Peer>& first_peer, util::Task* timer);
 
   mutable std::mutex lock_;
   const bool fetch_scts_;
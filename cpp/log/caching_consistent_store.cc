@@ -0,0 +1,180 @@
+#include "log/caching_consistent_store.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include "monitoring/counter.h"
+#include "monitoring/monitoring.h"
+
+DEFINE_int32(consistent_store_cache_max_staleness_ms, 2000,
+             "How long the sequence mapping and the node state read from "
+             "the consistent store are served from memory before being "
+             "read again. 0 disables the cache.");
+
+namespace cert_trans {
+
+using ct::ClusterNodeState;
+using ct::SequenceMapping;
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+using std::lock_guard;
+using std::mutex;
+using std::string;
+using util::Status;
+using util::StatusOr;
+
+namespace {
+
+
+Counter<string, string>* consistent_store_cache_reads =
+    Counter<string, string>::New("consistent_store_cache_reads", "type",
+                                 "result",
+                                 "Number of reads of the consistent store "
+                                 "cache, broken down by type and hit or "
+                                 "miss.");
+
+
+}  // namespace
+
+
+CachingConsistentStore::CachingConsistentStore(ConsistentStore* peer)
+    : peer_(CHECK_NOTNULL(peer)),
+      max_staleness_(
+          milliseconds(FLAGS_consistent_store_cache_max_staleness_ms)),
+      generation_(0),
+      has_mapping_(false),
+      has_node_state_(false) {
+  CHECK_GE(FLAGS_consistent_store_cache_max_staleness_ms, 0);
+}
+
+
+void CachingConsistentStore::Invalidate() {
+  lock_guard<mutex> lock(lock_);
+  ++generation_;
+  has_mapping_ = false;
+  has_node_state_ = false;
+}
+
+
+StatusOr<int64_t> CachingConsistentStore::NextAvailableSequenceNumber() const {
+  // Same as what the peer does, but with the cached mapping.
+  EntryHandle<SequenceMapping> sequence_mapping;
+  const Status status(GetSequenceMapping(&sequence_mapping));
+  if (!status.ok()) {
+    return status;
+  }
+  const SequenceMapping& mapping(sequence_mapping.Entry());
+  if (mapping.mapping_size() > 0) {
+    return mapping.mapping(mapping.mapping_size() - 1).sequence_number() + 1;
+  }
+
+  const StatusOr<ct::SignedTreeHead> sth(peer_->GetServingSTH());
+  if (!sth.ok()) {
+    if (sth.status().CanonicalCode() == util::error::NOT_FOUND) {
+      LOG(WARNING) << "Log has no Serving STH [new log?], returning 0";
+      return 0;
+    }
+    return sth.status();
+  }
+  return sth.ValueOrDie().tree_size();
+}
+
+
+Status CachingConsistentStore::GetSequenceMapping(
+    EntryHandle<SequenceMapping>* entry) const {
+  CHECK_NOTNULL(entry);
+  uint64_t generation;
+  {
+    lock_guard<mutex> lock(lock_);
+    if (has_mapping_ && IsFresh(mapping_cached_at_)) {
+      consistent_store_cache_reads->Increment("sequence_mapping", "hit");
+      *entry = mapping_;
+      return ::util::OkStatus();
+    }
+    generation = generation_;
+  }
+  consistent_store_cache_reads->Increment("sequence_mapping", "miss");
+
+  const Status status(peer_->GetSequenceMapping(entry));
+  if (status.ok()) {
+    lock_guard<mutex> lock(lock_);
+    if (generation == generation_) {
+      has_mapping_ = true;
+      mapping_cached_at_ = steady_clock::now();
+      mapping_ = *entry;
+    }
+  }
+  return status;
+}
+
+
+Status CachingConsistentStore::UpdateSequenceMapping(
+    EntryHandle<SequenceMapping>* entry) {
+  CHECK_NOTNULL(entry);
+  const Status status(peer_->UpdateSequenceMapping(entry));
+
+  lock_guard<mutex> lock(lock_);
+  ++generation_;
+  // On success, |entry| has the handle of the new version. Otherwise,
+  // whatever is cached is suspect.
+  has_mapping_ = status.ok();
+  if (status.ok()) {
+    mapping_cached_at_ = steady_clock::now();
+    mapping_ = *entry;
+  }
+  return status;
+}
+
+
+StatusOr<ClusterNodeState> CachingConsistentStore::GetClusterNodeState()
+    const {
+  uint64_t generation;
+  {
+    lock_guard<mutex> lock(lock_);
+    if (has_node_state_ && IsFresh(node_state_cached_at_)) {
+      consistent_store_cache_reads->Increment("cluster_node_state", "hit");
+      return node_state_;
+    }
+    generation = generation_;
+  }
+  consistent_store_cache_reads->Increment("cluster_node_state", "miss");
+
+  const StatusOr<ClusterNodeState> state(peer_->GetClusterNodeState());
+  if (state.ok()) {
+    lock_guard<mutex> lock(lock_);
+    if (generation == generation_) {
+      has_node_state_ = true;
+      node_state_cached_at_ = steady_clock::now();
+      node_state_ = state.ValueOrDie();
+    }
+    node_id_ = state.ValueOrDie().node_id();
+  }
+  return state;
+}
+
+
+Status CachingConsistentStore::SetClusterNodeState(
+    const ClusterNodeState& state) {
+  const Status status(peer_->SetClusterNodeState(state));
+
+  lock_guard<mutex> lock(lock_);
+  ++generation_;
+  // The peer fills in the node ID, which is only known once it has
+  // been read.
+  has_node_state_ = status.ok() && !node_id_.empty();
+  if (has_node_state_) {
+    node_state_cached_at_ = steady_clock::now();
+    node_state_ = state;
+    node_state_.set_node_id(node_id_);
+  }
+  return status;
+}
+
+
+bool CachingConsistentStore::IsFresh(
+    steady_clock::time_point cached_at) const {
+  return steady_clock::now() - cached_at < max_staleness_;
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,146 @@
+#ifndef CERT_TRANS_LOG_CACHING_CONSISTENT_STORE_H_
+#define CERT_TRANS_LOG_CACHING_CONSISTENT_STORE_H_
+
+#include <stdint.h>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "log/consistent_store.h"
+#include "log/logged_entry.h"
+
+namespace cert_trans {
+
+// A wrapper around a ConsistentStore which keeps the sequence mapping
+// and the node state of this node in memory, and serves reads of them
+// from there rather than going to the peer each time.
+//
+// Both are only ever written through this node (the sequence mapping
+// by the master, with compare-and-update), so that writing them
+// through keeps the copies current. The copies are nonetheless
+// dropped once older than max_staleness(), which bounds how stale a
+// read can be after a change made elsewhere (e.g. by a previous
+// master). A stale sequence mapping is never written back: its handle
+// no longer matches, so the update fails and the next read goes to the
+// peer again.
+//
+// Callers which need a linearizable read should call Invalidate()
+// first.
+class CachingConsistentStore : public ConsistentStore {
+ public:
+  // Takes ownership of |peer|.
+  explicit CachingConsistentStore(ConsistentStore* peer);
+
+  virtual ~CachingConsistentStore() = default;
+
+  // How old a cached value can get before it is read again from the
+  // peer. Zero means that nothing is cached.
+  std::chrono::steady_clock::duration max_staleness() const {
+    return max_staleness_;
+  }
+
+  // Drops the cached values, so that the next reads go to the peer.
+  void Invalidate();
+
+  // Cached methods:
+
+  util::StatusOr<int64_t> NextAvailableSequenceNumber() const override;
+
+  util::Status GetSequenceMapping(
+      EntryHandle<ct::SequenceMapping>* entry) const override;
+
+  util::Status UpdateSequenceMapping(
+      EntryHandle<ct::SequenceMapping>* entry) override;
+
+  util::StatusOr<ct::ClusterNodeState> GetClusterNodeState() const override;
+
+  util::Status SetClusterNodeState(const ct::ClusterNodeState& state) override;
+
+  // Other methods:
+
+  util::Status SetServingSTH(const ct::SignedTreeHead& new_sth) override {
+    return peer_->SetServingSTH(new_sth);
+  }
+
+  util::StatusOr<ct::SignedTreeHead> GetServingSTH() const override {
+    return peer_->GetServingSTH();
+  }
+
+  util::Status AddPendingEntry(LoggedEntry* entry) override {
+    return peer_->AddPendingEntry(entry);
+  }
+
+  void AddPendingEntryAsync(LoggedEntry* entry, util::Task* task) override {
+    peer_->AddPendingEntryAsync(entry, task);
+  }
+
+  void AddPendingEntries(const std::vector<LoggedEntry*>& entries,
+                         std::vector<util::Status>* statuses) override {
+    peer_->AddPendingEntries(entries, statuses);
+  }
+
+  util::Status GetPendingEntryForHash(
+      const std::string& hash,
+      EntryHandle<LoggedEntry>* entry) const override {
+    return peer_->GetPendingEntryForHash(hash, entry);
+  }
+
+  util::Status GetPendingEntries(
+      std::vector<EntryHandle<LoggedEntry>>* entries) const override {
+    return peer_->GetPendingEntries(entries);
+  }
+
+  void WatchServingSTH(const ConsistentStore::ServingSTHCallback& cb,
+                       util::Task* task) override {
+    return peer_->WatchServingSTH(cb, task);
+  }
+
+  void WatchClusterNodeStates(
+      const ConsistentStore::ClusterNodeStateCallback& cb,
+      util::Task* task) override {
+    return peer_->WatchClusterNodeStates(cb, task);
+  }
+
+  void WatchClusterConfig(const ConsistentStore::ClusterConfigCallback& cb,
+                          util::Task* task) override {
+    return peer_->WatchClusterConfig(cb, task);
+  }
+
+  void WatchPendingEntries(const ConsistentStore::PendingEntriesCallback& cb,
+                           util::Task* task) override {
+    return peer_->WatchPendingEntries(cb, task);
+  }
+
+  util::Status SetClusterConfig(const ct::ClusterConfig& config) override {
+    return peer_->SetClusterConfig(config);
+  }
+
+  util::StatusOr<int64_t> CleanupOldEntries() override {
+    return peer_->CleanupOldEntries();
+  }
+
+ private:
+  bool IsFresh(std::chrono::steady_clock::time_point cached_at) const;
+
+  const std::unique_ptr<ConsistentStore> peer_;
+  const std::chrono::steady_clock::duration max_staleness_;
+
+  mutable std::mutex lock_;
+  // Bumped by every write and invalidation, so that a read of the peer
+  // which raced with one does not replace the newer value.
+  mutable uint64_t generation_;
+  mutable bool has_mapping_;
+  mutable std::chrono::steady_clock::time_point mapping_cached_at_;
+  mutable EntryHandle<ct::SequenceMapping> mapping_;
+  mutable bool has_node_state_;
+  mutable std::chrono::steady_clock::time_point node_state_cached_at_;
+  mutable ct::ClusterNodeState node_state_;
+  // Learnt from the first read of the node state.
+  mutable std::string node_id_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_CACHING_CONSISTENT_STORE_H_
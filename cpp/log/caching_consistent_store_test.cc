@@ -0,0 +1,186 @@
+#include "log/caching_consistent_store.h"
+
+#include <gflags/gflags.h>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include "log/mock_consistent_store.h"
+#include "util/status.h"
+#include "util/status_test_util.h"
+#include "util/statusor.h"
+#include "util/testing.h"
+
+DECLARE_int32(consistent_store_cache_max_staleness_ms);
+
+namespace cert_trans {
+
+using ct::ClusterNodeState;
+using ct::SequenceMapping;
+using testing::_;
+using testing::Invoke;
+using testing::NiceMock;
+using testing::Return;
+using util::Status;
+using util::StatusOr;
+using util::testing::StatusIs;
+
+
+namespace {
+
+
+// Sets the last sequence number of the mapping to |seq|.
+Status SetMapping(int64_t seq, EntryHandle<SequenceMapping>* entry) {
+  entry->MutableEntry()->add_mapping()->set_sequence_number(seq);
+  return ::util::OkStatus();
+}
+
+
+}  // namespace
+
+
+class CachingConsistentStoreTest : public ::testing::Test {
+ public:
+  CachingConsistentStoreTest()
+      : peer_(new NiceMock<MockConsistentStore>()), store_(peer_) {
+  }
+
+ protected:
+  // store_ takes ownership of this:
+  NiceMock<MockConsistentStore>* peer_;
+  CachingConsistentStore store_;
+};
+
+
+TEST_F(CachingConsistentStoreTest, GetSequenceMappingIsCached) {
+  EXPECT_CALL(*peer_, GetSequenceMapping(_))
+      .WillOnce(Invoke([](EntryHandle<SequenceMapping>* entry) {
+        return SetMapping(41, entry);
+      }));
+
+  for (int i = 0; i < 3; ++i) {
+    EntryHandle<SequenceMapping> entry;
+    EXPECT_OK(store_.GetSequenceMapping(&entry));
+    ASSERT_EQ(1, entry.Entry().mapping_size());
+    EXPECT_EQ(41, entry.Entry().mapping(0).sequence_number());
+  }
+  EXPECT_EQ(42, store_.NextAvailableSequenceNumber().ValueOrDie());
+}
+
+
+TEST_F(CachingConsistentStoreTest, InvalidateReadsAgain) {
+  EXPECT_CALL(*peer_, GetSequenceMapping(_))
+      .Times(2)
+      .WillRepeatedly(Invoke([](EntryHandle<SequenceMapping>* entry) {
+        return SetMapping(41, entry);
+      }));
+
+  EntryHandle<SequenceMapping> entry;
+  EXPECT_OK(store_.GetSequenceMapping(&entry));
+  store_.Invalidate();
+  EXPECT_OK(store_.GetSequenceMapping(&entry));
+}
+
+
+TEST_F(CachingConsistentStoreTest, UpdateSequenceMappingWritesThrough) {
+  EXPECT_CALL(*peer_, GetSequenceMapping(_)).Times(0);
+  EXPECT_CALL(*peer_, UpdateSequenceMapping(_))
+      .WillOnce(Return(::util::OkStatus()));
+
+  EntryHandle<SequenceMapping> update;
+  SetMapping(12, &update);
+  EXPECT_OK(store_.UpdateSequenceMapping(&update));
+
+  EntryHandle<SequenceMapping> entry;
+  EXPECT_OK(store_.GetSequenceMapping(&entry));
+  ASSERT_EQ(1, entry.Entry().mapping_size());
+  EXPECT_EQ(12, entry.Entry().mapping(0).sequence_number());
+}
+
+
+TEST_F(CachingConsistentStoreTest, FailedUpdateSequenceMappingInvalidates) {
+  EXPECT_CALL(*peer_, GetSequenceMapping(_))
+      .Times(2)
+      .WillRepeatedly(Invoke([](EntryHandle<SequenceMapping>* entry) {
+        return SetMapping(41, entry);
+      }));
+  EXPECT_CALL(*peer_, UpdateSequenceMapping(_))
+      .WillOnce(Return(Status(util::error::FAILED_PRECONDITION, "stale")));
+
+  EntryHandle<SequenceMapping> entry;
+  EXPECT_OK(store_.GetSequenceMapping(&entry));
+  SetMapping(42, &entry);
+  EXPECT_THAT(store_.UpdateSequenceMapping(&entry),
+              StatusIs(util::error::FAILED_PRECONDITION));
+  EXPECT_OK(store_.GetSequenceMapping(&entry));
+}
+
+
+TEST_F(CachingConsistentStoreTest, ErrorsAreNotCached) {
+  EXPECT_CALL(*peer_, GetSequenceMapping(_))
+      .WillOnce(Return(Status(util::error::UNAVAILABLE, "down")))
+      .WillOnce(Invoke([](EntryHandle<SequenceMapping>* entry) {
+        return SetMapping(41, entry);
+      }));
+
+  EntryHandle<SequenceMapping> entry;
+  EXPECT_THAT(store_.GetSequenceMapping(&entry),
+              StatusIs(util::error::UNAVAILABLE));
+  EXPECT_OK(store_.GetSequenceMapping(&entry));
+}
+
+
+TEST_F(CachingConsistentStoreTest, NextAvailableSequenceNumberFromSTH) {
+  EXPECT_CALL(*peer_, GetSequenceMapping(_))
+      .WillOnce(Return(::util::OkStatus()));
+  ct::SignedTreeHead sth;
+  sth.set_tree_size(1234);
+  EXPECT_CALL(*peer_, GetServingSTH()).WillOnce(Return(sth));
+
+  EXPECT_EQ(1234, store_.NextAvailableSequenceNumber().ValueOrDie());
+}
+
+
+TEST_F(CachingConsistentStoreTest, ClusterNodeStateIsCached) {
+  ClusterNodeState state;
+  state.set_node_id("node1");
+  state.set_hostname("host1");
+  EXPECT_CALL(*peer_, GetClusterNodeState()).WillOnce(Return(state));
+  EXPECT_CALL(*peer_, SetClusterNodeState(_))
+      .WillOnce(Return(::util::OkStatus()));
+
+  EXPECT_EQ("host1", store_.GetClusterNodeState().ValueOrDie().hostname());
+
+  ClusterNodeState new_state;
+  new_state.set_hostname("host2");
+  EXPECT_OK(store_.SetClusterNodeState(new_state));
+
+  const StatusOr<ClusterNodeState> cached(store_.GetClusterNodeState());
+  EXPECT_EQ("node1", cached.ValueOrDie().node_id());
+  EXPECT_EQ("host2", cached.ValueOrDie().hostname());
+}
+
+
+TEST_F(CachingConsistentStoreTest, ZeroStalenessDisablesCache) {
+  const int old_max_staleness_ms(FLAGS_consistent_store_cache_max_staleness_ms);
+  FLAGS_consistent_store_cache_max_staleness_ms = 0;
+  NiceMock<MockConsistentStore>* const peer(
+      new NiceMock<MockConsistentStore>());
+  CachingConsistentStore store(peer);
+  FLAGS_consistent_store_cache_max_staleness_ms = old_max_staleness_ms;
+  EXPECT_CALL(*peer, GetSequenceMapping(_))
+      .Times(2)
+      .WillRepeatedly(Return(::util::OkStatus()));
+
+  EntryHandle<SequenceMapping> entry;
+  EXPECT_OK(store.GetSequenceMapping(&entry));
+  EXPECT_OK(store.GetSequenceMapping(&entry));
+}
+
+
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
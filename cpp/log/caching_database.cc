@@ -0,0 +1,292 @@
+#include "log/caching_database.h"
+
+#include <glog/logging.h>
+#include <functional>
+
+#include "monitoring/counter.h"
+#include "monitoring/monitoring.h"
+
+using std::lock_guard;
+using std::make_shared;
+using std::mutex;
+using std::pair;
+using std::shared_ptr;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+namespace cert_trans {
+namespace {
+
+
+const size_t kNumShards = 16;
+
+
+Counter<string, string>* database_cache_lookups =
+    Counter<string, string>::New("database_cache_lookups", "by", "result",
+                                 "Number of lookups of entries in the "
+                                 "database cache, broken down by index or "
+                                 "hash, and hit or miss.");
+
+
+string IndexKey(int64_t sequence_number) {
+  string key("i");
+  for (int shift = 56; shift >= 0; shift -= 8) {
+    key.push_back(static_cast<char>((sequence_number >> shift) & 0xff));
+  }
+  return key;
+}
+
+
+}  // namespace
+
+
+CachingDatabase::CachingDatabase(ReadOnlyDatabase* db, size_t max_entries)
+    : db_(CHECK_NOTNULL(db)),
+      max_entries_per_shard_((max_entries + kNumShards - 1) / kNumShards),
+      shards_(new Shard[kNumShards]) {
+}
+
+
+ReadOnlyDatabase::LookupResult CachingDatabase::LookupByHash(
+    const string& hash, LoggedEntry* result) const {
+  CHECK_NOTNULL(result);
+  const string key("h" + hash);
+  const shared_ptr<const LoggedEntry> cached(Lookup(key));
+  database_cache_lookups->Increment("hash", cached ? "hit" : "miss");
+  if (cached) {
+    result->CopyFrom(*cached);
+    return LOOKUP_OK;
+  }
+
+  const LookupResult found(db_->LookupByHash(hash, result));
+  if (found == LOOKUP_OK) {
+    InsertFound(key, *result);
+  }
+  return found;
+}
+
+
+ReadOnlyDatabase::LookupResult CachingDatabase::LookupByIndex(
+    int64_t sequence_number, LoggedEntry* result) const {
+  CHECK_NOTNULL(result);
+  const string key(IndexKey(sequence_number));
+  const shared_ptr<const LoggedEntry> cached(Lookup(key));
+  database_cache_lookups->Increment("index", cached ? "hit" : "miss");
+  if (cached) {
+    result->CopyFrom(*cached);
+    return LOOKUP_OK;
+  }
+
+  const LookupResult found(db_->LookupByIndex(sequence_number, result));
+  if (found == LOOKUP_OK) {
+    InsertFound(key, *result);
+  }
+  return found;
+}
+
+
+vector<ReadOnlyDatabase::LookupResult> CachingDatabase::LookupByHashes(
+    const vector<string>& hashes, vector<LoggedEntry>* results) const {
+  vector<string> keys;
+  keys.reserve(hashes.size());
+  for (const string& hash : hashes) {
+    keys.push_back("h" + hash);
+  }
+  return LookupBatch(keys, "hash", results,
+                     [this, &hashes](const vector<size_t>& positions,
+                                     vector<LoggedEntry>* missed) {
+                       vector<string> missed_hashes;
+                       for (const size_t i : positions) {
+                         missed_hashes.push_back(hashes[i]);
+                       }
+                       return db_->LookupByHashes(missed_hashes, missed);
+                     });
+}
+
+
+vector<ReadOnlyDatabase::LookupResult> CachingDatabase::LookupByIndices(
+    const vector<int64_t>& sequence_numbers,
+    vector<LoggedEntry>* results) const {
+  vector<string> keys;
+  keys.reserve(sequence_numbers.size());
+  for (const int64_t sequence_number : sequence_numbers) {
+    keys.push_back(IndexKey(sequence_number));
+  }
+  return LookupBatch(keys, "index", results,
+                     [this, &sequence_numbers](const vector<size_t>& positions,
+                                               vector<LoggedEntry>* missed) {
+                       vector<int64_t> missed_sequence_numbers;
+                       for (const size_t i : positions) {
+                         missed_sequence_numbers.push_back(
+                             sequence_numbers[i]);
+                       }
+                       return db_->LookupByIndices(missed_sequence_numbers,
+                                                   missed);
+                     });
+}
+
+
+ReadOnlyDatabase::LookupResult CachingDatabase::LatestTreeHead(
+    ct::SignedTreeHead* result) const {
+  return db_->LatestTreeHead(result);
+}
+
+
+unique_ptr<ReadOnlyDatabase::Iterator> CachingDatabase::ScanEntries(
+    int64_t start_index) const {
+  return db_->ScanEntries(start_index);
+}
+
+
+int64_t CachingDatabase::TreeSize() const {
+  return db_->TreeSize();
+}
+
+
+vector<pair<int64_t, int64_t>> CachingDatabase::SparseRanges() const {
+  return db_->SparseRanges();
+}
+
+
+void CachingDatabase::AddNotifySTHCallback(
+    const NotifySTHCallback* callback) {
+  db_->AddNotifySTHCallback(callback);
+}
+
+
+void CachingDatabase::RemoveNotifySTHCallback(
+    const NotifySTHCallback* callback) {
+  db_->RemoveNotifySTHCallback(callback);
+}
+
+
+void CachingDatabase::InitializeNode(const string& node_id) {
+  db_->InitializeNode(node_id);
+}
+
+
+ReadOnlyDatabase::LookupResult CachingDatabase::NodeId(string* node_id) {
+  return db_->NodeId(node_id);
+}
+
+
+ReadOnlyDatabase::LookupResult CachingDatabase::LookupTile(
+    int level, int64_t index, string* hashes) const {
+  return db_->LookupTile(level, index, hashes);
+}
+
+
+ReadOnlyDatabase::LookupResult CachingDatabase::LookupFrontier(
+    int64_t tree_size, string* hashes) const {
+  return db_->LookupFrontier(tree_size, hashes);
+}
+
+
+size_t CachingDatabase::Size() const {
+  size_t size(0);
+  for (size_t i = 0; i < kNumShards; ++i) {
+    lock_guard<mutex> lock(shards_[i].lock);
+    size += shards_[i].entries.size();
+  }
+  return size;
+}
+
+
+unique_ptr<ReadOnlyDatabase::Iterator> CachingDatabase::ScanEntries_(
+    int64_t start_index, int64_t end_index, bool fill_cache) const {
+  // The readahead, if any, is done by ScanEntries() around this.
+  ScanOptions options;
+  options.fill_cache = fill_cache;
+  return db_->ScanEntries(start_index, end_index, options);
+}
+
+
+CachingDatabase::Shard* CachingDatabase::ShardFor(const string& key) const {
+  return &shards_[std::hash<string>()(key) % kNumShards];
+}
+
+
+shared_ptr<const LoggedEntry> CachingDatabase::Lookup(
+    const string& key) const {
+  Shard* const shard(ShardFor(key));
+  lock_guard<mutex> lock(shard->lock);
+  const auto it(shard->entries.find(key));
+  if (it == shard->entries.end()) {
+    return nullptr;
+  }
+  shard->lru.splice(shard->lru.begin(), shard->lru, it->second.lru_position);
+  return it->second.entry;
+}
+
+
+vector<ReadOnlyDatabase::LookupResult> CachingDatabase::LookupBatch(
+    const vector<string>& keys, const string& by,
+    vector<LoggedEntry>* results, const LookupMissed& lookup_missed) const {
+  CHECK_NOTNULL(results)->resize(keys.size());
+  vector<LookupResult> found(keys.size(), LOOKUP_OK);
+  vector<size_t> positions;
+  for (size_t i = 0; i < keys.size(); ++i) {
+    const shared_ptr<const LoggedEntry> cached(Lookup(keys[i]));
+    database_cache_lookups->Increment(by, cached ? "hit" : "miss");
+    if (cached) {
+      (*results)[i].CopyFrom(*cached);
+    } else {
+      positions.push_back(i);
+    }
+  }
+  if (positions.empty()) {
+    return found;
+  }
+
+  vector<LoggedEntry> missed;
+  const vector<LookupResult> missed_found(lookup_missed(positions, &missed));
+  CHECK_EQ(positions.size(), missed_found.size());
+  for (size_t j = 0; j < positions.size(); ++j) {
+    const size_t i(positions[j]);
+    found[i] = missed_found[j];
+    if (found[i] == LOOKUP_OK) {
+      InsertFound(keys[i], missed[j]);
+      (*results)[i].Swap(&missed[j]);
+    }
+  }
+  return found;
+}
+
+
+void CachingDatabase::InsertFound(const string& key,
+                                  const LoggedEntry& entry) const {
+  const shared_ptr<const LoggedEntry> cached(
+      make_shared<const LoggedEntry>(entry));
+  Insert(key, cached);
+  // An entry found by hash is also the one at its index.
+  if (key[0] == 'h' && entry.has_sequence_number()) {
+    Insert(IndexKey(entry.sequence_number()), cached);
+  }
+}
+
+
+void CachingDatabase::Insert(const string& key,
+                             const shared_ptr<const LoggedEntry>& entry) const {
+  if (max_entries_per_shard_ == 0) {
+    return;
+  }
+  Shard* const shard(ShardFor(key));
+  lock_guard<mutex> lock(shard->lock);
+  const auto it(shard->entries.find(key));
+  if (it != shard->entries.end()) {
+    shard->lru.splice(shard->lru.begin(), shard->lru, it->second.lru_position);
+    return;
+  }
+  if (shard->entries.size() >= max_entries_per_shard_) {
+    shard->entries.erase(shard->lru.back());
+    shard->lru.pop_back();
+  }
+  shard->lru.push_front(key);
+  CachedEntry* const cached(&shard->entries[key]);
+  cached->entry = entry;
+  cached->lru_position = shard->lru.begin();
+}
+
+
+}  // namespace cert_trans
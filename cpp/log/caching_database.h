@@ -0,0 +1,113 @@
+#ifndef CERT_TRANS_LOG_CACHING_DATABASE_H_
+#define CERT_TRANS_LOG_CACHING_DATABASE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "log/database.h"
+
+namespace cert_trans {
+
+
+// A ReadOnlyDatabase which keeps the entries recently looked up by
+// index or by hash, already parsed, in front of another one of any
+// kind. Logged entries never change, so they never need to be
+// invalidated, and the least recently used are dropped to make room.
+// Lookups which find nothing are not cached, nor are scans.
+//
+// The cache is split into shards with their own lock, so that
+// concurrent lookups rarely wait on each other.
+//
+// This class is thread-safe if |db| is.
+class CachingDatabase : public ReadOnlyDatabase {
+ public:
+  // Does not take ownership of |db|, which must outlive this instance.
+  // Keeps up to (about) |max_entries| lookups; 0 caches nothing.
+  CachingDatabase(ReadOnlyDatabase* db, size_t max_entries);
+  CachingDatabase(const CachingDatabase&) = delete;
+  CachingDatabase& operator=(const CachingDatabase&) = delete;
+
+  LookupResult LookupByHash(const std::string& hash,
+                            LoggedEntry* result) const override;
+  LookupResult LookupByIndex(int64_t sequence_number,
+                             LoggedEntry* result) const override;
+  // These look up the entries which are not cached as one batch.
+  std::vector<LookupResult> LookupByHashes(
+      const std::vector<std::string>& hashes,
+      std::vector<LoggedEntry>* results) const override;
+  std::vector<LookupResult> LookupByIndices(
+      const std::vector<int64_t>& sequence_numbers,
+      std::vector<LoggedEntry>* results) const override;
+
+  // The rest goes straight to |db|.
+  LookupResult LatestTreeHead(ct::SignedTreeHead* result) const override;
+  std::unique_ptr<Iterator> ScanEntries(int64_t start_index) const override;
+  int64_t TreeSize() const override;
+  std::vector<std::pair<int64_t, int64_t>> SparseRanges() const override;
+  void AddNotifySTHCallback(const NotifySTHCallback* callback) override;
+  void RemoveNotifySTHCallback(const NotifySTHCallback* callback) override;
+  void InitializeNode(const std::string& node_id) override;
+  LookupResult NodeId(std::string* node_id) override;
+  LookupResult LookupTile(int level, int64_t index,
+                          std::string* hashes) const override;
+  LookupResult LookupFrontier(int64_t tree_size,
+                              std::string* hashes) const override;
+
+  // Number of cached lookups.
+  size_t Size() const;
+
+ private:
+  typedef std::list<std::string> LruList;
+
+  struct CachedEntry {
+    std::shared_ptr<const LoggedEntry> entry;
+    LruList::iterator lru_position;
+  };
+
+  struct Shard {
+    std::mutex lock;
+    // By "i" and the index, or "h" and the hash.
+    std::unordered_map<std::string, CachedEntry> entries;
+    // The keys of |entries|, most recently used first.
+    LruList lru;
+  };
+
+  std::unique_ptr<Iterator> ScanEntries_(int64_t start_index,
+                                         int64_t end_index,
+                                         bool fill_cache) const override;
+
+  // Looks up the entries at |positions| of a batch in |db_|.
+  typedef std::function<std::vector<LookupResult>(
+      const std::vector<size_t>& positions, std::vector<LoggedEntry>* missed)>
+      LookupMissed;
+
+  // Looks up the batch of |keys| in the cache, and the rest with
+  // |lookup_missed|, counting the lookups as made |by| index or hash.
+  std::vector<LookupResult> LookupBatch(
+      const std::vector<std::string>& keys, const std::string& by,
+      std::vector<LoggedEntry>* results,
+      const LookupMissed& lookup_missed) const;
+  // Caches |entry|, found under |key|.
+  void InsertFound(const std::string& key, const LoggedEntry& entry) const;
+  Shard* ShardFor(const std::string& key) const;
+  std::shared_ptr<const LoggedEntry> Lookup(const std::string& key) const;
+  void Insert(const std::string& key,
+              const std::shared_ptr<const LoggedEntry>& entry) const;
+
+  ReadOnlyDatabase* const db_;
+  const size_t max_entries_per_shard_;
+  const std::unique_ptr<Shard[]> shards_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_CACHING_DATABASE_H_
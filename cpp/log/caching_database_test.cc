@@ -0,0 +1,165 @@
+#include "log/caching_database.h"
+
+#include <gtest/gtest.h>
+#include <string>
+#include <vector>
+
+#include "log/leveldb_db.h"
+#include "log/logged_entry.h"
+#include "log/test_db.h"
+#include "log/test_signer.h"
+#include "util/testing.h"
+
+namespace cert_trans {
+namespace {
+
+using std::string;
+using std::vector;
+
+
+class CachingDatabaseTest : public ::testing::Test {
+ protected:
+  // Adds a new entry to the database, and returns it.
+  LoggedEntry Add() {
+    LoggedEntry entry;
+    test_signer_.CreateUnique(&entry);
+    CHECK_EQ(Database::OK, test_db_.db()->CreateSequencedEntry(entry));
+    return entry;
+  }
+
+  TestDB<LevelDB> test_db_;
+  TestSigner test_signer_;
+};
+
+
+TEST_F(CachingDatabaseTest, LooksUpByIndex) {
+  CachingDatabase db(test_db_.db(), 100);
+  const LoggedEntry entry(Add());
+
+  for (int i = 0; i < 2; ++i) {
+    LoggedEntry lookup;
+    EXPECT_EQ(Database::LOOKUP_OK,
+              db.LookupByIndex(entry.sequence_number(), &lookup));
+    TestSigner::TestEqualLoggedCerts(entry, lookup);
+    EXPECT_EQ(1U, db.Size());
+  }
+}
+
+
+TEST_F(CachingDatabaseTest, LooksUpByHashAndKeepsTheIndex) {
+  CachingDatabase db(test_db_.db(), 100);
+  const LoggedEntry entry(Add());
+
+  LoggedEntry lookup;
+  EXPECT_EQ(Database::LOOKUP_OK, db.LookupByHash(entry.Hash(), &lookup));
+  TestSigner::TestEqualLoggedCerts(entry, lookup);
+  EXPECT_EQ(2U, db.Size());
+
+  lookup.Clear();
+  EXPECT_EQ(Database::LOOKUP_OK,
+            db.LookupByIndex(entry.sequence_number(), &lookup));
+  TestSigner::TestEqualLoggedCerts(entry, lookup);
+  EXPECT_EQ(2U, db.Size());
+}
+
+
+TEST_F(CachingDatabaseTest, LooksUpBatches) {
+  CachingDatabase db(test_db_.db(), 100);
+  const LoggedEntry first(Add());
+  const LoggedEntry second(Add());
+
+  LoggedEntry lookup;
+  ASSERT_EQ(Database::LOOKUP_OK,
+            db.LookupByIndex(first.sequence_number(), &lookup));
+  EXPECT_EQ(1U, db.Size());
+
+  // One cached, one not, and one missing.
+  vector<LoggedEntry> lookups;
+  const vector<Database::LookupResult> found(db.LookupByIndices(
+      {first.sequence_number(), second.sequence_number(), 1000}, &lookups));
+  ASSERT_EQ(3U, found.size());
+  EXPECT_EQ(Database::LOOKUP_OK, found[0]);
+  TestSigner::TestEqualLoggedCerts(first, lookups[0]);
+  EXPECT_EQ(Database::LOOKUP_OK, found[1]);
+  TestSigner::TestEqualLoggedCerts(second, lookups[1]);
+  EXPECT_EQ(Database::NOT_FOUND, found[2]);
+  EXPECT_EQ(2U, db.Size());
+
+  const vector<Database::LookupResult> by_hash(
+      db.LookupByHashes({second.Hash()}, &lookups));
+  ASSERT_EQ(1U, by_hash.size());
+  EXPECT_EQ(Database::LOOKUP_OK, by_hash[0]);
+  TestSigner::TestEqualLoggedCerts(second, lookups[0]);
+  EXPECT_EQ(3U, db.Size());
+}
+
+
+TEST_F(CachingDatabaseTest, DoesNotCacheMissingEntries) {
+  CachingDatabase db(test_db_.db(), 100);
+
+  LoggedEntry lookup;
+  EXPECT_EQ(Database::NOT_FOUND, db.LookupByIndex(0, &lookup));
+  EXPECT_EQ(Database::NOT_FOUND,
+            db.LookupByHash(test_signer_.UniqueHash(), &lookup));
+  EXPECT_EQ(0U, db.Size());
+
+  // And finds them once they are added.
+  const LoggedEntry entry(Add());
+  EXPECT_EQ(Database::LOOKUP_OK,
+            db.LookupByIndex(entry.sequence_number(), &lookup));
+  TestSigner::TestEqualLoggedCerts(entry, lookup);
+}
+
+
+TEST_F(CachingDatabaseTest, KeepsAtMostMaxEntries) {
+  // One per shard.
+  CachingDatabase db(test_db_.db(), 16);
+
+  for (int i = 0; i < 100; ++i) {
+    const LoggedEntry entry(Add());
+    LoggedEntry lookup;
+    ASSERT_EQ(Database::LOOKUP_OK,
+              db.LookupByIndex(entry.sequence_number(), &lookup));
+    TestSigner::TestEqualLoggedCerts(entry, lookup);
+  }
+  EXPECT_GE(16U, db.Size());
+  EXPECT_LT(0U, db.Size());
+}
+
+
+TEST_F(CachingDatabaseTest, ZeroCachesNothing) {
+  CachingDatabase db(test_db_.db(), 0);
+  const LoggedEntry entry(Add());
+
+  LoggedEntry lookup;
+  EXPECT_EQ(Database::LOOKUP_OK, db.LookupByHash(entry.Hash(), &lookup));
+  TestSigner::TestEqualLoggedCerts(entry, lookup);
+  EXPECT_EQ(0U, db.Size());
+}
+
+
+TEST_F(CachingDatabaseTest, ForwardsTheRest) {
+  CachingDatabase db(test_db_.db(), 100);
+  Add();
+  Add();
+
+  EXPECT_EQ(test_db_.db()->TreeSize(), db.TreeSize());
+  int count(0);
+  auto it(db.ScanEntries(0));
+  LoggedEntry entry;
+  while (it->GetNextEntry(&entry)) {
+    EXPECT_EQ(count, entry.sequence_number());
+    ++count;
+  }
+  EXPECT_EQ(2, count);
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
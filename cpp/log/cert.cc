@@ -18,10 +18,13 @@
 #include <time.h>
 #include <algorithm>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
+using std::lock_guard;
 using std::move;
+using std::mutex;
 using std::string;
 using std::to_string;
 using std::unique_ptr;
@@ -213,7 +216,17 @@ unique_ptr<Cert> Cert::Clone() const {
       LOG_OPENSSL_ERRORS(ERROR);
     }
   }
-  return FromX509(move(x509));
+  unique_ptr<Cert> clone(FromX509(move(x509)));
+  if (clone) {
+    lock_guard<mutex> lock(memo_lock_);
+    clone->der_ = der_;
+    clone->sha256_digest_ = sha256_digest_;
+    clone->tbs_der_ = tbs_der_;
+    clone->subject_name_der_ = subject_name_der_;
+    clone->issuer_name_der_ = issuer_name_der_;
+    clone->spki_sha256_digest_ = spki_sha256_digest_;
+  }
+  return clone;
 }
 
 
@@ -225,7 +238,13 @@ unique_ptr<Cert> Cert::FromDerString(const string& der_string) {
     LOG(WARNING) << "Input is not a valid DER-encoded certificate";
     LOG_OPENSSL_ERRORS(WARNING);
   }
-  return FromX509(move(x509));
+  unique_ptr<Cert> cert(FromX509(move(x509)));
+  // Keep the encoding, unless there was trailing data after it.
+  if (cert && start == reinterpret_cast<const unsigned char*>(
+                           der_string.data() + der_string.size())) {
+    cert->der_ = der_string;
+  }
+  return cert;
 }
 
 
@@ -494,7 +513,27 @@ StatusOr<bool> Cert::IsSignedBy(const Cert& issuer) const {
 }
 
 
+bool Cert::GetMemo(const string& memo, string* result) const {
+  lock_guard<mutex> lock(memo_lock_);
+  if (memo.empty()) {
+    return false;
+  }
+  CHECK_NOTNULL(result)->assign(memo);
+  return true;
+}
+
+
+void Cert::SetMemo(string* memo, const string& value) const {
+  lock_guard<mutex> lock(memo_lock_);
+  memo->assign(value);
+}
+
+
 util::Status Cert::DerEncoding(string* result) const {
+  if (GetMemo(der_, result)) {
+    return ::util::OkStatus();
+  }
+
   unsigned char* der_buf(nullptr);
   int der_length = i2d_X509(CHECK_NOTNULL(x509_.get()), &der_buf);
 
@@ -508,6 +547,7 @@ util::Status Cert::DerEncoding(string* result) const {
 
   result->assign(reinterpret_cast<char*>(der_buf), der_length);
   OPENSSL_free(der_buf);
+  SetMemo(&der_, *result);
   return ::util::OkStatus();
 }
 
@@ -532,6 +572,10 @@ util::Status Cert::PemEncoding(string* result) const {
 
 
 util::Status Cert::Sha256Digest(string* result) const {
+  if (GetMemo(sha256_digest_, result)) {
+    return ::util::OkStatus();
+  }
+
   unsigned char digest[EVP_MAX_MD_SIZE];
   unsigned int len;
   if (X509_digest(CHECK_NOTNULL(x509_.get()), EVP_sha256(), digest, &len) !=
@@ -544,11 +588,16 @@ util::Status Cert::Sha256Digest(string* result) const {
   }
 
   result->assign(reinterpret_cast<char*>(digest), len);
+  SetMemo(&sha256_digest_, *result);
   return ::util::OkStatus();
 }
 
 
 util::Status Cert::DerEncodedTbsCertificate(string* result) const {
+  if (GetMemo(tbs_der_, result)) {
+    return ::util::OkStatus();
+  }
+
   unsigned char* der_buf(nullptr);
   int der_length = i2d_re_X509_tbs(CHECK_NOTNULL(x509_.get()), &der_buf);
   if (der_length < 0) {
@@ -560,19 +609,36 @@ util::Status Cert::DerEncodedTbsCertificate(string* result) const {
   }
   result->assign(reinterpret_cast<char*>(der_buf), der_length);
   OPENSSL_free(der_buf);
+  SetMemo(&tbs_der_, *result);
   return ::util::OkStatus();
 }
 
 
 util::Status Cert::DerEncodedSubjectName(string* result) const {
-  return DerEncodedName(X509_get_subject_name(CHECK_NOTNULL(x509_.get())),
-                        result);
+  if (GetMemo(subject_name_der_, result)) {
+    return ::util::OkStatus();
+  }
+
+  const util::Status status(DerEncodedName(
+      X509_get_subject_name(CHECK_NOTNULL(x509_.get())), result));
+  if (status.ok()) {
+    SetMemo(&subject_name_der_, *result);
+  }
+  return status;
 }
 
 
 util::Status Cert::DerEncodedIssuerName(string* result) const {
-  return DerEncodedName(X509_get_issuer_name(CHECK_NOTNULL(x509_.get())),
-                        result);
+  if (GetMemo(issuer_name_der_, result)) {
+    return ::util::OkStatus();
+  }
+
+  const util::Status status(DerEncodedName(
+      X509_get_issuer_name(CHECK_NOTNULL(x509_.get())), result));
+  if (status.ok()) {
+    SetMemo(&issuer_name_der_, *result);
+  }
+  return status;
 }
 
 
@@ -632,10 +698,15 @@ StatusOr<string> Cert::SPKI() const {
 
 
 util::Status Cert::SPKISha256Digest(string* result) const {
+  if (GetMemo(spki_sha256_digest_, result)) {
+    return ::util::OkStatus();
+  }
+
   const util::StatusOr<string> spki(SPKI());
   if (spki.ok()) {
     string sha256_digest = Sha256Hasher::Sha256Digest(spki.ValueOrDie());
     CHECK_NOTNULL(result)->assign(sha256_digest);
+    SetMemo(&spki_sha256_digest_, sha256_digest);
   }
   return spki.status();
 }
@@ -1242,7 +1313,7 @@ util::Status TbsCertificate::CopyIssuerFrom(const Cert& from) {
     return ::util::OkStatus();
   }
 
-  if (!status.ok() || !status.ValueOrDie()) {
+  if (!status.ok()) {
     LOG(ERROR) << "Failed to check Authority Key Identifier extension";
     return util::Status(Code::INTERNAL,
                         "Failed to check Authority KeyID extension (TBS)");
@@ -5,6 +5,7 @@
 #include <openssl/asn1.h>
 #include <openssl/x509.h>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -19,6 +20,10 @@ bool IsRedactedHost(const std::string& hostname);
 // Tests if a hostname containing any redactions follows the RFC rules
 bool IsValidRedactedHost(const std::string& hostname);
 
+// A Cert does not change once created, so its DER encoding, the DER
+// encoding of its TBS certificate and names, and its digests are only
+// computed once, when first asked for. The DER encoding is the one it
+// was parsed from, if it was created with FromDerString().
 class Cert {
  public:
   // The following factory static methods return null if the input is
@@ -209,7 +214,21 @@ class Cert {
   static std::string PrintName(X509_NAME* name);
   static std::string PrintTime(ASN1_TIME* when);
   static util::Status DerEncodedName(X509_NAME* name, std::string* result);
+  // Sets |result| to |memo| and returns true, if it has been computed.
+  bool GetMemo(const std::string& memo, std::string* result) const;
+  // Sets |memo| to |value|, once computed.
+  void SetMemo(std::string* memo, const std::string& value) const;
+
   const ScopedX509 x509_;
+
+  // The values computed so far, empty if not yet.
+  mutable std::mutex memo_lock_;
+  mutable std::string der_;
+  mutable std::string sha256_digest_;
+  mutable std::string tbs_der_;
+  mutable std::string subject_name_der_;
+  mutable std::string issuer_name_der_;
+  mutable std::string spki_sha256_digest_;
 };
 
 // A wrapper around X509_CINF for chopping at the TBS to CT-sign it or verify
@@ -0,0 +1,447 @@
+// Benchmarks for the CPU path of add-chain and add-pre-chain, a step
+// at a time: parsing the certificates, their digests, checking the
+// chains, making the log entries, signing the SCTs and serializing
+// them. Each step goes round the chains of the corpus, and reports
+// how many it gets through a second.
+//
+// The corpus is the test chains by default. A real-world one (e.g.
+// chains fetched with get-entries from a production log, one PEM file
+// per chain, leaf first) can be given with --chain_dir, along with
+// the roots it chains to in --roots. The precertificate chains are
+// told apart by their poison extension. Run with --help for the
+// options of the benchmark library, e.g. --benchmark_filter=<regex>.
+#include <benchmark/benchmark.h>
+#include <dirent.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <openssl/evp.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "log/cert.h"
+#include "log/cert_checker.h"
+#include "log/cert_submission_handler.h"
+#include "log/ct_extensions.h"
+#include "log/log_signer.h"
+#include "proto/cert_serializer.h"
+#include "proto/ct.pb.h"
+#include "proto/serializer.h"
+#include "util/read_key.h"
+#include "util/status.h"
+#include "util/util.h"
+
+DEFINE_string(test_data_dir, "test/testdata",
+              "Directory of the test chains, roots and log key, used "
+              "unless overridden by the other flags.");
+DEFINE_string(chain_dir, "",
+              "If set, directory of PEM chains to use instead of the "
+              "test chains, one per file, leaf first.");
+DEFINE_string(roots, "",
+              "PEM file of the roots the chains are checked against. "
+              "Defaults to the test CA.");
+DEFINE_string(log_key, "",
+              "PEM private key the SCTs are signed with. Defaults to "
+              "the test log key.");
+
+using cert_trans::Cert;
+using cert_trans::CertChain;
+using cert_trans::CertChecker;
+using cert_trans::CertSubmissionHandler;
+using cert_trans::PreCertChain;
+using cert_trans::serialization::SerializeResult;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+namespace {
+
+
+// A chain of the corpus, as DER certificates.
+struct Chain {
+  vector<string> certs;
+};
+
+
+struct Corpus {
+  vector<Chain> chains;
+  vector<Chain> precert_chains;
+  // The entries made of the chains, by the same index.
+  vector<ct::LogEntry> entries;
+  vector<ct::LogEntry> precert_entries;
+  unique_ptr<CertChecker> checker;
+  unique_ptr<CertSubmissionHandler> handler;
+  unique_ptr<LogSigner> signer;
+};
+
+
+Corpus* corpus;
+
+
+// Adds the chain in |pem| to the corpus, and returns false if it is
+// not a valid chain.
+bool AddChain(const string& pem) {
+  const CertChain chain(pem);
+  if (!chain.IsLoaded()) {
+    return false;
+  }
+  Chain der_chain;
+  for (size_t i = 0; i < chain.Length(); ++i) {
+    string der;
+    if (!chain.CertAt(i)->DerEncoding(&der).ok()) {
+      return false;
+    }
+    der_chain.certs.push_back(der);
+  }
+  const util::StatusOr<bool> precert(
+      chain.LeafCert()->HasCriticalExtension(cert_trans::NID_ctPoison));
+  if (!precert.ok()) {
+    return false;
+  }
+  (precert.ValueOrDie() ? corpus->precert_chains : corpus->chains)
+      .push_back(der_chain);
+  return true;
+}
+
+
+string ReadFile(const string& file) {
+  string contents;
+  PCHECK(util::ReadBinaryFile(file, &contents)) << "Cannot read " << file;
+  return contents;
+}
+
+
+void LoadCorpus() {
+  const string data_dir(FLAGS_test_data_dir + "/");
+  if (FLAGS_chain_dir.empty()) {
+    // Without the root, which the checker adds.
+    CHECK(AddChain(ReadFile(data_dir + "test-cert.pem")));
+    CHECK(AddChain(ReadFile(data_dir + "test-intermediate-cert.pem") +
+                   ReadFile(data_dir + "intermediate-cert.pem")));
+    CHECK(AddChain(ReadFile(data_dir + "test-embedded-pre-cert.pem")));
+    CHECK(AddChain(
+        ReadFile(data_dir + "test-embedded-with-preca-pre-cert.pem") +
+        ReadFile(data_dir + "ca-pre-cert.pem")));
+  } else {
+    DIR* const dir(opendir(FLAGS_chain_dir.c_str()));
+    PCHECK(dir) << "Cannot open " << FLAGS_chain_dir;
+    int invalid(0);
+    while (const dirent* const file = readdir(dir)) {
+      if (file->d_name[0] == '.') {
+        continue;
+      }
+      if (!AddChain(ReadFile(FLAGS_chain_dir + "/" + file->d_name))) {
+        ++invalid;
+      }
+    }
+    closedir(dir);
+    LOG_IF(WARNING, invalid > 0) << "Skipped " << invalid
+                                 << " invalid chains.";
+  }
+  LOG(INFO) << "Loaded " << corpus->chains.size() << " chains and "
+            << corpus->precert_chains.size() << " precertificate chains.";
+
+  corpus->checker.reset(new CertChecker);
+  const string roots(FLAGS_roots.empty() ? data_dir + "ca-cert.pem"
+                                         : FLAGS_roots);
+  CHECK(corpus->checker->LoadTrustedCertificates(roots))
+      << "Cannot load the roots in " << roots;
+  corpus->handler.reset(new CertSubmissionHandler(corpus->checker.get()));
+
+  const string key(FLAGS_log_key.empty() ? data_dir + "ct-server-key.pem"
+                                         : FLAGS_log_key);
+  util::StatusOr<EVP_PKEY*> pkey(cert_trans::ReadPrivateKey(key));
+  CHECK_EQ(pkey.status(), ::util::OkStatus()) << "Cannot read " << key;
+  corpus->signer.reset(new LogSigner(pkey.ValueOrDie()));
+}
+
+
+template <class ChainType>
+void MakeChain(const Chain& chain, ChainType* out) {
+  for (const string& der : chain.certs) {
+    CHECK(out->AddCert(Cert::FromDerString(der)));
+  }
+}
+
+
+// Makes the entries of the chains that the roots accept, and drops
+// the others, so that the steps after the check see valid chains
+// only.
+void MakeEntries() {
+  vector<Chain> valid;
+  for (const Chain& chain : corpus->chains) {
+    CertChain cert_chain;
+    MakeChain(chain, &cert_chain);
+    ct::LogEntry entry;
+    if (corpus->handler->ProcessX509Submission(&cert_chain, &entry).ok()) {
+      valid.push_back(chain);
+      corpus->entries.push_back(entry);
+    }
+  }
+  corpus->chains.swap(valid);
+
+  valid.clear();
+  for (const Chain& chain : corpus->precert_chains) {
+    PreCertChain cert_chain;
+    MakeChain(chain, &cert_chain);
+    ct::LogEntry entry;
+    if (corpus->handler->ProcessPreCertSubmission(&cert_chain, &entry)
+            .ok()) {
+      valid.push_back(chain);
+      corpus->precert_entries.push_back(entry);
+    }
+  }
+  corpus->precert_chains.swap(valid);
+  LOG(INFO) << corpus->chains.size() << " chains and "
+            << corpus->precert_chains.size()
+            << " precertificate chains are accepted by the roots.";
+}
+
+
+ct::SignedCertificateTimestamp SignedSCT(const ct::LogEntry& entry) {
+  ct::SignedCertificateTimestamp sct;
+  sct.set_version(ct::V1);
+  sct.set_timestamp(util::TimeInMilliseconds());
+  CHECK_EQ(LogSigner::OK,
+           corpus->signer->SignCertificateTimestamp(entry, &sct));
+  return sct;
+}
+
+
+// Skips the benchmark if there is nothing to run it on.
+bool HasInput(benchmark::State& state, size_t size) {
+  if (size == 0) {
+    state.SkipWithError("No chains in the corpus.");
+    return false;
+  }
+  return true;
+}
+
+
+void BM_CertFromDerString(benchmark::State& state) {
+  const vector<Chain>& chains(corpus->chains);
+  if (!HasInput(state, chains.size())) {
+    return;
+  }
+  size_t i(0);
+  int64_t bytes(0);
+  for (auto _ : state) {
+    const string& der(chains[i++ % chains.size()].certs[0]);
+    const unique_ptr<Cert> cert(Cert::FromDerString(der));
+    CHECK(cert);
+    bytes += der.size();
+  }
+  state.SetItemsProcessed(state.iterations());
+  state.SetBytesProcessed(bytes);
+}
+BENCHMARK(BM_CertFromDerString);
+
+
+void BM_CertSha256Digest(benchmark::State& state) {
+  vector<unique_ptr<Cert>> certs;
+  for (const Chain& chain : corpus->chains) {
+    certs.push_back(Cert::FromDerString(chain.certs[0]));
+  }
+  if (!HasInput(state, certs.size())) {
+    return;
+  }
+  size_t i(0);
+  string digest;
+  for (auto _ : state) {
+    CHECK(certs[i++ % certs.size()]->Sha256Digest(&digest).ok());
+    benchmark::DoNotOptimize(digest.data());
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_CertSha256Digest);
+
+
+void BM_CertPublicKeySha256Digest(benchmark::State& state) {
+  vector<unique_ptr<Cert>> certs;
+  for (const Chain& chain : corpus->chains) {
+    certs.push_back(Cert::FromDerString(chain.certs[0]));
+  }
+  if (!HasInput(state, certs.size())) {
+    return;
+  }
+  size_t i(0);
+  string digest;
+  for (auto _ : state) {
+    CHECK(certs[i++ % certs.size()]->PublicKeySha256Digest(&digest).ok());
+    benchmark::DoNotOptimize(digest.data());
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_CertPublicKeySha256Digest);
+
+
+// The checks change the chains (by adding the root), so each one
+// gets a new chain, made with the timing paused.
+void BM_CheckCertChain(benchmark::State& state) {
+  const vector<Chain>& chains(corpus->chains);
+  if (!HasInput(state, chains.size())) {
+    return;
+  }
+  size_t i(0);
+  for (auto _ : state) {
+    state.PauseTiming();
+    CertChain chain;
+    MakeChain(chains[i++ % chains.size()], &chain);
+    state.ResumeTiming();
+    CHECK(corpus->checker->CheckCertChain(&chain).ok());
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_CheckCertChain);
+
+
+void BM_CheckPreCertChain(benchmark::State& state) {
+  const vector<Chain>& chains(corpus->precert_chains);
+  if (!HasInput(state, chains.size())) {
+    return;
+  }
+  size_t i(0);
+  string issuer_key_hash, tbs_certificate;
+  for (auto _ : state) {
+    state.PauseTiming();
+    PreCertChain chain;
+    MakeChain(chains[i++ % chains.size()], &chain);
+    state.ResumeTiming();
+    CHECK(corpus->checker
+              ->CheckPreCertChain(&chain, &issuer_key_hash, &tbs_certificate)
+              .ok());
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_CheckPreCertChain);
+
+
+// The whole submission, from the DER certificates as the handler gets
+// them to the entry.
+void BM_ProcessX509Submission(benchmark::State& state) {
+  const vector<Chain>& chains(corpus->chains);
+  if (!HasInput(state, chains.size())) {
+    return;
+  }
+  size_t i(0);
+  for (auto _ : state) {
+    CertChain chain;
+    MakeChain(chains[i++ % chains.size()], &chain);
+    ct::LogEntry entry;
+    CHECK(corpus->handler->ProcessX509Submission(&chain, &entry).ok());
+    benchmark::DoNotOptimize(&entry);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ProcessX509Submission);
+
+
+void BM_ProcessPreCertSubmission(benchmark::State& state) {
+  const vector<Chain>& chains(corpus->precert_chains);
+  if (!HasInput(state, chains.size())) {
+    return;
+  }
+  size_t i(0);
+  for (auto _ : state) {
+    PreCertChain chain;
+    MakeChain(chains[i++ % chains.size()], &chain);
+    ct::LogEntry entry;
+    CHECK(corpus->handler->ProcessPreCertSubmission(&chain, &entry).ok());
+    benchmark::DoNotOptimize(&entry);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ProcessPreCertSubmission);
+
+
+// Signing the SCT of a certificate (0) or a precertificate (1) entry.
+void BM_SignCertificateTimestamp(benchmark::State& state) {
+  const vector<ct::LogEntry>& entries(
+      state.range(0) ? corpus->precert_entries : corpus->entries);
+  if (!HasInput(state, entries.size())) {
+    return;
+  }
+  size_t i(0);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(SignedSCT(entries[i++ % entries.size()]));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_SignCertificateTimestamp)->Arg(0)->Arg(1);
+
+
+void BM_SerializeSCTSignatureInput(benchmark::State& state) {
+  const vector<ct::LogEntry>& entries(
+      state.range(0) ? corpus->precert_entries : corpus->entries);
+  if (!HasInput(state, entries.size())) {
+    return;
+  }
+  const ct::SignedCertificateTimestamp sct(SignedSCT(entries[0]));
+  size_t i(0);
+  string out;
+  for (auto _ : state) {
+    CHECK_EQ(SerializeResult::OK,
+             Serializer::SerializeSCTSignatureInput(
+                 sct, entries[i++ % entries.size()], &out));
+    benchmark::DoNotOptimize(out.data());
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_SerializeSCTSignatureInput)->Arg(0)->Arg(1);
+
+
+void BM_SerializeSCTMerkleTreeLeaf(benchmark::State& state) {
+  const vector<ct::LogEntry>& entries(
+      state.range(0) ? corpus->precert_entries : corpus->entries);
+  if (!HasInput(state, entries.size())) {
+    return;
+  }
+  const ct::SignedCertificateTimestamp sct(SignedSCT(entries[0]));
+  size_t i(0);
+  string out;
+  for (auto _ : state) {
+    CHECK_EQ(SerializeResult::OK,
+             Serializer::SerializeSCTMerkleTreeLeaf(
+                 sct, entries[i++ % entries.size()], &out));
+    benchmark::DoNotOptimize(out.data());
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_SerializeSCTMerkleTreeLeaf)->Arg(0)->Arg(1);
+
+
+void BM_SerializeSCT(benchmark::State& state) {
+  if (!HasInput(state, corpus->entries.size())) {
+    return;
+  }
+  const ct::SignedCertificateTimestamp sct(SignedSCT(corpus->entries[0]));
+  string out;
+  for (auto _ : state) {
+    CHECK_EQ(SerializeResult::OK, Serializer::SerializeSCT(sct, &out));
+    benchmark::DoNotOptimize(out.data());
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_SerializeSCT);
+
+
+}  // namespace
+
+
+int main(int argc, char** argv) {
+  benchmark::Initialize(&argc, argv);
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  ConfigureSerializerForV1CT();
+  cert_trans::LoadCtExtensions();
+
+  Corpus the_corpus;
+  corpus = &the_corpus;
+  LoadCorpus();
+  MakeEntries();
+
+  benchmark::RunSpecifiedBenchmarks();
+  return 0;
+}
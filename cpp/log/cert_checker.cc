@@ -1,6 +1,7 @@
 /* -*- indent-tabs-mode: nil -*- */
 #include "log/cert_checker.h"
 
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <openssl/asn1.h>
 #include <openssl/bio.h>
@@ -8,6 +9,7 @@
 #include <openssl/x509.h>
 #include <openssl/x509v3.h>
 #include <string.h>
+#include <algorithm>
 #include <memory>
 #include <string>
 #include <utility>
@@ -15,12 +17,20 @@
 
 #include "log/cert.h"
 #include "log/ct_extensions.h"
+#include "log/root_store.h"
+#include "log/tbs_rewriter.h"
+#include "monitoring/counter.h"
+#include "monitoring/monitoring.h"
 #include "util/openssl_scoped_types.h"
 #include "util/openssl_util.h"  // for LOG_OPENSSL_ERRORS
 #include "util/util.h"
 
+using std::find;
+using std::lock_guard;
+using std::max;
 using std::move;
 using std::multimap;
+using std::mutex;
 using std::pair;
 using std::string;
 using std::unique_ptr;
@@ -30,9 +40,67 @@ using util::Status;
 using util::StatusOr;
 using util::error::Code;
 
+DEFINE_int32(cert_checker_verified_signatures, 100000,
+             "Number of valid certificate signatures remembered by the "
+             "certificate checker, so as not to verify them again. 0 "
+             "disables this.");
+DEFINE_int32(cert_checker_verified_chains, 10000,
+             "Number of valid certificate chains (without their leaf) "
+             "remembered by the certificate checker, so as to only check "
+             "the leaf of a chain ending with one of them. 0 disables "
+             "this.");
+
 namespace cert_trans {
+namespace {
+
+
+Counter<string>* cert_checker_signature_checks =
+    Counter<string>::New("cert_checker_signature_checks", "result",
+                         "Number of certificate signature checks, broken down "
+                         "by whether they were cached or verified.");
+
+Counter<string>* cert_checker_verified_chain_lookups =
+    Counter<string>::New("cert_checker_verified_chain_lookups", "result",
+                         "Number of lookups of the chain above the leaf in "
+                         "the verified chains, broken down by hit or miss.");
+
+
+// Sets |key_id| to the key identifier in the authority key identifier
+// extension of |x509|, if it has one.
+bool GetAuthorityKeyId(X509* x509, string* key_id) {
+  int crit;
+  const ScopedAUTHORITY_KEYID akid(static_cast<AUTHORITY_KEYID*>(
+      X509_get_ext_d2i(x509, NID_authority_key_identifier, &crit, nullptr)));
+  if (!akid) {
+    // Missing or corrupt: either way, we look the issuer up by name.
+    if (crit != -1) {
+      ClearOpenSSLErrors();
+    }
+    return false;
+  }
+  if (!akid->keyid) {
+    return false;
+  }
+  key_id->assign(reinterpret_cast<const char*>(akid->keyid->data),
+                 akid->keyid->length);
+  return true;
+}
+
+
+}  // namespace
+
+
+CertChecker::CertChecker()
+    : trusted_version_(0),
+      max_verified_(max(0, FLAGS_cert_checker_verified_signatures)),
+      max_verified_chains_(max(0, FLAGS_cert_checker_verified_chains)) {
+}
 
 bool CertChecker::LoadTrustedCertificates(const string& cert_file) {
+  if (RootStore::IsRootStore(cert_file)) {
+    return LoadTrustedCertificatesFromStore(cert_file);
+  }
+
   // A read-only BIO.
   ScopedBIO bio_in(BIO_new(BIO_s_file()));
   if (!bio_in) {
@@ -114,16 +182,64 @@ bool CertChecker::LoadTrustedCertificatesFromBIO(BIO* bio_in) {
     return false;
   }
 
-  size_t new_certs = certs_to_add.size();
-  while (!certs_to_add.empty()) {
-    trusted_.insert(move(certs_to_add.back()));
-    certs_to_add.pop_back();
+  AddTrustedCertificates(&certs_to_add);
+  return true;
+}
+
+bool CertChecker::LoadTrustedCertificatesFromStore(const string& store_file) {
+  StatusOr<unique_ptr<RootStore>> store(RootStore::Open(store_file));
+  if (!store.ok()) {
+    LOG(ERROR) << "Failed to open root store: " << store.status();
+    return false;
+  }
+
+  vector<pair<string, unique_ptr<const Cert>>> certs_to_add;
+  for (size_t i = 0; i < store.ValueOrDie()->size(); ++i) {
+    const RootStore::Root root(store.ValueOrDie()->Get(i));
+    unique_ptr<Cert> cert(
+        Cert::FromDerString(string(root.der, root.der_size)));
+    if (!cert) {
+      LOG(ERROR) << "Badly encoded certificate in root store " << store_file;
+      return false;
+    }
+    // The store has no duplicates, but the roots may already be loaded.
+    string subject_name;
+    const StatusOr<bool> is_trusted(IsTrusted(*cert, &subject_name));
+    if (!is_trusted.ok()) {
+      return false;
+    }
+    if (!is_trusted.ValueOrDie()) {
+      certs_to_add.push_back(make_pair(subject_name, move(cert)));
+    }
+  }
+  if (store.ValueOrDie()->size() == 0) {
+    return false;
   }
-  LOG(INFO) << "Added " << new_certs << " new certificate(s) to trusted store";
 
+  AddTrustedCertificates(&certs_to_add);
   return true;
 }
 
+void CertChecker::AddTrustedCertificates(
+    vector<pair<string, unique_ptr<const Cert>>>* certs_to_add) {
+  size_t new_certs = certs_to_add->size();
+  if (new_certs > 0) {
+    ++trusted_version_;
+  }
+  while (!certs_to_add->empty()) {
+    const Cert* const cert(certs_to_add->back().second.get());
+    trusted_.insert(move(certs_to_add->back()));
+    certs_to_add->pop_back();
+
+    string key_id;
+    if (cert->OctetStringExtensionData(NID_subject_key_identifier, &key_id)
+            .ok()) {
+      trusted_by_key_id_.emplace(key_id, cert);
+    }
+  }
+  LOG(INFO) << "Added " << new_certs << " new certificate(s) to trusted store";
+}
+
 Status CertChecker::CheckCertChain(CertChain* chain) const {
   if (!chain || !chain->IsLoaded())
     return Status(util::error::INVALID_ARGUMENT, "invalid certificate chain");
@@ -148,6 +264,29 @@ Status CertChecker::CheckIssuerChain(CertChain* chain) const {
     return Status(util::error::INTERNAL, "failed to trim chain");
   }
 
+  // If the chain above the leaf was found valid before, only the leaf
+  // needs checking.
+  string chain_key;
+  if (max_verified_chains_ > 0 && chain->Length() >= 2 &&
+      VerifiedChainKey(*chain, &chain_key).ok()) {
+    bool found(false);
+    const Cert* trusted_issuer(nullptr);
+    {
+      lock_guard<mutex> lock(verified_lock_);
+      const auto it(verified_chains_.find(chain_key));
+      if (it != verified_chains_.end()) {
+        found = true;
+        trusted_issuer = it->second;
+      }
+    }
+    cert_checker_verified_chain_lookups->Increment(found ? "hit" : "miss");
+    if (found) {
+      return CheckLeafIssuer(chain, trusted_issuer);
+    }
+  } else {
+    chain_key.clear();
+  }
+
   // Note that it is OK to allow a root cert that is not CA:true
   // because we will later check that it is trusted.
   Status status = chain->IsValidCaIssuerChainMaybeLegacyRoot();
@@ -156,12 +295,66 @@ Status CertChecker::CheckIssuerChain(CertChain* chain) const {
     return Status(status.CanonicalCode(), "invalid certificate chain");
   }
 
-  const Status valid_chain(chain->IsValidSignatureChain());
+  const Status valid_chain(CheckSignatureChain(*chain));
   if (!valid_chain.ok()) {
     return valid_chain;
   }
 
-  return GetTrustedCa(chain);
+  const Cert* trusted_issuer;
+  status = GetTrustedCa(chain, &trusted_issuer);
+  if (status.ok() && !chain_key.empty()) {
+    lock_guard<mutex> lock(verified_lock_);
+    if (verified_chains_.emplace(chain_key, trusted_issuer).second) {
+      verified_chains_order_.push_back(chain_key);
+      while (verified_chains_order_.size() > max_verified_chains_) {
+        verified_chains_.erase(verified_chains_order_.front());
+        verified_chains_order_.pop_front();
+      }
+    }
+  }
+
+  return status;
+}
+
+Status CertChecker::VerifiedChainKey(const CertChain& chain,
+                                     string* key) const {
+  key->assign(reinterpret_cast<const char*>(&trusted_version_),
+              sizeof(trusted_version_));
+  for (size_t i = 1; i < chain.Length(); ++i) {
+    string digest;
+    const Status status(chain.CertAt(i)->Sha256Digest(&digest));
+    if (!status.ok()) {
+      return status;
+    }
+    key->append(digest);
+  }
+
+  return ::util::OkStatus();
+}
+
+Status CertChecker::CheckLeafIssuer(CertChain* chain,
+                                    const Cert* trusted_issuer) const {
+  const Cert* const leaf(chain->LeafCert());
+  const Cert* const issuer(chain->CertAt(1));
+
+  // What CertChain::IsValidCaIssuerChainMaybeLegacyRoot() checks of
+  // the leaf: that |issuer| is a CA is known already.
+  const StatusOr<bool> issued_by(leaf->IsIssuedBy(*issuer));
+  if (!issued_by.ok() || !issued_by.ValueOrDie()) {
+    LOG(ERROR) << "Failed to check issuer chain";
+    return Status(util::error::INVALID_ARGUMENT, "invalid certificate chain");
+  }
+
+  const StatusOr<bool> signed_by(IsSignedBy(*leaf, *issuer));
+  if (!signed_by.ok()) {
+    return signed_by.status();
+  }
+  if (!signed_by.ValueOrDie()) {
+    return Status(util::error::INVALID_ARGUMENT, "invalid certificate chain");
+  }
+
+  return trusted_issuer ? AddTrustedCa(chain, *trusted_issuer)
+                        : ::util::OkStatus();
 }
 
 Status CertChecker::CheckPreCertChain(PreCertChain* chain,
@@ -218,24 +411,31 @@ Status CertChecker::CheckPreCertChain(PreCertChain* chain,
     return Status(util::error::INTERNAL, "internal error");
   }
   // A well-formed chain always has a precert.
-  TbsCertificate tbs(*chain->PreCert());
-  if (!tbs.IsLoaded() || !tbs.DeleteExtension(cert_trans::NID_ctPoison).ok()) {
-    return Status(util::error::INTERNAL, "internal error");
-  }
-
   // If the issuing cert is the special Precert Signing Certificate,
   // replace the issuer with the one that will sign the final cert.
-  // Should always succeed as we've already verified that the chain
-  // is well-formed.
-  if (uses_pre_issuer.ValueOrDie() &&
-      !tbs.CopyIssuerFrom(*chain->PrecertIssuingCert()).ok()) {
-    return Status(util::error::INTERNAL, "internal error");
-  }
-
+  const Cert* const issuer_from(
+      uses_pre_issuer.ValueOrDie() ? chain->PrecertIssuingCert() : nullptr);
   string der_tbs;
-  if (!tbs.DerEncoding(&der_tbs).ok()) {
-    return Status(util::error::INTERNAL,
-                  "could not DER-encode tbs certificate");
+  if (!RewriteTbsCertificate(*chain->PreCert(), cert_trans::NID_ctPoison,
+                             issuer_from, &der_tbs)
+           .ok()) {
+    // Go through OpenSSL instead.
+    TbsCertificate tbs(*chain->PreCert());
+    if (!tbs.IsLoaded() ||
+        !tbs.DeleteExtension(cert_trans::NID_ctPoison).ok()) {
+      return Status(util::error::INTERNAL, "internal error");
+    }
+
+    // Should always succeed as we've already verified that the chain
+    // is well-formed.
+    if (issuer_from && !tbs.CopyIssuerFrom(*issuer_from).ok()) {
+      return Status(util::error::INTERNAL, "internal error");
+    }
+
+    if (!tbs.DerEncoding(&der_tbs).ok()) {
+      return Status(util::error::INTERNAL,
+                    "could not DER-encode tbs certificate");
+    }
   }
 
   issuer_key_hash->assign(key_hash);
@@ -243,7 +443,9 @@ Status CertChecker::CheckPreCertChain(PreCertChain* chain,
   return ::util::OkStatus();
 }
 
-Status CertChecker::GetTrustedCa(CertChain* chain) const {
+Status CertChecker::GetTrustedCa(CertChain* chain,
+                                 const Cert** trusted_issuer) const {
+  *trusted_issuer = nullptr;
   const Cert* subject = chain->LastCert();
   if (!subject) {
     LOG(ERROR) << "Chain has no valid certs";
@@ -279,14 +481,34 @@ Status CertChecker::GetTrustedCa(CertChain* chain) const {
                   "untrusted self-signed certificate");
   }
 
+  // Try the trusted certificates with the key identifier given by the
+  // authority key identifier of |subject| first, as one of them is
+  // almost always the issuer, then the others with the right name.
+  vector<const Cert*> candidates;
+  string key_id;
+  if (GetAuthorityKeyId(subject->x509_.get(), &key_id)) {
+    const auto key_id_range(trusted_by_key_id_.equal_range(key_id));
+    for (auto it = key_id_range.first; it != key_id_range.second; ++it) {
+      string cand_name;
+      if (it->second->DerEncodedSubjectName(&cand_name).ok() &&
+          cand_name == issuer_name) {
+        candidates.push_back(it->second);
+      }
+    }
+  }
   const auto issuer_range(trusted_.equal_range(issuer_name));
-  const Cert* issuer(nullptr);
   for (multimap<string, unique_ptr<const Cert>>::const_iterator it =
            issuer_range.first;
        it != issuer_range.second; ++it) {
-    const unique_ptr<const Cert>& issuer_cand(it->second);
+    if (find(candidates.begin(), candidates.end(), it->second.get()) ==
+        candidates.end()) {
+      candidates.push_back(it->second.get());
+    }
+  }
 
-    StatusOr<bool> signed_by_issuer = subject->IsSignedBy(*issuer_cand);
+  const Cert* issuer(nullptr);
+  for (const Cert* issuer_cand : candidates) {
+    StatusOr<bool> signed_by_issuer = IsSignedBy(*subject, *issuer_cand);
     if (signed_by_issuer.status().CanonicalCode() == Code::UNIMPLEMENTED) {
       // If the cert's algorithm is unsupported, then there's no point
       // continuing: it's unconditionally invalid.
@@ -299,7 +521,7 @@ Status CertChecker::GetTrustedCa(CertChain* chain) const {
                     "failed to check signature for trusted root");
     }
     if (signed_by_issuer.ValueOrDie()) {
-      issuer = issuer_cand.get();
+      issuer = issuer_cand;
       break;
     }
   }
@@ -308,10 +530,19 @@ Status CertChecker::GetTrustedCa(CertChain* chain) const {
     return Status(util::error::FAILED_PRECONDITION, "unknown root");
   }
 
+  const Status added(AddTrustedCa(chain, *issuer));
+  if (added.ok()) {
+    *trusted_issuer = issuer;
+  }
+  return added;
+}
+
+Status CertChecker::AddTrustedCa(CertChain* chain,
+                                 const Cert& trusted_issuer) const {
   // Clone creates a new Cert but AddCert takes ownership even if Clone
   // failed and the cert can't be added, so we don't have to explicitly
   // check for IsLoaded here.
-  if (!chain->AddCert(issuer->Clone())) {
+  if (!chain->AddCert(trusted_issuer.Clone())) {
     LOG(ERROR) << "Failed to add trusted root to chain";
     return Status(util::error::INTERNAL,
                   "failed to add trusted root to chain");
@@ -320,6 +551,68 @@ Status CertChecker::GetTrustedCa(CertChain* chain) const {
   return ::util::OkStatus();
 }
 
+Status CertChecker::CheckSignatureChain(const CertChain& chain) const {
+  if (!chain.IsLoaded()) {
+    LOG(ERROR) << "Chain is not loaded";
+    return Status(util::error::FAILED_PRECONDITION,
+                  "certificate chain is not loaded");
+  }
+
+  for (size_t i = 0; i + 1 < chain.Length(); ++i) {
+    const StatusOr<bool> status(
+        IsSignedBy(*chain.CertAt(i), *chain.CertAt(i + 1)));
+
+    // As in CertChain::IsValidSignatureChain(), propagate any failure,
+    // including UNIMPLEMENTED for unsupported algorithms.
+    if (!status.ok()) {
+      return status.status();
+    }
+
+    if (!status.ValueOrDie()) {
+      return Status(util::error::INVALID_ARGUMENT,
+                    "invalid certificate chain");
+    }
+  }
+
+  return ::util::OkStatus();
+}
+
+StatusOr<bool> CertChecker::IsSignedBy(const Cert& subject,
+                                       const Cert& issuer) const {
+  // The digest of |subject| covers its signature, not just its TBS
+  // certificate, so that a copy with a bad signature does not match.
+  string key;
+  if (max_verified_ > 0) {
+    string subject_digest;
+    if (issuer.Sha256Digest(&key).ok() &&
+        subject.Sha256Digest(&subject_digest).ok()) {
+      key.append(subject_digest);
+      lock_guard<mutex> lock(verified_lock_);
+      if (verified_.count(key) > 0) {
+        cert_checker_signature_checks->Increment("cached");
+        return true;
+      }
+    } else {
+      key.clear();
+    }
+  }
+
+  cert_checker_signature_checks->Increment("verified");
+  const StatusOr<bool> signed_by(subject.IsSignedBy(issuer));
+  if (!key.empty() && signed_by.ok() && signed_by.ValueOrDie()) {
+    lock_guard<mutex> lock(verified_lock_);
+    if (verified_.insert(key).second) {
+      verified_order_.push_back(key);
+      while (verified_order_.size() > max_verified_) {
+        verified_.erase(verified_order_.front());
+        verified_order_.pop_front();
+      }
+    }
+  }
+
+  return signed_by;
+}
+
 StatusOr<bool> CertChecker::IsTrusted(const Cert& cert,
                                       string* subject_name) const {
   string cert_name;
@@ -4,10 +4,15 @@
 #include <openssl/pem.h>
 #include <openssl/x509.h>
 #include <openssl/x509v3.h>
+#include <stdint.h>
 
+#include <deque>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include "log/cert.h"
@@ -28,14 +33,21 @@ class PreCertChain;
 // want to check that submissions chain to a whitelisted CA, so that
 // (1) we know where a cert is coming from; and
 // (2) we get some spam protection.
+//
+// Signatures found to be valid are remembered (up to
+// --cert_checker_verified_signatures of them), so that chains through
+// the same intermediates and roots are not verified over and over. So
+// are the valid chains without their leaf (up to
+// --cert_checker_verified_chains of them), so that only the link from
+// the leaf to its issuer needs checking when one of them comes again.
 class CertChecker {
  public:
-  CertChecker() = default;
+  CertChecker();
   virtual ~CertChecker() = default;
   CertChecker(const CertChecker&) = delete;
   CertChecker& operator=(const CertChecker&) = delete;
 
-  // Load a file of concatenated PEM-certs.
+  // Load a file of concatenated PEM-certs, or a RootStore.
   // Returns true if at least one certificate was successfully loaded, and no
   // errors were encountered. Returns false otherwise (and will not load any
   // certificates from this file).
@@ -84,8 +96,36 @@ class CertChecker {
  private:
   util::Status CheckIssuerChain(CertChain* chain) const;
 
-  // Look issuer up from the trusted store, and verify signature.
-  util::Status GetTrustedCa(CertChain* chain) const;
+  // Sets |key| to the key of the chain formed by the certificates of
+  // |chain| after its leaf in |verified_chains_|.
+  util::Status VerifiedChainKey(const CertChain& chain,
+                                std::string* key) const;
+
+  // Checks that the leaf of |chain| is issued by the next certificate,
+  // the rest of the chain being known to be valid, and adds
+  // |trusted_issuer| to it, if not NULL.
+  util::Status CheckLeafIssuer(CertChain* chain,
+                               const Cert* trusted_issuer) const;
+
+  // Checks that each certificate in |chain| is signed by the next one,
+  // as CertChain::IsValidSignatureChain() does, but using IsSignedBy()
+  // below.
+  util::Status CheckSignatureChain(const CertChain& chain) const;
+
+  // As Cert::IsSignedBy(), but answers from |verified_| if the
+  // signature was verified before, and adds it there if it is valid.
+  util::StatusOr<bool> IsSignedBy(const Cert& subject,
+                                  const Cert& issuer) const;
+
+  // Look issuer up from the trusted store, and verify signature. Sets
+  // |trusted_issuer| to the certificate added to the chain, or NULL if
+  // the last certificate is itself trusted.
+  util::Status GetTrustedCa(CertChain* chain,
+                            const Cert** trusted_issuer) const;
+
+  // Adds a copy of |trusted_issuer| to |chain|.
+  util::Status AddTrustedCa(CertChain* chain,
+                            const Cert& trusted_issuer) const;
 
   // Returns true if the cert is trusted, false if it's not,
   // INVALID_ARGUMENT if something is wrong with the cert, and
@@ -97,10 +137,39 @@ class CertChecker {
   // All code manipulating this container must ensure contained elements are
   // deallocated appropriately.
   std::multimap<std::string, std::unique_ptr<const Cert>> trusted_;
+  // Changes whenever certificates are added to |trusted_|.
+  int64_t trusted_version_;
+
+  // The certificates of |trusted_| which have a subject key identifier,
+  // by that identifier, so that the issuer of a certificate can be
+  // found from its authority key identifier.
+  std::unordered_multimap<std::string, const Cert*> trusted_by_key_id_;
+
+  // The signatures known to be valid, keyed by the SHA256 digests of
+  // the issuer and of the signed certificate (signature included), and
+  // in the order they were added, for eviction.
+  const size_t max_verified_;
+  mutable std::mutex verified_lock_;
+  mutable std::unordered_set<std::string> verified_;
+  mutable std::deque<std::string> verified_order_;
+
+  // The chains without their leaf known to be valid, keyed by the
+  // version of the trusted store and the SHA256 digests of their
+  // certificates, with the trusted certificate added to them (or NULL
+  // if the last one is trusted), and in the order they were added.
+  const size_t max_verified_chains_;
+  mutable std::unordered_map<std::string, const Cert*> verified_chains_;
+  mutable std::deque<std::string> verified_chains_order_;
 
   // Helper for LoadTrustedCertificates, whether reading from file or memory.
   // Takes ownership of bio_in and frees it.
   bool LoadTrustedCertificatesFromBIO(BIO* bio_in);
+  // As above, for a RootStore.
+  bool LoadTrustedCertificatesFromStore(const std::string& store_file);
+  // Adds the certificates of |certs_to_add|, by subject name.
+  void AddTrustedCertificates(
+      std::vector<std::pair<std::string, std::unique_ptr<const Cert>>>*
+          certs_to_add);
 };
 
 }  // namespace cert_trans
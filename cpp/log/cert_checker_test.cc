@@ -602,6 +602,46 @@ TEST_F(CertCheckerTest, ResolveIssuerCollisions) {
   EXPECT_OK(checker_.CheckCertChain(&chain2));
 }
 
+TEST_F(CertCheckerTest, RemembersValidSignatures) {
+  EXPECT_TRUE(checker_.LoadTrustedCertificates(cert_dir_ + "/" + kCaCert));
+  for (int i = 0; i < 2; ++i) {
+    CertChain chain(chain_leaf_pem_ + intermediate_pem_);
+    ASSERT_TRUE(chain.IsLoaded());
+    EXPECT_OK(checker_.CheckCertChain(&chain));
+    EXPECT_EQ(3U, chain.Length());
+  }
+
+  // A remembered signature does not vouch for another copy of the
+  // certificate with a different signature.
+  vector<string> roots;
+  roots.push_back(kDsaPrecertChainRootOnly);
+  checker_.LoadTrustedCertificates(roots);
+  string issuer_key_hash, tbs;
+  PreCertChain pre_chain(kDsaPrecertChain);
+  EXPECT_OK(checker_.CheckPreCertChain(&pre_chain, &issuer_key_hash, &tbs));
+  PreCertChain invalid_chain(kDsaPrecertChainInvalidSig);
+  EXPECT_THAT(
+      checker_.CheckPreCertChain(&invalid_chain, &issuer_key_hash, &tbs),
+      StatusIs(util::error::INVALID_ARGUMENT, "invalid certificate chain"));
+}
+
+TEST_F(CertCheckerTest, RemembersValidChains) {
+  EXPECT_TRUE(checker_.LoadTrustedCertificates(cert_dir_ + "/" + kCaCert));
+  for (int i = 0; i < 2; ++i) {
+    CertChain chain(chain_leaf_pem_ + intermediate_pem_);
+    ASSERT_TRUE(chain.IsLoaded());
+    EXPECT_OK(checker_.CheckCertChain(&chain));
+    ASSERT_EQ(3U, chain.Length());
+    EXPECT_TRUE(chain.LastCert()->IsIdenticalTo(*Cert::FromPemString(ca_pem_)));
+  }
+
+  // The leaf is still checked against the remembered chain.
+  CertChain invalid(leaf_pem_ + intermediate_pem_);
+  ASSERT_TRUE(invalid.IsLoaded());
+  EXPECT_THAT(checker_.CheckCertChain(&invalid),
+              StatusIs(util::error::INVALID_ARGUMENT));
+}
+
 TEST_F(CertCheckerTest, TestDsaPrecertFailsRootNotTrusted) {
   // Load CA certs.
   EXPECT_TRUE(checker_.LoadTrustedCertificates(cert_dir_ + "/" + kCaCert));
@@ -6,6 +6,7 @@
 #include "log/cert.h"
 #include "log/cert_checker.h"
 #include "log/ct_extensions.h"
+#include "log/tbs_rewriter.h"
 #include "proto/ct.pb.h"
 #include "proto/serializer.h"
 
@@ -26,6 +27,13 @@ namespace {
 
 
 bool SerializedTbs(const Cert& cert, string* result) {
+  if (RewriteTbsCertificate(
+          cert, cert_trans::NID_ctEmbeddedSignedCertificateTimestampList,
+          nullptr, result)
+          .ok()) {
+    return true;
+  }
+
   const StatusOr<bool> has_embedded_proof = cert.HasExtension(
       cert_trans::NID_ctEmbeddedSignedCertificateTimestampList);
   if (!has_embedded_proof.ok()) {
@@ -529,6 +529,28 @@ TEST_F(CertTest, SPKISha256Digest) {
             util::ToBase64(digest));
 }
 
+TEST_F(CertTest, MemoizedValues) {
+  string digest, digest2, der, der2;
+  ASSERT_OK(leaf_cert_->Sha256Digest(&digest));
+  ASSERT_OK(leaf_cert_->Sha256Digest(&digest2));
+  EXPECT_EQ(digest, digest2);
+  ASSERT_OK(leaf_cert_->DerEncoding(&der));
+  EXPECT_EQ(Sha256Hasher::Sha256Digest(der), digest);
+
+  const unique_ptr<Cert> clone(leaf_cert_->Clone());
+  ASSERT_TRUE(clone.get());
+  ASSERT_OK(clone->Sha256Digest(&digest2));
+  EXPECT_EQ(digest, digest2);
+
+  // The encoding parsed is kept, but not trailing data.
+  const unique_ptr<Cert> from_der(Cert::FromDerString(der + "trailing"));
+  ASSERT_TRUE(from_der.get());
+  ASSERT_OK(from_der->DerEncoding(&der2));
+  EXPECT_EQ(der, der2);
+  ASSERT_OK(from_der->Sha256Digest(&digest2));
+  EXPECT_EQ(digest, digest2);
+}
+
 TEST_F(CertTest, TestIsRedactedHost) {
   EXPECT_FALSE(cert_trans::IsRedactedHost(""));
   EXPECT_FALSE(cert_trans::IsRedactedHost("example.com"));
@@ -0,0 +1,115 @@
+#include "log/chain_cert_store.h"
+
+#include <glog/logging.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <mutex>
+
+#include "merkletree/serial_hasher.h"
+#include "util/util.h"
+
+using std::string;
+using std::to_string;
+using std::unique_lock;
+
+namespace cert_trans {
+namespace {
+
+
+// The certificates are stored in the order they were first seen, so
+// that they can be read back without scanning the metadata.
+const char kCertCountKey[] = "chain_certs";
+const char kCertKeyPrefix[] = "chain_cert_";
+
+
+string CertKey(size_t index) {
+  return kCertKeyPrefix + to_string(index);
+}
+
+
+}  // namespace
+
+
+ChainCertStore::ChainCertStore(const MetadataReader& read,
+                               const MetadataWriter& write)
+    : write_(write) {
+  string count_str;
+  if (!read(kCertCountKey, &count_str)) {
+    return;
+  }
+  const size_t count(strtoull(count_str.c_str(), nullptr, 10));
+  certs_.reserve(count);
+  for (size_t i = 0; i < count; ++i) {
+    string cert;
+    CHECK(read(CertKey(i), &cert)) << "missing chain certificate " << i;
+    const string sha256(Sha256Hasher::Sha256Digest(cert));
+    certs_.emplace(sha256, std::move(cert));
+  }
+  LOG(INFO) << "Loaded " << certs_.size() << " chain certificates";
+}
+
+
+void ChainCertStore::Deduplicate(LoggedEntry* entry) {
+  CHECK_NOTNULL(entry)->ReplaceChainWithHashes(
+      [this](const string& sha256, const string& cert) {
+        Add(sha256, cert);
+      });
+}
+
+
+util::Status ChainCertStore::Restore(LoggedEntry* entry) const {
+  CHECK_NOTNULL(entry);
+  if (!entry->has_chain_hashes()) {
+    return ::util::OkStatus();
+  }
+
+  string missing;
+  ReaderLock lock(&lock_);
+  const bool restored(
+      entry->RestoreChain([this, &missing](const string& sha256,
+                                           string* cert) {
+        const auto it(certs_.find(sha256));
+        if (it == certs_.end()) {
+          missing = sha256;
+          return false;
+        }
+        *cert = it->second;
+        return true;
+      }));
+  if (!restored) {
+    return util::Status(util::error::NOT_FOUND,
+                        "missing chain certificate " +
+                            util::HexString(missing));
+  }
+  return ::util::OkStatus();
+}
+
+
+size_t ChainCertStore::size() const {
+  ReaderLock lock(&lock_);
+  return certs_.size();
+}
+
+
+void ChainCertStore::Add(const string& sha256, const string& cert) {
+  {
+    ReaderLock lock(&lock_);
+    if (certs_.find(sha256) != certs_.end()) {
+      return;
+    }
+  }
+
+  unique_lock<ReadWriteMutex> lock(lock_);
+  if (certs_.find(sha256) != certs_.end()) {
+    return;
+  }
+  // The certificate has to be stored before the count that covers it,
+  // and both before the entries that refer to it.
+  const size_t index(certs_.size());
+  write_(CertKey(index), cert);
+  write_(kCertCountKey, to_string(index + 1));
+  certs_.emplace(sha256, cert);
+}
+
+
+}  // namespace cert_trans
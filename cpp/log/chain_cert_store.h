@@ -0,0 +1,65 @@
+#ifndef CERT_TRANS_LOG_CHAIN_CERT_STORE_H_
+#define CERT_TRANS_LOG_CHAIN_CERT_STORE_H_
+
+#include <stddef.h>
+#include <functional>
+#include <string>
+#include <unordered_map>
+
+#include "base/read_write_mutex.h"
+#include "log/logged_entry.h"
+#include "util/status.h"
+
+namespace cert_trans {
+
+
+// Stores the certificates of the chains of the entries of a database
+// once each, keyed by SHA-256, so that the entries only hold their
+// hashes (see LoggedEntry::ReplaceChainWithHashes()). The same few
+// hundred intermediates and roots are in the chains of nearly all the
+// entries of a log.
+//
+// The certificates are kept in the metadata of the database, and all
+// of them in memory, so that restoring a chain does not read anything.
+//
+// This is thread-safe. The writes to the metadata are made with the
+// lock of the store held, so they must not wait for readers of the
+// store.
+class ChainCertStore {
+ public:
+  // Reads the metadata stored under |key|, returning false if there is
+  // none.
+  typedef std::function<bool(const std::string& key, std::string* value)>
+      MetadataReader;
+  typedef std::function<void(const std::string& key,
+                             const std::string& value)> MetadataWriter;
+
+  // Loads the certificates stored in the metadata.
+  ChainCertStore(const MetadataReader& read, const MetadataWriter& write);
+  ChainCertStore(const ChainCertStore&) = delete;
+  ChainCertStore& operator=(const ChainCertStore&) = delete;
+
+  // Replaces the chain of |entry| with the hashes of its certificates,
+  // storing the certificates that are not stored yet.
+  void Deduplicate(LoggedEntry* entry);
+
+  // Puts the chain of |entry| back, if it was replaced.
+  util::Status Restore(LoggedEntry* entry) const;
+
+  size_t size() const;
+
+ private:
+  // Stores |cert| if it is not stored yet.
+  void Add(const std::string& sha256, const std::string& cert);
+
+  const MetadataWriter write_;
+
+  mutable ReadWriteMutex lock_;
+  // By SHA-256.
+  std::unordered_map<std::string, std::string> certs_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_CHAIN_CERT_STORE_H_
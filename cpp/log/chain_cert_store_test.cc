@@ -0,0 +1,170 @@
+#include "log/chain_cert_store.h"
+
+#include <gtest/gtest.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "log/logged_entry.h"
+#include "log/test_signer.h"
+#include "util/status_test_util.h"
+#include "util/testing.h"
+
+namespace cert_trans {
+namespace {
+
+using std::map;
+using std::string;
+using std::vector;
+using util::testing::StatusIs;
+
+
+class ChainCertStoreTest : public ::testing::Test {
+ protected:
+  ChainCertStoreTest()
+      : read_([this](const string& key, string* value) {
+          const auto it(metadata_.find(key));
+          if (it == metadata_.end()) {
+            return false;
+          }
+          *value = it->second;
+          return true;
+        }),
+        write_([this](const string& key, const string& value) {
+          metadata_[key] = value;
+          ++writes_;
+        }),
+        writes_(0) {
+  }
+
+  // An X.509 entry with |chain_|.
+  void CreateEntry(LoggedEntry* entry) {
+    if (chain_.empty()) {
+      chain_.push_back(test_signer_.UniqueFakeCertBytestring());
+      chain_.push_back(test_signer_.UniqueFakeCertBytestring());
+    }
+    test_signer_.CreateUnique(entry);
+    ct::LogEntry* const log_entry(entry->mutable_entry());
+    log_entry->set_type(ct::X509_ENTRY);
+    log_entry->clear_precert_entry();
+    log_entry->mutable_x509_entry()->set_leaf_certificate(
+        test_signer_.UniqueFakeCertBytestring());
+    log_entry->mutable_x509_entry()->clear_certificate_chain();
+    for (const string& cert : chain_) {
+      log_entry->mutable_x509_entry()->add_certificate_chain(cert);
+    }
+  }
+
+  TestSigner test_signer_;
+  vector<string> chain_;
+  map<string, string> metadata_;
+  const ChainCertStore::MetadataReader read_;
+  const ChainCertStore::MetadataWriter write_;
+  int writes_;
+};
+
+
+TEST_F(ChainCertStoreTest, DeduplicateAndRestore) {
+  ChainCertStore store(read_, write_);
+  LoggedEntry entry, original;
+  CreateEntry(&entry);
+  original.CopyFrom(entry);
+
+  store.Deduplicate(&entry);
+  EXPECT_TRUE(entry.has_chain_hashes());
+  EXPECT_EQ(0, entry.entry().x509_entry().certificate_chain_size());
+  EXPECT_EQ(original.Hash(), entry.Hash());
+  EXPECT_EQ(2U, store.size());
+
+  EXPECT_OK(store.Restore(&entry));
+  EXPECT_FALSE(entry.has_chain_hashes());
+  EXPECT_TRUE(entry == original);
+}
+
+
+TEST_F(ChainCertStoreTest, StoresEachCertificateOnce) {
+  ChainCertStore store(read_, write_);
+  for (int i = 0; i < 10; ++i) {
+    LoggedEntry entry;
+    CreateEntry(&entry);
+    store.Deduplicate(&entry);
+  }
+  EXPECT_EQ(2U, store.size());
+  // Each certificate, then the count.
+  EXPECT_EQ(4, writes_);
+}
+
+
+TEST_F(ChainCertStoreTest, Reload) {
+  LoggedEntry entry, original;
+  CreateEntry(&entry);
+  original.CopyFrom(entry);
+  {
+    ChainCertStore store(read_, write_);
+    store.Deduplicate(&entry);
+  }
+
+  const ChainCertStore store(read_, write_);
+  EXPECT_EQ(2U, store.size());
+  EXPECT_OK(store.Restore(&entry));
+  EXPECT_TRUE(entry == original);
+}
+
+
+TEST_F(ChainCertStoreTest, MissingCertificate) {
+  LoggedEntry entry;
+  CreateEntry(&entry);
+  {
+    ChainCertStore store(read_, write_);
+    store.Deduplicate(&entry);
+  }
+
+  metadata_.clear();
+  const ChainCertStore store(read_, write_);
+  EXPECT_THAT(store.Restore(&entry), StatusIs(util::error::NOT_FOUND));
+}
+
+
+TEST_F(ChainCertStoreTest, KeepsServedEncodings) {
+  ChainCertStore store(read_, write_);
+  LoggedEntry entry;
+  CreateEntry(&entry);
+  ASSERT_TRUE(entry.StoreSerialized());
+  string leaf_input, extra_data;
+  ASSERT_TRUE(entry.SerializeForServing(&leaf_input, &extra_data, nullptr));
+
+  store.Deduplicate(&entry);
+  EXPECT_TRUE(entry.has_serialized());
+  EXPECT_FALSE(entry.contents().serialized().has_extra_data());
+  EXPECT_OK(store.Restore(&entry));
+  string restored_leaf_input, restored_extra_data;
+  EXPECT_TRUE(entry.SerializeForServing(&restored_leaf_input,
+                                        &restored_extra_data, nullptr));
+  EXPECT_EQ(leaf_input, restored_leaf_input);
+  EXPECT_EQ(extra_data, restored_extra_data);
+}
+
+
+TEST_F(ChainCertStoreTest, NoChain) {
+  ChainCertStore store(read_, write_);
+  LoggedEntry entry, original;
+  CreateEntry(&entry);
+  entry.mutable_entry()->mutable_x509_entry()->clear_certificate_chain();
+  original.CopyFrom(entry);
+
+  store.Deduplicate(&entry);
+  EXPECT_FALSE(entry.has_chain_hashes());
+  EXPECT_EQ(0U, store.size());
+  EXPECT_OK(store.Restore(&entry));
+  EXPECT_TRUE(entry == original);
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
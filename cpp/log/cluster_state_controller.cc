@@ -1,6 +1,8 @@
 #include "log/cluster_state_controller.h"
 
+#include <gflags/gflags.h>
 #include <stdint.h>
+#include <algorithm>
 #include <functional>
 
 #include "fetcher/peer.h"
@@ -13,6 +15,8 @@ using ct::ClusterConfig;
 using ct::ClusterNodeState;
 using ct::SignedTreeHead;
 using std::bind;
+using std::chrono::seconds;
+using std::chrono::steady_clock;
 using std::lock_guard;
 using std::make_pair;
 using std::make_shared;
@@ -30,6 +34,8 @@ using util::Executor;
 using util::Status;
 using util::StatusOr;
 
+DECLARE_int32(node_state_ttl_seconds);
+
 namespace cert_trans {
 namespace {
 
@@ -183,6 +189,7 @@ void ClusterStateController::NewTreeHead(const SignedTreeHead& sth) {
     // we're able to serve it.
     CHECK_EQ(Database::OK, database_->WriteTreeHead(sth_to_write));
   }
+  NotifyStalenessChanged();
 }
 
 
@@ -214,6 +221,13 @@ void ClusterStateController::SetNodeHostPort(const string& host,
 
 void ClusterStateController::RefreshNodeState() {
   unique_lock<mutex> lock(mutex_);
+  // This only needs to keep our node state from expiring, and NewTreeHead()
+  // already pushes it out on every signing run.
+  if (steady_clock::now() - last_pushed_ <
+      seconds(FLAGS_node_state_ttl_seconds) / 4) {
+    VLOG(1) << "Node state was pushed recently, not refreshing.";
+    return;
+  }
   PushLocalNodeState(lock);
 }
 
@@ -227,6 +241,38 @@ bool ClusterStateController::NodeIsStale() const {
 }
 
 
+int64_t ClusterStateController::NodeLag() const {
+  lock_guard<mutex> lock(mutex_);
+  if (!actual_serving_sth_) {
+    return -1;
+  }
+  return std::max<int64_t>(
+      0, actual_serving_sth_->tree_size() - database_->TreeSize());
+}
+
+
+void ClusterStateController::AddStalenessCallback(
+    const StalenessCallback* callback) {
+  lock_guard<mutex> lock(staleness_callbacks_mutex_);
+  CHECK(staleness_callbacks_.insert(CHECK_NOTNULL(callback)).second);
+}
+
+
+void ClusterStateController::RemoveStalenessCallback(
+    const StalenessCallback* callback) {
+  lock_guard<mutex> lock(staleness_callbacks_mutex_);
+  CHECK_EQ(1U, staleness_callbacks_.erase(callback));
+}
+
+
+void ClusterStateController::NotifyStalenessChanged() {
+  lock_guard<mutex> lock(staleness_callbacks_mutex_);
+  for (const StalenessCallback* callback : staleness_callbacks_) {
+    (*callback)();
+  }
+}
+
+
 vector<ClusterNodeState> ClusterStateController::GetFreshNodes() const {
   lock_guard<mutex> lock(mutex_);
   if (!actual_serving_sth_) {
@@ -250,12 +296,68 @@ vector<ClusterNodeState> ClusterStateController::GetFreshNodes() const {
 }
 
 
+bool ClusterStateController::GetNodeState(const string& node_id,
+                                          ClusterNodeState* state) const {
+  CHECK_NOTNULL(state);
+  lock_guard<mutex> lock(mutex_);
+  const auto it(all_peers_.find(node_id));
+  if (it == all_peers_.end()) {
+    return false;
+  }
+  *state = it->second->state();
+  return true;
+}
+
+
 void ClusterStateController::PushLocalNodeState(
     const unique_lock<mutex>& lock) {
   CHECK(lock.owns_lock());
 
   const Status status(store_->SetClusterNodeState(local_node_state_));
   LOG_IF(WARNING, !status.ok()) << "Couldn't set ClusterNodeState: " << status;
+  if (status.ok()) {
+    last_pushed_ = steady_clock::now();
+  }
+}
+
+
+void ClusterStateController::IndexNodeSTH(const unique_lock<mutex>& lock,
+                                          const string& node_id,
+                                          const ClusterNodeState& state) {
+  UnindexNodeSTH(lock, node_id);
+  if (!state.has_newest_sth()) {
+    return;
+  }
+
+  const int64_t tree_size(state.newest_sth().tree_size());
+  CHECK_LE(0, tree_size);
+  const int64_t timestamp(state.newest_sth().timestamp());
+  CHECK_LE(0, timestamp);
+  const pair<int64_t, int64_t> key(tree_size, timestamp);
+
+  AnnouncedSTH& announced(sths_by_size_[key]);
+  if (announced.num_nodes == 0) {
+    announced.sth = state.newest_sth();
+  }
+  ++announced.num_nodes;
+  node_sth_keys_.emplace(node_id, key);
+}
+
+
+void ClusterStateController::UnindexNodeSTH(const unique_lock<mutex>& lock,
+                                            const string& node_id) {
+  CHECK(lock.owns_lock());
+  const auto node_it(node_sth_keys_.find(node_id));
+  if (node_it == node_sth_keys_.end()) {
+    return;
+  }
+
+  const auto it(sths_by_size_.find(node_it->second));
+  CHECK(it != sths_by_size_.end());
+  if (--it->second.num_nodes == 0) {
+    sths_by_size_.erase(it);
+  }
+  node_sth_keys_.erase(node_it);
 }
 
 
@@ -279,7 +381,14 @@ void ClusterStateController::OnClusterStateUpdated(
       }
 
       if (it != all_peers_.end()) {
+        const int64_t old_tree_size(it->second->TreeSize());
         it->second->UpdateClusterNodeState(update.handle_.Entry());
+        // Fetch the new entries now, rather than waiting for the
+        // fetcher's next periodic attempt.
+        if (it->second->TreeSize() > old_tree_size &&
+            it->second->TreeSize() > database_->TreeSize()) {
+          fetcher_->TriggerFetch();
+        }
       } else {
         const shared_ptr<ClusterPeer> peer(
             make_shared<ClusterPeer>(base_, url_fetcher_,
@@ -291,9 +400,11 @@ void ClusterStateController::OnClusterStateUpdated(
         all_peers_.emplace(node_id, peer);
         fetcher_->AddPeer(node_id, peer);
       }
+      IndexNodeSTH(lock, node_id, update.handle_.Entry());
     } else {
       VLOG(1) << "Node left: " << node_id;
       CHECK_EQ(static_cast<size_t>(1), all_peers_.erase(node_id));
+      UnindexNodeSTH(lock, node_id);
       fetcher_->RemovePeer(node_id);
     }
   }
@@ -394,6 +505,7 @@ void ClusterStateController::OnServingSthUpdated(
     // All good, write this STH to our local DB:
     CHECK_EQ(Database::OK, database_->WriteTreeHead(sth_to_write));
   }
+  NotifyStalenessChanged();
 }
 
 
@@ -402,28 +514,6 @@ void ClusterStateController::CalculateServingSTH(
   VLOG(1) << "Calculating new ServingSTH...";
   CHECK(lock.owns_lock());
 
-  // First, create a mapping of tree size to number of nodes at that size, and
-  // a mapping of the newst STH for any given size:
-  map<int64_t, SignedTreeHead> sth_by_size;
-  map<int64_t, int> num_nodes_by_sth_size;
-  for (const auto& node : all_peers_) {
-    const ClusterNodeState node_state(node.second->state());
-    if (node_state.has_newest_sth()) {
-      const int64_t tree_size(node_state.newest_sth().tree_size());
-      CHECK_LE(0, tree_size);
-      const int64_t timestamp(node_state.newest_sth().timestamp());
-      CHECK_LE(0, timestamp);
-
-      num_nodes_by_sth_size[tree_size]++;
-
-      // Default timestamp (first call in here) will be 0
-      if (node_state.newest_sth().timestamp() >
-          sth_by_size[tree_size].timestamp()) {
-        sth_by_size[tree_size] = node_state.newest_sth();
-      }
-    }
-  }
-
   // Next calculate the newest STH we've seen which satisfies the following
   // criteria:
   //   - at least minimum_serving_nodes have an STH at least as large
@@ -439,18 +529,21 @@ void ClusterStateController::CalculateServingSTH(
   // Work backwards (from largest STH size) until we see that there's enough
   // coverage (according to the criteria above) to serve an STH (or determine
   // that there are insufficient nodes to serve anything.)
-  for (auto it = num_nodes_by_sth_size.rbegin();
-       it != num_nodes_by_sth_size.rend() && it->first >= current_tree_size;
-       ++it) {
+  auto it(sths_by_size_.rbegin());
+  while (it != sths_by_size_.rend() && it->first.first >= current_tree_size) {
+    const int64_t tree_size(it->first.first);
+    // The first STH of a given size is the one with the newest timestamp.
+    const SignedTreeHead& candidate_sth(it->second.sth);
     // num_nodes_seen keeps track of the number of nodes we've seen so far (and
     // since we're working from larger to smaller size STH, they should all be
     // able to serve this [and smaller] STHs.)
-    num_nodes_seen += it->second;
+    for (; it != sths_by_size_.rend() && it->first.first == tree_size; ++it) {
+      num_nodes_seen += it->second.num_nodes;
+    }
     const double serving_fraction(static_cast<double>(num_nodes_seen) /
                                   all_peers_.size());
     if (serving_fraction >= cluster_config_.minimum_serving_fraction() &&
         num_nodes_seen >= cluster_config_.minimum_serving_nodes()) {
-      const SignedTreeHead& candidate_sth(sth_by_size[it->first]);
 
       // This STH isn't a viable candidate unless its timestamp is strictly
       // newer than any current serving STH:
@@ -464,10 +557,9 @@ void ClusterStateController::CalculateServingSTH(
         continue;
       }
 
-      LOG(INFO) << "Can serve @" << it->first << " with " << num_nodes_seen
+      LOG(INFO) << "Can serve @" << tree_size << " with " << num_nodes_seen
                 << " nodes (" << (serving_fraction * 100) << "% of cluster)";
-      calculated_serving_sth_.reset(
-          new SignedTreeHead(sth_by_size[it->first]));
+      calculated_serving_sth_.reset(new SignedTreeHead(candidate_sth));
       // Push this STH out to the cluster if we're master:
       if (election_->IsMaster()) {
         VLOG(1) << "Pushing new STH out to cluster";
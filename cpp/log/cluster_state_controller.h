@@ -1,11 +1,14 @@
 #ifndef CERT_TRANS_LOG_CLUSTER_STATE_CONTROLLER_H_
 #define CERT_TRANS_LOG_CLUSTER_STATE_CONTROLLER_H_
 
+#include <stdint.h>
+#include <chrono>
 #include <condition_variable>
 #include <functional>
 #include <map>
 #include <memory>
 #include <queue>
+#include <set>
 #include <string>
 
 #include "fetcher/continuous_fetcher.h"
@@ -31,6 +34,8 @@ class Database;
 //    and leaves/joins the election as appropriate.
 class ClusterStateController {
  public:
+  typedef std::function<void()> StalenessCallback;
+
   ClusterStateController(util::Executor* executor,
                          const std::shared_ptr<libevent::Base>& base,
                          UrlFetcher* url_fetcher, Database* database,
@@ -65,11 +70,27 @@ class ClusterStateController {
 
   bool NodeIsStale() const;
 
+  // Returns how many entries of the serving STH the local database
+  // lacks, or -1 if there is no serving STH.
+  int64_t NodeLag() const;
+
+  // Has |*callback| called whenever NodeIsStale() may have changed:
+  // when the serving STH changes, and when this node has a new tree
+  // head. It is called from whichever thread does that, without any
+  // lock of this instance held, and not after it is removed.
+  void AddStalenessCallback(const StalenessCallback* callback);
+  void RemoveStalenessCallback(const StalenessCallback* callback);
+
   // Returns a vector of the other nodes in the cluster which are able to serve
   // the cluster's current ServingSTH. Does not include this node in the
   // returned list regardless of its freshness.
   std::vector<ct::ClusterNodeState> GetFreshNodes() const;
 
+  // Sets |*state| to the last known state of node |node_id|, and returns
+  // true, if it is in the cluster.
+  bool GetNodeState(const std::string& node_id,
+                    ct::ClusterNodeState* state) const;
+
  private:
   class ClusterPeer : public Peer {
    public:
@@ -88,9 +109,25 @@ class ClusterStateController {
     ct::ClusterNodeState state_;
   };
 
+  // An STH announced by one or more nodes, see sths_by_size_.
+  struct AnnouncedSTH {
+    int num_nodes = 0;
+    ct::SignedTreeHead sth;
+  };
+
   // Updates the representation of *this* node's state in the consistent store.
   void PushLocalNodeState(const std::unique_lock<std::mutex>& lock);
 
+  // Records |state| as the latest state of node |node_id| in sths_by_size_,
+  // replacing whatever it announced before.
+  void IndexNodeSTH(const std::unique_lock<std::mutex>& lock,
+                    const std::string& node_id,
+                    const ct::ClusterNodeState& state);
+
+  // Removes whatever node |node_id| announced from sths_by_size_.
+  void UnindexNodeSTH(const std::unique_lock<std::mutex>& lock,
+                      const std::string& node_id);
+
   // Entry point for the watcher callback.
   // Called whenever a node changes its node state.
   void OnClusterStateUpdated(
@@ -118,6 +155,9 @@ class ClusterStateController {
   // Thread entry point for ServingSTH updater thread.
   void ClusterServingSTHUpdater();
 
+  // Calls the staleness callbacks. Must be called without |mutex_|.
+  void NotifyStalenessChanged();
+
   const std::shared_ptr<libevent::Base> base_;
   UrlFetcher* const url_fetcher_;     // Not owned by us
   Database* const database_;          // Not owned by us
@@ -132,6 +172,13 @@ class ClusterStateController {
   mutable std::mutex mutex_;  // covers the members below:
   ct::ClusterNodeState local_node_state_;
   std::map<std::string, const std::shared_ptr<ClusterPeer>> all_peers_;
+  // The STHs announced by the nodes in all_peers_, keyed by (tree size,
+  // timestamp), and the key of each node's STH. This is kept up to date
+  // as node states change, so that CalculateServingSTH() does not need
+  // to look at every node.
+  std::map<std::pair<int64_t, int64_t>, AnnouncedSTH> sths_by_size_;
+  std::map<std::string, std::pair<int64_t, int64_t>> node_sth_keys_;
+  std::chrono::steady_clock::time_point last_pushed_;
   std::unique_ptr<ct::SignedTreeHead> calculated_serving_sth_;
   std::unique_ptr<ct::SignedTreeHead> actual_serving_sth_;
   bool exiting_;
@@ -139,6 +186,11 @@ class ClusterStateController {
   std::condition_variable update_required_cv_;
   std::thread cluster_serving_sth_update_thread_;
 
+  // Held while the staleness callbacks are called, so that they are
+  // not removed from under the caller.
+  std::mutex staleness_callbacks_mutex_;
+  std::set<const StalenessCallback*> staleness_callbacks_;
+
   friend class ClusterStateControllerTest;
 };
 
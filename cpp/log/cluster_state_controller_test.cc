@@ -1,4 +1,5 @@
 #include <gtest/gtest.h>
+#include <atomic>
 #include <map>
 #include <memory>
 #include <string>
@@ -26,6 +27,7 @@ using std::shared_ptr;
 using std::string;
 using std::vector;
 using testing::AnyNumber;
+using testing::AtLeast;
 using testing::NiceMock;
 using testing::Return;
 using testing::_;
@@ -66,6 +68,7 @@ class ClusterStateControllerTest : public ::testing::Test {
     // this test, but this isn't what we're testing here, so just
     // ignore them.
     EXPECT_CALL(fetcher_, AddPeer(_, _)).Times(AnyNumber());
+    EXPECT_CALL(fetcher_, TriggerFetch()).Times(AnyNumber());
 
     // Set default cluster config:
     ct::ClusterConfig default_config;
@@ -300,6 +303,19 @@ TEST_F(ClusterStateControllerTest, TestKeepsNewerSTH) {
 }
 
 
+TEST_F(ClusterStateControllerTest, TestTriggersFetchWhenPeerTreeGrows) {
+  ClusterNodeState cns(cns100_);
+  cns.set_hostname(kNodeId2);
+  store2_->SetClusterNodeState(cns);
+  sleep(1);
+
+  EXPECT_CALL(fetcher_, TriggerFetch()).Times(AtLeast(1));
+  cns.mutable_newest_sth()->CopyFrom(sth200_);
+  store2_->SetClusterNodeState(cns);
+  sleep(1);
+}
+
+
 TEST_F(ClusterStateControllerTest, TestCannotSelectSmallerSTH) {
   NiceMock<MockMasterElection> election_is_master;
   EXPECT_CALL(election_is_master, IsMaster()).WillRepeatedly(Return(true));
@@ -618,6 +634,52 @@ TEST_F(ClusterStateControllerTest, TestNodeIsStale) {
 }
 
 
+TEST_F(ClusterStateControllerTest, TestStalenessCallback) {
+  std::atomic<int> calls(0);
+  const ClusterStateController::StalenessCallback callback(
+      [&calls]() { ++calls; });
+  controller_.AddStalenessCallback(&callback);
+  EXPECT_EQ(-1, controller_.NodeLag());  // no STH yet.
+
+  {
+    SignedTreeHead sth;
+    sth.set_timestamp(10000);
+    sth.set_tree_size(2);
+    store1_->SetServingSTH(sth);
+    sleep(1);
+  }
+  EXPECT_LT(0, calls.load());
+  EXPECT_EQ(2, controller_.NodeLag());
+
+  for (int i = 0; i < 2; ++i) {
+    LoggedEntry cert;
+    cert.RandomForTest();
+    cert.set_sequence_number(i);
+    EXPECT_EQ(Database::OK, test_db_.db()->CreateSequencedEntry(cert));
+  }
+  EXPECT_EQ(0, controller_.NodeLag());
+
+  int before(calls.load());
+  {
+    SignedTreeHead sth;
+    sth.set_timestamp(10001);
+    sth.set_tree_size(2);
+    controller_.NewTreeHead(sth);
+  }
+  EXPECT_EQ(before + 1, calls.load());
+
+  controller_.RemoveStalenessCallback(&callback);
+  before = calls.load();
+  {
+    SignedTreeHead sth;
+    sth.set_timestamp(10002);
+    sth.set_tree_size(3);
+    store1_->SetServingSTH(sth);
+    sleep(1);
+  }
+  EXPECT_EQ(before, calls.load());
+}
+
 TEST_F(ClusterStateControllerTest, TestGetFreshNodes) {
   ClusterStateController c2(&pool_, base_, &url_fetcher_, test_db_.db(),
                             store2_.get(), &election2_, &fetcher_);
@@ -1,15 +1,58 @@
 /* -*- indent-tabs-mode: nil -*- */
 #include "log/cms_verifier.h"
+
+#include <openssl/sha.h>
+
 #include "log/ct_extensions.h"
 #include "util/cms_scoped_types.h"
 #include "util/openssl_scoped_types.h"
 
+using std::lock_guard;
+using std::mutex;
 using std::string;
 using std::unique_ptr;
 using util::Status;
 using util::StatusOr;
 
 namespace cert_trans {
+namespace {
+
+
+// How many successful verifications are remembered.
+const size_t kMaxVerified = 4096;
+
+
+bool HasSigner(CMS_ContentInfo* cms_content_info, X509* cert) {
+  // This stack must not be freed as it points into the CMS structure
+  STACK_OF(CMS_SignerInfo) *
+      const signers(CMS_get0_SignerInfos(cms_content_info));
+  if (!signers) {
+    return false;
+  }
+
+  const int num_signers(sk_CMS_SignerInfo_num(signers));
+  // Submissions almost always have the one signer.
+  if (num_signers == 1) {
+    return CMS_SignerInfo_cert_cmp(sk_CMS_SignerInfo_value(signers, 0),
+                                   cert) == 0;
+  }
+  for (int s = 0; s < num_signers; ++s) {
+    if (CMS_SignerInfo_cert_cmp(sk_CMS_SignerInfo_value(signers, s), cert) ==
+        0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+
+}  // namespace
+
+
+CmsVerifier::CmsVerifier() {
+}
+
+
 util::StatusOr<bool> CmsVerifier::IsCmsSignedByCert(BIO* cms_bio_in,
                                                     const Cert& cert) const {
   CHECK_NOTNULL(cms_bio_in);
@@ -23,31 +66,21 @@ util::StatusOr<bool> CmsVerifier::IsCmsSignedByCert(BIO* cms_bio_in,
                   "CMS data could not be parsed");
   }
 
-  // This stack must not be freed as it points into the CMS structure
-  STACK_OF(CMS_SignerInfo) *
-      const signers(CMS_get0_SignerInfos(cms_content_info.get()));
-
-  if (signers) {
-    for (int s = 0; s < sk_CMS_SignerInfo_num(signers); ++s) {
-      CMS_SignerInfo* const signer = sk_CMS_SignerInfo_value(signers, s);
-
-      if (CMS_SignerInfo_cert_cmp(signer, cert.x509_.get()) == 0) {
-        return true;
-      }
-    }
-  }
-
-  return false;
+  return HasSigner(cms_content_info.get(), cert.x509_.get());
 }
 
 StatusOr<bool> CmsVerifier::IsCmsSignedByCert(const string& cms_object,
                                               const Cert& cert) const {
-  // Load a source bio with the CMS signed data object and parse it
-  ScopedBIO source_bio(BIO_new(BIO_s_mem()));
-  BIO_write(source_bio.get(), cms_object.c_str(), cms_object.length());
+  const string key(VerifiedKey(cms_object, cert));
+  if (!key.empty() && IsVerified(key)) {
+    return true;
+  }
 
+  // Parse the CMS signed data object in place.
+  const unsigned char* der(
+      reinterpret_cast<const unsigned char*>(cms_object.data()));
   ScopedCMS_ContentInfo cms_content_info(
-      d2i_CMS_bio(source_bio.get(), nullptr));
+      d2i_CMS_ContentInfo(nullptr, &der, cms_object.size()));
 
   if (!cms_content_info) {
     LOG(ERROR) << "Could not parse CMS data";
@@ -79,21 +112,14 @@ StatusOr<bool> CmsVerifier::IsCmsSignedByCert(const string& cms_object,
     return false;
   }
 
-  // This stack must not be freed as it points into the CMS structure
-  STACK_OF(CMS_SignerInfo) *
-      const signers(CMS_get0_SignerInfos(cms_content_info.get()));
-
-  if (signers) {
-    for (int s = 0; s < sk_CMS_SignerInfo_num(signers); ++s) {
-      CMS_SignerInfo* const signer = sk_CMS_SignerInfo_value(signers, s);
-
-      if (CMS_SignerInfo_cert_cmp(signer, cert.x509_.get()) == 0) {
-        return true;
-      }
-    }
+  if (!HasSigner(cms_content_info.get(), cert.x509_.get())) {
+    return false;
   }
 
-  return false;
+  if (!key.empty()) {
+    AddVerified(key);
+  }
+  return true;
 }
 
 
@@ -207,9 +233,9 @@ unique_ptr<Cert> CmsVerifier::UnpackCmsSignedCertificate(
 
 unique_ptr<Cert> CmsVerifier::UnpackCmsSignedCertificate(
     const string& cms_object) {
-  // Load the source bio with the CMS signed data object
-  ScopedBIO source_bio(BIO_new(BIO_s_mem()));
-  BIO_write(source_bio.get(), cms_object.c_str(), cms_object.length());
+  // A read-only bio over the CMS signed data object, which isn't copied.
+  ScopedBIO source_bio(BIO_new_mem_buf(const_cast<char*>(cms_object.data()),
+                                       cms_object.size()));
 
   ScopedBIO unpacked_bio(BIO_new(BIO_s_mem()));
   unique_ptr<Cert> cert;
@@ -230,4 +256,37 @@ unique_ptr<Cert> CmsVerifier::UnpackCmsSignedCertificate(
   return cert;
 }
 
+
+// static
+string CmsVerifier::VerifiedKey(const string& cms_object, const Cert& cert) {
+  string key;
+  if (!cert.Sha256Digest(&key).ok()) {
+    return "";
+  }
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+  SHA256(reinterpret_cast<const unsigned char*>(cms_object.data()),
+         cms_object.size(), digest);
+  key.append(reinterpret_cast<const char*>(digest), sizeof(digest));
+  return key;
+}
+
+
+bool CmsVerifier::IsVerified(const string& key) const {
+  lock_guard<mutex> lock(verified_lock_);
+  return verified_.count(key) > 0;
+}
+
+
+void CmsVerifier::AddVerified(const string& key) const {
+  lock_guard<mutex> lock(verified_lock_);
+  if (!verified_.insert(key).second) {
+    return;
+  }
+  verified_order_.push_back(key);
+  if (verified_order_.size() > kMaxVerified) {
+    verified_.erase(verified_order_.front());
+    verified_order_.pop_front();
+  }
+}
+
 }  // namespace cert_trans
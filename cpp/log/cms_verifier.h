@@ -4,7 +4,11 @@
 #include <openssl/asn1.h>
 #include <openssl/bio.h>
 #include <openssl/cms.h>
+#include <deque>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_set>
 
 #include "log/cert.h"
 #include "util/openssl_util.h"  // for LOG_OPENSSL_ERRORS
@@ -12,9 +16,13 @@
 
 namespace cert_trans {
 
+// The verifications of CMS objects given as strings which succeed are
+// remembered, by digest of the object and of the certificate, so that
+// the same submission checked again against the same signer is not
+// parsed and verified again. Failures are not remembered.
 class CmsVerifier {
  public:
-  CmsVerifier() = default;
+  CmsVerifier();
 
   virtual ~CmsVerifier() = default;
   CmsVerifier(const CmsVerifier&) = delete;
@@ -29,8 +37,8 @@ class CmsVerifier {
   // certificate. Does not verify the signature or check the payload.
   virtual util::StatusOr<bool> IsCmsSignedByCert(BIO* cms_bio_in,
                                                  const Cert& cert) const;
-  // Checks that a CMS_ContentInfo has a signer that matches a specified
-  // certificate. Does not verify the signature or check the payload.
+  // Checks that a CMS_ContentInfo has a valid signature by a signer that
+  // matches a specified certificate. Does not check the payload.
   virtual util::StatusOr<bool> IsCmsSignedByCert(const std::string& cms_object,
                                                  const Cert& cert) const;
 
@@ -68,6 +76,18 @@ class CmsVerifier {
   // The unpacked data may not be a valid X.509 cert. The caller must
   // apply any additional checks necessary.
   util::Status UnpackCmsDerBio(BIO* cms_bio_in, BIO* cms_bio_out);
+
+  // Returns the key under which a verification of |cms_object| against
+  // |cert| is remembered, or an empty string if |cert| can't be encoded.
+  static std::string VerifiedKey(const std::string& cms_object,
+                                 const Cert& cert);
+  bool IsVerified(const std::string& key) const;
+  void AddVerified(const std::string& key) const;
+
+  mutable std::mutex verified_lock_;
+  mutable std::unordered_set<std::string> verified_;
+  // The keys of |verified_|, oldest first.
+  mutable std::deque<std::string> verified_order_;
 };
 
 }  // namespace cert_trans
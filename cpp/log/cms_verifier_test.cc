@@ -113,6 +113,22 @@ TEST_F(CmsVerifierTest, CmsSignTestCase4) {
 }
 
 
+TEST_F(CmsVerifierTest, CmsSignRememberedByContentAndCert) {
+  string cms;
+  ASSERT_TRUE(util::ReadBinaryFile(cert_dir_v2_ + kCmsSignedDataTest3, &cms));
+
+  // The second time is answered from what was remembered.
+  EXPECT_TRUE(verifier_.IsCmsSignedByCert(cms, *ca_cert_).ValueOrDie());
+  EXPECT_TRUE(verifier_.IsCmsSignedByCert(cms, *ca_cert_).ValueOrDie());
+  // Which doesn't extend to other signers, or to other content.
+  EXPECT_FALSE(
+      verifier_.IsCmsSignedByCert(cms, *intermediate_cert_).ValueOrDie());
+  EXPECT_THAT(verifier_.IsCmsSignedByCert(cms.substr(0, cms.size() / 2),
+                                          *ca_cert_).status(),
+              StatusIs(util::error::INVALID_ARGUMENT));
+}
+
+
 TEST_F(CmsVerifierTest, CmsVerifyTestCase2) {
   ScopedBIO bio(OpenTestFileBio(cert_dir_v2_ + kCmsSignedDataTest2));
   unique_ptr<Cert> unpacked_cert(
@@ -124,6 +124,11 @@ struct Update {
 };
 
 
+// Whether |a| and |b| are for the same leaf, which they can be while
+// their chains differ.
+bool LeafEntriesMatch(const LoggedEntry& a, const LoggedEntry& b);
+
+
 class ConsistentStore {
  public:
   typedef std::function<void(const Update<ct::SignedTreeHead>& update)>
@@ -132,6 +137,8 @@ class ConsistentStore {
                                  updates)> ClusterNodeStateCallback;
   typedef std::function<void(const Update<ct::ClusterConfig>& update)>
       ClusterConfigCallback;
+  typedef std::function<void(const std::vector<Update<LoggedEntry>>& updates)>
+      PendingEntriesCallback;
 
   ConsistentStore() = default;
   ConsistentStore(const ConsistentStore&) = delete;
@@ -147,6 +154,17 @@ class ConsistentStore {
 
   virtual util::Status AddPendingEntry(LoggedEntry* entry) = 0;
 
+  // As AddPendingEntry(), but returns the status on |task| instead of
+  // waiting for it, so that the calling thread does not sit idle for
+  // the round trip to the store. |entry| must remain valid until
+  // |task| is done.
+  virtual void AddPendingEntryAsync(LoggedEntry* entry, util::Task* task) = 0;
+
+  // Adds each of |entries| as AddPendingEntry() would, but together,
+  // and sets |statuses| to the status of each.
+  virtual void AddPendingEntries(const std::vector<LoggedEntry*>& entries,
+                                 std::vector<util::Status>* statuses) = 0;
+
   virtual util::Status GetPendingEntryForHash(
       const std::string& hash, EntryHandle<LoggedEntry>* entry) const = 0;
 
@@ -173,6 +191,11 @@ class ConsistentStore {
   virtual void WatchClusterConfig(const ClusterConfigCallback& cb,
                                   util::Task* task) = 0;
 
+  // Calls |cb| with all the pending entries, then with the ones added
+  // or removed. The updates of removed entries only have their key.
+  virtual void WatchPendingEntries(const PendingEntriesCallback& cb,
+                                   util::Task* task) = 0;
+
   virtual util::Status SetClusterConfig(const ct::ClusterConfig& config) = 0;
 
   // Cleans up entries in the store according to the implementation's policy.
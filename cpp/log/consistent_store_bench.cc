@@ -0,0 +1,456 @@
+// Benchmarks for EtcdConsistentStore, with the workloads of a log
+// cluster: bursts of new pending entries, sequence mapping updates as
+// the sequenced backlog grows, watches with many subscribers, and
+// cleanups. This is meant for sizing etcd clusters, and comparing
+// configurations (e.g. --etcd_sequence_mapping_chunk_size).
+//
+// By default the store talks to a FakeEtcdClient, which measures the
+// store itself. With --consistent_store_bench_etcd_servers, it talks to
+// real etcd servers instead, using the v2 or v3 API according to
+// --consistent_store_bench_etcd_api_version; every benchmark then uses
+// its own directory under --consistent_store_bench_etcd_root, which is
+// not cleaned up afterwards.
+//
+// Run with --help for the options of the benchmark library, e.g.
+// --benchmark_filter=<regex>, and --benchmark_format=json or
+// --benchmark_out=<file> for machine-readable results. Besides
+// throughput, every benchmark reports the p50, p99 and p999 latencies
+// of its operations in microseconds (averaged over threads, for the
+// multi-threaded ones).
+#include <benchmark/benchmark.h>
+#include <event2/thread.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <gmock/gmock.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "log/etcd_consistent_store.h"
+#include "log/logged_entry.h"
+#include "net/url_fetcher.h"
+#include "proto/cert_serializer.h"
+#include "util/etcd.h"
+#include "util/etcd_v3.h"
+#include "util/fake_etcd.h"
+#include "util/libevent_wrapper.h"
+#include "util/mock_masterelection.h"
+#include "util/status.h"
+#include "util/sync_task.h"
+#include "util/thread_pool.h"
+
+DEFINE_string(consistent_store_bench_etcd_servers, "",
+              "Comma-separated host:port list of the etcd servers to "
+              "benchmark against. Empty to use a fake etcd in memory.");
+DEFINE_int32(consistent_store_bench_etcd_api_version, 2,
+             "Version of the etcd API to use with "
+             "--consistent_store_bench_etcd_servers, 2 or 3.");
+DEFINE_string(consistent_store_bench_etcd_root, "/consistent_store_bench",
+              "etcd directory under which the benchmarks keep their data, "
+              "when using --consistent_store_bench_etcd_servers.");
+
+DECLARE_int32(etcd_sequence_mapping_chunk_size);
+
+namespace libevent = cert_trans::libevent;
+
+using cert_trans::EntryHandle;
+using cert_trans::EtcdClient;
+using cert_trans::EtcdConsistentStore;
+using cert_trans::EtcdV3Client;
+using cert_trans::FakeEtcdClient;
+using cert_trans::LoggedEntry;
+using cert_trans::MockMasterElection;
+using cert_trans::ThreadPool;
+using cert_trans::Update;
+using cert_trans::UrlFetcher;
+using ct::SequenceMapping;
+using ct::SignedTreeHead;
+using std::atomic;
+using std::chrono::duration;
+using std::chrono::steady_clock;
+using std::condition_variable;
+using std::lock_guard;
+using std::make_shared;
+using std::mutex;
+using std::string;
+using std::to_string;
+using std::unique_lock;
+using std::unique_ptr;
+using std::vector;
+using testing::NiceMock;
+using testing::Return;
+using util::Status;
+using util::StatusOr;
+using util::SyncTask;
+
+namespace {
+
+
+// Times the operations of a benchmark, one per iteration, and reports
+// their latency percentiles when destroyed. Benchmarks using it must
+// be registered with UseManualTime().
+class Latencies {
+ public:
+  explicit Latencies(benchmark::State* state) : state_(state) {
+  }
+
+  ~Latencies() {
+    if (latencies_.empty()) {
+      return;
+    }
+    std::sort(latencies_.begin(), latencies_.end());
+    Report("p50_us", 0.5);
+    Report("p99_us", 0.99);
+    Report("p999_us", 0.999);
+  }
+
+  template <class Operation>
+  void Time(const Operation& operation) {
+    const steady_clock::time_point start(steady_clock::now());
+    operation();
+    const duration<double> elapsed(steady_clock::now() - start);
+    state_->SetIterationTime(elapsed.count());
+    latencies_.push_back(elapsed.count());
+  }
+
+ private:
+  void Report(const string& name, double percentile) {
+    const size_t index(std::min(
+        latencies_.size() - 1,
+        static_cast<size_t>(percentile * latencies_.size())));
+    state_->counters[name] = benchmark::Counter(
+        latencies_[index] * 1e6, benchmark::Counter::kAvgThreads);
+  }
+
+  benchmark::State* const state_;
+  vector<double> latencies_;
+};
+
+
+// Makes pending entries, different across all the benchmarks and
+// threads.
+LoggedEntry MakePendingEntry() {
+  static atomic<int64_t> next_id(0);
+  const int64_t id(next_id++);
+  LoggedEntry entry;
+  entry.mutable_sct()->set_timestamp(id);
+  entry.mutable_entry()->set_type(ct::X509_ENTRY);
+  entry.mutable_entry()->mutable_x509_entry()->set_leaf_certificate(
+      "leaf certificate " + to_string(id));
+  return entry;
+}
+
+
+// An EtcdConsistentStore, on its own etcd client and directory, as the
+// master of its cluster.
+class Store {
+ public:
+  Store()
+      : base_(make_shared<libevent::Base>()),
+        pump_(base_),
+        pool_(4),
+        fetcher_(base_.get(), &pool_),
+        client_(MakeClient()) {
+    ON_CALL(election_, IsMaster()).WillByDefault(Return(true));
+    static atomic<int> next_root(0);
+    const string root(FLAGS_consistent_store_bench_etcd_root + "/" +
+                      to_string(getpid()) + "-" + to_string(next_root++));
+    // An empty sequence mapping, as a new log has.
+    SyncTask task(&pool_);
+    EtcdClient::Response resp;
+    client_->Create(root + "/sequence_mapping", "", &resp, task.task());
+    task.Wait();
+    CHECK_EQ(::util::OkStatus(), task.status());
+    store_.reset(new EtcdConsistentStore(base_.get(), &pool_, client_.get(),
+                                         &election_, root, "bench"));
+  }
+
+  EtcdConsistentStore* store() const {
+    return store_.get();
+  }
+
+  util::Executor* executor() {
+    return &pool_;
+  }
+
+  // Adds |num_entries| pending entries, and sequences them. Like the
+  // tree signer, this drops the mappings of the entries which are
+  // served already.
+  void AddSequencedEntries(int num_entries) {
+    int64_t sequence_number(
+        store_->NextAvailableSequenceNumber().ValueOrDie());
+    EntryHandle<SequenceMapping> mapping;
+    CHECK_EQ(::util::OkStatus(), store_->GetSequenceMapping(&mapping));
+    const StatusOr<SignedTreeHead> sth(store_->GetServingSTH());
+    const int64_t tree_size(sth.ok() ? sth.ValueOrDie().tree_size() : 0);
+    auto* const mappings(mapping.MutableEntry()->mutable_mapping());
+    int num_served(0);
+    while (num_served < mappings->size() &&
+           mappings->Get(num_served).sequence_number() < tree_size) {
+      ++num_served;
+    }
+    mappings->DeleteSubrange(0, num_served);
+    for (int i = 0; i < num_entries; ++i) {
+      LoggedEntry entry(MakePendingEntry());
+      CHECK_EQ(::util::OkStatus(), store_->AddPendingEntry(&entry));
+      SequenceMapping::Mapping* const m(
+          mapping.MutableEntry()->add_mapping());
+      m->set_sequence_number(sequence_number++);
+      m->set_entry_hash(entry.Hash());
+    }
+    CHECK_EQ(::util::OkStatus(), store_->UpdateSequenceMapping(&mapping));
+  }
+
+ private:
+  unique_ptr<EtcdClient> MakeClient() {
+    if (FLAGS_consistent_store_bench_etcd_servers.empty()) {
+      return unique_ptr<EtcdClient>(new FakeEtcdClient(base_.get()));
+    }
+    const auto servers(
+        cert_trans::SplitHosts(FLAGS_consistent_store_bench_etcd_servers));
+    if (FLAGS_consistent_store_bench_etcd_api_version == 3) {
+      return unique_ptr<EtcdClient>(
+          new EtcdV3Client(&pool_, &fetcher_, servers));
+    }
+    CHECK_EQ(2, FLAGS_consistent_store_bench_etcd_api_version);
+    return unique_ptr<EtcdClient>(new EtcdClient(&pool_, &fetcher_, servers));
+  }
+
+  const std::shared_ptr<libevent::Base> base_;
+  libevent::EventPumpThread pump_;
+  ThreadPool pool_;
+  UrlFetcher fetcher_;
+  const unique_ptr<EtcdClient> client_;
+  NiceMock<MockMasterElection> election_;
+  unique_ptr<EtcdConsistentStore> store_;
+};
+
+
+// The store shared by the threads of the multi-threaded benchmarks.
+Store* SharedStore() {
+  static Store* const store(new Store);
+  return store;
+}
+
+
+void BM_AddPendingEntry(benchmark::State& state) {
+  Store* const store(SharedStore());
+  Latencies latencies(&state);
+  for (auto _ : state) {
+    LoggedEntry entry(MakePendingEntry());
+    latencies.Time([store, &entry]() {
+      CHECK_EQ(::util::OkStatus(), store->store()->AddPendingEntry(&entry));
+    });
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+
+// Adds bursts of state.range(0) pending entries at once, as add-chains
+// does. The latencies are those of whole bursts.
+void BM_AddPendingEntries(benchmark::State& state) {
+  Store* const store(SharedStore());
+  Latencies latencies(&state);
+  vector<LoggedEntry> entries(state.range(0));
+  vector<LoggedEntry*> entry_ptrs;
+  for (LoggedEntry& entry : entries) {
+    entry_ptrs.push_back(&entry);
+  }
+  vector<Status> statuses;
+  for (auto _ : state) {
+    for (LoggedEntry& entry : entries) {
+      entry = MakePendingEntry();
+    }
+    latencies.Time([store, &entry_ptrs, &statuses]() {
+      store->store()->AddPendingEntries(entry_ptrs, &statuses);
+    });
+    for (const Status& status : statuses) {
+      CHECK_EQ(::util::OkStatus(), status);
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * entries.size());
+}
+
+
+// Sequences state.range(0) new entries per iteration, as a sequencing
+// run of the master does: reading the mapping and writing it back
+// with the new entries, so that it grows with every iteration (nothing
+// is cleaned up). state.range(1) is the value of
+// --etcd_sequence_mapping_chunk_size.
+void BM_UpdateSequenceMapping(benchmark::State& state) {
+  FLAGS_etcd_sequence_mapping_chunk_size = state.range(1);
+  Store store;
+  FLAGS_etcd_sequence_mapping_chunk_size = 0;
+  Latencies latencies(&state);
+  int64_t mapping_size(0);
+  for (auto _ : state) {
+    vector<string> hashes;
+    for (int i = 0; i < state.range(0); ++i) {
+      hashes.push_back(MakePendingEntry().Hash());
+    }
+    latencies.Time([&store, &hashes, &mapping_size]() {
+      EntryHandle<SequenceMapping> mapping;
+      CHECK_EQ(::util::OkStatus(),
+               store.store()->GetSequenceMapping(&mapping));
+      for (const string& hash : hashes) {
+        SequenceMapping::Mapping* const m(
+            mapping.MutableEntry()->add_mapping());
+        m->set_sequence_number(mapping_size++);
+        m->set_entry_hash(hash);
+      }
+      CHECK_EQ(::util::OkStatus(),
+               store.store()->UpdateSequenceMapping(&mapping));
+    });
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+  state.counters["mapping_size"] = mapping_size;
+}
+
+
+// Counts the updates received by the subscribers of a watch.
+class WatchCounter {
+ public:
+  WatchCounter() : num_calls_(0), num_updates_(0) {
+  }
+
+  void OnUpdates(const vector<Update<LoggedEntry>>& updates) {
+    lock_guard<mutex> lock(lock_);
+    ++num_calls_;
+    num_updates_ += updates.size();
+    cv_.notify_all();
+  }
+
+  void WaitForCalls(int64_t num_calls) {
+    unique_lock<mutex> lock(lock_);
+    cv_.wait(lock, [this, num_calls]() { return num_calls_ >= num_calls; });
+  }
+
+  void WaitForUpdates(int64_t num_updates) {
+    unique_lock<mutex> lock(lock_);
+    cv_.wait(lock,
+             [this, num_updates]() { return num_updates_ >= num_updates; });
+  }
+
+ private:
+  mutex lock_;
+  condition_variable cv_;
+  int64_t num_calls_;
+  int64_t num_updates_;
+};
+
+
+// Adds one pending entry per iteration, with state.range(0) watches of
+// the pending entries. The latencies are from adding the entry to all
+// the watches having reported it.
+void BM_WatchPendingEntries(benchmark::State& state) {
+  Store store;
+  WatchCounter counter;
+  vector<unique_ptr<SyncTask>> watches;
+  for (int i = 0; i < state.range(0); ++i) {
+    watches.emplace_back(new SyncTask(store.executor()));
+  }
+  for (const auto& watch : watches) {
+    store.store()->WatchPendingEntries(
+        [&counter](const vector<Update<LoggedEntry>>& updates) {
+          counter.OnUpdates(updates);
+        },
+        watch->task());
+  }
+  // The initial state, which is empty.
+  counter.WaitForCalls(state.range(0));
+
+  Latencies latencies(&state);
+  int64_t num_updates(0);
+  for (auto _ : state) {
+    LoggedEntry entry(MakePendingEntry());
+    num_updates += state.range(0);
+    latencies.Time([&store, &counter, &entry, num_updates]() {
+      CHECK_EQ(::util::OkStatus(), store.store()->AddPendingEntry(&entry));
+      counter.WaitForUpdates(num_updates);
+    });
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+
+  for (const auto& watch : watches) {
+    watch->Cancel();
+    watch->Wait();
+  }
+}
+
+
+// Cleans up state.range(0) sequenced entries per iteration, with
+// state.range(1) as the value of --etcd_sequence_mapping_chunk_size.
+void BM_CleanupOldEntries(benchmark::State& state) {
+  FLAGS_etcd_sequence_mapping_chunk_size = state.range(1);
+  Store store;
+  FLAGS_etcd_sequence_mapping_chunk_size = 0;
+  Latencies latencies(&state);
+  SignedTreeHead sth;
+  for (auto _ : state) {
+    store.AddSequencedEntries(state.range(0));
+    // Serve all of them, so that they can be cleaned up.
+    sth.set_timestamp(sth.timestamp() + 1);
+    sth.set_tree_size(sth.tree_size() + state.range(0));
+    CHECK_EQ(::util::OkStatus(), store.store()->SetServingSTH(sth));
+    latencies.Time([&store, &state]() {
+      // With chunks, the entries of the last one are deleted again,
+      // which finds them gone.
+      CHECK_LE(state.range(0),
+               store.store()->CleanupOldEntries().ValueOrDie());
+    });
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+
+void RegisterBenchmarks() {
+  benchmark::RegisterBenchmark("BM_AddPendingEntry", BM_AddPendingEntry)
+      ->ThreadRange(1, 16)
+      ->UseManualTime();
+  benchmark::RegisterBenchmark("BM_AddPendingEntries", BM_AddPendingEntries)
+      ->Arg(16)
+      ->Arg(256)
+      ->ThreadRange(1, 4)
+      ->UseManualTime();
+  benchmark::RegisterBenchmark("BM_UpdateSequenceMapping",
+                               BM_UpdateSequenceMapping)
+      ->Args({1, 0})
+      ->Args({100, 0})
+      ->Args({100, 1000})
+      ->Args({1000, 1000})
+      ->UseManualTime();
+  benchmark::RegisterBenchmark("BM_WatchPendingEntries",
+                               BM_WatchPendingEntries)
+      ->Arg(1)
+      ->Arg(16)
+      ->Arg(128)
+      ->UseManualTime();
+  benchmark::RegisterBenchmark("BM_CleanupOldEntries", BM_CleanupOldEntries)
+      ->Args({100, 0})
+      ->Args({1000, 0})
+      ->Args({1000, 1000})
+      ->UseManualTime();
+}
+
+
+}  // namespace
+
+
+int main(int argc, char** argv) {
+  benchmark::Initialize(&argc, argv);
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  evthread_use_pthreads();
+  ConfigureSerializerForV1CT();
+  RegisterBenchmarks();
+  benchmark::RunSpecifiedBenchmarks();
+  return 0;
+}
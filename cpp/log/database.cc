@@ -1,6 +1,375 @@
 #include "log/database.h"
 
+#include <gflags/gflags.h>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "merkletree/serial_hasher.h"
+#include "merkletree/tree_hasher.h"
+
+using std::condition_variable;
+using std::deque;
+using std::future;
+using std::lock_guard;
+using std::make_shared;
+using std::move;
+using std::mutex;
+using std::pair;
+using std::promise;
+using std::set;
+using std::shared_ptr;
+using std::string;
+using std::unique_lock;
+using std::unique_ptr;
+using std::vector;
+
+DEFINE_bool(db_store_serialized_entries, false,
+            "store new entries along with their encodings for get-entries, "
+            "so that they do not have to be encoded again for every "
+            "request");
+DEFINE_bool(db_store_leaf_hashes, false,
+            "store new entries along with their Merkle leaf hashes, so "
+            "that building the tree from the database does not have to "
+            "hash them again");
+DEFINE_bool(db_deduplicate_chains, false,
+            "store the certificates of the chains of new entries once, "
+            "apart from the entries, which only refer to them by hash");
+
 namespace cert_trans {
+namespace {
+
+
+// Returns |logged| with its encodings and leaf hash stored, if it
+// should have them.
+const LoggedEntry& MaybeStoreSerialized(const LoggedEntry& logged,
+                                        LoggedEntry* copy) {
+  const bool store_serialized(FLAGS_db_store_serialized_entries &&
+                              !logged.has_serialized());
+  const bool store_leaf_hash(FLAGS_db_store_leaf_hashes &&
+                             !logged.has_leaf_hash());
+  if (!store_serialized && !store_leaf_hash) {
+    return logged;
+  }
+  copy->CopyFrom(logged);
+  if (store_serialized && !copy->StoreSerialized()) {
+    LOG(WARNING) << "Failed to serialize entry @ "
+                 << logged.sequence_number();
+  }
+  static const TreeHasher* const hasher(
+      new TreeHasher(unique_ptr<Sha256Hasher>(new Sha256Hasher)));
+  if (store_leaf_hash && !copy->StoreLeafHash(*hasher)) {
+    LOG(WARNING) << "Failed to hash entry @ " << logged.sequence_number();
+  }
+  return *copy;
+}
+
+
+class BoundedIterator : public ReadOnlyDatabase::Iterator {
+ public:
+  BoundedIterator(unique_ptr<ReadOnlyDatabase::Iterator> it, int64_t end_index)
+      : it_(move(it)), end_index_(end_index) {
+  }
+
+  bool GetNextEntry(LoggedEntry* entry) override {
+    return it_->GetNextEntry(entry) && entry->sequence_number() < end_index_;
+  }
+
+  size_t GetNextEntries(size_t max_entries,
+                        vector<LoggedEntry>* entries) override {
+    it_->GetNextEntries(max_entries, entries);
+    // The entries are in order, so only the last ones can be past the end.
+    while (!entries->empty() &&
+           entries->back().sequence_number() >= end_index_) {
+      entries->pop_back();
+    }
+    return entries->size();
+  }
+
+ private:
+  const unique_ptr<ReadOnlyDatabase::Iterator> it_;
+  const int64_t end_index_;
+};
+
+
+// Reads the entries of another iterator on a thread of its own, into a
+// queue of up to |readahead| entries.
+class ReadaheadIterator : public ReadOnlyDatabase::Iterator {
+ public:
+  ReadaheadIterator(unique_ptr<ReadOnlyDatabase::Iterator> it,
+                    size_t readahead)
+      : it_(move(it)),
+        readahead_(readahead),
+        done_(false),
+        cancelled_(false),
+        thread_(&ReadaheadIterator::Run, this) {
+    CHECK_GT(readahead_, 0U);
+  }
+
+  ~ReadaheadIterator() {
+    {
+      lock_guard<mutex> lock(lock_);
+      cancelled_ = true;
+    }
+    not_full_.notify_one();
+    thread_.join();
+  }
+
+  bool GetNextEntry(LoggedEntry* entry) override {
+    CHECK_NOTNULL(entry);
+    unique_lock<mutex> lock(lock_);
+    not_empty_.wait(lock, [this]() { return !entries_.empty() || done_; });
+    if (entries_.empty()) {
+      return false;
+    }
+
+    entry->Swap(&entries_.front());
+    Recycle();
+    lock.unlock();
+    not_full_.notify_one();
+    return true;
+  }
+
+  // Takes the entries queued so far under a single lock, rather than
+  // one at a time.
+  size_t GetNextEntries(size_t max_entries,
+                        vector<LoggedEntry>* entries) override {
+    CHECK_NOTNULL(entries);
+    if (entries->size() < max_entries) {
+      entries->resize(max_entries);
+    }
+    size_t count(0);
+    unique_lock<mutex> lock(lock_);
+    while (count < max_entries) {
+      not_empty_.wait(lock, [this]() { return !entries_.empty() || done_; });
+      if (entries_.empty()) {
+        break;
+      }
+      for (; count < max_entries && !entries_.empty(); ++count) {
+        (*entries)[count].Swap(&entries_.front());
+        Recycle();
+      }
+      not_full_.notify_one();
+    }
+    lock.unlock();
+    entries->resize(count);
+    return count;
+  }
+
+ private:
+  // How many entries are read from |it_| at a time.
+  static const size_t kBatchSize = 64;
+
+  // Moves the front of |entries_|, which the caller has swapped its
+  // old entry into, to |spare_|. Must be called with |lock_|.
+  void Recycle() {
+    if (spare_.size() < readahead_) {
+      spare_.emplace_back();
+      spare_.back().Swap(&entries_.front());
+    }
+    entries_.pop_front();
+  }
+
+  void Run() {
+    const size_t batch_size(std::min(readahead_, kBatchSize));
+    vector<LoggedEntry> batch;
+    while (true) {
+      const size_t count(it_->GetNextEntries(batch_size, &batch));
+
+      unique_lock<mutex> lock(lock_);
+      not_full_.wait(lock, [this, count]() {
+        return entries_.size() + count <= readahead_ || cancelled_;
+      });
+      if (cancelled_) {
+        return;
+      }
+      for (LoggedEntry& entry : batch) {
+        entries_.emplace_back();
+        entries_.back().Swap(&entry);
+        // The next batch is parsed into the buffers of entries the
+        // caller is done with, rather than into new ones.
+        if (!spare_.empty()) {
+          entry.Swap(&spare_.back());
+          spare_.pop_back();
+        }
+      }
+      if (count < batch_size) {
+        done_ = true;
+      }
+      lock.unlock();
+      not_empty_.notify_one();
+      if (count < batch_size) {
+        return;
+      }
+    }
+  }
+
+  const unique_ptr<ReadOnlyDatabase::Iterator> it_;
+  const size_t readahead_;
+
+  mutex lock_;
+  condition_variable not_empty_;
+  condition_variable not_full_;
+  deque<LoggedEntry> entries_;
+  // Entries the caller is done with, whose messages and strings still
+  // have their memory allocated.
+  deque<LoggedEntry> spare_;
+  bool done_;
+  bool cancelled_;
+
+  // Keep this last, so that the thread starts once everything else is
+  // initialized.
+  std::thread thread_;
+};
+
+
+}  // namespace
+
+
+size_t ReadOnlyDatabase::Iterator::GetNextEntries(
+    size_t max_entries, vector<LoggedEntry>* entries) {
+  CHECK_NOTNULL(entries);
+  if (entries->size() < max_entries) {
+    entries->resize(max_entries);
+  }
+  size_t count(0);
+  while (count < max_entries && GetNextEntry(&(*entries)[count])) {
+    ++count;
+  }
+  entries->resize(count);
+  return count;
+}
+
+
+vector<ReadOnlyDatabase::LookupResult> ReadOnlyDatabase::LookupByHashes(
+    const vector<string>& hashes, vector<LoggedEntry>* results) const {
+  CHECK_NOTNULL(results)->resize(hashes.size());
+  vector<LookupResult> found;
+  found.reserve(hashes.size());
+  for (size_t i = 0; i < hashes.size(); ++i) {
+    found.push_back(LookupByHash(hashes[i], &(*results)[i]));
+  }
+  return found;
+}
+
+
+vector<ReadOnlyDatabase::LookupResult> ReadOnlyDatabase::LookupByIndices(
+    const vector<int64_t>& sequence_numbers,
+    vector<LoggedEntry>* results) const {
+  CHECK_NOTNULL(results)->resize(sequence_numbers.size());
+  vector<LookupResult> found;
+  found.reserve(sequence_numbers.size());
+  for (size_t i = 0; i < sequence_numbers.size(); ++i) {
+    found.push_back(LookupByIndex(sequence_numbers[i], &(*results)[i]));
+  }
+  return found;
+}
+
+
+unique_ptr<ReadOnlyDatabase::Iterator> ReadOnlyDatabase::ScanEntries(
+    int64_t start_index, int64_t end_index, const ScanOptions& options) const {
+  CHECK_GE(start_index, 0);
+  unique_ptr<Iterator> it(
+      ScanEntries_(start_index, end_index, options.fill_cache));
+  if (options.readahead > 0) {
+    it.reset(new ReadaheadIterator(move(it), options.readahead));
+  }
+  return it;
+}
+
+
+unique_ptr<ReadOnlyDatabase::Iterator> ReadOnlyDatabase::ScanEntries_(
+    int64_t start_index, int64_t end_index, bool) const {
+  return unique_ptr<Iterator>(
+      new BoundedIterator(ScanEntries(start_index), end_index));
+}
+
+
+// static
+vector<pair<int64_t, int64_t>> ReadOnlyDatabase::ToRanges(
+    const set<int64_t>& sequence_numbers) {
+  vector<pair<int64_t, int64_t>> ranges;
+  for (const int64_t sequence_number : sequence_numbers) {
+    if (ranges.empty() || ranges.back().second != sequence_number) {
+      ranges.emplace_back(sequence_number, sequence_number);
+    }
+    ++ranges.back().second;
+  }
+  return ranges;
+}
+
+
+Database::~Database() {
+  lock_guard<mutex> lock(write_thread_lock_);
+  CHECK_EQ(0, pending_writes_) << "destroying a database with pending writes";
+}
+
+
+Database::WriteResult Database::CreateSequencedEntry(
+    const LoggedEntry& logged) {
+  CHECK(logged.has_sequence_number());
+  CHECK_GE(logged.sequence_number(), 0);
+  LoggedEntry copy;
+  return CreateSequencedEntry_(MaybeStoreSerialized(logged, &copy));
+}
+
+
+vector<Database::WriteResult> Database::CreateSequencedEntries(
+    const vector<LoggedEntry>& entries) {
+  for (const auto& logged : entries) {
+    CHECK(logged.has_sequence_number());
+    CHECK_GE(logged.sequence_number(), 0);
+  }
+  if (!FLAGS_db_store_serialized_entries && !FLAGS_db_store_leaf_hashes) {
+    return CreateSequencedEntries_(entries);
+  }
+
+  vector<LoggedEntry> copies(entries.size());
+  for (size_t i = 0; i < entries.size(); ++i) {
+    const LoggedEntry& logged(MaybeStoreSerialized(entries[i], &copies[i]));
+    if (&logged != &copies[i]) {
+      copies[i].CopyFrom(logged);
+    }
+  }
+  return CreateSequencedEntries_(copies);
+}
+
+
+future<vector<Database::WriteResult>>
+Database::CreateSequencedEntriesAsync(vector<LoggedEntry> entries) {
+  const shared_ptr<vector<LoggedEntry>> batch(
+      make_shared<vector<LoggedEntry>>(move(entries)));
+  const shared_ptr<promise<vector<WriteResult>>> results(
+      make_shared<promise<vector<WriteResult>>>());
+  lock_guard<mutex> lock(write_thread_lock_);
+  if (!write_thread_) {
+    // A single thread keeps the writes in order.
+    write_thread_.reset(new ThreadPool(1));
+  }
+  ++pending_writes_;
+  write_thread_->Add([this, batch, results]() {
+    vector<WriteResult> batch_results(CreateSequencedEntries(*batch));
+    {
+      lock_guard<mutex> lock(write_thread_lock_);
+      --pending_writes_;
+    }
+    results->set_value(move(batch_results));
+  });
+  return results->get_future();
+}
+
+
+vector<Database::WriteResult> Database::CreateSequencedEntries_(
+    const vector<LoggedEntry>& entries) {
+  vector<WriteResult> results;
+  results.reserve(entries.size());
+  for (const auto& logged : entries) {
+    results.push_back(CreateSequencedEntry_(logged));
+  }
+  return results;
+}
 
 
 DatabaseNotifierHelper::~DatabaseNotifierHelper() {
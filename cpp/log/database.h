@@ -4,11 +4,17 @@
 #include <glog/logging.h>
 #include <stdint.h>
 #include <functional>
+#include <future>
 #include <memory>
+#include <mutex>
 #include <set>
+#include <string>
+#include <utility>
+#include <vector>
 
 #include "log/logged_entry.h"
 #include "proto/ct.pb.h"
+#include "util/thread_pool.h"
 
 namespace cert_trans {
 
@@ -44,6 +50,24 @@ class ReadOnlyDatabase {
     // If there is an entry available, fill *entry and return true,
     // otherwise return false.
     virtual bool GetNextEntry(LoggedEntry* entry) = 0;
+
+    // Read up to |max_entries| entries into *entries, resize it to the
+    // number read and return that number. Fewer than |max_entries| are
+    // read only once there are no more entries. The LoggedEntry
+    // objects already in *entries are reused, so that callers scanning
+    // in batches with the same vector do not allocate every entry anew.
+    virtual size_t GetNextEntries(size_t max_entries,
+                                  std::vector<LoggedEntry>* entries);
+  };
+
+  struct ScanOptions {
+    // How many entries a background thread reads, and parses, ahead of
+    // the caller. With 0, each entry is read by GetNextEntry().
+    size_t readahead = 0;
+    // Whether the entries read are kept in the database's block
+    // cache. Bulk scans should turn this off, so that they do not
+    // evict the entries that are actually looked up often.
+    bool fill_cache = true;
   };
 
   virtual ~ReadOnlyDatabase() = default;
@@ -59,17 +83,42 @@ class ReadOnlyDatabase {
   virtual LookupResult LookupByIndex(int64_t sequence_number,
                                      LoggedEntry* result) const = 0;
 
+  // Look up several entries at once, with the same results as calling
+  // LookupByHash() on each of |hashes| in order. *results is resized to
+  // the number of hashes, and the entries found written to the matching
+  // elements. Implementations can read the whole batch at once, which
+  // is much cheaper than one entry at a time; the default
+  // implementation looks them up one by one.
+  virtual std::vector<LookupResult> LookupByHashes(
+      const std::vector<std::string>& hashes,
+      std::vector<LoggedEntry>* results) const;
+
+  // Likewise, for LookupByIndex().
+  virtual std::vector<LookupResult> LookupByIndices(
+      const std::vector<int64_t>& sequence_numbers,
+      std::vector<LoggedEntry>* results) const;
+
   // Return the tree head with the freshest timestamp.
   virtual LookupResult LatestTreeHead(ct::SignedTreeHead* result) const = 0;
 
   // Scan the entries, starting with the given index.
   virtual std::unique_ptr<Iterator> ScanEntries(int64_t start_index) const = 0;
 
+  // Scan the entries with an index in [start_index, end_index).
+  std::unique_ptr<Iterator> ScanEntries(int64_t start_index, int64_t end_index,
+                                        const ScanOptions& options) const;
+
   // Return the number of entries of contiguous entries (what could be
   // put in a signed tree head). This can be greater than the tree
   // size returned by LatestTreeHead.
   virtual int64_t TreeSize() const = 0;
 
+  // Return the ranges [first, second) of the entries stored beyond the
+  // contiguous ones (as can be written out of order by the fetcher), in
+  // order. Together with TreeSize(), this tells which entries are still
+  // missing, e.g. after a restart.
+  virtual std::vector<std::pair<int64_t, int64_t>> SparseRanges() const = 0;
+
   // Add/remove a callback to be called when a new tree head is
   // available. The pointer is used as a key, so it should be the same
   // in matching add/remove calls.
@@ -85,8 +134,31 @@ class ReadOnlyDatabase {
   virtual void InitializeNode(const std::string& node_id) = 0;
   virtual LookupResult NodeId(std::string* node_id) = 0;
 
+  // Look up a tile of Merkle tree node hashes (see
+  // merkletree/tiled_merkle_tree.h) by tile level and index. Returns
+  // the version of the tile written last.
+  virtual LookupResult LookupTile(int level, int64_t index,
+                                  std::string* hashes) const = 0;
+
+  // Look up the frontier of the tree of the first |tree_size| entries,
+  // as written by the signer with its tree heads (see WriteFrontier()).
+  virtual LookupResult LookupFrontier(int64_t tree_size,
+                                      std::string* hashes) const = 0;
+
  protected:
   ReadOnlyDatabase() = default;
+
+  // Returns the ranges of consecutive sequence numbers in
+  // |sequence_numbers|, for SparseRanges().
+  static std::vector<std::pair<int64_t, int64_t>> ToRanges(
+      const std::set<int64_t>& sequence_numbers);
+
+  // Returns an iterator for ScanEntries(), without readahead. The
+  // default implementation stops ScanEntries(start_index) at
+  // |end_index|, and ignores |fill_cache|.
+  virtual std::unique_ptr<Iterator> ScanEntries_(int64_t start_index,
+                                                 int64_t end_index,
+                                                 bool fill_cache) const;
 };
 
 
@@ -107,17 +179,34 @@ class Database : public ReadOnlyDatabase {
     MISSING_TREE_HEAD_TIMESTAMP,
   };
 
-  virtual ~Database() = default;
+  // REQUIRES: all the writes started with CreateSequencedEntriesAsync()
+  // are complete.
+  virtual ~Database();
   Database(const Database&) = delete;
   Database& operator=(const Database&) = delete;
 
   // Attempt to create a new entry with the status LOGGED.
   // Fail if an entry with this hash already exists.
-  WriteResult CreateSequencedEntry(const LoggedEntry& logged) {
-    CHECK(logged.has_sequence_number());
-    CHECK_GE(logged.sequence_number(), 0);
-    return CreateSequencedEntry_(logged);
-  }
+  //
+  // With --db_store_serialized_entries, the entry is stored with its
+  // encodings for get-entries (see LoggedEntry::StoreSerialized()).
+  // With --db_deduplicate_chains, its chain is stored apart from it
+  // (see ChainCertStore), and put back when it is read.
+  WriteResult CreateSequencedEntry(const LoggedEntry& logged);
+
+  // Create several entries, with the same result as calling
+  // CreateSequencedEntry() on each of them in order, and return the
+  // result for each entry. Implementations can write the whole batch
+  // at once, which is much cheaper than one entry at a time.
+  std::vector<WriteResult> CreateSequencedEntries(
+      const std::vector<LoggedEntry>& entries);
+
+  // Like CreateSequencedEntries(), but the entries are written on a
+  // thread of the database, in the order of the calls, so that the
+  // caller can go on while they reach the disk. The results are
+  // available from the returned future once the entries are written.
+  std::future<std::vector<WriteResult>> CreateSequencedEntriesAsync(
+      std::vector<LoggedEntry> entries);
 
   // Attempt to write a tree head. Fails only if a tree head with this
   // timestamp already exists (i.e., |timestamp| is primary key). Does
@@ -128,13 +217,45 @@ class Database : public ReadOnlyDatabase {
     return WriteTreeHead_(sth);
   }
 
+  // Write a tile of Merkle tree node hashes. Tiles at the right edge of
+  // the tree grow as leaves are added, so this overwrites any existing
+  // tile with the same level and index.
+  WriteResult WriteTile(int level, int64_t index, const std::string& hashes) {
+    CHECK_GE(level, 0);
+    CHECK_GE(index, 0);
+    return WriteTile_(level, index, hashes);
+  }
+
+  // Write the frontier of the tree of the first |tree_size| entries
+  // (see CompactMerkleTree::Frontier()): the hashes of its non-empty
+  // levels, back to back, lowest level first. A signer can pick up
+  // from there instead of hashing all the entries again. Overwrites
+  // any existing frontier for the same size.
+  WriteResult WriteFrontier(int64_t tree_size, const std::string& hashes) {
+    CHECK_GE(tree_size, 0);
+    return WriteFrontier_(tree_size, hashes);
+  }
+
  protected:
   Database() = default;
 
   // See the inline methods with similar names defined above for more
   // documentation.
   virtual WriteResult CreateSequencedEntry_(const LoggedEntry& logged) = 0;
+  // The default implementation creates the entries one by one.
+  virtual std::vector<WriteResult> CreateSequencedEntries_(
+      const std::vector<LoggedEntry>& entries);
   virtual WriteResult WriteTreeHead_(const ct::SignedTreeHead& sth) = 0;
+  virtual WriteResult WriteTile_(int level, int64_t index,
+                                 const std::string& hashes) = 0;
+  virtual WriteResult WriteFrontier_(int64_t tree_size,
+                                     const std::string& hashes) = 0;
+
+ private:
+  std::mutex write_thread_lock_;
+  // Started by the first CreateSequencedEntriesAsync() call.
+  std::unique_ptr<ThreadPool> write_thread_;
+  int pending_writes_ = 0;
 };
 
 
@@ -0,0 +1,356 @@
+// Benchmarks for the Database implementations, to compare them with
+// each other and with different flags (e.g. --leveldb_compress_entries).
+// Run with --help for the options of the benchmark library, e.g.
+// --benchmark_filter=<regex>, and --benchmark_format=json or
+// --benchmark_out=<file> for machine-readable results.
+//
+// The time reported is that of the database operations only. Besides
+// throughput, every benchmark reports the p50, p99 and p999 latencies
+// of its operations in microseconds (averaged over threads, for the
+// multi-threaded ones).
+#include <benchmark/benchmark.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "log/database.h"
+#include "log/file_db.h"
+#include "log/leveldb_db.h"
+#include "log/logged_entry.h"
+#include "log/sqlite_db.h"
+#include "log/test_db.h"
+#include "log/test_signer.h"
+#include "proto/cert_serializer.h"
+
+DEFINE_int32(database_bench_size, 10000,
+             "Number of entries in the databases that the lookup, scan and "
+             "mixed benchmarks read from. Entries are a few kB each.");
+
+using cert_trans::Database;
+using cert_trans::FileDB;
+using cert_trans::LevelDB;
+using cert_trans::LoggedEntry;
+using cert_trans::SQLiteDB;
+using std::atomic;
+using std::chrono::duration;
+using std::chrono::steady_clock;
+using std::lock_guard;
+using std::mt19937_64;
+using std::mutex;
+using std::string;
+using std::vector;
+
+namespace {
+
+
+// Times the operations of a benchmark, one per iteration, and reports
+// their latency percentiles when destroyed. Benchmarks using it must
+// be registered with UseManualTime().
+class Latencies {
+ public:
+  explicit Latencies(benchmark::State* state) : state_(state) {
+  }
+
+  ~Latencies() {
+    if (latencies_.empty()) {
+      return;
+    }
+    std::sort(latencies_.begin(), latencies_.end());
+    Report("p50_us", 0.5);
+    Report("p99_us", 0.99);
+    Report("p999_us", 0.999);
+  }
+
+  template <class Operation>
+  void Time(const Operation& operation) {
+    const steady_clock::time_point start(steady_clock::now());
+    operation();
+    const duration<double> elapsed(steady_clock::now() - start);
+    state_->SetIterationTime(elapsed.count());
+    latencies_.push_back(elapsed.count());
+  }
+
+ private:
+  void Report(const string& name, double percentile) {
+    const size_t index(std::min(
+        latencies_.size() - 1,
+        static_cast<size_t>(percentile * latencies_.size())));
+    state_->counters[name] = benchmark::Counter(
+        latencies_[index] * 1e6, benchmark::Counter::kAvgThreads);
+  }
+
+  benchmark::State* const state_;
+  vector<double> latencies_;
+};
+
+
+// Creates the entries written by the benchmarks, which may do so from
+// several threads.
+class EntryFactory {
+ public:
+  void Create(int64_t sequence_number, LoggedEntry* entry) {
+    lock_guard<mutex> lock(lock_);
+    test_signer_.CreateUniqueFakeSignature(entry);
+    entry->set_sequence_number(sequence_number);
+  }
+
+ private:
+  mutex lock_;
+  TestSigner test_signer_;
+};
+
+
+EntryFactory* Entries() {
+  static EntryFactory* const entries(new EntryFactory);
+  return entries;
+}
+
+
+// A database of --database_bench_size entries, shared by the
+// benchmarks of each implementation that read from it. The mixed
+// benchmarks append to it.
+template <class T>
+class FilledDB {
+ public:
+  static FilledDB* Get() {
+    // Removed, with its files, when the program exits.
+    static FilledDB filled;
+    return &filled;
+  }
+
+  T* db() const {
+    return test_db_.db();
+  }
+
+  const string& hash(int64_t sequence_number) const {
+    return hashes_[sequence_number];
+  }
+
+  int64_t size() const {
+    return hashes_.size();
+  }
+
+  int64_t NextSequenceNumber() {
+    return next_sequence_number_++;
+  }
+
+ private:
+  FilledDB() {
+    const int64_t size(FLAGS_database_bench_size);
+    CHECK_GT(size, 0);
+    vector<LoggedEntry> batch;
+    for (int64_t i = 0; i < size; ++i) {
+      batch.emplace_back();
+      Entries()->Create(i, &batch.back());
+      hashes_.push_back(batch.back().Hash());
+      if (batch.size() == 1000 || i == size - 1) {
+        for (Database::WriteResult result :
+             db()->CreateSequencedEntries(batch)) {
+          CHECK_EQ(Database::OK, result);
+        }
+        batch.clear();
+      }
+    }
+    next_sequence_number_ = size;
+  }
+
+  TestDB<T> test_db_;
+  vector<string> hashes_;
+  atomic<int64_t> next_sequence_number_;
+};
+
+
+// Random entries of a filled database, different for every thread.
+class RandomIndex {
+ public:
+  RandomIndex(const benchmark::State& state, int64_t size)
+      : random_(state.thread_index()), index_(0, size - 1) {
+  }
+
+  int64_t operator()() {
+    return index_(random_);
+  }
+
+ private:
+  mt19937_64 random_;
+  std::uniform_int_distribution<int64_t> index_;
+};
+
+
+// Writes entries one at a time to an empty database.
+template <class T>
+void BM_SequentialInsert(benchmark::State& state) {
+  TestDB<T> test_db;
+  Latencies latencies(&state);
+  LoggedEntry entry;
+  int64_t sequence_number(0);
+  for (auto _ : state) {
+    Entries()->Create(sequence_number++, &entry);
+    latencies.Time([&test_db, &entry]() {
+      CHECK_EQ(Database::OK, test_db.db()->CreateSequencedEntry(entry));
+    });
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+
+// Writes entries in batches of state.range(0) to an empty database.
+// The latencies are those of whole batches.
+template <class T>
+void BM_BatchedInsert(benchmark::State& state) {
+  TestDB<T> test_db;
+  Latencies latencies(&state);
+  vector<LoggedEntry> batch(state.range(0));
+  int64_t sequence_number(0);
+  for (auto _ : state) {
+    for (LoggedEntry& entry : batch) {
+      Entries()->Create(sequence_number++, &entry);
+    }
+    latencies.Time([&test_db, &batch]() {
+      for (Database::WriteResult result :
+           test_db.db()->CreateSequencedEntries(batch)) {
+        CHECK_EQ(Database::OK, result);
+      }
+    });
+  }
+  state.SetItemsProcessed(state.iterations() * batch.size());
+}
+
+
+template <class T>
+void BM_LookupByHash(benchmark::State& state) {
+  FilledDB<T>* const filled(FilledDB<T>::Get());
+  RandomIndex random_index(state, filled->size());
+  Latencies latencies(&state);
+  LoggedEntry entry;
+  for (auto _ : state) {
+    const string& hash(filled->hash(random_index()));
+    latencies.Time([filled, &hash, &entry]() {
+      CHECK_EQ(Database::LOOKUP_OK, filled->db()->LookupByHash(hash, &entry));
+    });
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+
+template <class T>
+void BM_LookupByIndex(benchmark::State& state) {
+  FilledDB<T>* const filled(FilledDB<T>::Get());
+  RandomIndex random_index(state, filled->size());
+  Latencies latencies(&state);
+  LoggedEntry entry;
+  for (auto _ : state) {
+    const int64_t index(random_index());
+    latencies.Time([filled, index, &entry]() {
+      CHECK_EQ(Database::LOOKUP_OK,
+               filled->db()->LookupByIndex(index, &entry));
+    });
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+
+// Scans state.range(0) entries from a random position, as get-entries
+// does. The latencies are those of whole scans.
+template <class T>
+void BM_ScanEntries(benchmark::State& state) {
+  FilledDB<T>* const filled(FilledDB<T>::Get());
+  const int64_t length(std::min<int64_t>(state.range(0), filled->size()));
+  RandomIndex random_index(state, filled->size() - length + 1);
+  Latencies latencies(&state);
+  vector<LoggedEntry> entries;
+  for (auto _ : state) {
+    const int64_t start(random_index());
+    latencies.Time([filled, start, length, &entries]() {
+      CHECK_EQ(static_cast<size_t>(length),
+               filled->db()
+                   ->ScanEntries(start, start + length, Database::ScanOptions())
+                   ->GetNextEntries(length, &entries));
+    });
+  }
+  state.SetItemsProcessed(state.iterations() * length);
+}
+
+
+// Looks up random entries by index, and writes new entries in
+// state.range(0) percent of the iterations.
+template <class T>
+void BM_Mixed(benchmark::State& state) {
+  FilledDB<T>* const filled(FilledDB<T>::Get());
+  RandomIndex random_index(state, filled->size());
+  mt19937_64 random_percent(state.thread_index());
+  Latencies latencies(&state);
+  LoggedEntry entry;
+  for (auto _ : state) {
+    if (static_cast<int64_t>(random_percent() % 100) < state.range(0)) {
+      Entries()->Create(filled->NextSequenceNumber(), &entry);
+      latencies.Time([filled, &entry]() {
+        CHECK_EQ(Database::OK, filled->db()->CreateSequencedEntry(entry));
+      });
+    } else {
+      const int64_t index(random_index());
+      latencies.Time([filled, index, &entry]() {
+        CHECK_EQ(Database::LOOKUP_OK,
+                 filled->db()->LookupByIndex(index, &entry));
+      });
+    }
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+
+template <class T>
+void RegisterBenchmarks(const string& name) {
+  benchmark::RegisterBenchmark(("BM_SequentialInsert/" + name).c_str(),
+                               BM_SequentialInsert<T>)
+      ->UseManualTime();
+  benchmark::RegisterBenchmark(("BM_BatchedInsert/" + name).c_str(),
+                               BM_BatchedInsert<T>)
+      ->Arg(16)
+      ->Arg(256)
+      ->UseManualTime();
+  benchmark::RegisterBenchmark(("BM_LookupByHash/" + name).c_str(),
+                               BM_LookupByHash<T>)
+      ->ThreadRange(1, 16)
+      ->UseManualTime();
+  benchmark::RegisterBenchmark(("BM_LookupByIndex/" + name).c_str(),
+                               BM_LookupByIndex<T>)
+      ->ThreadRange(1, 16)
+      ->UseManualTime();
+  benchmark::RegisterBenchmark(("BM_ScanEntries/" + name).c_str(),
+                               BM_ScanEntries<T>)
+      ->Arg(1)
+      ->Arg(1000)
+      ->ThreadRange(1, 4)
+      ->UseManualTime();
+  benchmark::RegisterBenchmark(("BM_Mixed/" + name).c_str(), BM_Mixed<T>)
+      ->Arg(1)
+      ->Arg(10)
+      ->Arg(50)
+      ->ThreadRange(1, 16)
+      ->UseManualTime();
+}
+
+
+}  // namespace
+
+
+int main(int argc, char** argv) {
+  benchmark::Initialize(&argc, argv);
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  ConfigureSerializerForV1CT();
+  RegisterBenchmarks<FileDB>("FileDB");
+  RegisterBenchmarks<SQLiteDB>("SQLiteDB");
+  RegisterBenchmarks<LevelDB>("LevelDB");
+  benchmark::RunSpecifiedBenchmarks();
+  return 0;
+}
@@ -1,7 +1,13 @@
 /* -*- indent-tabs-mode: nil -*- */
+#include <gflags/gflags.h>
 #include <gtest/gtest.h>
+#include <leveldb/db.h>
+#include <stdio.h>
+#include <unistd.h>
 #include <set>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "log/database.h"
 #include "log/file_db.h"
@@ -12,21 +18,40 @@
 #include "log/test_db.h"
 #include "log/test_signer.h"
 #include "proto/cert_serializer.h"
+#include "util/status_test_util.h"
 #include "util/testing.h"
 #include "util/util.h"
 
+DECLARE_bool(db_deduplicate_chains);
+DECLARE_bool(db_store_leaf_hashes);
+DECLARE_bool(db_store_serialized_entries);
+DECLARE_bool(file_db_compress_entries);
+DECLARE_bool(leveldb_compress_entries);
+DECLARE_int32(leveldb_archive_interval_secs);
+DECLARE_int32(leveldb_archive_keep_entries);
+DECLARE_int32(leveldb_archive_range_size);
+DECLARE_string(leveldb_archive_dir);
+DECLARE_bool(leveldb_upgrade_key_schema);
+DECLARE_bool(sqlite_compress_entries);
+DECLARE_int32(compression_dictionary_samples);
+
 // TODO(benl): Introduce a test |Logged| type.
 
 namespace {
 
 using cert_trans::Database;
 using cert_trans::FileDB;
+using cert_trans::FileStorage;
 using cert_trans::LevelDB;
 using cert_trans::LoggedEntry;
+#ifdef HAVE_ROCKSDB
+using cert_trans::RocksDB;
+#endif
 using cert_trans::SQLiteDB;
 using ct::SignedTreeHead;
 using std::string;
 using std::unique_ptr;
+using std::vector;
 
 
 template <class T>
@@ -46,7 +71,11 @@ class DBTest : public ::testing::Test {
   TestSigner test_signer_;
 };
 
+#ifdef HAVE_ROCKSDB
+typedef testing::Types<FileDB, SQLiteDB, LevelDB, RocksDB> Databases;
+#else
 typedef testing::Types<FileDB, SQLiteDB, LevelDB> Databases;
+#endif
 
 
 template <class T>
@@ -83,6 +112,48 @@ TYPED_TEST(DBTest, CreateSequenced) {
 }
 
 
+TYPED_TEST(DBTest, LookupBatches) {
+  vector<LoggedEntry> logged_certs(3);
+  for (auto& logged_cert : logged_certs) {
+    this->test_signer_.CreateUnique(&logged_cert);
+    EXPECT_EQ(Database::OK, this->db()->CreateSequencedEntry(logged_cert));
+  }
+
+  // In any order, with repeats and missing entries.
+  vector<LoggedEntry> lookup_certs;
+  const vector<Database::LookupResult> by_hash(this->db()->LookupByHashes(
+      {logged_certs[2].Hash(), this->test_signer_.UniqueHash(),
+       logged_certs[0].Hash(), logged_certs[2].Hash()},
+      &lookup_certs));
+  ASSERT_EQ(4U, by_hash.size());
+  ASSERT_EQ(4U, lookup_certs.size());
+  EXPECT_EQ(Database::LOOKUP_OK, by_hash[0]);
+  TestSigner::TestEqualLoggedCerts(logged_certs[2], lookup_certs[0]);
+  EXPECT_EQ(Database::NOT_FOUND, by_hash[1]);
+  EXPECT_EQ(Database::LOOKUP_OK, by_hash[2]);
+  TestSigner::TestEqualLoggedCerts(logged_certs[0], lookup_certs[2]);
+  EXPECT_EQ(Database::LOOKUP_OK, by_hash[3]);
+  TestSigner::TestEqualLoggedCerts(logged_certs[2], lookup_certs[3]);
+
+  const vector<Database::LookupResult> by_index(this->db()->LookupByIndices(
+      {logged_certs[1].sequence_number(), 1000000,
+       logged_certs[1].sequence_number(), logged_certs[0].sequence_number()},
+      &lookup_certs));
+  ASSERT_EQ(4U, by_index.size());
+  ASSERT_EQ(4U, lookup_certs.size());
+  EXPECT_EQ(Database::LOOKUP_OK, by_index[0]);
+  TestSigner::TestEqualLoggedCerts(logged_certs[1], lookup_certs[0]);
+  EXPECT_EQ(Database::NOT_FOUND, by_index[1]);
+  EXPECT_EQ(Database::LOOKUP_OK, by_index[2]);
+  TestSigner::TestEqualLoggedCerts(logged_certs[1], lookup_certs[2]);
+  EXPECT_EQ(Database::LOOKUP_OK, by_index[3]);
+  TestSigner::TestEqualLoggedCerts(logged_certs[0], lookup_certs[3]);
+
+  EXPECT_TRUE(this->db()->LookupByHashes({}, &lookup_certs).empty());
+  EXPECT_TRUE(lookup_certs.empty());
+}
+
+
 TYPED_TEST(DBTest, CreateSequencedDuplicateEntry) {
   LoggedEntry logged_cert;
   this->test_signer_.CreateUnique(&logged_cert);
@@ -172,6 +243,82 @@ TYPED_TEST(DBTest, CreateSequencedDuplicateSequenceNumber) {
 }
 
 
+TYPED_TEST(DBTest, CreateSequencedEntries) {
+  LoggedEntry existing;
+  this->test_signer_.CreateUnique(&existing);
+  existing.set_sequence_number(1);
+  EXPECT_EQ(Database::OK, this->db()->CreateSequencedEntry(existing));
+
+  std::vector<LoggedEntry> entries(6);
+  for (int i = 0; i < 4; ++i) {
+    this->test_signer_.CreateUnique(&entries[i]);
+    entries[i].set_sequence_number(i);
+  }
+  // entries[1] has the same sequence number as an entry in the
+  // database, entries[4] is identical to that entry, and entries[5] has
+  // the same sequence number as an earlier entry of the batch.
+  entries[4].CopyFrom(existing);
+  this->test_signer_.CreateUnique(&entries[5]);
+  entries[5].set_sequence_number(3);
+
+  const std::vector<Database::WriteResult> results(
+      this->db()->CreateSequencedEntries(entries));
+  const std::vector<Database::WriteResult> expected{
+      Database::OK, Database::SEQUENCE_NUMBER_ALREADY_IN_USE,
+      Database::OK, Database::OK,
+      Database::OK, Database::SEQUENCE_NUMBER_ALREADY_IN_USE};
+  EXPECT_EQ(expected, results);
+  EXPECT_EQ(4, this->db()->TreeSize());
+
+  LoggedEntry lookup_cert;
+  for (int i : {0, 2, 3}) {
+    EXPECT_EQ(Database::LOOKUP_OK,
+              this->db()->LookupByIndex(i, &lookup_cert));
+    TestSigner::TestEqualLoggedCerts(entries[i], lookup_cert);
+    EXPECT_EQ(Database::LOOKUP_OK,
+              this->db()->LookupByHash(entries[i].Hash(), &lookup_cert));
+    TestSigner::TestEqualLoggedCerts(entries[i], lookup_cert);
+  }
+  EXPECT_EQ(Database::LOOKUP_OK, this->db()->LookupByIndex(1, &lookup_cert));
+  TestSigner::TestEqualLoggedCerts(existing, lookup_cert);
+  EXPECT_EQ(Database::NOT_FOUND,
+            this->db()->LookupByHash(entries[5].Hash(), nullptr));
+}
+
+
+TYPED_TEST(DBTest, CreateSequencedEntriesAsync) {
+  std::vector<LoggedEntry> entries(3);
+  for (size_t i = 0; i < entries.size(); ++i) {
+    this->test_signer_.CreateUnique(&entries[i]);
+    entries[i].set_sequence_number(i);
+  }
+  // The writes are made in order, so the second one conflicts with the
+  // first.
+  std::future<std::vector<Database::WriteResult>> first(
+      this->db()->CreateSequencedEntriesAsync(
+          std::vector<LoggedEntry>(entries.begin(), entries.begin() + 2)));
+  LoggedEntry conflicting;
+  this->test_signer_.CreateUnique(&conflicting);
+  conflicting.set_sequence_number(1);
+  std::future<std::vector<Database::WriteResult>> second(
+      this->db()->CreateSequencedEntriesAsync(
+          std::vector<LoggedEntry>{conflicting, entries[2]}));
+
+  EXPECT_EQ((std::vector<Database::WriteResult>{Database::OK, Database::OK}),
+            first.get());
+  EXPECT_EQ((std::vector<Database::WriteResult>{
+                Database::SEQUENCE_NUMBER_ALREADY_IN_USE, Database::OK}),
+            second.get());
+  EXPECT_EQ(3, this->db()->TreeSize());
+  LoggedEntry lookup_cert;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    EXPECT_EQ(Database::LOOKUP_OK,
+              this->db()->LookupByIndex(i, &lookup_cert));
+    TestSigner::TestEqualLoggedCerts(entries[i], lookup_cert);
+  }
+}
+
+
 TYPED_TEST(DBTest, TreeSize) {
   LoggedEntry logged_cert;
 
@@ -218,6 +365,33 @@ TYPED_TEST(DBTest, TreeSize) {
 }
 
 
+TYPED_TEST(DBTest, SparseRanges) {
+  typedef std::vector<std::pair<int64_t, int64_t>> Ranges;
+  EXPECT_EQ(Ranges(), this->db()->SparseRanges());
+
+  LoggedEntry logged_cert;
+  for (const int64_t sequence_number : {0, 3, 4, 7}) {
+    this->test_signer_.CreateUnique(&logged_cert);
+    logged_cert.set_sequence_number(sequence_number);
+    EXPECT_EQ(Database::OK, this->db()->CreateSequencedEntry(logged_cert));
+  }
+  EXPECT_EQ(1, this->db()->TreeSize());
+  EXPECT_EQ(Ranges({{3, 5}, {7, 8}}), this->db()->SparseRanges());
+
+  // They are found again after a restart.
+  unique_ptr<Database> db2(this->test_db_.SecondDB());
+  EXPECT_EQ(Ranges({{3, 5}, {7, 8}}), db2->SparseRanges());
+
+  for (const int64_t sequence_number : {1, 2}) {
+    this->test_signer_.CreateUnique(&logged_cert);
+    logged_cert.set_sequence_number(sequence_number);
+    EXPECT_EQ(Database::OK, db2->CreateSequencedEntry(logged_cert));
+  }
+  EXPECT_EQ(5, db2->TreeSize());
+  EXPECT_EQ(Ranges({{7, 8}}), db2->SparseRanges());
+}
+
+
 TYPED_TEST(DBTest, LookupBySequenceNumber) {
   LoggedEntry logged_cert, logged_cert2, lookup_cert, lookup_cert2;
   this->test_signer_.CreateUnique(&logged_cert);
@@ -340,6 +514,48 @@ TYPED_TEST(DBTest, Resume) {
 }
 
 
+TYPED_TEST(DBTest, ResumeTreeSize) {
+  // Contiguous entries, some written after a gap, and a duplicate.
+  std::vector<LoggedEntry> entries(8);
+  for (size_t i = 0; i < entries.size(); ++i) {
+    this->test_signer_.CreateUnique(&entries[i]);
+    entries[i].set_sequence_number(i);
+  }
+  entries[7].CopyFrom(entries[1]);
+  entries[7].set_sequence_number(7);
+  for (int i : {0, 1, 2, 3, 6, 7}) {
+    EXPECT_EQ(Database::OK, this->db()->CreateSequencedEntry(entries[i]));
+  }
+  SignedTreeHead sth;
+  this->test_signer_.CreateUnique(&sth);
+  EXPECT_EQ(Database::OK, this->db()->WriteTreeHead(sth));
+
+  unique_ptr<Database> db2(this->test_db_.SecondDB());
+  EXPECT_EQ(4, db2->TreeSize());
+  LoggedEntry lookup_cert;
+  EXPECT_EQ(Database::LOOKUP_OK,
+            db2->LookupByHash(entries[1].Hash(), &lookup_cert));
+  EXPECT_EQ(1, lookup_cert.sequence_number());
+  EXPECT_EQ(Database::NOT_FOUND, db2->LookupByHash(entries[4].Hash(), nullptr));
+
+  for (int i : {4, 5}) {
+    EXPECT_EQ(Database::OK, db2->CreateSequencedEntry(entries[i]));
+  }
+  EXPECT_EQ(8, db2->TreeSize());
+  this->test_signer_.CreateUnique(&sth);
+  EXPECT_EQ(Database::OK, db2->WriteTreeHead(sth));
+
+  db2.reset();
+  db2.reset(this->test_db_.SecondDB());
+  EXPECT_EQ(8, db2->TreeSize());
+  for (size_t i = 0; i < 7; ++i) {
+    EXPECT_EQ(Database::LOOKUP_OK,
+              db2->LookupByHash(entries[i].Hash(), &lookup_cert));
+    TestSigner::TestEqualLoggedCerts(entries[i], lookup_cert);
+  }
+}
+
+
 TYPED_TEST(DBTest, ResumeEmpty) {
   Database* db2 = this->test_db_.SecondDB();
 
@@ -368,6 +584,357 @@ TYPED_TEST(DBTest, NoNodeIdSet) {
 }
 
 
+TYPED_TEST(DBTest, Tiles) {
+  string tile;
+  EXPECT_EQ(Database::NOT_FOUND, this->db()->LookupTile(0, 0, &tile));
+
+  EXPECT_EQ(Database::OK, this->db()->WriteTile(0, 0, "partial"));
+  EXPECT_EQ(Database::OK, this->db()->WriteTile(0, 1, "other index"));
+  EXPECT_EQ(Database::OK, this->db()->WriteTile(1, 0, "other level"));
+  EXPECT_EQ(Database::LOOKUP_OK, this->db()->LookupTile(0, 0, &tile));
+  EXPECT_EQ("partial", tile);
+
+  // Tiles are overwritten as they grow.
+  EXPECT_EQ(Database::OK, this->db()->WriteTile(0, 0, "partial and more"));
+  EXPECT_EQ(Database::LOOKUP_OK, this->db()->LookupTile(0, 0, &tile));
+  EXPECT_EQ("partial and more", tile);
+  EXPECT_EQ(Database::LOOKUP_OK, this->db()->LookupTile(0, 1, &tile));
+  EXPECT_EQ("other index", tile);
+  EXPECT_EQ(Database::LOOKUP_OK, this->db()->LookupTile(1, 0, &tile));
+  EXPECT_EQ("other level", tile);
+  EXPECT_EQ(Database::NOT_FOUND, this->db()->LookupTile(1, 1, &tile));
+}
+
+
+TYPED_TEST(DBTest, Frontiers) {
+  string frontier;
+  EXPECT_EQ(Database::NOT_FOUND, this->db()->LookupFrontier(3, &frontier));
+
+  EXPECT_EQ(Database::OK, this->db()->WriteFrontier(3, "three"));
+  EXPECT_EQ(Database::OK, this->db()->WriteFrontier(4, "four"));
+  EXPECT_EQ(Database::LOOKUP_OK, this->db()->LookupFrontier(3, &frontier));
+  EXPECT_EQ("three", frontier);
+  EXPECT_EQ(Database::LOOKUP_OK, this->db()->LookupFrontier(4, &frontier));
+  EXPECT_EQ("four", frontier);
+  EXPECT_EQ(Database::NOT_FOUND, this->db()->LookupFrontier(5, &frontier));
+
+  EXPECT_EQ(Database::OK, this->db()->WriteFrontier(3, "three again"));
+  EXPECT_EQ(Database::LOOKUP_OK, this->db()->LookupFrontier(3, &frontier));
+  EXPECT_EQ("three again", frontier);
+}
+
+
+TYPED_TEST(DBTest, ScanEntriesRange) {
+  // More entries than SQLiteDB reads at a time, and one after a gap.
+  std::vector<LoggedEntry> entries(601);
+  for (size_t i = 0; i < entries.size(); ++i) {
+    this->test_signer_.CreateUnique(&entries[i]);
+    entries[i].set_sequence_number(i);
+  }
+  entries.back().set_sequence_number(700);
+  for (Database::WriteResult result :
+       this->db()->CreateSequencedEntries(entries)) {
+    ASSERT_EQ(Database::OK, result);
+  }
+
+  Database::ScanOptions readahead;
+  readahead.readahead = 16;
+  readahead.fill_cache = false;
+  const struct {
+    int64_t start_index;
+    int64_t end_index;
+    Database::ScanOptions options;
+    size_t first;
+    size_t last;
+  } kScans[] = {
+      {0, 1000, Database::ScanOptions(), 0, 601},
+      {100, 550, Database::ScanOptions(), 100, 550},
+      {100, 550, readahead, 100, 550},
+      {590, 700, readahead, 590, 600},
+      {590, 701, readahead, 590, 601},
+      {650, 1000, readahead, 600, 601},
+      {750, 1000, readahead, 601, 601},
+  };
+  for (const auto& scan : kScans) {
+    SCOPED_TRACE(std::to_string(scan.start_index) + "-" +
+                 std::to_string(scan.end_index));
+    unique_ptr<Database::Iterator> it(this->db()->ScanEntries(
+        scan.start_index, scan.end_index, scan.options));
+    LoggedEntry it_cert;
+    for (size_t i = scan.first; i < scan.last; ++i) {
+      ASSERT_TRUE(it->GetNextEntry(&it_cert));
+      TestSigner::TestEqualLoggedCerts(entries[i], it_cert);
+    }
+    EXPECT_FALSE(it->GetNextEntry(&it_cert));
+  }
+
+  // Iterators can be destroyed before the end of their range.
+  unique_ptr<Database::Iterator> it(this->db()->ScanEntries(0, 1000, readahead));
+  LoggedEntry it_cert;
+  ASSERT_TRUE(it->GetNextEntry(&it_cert));
+  TestSigner::TestEqualLoggedCerts(entries[0], it_cert);
+  it.reset();
+}
+
+
+TYPED_TEST(DBTest, GetNextEntries) {
+  std::vector<LoggedEntry> entries(601);
+  for (size_t i = 0; i < entries.size(); ++i) {
+    this->test_signer_.CreateUnique(&entries[i]);
+    entries[i].set_sequence_number(i);
+  }
+  entries.back().set_sequence_number(700);
+  for (Database::WriteResult result :
+       this->db()->CreateSequencedEntries(entries)) {
+    ASSERT_EQ(Database::OK, result);
+  }
+
+  Database::ScanOptions readahead;
+  readahead.readahead = 16;
+  for (const Database::ScanOptions& options :
+       {Database::ScanOptions(), readahead}) {
+    SCOPED_TRACE(options.readahead);
+    unique_ptr<Database::Iterator> it(
+        this->db()->ScanEntries(100, 701, options));
+    std::vector<LoggedEntry> batch;
+    size_t next(100);
+    // Batches that do not divide the range, and reuse the vector.
+    while (it->GetNextEntries(300, &batch) > 0) {
+      ASSERT_LE(batch.size(), 300U);
+      for (const LoggedEntry& entry : batch) {
+        TestSigner::TestEqualLoggedCerts(entries[next++], entry);
+      }
+    }
+    EXPECT_EQ(entries.size(), next);
+    EXPECT_EQ(0U, it->GetNextEntries(300, &batch));
+    EXPECT_TRUE(batch.empty());
+  }
+}
+
+
+TYPED_TEST(DBTest, StoreSerializedEntries) {
+  LoggedEntry logged_cert, lookup_cert;
+  this->test_signer_.CreateUnique(&logged_cert);
+  FLAGS_db_store_serialized_entries = true;
+  EXPECT_EQ(Database::OK, this->db()->CreateSequencedEntry(logged_cert));
+  std::vector<LoggedEntry> entries(1);
+  this->test_signer_.CreateUnique(&entries[0]);
+  EXPECT_EQ(std::vector<Database::WriteResult>{Database::OK},
+            this->db()->CreateSequencedEntries(entries));
+  FLAGS_db_store_serialized_entries = false;
+
+  for (const LoggedEntry& entry : {logged_cert, entries[0]}) {
+    EXPECT_EQ(Database::LOOKUP_OK,
+              this->db()->LookupByIndex(entry.sequence_number(),
+                                        &lookup_cert));
+    TestSigner::TestEqualLoggedCerts(entry, lookup_cert);
+    EXPECT_TRUE(lookup_cert.has_serialized());
+    string leaf_input, lookup_leaf_input, extra_data, lookup_extra_data;
+    EXPECT_TRUE(entry.SerializeForServing(&leaf_input, &extra_data, nullptr));
+    EXPECT_TRUE(lookup_cert.SerializeForServing(&lookup_leaf_input,
+                                                &lookup_extra_data, nullptr));
+    EXPECT_EQ(leaf_input, lookup_leaf_input);
+    EXPECT_EQ(extra_data, lookup_extra_data);
+  }
+
+  // The same entry without the encodings is not a different one.
+  EXPECT_EQ(Database::OK, this->db()->CreateSequencedEntry(logged_cert));
+}
+
+
+TYPED_TEST(DBTest, StoreLeafHashes) {
+  LoggedEntry logged_cert, lookup_cert;
+  this->test_signer_.CreateUnique(&logged_cert);
+  FLAGS_db_store_leaf_hashes = true;
+  EXPECT_EQ(Database::OK, this->db()->CreateSequencedEntry(logged_cert));
+  std::vector<LoggedEntry> entries(1);
+  this->test_signer_.CreateUnique(&entries[0]);
+  EXPECT_EQ(std::vector<Database::WriteResult>{Database::OK},
+            this->db()->CreateSequencedEntries(entries));
+  FLAGS_db_store_leaf_hashes = false;
+
+  for (const LoggedEntry& entry : {logged_cert, entries[0]}) {
+    EXPECT_EQ(Database::LOOKUP_OK,
+              this->db()->LookupByIndex(entry.sequence_number(),
+                                        &lookup_cert));
+    TestSigner::TestEqualLoggedCerts(entry, lookup_cert);
+    ASSERT_TRUE(lookup_cert.has_leaf_hash());
+    EXPECT_EQ(entry.merkle_leaf_hash(), lookup_cert.leaf_hash());
+    // Modifying the entry drops it.
+    lookup_cert.mutable_sct()->set_timestamp(entry.timestamp() + 1);
+    EXPECT_FALSE(lookup_cert.has_leaf_hash());
+  }
+
+  // The same entry without the leaf hash is not a different one.
+  EXPECT_EQ(Database::OK, this->db()->CreateSequencedEntry(logged_cert));
+}
+
+
+void SetCompressEntries(bool compress) {
+  FLAGS_file_db_compress_entries = compress;
+  FLAGS_leveldb_compress_entries = compress;
+  FLAGS_sqlite_compress_entries = compress;
+}
+
+
+TYPED_TEST(DBTest, CompressEntries) {
+  const int kEntries(10);
+  const int32_t saved_samples(FLAGS_compression_dictionary_samples);
+  SetCompressEntries(true);
+  FLAGS_compression_dictionary_samples = kEntries / 2;
+
+  // The first half is compressed without a dictionary, which is
+  // trained on them when the database is opened again. Writing a tree
+  // head commits the entries of SQLiteDB.
+  std::vector<LoggedEntry> entries(kEntries);
+  SignedTreeHead sth;
+  unique_ptr<Database> db(this->test_db_.SecondDB());
+  for (int i = 0; i < kEntries; ++i) {
+    if (i == kEntries / 2) {
+      this->test_signer_.CreateUnique(&sth);
+      EXPECT_EQ(Database::OK, db->WriteTreeHead(sth));
+      db.reset();
+      db.reset(this->test_db_.SecondDB());
+    }
+    this->test_signer_.CreateUnique(&entries[i]);
+    entries[i].set_sequence_number(i);
+    EXPECT_EQ(Database::OK, db->CreateSequencedEntry(entries[i]));
+  }
+  // Compressed entries are compared uncompressed.
+  EXPECT_EQ(Database::OK, db->CreateSequencedEntry(entries[0]));
+  EXPECT_EQ(Database::OK, db->CreateSequencedEntry(entries[kEntries - 1]));
+  this->test_signer_.CreateUnique(&sth);
+  EXPECT_EQ(Database::OK, db->WriteTreeHead(sth));
+
+  // They remain readable once compression is turned off.
+  SetCompressEntries(false);
+  FLAGS_compression_dictionary_samples = saved_samples;
+  db.reset();
+  db.reset(this->test_db_.SecondDB());
+  EXPECT_EQ(kEntries, db->TreeSize());
+  LoggedEntry lookup_cert;
+  for (const LoggedEntry& entry : entries) {
+    EXPECT_EQ(Database::LOOKUP_OK,
+              db->LookupByIndex(entry.sequence_number(), &lookup_cert));
+    TestSigner::TestEqualLoggedCerts(entry, lookup_cert);
+    EXPECT_EQ(Database::LOOKUP_OK, db->LookupByHash(entry.Hash(),
+                                                    &lookup_cert));
+    TestSigner::TestEqualLoggedCerts(entry, lookup_cert);
+  }
+  const unique_ptr<Database::Iterator> it(db->ScanEntries(0));
+  for (const LoggedEntry& entry : entries) {
+    ASSERT_TRUE(it->GetNextEntry(&lookup_cert));
+    TestSigner::TestEqualLoggedCerts(entry, lookup_cert);
+  }
+  EXPECT_FALSE(it->GetNextEntry(&lookup_cert));
+}
+
+
+TYPED_TEST(DBTest, DeduplicateChains) {
+  const int kEntries(10);
+  FLAGS_db_deduplicate_chains = true;
+  unique_ptr<Database> db(this->test_db_.SecondDB());
+  std::vector<LoggedEntry> entries(kEntries);
+  for (int i = 0; i < kEntries; ++i) {
+    this->test_signer_.CreateUnique(&entries[i]);
+    entries[i].set_sequence_number(i);
+  }
+  EXPECT_EQ(std::vector<Database::WriteResult>(kEntries, Database::OK),
+            db->CreateSequencedEntries(entries));
+  // Entries with their chain apart are compared with it.
+  EXPECT_EQ(Database::OK, db->CreateSequencedEntry(entries[1]));
+  SignedTreeHead sth;
+  this->test_signer_.CreateUnique(&sth);
+  EXPECT_EQ(Database::OK, db->WriteTreeHead(sth));
+
+  // The chains are still found once this is turned off.
+  FLAGS_db_deduplicate_chains = false;
+  db.reset();
+  db.reset(this->test_db_.SecondDB());
+  LoggedEntry lookup_cert;
+  for (const LoggedEntry& entry : entries) {
+    EXPECT_EQ(Database::LOOKUP_OK,
+              db->LookupByIndex(entry.sequence_number(), &lookup_cert));
+    TestSigner::TestEqualLoggedCerts(entry, lookup_cert);
+    EXPECT_FALSE(lookup_cert.has_chain_hashes());
+    EXPECT_EQ(Database::LOOKUP_OK, db->LookupByHash(entry.Hash(),
+                                                    &lookup_cert));
+    TestSigner::TestEqualLoggedCerts(entry, lookup_cert);
+  }
+  const unique_ptr<Database::Iterator> it(db->ScanEntries(0));
+  for (const LoggedEntry& entry : entries) {
+    ASSERT_TRUE(it->GetNextEntry(&lookup_cert));
+    TestSigner::TestEqualLoggedCerts(entry, lookup_cert);
+  }
+  EXPECT_FALSE(it->GetNextEntry(&lookup_cert));
+}
+
+
+TYPED_TEST(DBTest, ConcurrentLookupsAndWrites) {
+  const int kWritten(100);
+  std::vector<LoggedEntry> entries(2 * kWritten);
+  for (int i = 0; i < 2 * kWritten; ++i) {
+    this->test_signer_.CreateUnique(&entries[i]);
+    entries[i].set_sequence_number(i);
+  }
+  for (int i = 0; i < kWritten; ++i) {
+    EXPECT_EQ(Database::OK, this->db()->CreateSequencedEntry(entries[i]));
+  }
+  SignedTreeHead sth;
+  this->test_signer_.CreateUnique(&sth);
+  EXPECT_EQ(Database::OK, this->db()->WriteTreeHead(sth));
+
+  Database* const db(this->db());
+  // The writer adds the other entries, and a newer tree head every
+  // kEntriesPerTreeHead of them.
+  const int kEntriesPerTreeHead(10);
+  SignedTreeHead last_sth(sth);
+  last_sth.set_timestamp(sth.timestamp() + kWritten / kEntriesPerTreeHead);
+  std::thread writer([db, &entries, &sth]() {
+    SignedTreeHead new_sth(sth);
+    for (int i = kWritten; i < 2 * kWritten; ++i) {
+      EXPECT_EQ(Database::OK, db->CreateSequencedEntry(entries[i]));
+      if ((i + 1) % kEntriesPerTreeHead == 0) {
+        new_sth.set_timestamp(new_sth.timestamp() + 1);
+        EXPECT_EQ(Database::OK, db->WriteTreeHead(new_sth));
+      }
+    }
+  });
+  std::vector<std::thread> readers;
+  for (int t = 0; t < 4; ++t) {
+    readers.emplace_back([db, &entries, &sth, t]() {
+      LoggedEntry lookup_cert;
+      SignedTreeHead lookup_sth;
+      int64_t tree_size(kWritten);
+      uint64_t timestamp(sth.timestamp());
+      for (int i = t; i < kWritten; i += 4) {
+        EXPECT_EQ(Database::LOOKUP_OK,
+                  db->LookupByHash(entries[i].Hash(), &lookup_cert));
+        EXPECT_EQ(i, lookup_cert.sequence_number());
+        EXPECT_EQ(Database::LOOKUP_OK, db->LookupByIndex(i, &lookup_cert));
+        EXPECT_EQ(entries[i].Hash(), lookup_cert.Hash());
+
+        // Neither of these can go backwards.
+        EXPECT_EQ(Database::LOOKUP_OK, db->LatestTreeHead(&lookup_sth));
+        EXPECT_LE(timestamp, lookup_sth.timestamp());
+        timestamp = lookup_sth.timestamp();
+        EXPECT_LE(tree_size, db->TreeSize());
+        tree_size = db->TreeSize();
+      }
+    });
+  }
+  for (auto& reader : readers) {
+    reader.join();
+  }
+  writer.join();
+
+  EXPECT_EQ(2 * kWritten, db->TreeSize());
+  SignedTreeHead lookup_sth;
+  EXPECT_EQ(Database::LOOKUP_OK, db->LatestTreeHead(&lookup_sth));
+  EXPECT_EQ(last_sth.timestamp(), lookup_sth.timestamp());
+}
+
+
 TYPED_TEST(DBTestDeathTest, CannotOverwriteNodeId) {
   const string kNodeId("some_node_id");
   this->db()->InitializeNode(kNodeId);
@@ -428,6 +995,413 @@ TYPED_TEST(DBTest, Iterator) {
 }
 
 
+class FileDBTest : public ::testing::Test {
+ protected:
+  FileDBTest()
+      : certs_dir_(tmp_.TmpStorageDir() + "/certs"),
+        tree_dir_(tmp_.TmpStorageDir() + "/tree"),
+        meta_dir_(tmp_.TmpStorageDir() + "/meta"),
+        snapshot_path_(tmp_.TmpStorageDir() + "/index") {
+    CHECK_ERR(mkdir(certs_dir_.c_str(), 0700));
+    CHECK_ERR(mkdir(tree_dir_.c_str(), 0700));
+    CHECK_ERR(mkdir(meta_dir_.c_str(), 0700));
+  }
+
+  unique_ptr<FileDB> Open() {
+    return unique_ptr<FileDB>(
+        new FileDB(new FileStorage(certs_dir_, kCertStorageDepth),
+                   new FileStorage(tree_dir_, kTreeStorageDepth),
+                   new FileStorage(meta_dir_, 0), snapshot_path_));
+  }
+
+  bool SnapshotSaved() const {
+    return access((snapshot_path_ + ".meta").c_str(), F_OK) == 0;
+  }
+
+  void ExpectEntry(const FileDB& db, const LoggedEntry& logged) {
+    LoggedEntry lookup_cert;
+    EXPECT_EQ(Database::LOOKUP_OK,
+              db.LookupByHash(logged.Hash(), &lookup_cert));
+    TestSigner::TestEqualLoggedCerts(logged, lookup_cert);
+  }
+
+  TmpStorage tmp_;
+  TestSigner test_signer_;
+  const string certs_dir_;
+  const string tree_dir_;
+  const string meta_dir_;
+  const string snapshot_path_;
+};
+
+
+TEST_F(FileDBTest, IndexSnapshot) {
+  std::vector<LoggedEntry> entries(4);
+  for (int i = 0; i < 4; ++i) {
+    test_signer_.CreateUnique(&entries[i]);
+    // Leave a gap before the last one.
+    entries[i].set_sequence_number(i < 3 ? i : 10);
+  }
+
+  unique_ptr<FileDB> db(Open());
+  // The index of the empty database is saved right away.
+  EXPECT_TRUE(SnapshotSaved());
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_EQ(Database::OK, db->CreateSequencedEntry(entries[i]));
+  }
+  EXPECT_FALSE(SnapshotSaved());
+  db.reset();
+  EXPECT_TRUE(SnapshotSaved());
+
+  db = Open();
+  EXPECT_EQ(3, db->TreeSize());
+  for (int i = 0; i < 3; ++i) {
+    ExpectEntry(*db, entries[i]);
+  }
+  EXPECT_EQ(Database::OK, db->CreateSequencedEntry(entries[3]));
+  db.reset();
+
+  db = Open();
+  for (const auto& logged : entries) {
+    ExpectEntry(*db, logged);
+  }
+  db.reset();
+
+  // Entries written behind the back of the database make the snapshot
+  // out of date.
+  LoggedEntry logged;
+  test_signer_.CreateUnique(&logged);
+  logged.set_sequence_number(3);
+  string data;
+  ASSERT_TRUE(logged.SerializeToString(&data));
+  ASSERT_OK(FileStorage(certs_dir_, kCertStorageDepth).CreateEntry("3", data));
+
+  db = Open();
+  EXPECT_EQ(4, db->TreeSize());
+  ExpectEntry(*db, logged);
+  ExpectEntry(*db, entries[3]);
+}
+
+
+TEST(LevelDBTest, ArchiveEntries) {
+  TmpStorage tmp;
+  const string db_path(tmp.TmpStorageDir() + "/leveldb");
+  FLAGS_leveldb_archive_dir = tmp.TmpStorageDir() + "/archive";
+  FLAGS_leveldb_archive_range_size = 10;
+  FLAGS_leveldb_archive_keep_entries = 5;
+  FLAGS_leveldb_archive_interval_secs = 0;
+  TestSigner test_signer;
+
+  const int kEntries(38);
+  std::vector<LoggedEntry> entries(kEntries);
+  for (int i = 0; i < kEntries; ++i) {
+    test_signer.CreateUnique(&entries[i]);
+    entries[i].set_sequence_number(i);
+  }
+  unique_ptr<LevelDB> db(new LevelDB(db_path));
+  EXPECT_EQ(std::vector<Database::WriteResult>(kEntries, Database::OK),
+            db->CreateSequencedEntries(entries));
+  // [0, 30) is archived, [30, 38) is too recent.
+  ASSERT_OK(db->ArchiveEntries());
+  for (const string& start : {"0000000000000000", "000000000000000a",
+                               "0000000000000014"}) {
+    EXPECT_EQ(0, access((FLAGS_leveldb_archive_dir + "/entries-" + start)
+                            .c_str(),
+                        F_OK));
+  }
+  EXPECT_NE(0, access((FLAGS_leveldb_archive_dir + "/entries-000000000000001e")
+                          .c_str(),
+                      F_OK));
+
+  // Archived entries are still found, and not overwritten.
+  LoggedEntry conflicting;
+  test_signer.CreateUnique(&conflicting);
+  conflicting.set_sequence_number(3);
+  for (int reopen = 0; reopen < 2; ++reopen) {
+    EXPECT_EQ(kEntries, db->TreeSize());
+    LoggedEntry lookup_cert;
+    for (const LoggedEntry& entry : entries) {
+      EXPECT_EQ(Database::LOOKUP_OK,
+                db->LookupByIndex(entry.sequence_number(), &lookup_cert));
+      TestSigner::TestEqualLoggedCerts(entry, lookup_cert);
+      EXPECT_EQ(Database::LOOKUP_OK,
+                db->LookupByHash(entry.Hash(), &lookup_cert));
+      TestSigner::TestEqualLoggedCerts(entry, lookup_cert);
+    }
+    EXPECT_EQ(Database::NOT_FOUND, db->LookupByIndex(kEntries, &lookup_cert));
+    const unique_ptr<Database::Iterator> it(db->ScanEntries(25));
+    for (int i = 25; i < kEntries; ++i) {
+      ASSERT_TRUE(it->GetNextEntry(&lookup_cert));
+      TestSigner::TestEqualLoggedCerts(entries[i], lookup_cert);
+    }
+    EXPECT_FALSE(it->GetNextEntry(&lookup_cert));
+    EXPECT_EQ(Database::OK, db->CreateSequencedEntry(entries[3]));
+    EXPECT_EQ(Database::SEQUENCE_NUMBER_ALREADY_IN_USE,
+              db->CreateSequencedEntry(conflicting));
+
+    db.reset();
+    db.reset(new LevelDB(db_path));
+  }
+
+  FLAGS_leveldb_archive_dir = "";
+  FLAGS_leveldb_archive_range_size = 1000000;
+  FLAGS_leveldb_archive_keep_entries = 10000000;
+  FLAGS_leveldb_archive_interval_secs = 3600;
+}
+
+
+TEST(LevelDBTest, WriteSnapshot) {
+  TmpStorage tmp;
+  const string db_path(tmp.TmpStorageDir() + "/leveldb");
+  const string snapshot_path(tmp.TmpStorageDir() + "/snapshot");
+  FLAGS_leveldb_archive_dir = tmp.TmpStorageDir() + "/archive";
+  FLAGS_leveldb_archive_range_size = 10;
+  FLAGS_leveldb_archive_keep_entries = 5;
+  FLAGS_leveldb_archive_interval_secs = 0;
+  TestSigner test_signer;
+
+  const int kEntries(28);
+  std::vector<LoggedEntry> entries(kEntries);
+  for (int i = 0; i < kEntries; ++i) {
+    test_signer.CreateUnique(&entries[i]);
+    entries[i].set_sequence_number(i);
+  }
+  SignedTreeHead sth;
+  test_signer.CreateUnique(&sth);
+  {
+    LevelDB db(db_path);
+    db.InitializeNode("node");
+    EXPECT_EQ(std::vector<Database::WriteResult>(kEntries, Database::OK),
+              db.CreateSequencedEntries(entries));
+    EXPECT_EQ(Database::OK, db.WriteTreeHead(sth));
+    EXPECT_EQ(Database::OK, db.WriteTile(0, 0, "hashes"));
+    // [0, 20) is archived.
+    ASSERT_OK(db.ArchiveEntries());
+    ASSERT_OK(db.WriteSnapshot(snapshot_path));
+    // Later writes are not in the snapshot.
+    LoggedEntry later;
+    test_signer.CreateUnique(&later);
+    later.set_sequence_number(kEntries);
+    EXPECT_EQ(Database::OK, db.CreateSequencedEntry(later));
+  }
+
+  FLAGS_leveldb_archive_dir = snapshot_path + "/archive";
+  LevelDB snapshot(snapshot_path);
+  EXPECT_EQ(kEntries, snapshot.TreeSize());
+  LoggedEntry lookup_cert;
+  for (const LoggedEntry& entry : entries) {
+    EXPECT_EQ(Database::LOOKUP_OK,
+              snapshot.LookupByIndex(entry.sequence_number(), &lookup_cert));
+    TestSigner::TestEqualLoggedCerts(entry, lookup_cert);
+  }
+  SignedTreeHead lookup_sth;
+  EXPECT_EQ(Database::LOOKUP_OK, snapshot.LatestTreeHead(&lookup_sth));
+  TestSigner::TestEqualTreeHeads(sth, lookup_sth);
+  string hashes;
+  EXPECT_EQ(Database::LOOKUP_OK, snapshot.LookupTile(0, 0, &hashes));
+  EXPECT_EQ("hashes", hashes);
+  // The new node gets an ID of its own.
+  string node_id;
+  EXPECT_EQ(Database::NOT_FOUND, snapshot.NodeId(&node_id));
+
+  FLAGS_leveldb_archive_dir = "";
+  FLAGS_leveldb_archive_range_size = 1000000;
+  FLAGS_leveldb_archive_keep_entries = 10000000;
+  FLAGS_leveldb_archive_interval_secs = 3600;
+}
+
+
+// Returns the keys of the leveldb at |path| starting with |prefix|.
+std::vector<string> RawKeys(const string& path, const string& prefix) {
+  leveldb::DB* raw;
+  CHECK(leveldb::DB::Open(leveldb::Options(), path, &raw).ok());
+  const unique_ptr<leveldb::DB> db(raw);
+  const unique_ptr<leveldb::Iterator> it(
+      db->NewIterator(leveldb::ReadOptions()));
+  std::vector<string> keys;
+  for (it->Seek(prefix); it->Valid() && it->key().starts_with(prefix);
+       it->Next()) {
+    keys.push_back(it->key().ToString());
+  }
+  return keys;
+}
+
+
+TEST(LevelDBTest, UpgradeKeySchema) {
+  TmpStorage tmp;
+  const string db_path(tmp.TmpStorageDir() + "/leveldb");
+  TestSigner test_signer;
+
+  const int kEntries(12);
+  std::vector<LoggedEntry> entries(kEntries + 1);
+  for (int i = 0; i <= kEntries; ++i) {
+    test_signer.CreateUnique(&entries[i]);
+    entries[i].set_sequence_number(i);
+  }
+
+  // New databases get binary keys.
+  {
+    LevelDB db(tmp.TmpStorageDir() + "/new");
+    EXPECT_EQ(Database::OK, db.CreateSequencedEntry(entries[0]));
+  }
+  EXPECT_TRUE(RawKeys(tmp.TmpStorageDir() + "/new", "entry-").empty());
+  EXPECT_EQ(1U, RawKeys(tmp.TmpStorageDir() + "/new", "E").size());
+
+  // Written as before binary keys, and without hash keys.
+  {
+    leveldb::Options options;
+    options.create_if_missing = true;
+    leveldb::DB* raw;
+    ASSERT_TRUE(leveldb::DB::Open(options, db_path, &raw).ok());
+    const unique_ptr<leveldb::DB> db(raw);
+    for (int i = 0; i < kEntries; ++i) {
+      char key[32];
+      snprintf(key, sizeof(key), "entry-%016x", i);
+      string data;
+      ASSERT_TRUE(entries[i].SerializeToString(&data));
+      ASSERT_TRUE(db->Put(leveldb::WriteOptions(), key, data).ok());
+    }
+  }
+
+  const auto expect_entries = [&entries](const LevelDB& db, int count) {
+    EXPECT_EQ(count, db.TreeSize());
+    LoggedEntry lookup_cert;
+    for (int i = 0; i < count; ++i) {
+      EXPECT_EQ(Database::LOOKUP_OK, db.LookupByIndex(i, &lookup_cert));
+      TestSigner::TestEqualLoggedCerts(entries[i], lookup_cert);
+      EXPECT_EQ(Database::LOOKUP_OK,
+                db.LookupByHash(entries[i].Hash(), &lookup_cert));
+      TestSigner::TestEqualLoggedCerts(entries[i], lookup_cert);
+    }
+    const unique_ptr<Database::Iterator> it(db.ScanEntries(count - 3));
+    for (int i = count - 3; i < count; ++i) {
+      ASSERT_TRUE(it->GetNextEntry(&lookup_cert));
+      TestSigner::TestEqualLoggedCerts(entries[i], lookup_cert);
+    }
+    EXPECT_FALSE(it->GetNextEntry(&lookup_cert));
+  };
+
+  // The hex keys are read, and written, until the upgrade.
+  {
+    LevelDB db(db_path);
+    expect_entries(db, kEntries);
+    EXPECT_EQ(Database::OK, db.CreateSequencedEntry(entries[kEntries]));
+  }
+  EXPECT_EQ(static_cast<size_t>(kEntries + 1),
+            RawKeys(db_path, "entry-").size());
+
+  FLAGS_leveldb_upgrade_key_schema = true;
+  for (int reopen = 0; reopen < 2; ++reopen) {
+    {
+      LevelDB db(db_path);
+      expect_entries(db, kEntries + 1);
+    }
+    EXPECT_TRUE(RawKeys(db_path, "entry-").empty());
+    EXPECT_EQ(static_cast<size_t>(kEntries + 1),
+              RawKeys(db_path, "E").size());
+  }
+  FLAGS_leveldb_upgrade_key_schema = false;
+}
+
+
+TEST(SQLiteDBTest, ConcurrentLookups) {
+  TestDB<SQLiteDB> test_db;
+  TestSigner test_signer;
+  SQLiteDB* const db(test_db.db());
+
+  const int kCommitted(100);
+  std::vector<LoggedEntry> entries(2 * kCommitted);
+  for (int i = 0; i < 2 * kCommitted; ++i) {
+    test_signer.CreateUnique(&entries[i]);
+    entries[i].set_sequence_number(i);
+  }
+  for (int i = 0; i < kCommitted; ++i) {
+    EXPECT_EQ(Database::OK, db->CreateSequencedEntry(entries[i]));
+  }
+  // Commits the entries, so that the readers can serve them.
+  SignedTreeHead sth;
+  test_signer.CreateUnique(&sth);
+  EXPECT_EQ(Database::OK, db->WriteTreeHead(sth));
+
+  // The entries written meanwhile are uncommitted, but must be found
+  // all the same.
+  std::thread writer([db, &entries]() {
+    for (int i = kCommitted; i < 2 * kCommitted; ++i) {
+      EXPECT_EQ(Database::OK, db->CreateSequencedEntry(entries[i]));
+    }
+  });
+  std::vector<std::thread> readers;
+  for (int t = 0; t < 4; ++t) {
+    readers.emplace_back([db, &entries, t]() {
+      LoggedEntry lookup_cert;
+      for (int i = t; i < kCommitted; i += 4) {
+        EXPECT_EQ(Database::LOOKUP_OK,
+                  db->LookupByHash(entries[i].Hash(), &lookup_cert));
+        EXPECT_EQ(i, lookup_cert.sequence_number());
+        EXPECT_EQ(Database::LOOKUP_OK, db->LookupByIndex(i, &lookup_cert));
+        EXPECT_EQ(entries[i].Hash(), lookup_cert.Hash());
+      }
+      SignedTreeHead lookup_sth;
+      EXPECT_EQ(Database::LOOKUP_OK, db->LatestTreeHead(&lookup_sth));
+    });
+  }
+  for (auto& reader : readers) {
+    reader.join();
+  }
+  writer.join();
+
+  LoggedEntry lookup_cert;
+  for (int i = 0; i < 2 * kCommitted; ++i) {
+    EXPECT_EQ(Database::LOOKUP_OK, db->LookupByIndex(i, &lookup_cert));
+    EXPECT_EQ(entries[i].Hash(), lookup_cert.Hash());
+  }
+  int64_t scanned(0);
+  const unique_ptr<Database::Iterator> it(db->ScanEntries(0));
+  while (it->GetNextEntry(&lookup_cert)) {
+    EXPECT_EQ(scanned++, lookup_cert.sequence_number());
+  }
+  EXPECT_EQ(2 * kCommitted, scanned);
+  EXPECT_EQ(2 * kCommitted, db->TreeSize());
+}
+
+
+TEST(SQLiteDBTest, HashFilter) {
+  TestDB<SQLiteDB> test_db;
+  TestSigner test_signer;
+  SQLiteDB* const db(test_db.db());
+
+  std::vector<LoggedEntry> entries(3);
+  for (int i = 0; i < 3; ++i) {
+    test_signer.CreateUnique(&entries[i]);
+    entries[i].set_sequence_number(i);
+  }
+  EXPECT_EQ(Database::OK, db->CreateSequencedEntry(entries[0]));
+  EXPECT_EQ(Database::OK, db->CreateSequencedEntry(entries[1]));
+  SignedTreeHead sth;
+  test_signer.CreateUnique(&sth);
+  EXPECT_EQ(Database::OK, db->WriteTreeHead(sth));
+
+  LoggedEntry lookup_cert;
+  EXPECT_EQ(Database::NOT_FOUND,
+            db->LookupByHash(entries[2].Hash(), &lookup_cert));
+
+  // Another instance brings the saved filter up to date.
+  unique_ptr<SQLiteDB> db2(test_db.SecondDB());
+  EXPECT_EQ(Database::LOOKUP_OK,
+            db2->LookupByHash(entries[1].Hash(), &lookup_cert));
+  EXPECT_EQ(1, lookup_cert.sequence_number());
+
+  // It only sees the entries written by the first one since once told
+  // to refresh.
+  EXPECT_EQ(Database::OK, db->CreateSequencedEntry(entries[2]));
+  test_signer.CreateUnique(&sth);
+  EXPECT_EQ(Database::OK, db->WriteTreeHead(sth));
+  db2->ForceNotifySTH();
+  EXPECT_EQ(Database::LOOKUP_OK,
+            db2->LookupByHash(entries[2].Hash(), &lookup_cert));
+  EXPECT_EQ(2, lookup_cert.sequence_number());
+}
+
+
 }  // namespace
 
 
@@ -0,0 +1,34 @@
+#include "log/database_tile_store.h"
+
+#include <glog/logging.h>
+
+#include "log/database.h"
+
+using std::string;
+
+namespace cert_trans {
+
+
+DatabaseTileStore::DatabaseTileStore(ReadOnlyDatabase* db)
+    : db_(CHECK_NOTNULL(db)), writable_db_(nullptr) {
+}
+
+
+DatabaseTileStore::DatabaseTileStore(Database* db)
+    : db_(CHECK_NOTNULL(db)), writable_db_(db) {
+}
+
+
+bool DatabaseTileStore::GetTile(size_t level, size_t index, string* hashes) {
+  return db_->LookupTile(level, index, hashes) == Database::LOOKUP_OK;
+}
+
+
+void DatabaseTileStore::PutTile(size_t level, size_t index,
+                                const string& hashes) {
+  CHECK(writable_db_) << "Writing a tile to a read-only store";
+  CHECK_EQ(Database::OK, writable_db_->WriteTile(level, index, hashes));
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,37 @@
+#ifndef CERT_TRANS_LOG_DATABASE_TILE_STORE_H_
+#define CERT_TRANS_LOG_DATABASE_TILE_STORE_H_
+
+#include <string>
+
+#include "merkletree/tiled_merkle_tree.h"
+
+namespace cert_trans {
+
+class Database;
+class ReadOnlyDatabase;
+
+
+// Keeps the tiles of a TiledMerkleTree in a log database.
+class DatabaseTileStore : public MerkleTileStore {
+ public:
+  // A read-only store, for followers of the tree: PutTile() must not be
+  // called. Does not take ownership of |db|.
+  explicit DatabaseTileStore(ReadOnlyDatabase* db);
+  // Does not take ownership of |db|.
+  explicit DatabaseTileStore(Database* db);
+  DatabaseTileStore(const DatabaseTileStore&) = delete;
+  DatabaseTileStore& operator=(const DatabaseTileStore&) = delete;
+
+  bool GetTile(size_t level, size_t index, std::string* hashes) override;
+  void PutTile(size_t level, size_t index, const std::string& hashes) override;
+
+ private:
+  ReadOnlyDatabase* const db_;
+  // NULL for a read-only store.
+  Database* const writable_db_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_DATABASE_TILE_STORE_H_
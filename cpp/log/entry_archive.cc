@@ -0,0 +1,177 @@
+#include "log/entry_archive.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glog/logging.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using std::string;
+using std::unique_ptr;
+using std::vector;
+using util::Status;
+using util::StatusOr;
+
+namespace cert_trans {
+namespace {
+
+
+const char kMagic[] = "CTARCHV1";
+const size_t kMagicSize = 8;
+// Magic, start and count.
+const size_t kHeaderSize = kMagicSize + 16;
+
+
+void AppendUint64(uint64_t value, string* out) {
+  for (int i = 0; i < 8; ++i) {
+    out->push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+  }
+}
+
+
+uint64_t ReadUint64(const char* data) {
+  uint64_t value(0);
+  for (int i = 7; i >= 0; --i) {
+    value = (value << 8) | static_cast<unsigned char>(data[i]);
+  }
+  return value;
+}
+
+
+Status ErrnoStatus(const string& what, const string& path) {
+  return Status(util::error::INTERNAL,
+                what + " " + path + ": " + strerror(errno));
+}
+
+
+// Reads exactly |size| bytes at |offset|.
+bool ReadAt(int fd, uint64_t offset, size_t size, char* buf) {
+  while (size > 0) {
+    const ssize_t n(pread(fd, buf, size, offset));
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    buf += n;
+    size -= n;
+    offset += n;
+  }
+  return true;
+}
+
+
+}  // namespace
+
+
+EntryArchive::EntryArchive(const string& path, int fd, int64_t start,
+                           int64_t count, uint64_t file_size)
+    : path_(path),
+      fd_(fd),
+      start_(start),
+      count_(count),
+      file_size_(file_size) {
+}
+
+
+EntryArchive::~EntryArchive() {
+  close(fd_);
+}
+
+
+// static
+Status EntryArchive::Write(const string& path, int64_t start,
+                           const vector<string>& records) {
+  CHECK_GE(start, 0);
+  string header(kMagic, kMagicSize);
+  AppendUint64(start, &header);
+  AppendUint64(records.size(), &header);
+  uint64_t offset(kHeaderSize + 8 * (records.size() + 1));
+  for (const string& record : records) {
+    AppendUint64(offset, &header);
+    offset += record.size();
+  }
+  AppendUint64(offset, &header);
+
+  const string tmp_path(path + ".tmp");
+  FILE* const out(fopen(tmp_path.c_str(), "wb"));
+  if (!out) {
+    return ErrnoStatus("cannot create", tmp_path);
+  }
+  bool ok(fwrite(header.data(), 1, header.size(), out) == header.size());
+  for (const string& record : records) {
+    ok = ok && fwrite(record.data(), 1, record.size(), out) == record.size();
+  }
+  // Only replace |path| once the records are on disk.
+  ok = ok && fflush(out) == 0 && fsync(fileno(out)) == 0;
+  if (fclose(out) != 0 || !ok) {
+    const Status status(ErrnoStatus("cannot write", tmp_path));
+    unlink(tmp_path.c_str());
+    return status;
+  }
+  if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+    return ErrnoStatus("cannot rename " + tmp_path + " to", path);
+  }
+  return ::util::OkStatus();
+}
+
+
+// static
+StatusOr<unique_ptr<EntryArchive>> EntryArchive::Open(const string& path) {
+  const int fd(open(path.c_str(), O_RDONLY));
+  if (fd < 0) {
+    return Status(errno == ENOENT ? util::error::NOT_FOUND
+                                  : util::error::INTERNAL,
+                  "cannot open " + path + ": " + strerror(errno));
+  }
+  struct stat st;
+  char header[kHeaderSize];
+  if (fstat(fd, &st) != 0 || !ReadAt(fd, 0, kHeaderSize, header) ||
+      memcmp(header, kMagic, kMagicSize) != 0) {
+    close(fd);
+    return Status(util::error::FAILED_PRECONDITION,
+                  "not an entry archive: " + path);
+  }
+  const uint64_t start(ReadUint64(header + kMagicSize));
+  const uint64_t count(ReadUint64(header + kMagicSize + 8));
+  const uint64_t file_size(st.st_size);
+  char end_offset[8];
+  if (start > INT64_MAX || count > (file_size - kHeaderSize) / 8 ||
+      !ReadAt(fd, kHeaderSize + 8 * count, 8, end_offset) ||
+      ReadUint64(end_offset) != file_size) {
+    close(fd);
+    return Status(util::error::FAILED_PRECONDITION,
+                  "truncated entry archive: " + path);
+  }
+  return unique_ptr<EntryArchive>(
+      new EntryArchive(path, fd, start, count, file_size));
+}
+
+
+Status EntryArchive::Read(int64_t sequence_number, string* record) const {
+  CHECK_GE(sequence_number, start_);
+  CHECK_LT(sequence_number, end());
+  CHECK_NOTNULL(record);
+  char offsets[16];
+  if (!ReadAt(fd_, kHeaderSize + 8 * (sequence_number - start_), 16,
+              offsets)) {
+    return ErrnoStatus("cannot read", path_);
+  }
+  const uint64_t begin(ReadUint64(offsets));
+  const uint64_t end(ReadUint64(offsets + 8));
+  if (begin > end || end > file_size_) {
+    return Status(util::error::DATA_LOSS,
+                  "invalid record offsets in " + path_);
+  }
+  record->resize(end - begin);
+  if (!ReadAt(fd_, begin, record->size(), &(*record)[0])) {
+    return ErrnoStatus("cannot read", path_);
+  }
+  return ::util::OkStatus();
+}
+
+
+}  // namespace cert_trans
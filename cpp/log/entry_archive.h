@@ -0,0 +1,66 @@
+#ifndef CERT_TRANS_LOG_ENTRY_ARCHIVE_H_
+#define CERT_TRANS_LOG_ENTRY_ARCHIVE_H_
+
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "util/status.h"
+#include "util/statusor.h"
+
+namespace cert_trans {
+
+
+// An immutable file holding the stored entries of the sequence numbers
+// [start(), end()), so that a Database backend can move old ranges of
+// the log out of its hot storage, e.g. to a cheaper disk (see LevelDB).
+//
+// The file starts with a header (magic, start and count), followed by
+// the offsets of the records, and the records themselves. The records
+// are opaque here: the backend stores them as it would store the
+// entries, compressed.
+//
+// Reads are thread-safe, and each reads its record with two pread()s,
+// so an open archive takes no memory for its entries.
+class EntryArchive {
+ public:
+  ~EntryArchive();
+  EntryArchive(const EntryArchive&) = delete;
+  EntryArchive& operator=(const EntryArchive&) = delete;
+
+  // Writes |records|, those of the sequence numbers from |start| on, to
+  // the file |path|, replacing it atomically once they are on disk.
+  static util::Status Write(const std::string& path, int64_t start,
+                            const std::vector<std::string>& records);
+
+  // Opens an archive written by Write().
+  static util::StatusOr<std::unique_ptr<EntryArchive>> Open(
+      const std::string& path);
+
+  int64_t start() const {
+    return start_;
+  }
+
+  int64_t end() const {
+    return start_ + count_;
+  }
+
+  // REQUIRES: start() <= sequence_number < end().
+  util::Status Read(int64_t sequence_number, std::string* record) const;
+
+ private:
+  EntryArchive(const std::string& path, int fd, int64_t start,
+               int64_t count, uint64_t file_size);
+
+  const std::string path_;
+  const int fd_;
+  const int64_t start_;
+  const int64_t count_;
+  const uint64_t file_size_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_ENTRY_ARCHIVE_H_
@@ -0,0 +1,86 @@
+#include "log/entry_archive.h"
+
+#include <gtest/gtest.h>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "util/status_test_util.h"
+#include "util/test_db.h"
+#include "util/testing.h"
+
+namespace cert_trans {
+namespace {
+
+using std::string;
+using std::unique_ptr;
+using std::vector;
+using util::testing::StatusIs;
+
+
+TEST(EntryArchiveTest, WriteAndRead) {
+  TmpStorage tmp;
+  const string path(tmp.TmpStorageDir() + "/archive");
+  EXPECT_THAT(EntryArchive::Open(path).status(),
+              StatusIs(util::error::NOT_FOUND));
+
+  vector<string> records;
+  for (int i = 0; i < 1000; ++i) {
+    records.push_back(string(i % 7, 'a' + i % 26) + std::to_string(i));
+  }
+  // Including an empty one.
+  records.push_back("");
+  ASSERT_OK(EntryArchive::Write(path, 5000, records));
+
+  util::StatusOr<unique_ptr<EntryArchive>> archive(EntryArchive::Open(path));
+  ASSERT_OK(archive.status());
+  EXPECT_EQ(5000, archive.ValueOrDie()->start());
+  EXPECT_EQ(6001, archive.ValueOrDie()->end());
+  string record;
+  for (size_t i = 0; i < records.size(); ++i) {
+    ASSERT_OK(archive.ValueOrDie()->Read(5000 + i, &record));
+    EXPECT_EQ(records[i], record);
+  }
+}
+
+
+TEST(EntryArchiveTest, Empty) {
+  TmpStorage tmp;
+  const string path(tmp.TmpStorageDir() + "/archive");
+  ASSERT_OK(EntryArchive::Write(path, 0, vector<string>()));
+  util::StatusOr<unique_ptr<EntryArchive>> archive(EntryArchive::Open(path));
+  ASSERT_OK(archive.status());
+  EXPECT_EQ(0, archive.ValueOrDie()->start());
+  EXPECT_EQ(0, archive.ValueOrDie()->end());
+}
+
+
+TEST(EntryArchiveTest, Corrupt) {
+  TmpStorage tmp;
+  const string path(tmp.TmpStorageDir() + "/archive");
+  std::ofstream(path, std::ios::trunc) << "garbage";
+  EXPECT_THAT(EntryArchive::Open(path).status(),
+              StatusIs(util::error::FAILED_PRECONDITION));
+
+  ASSERT_OK(EntryArchive::Write(path, 0, {"first", "second"}));
+  // Drop the end of the last record.
+  std::ifstream in(path, std::ios::binary);
+  const string data((std::istreambuf_iterator<char>(in)),
+                    std::istreambuf_iterator<char>());
+  std::ofstream(path, std::ios::trunc | std::ios::binary)
+      << data.substr(0, data.size() - 1);
+  EXPECT_THAT(EntryArchive::Open(path).status(),
+              StatusIs(util::error::FAILED_PRECONDITION));
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,320 @@
+#include "log/entry_compressor.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include <algorithm>
+#include <queue>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+
+using std::string;
+using std::to_string;
+using std::vector;
+
+DEFINE_int32(compression_dictionary_samples, 1000,
+             "number of entries a compression dictionary is trained on. "
+             "It is trained when a database that compresses its entries is "
+             "opened with at least that many entries, and no dictionary.");
+
+namespace cert_trans {
+namespace {
+
+
+// No serialized protobuf starts with this, as field number 0 is
+// invalid.
+const char kCompressedMarker = '\0';
+// The marker, then the dictionary version and the uncompressed size.
+const size_t kHeaderSize = 9;
+
+const char kDictionaryCountKey[] = "compression_dictionaries";
+const char kDictionaryKeyPrefix[] = "compression_dictionary_";
+
+// Training scores the segments of the samples by how common the
+// d-mers (substrings of kDmerSize bytes) they contain are.
+const size_t kDmerSize = 8;
+const size_t kSegmentSize = 128;
+const size_t kSegmentStride = 64;
+
+
+void PutUint32(uint32_t value, char* out) {
+  for (int i = 3; i >= 0; --i) {
+    *out++ = static_cast<char>((value >> (8 * i)) & 0xff);
+  }
+}
+
+
+uint32_t GetUint32(const char* data) {
+  const unsigned char* const bytes(
+      reinterpret_cast<const unsigned char*>(data));
+  return (static_cast<uint32_t>(bytes[0]) << 24) |
+         (static_cast<uint32_t>(bytes[1]) << 16) |
+         (static_cast<uint32_t>(bytes[2]) << 8) | bytes[3];
+}
+
+
+uint64_t Dmer(const char* data) {
+  uint64_t dmer;
+  memcpy(&dmer, data, sizeof(dmer));
+  return dmer;
+}
+
+
+string DictionaryKey(uint32_t version) {
+  return kDictionaryKeyPrefix + to_string(version);
+}
+
+
+struct Segment {
+  const string* sample;
+  size_t offset;
+  size_t size;
+};
+
+
+// The sum of the counts of the d-mers of |segment|. D-mers that are
+// in less than two samples are not worth anything.
+uint64_t Score(const Segment& segment,
+               const std::unordered_map<uint64_t, uint32_t>& counts) {
+  uint64_t score(0);
+  const char* const data(segment.sample->data() + segment.offset);
+  for (size_t i = 0; i + kDmerSize <= segment.size; ++i) {
+    const auto it(counts.find(Dmer(data + i)));
+    if (it != counts.end() && it->second > 1) {
+      score += it->second;
+    }
+  }
+  return score;
+}
+
+
+}  // namespace
+
+
+static_assert(kDmerSize == sizeof(uint64_t), "d-mers must fit a uint64_t");
+const size_t EntryCompressor::kMaxDictionarySize = 32 << 10;
+
+
+// static
+string EntryCompressor::TrainDictionary(const vector<string>& samples,
+                                        size_t max_size) {
+  // In how many samples each d-mer is.
+  std::unordered_map<uint64_t, uint32_t> counts;
+  vector<Segment> segments;
+  for (const string& sample : samples) {
+    std::unordered_set<uint64_t> seen;
+    for (size_t i = 0; i + kDmerSize <= sample.size(); ++i) {
+      if (seen.insert(Dmer(sample.data() + i)).second) {
+        ++counts[Dmer(sample.data() + i)];
+      }
+    }
+    for (size_t offset = 0; offset + kDmerSize <= sample.size();
+         offset += kSegmentStride) {
+      segments.push_back(Segment{&sample, offset,
+                                 std::min(kSegmentSize,
+                                          sample.size() - offset)});
+    }
+  }
+
+  // Greedily pick the best segment, then forget about its d-mers so
+  // that the next ones cover something else. Scores only go down, so
+  // a segment whose updated score is still the best is the best.
+  typedef std::pair<uint64_t, size_t> ScoredSegment;
+  std::priority_queue<ScoredSegment> queue;
+  for (size_t i = 0; i < segments.size(); ++i) {
+    queue.emplace(Score(segments[i], counts), i);
+  }
+  vector<size_t> picked;
+  size_t size(0);
+  while (!queue.empty() && size < max_size) {
+    const size_t index(queue.top().second);
+    queue.pop();
+    const Segment& segment(segments[index]);
+    const uint64_t score(Score(segment, counts));
+    if (score == 0) {
+      continue;
+    }
+    if (!queue.empty() && score < queue.top().first) {
+      queue.emplace(score, index);
+      continue;
+    }
+
+    picked.push_back(index);
+    size += segment.size;
+    const char* const data(segment.sample->data() + segment.offset);
+    for (size_t i = 0; i + kDmerSize <= segment.size; ++i) {
+      counts[Dmer(data + i)] = 0;
+    }
+  }
+
+  // deflate finds matches closer to the end of the dictionary with
+  // shorter distances, so put the best segments there.
+  string dictionary;
+  dictionary.reserve(size);
+  for (auto it = picked.rbegin(); it != picked.rend(); ++it) {
+    const Segment& segment(segments[*it]);
+    dictionary.append(*segment.sample, segment.offset, segment.size);
+  }
+  if (dictionary.size() > max_size) {
+    dictionary.erase(0, dictionary.size() - max_size);
+  }
+  return dictionary;
+}
+
+
+// static
+bool EntryCompressor::IsCompressed(const string& data) {
+  return !data.empty() && data[0] == kCompressedMarker;
+}
+
+
+void EntryCompressor::LoadDictionaries(const MetadataReader& read) {
+  CHECK(dictionaries_.empty());
+  string count_str;
+  if (!read(kDictionaryCountKey, &count_str)) {
+    return;
+  }
+  const uint32_t count(strtoul(count_str.c_str(), nullptr, 10));
+  dictionaries_.resize(count);
+  for (uint32_t version = 1; version <= count; ++version) {
+    CHECK(read(DictionaryKey(version), &dictionaries_[version - 1]))
+        << "missing compression dictionary " << version;
+  }
+}
+
+
+void EntryCompressor::AddTrainedDictionary(const vector<string>& samples,
+                                           const MetadataWriter& write) {
+  string dictionary(TrainDictionary(samples));
+  if (dictionary.empty()) {
+    LOG(WARNING) << "The " << samples.size() << " samples have nothing in "
+                 << "common to train a compression dictionary on";
+    return;
+  }
+
+  const uint32_t version(current_version() + 1);
+  write(DictionaryKey(version), dictionary);
+  write(kDictionaryCountKey, to_string(version));
+  LOG(INFO) << "Trained compression dictionary " << version << " ("
+            << dictionary.size() << " bytes) on " << samples.size()
+            << " entries";
+  dictionaries_.emplace_back(std::move(dictionary));
+}
+
+
+void EntryCompressor::MaybeTrainDictionary(int64_t entry_count,
+                                           const EntryReader& read_entry,
+                                           const MetadataWriter& write) {
+  if (current_version() > 0 || FLAGS_compression_dictionary_samples <= 0 ||
+      entry_count < FLAGS_compression_dictionary_samples) {
+    return;
+  }
+
+  // Spread the samples over the whole log.
+  vector<string> samples;
+  samples.reserve(FLAGS_compression_dictionary_samples);
+  for (int64_t i = 0; i < FLAGS_compression_dictionary_samples; ++i) {
+    string sample;
+    if (read_entry(i * entry_count / FLAGS_compression_dictionary_samples,
+                   &sample)) {
+      samples.emplace_back(std::move(sample));
+    }
+  }
+  AddTrainedDictionary(samples, write);
+}
+
+
+string EntryCompressor::Compress(const string& data) const {
+  CHECK_LE(data.size(), UINT32_MAX);
+  const uint32_t version(current_version());
+
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  // Raw deflate, the header and checksum of zlib are of no use here.
+  CHECK_EQ(Z_OK, deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                              -MAX_WBITS, 8, Z_DEFAULT_STRATEGY));
+  if (version > 0) {
+    const string& dictionary(dictionaries_[version - 1]);
+    CHECK_EQ(Z_OK,
+             deflateSetDictionary(&stream, reinterpret_cast<const Bytef*>(
+                                               dictionary.data()),
+                                  dictionary.size()));
+  }
+
+  string result(kHeaderSize + deflateBound(&stream, data.size()), '\0');
+  result[0] = kCompressedMarker;
+  PutUint32(version, &result[1]);
+  PutUint32(data.size(), &result[5]);
+
+  stream.next_in =
+      reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+  stream.avail_in = data.size();
+  stream.next_out = reinterpret_cast<Bytef*>(&result[kHeaderSize]);
+  stream.avail_out = result.size() - kHeaderSize;
+  CHECK_EQ(Z_STREAM_END, deflate(&stream, Z_FINISH));
+  result.resize(kHeaderSize + stream.total_out);
+  CHECK_EQ(Z_OK, deflateEnd(&stream));
+
+  return result;
+}
+
+
+util::Status EntryCompressor::Decompress(const string& data,
+                                         string* result) const {
+  return Decompress(data.data(), data.size(), result);
+}
+
+
+util::Status EntryCompressor::Decompress(const char* data, size_t size,
+                                         string* result) const {
+  CHECK_NOTNULL(result);
+  if (size == 0 || data[0] != kCompressedMarker) {
+    result->assign(data, size);
+    return ::util::OkStatus();
+  }
+  if (size < kHeaderSize) {
+    return util::Status(util::error::DATA_LOSS,
+                        "truncated compressed entry");
+  }
+
+  const uint32_t version(GetUint32(data + 1));
+  if (version > current_version()) {
+    return util::Status(util::error::FAILED_PRECONDITION,
+                        "unknown compression dictionary " +
+                            to_string(version));
+  }
+
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  CHECK_EQ(Z_OK, inflateInit2(&stream, -MAX_WBITS));
+  if (version > 0) {
+    const string& dictionary(dictionaries_[version - 1]);
+    CHECK_EQ(Z_OK,
+             inflateSetDictionary(&stream, reinterpret_cast<const Bytef*>(
+                                               dictionary.data()),
+                                  dictionary.size()));
+  }
+
+  result->resize(GetUint32(data + 5));
+  stream.next_in =
+      reinterpret_cast<Bytef*>(const_cast<char*>(data + kHeaderSize));
+  stream.avail_in = size - kHeaderSize;
+  stream.next_out = reinterpret_cast<Bytef*>(&(*result)[0]);
+  stream.avail_out = result->size();
+  const int ret(inflate(&stream, Z_FINISH));
+  const bool complete(ret == Z_STREAM_END &&
+                      stream.total_out == result->size() &&
+                      stream.avail_in == 0);
+  CHECK_EQ(Z_OK, inflateEnd(&stream));
+
+  if (!complete) {
+    return util::Status(util::error::DATA_LOSS, "corrupt compressed entry");
+  }
+  return ::util::OkStatus();
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,93 @@
+#ifndef CERT_TRANS_LOG_ENTRY_COMPRESSOR_H_
+#define CERT_TRANS_LOG_ENTRY_COMPRESSOR_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "util/status.h"
+
+namespace cert_trans {
+
+
+// Compresses the serialized entries stored by the Database backends
+// with deflate, using a preset dictionary trained on entries of the
+// log. Entries share issuers, OIDs and most of their chains, so a
+// dictionary holding those compresses them much better than they
+// compress on their own.
+//
+// Compressed data starts with a byte that no serialized protobuf
+// starts with, so Decompress() passes through the data stored before
+// compression was turned on. It also records the version of the
+// dictionary used, so that entries compressed with older dictionaries
+// remain readable once a new one is trained.
+//
+// The dictionaries are kept in the metadata of each database, see
+// LoadDictionaries() and AddTrainedDictionary(). These must not be
+// called concurrently with the other methods, which are thread-safe.
+class EntryCompressor {
+ public:
+  // Reads the metadata stored under |key|, returning false if there is
+  // none.
+  typedef std::function<bool(const std::string& key, std::string* value)>
+      MetadataReader;
+  typedef std::function<void(const std::string& key,
+                             const std::string& value)> MetadataWriter;
+  // Reads the serialized entry with sequence number |sequence_number|,
+  // returning false if there is none.
+  typedef std::function<bool(int64_t sequence_number, std::string* entry)>
+      EntryReader;
+
+  // The size of the deflate window, a larger dictionary is useless.
+  static const size_t kMaxDictionarySize;
+
+  EntryCompressor() = default;
+  EntryCompressor(const EntryCompressor&) = delete;
+  EntryCompressor& operator=(const EntryCompressor&) = delete;
+
+  // Returns a dictionary of up to |max_size| bytes, made of the parts
+  // of |samples| that are most common across them.
+  static std::string TrainDictionary(const std::vector<std::string>& samples,
+                                     size_t max_size = kMaxDictionarySize);
+
+  static bool IsCompressed(const std::string& data);
+
+  // Loads all the dictionaries stored in the metadata.
+  void LoadDictionaries(const MetadataReader& read);
+
+  // Trains a dictionary on |samples|, stores it in the metadata as the
+  // next version, and compresses with it from now on.
+  void AddTrainedDictionary(const std::vector<std::string>& samples,
+                            const MetadataWriter& write);
+
+  // Trains a dictionary on --compression_dictionary_samples of the
+  // |entry_count| entries, if there is no dictionary yet, and there
+  // are enough entries.
+  void MaybeTrainDictionary(int64_t entry_count,
+                            const EntryReader& read_entry,
+                            const MetadataWriter& write);
+
+  // The version of the dictionary Compress() uses, 0 if there is none
+  // yet.
+  uint32_t current_version() const {
+    return dictionaries_.size();
+  }
+
+  std::string Compress(const std::string& data) const;
+
+  // Copies |data| to |result| if it is not compressed.
+  util::Status Decompress(const std::string& data, std::string* result) const;
+  util::Status Decompress(const char* data, size_t size,
+                          std::string* result) const;
+
+ private:
+  // The dictionary of version N is at index N - 1.
+  std::vector<std::string> dictionaries_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_ENTRY_COMPRESSOR_H_
@@ -0,0 +1,217 @@
+#include "log/entry_compressor.h"
+
+#include <gflags/gflags.h>
+#include <gtest/gtest.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "log/logged_entry.h"
+#include "log/test_signer.h"
+#include "util/status_test_util.h"
+#include "util/testing.h"
+
+DECLARE_int32(compression_dictionary_samples);
+
+namespace cert_trans {
+namespace {
+
+using std::map;
+using std::string;
+using std::vector;
+using util::testing::StatusIs;
+
+
+class EntryCompressorTest : public ::testing::Test {
+ protected:
+  EntryCompressorTest()
+      : read_([this](const string& key, string* value) {
+          const auto it(metadata_.find(key));
+          if (it == metadata_.end()) {
+            return false;
+          }
+          *value = it->second;
+          return true;
+        }),
+        write_([this](const string& key, const string& value) {
+          metadata_[key] = value;
+        }) {
+  }
+
+  // Serialized entries that share their chain, as entries of a log do.
+  vector<string> Entries(int count) {
+    if (chain_.empty()) {
+      chain_.push_back(test_signer_.UniqueFakeCertBytestring());
+      chain_.push_back(test_signer_.UniqueFakeCertBytestring());
+    }
+    vector<string> entries;
+    for (int i = 0; i < count; ++i) {
+      LoggedEntry entry;
+      test_signer_.CreateUnique(&entry);
+      ct::X509ChainEntry* const x509_entry(
+          entry.mutable_entry()->mutable_x509_entry());
+      entry.mutable_entry()->set_type(ct::X509_ENTRY);
+      entry.mutable_entry()->clear_precert_entry();
+      x509_entry->set_leaf_certificate(
+          test_signer_.UniqueFakeCertBytestring());
+      x509_entry->clear_certificate_chain();
+      for (const string& cert : chain_) {
+        x509_entry->add_certificate_chain(cert);
+      }
+      entry.set_sequence_number(i);
+      entries.emplace_back();
+      CHECK(entry.SerializeToString(&entries.back()));
+    }
+    return entries;
+  }
+
+  void ExpectRoundTrip(const EntryCompressor& compressor,
+                       const string& data) {
+    const string compressed(compressor.Compress(data));
+    EXPECT_TRUE(EntryCompressor::IsCompressed(compressed));
+    string decompressed;
+    EXPECT_OK(compressor.Decompress(compressed, &decompressed));
+    EXPECT_EQ(data, decompressed);
+  }
+
+  TestSigner test_signer_;
+  vector<string> chain_;
+  map<string, string> metadata_;
+  const EntryCompressor::MetadataReader read_;
+  const EntryCompressor::MetadataWriter write_;
+};
+
+
+TEST_F(EntryCompressorTest, PassesThroughUncompressed) {
+  const EntryCompressor compressor;
+  for (const string& entry : Entries(2)) {
+    EXPECT_FALSE(EntryCompressor::IsCompressed(entry));
+    string result;
+    EXPECT_OK(compressor.Decompress(entry, &result));
+    EXPECT_EQ(entry, result);
+  }
+  string result("x");
+  EXPECT_OK(compressor.Decompress(string(), &result));
+  EXPECT_EQ("", result);
+}
+
+
+TEST_F(EntryCompressorTest, RoundTrip) {
+  EntryCompressor compressor;
+  const vector<string> entries(Entries(20));
+  ExpectRoundTrip(compressor, entries[0]);
+  ExpectRoundTrip(compressor, "");
+
+  compressor.AddTrainedDictionary(entries, write_);
+  EXPECT_EQ(1U, compressor.current_version());
+  for (const string& entry : Entries(5)) {
+    ExpectRoundTrip(compressor, entry);
+  }
+}
+
+
+TEST_F(EntryCompressorTest, DictionaryHelps) {
+  const vector<string> entries(Entries(50));
+  EntryCompressor compressor;
+  const size_t plain_size(compressor.Compress(entries.back()).size());
+  compressor.AddTrainedDictionary(
+      vector<string>(entries.begin(), entries.end() - 1), write_);
+  const size_t dictionary_size(compressor.Compress(entries.back()).size());
+  // The chain is in the dictionary.
+  EXPECT_LT(dictionary_size * 2, plain_size);
+}
+
+
+TEST_F(EntryCompressorTest, TrainDictionary) {
+  const vector<string> entries(Entries(20));
+  const string dictionary(EntryCompressor::TrainDictionary(entries, 1024));
+  EXPECT_FALSE(dictionary.empty());
+  EXPECT_LE(dictionary.size(), 1024U);
+
+  // Nothing in common, nothing to keep.
+  EXPECT_EQ("", EntryCompressor::TrainDictionary({"abcdefghijklmnop"}));
+  EXPECT_EQ("", EntryCompressor::TrainDictionary({}));
+}
+
+
+TEST_F(EntryCompressorTest, OlderDictionariesRemainReadable) {
+  const vector<string> entries(Entries(20));
+  string compressed[3];
+  {
+    EntryCompressor compressor;
+    compressed[0] = compressor.Compress(entries[0]);
+    compressor.AddTrainedDictionary(entries, write_);
+    compressed[1] = compressor.Compress(entries[1]);
+    compressor.AddTrainedDictionary(Entries(20), write_);
+    EXPECT_EQ(2U, compressor.current_version());
+    compressed[2] = compressor.Compress(entries[2]);
+  }
+
+  EntryCompressor compressor;
+  compressor.LoadDictionaries(read_);
+  EXPECT_EQ(2U, compressor.current_version());
+  for (int i = 0; i < 3; ++i) {
+    string result;
+    EXPECT_OK(compressor.Decompress(compressed[i], &result));
+    EXPECT_EQ(entries[i], result);
+  }
+
+  // Without the dictionaries, only the first one can be read.
+  const EntryCompressor without;
+  string result;
+  EXPECT_OK(without.Decompress(compressed[0], &result));
+  EXPECT_THAT(without.Decompress(compressed[1], &result),
+              StatusIs(util::error::FAILED_PRECONDITION));
+}
+
+
+TEST_F(EntryCompressorTest, MaybeTrainDictionary) {
+  const vector<string> entries(Entries(20));
+  vector<int64_t> read;
+  const EntryCompressor::EntryReader read_entry(
+      [&entries, &read](int64_t sequence_number, string* entry) {
+        read.push_back(sequence_number);
+        *entry = entries[sequence_number];
+        return true;
+      });
+
+  FLAGS_compression_dictionary_samples = 10;
+  EntryCompressor compressor;
+  compressor.MaybeTrainDictionary(9, read_entry, write_);
+  EXPECT_EQ(0U, compressor.current_version());
+  EXPECT_TRUE(read.empty());
+
+  compressor.MaybeTrainDictionary(entries.size(), read_entry, write_);
+  EXPECT_EQ(1U, compressor.current_version());
+  EXPECT_EQ((vector<int64_t>{0, 2, 4, 6, 8, 10, 12, 14, 16, 18}), read);
+
+  // Only once.
+  compressor.MaybeTrainDictionary(entries.size(), read_entry, write_);
+  EXPECT_EQ(1U, compressor.current_version());
+}
+
+
+TEST_F(EntryCompressorTest, Corrupt) {
+  EntryCompressor compressor;
+  const string entry(Entries(1)[0]);
+  string compressed(compressor.Compress(entry));
+  string result;
+  EXPECT_THAT(compressor.Decompress(compressed.substr(0, 5), &result),
+              StatusIs(util::error::DATA_LOSS));
+  EXPECT_THAT(compressor.Decompress(
+                  compressed.substr(0, compressed.size() - 1), &result),
+              StatusIs(util::error::DATA_LOSS));
+  compressed[8] ^= 1;
+  EXPECT_THAT(compressor.Decompress(compressed, &result),
+              StatusIs(util::error::DATA_LOSS));
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,343 @@
+#include "log/entry_journal.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <set>
+#include <utility>
+
+DEFINE_int64(entry_journal_segment_bytes, 64 << 20,
+             "Size past which the frontend entry journal starts a new "
+             "segment file.");
+
+using std::mutex;
+using std::set;
+using std::string;
+using std::unique_lock;
+using std::unique_ptr;
+using std::vector;
+using util::Status;
+using util::StatusOr;
+
+namespace cert_trans {
+namespace {
+
+
+const char kSegmentPrefix[] = "journal-";
+const size_t kLengthSize = 4;
+
+
+Status ErrnoStatus(const string& what, const string& path) {
+  return Status(util::error::INTERNAL,
+                what + " " + path + ": " + strerror(errno));
+}
+
+
+Status WriteFully(int fd, const char* data, size_t size) {
+  while (size > 0) {
+    const ssize_t written(write(fd, data, size));
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return Status(util::error::INTERNAL,
+                    string("write failed: ") + strerror(errno));
+    }
+    data += written;
+    size -= written;
+  }
+  return ::util::OkStatus();
+}
+
+
+Status ReadFile(const string& path, string* contents) {
+  const int fd(open(path.c_str(), O_RDONLY));
+  if (fd < 0) {
+    return ErrnoStatus("cannot open", path);
+  }
+  contents->clear();
+  char buf[65536];
+  while (true) {
+    const ssize_t got(read(fd, buf, sizeof(buf)));
+    if (got < 0) {
+      if (errno == EINTR)
+        continue;
+      const Status status(ErrnoStatus("cannot read", path));
+      close(fd);
+      return status;
+    }
+    if (got == 0) {
+      break;
+    }
+    contents->append(buf, got);
+  }
+  close(fd);
+  return ::util::OkStatus();
+}
+
+
+// Returns the numbers of the segment files in |dir|, in order.
+StatusOr<set<int64_t>> ListSegments(const string& dir) {
+  DIR* const d(opendir(dir.c_str()));
+  if (d == nullptr) {
+    return ErrnoStatus("cannot open directory", dir);
+  }
+  set<int64_t> segments;
+  const size_t prefix_size(strlen(kSegmentPrefix));
+  while (struct dirent* const ent = readdir(d)) {
+    const string name(ent->d_name);
+    if (name.compare(0, prefix_size, kSegmentPrefix) != 0 ||
+        name.size() == prefix_size) {
+      continue;
+    }
+    char* end;
+    const int64_t segment(strtoll(name.c_str() + prefix_size, &end, 10));
+    if (*end != '\0' || segment < 0) {
+      LOG(WARNING) << "Ignoring unexpected file in journal directory: "
+                   << name;
+      continue;
+    }
+    segments.insert(segment);
+  }
+  closedir(d);
+  return segments;
+}
+
+
+string EncodeRecord(const LoggedEntry& entry) {
+  string serialized;
+  CHECK(entry.SerializeToString(&serialized));
+  const uint32_t size(serialized.size());
+  string record;
+  record.reserve(kLengthSize + serialized.size());
+  for (size_t i = 0; i < kLengthSize; ++i) {
+    record.push_back(static_cast<char>((size >> (8 * i)) & 0xff));
+  }
+  record.append(serialized);
+  return record;
+}
+
+
+// Appends the entries in the records of |contents| to |recovered|,
+// stopping at the first partial or unparseable one.
+void DecodeRecords(const string& path, int64_t segment,
+                   const string& contents,
+                   vector<EntryJournal::Recovered>* recovered) {
+  size_t pos(0);
+  while (contents.size() - pos >= kLengthSize) {
+    uint32_t size(0);
+    for (size_t i = 0; i < kLengthSize; ++i) {
+      size |= static_cast<uint32_t>(
+                  static_cast<unsigned char>(contents[pos + i]))
+              << (8 * i);
+    }
+    if (contents.size() - pos - kLengthSize < size) {
+      break;
+    }
+    EntryJournal::Recovered rec;
+    rec.segment = segment;
+    if (!rec.entry.ParseFromArray(contents.data() + pos + kLengthSize,
+                                  size)) {
+      LOG(WARNING) << "Corrupt record at offset " << pos << " of " << path;
+      return;
+    }
+    recovered->emplace_back(std::move(rec));
+    pos += kLengthSize + size;
+  }
+  LOG_IF(WARNING, pos != contents.size())
+      << "Ignoring " << contents.size() - pos << " trailing bytes of "
+      << path;
+}
+
+
+}  // namespace
+
+
+// static
+StatusOr<unique_ptr<EntryJournal>> EntryJournal::Open(const string& dir) {
+  const StatusOr<set<int64_t>> segments(ListSegments(dir));
+  if (!segments.ok()) {
+    return segments.status();
+  }
+
+  vector<Recovered> recovered;
+  for (const int64_t segment : segments.ValueOrDie()) {
+    const string path(dir + "/" + kSegmentPrefix + std::to_string(segment));
+    string contents;
+    const Status status(ReadFile(path, &contents));
+    if (!status.ok()) {
+      return status;
+    }
+    DecodeRecords(path, segment, contents, &recovered);
+  }
+
+  const int64_t segment(segments.ValueOrDie().empty()
+                            ? 0
+                            : *segments.ValueOrDie().rbegin() + 1);
+  const string path(dir + "/" + kSegmentPrefix + std::to_string(segment));
+  const int fd(open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644));
+  if (fd < 0) {
+    return ErrnoStatus("cannot create", path);
+  }
+
+  unique_ptr<EntryJournal> journal(
+      new EntryJournal(dir, segment, fd, &recovered));
+  // Segments left empty, or holding only torn records, are done with.
+  unique_lock<mutex> lock(journal->lock_);
+  for (const int64_t old_segment : segments.ValueOrDie()) {
+    journal->MaybeDelete(old_segment);
+  }
+  lock.unlock();
+  return std::move(journal);
+}
+
+
+EntryJournal::EntryJournal(const string& dir, int64_t segment, int fd,
+                           vector<Recovered>* recovered)
+    : dir_(dir),
+      segment_(segment),
+      fd_(fd),
+      segment_bytes_(0),
+      appended_(0),
+      synced_(0),
+      writing_(false),
+      failed_from_(0) {
+  recovered_.swap(*recovered);
+  for (const Recovered& rec : recovered_) {
+    ++outstanding_[rec.segment];
+  }
+}
+
+
+EntryJournal::~EntryJournal() {
+  unique_lock<mutex> lock(lock_);
+  CHECK(!writing_);
+  close(fd_);
+  fd_ = -1;
+  MaybeDelete(segment_);
+}
+
+
+void EntryJournal::TakeRecovered(vector<Recovered>* recovered) {
+  unique_lock<mutex> lock(lock_);
+  recovered->clear();
+  recovered->swap(recovered_);
+}
+
+
+Status EntryJournal::Append(const LoggedEntry& entry, int64_t* segment) {
+  const string record(EncodeRecord(entry));
+
+  unique_lock<mutex> lock(lock_);
+  if (!write_status_.ok()) {
+    return write_status_;
+  }
+  const uint64_t seq(++appended_);
+  buffer_.append(record);
+  *segment = segment_;
+  ++outstanding_[segment_];
+
+  while (synced_ < seq && write_status_.ok()) {
+    if (writing_) {
+      synced_cv_.wait(lock);
+      continue;
+    }
+
+    // Write out everything appended so far, including for the callers
+    // waiting for the previous write.
+    writing_ = true;
+    string data;
+    data.swap(buffer_);
+    const uint64_t last(appended_);
+    const int fd(fd_);
+    lock.unlock();
+
+    Status status(WriteFully(fd, data.data(), data.size()));
+    if (status.ok() && fdatasync(fd) != 0) {
+      status = Status(util::error::INTERNAL,
+                      string("fdatasync failed: ") + strerror(errno));
+    }
+
+    lock.lock();
+    writing_ = false;
+    if (!status.ok() && write_status_.ok()) {
+      LOG(ERROR) << "Journal write failed: " << status;
+      write_status_ = status;
+      failed_from_ = synced_ + 1;
+    }
+    synced_ = last;
+    segment_bytes_ += data.size();
+    if (write_status_.ok() &&
+        segment_bytes_ >=
+            static_cast<size_t>(FLAGS_entry_journal_segment_bytes)) {
+      const Status rotate_status(Rotate());
+      LOG_IF(WARNING, !rotate_status.ok())
+          << "Cannot start a new journal segment: " << rotate_status;
+    }
+    synced_cv_.notify_all();
+  }
+
+  if (!write_status_.ok() && seq >= failed_from_) {
+    return write_status_;
+  }
+  return ::util::OkStatus();
+}
+
+
+void EntryJournal::Replicated(int64_t segment) {
+  unique_lock<mutex> lock(lock_);
+  const auto it(outstanding_.find(segment));
+  CHECK(it != outstanding_.end()) << "unknown segment " << segment;
+  CHECK_GT(it->second, 0);
+  --it->second;
+  MaybeDelete(segment);
+}
+
+
+string EntryJournal::SegmentPath(int64_t segment) const {
+  return dir_ + "/" + kSegmentPrefix + std::to_string(segment);
+}
+
+
+Status EntryJournal::Rotate() {
+  CHECK(!writing_);
+  const string path(SegmentPath(segment_ + 1));
+  const int fd(open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644));
+  if (fd < 0) {
+    return ErrnoStatus("cannot create", path);
+  }
+  close(fd_);
+  const int64_t old_segment(segment_);
+  fd_ = fd;
+  ++segment_;
+  segment_bytes_ = 0;
+  MaybeDelete(old_segment);
+  return ::util::OkStatus();
+}
+
+
+void EntryJournal::MaybeDelete(int64_t segment) {
+  // The current segment is kept for appending to, until the journal is
+  // closed.
+  if (segment == segment_ && fd_ >= 0) {
+    return;
+  }
+  const auto it(outstanding_.find(segment));
+  if (it != outstanding_.end()) {
+    if (it->second > 0) {
+      return;
+    }
+    outstanding_.erase(it);
+  }
+  const string path(SegmentPath(segment));
+  if (unlink(path.c_str()) != 0 && errno != ENOENT) {
+    PLOG(WARNING) << "Cannot delete journal segment " << path;
+  }
+}
+
+
+}  // namespace cert_trans
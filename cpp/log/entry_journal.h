@@ -0,0 +1,102 @@
+#ifndef CERT_TRANS_LOG_ENTRY_JOURNAL_H_
+#define CERT_TRANS_LOG_ENTRY_JOURNAL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "log/logged_entry.h"
+#include "util/status.h"
+#include "util/statusor.h"
+
+namespace cert_trans {
+
+
+// Local write-ahead journal of the entries a frontend has issued SCTs
+// for, so that it can return an SCT once the entry is on its own disk,
+// rather than waiting for the consistent store. The entries are then
+// added to the consistent store in the background, and reported back
+// with Replicated(); those the process did not get to before exiting
+// are handed back by TakeRecovered() when the journal is next opened.
+//
+// The journal is a directory of segment files, named "journal-<n>" with
+// <n> increasing. Each holds records made of a little-endian 32-bit
+// length and a serialized LoggedEntryPB. A trailing partial record
+// (i.e., a torn write) is ignored. A new segment is started when the
+// current one grows past --entry_journal_segment_bytes, and the older
+// ones are deleted once all of their entries have been replicated.
+//
+// Append() is group committed: the records appended while one caller
+// is syncing the file are written and synced together by the next one.
+class EntryJournal {
+ public:
+  struct Recovered {
+    int64_t segment;
+    LoggedEntry entry;
+  };
+
+  // Opens the journal in |dir|, which must exist. The entries found in
+  // the existing segments are kept for TakeRecovered(), and new ones go
+  // to a new segment.
+  static util::StatusOr<std::unique_ptr<EntryJournal>> Open(
+      const std::string& dir);
+
+  ~EntryJournal();
+  EntryJournal(const EntryJournal&) = delete;
+  EntryJournal& operator=(const EntryJournal&) = delete;
+
+  // Moves the entries found when the journal was opened, in the order
+  // they were appended, to |recovered|. Each of them must eventually be
+  // reported with Replicated().
+  void TakeRecovered(std::vector<Recovered>* recovered);
+
+  // Writes |entry| to the journal, and returns once it is synced to
+  // disk. On success, sets |segment| to the value to pass to
+  // Replicated() for it. Once a write has failed, all later ones fail
+  // too, as the state of the file is not known.
+  util::Status Append(const LoggedEntry& entry, int64_t* segment);
+
+  // Records that an entry of |segment| has been added to the consistent
+  // store, and so no longer needs to be kept.
+  void Replicated(int64_t segment);
+
+ private:
+  EntryJournal(const std::string& dir, int64_t segment, int fd,
+               std::vector<Recovered>* recovered);
+
+  std::string SegmentPath(int64_t segment) const;
+  // Starts a new segment. |lock_| must be held and no write in flight.
+  util::Status Rotate();
+  // Deletes |segment| if it is done with. |lock_| must be held.
+  void MaybeDelete(int64_t segment);
+
+  const std::string dir_;
+  std::vector<Recovered> recovered_;
+
+  std::mutex lock_;
+  std::condition_variable synced_cv_;
+  int64_t segment_;
+  int fd_;
+  size_t segment_bytes_;
+  // Number of entries not replicated yet, by segment.
+  std::map<int64_t, int64_t> outstanding_;
+  // The records appended and not written yet.
+  std::string buffer_;
+  // Appends are numbered from 1, the ones up to |synced_| are done with.
+  uint64_t appended_;
+  uint64_t synced_;
+  bool writing_;
+  // If not OK, the appends from |failed_from_| on have failed.
+  util::Status write_status_;
+  uint64_t failed_from_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_ENTRY_JOURNAL_H_
@@ -0,0 +1,195 @@
+#include "log/entry_journal.h"
+
+#include <fcntl.h>
+#include <gflags/gflags.h>
+#include <gtest/gtest.h>
+#include <unistd.h>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "util/status_test_util.h"
+#include "util/test_db.h"
+#include "util/testing.h"
+
+DECLARE_int64(entry_journal_segment_bytes);
+
+namespace cert_trans {
+namespace {
+
+using std::string;
+using std::thread;
+using std::unique_ptr;
+using std::vector;
+using util::StatusOr;
+
+
+LoggedEntry TestEntry(int i) {
+  LoggedEntry entry;
+  entry.mutable_entry()->set_type(ct::X509_ENTRY);
+  entry.mutable_entry()->mutable_x509_entry()->set_leaf_certificate(
+      "cert" + std::to_string(i));
+  entry.mutable_sct()->set_timestamp(1000 + i);
+  return entry;
+}
+
+
+class EntryJournalTest : public ::testing::Test {
+ protected:
+  EntryJournalTest() : dir_(tmp_.TmpStorageDir()) {
+  }
+
+  unique_ptr<EntryJournal> Open() {
+    StatusOr<unique_ptr<EntryJournal>> journal(EntryJournal::Open(dir_));
+    CHECK(journal.ok()) << journal.status();
+    return std::move(journal.ValueOrDie());
+  }
+
+  vector<EntryJournal::Recovered> Recover(EntryJournal* journal) {
+    vector<EntryJournal::Recovered> recovered;
+    journal->TakeRecovered(&recovered);
+    return recovered;
+  }
+
+  int NumSegments() const {
+    int count(0);
+    for (int i = 0; i < 100; ++i) {
+      if (access((dir_ + "/journal-" + std::to_string(i)).c_str(), F_OK) ==
+          0) {
+        ++count;
+      }
+    }
+    return count;
+  }
+
+  TmpStorage tmp_;
+  const string dir_;
+};
+
+
+TEST_F(EntryJournalTest, RecoversUnreplicatedEntries) {
+  {
+    unique_ptr<EntryJournal> journal(Open());
+    EXPECT_TRUE(Recover(journal.get()).empty());
+    int64_t segments[3];
+    for (int i = 0; i < 3; ++i) {
+      EXPECT_OK(journal->Append(TestEntry(i), &segments[i]));
+    }
+    journal->Replicated(segments[1]);
+  }
+
+  unique_ptr<EntryJournal> journal(Open());
+  vector<EntryJournal::Recovered> recovered(Recover(journal.get()));
+  // Replicated() counts entries, not which ones: the journal only
+  // decides when a segment can go.
+  ASSERT_EQ(3U, recovered.size());
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_EQ(TestEntry(i), recovered[i].entry);
+  }
+}
+
+
+TEST_F(EntryJournalTest, DeletesReplicatedSegments) {
+  {
+    unique_ptr<EntryJournal> journal(Open());
+    int64_t segment;
+    EXPECT_OK(journal->Append(TestEntry(0), &segment));
+    journal->Replicated(segment);
+  }
+  EXPECT_EQ(0, NumSegments());
+
+  unique_ptr<EntryJournal> journal(Open());
+  EXPECT_TRUE(Recover(journal.get()).empty());
+}
+
+
+TEST_F(EntryJournalTest, ReplicatesRecoveredEntries) {
+  {
+    unique_ptr<EntryJournal> journal(Open());
+    int64_t segment;
+    EXPECT_OK(journal->Append(TestEntry(0), &segment));
+  }
+
+  {
+    unique_ptr<EntryJournal> journal(Open());
+    vector<EntryJournal::Recovered> recovered(Recover(journal.get()));
+    ASSERT_EQ(1U, recovered.size());
+    journal->Replicated(recovered[0].segment);
+  }
+  EXPECT_EQ(0, NumSegments());
+}
+
+
+TEST_F(EntryJournalTest, IgnoresTornRecord) {
+  {
+    unique_ptr<EntryJournal> journal(Open());
+    int64_t segment;
+    EXPECT_OK(journal->Append(TestEntry(0), &segment));
+    EXPECT_OK(journal->Append(TestEntry(1), &segment));
+  }
+  const string path(dir_ + "/journal-0");
+  const int fd(open(path.c_str(), O_WRONLY));
+  ASSERT_GE(fd, 0);
+  ASSERT_EQ(0, ftruncate(fd, lseek(fd, 0, SEEK_END) - 3));
+  close(fd);
+
+  unique_ptr<EntryJournal> journal(Open());
+  vector<EntryJournal::Recovered> recovered(Recover(journal.get()));
+  ASSERT_EQ(1U, recovered.size());
+  EXPECT_EQ(TestEntry(0), recovered[0].entry);
+}
+
+
+TEST_F(EntryJournalTest, RotatesSegments) {
+  const int64_t old_segment_bytes(FLAGS_entry_journal_segment_bytes);
+  FLAGS_entry_journal_segment_bytes = 1;
+  unique_ptr<EntryJournal> journal(Open());
+  int64_t segments[3];
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_OK(journal->Append(TestEntry(i), &segments[i]));
+  }
+  EXPECT_LT(segments[0], segments[1]);
+  EXPECT_LT(segments[1], segments[2]);
+  // The current (empty) one, and one per entry.
+  EXPECT_EQ(4, NumSegments());
+
+  journal->Replicated(segments[1]);
+  EXPECT_EQ(3, NumSegments());
+  FLAGS_entry_journal_segment_bytes = old_segment_bytes;
+}
+
+
+TEST_F(EntryJournalTest, ConcurrentAppends) {
+  const int kNumThreads(8);
+  const int kPerThread(50);
+  {
+    unique_ptr<EntryJournal> journal(Open());
+    vector<thread> threads;
+    for (int t = 0; t < kNumThreads; ++t) {
+      threads.emplace_back([&journal, t, kPerThread]() {
+        for (int i = 0; i < kPerThread; ++i) {
+          int64_t segment;
+          EXPECT_OK(journal->Append(TestEntry(t * kPerThread + i), &segment));
+        }
+      });
+    }
+    for (thread& t : threads) {
+      t.join();
+    }
+  }
+
+  unique_ptr<EntryJournal> journal(Open());
+  EXPECT_EQ(static_cast<size_t>(kNumThreads * kPerThread),
+            Recover(journal.get()).size());
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
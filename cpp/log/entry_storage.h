@@ -0,0 +1,64 @@
+#ifndef CERT_TRANS_LOG_ENTRY_STORAGE_H_
+#define CERT_TRANS_LOG_ENTRY_STORAGE_H_
+
+#include <set>
+#include <string>
+
+#include "util/status.h"
+
+namespace util {
+class Executor;
+}  // namespace util
+
+namespace cert_trans {
+
+
+// Interface of the stores of (key, data) entries that FileDB keeps its
+// certificates, tree heads, and metadata in. Implementations abort upon
+// I/O errors, and must be threadsafe.
+class EntryStorage {
+ public:
+  virtual ~EntryStorage() = default;
+  EntryStorage(const EntryStorage&) = delete;
+  EntryStorage& operator=(const EntryStorage&) = delete;
+
+  // Scan the entire database and return the list of keys.
+  virtual std::set<std::string> Scan() const = 0;
+
+  // Like Scan(), but may spread the work over |executor|.
+  virtual std::set<std::string> ParallelScan(util::Executor* executor) const {
+    return Scan();
+  }
+
+  // Write (key, data) unless an entry matching |key| already exists.
+  virtual util::Status CreateEntry(const std::string& key,
+                                   const std::string& data) = 0;
+
+  // Update an existing entry; fail if it doesn't already exist.
+  virtual util::Status UpdateEntry(const std::string& key,
+                                   const std::string& data) = 0;
+
+  // Lookup entry based on key.
+  virtual util::Status LookupEntry(const std::string& key,
+                                   std::string* result) const = 0;
+
+  // Make all the entries written so far durable. Implementations that
+  // make every write durable before returning need not override this.
+  virtual void Sync() {
+  }
+
+  // A token that changes whenever an entry is created or updated, and
+  // is much cheaper to compute than a Scan(), or the empty string if
+  // the storage has no such thing.
+  virtual std::string StateToken() const {
+    return std::string();
+  }
+
+ protected:
+  EntryStorage() = default;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_ENTRY_STORAGE_H_
@@ -2,12 +2,14 @@
 
 #include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <stdlib.h>
+#include <algorithm>
 #include <chrono>
 #include <unordered_map>
 #include <vector>
 
 #include "base/notification.h"
-#include "monitoring/event_metric.h"
+#include "log/pending_entry_store.h"
 #include "monitoring/latency.h"
 #include "monitoring/monitoring.h"
 #include "util/etcd_delete.h"
@@ -18,9 +20,11 @@
 using ct::ClusterConfig;
 using ct::ClusterNodeState;
 using ct::SequenceMapping;
+using ct::SequenceMappingChunk;
 using ct::SignedTreeHead;
 using std::bind;
 using std::chrono::seconds;
+using std::chrono::steady_clock;
 using std::lock_guard;
 using std::map;
 using std::move;
@@ -43,6 +47,40 @@ DEFINE_int32(etcd_stats_collection_interval_seconds, 2,
              "Number of seconds between fetches of etcd stats.");
 DEFINE_int32(node_state_ttl_seconds, 60,
              "TTL in seconds on the node state files.");
+DEFINE_int32(etcd_pending_entries_shard_prefix_length, 0,
+             "If not 0, the pending entries are sharded in etcd into 16 or "
+             "256 directories, by the first 1 or 2 hex digits of their "
+             "hash, rather than all kept in the one directory. This must be "
+             "the same across the cluster, and only changed while no "
+             "entries are pending.");
+DEFINE_int32(node_state_watch_coalesce_ms, 0,
+             "If not 0, the changes to the cluster node states are passed "
+             "to the watcher at most once per this many milliseconds, "
+             "rather than each on its own.");
+DEFINE_int32(etcd_sequence_mapping_chunk_size, 0,
+             "If not 0, the sequence mapping is kept in etcd as chunks of "
+             "at most this many entries, which are only ever added and "
+             "deleted, rather than as a single value rewritten by each "
+             "sequencing run. This must be the same across the cluster, "
+             "and only changed while no entries are pending.");
+DEFINE_bool(etcd_admission_control, true,
+            "Whether to admit new pending entries at a rate derived from "
+            "the rate at which entries leave etcd and from the room left "
+            "below etcd_reject_add_pending_threshold, rejecting the others "
+            "straight away, rather than admitting all of them until etcd "
+            "reaches that threshold.");
+DEFINE_double(etcd_admission_headroom_seconds, 30,
+              "With --etcd_admission_control, the room left in etcd is "
+              "admitted over this many seconds, on top of the rate at "
+              "which entries leave it.");
+DEFINE_double(etcd_admission_burst_seconds, 1,
+              "With --etcd_admission_control, how many seconds worth of "
+              "the admission rate can be admitted at once.");
+DEFINE_bool(etcd_refresh_node_state, true,
+            "Whether to only restart the TTL of this node's state in etcd "
+            "when it has not changed since it was last written, so that "
+            "the other nodes are only told about actual changes, rather "
+            "than writing it again. Needs etcd 2.3 or later.");
 
 namespace cert_trans {
 namespace {
@@ -51,6 +89,7 @@ namespace {
 const char kClusterConfigFile[] = "/cluster_config";
 const char kEntriesDir[] = "/entries/";
 const char kSequenceFile[] = "/sequence_mapping";
+const char kSequenceChunksDir[] = "/sequence_mapping_chunks/";
 const char kServingSthFile[] = "/serving_sth";
 const char kNodesDir[] = "/nodes/";
 
@@ -63,12 +102,12 @@ static Gauge<string>* etcd_store_stats =
     Gauge<string>::New("etcd_store_stats", "name",
                        "Re-export of etcd's store stats.");
 
-static EventMetric<string> etcd_throttle_delay_ms("etcd_throttle_delay_ms",
-                                                  "type",
-                                                  "Count and total thottle "
-                                                  "delay applied to requests, "
-                                                  "broken down by request "
-                                                  "type");
+static Gauge<string>* etcd_admission_rates =
+    Gauge<string>::New("etcd_admission_rates", "type",
+                       "Rates in entries per second of the admission of "
+                       "new pending entries: \"drain\" is the rate at "
+                       "which entries leave etcd, and \"admission\" that "
+                       "at which new ones are let in.");
 
 static Counter<string>* etcd_rejected_requests =
     Counter<string>::New("etcd_rejected_requests", "type",
@@ -93,6 +132,51 @@ void CheckMappingIsOrdered(const SequenceMapping& mapping) {
 }
 
 
+// Appends the entries of |chunk| to |mapping|.
+void AppendChunk(const SequenceMappingChunk& chunk, SequenceMapping* mapping) {
+  CHECK_EQ(chunk.sequence_number_delta_size(), chunk.entry_hash_size());
+  int64_t sequence_number(chunk.first_sequence_number());
+  for (int i = 0; i < chunk.entry_hash_size(); ++i) {
+    sequence_number += chunk.sequence_number_delta(i);
+    SequenceMapping::Mapping* const m(mapping->add_mapping());
+    m->set_entry_hash(chunk.entry_hash(i));
+    m->set_sequence_number(sequence_number);
+  }
+}
+
+
+// Makes a chunk of the entries of |mapping| from |begin| to |end|.
+SequenceMappingChunk MakeChunk(const SequenceMapping& mapping, int begin,
+                               int end) {
+  CHECK_LT(begin, end);
+  SequenceMappingChunk chunk;
+  int64_t sequence_number(mapping.mapping(begin).sequence_number());
+  chunk.set_first_sequence_number(sequence_number);
+  for (int i = begin; i < end; ++i) {
+    chunk.add_sequence_number_delta(mapping.mapping(i).sequence_number() -
+                                    sequence_number);
+    chunk.add_entry_hash(mapping.mapping(i).entry_hash());
+    sequence_number = mapping.mapping(i).sequence_number();
+  }
+  return chunk;
+}
+
+
+// The sequence number a chunk key is named after, or -1 for the
+// chunks directory itself.
+int64_t ChunkKeySequenceNumber(const string& key) {
+  CHECK(!key.empty());
+  if (key.back() == '/') {
+    return -1;
+  }
+  const string name(key.substr(key.rfind('/') + 1));
+  char* end;
+  const long long sequence_number(strtoll(name.c_str(), &end, 10));
+  CHECK(!name.empty() && *end == '\0') << "bad chunk key: " << key;
+  return sequence_number;
+}
+
+
 StatusOr<int64_t> GetStat(const map<string, int64_t>& stats,
                           const string& name) {
   const auto& it(stats.find(name));
@@ -129,24 +213,75 @@ StatusOr<int64_t> CalculateNumEtcdEntries(const map<string, int64_t>& stats) {
   return created.ValueOrDie() - num_removed;
 }
 
+// Combines the watches of the shards of the pending entries: holds back
+// their initial updates until every shard has reported, so that the
+// first callback still has all the pending entries, and then passes on
+// the later ones as they come, one at a time.
+class ShardedPendingEntriesWatch {
+ public:
+  ShardedPendingEntriesWatch(
+      int num_shards, const ConsistentStore::PendingEntriesCallback& cb)
+      : cb_(cb), reported_(num_shards, false), num_unreported_(num_shards) {
+  }
+
+  void OnUpdates(int shard, const vector<Update<LoggedEntry>>& updates) {
+    lock_guard<mutex> lock(lock_);
+    if (num_unreported_ == 0) {
+      cb_(updates);
+      return;
+    }
+    for (const auto& update : updates) {
+      initial_updates_.push_back(update);
+    }
+    if (!reported_[shard]) {
+      reported_[shard] = true;
+      --num_unreported_;
+    }
+    if (num_unreported_ == 0) {
+      cb_(initial_updates_);
+      initial_updates_.clear();
+    }
+  }
+
+ private:
+  const ConsistentStore::PendingEntriesCallback cb_;
+  mutex lock_;
+  vector<bool> reported_;
+  int num_unreported_;
+  vector<Update<LoggedEntry>> initial_updates_;
+};
+
+
 }  // namespace
 
 
 EtcdConsistentStore::EtcdConsistentStore(
     libevent::Base* base, util::Executor* executor, EtcdClient* client,
-    const MasterElection* election, const string& root, const string& node_id)
+    const MasterElection* election, const string& root, const string& node_id,
+    PendingEntryStore* pending_entry_store)
     : client_(CHECK_NOTNULL(client)),
       base_(CHECK_NOTNULL(base)),
       executor_(CHECK_NOTNULL(executor)),
       election_(CHECK_NOTNULL(election)),
       root_(root),
       node_id_(node_id),
+      pending_entry_store_(pending_entry_store),
+      shard_prefix_length_(FLAGS_etcd_pending_entries_shard_prefix_length),
+      chunk_size_(FLAGS_etcd_sequence_mapping_chunk_size),
       serving_sth_watch_task_(CHECK_NOTNULL(executor)),
       cluster_config_watch_task_(CHECK_NOTNULL(executor)),
       etcd_stats_task_(executor_),
+      mutex_(LockContention::Get("etcd_consistent_store")),
       received_initial_sth_(false),
       exiting_(false),
-      num_etcd_entries_(0) {
+      num_etcd_entries_(0),
+      admitted_since_stats_(0),
+      drain_rate_(0),
+      admission_rate_(-1),
+      admission_tokens_(0) {
+  CHECK_GE(shard_prefix_length_, 0);
+  CHECK_LE(shard_prefix_length_, 2);
+  CHECK_GE(chunk_size_, 0);
   // Set up watches on things we're interested in...
   WatchServingSTH(bind(&EtcdConsistentStore::OnEtcdServingSTHUpdated, this,
                        _1),
@@ -160,7 +295,7 @@ EtcdConsistentStore::EtcdConsistentStore(
   // And wait for the initial updates to come back so that we've got a
   // view on the current state before proceding...
   {
-    unique_lock<mutex> lock(mutex_);
+    unique_lock<ContendedMutex> lock(mutex_);
     serving_sth_cv_.wait(lock, [this]() { return received_initial_sth_; });
   }
 }
@@ -178,7 +313,7 @@ EtcdConsistentStore::~EtcdConsistentStore() {
   etcd_stats_task_.Wait();
   VLOG(1) << "Joining cleanup thread";
   {
-    lock_guard<mutex> lock(mutex_);
+    lock_guard<ContendedMutex> lock(mutex_);
     exiting_ = true;
   }
   serving_sth_cv_.notify_all();
@@ -212,8 +347,8 @@ StatusOr<int64_t> EtcdConsistentStore::NextAvailableSequenceNumber() const {
 }
 
 
-void EtcdConsistentStore::WaitForServingSTHVersion(unique_lock<mutex>* lock,
-                                                   const int version) {
+void EtcdConsistentStore::WaitForServingSTHVersion(
+    unique_lock<ContendedMutex>* lock, const int version) {
   VLOG(1) << "Waiting for ServingSTH version " << version;
   serving_sth_cv_.wait(*lock, [this, version]() {
     VLOG(1) << "Want version " << version << ", have: "
@@ -229,7 +364,7 @@ Status EtcdConsistentStore::SetServingSTH(const SignedTreeHead& new_sth) {
       etcd_latency_by_op_ms.GetScopedLatency("set_serving_sth"));
 
   const string full_path(GetFullPath(kServingSthFile));
-  unique_lock<mutex> lock(mutex_);
+  unique_lock<ContendedMutex> lock(mutex_);
 
   // The watcher should have already populated serving_sth_ if etcd had one.
   if (!serving_sth_) {
@@ -269,7 +404,7 @@ Status EtcdConsistentStore::SetServingSTH(const SignedTreeHead& new_sth) {
 
 
 StatusOr<SignedTreeHead> EtcdConsistentStore::GetServingSTH() const {
-  lock_guard<mutex> lock(mutex_);
+  lock_guard<ContendedMutex> lock(mutex_);
   if (serving_sth_) {
     return serving_sth_->Entry();
   } else {
@@ -279,6 +414,10 @@ StatusOr<SignedTreeHead> EtcdConsistentStore::GetServingSTH() const {
 
 
 bool LeafEntriesMatch(const LoggedEntry& a, const LoggedEntry& b) {
+  // A reference only has the hash of the leaf.
+  if (a.IsReference() || b.IsReference()) {
+    return a.Hash() == b.Hash();
+  }
   CHECK_EQ(a.entry().type(), b.entry().type());
   switch (a.entry().type()) {
     case ct::X509_ENTRY:
@@ -315,26 +454,169 @@ Status EtcdConsistentStore::AddPendingEntry(LoggedEntry* entry) {
   }
 
   const string full_path(GetEntryPath(*entry));
-  EntryHandle<LoggedEntry> handle(full_path, *entry);
+  LoggedEntry stored;
+  const bool kept(KeepPendingEntry(*entry, &stored));
+  EntryHandle<LoggedEntry> handle(full_path, stored);
   status = CreateEntry(&handle);
+  ForgetPendingEntry(*entry, kept, status);
   if (status.CanonicalCode() == util::error::FAILED_PRECONDITION) {
-    // Entry with that hash already exists.
-    EntryHandle<LoggedEntry> preexisting_entry;
-    status = GetEntry(full_path, &preexisting_entry);
-    if (!status.ok()) {
-      LOG(ERROR) << "Couldn't create or fetch " << full_path << " : "
-                 << status;
-      return status;
+    return GetExistingPendingEntry(full_path, entry);
+  }
+  return status;
+}
+
+
+void EtcdConsistentStore::AddPendingEntryAsync(LoggedEntry* entry,
+                                               Task* task) {
+  CHECK_NOTNULL(entry);
+  CHECK_NOTNULL(task);
+  CHECK(!entry->has_sequence_number());
+
+  const Status status(MaybeReject("add_pending_entry"));
+  if (!status.ok()) {
+    task->Return(status);
+    return;
+  }
+
+  LoggedEntry stored;
+  const bool kept(KeepPendingEntry(*entry, &stored));
+  string flat_entry;
+  CHECK(stored.SerializeToString(&flat_entry));
+  const string path(GetEntryPath(*entry));
+  EtcdClient::Response* const resp(new EtcdClient::Response);
+  task->DeleteWhenDone(resp);
+  client_->Create(path, ToBase64(flat_entry), resp,
+                  task->AddChild(bind(
+                      &EtcdConsistentStore::AddPendingEntryDone, this, path,
+                      entry, kept, steady_clock::now(), task, _1)));
+}
+
+
+void EtcdConsistentStore::AddPendingEntryDone(
+    const string& path, LoggedEntry* entry, bool kept,
+    const steady_clock::time_point& start, Task* task, Task* create_task) {
+  ForgetPendingEntry(*entry, kept, create_task->status());
+  if (create_task->status().CanonicalCode() !=
+      util::error::FAILED_PRECONDITION) {
+    etcd_latency_by_op_ms.RecordLatency("add_pending_entry_async",
+                                        steady_clock::now() - start);
+    task->Return(create_task->status());
+    return;
+  }
+
+  // Already pending, reply with its SCT.
+  EtcdClient::GetResponse* const resp(new EtcdClient::GetResponse);
+  task->DeleteWhenDone(resp);
+  client_->Get(path, resp,
+               task->AddChild(
+                   bind(&EtcdConsistentStore::GetExistingPendingEntryDone,
+                        this, path, entry, start, resp, task, _1)));
+}
+
+
+void EtcdConsistentStore::GetExistingPendingEntryDone(
+    const string& path, LoggedEntry* entry,
+    const steady_clock::time_point& start,
+    const EtcdClient::GetResponse* resp, Task* task, Task* get_task) {
+  etcd_latency_by_op_ms.RecordLatency("add_pending_entry_async",
+                                      steady_clock::now() - start);
+  if (!get_task->status().ok()) {
+    LOG(ERROR) << "Couldn't create or fetch " << path << " : "
+               << get_task->status();
+    task->Return(get_task->status());
+    return;
+  }
+
+  LoggedEntry preexisting_entry;
+  CHECK(preexisting_entry.ParseFromString(
+      FromBase64(resp->node.value_.c_str())));
+  // As in GetExistingPendingEntry().
+  CHECK(LeafEntriesMatch(preexisting_entry, *entry));
+  *entry->mutable_sct() = preexisting_entry.sct();
+  task->Return(
+      Status(util::error::ALREADY_EXISTS, "Pending entry already exists."));
+}
+
+
+void EtcdConsistentStore::AddPendingEntries(const vector<LoggedEntry*>& entries,
+                                            vector<Status>* statuses) {
+  ScopedLatency scoped_latency(
+      etcd_latency_by_op_ms.GetScopedLatency("add_pending_entries"));
+
+  CHECK_NOTNULL(statuses);
+  const Status status(MaybeReject("add_pending_entry"));
+  if (!status.ok()) {
+    statuses->assign(entries.size(), status);
+    return;
+  }
+
+  vector<string> paths;
+  vector<bool> kept;
+  vector<EtcdClient::Response> resps(entries.size());
+  vector<unique_ptr<SyncTask>> tasks;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    CHECK_NOTNULL(entries[i]);
+    CHECK(!entries[i]->has_sequence_number());
+    LoggedEntry stored;
+    kept.push_back(KeepPendingEntry(*entries[i], &stored));
+    string flat_entry;
+    CHECK(stored.SerializeToString(&flat_entry));
+    paths.emplace_back(GetEntryPath(*entries[i]));
+    tasks.emplace_back(new SyncTask(executor_));
+    client_->Create(paths.back(), ToBase64(flat_entry), &resps[i],
+                    tasks.back()->task());
+  }
+
+  statuses->clear();
+  for (size_t i = 0; i < entries.size(); ++i) {
+    tasks[i]->Wait();
+    ForgetPendingEntry(*entries[i], kept[i], tasks[i]->status());
+    if (tasks[i]->status().CanonicalCode() ==
+        util::error::FAILED_PRECONDITION) {
+      statuses->emplace_back(GetExistingPendingEntry(paths[i], entries[i]));
+    } else {
+      statuses->emplace_back(tasks[i]->status());
     }
+  }
+}
 
-    // Check the leaf certs are the same (we might be seeing the same cert
-    // submitted with a different chain.)
-    CHECK(LeafEntriesMatch(preexisting_entry.Entry(), *entry));
-    *entry->mutable_sct() = preexisting_entry.Entry().sct();
-    return Status(util::error::ALREADY_EXISTS,
-                  "Pending entry already exists.");
+
+bool EtcdConsistentStore::KeepPendingEntry(const LoggedEntry& entry,
+                                           LoggedEntry* stored) {
+  if (!pending_entry_store_) {
+    *stored = entry;
+    return false;
   }
-  return status;
+  *stored = entry.Reference(node_id_);
+  return pending_entry_store_->Add(entry);
+}
+
+
+void EtcdConsistentStore::ForgetPendingEntry(const LoggedEntry& entry,
+                                             bool kept, const Status& status) {
+  // Unless it was created, or it is already pending (possibly by another
+  // node, which keeps it too), nobody is going to sequence it.
+  if (kept && !status.ok() &&
+      status.CanonicalCode() != util::error::FAILED_PRECONDITION) {
+    pending_entry_store_->Remove(entry.Hash());
+  }
+}
+
+
+Status EtcdConsistentStore::GetExistingPendingEntry(const string& path,
+                                                    LoggedEntry* entry) const {
+  EntryHandle<LoggedEntry> preexisting_entry;
+  const Status status(GetEntry(path, &preexisting_entry));
+  if (!status.ok()) {
+    LOG(ERROR) << "Couldn't create or fetch " << path << " : " << status;
+    return status;
+  }
+
+  // Check the leaf certs are the same (we might be seeing the same cert
+  // submitted with a different chain.)
+  CHECK(LeafEntriesMatch(preexisting_entry.Entry(), *entry));
+  *entry->mutable_sct() = preexisting_entry.Entry().sct();
+  return Status(util::error::ALREADY_EXISTS, "Pending entry already exists.");
 }
 
 
@@ -357,7 +639,7 @@ Status EtcdConsistentStore::GetPendingEntries(
   ScopedLatency scoped_latency(
       etcd_latency_by_op_ms.GetScopedLatency("get_pending_entries"));
 
-  Status status(GetAllEntriesInDir(GetFullPath(kEntriesDir), entries));
+  Status status(GetAllEntriesInDir(GetPendingEntryDirs(), entries));
   if (status.ok()) {
     for (const auto& entry : *entries) {
       CHECK(!entry.Entry().has_sequence_number());
@@ -373,7 +655,9 @@ Status EtcdConsistentStore::GetSequenceMapping(
   ScopedLatency scoped_latency(
       etcd_latency_by_op_ms.GetScopedLatency("get_sequence_mapping"));
 
-  Status status(GetEntry(GetFullPath(kSequenceFile), sequence_mapping));
+  Status status(chunk_size_ > 0
+                    ? GetChunkedSequenceMapping(sequence_mapping)
+                    : GetEntry(GetFullPath(kSequenceFile), sequence_mapping));
   if (!status.ok()) {
     return status;
   }
@@ -393,10 +677,118 @@ Status EtcdConsistentStore::UpdateSequenceMapping(
   CHECK(entry->HasHandle());
   CheckMappingIsOrdered(entry->Entry());
   CheckMappingIsContiguousWithServingTree(entry->Entry());
+  if (chunk_size_ > 0) {
+    return AppendSequenceMappingChunks(entry);
+  }
   return UpdateEntry(entry);
 }
 
 
+Status EtcdConsistentStore::GetSequenceMappingChunks(
+    vector<EntryHandle<SequenceMappingChunk>>* chunks,
+    int64_t* etcd_index) const {
+  CHECK_NOTNULL(chunks);
+  CHECK_NOTNULL(etcd_index);
+  SyncTask task(executor_);
+  EtcdClient::GetResponse resp;
+  client_->Get(GetFullPath(kSequenceChunksDir), &resp, task.task());
+  task.Wait();
+  *etcd_index = resp.etcd_index;
+  if (task.status().CanonicalCode() == util::error::NOT_FOUND) {
+    // Nothing was ever sequenced.
+    return ::util::OkStatus();
+  }
+  if (!task.status().ok()) {
+    return task.status();
+  }
+  if (!resp.node.is_dir_) {
+    return Status(util::error::FAILED_PRECONDITION,
+                  "node is not a directory: " +
+                      GetFullPath(kSequenceChunksDir));
+  }
+
+  for (const auto& node : resp.node.nodes_) {
+    SequenceMappingChunk chunk;
+    CHECK(chunk.ParseFromString(FromBase64(node.value_.c_str())));
+    CHECK_EQ(ChunkKeySequenceNumber(node.key_), chunk.first_sequence_number());
+    chunks->emplace_back(
+        EntryHandle<SequenceMappingChunk>(node.key_, chunk,
+                                          node.modified_index_));
+  }
+  // The keys are zero-padded, so that this is also by sequence number.
+  std::sort(chunks->begin(), chunks->end(),
+            [](const EntryHandle<SequenceMappingChunk>& a,
+               const EntryHandle<SequenceMappingChunk>& b) {
+              return a.Key() < b.Key();
+            });
+  etcd_total_entries->Set("sequence_mapping_chunks", chunks->size());
+  return ::util::OkStatus();
+}
+
+
+Status EtcdConsistentStore::GetChunkedSequenceMapping(
+    EntryHandle<SequenceMapping>* sequence_mapping) const {
+  vector<EntryHandle<SequenceMappingChunk>> chunks;
+  int64_t etcd_index;
+  const Status status(GetSequenceMappingChunks(&chunks, &etcd_index));
+  if (!status.ok()) {
+    return status;
+  }
+
+  SequenceMapping mapping;
+  for (const auto& chunk : chunks) {
+    AppendChunk(chunk.Entry(), &mapping);
+  }
+  // The key is that of the next chunk to add, which the update creates
+  // (failing if another node already has).
+  const string key(mapping.mapping_size() > 0
+                       ? GetSequenceChunkPath(
+                             mapping.mapping(mapping.mapping_size() - 1)
+                                 .sequence_number() +
+                             1)
+                       : GetFullPath(kSequenceChunksDir));
+  sequence_mapping->Set(key, mapping, etcd_index);
+  return ::util::OkStatus();
+}
+
+
+Status EtcdConsistentStore::AppendSequenceMappingChunks(
+    EntryHandle<SequenceMapping>* entry) {
+  const SequenceMapping& mapping(entry->Entry());
+  // Only the entries from the key of the handle onwards are new, the
+  // ones before are already in their chunks (even if |mapping| no
+  // longer has them all: they go when their chunk is cleaned up).
+  const int64_t next_sequence_number(ChunkKeySequenceNumber(entry->Key()));
+  int begin(0);
+  while (begin < mapping.mapping_size() &&
+         mapping.mapping(begin).sequence_number() < next_sequence_number) {
+    ++begin;
+  }
+  if (begin < mapping.mapping_size() && next_sequence_number >= 0) {
+    CHECK_EQ(next_sequence_number, mapping.mapping(begin).sequence_number());
+  }
+
+  while (begin < mapping.mapping_size()) {
+    const int end(std::min(begin + chunk_size_, mapping.mapping_size()));
+    EntryHandle<SequenceMappingChunk> chunk(
+        GetSequenceChunkPath(mapping.mapping(begin).sequence_number()),
+        MakeChunk(mapping, begin, end));
+    // If this fails, the chunks already created are there for the next
+    // read of the mapping, and |entry| names the first one which was
+    // not.
+    const Status status(CreateEntry(&chunk));
+    if (!status.ok()) {
+      return status;
+    }
+    entry->SetKey(GetSequenceChunkPath(
+        mapping.mapping(end - 1).sequence_number() + 1));
+    entry->SetHandle(chunk.Handle());
+    begin = end;
+  }
+  return ::util::OkStatus();
+}
+
+
 StatusOr<ClusterNodeState> EtcdConsistentStore::GetClusterNodeState() const {
   ScopedLatency scoped_latency(
       etcd_latency_by_op_ms.GetScopedLatency("get_cluster_node_state"));
@@ -421,7 +813,32 @@ Status EtcdConsistentStore::SetClusterNodeState(
   local_state.set_node_id(node_id_);
   EntryHandle<ClusterNodeState> entry(GetNodePath(node_id_), local_state);
   const seconds ttl(FLAGS_node_state_ttl_seconds);
-  return ForceSetEntryWithTTL(ttl, &entry);
+
+  string flat_state;
+  CHECK(local_state.SerializeToString(&flat_state));
+  bool unchanged;
+  {
+    lock_guard<ContendedMutex> lock(mutex_);
+    unchanged = FLAGS_etcd_refresh_node_state && flat_state == node_state_;
+  }
+  if (unchanged) {
+    const Status status(RefreshEntryTTL(ttl, entry.Key()));
+    if (status.ok()) {
+      return status;
+    }
+    // It may have expired meanwhile, in which case it is written again.
+    LOG(WARNING) << "Couldn't refresh ClusterNodeState, writing it: "
+                 << status;
+  }
+
+  const Status status(ForceSetEntryWithTTL(ttl, &entry));
+  lock_guard<ContendedMutex> lock(mutex_);
+  if (status.ok()) {
+    node_state_.swap(flat_state);
+  } else {
+    node_state_.clear();
+  }
+  return status;
 }
 
 
@@ -466,12 +883,12 @@ void EtcdConsistentStore::WatchServingSTH(
 
 void EtcdConsistentStore::WatchClusterNodeStates(
     const ConsistentStore::ClusterNodeStateCallback& cb, Task* task) {
-  client_->Watch(
+  client_->CoalescedWatch(
       GetFullPath(kNodesDir),
       bind(&ConvertMultipleUpdate<ClusterNodeState,
                                   ConsistentStore::ClusterNodeStateCallback>,
            cb, _1),
-      task);
+      std::chrono::milliseconds(FLAGS_node_state_watch_coalesce_ms), task);
 }
 
 
@@ -487,6 +904,39 @@ void EtcdConsistentStore::WatchClusterConfig(
 }
 
 
+void EtcdConsistentStore::WatchPendingEntries(
+    const ConsistentStore::PendingEntriesCallback& cb, Task* task) {
+  if (shard_prefix_length_ == 0) {
+    client_->Watch(
+        GetFullPath(kEntriesDir),
+        bind(&ConvertMultipleUpdate<LoggedEntry,
+                                    ConsistentStore::PendingEntriesCallback>,
+             cb, _1),
+        task);
+    return;
+  }
+
+  // An etcd watch only reports the immediate children of a directory
+  // initially, so each shard gets its own.
+  const vector<string> dirs(GetPendingEntryDirs());
+  ShardedPendingEntriesWatch* const watch(
+      new ShardedPendingEntriesWatch(dirs.size(), cb));
+  task->DeleteWhenDone(watch);
+  for (size_t i = 0; i < dirs.size(); ++i) {
+    const ConsistentStore::PendingEntriesCallback shard_cb(
+        bind(&ShardedPendingEntriesWatch::OnUpdates, watch, i, _1));
+    client_->Watch(
+        dirs[i],
+        bind(&ConvertMultipleUpdate<LoggedEntry,
+                                    ConsistentStore::PendingEntriesCallback>,
+             shard_cb, _1),
+        task->AddChild([](Task*) {}));
+  }
+  // The shard watches are cancelled along with |task|.
+  task->WhenCancelled([task]() { task->Return(Status::CANCELLED); });
+}
+
+
 Status EtcdConsistentStore::SetClusterConfig(const ClusterConfig& config) {
   ScopedLatency scoped_latency(
       etcd_latency_by_op_ms.GetScopedLatency("set_cluster_config"));
@@ -518,28 +968,46 @@ Status EtcdConsistentStore::GetEntry(const string& path,
 
 
 Status EtcdConsistentStore::GetAllEntriesInDir(
-    const string& dir, vector<EntryHandle<LoggedEntry>>* entries) const {
+    const vector<string>& dirs,
+    vector<EntryHandle<LoggedEntry>>* entries) const {
   ScopedLatency scoped_latency(
       etcd_latency_by_op_ms.GetScopedLatency("get_all_entries_in_dir"));
 
   CHECK_NOTNULL(entries);
   CHECK_EQ(static_cast<size_t>(0), entries->size());
-  SyncTask task(executor_);
-  EtcdClient::GetResponse resp;
-  client_->Get(dir, &resp, task.task());
-  task.Wait();
-  if (!task.status().ok()) {
-    return task.status();
+  CHECK(!dirs.empty());
+  vector<EtcdClient::GetResponse> resps(dirs.size());
+  vector<unique_ptr<SyncTask>> tasks;
+  for (size_t i = 0; i < dirs.size(); ++i) {
+    tasks.emplace_back(new SyncTask(executor_));
+    client_->Get(dirs[i], &resps[i], tasks.back()->task());
   }
-  if (!resp.node.is_dir_) {
-    return Status(util::error::FAILED_PRECONDITION,
-                  "node is not a directory: " + dir);
+  Status status;
+  for (const auto& task : tasks) {
+    task->Wait();
+    if (status.ok() && !task->status().ok() &&
+        (dirs.size() == 1 ||
+         task->status().CanonicalCode() != util::error::NOT_FOUND)) {
+      status = task->status();
+    }
   }
-  for (const auto& node : resp.node.nodes_) {
-    LoggedEntry entry;
-    CHECK(entry.ParseFromString(FromBase64(node.value_.c_str())));
-    entries->emplace_back(
-        EntryHandle<LoggedEntry>(node.key_, entry, node.modified_index_));
+  if (!status.ok()) {
+    return status;
+  }
+  for (size_t i = 0; i < dirs.size(); ++i) {
+    if (!tasks[i]->status().ok()) {
+      continue;
+    }
+    if (!resps[i].node.is_dir_) {
+      return Status(util::error::FAILED_PRECONDITION,
+                    "node is not a directory: " + dirs[i]);
+    }
+    for (const auto& node : resps[i].node.nodes_) {
+      LoggedEntry entry;
+      CHECK(entry.ParseFromString(FromBase64(node.value_.c_str())));
+      entries->emplace_back(
+          EntryHandle<LoggedEntry>(node.key_, entry, node.modified_index_));
+    }
   }
   return ::util::OkStatus();
 }
@@ -637,6 +1105,20 @@ Status EtcdConsistentStore::ForceSetEntryWithTTL(const seconds& ttl,
 }
 
 
+Status EtcdConsistentStore::RefreshEntryTTL(const seconds& ttl,
+                                            const string& key) {
+  ScopedLatency scoped_latency(
+      etcd_latency_by_op_ms.GetScopedLatency("refresh_entry_ttl"));
+
+  CHECK_LE(0, ttl.count());
+  SyncTask task(executor_);
+  EtcdClient::Response resp;
+  client_->RefreshTTL(key, ttl, &resp, task.task());
+  task.Wait();
+  return task.status();
+}
+
+
 Status EtcdConsistentStore::DeleteEntry(const EntryHandleBase& entry) {
   ScopedLatency scoped_latency(
       etcd_latency_by_op_ms.GetScopedLatency("delete_entry"));
@@ -656,7 +1138,30 @@ string EtcdConsistentStore::GetEntryPath(const LoggedEntry& entry) const {
 
 
 string EtcdConsistentStore::GetEntryPath(const string& hash) const {
-  return GetFullPath(string(kEntriesDir) + util::HexString(hash));
+  const string hex_hash(util::HexString(hash));
+  if (shard_prefix_length_ == 0) {
+    return GetFullPath(string(kEntriesDir) + hex_hash);
+  }
+  return GetFullPath(string(kEntriesDir) +
+                     hex_hash.substr(0, shard_prefix_length_) + "/" +
+                     hex_hash);
+}
+
+
+vector<string> EtcdConsistentStore::GetPendingEntryDirs() const {
+  if (shard_prefix_length_ == 0) {
+    return {GetFullPath(kEntriesDir)};
+  }
+  vector<string> dirs;
+  for (int shard = 0; shard < 1 << (4 * shard_prefix_length_); ++shard) {
+    // The shard number, as hex digits.
+    string prefix;
+    for (int i = shard_prefix_length_ - 1; i >= 0; --i) {
+      prefix.push_back("0123456789abcdef"[(shard >> (4 * i)) & 0xf]);
+    }
+    dirs.emplace_back(GetFullPath(string(kEntriesDir) + prefix));
+  }
+  return dirs;
 }
 
 
@@ -665,6 +1170,17 @@ string EtcdConsistentStore::GetNodePath(const string& id) const {
 }
 
 
+string EtcdConsistentStore::GetSequenceChunkPath(
+    int64_t sequence_number) const {
+  CHECK_GE(sequence_number, 0);
+  // Zero-padded to the width of the largest int64_t, so that the keys
+  // sort by sequence number.
+  const string number(std::to_string(sequence_number));
+  const string padding(19 - number.size(), '0');
+  return GetFullPath(string(kSequenceChunksDir) + padding + number);
+}
+
+
 string EtcdConsistentStore::GetFullPath(const string& key) const {
   CHECK(key.size() > 0);
   CHECK_EQ('/', key[0]);
@@ -674,7 +1190,7 @@ string EtcdConsistentStore::GetFullPath(const string& key) const {
 
 void EtcdConsistentStore::CheckMappingIsContiguousWithServingTree(
     const SequenceMapping& mapping) const {
-  lock_guard<mutex> lock(mutex_);
+  lock_guard<ContendedMutex> lock(mutex_);
   if (serving_sth_ && mapping.mapping_size() > 0) {
     // The sequence numbers are signed. However the tree size must fit in
     // memory so the unsigned -> signed conversion below should not overflow.
@@ -706,9 +1222,13 @@ void EtcdConsistentStore::CheckMappingIsContiguousWithServingTree(
 template <class T>
 Update<T> EtcdConsistentStore::TypedUpdateFromNode(
     const EtcdClient::Node& node) {
-  const string raw_value(FromBase64(node.value_.c_str()));
   T thing;
-  CHECK(thing.ParseFromString(raw_value)) << raw_value;
+  // Deleted nodes have no value, which would not parse if |T| has
+  // required fields.
+  if (!node.deleted_) {
+    const string raw_value(FromBase64(node.value_.c_str()));
+    CHECK(thing.ParseFromString(raw_value)) << raw_value;
+  }
   EntryHandle<T> handle(node.key_, thing);
   if (!node.deleted_) {
     handle.SetHandle(node.modified_index_);
@@ -718,7 +1238,7 @@ Update<T> EtcdConsistentStore::TypedUpdateFromNode(
 
 
 void EtcdConsistentStore::UpdateLocalServingSTH(
-    const unique_lock<mutex>& lock,
+    const unique_lock<ContendedMutex>& lock,
     const EntryHandle<SignedTreeHead>& handle) {
   CHECK(lock.owns_lock());
   CHECK(!serving_sth_ ||
@@ -731,7 +1251,7 @@ void EtcdConsistentStore::UpdateLocalServingSTH(
 
 void EtcdConsistentStore::OnEtcdServingSTHUpdated(
     const Update<SignedTreeHead>& update) {
-  unique_lock<mutex> lock(mutex_);
+  unique_lock<ContendedMutex> lock(mutex_);
 
   if (update.exists_) {
     VLOG(1) << "Got ServingSTH version " << update.handle_.Handle() << ": "
@@ -753,7 +1273,7 @@ void EtcdConsistentStore::OnClusterConfigUpdated(
   if (update.exists_) {
     VLOG(1) << "Got ClusterConfig version " << update.handle_.Handle() << ": "
             << update.handle_.Entry().DebugString();
-    lock_guard<mutex> lock(mutex_);
+    lock_guard<ContendedMutex> lock(mutex_);
     cluster_config_.reset(new ClusterConfig(update.handle_.Entry()));
   } else {
     LOG(WARNING) << "ClusterConfig non-existent/deleted.";
@@ -772,7 +1292,7 @@ StatusOr<int64_t> EtcdConsistentStore::CleanupOldEntries() {
   }
 
   // Figure out where we're cleaning up to...
-  unique_lock<mutex> lock(mutex_);
+  unique_lock<ContendedMutex> lock(mutex_);
   if (!serving_sth_) {
     LOG(INFO) << "No current serving_sth, nothing to do.";
     return 0;
@@ -784,6 +1304,10 @@ StatusOr<int64_t> EtcdConsistentStore::CleanupOldEntries() {
   LOG(INFO) << "Cleaning old entries up to and including sequence number: "
             << clean_up_to_sequence_number;
 
+  if (chunk_size_ > 0) {
+    return CleanupOldChunks(clean_up_to_sequence_number);
+  }
+
   EntryHandle<SequenceMapping> sequence_mapping;
   Status status(GetSequenceMapping(&sequence_mapping));
   if (!status.ok()) {
@@ -815,6 +1339,59 @@ StatusOr<int64_t> EtcdConsistentStore::CleanupOldEntries() {
 }
 
 
+StatusOr<int64_t> EtcdConsistentStore::CleanupOldChunks(
+    int64_t clean_up_to_sequence_number) {
+  vector<EntryHandle<SequenceMappingChunk>> chunks;
+  int64_t etcd_index;
+  Status status(GetSequenceMappingChunks(&chunks, &etcd_index));
+  if (!status.ok()) {
+    LOG(WARNING) << "Couldn't get sequence mapping chunks: " << status;
+    return status;
+  }
+
+  vector<string> keys_to_delete;
+  vector<string> chunks_to_delete;
+  for (size_t i = 0; i < chunks.size(); ++i) {
+    SequenceMapping mapping;
+    AppendChunk(chunks[i].Entry(), &mapping);
+    int num_covered(0);
+    while (num_covered < mapping.mapping_size() &&
+           mapping.mapping(num_covered).sequence_number() <=
+               clean_up_to_sequence_number) {
+      keys_to_delete.emplace_back(
+          GetEntryPath(mapping.mapping(num_covered).entry_hash()));
+      ++num_covered;
+    }
+    // The last chunk stays, even once covered, so that a stale master
+    // appending after an older one finds its key taken.
+    if (num_covered == mapping.mapping_size() && i + 1 < chunks.size()) {
+      chunks_to_delete.emplace_back(chunks[i].Key());
+    }
+  }
+
+  // The entries of the last chunk, and of one which was only partly
+  // covered last time, can already be gone, which is fine.
+  const int64_t num_entries_cleaned(keys_to_delete.size());
+  SyncTask task(executor_);
+  EtcdForceDeleteKeys(client_, move(keys_to_delete), task.task());
+  task.Wait();
+  if (!task.status().ok()) {
+    // Keep the chunks, to try again with their entries next time.
+    LOG(WARNING) << "EtcdDeleteKeys failed: " << task.status();
+    return num_entries_cleaned;
+  }
+
+  SyncTask chunks_task(executor_);
+  EtcdForceDeleteKeys(client_, move(chunks_to_delete), chunks_task.task());
+  chunks_task.Wait();
+  if (!chunks_task.status().ok()) {
+    LOG(WARNING) << "EtcdDeleteKeys of chunks failed: "
+                 << chunks_task.status();
+  }
+  return num_entries_cleaned;
+}
+
+
 void EtcdConsistentStore::StartEtcdStatsFetch() {
   if (etcd_stats_task_.task()->CancelRequested()) {
     etcd_stats_task_.task()->Return(Status::CANCELLED);
@@ -841,7 +1418,8 @@ void EtcdConsistentStore::EtcdStatsFetchDone(
         CalculateNumEtcdEntries(response->stats));
     if (num_entries.ok()) {
       {
-        lock_guard<mutex> lock(mutex_);
+        lock_guard<ContendedMutex> lock(mutex_);
+        UpdateAdmissionRate(num_entries.ValueOrDie());
         num_etcd_entries_ = num_entries.ValueOrDie();
       }
       etcd_total_entries->Set("all", num_etcd_entries_);
@@ -857,30 +1435,83 @@ void EtcdConsistentStore::EtcdStatsFetchDone(
                    bind(&EtcdConsistentStore::StartEtcdStatsFetch, this)));
 }
 
-// This method attempts to modulate the incoming traffic in response to the
-// number of entries currently in etcd.
-//
+void EtcdConsistentStore::UpdateAdmissionRate(int64_t num_entries) {
+  const steady_clock::time_point now(steady_clock::now());
+  if (stats_time_ != steady_clock::time_point()) {
+    const double elapsed(
+        std::chrono::duration<double>(now - stats_time_).count());
+    // What came in since the last sample and is not there any more
+    // went out.
+    const int64_t drained(std::max<int64_t>(
+        0, num_etcd_entries_ + admitted_since_stats_ - num_entries));
+    if (elapsed > 0) {
+      // Smoothed, as the entries admitted take a while to show up.
+      drain_rate_ = 0.7 * drain_rate_ + 0.3 * drained / elapsed;
+    }
+  }
+  stats_time_ = now;
+  admitted_since_stats_ = 0;
+
+  if (!cluster_config_ || FLAGS_etcd_admission_headroom_seconds <= 0) {
+    return;
+  }
+  const int64_t headroom(
+      cluster_config_->etcd_reject_add_pending_threshold() - num_entries);
+  const bool first(admission_rate_ < 0);
+  admission_rate_ = std::max(
+      0.0, drain_rate_ + headroom / FLAGS_etcd_admission_headroom_seconds);
+  if (first) {
+    admission_tokens_ = std::max(
+        1.0, admission_rate_ * FLAGS_etcd_admission_burst_seconds);
+    tokens_time_ = now;
+  }
+  etcd_admission_rates->Set("drain", drain_rate_);
+  etcd_admission_rates->Set("admission", admission_rate_);
+}
+
+
 // Once the number of entries is above reject_threshold, we will start
-// returning a RESOURCE_EXHAUSTED status, which should result in a 503 being
-// sent to the client.
+// returning a RESOURCE_EXHAUSTED status, which should result in a 503
+// being sent to the client. With --etcd_admission_control, entries are
+// also turned away before that, as soon as they come faster than etcd
+// can take them, so that the clients see an early 503 rather than all
+// of them being held up once etcd is full.
 Status EtcdConsistentStore::MaybeReject(const string& type) const {
-  unique_lock<mutex> lock(mutex_);
+  lock_guard<ContendedMutex> lock(mutex_);
 
   if (!cluster_config_) {
     // No config, whatever.
     return ::util::OkStatus();
   }
 
-  const int64_t etcd_size(num_etcd_entries_);
-  const int64_t reject_threshold(
-      cluster_config_->etcd_reject_add_pending_threshold());
-  lock.unlock();
-
-  if (etcd_size >= reject_threshold) {
+  if (num_etcd_entries_ >=
+      cluster_config_->etcd_reject_add_pending_threshold()) {
     etcd_rejected_requests->Increment(type);
     return Status(util::error::RESOURCE_EXHAUSTED,
                   "Rejected due to high number of pending entries.");
   }
+
+  // Until there is a rate, there is nothing to go by.
+  if (FLAGS_etcd_admission_control && admission_rate_ >= 0) {
+    const steady_clock::time_point now(steady_clock::now());
+    const double burst(std::max(
+        1.0, admission_rate_ * FLAGS_etcd_admission_burst_seconds));
+    admission_tokens_ = std::min(
+        burst, admission_tokens_ +
+                   admission_rate_ *
+                       std::chrono::duration<double>(now - tokens_time_)
+                           .count());
+    tokens_time_ = now;
+    if (admission_tokens_ < 1) {
+      etcd_rejected_requests->Increment(type + "_rate");
+      return Status(util::error::RESOURCE_EXHAUSTED,
+                    "Rejected to keep the pending entries within what etcd "
+                    "can take.");
+    }
+    admission_tokens_ -= 1;
+  }
+
+  ++admitted_since_stats_;
   return ::util::OkStatus();
 }
 
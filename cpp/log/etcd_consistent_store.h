@@ -2,10 +2,13 @@
 #define CERT_TRANS_LOG_ETCD_CONSISTENT_STORE_H_
 
 #include <stdint.h>
+#include <chrono>
+#include <condition_variable>
 #include <memory>
 #include <mutex>
 #include <vector>
 
+#include "base/lock_contention.h"
 #include "log/consistent_store.h"
 #include "log/logged_entry.h"
 #include "proto/ct.pb.h"
@@ -17,6 +20,7 @@
 namespace cert_trans {
 
 class MasterElection;
+class PendingEntryStore;
 
 
 class EtcdConsistentStore : public ConsistentStore {
@@ -24,9 +28,15 @@ class EtcdConsistentStore : public ConsistentStore {
   // No change of ownership for |client|, |executor| must continue to be valid
   // at least as long as this object is, and should not be the libevent::Base
   // used by |client|.
+  //
+  // With a |pending_entry_store|, which must also outlive this object,
+  // the pending entries added through this object are kept there, and
+  // only their references (see LoggedEntry::Reference()) are written to
+  // etcd.
   EtcdConsistentStore(libevent::Base* base, util::Executor* executor,
                       EtcdClient* client, const MasterElection* election,
-                      const std::string& root, const std::string& node_id);
+                      const std::string& root, const std::string& node_id,
+                      PendingEntryStore* pending_entry_store = nullptr);
 
   virtual ~EtcdConsistentStore();
   EtcdConsistentStore(const EtcdConsistentStore&) = delete;
@@ -40,6 +50,13 @@ class EtcdConsistentStore : public ConsistentStore {
 
   util::Status AddPendingEntry(LoggedEntry* entry) override;
 
+  void AddPendingEntryAsync(LoggedEntry* entry, util::Task* task) override;
+
+  // etcd has no multi-key writes, so the entries are still created one
+  // by one, but all the requests are sent at once.
+  void AddPendingEntries(const std::vector<LoggedEntry*>& entries,
+                         std::vector<util::Status>* statuses) override;
+
   util::Status GetPendingEntryForHash(
       const std::string& hash, EntryHandle<LoggedEntry>* entry) const override;
 
@@ -66,6 +83,9 @@ class EtcdConsistentStore : public ConsistentStore {
   void WatchClusterConfig(const ConsistentStore::ClusterConfigCallback& cb,
                           util::Task* task) override;
 
+  void WatchPendingEntries(const ConsistentStore::PendingEntriesCallback& cb,
+                           util::Task* task) override;
+
   util::Status SetClusterConfig(const ct::ClusterConfig& config) override;
 
   // Removes sequenced entries with sequence numbers covered by the current
@@ -73,14 +93,17 @@ class EtcdConsistentStore : public ConsistentStore {
   util::StatusOr<int64_t> CleanupOldEntries() override;
 
  private:
-  void WaitForServingSTHVersion(std::unique_lock<std::mutex>* lock,
+  void WaitForServingSTHVersion(std::unique_lock<ContendedMutex>* lock,
                                 const int version);
 
   template <class T>
   util::Status GetEntry(const std::string& path, EntryHandle<T>* entry) const;
 
+  // Gets the entries in |dirs|, reading them in parallel. A missing
+  // directory is skipped if there are several, as a shard may have had
+  // no entries yet.
   util::Status GetAllEntriesInDir(
-      const std::string& dir,
+      const std::vector<std::string>& dirs,
       std::vector<EntryHandle<LoggedEntry>>* entries) const;
 
   util::Status UpdateEntry(EntryHandleBase* entry);
@@ -92,16 +115,74 @@ class EtcdConsistentStore : public ConsistentStore {
   util::Status ForceSetEntryWithTTL(const std::chrono::seconds& ttl,
                                     EntryHandleBase* entry);
 
+  // Restarts the TTL of |key|, leaving its value as it is.
+  util::Status RefreshEntryTTL(const std::chrono::seconds& ttl,
+                               const std::string& key);
+
   util::Status DeleteEntry(const EntryHandleBase& entry);
 
-  std::string GetEntryPath(const LoggedEntry& entry) const;
+  // Handles the creation of the pending |entry| at |path| having
+  // failed, because the entry is already pending: sets its SCT to that
+  // of the existing one, and returns ALREADY_EXISTS.
+  util::Status GetExistingPendingEntry(const std::string& path,
+                                       LoggedEntry* entry) const;
+
+  // The continuations of AddPendingEntryAsync(), once the creation of
+  // the pending |entry| at |path| is done, and once the existing entry
+  // is read back if it was already there.
+  void AddPendingEntryDone(const std::string& path, LoggedEntry* entry,
+                           bool kept,
+                           const std::chrono::steady_clock::time_point& start,
+                           util::Task* task, util::Task* create_task);
+  void GetExistingPendingEntryDone(
+      const std::string& path, LoggedEntry* entry,
+      const std::chrono::steady_clock::time_point& start,
+      const EtcdClient::GetResponse* resp, util::Task* task,
+      util::Task* get_task);
+
+  // Keeps |entry| in |pending_entry_store_|, if there is one, and returns
+  // whether it is new there. Sets |*stored| to what is written to etcd
+  // for it: its reference, or the entry itself without a store.
+  bool KeepPendingEntry(const LoggedEntry& entry, LoggedEntry* stored);
+  // Drops |entry| from |pending_entry_store_| if it was |kept| there, and
+  // creating it in etcd failed with |status|.
+  void ForgetPendingEntry(const LoggedEntry& entry, bool kept,
+                          const util::Status& status);
 
+  std::string GetEntryPath(const LoggedEntry& entry) const;
   std::string GetEntryPath(const std::string& hash) const;
 
+  // The directories of the pending entries: the entries directory
+  // itself, or its shards.
+  std::vector<std::string> GetPendingEntryDirs() const;
+
   std::string GetNodePath(const std::string& node_id) const;
 
+  // The key of the sequence mapping chunk starting at
+  // |sequence_number|.
+  std::string GetSequenceChunkPath(int64_t sequence_number) const;
+
   std::string GetFullPath(const std::string& key) const;
 
+  // Sets |chunks| to the sequence mapping chunks, in order, and
+  // |etcd_index| to the index they were read at.
+  util::Status GetSequenceMappingChunks(
+      std::vector<EntryHandle<ct::SequenceMappingChunk>>* chunks,
+      int64_t* etcd_index) const;
+
+  util::Status GetChunkedSequenceMapping(
+      EntryHandle<ct::SequenceMapping>* sequence_mapping) const;
+
+  // Creates the chunks for the entries of |entry| which are not in one
+  // yet.
+  util::Status AppendSequenceMappingChunks(
+      EntryHandle<ct::SequenceMapping>* entry);
+
+  // Deletes the pending entries sequenced up to (and including)
+  // |clean_up_to_sequence_number|, and the chunks which only have those.
+  util::StatusOr<int64_t> CleanupOldChunks(
+      int64_t clean_up_to_sequence_number);
+
   void CheckMappingIsContiguousWithServingTree(
       const ct::SequenceMapping& mapping) const;
 
@@ -126,7 +207,7 @@ class EtcdConsistentStore : public ConsistentStore {
   template <class T>
   static Update<T> TypedUpdateFromNode(const EtcdClient::Node& node);
 
-  void UpdateLocalServingSTH(const std::unique_lock<std::mutex>& lock,
+  void UpdateLocalServingSTH(const std::unique_lock<ContendedMutex>& lock,
                              const EntryHandle<ct::SignedTreeHead>& handle);
 
   void OnEtcdServingSTHUpdated(const Update<ct::SignedTreeHead>& update);
@@ -137,6 +218,10 @@ class EtcdConsistentStore : public ConsistentStore {
   void EtcdStatsFetchDone(EtcdClient::StatsResponse* response,
                           util::Task* task);
 
+  // Derives the admission rate from the drain rate and the room left
+  // in etcd, once it has |num_entries|. Must be called with |mutex_|.
+  void UpdateAdmissionRate(int64_t num_entries);
+
   util::Status MaybeReject(const std::string& type) const;
 
   EtcdClient* const client_;              // We don't own this.
@@ -145,17 +230,36 @@ class EtcdConsistentStore : public ConsistentStore {
   const MasterElection* const election_;  // We don't own this.
   const std::string root_;
   const std::string node_id_;
-  std::condition_variable serving_sth_cv_;
+  PendingEntryStore* const pending_entry_store_;  // We don't own this.
+  // The pending entries are sharded by this many leading hex digits of
+  // their hash, if not 0.
+  const int shard_prefix_length_;
+  // The sequence mapping is kept in chunks of at most this many
+  // entries, if not 0.
+  const int chunk_size_;
+  std::condition_variable_any serving_sth_cv_;
   util::SyncTask serving_sth_watch_task_;
   util::SyncTask cluster_config_watch_task_;
   util::SyncTask etcd_stats_task_;
 
-  mutable std::mutex mutex_;
+  mutable ContendedMutex mutex_;
   bool received_initial_sth_;
   std::unique_ptr<EntryHandle<ct::SignedTreeHead>> serving_sth_;
   std::unique_ptr<ct::ClusterConfig> cluster_config_;
   bool exiting_;
   int64_t num_etcd_entries_;
+  // The serialized node state last written by SetClusterNodeState(),
+  // if that succeeded, whose TTL only needs to be refreshed.
+  std::string node_state_;
+
+  // The admission control of MaybeReject(): a token bucket, filled at
+  // |admission_rate_| (-1 until known), in entries per second.
+  std::chrono::steady_clock::time_point stats_time_;
+  mutable int64_t admitted_since_stats_;
+  double drain_rate_;
+  double admission_rate_;
+  mutable double admission_tokens_;
+  mutable std::chrono::steady_clock::time_point tokens_time_;
 
   friend class EtcdConsistentStoreTest;
   template <class T>
@@ -25,12 +25,16 @@
 #include "util/util.h"
 
 DECLARE_int32(node_state_ttl_seconds);
+DECLARE_double(etcd_admission_headroom_seconds);
 DECLARE_int32(etcd_stats_collection_interval_seconds);
+DECLARE_int32(etcd_pending_entries_shard_prefix_length);
+DECLARE_int32(etcd_sequence_mapping_chunk_size);
 
 namespace cert_trans {
 
 
 using ct::SequenceMapping;
+using ct::SequenceMappingChunk;
 using ct::SignedTreeHead;
 using std::atomic;
 using std::bind;
@@ -402,6 +406,53 @@ TEST_F(EtcdConsistentStoreTest, TestGetPendingEntries) {
 }
 
 
+TEST_F(EtcdConsistentStoreTest, TestShardedPendingEntries) {
+  // The store reads the flag on construction.
+  FLAGS_etcd_pending_entries_shard_prefix_length = 1;
+  EtcdConsistentStore store(base_.get(), &executor_, &client_, &election_,
+                            kRoot, kNodeId);
+  FLAGS_etcd_pending_entries_shard_prefix_length = 0;
+
+  // Add entries until every shard has some, as the watch only reports
+  // once they all exist.
+  unordered_map<string, LoggedEntry> certs;
+  unordered_set<string> shards;
+  for (int i = 0; shards.size() < 16; ++i) {
+    LoggedEntry cert(MakeCert(i, "cert " + std::to_string(i)));
+    ASSERT_OK(store.AddPendingEntry(&cert));
+    const string hex_hash(util::HexString(cert.Hash()));
+    PeekEntry(string(kRoot) + "/entries/" + hex_hash.substr(0, 1) + "/" +
+                  hex_hash,
+              &cert);
+    shards.insert(hex_hash.substr(0, 1));
+    certs.insert(make_pair(cert.Hash(), cert));
+  }
+
+  vector<EntryHandle<LoggedEntry>> entries;
+  ASSERT_OK(store.GetPendingEntries(&entries));
+  EXPECT_EQ(certs.size(), entries.size());
+  for (const auto& entry : entries) {
+    EXPECT_EQ(1, certs.count(entry.Entry().Hash()));
+  }
+
+  // The first callback of the watch has all the entries.
+  Notification notification;
+  SyncTask task(&executor_);
+  store.WatchPendingEntries(
+      [&certs, &notification](const vector<Update<LoggedEntry>>& updates) {
+        if (notification.HasBeenNotified()) {
+          return;
+        }
+        EXPECT_EQ(certs.size(), updates.size());
+        notification.Notify();
+      },
+      task.task());
+  EXPECT_TRUE(notification.WaitForNotificationWithTimeout(milliseconds(5000)));
+  task.Cancel();
+  task.Wait();
+}
+
+
 TEST_F(EtcdConsistentStoreDeathTest,
        TestGetPendingEntriesBarfsWithSequencedEntry) {
   const string kPath(string(kRoot) + "/entries/");
@@ -517,6 +568,73 @@ TEST_F(EtcdConsistentStoreDeathTest,
 }
 
 
+TEST_F(EtcdConsistentStoreTest, TestChunkedSequenceMapping) {
+  // The store reads the flag on construction.
+  FLAGS_etcd_sequence_mapping_chunk_size = 2;
+  EtcdConsistentStore store(base_.get(), &executor_, &client_, &election_,
+                            kRoot, kNodeId);
+  FLAGS_etcd_sequence_mapping_chunk_size = 0;
+  const string kChunksDir(string(kRoot) + "/sequence_mapping_chunks/");
+
+  EntryHandle<SequenceMapping> mapping;
+  ASSERT_OK(store.GetSequenceMapping(&mapping));
+  EXPECT_EQ(0, mapping.Entry().mapping_size());
+  for (int i = 0; i < 5; ++i) {
+    SequenceMapping::Mapping* const m(mapping.MutableEntry()->add_mapping());
+    m->set_sequence_number(i);
+    m->set_entry_hash("hash " + std::to_string(i));
+  }
+  ASSERT_OK(store.UpdateSequenceMapping(&mapping));
+
+  // Chunks of 2, named after their first sequence number.
+  SequenceMappingChunk chunk;
+  PeekEntry(kChunksDir + "0000000000000000002", &chunk);
+  EXPECT_EQ(2, chunk.first_sequence_number());
+  ASSERT_EQ(2, chunk.entry_hash_size());
+  EXPECT_EQ("hash 3", chunk.entry_hash(1));
+  EXPECT_EQ(1, chunk.sequence_number_delta(1));
+  PeekEntry(kChunksDir + "0000000000000000004", &chunk);
+  EXPECT_EQ(1, chunk.entry_hash_size());
+
+  // Dropping entries does not rewrite their chunk, only the new ones
+  // are added.
+  EntryHandle<SequenceMapping> stale;
+  ASSERT_OK(store.GetSequenceMapping(&stale));
+  EXPECT_EQ(5, stale.Entry().mapping_size());
+  mapping.MutableEntry()->mutable_mapping()->DeleteSubrange(0, 2);
+  SequenceMapping::Mapping* m(mapping.MutableEntry()->add_mapping());
+  m->set_sequence_number(5);
+  m->set_entry_hash("hash 5");
+  ASSERT_OK(store.UpdateSequenceMapping(&mapping));
+
+  EntryHandle<SequenceMapping> current;
+  ASSERT_OK(store.GetSequenceMapping(&current));
+  ASSERT_EQ(6, current.Entry().mapping_size());
+  EXPECT_EQ(5, current.Entry().mapping(5).sequence_number());
+  EXPECT_EQ("hash 5", current.Entry().mapping(5).entry_hash());
+
+  // Appending after an outdated mapping fails.
+  m = stale.MutableEntry()->add_mapping();
+  m->set_sequence_number(5);
+  m->set_entry_hash("other hash 5");
+  EXPECT_THAT(store.UpdateSequenceMapping(&stale),
+              StatusIs(util::error::FAILED_PRECONDITION));
+
+  // Cleaning up deletes the chunks which are covered, except the last.
+  EXPECT_CALL(election_, IsMaster()).WillRepeatedly(Return(true));
+  SignedTreeHead sth;
+  sth.set_timestamp(345345);
+  sth.set_tree_size(6);
+  ASSERT_OK(store.SetServingSTH(sth));
+  const StatusOr<int64_t> num_cleaned(store.CleanupOldEntries());
+  ASSERT_OK(num_cleaned.status());
+  EXPECT_EQ(6, num_cleaned.ValueOrDie());
+  ASSERT_OK(store.GetSequenceMapping(&current));
+  ASSERT_EQ(1, current.Entry().mapping_size());
+  EXPECT_EQ(5, current.Entry().mapping(0).sequence_number());
+}
+
+
 TEST_F(EtcdConsistentStoreTest, TestSetClusterNodeState) {
   const string kPath(string(kRoot) + "/nodes/" + kNodeId);
 
@@ -556,6 +674,51 @@ TEST_F(EtcdConsistentStoreTest, TestSetClusterNodeStateHasTTL) {
 }
 
 
+TEST_F(EtcdConsistentStoreTest, TestSetClusterNodeStateRefreshesUnchanged) {
+  FLAGS_node_state_ttl_seconds = 1;
+  const string kPath(string(kRoot) + "/nodes/" + kNodeId);
+
+  ct::ClusterNodeState state;
+  state.set_node_id(kNodeId);
+  state.set_hostname("host");
+  EXPECT_OK(store_->SetClusterNodeState(state));
+  EtcdClient::GetResponse resp;
+  {
+    SyncTask task(base_.get());
+    client_.Get(kPath, &resp, task.task());
+    task.Wait();
+    ASSERT_OK(task.status());
+  }
+  const int64_t written_index(resp.node.modified_index_);
+
+  // The same state only has its TTL restarted, which keeps it past the
+  // first one.
+  std::this_thread::sleep_for(milliseconds(600));
+  EXPECT_OK(store_->SetClusterNodeState(state));
+  std::this_thread::sleep_for(milliseconds(600));
+  {
+    SyncTask task(base_.get());
+    client_.Get(kPath, &resp, task.task());
+    task.Wait();
+    ASSERT_OK(task.status());
+  }
+  EXPECT_EQ(written_index, resp.node.modified_index_);
+
+  // A change is written.
+  state.set_hostname("other_host");
+  EXPECT_OK(store_->SetClusterNodeState(state));
+  ct::ClusterNodeState set_state;
+  PeekEntry(kPath, &set_state);
+  EXPECT_EQ("other_host", set_state.hostname());
+
+  // As is the same state again, once it has expired.
+  sleep(2);
+  EXPECT_OK(store_->SetClusterNodeState(state));
+  PeekEntry(kPath, &set_state);
+  EXPECT_EQ("other_host", set_state.hostname());
+}
+
+
 TEST_F(EtcdConsistentStoreTest, WatchServingSTH) {
   Notification notify;
 
@@ -791,6 +954,25 @@ TEST_F(EtcdConsistentStoreTest, TestRejectsAddsWhenOverCapacity) {
 }
 
 
+TEST_F(EtcdConsistentStoreTest, TestAdmitsAddsAtDrainRate) {
+  const double old_headroom_seconds(FLAGS_etcd_admission_headroom_seconds);
+  FLAGS_etcd_admission_headroom_seconds = 1000;
+  ct::ClusterConfig config;
+  config.set_etcd_reject_add_pending_threshold(100);
+  ASSERT_OK(store_->SetClusterConfig(config));
+  // Nothing leaves etcd, so only the room left in it is admitted, at
+  // 0.1 entries per second.
+  sleep(2 * FLAGS_etcd_stats_collection_interval_seconds);
+
+  LoggedEntry cert1(MakeCert(1000, "cert1000"));
+  EXPECT_OK(store_->AddPendingEntry(&cert1));
+  LoggedEntry cert2(MakeCert(1001, "cert1001"));
+  EXPECT_THAT(store_->AddPendingEntry(&cert2),
+              StatusIs(util::error::RESOURCE_EXHAUSTED));
+  FLAGS_etcd_admission_headroom_seconds = old_headroom_seconds;
+}
+
+
 }  // namespace cert_trans
 
 int main(int argc, char** argv) {
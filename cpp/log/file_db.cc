@@ -1,31 +1,48 @@
 #include "log/file_db.h"
 
+#include <errno.h>
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fstream>
+#include <functional>
 #include <map>
 #include <set>
+#include <sstream>
 #include <string>
 #include <vector>
 
-#include "log/file_storage.h"
+#include "base/lock_contention.h"
+#include "log/entry_storage.h"
 #include "monitoring/latency.h"
 #include "monitoring/monitoring.h"
 #include "proto/ct.pb.h"
 #include "proto/serializer.h"
+#include "util/parallel_for.h"
+#include "util/thread_pool.h"
 #include "util/util.h"
 
+DEFINE_int32(file_db_index_threads, 0,
+             "Number of threads reading the certificates of a file database "
+             "when building its index at startup; 0 for one per core.");
+DEFINE_bool(file_db_compress_entries, false,
+            "Whether to compress the certificates written, with a "
+            "dictionary trained on the certificates of the log.");
+DECLARE_bool(db_deduplicate_chains);
+
 using cert_trans::serialization::DeserializeResult;
 using std::chrono::milliseconds;
+using std::function;
 using std::lock_guard;
-using std::make_pair;
-using std::min;
-using std::mutex;
 using std::set;
 using std::stoll;
 using std::string;
 using std::to_string;
 using std::unique_lock;
 using std::unique_ptr;
+using std::vector;
 
 namespace cert_trans {
 namespace {
@@ -35,8 +52,29 @@ static Latency<milliseconds, string> latency_by_op_ms(
     "filedb_latency_by_operation_ms", "operation",
     "Database latency in ms broken out by operation.");
 
+static Gauge<string>* index_entries =
+    Gauge<string>::New("filedb_index_entries", "state",
+                       "Number of certificates found (total) and indexed so "
+                       "far (indexed) while building the index at startup.");
+
+
+// Certificates read concurrently at a time when building the index.
+const size_t kIndexBatchSize = 16384;
+
 
 const char kMetaNodeIdKey[] = "node_id";
+const char kMetaTilePrefix[] = "tile-";
+const char kMetaFrontierPrefix[] = "frontier-";
+
+
+string TileKey(int level, int64_t index) {
+  return kMetaTilePrefix + to_string(level) + "-" + to_string(index);
+}
+
+
+string FrontierKey(int64_t tree_size) {
+  return kMetaFrontierPrefix + to_string(tree_size);
+}
 
 
 string FormatSequenceNumber(const int64_t seq) {
@@ -65,7 +103,7 @@ class FileDB::Iterator : public Database::Iterator {
   bool GetNextEntry(LoggedEntry* entry) override {
     CHECK_NOTNULL(entry);
     {
-      lock_guard<mutex> lock(db_->lock_);
+      ReaderLock lock(&db_->lock_);
       if (next_index_ >= db_->contiguous_size_) {
         set<int64_t>::const_iterator it(
             db_->sparse_entries_.lower_bound(next_index_));
@@ -88,19 +126,54 @@ class FileDB::Iterator : public Database::Iterator {
 };
 
 
-FileDB::FileDB(FileStorage* cert_storage, FileStorage* tree_storage,
-               FileStorage* meta_storage)
+FileDB::FileDB(EntryStorage* cert_storage, EntryStorage* tree_storage,
+               EntryStorage* meta_storage, const string& index_snapshot_path)
     : cert_storage_(CHECK_NOTNULL(cert_storage)),
       tree_storage_(CHECK_NOTNULL(tree_storage)),
       meta_storage_(CHECK_NOTNULL(meta_storage)),
+      compress_entries_(FLAGS_file_db_compress_entries),
+      deduplicate_chains_(FLAGS_db_deduplicate_chains),
+      lock_(LockContention::Get("file_db")),
       contiguous_size_(0),
-      latest_tree_timestamp_(0) {
+      latest_tree_timestamp_(0),
+      index_snapshot_path_(index_snapshot_path),
+      index_snapshot_current_(false),
+      hash_index_memory_("db_hash_index", [this]() {
+        ReaderLock lock(&lock_);
+        return id_by_hash_.MemoryUsage();
+      }) {
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("open"));
+  const function<bool(const string&, string*)> read_metadata(
+      [this](const string& key, string* value) {
+        return meta_storage_->LookupEntry(key, value).ok();
+      });
+  const function<void(const string&, const string&)> write_metadata(
+      [this](const string& key, const string& value) {
+        util::Status status(meta_storage_->CreateEntry(key, value));
+        if (status.CanonicalCode() == util::error::ALREADY_EXISTS) {
+          status = meta_storage_->UpdateEntry(key, value);
+        }
+        CHECK(status.ok()) << "Failed to write " << key << ": " << status;
+      });
+  // The dictionaries and chains are needed to read the certificates
+  // stored with them earlier, even if new ones are not.
+  compressor_.LoadDictionaries(read_metadata);
+  chain_certs_.reset(new ChainCertStore(read_metadata, write_metadata));
   BuildIndex();
+  if (compress_entries_) {
+    compressor_.MaybeTrainDictionary(
+        contiguous_size_,
+        [this](int64_t sequence_number, string* entry) {
+          return ReadEntry(FormatSequenceNumber(sequence_number), entry).ok();
+        },
+        write_metadata);
+  }
 }
 
 
 FileDB::~FileDB() {
+  lock_guard<ReadWriteMutex> lock(lock_);
+  SaveIndexSnapshot();
 }
 
 
@@ -113,18 +186,25 @@ Database::WriteResult FileDB::CreateSequencedEntry_(
 
   string data;
   CHECK(logged.SerializeToString(&data));
+  const string stored(EncodeEntry(logged, data));
 
   const string seq_str(FormatSequenceNumber(logged.sequence_number()));
 
-  unique_lock<mutex> lock(lock_);
+  unique_lock<ReadWriteMutex> lock(lock_);
+  InvalidateIndexSnapshot();
 
   // Try to create.
-  util::Status status(cert_storage_->CreateEntry(seq_str, data));
+  util::Status status(cert_storage_->CreateEntry(seq_str, stored));
   if (status.CanonicalCode() == util::error::ALREADY_EXISTS) {
     string existing_data;
-    status = cert_storage_->LookupEntry(seq_str, &existing_data);
+    status = ReadEntry(seq_str, &existing_data);
     CHECK_EQ(status, ::util::OkStatus());
-    if (existing_data == data) {
+    // Compared as it would be written without compression, nor with its
+    // chain kept apart.
+    LoggedEntry existing;
+    ParseEntry(existing_data, &existing);
+    CHECK(existing.SerializeToString(&existing_data));
+    if (LoggedEntry::SameSerializedEntry(existing_data, data)) {
       return this->OK;
     }
     return this->SEQUENCE_NUMBER_ALREADY_IN_USE;
@@ -141,27 +221,65 @@ Database::LookupResult FileDB::LookupByHash(const string& hash,
                                             LoggedEntry* result) const {
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("lookup_by_hash"));
 
-  unique_lock<mutex> lock(lock_);
+  vector<int64_t> candidates;
+  {
+    ReaderLock lock(&lock_);
+    id_by_hash_.Candidates(hash, &candidates);
+  }
 
-  auto i(id_by_hash_.find(hash));
-  if (i == id_by_hash_.end()) {
-    return this->NOT_FOUND;
+  for (int64_t sequence_number : candidates) {
+    string cert_data;
+    const util::Status status(
+        ReadEntry(FormatSequenceNumber(sequence_number), &cert_data));
+    // Gotta be there, or we're in trouble...
+    CHECK_EQ(status, ::util::OkStatus());
+
+    LoggedEntry logged;
+    ParseEntry(cert_data, &logged);
+    if (logged.Hash() == hash) {
+      if (result) {
+        result->CopyFrom(logged);
+      }
+      return this->LOOKUP_OK;
+    }
   }
-  const string seq_str(FormatSequenceNumber(i->second));
 
-  lock.unlock();
+  return this->NOT_FOUND;
+}
 
-  string cert_data;
-  const util::Status status(cert_storage_->LookupEntry(seq_str, &cert_data));
-  // Gotta be there, or we're in trouble...
-  CHECK_EQ(status, ::util::OkStatus());
 
-  if (result) {
-    CHECK(result->ParseFromString(cert_data));
-    CHECK_EQ(result->Hash(), hash);
+vector<Database::LookupResult> FileDB::LookupByHashes(
+    const vector<string>& hashes, vector<LoggedEntry>* results) const {
+  CHECK_NOTNULL(results)->resize(hashes.size());
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("lookup_by_hashes"));
+
+  vector<vector<int64_t>> candidates(hashes.size());
+  {
+    ReaderLock lock(&lock_);
+    for (size_t i = 0; i < hashes.size(); ++i) {
+      id_by_hash_.Candidates(hashes[i], &candidates[i]);
+    }
   }
 
-  return this->LOOKUP_OK;
+  vector<LookupResult> found(hashes.size(), this->NOT_FOUND);
+  for (size_t i = 0; i < hashes.size(); ++i) {
+    for (int64_t sequence_number : candidates[i]) {
+      string cert_data;
+      const util::Status status(
+          ReadEntry(FormatSequenceNumber(sequence_number), &cert_data));
+      CHECK_EQ(status, ::util::OkStatus());
+
+      LoggedEntry logged;
+      ParseEntry(cert_data, &logged);
+      if (logged.Hash() == hashes[i]) {
+        (*results)[i].Swap(&logged);
+        found[i] = this->LOOKUP_OK;
+        break;
+      }
+    }
+  }
+
+  return found;
 }
 
 
@@ -172,12 +290,12 @@ Database::LookupResult FileDB::LookupByIndex(int64_t sequence_number,
 
   const string seq_str(FormatSequenceNumber(sequence_number));
   string cert_data;
-  if (cert_storage_->LookupEntry(seq_str, &cert_data).CanonicalCode() ==
+  if (ReadEntry(seq_str, &cert_data).CanonicalCode() ==
       util::error::NOT_FOUND) {
     return this->NOT_FOUND;
   }
   if (result) {
-    CHECK(result->ParseFromString(cert_data));
+    ParseEntry(cert_data, result);
     CHECK_EQ(result->sequence_number(), sequence_number);
   }
   return this->LOOKUP_OK;
@@ -200,7 +318,8 @@ Database::WriteResult FileDB::WriteTreeHead_(const ct::SignedTreeHead& sth) {
   string data;
   CHECK(sth.SerializeToString(&data));
 
-  unique_lock<mutex> lock(lock_);
+  unique_lock<ReadWriteMutex> lock(lock_);
+  cert_storage_->Sync();
   util::Status status(tree_storage_->CreateEntry(timestamp_key, data));
   if (status.CanonicalCode() == util::error::ALREADY_EXISTS) {
     string existing_sth_data;
@@ -213,6 +332,7 @@ Database::WriteResult FileDB::WriteTreeHead_(const ct::SignedTreeHead& sth) {
     return this->DUPLICATE_TREE_HEAD_TIMESTAMP;
   }
   CHECK_EQ(status, ::util::OkStatus());
+  tree_storage_->Sync();
 
   if (sth.timestamp() > latest_tree_timestamp_) {
     latest_tree_timestamp_ = sth.timestamp();
@@ -229,23 +349,37 @@ Database::WriteResult FileDB::WriteTreeHead_(const ct::SignedTreeHead& sth) {
 Database::LookupResult FileDB::LatestTreeHead(
     ct::SignedTreeHead* result) const {
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("latest_tree_head"));
-  lock_guard<mutex> lock(lock_);
+  uint64_t timestamp;
+  string timestamp_key;
+  {
+    ReaderLock lock(&lock_);
+    timestamp = latest_tree_timestamp_;
+    timestamp_key = latest_timestamp_key_;
+  }
 
-  return LatestTreeHeadNoLock(result);
+  // Tree heads are never overwritten, so this one can be read without
+  // the lock, even if a newer one gets written meanwhile.
+  return ReadTreeHead(timestamp, timestamp_key, result);
 }
 
 
 int64_t FileDB::TreeSize() const {
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("tree_size"));
-  lock_guard<mutex> lock(lock_);
+  ReaderLock lock(&lock_);
 
   return contiguous_size_;
 }
 
 
+vector<std::pair<int64_t, int64_t>> FileDB::SparseRanges() const {
+  ReaderLock lock(&lock_);
+  return ToRanges(sparse_entries_);
+}
+
+
 void FileDB::AddNotifySTHCallback(
     const Database::NotifySTHCallback* callback) {
-  unique_lock<mutex> lock(lock_);
+  unique_lock<ReadWriteMutex> lock(lock_);
 
   callbacks_.Add(callback);
 
@@ -259,7 +393,7 @@ void FileDB::AddNotifySTHCallback(
 
 void FileDB::RemoveNotifySTHCallback(
     const Database::NotifySTHCallback* callback) {
-  lock_guard<mutex> lock(lock_);
+  lock_guard<ReadWriteMutex> lock(lock_);
 
   callbacks_.Remove(callback);
 }
@@ -268,7 +402,7 @@ void FileDB::RemoveNotifySTHCallback(
 void FileDB::InitializeNode(const string& node_id) {
   CHECK(!node_id.empty());
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("initialize_node"));
-  unique_lock<mutex> lock(lock_);
+  unique_lock<ReadWriteMutex> lock(lock_);
   string existing_id;
   if (NodeId(&existing_id) != this->NOT_FOUND) {
     LOG(FATAL) << "Attempting to initialze DB belonging to node with node_id: "
@@ -287,33 +421,109 @@ Database::LookupResult FileDB::NodeId(string* node_id) {
 }
 
 
+Database::WriteResult FileDB::WriteTile_(int level, int64_t index,
+                                         const string& hashes) {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("write_tile"));
+  const string key(TileKey(level, index));
+  util::Status status(meta_storage_->CreateEntry(key, hashes));
+  if (status.CanonicalCode() == util::error::ALREADY_EXISTS) {
+    status = meta_storage_->UpdateEntry(key, hashes);
+  }
+  CHECK(status.ok()) << "Failed to write tile " << key << ": " << status;
+  return this->OK;
+}
+
+
+Database::LookupResult FileDB::LookupTile(int level, int64_t index,
+                                          string* hashes) const {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("lookup_tile"));
+  CHECK_NOTNULL(hashes);
+  if (!meta_storage_->LookupEntry(TileKey(level, index), hashes).ok()) {
+    return this->NOT_FOUND;
+  }
+  return this->LOOKUP_OK;
+}
+
+
+Database::WriteResult FileDB::WriteFrontier_(int64_t tree_size,
+                                             const string& hashes) {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("write_frontier"));
+  const string key(FrontierKey(tree_size));
+  util::Status status(meta_storage_->CreateEntry(key, hashes));
+  if (status.CanonicalCode() == util::error::ALREADY_EXISTS) {
+    status = meta_storage_->UpdateEntry(key, hashes);
+  }
+  CHECK(status.ok()) << "Failed to write frontier " << key << ": " << status;
+  return this->OK;
+}
+
+
+Database::LookupResult FileDB::LookupFrontier(int64_t tree_size,
+                                              string* hashes) const {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("lookup_frontier"));
+  CHECK_NOTNULL(hashes);
+  if (!meta_storage_->LookupEntry(FrontierKey(tree_size), hashes).ok()) {
+    return this->NOT_FOUND;
+  }
+  return this->LOOKUP_OK;
+}
+
+
 void FileDB::BuildIndex() {
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("build_index"));
   // Technically, this should only be called from the constructor, so
   // this should not be necessarily, but just to be sure...
-  lock_guard<mutex> lock(lock_);
-
-  const set<string> sequence_numbers(cert_storage_->Scan());
-  id_by_hash_.reserve(sequence_numbers.size());
-
-  for (const auto& seq_path : sequence_numbers) {
-    const int64_t seq(ParseSequenceNumber(seq_path));
-    string cert_data;
-    // Read the data; tolerate no errors.
-    CHECK_EQ(cert_storage_->LookupEntry(seq_path, &cert_data),
-             ::util::OkStatus())
-        << "Failed to read entry with sequence number " << seq;
-
-    LoggedEntry logged;
-    CHECK(logged.ParseFromString(cert_data))
-        << "Failed to parse entry with sequence number " << seq;
-    CHECK(logged.has_sequence_number())
-        << "sequence_number() is unset for for entry with sequence number "
-        << seq;
-    CHECK_EQ(logged.sequence_number(), seq)
-        << "Entry has a negative sequence_number(): " << seq;
+  lock_guard<ReadWriteMutex> lock(lock_);
+
+  if (!LoadIndexSnapshot()) {
+    const unique_ptr<ThreadPool> pool(
+        FLAGS_file_db_index_threads > 0
+            ? new ThreadPool(FLAGS_file_db_index_threads)
+            : new ThreadPool);
+    const set<string> sequence_numbers(
+        cert_storage_->ParallelScan(pool.get()));
+    id_by_hash_.Reserve(sequence_numbers.size());
+    index_entries->Set("total", sequence_numbers.size());
+
+    // Read and hash the entries a batch at a time, so that only the
+    // hashes of one batch are held at once.
+    vector<const string*> batch;
+    vector<string> hashes;
+    size_t indexed(0);
+    auto next(sequence_numbers.begin());
+    while (next != sequence_numbers.end()) {
+      batch.clear();
+      for (; next != sequence_numbers.end() && batch.size() < kIndexBatchSize;
+           ++next) {
+        batch.push_back(&*next);
+      }
+      hashes.resize(batch.size());
+      util::ParallelFor(pool.get(), batch.size(), [&](size_t i) {
+        const int64_t seq(ParseSequenceNumber(*batch[i]));
+        string cert_data;
+        // Read the data; tolerate no errors.
+        CHECK_EQ(ReadEntry(*batch[i], &cert_data), ::util::OkStatus())
+            << "Failed to read entry with sequence number " << seq;
+
+        LoggedEntry logged;
+        CHECK(logged.ParseFromString(cert_data))
+            << "Failed to parse entry with sequence number " << seq;
+        CHECK(logged.has_sequence_number())
+            << "sequence_number() is unset for for entry with sequence "
+            << "number " << seq;
+        CHECK_EQ(logged.sequence_number(), seq)
+            << "Entry has a negative sequence_number(): " << seq;
+        hashes[i] = logged.Hash();
+      });
+
+      for (size_t i = 0; i < batch.size(); ++i) {
+        InsertEntryMapping(ParseSequenceNumber(*batch[i]), hashes[i]);
+      }
+      indexed += batch.size();
+      index_entries->Set("indexed", indexed);
+    }
 
-    InsertEntryMapping(logged.sequence_number(), logged.Hash());
+    SaveIndexSnapshot();
   }
 
   // Now read the STH entries.
@@ -328,30 +538,177 @@ void FileDB::BuildIndex() {
 }
 
 
+string FileDB::EncodeEntry(const LoggedEntry& logged,
+                           const string& data) const {
+  string result;
+  if (deduplicate_chains_) {
+    LoggedEntry copy;
+    copy.CopyFrom(logged);
+    chain_certs_->Deduplicate(&copy);
+    CHECK(copy.SerializeToString(&result));
+  } else {
+    result = data;
+  }
+  return compress_entries_ ? compressor_.Compress(result) : result;
+}
+
+
+util::Status FileDB::ReadEntry(const string& seq_str, string* data) const {
+  string stored;
+  const util::Status status(cert_storage_->LookupEntry(seq_str, &stored));
+  if (!status.ok()) {
+    return status;
+  }
+  return compressor_.Decompress(stored, data);
+}
+
+
+void FileDB::ParseEntry(const string& data, LoggedEntry* entry) const {
+  CHECK(entry->ParseFromString(data)) << "Failed to parse entry";
+  const util::Status status(chain_certs_->Restore(entry));
+  CHECK(status.ok()) << "Failed to restore the chain of entry "
+                     << entry->sequence_number() << ": " << status;
+}
+
+
 Database::LookupResult FileDB::LatestTreeHeadNoLock(
     ct::SignedTreeHead* result) const {
-  if (latest_tree_timestamp_ == 0) {
+  return ReadTreeHead(latest_tree_timestamp_, latest_timestamp_key_, result);
+}
+
+
+Database::LookupResult FileDB::ReadTreeHead(uint64_t timestamp,
+                                            const string& timestamp_key,
+                                            ct::SignedTreeHead* result) const {
+  if (timestamp == 0) {
     return this->NOT_FOUND;
   }
 
   string tree_data;
-  CHECK_EQ(tree_storage_->LookupEntry(latest_timestamp_key_, &tree_data),
+  CHECK_EQ(tree_storage_->LookupEntry(timestamp_key, &tree_data),
            ::util::OkStatus());
 
   CHECK(result->ParseFromString(tree_data));
-  CHECK_EQ(result->timestamp(), latest_tree_timestamp_);
+  CHECK_EQ(result->timestamp(), timestamp);
 
   return this->LOOKUP_OK;
 }
 
 
 // This must be called with "lock_" held.
-void FileDB::InsertEntryMapping(int64_t sequence_number, const string& hash) {
-  if (!id_by_hash_.insert(make_pair(hash, sequence_number)).second) {
-    // This is a duplicate hash under a new sequence number.
-    // Make sure we track the entry with the lowest sequence number:
-    id_by_hash_[hash] = min(id_by_hash_[hash], sequence_number);
+bool FileDB::LoadIndexSnapshot() {
+  if (index_snapshot_path_.empty()) {
+    return false;
   }
+  const string token(cert_storage_->StateToken());
+  string meta;
+  if (token.empty() ||
+      !util::ReadBinaryFile(index_snapshot_path_ + ".meta", &meta)) {
+    return false;
+  }
+
+  std::istringstream in(meta);
+  string snapshot_token;
+  int64_t contiguous_size;
+  size_t index_size, sparse_count;
+  if (!(in >> snapshot_token >> contiguous_size >> index_size >>
+        sparse_count) ||
+      snapshot_token != token) {
+    LOG(INFO) << "Index snapshot " << index_snapshot_path_
+              << " is out of date";
+    return false;
+  }
+  set<int64_t> sparse_entries;
+  for (size_t i = 0; i < sparse_count; ++i) {
+    int64_t seq;
+    if (!(in >> seq)) {
+      LOG(WARNING) << "Index snapshot " << index_snapshot_path_
+                   << " is truncated";
+      return false;
+    }
+    sparse_entries.insert(sparse_entries.end(), seq);
+  }
+
+  util::StatusOr<unique_ptr<LeafHashIndex>> index(
+      LeafHashIndex::Load(index_snapshot_path_));
+  if (!index.ok() || index.ValueOrDie()->size() != index_size) {
+    LOG(WARNING) << "Cannot load the index snapshot " << index_snapshot_path_
+                 << ": "
+                 << (index.ok() ? "wrong size" : index.status().ToString());
+    return false;
+  }
+
+  id_by_hash_.Swap(index.ValueOrDie().get());
+  contiguous_size_ = contiguous_size;
+  sparse_entries_.swap(sparse_entries);
+  index_snapshot_current_ = true;
+  index_entries->Set("total", index_size);
+  index_entries->Set("indexed", index_size);
+  LOG(INFO) << "Loaded the index of " << index_size << " certificates from "
+            << index_snapshot_path_;
+  return true;
+}
+
+
+void FileDB::SaveIndexSnapshot() {
+  if (index_snapshot_path_.empty() || index_snapshot_current_) {
+    return;
+  }
+  const string token(cert_storage_->StateToken());
+  if (token.empty()) {
+    return;
+  }
+  const string meta_path(index_snapshot_path_ + ".meta");
+  PCHECK(unlink(meta_path.c_str()) == 0 || errno == ENOENT)
+      << "Cannot remove the index snapshot " << meta_path;
+  // The snapshot must not refer to certificates a crash could lose.
+  cert_storage_->Sync();
+
+  const util::Status status(id_by_hash_.Save(index_snapshot_path_));
+  if (!status.ok()) {
+    LOG(WARNING) << "Cannot save the index snapshot: " << status;
+    return;
+  }
+
+  const string tmp_path(meta_path + ".tmp");
+  {
+    std::ofstream out(tmp_path, std::ios::trunc);
+    out << token << "\n"
+        << contiguous_size_ << "\n"
+        << id_by_hash_.size() << "\n"
+        << sparse_entries_.size() << "\n";
+    for (int64_t seq : sparse_entries_) {
+      out << seq << "\n";
+    }
+    out.flush();
+    if (!out) {
+      LOG(WARNING) << "Cannot write " << tmp_path;
+      return;
+    }
+  }
+  if (rename(tmp_path.c_str(), meta_path.c_str()) != 0) {
+    PLOG(WARNING) << "Cannot rename " << tmp_path << " to " << meta_path;
+    return;
+  }
+  index_snapshot_current_ = true;
+}
+
+
+void FileDB::InvalidateIndexSnapshot() {
+  if (!index_snapshot_current_) {
+    return;
+  }
+  const string meta_path(index_snapshot_path_ + ".meta");
+  PCHECK(unlink(meta_path.c_str()) == 0 || errno == ENOENT)
+      << "Cannot remove the index snapshot " << meta_path;
+  index_snapshot_current_ = false;
+}
+
+
+void FileDB::InsertEntryMapping(int64_t sequence_number, const string& hash) {
+  // Duplicate hashes are kept under all their sequence numbers, and
+  // lookups return the entry with the lowest one.
+  id_by_hash_.Insert(hash, sequence_number);
 
   if (sequence_number == contiguous_size_) {
     ++contiguous_size_;
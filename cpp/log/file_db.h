@@ -6,16 +6,21 @@
 #include <memory>
 #include <mutex>
 #include <set>
-#include <unordered_map>
+#include <string>
 #include <vector>
 
+#include "base/read_write_mutex.h"
+#include "log/chain_cert_store.h"
 #include "log/database.h"
+#include "log/entry_compressor.h"
+#include "log/leaf_hash_index.h"
+#include "monitoring/memory.h"
 #include "proto/ct.pb.h"
 #include "util/statusor.h"
 
 namespace cert_trans {
 
-class FileStorage;
+class EntryStorage;
 
 
 // Database interface that stores certificates and tree head
@@ -33,8 +38,22 @@ class FileDB : public Database {
   // of 8 buckets tree head updates within about 1 minute
   // (timestamps xxxxxxxx0000 - xxxxxxxxFFFF) to the same directory.
   // Takes ownership of |cert_storage|, |tree_storage|, and |meta_storage|.
-  FileDB(FileStorage* cert_storage, FileStorage* tree_storage,
-         FileStorage* meta_storage);
+  // The certificates written are synced before each tree head is
+  // written, so with storage that batches syncs (such as
+  // SegmentStorage), a tree head never covers entries that a crash
+  // could lose.
+  // The certificates are read concurrently on --file_db_index_threads
+  // threads when building the index. If |index_snapshot_path| is not
+  // empty, the index is saved there (and to |index_snapshot_path|.meta)
+  // after it is built and on destruction, and loaded from there instead
+  // of being rebuilt if the StateToken() of |cert_storage| is unchanged.
+  // With --file_db_compress_entries, the certificates are compressed
+  // with a dictionary kept in |meta_storage| (see EntryCompressor).
+  // With --db_deduplicate_chains, their chains are kept apart, in
+  // |meta_storage| too (see ChainCertStore).
+  FileDB(EntryStorage* cert_storage, EntryStorage* tree_storage,
+         EntryStorage* meta_storage,
+         const std::string& index_snapshot_path = std::string());
   ~FileDB();
   FileDB(const FileDB&) = delete;
   FileDB& operator=(const FileDB&) = delete;
@@ -51,6 +70,12 @@ class FileDB : public Database {
   Database::LookupResult LookupByIndex(int64_t sequence_number,
                                        LoggedEntry* result) const override;
 
+  // Finds the candidates of all the hashes with the lock held once.
+  std::vector<Database::LookupResult> LookupByHashes(
+      const std::vector<std::string>& hashes,
+      std::vector<LoggedEntry>* results) const override;
+
+  using Database::ScanEntries;
   std::unique_ptr<Database::Iterator> ScanEntries(
       int64_t start_index) const override;
 
@@ -61,6 +86,8 @@ class FileDB : public Database {
 
   int64_t TreeSize() const override;
 
+  std::vector<std::pair<int64_t, int64_t>> SparseRanges() const override;
+
   void AddNotifySTHCallback(
       const Database::NotifySTHCallback* callback) override;
 
@@ -71,26 +98,64 @@ class FileDB : public Database {
 
   Database::LookupResult NodeId(std::string* node_id) override;
 
+  Database::WriteResult WriteTile_(int level, int64_t index,
+                                   const std::string& hashes) override;
+
+  Database::LookupResult LookupTile(int level, int64_t index,
+                                    std::string* hashes) const override;
+
+  Database::WriteResult WriteFrontier_(int64_t tree_size,
+                                       const std::string& hashes) override;
+
+  Database::LookupResult LookupFrontier(int64_t tree_size,
+                                        std::string* hashes) const override;
+
  private:
   class Iterator;
 
   void BuildIndex();
+  // Returns what to store for |logged|, which serializes to |data|.
+  std::string EncodeEntry(const LoggedEntry& logged,
+                          const std::string& data) const;
+  // Returns the serialized entry stored under |seq_str|, without its
+  // chain if it is kept apart, or NOT_FOUND.
+  util::Status ReadEntry(const std::string& seq_str, std::string* data) const;
+  // Parses the entry read by ReadEntry(), with its chain.
+  void ParseEntry(const std::string& data, LoggedEntry* entry) const;
+  // Returns false if there is no up to date snapshot.
+  bool LoadIndexSnapshot();
+  void SaveIndexSnapshot();
+  // Called before the certificates change.
+  void InvalidateIndexSnapshot();
   Database::LookupResult LatestTreeHeadNoLock(
       ct::SignedTreeHead* result) const;
+  // Reads the tree head stored under |timestamp_key|, without holding
+  // lock_.
+  Database::LookupResult ReadTreeHead(uint64_t timestamp,
+                                      const std::string& timestamp_key,
+                                      ct::SignedTreeHead* result) const;
   void InsertEntryMapping(int64_t sequence_number, const std::string& hash);
 
-  const std::unique_ptr<FileStorage> cert_storage_;
+  const std::unique_ptr<EntryStorage> cert_storage_;
   // Store all tree heads, but currently only support looking up the latest
   // one.
   // Other necessary lookup indices (by tree size, by timestamp range?) TBD.
-  const std::unique_ptr<FileStorage> tree_storage_;
+  const std::unique_ptr<EntryStorage> tree_storage_;
+
+  const std::unique_ptr<EntryStorage> meta_storage_;
 
-  const std::unique_ptr<FileStorage> meta_storage_;
+  const bool compress_entries_;
+  EntryCompressor compressor_;
+  const bool deduplicate_chains_;
+  std::unique_ptr<ChainCertStore> chain_certs_;
 
-  mutable std::mutex lock_;
+  // Lookups only hold this shared, to read the in-memory state below.
+  // The storages synchronize their own accesses.
+  mutable ReadWriteMutex lock_;
 
   int64_t contiguous_size_;
-  std::unordered_map<std::string, int64_t> id_by_hash_;
+  // Candidates are confirmed against the stored entries.
+  LeafHashIndex id_by_hash_;
 
   // This is a mapping of the non-contiguous entries of the log (which
   // can happen while it is being fetched). When entries here become
@@ -101,6 +166,13 @@ class FileDB : public Database {
   // The same as a string;
   std::string latest_timestamp_key_;
   DatabaseNotifierHelper callbacks_;
+
+  const std::string index_snapshot_path_;
+  // Whether the snapshot on disk matches the index.
+  bool index_snapshot_current_;
+
+  // Last, so that it is gone before the rest.
+  const MemoryEstimate hash_index_memory_;
 };
 
 
@@ -6,16 +6,19 @@
 #include <glog/logging.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <algorithm>
 #include <cstdlib>
 #include <set>
 #include <string>
 
 #include "log/filesystem_ops.h"
+#include "merkletree/serial_hasher.h"
+#include "util/parallel_for.h"
 #include "util/util.h"
 
-using cert_trans::BasicFilesystemOps;
 using cert_trans::FilesystemOps;
 using std::string;
+using std::vector;
 
 namespace cert_trans {
 
@@ -25,7 +28,7 @@ FileStorage::FileStorage(const string& file_base, int storage_depth)
       tmp_dir_(file_base + "/tmp"),
       tmp_file_template_(tmp_dir_ + "/tmpXXXXXX"),
       storage_depth_(storage_depth),
-      file_op_(new BasicFilesystemOps()) {
+      file_op_(NewDefaultFilesystemOps()) {
   CHECK_GE(storage_depth_, 0);
   CreateMissingDirectory(storage_dir_);
   CreateMissingDirectory(tmp_dir_);
@@ -57,6 +60,27 @@ std::set<string> FileStorage::Scan() const {
 }
 
 
+std::set<string> FileStorage::ParallelScan(util::Executor* executor) const {
+  if (storage_depth_ == 0) {
+    return Scan();
+  }
+
+  const vector<string> subdirs(ListSubdirectories(storage_dir_));
+  vector<std::set<string>> subdir_keys(subdirs.size());
+  util::ParallelFor(executor, subdirs.size(), [&](size_t i) {
+    ScanDir(storage_dir_ + "/" + subdirs[i], storage_depth_ - 1,
+            &subdir_keys[i]);
+  });
+
+  std::set<string> storage_keys;
+  for (auto& keys : subdir_keys) {
+    storage_keys.insert(keys.begin(), keys.end());
+    std::set<string>().swap(keys);
+  }
+  return storage_keys;
+}
+
+
 util::Status FileStorage::CreateEntry(const string& key, const string& data) {
   if (LookupEntry(key, NULL).ok()) {
     return util::Status(util::error::ALREADY_EXISTS,
@@ -84,12 +108,20 @@ util::Status FileStorage::LookupEntry(const string& key,
     return util::Status(util::error::NOT_FOUND, "entry not found: " + key);
   }
   if (result) {
-    CHECK(util::ReadBinaryFile(data_file, result));
+    PCHECK(file_op_->read_file(data_file, result) == 0)
+        << "cannot read " << data_file;
   }
   return ::util::OkStatus();
 }
 
 
+string FileStorage::StateToken() const {
+  string times;
+  AppendDirTimes(storage_dir_, storage_depth_, &times);
+  return util::HexString(Sha256Hasher::Sha256Digest(times));
+}
+
+
 string FileStorage::StoragePathBasename(const string& hex) const {
   if (hex.length() <= static_cast<uint>(storage_depth_))
     return "-";
@@ -183,6 +215,36 @@ void FileStorage::ScanDir(const string& dir_path, int depth,
 }
 
 
+vector<string> FileStorage::ListSubdirectories(const string& dir_path) const {
+  DIR* dir = CHECK_NOTNULL(opendir(dir_path.c_str()));
+  struct dirent* entry;
+  vector<string> subdirs;
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] == '.')
+      continue;
+    subdirs.push_back(entry->d_name);
+  }
+  closedir(dir);
+  // So that the token does not depend on the order of readdir().
+  std::sort(subdirs.begin(), subdirs.end());
+  return subdirs;
+}
+
+
+void FileStorage::AppendDirTimes(const string& dir_path, int depth,
+                                 string* times) const {
+  struct stat st;
+  CHECK_EQ(stat(dir_path.c_str(), &st), 0) << "cannot stat " << dir_path;
+  times->append(dir_path + " " + std::to_string(st.st_mtim.tv_sec) + "." +
+                std::to_string(st.st_mtim.tv_nsec) + "\n");
+  if (depth > 0) {
+    for (const auto& subdir : ListSubdirectories(dir_path)) {
+      AppendDirTimes(dir_path + "/" + subdir, depth - 1, times);
+    }
+  }
+}
+
+
 bool FileStorage::FileExists(const string& file_path) const {
   if (file_op_->access(file_path, F_OK) == 0)
     return true;
@@ -195,11 +257,8 @@ bool FileStorage::FileExists(const string& file_path) const {
 
 void FileStorage::AtomicWriteBinaryFile(const string& file_path,
                                         const string& data) {
-  const string tmp_file(
-      util::WriteTemporaryBinaryFile(tmp_file_template_, data));
-
-  CHECK(!tmp_file.empty());
-  CHECK_EQ(file_op_->rename(tmp_file, file_path), 0);
+  PCHECK(file_op_->atomic_write(tmp_file_template_, file_path, data) == 0)
+      << "cannot write " << file_path;
 }
 
 
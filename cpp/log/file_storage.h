@@ -5,7 +5,9 @@
 #include <memory>
 #include <set>
 #include <string>
+#include <vector>
 
+#include "log/entry_storage.h"
 #include "util/status.h"
 
 namespace cert_trans {
@@ -41,28 +43,34 @@ class FilesystemOps;
 //
 // FileStorage aborts upon any FilesystemOps error. This class is
 // threadsafe.
-class FileStorage {
+class FileStorage : public EntryStorage {
  public:
-  // Default constructor, uses BasicFilesystemOps.
+  // Default constructor, uses NewDefaultFilesystemOps().
   FileStorage(const std::string& file_base, int storage_depth);
   // Takes ownership of the FilesystemOps.
   FileStorage(const std::string& file_base, int storage_depth,
               cert_trans::FilesystemOps* file_op);
-  ~FileStorage();
-  FileStorage(const FileStorage&) = delete;
-  FileStorage& operator=(const FileStorage&) = delete;
+  ~FileStorage() override;
 
-  // Scan the entire database and return the list of keys.
-  std::set<std::string> Scan() const;
+  // Implement abstract functions, see entry_storage.h for comments.
+  std::set<std::string> Scan() const override;
 
-  // Write (key, data) unless an entry matching |key| already exists.
-  util::Status CreateEntry(const std::string& key, const std::string& data);
+  // Scans the subdirectories of the top level of the storage
+  // concurrently.
+  std::set<std::string> ParallelScan(util::Executor* executor) const override;
 
-  // Update an existing entry; fail if it doesn't already exist.
-  util::Status UpdateEntry(const std::string& key, const std::string& data);
+  util::Status CreateEntry(const std::string& key,
+                           const std::string& data) override;
 
-  // Lookup entry based on key.
-  util::Status LookupEntry(const std::string& key, std::string* result) const;
+  util::Status UpdateEntry(const std::string& key,
+                           const std::string& data) override;
+
+  util::Status LookupEntry(const std::string& key,
+                           std::string* result) const override;
+
+  // A hash of the modification times of the directories of the
+  // storage, which change when their entries are created or replaced.
+  std::string StateToken() const override;
 
  private:
   std::string StoragePathBasename(const std::string& hex) const;
@@ -75,6 +83,11 @@ class FileStorage {
                  std::set<std::string>* keys) const;
   void ScanDir(const std::string& dir_path, int depth,
                std::set<std::string>* keys) const;
+  // The names of the subdirectories of |dir_path|.
+  std::vector<std::string> ListSubdirectories(
+      const std::string& dir_path) const;
+  void AppendDirTimes(const std::string& dir_path, int depth,
+                      std::string* times) const;
 
   // The following methods abort upon any error.
   bool FileExists(const std::string& file_path) const;
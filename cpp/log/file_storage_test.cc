@@ -10,6 +10,7 @@
 #include "log/file_storage.h"
 #include "log/filesystem_ops.h"
 #include "log/test_db.h"
+#include "util/thread_pool.h"
 #include "util/status_test_util.h"
 #include "util/testing.h"
 #include "util/util.h"
@@ -73,6 +74,32 @@ TEST_F(BasicFileStorageTest, Scan) {
   EXPECT_EQ(keys, scan_keys);
 }
 
+TEST_F(BasicFileStorageTest, ParallelScan) {
+  cert_trans::ThreadPool pool(4);
+  EXPECT_TRUE(fs()->ParallelScan(&pool).empty());
+
+  std::set<string> keys;
+  for (int i = 0; i < 100; ++i) {
+    const string key(util::RandomString(1, 8));
+    if (keys.insert(key).second) {
+      EXPECT_OK(fs()->CreateEntry(key, "value"));
+    }
+  }
+  EXPECT_EQ(keys, fs()->ParallelScan(&pool));
+}
+
+TEST_F(BasicFileStorageTest, StateToken) {
+  const string token0(fs()->StateToken());
+  EXPECT_FALSE(token0.empty());
+  EXPECT_EQ(token0, fs()->StateToken());
+
+  // Creating the entry changes the directories above it.
+  EXPECT_OK(fs()->CreateEntry("1234xyzw", "unicorn"));
+  const string token1(fs()->StateToken());
+  EXPECT_NE(token0, token1);
+  EXPECT_EQ(token1, fs()->StateToken());
+}
+
 TEST_F(BasicFileStorageTest, CreateDuplicate) {
   string key("1234xyzw", 8);
   string value("unicorn", 7);
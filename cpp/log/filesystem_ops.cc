@@ -1,13 +1,71 @@
 #include "log/filesystem_ops.h"
 
 #include <errno.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
 #include <stdio.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <utility>
+
+#include "config.h"
+#ifdef HAVE_LIBURING
+#include "log/uring_filesystem_ops.h"
+#endif
+#include "util/util.h"
+
+DEFINE_bool(filesystem_io_uring, false,
+            "Do the file I/O of the file database through io_uring, if the "
+            "kernel supports it, so that concurrent writes are submitted "
+            "together.");
 
 namespace cert_trans {
 
 
+int FilesystemOps::atomic_write(const std::string& tmp_template,
+                                const std::string& path,
+                                const std::string& data) {
+  const std::string tmp_file(
+      util::WriteTemporaryBinaryFile(tmp_template, data));
+  if (tmp_file.empty()) {
+    if (errno == 0) {
+      errno = EIO;
+    }
+    return -1;
+  }
+  return rename(tmp_file, path);
+}
+
+
+int FilesystemOps::read_file(const std::string& path, std::string* data) {
+  if (!util::ReadBinaryFile(path, data)) {
+    if (errno == 0) {
+      errno = EIO;
+    }
+    return -1;
+  }
+  return 0;
+}
+
+
+std::unique_ptr<FilesystemOps> NewDefaultFilesystemOps() {
+#ifdef HAVE_LIBURING
+  if (FLAGS_filesystem_io_uring) {
+    std::unique_ptr<UringFilesystemOps> uring_ops(
+        UringFilesystemOps::Create());
+    if (uring_ops) {
+      return std::move(uring_ops);
+    }
+    LOG(WARNING) << "io_uring is not available, using blocking file I/O";
+  }
+#else
+  LOG_IF(WARNING, FLAGS_filesystem_io_uring)
+      << "Not built with io_uring, using blocking file I/O";
+#endif
+  return std::unique_ptr<FilesystemOps>(new BasicFilesystemOps);
+}
+
+
 int BasicFilesystemOps::mkdir(const std::string& path, mode_t mode) {
   return ::mkdir(path.c_str(), mode);
 }
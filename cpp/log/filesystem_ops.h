@@ -2,6 +2,7 @@
 #define CERT_TRANS_LOG_FILESYSTEM_OPS_H_
 
 #include <sys/types.h>
+#include <memory>
 #include <string>
 
 namespace cert_trans {
@@ -21,6 +22,14 @@ class FilesystemOps {
                      const std::string& new_name) = 0;
   virtual int access(const std::string& path, int amode) = 0;
 
+  // Writes |data| to a new file named after |tmp_template| (as for
+  // mkstemp()), then renames it to |path|. By default, with the rename()
+  // above.
+  virtual int atomic_write(const std::string& tmp_template,
+                           const std::string& path, const std::string& data);
+  // Reads the whole file at |path| into |data|.
+  virtual int read_file(const std::string& path, std::string* data);
+
  protected:
   FilesystemOps() = default;
 };
@@ -38,6 +47,12 @@ class BasicFilesystemOps : public FilesystemOps {
 };
 
 
+// Returns the FilesystemOps to use by default: an UringFilesystemOps
+// with --filesystem_io_uring if io_uring is available, or else a
+// BasicFilesystemOps.
+std::unique_ptr<FilesystemOps> NewDefaultFilesystemOps();
+
+
 // Fail at an operation with a given op count.
 class FailingFilesystemOps : public BasicFilesystemOps {
  public:
@@ -9,6 +9,8 @@
 #include "monitoring/event_metric.h"
 #include "proto/ct.pb.h"
 #include "util/status.h"
+#include "util/task.h"
+#include "util/trace.h"
 
 using cert_trans::CertChain;
 using cert_trans::PreCertChain;
@@ -52,6 +54,25 @@ Status Frontend::QueueProcessedEntry(Status pre_status, const LogEntry& entry,
     return UpdateStats(entry.type(), pre_status);
   }
 
+  util::ScopedSpan span("Frontend::QueueProcessedEntry");
+
   // Step 2. Submit to database.
   return UpdateStats(entry.type(), signer_->QueueEntry(entry, sct));
 }
+
+void Frontend::QueueProcessedEntryAsync(const Status& pre_status,
+                                        const LogEntry& entry,
+                                        SignedCertificateTimestamp* sct,
+                                        util::Task* task) {
+  CHECK(entry.has_type());
+  if (!pre_status.ok()) {
+    task->Return(UpdateStats(entry.type(), pre_status));
+    return;
+  }
+
+  const ct::LogEntryType type(entry.type());
+  signer_->QueueEntryAsync(
+      entry, sct, task->AddChild([type, task](util::Task* queue_task) {
+        task->Return(UpdateStats(type, queue_task->status()));
+      }));
+}
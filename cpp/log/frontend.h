@@ -11,6 +11,7 @@ class FrontendSigner;
 
 namespace util {
 class Status;
+class Task;
 }  // namespace util
 
 // Frontend for accepting new submissions.
@@ -26,6 +27,14 @@ class Frontend {
                                    const ct::LogEntry& entry,
                                    ct::SignedCertificateTimestamp* sct);
 
+  // As QueueProcessedEntry(), but returns the status on |task| (see
+  // FrontendSigner::QueueEntryAsync()). |sct| must remain valid until
+  // |task| is done.
+  void QueueProcessedEntryAsync(const util::Status& pre_status,
+                                const ct::LogEntry& entry,
+                                ct::SignedCertificateTimestamp* sct,
+                                util::Task* task);
+
  private:
   const std::unique_ptr<FrontendSigner> signer_;
 };
@@ -1,38 +1,259 @@
 /* -*- indent-tabs-mode: nil -*- */
 #include "log/frontend_signer.h"
 
+#include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <algorithm>
+#include <functional>
 
 #include "log/database.h"
+#include "log/entry_journal.h"
 #include "log/log_signer.h"
 #include "merkletree/serial_hasher.h"
+#include "monitoring/counter.h"
+#include "monitoring/monitoring.h"
 #include "proto/ct.pb.h"
 #include "proto/serializer.h"
 #include "util/status.h"
+#include "util/task.h"
+#include "util/trace.h"
+#include "util/executor.h"
 #include "util/util.h"
 
+DEFINE_int32(frontend_batch_window_ms, 0,
+             "If not 0, the entries submitted concurrently are added to the "
+             "consistent store together: the first one waits for up to this "
+             "long for others to join it.");
+DEFINE_int32(frontend_max_batch_size, 100,
+             "Maximum number of entries added to the consistent store "
+             "together, see --frontend_batch_window_ms.");
+DEFINE_int32(frontend_sct_cache_size, 100000,
+             "Number of recently issued SCTs kept in memory, to answer "
+             "resubmissions of the same entries.");
+DEFINE_int32(frontend_journal_retry_delay_ms, 1000,
+             "How long to wait before retrying to add a journaled entry to "
+             "the consistent store.");
+
 using cert_trans::ConsistentStore;
+using cert_trans::Counter;
 using cert_trans::Database;
+using cert_trans::EntryJournal;
 using cert_trans::LoggedEntry;
 using ct::LogEntry;
 using ct::SignedCertificateTimestamp;
+using std::chrono::milliseconds;
+using std::lock_guard;
+using std::mutex;
 using std::string;
+using std::unique_lock;
+using std::unique_ptr;
+using std::vector;
 using util::Status;
 
+namespace {
+
+
+Counter<>* frontend_journal_conflicting_scts =
+    Counter<>::New("frontend_journal_conflicting_scts",
+                   "Number of journaled entries found in the consistent "
+                   "store with another SCT.");
+
+
+}  // namespace
+
+
+struct FrontendSigner::PendingAdd {
+  explicit PendingAdd(LoggedEntry* e) : entry(e), done(false) {
+  }
+
+  LoggedEntry* const entry;
+  Status status;
+  bool done;
+};
+
+
+struct FrontendSigner::Replication {
+  Replication(const LoggedEntry& e, int64_t s) : entry(e), segment(s) {
+  }
+
+  LoggedEntry entry;
+  const int64_t segment;
+};
+
 
 FrontendSigner::FrontendSigner(Database* db, ConsistentStore* store,
-                               LogSigner* signer)
+                               LogSigner* signer, EntryJournal* journal,
+                               util::Executor* executor)
     : db_(CHECK_NOTNULL(db)),
       store_(CHECK_NOTNULL(store)),
-      signer_(CHECK_NOTNULL(signer)) {
+      signer_(CHECK_NOTNULL(signer)),
+      batch_window_(FLAGS_frontend_batch_window_ms),
+      max_batch_size_(FLAGS_frontend_max_batch_size),
+      sct_cache_(std::max(FLAGS_frontend_sct_cache_size, 0)),
+      batch_collecting_(false),
+      journal_(journal),
+      executor_(executor),
+      replicating_(0),
+      stopping_(false) {
+  CHECK_GE(batch_window_.count(), 0);
+  CHECK_GT(max_batch_size_, static_cast<size_t>(0));
+  if (!journal_) {
+    return;
+  }
+  CHECK_NOTNULL(executor_);
+
+  // Finish adding the entries of the previous run, in the order they
+  // were journaled. The SCTs have been returned, so they are served to
+  // resubmissions while on their way.
+  vector<EntryJournal::Recovered> recovered;
+  journal_->TakeRecovered(&recovered);
+  vector<string> hashes;
+  for (const EntryJournal::Recovered& rec : recovered) {
+    hashes.push_back(rec.entry.Hash());
+  }
+  vector<LoggedEntry> existing;
+  const vector<Database::LookupResult> in_db(
+      db_->LookupByHashes(hashes, &existing));
+  int64_t replayed(0);
+  for (size_t i = 0; i < recovered.size(); ++i) {
+    EntryJournal::Recovered& rec(recovered[i]);
+    const string& hash(hashes[i]);
+    if (in_db[i] == Database::LOOKUP_OK) {
+      journal_->Replicated(rec.segment);
+      continue;
+    }
+    sct_cache_.Insert(hash, rec.entry.sct());
+    {
+      lock_guard<mutex> lock(replication_lock_);
+      auto it(journaled_.find(hash));
+      if (it == journaled_.end()) {
+        it = journaled_.emplace(hash, std::make_pair(rec.entry.sct(), 0))
+                 .first;
+      }
+      ++it->second.second;
+      ++replicating_;
+    }
+    Replicate(new Replication(rec.entry, rec.segment));
+    ++replayed;
+  }
+  LOG_IF(INFO, !recovered.empty())
+      << "Replaying " << replayed << " of " << recovered.size()
+      << " journaled entries";
+}
+
+
+FrontendSigner::~FrontendSigner() {
+  unique_lock<mutex> lock(replication_lock_);
+  stopping_ = true;
+  replication_cv_.wait(lock, [this]() { return replicating_ == 0; });
 }
 
+
 Status FrontendSigner::QueueEntry(const LogEntry& entry,
                                   SignedCertificateTimestamp* sct) {
+  LoggedEntry new_logged;
+  const Status status(PrepareEntry(entry, sct, &new_logged));
+  if (!status.ok()) {
+    return status;
+  }
+
+  if (journal_) {
+    const Status journal_status(JournalEntry(&new_logged));
+    if (journal_status.ok() && sct != nullptr) {
+      *sct = new_logged.sct();
+    }
+    return journal_status;
+  }
+
+  // If this cert has already been added (but not yet integrated into the
+  // tree), then this call will update new_logged.sct with the previously
+  // issued one.
+  const Status add_status(AddPendingEntry(&new_logged));
+  EntryAdded(add_status, new_logged, sct);
+  return add_status;
+}
+
+
+void FrontendSigner::QueueEntryAsync(const LogEntry& entry,
+                                     SignedCertificateTimestamp* sct,
+                                     util::Task* task) {
+  if (journal_) {
+    // Only waits for the journal.
+    task->Return(QueueEntry(entry, sct));
+    return;
+  }
+
+  const string sha256_hash(
+      Sha256Hasher::Sha256Digest(Serializer::LeafData(entry)));
+  const Status status(LookupEntry(sha256_hash, sct));
+  if (!status.ok()) {
+    task->Return(status);
+    return;
+  }
+
+  LoggedEntry* const new_logged(new LoggedEntry);
+  task->DeleteWhenDone(new_logged);
+  new_logged->mutable_entry()->CopyFrom(entry);
+  CHECK_EQ(new_logged->Hash(), sha256_hash);
+  Timestamp(new_logged->mutable_sct());
+  // The submission handler has already verified the format of this entry,
+  // so this should never fail.
+  CHECK_EQ(LogSigner::OK,
+           signer_->SignCertificateTimestampAsync(
+               new_logged->entry(), new_logged->mutable_sct(),
+               task->AddChild([this, new_logged, sct, task](util::Task*) {
+                 AddSignedEntryAsync(new_logged, sct, task);
+               })));
+}
+
+
+void FrontendSigner::AddSignedEntryAsync(LoggedEntry* new_logged,
+                                         SignedCertificateTimestamp* sct,
+                                         util::Task* task) {
+  store_->AddPendingEntryAsync(
+      new_logged,
+      task->AddChild([this, new_logged, sct, task](util::Task* add_task) {
+        EntryAdded(add_task->status(), *new_logged, sct);
+        task->Return(add_task->status());
+      }));
+}
+
+
+Status FrontendSigner::PrepareEntry(const LogEntry& entry,
+                                    SignedCertificateTimestamp* sct,
+                                    LoggedEntry* new_logged) {
   const string sha256_hash(
       Sha256Hasher::Sha256Digest(Serializer::LeafData(entry)));
+  const Status status(LookupEntry(sha256_hash, sct));
+  if (!status.ok()) {
+    return status;
+  }
+
+  // Dont have the cert locally, so create an SCT and store it and the cert.
+  SignedCertificateTimestamp local_sct;
+  TimestampAndSign(entry, &local_sct);
+
+  new_logged->mutable_sct()->CopyFrom(local_sct);
+  new_logged->mutable_entry()->CopyFrom(entry);
+  CHECK_EQ(new_logged->Hash(), sha256_hash);
+  return ::util::OkStatus();
+}
+
+
+Status FrontendSigner::LookupEntry(const string& sha256_hash,
+                                   SignedCertificateTimestamp* sct) {
   CHECK(!sha256_hash.empty());
 
+  // Resubmissions are common, answer them without going to the database
+  // or the consistent store.
+  SignedCertificateTimestamp cached_sct;
+  if (sct_cache_.Lookup(sha256_hash, &cached_sct)) {
+    if (sct != nullptr) {
+      *sct = cached_sct;
+    }
+    return Status(util::error::ALREADY_EXISTS, "entry already exists");
+  }
+
   // Check if the entry already exists in the local DB (i.e. it's been
   // integrated into the tree.)
   // This isn't foolproof; it could be that the local node doesn't yet have
@@ -44,6 +265,7 @@ Status FrontendSigner::QueueEntry(const LogEntry& entry,
 
   if (db_result == Database::LOOKUP_OK) {
     // If we did find a local copy, return the previously issued SCT.
+    sct_cache_.Insert(sha256_hash, logged.sct());
     if (sct != nullptr) {
       *sct = logged.sct();
     }
@@ -51,35 +273,179 @@ Status FrontendSigner::QueueEntry(const LogEntry& entry,
                   "entry already exists in Database");
   }
   CHECK_EQ(Database::NOT_FOUND, db_result);
+  return ::util::OkStatus();
+}
 
-  // Dont have the cert locally, so create an SCT and store it and the cert.
-  SignedCertificateTimestamp local_sct;
-  TimestampAndSign(entry, &local_sct);
-
-  cert_trans::LoggedEntry new_logged;
-  new_logged.mutable_sct()->CopyFrom(local_sct);
-  new_logged.mutable_entry()->CopyFrom(entry);
-  CHECK_EQ(new_logged.Hash(), sha256_hash);
 
-  // If this cert has already been added (but not yet integrated into the
-  // tree), then this call will update new_logged.sct with the previously
-  // issued one.
-  util::Status status(store_->AddPendingEntry(&new_logged));
-  CHECK_EQ(new_logged.Hash(), sha256_hash);
+void FrontendSigner::EntryAdded(const Status& status,
+                                const LoggedEntry& new_logged,
+                                SignedCertificateTimestamp* sct) {
+  if (status.ok() || status.CanonicalCode() == util::error::ALREADY_EXISTS) {
+    sct_cache_.Insert(new_logged.Hash(), new_logged.sct());
+  }
 
   if (sct != nullptr) {
     *sct = new_logged.sct();
   }
+}
+
+
+Status FrontendSigner::AddPendingEntry(LoggedEntry* entry) {
+  // Includes the time waiting for a batch to fill up.
+  util::ScopedSpan span("FrontendSigner::AddPendingEntry");
+  if (batch_window_ == milliseconds::zero()) {
+    return store_->AddPendingEntry(entry);
+  }
+
+  PendingAdd add(entry);
+  unique_lock<mutex> lock(batch_lock_);
+  batch_.push_back(&add);
+  if (batch_collecting_) {
+    if (batch_.size() >= max_batch_size_) {
+      batch_cv_.notify_all();
+    }
+    batch_cv_.wait(lock, [&add]() { return add.done; });
+    return add.status;
+  }
+
+  // This is the first entry of a new batch, wait for others.
+  batch_collecting_ = true;
+  batch_cv_.wait_for(lock, batch_window_,
+                     [this]() { return batch_.size() >= max_batch_size_; });
+  vector<PendingAdd*> adds;
+  adds.swap(batch_);
+  // The entries coming in from now on start another batch.
+  batch_collecting_ = false;
+  lock.unlock();
+
+  vector<LoggedEntry*> entries;
+  for (PendingAdd* const pending_add : adds) {
+    entries.push_back(pending_add->entry);
+  }
+  vector<Status> statuses;
+  store_->AddPendingEntries(entries, &statuses);
+  CHECK_EQ(adds.size(), statuses.size());
 
-  return status;
+  lock.lock();
+  for (size_t i = 0; i < adds.size(); ++i) {
+    adds[i]->status = statuses[i];
+    adds[i]->done = true;
+  }
+  batch_cv_.notify_all();
+  return add.status;
 }
 
 
-void FrontendSigner::TimestampAndSign(const LogEntry& entry,
-                                      SignedCertificateTimestamp* sct) const {
+Status FrontendSigner::JournalEntry(LoggedEntry* new_logged) {
+  util::ScopedSpan span("FrontendSigner::JournalEntry");
+  const string hash(new_logged->Hash());
+  {
+    // Concurrent submissions of an entry all get the first SCT, and it
+    // is journaled again for each, so that none returns before it is on
+    // disk.
+    lock_guard<mutex> lock(replication_lock_);
+    auto it(journaled_.find(hash));
+    if (it == journaled_.end()) {
+      it = journaled_.emplace(hash, std::make_pair(new_logged->sct(), 0))
+               .first;
+    } else {
+      new_logged->mutable_sct()->CopyFrom(it->second.first);
+    }
+    ++it->second.second;
+    ++replicating_;
+  }
+
+  int64_t segment;
+  const Status status(journal_->Append(*new_logged, &segment));
+  if (!status.ok()) {
+    lock_guard<mutex> lock(replication_lock_);
+    const auto it(journaled_.find(hash));
+    if (--it->second.second == 0) {
+      journaled_.erase(it);
+    }
+    --replicating_;
+    replication_cv_.notify_all();
+    return status;
+  }
+
+  sct_cache_.Insert(hash, new_logged->sct());
+  Replicate(new Replication(*new_logged, segment));
+  return ::util::OkStatus();
+}
+
+
+void FrontendSigner::Replicate(Replication* replication) {
+  {
+    lock_guard<mutex> lock(replication_lock_);
+    if (stopping_) {
+      // Left in the journal for the next run.
+      delete replication;
+      --replicating_;
+      replication_cv_.notify_all();
+      return;
+    }
+  }
+
+  store_->AddPendingEntryAsync(
+      &replication->entry,
+      new util::Task(std::bind(&FrontendSigner::ReplicationDone, this,
+                               replication, std::placeholders::_1),
+                     executor_));
+}
+
+
+void FrontendSigner::ReplicationDone(Replication* replication,
+                                     util::Task* task) {
+  unique_ptr<util::Task> task_deleter(task);
+  const Status status(task->status());
+  if (!status.ok() && status.CanonicalCode() != util::error::ALREADY_EXISTS) {
+    LOG(WARNING) << "Cannot add journaled entry to the consistent store, "
+                 << "will retry: " << status;
+    executor_->Delay(milliseconds(FLAGS_frontend_journal_retry_delay_ms),
+                     new util::Task(
+                         [this, replication](util::Task* delay_task) {
+                           delete delay_task;
+                           Replicate(replication);
+                         },
+                         executor_));
+    return;
+  }
+
+  unique_ptr<Replication> replication_deleter(replication);
+  const string hash(replication->entry.Hash());
+  lock_guard<mutex> lock(replication_lock_);
+  const auto it(journaled_.find(hash));
+  CHECK(it != journaled_.end());
+  // On ALREADY_EXISTS, the entry now has the SCT issued first.
+  if (replication->entry.sct().SerializeAsString() !=
+      it->second.first.SerializeAsString()) {
+    LOG(ERROR) << "Journaled entry " << util::ToBase64(hash)
+               << " was issued another SCT elsewhere first, the one "
+               << "returned here will not be honoured.";
+    frontend_journal_conflicting_scts->Increment();
+    sct_cache_.Insert(hash, replication->entry.sct());
+  }
+  if (--it->second.second == 0) {
+    journaled_.erase(it);
+  }
+  journal_->Replicated(replication->segment);
+  --replicating_;
+  replication_cv_.notify_all();
+}
+
+
+// static
+void FrontendSigner::Timestamp(SignedCertificateTimestamp* sct) {
   sct->set_version(ct::V1);
   sct->set_timestamp(util::TimeInMilliseconds());
   sct->clear_extensions();
+}
+
+
+void FrontendSigner::TimestampAndSign(const LogEntry& entry,
+                                      SignedCertificateTimestamp* sct) const {
+  util::ScopedSpan span("FrontendSigner::TimestampAndSign");
+  Timestamp(sct);
   // The submission handler has already verified the format of this entry,
   // so this should never fail.
   CHECK_EQ(LogSigner::OK, signer_->SignCertificateTimestamp(entry, sct));
@@ -2,27 +2,56 @@
 #define CERT_TRANS_LOG_FRONTEND_SIGNER_H_
 
 #include <stdint.h>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "log/consistent_store.h"
 #include "log/logged_entry.h"
+#include "log/sct_cache.h"
 
 class LogSigner;
 
 namespace util {
+class Executor;
 class Status;
+class Task;
 }  // namespace util
 
 namespace cert_trans {
 class Database;
+class EntryJournal;
 }  // namespace cert_trans
 
 
 class FrontendSigner {
  public:
-  // Does not take ownership of |db|, |store| or |signer|.
+  // Does not take ownership of anything.
+  //
+  // If |journal| is given, the new entries are written to it and their
+  // SCTs returned straight away, then added to the consistent store in
+  // the background on |executor|, retrying until that succeeds. The
+  // entries left in |journal| by a previous run are added first. This
+  // cuts the latency of add-chain to a local fsync, but:
+  //  - the time an entry takes to reach the consistent store counts
+  //    against the maximum merge delay, and while it is on the way the
+  //    entry is unknown to the other nodes: an entry that waits longer
+  //    than the guard window may be sequenced too late;
+  //  - a resubmission to another node before the entry reaches the
+  //    consistent store gets a second SCT. The first one to be added
+  //    wins, and the other is logged, and counted in
+  //    frontend_journal_conflicting_scts; that SCT will not be honoured.
+  // The journal must not be shared by several FrontendSigners.
   FrontendSigner(cert_trans::Database* db, cert_trans::ConsistentStore* store,
-                 LogSigner* signer);
+                 LogSigner* signer, cert_trans::EntryJournal* journal = nullptr,
+                 util::Executor* executor = nullptr);
+  // Waits for the additions to the consistent store in progress, if
+  // |journal| was given. Those not done yet are left in the journal.
+  ~FrontendSigner();
   FrontendSigner(const FrontendSigner&) = delete;
   FrontendSigner& operator=(const FrontendSigner&) = delete;
 
@@ -30,16 +59,96 @@ class FrontendSigner {
   // and return either a new timestamp-signature pair,
   // or a previously existing one. (Currently also copies the
   // entry to the sct but you shouldn't rely on this.)
+  //
+  // If --frontend_batch_window_ms is set, the entries queued
+  // concurrently are added to the consistent store together. The SCTs
+  // issued recently are cached, so that resubmissions get theirs
+  // straight away.
   util::Status QueueEntry(const ct::LogEntry& entry,
                           ct::SignedCertificateTimestamp* sct);
 
+  // As QueueEntry(), but returns the status on |task| instead of
+  // waiting for the consistent store, so that the calling thread can
+  // go on with other submissions meanwhile. |sct| is set once |task|
+  // is done, and must remain valid until then. The SCT is signed with
+  // LogSigner::SignCertificateTimestampAsync(), so that the signatures
+  // of concurrent submissions can be in flight together. The entries
+  // are not batched, see --frontend_batch_window_ms: each is added to
+  // the consistent store as soon as it is signed. With a journal, this
+  // is the same as QueueEntry(), which does not wait for the consistent
+  // store.
+  void QueueEntryAsync(const ct::LogEntry& entry,
+                       ct::SignedCertificateTimestamp* sct, util::Task* task);
+
  private:
+  struct PendingAdd;
+  struct Replication;
+
+  // Returns ALREADY_EXISTS, with |sct| set, if the entry with
+  // |sha256_hash| was already issued an SCT as far as can be told
+  // without the consistent store.
+  util::Status LookupEntry(const std::string& sha256_hash,
+                           ct::SignedCertificateTimestamp* sct);
+  // As LookupEntry(), then sets |new_logged| to the entry to add, with a
+  // new SCT.
+  util::Status PrepareEntry(const ct::LogEntry& entry,
+                            ct::SignedCertificateTimestamp* sct,
+                            cert_trans::LoggedEntry* new_logged);
+  // The rest of QueueEntryAsync(), once the SCT of |new_logged| is
+  // signed: adds it to the consistent store, and returns on |task|.
+  void AddSignedEntryAsync(cert_trans::LoggedEntry* new_logged,
+                           ct::SignedCertificateTimestamp* sct,
+                           util::Task* task);
+  // Called with the status of adding |new_logged| to the consistent
+  // store, which has set its SCT to the one issued first.
+  void EntryAdded(const util::Status& status,
+                  const cert_trans::LoggedEntry& new_logged,
+                  ct::SignedCertificateTimestamp* sct);
+
+  static void Timestamp(ct::SignedCertificateTimestamp* sct);
   void TimestampAndSign(const ct::LogEntry& entry,
                         ct::SignedCertificateTimestamp* sct) const;
 
+  // Adds |entry| to the consistent store, as part of a batch if
+  // |batch_window_| is not zero: the first entry of a batch waits for
+  // up to |batch_window_| for others to join it, then adds them all.
+  util::Status AddPendingEntry(cert_trans::LoggedEntry* entry);
+
+  // Writes |new_logged| to |journal_|, and starts adding it to the
+  // consistent store. If the same entry is still on its way there, its
+  // SCT is first replaced by the one issued then.
+  util::Status JournalEntry(cert_trans::LoggedEntry* new_logged);
+  // Adds a journaled entry to the consistent store, taking ownership of
+  // |replication|, and marks it done in |journal_| once it is there.
+  void Replicate(Replication* replication);
+  void ReplicationDone(Replication* replication, util::Task* task);
+
   cert_trans::Database* const db_;
   cert_trans::ConsistentStore* const store_;
   LogSigner* const signer_;
+  const std::chrono::milliseconds batch_window_;
+  const size_t max_batch_size_;
+  cert_trans::SctCache sct_cache_;
+
+  std::mutex batch_lock_;
+  std::condition_variable batch_cv_;
+  // The entries waiting to be added, if any, and whether one of their
+  // callers is waiting to add them.
+  std::vector<PendingAdd*> batch_;
+  bool batch_collecting_;
+
+  cert_trans::EntryJournal* const journal_;
+  util::Executor* const executor_;
+  std::mutex replication_lock_;
+  std::condition_variable replication_cv_;
+  // The number of journaled entries being added to the consistent
+  // store, and whether they should stop retrying.
+  int64_t replicating_;
+  bool stopping_;
+  // The SCTs of the journaled entries not in the consistent store yet,
+  // and how many times each is in the journal, by entry hash.
+  std::map<std::string, std::pair<ct::SignedCertificateTimestamp, int>>
+      journaled_;
 };
 
 #endif  // CERT_TRANS_LOG_FRONTEND_SIGNER_H_
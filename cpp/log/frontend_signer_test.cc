@@ -1,10 +1,14 @@
 /* -*- indent-tabs-mode: nil -*- */
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 #include <memory>
 #include <string>
+#include <thread>
+#include <vector>
 
+#include "log/entry_journal.h"
 #include "log/etcd_consistent_store.h"
 #include "log/file_db.h"
 #include "log/frontend_signer.h"
@@ -23,10 +27,14 @@
 #include "util/mock_masterelection.h"
 #include "util/status.h"
 #include "util/status_test_util.h"
+#include "util/statusor.h"
+#include "util/sync_task.h"
 #include "util/testing.h"
 #include "util/thread_pool.h"
 #include "util/util.h"
 
+DECLARE_int32(frontend_batch_window_ms);
+
 namespace {
 
 namespace libevent = cert_trans::libevent;
@@ -34,6 +42,7 @@ namespace libevent = cert_trans::libevent;
 using cert_trans::ConsistentStore;
 using cert_trans::Database;
 using cert_trans::EntryHandle;
+using cert_trans::EntryJournal;
 using cert_trans::EtcdConsistentStore;
 using cert_trans::FakeEtcdClient;
 using cert_trans::FileDB;
@@ -46,6 +55,7 @@ using ct::SignedCertificateTimestamp;
 using std::make_shared;
 using std::shared_ptr;
 using std::string;
+using std::thread;
 using std::unique_ptr;
 using std::vector;
 using testing::NiceMock;
@@ -54,6 +64,12 @@ using util::testing::StatusIs;
 
 typedef FrontendSigner FS;
 
+unique_ptr<EntryJournal> OpenJournal(const string& dir) {
+  util::StatusOr<unique_ptr<EntryJournal>> journal(EntryJournal::Open(dir));
+  CHECK(journal.ok()) << journal.status();
+  return std::move(journal.ValueOrDie());
+}
+
 template <class T>
 class FrontendSignerTest : public ::testing::Test {
  protected:
@@ -168,6 +184,26 @@ TYPED_TEST(FrontendSignerTest, LogDuplicates) {
   EXPECT_EQ(sct0.timestamp(), sct1.timestamp());
 }
 
+TYPED_TEST(FrontendSignerTest, LogDuplicatesFromCache) {
+  LogEntry entry;
+  this->test_signer_.CreateUnique(&entry);
+  SignedCertificateTimestamp sct0, sct1;
+  EXPECT_OK(this->frontend_.QueueEntry(entry, &sct0));
+
+  // The SCT is not looked up in the store again.
+  EntryHandle<LoggedEntry> entry_handle;
+  ASSERT_OK(this->store_.GetPendingEntryForHash(
+      Sha256Hasher::Sha256Digest(Serializer::LeafData(entry)),
+      &entry_handle));
+  util::SyncTask task(this->base_.get());
+  this->etcd_client_.ForceDelete(entry_handle.Key(), task.task());
+  task.Wait();
+  ASSERT_OK(task.status());
+  EXPECT_THAT(this->frontend_.QueueEntry(entry, &sct1),
+              StatusIs(util::error::ALREADY_EXISTS, _));
+  EXPECT_EQ(sct0.DebugString(), sct1.DebugString());
+}
+
 TYPED_TEST(FrontendSignerTest, LogDuplicatesDifferentChain) {
   LogEntry entry0, entry1;
   this->test_signer_.CreateUnique(&entry0);
@@ -194,6 +230,153 @@ TYPED_TEST(FrontendSignerTest, LogDuplicatesDifferentChain) {
   EXPECT_EQ(sct0.timestamp(), sct1.timestamp());
 }
 
+TYPED_TEST(FrontendSignerTest, LogBatched) {
+  // The frontend reads the flag on construction.
+  FLAGS_frontend_batch_window_ms = 50;
+  FS frontend(this->db(), &this->store_, this->log_signer_.get());
+  FLAGS_frontend_batch_window_ms = 0;
+
+  LogEntry duplicate;
+  this->test_signer_.CreateUnique(&duplicate);
+  SignedCertificateTimestamp duplicate_sct;
+  EXPECT_OK(frontend.QueueEntry(duplicate, &duplicate_sct));
+
+  // Queue entries concurrently, including the duplicate.
+  vector<LogEntry> entries(8);
+  for (LogEntry& entry : entries) {
+    this->test_signer_.CreateUnique(&entry);
+  }
+  entries.push_back(duplicate);
+  vector<SignedCertificateTimestamp> scts(entries.size());
+  vector<util::Status> statuses(entries.size());
+  vector<thread> threads;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    threads.emplace_back([&frontend, &entries, &scts, &statuses, i]() {
+      statuses[i] = frontend.QueueEntry(entries[i], &scts[i]);
+    });
+  }
+  for (thread& t : threads) {
+    t.join();
+  }
+
+  for (size_t i = 0; i + 1 < entries.size(); ++i) {
+    EXPECT_OK(statuses[i]);
+    EXPECT_EQ(this->verifier_.VerifySignedCertificateTimestamp(entries[i],
+                                                               scts[i]),
+              LogVerifier::VERIFY_OK);
+    EntryHandle<LoggedEntry> entry_handle;
+    EXPECT_OK(this->store_.GetPendingEntryForHash(
+        Sha256Hasher::Sha256Digest(Serializer::LeafData(entries[i])),
+        &entry_handle));
+    TestSigner::TestEqualEntries(entries[i], entry_handle.Entry().entry());
+  }
+  EXPECT_THAT(statuses.back(), StatusIs(util::error::ALREADY_EXISTS, _));
+  EXPECT_EQ(duplicate_sct.timestamp(), scts.back().timestamp());
+}
+
+TYPED_TEST(FrontendSignerTest, LogAsync) {
+  LogEntry duplicate;
+  this->test_signer_.CreateUnique(&duplicate);
+  SignedCertificateTimestamp duplicate_sct;
+  EXPECT_OK(this->frontend_.QueueEntry(duplicate, &duplicate_sct));
+
+  // All the entries are in flight at once. Another frontend does not
+  // have the duplicate in its cache, so it is found in the store.
+  FS frontend(this->db(), &this->store_, this->log_signer_.get());
+  vector<LogEntry> entries(8);
+  for (LogEntry& entry : entries) {
+    this->test_signer_.CreateUnique(&entry);
+  }
+  entries.push_back(duplicate);
+  vector<SignedCertificateTimestamp> scts(entries.size());
+  vector<unique_ptr<util::SyncTask>> tasks;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    tasks.emplace_back(new util::SyncTask(&this->pool_));
+    frontend.QueueEntryAsync(entries[i], &scts[i], tasks.back()->task());
+  }
+  for (const auto& task : tasks) {
+    task->Wait();
+  }
+
+  for (size_t i = 0; i + 1 < entries.size(); ++i) {
+    EXPECT_OK(tasks[i]->status());
+    EXPECT_EQ(this->verifier_.VerifySignedCertificateTimestamp(entries[i],
+                                                               scts[i]),
+              LogVerifier::VERIFY_OK);
+    EntryHandle<LoggedEntry> entry_handle;
+    EXPECT_OK(this->store_.GetPendingEntryForHash(
+        Sha256Hasher::Sha256Digest(Serializer::LeafData(entries[i])),
+        &entry_handle));
+    TestSigner::TestEqualEntries(entries[i], entry_handle.Entry().entry());
+  }
+  EXPECT_THAT(tasks.back()->status(),
+              StatusIs(util::error::ALREADY_EXISTS, _));
+  EXPECT_EQ(duplicate_sct.timestamp(), scts.back().timestamp());
+}
+
+TYPED_TEST(FrontendSignerTest, LogJournaled) {
+  TmpStorage tmp;
+  LogEntry entry;
+  this->test_signer_.CreateUnique(&entry);
+  const string hash(Sha256Hasher::Sha256Digest(Serializer::LeafData(entry)));
+  SignedCertificateTimestamp sct;
+  {
+    unique_ptr<EntryJournal> journal(OpenJournal(tmp.TmpStorageDir()));
+    FS frontend(this->db(), &this->store_, this->log_signer_.get(),
+                journal.get(), &this->pool_);
+    EXPECT_OK(frontend.QueueEntry(entry, &sct));
+    EXPECT_EQ(this->verifier_.VerifySignedCertificateTimestamp(entry, sct),
+              LogVerifier::VERIFY_OK);
+
+    // A resubmission gets the same SCT, whether or not the entry has
+    // made it to the consistent store yet.
+    SignedCertificateTimestamp sct2;
+    EXPECT_THAT(frontend.QueueEntry(entry, &sct2),
+                StatusIs(util::error::ALREADY_EXISTS, _));
+    EXPECT_EQ(sct.timestamp(), sct2.timestamp());
+    // Destroying the frontend waits for the consistent store.
+  }
+
+  EntryHandle<LoggedEntry> entry_handle;
+  EXPECT_OK(this->store_.GetPendingEntryForHash(hash, &entry_handle));
+  EXPECT_EQ(sct.timestamp(), entry_handle.Entry().sct().timestamp());
+
+  // Nothing is left to replay.
+  unique_ptr<EntryJournal> journal(OpenJournal(tmp.TmpStorageDir()));
+  vector<EntryJournal::Recovered> recovered;
+  journal->TakeRecovered(&recovered);
+  EXPECT_TRUE(recovered.empty());
+}
+
+TYPED_TEST(FrontendSignerTest, ReplaysJournal) {
+  TmpStorage tmp;
+  LoggedEntry logged;
+  this->test_signer_.CreateUnique(&logged);
+  {
+    // As if the frontend had exited before adding the entry to the
+    // consistent store.
+    unique_ptr<EntryJournal> journal(OpenJournal(tmp.TmpStorageDir()));
+    int64_t segment;
+    EXPECT_OK(journal->Append(logged, &segment));
+  }
+
+  {
+    unique_ptr<EntryJournal> journal(OpenJournal(tmp.TmpStorageDir()));
+    FS frontend(this->db(), &this->store_, this->log_signer_.get(),
+                journal.get(), &this->pool_);
+
+    // The journaled SCT is returned to resubmissions.
+    SignedCertificateTimestamp sct;
+    EXPECT_THAT(frontend.QueueEntry(logged.entry(), &sct),
+                StatusIs(util::error::ALREADY_EXISTS, _));
+    EXPECT_EQ(logged.sct().timestamp(), sct.timestamp());
+  }
+
+  EntryHandle<LoggedEntry> entry_handle;
+  EXPECT_OK(this->store_.GetPendingEntryForHash(logged.Hash(), &entry_handle));
+  EXPECT_EQ(logged.sct().timestamp(), entry_handle.Entry().sct().timestamp());
+}
+
 TYPED_TEST(FrontendSignerTest, Verify) {
   LogEntry entry0, entry1;
   this->test_signer_.CreateUnique(&entry0);
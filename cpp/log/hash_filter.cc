@@ -0,0 +1,156 @@
+#include "log/hash_filter.h"
+
+#include <glog/logging.h>
+#include <string.h>
+#include <algorithm>
+
+using std::string;
+using std::unique_ptr;
+
+namespace cert_trans {
+namespace {
+
+
+// About 1% false positives at capacity, for blocks of 8 words with a
+// bit set in each.
+const int64_t kBitsPerHash = 12;
+const int64_t kBitsPerBlock = 512;
+
+const char kMagic[] = "CTHFLTR1";
+const size_t kMagicSize = 8;
+const size_t kHeaderSize = kMagicSize + 3 * 8;
+
+// Odd constants, one per word of a block, which pick the bit set in
+// that word from the same 64 bits of the hash.
+const uint64_t kSalts[] = {
+    UINT64_C(0x47b6137b44974d91), UINT64_C(0x8824ad5ba2b7289d),
+    UINT64_C(0x705495c72df1424b), UINT64_C(0x9efc49475c6bfb31),
+    UINT64_C(0x2b2f7b0e9a1e6d35), UINT64_C(0x5c6bfb319efc4947),
+    UINT64_C(0xa2b7289d8824ad5b), UINT64_C(0x2df1424b705495c7),
+};
+
+
+// The finalizer of SplitMix64, as in LeafHashIndex.
+uint64_t Mix(uint64_t key) {
+  key = (key ^ (key >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+  key = (key ^ (key >> 27)) * UINT64_C(0x94d049bb133111eb);
+  return key ^ (key >> 31);
+}
+
+
+size_t BlocksFor(int64_t capacity) {
+  return std::max<int64_t>(
+      1, (capacity * kBitsPerHash + kBitsPerBlock - 1) / kBitsPerBlock);
+}
+
+
+void AppendUint64(uint64_t value, string* out) {
+  for (int i = 0; i < 8; ++i) {
+    out->push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+  }
+}
+
+
+uint64_t ReadUint64(const char* in) {
+  uint64_t value(0);
+  for (int i = 7; i >= 0; --i) {
+    value = (value << 8) | static_cast<unsigned char>(in[i]);
+  }
+  return value;
+}
+
+
+}  // namespace
+
+
+const int HashFilter::kWordsPerBlock;
+
+
+HashFilter::HashFilter(int64_t capacity)
+    : capacity_(std::max<int64_t>(capacity, 1)),
+      num_blocks_(BlocksFor(capacity_)),
+      words_(new std::atomic<uint64_t>[num_blocks_ * kWordsPerBlock]),
+      size_(0) {
+  for (size_t i = 0; i < num_blocks_ * kWordsPerBlock; ++i) {
+    words_[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+
+void HashFilter::Add(const string& hash) {
+  uint64_t bits[kWordsPerBlock];
+  const size_t first(Locate(hash, bits));
+  for (int i = 0; i < kWordsPerBlock; ++i) {
+    words_[first + i].fetch_or(bits[i], std::memory_order_release);
+  }
+  size_.fetch_add(1, std::memory_order_relaxed);
+}
+
+
+bool HashFilter::MayContain(const string& hash) const {
+  uint64_t bits[kWordsPerBlock];
+  const size_t first(Locate(hash, bits));
+  for (int i = 0; i < kWordsPerBlock; ++i) {
+    if ((words_[first + i].load(std::memory_order_acquire) & bits[i]) == 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+string HashFilter::Serialize() const {
+  string data(kMagic, kMagicSize);
+  data.reserve(kHeaderSize + num_blocks_ * kWordsPerBlock * 8);
+  AppendUint64(capacity_, &data);
+  AppendUint64(size(), &data);
+  AppendUint64(num_blocks_, &data);
+  for (size_t i = 0; i < num_blocks_ * kWordsPerBlock; ++i) {
+    AppendUint64(words_[i].load(std::memory_order_relaxed), &data);
+  }
+  return data;
+}
+
+
+// static
+unique_ptr<HashFilter> HashFilter::Parse(const string& data) {
+  if (data.size() < kHeaderSize ||
+      memcmp(data.data(), kMagic, kMagicSize) != 0) {
+    return nullptr;
+  }
+  const char* in(data.data() + kMagicSize);
+  const int64_t capacity(ReadUint64(in));
+  const int64_t size(ReadUint64(in + 8));
+  const uint64_t num_blocks(ReadUint64(in + 16));
+  if (capacity <= 0 || size < 0 || num_blocks != BlocksFor(capacity) ||
+      data.size() != kHeaderSize + num_blocks * kWordsPerBlock * 8) {
+    return nullptr;
+  }
+
+  unique_ptr<HashFilter> filter(new HashFilter(capacity));
+  in += 24;
+  for (size_t i = 0; i < num_blocks * kWordsPerBlock; ++i, in += 8) {
+    filter->words_[i].store(ReadUint64(in), std::memory_order_relaxed);
+  }
+  filter->size_.store(size, std::memory_order_relaxed);
+  return filter;
+}
+
+
+size_t HashFilter::Locate(const string& hash,
+                          uint64_t bits[kWordsPerBlock]) const {
+  uint64_t key[2] = {0, 0};
+  memcpy(key, hash.data(), std::min(hash.size(), sizeof(key)));
+  const uint64_t block_key(Mix(key[0] ^ hash.size()));
+  const uint64_t bit_key(Mix(key[1] ^ block_key));
+
+  for (int i = 0; i < kWordsPerBlock; ++i) {
+    bits[i] = UINT64_C(1) << ((bit_key * kSalts[i]) >> 58);
+  }
+  // The top bits of |block_key| pick the block, without a division.
+  const size_t block(((block_key >> 32) * num_blocks_) >> 32);
+  return block * kWordsPerBlock;
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,72 @@
+#ifndef CERT_TRANS_LOG_HASH_FILTER_H_
+#define CERT_TRANS_LOG_HASH_FILTER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <string>
+
+namespace cert_trans {
+
+
+// A blocked bloom filter of entry hashes, so that a database can tell
+// that it does not have a hash without looking in its index: each hash
+// sets 8 bits of a single 64-byte block, one per 64-bit word, so that
+// a lookup only touches one cache line. Sized for its capacity, it has
+// about 1% false positives, and more once it holds more hashes than
+// that.
+//
+// Like LeafHashIndex, it is meant for hashes that are (close to)
+// uniformly distributed, such as LoggedEntry::Hash().
+//
+// This class is thread-safe: lookups may run concurrently with each
+// other and with Add(), and see a hash once Add() returned.
+class HashFilter {
+ public:
+  explicit HashFilter(int64_t capacity);
+  HashFilter(const HashFilter&) = delete;
+  HashFilter& operator=(const HashFilter&) = delete;
+
+  // Number of hashes the filter was sized for.
+  int64_t capacity() const {
+    return capacity_;
+  }
+
+  // Number of calls to Add().
+  int64_t size() const {
+    return size_.load(std::memory_order_relaxed);
+  }
+
+  void Add(const std::string& hash);
+
+  // Returns false if |hash| was never added, and true if it was, or
+  // (rarely) if it was not.
+  bool MayContain(const std::string& hash) const;
+
+  // Returns the filter as it is now, for Parse(). Must not run
+  // concurrently with Add().
+  std::string Serialize() const;
+
+  // Returns a filter serialized by Serialize(), or nullptr if |data|
+  // is not one.
+  static std::unique_ptr<HashFilter> Parse(const std::string& data);
+
+ private:
+  static const int kWordsPerBlock = 8;
+
+  // The first word of the block for |hash|, and the bit to set in each
+  // of its words.
+  size_t Locate(const std::string& hash,
+                uint64_t bits[kWordsPerBlock]) const;
+
+  const int64_t capacity_;
+  const size_t num_blocks_;
+  const std::unique_ptr<std::atomic<uint64_t>[]> words_;
+  std::atomic<int64_t> size_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_HASH_FILTER_H_
@@ -0,0 +1,95 @@
+#include "log/hash_filter.h"
+
+#include <gtest/gtest.h>
+#include <memory>
+#include <string>
+
+#include "merkletree/serial_hasher.h"
+#include "util/testing.h"
+
+namespace cert_trans {
+namespace {
+
+using std::string;
+using std::unique_ptr;
+
+
+string TestHash(int i) {
+  Sha256Hasher hasher;
+  hasher.Update(std::to_string(i));
+  return hasher.Final();
+}
+
+
+TEST(HashFilterTest, FindsAddedHashes) {
+  HashFilter filter(1000);
+  for (int i = 0; i < 1000; ++i) {
+    filter.Add(TestHash(i));
+  }
+  EXPECT_EQ(1000, filter.size());
+  for (int i = 0; i < 1000; ++i) {
+    EXPECT_TRUE(filter.MayContain(TestHash(i))) << i;
+  }
+}
+
+
+TEST(HashFilterTest, FewFalsePositivesAtCapacity) {
+  const int kCapacity(100000);
+  HashFilter filter(kCapacity);
+  for (int i = 0; i < kCapacity; ++i) {
+    filter.Add(TestHash(i));
+  }
+  int false_positives(0);
+  for (int i = kCapacity; i < 2 * kCapacity; ++i) {
+    if (filter.MayContain(TestHash(i))) {
+      ++false_positives;
+    }
+  }
+  EXPECT_LT(false_positives, kCapacity / 50);
+}
+
+
+TEST(HashFilterTest, ShortHashes) {
+  HashFilter filter(10);
+  filter.Add("");
+  filter.Add("a");
+  EXPECT_TRUE(filter.MayContain(""));
+  EXPECT_TRUE(filter.MayContain("a"));
+}
+
+
+TEST(HashFilterTest, SerializeAndParse) {
+  HashFilter filter(1000);
+  for (int i = 0; i < 500; ++i) {
+    filter.Add(TestHash(i));
+  }
+
+  const unique_ptr<HashFilter> parsed(HashFilter::Parse(filter.Serialize()));
+  ASSERT_TRUE(parsed);
+  EXPECT_EQ(1000, parsed->capacity());
+  EXPECT_EQ(500, parsed->size());
+  for (int i = 0; i < 1000; ++i) {
+    EXPECT_EQ(filter.MayContain(TestHash(i)),
+              parsed->MayContain(TestHash(i)));
+  }
+}
+
+
+TEST(HashFilterTest, ParseRejectsGarbage) {
+  EXPECT_FALSE(HashFilter::Parse(""));
+  EXPECT_FALSE(HashFilter::Parse("not a filter"));
+
+  string data(HashFilter(1000).Serialize());
+  data.resize(data.size() - 1);
+  EXPECT_FALSE(HashFilter::Parse(data));
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,275 @@
+#include "log/leaf_hash_index.h"
+
+#include <errno.h>
+#include <glog/logging.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+
+#include "util/util.h"
+
+using std::string;
+using std::unique_ptr;
+using std::vector;
+using util::Status;
+using util::StatusOr;
+
+namespace cert_trans {
+namespace {
+
+
+const int kTableBits = 10;
+const size_t kNumTables = 1 << kTableBits;
+const int kTagBits = 24;
+const int kSequenceBits = 40;
+const uint64_t kSequenceMask = (UINT64_C(1) << kSequenceBits) - 1;
+// Entries are found from the slot given by their tag, so tables cannot
+// have more slots than there are tags.
+const size_t kMaxSlotsPerTable = 1 << kTagBits;
+const size_t kMinSlotsPerTable = 8;
+
+const char kMagic[] = "CTLHIDX1";
+const size_t kMagicSize = 8;
+
+
+uint64_t Tag(uint64_t slot_value) {
+  return slot_value >> kSequenceBits;
+}
+
+
+int64_t SequenceNumber(uint64_t slot_value) {
+  return static_cast<int64_t>(slot_value & kSequenceMask) - 1;
+}
+
+
+// Tables are kept at most 3/4 full.
+size_t SlotsFor(size_t count) {
+  size_t slots(kMinSlotsPerTable);
+  while (slots * 3 < count * 4) {
+    slots *= 2;
+  }
+  CHECK_LE(slots, kMaxSlotsPerTable) << "Leaf hash index is full";
+  return slots;
+}
+
+
+void AppendUint64(uint64_t value, string* out) {
+  for (int i = 0; i < 8; ++i) {
+    out->push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+  }
+}
+
+
+uint64_t ReadUint64(const char* in) {
+  uint64_t value(0);
+  for (int i = 7; i >= 0; --i) {
+    value = (value << 8) | static_cast<unsigned char>(in[i]);
+  }
+  return value;
+}
+
+
+}  // namespace
+
+
+const int64_t LeafHashIndex::kMaxSequenceNumber;
+
+
+LeafHashIndex::LeafHashIndex() : tables_(kNumTables), size_(0) {
+}
+
+
+size_t LeafHashIndex::MemoryUsage() const {
+  size_t usage(tables_.size() * sizeof(Table));
+  for (const Table& table : tables_) {
+    usage += table.slots.size() * sizeof(uint64_t);
+  }
+  return usage;
+}
+
+
+void LeafHashIndex::Swap(LeafHashIndex* other) {
+  tables_.swap(other->tables_);
+  std::swap(size_, other->size_);
+}
+
+
+void LeafHashIndex::Reserve(size_t count) {
+  // Hashes spread evenly over the tables, give or take a few.
+  const size_t slots(SlotsFor(count / kNumTables + count / kNumTables / 8));
+  for (Table& table : tables_) {
+    if (table.slots.size() < slots) {
+      Resize(&table, slots);
+    }
+  }
+}
+
+
+void LeafHashIndex::Insert(const string& hash, int64_t sequence_number) {
+  CHECK_GE(sequence_number, 0);
+  CHECK_LE(sequence_number, kMaxSequenceNumber);
+  size_t table_index;
+  uint64_t tag;
+  Locate(hash, &table_index, &tag);
+
+  Table* const table(&tables_[table_index]);
+  if ((table->size + 1) * 4 > table->slots.size() * 3) {
+    Resize(table, SlotsFor(table->size + 1));
+  }
+  InsertSlot(table, (tag << kSequenceBits) |
+                        static_cast<uint64_t>(sequence_number + 1));
+  ++table->size;
+  ++size_;
+}
+
+
+void LeafHashIndex::Candidates(const string& hash,
+                               vector<int64_t>* candidates) const {
+  candidates->clear();
+  size_t table_index;
+  uint64_t tag;
+  Locate(hash, &table_index, &tag);
+
+  const vector<uint64_t>& slots(tables_[table_index].slots);
+  if (slots.empty()) {
+    return;
+  }
+  const size_t mask(slots.size() - 1);
+  for (size_t i(tag & mask); slots[i] != 0; i = (i + 1) & mask) {
+    if (Tag(slots[i]) == tag) {
+      candidates->push_back(SequenceNumber(slots[i]));
+    }
+  }
+  std::sort(candidates->begin(), candidates->end());
+}
+
+
+int64_t LeafHashIndex::Find(
+    const string& hash, const std::function<bool(int64_t)>& confirm) const {
+  vector<int64_t> candidates;
+  Candidates(hash, &candidates);
+  for (int64_t sequence_number : candidates) {
+    if (confirm(sequence_number)) {
+      return sequence_number;
+    }
+  }
+  return -1;
+}
+
+
+Status LeafHashIndex::Save(const string& path) const {
+  const string tmp_path(path + ".tmp");
+  {
+    std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+    string header(kMagic, kMagicSize);
+    AppendUint64(tables_.size(), &header);
+    out.write(header.data(), header.size());
+    for (const Table& table : tables_) {
+      string buf;
+      AppendUint64(table.slots.size(), &buf);
+      for (uint64_t slot : table.slots) {
+        AppendUint64(slot, &buf);
+      }
+      out.write(buf.data(), buf.size());
+    }
+    out.flush();
+    if (!out) {
+      return Status(util::error::INTERNAL, "cannot write " + tmp_path);
+    }
+  }
+  if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+    return Status(util::error::INTERNAL, "cannot rename " + tmp_path +
+                                             " to " + path + ": " +
+                                             strerror(errno));
+  }
+  return ::util::OkStatus();
+}
+
+
+// static
+StatusOr<unique_ptr<LeafHashIndex>> LeafHashIndex::Load(const string& path) {
+  string data;
+  if (!util::ReadBinaryFile(path, &data)) {
+    return Status(util::error::NOT_FOUND, "cannot read " + path);
+  }
+  const Status corrupt(util::error::FAILED_PRECONDITION,
+                       "not a leaf hash index: " + path);
+  if (data.size() < kMagicSize + 8 ||
+      data.compare(0, kMagicSize, kMagic, kMagicSize) != 0 ||
+      ReadUint64(data.data() + kMagicSize) != kNumTables) {
+    return corrupt;
+  }
+
+  unique_ptr<LeafHashIndex> index(new LeafHashIndex);
+  size_t pos(kMagicSize + 8);
+  for (Table& table : index->tables_) {
+    if (data.size() - pos < 8) {
+      return corrupt;
+    }
+    const uint64_t slot_count(ReadUint64(data.data() + pos));
+    pos += 8;
+    if ((slot_count & (slot_count - 1)) != 0 ||
+        slot_count > kMaxSlotsPerTable ||
+        (data.size() - pos) / 8 < slot_count) {
+      return corrupt;
+    }
+    table.slots.resize(slot_count);
+    for (uint64_t& slot : table.slots) {
+      slot = ReadUint64(data.data() + pos);
+      pos += 8;
+      if (slot != 0) {
+        ++table.size;
+      }
+    }
+    index->size_ += table.size;
+  }
+  if (pos != data.size()) {
+    return corrupt;
+  }
+  return std::move(index);
+}
+
+
+// static
+void LeafHashIndex::Locate(const string& hash, size_t* table, uint64_t* tag) {
+  // Mix the first bytes of the hash (the finalizer of SplitMix64), so
+  // that even hashes that are not quite uniform spread out.
+  uint64_t key(0);
+  memcpy(&key, hash.data(), std::min(hash.size(), sizeof(key)));
+  key ^= hash.size();
+  key = (key ^ (key >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+  key = (key ^ (key >> 27)) * UINT64_C(0x94d049bb133111eb);
+  key ^= key >> 31;
+
+  *table = key >> (64 - kTableBits);
+  *tag = (key >> (64 - kTableBits - kTagBits)) & ((1 << kTagBits) - 1);
+}
+
+
+// static
+void LeafHashIndex::InsertSlot(Table* table, uint64_t slot_value) {
+  const size_t mask(table->slots.size() - 1);
+  size_t i(Tag(slot_value) & mask);
+  while (table->slots[i] != 0) {
+    i = (i + 1) & mask;
+  }
+  table->slots[i] = slot_value;
+}
+
+
+// static
+void LeafHashIndex::Resize(Table* table, size_t slot_count) {
+  Table resized;
+  resized.slots.resize(slot_count);
+  resized.size = table->size;
+  for (uint64_t slot : table->slots) {
+    if (slot != 0) {
+      InsertSlot(&resized, slot);
+    }
+  }
+  std::swap(*table, resized);
+}
+
+
+}  // namespace cert_trans
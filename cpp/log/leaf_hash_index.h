@@ -0,0 +1,100 @@
+#ifndef CERT_TRANS_LOG_LEAF_HASH_INDEX_H_
+#define CERT_TRANS_LOG_LEAF_HASH_INDEX_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "util/status.h"
+#include "util/statusor.h"
+
+namespace cert_trans {
+
+
+// A compact hash -> sequence number index, for hashes that are
+// (close to) uniformly distributed, such as Merkle leaf hashes or
+// LoggedEntry::Hash().
+//
+// Rather than the hashes themselves, the index only keeps 34 bits of
+// them: the hashes pick one of 1024 open-addressing tables, each of
+// which keeps 24 bits of the hash and the sequence number in 8-byte
+// slots (11 to 22 bytes per entry, depending on how full they are). A
+// lookup therefore returns candidate sequence numbers, which the caller
+// confirms against the real entries (see Find()). Unrelated hashes are
+// only rarely candidates for each other.
+//
+// Sequence numbers must be below kMaxSequenceNumber. The same hash may
+// be inserted under several sequence numbers.
+//
+// This class is thread-compatible: lookups may run concurrently
+// with each other, but not with an insertion.
+class LeafHashIndex {
+ public:
+  static const int64_t kMaxSequenceNumber = (INT64_C(1) << 40) - 1;
+
+  LeafHashIndex();
+  LeafHashIndex(const LeafHashIndex&) = delete;
+  LeafHashIndex& operator=(const LeafHashIndex&) = delete;
+
+  // Number of sequence numbers in the index.
+  size_t size() const {
+    return size_;
+  }
+
+  // Memory used by the table, in bytes.
+  size_t MemoryUsage() const;
+
+  void Swap(LeafHashIndex* other);
+
+  // Makes room for |count| sequence numbers without further resizing.
+  void Reserve(size_t count);
+
+  void Insert(const std::string& hash, int64_t sequence_number);
+
+  // Sets |candidates| to the sequence numbers that may have been
+  // inserted with |hash|, in increasing order. All of those inserted
+  // with |hash| are in there, but so may be a few others.
+  void Candidates(const std::string& hash,
+                  std::vector<int64_t>* candidates) const;
+
+  // Returns the lowest candidate for |hash| for which |confirm| returns
+  // true, or -1 if there is none.
+  int64_t Find(const std::string& hash,
+               const std::function<bool(int64_t)>& confirm) const;
+
+  // Writes the index to the file |path|, replacing it atomically.
+  util::Status Save(const std::string& path) const;
+
+  // Reads an index written by Save().
+  static util::StatusOr<std::unique_ptr<LeafHashIndex>> Load(
+      const std::string& path);
+
+ private:
+  // Each slot is 0 when empty, or holds the 24-bit tag of the hash in
+  // its top bits and the sequence number plus one in the others.
+  // Entries live from the slot given by their tag on, so that a table
+  // can be resized without the hashes.
+  struct Table {
+    Table() : size(0) {
+    }
+
+    std::vector<uint64_t> slots;
+    size_t size;
+  };
+
+  // The table and tag for |hash|.
+  static void Locate(const std::string& hash, size_t* table, uint64_t* tag);
+  static void InsertSlot(Table* table, uint64_t slot_value);
+  static void Resize(Table* table, size_t slot_count);
+
+  std::vector<Table> tables_;
+  size_t size_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_LEAF_HASH_INDEX_H_
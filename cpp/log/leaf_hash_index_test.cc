@@ -0,0 +1,143 @@
+#include "log/leaf_hash_index.h"
+
+#include <gtest/gtest.h>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "merkletree/serial_hasher.h"
+#include "util/status_test_util.h"
+#include "util/test_db.h"
+#include "util/testing.h"
+
+namespace cert_trans {
+namespace {
+
+using std::string;
+using std::unique_ptr;
+using std::vector;
+using util::testing::StatusIs;
+
+
+string TestHash(int i) {
+  Sha256Hasher hasher;
+  hasher.Update(std::to_string(i));
+  return hasher.Final();
+}
+
+
+void FillIndex(int count, LeafHashIndex* index) {
+  for (int i = 0; i < count; ++i) {
+    index->Insert(TestHash(i), i);
+  }
+}
+
+
+int64_t FindConfirmed(const LeafHashIndex& index, const string& hash) {
+  return index.Find(hash, [&hash](int64_t sequence_number) {
+    return TestHash(sequence_number) == hash;
+  });
+}
+
+
+TEST(LeafHashIndexTest, InsertAndFind) {
+  LeafHashIndex index;
+  EXPECT_EQ(-1, FindConfirmed(index, TestHash(0)));
+
+  const int kCount = 100000;
+  FillIndex(kCount, &index);
+  EXPECT_EQ(static_cast<size_t>(kCount), index.size());
+  for (int i = 0; i < kCount; ++i) {
+    ASSERT_EQ(i, FindConfirmed(index, TestHash(i)));
+  }
+  EXPECT_EQ(-1, FindConfirmed(index, TestHash(kCount)));
+}
+
+
+TEST(LeafHashIndexTest, FewCandidates) {
+  LeafHashIndex index;
+  const int kCount = 100000;
+  FillIndex(kCount, &index);
+
+  int false_candidates(0);
+  vector<int64_t> candidates;
+  for (int i = kCount; i < 2 * kCount; ++i) {
+    index.Candidates(TestHash(i), &candidates);
+    false_candidates += candidates.size();
+  }
+  // Each lookup matches an unrelated hash with odds of about 2^-34 per
+  // entry.
+  EXPECT_GT(10, false_candidates);
+}
+
+
+TEST(LeafHashIndexTest, Compact) {
+  LeafHashIndex index;
+  const int kCount = 200000;
+  FillIndex(kCount, &index);
+  // An unordered_map<string, int64_t> takes about 100 bytes per entry.
+  EXPECT_GT(static_cast<size_t>(23 * kCount), index.MemoryUsage());
+}
+
+
+TEST(LeafHashIndexTest, Duplicates) {
+  LeafHashIndex index;
+  index.Insert(TestHash(7), 9);
+  index.Insert(TestHash(7), 3);
+  index.Insert(TestHash(8), 4);
+
+  vector<int64_t> candidates;
+  index.Candidates(TestHash(7), &candidates);
+  EXPECT_EQ(vector<int64_t>({3, 9}), candidates);
+  EXPECT_EQ(3, index.Find(TestHash(7), [](int64_t) { return true; }));
+  EXPECT_EQ(9, index.Find(TestHash(7),
+                          [](int64_t sequence_number) {
+                            return sequence_number != 3;
+                          }));
+}
+
+
+TEST(LeafHashIndexTest, Reserve) {
+  LeafHashIndex index;
+  index.Reserve(50000);
+  const size_t reserved(index.MemoryUsage());
+  FillIndex(50000, &index);
+  EXPECT_EQ(reserved, index.MemoryUsage());
+  EXPECT_EQ(123, FindConfirmed(index, TestHash(123)));
+}
+
+
+TEST(LeafHashIndexTest, SaveAndLoad) {
+  TmpStorage tmp;
+  const string path(tmp.TmpStorageDir() + "/index");
+  EXPECT_THAT(LeafHashIndex::Load(path).status(),
+              StatusIs(util::error::NOT_FOUND));
+
+  LeafHashIndex index;
+  FillIndex(5000, &index);
+  ASSERT_OK(index.Save(path));
+
+  util::StatusOr<unique_ptr<LeafHashIndex>> loaded(LeafHashIndex::Load(path));
+  ASSERT_OK(loaded.status());
+  EXPECT_EQ(5000U, loaded.ValueOrDie()->size());
+  for (int i = 0; i < 5000; ++i) {
+    ASSERT_EQ(i, FindConfirmed(*loaded.ValueOrDie(), TestHash(i)));
+  }
+  loaded.ValueOrDie()->Insert(TestHash(5000), 5000);
+  EXPECT_EQ(5000, FindConfirmed(*loaded.ValueOrDie(), TestHash(5000)));
+
+  std::ofstream(path, std::ios::trunc) << "CTLHIDX1 garbage";
+  EXPECT_THAT(LeafHashIndex::Load(path).status(),
+              StatusIs(util::error::FAILED_PRECONDITION));
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -1,11 +1,28 @@
 #include "log/leveldb_db.h"
 
+#include <dirent.h>
+#include <errno.h>
 #include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <leveldb/write_batch.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <limits>
 #include <map>
+#include <set>
+#include <sstream>
 #include <string>
+#include <vector>
 
+#include "base/lock_contention.h"
+#include "monitoring/gauge.h"
 #include "monitoring/latency.h"
 #include "monitoring/monitoring.h"
 #include "proto/ct.pb.h"
@@ -14,18 +31,60 @@
 
 using cert_trans::serialization::DeserializeResult;
 using std::chrono::milliseconds;
+using std::chrono::seconds;
+using std::function;
+using std::istringstream;
 using std::lock_guard;
-using std::make_pair;
-using std::min;
 using std::mutex;
+using std::numeric_limits;
 using std::string;
 using std::unique_lock;
 using std::unique_ptr;
+using std::vector;
 
 DEFINE_int32(leveldb_max_open_files, 0,
              "number of open files that can be used by leveldb");
-DEFINE_int32(leveldb_bloom_filter_bits_per_key, 0,
-             "number of open files that can be used by leveldb");
+DEFINE_int32(leveldb_bloom_filter_bits_per_key, 10,
+             "number of bits per key of the leveldb bloom filter, which "
+             "saves reading from disk for the hashes of entries that are "
+             "not logged; 0 for no bloom filter");
+DEFINE_int32(leveldb_block_cache_mb, 0,
+             "size of the leveldb block cache in MB, 0 for the leveldb "
+             "default (8 MB)");
+DEFINE_int32(leveldb_write_buffer_mb, 0,
+             "size of the leveldb write buffer in MB, 0 for the leveldb "
+             "default (4 MB)");
+DEFINE_bool(leveldb_compression, true,
+            "whether leveldb compresses its blocks with Snappy");
+DEFINE_bool(leveldb_compress_entries, false,
+            "whether to compress the entries written, with a dictionary "
+            "trained on the entries of the log");
+DEFINE_int32(leveldb_stats_interval_secs, 60,
+             "how often to export the internal stats of leveldb as "
+             "metrics, 0 to never export them");
+DEFINE_string(leveldb_archive_dir, "",
+              "directory, possibly on a cheaper disk, where to archive old "
+              "entries in files of --leveldb_archive_range_size entries; "
+              "empty to keep all the entries in leveldb. Must remain set "
+              "once entries are archived");
+DEFINE_int32(leveldb_archive_range_size, 1000000,
+             "number of entries per archive file");
+DEFINE_int32(leveldb_archive_keep_entries, 10000000,
+             "number of the latest entries that are never archived");
+DEFINE_int32(leveldb_archive_interval_secs, 3600,
+             "how often to archive the old entries, 0 to only archive them "
+             "when asked to");
+DEFINE_string(leveldb_snapshot_dir, "",
+              "directory where to write snapshots of the database for new "
+              "nodes to start from, on the same filesystem as "
+              "--leveldb_archive_dir; empty for no snapshots");
+DEFINE_int32(leveldb_snapshot_interval_secs, 86400,
+             "how often to write a snapshot to --leveldb_snapshot_dir");
+DEFINE_bool(leveldb_upgrade_key_schema, false,
+            "whether to rewrite the hex entry keys of a database written "
+            "before binary keys on opening it, which reads all its "
+            "entries; new databases always get binary keys");
+DECLARE_bool(db_deduplicate_chains);
 
 namespace cert_trans {
 namespace {
@@ -35,11 +94,52 @@ static Latency<milliseconds, string> latency_by_op_ms(
     "leveldb_latency_by_operation_ms", "operation",
     "Database latency in ms broken out by operation.");
 
+static Gauge<int, string>* leveldb_level_stats =
+    Gauge<int, string>::New("leveldb_level_stats", "level", "stat",
+                            "Re-export of the per-level stats of leveldb: "
+                            "files, size_mb, and the time_secs, read_mb and "
+                            "write_mb of compactions.");
+
+static Gauge<string>* leveldb_stats =
+    Gauge<string>::New("leveldb_stats", "name",
+                       "Re-export of other internal stats of leveldb.");
+
 
 const char kMetaNodeIdKey[] = "metadata";
+// Followed by the sequence number of an entry in 16 hex digits, in the
+// first version of the key schema, or in 8 big-endian bytes, in the
+// second: both sort in sequence number order.
 const char kEntryPrefix[] = "entry-";
+const char kBinaryEntryPrefix[] = "E";
+// Followed by an entry hash, maps it to the sequence number of the entry
+// written first with that hash.
+const char kHashPrefix[] = "hash-";
 const char kTreeHeadPrefix[] = "sth-";
 const char kMetaPrefix[] = "meta-";
+const char kTilePrefix[] = "tile-";
+const char kFrontierPrefix[] = "frontier-";
+// Under kMetaPrefix: whether the hash keys were written for all the
+// entries, a lower bound of the number of contiguous entries, and the
+// number of entries removed from leveldb once archived.
+const char kHashIndexKey[] = "hash_index";
+const char kContiguousSizeKey[] = "contiguous_size";
+const char kArchivedSizeKey[] = "archived_size";
+// Under kMetaPrefix: the version of the key schema if it is not the
+// first, or kKeySchemaUpgrading while the entry keys are rewritten.
+const char kKeySchemaKey[] = "key_schema";
+const char kKeySchemaBinary[] = "2";
+const char kKeySchemaUpgrading[] = "upgrading";
+// How many entries are moved to binary keys at a time.
+const int64_t kUpgradeBatchSize = 10000;
+// Followed by the first sequence number of the archive, in hex.
+const char kArchivePrefix[] = "entries-";
+// Followed by the number of contiguous entries when it was started, in
+// hex.
+const char kSnapshotPrefix[] = "snapshot-";
+// The subdirectory of a snapshot with its archives.
+const char kSnapshotArchiveDir[] = "archive";
+// How much to write to a snapshot at once.
+const size_t kSnapshotBatchBytes = 4 << 20;
 
 
 #ifdef HAVE_LEVELDB_FILTER_POLICY_H
@@ -56,9 +156,67 @@ unique_ptr<const leveldb::FilterPolicy> BuildFilterPolicy() {
 #endif
 
 
+unique_ptr<leveldb::Cache> BuildBlockCache() {
+  unique_ptr<leveldb::Cache> retval;
+
+  if (FLAGS_leveldb_block_cache_mb > 0) {
+    retval.reset(CHECK_NOTNULL(leveldb::NewLRUCache(
+        static_cast<size_t>(FLAGS_leveldb_block_cache_mb) << 20)));
+  }
+
+  return retval;
+}
+
+
+// Exports the per-level table of the "leveldb.stats" property, which
+// looks like this:
+//
+//                                Compactions
+// Level  Files Size(MB) Time(sec) Read(MB) Write(MB)
+// --------------------------------------------------
+//   0        2        1         0        0         1
+//   2       17       33         5       40        38
+void ExportLevelStats(const string& stats) {
+  istringstream lines(stats);
+  string line;
+  bool in_table(false);
+  while (getline(lines, line)) {
+    if (!in_table) {
+      in_table = line.compare(0, 5, "-----") == 0;
+      continue;
+    }
+
+    int level, files;
+    double size_mb, time_secs, read_mb, write_mb;
+    if (sscanf(line.c_str(), "%d %d %lf %lf %lf %lf", &level, &files,
+               &size_mb, &time_secs, &read_mb, &write_mb) != 6) {
+      break;
+    }
+    leveldb_level_stats->Set(level, "files", files);
+    leveldb_level_stats->Set(level, "size_mb", size_mb);
+    leveldb_level_stats->Set(level, "time_secs", time_secs);
+    leveldb_level_stats->Set(level, "read_mb", read_mb);
+    leveldb_level_stats->Set(level, "write_mb", write_mb);
+  }
+}
+
+
+const char* EntryPrefix(bool binary_keys) {
+  return binary_keys ? kBinaryEntryPrefix : kEntryPrefix;
+}
+
+
 // WARNING: Do NOT change the type of "index" from int64_t, or you'll
 // break existing databases!
-string IndexToKey(int64_t index) {
+string IndexToKey(int64_t index, bool binary_keys) {
+  if (binary_keys) {
+    string key(kBinaryEntryPrefix);
+    for (int shift = 8 * (sizeof(index) - 1); shift >= 0; shift -= 8) {
+      key.push_back(static_cast<char>((index >> shift) & 0xff));
+    }
+    return key;
+  }
+
   const char nibble[] = "0123456789abcdef";
   string index_str(sizeof(index) * 2, nibble[0]);
   for (int i = sizeof(index) * 2; i > 0 && index > 0; --i) {
@@ -70,15 +228,153 @@ string IndexToKey(int64_t index) {
 }
 
 
-int64_t KeyToIndex(leveldb::Slice key) {
-  CHECK(key.starts_with(kEntryPrefix));
-  key.remove_prefix(strlen(kEntryPrefix));
-  const string index_str(util::BinaryString(key.ToString()));
+string HashKey(const string& hash) {
+  return kHashPrefix + hash;
+}
+
+
+string SequenceNumberValue(int64_t sequence_number) {
+  return Serializer::SerializeUint(sequence_number, sizeof(sequence_number));
+}
+
+
+int64_t ParseSequenceNumberValue(const string& value) {
+  uint64_t sequence_number;
+  CHECK_EQ(DeserializeResult::OK,
+           Deserializer::DeserializeUint<uint64_t>(
+               value, sizeof(sequence_number), &sequence_number))
+      << "Invalid sequence number value";
+  return sequence_number;
+}
+
+
+string HexFileName(const char* prefix, int64_t number) {
+  char number_hex[17];
+  snprintf(number_hex, sizeof(number_hex), "%016llx",
+           static_cast<unsigned long long>(number));
+  return prefix + string(number_hex);
+}
+
+
+string ArchiveFileName(int64_t start) {
+  return HexFileName(kArchivePrefix, start);
+}
+
+
+// Returns the start of the archive named |name|, or -1 if it is not the
+// name of an archive.
+int64_t ParseArchiveFileName(const string& name) {
+  const size_t prefix_size(strlen(kArchivePrefix));
+  if (name.size() != prefix_size + 16 ||
+      name.compare(0, prefix_size, kArchivePrefix) != 0 ||
+      name.find_first_not_of("0123456789abcdef", prefix_size) !=
+          string::npos) {
+    return -1;
+  }
+  return strtoll(name.c_str() + prefix_size, nullptr, 16);
+}
+
+
+// Removes a snapshot written by LevelDB::WriteSnapshot(), complete or
+// not.
+void RemoveSnapshot(const string& path) {
+  const string archive_dir(path + "/" + kSnapshotArchiveDir);
+  if (DIR* const dir = opendir(archive_dir.c_str())) {
+    while (const struct dirent* const file = readdir(dir)) {
+      if (ParseArchiveFileName(file->d_name) >= 0) {
+        PLOG_IF(WARNING,
+                unlink((archive_dir + "/" + file->d_name).c_str()) != 0)
+            << "Cannot remove " << file->d_name << " from " << archive_dir;
+      }
+    }
+    closedir(dir);
+    rmdir(archive_dir.c_str());
+  }
+  const leveldb::Status status(leveldb::DestroyDB(path, leveldb::Options()));
+  LOG_IF(WARNING, !status.ok()) << "Cannot remove " << path << ": "
+                                << status.ToString();
+}
+
+
+string TileKey(int level, int64_t index) {
+  return kTilePrefix + std::to_string(level) + "-" + std::to_string(index);
+}
+
+
+string FrontierKey(int64_t tree_size) {
+  return kFrontierPrefix + std::to_string(tree_size);
+}
+
+
+leveldb::ReadOptions ScanReadOptions(bool fill_cache) {
+  leveldb::ReadOptions options;
+  options.fill_cache = fill_cache;
+  return options;
+}
+
+
+// Reads from a consistent snapshot of a leveldb::DB while in scope.
+class SnapshotReadOptions {
+ public:
+  explicit SnapshotReadOptions(leveldb::DB* db) : db_(CHECK_NOTNULL(db)) {
+    options_.snapshot = db_->GetSnapshot();
+  }
+  ~SnapshotReadOptions() {
+    db_->ReleaseSnapshot(options_.snapshot);
+  }
+  SnapshotReadOptions(const SnapshotReadOptions&) = delete;
+  SnapshotReadOptions& operator=(const SnapshotReadOptions&) = delete;
+
+  const leveldb::ReadOptions& get() const {
+    return options_;
+  }
+
+ private:
+  leveldb::DB* const db_;
+  leveldb::ReadOptions options_;
+};
+
+
+// Returns the positions of |keys|, in the order of the keys, so that
+// reading them in that order goes through the blocks of leveldb once.
+template <class Key>
+vector<size_t> SortedPositions(const vector<Key>& keys) {
+  vector<size_t> positions(keys.size());
+  for (size_t i = 0; i < positions.size(); ++i) {
+    positions[i] = i;
+  }
+  std::sort(positions.begin(), positions.end(),
+            [&keys](size_t a, size_t b) { return keys[a] < keys[b]; });
+  return positions;
+}
+
+
+// Decodes the key in place, as it is done for every key scanned.
+int64_t KeyToIndex(leveldb::Slice key, bool binary_keys) {
+  const char* const prefix(EntryPrefix(binary_keys));
+  CHECK(key.starts_with(prefix));
+  key.remove_prefix(strlen(prefix));
 
-  int64_t index(0);
-  CHECK_EQ(index_str.size(), sizeof(index));
-  for (size_t i = 0; i < sizeof(index); ++i) {
-    index = (index << 8) | static_cast<unsigned char>(index_str[i]);
+  uint64_t index(0);
+  if (binary_keys) {
+    CHECK_EQ(key.size(), sizeof(index));
+    for (size_t i = 0; i < sizeof(index); ++i) {
+      index = (index << 8) | static_cast<unsigned char>(key[i]);
+    }
+    return index;
+  }
+
+  CHECK_EQ(key.size(), 2 * sizeof(index));
+  for (size_t i = 0; i < 2 * sizeof(index); ++i) {
+    const char c(key[i]);
+    int nibble;
+    if (c >= '0' && c <= '9') {
+      nibble = c - '0';
+    } else {
+      CHECK(c >= 'a' && c <= 'f') << "Invalid entry key";
+      nibble = c - 'a' + 10;
+    }
+    index = (index << 4) | nibble;
   }
 
   return index;
@@ -90,20 +386,47 @@ int64_t KeyToIndex(leveldb::Slice key) {
 
 class LevelDB::Iterator : public Database::Iterator {
  public:
-  Iterator(const LevelDB* db, int64_t start_index)
-      : it_(CHECK_NOTNULL(db)->db_->NewIterator(leveldb::ReadOptions())) {
+  Iterator(const LevelDB* db, int64_t start_index, int64_t end_index,
+           bool fill_cache)
+      : db_(CHECK_NOTNULL(db)),
+        it_(db->db_->NewIterator(ScanReadOptions(fill_cache))),
+        end_index_(end_index),
+        next_(start_index),
+        seeked_(false) {
     CHECK(it_);
-    it_->Seek(IndexToKey(start_index));
+    // it_ sees the entries that were not archived when it was created,
+    // which includes all those from this archived_size on.
+    ReaderLock lock(&db->lock_);
+    archived_size_ = db->archived_size_;
   }
 
   bool GetNextEntry(LoggedEntry* entry) override {
-    if (!it_->Valid() || !it_->key().starts_with(kEntryPrefix)) {
+    if (next_ < archived_size_) {
+      if (next_ >= end_index_) {
+        return false;
+      }
+      db_->ParseEntry(
+          db_->ReadArchivedEntry(*db_->FindArchive(next_), next_), entry);
+      CHECK_EQ(entry->sequence_number(), next_)
+          << "unexpected sequence_number";
+      ++next_;
+      return true;
+    }
+    if (!seeked_) {
+      it_->Seek(IndexToKey(next_, db_->binary_keys_));
+      seeked_ = true;
+    }
+
+    if (!it_->Valid() ||
+        !it_->key().starts_with(EntryPrefix(db_->binary_keys_))) {
       return false;
     }
 
-    const int64_t seq(KeyToIndex(it_->key()));
-    CHECK(entry->ParseFromArray(it_->value().data(), it_->value().size()))
-        << "failed to parse entry for key " << it_->key().ToString();
+    const int64_t seq(KeyToIndex(it_->key(), db_->binary_keys_));
+    if (seq >= end_index_) {
+      return false;
+    }
+    db_->ParseEntry(it_->value(), entry);
     CHECK(entry->has_sequence_number())
         << "no sequence number for entry with expected sequence number "
         << seq;
@@ -115,7 +438,13 @@ class LevelDB::Iterator : public Database::Iterator {
   }
 
  private:
+  const LevelDB* const db_;
   const unique_ptr<leveldb::Iterator> it_;
+  const int64_t end_index_;
+  int64_t archived_size_;
+  // The next archived entry, until it reaches archived_size_.
+  int64_t next_;
+  bool seeked_;
 };
 
 
@@ -123,19 +452,80 @@ const size_t LevelDB::kTimestampBytesIndexed = 6;
 
 
 LevelDB::LevelDB(const string& dbfile)
-    :
+    : lock_(LockContention::Get("leveldb")),
 #ifdef HAVE_LEVELDB_FILTER_POLICY_H
       filter_policy_(BuildFilterPolicy()),
 #endif
+      block_cache_(BuildBlockCache()),
+      compress_entries_(FLAGS_leveldb_compress_entries),
+      deduplicate_chains_(FLAGS_db_deduplicate_chains),
       contiguous_size_(0),
-      latest_tree_timestamp_(0) {
+      archive_dir_(FLAGS_leveldb_archive_dir),
+      archive_range_size_(FLAGS_leveldb_archive_range_size),
+      archive_keep_entries_(FLAGS_leveldb_archive_keep_entries),
+      archived_size_(0),
+      snapshot_dir_(FLAGS_leveldb_snapshot_dir),
+      frozen_(false),
+      binary_keys_(false),
+      latest_tree_timestamp_(0),
+      stopping_(false) {
+  Open(dbfile, block_cache_.get(), FLAGS_leveldb_max_open_files);
+
+  if (FLAGS_leveldb_stats_interval_secs > 0) {
+    stats_thread_ = std::thread(&LevelDB::ExportStats, this);
+  }
+  if (!archive_dir_.empty() && FLAGS_leveldb_archive_interval_secs > 0) {
+    archive_thread_ = std::thread(&LevelDB::ArchivePeriodically, this);
+  }
+  if (!snapshot_dir_.empty()) {
+    CHECK_GT(FLAGS_leveldb_snapshot_interval_secs, 0);
+    if (mkdir(snapshot_dir_.c_str(), 0700) != 0) {
+      PCHECK(errno == EEXIST) << "Cannot create " << snapshot_dir_;
+    }
+    snapshot_thread_ = std::thread(&LevelDB::SnapshotPeriodically, this);
+  }
+}
+
+
+LevelDB::LevelDB(const string& dbfile, const string& archive_dir,
+                 leveldb::Cache* block_cache, int max_open_files)
+    : lock_(LockContention::Get("leveldb")),
+#ifdef HAVE_LEVELDB_FILTER_POLICY_H
+      filter_policy_(BuildFilterPolicy()),
+#endif
+      compress_entries_(FLAGS_leveldb_compress_entries),
+      deduplicate_chains_(FLAGS_db_deduplicate_chains),
+      contiguous_size_(0),
+      archive_dir_(archive_dir),
+      archive_range_size_(FLAGS_leveldb_archive_range_size),
+      archive_keep_entries_(FLAGS_leveldb_archive_keep_entries),
+      archived_size_(0),
+      frozen_(true),
+      binary_keys_(false),
+      latest_tree_timestamp_(0),
+      stopping_(false) {
+  Open(dbfile, block_cache, max_open_files);
+}
+
+
+void LevelDB::Open(const string& dbfile, leveldb::Cache* block_cache,
+                   int max_open_files) {
   LOG(INFO) << "Opening " << dbfile;
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("open"));
   leveldb::Options options;
-  options.create_if_missing = true;
-  if (FLAGS_leveldb_max_open_files > 0) {
-    options.max_open_files = FLAGS_leveldb_max_open_files;
+  // A frozen shard must be there already.
+  options.create_if_missing = !frozen_;
+  if (max_open_files > 0) {
+    options.max_open_files = max_open_files;
+  }
+  options.block_cache = block_cache;
+  if (FLAGS_leveldb_write_buffer_mb > 0) {
+    options.write_buffer_size =
+        static_cast<size_t>(FLAGS_leveldb_write_buffer_mb) << 20;
   }
+  options.compression = FLAGS_leveldb_compression
+                            ? leveldb::kSnappyCompression
+                            : leveldb::kNoCompression;
 #ifdef HAVE_LEVELDB_FILTER_POLICY_H
   options.filter_policy = filter_policy_.get();
 #else
@@ -147,7 +537,74 @@ LevelDB::LevelDB(const string& dbfile)
   CHECK(status.ok()) << status.ToString();
   db_.reset(db);
 
-  BuildIndex();
+  const function<bool(const string&, string*)> read_metadata(
+      [this](const string& key, string* value) {
+        return db_->Get(leveldb::ReadOptions(), kMetaPrefix + key, value)
+            .ok();
+      });
+  const function<void(const string&, const string&)> write_metadata(
+      [this](const string& key, const string& value) {
+        leveldb::WriteOptions opts;
+        opts.sync = true;
+        const leveldb::Status status(db_->Put(opts, kMetaPrefix + key, value));
+        CHECK(status.ok()) << "Failed to write " << key << ": "
+                           << status.ToString();
+      });
+  // The dictionaries and chains are needed to read the entries stored
+  // with them earlier, even if new ones are not.
+  compressor_.LoadDictionaries(read_metadata);
+  chain_certs_.reset(new ChainCertStore(read_metadata, write_metadata));
+  LoadKeySchema();
+  IndexHashes();
+  LoadArchives();
+  LoadIndex();
+  // A frozen shard gets no new entries to compress.
+  if (compress_entries_ && !frozen_) {
+    compressor_.MaybeTrainDictionary(
+        contiguous_size_,
+        [this](int64_t sequence_number, string* entry) {
+          string data;
+          if (!ReadStoredEntry(leveldb::ReadOptions(), sequence_number,
+                               &data)) {
+            return false;
+          }
+          *entry = DecompressEntry(data);
+          return true;
+        },
+        write_metadata);
+  }
+
+  memory_estimate_.reset(new MemoryEstimate("leveldb", [this, block_cache]() {
+    // The memtables and the block cache.
+    string usage;
+    if (!db_->GetProperty("leveldb.approximate-memory-usage", &usage)) {
+      return block_cache ? block_cache->TotalCharge() : 0;
+    }
+    size_t bytes(std::stoull(usage));
+    // A shared cache is counted once, on its own.
+    if (frozen_ && block_cache) {
+      bytes -= std::min(bytes, block_cache->TotalCharge());
+    }
+    return bytes;
+  }));
+}
+
+
+LevelDB::~LevelDB() {
+  {
+    lock_guard<mutex> lock(stats_lock_);
+    stopping_ = true;
+  }
+  stats_cv_.notify_all();
+  if (stats_thread_.joinable()) {
+    stats_thread_.join();
+  }
+  if (archive_thread_.joinable()) {
+    archive_thread_.join();
+  }
+  if (snapshot_thread_.joinable()) {
+    snapshot_thread_.join();
+  }
 }
 
 
@@ -158,31 +615,22 @@ Database::WriteResult LevelDB::CreateSequencedEntry_(
   ScopedLatency latency(
       latency_by_op_ms.GetScopedLatency("create_sequenced_entry"));
 
-  unique_lock<mutex> lock(lock_);
+  return WriteEntries({&logged}).front();
+}
 
-  string data;
-  CHECK(logged.SerializeToString(&data));
 
-  const string key(IndexToKey(logged.sequence_number()));
+vector<Database::WriteResult> LevelDB::CreateSequencedEntries_(
+    const vector<LoggedEntry>& entries) {
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("create_sequenced_entries"));
 
-  string existing_data;
-  leveldb::Status status(
-      db_->Get(leveldb::ReadOptions(), key, &existing_data));
-  if (status.IsNotFound()) {
-    status = db_->Put(leveldb::WriteOptions(), key, data);
-    CHECK(status.ok()) << "Failed to write sequenced entry (seq: "
-                       << logged.sequence_number()
-                       << "): " << status.ToString();
-  } else {
-    if (existing_data == data) {
-      return this->OK;
-    }
-    return this->SEQUENCE_NUMBER_ALREADY_IN_USE;
+  vector<const LoggedEntry*> pointers;
+  pointers.reserve(entries.size());
+  for (const auto& logged : entries) {
+    pointers.push_back(&logged);
   }
 
-  InsertEntryMapping(logged.sequence_number(), logged.Hash());
-
-  return this->OK;
+  return WriteEntries(pointers);
 }
 
 
@@ -190,27 +638,29 @@ Database::LookupResult LevelDB::LookupByHash(const string& hash,
                                              LoggedEntry* result) const {
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("lookup_by_hash"));
 
-  unique_lock<mutex> lock(lock_);
-
-  auto i(id_by_hash_.find(hash));
-  if (i == id_by_hash_.end()) {
-    return this->NOT_FOUND;
-  }
-
-  string cert_data;
-  const leveldb::Status status(
-      db_->Get(leveldb::ReadOptions(), IndexToKey(i->second), &cert_data));
+  // The hash key is written along with the entry, so there is nothing
+  // to lock: if it is there, so is the entry.
+  string sequence_number_value;
+  leveldb::Status status(db_->Get(leveldb::ReadOptions(), HashKey(hash),
+                                  &sequence_number_value));
   if (status.IsNotFound()) {
     return this->NOT_FOUND;
   }
-  CHECK(status.ok()) << "Failed to get entry by hash(" << util::HexString(hash)
-                     << "): " << status.ToString();
-
-  if (result) {
-    CHECK(result->ParseFromString(cert_data));
-    CHECK_EQ(result->Hash(), hash);
+  CHECK(status.ok()) << "Failed to get entry by hash("
+                     << util::HexString(hash) << "): " << status.ToString();
+  const int64_t sequence_number(
+      ParseSequenceNumberValue(sequence_number_value));
+  if (!result) {
+    return this->LOOKUP_OK;
   }
 
+  string cert_data;
+  CHECK(ReadStoredEntry(leveldb::ReadOptions(), sequence_number, &cert_data))
+      << "Failed to get entry " << sequence_number << " by hash("
+      << util::HexString(hash) << ")";
+  ParseEntry(cert_data, result);
+  CHECK_EQ(result->Hash(), hash);
+
   return this->LOOKUP_OK;
 }
 
@@ -221,16 +671,12 @@ Database::LookupResult LevelDB::LookupByIndex(int64_t sequence_number,
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("lookup_by_index"));
 
   string cert_data;
-  leveldb::Status status(db_->Get(leveldb::ReadOptions(),
-                                  IndexToKey(sequence_number), &cert_data));
-  if (status.IsNotFound()) {
+  if (!ReadStoredEntry(leveldb::ReadOptions(), sequence_number, &cert_data)) {
     return this->NOT_FOUND;
   }
-  CHECK(status.ok()) << "Failed to get entry for sequence number "
-                     << sequence_number;
 
   if (result) {
-    CHECK(result->ParseFromString(cert_data));
+    ParseEntry(cert_data, result);
     CHECK_EQ(result->sequence_number(), sequence_number);
   }
 
@@ -238,9 +684,81 @@ Database::LookupResult LevelDB::LookupByIndex(int64_t sequence_number,
 }
 
 
+vector<Database::LookupResult> LevelDB::LookupByHashes(
+    const vector<string>& hashes, vector<LoggedEntry>* results) const {
+  CHECK_NOTNULL(results)->resize(hashes.size());
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("lookup_by_hashes"));
+  const SnapshotReadOptions snapshot(db_.get());
+
+  // First the sequence numbers of all the hashes, then the entries, so
+  // that each pass reads keys next to each other.
+  vector<int64_t> sequence_numbers;
+  vector<size_t> positions;
+  for (const size_t i : SortedPositions(hashes)) {
+    string value;
+    const leveldb::Status status(
+        db_->Get(snapshot.get(), HashKey(hashes[i]), &value));
+    if (status.IsNotFound()) {
+      continue;
+    }
+    CHECK(status.ok()) << "Failed to get entry by hash("
+                       << util::HexString(hashes[i])
+                       << "): " << status.ToString();
+    sequence_numbers.push_back(ParseSequenceNumberValue(value));
+    positions.push_back(i);
+  }
+
+  vector<LookupResult> found(hashes.size(), this->NOT_FOUND);
+  for (const size_t j : SortedPositions(sequence_numbers)) {
+    const size_t i(positions[j]);
+    string cert_data;
+    CHECK(ReadStoredEntry(snapshot.get(), sequence_numbers[j], &cert_data))
+        << "Failed to get entry " << sequence_numbers[j] << " by hash("
+        << util::HexString(hashes[i]) << ")";
+    ParseEntry(cert_data, &(*results)[i]);
+    CHECK_EQ((*results)[i].Hash(), hashes[i]);
+    found[i] = this->LOOKUP_OK;
+  }
+
+  return found;
+}
+
+
+vector<Database::LookupResult> LevelDB::LookupByIndices(
+    const vector<int64_t>& sequence_numbers,
+    vector<LoggedEntry>* results) const {
+  CHECK_NOTNULL(results)->resize(sequence_numbers.size());
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("lookup_by_indices"));
+  const SnapshotReadOptions snapshot(db_.get());
+
+  vector<LookupResult> found(sequence_numbers.size(), this->NOT_FOUND);
+  for (const size_t i : SortedPositions(sequence_numbers)) {
+    CHECK_GE(sequence_numbers[i], 0);
+    string cert_data;
+    if (!ReadStoredEntry(snapshot.get(), sequence_numbers[i], &cert_data)) {
+      continue;
+    }
+    ParseEntry(cert_data, &(*results)[i]);
+    CHECK_EQ((*results)[i].sequence_number(), sequence_numbers[i]);
+    found[i] = this->LOOKUP_OK;
+  }
+
+  return found;
+}
+
+
 unique_ptr<Database::Iterator> LevelDB::ScanEntries(
     int64_t start_index) const {
-  return unique_ptr<Iterator>(new Iterator(this, start_index));
+  return ScanEntries_(start_index, numeric_limits<int64_t>::max(), true);
+}
+
+
+unique_ptr<Database::Iterator> LevelDB::ScanEntries_(int64_t start_index,
+                                                     int64_t end_index,
+                                                     bool fill_cache) const {
+  return unique_ptr<Iterator>(
+      new Iterator(this, start_index, end_index, fill_cache));
 }
 
 
@@ -255,7 +773,7 @@ Database::WriteResult LevelDB::WriteTreeHead_(const ct::SignedTreeHead& sth) {
   string data;
   CHECK(sth.SerializeToString(&data));
 
-  unique_lock<mutex> lock(lock_);
+  unique_lock<ReadWriteMutex> lock(lock_);
   string existing_data;
   leveldb::Status status(db_->Get(leveldb::ReadOptions(),
                                   kTreeHeadPrefix + timestamp_key,
@@ -288,23 +806,37 @@ Database::WriteResult LevelDB::WriteTreeHead_(const ct::SignedTreeHead& sth) {
 Database::LookupResult LevelDB::LatestTreeHead(
     ct::SignedTreeHead* result) const {
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("latest_tree_head"));
-  lock_guard<mutex> lock(lock_);
+  uint64_t timestamp;
+  string timestamp_key;
+  {
+    ReaderLock lock(&lock_);
+    timestamp = latest_tree_timestamp_;
+    timestamp_key = latest_timestamp_key_;
+  }
 
-  return LatestTreeHeadNoLock(result);
+  // Tree heads are never overwritten, so this one can be read without
+  // the lock, even if a newer one gets written meanwhile.
+  return ReadTreeHead(timestamp, timestamp_key, result);
 }
 
 
 int64_t LevelDB::TreeSize() const {
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("tree_size"));
-  lock_guard<mutex> lock(lock_);
+  ReaderLock lock(&lock_);
 
   return contiguous_size_;
 }
 
 
+vector<std::pair<int64_t, int64_t>> LevelDB::SparseRanges() const {
+  ReaderLock lock(&lock_);
+  return ToRanges(sparse_entries_);
+}
+
+
 void LevelDB::AddNotifySTHCallback(
     const Database::NotifySTHCallback* callback) {
-  unique_lock<mutex> lock(lock_);
+  unique_lock<ReadWriteMutex> lock(lock_);
 
   callbacks_.Add(callback);
 
@@ -318,7 +850,7 @@ void LevelDB::AddNotifySTHCallback(
 
 void LevelDB::RemoveNotifySTHCallback(
     const Database::NotifySTHCallback* callback) {
-  lock_guard<mutex> lock(lock_);
+  lock_guard<ReadWriteMutex> lock(lock_);
 
   callbacks_.Remove(callback);
 }
@@ -327,7 +859,7 @@ void LevelDB::RemoveNotifySTHCallback(
 void LevelDB::InitializeNode(const string& node_id) {
   CHECK(!node_id.empty());
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("initialize_node"));
-  unique_lock<mutex> lock(lock_);
+  unique_lock<ReadWriteMutex> lock(lock_);
   string existing_id;
   if (NodeId(&existing_id) != this->NOT_FOUND) {
     LOG(FATAL)
@@ -357,34 +889,225 @@ Database::LookupResult LevelDB::NodeId(string* node_id) {
 }
 
 
-void LevelDB::BuildIndex() {
-  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("build_index"));
-  // Technically, this should only be called from the constructor, so
-  // this should not be necessarily, but just to be sure...
-  lock_guard<mutex> lock(lock_);
+Database::WriteResult LevelDB::WriteTile_(int level, int64_t index,
+                                          const string& hashes) {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("write_tile"));
+  const leveldb::Status status(
+      db_->Put(leveldb::WriteOptions(), TileKey(level, index), hashes));
+  CHECK(status.ok()) << "Failed to write tile: " << status.ToString();
+  return this->OK;
+}
+
+
+Database::LookupResult LevelDB::LookupTile(int level, int64_t index,
+                                           string* hashes) const {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("lookup_tile"));
+  CHECK_NOTNULL(hashes);
+  const leveldb::Status status(
+      db_->Get(leveldb::ReadOptions(), TileKey(level, index), hashes));
+  if (status.IsNotFound()) {
+    return this->NOT_FOUND;
+  }
+  CHECK(status.ok()) << "Tile lookup failed: " << status.ToString();
+  return this->LOOKUP_OK;
+}
+
+
+Database::WriteResult LevelDB::WriteFrontier_(int64_t tree_size,
+                                              const string& hashes) {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("write_frontier"));
+  const leveldb::Status status(
+      db_->Put(leveldb::WriteOptions(), FrontierKey(tree_size), hashes));
+  CHECK(status.ok()) << "Failed to write frontier: " << status.ToString();
+  return this->OK;
+}
 
+
+Database::LookupResult LevelDB::LookupFrontier(int64_t tree_size,
+                                               string* hashes) const {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("lookup_frontier"));
+  CHECK_NOTNULL(hashes);
+  const leveldb::Status status(
+      db_->Get(leveldb::ReadOptions(), FrontierKey(tree_size), hashes));
+  if (status.IsNotFound()) {
+    return this->NOT_FOUND;
+  }
+  CHECK(status.ok()) << "Frontier lookup failed: " << status.ToString();
+  return this->LOOKUP_OK;
+}
+
+
+void LevelDB::LoadKeySchema() {
+  const string schema_key(string(kMetaPrefix) + kKeySchemaKey);
+  string schema;
+  if (!db_->Get(leveldb::ReadOptions(), schema_key, &schema).ok()) {
+    unique_ptr<leveldb::Iterator> it(db_->NewIterator(ScanReadOptions(false)));
+    CHECK(it);
+    it->Seek(kEntryPrefix);
+    const bool hex_keys(it->Valid() && it->key().starts_with(kEntryPrefix));
+    it.reset();
+    if (frozen_ || (hex_keys && !FLAGS_leveldb_upgrade_key_schema)) {
+      // Not upgraded (yet).
+      return;
+    }
+    if (!hex_keys) {
+      leveldb::WriteOptions options;
+      options.sync = true;
+      const leveldb::Status status(
+          db_->Put(options, schema_key, kKeySchemaBinary));
+      CHECK(status.ok()) << "Failed to write the key schema: "
+                         << status.ToString();
+      binary_keys_ = true;
+      return;
+    }
+    schema = kKeySchemaUpgrading;
+  }
+
+  // An interrupted upgrade is resumed whatever the flag says, as some
+  // entries are only found with binary keys already.
+  if (schema == kKeySchemaUpgrading) {
+    UpgradeKeySchema();
+  } else {
+    CHECK_EQ(kKeySchemaBinary, schema) << "Unknown key schema";
+  }
+  binary_keys_ = true;
+}
+
+
+void LevelDB::UpgradeKeySchema() {
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("upgrade_key_schema"));
+  LOG(INFO) << "Rewriting the entry keys in binary";
+  const string schema_key(string(kMetaPrefix) + kKeySchemaKey);
+  leveldb::WriteOptions sync_options;
+  sync_options.sync = true;
+  leveldb::Status status(
+      db_->Put(sync_options, schema_key, kKeySchemaUpgrading));
+  CHECK(status.ok()) << "Failed to write the key schema: "
+                     << status.ToString();
+
+  // Each batch moves its entries, so that an interrupted upgrade can
+  // pick up from the first hex key left.
+  unique_ptr<leveldb::Iterator> it(db_->NewIterator(ScanReadOptions(false)));
+  CHECK(it);
+  leveldb::WriteBatch batch;
+  int64_t count(0);
+  for (it->Seek(kEntryPrefix);
+       it->Valid() && it->key().starts_with(kEntryPrefix); it->Next()) {
+    batch.Put(IndexToKey(KeyToIndex(it->key(), false), true), it->value());
+    batch.Delete(it->key());
+    if (++count % kUpgradeBatchSize == 0) {
+      status = db_->Write(leveldb::WriteOptions(), &batch);
+      CHECK(status.ok()) << "Failed to rewrite entry keys: "
+                         << status.ToString();
+      batch.Clear();
+    }
+  }
+  it.reset();
+  batch.Put(schema_key, kKeySchemaBinary);
+  status = db_->Write(sync_options, &batch);
+  CHECK(status.ok()) << "Failed to rewrite entry keys: " << status.ToString();
+
+  // Reclaim the space of the hex keys now.
+  string after_entries(kEntryPrefix);
+  ++after_entries.back();
+  const leveldb::Slice begin_slice(kEntryPrefix);
+  const leveldb::Slice end_slice(after_entries);
+  db_->CompactRange(&begin_slice, &end_slice);
+  LOG(INFO) << "Rewrote the keys of " << count << " entries";
+}
+
+
+void LevelDB::IndexHashes() {
+  string value;
+  if (db_->Get(leveldb::ReadOptions(), string(kMetaPrefix) + kHashIndexKey,
+               &value).ok()) {
+    return;
+  }
+
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("index_hashes"));
+  LOG(INFO) << "Writing the hash keys of the existing entries";
   leveldb::ReadOptions options;
   options.fill_cache = false;
   unique_ptr<leveldb::Iterator> it(db_->NewIterator(options));
   CHECK(it);
-  it->Seek(kEntryPrefix);
-
-  for (; it->Valid() && it->key().starts_with(kEntryPrefix); it->Next()) {
-    const int64_t seq(KeyToIndex(it->key()));
+  leveldb::WriteBatch batch;
+  // The hashes whose key is in |batch|.
+  std::set<string> batch_hashes;
+  int64_t count(0);
+  const char* const entry_prefix(EntryPrefix(binary_keys_));
+  for (it->Seek(entry_prefix);
+       it->Valid() && it->key().starts_with(entry_prefix); it->Next()) {
+    const int64_t seq(KeyToIndex(it->key(), binary_keys_));
     LoggedEntry logged;
-    CHECK(logged.ParseFromString(it->value().ToString()))
+    CHECK(logged.ParseFromString(DecompressEntry(it->value())))
         << "Failed to parse entry with sequence number " << seq;
-    CHECK(logged.has_sequence_number())
-        << "No sequence number for entry with sequence number " << seq;
     CHECK_EQ(logged.sequence_number(), seq)
         << "Entry has unexpected sequence_number: " << seq;
 
-    InsertEntryMapping(logged.sequence_number(), logged.Hash());
+    // Entries are in order, so the first one with a hash has the lowest
+    // sequence number.
+    const string hash(logged.Hash());
+    if (batch_hashes.count(hash) == 0 &&
+        db_->Get(leveldb::ReadOptions(), HashKey(hash), &value)
+            .IsNotFound()) {
+      batch.Put(HashKey(hash), SequenceNumberValue(seq));
+      batch_hashes.insert(hash);
+    }
+    if (++count % 10000 == 0) {
+      const leveldb::Status status(db_->Write(leveldb::WriteOptions(), &batch));
+      CHECK(status.ok()) << "Failed to write hash keys: " << status.ToString();
+      batch.Clear();
+      batch_hashes.clear();
+    }
+  }
+  // Only once all the hash keys are in.
+  batch.Put(string(kMetaPrefix) + kHashIndexKey, "1");
+  leveldb::WriteOptions write_options;
+  write_options.sync = true;
+  const leveldb::Status status(db_->Write(write_options, &batch));
+  CHECK(status.ok()) << "Failed to write hash keys: " << status.ToString();
+  LOG(INFO) << "Wrote the hash keys of " << count << " entries";
+}
+
+
+void LevelDB::LoadIndex() {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("load_index"));
+  // Technically, this should only be called from the constructor, so
+  // this should not be necessarily, but just to be sure...
+  lock_guard<ReadWriteMutex> lock(lock_);
+
+  // The entries below the stored contiguous size are all there, so only
+  // the keys of the following ones are read.
+  string value;
+  if (db_->Get(leveldb::ReadOptions(),
+               string(kMetaPrefix) + kContiguousSizeKey, &value).ok()) {
+    contiguous_size_ = ParseSequenceNumberValue(value);
+  }
+  // The archived entries were contiguous, but may have been written in
+  // a batch that did not store its contiguous size yet.
+  contiguous_size_ = std::max(contiguous_size_, archived_size_);
+  leveldb::ReadOptions options;
+  options.fill_cache = false;
+  unique_ptr<leveldb::Iterator> it(db_->NewIterator(options));
+  CHECK(it);
+  for (it->Seek(IndexToKey(contiguous_size_, binary_keys_));
+       it->Valid() && it->key().starts_with(EntryPrefix(binary_keys_));
+       it->Next()) {
+    InsertEntryMapping(KeyToIndex(it->key(), binary_keys_));
   }
 
-  // Now read the STH entries.
-  it->Seek(kTreeHeadPrefix);
-  for (; it->Valid() && it->key().starts_with(kTreeHeadPrefix); it->Next()) {
+  // The latest tree head is the last one in key order, which is the
+  // last key before whatever follows the tree heads.
+  string after_tree_heads(kTreeHeadPrefix);
+  ++after_tree_heads.back();
+  it->Seek(after_tree_heads);
+  if (it->Valid()) {
+    it->Prev();
+  } else {
+    it->SeekToLast();
+  }
+  if (it->Valid() && it->key().starts_with(kTreeHeadPrefix)) {
     leveldb::Slice key_slice(it->key());
     key_slice.remove_prefix(strlen(kTreeHeadPrefix));
     latest_timestamp_key_ = key_slice.ToString();
@@ -396,33 +1119,530 @@ void LevelDB::BuildIndex() {
 }
 
 
+void LevelDB::LoadArchives() {
+  string value;
+  int64_t stored_archived_size(0);
+  if (db_->Get(leveldb::ReadOptions(),
+               string(kMetaPrefix) + kArchivedSizeKey, &value).ok()) {
+    stored_archived_size = ParseSequenceNumberValue(value);
+  }
+  if (archive_dir_.empty()) {
+    CHECK_EQ(0, stored_archived_size)
+        << "Entries are archived, but --leveldb_archive_dir is not set";
+    return;
+  }
+  CHECK_GT(archive_range_size_, 0);
+  CHECK_GE(archive_keep_entries_, 0);
+  if (mkdir(archive_dir_.c_str(), 0700) != 0) {
+    PCHECK(errno == EEXIST) << "Cannot create " << archive_dir_;
+  }
+
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("load_archives"));
+  std::map<int64_t, string> paths;
+  DIR* const dir(CHECK_NOTNULL(opendir(archive_dir_.c_str())));
+  while (const struct dirent* const file = readdir(dir)) {
+    const int64_t start(ParseArchiveFileName(file->d_name));
+    if (start >= 0) {
+      paths.emplace(start, archive_dir_ + "/" + file->d_name);
+    }
+  }
+  closedir(dir);
+
+  lock_guard<ReadWriteMutex> lock(lock_);
+  for (const auto& path : paths) {
+    util::StatusOr<unique_ptr<EntryArchive>> archive(
+        EntryArchive::Open(path.second));
+    CHECK(archive.ok()) << archive.status();
+    CHECK_EQ(archived_size_, archive.ValueOrDie()->start())
+        << "Missing archive before " << path.second;
+    archived_size_ = archive.ValueOrDie()->end();
+    archives_.emplace_back(std::move(archive.ValueOrDie()));
+  }
+  CHECK_GE(archived_size_, stored_archived_size)
+      << "Missing archives in " << archive_dir_;
+  if (archived_size_ > stored_archived_size) {
+    LOG(INFO) << "Removing the entries archived before a crash";
+    DeleteArchivedEntries(stored_archived_size, archived_size_);
+  }
+  LOG(INFO) << "Opened " << archives_.size() << " archives of "
+            << archived_size_ << " entries";
+}
+
+
+util::Status LevelDB::ArchiveEntries() {
+  CHECK(!archive_dir_.empty());
+  lock_guard<mutex> archive_lock(archive_lock_);
+  while (true) {
+    int64_t start;
+    {
+      ReaderLock lock(&lock_);
+      start = archived_size_;
+      if (contiguous_size_ - archive_keep_entries_ <
+          start + archive_range_size_) {
+        return ::util::OkStatus();
+      }
+    }
+    const int64_t end(start + archive_range_size_);
+    ScopedLatency latency(
+        latency_by_op_ms.GetScopedLatency("archive_entries"));
+
+    // The entries are archived compressed, even if they were not
+    // stored so.
+    vector<string> records;
+    records.reserve(archive_range_size_);
+    unique_ptr<leveldb::Iterator> it(
+        db_->NewIterator(ScanReadOptions(false)));
+    CHECK(it);
+    it->Seek(IndexToKey(start, binary_keys_));
+    for (int64_t seq = start; seq < end; ++seq, it->Next()) {
+      CHECK(it->Valid() && it->key().starts_with(EntryPrefix(binary_keys_)) &&
+            KeyToIndex(it->key(), binary_keys_) == seq)
+          << "Missing contiguous entry " << seq;
+      const string stored(it->value().ToString());
+      records.push_back(EntryCompressor::IsCompressed(stored)
+                            ? stored
+                            : compressor_.Compress(stored));
+    }
+    it.reset();
+
+    const string path(archive_dir_ + "/" + ArchiveFileName(start));
+    util::Status status(EntryArchive::Write(path, start, records));
+    if (!status.ok()) {
+      return status;
+    }
+    util::StatusOr<unique_ptr<EntryArchive>> archive(
+        EntryArchive::Open(path));
+    if (!archive.ok()) {
+      return archive.status();
+    }
+
+    // Readers that miss an entry in leveldb from now on find it here.
+    {
+      lock_guard<ReadWriteMutex> lock(lock_);
+      archives_.emplace_back(std::move(archive.ValueOrDie()));
+      archived_size_ = end;
+    }
+    DeleteArchivedEntries(start, end);
+    LOG(INFO) << "Archived the entries [" << start << ", " << end
+              << ") to " << path;
+  }
+}
+
+
+util::Status LevelDB::WriteSnapshot(const string& path) {
+  // Keeps the archives in line with the entries in leveldb.
+  lock_guard<mutex> archive_lock(archive_lock_);
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("write_snapshot"));
+  const string tmp_path(path + ".tmp");
+  // Left over by a crash, maybe.
+  RemoveSnapshot(tmp_path);
+
+  leveldb::Options options;
+  options.create_if_missing = true;
+  options.error_if_exists = true;
+  options.compression = FLAGS_leveldb_compression
+                            ? leveldb::kSnappyCompression
+                            : leveldb::kNoCompression;
+  leveldb::DB* snapshot_db;
+  leveldb::Status status(leveldb::DB::Open(options, tmp_path, &snapshot_db));
+  if (!status.ok()) {
+    return util::Status(util::error::INTERNAL, status.ToString());
+  }
+  unique_ptr<leveldb::DB> snapshot_db_holder(snapshot_db);
+
+  vector<int64_t> archive_starts;
+  leveldb::ReadOptions read_options(ScanReadOptions(false));
+  {
+    ReaderLock lock(&lock_);
+    read_options.snapshot = db_->GetSnapshot();
+    for (const auto& archive : archives_) {
+      archive_starts.push_back(archive->start());
+    }
+  }
+
+  const string node_id_key(string(kMetaPrefix) + kMetaNodeIdKey);
+  unique_ptr<leveldb::Iterator> it(db_->NewIterator(read_options));
+  CHECK(it);
+  leveldb::WriteBatch batch;
+  size_t batch_bytes(0);
+  for (it->SeekToFirst(); it->Valid() && status.ok(); it->Next()) {
+    // The new node gets an ID of its own.
+    if (it->key() == leveldb::Slice(node_id_key)) {
+      continue;
+    }
+    batch.Put(it->key(), it->value());
+    batch_bytes += it->key().size() + it->value().size();
+    if (batch_bytes >= kSnapshotBatchBytes) {
+      status = snapshot_db->Write(leveldb::WriteOptions(), &batch);
+      batch.Clear();
+      batch_bytes = 0;
+    }
+  }
+  if (status.ok()) {
+    status = it->status();
+  }
+  if (status.ok()) {
+    leveldb::WriteOptions write_options;
+    write_options.sync = true;
+    status = snapshot_db->Write(write_options, &batch);
+  }
+  it.reset();
+  db_->ReleaseSnapshot(read_options.snapshot);
+  snapshot_db_holder.reset();
+  if (!status.ok()) {
+    RemoveSnapshot(tmp_path);
+    return util::Status(util::error::INTERNAL, status.ToString());
+  }
+
+  const string archive_dir(tmp_path + "/" + kSnapshotArchiveDir);
+  if (!archive_starts.empty() && mkdir(archive_dir.c_str(), 0700) != 0) {
+    const int mkdir_errno(errno);
+    RemoveSnapshot(tmp_path);
+    return util::Status(util::error::INTERNAL,
+                        "cannot create " + archive_dir + ": " +
+                            strerror(mkdir_errno));
+  }
+  for (const int64_t start : archive_starts) {
+    const string name(ArchiveFileName(start));
+    if (link((archive_dir_ + "/" + name).c_str(),
+             (archive_dir + "/" + name).c_str()) != 0) {
+      const int link_errno(errno);
+      RemoveSnapshot(tmp_path);
+      return util::Status(util::error::INTERNAL,
+                          "cannot link " + name + " into " + archive_dir +
+                              ": " + strerror(link_errno));
+    }
+  }
+
+  if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+    const int rename_errno(errno);
+    RemoveSnapshot(tmp_path);
+    return util::Status(util::error::INTERNAL,
+                        "cannot rename " + tmp_path + ": " +
+                            strerror(rename_errno));
+  }
+  LOG(INFO) << "Wrote a snapshot to " << path;
+  return ::util::OkStatus();
+}
+
+
+const EntryArchive* LevelDB::FindArchive(int64_t sequence_number) const {
+  ReaderLock lock(&lock_);
+  return FindArchiveNoLock(sequence_number);
+}
+
+
+// This must be called with "lock_" held.
+const EntryArchive* LevelDB::FindArchiveNoLock(
+    int64_t sequence_number) const {
+  if (sequence_number >= archived_size_) {
+    return nullptr;
+  }
+  const auto archive(std::upper_bound(
+      archives_.begin(), archives_.end(), sequence_number,
+      [](int64_t seq, const unique_ptr<EntryArchive>& archive) {
+        return seq < archive->end();
+      }));
+  CHECK(archive != archives_.end());
+  return archive->get();
+}
+
+
+string LevelDB::ReadArchivedEntry(const EntryArchive& archive,
+                                  int64_t sequence_number) const {
+  string data;
+  const util::Status status(archive.Read(sequence_number, &data));
+  CHECK(status.ok()) << "Failed to read archived entry " << sequence_number
+                     << ": " << status;
+  return data;
+}
+
+
+bool LevelDB::ReadStoredEntry(const leveldb::ReadOptions& options,
+                              int64_t sequence_number, string* data) const {
+  const EntryArchive* archive(FindArchive(sequence_number));
+  if (!archive) {
+    const leveldb::Status status(
+        db_->Get(options, IndexToKey(sequence_number, binary_keys_), data));
+    if (!status.IsNotFound()) {
+      CHECK(status.ok()) << "Failed to get entry for sequence number "
+                         << sequence_number << ": " << status.ToString();
+      return true;
+    }
+    // It may have been archived, and removed, in the meantime.
+    archive = FindArchive(sequence_number);
+    if (!archive) {
+      return false;
+    }
+  }
+  *data = ReadArchivedEntry(*archive, sequence_number);
+  return true;
+}
+
+
+void LevelDB::DeleteArchivedEntries(int64_t start, int64_t end) {
+  leveldb::WriteBatch batch;
+  for (int64_t seq = start; seq < end; ++seq) {
+    batch.Delete(IndexToKey(seq, binary_keys_));
+  }
+  batch.Put(string(kMetaPrefix) + kArchivedSizeKey, SequenceNumberValue(end));
+  leveldb::WriteOptions options;
+  options.sync = true;
+  const leveldb::Status status(db_->Write(options, &batch));
+  CHECK(status.ok()) << "Failed to remove archived entries: "
+                     << status.ToString();
+
+  // Reclaim their space now, rather than whenever leveldb gets to it.
+  const string begin_key(IndexToKey(start, binary_keys_));
+  const string end_key(IndexToKey(end, binary_keys_));
+  const leveldb::Slice begin_slice(begin_key);
+  const leveldb::Slice end_slice(end_key);
+  db_->CompactRange(&begin_slice, &end_slice);
+}
+
+
+// Writes the new entries of |entries| with a single leveldb::WriteBatch.
+vector<Database::WriteResult> LevelDB::WriteEntries(
+    const vector<const LoggedEntry*>& entries) {
+  vector<string> data(entries.size());
+  vector<string> hashes(entries.size());
+  for (size_t i = 0; i < entries.size(); ++i) {
+    CHECK(entries[i]->SerializeToString(&data[i]));
+    hashes[i] = entries[i]->Hash();
+  }
+  // What gets written, if it is not |data|.
+  vector<string> stored;
+  if (compress_entries_ || deduplicate_chains_) {
+    stored.reserve(entries.size());
+    for (size_t i = 0; i < entries.size(); ++i) {
+      stored.push_back(EncodeEntry(*entries[i], data[i]));
+    }
+  }
+
+  vector<Database::WriteResult> results(entries.size(), this->OK);
+  // Indices in |entries| of the entries in |batch|.
+  vector<size_t> batched;
+  // Those among them whose hash key is in |batch|.
+  vector<size_t> hashed;
+  leveldb::WriteBatch batch;
+
+  unique_lock<ReadWriteMutex> lock(lock_);
+  for (size_t i = 0; i < entries.size(); ++i) {
+    const int64_t sequence_number(entries[i]->sequence_number());
+    const string key(IndexToKey(sequence_number, binary_keys_));
+
+    // Entries that are being written, by this call or a concurrent
+    // one, count as existing already.
+    const string* existing(nullptr);
+    string existing_data;
+    const auto pending(pending_entries_.find(sequence_number));
+    const EntryArchive* const archive(FindArchiveNoLock(sequence_number));
+    if (pending != pending_entries_.end()) {
+      existing = pending->second;
+    } else if (archive ||
+               !db_->Get(leveldb::ReadOptions(), key, &existing_data)
+                    .IsNotFound()) {
+      if (archive) {
+        existing_data = ReadArchivedEntry(*archive, sequence_number);
+      }
+      // Compared as it would be written without compression, nor with
+      // its chain kept apart.
+      LoggedEntry existing_entry;
+      ParseEntry(existing_data, &existing_entry);
+      CHECK(existing_entry.SerializeToString(&existing_data));
+      existing = &existing_data;
+    }
+
+    if (existing) {
+      if (!LoggedEntry::SameSerializedEntry(*existing, data[i])) {
+        results[i] = this->SEQUENCE_NUMBER_ALREADY_IN_USE;
+      }
+      continue;
+    }
+
+    batch.Put(key, stored.empty() ? data[i] : stored[i]);
+    pending_entries_.emplace(sequence_number, &data[i]);
+    batched.push_back(i);
+
+    // The first entry written with a hash keeps its key.
+    const string hash_key(HashKey(hashes[i]));
+    string existing_hash;
+    if (pending_hashes_.count(hashes[i]) == 0 &&
+        db_->Get(leveldb::ReadOptions(), hash_key, &existing_hash)
+            .IsNotFound()) {
+      batch.Put(hash_key, SequenceNumberValue(sequence_number));
+      pending_hashes_.insert(hashes[i]);
+      hashed.push_back(i);
+    }
+  }
+
+  if (batched.empty()) {
+    return results;
+  }
+  // The entries below it are written already.
+  batch.Put(string(kMetaPrefix) + kContiguousSizeKey,
+            SequenceNumberValue(contiguous_size_));
+
+  // Concurrent callers can check their entries while this batch is
+  // being written, and leveldb commits the batches waiting to be
+  // written together, in a single log write.
+  lock.unlock();
+  const leveldb::Status status(db_->Write(leveldb::WriteOptions(), &batch));
+  CHECK(status.ok()) << "Failed to write " << batched.size()
+                     << " sequenced entries (first seq: "
+                     << entries[batched.front()]->sequence_number()
+                     << "): " << status.ToString();
+
+  lock.lock();
+  for (size_t i : batched) {
+    const int64_t sequence_number(entries[i]->sequence_number());
+    CHECK_EQ(1U, pending_entries_.erase(sequence_number));
+    InsertEntryMapping(sequence_number);
+  }
+  for (size_t i : hashed) {
+    CHECK_EQ(1U, pending_hashes_.erase(hashes[i]));
+  }
+
+  return results;
+}
+
+
+string LevelDB::EncodeEntry(const LoggedEntry& logged,
+                            const string& data) const {
+  string result;
+  if (deduplicate_chains_) {
+    LoggedEntry copy;
+    copy.CopyFrom(logged);
+    chain_certs_->Deduplicate(&copy);
+    CHECK(copy.SerializeToString(&result));
+  } else {
+    result = data;
+  }
+  return compress_entries_ ? compressor_.Compress(result) : result;
+}
+
+
+string LevelDB::DecompressEntry(const leveldb::Slice& data) const {
+  string result;
+  const util::Status status(
+      compressor_.Decompress(data.data(), data.size(), &result));
+  CHECK(status.ok()) << "Failed to decompress entry: " << status;
+  return result;
+}
+
+
+void LevelDB::ParseEntry(const leveldb::Slice& data,
+                         LoggedEntry* entry) const {
+  CHECK(entry->ParseFromString(DecompressEntry(data)))
+      << "Failed to parse entry";
+  const util::Status status(chain_certs_->Restore(entry));
+  CHECK(status.ok()) << "Failed to restore the chain of entry "
+                     << entry->sequence_number() << ": " << status;
+}
+
+
 Database::LookupResult LevelDB::LatestTreeHeadNoLock(
     ct::SignedTreeHead* result) const {
-  if (latest_tree_timestamp_ == 0) {
+  return ReadTreeHead(latest_tree_timestamp_, latest_timestamp_key_, result);
+}
+
+
+Database::LookupResult LevelDB::ReadTreeHead(uint64_t timestamp,
+                                             const string& timestamp_key,
+                                             ct::SignedTreeHead* result) const {
+  if (timestamp == 0) {
     return this->NOT_FOUND;
   }
 
   string tree_data;
   leveldb::Status status(db_->Get(leveldb::ReadOptions(),
-                                  kTreeHeadPrefix + latest_timestamp_key_,
+                                  kTreeHeadPrefix + timestamp_key,
                                   &tree_data));
   CHECK(status.ok()) << "Failed to read latest tree head: "
                      << status.ToString();
 
   CHECK(result->ParseFromString(tree_data));
-  CHECK_EQ(result->timestamp(), latest_tree_timestamp_);
+  CHECK_EQ(result->timestamp(), timestamp);
 
   return this->LOOKUP_OK;
 }
 
 
-// This must be called with "lock_" held.
-void LevelDB::InsertEntryMapping(int64_t sequence_number, const string& hash) {
-  if (!id_by_hash_.insert(make_pair(hash, sequence_number)).second) {
-    // This is a duplicate hash under a new sequence number.
-    // Make sure we track the entry with the lowest sequence number:
-    id_by_hash_[hash] = min(id_by_hash_[hash], sequence_number);
+void LevelDB::ExportStats() {
+  unique_lock<mutex> lock(stats_lock_);
+  do {
+    string value;
+    if (db_->GetProperty("leveldb.stats", &value)) {
+      ExportLevelStats(value);
+    }
+    // Not all versions of leveldb have this one.
+    if (db_->GetProperty("leveldb.approximate-memory-usage", &value)) {
+      leveldb_stats->Set("approximate_memory_usage_bytes",
+                         strtod(value.c_str(), nullptr));
+    }
+    if (block_cache_) {
+      leveldb_stats->Set("block_cache_usage_bytes",
+                         block_cache_->TotalCharge());
+    }
+  } while (!stats_cv_.wait_for(lock,
+                               seconds(FLAGS_leveldb_stats_interval_secs),
+                               [this]() { return stopping_; }));
+}
+
+
+void LevelDB::ArchivePeriodically() {
+  unique_lock<mutex> lock(stats_lock_);
+  while (!stats_cv_.wait_for(lock,
+                             seconds(FLAGS_leveldb_archive_interval_secs),
+                             [this]() { return stopping_; })) {
+    lock.unlock();
+    const util::Status status(ArchiveEntries());
+    LOG_IF(WARNING, !status.ok()) << "Failed to archive entries: " << status;
+    lock.lock();
   }
+}
+
+
+void LevelDB::SnapshotPeriodically() {
+  unique_lock<mutex> lock(stats_lock_);
+  while (!stats_cv_.wait_for(lock,
+                             seconds(FLAGS_leveldb_snapshot_interval_secs),
+                             [this]() { return stopping_; })) {
+    lock.unlock();
+    int64_t contiguous_size;
+    {
+      ReaderLock reader_lock(&lock_);
+      contiguous_size = contiguous_size_;
+    }
+    const string name(HexFileName(kSnapshotPrefix, contiguous_size));
+    // Nothing new since the last one.
+    if (access((snapshot_dir_ + "/" + name).c_str(), F_OK) != 0) {
+      const util::Status status(WriteSnapshot(snapshot_dir_ + "/" + name));
+      if (status.ok()) {
+        vector<string> old_snapshots;
+        DIR* const dir(CHECK_NOTNULL(opendir(snapshot_dir_.c_str())));
+        while (const struct dirent* const file = readdir(dir)) {
+          if (strncmp(file->d_name, kSnapshotPrefix,
+                      strlen(kSnapshotPrefix)) == 0 &&
+              file->d_name != name) {
+            old_snapshots.push_back(file->d_name);
+          }
+        }
+        closedir(dir);
+        for (const string& old_snapshot : old_snapshots) {
+          RemoveSnapshot(snapshot_dir_ + "/" + old_snapshot);
+        }
+      } else {
+        LOG(WARNING) << "Failed to write a snapshot: " << status;
+      }
+    }
+    lock.lock();
+  }
+}
+
+
+// This must be called with "lock_" held.
+void LevelDB::InsertEntryMapping(int64_t sequence_number) {
   if (sequence_number == contiguous_size_) {
     ++contiguous_size_;
     for (auto i = sparse_entries_.find(contiguous_size_);
@@ -3,30 +3,67 @@
 
 #include "config.h"
 
+#include <leveldb/cache.h>
 #include <leveldb/db.h>
 #ifdef HAVE_LEVELDB_FILTER_POLICY_H
 #include <leveldb/filter_policy.h>
 #endif
 #include <stdint.h>
+#include <condition_variable>
 #include <map>
 #include <memory>
 #include <mutex>
 #include <set>
-#include <unordered_map>
+#include <thread>
 #include <vector>
 
+#include "base/read_write_mutex.h"
+#include "log/chain_cert_store.h"
 #include "log/database.h"
+#include "log/entry_archive.h"
+#include "log/entry_compressor.h"
+#include "monitoring/memory.h"
 #include "proto/ct.pb.h"
 
 namespace cert_trans {
 
 
+// Entries are stored by sequence number, and their hashes map to their
+// sequence number in a key space of their own, written along with them,
+// so that opening the database does not read all the entries.
+//
+// The sequence numbers are in the entry keys as 8 big-endian bytes.
+// Databases written before that have them in hex, which is still read,
+// until they are opened once with --leveldb_upgrade_key_schema, which
+// rewrites the keys (resuming after a crash, if need be). The version
+// of the key schema is kept in the metadata.
+//
+// With --leveldb_compress_entries, the entries are compressed with a
+// dictionary kept in the metadata (see EntryCompressor). With
+// --db_deduplicate_chains, their chains are kept apart, in the metadata
+// too (see ChainCertStore).
+//
+// With --leveldb_archive_dir, ranges of old entries are sealed into
+// archive files in that directory (see EntryArchive), and removed from
+// leveldb, which keeps the hot entries, the hash keys and the rest.
+// Reads of archived entries go to their archive.
+//
+// With --leveldb_snapshot_dir, a consistent copy of the database is
+// written there every --leveldb_snapshot_interval_secs (see
+// WriteSnapshot()), for new nodes to start from.
 class LevelDB : public Database {
  public:
   static const size_t kTimestampBytesIndexed;
 
   explicit LevelDB(const std::string& dbfile);
-  ~LevelDB() = default;
+  // Opens the database of a frozen shard of the log, which is only
+  // read (see --frozen_shards of ct-server): with its archives, if
+  // any, in |archive_dir|, and the blocks read cached in |block_cache|
+  // if not null, which is shared with the other shards and must
+  // outlive this instance. It has no stats, archiving nor snapshots.
+  LevelDB(const std::string& dbfile, const std::string& archive_dir,
+          leveldb::Cache* block_cache, int max_open_files);
+  ~LevelDB();
   LevelDB(const LevelDB&) = delete;
   LevelDB& operator=(const LevelDB&) = delete;
 
@@ -34,12 +71,25 @@ class LevelDB : public Database {
   Database::WriteResult CreateSequencedEntry_(
       const LoggedEntry& logged) override;
 
+  std::vector<Database::WriteResult> CreateSequencedEntries_(
+      const std::vector<LoggedEntry>& entries) override;
+
   Database::LookupResult LookupByHash(const std::string& hash,
                                       LoggedEntry* result) const override;
 
   Database::LookupResult LookupByIndex(int64_t sequence_number,
                                        LoggedEntry* result) const override;
 
+  // These read the whole batch from one snapshot, in key order.
+  std::vector<Database::LookupResult> LookupByHashes(
+      const std::vector<std::string>& hashes,
+      std::vector<LoggedEntry>* results) const override;
+
+  std::vector<Database::LookupResult> LookupByIndices(
+      const std::vector<int64_t>& sequence_numbers,
+      std::vector<LoggedEntry>* results) const override;
+
+  using Database::ScanEntries;
   std::unique_ptr<Database::Iterator> ScanEntries(
       int64_t start_index) const override;
 
@@ -50,6 +100,8 @@ class LevelDB : public Database {
 
   int64_t TreeSize() const override;
 
+  std::vector<std::pair<int64_t, int64_t>> SparseRanges() const override;
+
   void AddNotifySTHCallback(
       const Database::NotifySTHCallback* callback) override;
 
@@ -60,33 +112,156 @@ class LevelDB : public Database {
 
   Database::LookupResult NodeId(std::string* node_id) override;
 
+  Database::WriteResult WriteTile_(int level, int64_t index,
+                                   const std::string& hashes) override;
+
+  Database::LookupResult LookupTile(int level, int64_t index,
+                                    std::string* hashes) const override;
+
+  Database::WriteResult WriteFrontier_(int64_t tree_size,
+                                       const std::string& hashes) override;
+
+  Database::LookupResult LookupFrontier(int64_t tree_size,
+                                        std::string* hashes) const override;
+
+  // Archives the ranges of --leveldb_archive_range_size entries that are
+  // complete, and followed by at least --leveldb_archive_keep_entries
+  // entries. This is done every --leveldb_archive_interval_secs, but
+  // can be called at any time.
+  // REQUIRES: --leveldb_archive_dir was set when opening the database.
+  util::Status ArchiveEntries();
+
+  // Writes a copy of the database as of now to the new directory
+  // |path|, which can be opened as a LevelDB by a new node, so that it
+  // only has to fetch the entries logged since. Everything is copied
+  // but the node ID. The archives are hard linked into |path|/archive,
+  // which must then be the new node's --leveldb_archive_dir, so
+  // --leveldb_snapshot_dir must be on the same filesystem as
+  // --leveldb_archive_dir. |path| only appears once it is complete.
+  util::Status WriteSnapshot(const std::string& path);
+
+ protected:
+  std::unique_ptr<Database::Iterator> ScanEntries_(
+      int64_t start_index, int64_t end_index, bool fill_cache) const override;
+
  private:
   class Iterator;
 
-  void BuildIndex();
+  void Open(const std::string& dbfile, leveldb::Cache* block_cache,
+            int max_open_files);
+  // Reads the version of the key schema, and upgrades it if asked to,
+  // or writes it if the database is new.
+  void LoadKeySchema();
+  // Rewrites the hex entry keys in binary.
+  void UpgradeKeySchema();
+  // Writes the hash keys of a database written before they existed.
+  void IndexHashes();
+  // Opens the archives, and removes from leveldb the entries that a
+  // crash left there after archiving them.
+  void LoadArchives();
+  // Finds the contiguous and sparse entries, and the latest tree head.
+  void LoadIndex();
+  // Returns the archive of |sequence_number|, or nullptr if it is not
+  // archived. The NoLock version must be called with lock_ held.
+  const EntryArchive* FindArchive(int64_t sequence_number) const;
+  const EntryArchive* FindArchiveNoLock(int64_t sequence_number) const;
+  // Reads the stored entry |sequence_number| from |archive|.
+  std::string ReadArchivedEntry(const EntryArchive& archive,
+                                int64_t sequence_number) const;
+  // Reads the stored entry |sequence_number| from wherever it is, with
+  // |options| for leveldb, returning false if there is none.
+  bool ReadStoredEntry(const leveldb::ReadOptions& options,
+                       int64_t sequence_number, std::string* data) const;
+  // Removes the entries [start, end) from leveldb once they are
+  // archived.
+  void DeleteArchivedEntries(int64_t start, int64_t end);
+  // Returns what to store for |logged|, which serializes to |data|.
+  std::string EncodeEntry(const LoggedEntry& logged,
+                          const std::string& data) const;
+  // Returns the serialized entry stored as |data|, without its chain if
+  // it is kept apart.
+  std::string DecompressEntry(const leveldb::Slice& data) const;
+  // Parses the entry stored as |data|, with its chain.
+  void ParseEntry(const leveldb::Slice& data, LoggedEntry* entry) const;
+  // Exports the internal stats of leveldb as metrics, every
+  // --leveldb_stats_interval_secs.
+  void ExportStats();
+  // Calls ArchiveEntries() every --leveldb_archive_interval_secs.
+  void ArchivePeriodically();
+  // Writes a snapshot every --leveldb_snapshot_interval_secs, and
+  // removes the older ones.
+  void SnapshotPeriodically();
+  std::vector<Database::WriteResult> WriteEntries(
+      const std::vector<const LoggedEntry*>& entries);
   Database::LookupResult LatestTreeHeadNoLock(
       ct::SignedTreeHead* result) const;
-  void InsertEntryMapping(int64_t sequence_number, const std::string& hash);
+  // Reads the tree head stored under |timestamp_key|, without holding
+  // lock_.
+  Database::LookupResult ReadTreeHead(uint64_t timestamp,
+                                      const std::string& timestamp_key,
+                                      ct::SignedTreeHead* result) const;
+  void InsertEntryMapping(int64_t sequence_number);
 
-  mutable std::mutex lock_;
+  // Lookups only hold this shared, to read the in-memory state below,
+  // and read from leveldb (which is thread-safe) without it.
+  mutable ReadWriteMutex lock_;
 #ifdef HAVE_LEVELDB_FILTER_POLICY_H
   // filter_policy_ must be valid for at least as long as db_ is, so
   // keep this order.
   const std::unique_ptr<const leveldb::FilterPolicy> filter_policy_;
 #endif
+  // Same as for filter_policy_. Null for a frozen shard, which uses a
+  // shared one.
+  const std::unique_ptr<leveldb::Cache> block_cache_;
   std::unique_ptr<leveldb::DB> db_;
 
+  const bool compress_entries_;
+  EntryCompressor compressor_;
+  const bool deduplicate_chains_;
+  std::unique_ptr<ChainCertStore> chain_certs_;
+
   int64_t contiguous_size_;
-  std::unordered_map<std::string, int64_t> id_by_hash_;
 
   // This is a mapping of the non-contiguous entries of the log (which
   // can happen while it is being fetched). When entries here become
   // contiguous with the beginning of the tree, they are removed.
   std::set<int64_t> sparse_entries_;
 
+  // The entries that WriteEntries() calls are writing without holding
+  // lock_, by sequence number, pointing to their serialized data.
+  std::map<int64_t, const std::string*> pending_entries_;
+  // The hashes whose keys they are writing.
+  std::set<std::string> pending_hashes_;
+
+  const std::string archive_dir_;
+  const int64_t archive_range_size_;
+  const int64_t archive_keep_entries_;
+  // Only one ArchiveEntries() call at a time.
+  std::mutex archive_lock_;
+  // The archives, in order, of the entries below archived_size_, which
+  // are not in leveldb anymore. Archives are only ever added.
+  std::vector<std::unique_ptr<EntryArchive>> archives_;
+  int64_t archived_size_;
+
+  const std::string snapshot_dir_;
+  const bool frozen_;
+  // Whether the entry keys are binary, rather than hex. Set in Open().
+  bool binary_keys_;
+
   uint64_t latest_tree_timestamp_;
   std::string latest_timestamp_key_;
   cert_trans::DatabaseNotifierHelper callbacks_;
+
+  // Also wake the archive and snapshot threads up when stopping.
+  std::mutex stats_lock_;
+  std::condition_variable stats_cv_;
+  bool stopping_;
+  std::thread stats_thread_;
+  std::thread archive_thread_;
+  std::thread snapshot_thread_;
+
+  // Set once open, and gone before the rest.
+  std::unique_ptr<MemoryEstimate> memory_estimate_;
 };
 
 
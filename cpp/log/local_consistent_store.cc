@@ -0,0 +1,513 @@
+#include "log/local_consistent_store.h"
+
+#include <glog/logging.h>
+
+#include "monitoring/monitoring.h"
+#include "util/executor.h"
+#include "util/masterelection.h"
+#include "util/util.h"
+
+using ct::ClusterConfig;
+using ct::ClusterNodeState;
+using ct::SequenceMapping;
+using ct::SignedTreeHead;
+using std::bind;
+using std::function;
+using std::lock_guard;
+using std::move;
+using std::mutex;
+using std::pair;
+using std::string;
+using std::unique_lock;
+using std::vector;
+using util::Status;
+using util::StatusOr;
+using util::Task;
+
+namespace cert_trans {
+namespace {
+
+// The keys of the handles, which only matter to the watchers, to tell
+// the pending entries apart.
+const char kServingSthKey[] = "serving_sth";
+const char kClusterConfigKey[] = "cluster_config";
+const char kSequenceMappingKey[] = "sequence_mapping";
+const char kNodesKey[] = "nodes/";
+
+
+static Gauge<string>* local_consistent_store_entries =
+    Gauge<string>::New("local_consistent_store_entries", "type",
+                       "Number of entries in the local consistent store of "
+                       "a stand-alone server, by type.");
+
+static Counter<string>* local_consistent_store_rejected_requests =
+    Counter<string>::New("local_consistent_store_rejected_requests", "type",
+                         "Number of requests rejected by the local "
+                         "consistent store due to overload, by type.");
+
+
+// As in TreeSigner: the contents, the key and the map node.
+size_t EntryBytes(const LoggedEntry& entry) {
+  return entry.contents().ByteSize() + 2 * entry.Hash().size() + 128;
+}
+
+
+// Removes the watch of |task| from |watches|, and returns whether it
+// was there.
+template <class CB>
+bool RemoveWatch(Task* task, vector<pair<CB, Task*>>* watches) {
+  for (auto it(watches->begin()); it != watches->end(); ++it) {
+    if (it->second == task) {
+      watches->erase(it);
+      return true;
+    }
+  }
+  return false;
+}
+
+
+}  // namespace
+
+
+LocalConsistentStore::LocalConsistentStore(const MasterElection* election,
+                                           const string& node_id)
+    : election_(CHECK_NOTNULL(election)),
+      node_id_(node_id),
+      index_(1),
+      pending_bytes_(0),
+      memory_("local_consistent_store", [this]() {
+        lock_guard<mutex> lock(lock_);
+        return pending_bytes_;
+      }) {
+  // Nothing is sequenced yet, but the mapping is there to be updated.
+  sequence_mapping_.SetKey(kSequenceMappingKey);
+  sequence_mapping_.SetHandle(index_);
+}
+
+
+LocalConsistentStore::~LocalConsistentStore() {
+  lock_guard<mutex> lock(lock_);
+  CHECK(sth_watches_.empty());
+  CHECK(node_state_watches_.empty());
+  CHECK(cluster_config_watches_.empty());
+  CHECK(pending_watches_.empty());
+}
+
+
+StatusOr<int64_t> LocalConsistentStore::NextAvailableSequenceNumber() const {
+  lock_guard<mutex> lock(lock_);
+  const SequenceMapping& mapping(sequence_mapping_.Entry());
+  if (mapping.mapping_size() > 0) {
+    return mapping.mapping(mapping.mapping_size() - 1).sequence_number() + 1;
+  }
+
+  if (!serving_sth_) {
+    LOG(WARNING) << "Log has no Serving STH [new log?], returning 0";
+    return 0;
+  }
+
+  return serving_sth_->Entry().tree_size();
+}
+
+
+Status LocalConsistentStore::SetServingSTH(const SignedTreeHead& new_sth) {
+  unique_lock<mutex> lock(lock_);
+  if (serving_sth_) {
+    if (serving_sth_->Entry().timestamp() >= new_sth.timestamp()) {
+      return Status(util::error::OUT_OF_RANGE,
+                    "Tree head is not newer than existing head");
+    }
+    // Ensure that nothing weird is going on with the tree size:
+    CHECK_LE(serving_sth_->Entry().tree_size(), new_sth.tree_size());
+  } else {
+    LOG(WARNING) << "Creating new serving STH";
+    serving_sth_.reset(new EntryHandle<SignedTreeHead>);
+    serving_sth_->SetKey(kServingSthKey);
+  }
+
+  *serving_sth_->MutableEntry() = new_sth;
+  serving_sth_->SetHandle(++index_);
+  const Update<SignedTreeHead> update(*serving_sth_, true /* exists */);
+  for (const auto& watch : sth_watches_) {
+    ScheduleWatchCallback(lock, watch.second, bind(watch.first, update));
+  }
+  return ::util::OkStatus();
+}
+
+
+StatusOr<SignedTreeHead> LocalConsistentStore::GetServingSTH() const {
+  lock_guard<mutex> lock(lock_);
+  if (!serving_sth_) {
+    return Status(util::error::NOT_FOUND, "No current Serving STH.");
+  }
+  return serving_sth_->Entry();
+}
+
+
+Status LocalConsistentStore::AddPendingEntry(LoggedEntry* entry) {
+  unique_lock<mutex> lock(lock_);
+  vector<Update<LoggedEntry>> updates;
+  const Status status(AddPendingEntryLocked(lock, entry, &updates));
+  NotifyPendingEntries(lock, updates);
+  UpdateSizesLocked(lock);
+  return status;
+}
+
+
+void LocalConsistentStore::AddPendingEntryAsync(LoggedEntry* entry,
+                                                Task* task) {
+  task->Return(AddPendingEntry(entry));
+}
+
+
+void LocalConsistentStore::AddPendingEntries(
+    const vector<LoggedEntry*>& entries, vector<Status>* statuses) {
+  CHECK_NOTNULL(statuses)->clear();
+  unique_lock<mutex> lock(lock_);
+  vector<Update<LoggedEntry>> updates;
+  for (LoggedEntry* const entry : entries) {
+    statuses->emplace_back(AddPendingEntryLocked(lock, entry, &updates));
+  }
+  NotifyPendingEntries(lock, updates);
+  UpdateSizesLocked(lock);
+}
+
+
+Status LocalConsistentStore::AddPendingEntryLocked(
+    const unique_lock<mutex>& lock, LoggedEntry* entry,
+    vector<Update<LoggedEntry>>* updates) {
+  CHECK(lock.owns_lock());
+  CHECK_NOTNULL(entry);
+  CHECK(!entry->has_sequence_number());
+
+  const string hash(entry->Hash());
+  const auto existing(pending_.find(hash));
+  if (existing != pending_.end()) {
+    // Check the leaf certs are the same (we might be seeing the same cert
+    // submitted with a different chain.)
+    CHECK(LeafEntriesMatch(existing->second.Entry(), *entry));
+    *entry->mutable_sct() = existing->second.Entry().sct();
+    return Status(util::error::ALREADY_EXISTS,
+                  "Pending entry already exists.");
+  }
+
+  const Status status(MaybeRejectLocked(lock));
+  if (!status.ok()) {
+    return status;
+  }
+
+  EntryHandle<LoggedEntry>* const handle(&pending_[hash]);
+  handle->SetKey(util::HexString(hash));
+  *handle->MutableEntry() = *entry;
+  handle->SetHandle(++index_);
+  pending_bytes_ += EntryBytes(*entry);
+  if (!pending_watches_.empty()) {
+    updates->emplace_back(*handle, true /* exists */);
+  }
+  return ::util::OkStatus();
+}
+
+
+Status LocalConsistentStore::MaybeRejectLocked(
+    const unique_lock<mutex>& lock) {
+  CHECK(lock.owns_lock());
+  if (cluster_config_ &&
+      static_cast<int64_t>(pending_.size()) >=
+          cluster_config_->Entry().etcd_reject_add_pending_threshold()) {
+    local_consistent_store_rejected_requests->Increment("add_pending_entry");
+    return Status(util::error::RESOURCE_EXHAUSTED,
+                  "Rejected due to high number of pending entries.");
+  }
+  return ::util::OkStatus();
+}
+
+
+Status LocalConsistentStore::GetPendingEntryForHash(
+    const string& hash, EntryHandle<LoggedEntry>* entry) const {
+  lock_guard<mutex> lock(lock_);
+  const auto it(pending_.find(hash));
+  if (it == pending_.end()) {
+    return Status(util::error::NOT_FOUND, "Pending entry not found.");
+  }
+  *CHECK_NOTNULL(entry) = it->second;
+  return ::util::OkStatus();
+}
+
+
+Status LocalConsistentStore::GetPendingEntries(
+    vector<EntryHandle<LoggedEntry>>* entries) const {
+  CHECK_NOTNULL(entries);
+  CHECK(entries->empty());
+  lock_guard<mutex> lock(lock_);
+  entries->reserve(pending_.size());
+  for (const auto& pending : pending_) {
+    entries->push_back(pending.second);
+  }
+  return ::util::OkStatus();
+}
+
+
+Status LocalConsistentStore::GetSequenceMapping(
+    EntryHandle<SequenceMapping>* entry) const {
+  lock_guard<mutex> lock(lock_);
+  *CHECK_NOTNULL(entry) = sequence_mapping_;
+  return ::util::OkStatus();
+}
+
+
+Status LocalConsistentStore::UpdateSequenceMapping(
+    EntryHandle<SequenceMapping>* entry) {
+  CHECK_NOTNULL(entry);
+  CHECK(entry->HasHandle());
+  const SequenceMapping& mapping(entry->Entry());
+  for (int i = 1; i < mapping.mapping_size(); ++i) {
+    CHECK_LT(mapping.mapping(i - 1).sequence_number(),
+             mapping.mapping(i).sequence_number());
+  }
+
+  unique_lock<mutex> lock(lock_);
+  if (entry->Handle() != sequence_mapping_.Handle()) {
+    return Status(util::error::FAILED_PRECONDITION,
+                  "Sequence mapping was updated since it was read.");
+  }
+  if (serving_sth_ && mapping.mapping_size() > 0) {
+    // The mapping must not have a gap between its lowest mapping and the
+    // serving tree.
+    CHECK_LE(mapping.mapping(0).sequence_number(),
+             static_cast<int64_t>(serving_sth_->Entry().tree_size()));
+  }
+  *sequence_mapping_.MutableEntry() = mapping;
+  sequence_mapping_.SetHandle(++index_);
+  entry->SetHandle(index_);
+  UpdateSizesLocked(lock);
+  return ::util::OkStatus();
+}
+
+
+StatusOr<ClusterNodeState> LocalConsistentStore::GetClusterNodeState() const {
+  lock_guard<mutex> lock(lock_);
+  if (!node_state_) {
+    return Status(util::error::NOT_FOUND, "No cluster node state.");
+  }
+  return node_state_->Entry();
+}
+
+
+Status LocalConsistentStore::SetClusterNodeState(
+    const ClusterNodeState& state) {
+  unique_lock<mutex> lock(lock_);
+  if (!node_state_) {
+    node_state_.reset(new EntryHandle<ClusterNodeState>);
+    node_state_->SetKey(kNodesKey + node_id_);
+  }
+  *node_state_->MutableEntry() = state;
+  node_state_->MutableEntry()->set_node_id(node_id_);
+  node_state_->SetHandle(++index_);
+  const vector<Update<ClusterNodeState>> updates{
+      Update<ClusterNodeState>(*node_state_, true /* exists */)};
+  for (const auto& watch : node_state_watches_) {
+    ScheduleWatchCallback(lock, watch.second, bind(watch.first, updates));
+  }
+  return ::util::OkStatus();
+}
+
+
+void LocalConsistentStore::WatchServingSTH(const ServingSTHCallback& cb,
+                                           Task* task) {
+  unique_lock<mutex> lock(lock_);
+  EntryHandle<SignedTreeHead> handle;
+  if (serving_sth_) {
+    handle = *serving_sth_;
+  } else {
+    handle.SetKey(kServingSthKey);
+  }
+  ScheduleWatchCallback(lock, task,
+                        bind(cb, Update<SignedTreeHead>(
+                                     handle, serving_sth_ != nullptr)));
+  sth_watches_.emplace_back(cb, task);
+  task->WhenCancelled(bind(&LocalConsistentStore::CancelWatch, this, task));
+}
+
+
+void LocalConsistentStore::WatchClusterNodeStates(
+    const ClusterNodeStateCallback& cb, Task* task) {
+  unique_lock<mutex> lock(lock_);
+  vector<Update<ClusterNodeState>> initial;
+  if (node_state_) {
+    initial.emplace_back(*node_state_, true /* exists */);
+  }
+  ScheduleWatchCallback(lock, task, bind(cb, move(initial)));
+  node_state_watches_.emplace_back(cb, task);
+  task->WhenCancelled(bind(&LocalConsistentStore::CancelWatch, this, task));
+}
+
+
+void LocalConsistentStore::WatchClusterConfig(const ClusterConfigCallback& cb,
+                                              Task* task) {
+  unique_lock<mutex> lock(lock_);
+  EntryHandle<ClusterConfig> handle;
+  if (cluster_config_) {
+    handle = *cluster_config_;
+  } else {
+    handle.SetKey(kClusterConfigKey);
+  }
+  ScheduleWatchCallback(lock, task,
+                        bind(cb, Update<ClusterConfig>(
+                                     handle, cluster_config_ != nullptr)));
+  cluster_config_watches_.emplace_back(cb, task);
+  task->WhenCancelled(bind(&LocalConsistentStore::CancelWatch, this, task));
+}
+
+
+void LocalConsistentStore::WatchPendingEntries(
+    const PendingEntriesCallback& cb, Task* task) {
+  unique_lock<mutex> lock(lock_);
+  vector<Update<LoggedEntry>> initial;
+  initial.reserve(pending_.size());
+  for (const auto& pending : pending_) {
+    initial.emplace_back(pending.second, true /* exists */);
+  }
+  ScheduleWatchCallback(lock, task, bind(cb, move(initial)));
+  pending_watches_.emplace_back(cb, task);
+  task->WhenCancelled(bind(&LocalConsistentStore::CancelWatch, this, task));
+}
+
+
+Status LocalConsistentStore::SetClusterConfig(const ClusterConfig& config) {
+  unique_lock<mutex> lock(lock_);
+  if (!cluster_config_) {
+    cluster_config_.reset(new EntryHandle<ClusterConfig>);
+    cluster_config_->SetKey(kClusterConfigKey);
+  }
+  *cluster_config_->MutableEntry() = config;
+  cluster_config_->SetHandle(++index_);
+  const Update<ClusterConfig> update(*cluster_config_, true /* exists */);
+  for (const auto& watch : cluster_config_watches_) {
+    ScheduleWatchCallback(lock, watch.second, bind(watch.first, update));
+  }
+  return ::util::OkStatus();
+}
+
+
+StatusOr<int64_t> LocalConsistentStore::CleanupOldEntries() {
+  if (!election_->IsMaster()) {
+    return Status(util::error::PERMISSION_DENIED,
+                  "Non-master node cannot run cleanups.");
+  }
+
+  unique_lock<mutex> lock(lock_);
+  if (!serving_sth_) {
+    LOG(INFO) << "No current serving_sth, nothing to do.";
+    return 0;
+  }
+  const int64_t tree_size(serving_sth_->Entry().tree_size());
+
+  // The mapping itself is left alone: the sequencer drops the mappings
+  // of the entries which are gone.
+  int64_t num_entries_cleaned(0);
+  vector<Update<LoggedEntry>> updates;
+  for (const auto& m : sequence_mapping_.Entry().mapping()) {
+    if (m.sequence_number() >= tree_size) {
+      break;
+    }
+    const auto it(pending_.find(m.entry_hash()));
+    if (it == pending_.end()) {
+      continue;
+    }
+    pending_bytes_ -= EntryBytes(it->second.Entry());
+    if (!pending_watches_.empty()) {
+      // As with etcd, the update of a removed entry only has its key.
+      EntryHandle<LoggedEntry> removed;
+      removed.SetKey(it->second.Key());
+      updates.emplace_back(removed, false /* exists */);
+    }
+    pending_.erase(it);
+    ++num_entries_cleaned;
+  }
+  NotifyPendingEntries(lock, updates);
+  UpdateSizesLocked(lock);
+  return num_entries_cleaned;
+}
+
+
+void LocalConsistentStore::UpdateSizesLocked(const unique_lock<mutex>& lock) {
+  CHECK(lock.owns_lock());
+  local_consistent_store_entries->Set("pending", pending_.size());
+  local_consistent_store_entries->Set(
+      "sequenced", sequence_mapping_.Entry().mapping_size());
+}
+
+
+void LocalConsistentStore::NotifyPendingEntries(
+    const unique_lock<mutex>& lock,
+    const vector<Update<LoggedEntry>>& updates) {
+  CHECK(lock.owns_lock());
+  if (updates.empty()) {
+    return;
+  }
+  for (const auto& watch : pending_watches_) {
+    ScheduleWatchCallback(lock, watch.second, bind(watch.first, updates));
+  }
+}
+
+
+void LocalConsistentStore::ScheduleWatchCallback(
+    const unique_lock<mutex>& lock, Task* task,
+    const function<void()>& callback) {
+  CHECK(lock.owns_lock());
+  const bool already_running(!callbacks_.empty());
+
+  task->AddHold();
+  callbacks_.emplace_back(task, callback);
+
+  if (!already_running) {
+    callbacks_.front().first->executor()->Add(
+        bind(&LocalConsistentStore::RunWatchCallback, this));
+  }
+}
+
+
+void LocalConsistentStore::RunWatchCallback() {
+  Task* current(nullptr);
+  Task* next(nullptr);
+  function<void()> callback;
+
+  {
+    lock_guard<mutex> lock(lock_);
+    CHECK(!callbacks_.empty());
+    current = callbacks_.front().first;
+    callback = move(callbacks_.front().second);
+    // Stays queued while running, so that ScheduleWatchCallback() does
+    // not start another run meanwhile.
+  }
+
+  callback();
+  current->RemoveHold();
+
+  {
+    lock_guard<mutex> lock(lock_);
+    callbacks_.pop_front();
+    if (!callbacks_.empty()) {
+      next = callbacks_.front().first;
+    }
+  }
+
+  if (next) {
+    next->executor()->Add(bind(&LocalConsistentStore::RunWatchCallback, this));
+  }
+}
+
+
+void LocalConsistentStore::CancelWatch(Task* task) {
+  lock_guard<mutex> lock(lock_);
+  CHECK(RemoveWatch(task, &sth_watches_) ||
+        RemoveWatch(task, &node_state_watches_) ||
+        RemoveWatch(task, &cluster_config_watches_) ||
+        RemoveWatch(task, &pending_watches_));
+  // The queued callbacks have a hold on |task|, so they still run before
+  // it is done, but there are no new ones.
+  task->Return(Status::CANCELLED);
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,155 @@
+#ifndef CERT_TRANS_LOG_LOCAL_CONSISTENT_STORE_H_
+#define CERT_TRANS_LOG_LOCAL_CONSISTENT_STORE_H_
+
+#include <stdint.h>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "log/consistent_store.h"
+#include "log/logged_entry.h"
+#include "monitoring/memory.h"
+#include "proto/ct.pb.h"
+#include "util/status.h"
+#include "util/statusor.h"
+#include "util/task.h"
+
+namespace cert_trans {
+
+class MasterElection;
+
+
+// A ConsistentStore for a log served by a single node (stand-alone
+// mode), which keeps the cluster state in memory rather than in etcd.
+// Unlike an EtcdConsistentStore over a FakeEtcdClient, nothing goes
+// through a key/value layer: the entries are kept as they are instead
+// of serialized, a pending entry is looked up by its hash, and the
+// watchers get the changes as they are made.
+//
+// As with a FakeEtcdClient, the state lives and dies with the process:
+// the entries pending when it exits are lost, and the tree is picked up
+// from the local database again.
+//
+// The watch callbacks are run one at a time, in the order of the
+// changes, on the executors of their tasks.
+//
+// This class is thread-safe.
+class LocalConsistentStore : public ConsistentStore {
+ public:
+  // Does not take ownership of |election|, which must outlive this
+  // instance.
+  LocalConsistentStore(const MasterElection* election,
+                       const std::string& node_id);
+  // The watches must have been cancelled.
+  ~LocalConsistentStore() override;
+
+  util::StatusOr<int64_t> NextAvailableSequenceNumber() const override;
+
+  util::Status SetServingSTH(const ct::SignedTreeHead& new_sth) override;
+
+  util::StatusOr<ct::SignedTreeHead> GetServingSTH() const override;
+
+  util::Status AddPendingEntry(LoggedEntry* entry) override;
+
+  // Adds |entry| straight away, there being nothing to wait for.
+  void AddPendingEntryAsync(LoggedEntry* entry, util::Task* task) override;
+
+  void AddPendingEntries(const std::vector<LoggedEntry*>& entries,
+                         std::vector<util::Status>* statuses) override;
+
+  util::Status GetPendingEntryForHash(
+      const std::string& hash, EntryHandle<LoggedEntry>* entry) const override;
+
+  util::Status GetPendingEntries(
+      std::vector<EntryHandle<LoggedEntry>>* entries) const override;
+
+  util::Status GetSequenceMapping(
+      EntryHandle<ct::SequenceMapping>* entry) const override;
+
+  util::Status UpdateSequenceMapping(
+      EntryHandle<ct::SequenceMapping>* entry) override;
+
+  util::StatusOr<ct::ClusterNodeState> GetClusterNodeState() const override;
+
+  util::Status SetClusterNodeState(const ct::ClusterNodeState& state) override;
+
+  void WatchServingSTH(const ConsistentStore::ServingSTHCallback& cb,
+                       util::Task* task) override;
+
+  void WatchClusterNodeStates(
+      const ConsistentStore::ClusterNodeStateCallback& cb,
+      util::Task* task) override;
+
+  void WatchClusterConfig(const ConsistentStore::ClusterConfigCallback& cb,
+                          util::Task* task) override;
+
+  void WatchPendingEntries(const ConsistentStore::PendingEntriesCallback& cb,
+                           util::Task* task) override;
+
+  util::Status SetClusterConfig(const ct::ClusterConfig& config) override;
+
+  // Removes the pending entries covered by the current serving STH.
+  util::StatusOr<int64_t> CleanupOldEntries() override;
+
+ private:
+  // Adds |entry| unless it is already pending, in which case its SCT is
+  // set to that of the pending one. Appends the update for the watchers
+  // to |updates|.
+  util::Status AddPendingEntryLocked(
+      const std::unique_lock<std::mutex>& lock, LoggedEntry* entry,
+      std::vector<Update<LoggedEntry>>* updates);
+  // Returns RESOURCE_EXHAUSTED once there are as many pending entries as
+  // ClusterConfig::etcd_reject_add_pending_threshold.
+  util::Status MaybeRejectLocked(const std::unique_lock<std::mutex>& lock);
+  // Sets the gauges and the memory estimate after a change to the
+  // pending entries or the sequence mapping.
+  void UpdateSizesLocked(const std::unique_lock<std::mutex>& lock);
+
+  // Calls the pending entries watchers with |updates|, if any.
+  void NotifyPendingEntries(const std::unique_lock<std::mutex>& lock,
+                            const std::vector<Update<LoggedEntry>>& updates);
+
+  // As in FakeEtcdClient, queues |callback| to be run on the executor of
+  // |task|, after those queued before.
+  void ScheduleWatchCallback(const std::unique_lock<std::mutex>& lock,
+                             util::Task* task,
+                             const std::function<void()>& callback);
+  void RunWatchCallback();
+  void CancelWatch(util::Task* task);
+
+  const MasterElection* const election_;
+  const std::string node_id_;
+
+  mutable std::mutex lock_;
+  // Incremented by each change, and used as the handle of what changed.
+  int index_;
+  std::unique_ptr<EntryHandle<ct::SignedTreeHead>> serving_sth_;
+  std::unique_ptr<EntryHandle<ct::ClusterConfig>> cluster_config_;
+  std::unique_ptr<EntryHandle<ct::ClusterNodeState>> node_state_;
+  EntryHandle<ct::SequenceMapping> sequence_mapping_;
+  // By entry hash.
+  std::unordered_map<std::string, EntryHandle<LoggedEntry>> pending_;
+  size_t pending_bytes_;
+
+  std::vector<std::pair<ServingSTHCallback, util::Task*>> sth_watches_;
+  std::vector<std::pair<ClusterNodeStateCallback, util::Task*>>
+      node_state_watches_;
+  std::vector<std::pair<ClusterConfigCallback, util::Task*>>
+      cluster_config_watches_;
+  std::vector<std::pair<PendingEntriesCallback, util::Task*>>
+      pending_watches_;
+  std::deque<std::pair<util::Task*, std::function<void()>>> callbacks_;
+
+  const MemoryEstimate memory_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_LOCAL_CONSISTENT_STORE_H_
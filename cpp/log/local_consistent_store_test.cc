@@ -0,0 +1,240 @@
+#include "log/local_consistent_store.h"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "base/notification.h"
+#include "log/logged_entry.h"
+#include "proto/ct.pb.h"
+#include "util/mock_masterelection.h"
+#include "util/status_test_util.h"
+#include "util/sync_task.h"
+#include "util/testing.h"
+#include "util/thread_pool.h"
+
+namespace cert_trans {
+namespace {
+
+using ct::SequenceMapping;
+using ct::SignedTreeHead;
+using std::chrono::milliseconds;
+using std::lock_guard;
+using std::mutex;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+using testing::Return;
+using util::SyncTask;
+using util::testing::StatusIs;
+
+
+const char kNodeId[] = "node_id";
+const int kTimestamp = 9000;
+
+
+class LocalConsistentStoreTest : public ::testing::Test {
+ protected:
+  LocalConsistentStoreTest()
+      : executor_(2), store_(new LocalConsistentStore(&election_, kNodeId)) {
+  }
+
+  LoggedEntry MakeCert(int timestamp, const string& body) {
+    LoggedEntry cert;
+    cert.mutable_sct()->set_timestamp(timestamp);
+    cert.mutable_entry()->set_type(ct::X509_ENTRY);
+    cert.mutable_entry()->mutable_x509_entry()->set_leaf_certificate(body);
+    return cert;
+  }
+
+  // Maps |cert| to |seq| in the sequence mapping.
+  void AddSequenceMapping(int64_t seq, const LoggedEntry& cert) {
+    EntryHandle<SequenceMapping> mapping;
+    ASSERT_OK(store_->GetSequenceMapping(&mapping));
+    SequenceMapping::Mapping* m(mapping.MutableEntry()->add_mapping());
+    m->set_entry_hash(cert.Hash());
+    m->set_sequence_number(seq);
+    ASSERT_OK(store_->UpdateSequenceMapping(&mapping));
+  }
+
+  void SetServingSTH(int64_t timestamp, int64_t tree_size) {
+    SignedTreeHead sth;
+    sth.set_timestamp(timestamp);
+    sth.set_tree_size(tree_size);
+    ASSERT_OK(store_->SetServingSTH(sth));
+  }
+
+  ThreadPool executor_;
+  MockMasterElection election_;
+  unique_ptr<LocalConsistentStore> store_;
+};
+
+
+TEST_F(LocalConsistentStoreTest, AddPendingEntry) {
+  LoggedEntry cert(MakeCert(kTimestamp, "leaf"));
+  EXPECT_OK(store_->AddPendingEntry(&cert));
+
+  EntryHandle<LoggedEntry> entry;
+  ASSERT_OK(store_->GetPendingEntryForHash(cert.Hash(), &entry));
+  EXPECT_EQ(cert.DebugString(), entry.Entry().DebugString());
+  EXPECT_TRUE(entry.HasHandle());
+
+  // The same leaf again gets the SCT of the pending one.
+  LoggedEntry other(MakeCert(kTimestamp + 1, "leaf"));
+  EXPECT_THAT(store_->AddPendingEntry(&other),
+              StatusIs(util::error::ALREADY_EXISTS));
+  EXPECT_EQ(kTimestamp, other.sct().timestamp());
+
+  vector<EntryHandle<LoggedEntry>> entries;
+  EXPECT_OK(store_->GetPendingEntries(&entries));
+  EXPECT_EQ(1U, entries.size());
+
+  EXPECT_THAT(store_->GetPendingEntryForHash("nope", &entry),
+              StatusIs(util::error::NOT_FOUND));
+}
+
+
+TEST_F(LocalConsistentStoreTest, RejectsOverThreshold) {
+  ct::ClusterConfig config;
+  config.set_etcd_reject_add_pending_threshold(1);
+  ASSERT_OK(store_->SetClusterConfig(config));
+
+  LoggedEntry one(MakeCert(kTimestamp, "one"));
+  LoggedEntry two(MakeCert(kTimestamp, "two"));
+  vector<util::Status> statuses;
+  store_->AddPendingEntries({&one, &two}, &statuses);
+  ASSERT_EQ(2U, statuses.size());
+  EXPECT_OK(statuses[0]);
+  EXPECT_THAT(statuses[1], StatusIs(util::error::RESOURCE_EXHAUSTED));
+}
+
+
+TEST_F(LocalConsistentStoreTest, UpdateSequenceMapping) {
+  LoggedEntry cert(MakeCert(kTimestamp, "leaf"));
+  ASSERT_OK(store_->AddPendingEntry(&cert));
+  EXPECT_EQ(0, store_->NextAvailableSequenceNumber().ValueOrDie());
+
+  EntryHandle<SequenceMapping> stale;
+  ASSERT_OK(store_->GetSequenceMapping(&stale));
+  AddSequenceMapping(0, cert);
+  EXPECT_EQ(1, store_->NextAvailableSequenceNumber().ValueOrDie());
+
+  // Someone else updated it since |stale| was read.
+  stale.MutableEntry()->add_mapping()->set_sequence_number(5);
+  EXPECT_THAT(store_->UpdateSequenceMapping(&stale),
+              StatusIs(util::error::FAILED_PRECONDITION));
+
+  EntryHandle<SequenceMapping> mapping;
+  ASSERT_OK(store_->GetSequenceMapping(&mapping));
+  ASSERT_EQ(1, mapping.Entry().mapping_size());
+  EXPECT_EQ(cert.Hash(), mapping.Entry().mapping(0).entry_hash());
+}
+
+
+TEST_F(LocalConsistentStoreTest, SetServingSTH) {
+  EXPECT_THAT(store_->GetServingSTH().status(),
+              StatusIs(util::error::NOT_FOUND));
+  SetServingSTH(kTimestamp, 10);
+  EXPECT_EQ(10U, store_->GetServingSTH().ValueOrDie().tree_size());
+  EXPECT_EQ(10, store_->NextAvailableSequenceNumber().ValueOrDie());
+
+  SignedTreeHead older;
+  older.set_timestamp(kTimestamp);
+  older.set_tree_size(20);
+  EXPECT_THAT(store_->SetServingSTH(older),
+              StatusIs(util::error::OUT_OF_RANGE));
+}
+
+
+TEST_F(LocalConsistentStoreTest, CleanupOldEntries) {
+  LoggedEntry one(MakeCert(kTimestamp, "one"));
+  LoggedEntry two(MakeCert(kTimestamp, "two"));
+  LoggedEntry three(MakeCert(kTimestamp, "three"));
+  ASSERT_OK(store_->AddPendingEntry(&one));
+  ASSERT_OK(store_->AddPendingEntry(&two));
+  ASSERT_OK(store_->AddPendingEntry(&three));
+  AddSequenceMapping(0, one);
+  AddSequenceMapping(1, two);
+  SetServingSTH(kTimestamp, 1);
+
+  EXPECT_CALL(election_, IsMaster()).WillRepeatedly(Return(false));
+  EXPECT_THAT(store_->CleanupOldEntries().status(),
+              StatusIs(util::error::PERMISSION_DENIED));
+
+  EXPECT_CALL(election_, IsMaster()).WillRepeatedly(Return(true));
+  EXPECT_EQ(1, store_->CleanupOldEntries().ValueOrDie());
+
+  EntryHandle<LoggedEntry> entry;
+  EXPECT_THAT(store_->GetPendingEntryForHash(one.Hash(), &entry),
+              StatusIs(util::error::NOT_FOUND));
+  EXPECT_OK(store_->GetPendingEntryForHash(two.Hash(), &entry));
+  EXPECT_OK(store_->GetPendingEntryForHash(three.Hash(), &entry));
+}
+
+
+TEST_F(LocalConsistentStoreTest, WatchPendingEntries) {
+  LoggedEntry one(MakeCert(kTimestamp, "one"));
+  ASSERT_OK(store_->AddPendingEntry(&one));
+
+  mutex mutex;
+  int call_count(0);
+  Notification added;
+  Notification removed;
+  SyncTask task(&executor_);
+  store_->WatchPendingEntries(
+      [&](const vector<Update<LoggedEntry>>& updates) {
+        lock_guard<std::mutex> lock(mutex);
+        ASSERT_EQ(1U, updates.size());
+        switch (call_count++) {
+          case 0:
+            // The initial state.
+            EXPECT_TRUE(updates[0].exists_);
+            EXPECT_EQ(one.Hash(), updates[0].handle_.Entry().Hash());
+            break;
+          case 1:
+            EXPECT_TRUE(updates[0].exists_);
+            EXPECT_EQ("two", updates[0]
+                                 .handle_.Entry()
+                                 .entry()
+                                 .x509_entry()
+                                 .leaf_certificate());
+            added.Notify();
+            break;
+          case 2:
+            EXPECT_FALSE(updates[0].exists_);
+            removed.Notify();
+            break;
+          default:
+            ADD_FAILURE() << "Extra update";
+        }
+      },
+      task.task());
+
+  LoggedEntry two(MakeCert(kTimestamp, "two"));
+  ASSERT_OK(store_->AddPendingEntry(&two));
+  EXPECT_TRUE(added.WaitForNotificationWithTimeout(milliseconds(5000)));
+
+  AddSequenceMapping(0, one);
+  SetServingSTH(kTimestamp, 1);
+  EXPECT_CALL(election_, IsMaster()).WillRepeatedly(Return(true));
+  EXPECT_EQ(1, store_->CleanupOldEntries().ValueOrDie());
+  EXPECT_TRUE(removed.WaitForNotificationWithTimeout(milliseconds(5000)));
+
+  task.Cancel();
+  task.Wait();
+  EXPECT_THAT(task.status(), StatusIs(util::error::CANCELLED));
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
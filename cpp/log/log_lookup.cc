@@ -1,16 +1,22 @@
 #include "log/log_lookup.h"
 
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <stdint.h>
 #include <stdlib.h>
-#include <map>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
+#include "base/lock_contention.h"
 #include "base/time_support.h"
-#include "merkletree/merkle_tree.h"
 #include "merkletree/serial_hasher.h"
+#include "merkletree/tiled_merkle_tree.h"
+#include "monitoring/gauge.h"
 #include "proto/ct.pb.h"
 #include "proto/serializer.h"
 #include "util/util.h"
@@ -20,137 +26,449 @@ using ct::ShortMerkleAuditProof;
 using ct::SignedTreeHead;
 using std::bind;
 using std::lock_guard;
-using std::make_pair;
-using std::map;
+using std::make_shared;
 using std::mutex;
 using std::placeholders::_1;
+using std::placeholders::_2;
+using std::shared_ptr;
 using std::string;
 using std::unique_lock;
 using std::unique_ptr;
 using std::vector;
 using util::HexString;
 
+DEFINE_int32(log_lookup_proof_cache_size, 16384,
+             "Maximum number of audit paths and consistency proofs cached "
+             "by the log lookup. 0 disables the cache.");
+DEFINE_int32(log_lookup_dropped_tree_levels, 0,
+             "Number of levels at the bottom of the Merkle tree that the "
+             "log lookup does not keep in memory, each of which halves its "
+             "memory. The proofs that go through them read up to 2^N leaf "
+             "hashes back from the database. At most 8, so that these are "
+             "in a single tile.");
+
 namespace cert_trans {
 
 
 static const int kCtimeBufSize = 26;
 
+// Number of entries whose leaf hashes are computed together when
+// updating the tree.
+static const size_t kLeafHashBatchSize = 1024;
+
+// Number of recent STHs whose tree sizes are kept in the proof cache.
+static const size_t kCachedTreeSizes = 4;
+
+static LockContention* const log_lookup_update_contention(
+    LockContention::Get("log_lookup_update"));
+
+static Gauge<>* const log_lookup_leaves_to_load(
+    Gauge<>::New("log_lookup_leaves_to_load",
+                 "Number of leaves the log lookup still has to add to its "
+                 "tree to catch up with the latest STH (0 once it has)."));
+
+
+static size_t DroppedTreeLevels() {
+  CHECK_GE(FLAGS_log_lookup_dropped_tree_levels, 0);
+  CHECK_LE(FLAGS_log_lookup_dropped_tree_levels,
+           static_cast<int>(TiledMerkleTree::kTileHeight));
+  return FLAGS_log_lookup_dropped_tree_levels;
+}
+
+
+LogLookup::TreeState::TreeState(
+    util::Executor* executor, size_t dropped_levels,
+    const LevelCompressedMerkleTree::LeafHashReader& reader)
+    : tree(unique_ptr<Sha256Hasher>(new Sha256Hasher), dropped_levels,
+           reader) {
+  tree.SetExecutor(executor);
+}
+
 
-LogLookup::LogLookup(ReadOnlyDatabase* db)
+LogLookup::LogLookup(ReadOnlyDatabase* db, util::Executor* executor,
+                     const string& node_file, InitialLoad initial_load)
     : db_(CHECK_NOTNULL(db)),
-      cert_tree_(unique_ptr<Sha256Hasher>(new Sha256Hasher)),
-      latest_tree_head_(),
-      update_from_sth_cb_(bind(&LogLookup::UpdateFromSTH, this, _1)) {
-  db_->AddNotifySTHCallback(&update_from_sth_cb_);
+      leaf_hasher_(unique_ptr<Sha256Hasher>(new Sha256Hasher)),
+      snapshot_(make_shared<Snapshot>(
+          make_shared<TreeState>(executor, DroppedTreeLevels(),
+                                 bind(&LogLookup::ReadLeafHashes, this, _1,
+                                      _2)),
+          SignedTreeHead())),
+      standby_(make_shared<TreeState>(executor, DroppedTreeLevels(),
+                                      bind(&LogLookup::ReadLeafHashes, this,
+                                           _1, _2))),
+      proof_cache_(std::max(FLAGS_log_lookup_proof_cache_size, 0)),
+      update_from_sth_cb_(bind(&LogLookup::UpdateFromSTH, this, _1)),
+      standby_tree_bytes_(0),
+      standby_index_bytes_(0),
+      tree_memory_("log_lookup_tree", bind(&LogLookup::MemoryUsage, this,
+                                           false /* index */)),
+      index_memory_("log_lookup_index", bind(&LogLookup::MemoryUsage, this,
+                                             true /* index */)) {
+  if (!node_file.empty()) {
+    util::StatusOr<unique_ptr<MappedMerkleNodeFile>> mapped(
+        MappedMerkleNodeFile::Open(node_file, standby_->tree.NodeSize()));
+    if (mapped.ok()) {
+      node_file_ = std::move(mapped.ValueOrDie());
+    } else {
+      LOG(WARNING) << "Not using Merkle node file: " << mapped.status();
+    }
+  }
+  if (initial_load == LOAD_IN_BACKGROUND) {
+    loader_ = std::thread(&LogLookup::Load, this);
+  } else {
+    Load();
+  }
 }
 
 
 LogLookup::~LogLookup() {
+  if (loader_.joinable()) {
+    loader_.join();
+  }
   db_->RemoveNotifySTHCallback(&update_from_sth_cb_);
 }
 
 
+void LogLookup::Load() {
+  db_->AddNotifySTHCallback(&update_from_sth_cb_);
+  // The database has reported its latest STH by now, if it has one. The
+  // tree signer may truncate the node file from here on, so stop using it.
+  {
+    const lock_guard<mutex> lock(update_lock_);
+    node_file_.reset();
+  }
+  loaded_.Notify();
+  LOG(INFO) << "Log lookup loaded the tree of size "
+            << GetSnapshot()->sth.tree_size();
+}
+
+
+shared_ptr<const LogLookup::Snapshot> LogLookup::GetSnapshot() const {
+  return std::atomic_load(&snapshot_);
+}
+
+
 void LogLookup::UpdateFromSTH(const SignedTreeHead& sth) {
-  lock_guard<mutex> lock(lock_);
+  const unique_lock<mutex> lock(
+      ContendedLock(&update_lock_, log_lookup_update_contention));
 
   CHECK_EQ(ct::V1, sth.version())
       << "Tree head signed with an unknown version";
 
-  if (sth.timestamp() == latest_tree_head_.timestamp())
+  const shared_ptr<const Snapshot> current(GetSnapshot());
+  const SignedTreeHead& latest_tree_head(current->sth);
+  if (sth.timestamp() == latest_tree_head.timestamp())
     return;
 
   CHECK_LE(0, sth.tree_size());
-  if (sth.timestamp() <= latest_tree_head_.timestamp() ||
-      static_cast<uint64_t>(sth.tree_size()) < cert_tree_.LeafCount()) {
+  const LevelCompressedMerkleTree& current_tree(current->state->tree);
+  if (sth.timestamp() <= latest_tree_head.timestamp() ||
+      static_cast<uint64_t>(sth.tree_size()) < current_tree.LeafCount()) {
     LOG(WARNING) << "Database replied with an STH that is older than ours: "
-                 << "Our STH:\n" << latest_tree_head_.DebugString()
+                 << "Our STH:\n" << latest_tree_head.DebugString()
                  << "Database STH:\n" << sth.DebugString();
     return;
   }
 
-  // Record the new hashes: append all of them, die on any error.
-  // TODO(ekasper): make tree signer write leaves out to the database,
-  // so that we don't have to read the entries in.
-  string leaf_hash;
-  auto it(db_->ScanEntries(cert_tree_.LeafCount()));
+  WaitForStandby();
+  TreeState* const next(standby_.get());
+
+  // Catch up with the current snapshot, which only gets read from here.
+  // Its leaf hashes may have to be read back from the database, so take
+  // them in batches.
+  const size_t node_size(next->tree.NodeSize());
+  for (size_t leaf = next->tree.LeafCount();
+       leaf < current_tree.LeafCount();) {
+    const size_t count(
+        std::min(current_tree.LeafCount() - leaf, kLeafHashBatchSize));
+    const string hashes(current_tree.ReadLeafHashes(leaf, count));
+    for (size_t i = 0; i < count; ++i, ++leaf) {
+      AddLeafHash(next, leaf, hashes.substr(i * node_size, node_size));
+    }
+  }
+
+  // The node file only helps with the initial load; whatever it does
+  // not cover is read from the database below.
+  if (node_file_ && next->tree.LeafCount() == 0) {
+    LoadFromNodeFile(sth, next);
+  }
+
   // LeafCount() is potentially unsigned here but as this is using memory
   // the count can never get close to overflow in 64 bits.
-  CHECK_LE(cert_tree_.LeafCount(), static_cast<uint64_t>(INT64_MAX));
-
-  for (int64_t sequence_number = cert_tree_.LeafCount();
-       sequence_number < sth.tree_size(); ++sequence_number) {
-    LoggedEntry logged;
+  CHECK_LE(next->tree.LeafCount(), static_cast<uint64_t>(INT64_MAX));
+  log_lookup_leaves_to_load->Set(sth.tree_size() - next->tree.LeafCount());
+  AddPublishedLeafHashes(sth.tree_size(), next);
+  log_lookup_leaves_to_load->Set(sth.tree_size() - next->tree.LeafCount());
+
+  // Record the hashes of the remaining entries, if the tree signer has
+  // not published them (yet): append all of them, die on any error.
+  // Catching up with a large STH reads a lot of entries only once, so
+  // keep them out of the database cache, and parse them while the
+  // previous batch is being hashed.
+  ReadOnlyDatabase::ScanOptions scan_options;
+  if (sth.tree_size() - static_cast<int64_t>(next->tree.LeafCount()) >
+      static_cast<int64_t>(kLeafHashBatchSize)) {
+    scan_options.readahead = kLeafHashBatchSize;
+    scan_options.fill_cache = false;
+  }
+  auto it(db_->ScanEntries(next->tree.LeafCount(), sth.tree_size(),
+                           scan_options));
+
+  // Leaves are hashed in batches, which is much faster than hashing them
+  // one at a time when catching up with a large STH.
+  vector<LoggedEntry> entries;
+  vector<string> serialized_leaves;
+  for (int64_t batch_start = next->tree.LeafCount();
+       batch_start < sth.tree_size();
+       batch_start += entries.size()) {
+    const size_t batch_size(static_cast<size_t>(std::min<int64_t>(
+        sth.tree_size() - batch_start, kLeafHashBatchSize)));
     // TODO(ekasper): perhaps some of these errors can/should be
     // handled more gracefully. E.g. we could retry a failed update
     // a number of times -- but until we know under which conditions
     // the database might fail (database busy?), just die.
-    CHECK(it->GetNextEntry(&logged))
-        << "Latest STH has " << sth.tree_size() << "entries but we failed to "
-        << "retrieve entry number " << sequence_number;
-    CHECK(logged.has_sequence_number())
-        << "Logged entry has no sequence number";
-    CHECK_EQ(sequence_number, logged.sequence_number());
-
-    leaf_hash = LeafHash(logged);
-    // TODO(ekasper): plug in the log public key so that we can verify the STH.
-    CHECK_EQ(static_cast<size_t>(sequence_number + 1),
-             cert_tree_.AddLeafHash(leaf_hash));
-    // Duplicate leaves shouldn't really happen but are not a problem either:
-    // we just return the Merkle proof of the first occurrence.
-    leaf_index_.insert(make_pair(leaf_hash, sequence_number));
-  }
-  CHECK_EQ(HexString(cert_tree_.CurrentRoot()),
+    CHECK_EQ(batch_size, it->GetNextEntries(batch_size, &entries))
+        << "Latest STH has " << sth.tree_size() << "entries but we failed "
+        << "to retrieve entries from number " << batch_start;
+    // Only the entries stored without their leaf hash are hashed.
+    serialized_leaves.clear();
+    for (size_t i = 0; i < batch_size; ++i) {
+      const LoggedEntry& logged(entries[i]);
+      CHECK(logged.has_sequence_number())
+          << "Logged entry has no sequence number";
+      CHECK_EQ(batch_start + static_cast<int64_t>(i),
+               logged.sequence_number());
+      if (!logged.has_leaf_hash()) {
+        serialized_leaves.emplace_back();
+        CHECK(logged.SerializeForLeaf(&serialized_leaves.back()));
+      }
+    }
+
+    const vector<string> leaf_hashes(
+        next->tree.LeafHashes(serialized_leaves));
+    size_t next_hashed(0);
+    for (size_t i = 0; i < batch_size; ++i) {
+      // TODO(ekasper): plug in the log public key so that we can verify the
+      // STH.
+      AddLeafHash(next, batch_start + i,
+                  entries[i].has_leaf_hash() ? entries[i].leaf_hash()
+                                             : leaf_hashes[next_hashed++]);
+    }
+    log_lookup_leaves_to_load->Set(sth.tree_size() - next->tree.LeafCount());
+  }
+  // This also evaluates the whole tree, which must not change anymore
+  // once it is published.
+  CHECK_EQ(HexString(next->tree.CurrentRoot()),
            HexString(sth.sha256_root_hash()))
       << "Computed root hash and stored STH root hash do not match";
-  LOG(INFO) << "Found " << sth.tree_size() - latest_tree_head_.tree_size()
+  LOG(INFO) << "Found " << sth.tree_size() - latest_tree_head.tree_size()
             << " new log entries";
-  latest_tree_head_.CopyFrom(sth);
 
-  const time_t last_update(static_cast<time_t>(latest_tree_head_.timestamp() /
-                                               kNumMillisPerSecond));
+  // Publish the new snapshot. The previous one becomes the standby, and
+  // will be updated once the lookups still using it are done.
+  std::atomic_store(&snapshot_, shared_ptr<const Snapshot>(
+                                    make_shared<Snapshot>(standby_, sth)));
+  standby_ = current->state;
+
+  // Proofs for the older tree sizes stay valid, but are now rarely asked
+  // for.
+  if (recent_tree_sizes_.empty() ||
+      recent_tree_sizes_.back() != sth.tree_size()) {
+    recent_tree_sizes_.push_back(sth.tree_size());
+  }
+  if (recent_tree_sizes_.size() > kCachedTreeSizes) {
+    recent_tree_sizes_.pop_front();
+    proof_cache_.EvictBefore(recent_tree_sizes_.front());
+  }
+
+  const time_t last_update(
+      static_cast<time_t>(sth.timestamp() / kNumMillisPerSecond));
   char buf[kCtimeBufSize];
   LOG(INFO) << "Tree successfully updated at " << ctime_r(&last_update, buf);
 }
 
 
+void LogLookup::WaitForStandby() const {
+  // Lookups get their own reference to the state through the snapshot,
+  // and no new ones can be taken once it is no longer published. They
+  // are short, so polling is good enough.
+  while (standby_.use_count() > 1) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  // Pairs with the release of the references by the lookups, so that
+  // their reads happen before our writes.
+  std::atomic_thread_fence(std::memory_order_acquire);
+}
+
+
+// static
+void LogLookup::AddLeafHash(TreeState* state, int64_t leaf_index,
+                            const string& leaf_hash) {
+  CHECK_EQ(static_cast<size_t>(leaf_index + 1),
+           state->tree.AddLeafHash(leaf_hash));
+  // Duplicate leaves shouldn't really happen but are not a problem
+  // either: we just return the Merkle proof of the first occurrence.
+  state->leaf_index.Insert(leaf_hash, leaf_index);
+}
+
+
+size_t LogLookup::MemoryUsage(bool index) {
+  const auto usage([index](const TreeState& state) {
+    return index ? state.leaf_index.MemoryUsage() : state.tree.MemoryUsage();
+  });
+  std::atomic<size_t>* const standby_bytes(index ? &standby_index_bytes_
+                                                 : &standby_tree_bytes_);
+  // Updates can take a while, and are not to be waited for.
+  const unique_lock<mutex> lock(update_lock_, std::try_to_lock);
+  if (lock.owns_lock()) {
+    standby_bytes->store(usage(*standby_));
+  }
+  return usage(*GetSnapshot()->state) + standby_bytes->load();
+}
+
+
+// static
+int64_t LogLookup::FindLeaf(const TreeState& state,
+                            const string& merkle_leaf_hash) {
+  return state.leaf_index.Find(merkle_leaf_hash,
+                               [&state, &merkle_leaf_hash](int64_t index) {
+                                 return state.tree.LeafHash(index + 1) ==
+                                        merkle_leaf_hash;
+                               });
+}
+
+
+string LogLookup::ReadLeafHashes(size_t start, size_t count) const {
+  const size_t node_size(leaf_hasher_.DigestSize());
+  const size_t tile_width(TiledMerkleTree::kTileWidth);
+  const size_t end(start + count);
+  string hashes;
+  string tile;
+  size_t leaf(start);
+  while (leaf < end) {
+    const size_t tile_index(leaf / tile_width);
+    if (db_->LookupTile(0, tile_index, &tile) != Database::LOOKUP_OK) {
+      break;
+    }
+    const size_t tile_start(tile_index * tile_width);
+    const size_t tile_end(
+        std::min(end, tile_start + tile.size() / node_size));
+    if (tile_end <= leaf) {
+      break;
+    }
+    hashes.append(tile, (leaf - tile_start) * node_size,
+                  (tile_end - leaf) * node_size);
+    leaf = tile_end;
+  }
+  if (leaf == end) {
+    return hashes;
+  }
+
+  // The tree signer has not published these (yet).
+  auto it(db_->ScanEntries(leaf, end, ReadOnlyDatabase::ScanOptions()));
+  vector<LoggedEntry> entries;
+  CHECK_EQ(end - leaf, it->GetNextEntries(end - leaf, &entries))
+      << "Failed to retrieve entries " << leaf << " to " << end - 1;
+  vector<string> serialized_leaves(entries.size());
+  for (size_t i = 0; i < entries.size(); ++i) {
+    CHECK_EQ(static_cast<int64_t>(leaf + i), entries[i].sequence_number());
+    CHECK(entries[i].SerializeForLeaf(&serialized_leaves[i]));
+  }
+  for (const string& hash : leaf_hasher_.HashLeaves(serialized_leaves)) {
+    hashes.append(hash);
+  }
+  return hashes;
+}
+
+
+void LogLookup::AddPublishedLeafHashes(int64_t tree_size,
+                                       TreeState* state) const {
+  const size_t node_size(state->tree.NodeSize());
+  const int64_t tile_width(TiledMerkleTree::kTileWidth);
+  string tile;
+  for (int64_t leaf(state->tree.LeafCount()); leaf < tree_size;) {
+    const int64_t tile_index(leaf / tile_width);
+    if (db_->LookupTile(0, tile_index, &tile) != Database::LOOKUP_OK) {
+      return;
+    }
+    const int64_t tile_start(tile_index * tile_width);
+    const int64_t tile_end(std::min<int64_t>(
+        tree_size, tile_start + static_cast<int64_t>(tile.size() / node_size)));
+    if (tile_end <= leaf) {
+      return;
+    }
+    for (; leaf < tile_end; ++leaf) {
+      AddLeafHash(state, leaf,
+                  tile.substr((leaf - tile_start) * node_size, node_size));
+    }
+  }
+}
+
+
+bool LogLookup::LoadFromNodeFile(const SignedTreeHead& sth,
+                                 TreeState* state) {
+  CHECK_EQ(0U, state->tree.LeafCount());
+  const size_t tree_size(sth.tree_size());
+  if (node_file_->LeafCount() < tree_size) {
+    LOG(INFO) << "Merkle node file only has " << node_file_->LeafCount()
+              << " of " << tree_size << " leaves, loading from database";
+    return false;
+  }
+
+  // Check the root before touching the tree, which cannot be rolled back.
+  CompactMerkleTree verifier(unique_ptr<Sha256Hasher>(new Sha256Hasher));
+  for (size_t i = 0; i < tree_size; ++i) {
+    verifier.AddLeafHash(string(node_file_->LeafHash(i), verifier.NodeSize()));
+  }
+  if (verifier.CurrentRoot() != sth.sha256_root_hash()) {
+    LOG(WARNING) << "Merkle node file does not match the root hash of the "
+                 << "latest STH, loading from database";
+    return false;
+  }
+
+  for (size_t i = 0; i < tree_size; ++i) {
+    AddLeafHash(state, i,
+                string(node_file_->LeafHash(i), state->tree.NodeSize()));
+  }
+  LOG(INFO) << "Loaded " << tree_size << " leaves from Merkle node file";
+  return true;
+}
+
+
 LogLookup::LookupResult LogLookup::GetIndex(const string& merkle_leaf_hash,
                                             int64_t* index) {
-  unique_lock<mutex> lock(lock_);
-  const int64_t myindex(GetIndexInternal(lock, merkle_leaf_hash));
-
+  const int64_t myindex(FindLeaf(*GetSnapshot()->state, merkle_leaf_hash));
   if (myindex < 0) {
     return NOT_FOUND;
-  } else {
-    *index = myindex;
-    return OK;
   }
+
+  *index = myindex;
+  return OK;
 }
 
 
 // Look up by SHA256-hash of the certificate.
 LogLookup::LookupResult LogLookup::AuditProof(const string& merkle_leaf_hash,
                                               MerkleAuditProof* proof) {
-  unique_lock<mutex> lock(lock_);
-
-  const int64_t leaf_index(GetIndexInternal(lock, merkle_leaf_hash));
+  const shared_ptr<const Snapshot> snapshot(GetSnapshot());
+  const int64_t leaf_index(FindLeaf(*snapshot->state, merkle_leaf_hash));
   if (leaf_index < 0) {
     return NOT_FOUND;
   }
 
-  CHECK_GE(leaf_index, 0);
+  const size_t tree_size(snapshot->state->tree.LeafCount());
   proof->set_version(ct::V1);
-  proof->set_tree_size(cert_tree_.LeafCount());
-  proof->set_timestamp(latest_tree_head_.timestamp());
+  proof->set_tree_size(tree_size);
+  proof->set_timestamp(snapshot->sth.timestamp());
   proof->set_leaf_index(leaf_index);
 
   proof->clear_path_node();
-  vector<string> audit_path = cert_tree_.PathToCurrentRoot(leaf_index + 1);
-  for (size_t i = 0; i < audit_path.size(); ++i)
-    proof->add_path_node(audit_path[i]);
+  for (const string& node : AuditPath(*snapshot, leaf_index, tree_size))
+    proof->add_path_node(node);
 
-  proof->mutable_id()->CopyFrom(latest_tree_head_.id());
-  proof->mutable_tree_head_signature()->CopyFrom(
-      latest_tree_head_.signature());
+  proof->mutable_id()->CopyFrom(snapshot->sth.id());
+  proof->mutable_tree_head_signature()->CopyFrom(snapshot->sth.signature());
   return OK;
 }
 
@@ -158,15 +476,13 @@ LogLookup::LookupResult LogLookup::AuditProof(const string& merkle_leaf_hash,
 LogLookup::LookupResult LogLookup::AuditProof(int64_t leaf_index,
                                               size_t tree_size,
                                               ShortMerkleAuditProof* proof) {
-  lock_guard<mutex> lock(lock_);
+  const shared_ptr<const Snapshot> snapshot(GetSnapshot());
 
   proof->set_leaf_index(leaf_index);
 
   proof->clear_path_node();
-  vector<string> audit_path =
-      cert_tree_.PathToRootAtSnapshot(leaf_index + 1, tree_size);
-  for (size_t i = 0; i < audit_path.size(); ++i)
-    proof->add_path_node(audit_path[i]);
+  for (const string& node : AuditPath(*snapshot, leaf_index, tree_size))
+    proof->add_path_node(node);
 
   return OK;
 }
@@ -185,41 +501,89 @@ LogLookup::LookupResult LogLookup::AuditProof(const string& merkle_leaf_hash,
 }
 
 
+vector<LogLookup::LookupResult> LogLookup::AuditProofs(
+    const vector<string>& merkle_leaf_hashes, size_t tree_size,
+    vector<ShortMerkleAuditProof>* proofs) {
+  const shared_ptr<const Snapshot> snapshot(GetSnapshot());
+  const bool have_tree(tree_size <= snapshot->state->tree.LeafCount());
+
+  vector<LookupResult> results(merkle_leaf_hashes.size(), NOT_FOUND);
+  proofs->clear();
+  proofs->resize(merkle_leaf_hashes.size());
+  for (size_t i = 0; have_tree && i < merkle_leaf_hashes.size(); ++i) {
+    const int64_t leaf_index(
+        FindLeaf(*snapshot->state, merkle_leaf_hashes[i]));
+    if (leaf_index < 0 || static_cast<size_t>(leaf_index) >= tree_size) {
+      continue;
+    }
+
+    ShortMerkleAuditProof* const proof(&(*proofs)[i]);
+    proof->set_leaf_index(leaf_index);
+    for (const string& node : AuditPath(*snapshot, leaf_index, tree_size))
+      proof->add_path_node(node);
+    results[i] = OK;
+  }
+
+  return results;
+}
+
+
+vector<string> LogLookup::ConsistencyProof(size_t first, size_t second) {
+  vector<string> proof;
+  if (proof_cache_.LookupConsistencyProof(first, second, &proof))
+    return proof;
+
+  proof = GetSnapshot()->state->tree.SnapshotConsistency(first, second);
+  // An empty proof is either trivial or for a tree we do not have yet.
+  if (!proof.empty())
+    proof_cache_.InsertConsistencyProof(first, second, proof);
+  return proof;
+}
+
+
 string LogLookup::RootAtSnapshot(size_t tree_size) {
-  lock_guard<mutex> lock(lock_);
-  return cert_tree_.RootAtSnapshot(tree_size);
+  return GetSnapshot()->state->tree.RootAtSnapshot(tree_size);
+}
+
+
+vector<string> LogLookup::RootsAtSnapshots(const vector<size_t>& tree_sizes) {
+  return GetSnapshot()->state->tree.RootsAtSnapshots(tree_sizes);
 }
 
 
 string LogLookup::LeafHash(const LoggedEntry& logged) const {
   string serialized_leaf;
   CHECK(logged.SerializeForLeaf(&serialized_leaf));
-  // We do not need to take the lock for this call into cert_tree_, as
-  // this is merely a const forwarder (to another const, thread-safe
+  // This is merely a const forwarder (to another const, thread-safe
   // method).
-  return cert_tree_.LeafHash(serialized_leaf);
+  return GetSnapshot()->state->tree.LeafHash(serialized_leaf);
 }
 
 
 unique_ptr<CompactMerkleTree> LogLookup::GetCompactMerkleTree(
     SerialHasher* hasher) {
-  lock_guard<mutex> lock(lock_);
-  return unique_ptr<CompactMerkleTree>(
-      new CompactMerkleTree(&cert_tree_, unique_ptr<SerialHasher>(hasher)));
+  loaded_.WaitForNotification();
+  const shared_ptr<const Snapshot> snapshot(GetSnapshot());
+  // Published trees are fully evaluated, so this copies their frontier
+  // without touching them.
+  const LevelCompressedMerkleTree& tree(snapshot->state->tree);
+  return unique_ptr<CompactMerkleTree>(new CompactMerkleTree(
+      tree.LeafCount(), tree.Frontier(), unique_ptr<SerialHasher>(hasher)));
 }
 
 
-int64_t LogLookup::GetIndexInternal(const unique_lock<mutex>& lock,
-                                    const string& merkle_leaf_hash) const {
-  CHECK(lock.owns_lock());
-
-  const map<string, int64_t>::const_iterator it(
-      leaf_index_.find(merkle_leaf_hash));
-  if (it == leaf_index_.end())
-    return -1;
+vector<string> LogLookup::AuditPath(const Snapshot& snapshot,
+                                    int64_t leaf_index, size_t tree_size) {
+  vector<string> path;
+  if (proof_cache_.LookupAuditPath(leaf_index, tree_size, &path))
+    return path;
 
-  CHECK_GE(it->second, 0);
-  return it->second;
+  path = snapshot.state->tree.PathToRootAtSnapshot(leaf_index + 1, tree_size);
+  // Only the path in a tree with a single leaf is legitimately empty,
+  // and it is cheap to compute.
+  if (!path.empty())
+    proof_cache_.InsertAuditPath(leaf_index, tree_size, path);
+  return path;
 }
 
 
@@ -2,24 +2,64 @@
 #define CERT_TRANS_LOG_LOG_LOOKUP_H_
 
 #include <stdint.h>
-#include <map>
+#include <atomic>
+#include <deque>
+#include <memory>
 #include <mutex>
 #include <string>
+#include <thread>
 
+#include "base/notification.h"
 #include "log/database.h"
+#include "log/leaf_hash_index.h"
+#include "log/merkle_node_file.h"
+#include "log/proof_cache.h"
 #include "merkletree/compact_merkle_tree.h"
-#include "merkletree/merkle_tree.h"
+#include "merkletree/level_compressed_merkle_tree.h"
+#include "merkletree/tree_hasher.h"
+#include "monitoring/memory.h"
 #include "proto/ct.pb.h"
+#include "util/executor.h"
 
 namespace cert_trans {
 
 
 // Lookups into the database. Read-only, so could also be a mirror.
-// Keeps the entire Merkle Tree in memory to serve audit proofs.
+// Keeps the Merkle Tree in memory to serve audit proofs, and caches the
+// proofs for the most recent tree sizes. With
+// --log_lookup_dropped_tree_levels, the bottom levels of the tree are
+// left out, and the leaf hashes a proof needs from them are read back
+// from the database (see LevelCompressedMerkleTree).
+//
+// Lookups never wait on updates: they work on an immutable snapshot of
+// the tree and leaf index for the latest STH, while updates bring a
+// second copy up to date off to the side and then publish it as the
+// next snapshot. This costs twice the memory of a single tree.
+//
+// Updates take the leaf hashes published by the tree signer (see
+// TreeSigner) from the database when they are there, and only read and
+// hash the entries that they do not cover.
 class LogLookup {
  public:
-  // The constructor loads the content from the database.
-  explicit LogLookup(ReadOnlyDatabase* db);
+  // Whether the constructor loads the tree for the latest STH of the
+  // database before returning, or on a thread of its own while the
+  // lookups see an empty tree (see Loaded()).
+  enum InitialLoad {
+    LOAD_NOW,
+    LOAD_IN_BACKGROUND,
+  };
+
+  // The constructor loads the content from the database. If |executor|
+  // is not NULL, it is used to rebuild the tree in parallel when
+  // catching up with a large STH. If |node_file| is not empty, it names
+  // a MerkleNodeFile written by the tree signer, from which the initial
+  // tree is loaded when it covers the latest STH (falling back to the
+  // database otherwise).
+  explicit LogLookup(ReadOnlyDatabase* db,
+                     util::Executor* executor = nullptr,
+                     const std::string& node_file = "",
+                     InitialLoad initial_load = LOAD_NOW);
+  // Waits for the initial load to finish, if it has not.
   ~LogLookup();
   LogLookup(const LogLookup&) = delete;
   LogLookup& operator=(const LogLookup&) = delete;
@@ -29,6 +69,12 @@ class LogLookup {
     NOT_FOUND,
   };
 
+  // Whether the tree for the latest STH of the database at construction
+  // is loaded. Always true with LOAD_NOW.
+  bool Loaded() const {
+    return loaded_.HasBeenNotified();
+  }
+
   LookupResult GetIndex(const std::string& merkle_leaf_hash, int64_t* index);
 
   // Look up by hash of the logged item.
@@ -46,43 +92,123 @@ class LogLookup {
   LookupResult AuditProof(const std::string& merkle_leaf_hash,
                           size_t tree_size, ct::ShortMerkleAuditProof* proof);
 
+  // Looks up several leaves by hash in the tree of size |tree_size|,
+  // all in the same snapshot. Sets |proofs| to as many proofs as there
+  // are hashes, and returns as many results: NOT_FOUND for the hashes
+  // which are not in that tree, whose proof is left empty.
+  std::vector<LookupResult> AuditProofs(
+      const std::vector<std::string>& merkle_leaf_hashes, size_t tree_size,
+      std::vector<ct::ShortMerkleAuditProof>* proofs);
+
   // Get a consitency proof between two tree heads
-  std::vector<std::string> ConsistencyProof(size_t first, size_t second) {
-    std::lock_guard<std::mutex> lock(lock_);
-    return cert_tree_.SnapshotConsistency(first, second);
-  }
+  std::vector<std::string> ConsistencyProof(size_t first, size_t second);
 
-  const ct::SignedTreeHead& GetSTH() const {
-    std::lock_guard<std::mutex> lock(lock_);
-    return latest_tree_head_;
+  ct::SignedTreeHead GetSTH() const {
+    return GetSnapshot()->sth;
   }
 
   std::string RootAtSnapshot(size_t tree_size);
 
+  // RootAtSnapshot() for each of |tree_sizes|, from the same snapshot
+  // of the tree, in one pass (see MerkleTree::RootsAtSnapshots()).
+  std::vector<std::string> RootsAtSnapshots(
+      const std::vector<size_t>& tree_sizes);
+
   std::string LeafHash(const LoggedEntry& logged) const;
 
   // Creates a CompactMerkleTree based on the current state of our MerkleTree.
-  // Takes ownership of |hasher|.
+  // Takes ownership of |hasher|. Waits until Loaded(), so that it is not
+  // based on the empty tree.
   std::unique_ptr<CompactMerkleTree> GetCompactMerkleTree(
       SerialHasher* hasher);
 
  private:
-  void UpdateFromSTH(const ct::SignedTreeHead& sth);
-  int64_t GetIndexInternal(const std::unique_lock<std::mutex>& lock,
-                           const std::string& merkle_leaf_hash) const;
+  // A Merkle tree with an index of its leaves. While it is part of a
+  // published Snapshot, it is fully evaluated and not modified, so that
+  // it can be read from several threads at once.
+  struct TreeState {
+    TreeState(util::Executor* executor, size_t dropped_levels,
+              const LevelCompressedMerkleTree::LeafHashReader& reader);
+
+    LevelCompressedMerkleTree tree;
+    // We keep a hash -> index mapping in memory so that we can quickly
+    // serve Merkle proofs without having to query the database at all.
+    // Its candidates are confirmed against the leaf hashes in |tree|.
+    LeafHashIndex leaf_index;
+  };
+
+  struct Snapshot {
+    Snapshot(const std::shared_ptr<TreeState>& state,
+             const ct::SignedTreeHead& sth)
+        : state(state), sth(sth) {
+    }
 
-  mutable std::mutex lock_;
-  // We keep a hash -> index mapping in memory so that we can quickly serve
-  // Merkle proofs without having to query the database at all.
-  // Note that 32 bytes is an overkill and we can optimize this to use
-  // a shorter prefix (possibly with a multimap).
-  std::map<std::string, int64_t> leaf_index_;
+    const std::shared_ptr<TreeState> state;
+    const ct::SignedTreeHead sth;
+  };
+
+  std::shared_ptr<const Snapshot> GetSnapshot() const;
+  // Registers for the STHs of the database, which loads the latest one.
+  void Load();
+  void UpdateFromSTH(const ct::SignedTreeHead& sth);
+  // Waits until no lookup is using |standby_| anymore.
+  void WaitForStandby() const;
+  // The index of the first leaf of |state| with |merkle_leaf_hash|, or
+  // -1 if there is none.
+  static int64_t FindLeaf(const TreeState& state,
+                          const std::string& merkle_leaf_hash);
+  // Adds |leaf_hash| to |state| as the leaf at |leaf_index|, which must
+  // be the next one.
+  static void AddLeafHash(TreeState* state, int64_t leaf_index,
+                          const std::string& leaf_hash);
+  // The |count| leaf hashes from the leaf at |start| on, back to back,
+  // for the trees with dropped levels: from the tiles published by the
+  // tree signer, or else hashed from the entries.
+  std::string ReadLeafHashes(size_t start, size_t count) const;
+  // Adds the leaf hashes published to the database by the tree signer
+  // to |state|, up to |tree_size| or the first one missing.
+  void AddPublishedLeafHashes(int64_t tree_size, TreeState* state) const;
+  // Loads the leaves of |sth| from |node_file_| into the empty |state|.
+  // Returns false, leaving it empty, if the file does not cover |sth|
+  // or does not match its root hash.
+  bool LoadFromNodeFile(const ct::SignedTreeHead& sth, TreeState* state);
+  // The audit path of the leaf at |leaf_index| in the tree of size
+  // |tree_size|, from |proof_cache_| if possible.
+  std::vector<std::string> AuditPath(const Snapshot& snapshot,
+                                     int64_t leaf_index, size_t tree_size);
+  // The memory held by the trees (or the leaf indexes, with |index|)
+  // of the snapshot and of |standby_|, for MemoryEstimate.
+  size_t MemoryUsage(bool index);
 
   ReadOnlyDatabase* const db_;
-  MerkleTree cert_tree_;
-  ct::SignedTreeHead latest_tree_head_;
+  // For ReadLeafHashes(), which may run on several threads at once.
+  const TreeHasher leaf_hasher_;
+  // Only kept until the first STH has been loaded.
+  std::unique_ptr<MappedMerkleNodeFile> node_file_;
+  // Only accessed with std::atomic_load() and std::atomic_store().
+  std::shared_ptr<const Snapshot> snapshot_;
+
+  // Serializes updates, which are the only users of the members below.
+  std::mutex update_lock_;
+  // The tree state not in |snapshot_|, which lags behind it until the
+  // next update.
+  std::shared_ptr<TreeState> standby_;
+  // The tree sizes of the last few STHs, oldest first, for which
+  // |proof_cache_| keeps proofs.
+  std::deque<int64_t> recent_tree_sizes_;
+  ProofCache proof_cache_;
 
   const Database::NotifySTHCallback update_from_sth_cb_;
+  Notification loaded_;
+  // Runs Load() with LOAD_IN_BACKGROUND.
+  std::thread loader_;
+
+  // The last estimates of |standby_|, for when it is being updated.
+  std::atomic<size_t> standby_tree_bytes_;
+  std::atomic<size_t> standby_index_bytes_;
+  // Last, so that they are gone before the rest.
+  const MemoryEstimate tree_memory_;
+  const MemoryEstimate index_memory_;
 };
 
 
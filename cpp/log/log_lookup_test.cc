@@ -1,7 +1,10 @@
 /* -*- indent-tabs-mode: nil -*- */
+#include <gflags/gflags.h>
 #include <gtest/gtest.h>
 #include <memory>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "log/etcd_consistent_store.h"
 #include "log/file_db.h"
@@ -10,6 +13,7 @@
 #include "log/log_signer.h"
 #include "log/log_verifier.h"
 #include "log/logged_entry.h"
+#include "log/merkle_node_file.h"
 #include "log/sqlite_db.h"
 #include "log/test_db.h"
 #include "log/test_signer.h"
@@ -24,6 +28,8 @@
 #include "util/thread_pool.h"
 #include "util/util.h"
 
+DECLARE_int32(log_lookup_dropped_tree_levels);
+
 namespace {
 
 namespace libevent = cert_trans::libevent;
@@ -35,12 +41,14 @@ using cert_trans::FakeEtcdClient;
 using cert_trans::FileDB;
 using cert_trans::LogLookup;
 using cert_trans::LoggedEntry;
+using cert_trans::MerkleNodeFile;
 using cert_trans::MockMasterElection;
 using cert_trans::SQLiteDB;
 using cert_trans::ThreadPool;
 using cert_trans::TreeSigner;
 using ct::MerkleAuditProof;
 using ct::SequenceMapping;
+using ct::ShortMerkleAuditProof;
 using std::make_shared;
 using std::shared_ptr;
 using std::string;
@@ -119,6 +127,7 @@ class LogLookupTest : public ::testing::Test {
 
 
   TestDB<T> test_db_;
+  TmpStorage tmp_;
   shared_ptr<libevent::Base> base_;
   libevent::EventPumpThread event_pump_;
   FakeEtcdClient etcd_client_;
@@ -229,6 +238,339 @@ TYPED_TEST(LogLookupTest, VerifyWithPath) {
 }
 
 
+// Batch verification must agree with VerifyMerkleAuditProof() on every
+// proof, valid or not.
+TYPED_TEST(LogLookupTest, VerifyInBatch) {
+  LoggedEntry logged_certs[13];
+  for (int i = 0; i < 13; ++i) {
+    this->test_signer_.CreateUnique(&logged_certs[i]);
+    this->CreateSequencedEntry(&logged_certs[i], i);
+  }
+  this->UpdateTree();
+
+  LogLookup lookup(this->db());
+  std::vector<MerkleAuditProof> proofs(4 * 13);
+  std::vector<LogVerifier::AuditProofToVerify> to_verify;
+  for (int i = 0; i < 13; ++i) {
+    for (int j = 0; j < 4; ++j) {
+      MerkleAuditProof* const proof(&proofs[4 * i + j]);
+      ASSERT_EQ(LogLookup::OK,
+                lookup.AuditProof(logged_certs[i].merkle_leaf_hash(), proof));
+      const LoggedEntry* logged(&logged_certs[i]);
+      switch (j) {
+        case 1:
+          // Someone else's entry.
+          logged = &logged_certs[(i + 1) % 13];
+          break;
+        case 2:
+          proof->set_tree_size(14);
+          break;
+        case 3:
+          proof->mutable_tree_head_signature()->set_signature("bad");
+          break;
+      }
+      to_verify.push_back(LogVerifier::AuditProofToVerify{
+          &logged->entry(), &logged->sct(), proof});
+    }
+  }
+
+  const std::vector<LogVerifier::LogVerifyResult> results(
+      this->verifier_.VerifyMerkleAuditProofs(to_verify, &this->pool_));
+  ASSERT_EQ(to_verify.size(), results.size());
+  for (size_t i = 0; i < to_verify.size(); ++i) {
+    EXPECT_EQ(this->verifier_.VerifyMerkleAuditProof(
+                  *to_verify[i].entry, *to_verify[i].sct,
+                  *to_verify[i].merkle_proof),
+              results[i]) << i;
+    if (i % 4 == 0) {
+      EXPECT_EQ(LogVerifier::VERIFY_OK, results[i]);
+    } else {
+      EXPECT_NE(LogVerifier::VERIFY_OK, results[i]);
+    }
+  }
+}
+
+
+// Batch verification must agree with VerifySignedCertificateTimestamp()
+// and VerifySignedTreeHead(), valid or not.
+TYPED_TEST(LogLookupTest, VerifySignaturesInBatch) {
+  // Enough for several tasks on the pool.
+  const int kNumEntries(200);
+  std::vector<LoggedEntry> logged_certs(kNumEntries);
+  std::vector<ct::SignedCertificateTimestamp> scts(kNumEntries);
+  std::vector<LogVerifier::SCTToVerify> to_verify;
+  for (int i = 0; i < kNumEntries; ++i) {
+    this->test_signer_.CreateUnique(&logged_certs[i]);
+    scts[i] = logged_certs[i].sct();
+    if (i % 3 == 1) {
+      scts[i].mutable_signature()->set_signature("bad");
+    } else if (i % 3 == 2) {
+      scts[i].set_timestamp(util::TimeInMilliseconds() + 3600 * 1000);
+    }
+    to_verify.push_back(
+        LogVerifier::SCTToVerify{&logged_certs[i].entry(), &scts[i]});
+  }
+
+  const std::vector<LogVerifier::LogVerifyResult> results(
+      this->verifier_.VerifySignedCertificateTimestamps(to_verify,
+                                                        &this->pool_));
+  ASSERT_EQ(to_verify.size(), results.size());
+  for (size_t i = 0; i < to_verify.size(); ++i) {
+    EXPECT_EQ(this->verifier_.VerifySignedCertificateTimestamp(
+                  *to_verify[i].entry, *to_verify[i].sct),
+              results[i]) << i;
+    EXPECT_EQ(i % 3 == 0, results[i] == LogVerifier::VERIFY_OK) << i;
+  }
+
+  this->CreateSequencedEntry(&logged_certs[0], 0);
+  this->UpdateTree();
+  const ct::SignedTreeHead good_sth(this->tree_signer_.LatestSTH());
+  ct::SignedTreeHead bad_sth(good_sth);
+  bad_sth.set_tree_size(bad_sth.tree_size() + 1);
+  EXPECT_EQ(std::vector<LogVerifier::LogVerifyResult>(
+                {LogVerifier::VERIFY_OK, LogVerifier::INVALID_SIGNATURE}),
+            this->verifier_.VerifySignedTreeHeads({&good_sth, &bad_sth},
+                                                  &this->pool_));
+}
+
+
+TYPED_TEST(LogLookupTest, AuditProofsInBatch) {
+  LoggedEntry logged_certs[13];
+  for (int i = 0; i < 13; ++i) {
+    this->test_signer_.CreateUnique(&logged_certs[i]);
+    this->CreateSequencedEntry(&logged_certs[i], i);
+  }
+  this->UpdateTree();
+
+  LogLookup lookup(this->db());
+  const size_t tree_size(9);
+  std::vector<string> hashes;
+  for (int i = 0; i < 13; ++i) {
+    hashes.push_back(logged_certs[i].merkle_leaf_hash());
+  }
+  hashes.push_back(this->test_signer_.UniqueHash());
+
+  std::vector<ShortMerkleAuditProof> proofs;
+  const std::vector<LogLookup::LookupResult> results(
+      lookup.AuditProofs(hashes, tree_size, &proofs));
+  ASSERT_EQ(hashes.size(), results.size());
+  ASSERT_EQ(hashes.size(), proofs.size());
+  for (size_t i = 0; i < hashes.size(); ++i) {
+    // Only the leaves in the first |tree_size| are found.
+    if (i >= tree_size) {
+      EXPECT_EQ(LogLookup::NOT_FOUND, results[i]) << i;
+      continue;
+    }
+    ShortMerkleAuditProof proof;
+    ASSERT_EQ(LogLookup::OK, results[i]) << i;
+    ASSERT_EQ(LogLookup::OK, lookup.AuditProof(hashes[i], tree_size, &proof));
+    EXPECT_EQ(proof.DebugString(), proofs[i].DebugString()) << i;
+  }
+
+  // Nothing is found in a tree larger than the log.
+  EXPECT_EQ(LogLookup::NOT_FOUND,
+            lookup.AuditProofs(hashes, 14, &proofs).front());
+}
+
+
+TYPED_TEST(LogLookupTest, LookupsDuringUpdate) {
+  LogLookup lookup(this->db());
+  LoggedEntry logged_certs[13];
+  for (int i = 0; i < 13; ++i) {
+    this->test_signer_.CreateUnique(&logged_certs[i]);
+    this->CreateSequencedEntry(&logged_certs[i], i);
+  }
+
+  // Lookups see either the empty tree or the complete new one.
+  std::vector<std::thread> readers;
+  for (int i = 0; i < 4; ++i) {
+    readers.emplace_back([this, &lookup, &logged_certs, i]() {
+      MerkleAuditProof proof;
+      while (lookup.AuditProof(logged_certs[i].merkle_leaf_hash(), &proof) !=
+             LogLookup::OK) {
+        EXPECT_EQ(0, lookup.GetSTH().tree_size());
+        std::this_thread::yield();
+      }
+      EXPECT_EQ(13, proof.tree_size());
+      EXPECT_EQ(LogVerifier::VERIFY_OK,
+                this->verifier_.VerifyMerkleAuditProof(logged_certs[i].entry(),
+                                                       logged_certs[i].sct(),
+                                                       proof));
+    });
+  }
+
+  this->UpdateTree();
+  for (std::thread& reader : readers) {
+    reader.join();
+  }
+  EXPECT_EQ(13, lookup.GetSTH().tree_size());
+}
+
+
+TYPED_TEST(LogLookupTest, LoadFromNodeFile) {
+  LoggedEntry logged_certs[13];
+  for (int i = 0; i < 13; ++i) {
+    this->test_signer_.CreateUnique(&logged_certs[i]);
+    this->CreateSequencedEntry(&logged_certs[i], i);
+  }
+  this->UpdateTree();
+
+  const string path(this->tmp_.TmpStorageDir() + "/nodes");
+  {
+    util::StatusOr<unique_ptr<MerkleNodeFile>> file(
+        MerkleNodeFile::Open(path, 32));
+    ASSERT_TRUE(file.ok());
+    for (int i = 0; i < 13; ++i) {
+      file.ValueOrDie()->Append(logged_certs[i].merkle_leaf_hash());
+    }
+    ASSERT_TRUE(file.ValueOrDie()->Flush().ok());
+  }
+
+  LogLookup lookup(this->db(), nullptr, path);
+  EXPECT_EQ(this->tree_signer_.LatestSTH().sha256_root_hash(),
+            lookup.RootAtSnapshot(13));
+  MerkleAuditProof proof;
+  for (int i = 0; i < 13; ++i) {
+    EXPECT_EQ(LogLookup::OK,
+              lookup.AuditProof(logged_certs[i].merkle_leaf_hash(), &proof));
+    EXPECT_EQ(LogVerifier::VERIFY_OK,
+              this->verifier_.VerifyMerkleAuditProof(logged_certs[i].entry(),
+                                                     logged_certs[i].sct(),
+                                                     proof));
+  }
+}
+
+
+TYPED_TEST(LogLookupTest, IgnoresMismatchedNodeFile) {
+  LoggedEntry logged_certs[3];
+  for (int i = 0; i < 3; ++i) {
+    this->test_signer_.CreateUnique(&logged_certs[i]);
+    this->CreateSequencedEntry(&logged_certs[i], i);
+  }
+  this->UpdateTree();
+
+  const string path(this->tmp_.TmpStorageDir() + "/nodes");
+  {
+    util::StatusOr<unique_ptr<MerkleNodeFile>> file(
+        MerkleNodeFile::Open(path, 32));
+    ASSERT_TRUE(file.ok());
+    // Right count, wrong order.
+    for (int i = 2; i >= 0; --i) {
+      file.ValueOrDie()->Append(logged_certs[i].merkle_leaf_hash());
+    }
+    ASSERT_TRUE(file.ValueOrDie()->Flush().ok());
+  }
+
+  // The tree is loaded from the database instead.
+  LogLookup lookup(this->db(), nullptr, path);
+  EXPECT_EQ(this->tree_signer_.LatestSTH().sha256_root_hash(),
+            lookup.RootAtSnapshot(3));
+  int64_t index;
+  ASSERT_EQ(LogLookup::OK,
+            lookup.GetIndex(logged_certs[0].merkle_leaf_hash(), &index));
+  EXPECT_EQ(0, index);
+}
+
+
+TYPED_TEST(LogLookupTest, UsesPublishedLeafHashes) {
+  // Spanning two tiles.
+  const int kEntries(260);
+  std::vector<LoggedEntry> logged_certs(kEntries);
+  for (int i = 0; i < kEntries; ++i) {
+    this->test_signer_.CreateUnique(&logged_certs[i]);
+    this->CreateSequencedEntry(&logged_certs[i], i);
+  }
+  this->UpdateTree();
+
+  // A database with only the leaf hashes published by the tree signer,
+  // and the tree head: the entries are not needed.
+  TestDB<TypeParam> hashes_db;
+  for (int index = 0; index < 2; ++index) {
+    string tile;
+    ASSERT_EQ(Database::LOOKUP_OK, this->db()->LookupTile(0, index, &tile));
+    EXPECT_EQ(Database::OK, hashes_db.db()->WriteTile(0, index, tile));
+  }
+  EXPECT_EQ(Database::OK,
+            hashes_db.db()->WriteTreeHead(this->tree_signer_.LatestSTH()));
+
+  LogLookup lookup(hashes_db.db());
+  EXPECT_EQ(kEntries, lookup.GetSTH().tree_size());
+  MerkleAuditProof proof;
+  for (int i = 0; i < kEntries; i += 37) {
+    EXPECT_EQ(LogLookup::OK,
+              lookup.AuditProof(logged_certs[i].merkle_leaf_hash(), &proof));
+    EXPECT_EQ(LogVerifier::VERIFY_OK,
+              this->verifier_.VerifyMerkleAuditProof(logged_certs[i].entry(),
+                                                     logged_certs[i].sct(),
+                                                     proof));
+  }
+}
+
+
+TYPED_TEST(LogLookupTest, LoadsInBackground) {
+  LoggedEntry logged_cert;
+  this->test_signer_.CreateUnique(&logged_cert);
+  this->CreateSequencedEntry(&logged_cert, 0);
+  this->UpdateTree();
+
+  LogLookup lookup(this->db(), nullptr, "", LogLookup::LOAD_IN_BACKGROUND);
+  // Waits for the load.
+  EXPECT_EQ(1U, lookup.GetCompactMerkleTree(new Sha256Hasher)->LeafCount());
+  EXPECT_TRUE(lookup.Loaded());
+  EXPECT_EQ(1, lookup.GetSTH().tree_size());
+  MerkleAuditProof proof;
+  EXPECT_EQ(LogLookup::OK,
+            lookup.AuditProof(logged_cert.merkle_leaf_hash(), &proof));
+
+  // Later STHs are picked up as usual.
+  this->test_signer_.CreateUnique(&logged_cert);
+  this->CreateSequencedEntry(&logged_cert, 1);
+  this->UpdateTree();
+  EXPECT_EQ(2, lookup.GetSTH().tree_size());
+}
+
+
+TYPED_TEST(LogLookupTest, DropsTreeLevels) {
+  LogLookup lookup(this->db());
+  FLAGS_log_lookup_dropped_tree_levels = 3;
+  LogLookup dropped(this->db());
+  FLAGS_log_lookup_dropped_tree_levels = 0;
+
+  // Grow the tree over a few updates, so that the standby trees catch up
+  // with partial and complete blocks.
+  std::vector<LoggedEntry> logged_certs(45);
+  for (int size : {5, 21, 45}) {
+    for (int i = lookup.GetSTH().tree_size(); i < size; ++i) {
+      this->test_signer_.CreateUnique(&logged_certs[i]);
+      this->CreateSequencedEntry(&logged_certs[i], i);
+    }
+    this->UpdateTree();
+    ASSERT_EQ(size, dropped.GetSTH().tree_size());
+
+    for (int i = 0; i < size; ++i) {
+      MerkleAuditProof proof;
+      EXPECT_EQ(LogLookup::OK,
+                dropped.AuditProof(logged_certs[i].merkle_leaf_hash(),
+                                   &proof));
+      EXPECT_EQ(LogVerifier::VERIFY_OK,
+                this->verifier_.VerifyMerkleAuditProof(
+                    logged_certs[i].entry(), logged_certs[i].sct(), proof));
+
+      ShortMerkleAuditProof expected;
+      ShortMerkleAuditProof short_proof;
+      lookup.AuditProof(i, i + 1, &expected);
+      dropped.AuditProof(i, i + 1, &short_proof);
+      EXPECT_EQ(expected.DebugString(), short_proof.DebugString());
+      EXPECT_EQ(lookup.ConsistencyProof(i + 1, size),
+                dropped.ConsistencyProof(i + 1, size));
+      EXPECT_EQ(lookup.RootAtSnapshot(i), dropped.RootAtSnapshot(i));
+    }
+    EXPECT_EQ(lookup.GetCompactMerkleTree(new Sha256Hasher)->CurrentRoot(),
+              dropped.GetCompactMerkleTree(new Sha256Hasher)->CurrentRoot());
+  }
+}
+
+
 }  // namespace
 
 
@@ -121,6 +121,23 @@ LogSigner::SignResult LogSigner::SignCertificateTimestamp(
   return OK;
 }
 
+LogSigner::SignResult LogSigner::SignCertificateTimestampAsync(
+    const LogEntry& entry, SignedCertificateTimestamp* sct,
+    util::Task* task) const {
+  CHECK(sct->has_timestamp())
+      << "Attempt to sign an SCT with a missing timestamp";
+
+  string serialized_input;
+  SerializeResult res =
+      Serializer::SerializeSCTSignatureInput(*sct, entry, &serialized_input);
+
+  if (res != SerializeResult::OK)
+    return GetSerializeError(res);
+  sct->mutable_id()->set_key_id(KeyID());
+  SignAsync(serialized_input, sct->mutable_signature(), task);
+  return OK;
+}
+
 LogSigner::SignResult LogSigner::SignV1TreeHead(uint64_t timestamp,
                                                 int64_t tree_size,
                                                 const string& root_hash,
@@ -46,6 +46,13 @@ class LogSigner : public cert_trans::Signer {
   SignResult SignCertificateTimestamp(
       const ct::LogEntry& entry, ct::SignedCertificateTimestamp* sct) const;
 
+  // As SignCertificateTimestamp(), but signs with SignAsync(). If OK is
+  // returned, |task| returns once the signature is in |sct|, which must
+  // remain valid until then. Otherwise, |task| is not used.
+  SignResult SignCertificateTimestampAsync(const ct::LogEntry& entry,
+                                           ct::SignedCertificateTimestamp* sct,
+                                           util::Task* task) const;
+
   SignResult SignV1TreeHead(uint64_t timestamp, int64_t tree_size,
                             const std::string& root_hash,
                             std::string* result) const;
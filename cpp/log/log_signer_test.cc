@@ -2,14 +2,18 @@
 #include <glog/logging.h>
 #include <gtest/gtest.h>
 #include <stdint.h>
+#include <memory>
 #include <string>
+#include <vector>
 
 #include "log/log_signer.h"
 #include "log/test_signer.h"
 #include "proto/cert_serializer.h"
 #include "proto/ct.pb.h"
 #include "proto/serializer.h"
+#include "util/sync_task.h"
 #include "util/testing.h"
+#include "util/thread_pool.h"
 #include "util/util.h"
 
 namespace {
@@ -153,6 +157,40 @@ TEST_F(LogSignerTest, SignAndVerifyCertSCT) {
                 default_sct.extensions(), serialized_sig));
 }
 
+TEST_F(LogSignerTest, SignAndVerifyCertSCTAsync) {
+  LogEntry default_entry;
+  TestSigner::SetDefaults(&default_entry);
+  SignedCertificateTimestamp default_sct;
+  TestSigner::SetDefaults(&default_sct);
+
+  // Inline, then on a pool, with several signatures in flight.
+  cert_trans::ThreadPool pool(4);
+  for (util::Executor* executor : {static_cast<util::Executor*>(nullptr),
+                                   static_cast<util::Executor*>(&pool)}) {
+    signer_->SetAsyncExecutor(executor);
+    const int kSignatures(8);
+    SignedCertificateTimestamp scts[kSignatures];
+    std::vector<std::unique_ptr<util::SyncTask>> tasks;
+    for (int i = 0; i < kSignatures; ++i) {
+      scts[i].CopyFrom(default_sct);
+      scts[i].clear_signature();
+      tasks.emplace_back(new util::SyncTask(&pool));
+      EXPECT_EQ(LogSigner::OK,
+                signer_->SignCertificateTimestampAsync(default_entry,
+                                                       &scts[i],
+                                                       tasks.back()->task()));
+    }
+    for (int i = 0; i < kSignatures; ++i) {
+      tasks[i]->Wait();
+      EXPECT_TRUE(tasks[i]->status().ok());
+      EXPECT_EQ(default_sct.id().key_id(), scts[i].id().key_id());
+      EXPECT_EQ(LogSigVerifier::OK,
+                verifier_->VerifySCTSignature(default_entry, scts[i]));
+    }
+  }
+  signer_->SetAsyncExecutor(nullptr);
+}
+
 TEST_F(LogSignerTest, SignAndVerifyPrecertSCT) {
   LogEntry default_entry;
   TestSigner::SetPrecertDefaults(&default_entry);
@@ -2,20 +2,119 @@
 
 #include <glog/logging.h>
 #include <stdint.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <map>
 
 #include "log/cert_submission_handler.h"
 #include "log/log_signer.h"
 #include "merkletree/merkle_verifier.h"
+#include "monitoring/counter.h"
+#include "monitoring/latency.h"
 #include "proto/ct.pb.h"
 #include "proto/serializer.h"
+#include "util/parallel_for.h"
 #include "util/util.h"
 
+using cert_trans::Counter;
+using cert_trans::Latency;
 using cert_trans::serialization::SerializeResult;
 using ct::LogEntry;
 using ct::MerkleAuditProof;
 using ct::SignedCertificateTimestamp;
 using ct::SignedTreeHead;
+using std::chrono::milliseconds;
+using std::function;
+using std::map;
 using std::string;
+using std::vector;
+
+namespace {
+
+
+// Number of consecutive signatures checked by each task of the batch
+// verifications, so that tasks are worth scheduling.
+const size_t kSignaturesPerTask = 64;
+
+
+Counter<string, string>* log_verifier_signature_checks =
+    Counter<string, string>::New("log_verifier_signature_checks", "type",
+                                 "result",
+                                 "Number of SCTs and STHs verified in "
+                                 "batches, broken down by type and "
+                                 "result.");
+
+Latency<milliseconds, string> log_verifier_batch_latency_ms(
+    "log_verifier_batch_latency_ms", "type",
+    "Total time spent verifying batches of SCTs or STHs.");
+
+
+string ResultLabel(LogVerifier::LogVerifyResult result) {
+  switch (result) {
+    case LogVerifier::VERIFY_OK:
+      return "ok";
+    case LogVerifier::INVALID_FORMAT:
+      return "invalid_format";
+    case LogVerifier::INVALID_TIMESTAMP:
+      return "invalid_timestamp";
+    case LogVerifier::INCONSISTENT_TIMESTAMPS:
+      return "inconsistent_timestamps";
+    case LogVerifier::INVALID_SIGNATURE:
+      return "invalid_signature";
+    case LogVerifier::INVALID_MERKLE_PATH:
+      return "invalid_merkle_path";
+  }
+  LOG(FATAL) << "unknown value for LogVerifyResult enum: " << result;
+  abort();
+}
+
+
+// Sets |results| to |verify| of each index up to its size, on
+// |executor| if it is not NULL, and records the results as |type|.
+void VerifyAll(const string& type, util::Executor* executor,
+               const function<LogVerifier::LogVerifyResult(size_t)>& verify,
+               vector<LogVerifier::LogVerifyResult>* results) {
+  const cert_trans::ScopedLatency latency(
+      log_verifier_batch_latency_ms.GetScopedLatency(type));
+  const auto verify_range([&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      (*results)[i] = verify(i);
+    }
+  });
+  if (executor && results->size() > kSignaturesPerTask) {
+    util::ParallelFor(executor, (results->size() + kSignaturesPerTask - 1) /
+                                    kSignaturesPerTask,
+                      [&](size_t task) {
+                        verify_range(task * kSignaturesPerTask,
+                                     std::min(results->size(),
+                                              (task + 1) *
+                                                  kSignaturesPerTask));
+                      });
+  } else {
+    verify_range(0, results->size());
+  }
+  for (const LogVerifier::LogVerifyResult result : *results) {
+    log_verifier_signature_checks->Increment(type, ResultLabel(result));
+  }
+}
+
+
+// The tree head an audit proof was signed for, if its root is |root|.
+SignedTreeHead TreeHeadForProof(const MerkleAuditProof& merkle_proof,
+                                const string& root) {
+  SignedTreeHead sth;
+  sth.set_version(merkle_proof.version());
+  sth.mutable_id()->CopyFrom(merkle_proof.id());
+  sth.set_timestamp(merkle_proof.timestamp());
+  sth.set_tree_size(merkle_proof.tree_size());
+  sth.set_sha256_root_hash(root);
+  sth.mutable_signature()->CopyFrom(merkle_proof.tree_head_signature());
+  return sth;
+}
+
+
+}  // namespace
 
 LogVerifier::LogVerifier(LogSigVerifier* sig_verifier,
                          MerkleVerifier* merkle_verifier)
@@ -100,19 +199,116 @@ LogVerifier::LogVerifyResult LogVerifier::VerifyMerkleAuditProof(
   if (root_hash.empty())
     return INVALID_MERKLE_PATH;
 
-  SignedTreeHead sth;
-  sth.set_version(merkle_proof.version());
-  sth.mutable_id()->CopyFrom(merkle_proof.id());
-  sth.set_timestamp(merkle_proof.timestamp());
-  sth.set_tree_size(merkle_proof.tree_size());
-  sth.set_sha256_root_hash(root_hash);
-  sth.mutable_signature()->CopyFrom(merkle_proof.tree_head_signature());
-
-  if (sig_verifier_->VerifySTHSignature(sth) != LogSigVerifier::OK)
+  if (sig_verifier_->VerifySTHSignature(TreeHeadForProof(
+          merkle_proof, root_hash)) != LogSigVerifier::OK)
     return INVALID_SIGNATURE;
   return VERIFY_OK;
 }
 
+vector<LogVerifier::LogVerifyResult> LogVerifier::VerifyMerkleAuditProofs(
+    const vector<AuditProofToVerify>& proofs, util::Executor* executor) const {
+  const uint64_t latest(util::TimeInMilliseconds() + 1000);
+  vector<LogVerifyResult> results(proofs.size(), VERIFY_OK);
+  vector<MerkleVerifier::PathToVerify> paths(proofs.size());
+  // The proofs for each tree head (without its root, which the proofs
+  // do not include), by serialized tree head.
+  map<string, vector<size_t>> by_tree_head;
+  for (size_t i = 0; i < proofs.size(); ++i) {
+    const MerkleAuditProof& merkle_proof(*proofs[i].merkle_proof);
+    if (!IsBetween(merkle_proof.timestamp(), proofs[i].sct->timestamp(),
+                   latest)) {
+      results[i] = INCONSISTENT_TIMESTAMPS;
+      continue;
+    }
+
+    MerkleVerifier::PathToVerify* const path(&paths[i]);
+    if (Serializer::SerializeSCTMerkleTreeLeaf(*proofs[i].sct,
+                                               *proofs[i].entry,
+                                               &path->data) !=
+        SerializeResult::OK) {
+      results[i] = INVALID_FORMAT;
+      continue;
+    }
+    // Leaf indexing in the MerkleTree starts from 1.
+    path->leaf = merkle_proof.leaf_index() + 1;
+    path->path.assign(merkle_proof.path_node().begin(),
+                      merkle_proof.path_node().end());
+    by_tree_head[TreeHeadForProof(merkle_proof, string())
+                     .SerializeAsString()].push_back(i);
+  }
+
+  for (const auto& tree_head : by_tree_head) {
+    const vector<size_t>& group(tree_head.second);
+    const size_t tree_size(proofs[group[0]].merkle_proof->tree_size());
+
+    // Find the root the tree head was signed with, from the first proof
+    // whose root its signature verifies.
+    string root;
+    size_t first(0);
+    for (; first < group.size(); ++first) {
+      const size_t i(group[first]);
+      root = merkle_verifier_->RootFromPath(paths[i].leaf, tree_size,
+                                            paths[i].path, paths[i].data);
+      if (root.empty()) {
+        results[i] = INVALID_MERKLE_PATH;
+      } else if (sig_verifier_->VerifySTHSignature(TreeHeadForProof(
+                     *proofs[i].merkle_proof, root)) != LogSigVerifier::OK) {
+        results[i] = INVALID_SIGNATURE;
+      } else {
+        break;
+      }
+    }
+    if (first == group.size()) {
+      continue;
+    }
+
+    vector<MerkleVerifier::PathToVerify> rest;
+    rest.reserve(group.size() - first - 1);
+    for (size_t j = first + 1; j < group.size(); ++j) {
+      rest.emplace_back(std::move(paths[group[j]]));
+    }
+    const vector<bool> valid(
+        merkle_verifier_->VerifyPaths(tree_size, root, rest, executor));
+    for (size_t j = first + 1; j < group.size(); ++j) {
+      if (!valid[j - first - 1]) {
+        // Find out why, which is rare enough.
+        const AuditProofToVerify& proof(proofs[group[j]]);
+        results[group[j]] = VerifyMerkleAuditProof(*proof.entry, *proof.sct,
+                                                   *proof.merkle_proof);
+      }
+    }
+  }
+  return results;
+}
+
+vector<LogVerifier::LogVerifyResult>
+LogVerifier::VerifySignedCertificateTimestamps(const vector<SCTToVerify>& scts,
+                                               util::Executor* executor) const {
+  // The same bounds as VerifySignedCertificateTimestamp().
+  const uint64_t latest(util::TimeInMilliseconds() + 1000);
+  vector<LogVerifyResult> results(scts.size());
+  VerifyAll("sct", executor,
+            [this, &scts, latest](size_t i) {
+              return VerifySignedCertificateTimestamp(*scts[i].entry,
+                                                      *scts[i].sct, 0, latest);
+            },
+            &results);
+  return results;
+}
+
+vector<LogVerifier::LogVerifyResult> LogVerifier::VerifySignedTreeHeads(
+    const vector<const SignedTreeHead*>& sths,
+    util::Executor* executor) const {
+  const uint64_t latest(util::TimeInMilliseconds() + 1000);
+  vector<LogVerifyResult> results(sths.size());
+  VerifyAll("sth", executor,
+            [this, &sths, latest](size_t i) {
+              return VerifySignedTreeHead(*sths[i], 0, latest);
+            },
+            &results);
+  return results;
+}
+
 /* static */
 bool LogVerifier::IsBetween(uint64_t timestamp, uint64_t earliest,
                             uint64_t latest) {
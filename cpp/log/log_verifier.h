@@ -3,12 +3,18 @@
 
 #include <glog/logging.h>
 #include <stdint.h>
+#include <string>
+#include <vector>
 
 #include "log/log_signer.h"
 #include "proto/ct.pb.h"
 
 class MerkleVerifier;
 
+namespace util {
+class Executor;
+}  // namespace util
+
 // A verifier for verifying signed statements of the log.
 // TODO(ekasper): unit tests.
 class LogVerifier {
@@ -108,6 +114,43 @@ class LogVerifier {
       const ct::LogEntry& entry, const ct::SignedCertificateTimestamp& sct,
       const ct::MerkleAuditProof& merkle_proof) const;
 
+  // The arguments of one VerifyMerkleAuditProof() call, which must
+  // outlive the VerifyMerkleAuditProofs() call.
+  struct AuditProofToVerify {
+    const ct::LogEntry* entry;
+    const ct::SignedCertificateTimestamp* sct;
+    const ct::MerkleAuditProof* merkle_proof;
+  };
+
+  // Returns, for each of |proofs|, what VerifyMerkleAuditProof() would
+  // return for it. The signature of each distinct tree head is only
+  // verified once, and the paths into the same tree head are verified
+  // together (see MerkleVerifier::VerifyPaths()), on |executor| if it is
+  // not NULL.
+  std::vector<LogVerifyResult> VerifyMerkleAuditProofs(
+      const std::vector<AuditProofToVerify>& proofs,
+      util::Executor* executor = nullptr) const;
+
+  // The arguments of one VerifySignedCertificateTimestamp() call, which
+  // must outlive the VerifySignedCertificateTimestamps() call.
+  struct SCTToVerify {
+    const ct::LogEntry* entry;
+    const ct::SignedCertificateTimestamp* sct;
+  };
+
+  // Returns, for each of |scts|, what VerifySignedCertificateTimestamp()
+  // would return for it, verifying the signatures in parallel on
+  // |executor| if it is not NULL. SCTs from other logs should be
+  // filtered out by KeyID() first: they just fail to verify.
+  std::vector<LogVerifyResult> VerifySignedCertificateTimestamps(
+      const std::vector<SCTToVerify>& scts,
+      util::Executor* executor = nullptr) const;
+
+  // Same, for VerifySignedTreeHead().
+  std::vector<LogVerifyResult> VerifySignedTreeHeads(
+      const std::vector<const ct::SignedTreeHead*>& sths,
+      util::Executor* executor = nullptr) const;
+
   bool VerifyConsistency(const ct::SignedTreeHead& sth1,
                          const ct::SignedTreeHead& sth2,
                          const std::vector<std::string>& proof) const;
@@ -1,25 +1,58 @@
 #include "log/logged_entry.h"
 
+#include "merkletree/tree_hasher.h"
 #include "proto/cert_serializer.h"
 #include "proto/serializer.h"
 #include "util/util.h"
 
 using cert_trans::serialization::SerializeResult;
 using ct::CertInfo;
+using google::protobuf::RepeatedPtrField;
 using ct::LogEntry;
 using ct::PreCert;
 using ct::SignedCertificateTimestamp;
+using std::function;
 using std::string;
 using util::RandomString;
 
 namespace cert_trans {
+namespace {
+
+
+// Returns nullptr for the types of entries without a chain.
+RepeatedPtrField<string>* MutableChain(LogEntry* entry) {
+  switch (entry->type()) {
+    case ct::X509_ENTRY:
+      return entry->mutable_x509_entry()->mutable_certificate_chain();
+    case ct::PRECERT_ENTRY:
+      return entry->mutable_precert_entry()->mutable_precertificate_chain();
+    default:
+      return nullptr;
+  }
+}
+
+
+}  // namespace
 
 
 string LoggedEntry::Hash() const {
+  if (IsReference()) {
+    return reference_hash();
+  }
   return Sha256Hasher::Sha256Digest(Serializer::LeafData(entry()));
 }
 
 
+LoggedEntry LoggedEntry::Reference(const string& origin_node_id) const {
+  CHECK(!IsReference());
+  LoggedEntry reference;
+  *reference.mutable_contents()->mutable_sct() = sct();
+  reference.set_reference_hash(Hash());
+  reference.set_origin_node_id(origin_node_id);
+  return reference;
+}
+
+
 bool LoggedEntry::SerializeForLeaf(string* dst) const {
   return Serializer::SerializeSCTMerkleTreeLeaf(sct(), entry(), dst) ==
          SerializeResult::OK;
@@ -49,6 +82,118 @@ bool LoggedEntry::SerializeExtraData(string* dst) const {
 }
 
 
+bool LoggedEntry::StoreSerialized() {
+  ct::LoggedEntryPB::Serialized serialized;
+  if (!SerializeForLeaf(serialized.mutable_leaf_input()) ||
+      !SerializeExtraData(serialized.mutable_extra_data()) ||
+      Serializer::SerializeSCT(sct(), serialized.mutable_sct()) !=
+          SerializeResult::OK) {
+    return false;
+  }
+  mutable_contents()->mutable_serialized()->Swap(&serialized);
+  return true;
+}
+
+
+bool LoggedEntry::StoreLeafHash(const TreeHasher& hasher) {
+  string serialized_leaf;
+  if (!SerializeForLeaf(&serialized_leaf)) {
+    return false;
+  }
+  mutable_contents()->set_leaf_hash(hasher.HashLeaf(serialized_leaf));
+  return true;
+}
+
+
+void LoggedEntry::ReplaceChainWithHashes(
+    const function<void(const string& sha256, const string& cert)>& store) {
+  CHECK(!has_chain_hashes());
+  RepeatedPtrField<string>* const chain(
+      MutableChain(mutable_contents()->mutable_entry()));
+  if (!chain || chain->empty()) {
+    return;
+  }
+
+  if (has_serialized()) {
+    mutable_contents()->mutable_serialized()->clear_extra_data();
+  }
+  RepeatedPtrField<string>* const hashes(
+      mutable_contents()->mutable_chain_sha256());
+  for (const string& cert : *chain) {
+    string* const sha256(hashes->Add());
+    *sha256 = Sha256Hasher::Sha256Digest(cert);
+    store(*sha256, cert);
+  }
+  chain->Clear();
+}
+
+
+bool LoggedEntry::RestoreChain(
+    const function<bool(const string& sha256, string* cert)>& lookup) {
+  if (!has_chain_hashes()) {
+    return true;
+  }
+  RepeatedPtrField<string>* const chain(
+      MutableChain(mutable_contents()->mutable_entry()));
+  if (!chain) {
+    return false;
+  }
+
+  chain->Clear();
+  chain->Reserve(contents().chain_sha256_size());
+  for (const string& sha256 : contents().chain_sha256()) {
+    if (!lookup(sha256, chain->Add())) {
+      return false;
+    }
+  }
+  mutable_contents()->clear_chain_sha256();
+  return true;
+}
+
+
+bool LoggedEntry::SerializeForServing(string* leaf_input, string* extra_data,
+                                      string* sct_data) const {
+  if (has_serialized()) {
+    const ct::LoggedEntryPB::Serialized& serialized(contents().serialized());
+    leaf_input->assign(serialized.leaf_input());
+    // Dropped if the chain was stored apart from the entry.
+    if (serialized.has_extra_data()) {
+      extra_data->assign(serialized.extra_data());
+    } else if (!SerializeExtraData(extra_data)) {
+      return false;
+    }
+    if (sct_data) {
+      sct_data->assign(serialized.sct());
+    }
+    return true;
+  }
+
+  return SerializeForLeaf(leaf_input) && SerializeExtraData(extra_data) &&
+         (!sct_data ||
+          Serializer::SerializeSCT(sct(), sct_data) == SerializeResult::OK);
+}
+
+
+// static
+bool LoggedEntry::SameSerializedEntry(const string& a, const string& b) {
+  if (a == b) {
+    return true;
+  }
+
+  LoggedEntry a_entry, b_entry;
+  if (!a_entry.ParseFromString(a) || !b_entry.ParseFromString(b) ||
+      (!a_entry.has_serialized() && !b_entry.has_serialized() &&
+       !a_entry.has_leaf_hash() && !b_entry.has_leaf_hash())) {
+    return false;
+  }
+  a_entry.ClearSerialized();
+  b_entry.ClearSerialized();
+  a_entry.ClearLeafHash();
+  b_entry.ClearLeafHash();
+  return a_entry == b_entry;
+}
+
+
 bool LoggedEntry::CopyFromClientLogEntry(const AsyncLogClient::Entry& entry) {
   if (entry.leaf.timestamped_entry().entry_type() != ct::X509_ENTRY &&
       entry.leaf.timestamped_entry().entry_type() != ct::PRECERT_ENTRY &&
@@ -2,11 +2,15 @@
 #define CERT_TRANS_LOG_LOGGED_ENTRY_H_
 
 #include <glog/logging.h>
+#include <functional>
+#include <string>
 
 #include "client/async_log_client.h"
 #include "merkletree/serial_hasher.h"
 #include "proto/ct.pb.h"
 
+class TreeHasher;
+
 namespace cert_trans {
 
 class LoggedEntry : private ct::LoggedEntryPB {
@@ -25,13 +29,29 @@ class LoggedEntry : private ct::LoggedEntryPB {
   using LoggedEntryPB::merkle_leaf_hash;
   using LoggedEntryPB::set_merkle_leaf_hash;
   using LoggedEntryPB::set_sequence_number;
+  using LoggedEntryPB::origin_node_id;
   using LoggedEntryPB::CopyFrom;
   void CopyFrom(const LoggedEntry& from) {
     LoggedEntryPB::CopyFrom(from);
   }
+  void Swap(LoggedEntry* other) {
+    LoggedEntryPB::Swap(other);
+  }
 
+  // For a reference (see Reference()), the hash of the entry it
+  // refers to.
   std::string Hash() const;
 
+  // A pending entry can be written to the consistent store as only a
+  // reference to it, when its whole contents are kept by the node which
+  // took it (see PendingEntryStore): its SCT and hash, and the ID of
+  // that node, |origin_node_id|. This returns such a reference to this
+  // entry.
+  LoggedEntry Reference(const std::string& origin_node_id) const;
+  bool IsReference() const {
+    return has_reference_hash();
+  }
+
   uint64_t timestamp() const {
     return sct().timestamp();
   }
@@ -41,6 +61,8 @@ class LoggedEntry : private ct::LoggedEntryPB {
   }
 
   ct::SignedCertificateTimestamp* mutable_sct() {
+    ClearSerialized();
+    ClearLeafHash();
     return mutable_contents()->mutable_sct();
   }
 
@@ -49,6 +71,8 @@ class LoggedEntry : private ct::LoggedEntryPB {
   }
 
   ct::LogEntry* mutable_entry() {
+    ClearSerialized();
+    ClearLeafHash();
     return mutable_contents()->mutable_entry();
   }
 
@@ -63,6 +87,59 @@ class LoggedEntry : private ct::LoggedEntryPB {
   bool SerializeForLeaf(std::string* dst) const;
   bool SerializeExtraData(std::string* dst) const;
 
+  // Stores the encodings of the entry served by get-entries along with
+  // it, so that SerializeForServing() does not have to encode them
+  // again. They are dropped if the entry is modified.
+  bool StoreSerialized();
+  bool has_serialized() const {
+    return contents().has_serialized();
+  }
+  void ClearSerialized() {
+    mutable_contents()->clear_serialized();
+  }
+
+  // Stores the Merkle leaf hash of the entry along with it, as computed
+  // by |hasher|, so that it does not have to be hashed again whenever
+  // the tree is built from the database. It is dropped if the entry is
+  // modified.
+  bool StoreLeafHash(const TreeHasher& hasher);
+  bool has_leaf_hash() const {
+    return contents().has_leaf_hash();
+  }
+  const std::string& leaf_hash() const {
+    return contents().leaf_hash();
+  }
+  void ClearLeafHash() {
+    mutable_contents()->clear_leaf_hash();
+  }
+
+  // The databases can store the chain of the entry apart from it, as
+  // the SHA-256 hashes of its certificates (see ChainCertStore).
+  //
+  // Replaces the chain with the hashes, passing each certificate and
+  // its hash to |store|. The stored encoding of the extra data is
+  // dropped, as it holds the chain.
+  void ReplaceChainWithHashes(
+      const std::function<void(const std::string& sha256,
+                               const std::string& cert)>& store);
+  // Puts the chain back, returning false if |lookup| does not find one
+  // of its certificates.
+  bool RestoreChain(const std::function<bool(const std::string& sha256,
+                                             std::string* cert)>& lookup);
+  bool has_chain_hashes() const {
+    return contents().chain_sha256_size() > 0;
+  }
+
+  // Fills |leaf_input| and |extra_data|, and |sct| if it is not NULL,
+  // from the stored encodings if there are any.
+  bool SerializeForServing(std::string* leaf_input, std::string* extra_data,
+                           std::string* sct) const;
+
+  // Returns whether |a| and |b|, as written by SerializeToString(), are
+  // the same entry, whether or not either has the stored encodings or
+  // leaf hash.
+  static bool SameSerializedEntry(const std::string& a, const std::string& b);
+
   // Note that this method will not fully populate the SCT.
   bool CopyFromClientLogEntry(const AsyncLogClient::Entry& entry);
 
@@ -97,6 +97,65 @@ TYPED_TEST(LoggedTest, DifferentMerkleSerialization) {
   EXPECT_NE(s1, s2);
 }
 
+TYPED_TEST(LoggedTest, StoredSerializationIsServed) {
+  TypeParam l1;
+  l1.RandomForTest();
+  std::string leaf_input, extra_data, sct;
+  EXPECT_TRUE(l1.SerializeForServing(&leaf_input, &extra_data, &sct));
+  EXPECT_FALSE(l1.has_serialized());
+
+  // The stored encodings survive the database.
+  TypeParam l2;
+  l2.CopyFrom(l1);
+  EXPECT_TRUE(l2.StoreSerialized());
+  std::string d2;
+  EXPECT_TRUE(l2.SerializeForDatabase(&d2));
+  TypeParam l3;
+  EXPECT_TRUE(l3.ParseFromDatabase(d2));
+  EXPECT_TRUE(l3.has_serialized());
+
+  std::string leaf_input3, extra_data3, sct3;
+  EXPECT_TRUE(l3.SerializeForServing(&leaf_input3, &extra_data3, &sct3));
+  EXPECT_EQ(leaf_input, leaf_input3);
+  EXPECT_EQ(extra_data, extra_data3);
+  EXPECT_EQ(sct, sct3);
+  EXPECT_TRUE(l3.SerializeForServing(&leaf_input3, &extra_data3, nullptr));
+  EXPECT_EQ(leaf_input, leaf_input3);
+}
+
+TYPED_TEST(LoggedTest, ModifyingDropsStoredSerialization) {
+  TypeParam l1;
+  l1.RandomForTest();
+  EXPECT_TRUE(l1.StoreSerialized());
+  l1.mutable_sct()->set_timestamp(l1.sct().timestamp() + 1);
+  EXPECT_FALSE(l1.has_serialized());
+
+  EXPECT_TRUE(l1.StoreSerialized());
+  l1.mutable_entry();
+  EXPECT_FALSE(l1.has_serialized());
+}
+
+TYPED_TEST(LoggedTest, SameSerializedEntry) {
+  TypeParam l1;
+  l1.RandomForTest();
+  l1.set_sequence_number(42);
+  std::string s1;
+  EXPECT_TRUE(l1.SerializeToString(&s1));
+
+  TypeParam l2;
+  l2.CopyFrom(l1);
+  EXPECT_TRUE(l2.StoreSerialized());
+  std::string s2;
+  EXPECT_TRUE(l2.SerializeToString(&s2));
+  EXPECT_NE(s1, s2);
+  EXPECT_TRUE(TypeParam::SameSerializedEntry(s1, s2));
+  EXPECT_TRUE(TypeParam::SameSerializedEntry(s2, s2));
+
+  l2.set_sequence_number(43);
+  EXPECT_TRUE(l2.SerializeToString(&s2));
+  EXPECT_FALSE(TypeParam::SameSerializedEntry(s1, s2));
+}
+
 int main(int argc, char** argv) {
   cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
   ConfigureSerializerForV1CT();
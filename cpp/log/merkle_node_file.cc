@@ -0,0 +1,259 @@
+#include "log/merkle_node_file.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glog/logging.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using std::string;
+using std::unique_ptr;
+using util::Status;
+using util::StatusOr;
+
+namespace cert_trans {
+namespace {
+
+
+const char kMagic[] = "CTNODES1";
+const size_t kMagicSize = 8;
+const size_t kHeaderSize = 16;
+
+
+string Header(size_t node_size) {
+  string header(kMagic, kMagicSize);
+  for (int i = 0; i < 4; ++i) {
+    header.push_back(static_cast<char>((node_size >> (8 * i)) & 0xff));
+  }
+  header.append(4, '\0');
+  return header;
+}
+
+
+Status ErrnoStatus(const string& what, const string& path) {
+  return Status(util::error::INTERNAL,
+                what + " " + path + ": " + strerror(errno));
+}
+
+
+// Checks that the |size| bytes at |data| start with a header for
+// |node_size| byte nodes.
+Status CheckHeader(const string& path, const char* data, size_t size,
+                   size_t node_size) {
+  if (size < kHeaderSize || string(data, kHeaderSize) != Header(node_size)) {
+    return Status(util::error::FAILED_PRECONDITION,
+                  "not a Merkle node file for " + std::to_string(node_size) +
+                      " byte nodes: " + path);
+  }
+  return ::util::OkStatus();
+}
+
+
+Status WriteFully(int fd, const char* data, size_t size) {
+  while (size > 0) {
+    const ssize_t written(write(fd, data, size));
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return Status(util::error::INTERNAL,
+                    string("write failed: ") + strerror(errno));
+    }
+    data += written;
+    size -= written;
+  }
+  return ::util::OkStatus();
+}
+
+
+}  // namespace
+
+
+// static
+StatusOr<unique_ptr<MerkleNodeFile>> MerkleNodeFile::Open(const string& path,
+                                                          size_t node_size) {
+  CHECK_GT(node_size, 0U);
+  const int fd(open(path.c_str(), O_RDWR | O_CREAT, 0644));
+  if (fd < 0) {
+    return ErrnoStatus("cannot open", path);
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    const Status status(ErrnoStatus("cannot stat", path));
+    close(fd);
+    return status;
+  }
+
+  const string header(Header(node_size));
+  size_t leaf_count(0);
+  if (st.st_size == 0) {
+    Status status(WriteFully(fd, header.data(), header.size()));
+    if (status.ok() && fdatasync(fd) != 0) {
+      status = ErrnoStatus("cannot sync", path);
+    }
+    if (!status.ok()) {
+      close(fd);
+      return status;
+    }
+  } else {
+    char existing[kHeaderSize];
+    const ssize_t got(pread(fd, existing, kHeaderSize, 0));
+    const Status status(
+        CheckHeader(path, existing, got < 0 ? 0 : got, node_size));
+    if (!status.ok()) {
+      close(fd);
+      return status;
+    }
+    leaf_count = (st.st_size - kHeaderSize) / node_size;
+    if (ftruncate(fd, kHeaderSize + leaf_count * node_size) != 0) {
+      const Status status(ErrnoStatus("cannot truncate", path));
+      close(fd);
+      return status;
+    }
+  }
+
+  if (lseek(fd, 0, SEEK_END) < 0) {
+    const Status status(ErrnoStatus("cannot seek", path));
+    close(fd);
+    return status;
+  }
+
+  return unique_ptr<MerkleNodeFile>(
+      new MerkleNodeFile(fd, node_size, leaf_count));
+}
+
+
+MerkleNodeFile::MerkleNodeFile(int fd, size_t node_size, size_t leaf_count)
+    : fd_(fd), node_size_(node_size), flushed_count_(leaf_count) {
+}
+
+
+MerkleNodeFile::~MerkleNodeFile() {
+  const Status status(Flush());
+  LOG_IF(WARNING, !status.ok()) << "Lost unflushed leaf hashes: " << status;
+  close(fd_);
+}
+
+
+void MerkleNodeFile::Append(const string& leaf_hash) {
+  CHECK_EQ(node_size_, leaf_hash.size());
+  pending_.append(leaf_hash);
+}
+
+
+Status MerkleNodeFile::Flush() {
+  if (pending_.empty()) {
+    return ::util::OkStatus();
+  }
+
+  Status status(WriteFully(fd_, pending_.data(), pending_.size()));
+  if (status.ok() && fdatasync(fd_) != 0) {
+    status = Status(util::error::INTERNAL,
+                    string("fdatasync failed: ") + strerror(errno));
+  }
+  if (!status.ok()) {
+    // Drop whatever part of the buffer made it to the file, so that
+    // the next attempt starts from a known position.
+    const off_t size(kHeaderSize + flushed_count_ * node_size_);
+    if (ftruncate(fd_, size) != 0 || lseek(fd_, size, SEEK_SET) < 0) {
+      PLOG(WARNING) << "Cannot roll back a failed write";
+    }
+    return status;
+  }
+
+  flushed_count_ += pending_.size() / node_size_;
+  pending_.clear();
+  return ::util::OkStatus();
+}
+
+
+Status MerkleNodeFile::Truncate(size_t leaf_count) {
+  CHECK_LE(leaf_count, LeafCount());
+  if (leaf_count >= flushed_count_) {
+    pending_.resize((leaf_count - flushed_count_) * node_size_);
+    return ::util::OkStatus();
+  }
+
+  pending_.clear();
+  const off_t size(kHeaderSize + leaf_count * node_size_);
+  if (ftruncate(fd_, size) != 0 || lseek(fd_, size, SEEK_SET) < 0 ||
+      fdatasync(fd_) != 0) {
+    return Status(util::error::INTERNAL,
+                  string("truncate failed: ") + strerror(errno));
+  }
+  flushed_count_ = leaf_count;
+  return ::util::OkStatus();
+}
+
+
+// static
+StatusOr<unique_ptr<MappedMerkleNodeFile>> MappedMerkleNodeFile::Open(
+    const string& path, size_t node_size) {
+  CHECK_GT(node_size, 0U);
+  const int fd(open(path.c_str(), O_RDONLY));
+  if (fd < 0) {
+    return ErrnoStatus("cannot open", path);
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    const Status status(ErrnoStatus("cannot stat", path));
+    close(fd);
+    return status;
+  }
+  const size_t size(st.st_size);
+  if (size < kHeaderSize) {
+    close(fd);
+    return CheckHeader(path, nullptr, size, node_size);
+  }
+
+  void* const data(mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0));
+  // The mapping stays valid after the descriptor is closed.
+  const Status map_status(data == MAP_FAILED ? ErrnoStatus("cannot map", path)
+                                             : ::util::OkStatus());
+  close(fd);
+  if (!map_status.ok()) {
+    return map_status;
+  }
+
+  const Status status(
+      CheckHeader(path, static_cast<const char*>(data), size, node_size));
+  if (!status.ok()) {
+    munmap(data, size);
+    return status;
+  }
+
+  return unique_ptr<MappedMerkleNodeFile>(
+      new MappedMerkleNodeFile(static_cast<const char*>(data), size, node_size,
+                               (size - kHeaderSize) / node_size));
+}
+
+
+MappedMerkleNodeFile::MappedMerkleNodeFile(const char* data,
+                                           size_t mapped_size,
+                                           size_t node_size,
+                                           size_t leaf_count)
+    : data_(data),
+      mapped_size_(mapped_size),
+      node_size_(node_size),
+      leaf_count_(leaf_count) {
+  // Readers load the whole file front to back.
+  madvise(const_cast<char*>(data_), mapped_size_, MADV_SEQUENTIAL);
+}
+
+
+MappedMerkleNodeFile::~MappedMerkleNodeFile() {
+  munmap(const_cast<char*>(data_), mapped_size_);
+}
+
+
+const char* MappedMerkleNodeFile::LeafHash(size_t index) const {
+  CHECK_LT(index, leaf_count_);
+  return data_ + kHeaderSize + index * node_size_;
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,101 @@
+#ifndef CERT_TRANS_LOG_MERKLE_NODE_FILE_H_
+#define CERT_TRANS_LOG_MERKLE_NODE_FILE_H_
+
+#include <stddef.h>
+#include <memory>
+#include <string>
+
+#include "util/status.h"
+#include "util/statusor.h"
+
+namespace cert_trans {
+
+
+// On-disk, append-only record of the leaf hashes of a Merkle tree, in
+// sequence number order. This lets a server rebuild its in-memory tree
+// at startup from the hashes alone, without reading and rehashing every
+// entry in the database; the interior nodes are cheap to recompute.
+//
+// The file format is a 16 byte header (the magic "CTNODES1", then the
+// node size as a little-endian 32-bit integer, then 4 zero bytes),
+// followed by the leaf hashes back to back. A trailing partial hash
+// (i.e., a torn write) is ignored.
+//
+// The file is written by the tree signer (with MerkleNodeFile) and read
+// by LogLookup (with MappedMerkleNodeFile). The contents are only as
+// trustworthy as the disk they are on, so readers must check the root
+// they compute against a signed tree head before using them.
+class MerkleNodeFile {
+ public:
+  // Opens the file at |path| for appending, creating it if it does not
+  // exist. Any trailing partial hash is truncated away.
+  static util::StatusOr<std::unique_ptr<MerkleNodeFile>> Open(
+      const std::string& path, size_t node_size);
+
+  ~MerkleNodeFile();
+  MerkleNodeFile(const MerkleNodeFile&) = delete;
+  MerkleNodeFile& operator=(const MerkleNodeFile&) = delete;
+
+  size_t NodeSize() const {
+    return node_size_;
+  }
+
+  // Number of leaf hashes in the file, including those appended but not
+  // yet flushed.
+  size_t LeafCount() const {
+    return flushed_count_ + pending_.size() / node_size_;
+  }
+
+  // Appends a leaf hash, which must be NodeSize() bytes long. The hash
+  // is buffered in memory until the next call to Flush().
+  void Append(const std::string& leaf_hash);
+
+  // Writes out the buffered leaf hashes and syncs them to disk.
+  util::Status Flush();
+
+  // Discards all the leaf hashes past the first |leaf_count|, which must
+  // not be more than LeafCount().
+  util::Status Truncate(size_t leaf_count);
+
+ private:
+  MerkleNodeFile(int fd, size_t node_size, size_t leaf_count);
+
+  const int fd_;
+  const size_t node_size_;
+  size_t flushed_count_;
+  std::string pending_;
+};
+
+
+// Read-only, memory-mapped view of a file written by MerkleNodeFile, as
+// it was when opened.
+class MappedMerkleNodeFile {
+ public:
+  static util::StatusOr<std::unique_ptr<MappedMerkleNodeFile>> Open(
+      const std::string& path, size_t node_size);
+
+  ~MappedMerkleNodeFile();
+  MappedMerkleNodeFile(const MappedMerkleNodeFile&) = delete;
+  MappedMerkleNodeFile& operator=(const MappedMerkleNodeFile&) = delete;
+
+  size_t LeafCount() const {
+    return leaf_count_;
+  }
+
+  // Pointer to the node size bytes of the |index|th leaf hash.
+  const char* LeafHash(size_t index) const;
+
+ private:
+  MappedMerkleNodeFile(const char* data, size_t mapped_size,
+                       size_t node_size, size_t leaf_count);
+
+  const char* const data_;
+  const size_t mapped_size_;
+  const size_t node_size_;
+  const size_t leaf_count_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_MERKLE_NODE_FILE_H_
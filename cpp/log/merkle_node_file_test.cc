@@ -0,0 +1,147 @@
+#include "log/merkle_node_file.h"
+
+#include <gtest/gtest.h>
+#include <unistd.h>
+#include <memory>
+#include <string>
+
+#include "util/status_test_util.h"
+#include "util/test_db.h"
+#include "util/testing.h"
+
+namespace cert_trans {
+namespace {
+
+using std::string;
+using std::unique_ptr;
+using util::StatusOr;
+using util::testing::StatusIs;
+
+const size_t kNodeSize = 32;
+
+
+string TestHash(int i) {
+  return string(kNodeSize, static_cast<char>('a' + i));
+}
+
+
+class MerkleNodeFileTest : public ::testing::Test {
+ protected:
+  MerkleNodeFileTest() : path_(tmp_.TmpStorageDir() + "/nodes") {
+  }
+
+  unique_ptr<MerkleNodeFile> OpenForWrite() {
+    StatusOr<unique_ptr<MerkleNodeFile>> file(
+        MerkleNodeFile::Open(path_, kNodeSize));
+    CHECK(file.ok()) << file.status();
+    return std::move(file.ValueOrDie());
+  }
+
+  unique_ptr<MappedMerkleNodeFile> OpenForRead() {
+    StatusOr<unique_ptr<MappedMerkleNodeFile>> file(
+        MappedMerkleNodeFile::Open(path_, kNodeSize));
+    CHECK(file.ok()) << file.status();
+    return std::move(file.ValueOrDie());
+  }
+
+  TmpStorage tmp_;
+  const string path_;
+};
+
+
+TEST_F(MerkleNodeFileTest, AppendAndRead) {
+  {
+    unique_ptr<MerkleNodeFile> file(OpenForWrite());
+    EXPECT_EQ(0U, file->LeafCount());
+    for (int i = 0; i < 5; ++i) {
+      file->Append(TestHash(i));
+    }
+    EXPECT_EQ(5U, file->LeafCount());
+    // Not flushed yet.
+    EXPECT_EQ(0U, OpenForRead()->LeafCount());
+    EXPECT_OK(file->Flush());
+  }
+
+  unique_ptr<MappedMerkleNodeFile> mapped(OpenForRead());
+  ASSERT_EQ(5U, mapped->LeafCount());
+  for (int i = 0; i < 5; ++i) {
+    EXPECT_EQ(TestHash(i), string(mapped->LeafHash(i), kNodeSize));
+  }
+
+  // Reopening appends after the existing hashes.
+  unique_ptr<MerkleNodeFile> file(OpenForWrite());
+  EXPECT_EQ(5U, file->LeafCount());
+  file->Append(TestHash(5));
+  EXPECT_OK(file->Flush());
+  EXPECT_EQ(6U, OpenForRead()->LeafCount());
+  EXPECT_EQ(TestHash(5), string(OpenForRead()->LeafHash(5), kNodeSize));
+}
+
+
+TEST_F(MerkleNodeFileTest, Truncate) {
+  unique_ptr<MerkleNodeFile> file(OpenForWrite());
+  for (int i = 0; i < 4; ++i) {
+    file->Append(TestHash(i));
+  }
+  EXPECT_OK(file->Flush());
+  file->Append(TestHash(4));
+
+  // Within the unflushed hashes.
+  EXPECT_OK(file->Truncate(4));
+  EXPECT_EQ(4U, file->LeafCount());
+
+  // Within the flushed ones.
+  EXPECT_OK(file->Truncate(2));
+  EXPECT_EQ(2U, file->LeafCount());
+  EXPECT_EQ(2U, OpenForRead()->LeafCount());
+
+  file->Append(TestHash(7));
+  EXPECT_OK(file->Flush());
+  unique_ptr<MappedMerkleNodeFile> mapped(OpenForRead());
+  ASSERT_EQ(3U, mapped->LeafCount());
+  EXPECT_EQ(TestHash(1), string(mapped->LeafHash(1), kNodeSize));
+  EXPECT_EQ(TestHash(7), string(mapped->LeafHash(2), kNodeSize));
+}
+
+
+TEST_F(MerkleNodeFileTest, IgnoresTornWrite) {
+  {
+    unique_ptr<MerkleNodeFile> file(OpenForWrite());
+    file->Append(TestHash(0));
+    file->Append(TestHash(1));
+    EXPECT_OK(file->Flush());
+  }
+  // Chop off half of the last hash.
+  ASSERT_EQ(0, truncate(path_.c_str(), 16 + kNodeSize + kNodeSize / 2));
+
+  EXPECT_EQ(1U, OpenForRead()->LeafCount());
+  unique_ptr<MerkleNodeFile> file(OpenForWrite());
+  EXPECT_EQ(1U, file->LeafCount());
+  file->Append(TestHash(2));
+  EXPECT_OK(file->Flush());
+
+  unique_ptr<MappedMerkleNodeFile> mapped(OpenForRead());
+  ASSERT_EQ(2U, mapped->LeafCount());
+  EXPECT_EQ(TestHash(2), string(mapped->LeafHash(1), kNodeSize));
+}
+
+
+TEST_F(MerkleNodeFileTest, RejectsOtherFiles) {
+  EXPECT_FALSE(MappedMerkleNodeFile::Open(path_, kNodeSize).ok());
+
+  OpenForWrite();
+  EXPECT_THAT(MerkleNodeFile::Open(path_, kNodeSize + 1).status(),
+              StatusIs(util::error::FAILED_PRECONDITION));
+  EXPECT_THAT(MappedMerkleNodeFile::Open(path_, kNodeSize + 1).status(),
+              StatusIs(util::error::FAILED_PRECONDITION));
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -17,6 +17,13 @@ class MockConsistentStore : public ConsistentStore {
 
   MOCK_METHOD1_T(AddPendingEntry, util::Status(LoggedEntry* entry));
 
+  MOCK_METHOD2_T(AddPendingEntryAsync,
+                 void(LoggedEntry* entry, util::Task* task));
+
+  MOCK_METHOD2_T(AddPendingEntries,
+                 void(const std::vector<LoggedEntry*>& entries,
+                      std::vector<util::Status>* statuses));
+
   MOCK_CONST_METHOD2_T(GetPendingEntryForHash,
                        util::Status(const std::string& hash,
                                     EntryHandle<LoggedEntry>* entry));
@@ -50,6 +57,10 @@ class MockConsistentStore : public ConsistentStore {
                  void(const ConsistentStore::ClusterConfigCallback& cb,
                       util::Task* task));
 
+  MOCK_METHOD2_T(WatchPendingEntries,
+                 void(const ConsistentStore::PendingEntriesCallback& cb,
+                      util::Task* task));
+
   MOCK_METHOD1(SetClusterConfig, util::Status(const ct::ClusterConfig&));
 
   MOCK_METHOD0(CleanupOldEntries, util::StatusOr<int64_t>());
@@ -0,0 +1,150 @@
+#include "log/pending_entry_store.h"
+
+#include <glog/logging.h>
+#include <functional>
+
+#include "monitoring/monitoring.h"
+
+using ct::SignedTreeHead;
+using std::bind;
+using std::lock_guard;
+using std::make_shared;
+using std::mutex;
+using std::placeholders::_1;
+using std::shared_ptr;
+using std::string;
+using std::unique_lock;
+using std::vector;
+
+namespace cert_trans {
+namespace {
+
+
+static Gauge<>* pending_entry_store_entries(
+    Gauge<>::New("pending_entry_store_entries",
+                 "Number of pending entries kept by this node, whose "
+                 "references only are in the consistent store."));
+
+
+// As in TreeSigner: the contents, the key and the map node.
+size_t EntryBytes(const LoggedEntry& entry) {
+  return entry.contents().ByteSize() + entry.Hash().size() + 128;
+}
+
+
+}  // namespace
+
+
+PendingEntryStore::PendingEntryStore(ReadOnlyDatabase* db,
+                                     util::Executor* executor)
+    : db_(CHECK_NOTNULL(db)),
+      executor_(CHECK_NOTNULL(executor)),
+      callback_(bind(&PendingEntryStore::OnNewSTH, this, _1)),
+      bytes_(0),
+      prune_pending_(false),
+      pruning_(false),
+      memory_("pending_entry_store", [this]() {
+        lock_guard<mutex> lock(lock_);
+        return bytes_;
+      }) {
+  db_->AddNotifySTHCallback(&callback_);
+}
+
+
+PendingEntryStore::~PendingEntryStore() {
+  db_->RemoveNotifySTHCallback(&callback_);
+
+  unique_lock<mutex> lock(lock_);
+  prune_pending_ = false;
+  pruned_.wait(lock, [this]() { return !pruning_; });
+}
+
+
+bool PendingEntryStore::Add(const LoggedEntry& entry) {
+  CHECK(!entry.IsReference());
+  const string hash(entry.Hash());
+  lock_guard<mutex> lock(lock_);
+  if (!entries_.emplace(hash, make_shared<const LoggedEntry>(entry)).second) {
+    return false;
+  }
+  bytes_ += EntryBytes(entry);
+  pending_entry_store_entries->Set(entries_.size());
+  return true;
+}
+
+
+void PendingEntryStore::Remove(const string& hash) {
+  lock_guard<mutex> lock(lock_);
+  const auto it(entries_.find(hash));
+  if (it == entries_.end()) {
+    return;
+  }
+  bytes_ -= EntryBytes(*it->second);
+  entries_.erase(it);
+  pending_entry_store_entries->Set(entries_.size());
+}
+
+
+shared_ptr<const LoggedEntry> PendingEntryStore::Lookup(
+    const string& hash) const {
+  lock_guard<mutex> lock(lock_);
+  const auto it(entries_.find(hash));
+  return it == entries_.end() ? nullptr : it->second;
+}
+
+
+size_t PendingEntryStore::Size() const {
+  lock_guard<mutex> lock(lock_);
+  return entries_.size();
+}
+
+
+void PendingEntryStore::OnNewSTH(const SignedTreeHead&) {
+  lock_guard<mutex> lock(lock_);
+  if (entries_.empty()) {
+    return;
+  }
+  prune_pending_ = true;
+  // A run in progress goes over the entries again once it is done.
+  if (!pruning_) {
+    pruning_ = true;
+    executor_->Add(bind(&PendingEntryStore::Prune, this));
+  }
+}
+
+
+void PendingEntryStore::Prune() {
+  unique_lock<mutex> lock(lock_);
+  while (prune_pending_) {
+    prune_pending_ = false;
+    vector<string> hashes;
+    hashes.reserve(entries_.size());
+    for (const auto& entry : entries_) {
+      hashes.push_back(entry.first);
+    }
+    lock.unlock();
+
+    vector<LoggedEntry> found;
+    const vector<ReadOnlyDatabase::LookupResult> results(
+        db_->LookupByHashes(hashes, &found));
+    CHECK_EQ(hashes.size(), results.size());
+
+    lock.lock();
+    for (size_t i = 0; i < hashes.size(); ++i) {
+      if (results[i] != ReadOnlyDatabase::LOOKUP_OK) {
+        continue;
+      }
+      const auto it(entries_.find(hashes[i]));
+      if (it != entries_.end()) {
+        bytes_ -= EntryBytes(*it->second);
+        entries_.erase(it);
+      }
+    }
+    pending_entry_store_entries->Set(entries_.size());
+  }
+  pruning_ = false;
+  pruned_.notify_all();
+}
+
+
+}  // namespace cert_trans
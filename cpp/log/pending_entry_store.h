@@ -0,0 +1,94 @@
+#ifndef CERT_TRANS_LOG_PENDING_ENTRY_STORE_H_
+#define CERT_TRANS_LOG_PENDING_ENTRY_STORE_H_
+
+#include <stddef.h>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "log/database.h"
+#include "log/logged_entry.h"
+#include "monitoring/memory.h"
+#include "util/executor.h"
+
+namespace cert_trans {
+
+
+// The whole pending entries taken by this node, when the consistent
+// store only holds references to them (see LoggedEntry::Reference()),
+// so that the bytes written to etcd for each do not grow with its
+// chain. The sequencer fetches them from here, through a
+// PendingEntryFetcher, to write them to its database.
+//
+// They are kept until they are in the local database, which means that
+// they have been sequenced. They are only kept in memory: the entries
+// taken by a node which restarts before they are sequenced cannot be
+// sequenced anymore, until they are submitted again.
+//
+// This class is thread-safe.
+class PendingEntryStore {
+ public:
+  // Does not take ownership of |db| or |executor|, which must outlive
+  // this instance. The entries found in |db| after each new tree head
+  // are dropped, on |executor|.
+  PendingEntryStore(ReadOnlyDatabase* db, util::Executor* executor);
+  // Waits for the pruning in progress, if any.
+  ~PendingEntryStore();
+  PendingEntryStore(const PendingEntryStore&) = delete;
+  PendingEntryStore& operator=(const PendingEntryStore&) = delete;
+
+  // Keeps |entry|, and returns true, unless an entry with the same hash
+  // is already kept.
+  bool Add(const LoggedEntry& entry);
+
+  // Drops the entry with |hash|, e.g. once it could not be made pending.
+  void Remove(const std::string& hash);
+
+  // Returns the entry with |hash|, or null.
+  std::shared_ptr<const LoggedEntry> Lookup(const std::string& hash) const;
+
+  // Number of entries kept.
+  size_t Size() const;
+
+ private:
+  void OnNewSTH(const ct::SignedTreeHead& sth);
+  // Drops the entries which are in |db_|, until there is no newer tree
+  // head.
+  void Prune();
+
+  ReadOnlyDatabase* const db_;
+  util::Executor* const executor_;
+  const ReadOnlyDatabase::NotifySTHCallback callback_;
+
+  mutable std::mutex lock_;
+  std::unordered_map<std::string, std::shared_ptr<const LoggedEntry>>
+      entries_;
+  size_t bytes_;
+  // Whether a Prune() run is needed, and whether one is running.
+  bool prune_pending_;
+  bool pruning_;
+  std::condition_variable pruned_;
+
+  const MemoryEstimate memory_;
+};
+
+
+// Gets the whole entries of references (see LoggedEntry::Reference())
+// from the nodes which hold them.
+class PendingEntryFetcher {
+ public:
+  virtual ~PendingEntryFetcher() = default;
+
+  // Returns the entries referred to by |references|, in order, with
+  // null for those which cannot be had. May block.
+  virtual std::vector<std::shared_ptr<const LoggedEntry>> Fetch(
+      const std::vector<std::shared_ptr<const LoggedEntry>>& references) = 0;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_PENDING_ENTRY_STORE_H_
@@ -0,0 +1,104 @@
+#include "log/pending_entry_store.h"
+
+#include <gtest/gtest.h>
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include "log/leveldb_db.h"
+#include "log/logged_entry.h"
+#include "log/test_db.h"
+#include "log/test_signer.h"
+#include "util/testing.h"
+#include "util/thread_pool.h"
+
+namespace cert_trans {
+namespace {
+
+using std::string;
+
+
+class PendingEntryStoreTest : public ::testing::Test {
+ protected:
+  PendingEntryStoreTest() : pool_(1), store_(test_db_.db(), &pool_) {
+  }
+
+  LoggedEntry NewEntry() {
+    LoggedEntry entry;
+    test_signer_.CreateUnique(&entry);
+    entry.clear_sequence_number();
+    return entry;
+  }
+
+  // Waits for the store to have |size| entries, for a while.
+  void WaitForSize(size_t size) {
+    for (int i = 0; i < 500 && store_.Size() != size; ++i) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    EXPECT_EQ(size, store_.Size());
+  }
+
+  TestDB<LevelDB> test_db_;
+  TestSigner test_signer_;
+  ThreadPool pool_;
+  PendingEntryStore store_;
+};
+
+
+TEST_F(PendingEntryStoreTest, KeepsEntriesOnce) {
+  const LoggedEntry entry(NewEntry());
+  EXPECT_TRUE(store_.Add(entry));
+  EXPECT_FALSE(store_.Add(entry));
+  EXPECT_EQ(1U, store_.Size());
+
+  const std::shared_ptr<const LoggedEntry> kept(store_.Lookup(entry.Hash()));
+  ASSERT_TRUE(kept);
+  TestSigner::TestEqualLoggedCerts(entry, *kept);
+  EXPECT_FALSE(store_.Lookup(test_signer_.UniqueHash()));
+
+  store_.Remove(entry.Hash());
+  EXPECT_FALSE(store_.Lookup(entry.Hash()));
+  EXPECT_EQ(0U, store_.Size());
+  EXPECT_TRUE(store_.Add(entry));
+}
+
+
+TEST_F(PendingEntryStoreTest, ReferencesMatchTheirEntries) {
+  const LoggedEntry entry(NewEntry());
+  const LoggedEntry reference(entry.Reference("node"));
+  EXPECT_TRUE(reference.IsReference());
+  EXPECT_FALSE(entry.IsReference());
+  EXPECT_EQ(entry.Hash(), reference.Hash());
+  EXPECT_EQ(entry.timestamp(), reference.timestamp());
+  EXPECT_EQ("node", reference.origin_node_id());
+  EXPECT_GT(entry.contents().ByteSize(), reference.contents().ByteSize());
+}
+
+
+TEST_F(PendingEntryStoreTest, DropsSequencedEntries) {
+  LoggedEntry sequenced(NewEntry());
+  const LoggedEntry pending(NewEntry());
+  ASSERT_TRUE(store_.Add(sequenced));
+  ASSERT_TRUE(store_.Add(pending));
+
+  sequenced.set_sequence_number(0);
+  ASSERT_EQ(Database::OK, test_db_.db()->CreateSequencedEntry(sequenced));
+  ct::SignedTreeHead sth;
+  test_signer_.CreateUnique(&sth);
+  sth.set_tree_size(1);
+  ASSERT_EQ(Database::OK, test_db_.db()->WriteTreeHead(sth));
+
+  WaitForSize(1);
+  EXPECT_FALSE(store_.Lookup(sequenced.Hash()));
+  EXPECT_TRUE(store_.Lookup(pending.Hash()));
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,133 @@
+#include "log/proof_cache.h"
+
+#include <glog/logging.h>
+
+#include "monitoring/counter.h"
+#include "monitoring/monitoring.h"
+
+using std::lock_guard;
+using std::mutex;
+using std::string;
+using std::vector;
+
+namespace cert_trans {
+namespace {
+
+
+const size_t kNumShards = 16;
+
+
+Counter<string, string>* proof_cache_lookups =
+    Counter<string, string>::New("proof_cache_lookups", "proof", "result",
+                                 "Number of proof cache lookups, broken down "
+                                 "by proof type and hit or miss.");
+
+
+}  // namespace
+
+
+size_t ProofCache::KeyHash::operator()(const Key& key) const {
+  // Mix the fields so that a run of leaf indices with the same tree size
+  // spreads over all the shards.
+  uint64_t h(static_cast<uint64_t>(key.first) * 0x9e3779b97f4a7c15ULL);
+  h ^= static_cast<uint64_t>(key.tree_size) + 0x7f4a7c15ULL + (h << 6) +
+       (h >> 2);
+  h ^= key.kind;
+  return static_cast<size_t>(h ^ (h >> 32));
+}
+
+
+ProofCache::ProofCache(size_t max_entries)
+    : max_entries_per_shard_((max_entries + kNumShards - 1) / kNumShards),
+      shards_(new Shard[kNumShards]) {
+}
+
+
+bool ProofCache::LookupAuditPath(int64_t leaf_index, int64_t tree_size,
+                                 vector<string>* path) {
+  const bool found(Lookup(Key{AUDIT_PATH, leaf_index, tree_size}, path));
+  proof_cache_lookups->Increment("audit_path", found ? "hit" : "miss");
+  return found;
+}
+
+
+void ProofCache::InsertAuditPath(int64_t leaf_index, int64_t tree_size,
+                                 const vector<string>& path) {
+  Insert(Key{AUDIT_PATH, leaf_index, tree_size}, path);
+}
+
+
+bool ProofCache::LookupConsistencyProof(int64_t first, int64_t second,
+                                        vector<string>* proof) {
+  const bool found(Lookup(Key{CONSISTENCY_PROOF, first, second}, proof));
+  proof_cache_lookups->Increment("consistency_proof", found ? "hit" : "miss");
+  return found;
+}
+
+
+void ProofCache::InsertConsistencyProof(int64_t first, int64_t second,
+                                        const vector<string>& proof) {
+  Insert(Key{CONSISTENCY_PROOF, first, second}, proof);
+}
+
+
+void ProofCache::EvictBefore(int64_t tree_size) {
+  for (size_t i = 0; i < kNumShards; ++i) {
+    Shard* const shard(&shards_[i]);
+    lock_guard<mutex> lock(shard->lock);
+    for (auto it(shard->proofs.begin()); it != shard->proofs.end();) {
+      if (it->first.tree_size < tree_size) {
+        it = shard->proofs.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+}
+
+
+size_t ProofCache::Size() const {
+  size_t size(0);
+  for (size_t i = 0; i < kNumShards; ++i) {
+    lock_guard<mutex> lock(shards_[i].lock);
+    size += shards_[i].proofs.size();
+  }
+  return size;
+}
+
+
+ProofCache::Shard* ProofCache::ShardFor(const Key& key) {
+  return &shards_[KeyHash()(key) % kNumShards];
+}
+
+
+bool ProofCache::Lookup(const Key& key, vector<string>* proof) {
+  Shard* const shard(ShardFor(key));
+  lock_guard<mutex> lock(shard->lock);
+  const auto it(shard->proofs.find(key));
+  if (it == shard->proofs.end()) {
+    return false;
+  }
+  *proof = it->second;
+  return true;
+}
+
+
+void ProofCache::Insert(const Key& key, const vector<string>& proof) {
+  if (max_entries_per_shard_ == 0) {
+    return;
+  }
+  Shard* const shard(ShardFor(key));
+  lock_guard<mutex> lock(shard->lock);
+  // Old tree sizes are dropped by EvictBefore(), so a full shard is
+  // mostly full of proofs for the current trees: make room by dropping
+  // an arbitrary one rather than keeping track of their use.
+  if (shard->proofs.size() >= max_entries_per_shard_ &&
+      shard->proofs.count(key) == 0) {
+    shard->proofs.erase(shard->proofs.begin());
+  }
+  shard->proofs[key] = proof;
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,93 @@
+#ifndef CERT_TRANS_LOG_PROOF_CACHE_H_
+#define CERT_TRANS_LOG_PROOF_CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace cert_trans {
+
+
+// A cache of Merkle audit paths and consistency proofs, so that the
+// proofs most often asked for (against the current or a few recent tree
+// sizes) do not have to be recomputed from the tree every time.
+//
+// A proof for given tree sizes never changes as the tree grows, so
+// entries never need to be invalidated; EvictBefore() drops the ones
+// for tree sizes that are no longer served. The cache is split into
+// shards with their own lock, so that concurrent lookups rarely wait on
+// each other.
+//
+// This class is thread-safe.
+class ProofCache {
+ public:
+  // Keeps up to (about) |max_entries| proofs. A cache with no entries
+  // never stores anything.
+  explicit ProofCache(size_t max_entries);
+  ProofCache(const ProofCache&) = delete;
+  ProofCache& operator=(const ProofCache&) = delete;
+
+  // Sets |path| to the audit path of the leaf at index |leaf_index| (0
+  // based) in the tree of size |tree_size| and returns true, or returns
+  // false if it is not cached.
+  bool LookupAuditPath(int64_t leaf_index, int64_t tree_size,
+                       std::vector<std::string>* path);
+  void InsertAuditPath(int64_t leaf_index, int64_t tree_size,
+                       const std::vector<std::string>& path);
+
+  // Same for the consistency proof between tree sizes |first| and
+  // |second|.
+  bool LookupConsistencyProof(int64_t first, int64_t second,
+                              std::vector<std::string>* proof);
+  void InsertConsistencyProof(int64_t first, int64_t second,
+                              const std::vector<std::string>& proof);
+
+  // Drops the proofs for trees smaller than |tree_size|.
+  void EvictBefore(int64_t tree_size);
+
+  // Number of cached proofs.
+  size_t Size() const;
+
+ private:
+  enum Kind {
+    AUDIT_PATH,
+    CONSISTENCY_PROOF,
+  };
+
+  struct Key {
+    bool operator==(const Key& other) const {
+      return kind == other.kind && first == other.first &&
+             tree_size == other.tree_size;
+    }
+
+    Kind kind;
+    // The leaf index or the first tree size.
+    int64_t first;
+    int64_t tree_size;
+  };
+
+  struct KeyHash {
+    size_t operator()(const Key& key) const;
+  };
+
+  struct Shard {
+    mutable std::mutex lock;
+    std::unordered_map<Key, std::vector<std::string>, KeyHash> proofs;
+  };
+
+  Shard* ShardFor(const Key& key);
+  bool Lookup(const Key& key, std::vector<std::string>* proof);
+  void Insert(const Key& key, const std::vector<std::string>& proof);
+
+  const size_t max_entries_per_shard_;
+  std::unique_ptr<Shard[]> shards_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_PROOF_CACHE_H_
@@ -0,0 +1,83 @@
+#include "log/proof_cache.h"
+
+#include <gtest/gtest.h>
+#include <string>
+#include <vector>
+
+#include "util/testing.h"
+
+namespace cert_trans {
+namespace {
+
+using std::string;
+using std::vector;
+
+
+vector<string> TestProof(int n) {
+  return vector<string>(n, string(32, static_cast<char>('a' + n)));
+}
+
+
+TEST(ProofCacheTest, LookupAndInsert) {
+  ProofCache cache(100);
+  vector<string> proof;
+  EXPECT_FALSE(cache.LookupAuditPath(3, 10, &proof));
+  EXPECT_FALSE(cache.LookupConsistencyProof(3, 10, &proof));
+
+  cache.InsertAuditPath(3, 10, TestProof(4));
+  cache.InsertConsistencyProof(3, 10, TestProof(5));
+  EXPECT_EQ(2U, cache.Size());
+
+  ASSERT_TRUE(cache.LookupAuditPath(3, 10, &proof));
+  EXPECT_EQ(TestProof(4), proof);
+  ASSERT_TRUE(cache.LookupConsistencyProof(3, 10, &proof));
+  EXPECT_EQ(TestProof(5), proof);
+  EXPECT_FALSE(cache.LookupAuditPath(3, 11, &proof));
+  EXPECT_FALSE(cache.LookupAuditPath(4, 10, &proof));
+}
+
+
+TEST(ProofCacheTest, EvictBefore) {
+  ProofCache cache(100);
+  cache.InsertAuditPath(0, 10, TestProof(4));
+  cache.InsertAuditPath(0, 20, TestProof(5));
+  cache.InsertConsistencyProof(10, 15, TestProof(2));
+  cache.InsertConsistencyProof(10, 20, TestProof(3));
+
+  cache.EvictBefore(20);
+  EXPECT_EQ(2U, cache.Size());
+  vector<string> proof;
+  EXPECT_FALSE(cache.LookupAuditPath(0, 10, &proof));
+  EXPECT_FALSE(cache.LookupConsistencyProof(10, 15, &proof));
+  EXPECT_TRUE(cache.LookupAuditPath(0, 20, &proof));
+  EXPECT_TRUE(cache.LookupConsistencyProof(10, 20, &proof));
+}
+
+
+TEST(ProofCacheTest, BoundedSize) {
+  ProofCache cache(32);
+  for (int i = 0; i < 1000; ++i) {
+    cache.InsertAuditPath(i, 1000, TestProof(3));
+  }
+  EXPECT_GE(32U, cache.Size());
+  EXPECT_LT(0U, cache.Size());
+}
+
+
+TEST(ProofCacheTest, Disabled) {
+  ProofCache cache(0);
+  cache.InsertAuditPath(3, 10, TestProof(4));
+  vector<string> proof;
+  EXPECT_FALSE(cache.LookupAuditPath(3, 10, &proof));
+  EXPECT_EQ(0U, cache.Size());
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
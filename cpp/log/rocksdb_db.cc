@@ -0,0 +1,777 @@
+#include "log/rocksdb_db.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <rocksdb/cache.h>
+#include <rocksdb/filter_policy.h>
+#include <rocksdb/options.h>
+#include <rocksdb/rate_limiter.h>
+#include <rocksdb/slice_transform.h>
+#include <rocksdb/table.h>
+#include <rocksdb/write_batch.h>
+#include <stdint.h>
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "base/lock_contention.h"
+#include "monitoring/gauge.h"
+#include "monitoring/latency.h"
+#include "monitoring/monitoring.h"
+#include "proto/ct.pb.h"
+#include "proto/serializer.h"
+#include "util/util.h"
+
+using cert_trans::serialization::DeserializeResult;
+using std::chrono::milliseconds;
+using std::chrono::seconds;
+using std::lock_guard;
+using std::mutex;
+using std::numeric_limits;
+using std::shared_ptr;
+using std::string;
+using std::unique_lock;
+using std::unique_ptr;
+using std::vector;
+
+DEFINE_int32(rocksdb_max_open_files, -1,
+             "number of open files that can be used by rocksdb, -1 for no "
+             "limit");
+DEFINE_int32(rocksdb_block_cache_mb, 64,
+             "size of the rocksdb block cache in MB, shared by the column "
+             "families");
+DEFINE_int32(rocksdb_entries_write_buffer_mb, 64,
+             "size of the write buffer of the entries column family in MB");
+DEFINE_string(rocksdb_entries_compaction, "universal",
+              "compaction style of the entries column family: \"universal\" "
+              "(fewer rewrites of the append-only entries) or \"level\"");
+DEFINE_int32(rocksdb_bloom_filter_bits_per_key, 10,
+             "number of bits per key of the bloom filter of the hashes "
+             "column family, which saves reading from disk for the hashes "
+             "of entries that are not logged; 0 for no bloom filter");
+DEFINE_int32(rocksdb_hash_prefix_bytes, 8,
+             "length of the prefix of the entry hashes covered by the "
+             "memtable prefix bloom of the hashes column family; 0 for no "
+             "prefix bloom");
+DEFINE_bool(rocksdb_direct_reads, false,
+            "whether rocksdb reads with O_DIRECT, so that the scans of the "
+            "entries do not evict the hot data from the page cache; only "
+            "the block cache then caches reads");
+DEFINE_int32(rocksdb_scan_readahead_kb, 2048,
+             "readahead of the scans of the entries in KB, 0 for the "
+             "rocksdb default");
+DEFINE_int32(rocksdb_compaction_rate_limit_mb, 0,
+             "limit of the rate of the compaction and flush writes of "
+             "rocksdb in MB per second, 0 for no limit");
+DEFINE_int32(rocksdb_stats_interval_secs, 60,
+             "how often to export the internal stats of rocksdb as "
+             "metrics, 0 to never export them");
+
+namespace cert_trans {
+namespace {
+
+
+static Latency<milliseconds, string> latency_by_op_ms(
+    "rocksdb_latency_by_operation_ms", "operation",
+    "Database latency in ms broken out by operation.");
+
+static Gauge<string, string>* rocksdb_stats =
+    Gauge<string, string>::New("rocksdb_stats", "column_family", "name",
+                               "Re-export of the internal stats of "
+                               "rocksdb, by column family.");
+
+
+const char kEntriesFamily[] = "entries";
+const char kHashesFamily[] = "hashes";
+const char kTreeHeadsFamily[] = "tree_heads";
+
+// In the default column family.
+const char kMetaNodeIdKey[] = "metadata";
+// A lower bound of the number of contiguous entries.
+const char kContiguousSizeKey[] = "meta-contiguous_size";
+const char kTilePrefix[] = "tile-";
+const char kFrontierPrefix[] = "frontier-";
+
+// The integer properties exported by ExportStats().
+const char* const kIntProperties[] = {
+    "rocksdb.estimate-num-keys", "rocksdb.total-sst-files-size",
+    "rocksdb.cur-size-all-mem-tables", "rocksdb.num-running-compactions",
+    "rocksdb.estimate-pending-compaction-bytes",
+};
+
+
+// Big-endian, so that the entries are in sequence number order.
+string IndexToKey(int64_t index) {
+  return Serializer::SerializeUint(index, sizeof(index));
+}
+
+
+int64_t KeyToIndex(const rocksdb::Slice& key) {
+  uint64_t index;
+  CHECK_EQ(DeserializeResult::OK,
+           Deserializer::DeserializeUint<uint64_t>(key.ToString(),
+                                                   sizeof(index), &index))
+      << "Invalid entry key";
+  return index;
+}
+
+
+string SequenceNumberValue(int64_t sequence_number) {
+  return Serializer::SerializeUint(sequence_number, sizeof(sequence_number));
+}
+
+
+int64_t ParseSequenceNumberValue(const string& value) {
+  uint64_t sequence_number;
+  CHECK_EQ(DeserializeResult::OK,
+           Deserializer::DeserializeUint<uint64_t>(
+               value, sizeof(sequence_number), &sequence_number))
+      << "Invalid sequence number value";
+  return sequence_number;
+}
+
+
+string TileKey(int level, int64_t index) {
+  return kTilePrefix + std::to_string(level) + "-" + std::to_string(index);
+}
+
+
+string FrontierKey(int64_t tree_size) {
+  return kFrontierPrefix + std::to_string(tree_size);
+}
+
+
+rocksdb::ReadOptions ScanReadOptions(bool fill_cache) {
+  rocksdb::ReadOptions options;
+  options.fill_cache = fill_cache;
+  if (FLAGS_rocksdb_scan_readahead_kb > 0) {
+    options.readahead_size =
+        static_cast<size_t>(FLAGS_rocksdb_scan_readahead_kb) << 10;
+  }
+  return options;
+}
+
+
+rocksdb::BlockBasedTableOptions TableOptions(
+    const shared_ptr<rocksdb::Cache>& block_cache) {
+  rocksdb::BlockBasedTableOptions table_options;
+  table_options.block_cache = block_cache;
+  return table_options;
+}
+
+
+rocksdb::ColumnFamilyOptions EntriesOptions(
+    const shared_ptr<rocksdb::Cache>& block_cache) {
+  rocksdb::ColumnFamilyOptions options;
+  options.write_buffer_size =
+      static_cast<size_t>(FLAGS_rocksdb_entries_write_buffer_mb) << 20;
+  if (FLAGS_rocksdb_entries_compaction == "universal") {
+    options.compaction_style = rocksdb::kCompactionStyleUniversal;
+  } else {
+    CHECK_EQ("level", FLAGS_rocksdb_entries_compaction)
+        << "unknown --rocksdb_entries_compaction";
+    options.compaction_style = rocksdb::kCompactionStyleLevel;
+  }
+  options.table_factory.reset(
+      rocksdb::NewBlockBasedTableFactory(TableOptions(block_cache)));
+  return options;
+}
+
+
+rocksdb::ColumnFamilyOptions HashesOptions(
+    const shared_ptr<rocksdb::Cache>& block_cache) {
+  rocksdb::ColumnFamilyOptions options;
+  rocksdb::BlockBasedTableOptions table_options(TableOptions(block_cache));
+  if (FLAGS_rocksdb_bloom_filter_bits_per_key > 0) {
+    table_options.filter_policy.reset(rocksdb::NewBloomFilterPolicy(
+        FLAGS_rocksdb_bloom_filter_bits_per_key, false));
+  }
+  // The lookups are by whole hash, the prefix only serves the memtable
+  // bloom.
+  table_options.whole_key_filtering = true;
+  if (FLAGS_rocksdb_hash_prefix_bytes > 0) {
+    options.prefix_extractor.reset(
+        rocksdb::NewFixedPrefixTransform(FLAGS_rocksdb_hash_prefix_bytes));
+    options.memtable_prefix_bloom_size_ratio = 0.1;
+  }
+  options.table_factory.reset(
+      rocksdb::NewBlockBasedTableFactory(table_options));
+  return options;
+}
+
+
+rocksdb::ColumnFamilyOptions TreeHeadsOptions(
+    const shared_ptr<rocksdb::Cache>& block_cache) {
+  rocksdb::ColumnFamilyOptions options;
+  options.write_buffer_size = 4 << 20;
+  options.compaction_style = rocksdb::kCompactionStyleLevel;
+  options.table_factory.reset(
+      rocksdb::NewBlockBasedTableFactory(TableOptions(block_cache)));
+  return options;
+}
+
+
+}  // namespace
+
+
+class RocksDB::Iterator : public Database::Iterator {
+ public:
+  Iterator(const RocksDB* db, int64_t start_index, int64_t end_index,
+           bool fill_cache)
+      : it_(db->db_->NewIterator(ScanReadOptions(fill_cache),
+                                 db->entries_)),
+        end_index_(end_index) {
+    CHECK(it_);
+    it_->Seek(IndexToKey(start_index));
+  }
+
+  bool GetNextEntry(LoggedEntry* entry) override {
+    if (!it_->Valid()) {
+      CHECK(it_->status().ok()) << "Failed to scan entries: "
+                                << it_->status().ToString();
+      return false;
+    }
+
+    const int64_t seq(KeyToIndex(it_->key()));
+    if (seq >= end_index_) {
+      return false;
+    }
+    CHECK(entry->ParseFromArray(it_->value().data(), it_->value().size()))
+        << "Failed to parse entry with sequence number " << seq;
+    CHECK(entry->has_sequence_number())
+        << "no sequence number for entry with expected sequence number "
+        << seq;
+    CHECK_EQ(entry->sequence_number(), seq) << "unexpected sequence_number";
+
+    it_->Next();
+
+    return true;
+  }
+
+ private:
+  const unique_ptr<rocksdb::Iterator> it_;
+  const int64_t end_index_;
+};
+
+
+const size_t RocksDB::kTimestampBytesIndexed = 6;
+
+
+RocksDB::RocksDB(const string& dbfile)
+    : lock_(LockContention::Get("rocksdb")),
+      contiguous_size_(0),
+      latest_tree_timestamp_(0),
+      stopping_(false) {
+  LOG(INFO) << "Opening " << dbfile;
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("open"));
+  rocksdb::DBOptions options;
+  options.create_if_missing = true;
+  options.create_missing_column_families = true;
+  options.max_open_files = FLAGS_rocksdb_max_open_files;
+  options.use_direct_reads = FLAGS_rocksdb_direct_reads;
+  if (FLAGS_rocksdb_compaction_rate_limit_mb > 0) {
+    options.rate_limiter.reset(rocksdb::NewGenericRateLimiter(
+        static_cast<int64_t>(FLAGS_rocksdb_compaction_rate_limit_mb) << 20));
+  }
+
+  const shared_ptr<rocksdb::Cache> block_cache(rocksdb::NewLRUCache(
+      static_cast<size_t>(FLAGS_rocksdb_block_cache_mb) << 20));
+  rocksdb::ColumnFamilyOptions default_options;
+  default_options.table_factory.reset(
+      rocksdb::NewBlockBasedTableFactory(TableOptions(block_cache)));
+  // The handles come back in this order.
+  const vector<rocksdb::ColumnFamilyDescriptor> families{
+      {rocksdb::kDefaultColumnFamilyName, default_options},
+      {kEntriesFamily, EntriesOptions(block_cache)},
+      {kHashesFamily, HashesOptions(block_cache)},
+      {kTreeHeadsFamily, TreeHeadsOptions(block_cache)},
+  };
+
+  rocksdb::DB* db;
+  const rocksdb::Status status(
+      rocksdb::DB::Open(options, dbfile, families, &handles_, &db));
+  CHECK(status.ok()) << status.ToString();
+  db_.reset(db);
+  CHECK_EQ(families.size(), handles_.size());
+  entries_ = handles_[1];
+  hashes_ = handles_[2];
+  tree_heads_ = handles_[3];
+
+  LoadIndex();
+
+  if (FLAGS_rocksdb_stats_interval_secs > 0) {
+    stats_thread_ = std::thread(&RocksDB::ExportStats, this);
+  }
+}
+
+
+RocksDB::~RocksDB() {
+  {
+    lock_guard<mutex> lock(stats_lock_);
+    stopping_ = true;
+  }
+  stats_cv_.notify_all();
+  if (stats_thread_.joinable()) {
+    stats_thread_.join();
+  }
+  for (rocksdb::ColumnFamilyHandle* const handle : handles_) {
+    const rocksdb::Status status(db_->DestroyColumnFamilyHandle(handle));
+    LOG_IF(WARNING, !status.ok()) << "Failed to close column family: "
+                                  << status.ToString();
+  }
+}
+
+
+Database::WriteResult RocksDB::CreateSequencedEntry_(
+    const LoggedEntry& logged) {
+  CHECK(logged.has_sequence_number());
+  CHECK_GE(logged.sequence_number(), 0);
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("create_sequenced_entry"));
+
+  return WriteEntries({&logged}).front();
+}
+
+
+vector<Database::WriteResult> RocksDB::CreateSequencedEntries_(
+    const vector<LoggedEntry>& entries) {
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("create_sequenced_entries"));
+
+  vector<const LoggedEntry*> pointers;
+  pointers.reserve(entries.size());
+  for (const auto& logged : entries) {
+    pointers.push_back(&logged);
+  }
+
+  return WriteEntries(pointers);
+}
+
+
+Database::LookupResult RocksDB::LookupByHash(const string& hash,
+                                             LoggedEntry* result) const {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("lookup_by_hash"));
+
+  // The hash key is written along with the entry, so there is nothing
+  // to lock: if it is there, so is the entry.
+  string sequence_number_value;
+  const rocksdb::Status status(db_->Get(rocksdb::ReadOptions(), hashes_,
+                                        hash, &sequence_number_value));
+  if (status.IsNotFound()) {
+    return this->NOT_FOUND;
+  }
+  CHECK(status.ok()) << "Failed to get entry by hash("
+                     << util::HexString(hash) << "): " << status.ToString();
+  const int64_t sequence_number(
+      ParseSequenceNumberValue(sequence_number_value));
+  if (!result) {
+    return this->LOOKUP_OK;
+  }
+
+  CHECK_EQ(this->LOOKUP_OK, LookupByIndex(sequence_number, result))
+      << "Failed to get entry " << sequence_number << " by hash("
+      << util::HexString(hash) << ")";
+  CHECK_EQ(result->Hash(), hash);
+
+  return this->LOOKUP_OK;
+}
+
+
+Database::LookupResult RocksDB::LookupByIndex(int64_t sequence_number,
+                                              LoggedEntry* result) const {
+  CHECK_GE(sequence_number, 0);
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("lookup_by_index"));
+
+  string cert_data;
+  const rocksdb::Status status(db_->Get(rocksdb::ReadOptions(), entries_,
+                                        IndexToKey(sequence_number),
+                                        &cert_data));
+  if (status.IsNotFound()) {
+    return this->NOT_FOUND;
+  }
+  CHECK(status.ok()) << "Failed to get entry " << sequence_number << ": "
+                     << status.ToString();
+
+  if (result) {
+    CHECK(result->ParseFromString(cert_data))
+        << "Failed to parse entry with sequence number " << sequence_number;
+    CHECK_EQ(result->sequence_number(), sequence_number);
+  }
+
+  return this->LOOKUP_OK;
+}
+
+
+unique_ptr<Database::Iterator> RocksDB::ScanEntries(
+    int64_t start_index) const {
+  return ScanEntries_(start_index, numeric_limits<int64_t>::max(), true);
+}
+
+
+unique_ptr<Database::Iterator> RocksDB::ScanEntries_(int64_t start_index,
+                                                     int64_t end_index,
+                                                     bool fill_cache) const {
+  return unique_ptr<Iterator>(
+      new Iterator(this, start_index, end_index, fill_cache));
+}
+
+
+Database::WriteResult RocksDB::WriteTreeHead_(const ct::SignedTreeHead& sth) {
+  CHECK_GE(sth.tree_size(), 0);
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("write_tree_head"));
+
+  // 6 bytes are good enough for some 9000 years.
+  const string timestamp_key(
+      Serializer::SerializeUint(sth.timestamp(),
+                                RocksDB::kTimestampBytesIndexed));
+  string data;
+  CHECK(sth.SerializeToString(&data));
+
+  unique_lock<ReadWriteMutex> lock(lock_);
+  string existing_data;
+  rocksdb::Status status(db_->Get(rocksdb::ReadOptions(), tree_heads_,
+                                  timestamp_key, &existing_data));
+  if (status.ok()) {
+    if (existing_data == data) {
+      return this->OK;
+    }
+    return this->DUPLICATE_TREE_HEAD_TIMESTAMP;
+  }
+
+  rocksdb::WriteOptions opts;
+  opts.sync = true;
+  status = db_->Put(opts, tree_heads_, timestamp_key, data);
+  CHECK(status.ok()) << "Failed to write tree head ("
+                     << util::HexString(timestamp_key)
+                     << "): " << status.ToString();
+
+  if (sth.timestamp() > latest_tree_timestamp_) {
+    latest_tree_timestamp_ = sth.timestamp();
+    latest_timestamp_key_ = timestamp_key;
+  }
+
+  lock.unlock();
+  callbacks_.Call(sth);
+
+  return this->OK;
+}
+
+
+Database::LookupResult RocksDB::LatestTreeHead(
+    ct::SignedTreeHead* result) const {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("latest_tree_head"));
+  uint64_t timestamp;
+  string timestamp_key;
+  {
+    ReaderLock lock(&lock_);
+    timestamp = latest_tree_timestamp_;
+    timestamp_key = latest_timestamp_key_;
+  }
+
+  // Tree heads are never overwritten, so this one can be read without
+  // the lock, even if a newer one gets written meanwhile.
+  return ReadTreeHead(timestamp, timestamp_key, result);
+}
+
+
+int64_t RocksDB::TreeSize() const {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("tree_size"));
+  ReaderLock lock(&lock_);
+
+  return contiguous_size_;
+}
+
+
+vector<std::pair<int64_t, int64_t>> RocksDB::SparseRanges() const {
+  ReaderLock lock(&lock_);
+  return ToRanges(sparse_entries_);
+}
+
+
+void RocksDB::AddNotifySTHCallback(
+    const Database::NotifySTHCallback* callback) {
+  unique_lock<ReadWriteMutex> lock(lock_);
+
+  callbacks_.Add(callback);
+
+  ct::SignedTreeHead sth;
+  if (LatestTreeHeadNoLock(&sth) == this->LOOKUP_OK) {
+    lock.unlock();
+    (*callback)(sth);
+  }
+}
+
+
+void RocksDB::RemoveNotifySTHCallback(
+    const Database::NotifySTHCallback* callback) {
+  lock_guard<ReadWriteMutex> lock(lock_);
+
+  callbacks_.Remove(callback);
+}
+
+
+void RocksDB::InitializeNode(const string& node_id) {
+  CHECK(!node_id.empty());
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("initialize_node"));
+  unique_lock<ReadWriteMutex> lock(lock_);
+  string existing_id;
+  if (NodeId(&existing_id) != this->NOT_FOUND) {
+    LOG(FATAL)
+        << "Attempting to initialize DB belonging to node with node_id: "
+        << existing_id;
+  }
+  const rocksdb::Status status(
+      db_->Put(rocksdb::WriteOptions(), kMetaNodeIdKey, node_id));
+  CHECK(status.ok()) << "Failed to store NodeId: " << status.ToString();
+}
+
+
+Database::LookupResult RocksDB::NodeId(string* node_id) {
+  CHECK_NOTNULL(node_id);
+  const rocksdb::Status status(
+      db_->Get(rocksdb::ReadOptions(), kMetaNodeIdKey, node_id));
+
+  if (status.ok()) {
+    return this->LOOKUP_OK;
+  }
+  if (status.IsNotFound()) {
+    return this->NOT_FOUND;
+  }
+  LOG(FATAL) << "Node ID lookup failed: " << status.ToString();
+}
+
+
+Database::WriteResult RocksDB::WriteTile_(int level, int64_t index,
+                                          const string& hashes) {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("write_tile"));
+  const rocksdb::Status status(
+      db_->Put(rocksdb::WriteOptions(), TileKey(level, index), hashes));
+  CHECK(status.ok()) << "Failed to write tile: " << status.ToString();
+  return this->OK;
+}
+
+
+Database::LookupResult RocksDB::LookupTile(int level, int64_t index,
+                                           string* hashes) const {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("lookup_tile"));
+  CHECK_NOTNULL(hashes);
+  const rocksdb::Status status(
+      db_->Get(rocksdb::ReadOptions(), TileKey(level, index), hashes));
+  if (status.IsNotFound()) {
+    return this->NOT_FOUND;
+  }
+  CHECK(status.ok()) << "Tile lookup failed: " << status.ToString();
+  return this->LOOKUP_OK;
+}
+
+
+Database::WriteResult RocksDB::WriteFrontier_(int64_t tree_size,
+                                              const string& hashes) {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("write_frontier"));
+  const rocksdb::Status status(
+      db_->Put(rocksdb::WriteOptions(), FrontierKey(tree_size), hashes));
+  CHECK(status.ok()) << "Failed to write frontier: " << status.ToString();
+  return this->OK;
+}
+
+
+Database::LookupResult RocksDB::LookupFrontier(int64_t tree_size,
+                                               string* hashes) const {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("lookup_frontier"));
+  CHECK_NOTNULL(hashes);
+  const rocksdb::Status status(
+      db_->Get(rocksdb::ReadOptions(), FrontierKey(tree_size), hashes));
+  if (status.IsNotFound()) {
+    return this->NOT_FOUND;
+  }
+  CHECK(status.ok()) << "Frontier lookup failed: " << status.ToString();
+  return this->LOOKUP_OK;
+}
+
+
+void RocksDB::LoadIndex() {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("load_index"));
+  lock_guard<ReadWriteMutex> lock(lock_);
+
+  // The entries below the stored contiguous size are all there, so only
+  // the keys of the following ones are read.
+  string value;
+  if (db_->Get(rocksdb::ReadOptions(), kContiguousSizeKey, &value).ok()) {
+    contiguous_size_ = ParseSequenceNumberValue(value);
+  }
+  unique_ptr<rocksdb::Iterator> it(
+      db_->NewIterator(ScanReadOptions(false), entries_));
+  CHECK(it);
+  for (it->Seek(IndexToKey(contiguous_size_)); it->Valid(); it->Next()) {
+    InsertEntryMapping(KeyToIndex(it->key()));
+  }
+  CHECK(it->status().ok()) << "Failed to load the entries: "
+                           << it->status().ToString();
+
+  // The latest tree head is the last one in key order.
+  it.reset(db_->NewIterator(rocksdb::ReadOptions(), tree_heads_));
+  CHECK(it);
+  it->SeekToLast();
+  if (it->Valid()) {
+    latest_timestamp_key_ = it->key().ToString();
+    CHECK_EQ(DeserializeResult::OK,
+             Deserializer::DeserializeUint<uint64_t>(
+                 latest_timestamp_key_, RocksDB::kTimestampBytesIndexed,
+                 &latest_tree_timestamp_));
+  }
+}
+
+
+// Writes the new entries of |entries|, and their hash keys, with a
+// single rocksdb::WriteBatch.
+vector<Database::WriteResult> RocksDB::WriteEntries(
+    const vector<const LoggedEntry*>& entries) {
+  vector<string> data(entries.size());
+  vector<string> hashes(entries.size());
+  for (size_t i = 0; i < entries.size(); ++i) {
+    CHECK(entries[i]->SerializeToString(&data[i]));
+    hashes[i] = entries[i]->Hash();
+  }
+
+  vector<Database::WriteResult> results(entries.size(), this->OK);
+  // Indices in |entries| of the entries in |batch|.
+  vector<size_t> batched;
+  // Those among them whose hash key is in |batch|.
+  vector<size_t> hashed;
+  rocksdb::WriteBatch batch;
+
+  unique_lock<ReadWriteMutex> lock(lock_);
+  for (size_t i = 0; i < entries.size(); ++i) {
+    const int64_t sequence_number(entries[i]->sequence_number());
+    const string key(IndexToKey(sequence_number));
+
+    // Entries that are being written, by this call or a concurrent
+    // one, count as existing already.
+    const string* existing(nullptr);
+    string existing_data;
+    const auto pending(pending_entries_.find(sequence_number));
+    if (pending != pending_entries_.end()) {
+      existing = pending->second;
+    } else if (!db_->Get(rocksdb::ReadOptions(), entries_, key,
+                         &existing_data)
+                    .IsNotFound()) {
+      existing = &existing_data;
+    }
+
+    if (existing) {
+      if (!LoggedEntry::SameSerializedEntry(*existing, data[i])) {
+        results[i] = this->SEQUENCE_NUMBER_ALREADY_IN_USE;
+      }
+      continue;
+    }
+
+    batch.Put(entries_, key, data[i]);
+    pending_entries_.emplace(sequence_number, &data[i]);
+    batched.push_back(i);
+
+    // The first entry written with a hash keeps its key.
+    string existing_hash;
+    if (pending_hashes_.count(hashes[i]) == 0 &&
+        db_->Get(rocksdb::ReadOptions(), hashes_, hashes[i], &existing_hash)
+            .IsNotFound()) {
+      batch.Put(hashes_, hashes[i], SequenceNumberValue(sequence_number));
+      pending_hashes_.insert(hashes[i]);
+      hashed.push_back(i);
+    }
+  }
+
+  if (batched.empty()) {
+    return results;
+  }
+  // The entries below it are written already.
+  batch.Put(kContiguousSizeKey, SequenceNumberValue(contiguous_size_));
+
+  // Concurrent callers can check their entries while this batch is
+  // being written, and rocksdb commits the batches waiting to be
+  // written together, in a single log write.
+  lock.unlock();
+  const rocksdb::Status status(db_->Write(rocksdb::WriteOptions(), &batch));
+  CHECK(status.ok()) << "Failed to write " << batched.size()
+                     << " sequenced entries (first seq: "
+                     << entries[batched.front()]->sequence_number()
+                     << "): " << status.ToString();
+
+  lock.lock();
+  for (size_t i : batched) {
+    const int64_t sequence_number(entries[i]->sequence_number());
+    CHECK_EQ(1U, pending_entries_.erase(sequence_number));
+    InsertEntryMapping(sequence_number);
+  }
+  for (size_t i : hashed) {
+    CHECK_EQ(1U, pending_hashes_.erase(hashes[i]));
+  }
+
+  return results;
+}
+
+
+Database::LookupResult RocksDB::LatestTreeHeadNoLock(
+    ct::SignedTreeHead* result) const {
+  return ReadTreeHead(latest_tree_timestamp_, latest_timestamp_key_, result);
+}
+
+
+Database::LookupResult RocksDB::ReadTreeHead(uint64_t timestamp,
+                                             const string& timestamp_key,
+                                             ct::SignedTreeHead* result) const {
+  if (timestamp == 0) {
+    return this->NOT_FOUND;
+  }
+
+  string tree_data;
+  const rocksdb::Status status(db_->Get(rocksdb::ReadOptions(), tree_heads_,
+                                        timestamp_key, &tree_data));
+  CHECK(status.ok()) << "Failed to read latest tree head: "
+                     << status.ToString();
+
+  CHECK(result->ParseFromString(tree_data));
+  CHECK_EQ(result->timestamp(), timestamp);
+
+  return this->LOOKUP_OK;
+}
+
+
+void RocksDB::ExportStats() {
+  unique_lock<mutex> lock(stats_lock_);
+  do {
+    for (rocksdb::ColumnFamilyHandle* const handle : handles_) {
+      for (const char* const property : kIntProperties) {
+        uint64_t value;
+        if (db_->GetIntProperty(handle, property, &value)) {
+          rocksdb_stats->Set(handle->GetName(), property, value);
+        }
+      }
+    }
+  } while (!stats_cv_.wait_for(lock,
+                               seconds(FLAGS_rocksdb_stats_interval_secs),
+                               [this]() { return stopping_; }));
+}
+
+
+// This must be called with "lock_" held.
+void RocksDB::InsertEntryMapping(int64_t sequence_number) {
+  if (sequence_number == contiguous_size_) {
+    ++contiguous_size_;
+    for (auto i = sparse_entries_.find(contiguous_size_);
+         i != sparse_entries_.end() && *i == contiguous_size_;) {
+      ++contiguous_size_;
+      i = sparse_entries_.erase(i);
+    }
+  } else {
+    // It's not contiguous, put it with the other sparse entries.
+    CHECK(sparse_entries_.insert(sequence_number).second)
+        << "sequence number " << sequence_number << " already assigned.";
+  }
+}
+
+
+}  // namespace cert_trans
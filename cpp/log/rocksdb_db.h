@@ -0,0 +1,156 @@
+#ifndef CERT_TRANS_LOG_ROCKSDB_DB_H_
+#define CERT_TRANS_LOG_ROCKSDB_DB_H_
+
+#include "config.h"
+
+#include <rocksdb/db.h>
+#include <stdint.h>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "base/read_write_mutex.h"
+#include "log/database.h"
+#include "proto/ct.pb.h"
+
+namespace cert_trans {
+
+
+// Same data as LevelDB, but kept in separate RocksDB column families,
+// so that each can be tuned for how it is used:
+//  - "entries", by sequence number, is append-only and only read back
+//    in order or by index, so it uses universal compaction (see
+//    --rocksdb_entries_compaction) to write each entry fewer times;
+//  - "hashes", mapping an entry hash to its sequence number, gets the
+//    point lookups of add-chain, most of them for entries not logged,
+//    so it has a bloom filter, and a prefix bloom in the memtable;
+//  - "tree_heads", by timestamp, is small and hot, and uses leveled
+//    compaction with a small write buffer;
+//  - the default one holds the node ID, tiles and frontiers.
+// Compaction and flushes share a rate limit (see
+// --rocksdb_compaction_rate_limit_mb), so that they do not starve the
+// reads of the serving path.
+//
+// It does not support archiving, snapshots, entry compression or
+// deduplicated chains, as LevelDB does.
+class RocksDB : public Database {
+ public:
+  static const size_t kTimestampBytesIndexed;
+
+  explicit RocksDB(const std::string& dbfile);
+  ~RocksDB();
+  RocksDB(const RocksDB&) = delete;
+  RocksDB& operator=(const RocksDB&) = delete;
+
+  // Implement abstract functions, see database.h for comments.
+  Database::WriteResult CreateSequencedEntry_(
+      const LoggedEntry& logged) override;
+
+  std::vector<Database::WriteResult> CreateSequencedEntries_(
+      const std::vector<LoggedEntry>& entries) override;
+
+  Database::LookupResult LookupByHash(const std::string& hash,
+                                      LoggedEntry* result) const override;
+
+  Database::LookupResult LookupByIndex(int64_t sequence_number,
+                                       LoggedEntry* result) const override;
+
+  using Database::ScanEntries;
+  std::unique_ptr<Database::Iterator> ScanEntries(
+      int64_t start_index) const override;
+
+  Database::WriteResult WriteTreeHead_(const ct::SignedTreeHead& sth) override;
+
+  Database::LookupResult LatestTreeHead(
+      ct::SignedTreeHead* result) const override;
+
+  int64_t TreeSize() const override;
+
+  std::vector<std::pair<int64_t, int64_t>> SparseRanges() const override;
+
+  void AddNotifySTHCallback(
+      const Database::NotifySTHCallback* callback) override;
+
+  void RemoveNotifySTHCallback(
+      const Database::NotifySTHCallback* callback) override;
+
+  void InitializeNode(const std::string& node_id) override;
+
+  Database::LookupResult NodeId(std::string* node_id) override;
+
+  Database::WriteResult WriteTile_(int level, int64_t index,
+                                   const std::string& hashes) override;
+
+  Database::LookupResult LookupTile(int level, int64_t index,
+                                    std::string* hashes) const override;
+
+  Database::WriteResult WriteFrontier_(int64_t tree_size,
+                                       const std::string& hashes) override;
+
+  Database::LookupResult LookupFrontier(int64_t tree_size,
+                                        std::string* hashes) const override;
+
+ protected:
+  std::unique_ptr<Database::Iterator> ScanEntries_(
+      int64_t start_index, int64_t end_index, bool fill_cache) const override;
+
+ private:
+  class Iterator;
+
+  // Finds the contiguous and sparse entries, and the latest tree head.
+  void LoadIndex();
+  // Exports the internal stats of rocksdb as metrics, every
+  // --rocksdb_stats_interval_secs.
+  void ExportStats();
+  std::vector<Database::WriteResult> WriteEntries(
+      const std::vector<const LoggedEntry*>& entries);
+  Database::LookupResult LatestTreeHeadNoLock(
+      ct::SignedTreeHead* result) const;
+  // Reads the tree head stored under |timestamp_key|, without holding
+  // lock_.
+  Database::LookupResult ReadTreeHead(uint64_t timestamp,
+                                      const std::string& timestamp_key,
+                                      ct::SignedTreeHead* result) const;
+  void InsertEntryMapping(int64_t sequence_number);
+
+  // Lookups only hold this shared, to read the in-memory state below,
+  // and read from rocksdb (which is thread-safe) without it.
+  mutable ReadWriteMutex lock_;
+  std::unique_ptr<rocksdb::DB> db_;
+  // Owned by db_, and destroyed before it.
+  std::vector<rocksdb::ColumnFamilyHandle*> handles_;
+  rocksdb::ColumnFamilyHandle* entries_;
+  rocksdb::ColumnFamilyHandle* hashes_;
+  rocksdb::ColumnFamilyHandle* tree_heads_;
+
+  int64_t contiguous_size_;
+
+  // This is a mapping of the non-contiguous entries of the log (which
+  // can happen while it is being fetched). When entries here become
+  // contiguous with the beginning of the tree, they are removed.
+  std::set<int64_t> sparse_entries_;
+
+  // The entries that WriteEntries() calls are writing without holding
+  // lock_, by sequence number, pointing to their serialized data.
+  std::map<int64_t, const std::string*> pending_entries_;
+  // The hashes whose keys they are writing.
+  std::set<std::string> pending_hashes_;
+
+  uint64_t latest_tree_timestamp_;
+  std::string latest_timestamp_key_;
+  cert_trans::DatabaseNotifierHelper callbacks_;
+
+  std::mutex stats_lock_;
+  std::condition_variable stats_cv_;
+  bool stopping_;
+  std::thread stats_thread_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_ROCKSDB_DB_H_
@@ -0,0 +1,329 @@
+#include "log/root_store.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glog/logging.h>
+#include <openssl/x509v3.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <fstream>
+
+#include "log/cert.h"
+
+using std::string;
+using std::unique_ptr;
+using std::vector;
+using util::Status;
+using util::StatusOr;
+
+namespace cert_trans {
+namespace {
+
+
+const char kMagic[] = "CTROOTS1";
+const size_t kMagicSize = 8;
+const size_t kHeaderSize = 16;
+const size_t kSha256Size = 32;
+// Three offset and size pairs, then the fingerprint.
+const size_t kRecordSize = 6 * 4 + kSha256Size;
+
+
+struct CompiledRoot {
+  string der;
+  string subject;
+  string key_id;
+  string sha256;
+};
+
+
+void AppendUint32(uint32_t value, string* out) {
+  for (int i = 0; i < 4; ++i) {
+    out->push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+  }
+}
+
+
+uint32_t ReadUint32(const char* data) {
+  uint32_t value(0);
+  for (int i = 3; i >= 0; --i) {
+    value = (value << 8) | static_cast<unsigned char>(data[i]);
+  }
+  return value;
+}
+
+
+Status ErrnoStatus(const string& what, const string& path) {
+  return Status(util::error::INTERNAL,
+                what + " " + path + ": " + strerror(errno));
+}
+
+
+Status CompileRoot(const Cert& cert, CompiledRoot* root) {
+  Status status(cert.DerEncoding(&root->der));
+  if (status.ok()) {
+    status = cert.DerEncodedSubjectName(&root->subject);
+  }
+  if (status.ok()) {
+    status = cert.Sha256Digest(&root->sha256);
+  }
+  if (!status.ok()) {
+    return status;
+  }
+  // Roots without an identifier are only looked up by name.
+  if (!cert.OctetStringExtensionData(NID_subject_key_identifier,
+                                     &root->key_id)
+           .ok()) {
+    root->key_id.clear();
+  }
+  return ::util::OkStatus();
+}
+
+
+// Compares |size| bytes at |data| with |value|, as strings.
+int Compare(const char* data, size_t size, const string& value) {
+  const int cmp(memcmp(data, value.data(), std::min(size, value.size())));
+  if (cmp != 0) {
+    return cmp;
+  }
+  return size < value.size() ? -1 : (size > value.size() ? 1 : 0);
+}
+
+
+}  // namespace
+
+
+// static
+bool RootStore::IsRootStore(const string& path) {
+  std::ifstream in(path, std::ios::binary);
+  char magic[kMagicSize];
+  return in.read(magic, kMagicSize) && memcmp(magic, kMagic, kMagicSize) == 0;
+}
+
+
+// static
+Status RootStore::Write(const string& path,
+                        const vector<const Cert*>& roots) {
+  vector<CompiledRoot> compiled;
+  compiled.reserve(roots.size());
+  for (const Cert* cert : roots) {
+    CHECK_NOTNULL(cert);
+    compiled.emplace_back();
+    const Status status(CompileRoot(*cert, &compiled.back()));
+    if (!status.ok()) {
+      return status;
+    }
+  }
+  std::sort(compiled.begin(), compiled.end(),
+            [](const CompiledRoot& x, const CompiledRoot& y) {
+              return x.subject != y.subject ? x.subject < y.subject
+                                            : x.sha256 < y.sha256;
+            });
+  compiled.erase(std::unique(compiled.begin(), compiled.end(),
+                             [](const CompiledRoot& x, const CompiledRoot& y) {
+                               return x.sha256 == y.sha256;
+                             }),
+                 compiled.end());
+
+  vector<uint32_t> by_key_id;
+  for (size_t i = 0; i < compiled.size(); ++i) {
+    if (!compiled[i].key_id.empty()) {
+      by_key_id.push_back(i);
+    }
+  }
+  std::sort(by_key_id.begin(), by_key_id.end(),
+            [&compiled](uint32_t x, uint32_t y) {
+              return compiled[x].key_id < compiled[y].key_id;
+            });
+
+  string header(kMagic, kMagicSize);
+  AppendUint32(compiled.size(), &header);
+  AppendUint32(by_key_id.size(), &header);
+  string records;
+  string blobs;
+  const size_t blobs_offset(kHeaderSize + compiled.size() * kRecordSize +
+                            by_key_id.size() * 4);
+  for (const CompiledRoot& root : compiled) {
+    for (const string* blob : {&root.der, &root.subject, &root.key_id}) {
+      AppendUint32(blobs_offset + blobs.size(), &records);
+      AppendUint32(blob->size(), &records);
+      blobs.append(*blob);
+    }
+    CHECK_EQ(kSha256Size, root.sha256.size());
+    records.append(root.sha256);
+  }
+  if (blobs_offset + blobs.size() > UINT32_MAX) {
+    return Status(util::error::INVALID_ARGUMENT, "too many roots");
+  }
+  for (uint32_t index : by_key_id) {
+    AppendUint32(index, &records);
+  }
+
+  const string tmp_path(path + ".tmp");
+  {
+    std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+    out.write(header.data(), header.size());
+    out.write(records.data(), records.size());
+    out.write(blobs.data(), blobs.size());
+    out.flush();
+    if (!out) {
+      return Status(util::error::INTERNAL, "cannot write " + tmp_path);
+    }
+  }
+  if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+    return Status(util::error::INTERNAL, "cannot rename " + tmp_path +
+                                             " to " + path + ": " +
+                                             strerror(errno));
+  }
+  return ::util::OkStatus();
+}
+
+
+// static
+StatusOr<unique_ptr<RootStore>> RootStore::Open(const string& path) {
+  const int fd(open(path.c_str(), O_RDONLY));
+  if (fd < 0) {
+    return ErrnoStatus("cannot open", path);
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    const Status status(ErrnoStatus("cannot stat", path));
+    close(fd);
+    return status;
+  }
+  const size_t size(st.st_size);
+  const Status corrupt(util::error::FAILED_PRECONDITION,
+                       "not a root store: " + path);
+  if (size < kHeaderSize) {
+    close(fd);
+    return corrupt;
+  }
+
+  void* const mapping(mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0));
+  // The mapping stays valid after the descriptor is closed.
+  const Status map_status(mapping == MAP_FAILED
+                              ? ErrnoStatus("cannot map", path)
+                              : ::util::OkStatus());
+  close(fd);
+  if (!map_status.ok()) {
+    return map_status;
+  }
+  const char* const data(static_cast<const char*>(mapping));
+
+  // Check everything the accessors rely on once, here.
+  const uint32_t count(ReadUint32(data + kMagicSize));
+  const uint32_t key_id_count(ReadUint32(data + kMagicSize + 4));
+  bool valid(memcmp(data, kMagic, kMagicSize) == 0 &&
+             key_id_count <= count &&
+             (size - kHeaderSize) / kRecordSize >= count &&
+             (size - kHeaderSize - count * kRecordSize) / 4 >= key_id_count);
+  for (uint32_t i = 0; valid && i < count; ++i) {
+    const char* const record(data + kHeaderSize + i * kRecordSize);
+    for (int blob = 0; valid && blob < 3; ++blob) {
+      const size_t offset(ReadUint32(record + 8 * blob));
+      valid = offset <= size && ReadUint32(record + 8 * blob + 4) <=
+                                    size - offset;
+    }
+  }
+  const char* const key_ids(data + kHeaderSize + count * kRecordSize);
+  for (uint32_t i = 0; valid && i < key_id_count; ++i) {
+    valid = ReadUint32(key_ids + 4 * i) < count;
+  }
+  if (!valid) {
+    munmap(mapping, size);
+    return corrupt;
+  }
+
+  return unique_ptr<RootStore>(
+      new RootStore(data, size, count, key_id_count));
+}
+
+
+RootStore::RootStore(const char* data, size_t mapped_size, uint32_t count,
+                     uint32_t key_id_count)
+    : data_(data),
+      mapped_size_(mapped_size),
+      count_(count),
+      key_id_count_(key_id_count) {
+}
+
+
+RootStore::~RootStore() {
+  munmap(const_cast<char*>(data_), mapped_size_);
+}
+
+
+const char* RootStore::Record(size_t index) const {
+  CHECK_LT(index, count_);
+  return data_ + kHeaderSize + index * kRecordSize;
+}
+
+
+RootStore::Root RootStore::Get(size_t index) const {
+  const char* const record(Record(index));
+  Root root;
+  root.der = data_ + ReadUint32(record);
+  root.der_size = ReadUint32(record + 4);
+  root.subject = data_ + ReadUint32(record + 8);
+  root.subject_size = ReadUint32(record + 12);
+  root.key_id = data_ + ReadUint32(record + 16);
+  root.key_id_size = ReadUint32(record + 20);
+  root.sha256 = record + 24;
+  return root;
+}
+
+
+vector<size_t> RootStore::FindBySubject(const string& subject) const {
+  // The records are in order of subject name.
+  size_t low(0), high(count_);
+  while (low < high) {
+    const size_t mid(low + (high - low) / 2);
+    const Root root(Get(mid));
+    if (Compare(root.subject, root.subject_size, subject) < 0) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  vector<size_t> found;
+  for (size_t i = low; i < count_; ++i) {
+    const Root root(Get(i));
+    if (Compare(root.subject, root.subject_size, subject) != 0) {
+      break;
+    }
+    found.push_back(i);
+  }
+  return found;
+}
+
+
+vector<size_t> RootStore::FindByKeyId(const string& key_id) const {
+  const char* const index(data_ + kHeaderSize + count_ * kRecordSize);
+  size_t low(0), high(key_id_count_);
+  while (low < high) {
+    const size_t mid(low + (high - low) / 2);
+    const Root root(Get(ReadUint32(index + 4 * mid)));
+    if (Compare(root.key_id, root.key_id_size, key_id) < 0) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  vector<size_t> found;
+  for (size_t i = low; i < key_id_count_; ++i) {
+    const size_t root_index(ReadUint32(index + 4 * i));
+    const Root root(Get(root_index));
+    if (Compare(root.key_id, root.key_id_size, key_id) != 0) {
+      break;
+    }
+    found.push_back(root_index);
+  }
+  return found;
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,96 @@
+#ifndef CERT_TRANS_LOG_ROOT_STORE_H_
+#define CERT_TRANS_LOG_ROOT_STORE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "util/status.h"
+#include "util/statusor.h"
+
+namespace cert_trans {
+
+class Cert;
+
+
+// Read-only, memory-mapped set of trusted roots, precompiled from a PEM
+// bundle (see tools/compile_roots.cc) so that loading it needs neither
+// PEM decoding nor re-encoding of the subject names, and so that the
+// processes reading it share its pages.
+//
+// The file format is a 16 byte header (the magic "CTROOTS1", then the
+// number of roots and the number of roots with a subject key
+// identifier, as little-endian 32-bit integers), followed by:
+//  - a record per root, in order of DER-encoded subject name: the
+//    offset and size of its DER encoding, subject name and subject key
+//    identifier (empty if it has none) in the file, as little-endian
+//    32-bit integers, then its SHA256 fingerprint;
+//  - the indices of the roots with a subject key identifier, in order
+//    of identifier, as little-endian 32-bit integers;
+//  - the DER encodings, subject names and identifiers themselves.
+// The roots are thus looked up by subject name or key identifier with
+// a binary search over the mapping, without building an index.
+//
+// The file is replaced by renaming a new one over it, so that readers
+// which have it open keep the set it had when they opened it.
+class RootStore {
+ public:
+  // A root, pointing into the mapping: valid for as long as the
+  // RootStore which returned it.
+  struct Root {
+    const char* der;
+    size_t der_size;
+    const char* subject;
+    size_t subject_size;
+    const char* key_id;
+    size_t key_id_size;
+    // 32 bytes.
+    const char* sha256;
+  };
+
+  // Returns true if the file at |path| starts with the magic of a
+  // RootStore (and so is not a PEM bundle).
+  static bool IsRootStore(const std::string& path);
+
+  // Writes |roots| to |path|, replacing whatever was there. Duplicate
+  // certificates are written once.
+  static util::Status Write(const std::string& path,
+                            const std::vector<const Cert*>& roots);
+
+  static util::StatusOr<std::unique_ptr<RootStore>> Open(
+      const std::string& path);
+
+  ~RootStore();
+  RootStore(const RootStore&) = delete;
+  RootStore& operator=(const RootStore&) = delete;
+
+  size_t size() const {
+    return count_;
+  }
+
+  // The |index|th root, in order of subject name.
+  Root Get(size_t index) const;
+
+  // Returns the indices of the roots with the DER-encoded subject name
+  // |subject|, or with the subject key identifier |key_id|.
+  std::vector<size_t> FindBySubject(const std::string& subject) const;
+  std::vector<size_t> FindByKeyId(const std::string& key_id) const;
+
+ private:
+  RootStore(const char* data, size_t mapped_size, uint32_t count,
+            uint32_t key_id_count);
+
+  const char* Record(size_t index) const;
+
+  const char* const data_;
+  const size_t mapped_size_;
+  const uint32_t count_;
+  const uint32_t key_id_count_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_ROOT_STORE_H_
@@ -0,0 +1,181 @@
+#include "log/root_store.h"
+
+#include <gflags/gflags.h>
+#include <gtest/gtest.h>
+#include <openssl/x509v3.h>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "log/cert.h"
+#include "log/cert_checker.h"
+#include "util/status_test_util.h"
+#include "util/test_db.h"
+#include "util/testing.h"
+#include "util/util.h"
+
+namespace cert_trans {
+namespace {
+
+using std::string;
+using std::unique_ptr;
+using std::vector;
+using util::StatusOr;
+using util::testing::StatusIs;
+
+// Self-signed, with a subject key identifier.
+const char kCaCert[] = "ca-cert.pem";
+// Issued by ca-cert.pem.
+const char kIntermediateCert[] = "intermediate-cert.pem";
+// Two CA certs that have identical name and no key identifier.
+const char kCollidingRoots[] = "test-colliding-roots.pem";
+
+
+class RootStoreTest : public ::testing::Test {
+ protected:
+  RootStoreTest()
+      : cert_dir_(FLAGS_test_srcdir + "/test/testdata"),
+        path_(tmp_.TmpStorageDir() + "/roots") {
+  }
+
+  // Loads the PEM bundles |files| and writes their roots to |path_|.
+  vector<unique_ptr<Cert>> WriteStore(const vector<string>& files) {
+    vector<unique_ptr<Cert>> certs;
+    vector<const Cert*> roots;
+    for (const string& file : files) {
+      string pem;
+      CHECK(util::ReadTextFile(cert_dir_ + "/" + file, &pem)) << file;
+      certs.emplace_back(Cert::FromPemString(pem));
+      CHECK(certs.back()) << file;
+      roots.push_back(certs.back().get());
+    }
+    CHECK(RootStore::Write(path_, roots).ok());
+    return certs;
+  }
+
+  unique_ptr<RootStore> Open() {
+    StatusOr<unique_ptr<RootStore>> store(RootStore::Open(path_));
+    CHECK(store.ok()) << store.status();
+    return std::move(store.ValueOrDie());
+  }
+
+  TmpStorage tmp_;
+  const string cert_dir_;
+  const string path_;
+};
+
+
+TEST_F(RootStoreTest, WritesAndLooksUp) {
+  const vector<unique_ptr<Cert>> certs(
+      WriteStore({kIntermediateCert, kCaCert, kCaCert}));
+  EXPECT_TRUE(RootStore::IsRootStore(path_));
+  EXPECT_FALSE(RootStore::IsRootStore(cert_dir_ + "/" + kCaCert));
+
+  const unique_ptr<RootStore> store(Open());
+  // The duplicate is dropped.
+  ASSERT_EQ(2U, store->size());
+
+  for (const auto& cert : certs) {
+    string subject, der, sha256, key_id;
+    ASSERT_OK(cert->DerEncodedSubjectName(&subject));
+    ASSERT_OK(cert->DerEncoding(&der));
+    ASSERT_OK(cert->Sha256Digest(&sha256));
+    ASSERT_OK(
+        cert->OctetStringExtensionData(NID_subject_key_identifier, &key_id));
+
+    const vector<size_t> by_subject(store->FindBySubject(subject));
+    ASSERT_EQ(1U, by_subject.size());
+    EXPECT_EQ(by_subject, store->FindByKeyId(key_id));
+    const RootStore::Root root(store->Get(by_subject[0]));
+    EXPECT_EQ(der, string(root.der, root.der_size));
+    EXPECT_EQ(subject, string(root.subject, root.subject_size));
+    EXPECT_EQ(key_id, string(root.key_id, root.key_id_size));
+    EXPECT_EQ(sha256, string(root.sha256, 32));
+  }
+
+  EXPECT_TRUE(store->FindBySubject("not a name").empty());
+  EXPECT_TRUE(store->FindByKeyId("not an identifier").empty());
+}
+
+
+TEST_F(RootStoreTest, CollidingNames) {
+  CertChecker checker;
+  ASSERT_TRUE(checker.LoadTrustedCertificates(cert_dir_ + "/" +
+                                              kCollidingRoots));
+  ASSERT_EQ(2U, checker.NumTrustedCertificates());
+  vector<const Cert*> roots;
+  for (const auto& root : checker.GetTrustedCertificates()) {
+    roots.push_back(root.second.get());
+  }
+  ASSERT_OK(RootStore::Write(path_, roots));
+
+  const unique_ptr<RootStore> store(Open());
+  ASSERT_EQ(2U, store->size());
+  EXPECT_EQ(vector<size_t>({0, 1}),
+            store->FindBySubject(checker.GetTrustedCertificates()
+                                     .begin()
+                                     ->first));
+}
+
+
+TEST_F(RootStoreTest, CertCheckerLoadsStore) {
+  WriteStore({kCaCert, kIntermediateCert});
+
+  CertChecker from_pem;
+  ASSERT_TRUE(from_pem.LoadTrustedCertificates(cert_dir_ + "/" + kCaCert));
+  ASSERT_TRUE(
+      from_pem.LoadTrustedCertificates(cert_dir_ + "/" + kIntermediateCert));
+
+  CertChecker from_store;
+  ASSERT_TRUE(from_store.LoadTrustedCertificates(path_));
+  ASSERT_EQ(from_pem.NumTrustedCertificates(),
+            from_store.NumTrustedCertificates());
+  auto pem_it(from_pem.GetTrustedCertificates().begin());
+  for (const auto& root : from_store.GetTrustedCertificates()) {
+    EXPECT_EQ(pem_it->first, root.first);
+    EXPECT_TRUE(pem_it->second->IsIdenticalTo(*root.second));
+    ++pem_it;
+  }
+
+  // Loading it again adds nothing.
+  ASSERT_TRUE(from_store.LoadTrustedCertificates(path_));
+  EXPECT_EQ(from_pem.NumTrustedCertificates(),
+            from_store.NumTrustedCertificates());
+}
+
+
+TEST_F(RootStoreTest, RejectsCorruptStore) {
+  WriteStore({kCaCert});
+  string data;
+  ASSERT_TRUE(util::ReadBinaryFile(path_, &data));
+
+  // Truncated in the middle of the records.
+  {
+    std::ofstream out(path_, std::ios::binary | std::ios::trunc);
+    out.write(data.data(), 40);
+  }
+  EXPECT_THAT(RootStore::Open(path_).status(),
+              StatusIs(util::error::FAILED_PRECONDITION));
+
+  // Missing the last byte of the blobs.
+  {
+    std::ofstream out(path_, std::ios::binary | std::ios::trunc);
+    out.write(data.data(), data.size() - 1);
+  }
+  EXPECT_THAT(RootStore::Open(path_).status(),
+              StatusIs(util::error::FAILED_PRECONDITION));
+
+  EXPECT_THAT(RootStore::Open(path_ + ".missing").status(),
+              StatusIs(util::error::INTERNAL));
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
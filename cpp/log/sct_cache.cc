@@ -0,0 +1,99 @@
+#include "log/sct_cache.h"
+
+#include <glog/logging.h>
+
+#include "monitoring/counter.h"
+#include "monitoring/monitoring.h"
+
+using ct::SignedCertificateTimestamp;
+using std::lock_guard;
+using std::mutex;
+using std::string;
+
+namespace cert_trans {
+namespace {
+
+
+const size_t kNumShards = 16;
+
+
+Counter<string>* sct_cache_lookups =
+    Counter<string>::New("sct_cache_lookups", "result",
+                         "Number of SCT cache lookups, broken down by hit or "
+                         "miss.");
+
+LabelledValueCell* const sct_cache_hits(sct_cache_lookups->GetCell("hit"));
+LabelledValueCell* const sct_cache_misses(
+    sct_cache_lookups->GetCell("miss"));
+
+
+}  // namespace
+
+
+SctCache::SctCache(size_t max_entries)
+    : max_entries_per_shard_((max_entries + kNumShards - 1) / kNumShards),
+      shards_(new Shard[kNumShards]) {
+}
+
+
+bool SctCache::Lookup(const string& leaf_hash,
+                      SignedCertificateTimestamp* sct) {
+  CHECK_NOTNULL(sct);
+  Shard* const shard(ShardFor(leaf_hash));
+  lock_guard<mutex> lock(shard->lock);
+  const auto it(shard->scts.find(leaf_hash));
+  if (it == shard->scts.end()) {
+    sct_cache_misses->Increment();
+    return false;
+  }
+  shard->lru.splice(shard->lru.begin(), shard->lru, it->second.lru_position);
+  *sct = it->second.sct;
+  sct_cache_hits->Increment();
+  return true;
+}
+
+
+void SctCache::Insert(const string& leaf_hash,
+                      const SignedCertificateTimestamp& sct) {
+  if (max_entries_per_shard_ == 0) {
+    return;
+  }
+  Shard* const shard(ShardFor(leaf_hash));
+  lock_guard<mutex> lock(shard->lock);
+  const auto it(shard->scts.find(leaf_hash));
+  if (it != shard->scts.end()) {
+    shard->lru.splice(shard->lru.begin(), shard->lru, it->second.lru_position);
+    it->second.sct = sct;
+    return;
+  }
+  if (shard->scts.size() >= max_entries_per_shard_) {
+    shard->scts.erase(shard->lru.back());
+    shard->lru.pop_back();
+  }
+  shard->lru.push_front(leaf_hash);
+  CachedSct* const cached(&shard->scts[leaf_hash]);
+  cached->sct = sct;
+  cached->lru_position = shard->lru.begin();
+}
+
+
+size_t SctCache::Size() const {
+  size_t size(0);
+  for (size_t i = 0; i < kNumShards; ++i) {
+    lock_guard<mutex> lock(shards_[i].lock);
+    size += shards_[i].scts.size();
+  }
+  return size;
+}
+
+
+SctCache::Shard* SctCache::ShardFor(const string& leaf_hash) {
+  // The leaf hashes are SHA-256 digests, already evenly spread.
+  const size_t index(leaf_hash.empty()
+                         ? 0
+                         : static_cast<unsigned char>(leaf_hash[0]));
+  return &shards_[index % kNumShards];
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,70 @@
+#ifndef CERT_TRANS_LOG_SCT_CACHE_H_
+#define CERT_TRANS_LOG_SCT_CACHE_H_
+
+#include <stddef.h>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "proto/ct.pb.h"
+
+namespace cert_trans {
+
+
+// A cache of the SCTs recently issued, by leaf hash, so that the
+// resubmissions of an entry, which are common, can be answered without
+// asking the consistent store for the SCT of the pending entry.
+//
+// An SCT is never withdrawn: the consistent store only drops a pending
+// entry once it is in the tree, and the database then has the same SCT.
+// So entries never need to be invalidated, and the least recently used
+// are dropped to make room. The cache is split into shards with their
+// own lock, so that concurrent lookups rarely wait on each other.
+//
+// This class is thread-safe.
+class SctCache {
+ public:
+  // Keeps up to (about) |max_entries| SCTs. A cache with no entries
+  // never stores anything.
+  explicit SctCache(size_t max_entries);
+  SctCache(const SctCache&) = delete;
+  SctCache& operator=(const SctCache&) = delete;
+
+  // Sets |sct| to the SCT of the entry with leaf hash |leaf_hash| and
+  // returns true, or returns false if it is not cached.
+  bool Lookup(const std::string& leaf_hash,
+              ct::SignedCertificateTimestamp* sct);
+
+  void Insert(const std::string& leaf_hash,
+              const ct::SignedCertificateTimestamp& sct);
+
+  // Number of cached SCTs.
+  size_t Size() const;
+
+ private:
+  typedef std::list<std::string> LruList;
+
+  struct CachedSct {
+    ct::SignedCertificateTimestamp sct;
+    LruList::iterator lru_position;
+  };
+
+  struct Shard {
+    mutable std::mutex lock;
+    std::unordered_map<std::string, CachedSct> scts;
+    // The keys of |scts|, most recently used first.
+    LruList lru;
+  };
+
+  Shard* ShardFor(const std::string& leaf_hash);
+
+  const size_t max_entries_per_shard_;
+  std::unique_ptr<Shard[]> shards_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_SCT_CACHE_H_
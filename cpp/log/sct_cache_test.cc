@@ -0,0 +1,79 @@
+#include "log/sct_cache.h"
+
+#include <gtest/gtest.h>
+#include <string>
+
+#include "util/testing.h"
+
+namespace cert_trans {
+namespace {
+
+using ct::SignedCertificateTimestamp;
+using std::string;
+
+
+SignedCertificateTimestamp TestSct(int timestamp) {
+  SignedCertificateTimestamp sct;
+  sct.set_version(ct::V1);
+  sct.set_timestamp(timestamp);
+  return sct;
+}
+
+
+TEST(SctCacheTest, LookupAndInsert) {
+  SctCache cache(100);
+  SignedCertificateTimestamp sct;
+  EXPECT_FALSE(cache.Lookup("hash", &sct));
+
+  cache.Insert("hash", TestSct(1234));
+  EXPECT_EQ(1U, cache.Size());
+  ASSERT_TRUE(cache.Lookup("hash", &sct));
+  EXPECT_EQ(1234U, sct.timestamp());
+  EXPECT_FALSE(cache.Lookup("other hash", &sct));
+}
+
+
+TEST(SctCacheTest, EvictsLeastRecentlyUsed) {
+  // Two per shard, and the hashes below all go to the same shard.
+  SctCache cache(32);
+  cache.Insert("a1", TestSct(1));
+  cache.Insert("a2", TestSct(2));
+  SignedCertificateTimestamp sct;
+  EXPECT_TRUE(cache.Lookup("a1", &sct));
+
+  cache.Insert("a3", TestSct(3));
+  EXPECT_EQ(2U, cache.Size());
+  EXPECT_TRUE(cache.Lookup("a1", &sct));
+  EXPECT_FALSE(cache.Lookup("a2", &sct));
+  EXPECT_TRUE(cache.Lookup("a3", &sct));
+}
+
+
+TEST(SctCacheTest, BoundedSize) {
+  SctCache cache(32);
+  for (int i = 0; i < 1000; ++i) {
+    cache.Insert(string(1, static_cast<char>(i)) + std::to_string(i),
+                 TestSct(i));
+  }
+  EXPECT_GE(32U, cache.Size());
+  EXPECT_LT(0U, cache.Size());
+}
+
+
+TEST(SctCacheTest, Disabled) {
+  SctCache cache(0);
+  cache.Insert("hash", TestSct(1234));
+  SignedCertificateTimestamp sct;
+  EXPECT_FALSE(cache.Lookup("hash", &sct));
+  EXPECT_EQ(0U, cache.Size());
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,458 @@
+#include "log/segment_storage.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glog/logging.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+
+#include "util/util.h"
+
+using std::lock_guard;
+using std::string;
+using std::vector;
+
+namespace cert_trans {
+namespace {
+
+
+const char kRecordMagic[] = "CTSR";
+const size_t kMagicSize = 4;
+const size_t kRecordHeaderSize = 16;
+const char kSegmentSuffix[] = ".seg";
+const char kIndexSuffix[] = ".idx";
+
+
+void PutUint32(uint32_t value, string* out) {
+  for (int i = 3; i >= 0; --i) {
+    out->push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+  }
+}
+
+
+uint32_t GetUint32(const char* data) {
+  const unsigned char* const bytes(
+      reinterpret_cast<const unsigned char*>(data));
+  return (static_cast<uint32_t>(bytes[0]) << 24) |
+         (static_cast<uint32_t>(bytes[1]) << 16) |
+         (static_cast<uint32_t>(bytes[2]) << 8) | bytes[3];
+}
+
+
+uint32_t Fnv1a(const char* data, size_t size, uint32_t hash = 2166136261U) {
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= static_cast<unsigned char>(data[i]);
+    hash *= 16777619U;
+  }
+  return hash;
+}
+
+
+void WriteFully(int fd, const char* data, size_t size) {
+  while (size > 0) {
+    const ssize_t written(write(fd, data, size));
+    if (written < 0 && errno == EINTR)
+      continue;
+    PCHECK(written > 0) << "write failed";
+    data += written;
+    size -= written;
+  }
+}
+
+
+void SyncDirectory(const string& dir) {
+  const int fd(open(dir.c_str(), O_RDONLY | O_DIRECTORY));
+  PCHECK(fd >= 0) << "cannot open " << dir;
+  PCHECK(fsync(fd) == 0) << "cannot sync " << dir;
+  close(fd);
+}
+
+
+// The numbers of the segments in |dir|, in order.
+vector<uint32_t> ListSegments(const string& dir) {
+  DIR* const d(opendir(dir.c_str()));
+  PCHECK(d != nullptr) << "cannot open " << dir;
+  vector<uint32_t> segments;
+  while (const struct dirent* const entry = readdir(d)) {
+    unsigned segment;
+    char suffix[8];
+    if (sscanf(entry->d_name, "%8u%7s", &segment, suffix) == 2 &&
+        strlen(entry->d_name) == 12 && strcmp(suffix, kSegmentSuffix) == 0) {
+      segments.push_back(segment);
+    }
+  }
+  closedir(d);
+  std::sort(segments.begin(), segments.end());
+  return segments;
+}
+
+
+}  // namespace
+
+
+const size_t SegmentStorage::kDefaultSegmentSize = 64 << 20;
+
+
+SegmentStorage::SegmentStorage(const string& file_base, int sync_interval,
+                               size_t segment_size)
+    : segment_dir_(file_base + "/segments"),
+      sync_interval_(sync_interval),
+      segment_size_(segment_size),
+      fd_(-1),
+      unsynced_records_(0) {
+  CHECK_GE(sync_interval_, 0);
+  CHECK_GT(segment_size_, 0U);
+  if (mkdir(segment_dir_.c_str(), 0700) != 0) {
+    PCHECK(errno == EEXIST) << "cannot create " << segment_dir_;
+  }
+
+  const vector<uint32_t> segments(ListSegments(segment_dir_));
+  for (size_t i = 0; i < segments.size(); ++i) {
+    CHECK_EQ(i, segments[i]) << "missing segment " << i << " in "
+                             << segment_dir_;
+  }
+
+  for (uint32_t i = 0; i + 1 < segments.size(); ++i) {
+    segments_.push_back(Segment{nullptr, 0});
+    MapSegment(i);
+    if (!ReadIndex(i)) {
+      LOG(INFO) << "Indexing " << SegmentPath(i, kSegmentSuffix);
+      Records records;
+      const size_t valid_size(
+          ReadRecords(i, segments_[i].mapped, segments_[i].size, &records));
+      LOG_IF(WARNING, valid_size < segments_[i].size)
+          << "Ignoring " << segments_[i].size - valid_size
+          << " trailing bytes of " << SegmentPath(i, kSegmentSuffix);
+      WriteIndex(i, records);
+    }
+  }
+
+  if (segments.empty()) {
+    StartSegment();
+  } else {
+    OpenLastSegment();
+  }
+}
+
+
+SegmentStorage::~SegmentStorage() {
+  lock_guard<ReadWriteMutex> lock(lock_);
+  SyncLocked();
+  close(fd_);
+  for (const auto& segment : segments_) {
+    if (segment.mapped && segment.size > 0) {
+      munmap(const_cast<char*>(segment.mapped), segment.size);
+    }
+  }
+}
+
+
+std::set<string> SegmentStorage::Scan() const {
+  ReaderLock lock(&lock_);
+  std::set<string> keys;
+  for (const auto& entry : index_) {
+    keys.insert(entry.first);
+  }
+  return keys;
+}
+
+
+util::Status SegmentStorage::CreateEntry(const string& key,
+                                         const string& data) {
+  lock_guard<ReadWriteMutex> lock(lock_);
+  if (index_.find(key) != index_.end()) {
+    return util::Status(util::error::ALREADY_EXISTS,
+                        "entry already exists: " + key);
+  }
+  AppendRecord(key, data);
+  return ::util::OkStatus();
+}
+
+
+util::Status SegmentStorage::UpdateEntry(const string& key,
+                                         const string& data) {
+  lock_guard<ReadWriteMutex> lock(lock_);
+  if (index_.find(key) == index_.end()) {
+    return util::Status(util::error::NOT_FOUND,
+                        "tried to update non-existent entry: " + key);
+  }
+  AppendRecord(key, data);
+  return ::util::OkStatus();
+}
+
+
+util::Status SegmentStorage::LookupEntry(const string& key,
+                                         string* result) const {
+  ReaderLock lock(&lock_);
+  const auto it(index_.find(key));
+  if (it == index_.end()) {
+    return util::Status(util::error::NOT_FOUND, "entry not found: " + key);
+  }
+  if (!result) {
+    return ::util::OkStatus();
+  }
+
+  const Location& location(it->second);
+  const Segment& segment(segments_[location.segment]);
+  if (segment.mapped) {
+    result->assign(segment.mapped + location.data_offset, location.data_size);
+    return ::util::OkStatus();
+  }
+
+  result->resize(location.data_size);
+  size_t done(0);
+  while (done < location.data_size) {
+    const ssize_t got(pread(fd_, &(*result)[done], location.data_size - done,
+                            location.data_offset + done));
+    if (got < 0 && errno == EINTR)
+      continue;
+    PCHECK(got > 0) << "cannot read " << key;
+    done += got;
+  }
+  return ::util::OkStatus();
+}
+
+
+void SegmentStorage::Sync() {
+  lock_guard<ReadWriteMutex> lock(lock_);
+  SyncLocked();
+}
+
+
+string SegmentStorage::StateToken() const {
+  ReaderLock lock(&lock_);
+  return std::to_string(segments_.size()) + ":" +
+         std::to_string(segments_.back().size);
+}
+
+
+size_t SegmentStorage::EntryCount() const {
+  ReaderLock lock(&lock_);
+  return index_.size();
+}
+
+
+void SegmentStorage::Import(const EntryStorage& from) {
+  size_t imported(0);
+  string data;
+  for (const auto& key : from.Scan()) {
+    const util::Status status(from.LookupEntry(key, &data));
+    CHECK(status.ok()) << "cannot import " << key << ": " << status;
+    lock_guard<ReadWriteMutex> lock(lock_);
+    if (index_.find(key) == index_.end()) {
+      AppendRecord(key, data);
+      ++imported;
+    }
+  }
+  Sync();
+  LOG(INFO) << "Imported " << imported << " entries into " << segment_dir_;
+}
+
+
+string SegmentStorage::SegmentPath(uint32_t segment,
+                                   const char* suffix) const {
+  char name[16];
+  snprintf(name, sizeof(name), "%08u", segment);
+  return segment_dir_ + "/" + name + suffix;
+}
+
+
+size_t SegmentStorage::ReadRecords(uint32_t segment, const char* data,
+                                   size_t size, Records* records) {
+  size_t offset(0);
+  while (size - offset >= kRecordHeaderSize) {
+    const char* const header(data + offset);
+    if (memcmp(header, kRecordMagic, kMagicSize) != 0) {
+      break;
+    }
+    const uint32_t key_size(GetUint32(header + 4));
+    const uint32_t data_size(GetUint32(header + 8));
+    const size_t record_size(kRecordHeaderSize + key_size + data_size);
+    if (record_size > size - offset) {
+      break;
+    }
+    const char* const key(header + kRecordHeaderSize);
+    if (Fnv1a(key, key_size + data_size) != GetUint32(header + 12)) {
+      break;
+    }
+
+    const Location location{segment, data_size,
+                            offset + kRecordHeaderSize + key_size};
+    records->emplace_back(string(key, key_size), location);
+    index_[records->back().first] = location;
+    offset += record_size;
+  }
+  return offset;
+}
+
+
+// The index holds, for each record, the key size and data size as
+// big-endian 32-bit integers, the data offset as two of them, and the
+// key, followed by the FNV-1a hash of all that.
+bool SegmentStorage::ReadIndex(uint32_t segment) {
+  const string path(SegmentPath(segment, kIndexSuffix));
+  string index;
+  if (!util::ReadBinaryFile(path, &index)) {
+    return false;
+  }
+  if (index.size() < 4 ||
+      Fnv1a(index.data(), index.size() - 4) !=
+          GetUint32(index.data() + index.size() - 4)) {
+    LOG(WARNING) << "Ignoring corrupt index " << path;
+    return false;
+  }
+
+  const size_t end(index.size() - 4);
+  const size_t segment_size(segments_[segment].size);
+  size_t offset(0);
+  while (offset < end) {
+    CHECK_LE(16U, end - offset) << "truncated index " << path;
+    const char* const header(index.data() + offset);
+    const uint32_t key_size(GetUint32(header));
+    const Location location{segment, GetUint32(header + 4),
+                            (static_cast<uint64_t>(GetUint32(header + 8))
+                             << 32) |
+                                GetUint32(header + 12)};
+    CHECK_LE(key_size, end - offset - 16) << "truncated index " << path;
+    CHECK_LE(location.data_offset + location.data_size, segment_size)
+        << "index " << path << " does not match its segment";
+    index_[string(header + 16, key_size)] = location;
+    offset += 16 + key_size;
+  }
+  return true;
+}
+
+
+void SegmentStorage::WriteIndex(uint32_t segment,
+                                const Records& records) const {
+  string index;
+  for (const auto& record : records) {
+    PutUint32(record.first.size(), &index);
+    PutUint32(record.second.data_size, &index);
+    PutUint32(record.second.data_offset >> 32, &index);
+    PutUint32(record.second.data_offset & 0xffffffff, &index);
+    index.append(record.first);
+  }
+  PutUint32(Fnv1a(index.data(), index.size()), &index);
+
+  const string path(SegmentPath(segment, kIndexSuffix));
+  const string tmp_path(path + ".tmp");
+  const int fd(open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644));
+  PCHECK(fd >= 0) << "cannot open " << tmp_path;
+  WriteFully(fd, index.data(), index.size());
+  PCHECK(fdatasync(fd) == 0) << "cannot sync " << tmp_path;
+  close(fd);
+  PCHECK(rename(tmp_path.c_str(), path.c_str()) == 0) << "cannot rename "
+                                                     << tmp_path;
+  SyncDirectory(segment_dir_);
+}
+
+
+void SegmentStorage::MapSegment(uint32_t segment) {
+  const string path(SegmentPath(segment, kSegmentSuffix));
+  const int fd(open(path.c_str(), O_RDONLY));
+  PCHECK(fd >= 0) << "cannot open " << path;
+  struct stat st;
+  PCHECK(fstat(fd, &st) == 0) << "cannot stat " << path;
+
+  Segment* const s(&segments_[segment]);
+  s->size = st.st_size;
+  if (s->size == 0) {
+    // Cannot map an empty file, but any non-null pointer will do.
+    s->mapped = kRecordMagic;
+  } else {
+    void* const data(mmap(nullptr, s->size, PROT_READ, MAP_SHARED, fd, 0));
+    PCHECK(data != MAP_FAILED) << "cannot map " << path;
+    s->mapped = static_cast<const char*>(data);
+  }
+  // The mapping stays valid after the descriptor is closed.
+  close(fd);
+}
+
+
+void SegmentStorage::OpenLastSegment() {
+  const uint32_t segment(segments_.size());
+  const string path(SegmentPath(segment, kSegmentSuffix));
+  segments_.push_back(Segment{nullptr, 0});
+  MapSegment(segment);
+  Segment* const s(&segments_[segment]);
+  const size_t size(s->size);
+  const size_t valid_size(ReadRecords(segment, s->mapped, size, &records_));
+  if (size > 0) {
+    munmap(const_cast<char*>(s->mapped), size);
+  }
+  s->mapped = nullptr;
+  s->size = valid_size;
+
+  fd_ = open(path.c_str(), O_RDWR | O_APPEND);
+  PCHECK(fd_ >= 0) << "cannot open " << path;
+  if (valid_size < size) {
+    LOG(WARNING) << "Truncating " << size - valid_size
+                 << " torn or corrupt bytes at the end of " << path;
+    PCHECK(ftruncate(fd_, valid_size) == 0) << "cannot truncate " << path;
+    PCHECK(fdatasync(fd_) == 0) << "cannot sync " << path;
+  }
+}
+
+
+void SegmentStorage::StartSegment() {
+  const uint32_t segment(segments_.size());
+  const string path(SegmentPath(segment, kSegmentSuffix));
+  fd_ = open(path.c_str(), O_RDWR | O_APPEND | O_CREAT | O_TRUNC, 0644);
+  PCHECK(fd_ >= 0) << "cannot create " << path;
+  SyncDirectory(segment_dir_);
+  segments_.push_back(Segment{nullptr, 0});
+  records_.clear();
+}
+
+
+void SegmentStorage::AppendRecord(const string& key, const string& data) {
+  string record(kRecordMagic, kMagicSize);
+  PutUint32(key.size(), &record);
+  PutUint32(data.size(), &record);
+  PutUint32(Fnv1a(data.data(), data.size(), Fnv1a(key.data(), key.size())),
+            &record);
+  record.append(key);
+  record.append(data);
+  WriteFully(fd_, record.data(), record.size());
+
+  const uint32_t segment(segments_.size() - 1);
+  Segment* const s(&segments_.back());
+  const Location location{segment, static_cast<uint32_t>(data.size()),
+                          s->size + kRecordHeaderSize + key.size()};
+  s->size += record.size();
+  index_[key] = location;
+  records_.emplace_back(key, location);
+
+  if (++unsynced_records_ >= sync_interval_ && sync_interval_ > 0) {
+    SyncLocked();
+  }
+
+  if (s->size >= segment_size_) {
+    // Seal the segment, so that the storage never has to read it again
+    // on startup.
+    SyncLocked();
+    close(fd_);
+    WriteIndex(segment, records_);
+    MapSegment(segment);
+    StartSegment();
+  }
+}
+
+
+void SegmentStorage::SyncLocked() {
+  if (unsynced_records_ == 0) {
+    return;
+  }
+  PCHECK(fdatasync(fd_) == 0) << "cannot sync segment "
+                              << segments_.size() - 1;
+  unsynced_records_ = 0;
+}
+
+
+}  // namespace cert_trans
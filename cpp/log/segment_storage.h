@@ -0,0 +1,129 @@
+#ifndef CERT_TRANS_LOG_SEGMENT_STORAGE_H_
+#define CERT_TRANS_LOG_SEGMENT_STORAGE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "base/read_write_mutex.h"
+#include "log/entry_storage.h"
+#include "util/status.h"
+
+namespace cert_trans {
+
+
+// Storage for (key, data) entries that appends them to a few large
+// segment files, rather than writing a file per entry like FileStorage
+// does, which runs out of inodes and takes hours to scan with tens of
+// millions of entries. It is structured as follows:
+//
+// <root>/segments/<n>.seg - The records of segment number <n> (8
+//                           decimal digits), each a 16 byte header
+//                           (the magic "CTSR", then the key size, the
+//                           data size, and the FNV-1a hash of the key
+//                           and data, as big-endian 32-bit integers),
+//                           followed by the key and the data. A record
+//                           for a key supersedes the earlier ones.
+//
+// <root>/segments/<n>.idx - The key and offset of each record of
+//                           segment <n>, written once the segment is
+//                           full, so that opening the storage does not
+//                           have to read it.
+//
+// Only the last segment is written to. Once it is more than
+// |segment_size| bytes long, it is synced, its index is written, and a
+// new segment is started. Opening the storage reads the records of the
+// last segment, and truncates away any torn or corrupt record at its
+// end, as well as the segments without an index (which are indexed
+// then).
+//
+// Writes are synced to disk every |sync_interval| records (if it is
+// positive), and on Sync(). Full segments are memory-mapped for
+// reading.
+//
+// The keys and record locations are kept in memory. SegmentStorage
+// aborts upon any I/O error. This class is threadsafe.
+class SegmentStorage : public EntryStorage {
+ public:
+  static const size_t kDefaultSegmentSize;
+
+  SegmentStorage(const std::string& file_base, int sync_interval,
+                 size_t segment_size = kDefaultSegmentSize);
+  ~SegmentStorage() override;
+
+  // Implement abstract functions, see entry_storage.h for comments.
+  std::set<std::string> Scan() const override;
+
+  util::Status CreateEntry(const std::string& key,
+                           const std::string& data) override;
+
+  util::Status UpdateEntry(const std::string& key,
+                           const std::string& data) override;
+
+  util::Status LookupEntry(const std::string& key,
+                           std::string* result) const override;
+
+  void Sync() override;
+
+  // The number of segments and the size of the last one.
+  std::string StateToken() const override;
+
+  size_t EntryCount() const;
+
+  // Copy into this storage, and sync, all the entries of |from| that it
+  // does not have, e.g. to migrate from a FileStorage.
+  void Import(const EntryStorage& from);
+
+ private:
+  struct Segment {
+    // Null for the last segment, which is read with pread().
+    const char* mapped;
+    size_t size;
+  };
+
+  struct Location {
+    uint32_t segment;
+    uint32_t data_size;
+    // Of the data, in the segment.
+    uint64_t data_offset;
+  };
+
+  typedef std::vector<std::pair<std::string, Location>> Records;
+
+  std::string SegmentPath(uint32_t segment, const char* suffix) const;
+  // Adds the records in the |size| bytes at |data| to |index_| and
+  // |records|, and returns the size of the valid ones.
+  size_t ReadRecords(uint32_t segment, const char* data, size_t size,
+                     Records* records);
+  // Returns false if the index of the segment is missing or corrupt.
+  bool ReadIndex(uint32_t segment);
+  void WriteIndex(uint32_t segment, const Records& records) const;
+  void MapSegment(uint32_t segment);
+  void OpenLastSegment();
+  void StartSegment();
+  void AppendRecord(const std::string& key, const std::string& data);
+  void SyncLocked();
+
+  const std::string segment_dir_;
+  const int sync_interval_;
+  const size_t segment_size_;
+
+  // Held shared by lookups, which only read from the segments.
+  mutable ReadWriteMutex lock_;
+  std::vector<Segment> segments_;
+  std::unordered_map<std::string, Location> index_;
+  // The last segment, open for appending, and its records.
+  int fd_;
+  Records records_;
+  int unsynced_records_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_SEGMENT_STORAGE_H_
@@ -0,0 +1,201 @@
+#include "log/segment_storage.h"
+
+#include <gtest/gtest.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <memory>
+#include <set>
+#include <string>
+
+#include "log/file_storage.h"
+#include "util/status_test_util.h"
+#include "util/test_db.h"
+#include "util/testing.h"
+#include "util/util.h"
+
+namespace cert_trans {
+namespace {
+
+using std::string;
+using std::unique_ptr;
+using util::testing::StatusIs;
+
+const int kSyncInterval = 4;
+// Small enough for a few records to fill a segment.
+const size_t kSegmentSize = 256;
+
+
+string Key(int i) {
+  return "key" + std::to_string(i);
+}
+
+
+string Value(int i) {
+  return string(50 + i, static_cast<char>('a' + i % 26));
+}
+
+
+bool FileExists(const string& path) {
+  struct stat st;
+  return stat(path.c_str(), &st) == 0;
+}
+
+
+off_t FileSize(const string& path) {
+  struct stat st;
+  CHECK_EQ(0, stat(path.c_str(), &st)) << path;
+  return st.st_size;
+}
+
+
+class SegmentStorageTest : public ::testing::Test {
+ protected:
+  SegmentStorageTest() : dir_(tmp_.TmpStorageDir()) {
+  }
+
+  unique_ptr<SegmentStorage> Open() {
+    return unique_ptr<SegmentStorage>(
+        new SegmentStorage(dir_, kSyncInterval, kSegmentSize));
+  }
+
+  string SegmentFile(const char* name) const {
+    return dir_ + "/segments/" + name;
+  }
+
+  void ExpectEntries(const SegmentStorage& storage, int count) {
+    EXPECT_EQ(static_cast<size_t>(count), storage.EntryCount());
+    string data;
+    for (int i = 0; i < count; ++i) {
+      EXPECT_OK(storage.LookupEntry(Key(i), &data));
+      EXPECT_EQ(Value(i), data);
+    }
+  }
+
+  TmpStorage tmp_;
+  const string dir_;
+};
+
+
+TEST_F(SegmentStorageTest, CreateUpdateLookup) {
+  unique_ptr<SegmentStorage> storage(Open());
+  EXPECT_THAT(storage->LookupEntry(Key(0), nullptr),
+              StatusIs(util::error::NOT_FOUND));
+  EXPECT_THAT(storage->UpdateEntry(Key(0), Value(0)),
+              StatusIs(util::error::NOT_FOUND));
+
+  EXPECT_OK(storage->CreateEntry(Key(0), Value(0)));
+  EXPECT_OK(storage->CreateEntry(Key(1), Value(1)));
+  EXPECT_THAT(storage->CreateEntry(Key(0), Value(2)),
+              StatusIs(util::error::ALREADY_EXISTS));
+  ExpectEntries(*storage, 2);
+
+  EXPECT_OK(storage->UpdateEntry(Key(0), Value(2)));
+  string data;
+  EXPECT_OK(storage->LookupEntry(Key(0), &data));
+  EXPECT_EQ(Value(2), data);
+  EXPECT_EQ((std::set<string>{Key(0), Key(1)}), storage->Scan());
+}
+
+
+TEST_F(SegmentStorageTest, Reopen) {
+  {
+    unique_ptr<SegmentStorage> storage(Open());
+    for (int i = 0; i < 20; ++i) {
+      EXPECT_OK(storage->CreateEntry(Key(i), Value(i)));
+    }
+    EXPECT_OK(storage->UpdateEntry(Key(3), Value(4)));
+  }
+  // Sealed segments are indexed, the last one is not.
+  EXPECT_TRUE(FileExists(SegmentFile("00000000.idx")));
+  EXPECT_TRUE(FileExists(SegmentFile("00000001.seg")));
+
+  unique_ptr<SegmentStorage> storage(Open());
+  EXPECT_EQ(20U, storage->EntryCount());
+  string data;
+  EXPECT_OK(storage->LookupEntry(Key(3), &data));
+  EXPECT_EQ(Value(4), data);
+  EXPECT_OK(storage->UpdateEntry(Key(3), Value(3)));
+  ExpectEntries(*storage, 20);
+
+  EXPECT_OK(storage->CreateEntry(Key(20), Value(20)));
+  storage.reset();
+  ExpectEntries(*Open(), 21);
+}
+
+
+TEST_F(SegmentStorageTest, TruncatesTornRecord) {
+  {
+    unique_ptr<SegmentStorage> storage(Open());
+    EXPECT_OK(storage->CreateEntry(Key(0), Value(0)));
+    EXPECT_OK(storage->CreateEntry(Key(1), Value(1)));
+  }
+  const string segment(SegmentFile("00000000.seg"));
+  const off_t size(FileSize(segment));
+  // Tear the second record.
+  ASSERT_EQ(0, truncate(segment.c_str(), size - 10));
+
+  {
+    unique_ptr<SegmentStorage> storage(Open());
+    ExpectEntries(*storage, 1);
+    EXPECT_OK(storage->CreateEntry(Key(1), Value(1)));
+  }
+  EXPECT_EQ(size, FileSize(segment));
+  ExpectEntries(*Open(), 2);
+}
+
+
+TEST_F(SegmentStorageTest, IgnoresCorruptRecord) {
+  {
+    unique_ptr<SegmentStorage> storage(Open());
+    EXPECT_OK(storage->CreateEntry(Key(0), Value(0)));
+    EXPECT_OK(storage->CreateEntry(Key(1), Value(1)));
+  }
+  const string segment(SegmentFile("00000000.seg"));
+  string data;
+  ASSERT_TRUE(util::ReadBinaryFile(segment, &data));
+  data[data.size() - 1] ^= 1;
+  FILE* const file(fopen(segment.c_str(), "w"));
+  ASSERT_EQ(data.size(), fwrite(data.data(), 1, data.size(), file));
+  fclose(file);
+
+  ExpectEntries(*Open(), 1);
+}
+
+
+TEST_F(SegmentStorageTest, RebuildsMissingIndex) {
+  {
+    unique_ptr<SegmentStorage> storage(Open());
+    for (int i = 0; i < 20; ++i) {
+      EXPECT_OK(storage->CreateEntry(Key(i), Value(i)));
+    }
+  }
+  ASSERT_EQ(0, unlink(SegmentFile("00000000.idx").c_str()));
+  ExpectEntries(*Open(), 20);
+  EXPECT_TRUE(FileExists(SegmentFile("00000000.idx")));
+  ExpectEntries(*Open(), 20);
+}
+
+
+TEST_F(SegmentStorageTest, ImportFromFileStorage) {
+  FileStorage files(dir_, 2);
+  for (int i = 0; i < 10; ++i) {
+    EXPECT_OK(files.CreateEntry(Key(i), Value(i)));
+  }
+
+  unique_ptr<SegmentStorage> storage(Open());
+  EXPECT_OK(storage->CreateEntry(Key(0), Value(0)));
+  storage->Import(files);
+  ExpectEntries(*storage, 10);
+  storage.reset();
+  ExpectEntries(*Open(), 10);
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
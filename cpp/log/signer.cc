@@ -1,24 +1,169 @@
 /* -*- indent-tabs-mode: nil -*- */
 #include "log/signer.h"
 
+#include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <openssl/ecdsa.h>
 #include <openssl/evp.h>
 #include <openssl/opensslv.h>
+#include <openssl/sha.h>
 #include <stdint.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
 
 #include "log/verifier.h"
+#include "monitoring/counter.h"
+#include "monitoring/monitoring.h"
 #include "proto/ct.pb.h"
+#include "util/executor.h"
+#include "util/status.h"
+#include "util/task.h"
 #include "util/util.h"
 
 #if OPENSSL_VERSION_NUMBER < 0x10000000
 #error "Need OpenSSL >= 1.0.0"
 #endif
 
+DEFINE_int32(signer_precomputed_nonces, 0,
+             "If not 0, this many ECDSA nonces are computed ahead of time "
+             "for each signing key, by a background thread, to take them "
+             "off the signing path.");
+
 using cert_trans::Verifier;
+using std::condition_variable;
+using std::lock_guard;
+using std::mutex;
+using std::pair;
+using std::string;
+using std::thread;
+using std::unique_lock;
+using std::vector;
 
 namespace cert_trans {
+namespace {
+
+
+Counter<string>* signer_signatures =
+    Counter<string>::New("signer_signatures", "nonce",
+                         "Number of signatures made, broken down by "
+                         "whether their nonce was precomputed.");
+
+Gauge<>* signer_async_in_flight =
+    Gauge<>::New("signer_async_in_flight",
+                 "Number of asynchronous signatures queued or being made.");
+
+mutex in_flight_lock;
+int64_t in_flight(0);
+
+
+void AddInFlight(int64_t delta) {
+  lock_guard<mutex> lock(in_flight_lock);
+  in_flight += delta;
+  signer_async_in_flight->Set(in_flight);
+}
+
+
+}  // namespace
+
+
+// Keeps a supply of ECDSA nonces, as the (k^-1, r) pairs that
+// ECDSA_sign_setup() computes, for ECDSA_do_sign_ex(). Each pair must
+// only be used once, so Take() hands it over.
+class Signer::NoncePool {
+ public:
+  NoncePool(EC_KEY* key, size_t size)
+      : key_(CHECK_NOTNULL(key)), size_(size), exiting_(false) {
+    CHECK_GT(size_, static_cast<size_t>(0));
+    thread_ = thread(&NoncePool::Fill, this);
+  }
+
+  ~NoncePool() {
+    {
+      lock_guard<mutex> lock(lock_);
+      exiting_ = true;
+    }
+    cv_.notify_all();
+    thread_.join();
+    for (auto& nonce : nonces_) {
+      BN_clear_free(nonce.first);
+      BN_clear_free(nonce.second);
+    }
+  }
+
+  EC_KEY* key() const {
+    return key_.get();
+  }
+
+  // Returns false if none is left.
+  bool Take(ScopedBIGNUM* kinv, ScopedBIGNUM* rp) {
+    lock_guard<mutex> lock(lock_);
+    if (nonces_.empty()) {
+      return false;
+    }
+    kinv->reset(nonces_.back().first);
+    rp->reset(nonces_.back().second);
+    nonces_.pop_back();
+    // Start refilling when half are used.
+    if (nonces_.size() <= size_ / 2) {
+      cv_.notify_all();
+    }
+    return true;
+  }
+
+ private:
+  void Fill() {
+    ScopedBN_CTX ctx(CHECK_NOTNULL(BN_CTX_new()));
+    unique_lock<mutex> lock(lock_);
+    while (true) {
+      cv_.wait(lock, [this]() {
+        return exiting_ || nonces_.size() <= size_ / 2;
+      });
+      while (!exiting_ && nonces_.size() < size_) {
+        lock.unlock();
+        BIGNUM* kinv(nullptr);
+        BIGNUM* rp(nullptr);
+        const bool ok(ECDSA_sign_setup(key_.get(), ctx.get(), &kinv, &rp) ==
+                      1);
+        lock.lock();
+        if (!ok) {
+          LOG(WARNING) << "Failed to precompute an ECDSA nonce.";
+          break;
+        }
+        nonces_.emplace_back(kinv, rp);
+      }
+      if (exiting_) {
+        return;
+      }
+    }
+  }
+
+  const ScopedEC_KEY key_;
+  const size_t size_;
+  mutex lock_;
+  condition_variable cv_;
+  bool exiting_;
+  vector<pair<BIGNUM*, BIGNUM*>> nonces_;
+  thread thread_;
+};
+
+
+// static
+Signer::NoncePool* Signer::NewNoncePool(EVP_PKEY* pkey) {
+  if (FLAGS_signer_precomputed_nonces <= 0 || pkey->type != EVP_PKEY_EC) {
+    return nullptr;
+  }
+  return new NoncePool(CHECK_NOTNULL(EVP_PKEY_get1_EC_KEY(pkey)),
+                       FLAGS_signer_precomputed_nonces);
+}
+
 
-Signer::Signer(EVP_PKEY* pkey) : pkey_(CHECK_NOTNULL(pkey)) {
+Signer::Signer(EVP_PKEY* pkey)
+    : pkey_(CHECK_NOTNULL(pkey)),
+      nonces_(NewNoncePool(pkey)),
+      async_executor_(nullptr) {
   switch (pkey_->type) {
     case EVP_PKEY_EC:
       hash_algo_ = ct::DigitallySigned::SHA256;
@@ -34,6 +179,9 @@ Signer::Signer(EVP_PKEY* pkey) : pkey_(CHECK_NOTNULL(pkey)) {
   key_id_ = Verifier::ComputeKeyID(pkey_.get());
 }
 
+Signer::~Signer() {
+}
+
 std::string Signer::KeyID() const {
   return key_id_;
 }
@@ -45,12 +193,40 @@ void Signer::Sign(const std::string& data,
   signature->set_signature(RawSign(data));
 }
 
+void Signer::SetAsyncExecutor(util::Executor* executor) {
+  async_executor_ = executor;
+}
+
+void Signer::SignAsync(const std::string& data,
+                       ct::DigitallySigned* signature,
+                       util::Task* task) const {
+  if (!async_executor_) {
+    Sign(data, signature);
+    task->Return();
+    return;
+  }
+  AddInFlight(1);
+  async_executor_->Add([this, data, signature, task]() {
+    Sign(data, signature);
+    AddInFlight(-1);
+    task->Return();
+  });
+}
+
 Signer::Signer()
     : hash_algo_(ct::DigitallySigned::NONE),
-      sig_algo_(ct::DigitallySigned::ANONYMOUS) {
+      sig_algo_(ct::DigitallySigned::ANONYMOUS),
+      async_executor_(nullptr) {
 }
 
 std::string Signer::RawSign(const std::string& data) const {
+  std::string precomputed;
+  if (PrecomputedSign(data, &precomputed)) {
+    signer_signatures->Increment("precomputed");
+    return precomputed;
+  }
+  signer_signatures->Increment("inline");
+
   EVP_MD_CTX ctx;
   EVP_MD_CTX_init(&ctx);
   // NOTE: this syntax for setting the hash function requires OpenSSL >= 1.0.0.
@@ -68,4 +244,30 @@ std::string Signer::RawSign(const std::string& data) const {
   return ret;
 }
 
+bool Signer::PrecomputedSign(const std::string& data,
+                             std::string* result) const {
+  ScopedBIGNUM kinv;
+  ScopedBIGNUM rp;
+  if (!nonces_ || !nonces_->Take(&kinv, &rp)) {
+    return false;
+  }
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+  SHA256(reinterpret_cast<const unsigned char*>(data.data()), data.size(),
+         digest);
+  // Produces the same DER encoded signature as EVP_SignFinal().
+  const ScopedECDSA_SIG sig(ECDSA_do_sign_ex(digest, sizeof(digest),
+                                             kinv.get(), rp.get(),
+                                             nonces_->key()));
+  if (!sig) {
+    // This can happen, very rarely, with a given nonce.
+    return false;
+  }
+  const int size(i2d_ECDSA_SIG(sig.get(), nullptr));
+  CHECK_GT(size, 0);
+  result->resize(size);
+  unsigned char* out(reinterpret_cast<unsigned char*>(&(*result)[0]));
+  CHECK_EQ(size, i2d_ECDSA_SIG(sig.get(), &out));
+  return true;
+}
+
 }  // namespace cert_trans
@@ -6,16 +6,26 @@
 #include <openssl/evp.h>
 #include <openssl/x509.h>  // for i2d_PUBKEY
 #include <stdint.h>
+#include <memory>
+#include <string>
 
 #include "proto/ct.pb.h"
 #include "util/openssl_scoped_types.h"
 
+namespace util {
+class Executor;
+class Task;
+}  // namespace util
+
 namespace cert_trans {
 
+// With ECDSA keys, if --signer_precomputed_nonces is set, the per
+// signature nonces are computed ahead of time by a background thread,
+// leaving only a few multiplications for Sign() to do.
 class Signer {
  public:
   explicit Signer(EVP_PKEY* pkey);
-  virtual ~Signer() = default;
+  virtual ~Signer();
   Signer(const Signer&) = delete;
   Signer& operator=(const Signer&) = delete;
 
@@ -24,17 +34,37 @@ class Signer {
   virtual void Sign(const std::string& data,
                     ct::DigitallySigned* signature) const;
 
+  // Has SignAsync() sign on |executor|, which must outlive this
+  // instance. With a key held by a device such as an HSM, where each
+  // signature is a round trip, this is typically a pool of as many
+  // threads as the device has sessions, so that that many signatures
+  // are in flight at once. Without one, SignAsync() signs inline.
+  void SetAsyncExecutor(util::Executor* executor);
+
+  // As Sign(), but returns on |task| once |signature| is set, which must
+  // remain valid until then.
+  virtual void SignAsync(const std::string& data,
+                         ct::DigitallySigned* signature,
+                         util::Task* task) const;
+
  protected:
   // A constructor for mocking.
   Signer();
 
  private:
+  class NoncePool;
+
+  static NoncePool* NewNoncePool(EVP_PKEY* pkey);
   std::string RawSign(const std::string& data) const;
+  // Signs with a precomputed nonce, if there is one.
+  bool PrecomputedSign(const std::string& data, std::string* result) const;
 
   ScopedEVP_PKEY pkey_;
+  const std::unique_ptr<NoncePool> nonces_;
   ct::DigitallySigned::HashAlgorithm hash_algo_;
   ct::DigitallySigned::SignatureAlgorithm sig_algo_;
   std::string key_id_;
+  util::Executor* async_executor_;
 };
 
 }  // namespace cert_trans
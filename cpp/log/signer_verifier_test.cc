@@ -1,7 +1,10 @@
 /* -*- indent-tabs-mode: nil -*- */
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <gtest/gtest.h>
 #include <stdint.h>
+#include <memory>
+#include <set>
 #include <string>
 
 #include "log/signer.h"
@@ -13,9 +16,13 @@
 #include "util/testing.h"
 #include "util/util.h"
 
+DECLARE_int32(signer_precomputed_nonces);
+
 using cert_trans::Verifier;
 using ct::DigitallySigned;
+using std::set;
 using std::string;
+using std::unique_ptr;
 
 namespace cert_trans {
 namespace {
@@ -91,6 +98,26 @@ TEST_F(SignerVerifierTest, SignAndVerify) {
   EXPECT_EQ(Verifier::OK, verifier_->Verify(kTestString, signature2));
 }
 
+// Check that signatures made with precomputed nonces verify, including
+// once the first ones are used up.
+TEST_F(SignerVerifierTest, SignWithPrecomputedNonces) {
+  // The signer reads the flag on construction.
+  FLAGS_signer_precomputed_nonces = 4;
+  unique_ptr<Signer> signer(TestSigner::DefaultSigner());
+  FLAGS_signer_precomputed_nonces = 0;
+  EXPECT_EQ(signer_->KeyID(), signer->KeyID());
+
+  set<string> signatures;
+  for (int i = 0; i < 20; ++i) {
+    DigitallySigned signature;
+    signer->Sign(kTestString, &signature);
+    EXPECT_EQ(DigitallySigned::ECDSA, signature.sig_algorithm());
+    EXPECT_EQ(Verifier::OK, verifier_->Verify(kTestString, signature));
+    // Each nonce is only used once.
+    EXPECT_TRUE(signatures.insert(signature.signature()).second);
+  }
+}
+
 // Check various error cases.
 TEST_F(SignerVerifierTest, Errors) {
   DigitallySigned signature;
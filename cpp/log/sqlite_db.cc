@@ -3,19 +3,31 @@
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <sqlite3.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <map>
+#include <set>
+#include <vector>
 
 #include "log/sqlite_statement.h"
+#include "monitoring/counter.h"
 #include "monitoring/latency.h"
 #include "monitoring/monitoring.h"
 #include "util/util.h"
 
+using std::function;
 using std::unique_ptr;
 using std::chrono::milliseconds;
 using std::lock_guard;
 using std::mutex;
+using std::numeric_limits;
 using std::ostringstream;
 using std::string;
 using std::unique_lock;
+using std::vector;
 
 // Several of these flags pass their value directly through to SQLite PRAGMA
 // statements, see the SQLite documentation
@@ -42,6 +54,27 @@ DEFINE_bool(sqlite_batch_into_transactions, true,
             "scenes.");
 DEFINE_int32(sqlite_transaction_batch_size, 400,
              "Max number of operations to batch into one transaction.");
+DEFINE_int32(sqlite_reader_connections, 8,
+             "Max number of read-only connections serving lookups "
+             "concurrently, in WAL journal mode. 0 serves them all on the "
+             "connection used for writing.");
+DEFINE_bool(sqlite_compress_entries, false,
+            "Whether to compress the entries written, with a dictionary "
+            "trained on the entries of the log.");
+DEFINE_bool(sqlite_hash_filter, true,
+            "Whether to keep a bloom filter of the entry hashes, so that "
+            "most lookups of hashes that are not in the database do not go "
+            "to its index.");
+DEFINE_int32(sqlite_hash_filter_save_interval, 100000,
+             "With --sqlite_hash_filter, number of entries after which the "
+             "filter is saved in the database. This bounds the entries "
+             "added to it again when the database is opened.");
+DEFINE_int64(sqlite_hash_filter_min_capacity, 1 << 20,
+             "With --sqlite_hash_filter, the least number of hashes the "
+             "filter is sized for. It is sized for twice the entries of "
+             "the database otherwise, and rebuilt at startup when it holds "
+             "more hashes than that.");
+DECLARE_bool(db_deduplicate_chains);
 
 namespace cert_trans {
 namespace {
@@ -51,6 +84,36 @@ static Latency<milliseconds, string> latency_by_op_ms(
     "sqlitedb_latency_by_operation_ms", "operation",
     "Database latency in ms broken out by operation");
 
+static Counter<string>* hash_filter_lookups(
+    Counter<string>::New("sqlitedb_hash_filter_lookups", "result",
+                         "Number of LookupByHash() calls checked against "
+                         "the hash filter, by result: \"negative\" ones "
+                         "did not go to the database, and "
+                         "\"false_positive\" ones found nothing there."));
+
+// The name of the hash filter in the metadata table. Its value is the
+// rowid of the last row it covers, a newline, and the filter.
+const char kHashFilterName[] = "hash_filter";
+
+
+// How many rows iterators read at a time.
+const int kScanChunkSize = 256;
+
+// How many keys batch lookups query at a time. A shorter batch repeats
+// its last key, so that they all use the same statement.
+const size_t kLookupBatchSize = 32;
+
+
+// Returns |select| with a list of kLookupBatchSize parameters in
+// parentheses, followed by |rest|.
+string LookupBatchQuery(const string& select, const string& rest) {
+  string query(select + " (?");
+  for (size_t i = 1; i < kLookupBatchSize; ++i) {
+    query += ", ?";
+  }
+  return query + ")" + rest;
+}
+
 
 sqlite3* SQLiteOpen(const string& dbfile) {
   ScopedLatency scoped_latency(latency_by_op_ms.GetScopedLatency("open"));
@@ -100,43 +163,144 @@ sqlite3* SQLiteOpen(const string& dbfile) {
 }  // namespace
 
 
+struct SQLiteDB::Connection {
+  explicit Connection(sqlite3* db) : db(db), statements(db) {
+  }
+
+  ~Connection() {
+    // Closes once |statements| has finalized its statements.
+    CHECK_EQ(SQLITE_OK, sqlite3_close_v2(db));
+  }
+
+  sqlite3* const db;
+  sqlite::StatementCache statements;
+};
+
+
+// Borrows a connection from the reader pool, if there is one and
+// |allowed| is true. Otherwise, get() returns nullptr, and the writer
+// connection has to be used instead.
+class SQLiteDB::ScopedReader {
+ public:
+  ScopedReader(const SQLiteDB* db, bool allowed)
+      : db_(db), reader_(allowed ? db->TakeReader() : nullptr) {
+  }
+
+  ~ScopedReader() {
+    if (reader_) {
+      db_->ReturnReader(std::move(reader_));
+    }
+  }
+
+  sqlite::StatementCache* get() const {
+    return reader_ ? &reader_->statements : nullptr;
+  }
+
+ private:
+  const SQLiteDB* const db_;
+  unique_ptr<Connection> reader_;
+};
+
+
+// Reads the rows in chunks, each with a single statement, and parses
+// them without holding the database lock.
 class SQLiteDB::Iterator : public Database::Iterator {
  public:
-  Iterator(const SQLiteDB* db, int64_t start_index)
-      : db_(CHECK_NOTNULL(db)), next_index_(start_index) {
+  Iterator(const SQLiteDB* db, int64_t start_index, int64_t end_index)
+      : db_(CHECK_NOTNULL(db)),
+        next_index_(start_index),
+        end_index_(end_index),
+        next_row_(0) {
     CHECK_GE(next_index_, 0);
   }
 
   bool GetNextEntry(LoggedEntry* entry) override {
     CHECK_NOTNULL(entry);
-    unique_lock<mutex> lock(db_->lock_);
-    if (next_index_ < db_->tree_size_) {
-      CHECK_EQ(db_->LookupByIndex(lock, next_index_, entry), db_->LOOKUP_OK);
-      ++next_index_;
-      return true;
+    if (next_row_ == rows_.size() && !ReadChunk()) {
+      return false;
     }
 
-    const bool retval(db_->LookupNextIndex(lock, next_index_, entry) ==
-                      db_->LOOKUP_OK);
-    if (retval) {
-      next_index_ = entry->sequence_number() + 1;
+    const Row& row(rows_[next_row_++]);
+    // Only the contents are parsed, and |entry| may be reused.
+    entry->Clear();
+    db_->ParseEntry(row.data, entry);
+    CHECK_EQ(entry->Hash(), row.hash);
+    entry->set_sequence_number(row.sequence_number);
+    return true;
+  }
+
+ private:
+  struct Row {
+    string data;
+    string hash;
+    int64_t sequence_number;
+  };
+
+  bool ReadChunk() {
+    rows_.clear();
+    next_row_ = 0;
+    if (next_index_ >= end_index_) {
+      return false;
     }
 
-    return retval;
+    // A reader would miss the uncommitted entries, which may be in the
+    // middle of the chunk.
+    const ScopedReader reader(db_, !db_->uncommitted_writes_);
+    unique_lock<ContendedMutex> lock(db_->lock_, std::defer_lock);
+    if (!reader.get()) {
+      lock.lock();
+    }
+    sqlite::Statement statement(reader.get() ? reader.get()
+                                             : db_->statements_.get(),
+                                "SELECT entry, hash, sequence FROM leaves "
+                                "WHERE sequence >= ? AND sequence < ? "
+                                "ORDER BY sequence LIMIT ?");
+    statement.BindUInt64(0, next_index_);
+    statement.BindUInt64(1, end_index_);
+    statement.BindUInt64(2, kScanChunkSize);
+    while (statement.Step() == SQLITE_ROW) {
+      rows_.emplace_back();
+      Row& row(rows_.back());
+      statement.GetBlob(0, &row.data);
+      statement.GetBlob(1, &row.hash);
+      row.sequence_number = statement.GetUInt64(2);
+      db_->NoteSequenceNumber(row.sequence_number);
+    }
+
+    if (rows_.empty()) {
+      next_index_ = end_index_;
+      return false;
+    }
+    next_index_ = rows_.back().sequence_number + 1;
+    return true;
   }
 
- private:
   const SQLiteDB* const db_;
   int64_t next_index_;
+  const int64_t end_index_;
+  vector<Row> rows_;
+  size_t next_row_;
 };
 
 
 SQLiteDB::SQLiteDB(const string& dbfile)
-    : db_(SQLiteOpen(dbfile)),
+    : dbfile_(dbfile),
+      lock_(LockContention::Get("sqlite")),
+      db_(SQLiteOpen(dbfile)),
+      statements_(new sqlite::StatementCache(db_)),
+      compress_entries_(FLAGS_sqlite_compress_entries),
+      deduplicate_chains_(FLAGS_db_deduplicate_chains),
+      hash_filter_rowid_(0),
+      hash_filter_unsaved_(0),
       tree_size_(0),
       transaction_size_(0),
-      in_transaction_(false) {
-  unique_lock<mutex> lock(lock_);
+      in_transaction_(false),
+      uncommitted_writes_(false),
+      max_readers_(strcasecmp(FLAGS_sqlite_journal_mode.c_str(), "WAL") == 0
+                       ? FLAGS_sqlite_reader_connections
+                       : 0),
+      open_readers_(0) {
+  unique_lock<ContendedMutex> lock(lock_);
   {
     ostringstream oss;
     oss << "PRAGMA synchronous = " << FLAGS_sqlite_synchronous_mode;
@@ -168,11 +332,49 @@ SQLiteDB::SQLiteDB(const string& dbfile)
     CHECK_EQ(SQLITE_DONE, statement.Step()) << sqlite3_errmsg(db_);
   }
 
+  {
+    // This table was added later than the others, so also create it in
+    // existing databases.
+    sqlite::Statement statement(db_,
+                                "CREATE TABLE IF NOT EXISTS tiles("
+                                "level INTEGER, idx INTEGER, hashes BLOB, "
+                                "PRIMARY KEY(level, idx))");
+    CHECK_EQ(SQLITE_DONE, statement.Step()) << sqlite3_errmsg(db_);
+  }
+
+  {
+    // Same as for the tiles table.
+    sqlite::Statement statement(db_,
+                                "CREATE TABLE IF NOT EXISTS metadata("
+                                "name BLOB UNIQUE, value BLOB)");
+    CHECK_EQ(SQLITE_DONE, statement.Step()) << sqlite3_errmsg(db_);
+  }
+
+  {
+    // Same as for the tiles table.
+    sqlite::Statement statement(db_,
+                                "CREATE TABLE IF NOT EXISTS frontiers("
+                                "tree_size INTEGER PRIMARY KEY, "
+                                "hashes BLOB)");
+    CHECK_EQ(SQLITE_DONE, statement.Step()) << sqlite3_errmsg(db_);
+  }
+
+  LoadMetadata(lock);
+  if (FLAGS_sqlite_hash_filter) {
+    LoadHashFilter(lock);
+  }
   BeginTransaction(lock);
 }
 
 
 SQLiteDB::~SQLiteDB() {
+  {
+    lock_guard<mutex> lock(readers_lock_);
+    CHECK_EQ(open_readers_, static_cast<int>(idle_readers_.size()))
+        << "readers still in use";
+    idle_readers_.clear();
+  }
+  statements_.reset();
   CHECK_EQ(SQLITE_OK, sqlite3_close(db_)) << sqlite3_errmsg(db_);
 }
 
@@ -181,37 +383,54 @@ Database::WriteResult SQLiteDB::CreateSequencedEntry_(
     const LoggedEntry& logged) {
   ScopedLatency latency(
       latency_by_op_ms.GetScopedLatency("create_sequenced_entry"));
-  unique_lock<mutex> lock(lock_);
+  unique_lock<ContendedMutex> lock(lock_);
 
   MaybeStartNewTransaction(lock);
 
-  sqlite::Statement statement(db_,
+  sqlite::Statement statement(statements_.get(),
                               "INSERT INTO leaves(hash, entry, sequence) "
                               "VALUES(?, ?, ?)");
   const string hash(logged.Hash());
   statement.BindBlob(0, hash);
 
   string data;
-  CHECK(logged.SerializeForDatabase(&data));
+  if (deduplicate_chains_) {
+    LoggedEntry copy;
+    copy.CopyFrom(logged);
+    chain_certs_->Deduplicate(&copy);
+    CHECK(copy.SerializeForDatabase(&data));
+  } else {
+    CHECK(logged.SerializeForDatabase(&data));
+  }
+  if (compress_entries_) {
+    data = compressor_.Compress(data);
+  }
+  // The statement does not copy |data|.
   statement.BindBlob(1, data);
 
   CHECK(logged.has_sequence_number());
   statement.BindUInt64(2, logged.sequence_number());
 
+  // Lookups must find the hash as soon as the row is there, so it goes
+  // in the filter first. Should the insertion fail, it is only a false
+  // positive.
+  if (hash_filter_) {
+    hash_filter_->Add(hash);
+  }
+
   int ret = statement.Step();
   if (ret == SQLITE_CONSTRAINT) {
     // Check whether we're trying to store a hash/sequence pair which already
     // exists - if it's identical we'll return OK as it could be the fetcher.
     sqlite::Statement s2(
-        db_, "SELECT sequence, hash FROM leaves WHERE sequence = ?");
+        statements_.get(),
+        "SELECT sequence, hash FROM leaves WHERE sequence = ?");
     s2.BindUInt64(0, logged.sequence_number());
     if (s2.Step() == SQLITE_ROW) {
       string existing_hash;
       s2.GetBlob(1, &existing_hash);
 
-      if (logged.sequence_number() == tree_size_) {
-        ++tree_size_;
-      }
+      NoteSequenceNumber(logged.sequence_number());
 
       if (hash == existing_hash) {
         return this->OK;
@@ -221,8 +440,13 @@ Database::WriteResult SQLiteDB::CreateSequencedEntry_(
   }
   CHECK_EQ(SQLITE_DONE, ret) << sqlite3_errmsg(db_);
 
-  if (logged.sequence_number() == tree_size_) {
-    ++tree_size_;
+  NoteSequenceNumber(logged.sequence_number());
+
+  if (hash_filter_) {
+    hash_filter_rowid_ = sqlite3_last_insert_rowid(db_);
+    if (++hash_filter_unsaved_ >= FLAGS_sqlite_hash_filter_save_interval) {
+      SaveHashFilter(lock);
+    }
   }
 
   return this->OK;
@@ -234,9 +458,36 @@ Database::LookupResult SQLiteDB::LookupByHash(const string& hash,
   CHECK_NOTNULL(result);
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("lookup_by_hash"));
 
-  lock_guard<mutex> lock(lock_);
+  if (hash_filter_ && !hash_filter_->MayContain(hash)) {
+    hash_filter_lookups->Increment("negative");
+    return this->NOT_FOUND;
+  }
+
+  LookupResult ret;
+  {
+    // An uncommitted entry could have a lower sequence number than the
+    // one a reader would find.
+    const ScopedReader reader(this, !uncommitted_writes_);
+    if (reader.get()) {
+      ret = LookupByHash(reader.get(), hash, result);
+    } else {
+      lock_guard<ContendedMutex> lock(lock_);
+      ret = LookupByHash(statements_.get(), hash, result);
+    }
+  }
+
+  if (hash_filter_) {
+    hash_filter_lookups->Increment(ret == this->LOOKUP_OK ? "positive"
+                                                          : "false_positive");
+  }
+  return ret;
+}
 
-  sqlite::Statement statement(db_,
+
+Database::LookupResult SQLiteDB::LookupByHash(
+    sqlite::StatementCache* connection, const string& hash,
+    LoggedEntry* result) const {
+  sqlite::Statement statement(connection,
                               "SELECT entry, sequence FROM leaves "
                               "WHERE hash = ? ORDER BY sequence LIMIT 1");
 
@@ -246,19 +497,17 @@ Database::LookupResult SQLiteDB::LookupByHash(const string& hash,
   if (ret == SQLITE_DONE) {
     return this->NOT_FOUND;
   }
-  CHECK_EQ(SQLITE_ROW, ret) << sqlite3_errmsg(db_);
+  CHECK_EQ(SQLITE_ROW, ret) << sqlite3_errmsg(connection->db());
 
   string data;
   statement.GetBlob(0, &data);
-  CHECK(result->ParseFromDatabase(data));
+  ParseEntry(data, result);
 
   if (statement.GetType(1) == SQLITE_NULL) {
     result->clear_sequence_number();
   } else {
     result->set_sequence_number(statement.GetUInt64(1));
-    if (result->sequence_number() == tree_size_) {
-      ++tree_size_;
-    }
+    NoteSequenceNumber(result->sequence_number());
   }
 
   return this->LOOKUP_OK;
@@ -267,20 +516,33 @@ Database::LookupResult SQLiteDB::LookupByHash(const string& hash,
 
 Database::LookupResult SQLiteDB::LookupByIndex(int64_t sequence_number,
                                                LoggedEntry* result) const {
+  CHECK_GE(sequence_number, 0);
+  CHECK_NOTNULL(result);
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("lookup_by_index"));
-  unique_lock<mutex> lock(lock_);
 
-  return LookupByIndex(lock, sequence_number, result);
+  {
+    // Entries never change once written, so only a missing one might
+    // be uncommitted.
+    const bool uncommitted_writes(uncommitted_writes_);
+    const ScopedReader reader(this, true);
+    if (reader.get()) {
+      const LookupResult ret(
+          LookupByIndex(reader.get(), sequence_number, result));
+      if (ret == this->LOOKUP_OK || !uncommitted_writes) {
+        return ret;
+      }
+    }
+  }
+
+  lock_guard<ContendedMutex> lock(lock_);
+  return LookupByIndex(statements_.get(), sequence_number, result);
 }
 
 
-Database::LookupResult SQLiteDB::LookupByIndex(const unique_lock<mutex>& lock,
-                                               int64_t sequence_number,
-                                               LoggedEntry* result) const {
-  CHECK(lock.owns_lock());
-  CHECK_GE(sequence_number, 0);
-  CHECK_NOTNULL(result);
-  sqlite::Statement statement(db_,
+Database::LookupResult SQLiteDB::LookupByIndex(
+    sqlite::StatementCache* connection, int64_t sequence_number,
+    LoggedEntry* result) const {
+  sqlite::Statement statement(connection,
                               "SELECT entry, hash FROM leaves "
                               "WHERE sequence = ?");
   statement.BindUInt64(0, sequence_number);
@@ -288,10 +550,11 @@ Database::LookupResult SQLiteDB::LookupByIndex(const unique_lock<mutex>& lock,
   if (ret == SQLITE_DONE) {
     return this->NOT_FOUND;
   }
+  CHECK_EQ(SQLITE_ROW, ret) << sqlite3_errmsg(connection->db());
 
   string data;
   statement.GetBlob(0, &data);
-  CHECK(result->ParseFromDatabase(data));
+  ParseEntry(data, result);
 
   string hash;
   statement.GetBlob(1, &hash);
@@ -299,81 +562,236 @@ Database::LookupResult SQLiteDB::LookupByIndex(const unique_lock<mutex>& lock,
   CHECK_EQ(result->Hash(), hash);
 
   result->set_sequence_number(sequence_number);
-  if (result->sequence_number() == tree_size_) {
-    ++tree_size_;
-  }
+  NoteSequenceNumber(sequence_number);
 
   return this->LOOKUP_OK;
 }
 
 
-Database::LookupResult SQLiteDB::LookupNextIndex(
-    const unique_lock<mutex>& lock, int64_t sequence_number,
-    LoggedEntry* result) const {
-  CHECK(lock.owns_lock());
-  CHECK_GE(sequence_number, 0);
-  CHECK_NOTNULL(result);
-  sqlite::Statement statement(db_,
-                              "SELECT entry, hash, sequence FROM leaves "
-                              "WHERE sequence >= ? ORDER BY sequence");
-  statement.BindUInt64(0, sequence_number);
-  if (statement.Step() == SQLITE_DONE) {
-    return this->NOT_FOUND;
+vector<Database::LookupResult> SQLiteDB::LookupByHashes(
+    const vector<string>& hashes, vector<LoggedEntry>* results) const {
+  CHECK_NOTNULL(results)->resize(hashes.size());
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("lookup_by_hashes"));
+
+  vector<LookupResult> found(hashes.size(), this->NOT_FOUND);
+  vector<size_t> positions;
+  for (size_t i = 0; i < hashes.size(); ++i) {
+    if (hash_filter_ && !hash_filter_->MayContain(hashes[i])) {
+      hash_filter_lookups->Increment("negative");
+      continue;
+    }
+    positions.push_back(i);
   }
 
-  string data;
-  statement.GetBlob(0, &data);
-  CHECK(result->ParseFromDatabase(data));
+  {
+    // As in LookupByHash().
+    const ScopedReader reader(this, !uncommitted_writes_);
+    if (reader.get()) {
+      LookupByHashes(reader.get(), hashes, positions, results, &found);
+    } else {
+      lock_guard<ContendedMutex> lock(lock_);
+      LookupByHashes(statements_.get(), hashes, positions, results, &found);
+    }
+  }
 
-  string hash;
-  statement.GetBlob(1, &hash);
+  if (hash_filter_) {
+    for (const size_t i : positions) {
+      hash_filter_lookups->Increment(
+          found[i] == this->LOOKUP_OK ? "positive" : "false_positive");
+    }
+  }
+  return found;
+}
 
-  CHECK_EQ(result->Hash(), hash);
 
-  result->set_sequence_number(statement.GetUInt64(2));
-  if (result->sequence_number() == tree_size_) {
-    ++tree_size_;
+void SQLiteDB::LookupByHashes(sqlite::StatementCache* connection,
+                              const vector<string>& hashes,
+                              const vector<size_t>& positions,
+                              vector<LoggedEntry>* results,
+                              vector<LookupResult>* found) const {
+  // The first row of each hash is the one LookupByHash() returns.
+  static const string query(LookupBatchQuery(
+      "SELECT entry, hash, sequence FROM leaves WHERE hash IN",
+      " ORDER BY sequence"));
+
+  for (size_t start = 0; start < positions.size();
+       start += kLookupBatchSize) {
+    const size_t end(std::min(positions.size(), start + kLookupBatchSize));
+    std::multimap<string, size_t> wanted;
+    sqlite::Statement statement(connection, query.c_str());
+    for (size_t i = 0; i < kLookupBatchSize; ++i) {
+      const size_t position(positions[std::min(start + i, end - 1)]);
+      statement.BindBlob(i, hashes[position]);
+      if (start + i < end) {
+        wanted.emplace(hashes[position], position);
+      }
+    }
+
+    int ret;
+    while ((ret = statement.Step()) == SQLITE_ROW) {
+      string hash;
+      statement.GetBlob(1, &hash);
+      const auto range(wanted.equal_range(hash));
+      if (range.first == range.second) {
+        // Not the first row of this hash.
+        continue;
+      }
+      string data;
+      statement.GetBlob(0, &data);
+      LoggedEntry* const first(&(*results)[range.first->second]);
+      ParseEntry(data, first);
+      if (statement.GetType(2) == SQLITE_NULL) {
+        first->clear_sequence_number();
+      } else {
+        first->set_sequence_number(statement.GetUInt64(2));
+        NoteSequenceNumber(first->sequence_number());
+      }
+      for (auto it(range.first); it != range.second; ++it) {
+        if (it != range.first) {
+          (*results)[it->second].CopyFrom(*first);
+        }
+        (*found)[it->second] = this->LOOKUP_OK;
+      }
+      wanted.erase(range.first, range.second);
+    }
+    CHECK_EQ(SQLITE_DONE, ret) << sqlite3_errmsg(connection->db());
   }
+}
 
-  return this->LOOKUP_OK;
+
+vector<Database::LookupResult> SQLiteDB::LookupByIndices(
+    const vector<int64_t>& sequence_numbers,
+    vector<LoggedEntry>* results) const {
+  CHECK_NOTNULL(results)->resize(sequence_numbers.size());
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("lookup_by_indices"));
+
+  vector<LookupResult> found(sequence_numbers.size(), this->NOT_FOUND);
+  vector<size_t> positions;
+  for (size_t i = 0; i < sequence_numbers.size(); ++i) {
+    CHECK_GE(sequence_numbers[i], 0);
+    positions.push_back(i);
+  }
+
+  {
+    // As in LookupByIndex(), only the missing entries are looked up
+    // again, if they might be uncommitted.
+    const bool uncommitted_writes(uncommitted_writes_);
+    const ScopedReader reader(this, true);
+    if (reader.get()) {
+      LookupByIndices(reader.get(), sequence_numbers, positions, results,
+                      &found);
+      if (!uncommitted_writes) {
+        return found;
+      }
+      positions.erase(std::remove_if(positions.begin(), positions.end(),
+                                     [&found](size_t i) {
+                                       return found[i] == LOOKUP_OK;
+                                     }),
+                      positions.end());
+    }
+  }
+
+  lock_guard<ContendedMutex> lock(lock_);
+  LookupByIndices(statements_.get(), sequence_numbers, positions, results,
+                  &found);
+  return found;
+}
+
+
+void SQLiteDB::LookupByIndices(sqlite::StatementCache* connection,
+                               const vector<int64_t>& sequence_numbers,
+                               const vector<size_t>& positions,
+                               vector<LoggedEntry>* results,
+                               vector<LookupResult>* found) const {
+  static const string query(LookupBatchQuery(
+      "SELECT entry, hash, sequence FROM leaves WHERE sequence IN", ""));
+
+  for (size_t start = 0; start < positions.size();
+       start += kLookupBatchSize) {
+    const size_t end(std::min(positions.size(), start + kLookupBatchSize));
+    std::multimap<int64_t, size_t> wanted;
+    sqlite::Statement statement(connection, query.c_str());
+    for (size_t i = 0; i < kLookupBatchSize; ++i) {
+      const size_t position(positions[std::min(start + i, end - 1)]);
+      statement.BindUInt64(i, sequence_numbers[position]);
+      if (start + i < end) {
+        wanted.emplace(sequence_numbers[position], position);
+      }
+    }
+
+    int ret;
+    while ((ret = statement.Step()) == SQLITE_ROW) {
+      const int64_t sequence_number(statement.GetUInt64(2));
+      const auto range(wanted.equal_range(sequence_number));
+      CHECK(range.first != range.second);
+      string data;
+      statement.GetBlob(0, &data);
+      string hash;
+      statement.GetBlob(1, &hash);
+      LoggedEntry* const first(&(*results)[range.first->second]);
+      ParseEntry(data, first);
+      CHECK_EQ(first->Hash(), hash);
+      first->set_sequence_number(sequence_number);
+      NoteSequenceNumber(sequence_number);
+      for (auto it(range.first); it != range.second; ++it) {
+        if (it != range.first) {
+          (*results)[it->second].CopyFrom(*first);
+        }
+        (*found)[it->second] = this->LOOKUP_OK;
+      }
+    }
+    CHECK_EQ(SQLITE_DONE, ret) << sqlite3_errmsg(connection->db());
+  }
 }
 
 
 unique_ptr<Database::Iterator> SQLiteDB::ScanEntries(
     int64_t start_index) const {
-  return unique_ptr<Iterator>(new Iterator(this, start_index));
+  return ScanEntries_(start_index, numeric_limits<int64_t>::max(), true);
+}
+
+
+unique_ptr<Database::Iterator> SQLiteDB::ScanEntries_(int64_t start_index,
+                                                      int64_t end_index,
+                                                      bool) const {
+  return unique_ptr<Iterator>(new Iterator(this, start_index, end_index));
 }
 
 
 Database::WriteResult SQLiteDB::WriteTreeHead_(const ct::SignedTreeHead& sth) {
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("write_tree_head"));
-  unique_lock<mutex> lock(lock_);
-
-  sqlite::Statement statement(db_,
-                              "INSERT INTO trees(timestamp, sth) "
-                              "VALUES(?, ?)");
-  statement.BindUInt64(0, sth.timestamp());
-
-  string sth_data;
-  CHECK(sth.SerializeToString(&sth_data));
-  statement.BindBlob(1, sth_data);
-
-  int r2 = statement.Step();
-  if (r2 == SQLITE_CONSTRAINT) {
-    sqlite::Statement s2(db_,
-                         "SELECT timestamp,sth FROM trees "
-                         "WHERE timestamp = ?");
-    s2.BindUInt64(0, sth.timestamp());
-    CHECK_EQ(SQLITE_ROW, s2.Step()) << sqlite3_errmsg(db_);
-    string existing_sth_data;
-    s2.GetBlob(1, &existing_sth_data);
-    if (existing_sth_data == sth_data) {
-      LOG(WARNING) << "Attempted to store indentical STH in DB.";
-      return this->OK;
+  unique_lock<ContendedMutex> lock(lock_);
+
+  {
+    // The statements go back to statements_ when destroyed, so they
+    // must not outlive the lock.
+    sqlite::Statement statement(statements_.get(),
+                                "INSERT INTO trees(timestamp, sth) "
+                                "VALUES(?, ?)");
+    statement.BindUInt64(0, sth.timestamp());
+
+    string sth_data;
+    CHECK(sth.SerializeToString(&sth_data));
+    statement.BindBlob(1, sth_data);
+
+    int r2 = statement.Step();
+    if (r2 == SQLITE_CONSTRAINT) {
+      sqlite::Statement s2(statements_.get(),
+                           "SELECT timestamp,sth FROM trees "
+                           "WHERE timestamp = ?");
+      s2.BindUInt64(0, sth.timestamp());
+      CHECK_EQ(SQLITE_ROW, s2.Step()) << sqlite3_errmsg(db_);
+      string existing_sth_data;
+      s2.GetBlob(1, &existing_sth_data);
+      if (existing_sth_data == sth_data) {
+        LOG(WARNING) << "Attempted to store indentical STH in DB.";
+        return this->OK;
+      }
+      return this->DUPLICATE_TREE_HEAD_TIMESTAMP;
     }
-    return this->DUPLICATE_TREE_HEAD_TIMESTAMP;
+    CHECK_EQ(SQLITE_DONE, r2) << sqlite3_errmsg(db_);
   }
-  CHECK_EQ(SQLITE_DONE, r2) << sqlite3_errmsg(db_);
 
   EndTransaction(lock);
   BeginTransaction(lock);
@@ -390,31 +808,40 @@ Database::WriteResult SQLiteDB::WriteTreeHead_(const ct::SignedTreeHead& sth) {
 Database::LookupResult SQLiteDB::LatestTreeHead(
     ct::SignedTreeHead* result) const {
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("latest_tree_head"));
-  unique_lock<mutex> lock(lock_);
 
+  {
+    // Tree heads are committed as soon as they are written.
+    const ScopedReader reader(this, true);
+    if (reader.get()) {
+      return LatestTreeHead(reader.get(), result);
+    }
+  }
+
+  unique_lock<ContendedMutex> lock(lock_);
   return LatestTreeHeadNoLock(lock, result);
 }
 
 
 int64_t SQLiteDB::TreeSize() const {
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("tree_size"));
-  unique_lock<mutex> lock(lock_);
+  unique_lock<ContendedMutex> lock(lock_);
 
   CHECK_GE(tree_size_, 0);
   sqlite::Statement statement(
-      db_,
+      statements_.get(),
       "SELECT sequence FROM leaves WHERE sequence >= ? ORDER BY sequence");
   statement.BindUInt64(0, tree_size_);
 
   int ret(statement.Step());
   while (ret == SQLITE_ROW) {
-    const sqlite3_uint64 sequence(statement.GetUInt64(0));
+    const int64_t sequence(statement.GetUInt64(0));
 
-    if (sequence != static_cast<uint64_t>(tree_size_)) {
+    // Readers may have advanced the tree size meanwhile.
+    if (sequence > tree_size_) {
       return tree_size_;
     }
 
-    ++tree_size_;
+    NoteSequenceNumber(sequence);
     ret = statement.Step();
   }
   CHECK_EQ(SQLITE_DONE, ret) << sqlite3_errmsg(db_);
@@ -423,9 +850,31 @@ int64_t SQLiteDB::TreeSize() const {
 }
 
 
+vector<std::pair<int64_t, int64_t>> SQLiteDB::SparseRanges() const {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("sparse_ranges"));
+  // Also brings tree_size_ up to date.
+  const int64_t tree_size(TreeSize());
+  unique_lock<ContendedMutex> lock(lock_);
+
+  std::set<int64_t> sparse_entries;
+  sqlite::Statement statement(
+      statements_.get(),
+      "SELECT sequence FROM leaves WHERE sequence > ? ORDER BY sequence");
+  statement.BindUInt64(0, tree_size);
+  int ret(statement.Step());
+  while (ret == SQLITE_ROW) {
+    sparse_entries.insert(statement.GetUInt64(0));
+    ret = statement.Step();
+  }
+  CHECK_EQ(SQLITE_DONE, ret) << sqlite3_errmsg(db_);
+
+  return ToRanges(sparse_entries);
+}
+
+
 void SQLiteDB::AddNotifySTHCallback(
     const Database::NotifySTHCallback* callback) {
-  unique_lock<mutex> lock(lock_);
+  unique_lock<ContendedMutex> lock(lock_);
 
   callbacks_.Add(callback);
 
@@ -441,7 +890,7 @@ void SQLiteDB::AddNotifySTHCallback(
 
 void SQLiteDB::RemoveNotifySTHCallback(
     const Database::NotifySTHCallback* callback) {
-  lock_guard<mutex> lock(lock_);
+  lock_guard<ContendedMutex> lock(lock_);
 
   callbacks_.Remove(callback);
 }
@@ -450,13 +899,14 @@ void SQLiteDB::RemoveNotifySTHCallback(
 void SQLiteDB::InitializeNode(const string& node_id) {
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("initialize_node"));
   CHECK(!node_id.empty());
-  unique_lock<mutex> lock(lock_);
+  unique_lock<ContendedMutex> lock(lock_);
   string existing_id;
   if (NodeId(lock, &existing_id) != this->NOT_FOUND) {
     LOG(FATAL) << "Attempting to initialize DB beloging to node with node_id: "
                << existing_id;
   }
-  sqlite::Statement statement(db_, "INSERT INTO node(node_id) VALUES(?)");
+  sqlite::Statement statement(statements_.get(),
+                              "INSERT INTO node(node_id) VALUES(?)");
   statement.BindBlob(0, node_id);
 
   const int result(statement.Step());
@@ -465,17 +915,17 @@ void SQLiteDB::InitializeNode(const string& node_id) {
 
 
 Database::LookupResult SQLiteDB::NodeId(string* node_id) {
-  unique_lock<mutex> lock(lock_);
+  unique_lock<ContendedMutex> lock(lock_);
   return NodeId(lock, CHECK_NOTNULL(node_id));
 }
 
 
-Database::LookupResult SQLiteDB::NodeId(const unique_lock<mutex>& lock,
+Database::LookupResult SQLiteDB::NodeId(const unique_lock<ContendedMutex>& lock,
                                         string* node_id) {
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("set_node_id"));
   CHECK(lock.owns_lock());
   CHECK_NOTNULL(node_id);
-  sqlite::Statement statement(db_, "SELECT node_id FROM node");
+  sqlite::Statement statement(statements_.get(), "SELECT node_id FROM node");
 
   int result(statement.Step());
   if (result == SQLITE_DONE) {
@@ -491,30 +941,288 @@ Database::LookupResult SQLiteDB::NodeId(const unique_lock<mutex>& lock,
 }
 
 
-void SQLiteDB::BeginTransaction(const unique_lock<mutex>& lock) {
+Database::WriteResult SQLiteDB::WriteTile_(int level, int64_t index,
+                                          const string& hashes) {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("write_tile"));
+  unique_lock<ContendedMutex> lock(lock_);
+
+  MaybeStartNewTransaction(lock);
+
+  sqlite::Statement statement(statements_.get(),
+                              "INSERT OR REPLACE INTO tiles(level, idx, "
+                              "hashes) VALUES(?, ?, ?)");
+  statement.BindUInt64(0, level);
+  statement.BindUInt64(1, index);
+  statement.BindBlob(2, hashes);
+  CHECK_EQ(SQLITE_DONE, statement.Step()) << sqlite3_errmsg(db_);
+
+  return this->OK;
+}
+
+
+Database::LookupResult SQLiteDB::LookupTile(int level, int64_t index,
+                                            string* hashes) const {
+  CHECK_NOTNULL(hashes);
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("lookup_tile"));
+
+  {
+    // Tiles get replaced as they fill up, so a reader could return an
+    // older one.
+    const ScopedReader reader(this, !uncommitted_writes_);
+    if (reader.get()) {
+      return LookupTile(reader.get(), level, index, hashes);
+    }
+  }
+
+  lock_guard<ContendedMutex> lock(lock_);
+  return LookupTile(statements_.get(), level, index, hashes);
+}
+
+
+Database::LookupResult SQLiteDB::LookupTile(sqlite::StatementCache* connection,
+                                            int level, int64_t index,
+                                            string* hashes) const {
+  sqlite::Statement statement(connection,
+                              "SELECT hashes FROM tiles "
+                              "WHERE level = ? AND idx = ?");
+  statement.BindUInt64(0, level);
+  statement.BindUInt64(1, index);
+
+  const int ret(statement.Step());
+  if (ret == SQLITE_DONE) {
+    return this->NOT_FOUND;
+  }
+  CHECK_EQ(SQLITE_ROW, ret) << sqlite3_errmsg(connection->db());
+  statement.GetBlob(0, hashes);
+  return this->LOOKUP_OK;
+}
+
+
+Database::WriteResult SQLiteDB::WriteFrontier_(int64_t tree_size,
+                                              const string& hashes) {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("write_frontier"));
+  unique_lock<ContendedMutex> lock(lock_);
+
+  MaybeStartNewTransaction(lock);
+
+  sqlite::Statement statement(statements_.get(),
+                              "INSERT OR REPLACE INTO frontiers(tree_size, "
+                              "hashes) VALUES(?, ?)");
+  statement.BindUInt64(0, tree_size);
+  statement.BindBlob(1, hashes);
+  CHECK_EQ(SQLITE_DONE, statement.Step()) << sqlite3_errmsg(db_);
+
+  return this->OK;
+}
+
+
+Database::LookupResult SQLiteDB::LookupFrontier(int64_t tree_size,
+                                                string* hashes) const {
+  CHECK_NOTNULL(hashes);
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("lookup_frontier"));
+
+  {
+    const ScopedReader reader(this, !uncommitted_writes_);
+    if (reader.get()) {
+      return LookupFrontier(reader.get(), tree_size, hashes);
+    }
+  }
+
+  lock_guard<ContendedMutex> lock(lock_);
+  return LookupFrontier(statements_.get(), tree_size, hashes);
+}
+
+
+Database::LookupResult SQLiteDB::LookupFrontier(
+    sqlite::StatementCache* connection, int64_t tree_size,
+    string* hashes) const {
+  sqlite::Statement statement(connection,
+                              "SELECT hashes FROM frontiers "
+                              "WHERE tree_size = ?");
+  statement.BindUInt64(0, tree_size);
+
+  const int ret(statement.Step());
+  if (ret == SQLITE_DONE) {
+    return this->NOT_FOUND;
+  }
+  CHECK_EQ(SQLITE_ROW, ret) << sqlite3_errmsg(connection->db());
+  statement.GetBlob(0, hashes);
+  return this->LOOKUP_OK;
+}
+
+
+void SQLiteDB::LoadMetadata(const unique_lock<ContendedMutex>& lock) {
+  CHECK(lock.owns_lock());
+  const function<bool(const string&, string*)> read_metadata(
+      [this](const string& name, string* value) {
+        sqlite::Statement statement(statements_.get(),
+                                    "SELECT value FROM metadata "
+                                    "WHERE name = ?");
+        statement.BindBlob(0, name);
+        const int ret(statement.Step());
+        if (ret == SQLITE_DONE) {
+          return false;
+        }
+        CHECK_EQ(SQLITE_ROW, ret) << sqlite3_errmsg(db_);
+        statement.GetBlob(0, value);
+        return true;
+      });
+  const function<void(const string&, const string&)> write_metadata(
+      [this](const string& name, const string& value) {
+        sqlite::Statement statement(statements_.get(),
+                                    "INSERT OR REPLACE INTO metadata(name, "
+                                    "value) VALUES(?, ?)");
+        statement.BindBlob(0, name);
+        statement.BindBlob(1, value);
+        CHECK_EQ(SQLITE_DONE, statement.Step()) << sqlite3_errmsg(db_);
+      });
+  // The dictionaries and chains are needed to read the entries stored
+  // with them earlier, even if new ones are not.
+  compressor_.LoadDictionaries(read_metadata);
+  chain_certs_.reset(new ChainCertStore(read_metadata, write_metadata));
+  if (!compress_entries_) {
+    return;
+  }
+
+  int64_t entry_count;
+  {
+    sqlite::Statement statement(statements_.get(),
+                                "SELECT COUNT(*) FROM leaves");
+    CHECK_EQ(SQLITE_ROW, statement.Step()) << sqlite3_errmsg(db_);
+    entry_count = statement.GetUInt64(0);
+  }
+  compressor_.MaybeTrainDictionary(
+      entry_count,
+      [this](int64_t sequence_number, string* entry) {
+        sqlite::Statement statement(statements_.get(),
+                                    "SELECT entry FROM leaves "
+                                    "WHERE sequence = ?");
+        statement.BindUInt64(0, sequence_number);
+        if (statement.Step() != SQLITE_ROW) {
+          return false;
+        }
+        string data;
+        statement.GetBlob(0, &data);
+        *entry = DecompressEntry(data);
+        return true;
+      },
+      write_metadata);
+}
+
+
+void SQLiteDB::LoadHashFilter(const unique_lock<ContendedMutex>& lock) {
+  CHECK(lock.owns_lock());
+  int64_t entry_count;
+  {
+    sqlite::Statement statement(statements_.get(),
+                                "SELECT COUNT(*) FROM leaves");
+    CHECK_EQ(SQLITE_ROW, statement.Step()) << sqlite3_errmsg(db_);
+    entry_count = statement.GetUInt64(0);
+  }
+
+  {
+    sqlite::Statement statement(statements_.get(),
+                                "SELECT value FROM metadata WHERE name = ?");
+    statement.BindBlob(0, kHashFilterName);
+    if (statement.Step() == SQLITE_ROW) {
+      string value;
+      statement.GetBlob(0, &value);
+      const size_t newline(value.find('\n'));
+      if (newline != string::npos) {
+        hash_filter_ = HashFilter::Parse(value.substr(newline + 1));
+        hash_filter_rowid_ = atoll(value.substr(0, newline).c_str());
+      }
+    }
+  }
+
+  if (hash_filter_ && hash_filter_->capacity() >= entry_count) {
+    CatchUpHashFilter(lock);
+    return;
+  }
+
+  LOG(INFO) << "Building the hash filter for " << entry_count
+            << " entries.";
+  hash_filter_.reset(new HashFilter(std::max<int64_t>(
+      FLAGS_sqlite_hash_filter_min_capacity, 2 * entry_count)));
+  hash_filter_rowid_ = 0;
+  CatchUpHashFilter(lock);
+  SaveHashFilter(lock);
+}
+
+
+void SQLiteDB::CatchUpHashFilter(const unique_lock<ContendedMutex>& lock) {
+  CHECK(lock.owns_lock());
+  sqlite::Statement statement(statements_.get(),
+                              "SELECT rowid, hash FROM leaves "
+                              "WHERE rowid > ? ORDER BY rowid");
+  statement.BindUInt64(0, hash_filter_rowid_);
+  string hash;
+  while (statement.Step() == SQLITE_ROW) {
+    hash_filter_rowid_ = statement.GetUInt64(0);
+    statement.GetBlob(1, &hash);
+    hash_filter_->Add(hash);
+    ++hash_filter_unsaved_;
+  }
+}
+
+
+void SQLiteDB::SaveHashFilter(const unique_lock<ContendedMutex>& lock) {
+  CHECK(lock.owns_lock());
+  // This goes in the same transaction as the rows it covers.
+  sqlite::Statement statement(statements_.get(),
+                              "INSERT OR REPLACE INTO metadata(name, "
+                              "value) VALUES(?, ?)");
+  statement.BindBlob(0, kHashFilterName);
+  const string value(std::to_string(hash_filter_rowid_) + "\n" +
+                     hash_filter_->Serialize());
+  statement.BindBlob(1, value);
+  CHECK_EQ(SQLITE_DONE, statement.Step()) << sqlite3_errmsg(db_);
+  hash_filter_unsaved_ = 0;
+}
+
+
+string SQLiteDB::DecompressEntry(const string& data) const {
+  string result;
+  const util::Status status(compressor_.Decompress(data, &result));
+  CHECK(status.ok()) << "Failed to decompress entry: " << status;
+  return result;
+}
+
+
+void SQLiteDB::ParseEntry(const string& data, LoggedEntry* entry) const {
+  CHECK(entry->ParseFromDatabase(DecompressEntry(data)))
+      << "Failed to parse entry";
+  const util::Status status(chain_certs_->Restore(entry));
+  CHECK(status.ok()) << "Failed to restore the chain of an entry: "
+                     << status;
+}
+
+
+void SQLiteDB::BeginTransaction(const unique_lock<ContendedMutex>& lock) {
   CHECK(lock.owns_lock());
   if (FLAGS_sqlite_batch_into_transactions) {
     CHECK_EQ(0, transaction_size_);
     CHECK(!in_transaction_);
     VLOG(1) << "Beginning new transaction.";
-    sqlite::Statement s(db_, "BEGIN TRANSACTION");
+    sqlite::Statement s(statements_.get(), "BEGIN TRANSACTION");
     CHECK_EQ(SQLITE_DONE, s.Step()) << sqlite3_errmsg(db_);
     in_transaction_ = true;
   }
 }
 
 
-void SQLiteDB::EndTransaction(const unique_lock<mutex>& lock) {
+void SQLiteDB::EndTransaction(const unique_lock<ContendedMutex>& lock) {
   CHECK(lock.owns_lock());
   if (FLAGS_sqlite_batch_into_transactions) {
     CHECK(in_transaction_);
     VLOG(1) << "Committing transaction.";
     {
-      sqlite::Statement s(db_, "END TRANSACTION");
+      sqlite::Statement s(statements_.get(), "END TRANSACTION");
       CHECK_EQ(SQLITE_DONE, s.Step()) << sqlite3_errmsg(db_);
     }
+    uncommitted_writes_ = false;
     {
-      sqlite::Statement s(db_, "PRAGMA wal_checkpoint(TRUNCATE)");
+      sqlite::Statement s(statements_.get(), "PRAGMA wal_checkpoint(TRUNCATE)");
       CHECK_EQ(SQLITE_ROW, s.Step()) << sqlite3_errmsg(db_);
       CHECK_EQ(SQLITE_DONE, s.Step()) << sqlite3_errmsg(db_);
     }
@@ -525,7 +1233,8 @@ void SQLiteDB::EndTransaction(const unique_lock<mutex>& lock) {
 }
 
 
-void SQLiteDB::MaybeStartNewTransaction(const unique_lock<mutex>& lock) {
+void SQLiteDB::MaybeStartNewTransaction(
+    const unique_lock<ContendedMutex>& lock) {
   CHECK(lock.owns_lock());
   if (FLAGS_sqlite_batch_into_transactions &&
       transaction_size_ >= FLAGS_sqlite_transaction_batch_size) {
@@ -534,11 +1243,59 @@ void SQLiteDB::MaybeStartNewTransaction(const unique_lock<mutex>& lock) {
     BeginTransaction(lock);
   }
   ++transaction_size_;
+  if (in_transaction_) {
+    uncommitted_writes_ = true;
+  }
+}
+
+
+void SQLiteDB::NoteSequenceNumber(int64_t sequence_number) const {
+  int64_t expected(sequence_number);
+  tree_size_.compare_exchange_strong(expected, sequence_number + 1);
+}
+
+
+unique_ptr<SQLiteDB::Connection> SQLiteDB::TakeReader() const {
+  if (max_readers_ <= 0) {
+    return nullptr;
+  }
+
+  unique_lock<mutex> lock(readers_lock_);
+  reader_returned_.wait(lock, [this]() {
+    return !idle_readers_.empty() || open_readers_ < max_readers_;
+  });
+  if (!idle_readers_.empty()) {
+    unique_ptr<Connection> reader(std::move(idle_readers_.back()));
+    idle_readers_.pop_back();
+    return reader;
+  }
+  ++open_readers_;
+  lock.unlock();
+
+  sqlite3* db;
+  const int ret(sqlite3_open_v2(dbfile_.c_str(), &db, SQLITE_OPEN_READONLY,
+                                nullptr));
+  CHECK_EQ(SQLITE_OK, ret) << sqlite3_errmsg(db);
+  // Waits out the writer checkpointing, rather than failing.
+  CHECK_EQ(SQLITE_OK, sqlite3_busy_timeout(db, 1000)) << sqlite3_errmsg(db);
+  return unique_ptr<Connection>(new Connection(db));
+}
+
+
+void SQLiteDB::ReturnReader(unique_ptr<Connection> reader) const {
+  {
+    lock_guard<mutex> lock(readers_lock_);
+    idle_readers_.emplace_back(std::move(reader));
+  }
+  reader_returned_.notify_one();
 }
 
 
 void SQLiteDB::ForceNotifySTH() {
-  unique_lock<mutex> lock(lock_);
+  unique_lock<ContendedMutex> lock(lock_);
+  if (hash_filter_) {
+    CatchUpHashFilter(lock);
+  }
 
   ct::SignedTreeHead sth;
   const Database::LookupResult db_result =
@@ -557,9 +1314,15 @@ void SQLiteDB::ForceNotifySTH() {
 
 
 Database::LookupResult SQLiteDB::LatestTreeHeadNoLock(
-    const unique_lock<mutex>& lock, ct::SignedTreeHead* result) const {
+    const unique_lock<ContendedMutex>& lock, ct::SignedTreeHead* result) const {
   CHECK(lock.owns_lock());
-  sqlite::Statement statement(db_,
+  return LatestTreeHead(statements_.get(), result);
+}
+
+
+Database::LookupResult SQLiteDB::LatestTreeHead(
+    sqlite::StatementCache* connection, ct::SignedTreeHead* result) const {
+  sqlite::Statement statement(connection,
                               "SELECT sth FROM trees WHERE timestamp IN "
                               "(SELECT MAX(timestamp) FROM trees)");
 
@@ -567,7 +1330,7 @@ Database::LookupResult SQLiteDB::LatestTreeHeadNoLock(
   if (ret == SQLITE_DONE) {
     return this->NOT_FOUND;
   }
-  CHECK_EQ(SQLITE_ROW, ret) << sqlite3_errmsg(db_);
+  CHECK_EQ(SQLITE_ROW, ret) << sqlite3_errmsg(connection->db());
 
   string sth;
   statement.GetBlob(0, &sth);
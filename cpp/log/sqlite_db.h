@@ -1,17 +1,47 @@
 #ifndef CERT_TRANS_LOG_SQLITE_DB_H_
 #define CERT_TRANS_LOG_SQLITE_DB_H_
 
+#include <atomic>
+#include <condition_variable>
+#include <memory>
 #include <mutex>
 #include <string>
+#include <vector>
 
+#include "base/lock_contention.h"
+#include "log/chain_cert_store.h"
 #include "log/database.h"
+#include "log/entry_compressor.h"
+#include "log/hash_filter.h"
 #include "log/logged_entry.h"
 
 struct sqlite3;
 
+namespace sqlite {
+class StatementCache;
+}  // namespace sqlite
+
 namespace cert_trans {
 
 
+// All the writes go through a single connection, and are batched into
+// transactions (see --sqlite_batch_into_transactions). In WAL journal
+// mode, the lookups and scans that can only see committed data are
+// served without taking the lock of that connection, by a pool of up
+// to --sqlite_reader_connections read-only connections.
+//
+// With --sqlite_compress_entries, the entries are compressed with a
+// dictionary kept in the metadata table (see EntryCompressor). With
+// --db_deduplicate_chains, their chains are kept apart, in the metadata
+// table too (see ChainCertStore).
+//
+// With --sqlite_hash_filter, LookupByHash() first checks a HashFilter
+// of the entry hashes, so that most lookups for hashes that are not in
+// the database do not go to its index. The filter is saved in the
+// metadata table every --sqlite_hash_filter_save_interval entries,
+// with the last row it covers, and brought up to date from there when
+// the database is opened. Another process writing to the same
+// database is only seen by ForceNotifySTH().
 class SQLiteDB : public Database {
  public:
   explicit SQLiteDB(const std::string& dbfile);
@@ -31,6 +61,16 @@ class SQLiteDB : public Database {
   LookupResult LookupByIndex(int64_t sequence_number,
                              LoggedEntry* result) const override;
 
+  // These query the batch a few dozen keys at a time.
+  std::vector<LookupResult> LookupByHashes(
+      const std::vector<std::string>& hashes,
+      std::vector<LoggedEntry>* results) const override;
+
+  std::vector<LookupResult> LookupByIndices(
+      const std::vector<int64_t>& sequence_numbers,
+      std::vector<LoggedEntry>* results) const override;
+
+  using Database::ScanEntries;
   std::unique_ptr<Database::Iterator> ScanEntries(
       int64_t start_index) const override;
 
@@ -40,6 +80,8 @@ class SQLiteDB : public Database {
 
   int64_t TreeSize() const override;
 
+  std::vector<std::pair<int64_t, int64_t>> SparseRanges() const override;
+
   void AddNotifySTHCallback(
       const Database::NotifySTHCallback* callback) override;
 
@@ -49,41 +91,124 @@ class SQLiteDB : public Database {
   void InitializeNode(const std::string& node_id) override;
   LookupResult NodeId(std::string* node_id) override;
 
+  WriteResult WriteTile_(int level, int64_t index,
+                         const std::string& hashes) override;
+  LookupResult LookupTile(int level, int64_t index,
+                          std::string* hashes) const override;
+  WriteResult WriteFrontier_(int64_t tree_size,
+                             const std::string& hashes) override;
+  LookupResult LookupFrontier(int64_t tree_size,
+                              std::string* hashes) const override;
+
   // Force an STH notification. This is needed only for ct-dns-server,
   // which shares a SQLite database with ct-server, but needs to
-  // refresh itself occasionally.
+  // refresh itself occasionally. It also adds the entries written by
+  // ct-server since to the hash filter.
   void ForceNotifySTH();
 
+ protected:
+  std::unique_ptr<Database::Iterator> ScanEntries_(
+      int64_t start_index, int64_t end_index, bool fill_cache) const override;
+
  private:
   class Iterator;
-
-  LookupResult LookupByIndex(const std::unique_lock<std::mutex>& lock,
+  class ScopedReader;
+  struct Connection;
+
+  // These run their query on |connection|, which is either the writer
+  // connection, with |lock_| held, or a reader.
+  LookupResult LookupByHash(sqlite::StatementCache* connection,
+                            const std::string& hash,
+                            LoggedEntry* result) const;
+  LookupResult LookupByIndex(sqlite::StatementCache* connection,
                              int64_t sequence_number,
                              LoggedEntry* result) const;
-  // This finds the next entry with a sequence number equal or greater
-  // to the one specified.
-  LookupResult LookupNextIndex(const std::unique_lock<std::mutex>& lock,
-                               int64_t sequence_number,
-                               LoggedEntry* result) const;
-  LookupResult LatestTreeHeadNoLock(const std::unique_lock<std::mutex>& lock,
-                                    ct::SignedTreeHead* result) const;
-  LookupResult NodeId(const std::unique_lock<std::mutex>& lock,
+  // These look up the keys at |positions| in the arguments of the
+  // public versions, and set the results of those found.
+  void LookupByHashes(sqlite::StatementCache* connection,
+                      const std::vector<std::string>& hashes,
+                      const std::vector<size_t>& positions,
+                      std::vector<LoggedEntry>* results,
+                      std::vector<LookupResult>* found) const;
+  void LookupByIndices(sqlite::StatementCache* connection,
+                       const std::vector<int64_t>& sequence_numbers,
+                       const std::vector<size_t>& positions,
+                       std::vector<LoggedEntry>* results,
+                       std::vector<LookupResult>* found) const;
+  LookupResult LatestTreeHead(sqlite::StatementCache* connection,
+                              ct::SignedTreeHead* result) const;
+  LookupResult LookupTile(sqlite::StatementCache* connection, int level,
+                          int64_t index, std::string* hashes) const;
+  LookupResult LookupFrontier(sqlite::StatementCache* connection,
+                              int64_t tree_size, std::string* hashes) const;
+
+  LookupResult LatestTreeHeadNoLock(
+      const std::unique_lock<ContendedMutex>& lock,
+      ct::SignedTreeHead* result) const;
+  LookupResult NodeId(const std::unique_lock<ContendedMutex>& lock,
                       std::string* node_id);
 
-  void BeginTransaction(const std::unique_lock<std::mutex>& lock);
+  // Loads the compression dictionaries and the chain certificates, and
+  // trains a dictionary if needed.
+  void LoadMetadata(const std::unique_lock<ContendedMutex>& lock);
+  // Loads the hash filter, or builds it if it is missing or too small
+  // for the entries, and adds the entries it does not cover yet.
+  void LoadHashFilter(const std::unique_lock<ContendedMutex>& lock);
+  // Adds the entries after |hash_filter_rowid_| to the hash filter.
+  void CatchUpHashFilter(const std::unique_lock<ContendedMutex>& lock);
+  void SaveHashFilter(const std::unique_lock<ContendedMutex>& lock);
+  // Returns the entry stored as |data|, serialized for the database,
+  // without its chain if it is kept apart.
+  std::string DecompressEntry(const std::string& data) const;
+  // Parses the entry stored as |data|, with its chain.
+  void ParseEntry(const std::string& data, LoggedEntry* entry) const;
+
+  void BeginTransaction(const std::unique_lock<ContendedMutex>& lock);
+
+  void EndTransaction(const std::unique_lock<ContendedMutex>& lock);
+
+  void MaybeStartNewTransaction(const std::unique_lock<ContendedMutex>& lock);
 
-  void EndTransaction(const std::unique_lock<std::mutex>& lock);
+  // Advances |tree_size_| if it is |sequence_number|.
+  void NoteSequenceNumber(int64_t sequence_number) const;
 
-  void MaybeStartNewTransaction(const std::unique_lock<std::mutex>& lock);
+  // Returns nullptr if there is no reader pool.
+  std::unique_ptr<Connection> TakeReader() const;
+  void ReturnReader(std::unique_ptr<Connection> reader) const;
 
-  mutable std::mutex lock_;
+  const std::string dbfile_;
+  mutable ContendedMutex lock_;
   sqlite3* const db_;
+  // Only reset by the destructor, which must finalize the statements
+  // before closing |db_|.
+  std::unique_ptr<sqlite::StatementCache> statements_;
+  const bool compress_entries_;
+  EntryCompressor compressor_;
+  const bool deduplicate_chains_;
+  // Writes its new certificates with |lock_| held.
+  std::unique_ptr<ChainCertStore> chain_certs_;
+  // Null without --sqlite_hash_filter. Lookups use it without |lock_|,
+  // but it is only added to with it.
+  std::unique_ptr<HashFilter> hash_filter_;
+  // The rowid of the last row of the leaves table in |hash_filter_|,
+  // and the number of entries added since it was saved.
+  int64_t hash_filter_rowid_;
+  int64_t hash_filter_unsaved_;
   // This is marked mutable, as it is a lazily updated cache updated
   // from some of the getters.
-  mutable int64_t tree_size_;
+  mutable std::atomic<int64_t> tree_size_;
   DatabaseNotifierHelper callbacks_;
   int64_t transaction_size_;
   bool in_transaction_;
+  // Whether the current transaction has writes, which the readers
+  // cannot see yet.
+  std::atomic<bool> uncommitted_writes_;
+
+  const int max_readers_;
+  mutable std::mutex readers_lock_;
+  mutable std::condition_variable reader_returned_;
+  mutable std::vector<std::unique_ptr<Connection>> idle_readers_;
+  mutable int open_readers_;
 };
 
 
@@ -4,25 +4,84 @@
 #include <glog/logging.h>
 #include <sqlite3.h>
 #include <string>
+#include <unordered_map>
 
 namespace sqlite {
 
+
+// The prepared statements of a connection, kept for reuse by the
+// Statements created with it. This class is not threadsafe, like the
+// connection it is for.
+class StatementCache {
+ public:
+  explicit StatementCache(sqlite3* db) : db_(CHECK_NOTNULL(db)) {
+  }
+
+  ~StatementCache() {
+    for (const auto& statement : statements_) {
+      CHECK_EQ(SQLITE_OK, sqlite3_finalize(statement.second));
+    }
+  }
+
+  StatementCache(const StatementCache&) = delete;
+  StatementCache& operator=(const StatementCache&) = delete;
+
+  sqlite3* db() const {
+    return db_;
+  }
+
+ private:
+  friend class Statement;
+
+  // Removes the statement for |sql| from the cache and returns it, or
+  // returns NULL if there is none, so that a statement is never used
+  // by two Statements at once.
+  sqlite3_stmt* Take(const char* sql) {
+    const auto it(statements_.find(sql));
+    if (it == statements_.end()) {
+      return NULL;
+    }
+    sqlite3_stmt* const stmt(it->second);
+    statements_.erase(it);
+    return stmt;
+  }
+
+  // Returns false if there already is a statement for |sql|.
+  bool Put(const char* sql, sqlite3_stmt* stmt) {
+    return statements_.emplace(sql, stmt).second;
+  }
+
+  sqlite3* const db_;
+  std::unordered_map<std::string, sqlite3_stmt*> statements_;
+};
+
+
 // Reduce the ugliness of the sqlite3 API.
 class Statement {
  public:
-  Statement(sqlite3* db, const char* sql) : stmt_(NULL) {
-    int ret = sqlite3_prepare_v2(db, sql, -1, &stmt_, NULL);
-    if (ret != SQLITE_OK)
-      LOG(ERROR) << "ret = " << ret << ", err = " << sqlite3_errmsg(db)
-                 << ", sql = " << sql << std::endl;
+  Statement(sqlite3* db, const char* sql)
+      : cache_(NULL), sql_(sql), stmt_(Prepare(db, sql)) {
+  }
 
-    CHECK_EQ(SQLITE_OK, ret);
+  // Uses the statement for |sql| in |cache|, if there is one, and puts
+  // it back there, reset, on destruction.
+  Statement(StatementCache* cache, const char* sql)
+      : cache_(CHECK_NOTNULL(cache)), sql_(sql), stmt_(cache->Take(sql)) {
+    if (!stmt_) {
+      stmt_ = Prepare(cache->db(), sql);
+    }
   }
 
   ~Statement() {
-    int ret = sqlite3_finalize(stmt_);
+    int ret = cache_ ? sqlite3_reset(stmt_) : sqlite3_finalize(stmt_);
     // can get SQLITE_CONSTRAINT if an insert failed due to a duplicate key.
     CHECK(ret == SQLITE_OK || ret == SQLITE_CONSTRAINT);
+    if (cache_) {
+      CHECK_EQ(SQLITE_OK, sqlite3_clear_bindings(stmt_));
+      if (!cache_->Put(sql_, stmt_)) {
+        CHECK_EQ(SQLITE_OK, sqlite3_finalize(stmt_));
+      }
+    }
   }
 
   Statement(const Statement&) = delete;
@@ -60,6 +119,19 @@ class Statement {
   }
 
  private:
+  static sqlite3_stmt* Prepare(sqlite3* db, const char* sql) {
+    sqlite3_stmt* stmt(NULL);
+    int ret = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+    if (ret != SQLITE_OK)
+      LOG(ERROR) << "ret = " << ret << ", err = " << sqlite3_errmsg(db)
+                 << ", sql = " << sql << std::endl;
+
+    CHECK_EQ(SQLITE_OK, ret);
+    return stmt;
+  }
+
+  StatementCache* const cache_;
+  const char* const sql_;
   sqlite3_stmt* stmt_;
 };
 
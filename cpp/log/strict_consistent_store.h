@@ -45,6 +45,15 @@ class StrictConsistentStore : public ConsistentStore {
     return peer_->AddPendingEntry(entry);
   }
 
+  void AddPendingEntryAsync(LoggedEntry* entry, util::Task* task) override {
+    peer_->AddPendingEntryAsync(entry, task);
+  }
+
+  void AddPendingEntries(const std::vector<LoggedEntry*>& entries,
+                         std::vector<util::Status>* statuses) override {
+    peer_->AddPendingEntries(entries, statuses);
+  }
+
   util::Status GetPendingEntryForHash(
       const std::string& hash,
       EntryHandle<LoggedEntry>* entry) const override {
@@ -86,6 +95,11 @@ class StrictConsistentStore : public ConsistentStore {
     return peer_->WatchClusterConfig(cb, task);
   }
 
+  void WatchPendingEntries(const ConsistentStore::PendingEntriesCallback& cb,
+                           util::Task* task) override {
+    return peer_->WatchPendingEntries(cb, task);
+  }
+
  private:
   const MasterElection* const election_;  // Not owned by us
   const std::unique_ptr<ConsistentStore> peer_;
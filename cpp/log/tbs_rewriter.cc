@@ -0,0 +1,324 @@
+#include "log/tbs_rewriter.h"
+
+#include <openssl/asn1.h>
+#include <openssl/crypto.h>
+#include <openssl/objects.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "log/cert.h"
+
+using std::string;
+using std::vector;
+using util::Status;
+
+namespace cert_trans {
+namespace {
+
+
+const uint8_t kBooleanTag = 0x01;
+const uint8_t kIntegerTag = 0x02;
+const uint8_t kOctetStringTag = 0x04;
+const uint8_t kOidTag = 0x06;
+const uint8_t kSequenceTag = 0x30;
+// The [0] and [3] EXPLICIT tags of the version and the extensions.
+const uint8_t kVersionTag = 0xa0;
+const uint8_t kExtensionsTag = 0xa3;
+
+// The serial number and the signature algorithm come between the
+// version, if any, and the issuer.
+const size_t kFieldsBeforeIssuer = 2;
+
+
+// A DER element of a buffer: its encoding is in [start, end), and its
+// contents start at |contents|.
+struct Element {
+  uint8_t tag;
+  size_t start;
+  size_t contents;
+  size_t end;
+};
+
+
+// The fields of a TBS certificate, and its extensions.
+struct ParsedTbs {
+  vector<Element> fields;
+  // The index of the issuer in |fields|.
+  size_t issuer;
+  // The index of the extensions in |fields|, or its size if none.
+  size_t extensions;
+  vector<Element> extension_list;
+};
+
+
+// Reads the element starting at |pos| in |der|, which must end by
+// |end|. Only single byte tags and minimal definite lengths are
+// accepted, as DER requires.
+bool ReadElement(const string& der, size_t pos, size_t end,
+                 Element* element) {
+  if (pos + 2 > end) {
+    return false;
+  }
+  element->tag = der[pos];
+  if ((element->tag & 0x1f) == 0x1f) {
+    return false;
+  }
+
+  const uint8_t first_length_byte(der[pos + 1]);
+  size_t header(2);
+  size_t length(first_length_byte);
+  if (first_length_byte >= 0x80) {
+    const size_t num_bytes(first_length_byte & 0x7f);
+    if (num_bytes == 0 || num_bytes > 4 || pos + header + num_bytes > end ||
+        der[pos + header] == 0) {
+      return false;
+    }
+    length = 0;
+    for (size_t i = 0; i < num_bytes; ++i) {
+      length = (length << 8) | static_cast<uint8_t>(der[pos + header + i]);
+    }
+    if (length < 0x80) {
+      return false;
+    }
+    header += num_bytes;
+  }
+  if (length > end - pos - header) {
+    return false;
+  }
+
+  element->start = pos;
+  element->contents = pos + header;
+  element->end = pos + header + length;
+  return true;
+}
+
+
+bool ReadChildren(const string& der, const Element& parent,
+                  vector<Element>* children) {
+  children->clear();
+  for (size_t pos = parent.contents; pos < parent.end;) {
+    Element child;
+    if (!ReadElement(der, pos, parent.end, &child)) {
+      return false;
+    }
+    children->push_back(child);
+    pos = child.end;
+  }
+  return true;
+}
+
+
+string Encoding(const string& der, const Element& element) {
+  return der.substr(element.start, element.end - element.start);
+}
+
+
+void AppendElement(uint8_t tag, const string& contents, string* out) {
+  out->push_back(tag);
+  if (contents.size() < 0x80) {
+    out->push_back(static_cast<char>(contents.size()));
+  } else {
+    string length;
+    for (size_t left = contents.size(); left > 0; left >>= 8) {
+      length.insert(0, 1, static_cast<char>(left & 0xff));
+    }
+    out->push_back(static_cast<char>(0x80 | length.size()));
+    out->append(length);
+  }
+  out->append(contents);
+}
+
+
+// Sets |encoding| to the DER encoding of the OID of |nid|.
+bool OidEncoding(int nid, string* encoding) {
+  const ASN1_OBJECT* const object(OBJ_nid2obj(nid));
+  if (!object) {
+    return false;
+  }
+  unsigned char* buf(nullptr);
+  const int length(i2d_ASN1_OBJECT(const_cast<ASN1_OBJECT*>(object), &buf));
+  if (length <= 0) {
+    return false;
+  }
+  encoding->assign(reinterpret_cast<char*>(buf), length);
+  OPENSSL_free(buf);
+  return true;
+}
+
+
+bool ParseTbs(const string& der, ParsedTbs* tbs) {
+  Element cert, tbs_element;
+  if (!ReadElement(der, 0, der.size(), &cert) || cert.tag != kSequenceTag ||
+      cert.end != der.size() ||
+      !ReadElement(der, cert.contents, cert.end, &tbs_element) ||
+      tbs_element.tag != kSequenceTag ||
+      !ReadChildren(der, tbs_element, &tbs->fields)) {
+    return false;
+  }
+
+  const size_t serial(
+      !tbs->fields.empty() && tbs->fields[0].tag == kVersionTag ? 1 : 0);
+  tbs->issuer = serial + kFieldsBeforeIssuer;
+  if (tbs->issuer >= tbs->fields.size() ||
+      tbs->fields[serial].tag != kIntegerTag ||
+      tbs->fields[tbs->issuer].tag != kSequenceTag) {
+    return false;
+  }
+
+  // OpenSSL encodes the serial number minimally again, which would
+  // change it if it was not.
+  const Element& serial_number(tbs->fields[serial]);
+  if (serial_number.end == serial_number.contents) {
+    return false;
+  }
+  if (serial_number.end - serial_number.contents > 1) {
+    const uint8_t first(der[serial_number.contents]);
+    const uint8_t second(der[serial_number.contents + 1]);
+    if ((first == 0x00 && !(second & 0x80)) ||
+        (first == 0xff && (second & 0x80))) {
+      return false;
+    }
+  }
+
+  tbs->extensions = tbs->fields.size();
+  tbs->extension_list.clear();
+  const Element& last(tbs->fields.back());
+  if (last.tag == kExtensionsTag) {
+    Element sequence;
+    if (!ReadElement(der, last.contents, last.end, &sequence) ||
+        sequence.tag != kSequenceTag || sequence.end != last.end ||
+        !ReadChildren(der, sequence, &tbs->extension_list)) {
+      return false;
+    }
+    tbs->extensions = tbs->fields.size() - 1;
+  }
+
+  return true;
+}
+
+
+// Sets |oid| and |value| to the OID and OCTET STRING of |extension|.
+bool ParseExtension(const string& der, const Element& extension,
+                    Element* oid, Element* value) {
+  vector<Element> parts;
+  if (extension.tag != kSequenceTag ||
+      !ReadChildren(der, extension, &parts)) {
+    return false;
+  }
+  if (parts.size() == 3) {
+    // OpenSSL leaves out a critical flag of FALSE, the default.
+    const Element& critical(parts[1]);
+    if (critical.tag != kBooleanTag ||
+        critical.end - critical.contents != 1 ||
+        static_cast<uint8_t>(der[critical.contents]) != 0xff) {
+      return false;
+    }
+  } else if (parts.size() != 2) {
+    return false;
+  }
+
+  *oid = parts.front();
+  *value = parts.back();
+  return oid->tag == kOidTag && value->tag == kOctetStringTag;
+}
+
+
+}  // namespace
+
+
+Status RewriteTbsCertificate(const Cert& cert, int extension_nid,
+                             const Cert* issuer_from, string* result) {
+  string der, oid, aki_oid;
+  ParsedTbs tbs;
+  if (!cert.DerEncoding(&der).ok() || !ParseTbs(der, &tbs)) {
+    return Status(util::error::UNIMPLEMENTED,
+                  "unsupported certificate encoding");
+  }
+  if (!OidEncoding(extension_nid, &oid) ||
+      !OidEncoding(NID_authority_key_identifier, &aki_oid)) {
+    return Status(util::error::INTERNAL, "unknown extension");
+  }
+
+  // The issuer name and authority key identifier value to use instead.
+  string issuer;
+  string authority_key_id;
+  if (issuer_from) {
+    string from_der;
+    ParsedTbs from_tbs;
+    if (!issuer_from->DerEncoding(&from_der).ok() ||
+        !ParseTbs(from_der, &from_tbs)) {
+      return Status(util::error::UNIMPLEMENTED,
+                    "unsupported issuer certificate encoding");
+    }
+    issuer = Encoding(from_der, from_tbs.fields[from_tbs.issuer]);
+    for (const Element& extension : from_tbs.extension_list) {
+      Element ext_oid, value;
+      if (!ParseExtension(from_der, extension, &ext_oid, &value)) {
+        return Status(util::error::UNIMPLEMENTED,
+                      "unsupported issuer certificate encoding");
+      }
+      if (Encoding(from_der, ext_oid) == aki_oid) {
+        if (!authority_key_id.empty()) {
+          return Status(util::error::UNIMPLEMENTED,
+                        "duplicate authority key identifier");
+        }
+        authority_key_id = Encoding(from_der, value);
+      }
+    }
+  }
+
+  string extensions;
+  bool removed(false);
+  bool replaced_aki(false);
+  for (const Element& extension : tbs.extension_list) {
+    Element ext_oid, value;
+    if (!ParseExtension(der, extension, &ext_oid, &value)) {
+      return Status(util::error::UNIMPLEMENTED,
+                    "unsupported certificate encoding");
+    }
+    const string ext_oid_encoding(Encoding(der, ext_oid));
+    if (ext_oid_encoding == oid) {
+      if (removed) {
+        return Status(util::error::UNIMPLEMENTED, "duplicate extension");
+      }
+      removed = true;
+    } else if (issuer_from && ext_oid_encoding == aki_oid) {
+      if (authority_key_id.empty() || replaced_aki) {
+        return Status(util::error::UNIMPLEMENTED,
+                      "incompatible authority key identifiers");
+      }
+      replaced_aki = true;
+      // Keep the OID and critical flag, but not the value.
+      string contents(der, ext_oid.start, value.start - ext_oid.start);
+      contents.append(authority_key_id);
+      AppendElement(kSequenceTag, contents, &extensions);
+    } else {
+      extensions.append(Encoding(der, extension));
+    }
+  }
+  if (removed && extensions.empty()) {
+    return Status(util::error::UNIMPLEMENTED, "no extensions left");
+  }
+
+  string contents;
+  for (size_t i = 0; i < tbs.fields.size(); ++i) {
+    if (i == tbs.issuer && issuer_from) {
+      contents.append(issuer);
+    } else if (i == tbs.extensions) {
+      string sequence;
+      AppendElement(kSequenceTag, extensions, &sequence);
+      AppendElement(kExtensionsTag, sequence, &contents);
+    } else {
+      contents.append(Encoding(der, tbs.fields[i]));
+    }
+  }
+
+  result->clear();
+  AppendElement(kSequenceTag, contents, result);
+  return ::util::OkStatus();
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,33 @@
+#ifndef CERT_TRANS_LOG_TBS_REWRITER_H_
+#define CERT_TRANS_LOG_TBS_REWRITER_H_
+
+#include <string>
+
+#include "util/status.h"
+
+namespace cert_trans {
+
+class Cert;
+
+
+// Sets |result| to the DER encoding of the TBS certificate of |cert|,
+// without its |extension_nid| extension (if present) and, if
+// |issuer_from| is not NULL, with the issuer name and authority key
+// identifier of |issuer_from|: what TbsCertificate::DeleteExtension(),
+// CopyIssuerFrom() and DerEncoding() give, but copied straight out of
+// the DER encodings of the certificates, rather than going through an
+// X509 copy of |cert| and encoding it again.
+//
+// This only handles certificates which are valid DER, and for which
+// the result is plain to work out: it returns an error otherwise (for
+// instance, if the extension is there more than once, or is the only
+// one), in which case the caller should fall back to TbsCertificate,
+// which also gives the proper error.
+util::Status RewriteTbsCertificate(const Cert& cert, int extension_nid,
+                                   const Cert* issuer_from,
+                                   std::string* result);
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_TBS_REWRITER_H_
@@ -0,0 +1,115 @@
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <memory>
+#include <string>
+
+#include "log/cert.h"
+#include "log/ct_extensions.h"
+#include "log/tbs_rewriter.h"
+#include "util/status_test_util.h"
+#include "util/testing.h"
+#include "util/util.h"
+
+namespace cert_trans {
+namespace {
+
+using std::string;
+using std::unique_ptr;
+
+// Issued by ca-cert.pem
+const char kLeafCert[] = "test-cert.pem";
+// Issued by ca-cert.pem, with an embedded SCT list.
+const char kEmbeddedCert[] = "test-embedded-cert.pem";
+// Issued by ca-cert.pem
+const char kCaPreCert[] = "ca-pre-cert.pem";
+// Issued by ca-cert.pem
+const char kPreCert[] = "test-embedded-pre-cert.pem";
+// Issued by ca-pre-cert.pem
+const char kPreWithPreCaCert[] = "test-embedded-with-preca-pre-cert.pem";
+
+
+class TbsRewriterTest : public ::testing::Test {
+ protected:
+  TbsRewriterTest() : cert_dir_(FLAGS_test_srcdir + "/test/testdata") {
+  }
+
+  unique_ptr<Cert> ReadCert(const string& name) {
+    string pem;
+    CHECK(util::ReadTextFile(cert_dir_ + "/" + name, &pem))
+        << "Could not read test data from " << cert_dir_
+        << ". Wrong --test_srcdir?";
+    unique_ptr<Cert> cert(Cert::FromPemString(pem));
+    CHECK(cert);
+    // Go through DER, as submissions do.
+    string der;
+    CHECK(cert->DerEncoding(&der).ok());
+    cert = Cert::FromDerString(der);
+    CHECK(cert);
+    return cert;
+  }
+
+  // What TbsCertificate gives.
+  string ExpectedTbs(const Cert& cert, int extension_nid,
+                     const Cert* issuer_from) {
+    TbsCertificate tbs(cert);
+    CHECK(tbs.IsLoaded());
+    const util::Status deleted(tbs.DeleteExtension(extension_nid));
+    CHECK(deleted.ok() || deleted.CanonicalCode() == util::error::NOT_FOUND);
+    if (issuer_from) {
+      CHECK(tbs.CopyIssuerFrom(*issuer_from).ok());
+    }
+    string der_tbs;
+    CHECK(tbs.DerEncoding(&der_tbs).ok());
+    return der_tbs;
+  }
+
+  void ExpectSameTbs(const Cert& cert, int extension_nid,
+                     const Cert* issuer_from) {
+    string der_tbs;
+    EXPECT_OK(
+        RewriteTbsCertificate(cert, extension_nid, issuer_from, &der_tbs));
+    EXPECT_EQ(ExpectedTbs(cert, extension_nid, issuer_from), der_tbs);
+  }
+
+  const string cert_dir_;
+};
+
+
+TEST_F(TbsRewriterTest, RemovesPoison) {
+  ExpectSameTbs(*ReadCert(kPreCert), NID_ctPoison, nullptr);
+}
+
+
+TEST_F(TbsRewriterTest, CopiesIssuer) {
+  const unique_ptr<Cert> ca_precert(ReadCert(kCaPreCert));
+  ExpectSameTbs(*ReadCert(kPreWithPreCaCert), NID_ctPoison,
+                ca_precert.get());
+}
+
+
+TEST_F(TbsRewriterTest, RemovesEmbeddedSctList) {
+  ExpectSameTbs(*ReadCert(kEmbeddedCert),
+                NID_ctEmbeddedSignedCertificateTimestampList, nullptr);
+}
+
+
+TEST_F(TbsRewriterTest, WithoutExtension) {
+  ExpectSameTbs(*ReadCert(kLeafCert),
+                NID_ctEmbeddedSignedCertificateTimestampList, nullptr);
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  OpenSSL_add_all_algorithms();
+  ERR_load_crypto_strings();
+  cert_trans::LoadCtExtensions();
+  return RUN_ALL_TESTS();
+}
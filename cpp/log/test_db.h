@@ -8,6 +8,9 @@
 #include "log/file_storage.h"
 #include "log/leveldb_db.h"
 #include "log/logged_entry.h"
+#ifdef HAVE_ROCKSDB
+#include "log/rocksdb_db.h"
+#endif
 #include "log/sqlite_db.h"
 #include "util/test_db.h"
 
@@ -63,6 +66,21 @@ cert_trans::LevelDB* TestDB<cert_trans::LevelDB>::SecondDB() {
   return new cert_trans::LevelDB(tmp_.TmpStorageDir() + "/leveldb");
 }
 
+#ifdef HAVE_ROCKSDB
+template <>
+void TestDB<cert_trans::RocksDB>::Setup() {
+  db_.reset(new cert_trans::RocksDB(tmp_.TmpStorageDir() + "/rocksdb"));
+}
+
+template <>
+cert_trans::RocksDB* TestDB<cert_trans::RocksDB>::SecondDB() {
+  // Like LevelDB, RocksDB won't allow the same DB to be opened
+  // concurrently.
+  db_.reset();
+  return new cert_trans::RocksDB(tmp_.TmpStorageDir() + "/rocksdb");
+}
+#endif
+
 // Not a Database; we just use the same template for setup.
 template <>
 void TestDB<cert_trans::FileStorage>::Setup() {
@@ -1,15 +1,26 @@
 #include "log/tree_signer.h"
 
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <stdint.h>
 #include <algorithm>
 #include <chrono>
+#include <map>
 #include <set>
+#include <thread>
 #include <unordered_map>
 
 #include "log/database.h"
 #include "log/log_signer.h"
+#include "log/merkle_node_file.h"
+#include "log/pending_entry_store.h"
+#include "merkletree/serial_hasher.h"
+#include "merkletree/tiled_merkle_tree.h"
+#include "monitoring/counter.h"
+#include "monitoring/gauge.h"
+#include "monitoring/latency.h"
 #include "proto/serializer.h"
+#include "util/parallel_for.h"
 #include "util/status.h"
 #include "util/util.h"
 
@@ -18,15 +29,24 @@ using ct::SequenceMapping;
 using ct::SequenceMapping_Mapping;
 using ct::SignedTreeHead;
 using std::chrono::duration;
+using std::chrono::duration_cast;
 using std::chrono::milliseconds;
+using std::chrono::steady_clock;
 using std::chrono::system_clock;
+using std::lock_guard;
 using std::make_pair;
+using std::make_shared;
 using std::map;
 using std::max;
 using std::move;
+using std::min;
+using std::mutex;
 using std::pair;
+using std::shared_ptr;
+using std::shared_future;
 using std::sort;
 using std::string;
+using std::unique_lock;
 using std::unique_ptr;
 using std::unordered_map;
 using std::vector;
@@ -35,10 +55,150 @@ using util::StatusOr;
 using util::TimeInMilliseconds;
 using util::ToBase64;
 
+DEFINE_int32(sequencer_db_write_batch_size, 10000,
+             "Number of newly sequenced entries copied and written to the "
+             "local database at a time.");
+
 namespace cert_trans {
 namespace {
 
 
+// Maximum number of leaf hashes UpdateTree() buffers before adding them
+// to the tree.
+const size_t kMaxLeafHashBatch = 1 << 16;
+// How many entries are read from the database at a time.
+const size_t kScanBatchSize = 1024;
+// How many entries each work item of UpdateTree() serializes.
+const size_t kSerializeChunk = 64;
+
+
+// The leaf hash of |logged| in |tree|: the one stored with it, if any.
+string LeafHash(const CompactMerkleTree& tree, const LoggedEntry& logged) {
+  if (logged.has_leaf_hash()) {
+    return logged.leaf_hash();
+  }
+  string serialized_leaf;
+  CHECK(logged.SerializeForLeaf(&serialized_leaf));
+  return tree.LeafHash(serialized_leaf);
+}
+
+
+// What sequencing needs of a pending entry, ordered as by
+// PendingEntriesOrder. The entry itself is only read again to be
+// written to the local database.
+struct PendingRecord {
+  PendingRecord(uint64_t timestamp, string hash,
+                shared_ptr<const LoggedEntry> entry)
+      : timestamp(timestamp), hash(move(hash)), entry(move(entry)) {
+  }
+
+  bool operator<(const PendingRecord& other) const {
+    return timestamp < other.timestamp ||
+           (timestamp == other.timestamp && hash < other.hash);
+  }
+
+  uint64_t timestamp;
+  string hash;
+  shared_ptr<const LoggedEntry> entry;
+};
+
+
+// Replaces the references (see LoggedEntry::Reference()) among
+// |*pending_entries| which are to be written to the database by the
+// entries they refer to, from |fetcher|, or by null if it does not have
+// them. Those are the ones out of the guard window, as of |now|, unless
+// they are already sequenced below |tree_size|, the size of the
+// database.
+void ResolveReferences(
+    PendingEntryFetcher* fetcher, const system_clock::time_point& now,
+    const duration<double>& guard_window,
+    const unordered_map<string, pair<int64_t, bool>>& sequenced_hashes,
+    int64_t tree_size, vector<PendingRecord>* pending_entries) {
+  vector<PendingRecord*> records;
+  vector<shared_ptr<const LoggedEntry>> references;
+  for (PendingRecord& record : *pending_entries) {
+    if (!record.entry->IsReference() ||
+        now - system_clock::time_point(milliseconds(record.timestamp)) <
+            guard_window) {
+      continue;
+    }
+    const auto seq_it(sequenced_hashes.find(record.hash));
+    if (seq_it != sequenced_hashes.end() && seq_it->second.first < tree_size) {
+      continue;
+    }
+    records.push_back(&record);
+    references.push_back(record.entry);
+  }
+  if (records.empty()) {
+    return;
+  }
+
+  const vector<shared_ptr<const LoggedEntry>> entries(
+      fetcher->Fetch(references));
+  CHECK_EQ(records.size(), entries.size());
+  for (size_t i = 0; i < records.size(); ++i) {
+    records[i]->entry = entries[i];
+  }
+}
+
+
+Latency<milliseconds, string> sequencer_phase_latency_ms(
+    "sequencer_phase_latency_ms", "phase",
+    "Time spent in each phase of the sequencer runs");
+
+Latency<milliseconds, string> signer_phase_latency_ms(
+    "signer_phase_latency_ms", "phase",
+    "Time spent in each phase of the signer runs");
+
+Gauge<>* sequencer_pending_entries =
+    Gauge<>::New("sequencer_pending_entries",
+                 "Number of pending entries seen by the last sequencer run");
+
+Gauge<>* sequencer_entries_per_run =
+    Gauge<>::New("sequencer_entries_per_run",
+                 "Number of entries given a sequence number by the last "
+                 "sequencer run");
+
+Gauge<>* signer_entries_per_run =
+    Gauge<>::New("signer_entries_per_run",
+                 "Number of entries added to the tree by the last signer "
+                 "run");
+
+Gauge<>* signer_unsigned_entries =
+    Gauge<>::New("signer_unsigned_entries",
+                 "Number of sequenced entries not covered by the tree head "
+                 "signed last");
+
+Counter<>* sequencer_unresolved_references =
+    Counter<>::New("sequencer_unresolved_references",
+                   "Number of times a pending entry was left to a later "
+                   "sequencer run, because the node holding it could not "
+                   "provide it");
+
+
+// Times consecutive phases of a run, recording each in a Latency
+// labelled by phase name.
+class PhaseTimer {
+ public:
+  explicit PhaseTimer(Latency<milliseconds, string>* latency)
+      : latency_(latency), phase_start_(steady_clock::now()) {
+  }
+
+  // Records the time since the end of the previous phase as |phase|,
+  // less |excluded|, which was recorded as a phase of its own.
+  void EndPhase(const string& phase, const steady_clock::duration& excluded =
+                                         steady_clock::duration::zero()) {
+    const steady_clock::time_point now(steady_clock::now());
+    latency_->RecordLatency(phase, now - phase_start_ - excluded);
+    phase_start_ = now;
+  }
+
+ private:
+  Latency<milliseconds, string>* const latency_;
+  steady_clock::time_point phase_start_;
+};
+
+
 bool LessThanBySequence(const SequenceMapping::Mapping& lhs,
                         const SequenceMapping::Mapping& rhs) {
   CHECK(lhs.has_sequence_number());
@@ -47,6 +207,44 @@ bool LessThanBySequence(const SequenceMapping::Mapping& lhs,
 }
 
 
+// The levels of a frontier are stored back to back, leaving out the
+// empty ones, which are implied by the tree size.
+string EncodeFrontier(const vector<string>& frontier) {
+  string hashes;
+  for (const string& node : frontier) {
+    hashes.append(node);
+  }
+  return hashes;
+}
+
+
+bool DecodeFrontier(int64_t tree_size, const string& hashes, size_t node_size,
+                    vector<string>* frontier) {
+  frontier->clear();
+  size_t offset(0);
+  for (int64_t size = tree_size; size != 0; size >>= 1) {
+    if ((size & 1) == 0) {
+      frontier->emplace_back();
+      continue;
+    }
+    if (hashes.size() - offset < node_size) {
+      return false;
+    }
+    frontier->emplace_back(hashes, offset, node_size);
+    offset += node_size;
+  }
+  return offset == hashes.size();
+}
+
+
+// The memory held by a pending entry: its contents, and its key in
+// |pending_| and |pending_keys_| (twice the hash, and the consistent
+// store key of roughly the same size), plus the nodes of both.
+size_t PendingEntryBytes(const LoggedEntry& entry) {
+  return entry.contents().ByteSize() + 3 * entry.Hash().size() + 256;
+}
+
+
 }  // namespace
 
 
@@ -71,14 +269,34 @@ bool PendingEntriesOrder::operator()(const EntryHandle<LoggedEntry>& x,
 
 TreeSigner::TreeSigner(const duration<double>& guard_window, Database* db,
                        unique_ptr<CompactMerkleTree> merkle_tree,
-                       ConsistentStore* consistent_store, LogSigner* signer)
+                       ConsistentStore* consistent_store, LogSigner* signer,
+                       MerkleNodeFile* node_file, util::Executor* executor)
     : guard_window_(guard_window),
       db_(db),
       consistent_store_(consistent_store),
       signer_(signer),
+      node_file_(node_file),
+      pending_entry_fetcher_(nullptr),
+      executor_(executor),
       cert_tree_(move(merkle_tree)),
-      latest_tree_head_() {
+      latest_tree_head_(),
+      leaf_tile_index_(0),
+      leaf_tile_dirty_(false),
+      pending_ready_(false),
+      new_pending_(0),
+      oldest_new_pending_(0),
+      sequenced_size_(0),
+      pending_bytes_(0),
+      pending_memory_("signer_pending_entries", [this]() {
+        lock_guard<mutex> lock(pending_lock_);
+        return pending_bytes_;
+      }) {
   CHECK(cert_tree_);
+  cert_tree_->SetExecutor(executor_);
+  if (node_file_) {
+    SyncNodeFile();
+  }
+  LoadLeafTile();
   // Try to get any STH previously published by this node.
   const StatusOr<ClusterNodeState> node_state(
       consistent_store_->GetClusterNodeState());
@@ -89,6 +307,50 @@ TreeSigner::TreeSigner(const duration<double>& guard_window, Database* db,
   if (node_state.ok()) {
     latest_tree_head_ = node_state.ValueOrDie().newest_sth();
   }
+  if (executor) {
+    watch_pending_task_.reset(new util::SyncTask(executor));
+    consistent_store_->WatchPendingEntries(
+        std::bind(&TreeSigner::OnPendingEntriesUpdated, this,
+                  std::placeholders::_1),
+        watch_pending_task_->task());
+  }
+}
+
+
+// static
+unique_ptr<CompactMerkleTree> TreeSigner::LoadCompactMerkleTree(
+    const ReadOnlyDatabase* db, SerialHasher* hasher) {
+  unique_ptr<SerialHasher> owned_hasher(hasher);
+  SignedTreeHead sth;
+  string hashes;
+  if (db->LatestTreeHead(&sth) != Database::LOOKUP_OK ||
+      db->LookupFrontier(sth.tree_size(), &hashes) != Database::LOOKUP_OK) {
+    return nullptr;
+  }
+
+  vector<string> frontier;
+  if (!DecodeFrontier(sth.tree_size(), hashes, owned_hasher->DigestSize(),
+                      &frontier)) {
+    LOG(WARNING) << "Malformed frontier for tree size " << sth.tree_size();
+    return nullptr;
+  }
+  unique_ptr<CompactMerkleTree> tree(
+      new CompactMerkleTree(sth.tree_size(), frontier, move(owned_hasher)));
+  if (tree->CurrentRoot() != sth.sha256_root_hash()) {
+    LOG(WARNING) << "Frontier for tree size " << sth.tree_size()
+                 << " does not match the latest tree head";
+    return nullptr;
+  }
+  return tree;
+}
+
+
+TreeSigner::~TreeSigner() {
+  if (watch_pending_task_) {
+    watch_pending_task_->Cancel();
+    watch_pending_task_->Wait();
+  }
+  WaitForLocalWrite();
 }
 
 
@@ -98,6 +360,10 @@ uint64_t TreeSigner::LastUpdateTime() const {
 
 
 Status TreeSigner::SequenceNewEntries() {
+  PhaseTimer timer(&sequencer_phase_latency_ms);
+  // The previous entries must be in the database for TreeSize() below.
+  WaitForLocalWrite();
+  timer.EndPhase("db_write_wait");
   const system_clock::time_point now(system_clock::now());
   StatusOr<int64_t> status_or_sequence_number(
       consistent_store_->NextAvailableSequenceNumber());
@@ -113,6 +379,7 @@ Status TreeSigner::SequenceNewEntries() {
   if (!status.ok()) {
     return status;
   }
+  timer.EndPhase("fetch_mapping");
 
   // Hashes which are already sequenced.
   unordered_map<string, pair<int64_t, bool /*present*/>> sequenced_hashes;
@@ -124,12 +391,57 @@ Status TreeSigner::SequenceNewEntries() {
               .second);
   }
 
-  vector<EntryHandle<LoggedEntry>> pending_entries;
-  status = consistent_store_->GetPendingEntries(&pending_entries);
-  if (!status.ok()) {
-    return status;
+  // The pending entries, in order: those reported by the watch if it
+  // has reported them all, so that they need neither fetching nor
+  // sorting. Only their timestamps and hashes are needed to sequence
+  // them, and the entries are shared rather than copied.
+  vector<PendingRecord> pending_entries;
+  unique_lock<mutex> pending_lock(pending_lock_);
+  const bool watched(pending_ready_);
+  if (watched) {
+    new_pending_ = 0;
+    pending_entries.reserve(pending_.size());
+    for (const auto& pending : pending_) {
+      pending_entries.emplace_back(pending.first.first, pending.first.second,
+                                   pending.second);
+    }
+  } else {
+    pending_lock.unlock();
+    vector<EntryHandle<LoggedEntry>> fetched_entries;
+    status = consistent_store_->GetPendingEntries(&fetched_entries);
+    if (!status.ok()) {
+      return status;
+    }
+    timer.EndPhase("fetch_pending");
+    pending_entries.reserve(fetched_entries.size());
+    for (auto& fetched_entry : fetched_entries) {
+      // Moved out of the handle, which is left empty.
+      const shared_ptr<LoggedEntry> entry(make_shared<LoggedEntry>());
+      entry->Swap(fetched_entry.MutableEntry());
+      CHECK(entry->contents().sct().has_timestamp());
+      pending_entries.emplace_back(entry->timestamp(), entry->Hash(), entry);
+    }
+    // Sorting the records rather than the entries moves, and hashes,
+    // much less.
+    sort(pending_entries.begin(), pending_entries.end());
   }
-  sort(pending_entries.begin(), pending_entries.end(), PendingEntriesOrder());
+
+  // When watched, this is the time spent collecting the pending entries.
+  timer.EndPhase(watched ? "fetch_pending" : "sort");
+
+  if (pending_entry_fetcher_) {
+    // The records hold their entries, so the watch can go on meanwhile.
+    if (watched) {
+      pending_lock.unlock();
+    }
+    ResolveReferences(pending_entry_fetcher_, now, guard_window_,
+                      sequenced_hashes, db_->TreeSize(), &pending_entries);
+    if (watched) {
+      pending_lock.lock();
+    }
+    timer.EndPhase("fetch_references");
+  }
+  sequencer_pending_entries->Set(pending_entries.size());
 
   VLOG(1) << "Sequencing " << pending_entries.size() << " entr"
           << (pending_entries.size() == 1 ? "y" : "ies");
@@ -142,18 +454,34 @@ Status TreeSigner::SequenceNewEntries() {
   // 3) mappings whose corresponding PendingEntry no longer exists will be
   //    removed from the sequence mapping file.
   google::protobuf::RepeatedPtrField<SequenceMapping_Mapping> new_mapping;
-  map<int64_t, const LoggedEntry*> seq_to_entry;
+  map<int64_t, const PendingRecord*> seq_to_entry;
   int num_sequenced(0);
-  for (auto& pending_entry : pending_entries) {
-    const string& pending_hash(pending_entry.Entry().Hash());
+  for (const PendingRecord& pending_entry : pending_entries) {
+    const string& pending_hash(pending_entry.hash);
     const system_clock::time_point cert_time(
-        milliseconds(pending_entry.Entry().timestamp()));
+        milliseconds(pending_entry.timestamp));
     if (now - cert_time < guard_window_) {
-      VLOG(1) << "Entry too recent: "
-              << ToBase64(pending_entry.Entry().Hash());
+      VLOG(1) << "Entry too recent: " << ToBase64(pending_hash);
+      if (watched) {
+        NoteNewPendingEntryLocked(pending_entry.timestamp);
+      }
       continue;
     }
     const auto seq_it(sequenced_hashes.find(pending_hash));
+    if (!pending_entry.entry) {
+      // A reference which could not be resolved. Unless it is already
+      // sequenced, it can wait for the next run.
+      if (seq_it != sequenced_hashes.end()) {
+        return Status(util::error::UNAVAILABLE,
+                      "Missing sequenced pending entry " +
+                          ToBase64(pending_hash));
+      }
+      sequencer_unresolved_references->Increment();
+      if (watched) {
+        NoteNewPendingEntryLocked(pending_entry.timestamp);
+      }
+      continue;
+    }
     SequenceMapping::Mapping* const seq_mapping(new_mapping.Add());
 
     if (seq_it == sequenced_hashes.end()) {
@@ -162,8 +490,7 @@ Status TreeSigner::SequenceNewEntries() {
 
       // Record the sequence -> hash mapping
       seq_mapping->set_sequence_number(next_sequence_number);
-      seq_mapping->set_entry_hash(pending_entry.Entry().Hash());
-      pending_entry.MutableEntry()->set_sequence_number(next_sequence_number);
+      seq_mapping->set_entry_hash(pending_hash);
       ++num_sequenced;
       ++next_sequence_number;
     } else {
@@ -171,31 +498,54 @@ Status TreeSigner::SequenceNewEntries() {
               << seq_it->second.first;
       CHECK(!seq_it->second.second /*present*/)
           << "Saw same sequenced cert twice.";
-      CHECK(!pending_entry.Entry().has_sequence_number());
+      CHECK(!pending_entry.entry->has_sequence_number());
       seq_it->second.second = true;  // present
 
       seq_mapping->set_entry_hash(seq_it->first);
       seq_mapping->set_sequence_number(seq_it->second.first);
-      pending_entry.MutableEntry()->set_sequence_number(seq_it->second.first);
     }
-    CHECK(seq_to_entry
-              .insert(make_pair(pending_entry.Entry().sequence_number(),
-                                pending_entry.MutableEntry()))
+    CHECK(seq_to_entry.insert(make_pair(seq_mapping->sequence_number(),
+                                        &pending_entry))
               .second);
   }
 
+  // The sequenced entries to add to our local DB (see below), which
+  // are only copied a batch at a time as they are written.
+  vector<pair<int64_t, shared_ptr<const LoggedEntry>>> local_entries;
+  for (auto it(seq_to_entry.find(db_->TreeSize())); it != seq_to_entry.end();
+       ++it) {
+    VLOG(1) << "Adding to local DB: " << it->first;
+    local_entries.emplace_back(it->first, it->second->entry);
+  }
+  if (pending_lock.owns_lock()) {
+    pending_lock.unlock();
+  }
+  seq_to_entry.clear();
+  // So that the entries which are not needed any more, if they were
+  // fetched, are freed now.
+  pending_entries.clear();
+  timer.EndPhase("assign");
+
   const StatusOr<SignedTreeHead> serving_sth(
       consistent_store_->GetServingSTH());
   if (!serving_sth.ok()) {
     LOG(WARNING) << "Failed to get ServingSTH: " << serving_sth.status();
     return serving_sth.status();
   }
+  timer.EndPhase("fetch_serving_sth");
 
   // Sanity check: make sure no hashes above the serving_sth level vanished:
   CHECK_LE(serving_sth.ValueOrDie().tree_size(), INT64_MAX);
   const int64_t serving_tree_size(serving_sth.ValueOrDie().tree_size());
   for (const auto& s : sequenced_hashes) {
     if (!s.second.second /*present*/) {
+      // The watch may not have reported an entry sequenced by another
+      // node yet.
+      if (watched && s.second.first >= serving_tree_size) {
+        return Status(util::error::UNAVAILABLE,
+                      "Watch of the pending entries is behind the sequence "
+                      "mapping.");
+      }
       // if it disappeared, check it's underwater:
       CHECK_LT(s.second.first, serving_tree_size);
     }
@@ -214,15 +564,21 @@ Status TreeSigner::SequenceNewEntries() {
   if (!status.ok()) {
     return status;
   }
+  timer.EndPhase("update_mapping");
 
   // Now add the sequenced entries to our local DB so that the local signer can
   // incorporate them.
-  for (auto it(seq_to_entry.find(db_->TreeSize())); it != seq_to_entry.end();
-       ++it) {
-    VLOG(1) << "Adding to local DB: " << it->first;
-    CHECK_EQ(it->first, it->second->sequence_number());
-    CHECK_EQ(Database::OK, db_->CreateSequencedEntry(*(it->second)));
+  const int64_t sequenced_size(
+      local_entries.empty() ? db_->TreeSize()
+                            : local_entries.back().first + 1);
+  WriteLocalEntries(move(local_entries));
+  {
+    lock_guard<mutex> lock(pending_lock_);
+    sequenced_size_ = sequenced_size;
   }
+  pending_cv_.notify_all();
+  timer.EndPhase("db_write_start");
+  sequencer_entries_per_run->Set(num_sequenced);
 
   VLOG(1) << "Sequenced " << num_sequenced << " entries.";
 
@@ -238,26 +594,126 @@ typename TreeSigner::UpdateResult TreeSigner::UpdateTree() {
   // multiple nodes in the cluster may make STHs with the same timestamp.
   // That'll get handled by the Serving STH selection code.
   uint64_t min_timestamp = LastUpdateTime() + 1;
+  PhaseTimer timer(&signer_phase_latency_ms);
+  const uint64_t old_leaf_count(cert_tree_->LeafCount());
+
+  // Include the entries sequenced last.
+  WaitForLocalWrite();
+  timer.EndPhase("db_write_wait");
 
-  // Add any newly sequenced entries from our local DB.
+  // Add any newly sequenced entries from our local DB. There may be a
+  // lot of them (e.g. on startup), so they are added to the tree in
+  // batches.
   auto it(db_->ScanEntries(cert_tree_->LeafCount()));
-  for (int64_t i(cert_tree_->LeafCount());; ++i) {
-    LoggedEntry logged;
-    if (!it->GetNextEntry(&logged) || logged.sequence_number() != i) {
-      break;
+  vector<LoggedEntry> entries;
+  vector<string> serialized_leaves;
+  // The indices in |entries| of those stored without their leaf hash,
+  // and the hashes computed for them.
+  vector<size_t> unhashed;
+  string computed_hashes;
+  const size_t node_size(cert_tree_->NodeSize());
+  string leaf_hashes;
+  size_t batch_size(0);
+  bool contiguous(true);
+  // The reads are interleaved with the hashing, time them separately.
+  steady_clock::duration scan_time(steady_clock::duration::zero());
+  steady_clock::time_point scan_start(steady_clock::now());
+  while (contiguous && it->GetNextEntries(kScanBatchSize, &entries) > 0) {
+    scan_time += steady_clock::now() - scan_start;
+    size_t count(0);
+    while (count < entries.size() &&
+           entries[count].sequence_number() ==
+               static_cast<int64_t>(cert_tree_->LeafCount() + batch_size +
+                                    count)) {
+      min_timestamp = max(min_timestamp, entries[count].sct().timestamp());
+      ++count;
+    }
+    contiguous = count == entries.size();
+
+    // Serialize and hash the entries stored without their leaf hash in
+    // parallel, then add them all to the tree in order.
+    unhashed.clear();
+    for (size_t i = 0; i < count; ++i) {
+      if (!entries[i].has_leaf_hash()) {
+        unhashed.push_back(i);
+      }
+    }
+    serialized_leaves.resize(unhashed.size());
+    const auto serialize(
+        [&entries, &serialized_leaves, &unhashed](size_t chunk) {
+          const size_t end(
+              min(unhashed.size(), (chunk + 1) * kSerializeChunk));
+          for (size_t i = chunk * kSerializeChunk; i < end; ++i) {
+            CHECK(
+                entries[unhashed[i]].SerializeForLeaf(&serialized_leaves[i]));
+          }
+        });
+    const size_t chunks((unhashed.size() + kSerializeChunk - 1) /
+                        kSerializeChunk);
+    if (executor_) {
+      util::ParallelFor(executor_, chunks, serialize);
+    } else {
+      for (size_t chunk = 0; chunk < chunks; ++chunk) {
+        serialize(chunk);
+      }
+    }
+    const size_t offset(leaf_hashes.size());
+    leaf_hashes.resize(offset + count * node_size);
+    if (unhashed.size() == count) {
+      cert_tree_->LeafHashes(serialized_leaves.data(), count,
+                             &leaf_hashes[offset]);
+    } else {
+      computed_hashes.resize(unhashed.size() * node_size);
+      cert_tree_->LeafHashes(serialized_leaves.data(), unhashed.size(),
+                             &computed_hashes[0]);
+      for (size_t i = 0, next_unhashed = 0; i < count; ++i) {
+        if (next_unhashed < unhashed.size() && unhashed[next_unhashed] == i) {
+          leaf_hashes.replace(offset + i * node_size, node_size,
+                              computed_hashes, next_unhashed * node_size,
+                              node_size);
+          ++next_unhashed;
+        } else {
+          CHECK_EQ(node_size, entries[i].leaf_hash().size());
+          leaf_hashes.replace(offset + i * node_size, node_size,
+                              entries[i].leaf_hash());
+        }
+      }
+    }
+    for (size_t i = 0; i < count; ++i) {
+      PublishLeafHash(leaf_hashes.substr(offset + i * node_size, node_size));
     }
-    CHECK_EQ(logged.sequence_number(), i);
-    AppendToTree(logged);
-    min_timestamp = max(min_timestamp, logged.sct().timestamp());
+
+    batch_size += count;
+    if (batch_size >= kMaxLeafHashBatch) {
+      cert_tree_->AddLeafHashes(leaf_hashes.data(), batch_size);
+      leaf_hashes.clear();
+      batch_size = 0;
+    }
+    scan_start = steady_clock::now();
   }
+  scan_time += steady_clock::now() - scan_start;
+  cert_tree_->AddLeafHashes(leaf_hashes.data(), batch_size);
   int64_t next_seq(cert_tree_->LeafCount());
   CHECK_GE(next_seq, 0);
+  signer_phase_latency_ms.RecordLatency("db_scan", scan_time);
+  timer.EndPhase("hash", scan_time);
+  signer_entries_per_run->Set(next_seq - old_leaf_count);
+
+  FlushLeafHashes();
+  timer.EndPhase("flush");
 
   // Our tree is consistent with the database, i.e., each leaf in the tree has
   // a matching sequence number in the database (at least assuming overwriting
   // the sequence number is not allowed).
   SignedTreeHead new_sth;
   TimestampAndSign(min_timestamp, &new_sth);
+  timer.EndPhase("sign");
+  WriteFrontier();
+  timer.EndPhase("frontier");
+  {
+    lock_guard<mutex> lock(pending_lock_);
+    signer_unsigned_entries->Set(max<int64_t>(sequenced_size_ - next_seq, 0));
+  }
 
   // We don't actually store this STH anywhere durable yet, but rather let the
   // caller decide what to do with it.  (In practice, this will mean that it's
@@ -286,19 +742,244 @@ bool TreeSigner::Append(const LoggedEntry& logged) {
     return false;
   }
 
-  // Update in-memory tree.
-  cert_tree_->AddLeaf(serialized_leaf);
+  AddLeafToTree(serialized_leaf);
   return true;
 }
 
 
-void TreeSigner::AppendToTree(const LoggedEntry& logged) {
-  // Serialize for inclusion in the tree.
-  string serialized_leaf;
-  CHECK(logged.SerializeForLeaf(&serialized_leaf));
-
+void TreeSigner::AddLeafToTree(const string& serialized_leaf) {
   // Update in-memory tree.
-  cert_tree_->AddLeaf(serialized_leaf);
+  const string leaf_hash(cert_tree_->LeafHash(serialized_leaf));
+  cert_tree_->AddLeafHash(leaf_hash);
+  PublishLeafHash(leaf_hash);
+}
+
+
+void TreeSigner::PublishLeafHash(const string& leaf_hash) {
+  if (node_file_) {
+    node_file_->Append(leaf_hash);
+  }
+  leaf_tile_.append(leaf_hash);
+  leaf_tile_dirty_ = true;
+  if (leaf_tile_.size() == TiledMerkleTree::kTileWidth * leaf_hash.size()) {
+    // Full tiles are only written once.
+    CHECK_EQ(Database::OK, db_->WriteTile(0, leaf_tile_index_, leaf_tile_));
+    ++leaf_tile_index_;
+    leaf_tile_.clear();
+    leaf_tile_dirty_ = false;
+  }
+}
+
+
+void TreeSigner::FlushLeafHashes() {
+  // Make sure the leaves are on disk before they are covered by a tree
+  // head. Failing that is not fatal, as readers verify the file against
+  // the tree head anyway; the write is retried on the next update.
+  if (node_file_) {
+    const Status status(node_file_->Flush());
+    LOG_IF(WARNING, !status.ok()) << "Failed to flush Merkle node file: "
+                                  << status;
+  }
+  if (leaf_tile_dirty_) {
+    CHECK_EQ(Database::OK, db_->WriteTile(0, leaf_tile_index_, leaf_tile_));
+    leaf_tile_dirty_ = false;
+  }
+}
+
+
+void TreeSigner::WriteFrontier() {
+  CHECK_EQ(Database::OK,
+           db_->WriteFrontier(cert_tree_->LeafCount(),
+                              EncodeFrontier(cert_tree_->Frontier())));
+}
+
+
+// Brings |node_file_| in line with the initial contents of |cert_tree_|.
+void TreeSigner::SyncNodeFile() {
+  CHECK_LE(cert_tree_->LeafCount(), static_cast<uint64_t>(INT64_MAX));
+  const int64_t tree_size(cert_tree_->LeafCount());
+
+  // The file may be ahead of the tree if we previously went down between
+  // writing it and signing a tree head.
+  if (node_file_->LeafCount() > static_cast<uint64_t>(tree_size)) {
+    LOG(INFO) << "Dropping " << node_file_->LeafCount() - tree_size
+              << " leaves from Merkle node file";
+    const Status status(node_file_->Truncate(tree_size));
+    CHECK(status.ok()) << "Failed to truncate Merkle node file: " << status;
+  }
+
+  // Or behind it, e.g. if it is new.
+  if (node_file_->LeafCount() < static_cast<uint64_t>(tree_size)) {
+    LOG(INFO) << "Adding " << tree_size - node_file_->LeafCount()
+              << " leaves to Merkle node file";
+    auto it(db_->ScanEntries(node_file_->LeafCount()));
+    for (int64_t i(node_file_->LeafCount()); i < tree_size; ++i) {
+      LoggedEntry logged;
+      CHECK(it->GetNextEntry(&logged)) << "Missing entry " << i;
+      CHECK_EQ(i, logged.sequence_number());
+      node_file_->Append(LeafHash(*cert_tree_, logged));
+    }
+  }
+
+  const Status status(node_file_->Flush());
+  LOG_IF(WARNING, !status.ok()) << "Failed to flush Merkle node file: "
+                                << status;
+}
+
+
+void TreeSigner::LoadLeafTile() {
+  CHECK_LE(cert_tree_->LeafCount(), static_cast<uint64_t>(INT64_MAX));
+  const int64_t tree_size(cert_tree_->LeafCount());
+  leaf_tile_index_ = tree_size / TiledMerkleTree::kTileWidth;
+  const int64_t tile_start(leaf_tile_index_ * TiledMerkleTree::kTileWidth);
+  const size_t tile_size((tree_size - tile_start) * cert_tree_->NodeSize());
+  if (tile_size == 0) {
+    return;
+  }
+
+  // The tile may be longer if we previously went down between writing
+  // it and signing a tree head, or missing if it was never written.
+  if (db_->LookupTile(0, leaf_tile_index_, &leaf_tile_) ==
+          Database::LOOKUP_OK &&
+      leaf_tile_.size() >= tile_size) {
+    leaf_tile_.resize(tile_size);
+    return;
+  }
+  LOG(INFO) << "Rebuilding the leaf hashes of tile " << leaf_tile_index_;
+  leaf_tile_.clear();
+  auto it(db_->ScanEntries(tile_start));
+  for (int64_t i(tile_start); i < tree_size; ++i) {
+    LoggedEntry logged;
+    CHECK(it->GetNextEntry(&logged)) << "Missing entry " << i;
+    CHECK_EQ(i, logged.sequence_number());
+    leaf_tile_.append(LeafHash(*cert_tree_, logged));
+  }
+  leaf_tile_dirty_ = true;
+}
+
+
+void TreeSigner::OnPendingEntriesUpdated(
+    const vector<Update<LoggedEntry>>& updates) {
+  lock_guard<mutex> lock(pending_lock_);
+  for (const auto& update : updates) {
+    const string& key(update.handle_.Key());
+    const auto existing(pending_keys_.find(key));
+    if (existing != pending_keys_.end()) {
+      const auto pending(pending_.find(existing->second));
+      if (pending != pending_.end()) {
+        pending_bytes_ -= PendingEntryBytes(*pending->second);
+        pending_.erase(pending);
+      }
+      pending_keys_.erase(existing);
+    }
+    if (update.exists_) {
+      // Ordered as by PendingEntriesOrder.
+      const LoggedEntry& entry(update.handle_.Entry());
+      CHECK(entry.contents().sct().has_timestamp());
+      const pair<uint64_t, string> order(entry.contents().sct().timestamp(),
+                                         entry.Hash());
+      if (existing == pending_keys_.end()) {
+        NoteNewPendingEntryLocked(entry.timestamp());
+      }
+      pending_.insert(make_pair(order, make_shared<const LoggedEntry>(entry)));
+      pending_bytes_ += PendingEntryBytes(entry);
+      pending_keys_.insert(make_pair(key, order));
+    }
+  }
+  pending_ready_ = true;
+  pending_cv_.notify_all();
+}
+
+
+void TreeSigner::NoteNewPendingEntryLocked(uint64_t timestamp) {
+  if (new_pending_ == 0 || timestamp < oldest_new_pending_) {
+    oldest_new_pending_ = timestamp;
+  }
+  ++new_pending_;
+}
+
+
+int64_t TreeSigner::WaitForPendingEntries(
+    int64_t min_entries, const duration<double>& max_delay,
+    const steady_clock::time_point& deadline) {
+  if (!watch_pending_task_) {
+    std::this_thread::sleep_until(deadline);
+    return -1;
+  }
+  unique_lock<mutex> lock(pending_lock_);
+  while (true) {
+    steady_clock::time_point until(deadline);
+    if (new_pending_ > 0) {
+      // Entries can only be sequenced once out of the guard window.
+      const system_clock::time_point due(
+          system_clock::time_point(milliseconds(oldest_new_pending_)) +
+          duration_cast<system_clock::duration>(guard_window_) +
+          (new_pending_ >= min_entries
+               ? system_clock::duration::zero()
+               : duration_cast<system_clock::duration>(max_delay)));
+      const system_clock::duration due_in(due - system_clock::now());
+      if (due_in <= system_clock::duration::zero()) {
+        break;
+      }
+      // Convert it to the steady clock.
+      until = min(until, steady_clock::now() +
+                             duration_cast<steady_clock::duration>(due_in));
+    }
+    if (steady_clock::now() >= deadline) {
+      break;
+    }
+    pending_cv_.wait_until(lock, until);
+  }
+  return new_pending_;
+}
+
+
+int64_t TreeSigner::WaitForUnsignedEntries(
+    int64_t min_entries, const steady_clock::time_point& deadline) {
+  // Only UpdateTree() changes |latest_tree_head_|, and it is called on
+  // the same thread as this.
+  const int64_t signed_size(latest_tree_head_.tree_size());
+  unique_lock<mutex> lock(pending_lock_);
+  pending_cv_.wait_until(lock, deadline, [this, min_entries, signed_size]() {
+    return sequenced_size_ - signed_size >= min_entries;
+  });
+  return max<int64_t>(sequenced_size_ - signed_size, 0);
+}
+
+
+void TreeSigner::WriteLocalEntries(
+    vector<pair<int64_t, shared_ptr<const LoggedEntry>>>&& entries) {
+  const size_t batch_size(max(FLAGS_sequencer_db_write_batch_size, 1));
+  for (size_t start = 0; start < entries.size(); start += batch_size) {
+    const size_t end(min(start + batch_size, entries.size()));
+    vector<LoggedEntry> batch;
+    batch.reserve(end - start);
+    for (size_t i = start; i < end; ++i) {
+      batch.push_back(*entries[i].second);
+      batch.back().set_sequence_number(entries[i].first);
+      entries[i].second.reset();
+    }
+    // The previous batch is written while this one is copied, but no
+    // more than that are kept in memory.
+    WaitForLocalWrite();
+    lock_guard<mutex> lock(local_write_lock_);
+    local_write_ = db_->CreateSequencedEntriesAsync(move(batch));
+  }
+}
+
+
+void TreeSigner::WaitForLocalWrite() {
+  shared_future<vector<Database::WriteResult>> local_write;
+  {
+    lock_guard<mutex> lock(local_write_lock_);
+    local_write = local_write_;
+  }
+  if (!local_write.valid()) {
+    return;
+  }
+  for (Database::WriteResult result : local_write.get()) {
+    CHECK_EQ(Database::OK, result);
+  }
 }
 
 
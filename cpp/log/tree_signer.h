@@ -4,12 +4,25 @@
 #include <stdint.h>
 #include <algorithm>
 #include <chrono>
+#include <condition_variable>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include "log/cluster_state_controller.h"
 #include "log/consistent_store.h"
+#include "log/database.h"
 #include "log/logged_entry.h"
 #include "merkletree/compact_merkle_tree.h"
+#include "monitoring/memory.h"
 #include "proto/ct.pb.h"
+#include "util/executor.h"
+#include "util/sync_task.h"
 
 
 namespace util {
@@ -21,7 +34,8 @@ class LogSigner;
 
 namespace cert_trans {
 
-class Database;
+class MerkleNodeFile;
+class PendingEntryFetcher;
 
 
 // Signer for appending new entries to the log.
@@ -30,13 +44,38 @@ class Database;
 // no other signers during its lifetime -- when it discovers the database has
 // received tree updates it has not written, it does not try to recover,
 // but rather reports an error.
+//
+// The hashes of the leaves added to the tree are published to the
+// database, as the level 0 tiles of the tree (see
+// merkletree/tiled_merkle_tree.h), before a tree head covering them is
+// signed. LogLookup reads them from there rather than reading the
+// entries back and hashing them again.
 class TreeSigner {
  public:
   // No transfer of ownership for params other than merkle_tree whose contents
-  // is moved into this object.
+  // is moved into this object. If |node_file| is not NULL, the hash of
+  // every leaf added to the tree is appended to it, and it is flushed
+  // before each new tree head is signed; it is first brought in line
+  // with |merkle_tree|. If |executor| is not NULL, the pending entries
+  // are watched on it, and kept in memory (see SequenceNewEntries()),
+  // and the new entries are serialized and hashed on it in parallel
+  // (see UpdateTree()).
   TreeSigner(const std::chrono::duration<double>& guard_window, Database* db,
              std::unique_ptr<CompactMerkleTree> merkle_tree,
-             cert_trans::ConsistentStore* consistent_store, LogSigner* signer);
+             cert_trans::ConsistentStore* consistent_store, LogSigner* signer,
+             MerkleNodeFile* node_file = nullptr,
+             util::Executor* executor = nullptr);
+  ~TreeSigner();
+
+  // Returns the tree of the latest tree head in |db|, built from the
+  // frontier written with it by a previous signer, which is verified
+  // against the root of the tree head. This only takes a few hashes
+  // whatever the size of the tree, unlike building it from the entries
+  // (see LogLookup::GetCompactMerkleTree()). Returns NULL if there is
+  // no such frontier, or it does not match. Takes ownership of
+  // |hasher|.
+  static std::unique_ptr<CompactMerkleTree> LoadCompactMerkleTree(
+      const ReadOnlyDatabase* db, SerialHasher* hasher);
 
   enum UpdateResult {
     OK,
@@ -46,11 +85,45 @@ class TreeSigner {
     INSUFFICIENT_DATA,
   };
 
+  // Has the references among the pending entries (see
+  // PendingEntryStore) resolved by |fetcher|, which must outlive this
+  // instance, before their entries are written to the database. Those
+  // it cannot resolve are left pending until it can, unless they are
+  // sequenced already, in which case SequenceNewEntries() fails.
+  void SetPendingEntryFetcher(PendingEntryFetcher* fetcher) {
+    pending_entry_fetcher_ = fetcher;
+  }
+
   // Latest Tree Head timestamp;
   uint64_t LastUpdateTime() const;
 
+  // Sequences the pending entries, and starts writing them to the
+  // local database. The next call, and UpdateTree(), wait for the
+  // write to complete.
+  //
+  // When the pending entries are watched, they are taken from memory,
+  // already in order, rather than all fetched from the consistent store
+  // and sorted. Entries added since the watch last reported are left to
+  // the next call.
   util::Status SequenceNewEntries();
 
+  // Waits until entries which have become pending since the last
+  // SequenceNewEntries() call are worth sequencing, or until |deadline|:
+  // once the oldest of them is out of the guard window, if there are at
+  // least |min_entries|, or otherwise |max_delay| later. Returns how
+  // many entries have become pending, or -1 if the pending entries are
+  // not watched, in which case it always waits until |deadline|.
+  int64_t WaitForPendingEntries(
+      int64_t min_entries, const std::chrono::duration<double>& max_delay,
+      const std::chrono::steady_clock::time_point& deadline);
+
+  // Waits until at least |min_entries| entries sequenced by
+  // SequenceNewEntries() are not covered by LatestSTH(), or until
+  // |deadline|. Returns how many are not.
+  int64_t WaitForUnsignedEntries(
+      int64_t min_entries,
+      const std::chrono::steady_clock::time_point& deadline);
+
   // Simplest update mechanism: take all pending entries and append
   // (in random order) to the tree. Checks that the update it writes
   // to the database is consistent with the latest STH.
@@ -64,16 +137,81 @@ class TreeSigner {
 
  private:
   bool Append(const LoggedEntry& logged);
-  void AppendToTree(const LoggedEntry& logged_cert);
+  void AddLeafToTree(const std::string& serialized_leaf);
+  // Appends the hash of the leaf added last to the tree to |node_file_|
+  // and |leaf_tile_|.
+  void PublishLeafHash(const std::string& leaf_hash);
+  // Writes out the leaf hashes published so far.
+  void FlushLeafHashes();
+  // Writes the frontier of |cert_tree_| to the database, for
+  // LoadCompactMerkleTree().
+  void WriteFrontier();
+  void SyncNodeFile();
+  // Loads the leaf hashes of the partial tile at the right edge of the
+  // initial tree into |leaf_tile_|.
+  void LoadLeafTile();
+  // Starts writing |entries| (sequence numbers and entries, in order)
+  // to the database, --sequencer_db_write_batch_size at a time, waiting
+  // for each batch but the last one to be written.
+  void WriteLocalEntries(
+      std::vector<std::pair<int64_t, std::shared_ptr<const LoggedEntry>>>&&
+          entries);
+  void WaitForLocalWrite();
+  void OnPendingEntriesUpdated(
+      const std::vector<Update<LoggedEntry>>& updates);
+  // Counts an entry added at |timestamp| in |new_pending_|.
+  // REQUIRES: |pending_lock_| is held.
+  void NoteNewPendingEntryLocked(uint64_t timestamp);
   void TimestampAndSign(uint64_t min_timestamp, ct::SignedTreeHead* sth);
 
   const std::chrono::duration<double> guard_window_;
   Database* const db_;
   cert_trans::ConsistentStore* const consistent_store_;
   LogSigner* const signer_;
+  MerkleNodeFile* const node_file_;
+  PendingEntryFetcher* pending_entry_fetcher_;
+  // Also serializes and hashes the entries added by UpdateTree().
+  util::Executor* const executor_;
   const std::unique_ptr<CompactMerkleTree> cert_tree_;
   ct::SignedTreeHead latest_tree_head_;
 
+  // The level 0 tile holding the last leaves of |cert_tree_|, which is
+  // written to the database when it is full, or on FlushLeafHashes()
+  // if it has changed.
+  int64_t leaf_tile_index_;
+  std::string leaf_tile_;
+  bool leaf_tile_dirty_;
+
+  // The pending entries reported by the watch, in PendingEntriesOrder,
+  // once it has reported them all.
+  std::mutex pending_lock_;
+  bool pending_ready_;
+  // The entries are shared with the SequenceNewEntries() call which
+  // writes them to the database, if any.
+  std::map<std::pair<uint64_t, std::string>,
+           std::shared_ptr<const LoggedEntry>>
+      pending_;
+  // The keys of |pending_|, by consistent store key.
+  std::unordered_map<std::string, std::pair<uint64_t, std::string>>
+      pending_keys_;
+  std::unique_ptr<util::SyncTask> watch_pending_task_;
+  // The entries which have become pending since the last
+  // SequenceNewEntries() call, or which it left as too recent, and the
+  // timestamp of the oldest of them.
+  int64_t new_pending_;
+  uint64_t oldest_new_pending_;
+  // The tree size once the entries sequenced last are added.
+  int64_t sequenced_size_;
+  // Notified when any of the above change.
+  std::condition_variable pending_cv_;
+  // An estimate of the memory held by |pending_| and |pending_keys_|.
+  size_t pending_bytes_;
+  const MemoryEstimate pending_memory_;
+
+  std::mutex local_write_lock_;
+  // The write started by the last SequenceNewEntries() call.
+  std::shared_future<std::vector<Database::WriteResult>> local_write_;
+
   template <class T>
   friend class TreeSignerTest;
 };
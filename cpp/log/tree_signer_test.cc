@@ -8,6 +8,7 @@
 #include "log/file_db.h"
 #include "log/log_signer.h"
 #include "log/log_verifier.h"
+#include "log/merkle_node_file.h"
 #include "log/sqlite_db.h"
 #include "log/test_db.h"
 #include "log/test_signer.h"
@@ -23,6 +24,8 @@
 #include "util/thread_pool.h"
 #include "util/util.h"
 
+DECLARE_bool(db_store_leaf_hashes);
+
 namespace cert_trans {
 
 using cert_trans::EntryHandle;
@@ -111,12 +114,12 @@ class TreeSignerTest : public ::testing::Test {
   }
 
 
-  TreeSigner* GetSimilar() {
+  TreeSigner* GetSimilar(MerkleNodeFile* node_file = nullptr) {
     return new TreeSigner(std::chrono::duration<double>(0), db(),
                           unique_ptr<CompactMerkleTree>(new CompactMerkleTree(
                               *tree_signer_->cert_tree_,
                               unique_ptr<Sha256Hasher>(new Sha256Hasher))),
-                          store_.get(), log_signer_.get());
+                          store_.get(), log_signer_.get(), node_file);
   }
 
   T* db() const {
@@ -133,6 +136,7 @@ class TreeSignerTest : public ::testing::Test {
   unique_ptr<LogVerifier> verifier_;
   unique_ptr<LogSigner> log_signer_;
   unique_ptr<TreeSigner> tree_signer_;
+  TmpStorage tmp_;
 };
 
 typedef testing::Types<FileDB, SQLiteDB> Databases;
@@ -285,6 +289,127 @@ TYPED_TEST(TreeSignerTest, SignEmpty) {
 }
 
 
+TYPED_TEST(TreeSignerTest, WritesNodeFile) {
+  LoggedEntry logged_certs[4];
+  for (int i = 0; i < 3; ++i) {
+    this->test_signer_.CreateUnique(&logged_certs[i]);
+    this->AddSequencedEntry(&logged_certs[i], i);
+  }
+  EXPECT_EQ(TreeSigner::OK, this->tree_signer_->UpdateTree());
+
+  const string path(this->tmp_.TmpStorageDir() + "/nodes");
+  util::StatusOr<unique_ptr<MerkleNodeFile>> file(
+      MerkleNodeFile::Open(path, 32));
+  ASSERT_OK(file.status());
+  {
+    // The existing leaves are added to the new file, and the new ones
+    // appended as they are added to the tree.
+    unique_ptr<TreeSigner> signer2(
+        this->GetSimilar(file.ValueOrDie().get()));
+    EXPECT_EQ(3U, file.ValueOrDie()->LeafCount());
+    this->test_signer_.CreateUnique(&logged_certs[3]);
+    this->AddSequencedEntry(&logged_certs[3], 3);
+    EXPECT_EQ(TreeSigner::OK, signer2->UpdateTree());
+  }
+
+  util::StatusOr<unique_ptr<MappedMerkleNodeFile>> mapped(
+      MappedMerkleNodeFile::Open(path, 32));
+  ASSERT_OK(mapped.status());
+  ASSERT_EQ(4U, mapped.ValueOrDie()->LeafCount());
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_EQ(logged_certs[i].merkle_leaf_hash(),
+              string(mapped.ValueOrDie()->LeafHash(i), 32));
+  }
+
+  // Leaves past the signer's tree are dropped.
+  unique_ptr<TreeSigner> signer3(this->GetSimilar(file.ValueOrDie().get()));
+  EXPECT_EQ(3U, file.ValueOrDie()->LeafCount());
+}
+
+
+TYPED_TEST(TreeSignerTest, PublishesLeafHashes) {
+  LoggedEntry logged_certs[4];
+  string leaf_hashes;
+  for (int i = 0; i < 3; ++i) {
+    this->test_signer_.CreateUnique(&logged_certs[i]);
+    this->AddSequencedEntry(&logged_certs[i], i);
+    leaf_hashes.append(logged_certs[i].merkle_leaf_hash());
+  }
+  EXPECT_EQ(TreeSigner::OK, this->tree_signer_->UpdateTree());
+  string tile;
+  ASSERT_EQ(Database::LOOKUP_OK, this->db()->LookupTile(0, 0, &tile));
+  EXPECT_EQ(leaf_hashes, tile);
+
+  // A new signer carries on with the same tile.
+  unique_ptr<TreeSigner> signer2(this->GetSimilar());
+  this->test_signer_.CreateUnique(&logged_certs[3]);
+  this->AddSequencedEntry(&logged_certs[3], 3);
+  leaf_hashes.append(logged_certs[3].merkle_leaf_hash());
+  EXPECT_EQ(TreeSigner::OK, signer2->UpdateTree());
+  ASSERT_EQ(Database::LOOKUP_OK, this->db()->LookupTile(0, 0, &tile));
+  EXPECT_EQ(leaf_hashes, tile);
+}
+
+
+TYPED_TEST(TreeSignerTest, UsesStoredLeafHashes) {
+  // Only some of the entries are stored with their leaf hash.
+  LoggedEntry logged_certs[5];
+  string leaf_hashes;
+  for (int i = 0; i < 5; ++i) {
+    FLAGS_db_store_leaf_hashes = i % 2 == 0;
+    this->test_signer_.CreateUnique(&logged_certs[i]);
+    this->AddSequencedEntry(&logged_certs[i], i);
+    leaf_hashes.append(logged_certs[i].merkle_leaf_hash());
+  }
+  FLAGS_db_store_leaf_hashes = false;
+  LoggedEntry stored;
+  ASSERT_EQ(Database::LOOKUP_OK, this->db()->LookupByIndex(0, &stored));
+  EXPECT_TRUE(stored.has_leaf_hash());
+
+  EXPECT_EQ(TreeSigner::OK, this->tree_signer_->UpdateTree());
+  string tile;
+  ASSERT_EQ(Database::LOOKUP_OK, this->db()->LookupTile(0, 0, &tile));
+  EXPECT_EQ(leaf_hashes, tile);
+}
+
+
+TYPED_TEST(TreeSignerTest, LoadsFrontier) {
+  // Nothing to load before a tree head is written.
+  EXPECT_FALSE(
+      TreeSigner::LoadCompactMerkleTree(this->db(), new Sha256Hasher));
+
+  LoggedEntry logged_certs[5];
+  for (int i = 0; i < 5; ++i) {
+    this->test_signer_.CreateUnique(&logged_certs[i]);
+    this->AddSequencedEntry(&logged_certs[i], i);
+  }
+  EXPECT_EQ(TreeSigner::OK, this->tree_signer_->UpdateTree());
+  const SignedTreeHead sth(this->tree_signer_->LatestSTH());
+  EXPECT_FALSE(
+      TreeSigner::LoadCompactMerkleTree(this->db(), new Sha256Hasher));
+
+  // Simulate the serving tree head being written out.
+  ASSERT_EQ(Database::OK, this->db()->WriteTreeHead(sth));
+  unique_ptr<CompactMerkleTree> tree(
+      TreeSigner::LoadCompactMerkleTree(this->db(), new Sha256Hasher));
+  ASSERT_TRUE(tree);
+  EXPECT_EQ(sth.tree_size(), tree->LeafCount());
+  EXPECT_EQ(sth.sha256_root_hash(), tree->CurrentRoot());
+
+  // A frontier that does not match the tree head is not used.
+  string frontier;
+  ASSERT_EQ(Database::LOOKUP_OK,
+            this->db()->LookupFrontier(sth.tree_size(), &frontier));
+  frontier[0] ^= 1;
+  ASSERT_EQ(Database::OK,
+            this->db()->WriteFrontier(sth.tree_size(), frontier));
+  EXPECT_FALSE(
+      TreeSigner::LoadCompactMerkleTree(this->db(), new Sha256Hasher));
+  ASSERT_EQ(Database::OK, this->db()->WriteFrontier(sth.tree_size(), "x"));
+  EXPECT_FALSE(
+      TreeSigner::LoadCompactMerkleTree(this->db(), new Sha256Hasher));
+}
+
 TYPED_TEST(TreeSignerTest, SequenceNewEntriesCleansUpOldSequenceMappings) {
   LoggedEntry logged_cert;
   this->test_signer_.CreateUnique(&logged_cert);
@@ -327,6 +452,84 @@ TYPED_TEST(TreeSignerTest, SequenceNewEntriesCleansUpOldSequenceMappings) {
 }
 
 
+TYPED_TEST(TreeSignerTest, SequenceNewEntriesFromWatch) {
+  unique_ptr<TreeSigner> signer(new TreeSigner(
+      std::chrono::duration<double>(0), this->db(),
+      unique_ptr<CompactMerkleTree>(
+          new CompactMerkleTree(unique_ptr<Sha256Hasher>(new Sha256Hasher))),
+      this->store_.get(), this->log_signer_.get(), nullptr, &this->pool_));
+
+  unordered_map<string, LoggedEntry> logged_certs;
+  for (int i(0); i < 3; ++i) {
+    LoggedEntry c;
+    this->test_signer_.CreateUnique(&c);
+    this->AddPendingEntry(&c);
+    logged_certs.insert(make_pair(c.Hash(), c));
+  }
+
+  // Until the watch reports the new entries, they may not all be
+  // sequenced yet.
+  EntryHandle<SequenceMapping> mapping;
+  for (int i(0); i < 100; ++i) {
+    EXPECT_OK(signer->SequenceNewEntries());
+    CHECK_EQ(::util::OkStatus(), this->store_->GetSequenceMapping(&mapping));
+    if (mapping.Entry().mapping_size() == 3) {
+      break;
+    }
+    usleep(10000);
+  }
+  ASSERT_EQ(3, mapping.Entry().mapping_size());
+  for (int i(0); i < mapping.Entry().mapping_size(); ++i) {
+    EXPECT_EQ(i, mapping.Entry().mapping(i).sequence_number());
+    EXPECT_NE(logged_certs.end(),
+              logged_certs.find(mapping.Entry().mapping(i).entry_hash()));
+  }
+
+  EXPECT_EQ(TreeSigner::OK, signer->UpdateTree());
+  EXPECT_EQ(3, signer->LatestSTH().tree_size());
+  EXPECT_EQ(3, this->db()->TreeSize());
+}
+
+
+TYPED_TEST(TreeSignerTest, WaitsForEntries) {
+  unique_ptr<TreeSigner> signer(new TreeSigner(
+      std::chrono::duration<double>(0), this->db(),
+      unique_ptr<CompactMerkleTree>(
+          new CompactMerkleTree(unique_ptr<Sha256Hasher>(new Sha256Hasher))),
+      this->store_.get(), this->log_signer_.get(), nullptr, &this->pool_));
+  const std::chrono::hours long_delay(1);
+
+  for (int i(0); i < 2; ++i) {
+    LoggedEntry c;
+    this->test_signer_.CreateUnique(&c);
+    this->AddPendingEntry(&c);
+  }
+  // Two new entries make a batch.
+  EXPECT_EQ(2, signer->WaitForPendingEntries(
+                   2, long_delay,
+                   std::chrono::steady_clock::now() + long_delay));
+
+  // Sequencing them resets the count.
+  EXPECT_OK(signer->SequenceNewEntries());
+  EXPECT_EQ(0, signer->WaitForPendingEntries(
+                   1, long_delay, std::chrono::steady_clock::now()));
+  EXPECT_EQ(2, signer->WaitForUnsignedEntries(
+                   2, std::chrono::steady_clock::now() + long_delay));
+
+  EXPECT_EQ(TreeSigner::OK, signer->UpdateTree());
+  EXPECT_EQ(0, signer->WaitForUnsignedEntries(
+                   1, std::chrono::steady_clock::now()));
+
+  // A single entry is waited for up to the delay.
+  LoggedEntry c;
+  this->test_signer_.CreateUnique(&c);
+  this->AddPendingEntry(&c);
+  EXPECT_EQ(1, signer->WaitForPendingEntries(
+                   2, std::chrono::milliseconds(10),
+                   std::chrono::steady_clock::now() + long_delay));
+}
+
+
 }  // namespace cert_trans
 
 
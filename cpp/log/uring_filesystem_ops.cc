@@ -0,0 +1,269 @@
+#include "log/uring_filesystem_ops.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+DEFINE_int32(filesystem_io_uring_entries, 256,
+             "Size of the submission queue of the io_uring of the file "
+             "database, see --filesystem_io_uring.");
+
+using std::function;
+using std::lock_guard;
+using std::mutex;
+using std::string;
+using std::unique_lock;
+using std::unique_ptr;
+using std::vector;
+
+namespace cert_trans {
+namespace {
+
+
+const int kOpcodes[] = {
+    IORING_OP_NOP,   IORING_OP_WRITE,    IORING_OP_READ,
+    IORING_OP_FSYNC, IORING_OP_CLOSE,    IORING_OP_RENAMEAT,
+};
+
+
+bool OpcodesSupported() {
+  io_uring_probe* const probe(io_uring_get_probe());
+  if (!probe) {
+    return false;
+  }
+  bool supported(true);
+  for (const int opcode : kOpcodes) {
+    supported = supported && io_uring_opcode_supported(probe, opcode);
+  }
+  io_uring_free_probe(probe);
+  return supported;
+}
+
+
+}  // namespace
+
+
+struct UringFilesystemOps::Completion {
+  Op* op;
+  int index;
+};
+
+
+struct UringFilesystemOps::Op {
+  explicit Op(int count)
+      : remaining(count), results(count, 0), completions(count) {
+    for (int i = 0; i < count; ++i) {
+      completions[i].op = this;
+      completions[i].index = i;
+    }
+  }
+
+  // Guarded by completion_lock_.
+  int remaining;
+  vector<int> results;
+  vector<Completion> completions;
+};
+
+
+// static
+unique_ptr<UringFilesystemOps> UringFilesystemOps::Create() {
+  if (!OpcodesSupported()) {
+    return nullptr;
+  }
+  unique_ptr<UringFilesystemOps> ops(new UringFilesystemOps);
+  const int ret(
+      io_uring_queue_init(FLAGS_filesystem_io_uring_entries, &ops->ring_, 0));
+  if (ret < 0) {
+    LOG(WARNING) << "io_uring_queue_init failed: " << strerror(-ret);
+    // There is no ring to close.
+    ops->ring_.ring_fd = -1;
+    return nullptr;
+  }
+  ops->reaper_ = std::thread(&UringFilesystemOps::Reap, ops.get());
+  return ops;
+}
+
+
+UringFilesystemOps::UringFilesystemOps() : submit_pending_(false) {
+  ring_.ring_fd = -1;
+}
+
+
+UringFilesystemOps::~UringFilesystemOps() {
+  if (ring_.ring_fd < 0) {
+    return;
+  }
+
+  {
+    // A completion without data stops the reaper.
+    lock_guard<mutex> lock(submit_lock_);
+    while (io_uring_sq_space_left(&ring_) < 1) {
+      CHECK_GE(io_uring_submit(&ring_), 0);
+    }
+    io_uring_sqe* const sqe(io_uring_get_sqe(&ring_));
+    io_uring_prep_nop(sqe);
+    io_uring_sqe_set_data(sqe, nullptr);
+    CHECK_GE(io_uring_submit(&ring_), 0);
+  }
+  reaper_.join();
+  io_uring_queue_exit(&ring_);
+}
+
+
+int UringFilesystemOps::atomic_write(const string& tmp_template,
+                                     const string& path, const string& data) {
+  vector<char> tmp_buf(tmp_template.begin(), tmp_template.end());
+  tmp_buf.push_back('\0');
+  const int fd(mkstemp(tmp_buf.data()));
+  if (fd < 0) {
+    return -1;
+  }
+  const string tmp_path(tmp_buf.data());
+
+  // A failure cancels the rest of the chain.
+  const vector<int> results(Run(4, [&](io_uring_sqe* const* sqes) {
+    io_uring_prep_write(sqes[0], fd, data.data(), data.size(), 0);
+    io_uring_sqe_set_flags(sqes[0], IOSQE_IO_LINK);
+    io_uring_prep_fsync(sqes[1], fd, IORING_FSYNC_DATASYNC);
+    io_uring_sqe_set_flags(sqes[1], IOSQE_IO_LINK);
+    io_uring_prep_close(sqes[2], fd);
+    io_uring_sqe_set_flags(sqes[2], IOSQE_IO_LINK);
+    io_uring_prep_renameat(sqes[3], AT_FDCWD, tmp_path.c_str(), AT_FDCWD,
+                           path.c_str(), 0);
+  }));
+
+  if (results[2] == -ECANCELED) {
+    close(fd);
+  }
+  int error(0);
+  if (results[0] >= 0 && static_cast<size_t>(results[0]) != data.size()) {
+    error = EIO;
+  } else {
+    for (const int result : results) {
+      if (result < 0) {
+        error = -result;
+        break;
+      }
+    }
+  }
+  if (error != 0) {
+    unlink(tmp_path.c_str());
+    errno = error;
+    return -1;
+  }
+  return 0;
+}
+
+
+int UringFilesystemOps::read_file(const string& path, string* data) {
+  const int fd(open(path.c_str(), O_RDONLY));
+  if (fd < 0) {
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    const int error(errno);
+    close(fd);
+    errno = error;
+    return -1;
+  }
+
+  data->resize(st.st_size);
+  size_t done(0);
+  if (!data->empty()) {
+    const vector<int> results(Run(1, [&](io_uring_sqe* const* sqes) {
+      io_uring_prep_read(sqes[0], fd, &(*data)[0], data->size(), 0);
+    }));
+    if (results[0] < 0) {
+      close(fd);
+      errno = -results[0];
+      return -1;
+    }
+    done = results[0];
+  }
+  // Short reads are finished off directly.
+  while (done < data->size()) {
+    const ssize_t got(
+        pread(fd, &(*data)[done], data->size() - done, done));
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got <= 0) {
+      break;
+    }
+    done += got;
+  }
+  data->resize(done);
+  close(fd);
+  return 0;
+}
+
+
+vector<int> UringFilesystemOps::Run(
+    int count, const function<void(io_uring_sqe* const*)>& prepare) {
+  Op op(count);
+  {
+    unique_lock<mutex> lock(submit_lock_);
+    // The entries of a chain must be submitted together.
+    while (io_uring_sq_space_left(&ring_) < static_cast<unsigned>(count)) {
+      CHECK_GE(io_uring_submit(&ring_), 0);
+    }
+    vector<io_uring_sqe*> sqes(count);
+    for (int i = 0; i < count; ++i) {
+      sqes[i] = CHECK_NOTNULL(io_uring_get_sqe(&ring_));
+    }
+    prepare(sqes.data());
+    for (int i = 0; i < count; ++i) {
+      io_uring_sqe_set_data(sqes[i], &op.completions[i]);
+    }
+
+    // Give the other callers a chance to queue theirs, and submit them
+    // all at once. Those who come in after the submission submit their
+    // own.
+    if (!submit_pending_) {
+      submit_pending_ = true;
+      lock.unlock();
+      std::this_thread::yield();
+      lock.lock();
+      CHECK_GE(io_uring_submit(&ring_), 0);
+      submit_pending_ = false;
+    }
+  }
+
+  unique_lock<mutex> lock(completion_lock_);
+  completion_cv_.wait(lock, [&op]() { return op.remaining == 0; });
+  return op.results;
+}
+
+
+void UringFilesystemOps::Reap() {
+  while (true) {
+    io_uring_cqe* cqe;
+    const int ret(io_uring_wait_cqe(&ring_, &cqe));
+    if (ret == -EINTR) {
+      continue;
+    }
+    CHECK_EQ(0, ret) << "io_uring_wait_cqe failed: " << strerror(-ret);
+    Completion* const completion(
+        static_cast<Completion*>(io_uring_cqe_get_data(cqe)));
+    const int result(cqe->res);
+    io_uring_cqe_seen(&ring_, cqe);
+    if (!completion) {
+      return;
+    }
+
+    lock_guard<mutex> lock(completion_lock_);
+    completion->op->results[completion->index] = result;
+    if (--completion->op->remaining == 0) {
+      completion_cv_.notify_all();
+    }
+  }
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,69 @@
+#ifndef CERT_TRANS_LOG_URING_FILESYSTEM_OPS_H_
+#define CERT_TRANS_LOG_URING_FILESYSTEM_OPS_H_
+
+#include <liburing.h>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "log/filesystem_ops.h"
+
+namespace cert_trans {
+
+
+// Does the writes and reads of files through an io_uring shared by all
+// the calling threads. The operations of the callers that come in while
+// one is submitting to the ring are submitted together, in a single
+// system call, and atomic_write() submits its write, sync, close and
+// rename as one linked chain, so the calling thread only waits for the
+// device. The other operations are those of BasicFilesystemOps.
+//
+// Unlike BasicFilesystemOps, atomic_write() syncs the data before the
+// rename, as it does not cost the caller an extra system call here.
+class UringFilesystemOps : public BasicFilesystemOps {
+ public:
+  // Returns nullptr if io_uring, or one of the operations used, is not
+  // supported.
+  static std::unique_ptr<UringFilesystemOps> Create();
+
+  ~UringFilesystemOps() override;
+
+  int atomic_write(const std::string& tmp_template, const std::string& path,
+                   const std::string& data) override;
+  int read_file(const std::string& path, std::string* data) override;
+
+ private:
+  struct Op;
+  struct Completion;
+
+  UringFilesystemOps();
+
+  // Gets |count| submission queue entries, has |prepare| fill them in,
+  // submits them, and waits for their results, which are returned in
+  // order.
+  std::vector<int> Run(
+      int count, const std::function<void(io_uring_sqe* const*)>& prepare);
+  // Reaps the completions, until the ring is closed.
+  void Reap();
+
+  io_uring ring_;
+
+  // Held to get and submit submission queue entries.
+  std::mutex submit_lock_;
+  // Whether a caller is about to submit the queued entries.
+  bool submit_pending_;
+
+  std::mutex completion_lock_;
+  std::condition_variable completion_cv_;
+
+  std::thread reaper_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_URING_FILESYSTEM_OPS_H_
@@ -3,15 +3,46 @@
 #include <assert.h>
 #include <glog/logging.h>
 #include <stddef.h>
+#include <string.h>
+#include <algorithm>
 #include <string>
 #include <vector>
 
 #include "merkletree/merkle_tree_math.h"
+#include "merkletree/serial_hasher.h"
+#include "util/parallel_for.h"
 
 using cert_trans::MerkleTreeInterface;
 using std::move;
 using std::string;
 using std::unique_ptr;
+using std::vector;
+
+namespace {
+
+// Height of the subtrees hashed by each work item in parallel mode.
+const size_t kParallelSubtreeLevel = 14;
+const size_t kParallelSubtreeLeaves = static_cast<size_t>(1)
+                                      << kParallelSubtreeLevel;
+// Number of leaves hashed by each work item of a parallel LeafHashes().
+const size_t kParallelLeafChunk = 256;
+
+// Number of levels in a tree with |leaf_count| leaves.
+size_t LevelCountForLeaves(size_t leaf_count) {
+  size_t levels(0);
+  while (leaf_count > (static_cast<size_t>(1) << levels) >> 1)
+    ++levels;
+  return levels;
+}
+
+// Brings the root of |model| up to date, so that all of it is covered
+// by its frontier.
+const MerkleTree& Evaluated(MerkleTree* model) {
+  model->CurrentRoot();
+  return *model;
+}
+
+}  // namespace
 
 CompactMerkleTree::CompactMerkleTree(unique_ptr<SerialHasher> hasher)
     : MerkleTreeInterface(),
@@ -19,82 +50,60 @@ CompactMerkleTree::CompactMerkleTree(unique_ptr<SerialHasher> hasher)
       leaf_count_(0),
       leaves_processed_(0),
       level_count_(0),
-      root_(treehasher_.HashEmpty()) {
+      root_(treehasher_.HashEmpty()),
+      executor_(nullptr) {
 }
 
-CompactMerkleTree::CompactMerkleTree(MerkleTree* model,
+CompactMerkleTree::CompactMerkleTree(const MerkleTree& model,
                                      unique_ptr<SerialHasher> hasher)
     : MerkleTreeInterface(),
-      tree_(std::max<int64_t>(0, CHECK_NOTNULL(model)->LevelCount() - 1)),
+      tree_(model.Frontier()),
       treehasher_(move(hasher)),
-      leaf_count_(model->LeafCount()),
+      leaf_count_(model.EvaluatedLeafCount()),
       leaves_processed_(0),
-      level_count_(model->LevelCount()),
-      root_(treehasher_.HashEmpty()) {
-  if (model->LeafCount() == 0) {
-    return;
-  }
-  // Get the inclusion proof path to the last entry in the tree, which by
-  // definition must consist purely of left-hand nodes.
-  std::vector<string> path(model->PathToCurrentRoot(model->LeafCount()));
-  if (!path.empty()) {
-    /* We have to do some juggling here as tree_[] differs from our MerkleTree
-    // structure in that incomplete right-hand subtrees 'fall-through' to lower
-    // levels:
-    //
-    // MerkleTree structure for 3 leaves:
-    //      R
-    //     / \
-    //    /   \
-    //   AB    c
-    //  / \
-    // a   b
-    //
-    // Compact tree represents this as:
-    //      R
-    //     / \
-    //    /   \
-    //   AB    .
-    //         |
-    //         c
-    // or:
-    // tree_[1] = AB
-    // tree_[0] = c  // (c) has "fallen-through" to the lowest level
-    //
-    // The inclusion proof path for the right-most entry effectively
-    // describes the state of the tree immediately before the right-most
-    // entry was added.
-    // Since the inclusion proof path consists exclusively of left-hand
-    // nodes and each entry in the path covers the maximum sub-tree possible,
-    // we can use this to directly construct the Compact respresentation of
-    // the tree before the newest entry was added.
-    */
-
-    // index into tree_, starting at the leaf level:
-    int level(0);
-    std::vector<string>::const_iterator i = path.begin();
-    size_t size_of_previous_tree(model->LeafCount() - 1);
-    for (; size_of_previous_tree != 0; size_of_previous_tree >>= 1) {
-      if ((size_of_previous_tree & 1) != 0) {
-        // if the level'th bit in the previous tree size is set, then we have
-        // a proof path entry for this level (because proof entries cover the
-        // maximum possible sub-tree.)
-        tree_[level] = *i;
-        i++;
-      }
-      level++;
-    }
-    assert(i == path.end());
+      level_count_(LevelCountForLeaves(leaf_count_)),
+      root_(treehasher_.HashEmpty()),
+      executor_(nullptr) {
+  // The frontier of the model is exactly our representation of the
+  // evaluated part of the tree (see the comment on |tree_|). Anything
+  // after that still has to be added.
+  if (model.LeafCount() > leaf_count_) {
+    const size_t count(model.LeafCount() - leaf_count_);
+    string hashes;
+    hashes.reserve(count * NodeSize());
+    for (size_t leaf = leaf_count_ + 1; leaf <= model.LeafCount(); ++leaf)
+      hashes.append(model.LeafHash(leaf));
+    AddLeafHashes(hashes.data(), count);
   }
+  assert(model.LeafCount() == LeafCount());
+  assert(model.LevelCount() == LevelCount());
+}
 
-  // Now tree_ should contain a representation of the tree state just before
-  // the last entry was added, so we PushBack the final right-hand entry
-  // here, which will perform any recalculations necessary to reach the final
-  // tree.
-  PushBack(0, model->LeafHash(model->LeafCount()));
+CompactMerkleTree::CompactMerkleTree(MerkleTree* model,
+                                     unique_ptr<SerialHasher> hasher)
+    : CompactMerkleTree(Evaluated(CHECK_NOTNULL(model)), move(hasher)) {
   assert(model->CurrentRoot() == CurrentRoot());
-  assert(model->LeafCount() == LeafCount());
-  assert(model->LevelCount() == LevelCount());
+}
+
+CompactMerkleTree::CompactMerkleTree(size_t leaf_count,
+                                     const vector<string>& frontier,
+                                     unique_ptr<SerialHasher> hasher)
+    : MerkleTreeInterface(),
+      tree_(frontier),
+      treehasher_(move(hasher)),
+      leaf_count_(leaf_count),
+      leaves_processed_(0),
+      level_count_(LevelCountForLeaves(leaf_count_)),
+      root_(treehasher_.HashEmpty()),
+      executor_(nullptr) {
+  CHECK(frontier.empty() || (leaf_count >> (frontier.size() - 1)) == 1)
+      << "Frontier of " << frontier.size() << " levels for " << leaf_count
+      << " leaves";
+  for (size_t level = 0; level < frontier.size(); ++level) {
+    CHECK_EQ((leaf_count >> level) & 1 ? NodeSize() : 0,
+             frontier[level].size())
+        << "Bad frontier node at level " << level;
+  }
 }
 
 
@@ -105,7 +114,8 @@ CompactMerkleTree::CompactMerkleTree(const CompactMerkleTree& other,
       leaf_count_(other.leaf_count_),
       leaves_processed_(other.leaves_processed_),
       level_count_(other.level_count_),
-      root_(other.root_) {
+      root_(other.root_),
+      executor_(nullptr) {
 }
 
 CompactMerkleTree::~CompactMerkleTree() {
@@ -113,11 +123,85 @@ CompactMerkleTree::~CompactMerkleTree() {
 
 
 size_t CompactMerkleTree::AddLeaf(const string& data) {
-  return AddLeafHash(treehasher_.HashLeaf(data));
+  char hash[SerialHasher::kMaxDigestSize];
+  treehasher_.HashLeaf(data.data(), data.size(), hash);
+  return AddLeafHashes(hash, 1);
+}
+
+size_t CompactMerkleTree::AddLeaves(const std::vector<string>& data) {
+  vector<char> hashes;
+  // Hashes the leaves at [|begin|, |end|) of |data| and adds them.
+  const auto add_leaves([this, &data, &hashes](size_t begin, size_t end) {
+    hashes.resize((end - begin) * NodeSize());
+    treehasher_.HashLeaves(data.data() + begin, end - begin, hashes.data());
+    AddLeafHashes(hashes.data(), end - begin);
+  });
+
+  size_t begin(0);
+  if (executor_ && data.size() >= 2 * kParallelSubtreeLeaves) {
+    // Bring the tree up to a subtree boundary first.
+    const size_t head((kParallelSubtreeLeaves -
+                       leaf_count_ % kParallelSubtreeLeaves) %
+                      kParallelSubtreeLeaves);
+    add_leaves(0, head);
+    begin = head + AddLeavesInParallel(data, head);
+  }
+  add_leaves(begin, data.size());
+  return LeafCount();
+}
+
+size_t CompactMerkleTree::AddLeavesInParallel(const vector<string>& data,
+                                              size_t begin) {
+  assert(leaf_count_ % kParallelSubtreeLeaves == 0);
+  const size_t subtrees((data.size() - begin) / kParallelSubtreeLeaves);
+  const size_t digest_size(treehasher_.DigestSize());
+
+  vector<string> roots(subtrees);
+  util::ParallelFor(executor_, subtrees, [&](size_t i) {
+    TreeHasher hasher(treehasher_.CreateSerialHasher());
+    // Hash the leaves, then each level of the subtree in turn, bouncing
+    // between two buffers.
+    vector<char> nodes(kParallelSubtreeLeaves * digest_size);
+    vector<char> parents(kParallelSubtreeLeaves / 2 * digest_size);
+    hasher.HashLeaves(&data[begin + i * kParallelSubtreeLeaves],
+                      kParallelSubtreeLeaves, nodes.data());
+    for (size_t count = kParallelSubtreeLeaves; count > 1; count /= 2) {
+      hasher.HashChildrenBatch(nodes.data(), count / 2, parents.data());
+      nodes.swap(parents);
+    }
+    roots[i].assign(nodes.data(), digest_size);
+  });
+
+  for (const auto& root : roots) {
+    PushBack(kParallelSubtreeLevel, root.data());
+    leaf_count_ += kParallelSubtreeLeaves;
+  }
+  level_count_ = LevelCountForLeaves(leaf_count_);
+  return subtrees * kParallelSubtreeLeaves;
+}
+
+void CompactMerkleTree::LeafHashes(const string* data, size_t count,
+                                   char* out) const {
+  if (!executor_ || count < 2 * kParallelLeafChunk) {
+    treehasher_.HashLeaves(data, count, out);
+    return;
+  }
+
+  const size_t digest_size(treehasher_.DigestSize());
+  const size_t chunks((count + kParallelLeafChunk - 1) / kParallelLeafChunk);
+  util::ParallelFor(executor_, chunks, [&](size_t i) {
+    // A hasher of its own, as |treehasher_| is locked while it hashes.
+    TreeHasher hasher(treehasher_.CreateSerialHasher());
+    const size_t begin(i * kParallelLeafChunk);
+    hasher.HashLeaves(data + begin,
+                      std::min(kParallelLeafChunk, count - begin),
+                      out + begin * digest_size);
+  });
 }
 
 size_t CompactMerkleTree::AddLeafHash(const string& hash) {
-  PushBack(0, hash);
+  assert(hash.size() == treehasher_.DigestSize());
+  PushBack(0, hash.data());
   // Update level count: a k-level tree can hold 2^{k-1} leaves,
   // so increment level count every time we overflow a power of two.
   // Do not update the root; we evaluate the tree lazily.
@@ -126,23 +210,71 @@ size_t CompactMerkleTree::AddLeafHash(const string& hash) {
   return leaf_count_;
 }
 
+size_t CompactMerkleTree::AddLeafHashes(const char* hashes, size_t count) {
+  const size_t node_size(NodeSize());
+  vector<char> nodes;
+  vector<char> parents;
+  while (count > 0) {
+    // The largest perfect subtree that starts at the next leaf and is
+    // covered by the new leaves. Subtrees are kept small enough that
+    // hashing them only takes bounded buffers; PushBack() merges them.
+    size_t level(0);
+    while (level < kParallelSubtreeLevel &&
+           leaf_count_ % (static_cast<size_t>(2) << level) == 0 &&
+           (static_cast<size_t>(2) << level) <= count)
+      ++level;
+    const size_t leaves(static_cast<size_t>(1) << level);
+
+    if (level == 0) {
+      PushBack(0, hashes);
+    } else {
+      // Hash each level of the subtree in turn, bouncing between two
+      // buffers.
+      nodes.resize(leaves / 2 * node_size);
+      treehasher_.HashChildrenBatch(hashes, leaves / 2, nodes.data());
+      for (size_t width = leaves / 2; width > 1; width /= 2) {
+        parents.resize(width / 2 * node_size);
+        treehasher_.HashChildrenBatch(nodes.data(), width / 2,
+                                      parents.data());
+        nodes.swap(parents);
+      }
+      PushBack(level, nodes.data());
+    }
+
+    leaf_count_ += leaves;
+    hashes += leaves * node_size;
+    count -= leaves;
+  }
+  // A k-level tree can hold 2^{k-1} leaves.
+  while (leaf_count_ > (static_cast<size_t>(1) << level_count_) >> 1)
+    ++level_count_;
+  return leaf_count_;
+}
+
 string CompactMerkleTree::CurrentRoot() {
   UpdateRoot();
   return root_;
 }
 
-void CompactMerkleTree::PushBack(size_t level, string node) {
-  assert(node.size() == treehasher_.DigestSize());
-  if (tree_.size() <= level) {
-    // First node at a new level.
-    tree_.push_back(node);
-  } else if (tree_[level].empty()) {
-    // Lone left sibling.
-    tree_[level] = node;
-  } else {
+void CompactMerkleTree::PushBack(size_t level, const char* node) {
+  const size_t node_size(NodeSize());
+  char parent[SerialHasher::kMaxDigestSize];
+  for (;; ++level) {
+    if (tree_.size() <= level) {
+      // First node at a new level.
+      tree_.resize(level);
+      tree_.emplace_back(node, node_size);
+      return;
+    } else if (tree_[level].empty()) {
+      // Lone left sibling. Cleared levels keep their storage, so this
+      // does not allocate.
+      tree_[level].assign(node, node_size);
+      return;
+    }
     // Left sibling waiting: hash together and propagate up.
-    PushBack(level + 1, treehasher_.HashChildren(tree_[level], node));
+    treehasher_.HashChildren(tree_[level].data(), node, parent);
     tree_[level].clear();
+    node = parent;
   }
 }
 
@@ -150,18 +282,23 @@ void CompactMerkleTree::UpdateRoot() {
   if (leaves_processed_ == LeafCount())
     return;
 
-  string right_sibling;
+  const size_t node_size(NodeSize());
+  char right_sibling[SerialHasher::kMaxDigestSize];
+  bool have_right_sibling(false);
 
   for (size_t level = 0; level < tree_.size(); ++level) {
     if (!tree_[level].empty()) {
       // A lonely left sibling gets pulled up as a right sibling.
-      if (right_sibling.empty())
-        right_sibling = tree_[level];
-      else
-        right_sibling = treehasher_.HashChildren(tree_[level], right_sibling);
+      if (!have_right_sibling) {
+        memcpy(right_sibling, tree_[level].data(), node_size);
+        have_right_sibling = true;
+      } else {
+        treehasher_.HashChildren(tree_[level].data(), right_sibling,
+                                 right_sibling);
+      }
     }
   }
 
-  root_ = right_sibling;
+  root_.assign(right_sibling, node_size);
   leaves_processed_ = LeafCount();
 }
@@ -12,6 +12,10 @@
 
 class SerialHasher;
 
+namespace util {
+class Executor;
+}  // namespace util
+
 // A memory-efficient version of Merkle Trees; like MerkleTree
 // (see merkletree/merkle_tree.h) but can only add new leaves and report
 // its current root (i.e., it cannot do paths, snapshots or consistency).
@@ -28,17 +32,40 @@ class CompactMerkleTree : public cert_trans::MerkleTreeInterface {
   explicit CompactMerkleTree(CompactMerkleTree&& other) = default;
 
   // Creates a new CompactMerkleTree based on the data present in the
-  // (non-compact) MerkleTree |model|.
+  // (non-compact) MerkleTree |model|. The part of |model| that has
+  // already been evaluated is copied from its frontier (see
+  // MerkleTree::Frontier()) without any hashing, so this is cheap for
+  // a model whose CurrentRoot() is up to date; the remaining leaves are
+  // added with AddLeafHashes().
   // Takes ownership of |hasher|, does not use |model| after the
   // construction.
-  // TODO(pphaneuf): This should take a const reference to the model,
-  // but implementation details currently make this too difficult.
   // TODO(pphaneuf): It should also get its |hasher| from |model|,
   // somehow.
+  CompactMerkleTree(const MerkleTree& model,
+                    std::unique_ptr<SerialHasher> hasher);
+
+  // Same as above, but evaluates |model| first.
   CompactMerkleTree(MerkleTree* model, std::unique_ptr<SerialHasher> hasher);
 
+  // Creates a tree of |leaf_count| leaves from its frontier, as returned
+  // by Frontier(), without any hashing. Only the shape of |frontier| is
+  // checked; whether it matches a given root is up to the caller.
+  CompactMerkleTree(size_t leaf_count, const std::vector<std::string>& frontier,
+                    std::unique_ptr<SerialHasher> hasher);
+
   virtual ~CompactMerkleTree();
 
+  // Hash large AddLeaves() batches in parallel on |executor|, which must
+  // outlive the tree (or be reset with nullptr first). The new leaves
+  // are split into aligned, power-of-two sized subtrees whose roots are
+  // computed concurrently, and then merged into the tree in order, so
+  // the results are identical to serial evaluation. Passing nullptr
+  // (the default) hashes everything on the calling thread. Large
+  // LeafHashes() batches are also hashed on |executor|.
+  void SetExecutor(util::Executor* executor) {
+    executor_ = executor;
+  }
+
   // Length of a node (i.e., a hash), in bytes.
   virtual size_t NodeSize() const {
     return treehasher_.DigestSize();
@@ -54,6 +81,18 @@ class CompactMerkleTree : public cert_trans::MerkleTreeInterface {
     return treehasher_.HashLeaf(data);
   }
 
+  // Return the leaf hashes, but do not append the data to the tree.
+  virtual std::vector<std::string> LeafHashes(
+      const std::vector<std::string>& data) const {
+    return treehasher_.HashLeaves(data);
+  }
+
+  // Writes the leaf hashes of the |count| leaves starting at |data|
+  // back to back starting at |out|, without appending them. Large
+  // batches are hashed in parallel, if there is an executor (see
+  // SetExecutor()).
+  void LeafHashes(const std::string* data, size_t count, char* out) const;
+
   // Number of levels. An empty tree has 0 levels, a tree with 1 leaf has
   // 1 level, a tree with 2 leaves has 2 levels, and a tree with n leaves has
   // ceil(log2(n)) + 1 levels.
@@ -61,6 +100,14 @@ class CompactMerkleTree : public cert_trans::MerkleTreeInterface {
     return level_count_;
   }
 
+  // The state of the tree, in the same form as MerkleTree::Frontier():
+  // for each level, the root of the rightmost perfect subtree of
+  // 2^level leaves if that bit of LeafCount() is set, and empty
+  // otherwise.
+  const std::vector<std::string>& Frontier() const {
+    return tree_;
+  }
+
   // Add a new leaf to the hash tree.
   //
   // (We update intermediate hashes as soon as a node becomes "fixed"
@@ -72,6 +119,14 @@ class CompactMerkleTree : public cert_trans::MerkleTreeInterface {
   // @param data Binary input blob
   virtual size_t AddLeaf(const std::string& data);
 
+  // Add new leaves to the hash tree, hashing them as a batch.
+  //
+  // Returns the position of the last leaf in the tree. Indexing starts
+  // at 1, so position = number of leaves in the tree after this update.
+  //
+  // @param data Binary input blobs
+  virtual size_t AddLeaves(const std::vector<std::string>& data);
+
   // Add a new leaf to the hash tree. It is the caller's responsibility
   // to ensure that the hash is correct.
   //
@@ -84,6 +139,15 @@ class CompactMerkleTree : public cert_trans::MerkleTreeInterface {
   // @param hash leaf hash
   virtual size_t AddLeafHash(const std::string& hash);
 
+  // Add |count| leaf hashes of NodeSize() bytes each, laid out back to
+  // back starting at |hashes|. Same as calling AddLeafHash() on each of
+  // them, but the leaves are folded into the tree a perfect subtree at a
+  // time, hashing each level of the subtree as a batch.
+  //
+  // Returns the position of the last leaf in the tree. Indexing starts
+  // at 1, so position = number of leaves in the tree after this update.
+  size_t AddLeafHashes(const char* hashes, size_t count);
+
   // Get the current root of the tree.
   // Update the root to reflect the current shape of the tree,
   // and return the tree digest.
@@ -93,8 +157,17 @@ class CompactMerkleTree : public cert_trans::MerkleTreeInterface {
   virtual std::string CurrentRoot();
 
  private:
-  // Append a node to the level.
-  void PushBack(size_t level, std::string node);
+  // Append a node (of NodeSize() bytes) to the level. Nodes can be
+  // pushed at a level above the leaves only if all the levels below it
+  // are empty, i.e., if |node| is the root of an aligned perfect subtree.
+  void PushBack(size_t level, const char* node);
+
+  // Add the leaves at [|begin|, |end|) of |data| to the tree, computing
+  // the roots of the aligned perfect subtrees they contain on
+  // |executor_|. Returns the number of leaves added, which may be zero
+  // if there are too few leaves to be worth it.
+  size_t AddLeavesInParallel(const std::vector<std::string>& data,
+                             size_t begin);
 
   void UpdateRoot();
   // Since the tree is append-only to the right, at any given point in time,
@@ -153,6 +226,8 @@ class CompactMerkleTree : public cert_trans::MerkleTreeInterface {
   size_t level_count_;
   // The root for |leaves_processed_| leaves.
   std::string root_;
+  // If not NULL, used to hash large batches of leaves in parallel.
+  util::Executor* executor_;
 };
 
 #endif  // CERT_TRANS_MERKLETREE_COMPACT_MERKLE_TREE_H_
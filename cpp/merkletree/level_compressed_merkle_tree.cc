@@ -0,0 +1,271 @@
+#include "merkletree/level_compressed_merkle_tree.h"
+
+#include <assert.h>
+#include <glog/logging.h>
+#include <algorithm>
+
+#include "merkletree/merkle_tree_math.h"
+#include "merkletree/serial_hasher.h"
+
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+
+LevelCompressedMerkleTree::LevelCompressedMerkleTree(
+    unique_ptr<SerialHasher> hasher, size_t dropped_levels,
+    const LeafHashReader& reader)
+    : treehasher_(hasher->Create()),
+      dropped_levels_(dropped_levels),
+      reader_(reader),
+      leaf_count_(0),
+      upper_(std::move(hasher)) {
+  CHECK_LT(dropped_levels_, 8 * sizeof(size_t));
+}
+
+
+string LevelCompressedMerkleTree::LeafHash(size_t leaf) const {
+  if (leaf == 0 || leaf > leaf_count_)
+    return string();
+  if (dropped_levels_ == 0)
+    return upper_.LeafHash(leaf);
+  return ReadLeafHashes(leaf - 1, 1);
+}
+
+
+string LevelCompressedMerkleTree::ReadLeafHashes(size_t start,
+                                                 size_t count) const {
+  CHECK_LE(start + count, leaf_count_);
+  const size_t node_size(NodeSize());
+  string hashes;
+  if (dropped_levels_ == 0) {
+    hashes.reserve(count * node_size);
+    for (size_t leaf = start + 1; leaf <= start + count; ++leaf)
+      hashes.append(upper_.LeafHash(leaf));
+    return hashes;
+  }
+
+  const size_t block_leaves(BlockLeafCount());
+  if (start < block_leaves) {
+    const size_t read(std::min(start + count, block_leaves) - start);
+    hashes = reader_(start, read);
+    CHECK_EQ(read * node_size, hashes.size())
+        << "Could not read leaf hashes " << start << " to "
+        << start + read - 1;
+  }
+  if (start + count > block_leaves) {
+    const size_t first(std::max(start, block_leaves));
+    hashes.append(tail_, (first - block_leaves) * node_size,
+                  (start + count - first) * node_size);
+  }
+  return hashes;
+}
+
+
+size_t LevelCompressedMerkleTree::AddLeafHash(const string& hash) {
+  CHECK_EQ(NodeSize(), hash.size());
+  ++leaf_count_;
+  if (dropped_levels_ == 0) {
+    upper_.AddLeafHash(hash);
+    return leaf_count_;
+  }
+
+  tail_.append(hash);
+  if (tail_.size() == BlockSize() * NodeSize()) {
+    upper_.AddLeafHash(PerfectSubtreeRoot(tail_.data(), BlockSize()));
+    tail_.clear();
+  }
+  return leaf_count_;
+}
+
+
+string LevelCompressedMerkleTree::CurrentRoot() {
+  const string upper_root(upper_.CurrentRoot());
+  if (leaf_count_ == BlockLeafCount())
+    return upper_root;
+  return RootAtSnapshot(leaf_count_);
+}
+
+
+vector<string> LevelCompressedMerkleTree::Frontier() const {
+  if (dropped_levels_ == 0)
+    return upper_.Frontier();
+  CHECK_EQ(upper_.LeafCount(), upper_.EvaluatedLeafCount())
+      << "Frontier of a tree that is not evaluated";
+
+  // The partial block splits into perfect subtrees, largest first, below
+  // those of the upper levels.
+  vector<string> frontier(dropped_levels_);
+  const size_t partial(leaf_count_ - BlockLeafCount());
+  size_t offset(0);
+  for (size_t level = dropped_levels_; level-- > 0;) {
+    if ((partial >> level) & 1) {
+      frontier[level] = PerfectSubtreeRoot(tail_.data() + offset * NodeSize(),
+                                           static_cast<size_t>(1) << level);
+      offset += static_cast<size_t>(1) << level;
+    }
+  }
+  for (const string& root : upper_.Frontier())
+    frontier.push_back(root);
+  while (!frontier.empty() && frontier.back().empty())
+    frontier.pop_back();
+  return frontier;
+}
+
+
+string LevelCompressedMerkleTree::RootAtSnapshot(size_t snapshot) {
+  if (dropped_levels_ == 0)
+    return upper_.RootAtSnapshot(snapshot);
+  if (snapshot > leaf_count_)
+    return string();
+  if (snapshot == 0)
+    return treehasher_.HashEmpty();
+  Evaluate();
+  Blocks blocks;
+  return SubtreeHash(0, snapshot, &blocks);
+}
+
+
+vector<string> LevelCompressedMerkleTree::RootsAtSnapshots(
+    const vector<size_t>& snapshots) {
+  if (dropped_levels_ == 0)
+    return upper_.RootsAtSnapshots(snapshots);
+  vector<string> roots;
+  roots.reserve(snapshots.size());
+  for (const size_t snapshot : snapshots)
+    roots.push_back(RootAtSnapshot(snapshot));
+  return roots;
+}
+
+
+vector<string> LevelCompressedMerkleTree::PathToRootAtSnapshot(
+    size_t leaf, size_t snapshot) {
+  if (dropped_levels_ == 0)
+    return upper_.PathToRootAtSnapshot(leaf, snapshot);
+  vector<string> path;
+  if (leaf == 0 || leaf > snapshot || snapshot > leaf_count_)
+    return path;
+  Evaluate();
+  Blocks blocks;
+  AppendPath(leaf - 1, 0, snapshot, &blocks, &path);
+  return path;
+}
+
+
+vector<string> LevelCompressedMerkleTree::SnapshotConsistency(
+    size_t snapshot1, size_t snapshot2) {
+  if (dropped_levels_ == 0)
+    return upper_.SnapshotConsistency(snapshot1, snapshot2);
+  vector<string> proof;
+  if (snapshot1 == 0 || snapshot1 >= snapshot2 || snapshot2 > leaf_count_)
+    return proof;
+  Evaluate();
+  Blocks blocks;
+  AppendSubproof(snapshot1, 0, snapshot2, true, &blocks, &proof);
+  return proof;
+}
+
+
+void LevelCompressedMerkleTree::Evaluate() {
+  if (upper_.EvaluatedLeafCount() < upper_.LeafCount())
+    upper_.CurrentRoot();
+}
+
+
+const string& LevelCompressedMerkleTree::BlockLeaves(size_t block,
+                                                     Blocks* blocks) const {
+  if (block == upper_.LeafCount())
+    return tail_;
+  assert(block < upper_.LeafCount());
+  const auto it(blocks->find(block));
+  if (it != blocks->end())
+    return it->second;
+
+  string* const leaves(&(*blocks)[block]);
+  *leaves = reader_(block << dropped_levels_, BlockSize());
+  CHECK_EQ(BlockSize() * NodeSize(), leaves->size())
+      << "Could not read the leaf hashes of block " << block;
+  return *leaves;
+}
+
+
+string LevelCompressedMerkleTree::PerfectSubtreeRoot(const char* leaves,
+                                                     size_t count) const {
+  const size_t node_size(NodeSize());
+  string nodes(leaves, count * node_size);
+  string parents;
+  for (; count > 1; count /= 2) {
+    parents.resize(count / 2 * node_size);
+    treehasher_.HashChildrenBatch(nodes.data(), count / 2, &parents[0]);
+    nodes.swap(parents);
+  }
+  return nodes;
+}
+
+
+string LevelCompressedMerkleTree::NodeHash(size_t level, size_t index,
+                                           Blocks* blocks) const {
+  assert(((index + 1) << level) <= leaf_count_);
+  if (level >= dropped_levels_)
+    return upper_.SubtreeRoot(level - dropped_levels_, index);
+
+  // A node of the dropped levels is within a single block.
+  const size_t first(index << level);
+  const size_t block(first >> dropped_levels_);
+  const size_t offset(first - (block << dropped_levels_));
+  return PerfectSubtreeRoot(
+      BlockLeaves(block, blocks).data() + offset * NodeSize(),
+      static_cast<size_t>(1) << level);
+}
+
+
+string LevelCompressedMerkleTree::SubtreeHash(size_t start, size_t size,
+                                              Blocks* blocks) const {
+  assert(size > 0);
+  const int level(MerkleTreeMath::Log2IfPowerOfTwo(size));
+  if (level >= 0) {
+    assert(start % size == 0);
+    return NodeHash(level, start >> level, blocks);
+  }
+  const size_t k(MerkleTreeMath::SplitPoint(size));
+  return treehasher_.HashChildren(SubtreeHash(start, k, blocks),
+                                  SubtreeHash(start + k, size - k, blocks));
+}
+
+
+// PATH(m, D[start:start + size]) from RFC 6962, section 2.1.1.
+void LevelCompressedMerkleTree::AppendPath(size_t leaf, size_t start,
+                                           size_t size, Blocks* blocks,
+                                           vector<string>* path) const {
+  if (size <= 1)
+    return;
+  const size_t k(MerkleTreeMath::SplitPoint(size));
+  if (leaf < k) {
+    AppendPath(leaf, start, k, blocks, path);
+    path->push_back(SubtreeHash(start + k, size - k, blocks));
+  } else {
+    AppendPath(leaf - k, start + k, size - k, blocks, path);
+    path->push_back(SubtreeHash(start, k, blocks));
+  }
+}
+
+
+// SUBPROOF(m, D[start:start + size], b) from RFC 6962, section 2.1.2.
+void LevelCompressedMerkleTree::AppendSubproof(size_t snapshot, size_t start,
+                                               size_t size, bool complete,
+                                               Blocks* blocks,
+                                               vector<string>* proof) const {
+  if (snapshot == size) {
+    if (!complete)
+      proof->push_back(SubtreeHash(start, size, blocks));
+    return;
+  }
+  const size_t k(MerkleTreeMath::SplitPoint(size));
+  if (snapshot <= k) {
+    AppendSubproof(snapshot, start, k, complete, blocks, proof);
+    proof->push_back(SubtreeHash(start + k, size - k, blocks));
+  } else {
+    AppendSubproof(snapshot - k, start + k, size - k, false, blocks, proof);
+    proof->push_back(SubtreeHash(start, k, blocks));
+  }
+}
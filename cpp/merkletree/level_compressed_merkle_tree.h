@@ -0,0 +1,159 @@
+#ifndef CERT_TRANS_MERKLETREE_LEVEL_COMPRESSED_MERKLE_TREE_H_
+#define CERT_TRANS_MERKLETREE_LEVEL_COMPRESSED_MERKLE_TREE_H_
+
+#include <stddef.h>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "merkletree/merkle_tree.h"
+#include "merkletree/tree_hasher.h"
+
+class SerialHasher;
+
+namespace util {
+class Executor;
+}  // namespace util
+
+// A Merkle tree (see merkletree/merkle_tree.h) that only keeps the nodes
+// of level |dropped_levels| and above in memory, and reads the leaf
+// hashes below them back from storage when it needs them.
+//
+// The leaves are grouped into blocks of 2^|dropped_levels|. Complete
+// blocks are only kept as their roots, which are the leaves of an
+// in-memory MerkleTree whose nodes are the upper levels of this tree,
+// while the leaf hashes of the partial block at the right edge are
+// kept as they are. A proof or root then takes the nodes of the upper
+// levels from memory, and the lower ones from the leaf hashes of at
+// most two blocks, which it reads once with the LeafHashReader. This
+// divides the memory of the tree by about 2^|dropped_levels|.
+//
+// This class is thread-compatible, but not thread-safe. Once
+// CurrentRoot() has evaluated the tree, the methods below which read
+// snapshots do not change it anymore, and can run concurrently if the
+// LeafHashReader can.
+class LevelCompressedMerkleTree {
+ public:
+  // Returns the |count| leaf hashes from the leaf at |start| (indexed
+  // from 0) on, back to back. Only asked for leaves already added to
+  // the tree, which it must return.
+  typedef std::function<std::string(size_t start, size_t count)>
+      LeafHashReader;
+
+  // With no |dropped_levels|, this is a plain MerkleTree, and |reader|
+  // is never called.
+  LevelCompressedMerkleTree(std::unique_ptr<SerialHasher> hasher,
+                            size_t dropped_levels,
+                            const LeafHashReader& reader);
+  LevelCompressedMerkleTree(const LevelCompressedMerkleTree&) = delete;
+  LevelCompressedMerkleTree& operator=(const LevelCompressedMerkleTree&) =
+      delete;
+
+  // See MerkleTree::SetExecutor(), for the upper levels.
+  void SetExecutor(util::Executor* executor) {
+    upper_.SetExecutor(executor);
+  }
+
+  size_t NodeSize() const {
+    return treehasher_.DigestSize();
+  }
+
+  size_t LeafCount() const {
+    return leaf_count_;
+  }
+
+  size_t DroppedLevels() const {
+    return dropped_levels_;
+  }
+
+  // Size in bytes of the memory allocated for the nodes.
+  size_t MemoryUsage() const {
+    return upper_.MemoryUsage() + tail_.capacity();
+  }
+
+  std::string LeafHash(const std::string& data) const {
+    return treehasher_.HashLeaf(data);
+  }
+
+  std::vector<std::string> LeafHashes(
+      const std::vector<std::string>& data) const {
+    return treehasher_.HashLeaves(data);
+  }
+
+  // The |leaf|th leaf hash in the tree, indexing from 1, or an empty
+  // string if there is none. Unless it is in the partial block, it is
+  // read with the LeafHashReader.
+  std::string LeafHash(size_t leaf) const;
+
+  // The |count| leaf hashes from the leaf at |start| (indexed from 0)
+  // on, back to back, which must all be in the tree. Those of complete
+  // blocks are read with the LeafHashReader in one call.
+  std::string ReadLeafHashes(size_t start, size_t count) const;
+
+  // Returns the position of the leaf, as MerkleTree::AddLeafHash().
+  // Completing a block hashes its root into the upper levels.
+  size_t AddLeafHash(const std::string& hash);
+
+  // Evaluates the tree, and returns its root.
+  std::string CurrentRoot();
+
+  // See MerkleTree::Frontier(), for the whole tree, which must have been
+  // evaluated by CurrentRoot().
+  std::vector<std::string> Frontier() const;
+
+  // The following behave like their MerkleTree equivalents.
+  std::string RootAtSnapshot(size_t snapshot);
+  std::vector<std::string> RootsAtSnapshots(
+      const std::vector<size_t>& snapshots);
+  std::vector<std::string> PathToRootAtSnapshot(size_t leaf, size_t snapshot);
+  std::vector<std::string> SnapshotConsistency(size_t snapshot1,
+                                               size_t snapshot2);
+
+ private:
+  // The leaf hashes of the complete blocks read for one proof or root,
+  // by block index.
+  typedef std::map<size_t, std::string> Blocks;
+
+  size_t BlockSize() const {
+    return static_cast<size_t>(1) << dropped_levels_;
+  }
+
+  // Number of leaves in the complete blocks.
+  size_t BlockLeafCount() const {
+    return upper_.LeafCount() << dropped_levels_;
+  }
+
+  // Evaluates the upper levels, if they are not yet.
+  void Evaluate();
+  // The leaf hashes of block |block|: |tail_| for the partial block,
+  // or those read in |blocks| (reading them first if needed).
+  const std::string& BlockLeaves(size_t block, Blocks* blocks) const;
+  // The root of the perfect subtree of the |count| (a power of two)
+  // leaf hashes at |leaves|.
+  std::string PerfectSubtreeRoot(const char* leaves, size_t count) const;
+
+  // As in TiledMerkleTree, the hash of the complete subtree at |level|
+  // and |index|, the hash of the |size| leaves starting at |start|, and
+  // RFC 6962 PATH and SUBPROOF. The upper levels must be evaluated.
+  std::string NodeHash(size_t level, size_t index, Blocks* blocks) const;
+  std::string SubtreeHash(size_t start, size_t size, Blocks* blocks) const;
+  void AppendPath(size_t leaf, size_t start, size_t size, Blocks* blocks,
+                  std::vector<std::string>* path) const;
+  void AppendSubproof(size_t snapshot, size_t start, size_t size,
+                      bool complete, Blocks* blocks,
+                      std::vector<std::string>* proof) const;
+
+  TreeHasher treehasher_;
+  const size_t dropped_levels_;
+  const LeafHashReader reader_;
+  size_t leaf_count_;
+  // The roots of the complete blocks are its leaves. With no dropped
+  // levels, these are the leaf hashes, and this is the whole tree.
+  MerkleTree upper_;
+  // The leaf hashes of the partial block, back to back.
+  std::string tail_;
+};
+
+#endif  // CERT_TRANS_MERKLETREE_LEVEL_COMPRESSED_MERKLE_TREE_H_
@@ -0,0 +1,142 @@
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+#include "merkletree/compact_merkle_tree.h"
+#include "merkletree/level_compressed_merkle_tree.h"
+#include "merkletree/merkle_tree.h"
+#include "merkletree/serial_hasher.h"
+#include "util/testing.h"
+
+namespace {
+
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+
+string Leaf(int i) {
+  return "leaf " + std::to_string(i);
+}
+
+
+class LevelCompressedMerkleTreeTest : public ::testing::Test {
+ protected:
+  LevelCompressedMerkleTreeTest() : reads_(0) {
+    Reset();
+  }
+
+  // Starts over with an empty reference tree.
+  void Reset() {
+    reference_.reset(
+        new MerkleTree(unique_ptr<Sha256Hasher>(new Sha256Hasher)));
+  }
+
+  unique_ptr<LevelCompressedMerkleTree> NewTree(size_t dropped_levels) {
+    return unique_ptr<LevelCompressedMerkleTree>(new LevelCompressedMerkleTree(
+        unique_ptr<Sha256Hasher>(new Sha256Hasher), dropped_levels,
+        [this](size_t start, size_t count) {
+          ++reads_;
+          string hashes;
+          for (size_t leaf = start + 1; leaf <= start + count; ++leaf)
+            hashes.append(reference_->LeafHash(leaf));
+          return hashes;
+        }));
+  }
+
+  void AddLeaves(int count, LevelCompressedMerkleTree* tree) {
+    for (int i = 0; i < count; ++i) {
+      const string leaf(Leaf(reference_->LeafCount()));
+      reference_->AddLeaf(leaf);
+      tree->AddLeafHash(reference_->LeafHash(reference_->LeafCount()));
+    }
+  }
+
+  unique_ptr<MerkleTree> reference_;
+  int reads_;
+};
+
+
+TEST_F(LevelCompressedMerkleTreeTest, MatchesMerkleTree) {
+  for (size_t dropped_levels = 0; dropped_levels <= 4; ++dropped_levels) {
+    Reset();
+    const unique_ptr<LevelCompressedMerkleTree> tree(NewTree(dropped_levels));
+    EXPECT_EQ(reference_->CurrentRoot(), tree->CurrentRoot());
+
+    // Cover partial and complete blocks of every size.
+    const size_t kSizes[] = {1, 2, 3, 7, 15, 16, 17, 32, 33, 100};
+    for (size_t size : kSizes) {
+      AddLeaves(size - tree->LeafCount(), tree.get());
+      ASSERT_EQ(size, tree->LeafCount());
+      EXPECT_EQ(reference_->CurrentRoot(), tree->CurrentRoot()) << size;
+
+      for (size_t snapshot = 1; snapshot <= size; ++snapshot) {
+        EXPECT_EQ(reference_->RootAtSnapshot(snapshot),
+                  tree->RootAtSnapshot(snapshot));
+        for (size_t leaf = 1; leaf <= snapshot; leaf += 3) {
+          EXPECT_EQ(reference_->PathToRootAtSnapshot(leaf, snapshot),
+                    tree->PathToRootAtSnapshot(leaf, snapshot))
+              << dropped_levels << " " << leaf << " " << snapshot;
+        }
+        EXPECT_EQ(reference_->SnapshotConsistency(snapshot, size),
+                  tree->SnapshotConsistency(snapshot, size))
+            << dropped_levels << " " << snapshot << " " << size;
+        EXPECT_EQ(reference_->LeafHash(snapshot), tree->LeafHash(snapshot));
+      }
+      EXPECT_EQ(reference_->RootsAtSnapshots({0, 1, size / 2, size}),
+                tree->RootsAtSnapshots({0, 1, size / 2, size}));
+
+      // The frontier makes the same compact tree.
+      CompactMerkleTree compact(size, tree->Frontier(),
+                                unique_ptr<Sha256Hasher>(new Sha256Hasher));
+      EXPECT_EQ(reference_->CurrentRoot(), compact.CurrentRoot());
+    }
+
+    // Out of range requests.
+    EXPECT_EQ(string(), tree->LeafHash(0));
+    EXPECT_EQ(string(), tree->LeafHash(101));
+    EXPECT_EQ(string(), tree->RootAtSnapshot(101));
+    EXPECT_TRUE(tree->PathToRootAtSnapshot(0, 10).empty());
+    EXPECT_TRUE(tree->PathToRootAtSnapshot(10, 9).empty());
+    EXPECT_TRUE(tree->SnapshotConsistency(10, 10).empty());
+    EXPECT_TRUE(tree->SnapshotConsistency(10, 101).empty());
+  }
+}
+
+
+TEST_F(LevelCompressedMerkleTreeTest, KeepsOnlyTheUpperLevels) {
+  const size_t kLeaves = 1 << 16;
+  const unique_ptr<LevelCompressedMerkleTree> plain(NewTree(0));
+  AddLeaves(kLeaves, plain.get());
+  plain->CurrentRoot();
+
+  const unique_ptr<LevelCompressedMerkleTree> tree(NewTree(8));
+  for (size_t leaf = 1; leaf <= kLeaves; ++leaf)
+    tree->AddLeafHash(reference_->LeafHash(leaf));
+  EXPECT_EQ(reference_->CurrentRoot(), tree->CurrentRoot());
+  EXPECT_GT(plain->MemoryUsage(), 8 * tree->MemoryUsage());
+  EXPECT_EQ(0, reads_);
+
+  // A proof reads the blocks it goes through, once.
+  EXPECT_EQ(reference_->PathToRootAtSnapshot(1000, 256 * 200),
+            tree->PathToRootAtSnapshot(1000, 256 * 200));
+  EXPECT_EQ(1, reads_);
+  reads_ = 0;
+  EXPECT_EQ(reference_->SnapshotConsistency(1000, 60000),
+            tree->SnapshotConsistency(1000, 60000));
+  EXPECT_EQ(2, reads_);
+
+  EXPECT_EQ(reference_->LeafHash(1000) + reference_->LeafHash(1001),
+            tree->ReadLeafHashes(999, 2));
+}
+
+
+}  // namespace
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
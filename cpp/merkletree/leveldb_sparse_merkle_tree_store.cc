@@ -0,0 +1,105 @@
+#include "merkletree/leveldb_sparse_merkle_tree_store.h"
+
+#include <glog/logging.h>
+#include <leveldb/write_batch.h>
+
+using std::pair;
+using std::string;
+using std::vector;
+
+namespace cert_trans {
+namespace {
+
+
+const char kNodePrefix[] = "node-";
+const char kRootKey[] = "root";
+const char kValuePrefix[] = "value-";
+
+// Most node lookups are for the siblings of the updated paths, which
+// often do not exist: a bloom filter saves reading the tables for them.
+const int kBloomFilterBitsPerKey = 10;
+
+
+// Big-endian, so that the nodes of a level are stored in order.
+string NodeKey(size_t depth, uint64_t index) {
+  string key(kNodePrefix);
+  key.push_back(static_cast<char>(depth >> 8));
+  key.push_back(static_cast<char>(depth));
+  for (int shift = 56; shift >= 0; shift -= 8) {
+    key.push_back(static_cast<char>(index >> shift));
+  }
+  return key;
+}
+
+
+}  // namespace
+
+
+LevelDBSparseMerkleTreeStore::LevelDBSparseMerkleTreeStore(
+    const string& dbfile)
+#ifdef HAVE_LEVELDB_FILTER_POLICY_H
+    : filter_policy_(
+          CHECK_NOTNULL(leveldb::NewBloomFilterPolicy(kBloomFilterBitsPerKey)))
+#endif
+{
+  LOG(INFO) << "Opening " << dbfile;
+  leveldb::Options options;
+  options.create_if_missing = true;
+#ifdef HAVE_LEVELDB_FILTER_POLICY_H
+  options.filter_policy = filter_policy_.get();
+#endif
+  leveldb::DB* db;
+  const leveldb::Status status(leveldb::DB::Open(options, dbfile, &db));
+  CHECK(status.ok()) << status.ToString();
+  db_.reset(db);
+}
+
+
+bool LevelDBSparseMerkleTreeStore::GetNode(size_t depth, uint64_t index,
+                                           string* data) {
+  return Get(NodeKey(depth, index), data);
+}
+
+
+bool LevelDBSparseMerkleTreeStore::GetRoot(string* root) {
+  return Get(kRootKey, root);
+}
+
+
+bool LevelDBSparseMerkleTreeStore::GetValue(const string& key,
+                                            string* value) {
+  return Get(kValuePrefix + key, value);
+}
+
+
+void LevelDBSparseMerkleTreeStore::Write(
+    const vector<Node>& nodes, const vector<pair<string, string>>& values,
+    const string& root) {
+  leveldb::WriteBatch batch;
+  for (const auto& node : nodes) {
+    batch.Put(NodeKey(node.depth, node.index), node.data);
+  }
+  for (const auto& value : values) {
+    batch.Put(kValuePrefix + value.first, value.second);
+  }
+  batch.Put(kRootKey, root);
+
+  const leveldb::Status status(db_->Write(leveldb::WriteOptions(), &batch));
+  CHECK(status.ok()) << "Failed to write " << nodes.size() << " nodes and "
+                     << values.size() << " values: " << status.ToString();
+}
+
+
+bool LevelDBSparseMerkleTreeStore::Get(const string& key, string* value) {
+  CHECK_NOTNULL(value);
+  const leveldb::Status status(
+      db_->Get(leveldb::ReadOptions(), key, value));
+  if (status.IsNotFound()) {
+    return false;
+  }
+  CHECK(status.ok()) << "Lookup failed: " << status.ToString();
+  return true;
+}
+
+
+}  // namespace cert_trans
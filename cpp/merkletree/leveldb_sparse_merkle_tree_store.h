@@ -0,0 +1,53 @@
+#ifndef CERT_TRANS_MERKLETREE_LEVELDB_SPARSE_MERKLE_TREE_STORE_H_
+#define CERT_TRANS_MERKLETREE_LEVELDB_SPARSE_MERKLE_TREE_STORE_H_
+
+#include "config.h"
+
+#include <leveldb/db.h>
+#ifdef HAVE_LEVELDB_FILTER_POLICY_H
+#include <leveldb/filter_policy.h>
+#endif
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "merkletree/sparse_merkle_tree.h"
+
+namespace cert_trans {
+
+
+// Keeps the nodes of a SparseMerkleTree (and the values of a
+// VerifiableMap) in a LevelDB database of their own.
+class LevelDBSparseMerkleTreeStore : public SparseMerkleTreeStore {
+ public:
+  // Opens (or creates) the database at |dbfile|.
+  explicit LevelDBSparseMerkleTreeStore(const std::string& dbfile);
+  LevelDBSparseMerkleTreeStore(const LevelDBSparseMerkleTreeStore&) = delete;
+  LevelDBSparseMerkleTreeStore& operator=(
+      const LevelDBSparseMerkleTreeStore&) = delete;
+
+  bool GetNode(size_t depth, uint64_t index, std::string* data) override;
+  bool GetRoot(std::string* root) override;
+  bool GetValue(const std::string& key, std::string* value) override;
+  void Write(const std::vector<Node>& nodes,
+             const std::vector<std::pair<std::string, std::string>>& values,
+             const std::string& root) override;
+
+ private:
+  bool Get(const std::string& key, std::string* value);
+
+#ifdef HAVE_LEVELDB_FILTER_POLICY_H
+  // filter_policy_ must be valid for at least as long as db_ is, so
+  // keep this order.
+  const std::unique_ptr<const leveldb::FilterPolicy> filter_policy_;
+#endif
+  std::unique_ptr<leveldb::DB> db_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_MERKLETREE_LEVELDB_SPARSE_MERKLE_TREE_STORE_H_
@@ -2,31 +2,70 @@
 
 #include <assert.h>
 #include <stddef.h>
+#include <string.h>
+#include <algorithm>
 #include <string>
 #include <vector>
 
 #include "merkletree/merkle_tree_math.h"
+#include "merkletree/serial_hasher.h"
+#include "util/parallel_for.h"
 
 using cert_trans::MerkleTreeInterface;
 using std::move;
 using std::string;
 using std::unique_ptr;
+using std::vector;
+
+namespace {
+
+// Levels with fewer new pairs of nodes than this are hashed serially,
+// even if there is an executor.
+const size_t kMinParallelPairs = 16 * NodeArena::kNodesPerChunk;
+
+// Number of nodes of a level hashed by each parallel work item. This is
+// a multiple of the node arena chunk size, so that work items cover
+// aligned subtrees and never share a chunk.
+const size_t kParallelNodesPerItem = 8 * NodeArena::kNodesPerChunk;
+
+// Batches of fewer roots than this are hashed serially, even if there
+// is an executor.
+const size_t kMinParallelRoots = 1024;
+
+// Number of roots hashed by each parallel work item.
+const size_t kParallelRootsPerItem = 256;
+
+}  // namespace
 
 MerkleTree::MerkleTree(unique_ptr<SerialHasher> hasher)
     : MerkleTreeInterface(),
       treehasher_(move(hasher)),
       leaves_processed_(0),
-      level_count_(0) {
+      level_count_(0),
+      executor_(nullptr) {
 }
 
 MerkleTree::~MerkleTree() {
 }
 
 size_t MerkleTree::AddLeaf(const string& data) {
-  return AddLeafHash(treehasher_.HashLeaf(data));
+  char hash[SerialHasher::kMaxDigestSize];
+  treehasher_.HashLeaf(data.data(), data.size(), hash);
+  return AppendLeafHash(hash);
+}
+
+size_t MerkleTree::AddLeaves(const std::vector<string>& data) {
+  for (const auto& hash : treehasher_.HashLeaves(data))
+    AddLeafHash(hash);
+  return LeafCount();
 }
 
 size_t MerkleTree::AddLeafHash(const string& hash) {
+  assert(hash.size() == treehasher_.DigestSize());
+  return AppendLeafHash(hash.data());
+}
+
+size_t MerkleTree::AppendLeafHash(const char* hash) {
   if (LazyLevelCount() == 0) {
     AddLevel();
     // The first leaf hash is also the first root.
@@ -47,6 +86,18 @@ string MerkleTree::CurrentRoot() {
   return RootAtSnapshot(LeafCount());
 }
 
+vector<string> MerkleTree::Frontier() const {
+  vector<string> frontier;
+  for (size_t level = 0; leaves_processed_ >> level != 0; ++level) {
+    if ((leaves_processed_ >> level) & 1) {
+      frontier.push_back(NodeString(level, (leaves_processed_ >> level) - 1));
+    } else {
+      frontier.push_back(string());
+    }
+  }
+  return frontier;
+}
+
 string MerkleTree::RootAtSnapshot(size_t snapshot) {
   if (snapshot == 0)
     return treehasher_.HashEmpty();
@@ -59,6 +110,44 @@ string MerkleTree::RootAtSnapshot(size_t snapshot) {
   return RecomputePastSnapshot(snapshot, 0, NULL);
 }
 
+vector<string> MerkleTree::RootsAtSnapshots(const vector<size_t>& snapshots) {
+  vector<string> roots(snapshots.size());
+  const size_t leaf_count(LeafCount());
+  size_t largest(0);
+  for (const size_t snapshot : snapshots) {
+    if (snapshot <= leaf_count) {
+      largest = std::max(largest, snapshot);
+    }
+  }
+  if (largest > leaves_processed_)
+    UpdateToSnapshot(largest);
+
+  // Only reads the tree, so the items can run concurrently, each with
+  // its own hasher.
+  const auto hash_roots = [this, &snapshots, &roots, leaf_count](
+      size_t begin, size_t end) {
+    TreeHasher hasher(treehasher_.CreateSerialHasher());
+    for (size_t i = begin; i < end; ++i) {
+      if (snapshots[i] == 0) {
+        roots[i] = treehasher_.HashEmpty();
+      } else if (snapshots[i] <= leaf_count) {
+        roots[i] = RootFromSubtrees(hasher, snapshots[i]);
+      }
+    }
+  };
+  if (!executor_ || snapshots.size() < kMinParallelRoots) {
+    hash_roots(0, snapshots.size());
+    return roots;
+  }
+  util::ParallelFor(executor_, (snapshots.size() + kParallelRootsPerItem - 1) /
+                                   kParallelRootsPerItem,
+                    [&snapshots, &hash_roots](size_t i) {
+    hash_roots(i * kParallelRootsPerItem,
+               std::min(snapshots.size(), (i + 1) * kParallelRootsPerItem));
+  });
+  return roots;
+}
+
 std::vector<string> MerkleTree::PathToCurrentRoot(size_t leaf) {
   return PathToRootAtSnapshot(leaf, LeafCount());
 }
@@ -96,7 +185,7 @@ std::vector<string> MerkleTree::SnapshotConsistency(size_t snapshot1,
 
   // Record the node, unless we already reached the root of snapshot1.
   if (node)
-    proof.push_back(Node(level, node));
+    proof.push_back(NodeString(level, node));
 
   // Now record the path from this node to the root of snapshot2.
   std::vector<string> path =
@@ -109,7 +198,7 @@ string MerkleTree::UpdateToSnapshot(size_t snapshot) {
   if (snapshot == 0)
     return treehasher_.HashEmpty();
   if (snapshot == 1)
-    return Node(0, 0);
+    return NodeString(0, 0);
   if (snapshot == leaves_processed_)
     return Root();
   assert(snapshot <= LeafCount());
@@ -121,6 +210,8 @@ string MerkleTree::UpdateToSnapshot(size_t snapshot) {
   size_t first_node = leaves_processed_;
   // Index of the last node.
   size_t last_node = snapshot - 1;
+  // Scratch space for the newly computed parents of a level.
+  std::vector<char> parents;
 
   // Process level-by-level until we converge to a single node.
   // (first_node, last_node) = (0, 0) means we have reached the root level.
@@ -136,9 +227,22 @@ string MerkleTree::UpdateToSnapshot(size_t snapshot) {
 
     // Compute the parents of new nodes at the current level.
     // Start with a left sibling and parse an even number of nodes.
-    for (size_t j = first_node & ~1; j < last_node; j += 2) {
-      PushBack(level + 1,
-               treehasher_.HashChildren(Node(level, j), Node(level, j + 1)));
+    // Sibling pairs never straddle a node arena chunk, so hash them in
+    // batches of up to a chunk's worth, reading them in place.
+    const size_t first_pair(first_node & ~1);
+    if (executor_ && (last_node + 1 - first_pair) / 2 >= kMinParallelPairs) {
+      HashLevelInParallel(level, first_pair, (last_node + 1 - first_pair) / 2);
+    } else {
+      for (size_t j = first_pair; j < last_node;) {
+        const size_t chunk_pairs(
+            (NodeArena::kNodesPerChunk - j % NodeArena::kNodesPerChunk) / 2);
+        const size_t pairs(std::min((last_node + 1 - j) / 2, chunk_pairs));
+        parents.resize(pairs * NodeSize());
+        treehasher_.HashChildrenBatch(Node(level, j), pairs, parents.data());
+        for (size_t i = 0; i < pairs; ++i)
+          PushBack(level + 1, parents.data() + i * NodeSize());
+        j += 2 * pairs;
+      }
     }
     // If the last node at the current level is a left sibling,
     // dummy-propagate it one level up.
@@ -154,6 +258,38 @@ string MerkleTree::UpdateToSnapshot(size_t snapshot) {
   return Root();
 }
 
+void MerkleTree::HashLevelInParallel(size_t level, size_t first,
+                                     size_t pairs) {
+  assert(first % 2 == 0);
+  assert(NodeCount(level + 1) == first / 2);
+  const size_t end(first + 2 * pairs);
+  tree_[level + 1].Grow(first / 2 + pairs);
+
+  // Each work item hashes the nodes of an aligned run at this level with
+  // its own TreeHasher, and writes their parents in place, so work
+  // items share nothing but the (read-only) nodes at this level.
+  const size_t first_item(first / kParallelNodesPerItem);
+  const size_t last_item((end - 1) / kParallelNodesPerItem);
+  util::ParallelFor(executor_, last_item - first_item + 1,
+                    [this, level, first, end, first_item](size_t i) {
+    const size_t item_begin(
+        std::max(first, (first_item + i) * kParallelNodesPerItem));
+    const size_t item_end(
+        std::min(end, (first_item + i + 1) * kParallelNodesPerItem));
+    TreeHasher hasher(treehasher_.CreateSerialHasher());
+    // HashChildrenBatch() needs its input to be contiguous, so go one
+    // node arena chunk at a time.
+    for (size_t j = item_begin; j < item_end;) {
+      const size_t chunk_end(
+          std::min(item_end, (j / NodeArena::kNodesPerChunk + 1) *
+                                 NodeArena::kNodesPerChunk));
+      hasher.HashChildrenBatch(Node(level, j), (chunk_end - j) / 2,
+                               tree_[level + 1].MutableNode(j / 2));
+      j = chunk_end;
+    }
+  });
+}
+
 string MerkleTree::RecomputePastSnapshot(size_t snapshot, size_t node_level,
                                          string* node) {
   size_t level = 0;
@@ -164,10 +300,10 @@ string MerkleTree::RecomputePastSnapshot(size_t snapshot, size_t node_level,
     // Nothing to recompute.
     if (node && LazyLevelCount() > node_level) {
       if (node_level > 0) {
-        node->assign(LastNode(node_level));
+        node->assign(LastNode(node_level), NodeSize());
       } else {
         // Leaf level: grab the last processed leaf.
-        node->assign(Node(node_level, last_node));
+        node->assign(Node(node_level, last_node), NodeSize());
       }
     }
     return Root();
@@ -178,7 +314,7 @@ string MerkleTree::RecomputePastSnapshot(size_t snapshot, size_t node_level,
   // Recompute nodes on the path of the last leaf.
   while (MerkleTreeMath::IsRightChild(last_node)) {
     if (node && node_level == level)
-      node->assign(Node(level, last_node));
+      node->assign(Node(level, last_node), NodeSize());
     // Left sibling and parent exist in the snapshot, and are equal to
     // those in the tree; no need to rehash, move one level up.
     last_node = MerkleTreeMath::Parent(last_node);
@@ -187,26 +323,44 @@ string MerkleTree::RecomputePastSnapshot(size_t snapshot, size_t node_level,
 
   // Now last_node is the index of a left sibling with no right sibling.
   // Record the node.
-  string subtree_root = Node(level, last_node);
+  char subtree_root[SerialHasher::kMaxDigestSize];
+  memcpy(subtree_root, Node(level, last_node), NodeSize());
 
   if (node && node_level == level)
-    node->assign(subtree_root);
+    node->assign(subtree_root, NodeSize());
 
   while (last_node) {
     if (MerkleTreeMath::IsRightChild(last_node)) {
       // Recompute the parent of tree_[level][last_node].
-      subtree_root =
-          treehasher_.HashChildren(Node(level, last_node - 1), subtree_root);
+      treehasher_.HashChildren(Node(level, last_node - 1), subtree_root,
+                               subtree_root);
     }
     // Else the parent is a dummy copy of the current node; do nothing.
 
     last_node = MerkleTreeMath::Parent(last_node);
     ++level;
     if (node && node_level == level)
-      node->assign(subtree_root);
+      node->assign(subtree_root, NodeSize());
   }
 
-  return subtree_root;
+  return string(subtree_root, NodeSize());
+}
+
+string MerkleTree::RootFromSubtrees(const TreeHasher& hasher,
+                                    size_t snapshot) const {
+  assert(snapshot > 0 && snapshot <= leaves_processed_);
+  // The lowest set bit of |snapshot| is the rightmost subtree, and each
+  // higher one a subtree to the left of the ones before.
+  size_t level = 0;
+  while (!((snapshot >> level) & 1))
+    ++level;
+  char root[SerialHasher::kMaxDigestSize];
+  memcpy(root, Node(level, (snapshot >> level) - 1), NodeSize());
+  for (++level; snapshot >> level != 0; ++level) {
+    if ((snapshot >> level) & 1)
+      hasher.HashChildren(Node(level, (snapshot >> level) - 1), root, root);
+  }
+  return string(root, NodeSize());
 }
 
 std::vector<string> MerkleTree::PathFromNodeToRootAtSnapshot(size_t node,
@@ -231,7 +385,7 @@ std::vector<string> MerkleTree::PathFromNodeToRootAtSnapshot(size_t node,
     if (sibling < last_node) {
       // The sibling is not the last node of the level in the snapshot
       // tree, so its value is correct in the tree.
-      path.push_back(Node(level, sibling));
+      path.emplace_back(Node(level, sibling), NodeSize());
     } else if (sibling == last_node) {
       // The sibling is the last node of the level in the snapshot tree,
       // so we get its value for the snapshot. Get the root in the same pass.
@@ -250,40 +404,43 @@ std::vector<string> MerkleTree::PathFromNodeToRootAtSnapshot(size_t node,
   return path;
 }
 
-string MerkleTree::Node(size_t level, size_t index) const {
+const char* MerkleTree::Node(size_t level, size_t index) const {
   assert(NodeCount(level) > index);
-  return tree_[level].substr(index * treehasher_.DigestSize(),
-                             treehasher_.DigestSize());
+  return tree_[level].Node(index);
 }
 
 string MerkleTree::Root() const {
-  assert(tree_.back().size() == treehasher_.DigestSize());
-  return tree_.back();
+  assert(tree_.back().size() == 1U);
+  return string(tree_.back().Node(0), NodeSize());
 }
 
 size_t MerkleTree::NodeCount(size_t level) const {
   assert(LazyLevelCount() > level);
-  return tree_[level].size() / treehasher_.DigestSize();
+  return tree_[level].size();
 }
 
-string MerkleTree::LastNode(size_t level) const {
+const char* MerkleTree::LastNode(size_t level) const {
   assert(NodeCount(level) >= 1U);
-  return tree_[level].substr(tree_[level].size() - treehasher_.DigestSize());
+  return tree_[level].LastNode();
 }
 
 void MerkleTree::PopBack(size_t level) {
   assert(NodeCount(level) >= 1U);
-  tree_[level].erase(tree_[level].size() - treehasher_.DigestSize());
+  tree_[level].PopBack();
 }
 
-void MerkleTree::PushBack(size_t level, string node) {
-  assert(node.size() == treehasher_.DigestSize());
+void MerkleTree::PushBack(size_t level, const char* node) {
   assert(LazyLevelCount() > level);
-  tree_[level].append(node);
+  tree_[level].PushBack(node);
+}
+
+void MerkleTree::PushBack(size_t level, const string& node) {
+  assert(node.size() == treehasher_.DigestSize());
+  PushBack(level, node.data());
 }
 
 void MerkleTree::AddLevel() {
-  tree_.push_back(string());
+  tree_.emplace_back(treehasher_.DigestSize());
 }
 
 size_t MerkleTree::LazyLevelCount() const {
@@ -1,16 +1,22 @@
 #ifndef CERT_TRANS_MERKLETREE_MERKLE_TREE_H_
 #define CERT_TRANS_MERKLETREE_MERKLE_TREE_H_
 
+#include <assert.h>
 #include <stddef.h>
 #include <memory>
 #include <string>
 #include <vector>
 
 #include "merkletree/merkle_tree_interface.h"
+#include "merkletree/node_arena.h"
 #include "merkletree/tree_hasher.h"
 
 class SerialHasher;
 
+namespace util {
+class Executor;
+}  // namespace util
+
 // Class for manipulating Merkle Hash Trees, as specified in the
 // Certificate Transparency specificationdoc/sunlight.xml
 // Implement binary Merkle Hash Trees, using an arbitrary hash function
@@ -27,6 +33,15 @@ class MerkleTree : public cert_trans::MerkleTreeInterface {
   explicit MerkleTree(std::unique_ptr<SerialHasher> hasher);
   virtual ~MerkleTree();
 
+  // Evaluate large updates of the tree in parallel on |executor|, which
+  // must outlive the tree (or be reset with nullptr first). The results
+  // are identical to serial evaluation; only the nodes of the lower
+  // levels are hashed concurrently. Passing nullptr (the default)
+  // evaluates the tree on the calling thread only.
+  void SetExecutor(util::Executor* executor) {
+    executor_ = executor;
+  }
+
   // Length of a node (i.e., a hash), in bytes.
   virtual size_t NodeSize() const {
     return treehasher_.DigestSize();
@@ -37,11 +52,20 @@ class MerkleTree : public cert_trans::MerkleTreeInterface {
     return tree_.empty() ? 0 : NodeCount(0);
   }
 
+  // Size in bytes of the memory allocated for the nodes.
+  size_t MemoryUsage() const {
+    size_t usage(0);
+    for (const NodeArena& level : tree_) {
+      usage += level.AllocatedBytes();
+    }
+    return usage;
+  }
+
   // The |leaf|th leaf hash in the tree. Indexing starts from 1.
   std::string LeafHash(size_t leaf) const {
     if (leaf == 0 || leaf > LeafCount())
       return std::string();
-    return Node(0, leaf - 1);
+    return NodeString(0, leaf - 1);
   }
 
   // Return the leaf hash, but do not append the data to the tree.
@@ -49,6 +73,12 @@ class MerkleTree : public cert_trans::MerkleTreeInterface {
     return treehasher_.HashLeaf(data);
   }
 
+  // Return the leaf hashes, but do not append the data to the tree.
+  virtual std::vector<std::string> LeafHashes(
+      const std::vector<std::string>& data) const {
+    return treehasher_.HashLeaves(data);
+  }
+
   // Number of levels. An empty tree has 0 levels, a tree with 1 leaf has
   // 1 level, a tree with 2 leaves has 2 levels, and a tree with n leaves has
   // ceil(log2(n)) + 1 levels.
@@ -67,6 +97,14 @@ class MerkleTree : public cert_trans::MerkleTreeInterface {
   // @param data Binary input blob
   virtual size_t AddLeaf(const std::string& data);
 
+  // Add new leaves to the hash tree, hashing them as a batch.
+  //
+  // Returns the position of the last leaf in the tree. Indexing starts
+  // at 1, so position = number of leaves in the tree after this update.
+  //
+  // @param data Binary input blobs
+  virtual size_t AddLeaves(const std::vector<std::string>& data);
+
   // Add a new leaf to the hash tree. Stores the provided hash in the
   // tree structure.  It is the caller's responsibility to ensure that
   // the hash is correct.
@@ -87,6 +125,28 @@ class MerkleTree : public cert_trans::MerkleTreeInterface {
   // (and hence, no root).
   virtual std::string CurrentRoot();
 
+  // Number of leaves the intermediate nodes have been computed for
+  // (the tree is evaluated lazily). Equal to LeafCount() after
+  // CurrentRoot().
+  size_t EvaluatedLeafCount() const {
+    return leaves_processed_;
+  }
+
+  // The roots of the perfect subtrees the first EvaluatedLeafCount()
+  // leaves split into, indexed by level: entry |level| is the root of a
+  // subtree of 2^|level| leaves if that bit of EvaluatedLeafCount() is
+  // set, and empty otherwise. This is the state of a CompactMerkleTree
+  // of that size, and is read without hashing anything.
+  std::vector<std::string> Frontier() const;
+
+  // The root of the perfect subtree of 2^|level| leaves at |index| in
+  // that level, which must be within the first EvaluatedLeafCount()
+  // leaves. Read from the tree without hashing anything.
+  std::string SubtreeRoot(size_t level, size_t index) const {
+    assert(((index + 1) << level) <= leaves_processed_);
+    return NodeString(level, index);
+  }
+
   // Get the root of the tree for a previous snapshot,
   // where snapshot 0 is an empty tree, snapshot 1 is the tree with
   // 1 leaf, etc.
@@ -97,6 +157,15 @@ class MerkleTree : public cert_trans::MerkleTreeInterface {
   // @param snapshot point in time (= number of leaves at that point).
   std::string RootAtSnapshot(size_t snapshot);
 
+  // RootAtSnapshot() for each of |snapshots|, in the same order. The
+  // tree is brought up to date once for all of them, and each root is
+  // hashed from the roots of the perfect subtrees its snapshot splits
+  // into, which the tree already has, so a long history of snapshots
+  // costs a few hashes each. With an executor, a large batch is split
+  // over it.
+  std::vector<std::string> RootsAtSnapshots(
+      const std::vector<size_t>& snapshots);
+
   // Get the Merkle path from leaf to root.
   //
   // Returns a vector of node hashes, ordered by levels from leaf to root.
@@ -131,13 +200,24 @@ class MerkleTree : public cert_trans::MerkleTreeInterface {
                                                size_t snapshot2);
 
  private:
+  // AddLeafHash() for the NodeSize() bytes at |hash|.
+  size_t AppendLeafHash(const char* hash);
   // Update to a given snapshot, return the root.
   std::string UpdateToSnapshot(size_t snapshot);
+  // Append to level |level| + 1 the parents of the |pairs| pairs of
+  // nodes of level |level| starting at index |first| (which is even),
+  // hashing them on |executor_|.
+  void HashLevelInParallel(size_t level, size_t first, size_t pairs);
   // Return the root of a past snapshot.
   // If node is not NULL, additionally record the rightmost node
   // for the given snapshot and node_level.
   std::string RecomputePastSnapshot(size_t snapshot, size_t node_level,
                                     std::string* node);
+  // Return the root of |snapshot|, which must be in (0,
+  // EvaluatedLeafCount()], from the roots of its perfect subtrees,
+  // right to left, hashing with |hasher|.
+  std::string RootFromSubtrees(const TreeHasher& hasher,
+                               size_t snapshot) const;
   // Path from a node at a given level (both indexed starting with 0)
   // to the root at a given snapshot.
   std::vector<std::string> PathFromNodeToRootAtSnapshot(size_t node_index,
@@ -145,7 +225,14 @@ class MerkleTree : public cert_trans::MerkleTreeInterface {
                                                         size_t snapshot);
   // Get the |index|-th node at level |level|. Indexing starts at 0;
   // caller is responsible for ensuring tree is sufficiently up to date.
-  std::string Node(size_t level, size_t index) const;
+  // The returned pointer refers to NodeSize() bytes stored in place in
+  // the tree, and remains valid until the node is popped.
+  const char* Node(size_t level, size_t index) const;
+
+  // Same as Node(), but returns a copy of the node.
+  std::string NodeString(size_t level, size_t index) const {
+    return std::string(Node(level, index), NodeSize());
+  }
 
   // Get the current root (of the lazily evaluated tree).
   // Caller is responsible for keeping track of the lazy evaluation status.
@@ -156,13 +243,15 @@ class MerkleTree : public cert_trans::MerkleTreeInterface {
   size_t NodeCount(size_t level) const;
 
   // Last node of the given level.
-  std::string LastNode(size_t level) const;
+  const char* LastNode(size_t level) const;
 
   // Pop the last node of the level.
   void PopBack(size_t level);
 
-  // Append a node to the level.
-  void PushBack(size_t level, std::string node);
+  // Append a node to the level, copying NodeSize() bytes from |node|.
+  // |node| may point into another level of the tree.
+  void PushBack(size_t level, const char* node);
+  void PushBack(size_t level, const std::string& node);
 
   // Start a new level.
   void AddLevel();
@@ -171,6 +260,8 @@ class MerkleTree : public cert_trans::MerkleTreeInterface {
   size_t LazyLevelCount() const;
   // A container for nodes, organized according to levels and sorted
   // left-to-right in each level. tree_[0] is the leaf level, etc.
+  // Each level is a NodeArena of fixed-size hashes, so nodes have stable
+  // addresses and can be read in place.
   // The hash of nodes tree_[i][j] and tree_[i][j+1] (j even) is stored
   // at tree_[i+1][j/2]. When tree_[i][j] is the last node of the level with
   // no right sibling, we store its dummy copy: tree_[i+1][j/2] = tree_[i][j].
@@ -200,13 +291,15 @@ class MerkleTree : public cert_trans::MerkleTreeInterface {
   // Since the tree is append-only from the right, at any given point in time,
   // at each level, all nodes computed so far, except possibly the last node,
   // are fixed and will no longer change.
-  std::vector<std::string> tree_;
+  std::vector<NodeArena> tree_;
   TreeHasher treehasher_;
   // Number of leaves propagated up to the root,
   // to keep track of lazy evaluation.
   size_t leaves_processed_;
   // The "true" level count for a fully evaluated tree.
   size_t level_count_;
+  // If not NULL, used to evaluate large updates in parallel.
+  util::Executor* executor_;
 };
 
 #endif  // CERT_TRANS_MERKLETREE_MERKLE_TREE_H_
@@ -0,0 +1,315 @@
+// Benchmarks for the Merkle tree classes. Run with --help for the
+// options of the benchmark library, e.g. --benchmark_filter=<regex>.
+//
+// Besides the time per operation, most benchmarks report as "bytes/op"
+// the number of bytes each operation hashes (the leaf data, or the nodes
+// of a proof).
+#include <benchmark/benchmark.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "merkletree/compact_merkle_tree.h"
+#include "merkletree/merkle_tree.h"
+#include "merkletree/merkle_verifier.h"
+#include "merkletree/serial_hasher.h"
+#include "merkletree/sparse_merkle_tree.h"
+#include "merkletree/tree_hasher.h"
+#include "util/thread_pool.h"
+
+using std::map;
+using std::pair;
+using std::string;
+using std::to_string;
+using std::unique_ptr;
+using std::vector;
+
+namespace {
+
+
+// Typical size of a serialized leaf (an X.509 certificate entry).
+const size_t kLeafSize = 1024;
+
+
+unique_ptr<SerialHasher> NewSha256Hasher() {
+  return unique_ptr<SerialHasher>(new Sha256Hasher);
+}
+
+
+string Leaf(size_t i) {
+  string leaf(to_string(i));
+  leaf.resize(kLeafSize, 0x42);
+  return leaf;
+}
+
+
+void SetBytesPerOp(benchmark::State* state, size_t bytes) {
+  state->counters["bytes/op"] = bytes;
+  state->SetBytesProcessed(state->iterations() * bytes);
+}
+
+
+// Fully evaluated trees of |size| leaves, built once and shared by the
+// benchmarks that only read them.
+MerkleTree* EvaluatedTree(size_t size) {
+  static map<size_t, unique_ptr<MerkleTree>>* const trees(
+      new map<size_t, unique_ptr<MerkleTree>>);
+  unique_ptr<MerkleTree>& tree((*trees)[size]);
+  if (!tree) {
+    tree.reset(new MerkleTree(NewSha256Hasher()));
+    for (size_t i = 0; i < size; ++i)
+      tree->AddLeaf(Leaf(i));
+    tree->CurrentRoot();
+  }
+  return tree.get();
+}
+
+
+// Appends leaves to an ever growing tree, without evaluating it.
+void BM_MerkleTreeAddLeaf(benchmark::State& state) {
+  MerkleTree tree(NewSha256Hasher());
+  const string leaf(Leaf(0));
+  for (auto _ : state)
+    tree.AddLeaf(leaf);
+  SetBytesPerOp(&state, kLeafSize);
+}
+BENCHMARK(BM_MerkleTreeAddLeaf);
+
+
+// Appends a leaf to a tree of state.range(0) leaves and evaluates the
+// new root.
+void BM_MerkleTreeCurrentRoot(benchmark::State& state) {
+  MerkleTree tree(NewSha256Hasher());
+  for (int64_t i = 0; i < state.range(0); ++i)
+    tree.AddLeaf(Leaf(i));
+  tree.CurrentRoot();
+
+  const string leaf(Leaf(0));
+  for (auto _ : state) {
+    tree.AddLeaf(leaf);
+    benchmark::DoNotOptimize(tree.CurrentRoot());
+  }
+  SetBytesPerOp(&state, kLeafSize);
+}
+BENCHMARK(BM_MerkleTreeCurrentRoot)->Range(1 << 10, 1 << 20);
+
+
+void BM_MerkleTreePathToCurrentRoot(benchmark::State& state) {
+  MerkleTree* const tree(EvaluatedTree(state.range(0)));
+  size_t leaf(0);
+  size_t bytes(0);
+  for (auto _ : state) {
+    // Walk the leaves with a stride coprime to the tree size.
+    leaf = (leaf + 7919) % tree->LeafCount();
+    const vector<string> path(tree->PathToCurrentRoot(leaf + 1));
+    bytes = path.size() * tree->NodeSize();
+    benchmark::DoNotOptimize(path.data());
+  }
+  SetBytesPerOp(&state, bytes);
+}
+BENCHMARK(BM_MerkleTreePathToCurrentRoot)->Range(1 << 10, 1 << 20);
+
+
+void BM_MerkleTreeSnapshotConsistency(benchmark::State& state) {
+  MerkleTree* const tree(EvaluatedTree(state.range(0)));
+  size_t snapshot(0);
+  size_t bytes(0);
+  for (auto _ : state) {
+    snapshot = (snapshot + 7919) % tree->LeafCount();
+    const vector<string> proof(
+        tree->SnapshotConsistency(snapshot + 1, tree->LeafCount()));
+    bytes = proof.size() * tree->NodeSize();
+    benchmark::DoNotOptimize(proof.data());
+  }
+  SetBytesPerOp(&state, bytes);
+}
+BENCHMARK(BM_MerkleTreeSnapshotConsistency)->Range(1 << 10, 1 << 20);
+
+
+// Verifies state.range(0) paths to the root of a tree of 1 << 20
+// leaves, one at a time if state.range(1) is 0, or in one batch.
+void BM_MerkleVerifierVerifyPaths(benchmark::State& state) {
+  MerkleTree* const tree(EvaluatedTree(1 << 20));
+  const string root(tree->CurrentRoot());
+  vector<MerkleVerifier::PathToVerify> paths;
+  size_t leaf(0);
+  for (int64_t i = 0; i < state.range(0); ++i) {
+    leaf = (leaf + 7919) % tree->LeafCount();
+    paths.push_back(MerkleVerifier::PathToVerify{
+        leaf + 1, tree->PathToCurrentRoot(leaf + 1), Leaf(leaf)});
+  }
+
+  MerkleVerifier verifier(NewSha256Hasher());
+  for (auto _ : state) {
+    if (state.range(1)) {
+      benchmark::DoNotOptimize(
+          verifier.VerifyPaths(tree->LeafCount(), root, paths));
+    } else {
+      for (const auto& path : paths)
+        benchmark::DoNotOptimize(verifier.VerifyPath(
+            path.leaf, tree->LeafCount(), path.path, root, path.data));
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_MerkleVerifierVerifyPaths)
+    ->Args({1024, 0})
+    ->Args({1024, 1})
+    ->Args({65536, 0})
+    ->Args({65536, 1});
+
+
+// Appends a leaf to an ever growing compact tree, and evaluates its
+// root every state.range(0) leaves.
+void BM_CompactMerkleTreeAddLeaf(benchmark::State& state) {
+  CompactMerkleTree tree(NewSha256Hasher());
+  const string leaf(Leaf(0));
+  int64_t i(0);
+  for (auto _ : state) {
+    tree.AddLeaf(leaf);
+    if (++i % state.range(0) == 0)
+      benchmark::DoNotOptimize(tree.CurrentRoot());
+  }
+  SetBytesPerOp(&state, kLeafSize);
+}
+BENCHMARK(BM_CompactMerkleTreeAddLeaf)->Arg(1)->Arg(1024);
+
+
+// Appends batches of state.range(0) leaf hashes to a compact tree.
+void BM_CompactMerkleTreeAddLeafHashes(benchmark::State& state) {
+  CompactMerkleTree tree(NewSha256Hasher());
+  string hashes;
+  for (int64_t i = 0; i < state.range(0); ++i)
+    hashes.append(tree.LeafHash(Leaf(i)));
+  for (auto _ : state) {
+    tree.AddLeafHashes(hashes.data(), state.range(0));
+    benchmark::DoNotOptimize(tree.CurrentRoot());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+  SetBytesPerOp(&state, hashes.size());
+}
+BENCHMARK(BM_CompactMerkleTreeAddLeafHashes)->Range(1, 1 << 16);
+
+
+// Builds a compact tree from a fully evaluated tree of state.range(0)
+// leaves.
+void BM_CompactMerkleTreeFromMerkleTree(benchmark::State& state) {
+  const MerkleTree& model(*EvaluatedTree(state.range(0)));
+  for (auto _ : state) {
+    CompactMerkleTree tree(model, NewSha256Hasher());
+    benchmark::DoNotOptimize(tree.CurrentRoot());
+  }
+}
+BENCHMARK(BM_CompactMerkleTreeFromMerkleTree)->Range(1 << 10, 1 << 20);
+
+
+// Sets leaves at pseudo-random paths in a sparse tree that already has
+// state.range(0) leaves, and evaluates the new root.
+void BM_SparseMerkleTreeSetLeaf(benchmark::State& state) {
+  SparseMerkleTree tree(new Sha256Hasher);
+  Sha256Hasher path_hasher;
+  const auto path_for([&path_hasher](int64_t i) {
+    path_hasher.Reset();
+    path_hasher.Update(to_string(i));
+    return PathFromBytes(path_hasher.Final());
+  });
+  for (int64_t i = 0; i < state.range(0); ++i)
+    tree.SetLeaf(path_for(i), Leaf(i));
+  tree.CurrentRoot();
+
+  const string leaf(Leaf(0));
+  int64_t i(state.range(0));
+  for (auto _ : state) {
+    tree.SetLeaf(path_for(i++), leaf);
+    benchmark::DoNotOptimize(tree.CurrentRoot());
+  }
+  SetBytesPerOp(&state, kLeafSize);
+}
+BENCHMARK(BM_SparseMerkleTreeSetLeaf)->Range(1 << 8, 1 << 14);
+
+
+// Sets batches of state.range(0) leaves at pseudo-random paths in a
+// sparse tree, and evaluates the new root, on state.range(1) threads
+// (0 for the calling thread only).
+void BM_SparseMerkleTreeSetLeaves(benchmark::State& state) {
+  unique_ptr<cert_trans::ThreadPool> pool;
+  SparseMerkleTree tree(new Sha256Hasher);
+  if (state.range(1) > 0) {
+    pool.reset(new cert_trans::ThreadPool(state.range(1)));
+    tree.SetExecutor(pool.get());
+  }
+  Sha256Hasher path_hasher;
+  const string leaf(Leaf(0));
+  int64_t i(0);
+  for (auto _ : state) {
+    vector<pair<SparseMerkleTree::Path, string>> leaves;
+    for (int64_t j = 0; j < state.range(0); ++j) {
+      path_hasher.Reset();
+      path_hasher.Update(to_string(i++));
+      leaves.emplace_back(PathFromBytes(path_hasher.Final()), leaf);
+    }
+    tree.SetLeaves(leaves);
+    benchmark::DoNotOptimize(tree.CurrentRoot());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+  SetBytesPerOp(&state, state.range(0) * kLeafSize);
+}
+BENCHMARK(BM_SparseMerkleTreeSetLeaves)
+    ->Args({1024, 0})
+    ->Args({1024, 4})
+    ->Args({16384, 0})
+    ->Args({16384, 4});
+
+
+void BM_TreeHasherHashLeaf(benchmark::State& state) {
+  TreeHasher hasher(NewSha256Hasher());
+  const string data(state.range(0), 0x42);
+  for (auto _ : state)
+    benchmark::DoNotOptimize(hasher.HashLeaf(data));
+  SetBytesPerOp(&state, data.size());
+}
+BENCHMARK(BM_TreeHasherHashLeaf)->Range(32, 4096);
+
+
+void BM_TreeHasherHashChildren(benchmark::State& state) {
+  TreeHasher hasher(NewSha256Hasher());
+  const string left(hasher.HashLeaf("left"));
+  const string right(hasher.HashLeaf("right"));
+  for (auto _ : state)
+    benchmark::DoNotOptimize(hasher.HashChildren(left, right));
+  SetBytesPerOp(&state, left.size() + right.size());
+}
+BENCHMARK(BM_TreeHasherHashChildren);
+
+
+// Hashes state.range(0) pairs of children at once.
+void BM_TreeHasherHashChildrenBatch(benchmark::State& state) {
+  TreeHasher hasher(NewSha256Hasher());
+  const size_t digest_size(hasher.DigestSize());
+  const vector<char> nodes(2 * state.range(0) * digest_size, 0x42);
+  vector<char> parents(state.range(0) * digest_size);
+  for (auto _ : state) {
+    hasher.HashChildrenBatch(nodes.data(), state.range(0), parents.data());
+    benchmark::DoNotOptimize(parents.data());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+  SetBytesPerOp(&state, nodes.size());
+}
+BENCHMARK(BM_TreeHasherHashChildrenBatch)->Range(1, 1024);
+
+
+}  // namespace
+
+
+int main(int argc, char** argv) {
+  benchmark::Initialize(&argc, argv);
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  benchmark::RunSpecifiedBenchmarks();
+  return 0;
+}
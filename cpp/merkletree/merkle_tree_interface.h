@@ -6,6 +6,7 @@
 
 #include <stddef.h>
 #include <string>
+#include <vector>
 
 namespace cert_trans {
 
@@ -27,6 +28,12 @@ class MerkleTreeInterface {
   // Returns the leaf hash, but do not append the data to the tree.
   virtual std::string LeafHash(const std::string& data) const = 0;
 
+  // Returns the leaf hashes of |data|, in the same order, but do not
+  // append the data to the tree. Faster than calling LeafHash() for
+  // each element.
+  virtual std::vector<std::string> LeafHashes(
+      const std::vector<std::string>& data) const = 0;
+
   // Number of levels. An empty tree has 0 levels, a tree with 1 leaf has
   // 1 level, a tree with 2 leaves has 2 levels, and a tree with n leaves has
   // ceil(log2(n)) + 1 levels.
@@ -40,6 +47,15 @@ class MerkleTreeInterface {
   // @param data Binary input blob
   virtual size_t AddLeaf(const std::string& data) = 0;
 
+  // Add new leaves to the hash tree, in order. Equivalent to calling
+  // AddLeaf() for each element of |data|, but faster.
+  //
+  // Returns the position of the last leaf in the tree (i.e., the number
+  // of leaves in the tree after this update).
+  //
+  // @param data Binary input blobs
+  virtual size_t AddLeaves(const std::vector<std::string>& data) = 0;
+
   // Add a new leaf to the hash tree. It is the caller's responsibility
   // to ensure that the hash is correct.
   //
@@ -1,5 +1,6 @@
 #include "merkletree/merkle_tree_math.h"
 
+#include <assert.h>
 #include <stddef.h>
 
 // static
@@ -27,3 +28,22 @@ bool MerkleTreeMath::IsRightChild(size_t leaf) {
 size_t MerkleTreeMath::Sibling(size_t leaf) {
   return IsRightChild(leaf) ? (leaf - 1) : (leaf + 1);
 }
+
+// static
+size_t MerkleTreeMath::SplitPoint(size_t n) {
+  assert(n > 1);
+  size_t k(1);
+  while (k << 1 < n)
+    k <<= 1;
+  return k;
+}
+
+// static
+int MerkleTreeMath::Log2IfPowerOfTwo(size_t n) {
+  if (n == 0 || (n & (n - 1)) != 0)
+    return -1;
+  int log(0);
+  while ((static_cast<size_t>(1) << log) < n)
+    ++log;
+  return log;
+}
@@ -17,6 +17,13 @@ class MerkleTreeMath {
   // Index of the node's (left or right) sibling in the same level.
   static size_t Sibling(size_t leaf);
 
+  // The largest power of two smaller than |n|, which must be at least
+  // 2: where RFC 6962 splits a tree of |n| leaves.
+  static size_t SplitPoint(size_t n);
+
+  // Log2 of |n| if it is a power of two, or -1.
+  static int Log2IfPowerOfTwo(size_t n);
+
  private:
   MerkleTreeMath();
 };
@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <time.h>
+#include <random>
 #include <string>
 #include <vector>
 
@@ -13,6 +14,7 @@
 #include "merkletree/serial_hasher.h"
 #include "merkletree/tree_hasher.h"
 #include "util/testing.h"
+#include "util/thread_pool.h"
 #include "util/util.h"
 
 namespace {
@@ -181,6 +183,32 @@ TEST_F(MerkleTreeFuzzTest, RootFuzz) {
   }
 }
 
+// Batches of root queries, in any order, with some past the tree.
+TEST_F(MerkleTreeFuzzTest, RootsAtSnapshotsFuzz) {
+  for (size_t tree_size = 1; tree_size <= data_.size(); ++tree_size) {
+    MerkleTree tree(NewSha256Hasher());
+    for (size_t j = 0; j < tree_size; ++j)
+      tree.AddLeaf(data_[j]);
+    // Evaluate part of the tree first, half of the time.
+    if (rand() & 1)
+      tree.RootAtSnapshot(rand() % (tree_size + 1));
+
+    std::vector<size_t> snapshots;
+    for (size_t j = 0; j < 8; ++j)
+      snapshots.push_back(rand() % (tree_size + 2));
+    const std::vector<string> roots(tree.RootsAtSnapshots(snapshots));
+    ASSERT_EQ(snapshots.size(), roots.size());
+    for (size_t j = 0; j < snapshots.size(); ++j) {
+      if (snapshots[j] > tree_size) {
+        EXPECT_EQ("", roots[j]);
+      } else {
+        EXPECT_EQ(roots[j], ReferenceMerkleTreeHash(data_.data(), snapshots[j],
+                                                    &tree_hasher_));
+      }
+    }
+  }
+}
+
 TEST_F(CompactMerkleTreeTest, RootFuzz) {
   for (size_t tree_size = 1; tree_size <= data_.size(); ++tree_size) {
     CompactMerkleTree tree(NewSha256Hasher());
@@ -582,12 +610,201 @@ TEST_F(MerkleTreeTest, AddLeafHash) {
   EXPECT_EQ(kHashValue, tree.LeafHash(index));
 }
 
+// Grow the tree across several node arena chunks, and check that nodes
+// stored before and after each chunk boundary are still served correctly.
+TEST_F(MerkleTreeTest, SpansNodeArenaChunks) {
+  const size_t kTreeSize(3 * NodeArena::kNodesPerChunk + 5);
+  MerkleTree tree(NewSha256Hasher());
+  CompactMerkleTree compact(NewSha256Hasher());
+  std::vector<string> roots;
+  roots.push_back(compact.CurrentRoot());
+  for (size_t i = 0; i < kTreeSize; ++i) {
+    const string leaf(data_[i % data_.size()] + std::to_string(i));
+    tree.AddLeaf(leaf);
+    compact.AddLeaf(leaf);
+    roots.push_back(compact.CurrentRoot());
+    // Evaluate the tree every so often, so that the upper levels also
+    // grow by popping and pushing back nodes.
+    if (i % 97 == 0)
+      EXPECT_EQ(roots.back(), tree.CurrentRoot());
+  }
+  EXPECT_EQ(roots.back(), tree.CurrentRoot());
+
+  MerkleVerifier verifier(NewSha256Hasher());
+  for (size_t snapshot = NodeArena::kNodesPerChunk - 1; snapshot <= kTreeSize;
+       snapshot += NodeArena::kNodesPerChunk / 2 + 1) {
+    EXPECT_EQ(roots[snapshot], tree.RootAtSnapshot(snapshot));
+    const size_t leaf(snapshot / 3 + 1);
+    EXPECT_EQ(roots[snapshot],
+              verifier.RootFromPath(leaf, snapshot,
+                                    tree.PathToRootAtSnapshot(leaf, snapshot),
+                                    data_[(leaf - 1) % data_.size()] +
+                                        std::to_string(leaf - 1)));
+    EXPECT_TRUE(verifier.VerifyConsistency(snapshot, kTreeSize,
+                                           roots[snapshot], roots.back(),
+                                           tree.SnapshotConsistency(
+                                               snapshot, kTreeSize)));
+  }
+}
+
 TEST_F(CompactMerkleTreeTest, TestCloneEmptyTreeProducesWorkingTree) {
   MerkleTree tree(NewSha256Hasher());
   CompactMerkleTree compact(&tree, NewSha256Hasher());
   EXPECT_STREQ(H(compact.CurrentRoot()).c_str(), kSHA256EmptyTreeHash.str);
 }
 
+// Parallel evaluation must produce exactly the same trees as serial
+// evaluation, whatever the alignment of the updates.
+TEST_F(MerkleTreeTest, ParallelEvaluation) {
+  cert_trans::ThreadPool pool(4);
+  MerkleTree serial(NewSha256Hasher());
+  MerkleTree parallel(NewSha256Hasher());
+  parallel.SetExecutor(&pool);
+
+  size_t leaf(0);
+  for (const size_t update : {3, 70001, 12, 40000, 100000}) {
+    for (size_t i = 0; i < update; ++i, ++leaf) {
+      const string data(std::to_string(leaf));
+      serial.AddLeaf(data);
+      parallel.AddLeaf(data);
+    }
+    EXPECT_EQ(H(serial.CurrentRoot()), H(parallel.CurrentRoot()));
+  }
+  for (size_t snapshot = 1; snapshot <= leaf; snapshot += 9973) {
+    EXPECT_EQ(serial.RootAtSnapshot(snapshot),
+              parallel.RootAtSnapshot(snapshot));
+    EXPECT_EQ(serial.PathToRootAtSnapshot(snapshot / 2 + 1, snapshot),
+              parallel.PathToRootAtSnapshot(snapshot / 2 + 1, snapshot));
+  }
+}
+
+TEST_F(MerkleTreeTest, ParallelRootsAtSnapshots) {
+  cert_trans::ThreadPool pool(4);
+  MerkleTree serial(NewSha256Hasher());
+  MerkleTree parallel(NewSha256Hasher());
+  parallel.SetExecutor(&pool);
+
+  std::vector<size_t> snapshots;
+  for (size_t leaf = 0; leaf < 20000; ++leaf) {
+    const string data(std::to_string(leaf));
+    serial.AddLeaf(data);
+    parallel.AddLeaf(data);
+    snapshots.push_back(leaf + 1);
+  }
+  const std::vector<string> roots(parallel.RootsAtSnapshots(snapshots));
+  ASSERT_EQ(snapshots.size(), roots.size());
+  for (size_t i = 0; i < snapshots.size(); i += 997) {
+    EXPECT_EQ(serial.RootAtSnapshot(snapshots[i]), roots[i]);
+  }
+  EXPECT_EQ(serial.CurrentRoot(), roots.back());
+}
+
+TEST_F(CompactMerkleTreeTest, ParallelAddLeaves) {
+  cert_trans::ThreadPool pool(4);
+  CompactMerkleTree serial(NewSha256Hasher());
+  CompactMerkleTree parallel(NewSha256Hasher());
+  parallel.SetExecutor(&pool);
+
+  size_t leaf(0);
+  for (const size_t update : {5, 100000, 1, 40000}) {
+    std::vector<string> data;
+    for (size_t i = 0; i < update; ++i, ++leaf)
+      data.push_back(std::to_string(leaf));
+    EXPECT_EQ(serial.AddLeaves(data), parallel.AddLeaves(data));
+    EXPECT_EQ(serial.LevelCount(), parallel.LevelCount());
+    EXPECT_EQ(H(serial.CurrentRoot()), H(parallel.CurrentRoot()));
+  }
+  // The tree must keep working normally afterwards.
+  serial.AddLeaf("last");
+  parallel.AddLeaf("last");
+  EXPECT_EQ(H(serial.CurrentRoot()), H(parallel.CurrentRoot()));
+}
+
+TEST_F(CompactMerkleTreeTest, ParallelLeafHashes) {
+  cert_trans::ThreadPool pool(4);
+  CompactMerkleTree serial(NewSha256Hasher());
+  CompactMerkleTree parallel(NewSha256Hasher());
+  parallel.SetExecutor(&pool);
+
+  for (const size_t count : {0, 1, 511, 512, 10001}) {
+    std::vector<string> data;
+    for (size_t i = 0; i < count; ++i)
+      data.push_back(std::to_string(i));
+    string serial_hashes(count * serial.NodeSize(), '\0');
+    string parallel_hashes(count * parallel.NodeSize(), '\0');
+    serial.LeafHashes(data.data(), count, &serial_hashes[0]);
+    parallel.LeafHashes(data.data(), count, &parallel_hashes[0]);
+    EXPECT_EQ(serial_hashes, parallel_hashes);
+    if (count > 0) {
+      EXPECT_EQ(serial.LeafHash(data.back()),
+                parallel_hashes.substr((count - 1) * parallel.NodeSize()));
+    }
+  }
+  // Nothing is added to the trees.
+  EXPECT_EQ(0U, parallel.LeafCount());
+}
+
+TEST_F(CompactMerkleTreeTest, AddLeafHashes) {
+  CompactMerkleTree single(NewSha256Hasher());
+  CompactMerkleTree bulk(NewSha256Hasher());
+
+  size_t leaf(0);
+  for (const size_t update : {0, 1, 6, 3, 40000, 2, 16384, 7}) {
+    string hashes;
+    for (size_t i = 0; i < update; ++i, ++leaf) {
+      const string hash(single.LeafHash(std::to_string(leaf)));
+      single.AddLeafHash(hash);
+      hashes.append(hash);
+    }
+    EXPECT_EQ(leaf, bulk.AddLeafHashes(hashes.data(), update));
+    EXPECT_EQ(single.LevelCount(), bulk.LevelCount());
+    EXPECT_EQ(H(single.CurrentRoot()), H(bulk.CurrentRoot()));
+  }
+  single.AddLeaf("last");
+  bulk.AddLeaf("last");
+  EXPECT_EQ(H(single.CurrentRoot()), H(bulk.CurrentRoot()));
+}
+
+// A model that has only been partly evaluated must still produce the
+// right tree, without being evaluated any further.
+TEST_F(CompactMerkleTreeTest, FromPartlyEvaluatedModel) {
+  for (const size_t evaluated : {1, 5, 8, 1000}) {
+    MerkleTree tree(NewSha256Hasher());
+    for (size_t i = 0; i < evaluated; ++i)
+      tree.AddLeaf(std::to_string(i));
+    tree.CurrentRoot();
+    for (size_t i = evaluated; i < evaluated + 37; ++i)
+      tree.AddLeaf(std::to_string(i));
+
+    const MerkleTree& model(tree);
+    CompactMerkleTree compact(model, NewSha256Hasher());
+    EXPECT_EQ(evaluated, tree.EvaluatedLeafCount());
+    EXPECT_EQ(tree.LeafCount(), compact.LeafCount());
+    EXPECT_EQ(tree.LevelCount(), compact.LevelCount());
+    EXPECT_EQ(H(tree.CurrentRoot()), H(compact.CurrentRoot()));
+  }
+}
+
+TEST_F(CompactMerkleTreeTest, FromFrontier) {
+  CompactMerkleTree tree(NewSha256Hasher());
+  for (const size_t leaf_count : {0, 1, 2, 3, 8, 1000}) {
+    while (tree.LeafCount() < leaf_count)
+      tree.AddLeaf(std::to_string(tree.LeafCount()));
+
+    CompactMerkleTree restored(tree.LeafCount(), tree.Frontier(),
+                               NewSha256Hasher());
+    EXPECT_EQ(tree.LeafCount(), restored.LeafCount());
+    EXPECT_EQ(tree.LevelCount(), restored.LevelCount());
+    EXPECT_EQ(H(tree.CurrentRoot()), H(restored.CurrentRoot()));
+
+    // It must keep working normally afterwards.
+    CompactMerkleTree copy(tree, NewSha256Hasher());
+    copy.AddLeaf("next");
+    restored.AddLeaf("next");
+    EXPECT_EQ(H(copy.CurrentRoot()), H(restored.CurrentRoot()));
+  }
+}
+
 // VERIFICATION TESTS
 
 class MerkleVerifierTest : public MerkleTreeTest {
@@ -786,6 +1003,52 @@ TEST_F(MerkleVerifierTest, VerifyPath) {
   }
 }
 
+// Batch verification must agree with VerifyPath() on every path, valid
+// or not, in any order.
+TEST_F(MerkleVerifierTest, VerifyPaths) {
+  cert_trans::ThreadPool pool(4);
+  const size_t tree_size(3000);
+  MerkleTree tree(NewSha256Hasher());
+  for (size_t i = 0; i < tree_size; ++i)
+    tree.AddLeaf(std::to_string(i));
+  const string root(tree.CurrentRoot());
+
+  std::mt19937 rand(42);
+  std::vector<MerkleVerifier::PathToVerify> paths;
+  for (size_t i = 0; i < 3 * tree_size; ++i) {
+    const size_t leaf(rand() % tree_size + 1);
+    MerkleVerifier::PathToVerify path{leaf, tree.PathToCurrentRoot(leaf),
+                                      std::to_string(leaf - 1)};
+    switch (rand() % 8) {
+      case 0:
+        path.data = "wrong";
+        break;
+      case 1:
+        path.path[rand() % path.path.size()] = S(kSHA256EmptyTreeHash);
+        break;
+      case 2:
+        path.path.push_back(root);
+        break;
+      case 3:
+        path.path.pop_back();
+        break;
+      case 4:
+        path.leaf = leaf ^ 1;
+        break;
+    }
+    paths.push_back(path);
+  }
+
+  std::vector<bool> expected;
+  for (const auto& path : paths)
+    expected.push_back(
+        verifier_.VerifyPath(path.leaf, tree_size, path.path, root, path.data));
+  EXPECT_EQ(expected, verifier_.VerifyPaths(tree_size, root, paths));
+  EXPECT_EQ(expected, verifier_.VerifyPaths(tree_size, root, paths, &pool));
+  EXPECT_EQ(std::vector<bool>(paths.size(), false),
+            verifier_.VerifyPaths(tree_size, S(kSHA256EmptyTreeHash), paths));
+}
+
 TEST_F(MerkleVerifierTest, VerifyConsistencyProof) {
   std::vector<string> proof;
   string root1, root2;
@@ -1,11 +1,26 @@
 #include "merkletree/merkle_verifier.h"
 
 #include <stddef.h>
+#include <string.h>
+#include <algorithm>
+#include <numeric>
 #include <vector>
 
+#include "merkletree/serial_hasher.h"
+#include "util/parallel_for.h"
+
 using std::move;
 using std::string;
 using std::unique_ptr;
+using std::vector;
+
+namespace {
+
+// Number of consecutive paths checked by each VerifyPaths() task: large
+// enough that most of the shortcuts are still taken.
+const size_t kPathsPerTask = 1024;
+
+}  // namespace
 
 MerkleVerifier::MerkleVerifier(unique_ptr<SerialHasher> hasher)
     : treehasher_(move(hasher)) {
@@ -31,6 +46,145 @@ bool MerkleVerifier::VerifyPath(size_t leaf, size_t tree_size,
   return path_root == root;
 }
 
+namespace {
+
+
+// Checks sorted runs of paths for MerkleVerifier::VerifyPaths().
+class SortedPathVerifier {
+ public:
+  SortedPathVerifier(const TreeHasher& hasher, size_t tree_size,
+                     const string& root)
+      : hasher_(hasher), tree_size_(tree_size), root_(root) {
+  }
+
+  // Verifies |path|, which must not be to the left of the previous one.
+  bool Verify(const MerkleVerifier::PathToVerify& path);
+
+ private:
+  // One level of a path: the node it goes through, the hash of that
+  // node, and its sibling in the path (NULL if it has none).
+  struct Level {
+    size_t node;
+    char hash[SerialHasher::kMaxDigestSize];
+    const string* sibling;
+  };
+
+  // True if [|it|, |end|) holds exactly the siblings of |verified_|
+  // from |level| up.
+  bool RestMatches(size_t level, vector<string>::const_iterator it,
+                   vector<string>::const_iterator end) const;
+
+  const TreeHasher& hasher_;
+  const size_t tree_size_;
+  const string& root_;
+  // The levels of the last valid path, from the leaves up. They are all
+  // authenticated by the root.
+  vector<Level> verified_;
+  vector<Level> current_;
+};
+
+
+bool SortedPathVerifier::Verify(const MerkleVerifier::PathToVerify& path) {
+  const size_t digest_size(hasher_.DigestSize());
+  if (path.leaf > tree_size_ || path.leaf == 0 || root_.size() != digest_size)
+    return false;
+
+  size_t node = path.leaf - 1;
+  size_t last_node = tree_size_ - 1;
+  char node_hash[SerialHasher::kMaxDigestSize];
+  hasher_.HashLeaf(path.data.data(), path.data.size(), node_hash);
+  vector<string>::const_iterator it = path.path.begin();
+  current_.clear();
+
+  for (size_t level = 0; last_node; ++level) {
+    if (level < verified_.size() && verified_[level].node == node) {
+      // The path joins the last valid one here, so the rest of it has to
+      // be the same.
+      if (memcmp(node_hash, verified_[level].hash, digest_size) != 0 ||
+          !RestMatches(level, it, path.path.end()))
+        return false;
+      std::copy(current_.begin(), current_.end(), verified_.begin());
+      return true;
+    }
+
+    current_.emplace_back();
+    Level* const current(&current_.back());
+    current->node = node;
+    memcpy(current->hash, node_hash, digest_size);
+    current->sibling = nullptr;
+    if (IsRightChild(node) || node < last_node) {
+      if (it == path.path.end() || it->size() != digest_size)
+        return false;
+      current->sibling = &*it;
+      if (IsRightChild(node))
+        hasher_.HashChildren(it->data(), node_hash, node_hash);
+      else
+        hasher_.HashChildren(node_hash, it->data(), node_hash);
+      ++it;
+    }
+    // Else the sibling does not exist and the parent is a dummy copy.
+
+    node = Parent(node);
+    last_node = Parent(last_node);
+  }
+
+  if (it != path.path.end() ||
+      memcmp(node_hash, root_.data(), digest_size) != 0)
+    return false;
+  verified_.swap(current_);
+  return true;
+}
+
+
+bool SortedPathVerifier::RestMatches(size_t level,
+                                     vector<string>::const_iterator it,
+                                     vector<string>::const_iterator end) const {
+  for (; level < verified_.size(); ++level) {
+    const string* const sibling(verified_[level].sibling);
+    if (!sibling)
+      continue;
+    if (it == end || *it != *sibling)
+      return false;
+    ++it;
+  }
+  return it == end;
+}
+
+
+}  // namespace
+
+
+vector<bool> MerkleVerifier::VerifyPaths(size_t tree_size, const string& root,
+                                         const vector<PathToVerify>& paths,
+                                         util::Executor* executor) {
+  vector<size_t> order(paths.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&paths](size_t a, size_t b) {
+    return paths[a].leaf < paths[b].leaf;
+  });
+
+  // Not a vector<bool>, so that tasks can set their results concurrently.
+  vector<char> valid(paths.size());
+  const auto verify([&](const TreeHasher& hasher, size_t begin, size_t end) {
+    SortedPathVerifier verifier(hasher, tree_size, root);
+    for (size_t i = begin; i < end; ++i)
+      valid[order[i]] = verifier.Verify(paths[order[i]]);
+  });
+  if (executor && paths.size() > kPathsPerTask) {
+    util::ParallelFor(executor,
+                      (paths.size() + kPathsPerTask - 1) / kPathsPerTask,
+                      [&](size_t task) {
+                        verify(TreeHasher(treehasher_.CreateSerialHasher()),
+                               task * kPathsPerTask,
+                               std::min(paths.size(),
+                                        (task + 1) * kPathsPerTask));
+                      });
+  } else {
+    verify(treehasher_, 0, paths.size());
+  }
+  return vector<bool>(valid.begin(), valid.end());
+}
+
 string MerkleVerifier::RootFromPath(size_t leaf, size_t tree_size,
                                     const std::vector<string>& path,
                                     const string& data) {
@@ -41,17 +195,25 @@ string MerkleVerifier::RootFromPath(size_t leaf, size_t tree_size,
   size_t node = leaf - 1;
   size_t last_node = tree_size - 1;
 
-  string node_hash = LeafHash(data);
+  const size_t digest_size(treehasher_.DigestSize());
+  char node_hash[SerialHasher::kMaxDigestSize];
+  treehasher_.HashLeaf(data.data(), data.size(), node_hash);
   std::vector<string>::const_iterator it = path.begin();
 
   while (last_node) {
     if (it == path.end())
       // We've reached the end but we're not done yet.
       return string();
-    if (IsRightChild(node))
-      node_hash = treehasher_.HashChildren(*it++, node_hash);
-    else if (node < last_node)
-      node_hash = treehasher_.HashChildren(node_hash, *it++);
+    if (IsRightChild(node) || node < last_node) {
+      if (it->size() != digest_size)
+        // Not a node of the tree.
+        return string();
+      if (IsRightChild(node))
+        treehasher_.HashChildren(it->data(), node_hash, node_hash);
+      else
+        treehasher_.HashChildren(node_hash, it->data(), node_hash);
+      ++it;
+    }
     // Else the sibling does not exist and the parent is a dummy copy.
     // Do nothing.
 
@@ -62,7 +224,7 @@ string MerkleVerifier::RootFromPath(size_t leaf, size_t tree_size,
   // Check that we've reached the end.
   if (it != path.end())
     return string();
-  return node_hash;
+  return string(node_hash, digest_size);
 }
 
 bool MerkleVerifier::VerifyConsistency(size_t snapshot1, size_t snapshot2,
@@ -83,6 +245,14 @@ bool MerkleVerifier::VerifyConsistency(size_t snapshot1, size_t snapshot2,
   size_t last_node = snapshot2 - 1;
   if (proof.empty())
     return false;
+  // Nodes of the wrong size cannot be part of either tree.
+  const size_t digest_size(treehasher_.DigestSize());
+  if (root1.size() != digest_size || root2.size() != digest_size)
+    return false;
+  for (const auto& proof_node : proof) {
+    if (proof_node.size() != digest_size)
+      return false;
+  }
   std::vector<string>::const_iterator it = proof.begin();
   // Move up until the first mutable node.
   while (IsRightChild(node)) {
@@ -90,25 +260,30 @@ bool MerkleVerifier::VerifyConsistency(size_t snapshot1, size_t snapshot2,
     last_node = Parent(last_node);
   }
 
-  string node1_hash;
-  string node2_hash;
-  if (node)
-    node2_hash = node1_hash = *it++;
-  else
+  char node1_hash[SerialHasher::kMaxDigestSize];
+  char node2_hash[SerialHasher::kMaxDigestSize];
+  if (node) {
+    memcpy(node1_hash, it->data(), digest_size);
+    ++it;
+  } else {
     // The tree at snapshot1 was balanced, nothing to verify for root1.
-    node2_hash = node1_hash = root1;
+    memcpy(node1_hash, root1.data(), digest_size);
+  }
+  memcpy(node2_hash, node1_hash, digest_size);
   while (node) {
     if (it == proof.end())
       return false;
 
     if (IsRightChild(node)) {
-      node1_hash = treehasher_.HashChildren(*it, node1_hash);
-      node2_hash = treehasher_.HashChildren(*it, node2_hash);
+      treehasher_.HashChildren(it->data(), node1_hash, node1_hash);
+      treehasher_.HashChildren(it->data(), node2_hash, node2_hash);
       ++it;
-    } else if (node < last_node)
+    } else if (node < last_node) {
       // The sibling only exists in the later tree. The parent in the
       // snapshot1 tree is a dummy copy.
-      node2_hash = treehasher_.HashChildren(node2_hash, *it++);
+      treehasher_.HashChildren(node2_hash, it->data(), node2_hash);
+      ++it;
+    }
     // Else the sibling does not exist in either tree. Do nothing.
 
     node = Parent(node);
@@ -116,7 +291,7 @@ bool MerkleVerifier::VerifyConsistency(size_t snapshot1, size_t snapshot2,
   }
 
   // Verify the first root.
-  if (node1_hash != root1)
+  if (memcmp(node1_hash, root1.data(), digest_size) != 0)
     return false;
 
   // Continue until the second root.
@@ -125,12 +300,14 @@ bool MerkleVerifier::VerifyConsistency(size_t snapshot1, size_t snapshot2,
       // We've reached the end but we're not done yet.
       return false;
 
-    node2_hash = treehasher_.HashChildren(node2_hash, *it++);
+    treehasher_.HashChildren(node2_hash, it->data(), node2_hash);
+    ++it;
     last_node = Parent(last_node);
   }
 
   // Verify the second root.
-  return node2_hash == root2 && it == proof.end();
+  return memcmp(node2_hash, root2.data(), digest_size) == 0 &&
+         it == proof.end();
 }
 
 string MerkleVerifier::LeafHash(const std::string& data) {
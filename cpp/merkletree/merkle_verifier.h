@@ -3,17 +3,29 @@
 
 #include <stddef.h>
 #include <memory>
+#include <string>
 #include <vector>
 
 #include "merkletree/tree_hasher.h"
 
 class SerialHasher;
 
+namespace util {
+class Executor;
+}  // namespace util
+
 // Class for verifying paths emitted by MerkleTrees.
 // TODO: consistency proofs between snapshots.
 
 class MerkleVerifier {
  public:
+  // The arguments of one VerifyPath() call, for VerifyPaths().
+  struct PathToVerify {
+    size_t leaf;
+    std::vector<std::string> path;
+    std::string data;
+  };
+
   MerkleVerifier(std::unique_ptr<SerialHasher> hasher);
   ~MerkleVerifier();
 
@@ -31,6 +43,18 @@ class MerkleVerifier {
                   const std::vector<std::string>& path,
                   const std::string& root, const std::string& data);
 
+  // Verify many Merkle paths in the same tree. Returns, for each of
+  // |paths|, what VerifyPath() would return for it with |tree_size| and
+  // |root|.
+  //
+  // The paths are checked in leaf order, and once one is valid, the
+  // nodes it authenticates are not hashed again: the paths that go
+  // through them only have to match the rest of it. If |executor| is
+  // not NULL, runs of consecutive paths are checked on it concurrently.
+  std::vector<bool> VerifyPaths(size_t tree_size, const std::string& root,
+                                const std::vector<PathToVerify>& paths,
+                                util::Executor* executor = nullptr);
+
   // Compute the root corresponding to a Merkle audit path.
   // Returns an empty string if the path is not valid.
   //
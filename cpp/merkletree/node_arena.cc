@@ -0,0 +1,32 @@
+#include "merkletree/node_arena.h"
+
+#include <string.h>
+
+const size_t NodeArena::kNodesPerChunk;
+
+NodeArena::NodeArena(size_t node_size) : node_size_(node_size), size_(0) {
+  assert(node_size_ > 0);
+}
+
+void NodeArena::PushBack(const char* node) {
+  const size_t offset(size_ % kNodesPerChunk);
+  if (offset == 0 && size_ / kNodesPerChunk == chunks_.size()) {
+    chunks_.emplace_back(new char[kNodesPerChunk * node_size_]);
+  }
+  memcpy(chunks_[size_ / kNodesPerChunk].get() + offset * node_size_, node,
+         node_size_);
+  ++size_;
+}
+
+void NodeArena::PopBack() {
+  assert(size_ > 0);
+  --size_;
+}
+
+void NodeArena::Grow(size_t size) {
+  assert(size >= size_);
+  while (chunks_.size() * kNodesPerChunk < size) {
+    chunks_.emplace_back(new char[kNodesPerChunk * node_size_]);
+  }
+  size_ = size;
+}
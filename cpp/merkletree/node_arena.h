@@ -0,0 +1,83 @@
+#ifndef CERT_TRANS_MERKLETREE_NODE_ARENA_H_
+#define CERT_TRANS_MERKLETREE_NODE_ARENA_H_
+
+#include <assert.h>
+#include <stddef.h>
+#include <memory>
+#include <vector>
+
+// An append-only array of fixed-size nodes (i.e., hashes).
+//
+// Nodes are packed back to back into fixed-size chunks, so that appending
+// never moves existing nodes: a pointer returned by Node() stays valid
+// until that node is popped or the arena is destroyed. This avoids both
+// the copying of a single growing buffer and the per-node overhead of
+// storing each hash in its own std::string.
+//
+// This class is thread-compatible, but not thread-safe.
+class NodeArena {
+ public:
+  // Number of nodes in each chunk. Must be a power of two.
+  static const size_t kNodesPerChunk = 1024;
+
+  explicit NodeArena(size_t node_size);
+  NodeArena(NodeArena&& other) = default;
+  NodeArena& operator=(NodeArena&& other) = default;
+  NodeArena(const NodeArena&) = delete;
+  NodeArena& operator=(const NodeArena&) = delete;
+
+  size_t NodeSize() const {
+    return node_size_;
+  }
+
+  // Number of nodes in the arena.
+  size_t size() const {
+    return size_;
+  }
+
+  bool empty() const {
+    return size_ == 0;
+  }
+
+  // Pointer to the NodeSize() bytes of the |index|th node. Indexing
+  // starts at 0.
+  const char* Node(size_t index) const {
+    assert(index < size_);
+    return chunks_[index / kNodesPerChunk].get() +
+           (index % kNodesPerChunk) * node_size_;
+  }
+
+  const char* LastNode() const {
+    assert(size_ > 0);
+    return Node(size_ - 1);
+  }
+
+  // Append a node, copying NodeSize() bytes from |node|.
+  void PushBack(const char* node);
+
+  // Remove the last node. Its storage is reused by the next PushBack().
+  void PopBack();
+
+  // Grow the arena to |size| nodes (which must be at least size()). The
+  // new nodes are uninitialized, and must be filled in with
+  // MutableNode() before being read.
+  void Grow(size_t size);
+
+  // Writable pointer to the NodeSize() bytes of the |index|th node.
+  // Distinct nodes can be written concurrently.
+  char* MutableNode(size_t index) {
+    return const_cast<char*>(Node(index));
+  }
+
+  // Size in bytes of the memory allocated for nodes.
+  size_t AllocatedBytes() const {
+    return chunks_.size() * kNodesPerChunk * node_size_;
+  }
+
+ private:
+  size_t node_size_;
+  size_t size_;
+  std::vector<std::unique_ptr<char[]>> chunks_;
+};
+
+#endif  // CERT_TRANS_MERKLETREE_NODE_ARENA_H_
@@ -13,6 +13,10 @@ class SerialHasher {
   SerialHasher(const SerialHasher&) = delete;
   SerialHasher& operator=(const SerialHasher&) = delete;
 
+  // Upper bound on DigestSize(), for callers that keep digests in fixed
+  // size buffers.
+  static const size_t kMaxDigestSize = 32;
+
   virtual size_t DigestSize() const = 0;
 
   // Reset the context. Must be called before the first Update() call.
@@ -22,10 +26,26 @@ class SerialHasher {
   virtual void Reset() = 0;
 
   // Update the hash context with (binary) data.
-  virtual void Update(const std::string& data) = 0;
+  virtual void Update(const char* data, size_t size) = 0;
+  void Update(const std::string& data) {
+    Update(data.data(), data.size());
+  }
+
+  // Finalize the hash context and write the DigestSize() bytes of the
+  // binary digest to |out|.
+  virtual void Final(char* out) = 0;
 
   // Finalize the hash context and return the binary digest blob.
-  virtual std::string Final() = 0;
+  std::string Final();
+
+  // Compute the digests of |count| independent messages, where the i-th
+  // message is |prefix| followed by the |sizes[i]| bytes at |data[i]|.
+  // Writes DigestSize() bytes per digest, back to back, starting at
+  // |out|. Leaves the hasher in a reset state.
+  // The default implementation hashes the messages one at a time;
+  // implementations may override it to hash several messages at once.
+  virtual void HashBatch(char prefix, const char* const* data,
+                         const size_t* sizes, size_t count, char* out);
 
   // A virtual constructor, creates a new instance of the same type.
   virtual std::unique_ptr<SerialHasher> Create() const = 0;
@@ -41,17 +61,33 @@ class Sha256Hasher : public SerialHasher {
     return kDigestSize;
   }
 
+  // Messages of up to kMaxBufferedSize bytes, such as the leaf and node
+  // hashes of TreeHasher, are buffered and hashed in one go with the
+  // SHA-256 instructions of the CPU when it has them (see
+  // merkletree/sha256_hardware.h).
   void Reset();
-  void Update(const std::string& data);
-  std::string Final();
+  using SerialHasher::Update;
+  void Update(const char* data, size_t size);
+  using SerialHasher::Final;
+  void Final(char* out);
+  // Uses multi-buffer SHA-256 (see merkletree/sha256_multibuffer.h)
+  // when the CPU supports it.
+  void HashBatch(char prefix, const char* const* data, const size_t* sizes,
+                 size_t count, char* out);
   std::unique_ptr<SerialHasher> Create() const;
 
   // Create a new hasher and call Reset(), Update(), and Final().
   static std::string Sha256Digest(const std::string& data);
 
  private:
+  static const size_t kMaxBufferedSize = 128;
+
   SHA256_CTX ctx_;
   bool initialized_;
+  // True if the message so far is in |buffer_| rather than in |ctx_|.
+  bool buffering_;
+  size_t buffered_size_;
+  char buffer_[kMaxBufferedSize];
   static const size_t kDigestSize;
 };
 
@@ -1,8 +1,12 @@
+#include <glog/logging.h>
 #include <gtest/gtest.h>
+#include <openssl/sha.h>
 #include <stddef.h>
 #include <string>
+#include <vector>
 
 #include "merkletree/serial_hasher.h"
+#include "merkletree/sha256_hardware.h"
 #include "util/testing.h"
 #include "util/util.h"
 
@@ -107,6 +111,36 @@ TYPED_TEST(SerialHasherTest, Create) {
   }
 }
 
+// Batches of messages of assorted lengths, including ones whose padding
+// spills into an extra block, must hash the same as one by one.
+TYPED_TEST(SerialHasherTest, HashBatch) {
+  std::vector<string> messages;
+  for (size_t size = 0; size < 200; size += 7)
+    messages.push_back(string(size, static_cast<char>('a' + size % 26)));
+  for (size_t size = 53; size < 58; ++size)
+    messages.push_back(string(size, 'x'));
+
+  std::vector<const char*> data;
+  std::vector<size_t> sizes;
+  for (const auto& m : messages) {
+    data.push_back(m.data());
+    sizes.push_back(m.size());
+  }
+
+  const size_t digest_size(this->hasher_->DigestSize());
+  for (size_t count = 0; count <= messages.size(); count += 3) {
+    string out(count * digest_size, '\0');
+    this->hasher_->HashBatch('p', data.data(), sizes.data(), count, &out[0]);
+    for (size_t i = 0; i < count; ++i) {
+      this->hasher_->Reset();
+      this->hasher_->Update("p" + messages[i]);
+      EXPECT_EQ(H(this->hasher_->Final()),
+                H(out.substr(i * digest_size, digest_size)))
+          << "message " << i << " of " << count;
+    }
+  }
+}
+
 TEST(Sha256Test, StaticDigest) {
   string input, output, digest;
 
@@ -117,6 +151,45 @@ TEST(Sha256Test, StaticDigest) {
   }
 }
 
+// The hardware backend must agree with OpenSSL on messages of all the
+// lengths around block and padding boundaries.
+TEST(Sha256Test, HardwareBackend) {
+  if (!Sha256Hardware::Supported()) {
+    LOG(WARNING) << "No SHA-256 instructions, skipping test";
+    return;
+  }
+  for (size_t size = 0; size < 300; ++size) {
+    string message;
+    for (size_t i = 0; i < size; ++i)
+      message.push_back(static_cast<char>(i * 131 + size));
+    unsigned char expected[SHA256_DIGEST_LENGTH];
+    SHA256(reinterpret_cast<const unsigned char*>(message.data()),
+           message.size(), expected);
+    char digest[SHA256_DIGEST_LENGTH];
+    Sha256Hardware::Hash(message.data(), message.size(), digest);
+    EXPECT_EQ(H(string(reinterpret_cast<char*>(expected), sizeof(expected))),
+              H(string(digest, sizeof(digest))))
+        << "size " << size;
+  }
+}
+
+// Messages are buffered up to a point, and streamed after that.
+TEST(Sha256Test, LongUpdates) {
+  const string chunk(100, 'c');
+  string message;
+  Sha256Hasher hasher;
+  hasher.Reset();
+  for (int i = 0; i < 5; ++i) {
+    hasher.Update(chunk);
+    message += chunk;
+  }
+  unsigned char expected[SHA256_DIGEST_LENGTH];
+  SHA256(reinterpret_cast<const unsigned char*>(message.data()),
+         message.size(), expected);
+  EXPECT_EQ(H(string(reinterpret_cast<char*>(expected), sizeof(expected))),
+            H(hasher.Final()));
+}
+
 #undef S
 #undef H
 
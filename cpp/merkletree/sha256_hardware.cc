@@ -0,0 +1,307 @@
+#include "merkletree/sha256_hardware.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_SHA256_SHA_NI 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__GNUC__) && defined(__linux__)
+#define HAVE_SHA256_ARMV8 1
+#include <arm_neon.h>
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+
+namespace {
+
+const size_t kBlockSize = 64;
+
+#if defined(HAVE_SHA256_SHA_NI) || defined(HAVE_SHA256_ARMV8)
+
+const uint32_t kRoundConstants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+#endif
+
+const uint32_t kInitialState[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372,
+                                   0xa54ff53a, 0x510e527f, 0x9b05688c,
+                                   0x1f83d9ab, 0x5be0cd19};
+
+
+// Updates |state| with the |count| blocks at |blocks|.
+typedef void (*CompressFunction)(uint32_t* state, const unsigned char* blocks,
+                                 size_t count);
+
+
+#ifdef HAVE_SHA256_SHA_NI
+
+#define SHA_NI_TARGET __attribute__((target("sha,sse4.1")))
+
+bool CpuHasShaNi() {
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || (ecx & bit_SSE4_1) == 0) {
+    return false;
+  }
+  // SHA is bit 29 of EBX for leaf 7, sub-leaf 0.
+  if (__get_cpuid_max(0, nullptr) < 7) {
+    return false;
+  }
+  __cpuid_count(7, 0, eax, ebx, ecx, edx);
+  return (ebx & (1U << 29)) != 0;
+}
+
+
+// The next four words of the message schedule, from the previous 16
+// (|w0| being the oldest four).
+SHA_NI_TARGET inline __m128i ShaNiSchedule(__m128i w0, __m128i w1, __m128i w2,
+                                           __m128i w3) {
+  return _mm_sha256msg2_epu32(
+      _mm_add_epi32(_mm_sha256msg1_epu32(w0, w1), _mm_alignr_epi8(w3, w2, 4)),
+      w3);
+}
+
+
+// Rounds 4 * |i| to 4 * |i| + 3, with the message schedule words |w|.
+SHA_NI_TARGET inline void ShaNiRounds(int i, __m128i w, __m128i* abef,
+                                      __m128i* cdgh) {
+  const __m128i wk(_mm_add_epi32(
+      w, _mm_loadu_si128(
+             reinterpret_cast<const __m128i*>(kRoundConstants + 4 * i))));
+  *cdgh = _mm_sha256rnds2_epu32(*cdgh, *abef, wk);
+  *abef = _mm_sha256rnds2_epu32(*abef, *cdgh, _mm_shuffle_epi32(wk, 0x0e));
+}
+
+
+SHA_NI_TARGET void CompressShaNi(uint32_t* state, const unsigned char* blocks,
+                                 size_t count) {
+  // The SHA instructions keep the state in two registers, as ABEF and
+  // CDGH.
+  const __m128i byte_swap(
+      _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL));
+  __m128i tmp(_mm_shuffle_epi32(
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(state)), 0xb1));
+  __m128i cdgh(_mm_shuffle_epi32(
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(state + 4)), 0x1b));
+  __m128i abef(_mm_alignr_epi8(tmp, cdgh, 8));
+  cdgh = _mm_blend_epi16(cdgh, tmp, 0xf0);
+
+  for (; count > 0; --count, blocks += kBlockSize) {
+    const __m128i abef_before(abef);
+    const __m128i cdgh_before(cdgh);
+    const __m128i* const words(reinterpret_cast<const __m128i*>(blocks));
+
+    // The last 16 words of the message schedule, four per register.
+    __m128i w0(_mm_shuffle_epi8(_mm_loadu_si128(words), byte_swap));
+    __m128i w1(_mm_shuffle_epi8(_mm_loadu_si128(words + 1), byte_swap));
+    __m128i w2(_mm_shuffle_epi8(_mm_loadu_si128(words + 2), byte_swap));
+    __m128i w3(_mm_shuffle_epi8(_mm_loadu_si128(words + 3), byte_swap));
+    ShaNiRounds(0, w0, &abef, &cdgh);
+    ShaNiRounds(1, w1, &abef, &cdgh);
+    ShaNiRounds(2, w2, &abef, &cdgh);
+    ShaNiRounds(3, w3, &abef, &cdgh);
+    for (int i = 4; i < 16; i += 4) {
+      w0 = ShaNiSchedule(w0, w1, w2, w3);
+      ShaNiRounds(i, w0, &abef, &cdgh);
+      w1 = ShaNiSchedule(w1, w2, w3, w0);
+      ShaNiRounds(i + 1, w1, &abef, &cdgh);
+      w2 = ShaNiSchedule(w2, w3, w0, w1);
+      ShaNiRounds(i + 2, w2, &abef, &cdgh);
+      w3 = ShaNiSchedule(w3, w0, w1, w2);
+      ShaNiRounds(i + 3, w3, &abef, &cdgh);
+    }
+
+    abef = _mm_add_epi32(abef, abef_before);
+    cdgh = _mm_add_epi32(cdgh, cdgh_before);
+  }
+
+  tmp = _mm_shuffle_epi32(abef, 0x1b);
+  cdgh = _mm_shuffle_epi32(cdgh, 0xb1);
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(state),
+                   _mm_blend_epi16(tmp, cdgh, 0xf0));
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(state + 4),
+                   _mm_alignr_epi8(cdgh, tmp, 8));
+}
+
+#undef SHA_NI_TARGET
+
+#endif  // HAVE_SHA256_SHA_NI
+
+
+#ifdef HAVE_SHA256_ARMV8
+
+#define ARMV8_TARGET __attribute__((target("+crypto")))
+
+bool CpuHasArmv8Sha2() {
+  return (getauxval(AT_HWCAP) & HWCAP_SHA2) != 0;
+}
+
+
+// The next four words of the message schedule, from the previous 16
+// (|w0| being the oldest four).
+ARMV8_TARGET inline uint32x4_t Armv8Schedule(uint32x4_t w0, uint32x4_t w1,
+                                             uint32x4_t w2, uint32x4_t w3) {
+  return vsha256su1q_u32(vsha256su0q_u32(w0, w1), w2, w3);
+}
+
+
+// Rounds 4 * |i| to 4 * |i| + 3, with the message schedule words |w|.
+ARMV8_TARGET inline void Armv8Rounds(int i, uint32x4_t w, uint32x4_t* abcd,
+                                     uint32x4_t* efgh) {
+  const uint32x4_t wk(vaddq_u32(w, vld1q_u32(kRoundConstants + 4 * i)));
+  const uint32x4_t abcd_before(*abcd);
+  *abcd = vsha256hq_u32(*abcd, *efgh, wk);
+  *efgh = vsha256h2q_u32(*efgh, abcd_before, wk);
+}
+
+
+ARMV8_TARGET void CompressArmv8(uint32_t* state, const unsigned char* blocks,
+                                size_t count) {
+  uint32x4_t abcd(vld1q_u32(state));
+  uint32x4_t efgh(vld1q_u32(state + 4));
+
+  for (; count > 0; --count, blocks += kBlockSize) {
+    const uint32x4_t abcd_before(abcd);
+    const uint32x4_t efgh_before(efgh);
+
+    // The last 16 words of the message schedule, four per register.
+    uint32x4_t w0(vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(blocks))));
+    uint32x4_t w1(vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(blocks + 16))));
+    uint32x4_t w2(vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(blocks + 32))));
+    uint32x4_t w3(vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(blocks + 48))));
+    Armv8Rounds(0, w0, &abcd, &efgh);
+    Armv8Rounds(1, w1, &abcd, &efgh);
+    Armv8Rounds(2, w2, &abcd, &efgh);
+    Armv8Rounds(3, w3, &abcd, &efgh);
+    for (int i = 4; i < 16; i += 4) {
+      w0 = Armv8Schedule(w0, w1, w2, w3);
+      Armv8Rounds(i, w0, &abcd, &efgh);
+      w1 = Armv8Schedule(w1, w2, w3, w0);
+      Armv8Rounds(i + 1, w1, &abcd, &efgh);
+      w2 = Armv8Schedule(w2, w3, w0, w1);
+      Armv8Rounds(i + 2, w2, &abcd, &efgh);
+      w3 = Armv8Schedule(w3, w0, w1, w2);
+      Armv8Rounds(i + 3, w3, &abcd, &efgh);
+    }
+
+    abcd = vaddq_u32(abcd, abcd_before);
+    efgh = vaddq_u32(efgh, efgh_before);
+  }
+
+  vst1q_u32(state, abcd);
+  vst1q_u32(state + 4, efgh);
+}
+
+#undef ARMV8_TARGET
+
+#endif  // HAVE_SHA256_ARMV8
+
+
+Sha256Hardware::Backend DetectBackend() {
+#ifdef HAVE_SHA256_SHA_NI
+  if (CpuHasShaNi()) {
+    return Sha256Hardware::SHA_NI;
+  }
+#endif
+#ifdef HAVE_SHA256_ARMV8
+  if (CpuHasArmv8Sha2()) {
+    return Sha256Hardware::ARMV8;
+  }
+#endif
+  return Sha256Hardware::NONE;
+}
+
+
+CompressFunction CompressFor(Sha256Hardware::Backend backend) {
+  switch (backend) {
+#ifdef HAVE_SHA256_SHA_NI
+    case Sha256Hardware::SHA_NI:
+      return CompressShaNi;
+#endif
+#ifdef HAVE_SHA256_ARMV8
+    case Sha256Hardware::ARMV8:
+      return CompressArmv8;
+#endif
+    default:
+      return nullptr;
+  }
+}
+
+
+inline void StoreBigEndian32(uint32_t v, char* p) {
+  p[0] = static_cast<char>(v >> 24);
+  p[1] = static_cast<char>(v >> 16);
+  p[2] = static_cast<char>(v >> 8);
+  p[3] = static_cast<char>(v);
+}
+
+
+}  // namespace
+
+
+// static
+Sha256Hardware::Backend Sha256Hardware::ActiveBackend() {
+  static const Backend backend(DetectBackend());
+  return backend;
+}
+
+
+// static
+const char* Sha256Hardware::BackendName(Backend backend) {
+  switch (backend) {
+    case NONE:
+      return "none";
+    case SHA_NI:
+      return "sha_ni";
+    case ARMV8:
+      return "armv8";
+  }
+  return "unknown";
+}
+
+
+// static
+void Sha256Hardware::Hash(const char* data, size_t size, char* out) {
+  static const CompressFunction compress(CompressFor(ActiveBackend()));
+  assert(compress);
+
+  uint32_t state[8];
+  memcpy(state, kInitialState, sizeof(state));
+
+  // Whole blocks are hashed in place, and only the tail (with the
+  // padding) is copied.
+  const unsigned char* const bytes(reinterpret_cast<const unsigned char*>(data));
+  const size_t whole_blocks(size / kBlockSize);
+  compress(state, bytes, whole_blocks);
+
+  const size_t tail_size(size % kBlockSize);
+  const size_t tail_blocks(tail_size + 9 > kBlockSize ? 2 : 1);
+  unsigned char tail[2 * kBlockSize];
+  memcpy(tail, bytes + whole_blocks * kBlockSize, tail_size);
+  tail[tail_size] = 0x80;
+  memset(tail + tail_size + 1, 0, tail_blocks * kBlockSize - tail_size - 1);
+  const uint64_t bits(static_cast<uint64_t>(size) * 8);
+  for (int i = 0; i < 8; ++i) {
+    tail[tail_blocks * kBlockSize - 1 - i] =
+        static_cast<unsigned char>(bits >> (8 * i));
+  }
+  compress(state, tail, tail_blocks);
+
+  for (int i = 0; i < 8; ++i) {
+    StoreBigEndian32(state[i], out + 4 * i);
+  }
+}
@@ -0,0 +1,39 @@
+#ifndef CERT_TRANS_MERKLETREE_SHA256_HARDWARE_H_
+#define CERT_TRANS_MERKLETREE_SHA256_HARDWARE_H_
+
+#include <stddef.h>
+
+// SHA-256 using the instructions some CPUs have for it (the x86 SHA
+// extensions, or the ARMv8 cryptography extensions). Hashing a message
+// with these is a plain function call on a contiguous buffer, which is
+// much cheaper than going through a generic hashing context for short
+// messages such as Merkle tree nodes.
+class Sha256Hardware {
+ public:
+  enum Backend {
+    NONE,
+    SHA_NI,
+    ARMV8,
+  };
+
+  // The backend supported by the CPU, detected on first use.
+  static Backend ActiveBackend();
+
+  // A short name for |backend|, for logs and metrics.
+  static const char* BackendName(Backend backend);
+
+  // True if ActiveBackend() is not NONE. If this returns false, Hash()
+  // must not be called.
+  static bool Supported() {
+    return ActiveBackend() != NONE;
+  }
+
+  // Computes the SHA-256 digest of the |size| bytes at |data|, and
+  // writes its 32 bytes to |out|.
+  static void Hash(const char* data, size_t size, char* out);
+
+ private:
+  Sha256Hardware() = delete;
+};
+
+#endif  // CERT_TRANS_MERKLETREE_SHA256_HARDWARE_H_
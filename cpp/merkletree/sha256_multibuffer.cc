@@ -0,0 +1,258 @@
+#include "merkletree/sha256_multibuffer.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_SHA256_AVX2 1
+#include <immintrin.h>
+#endif
+
+using std::vector;
+
+const size_t Sha256MultiBuffer::kLanes;
+
+namespace {
+
+const size_t kBlockSize = 64;
+const size_t kDigestSize = 32;
+
+const uint32_t kRoundConstants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+const uint32_t kInitialState[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372,
+                                   0xa54ff53a, 0x510e527f, 0x9b05688c,
+                                   0x1f83d9ab, 0x5be0cd19};
+
+
+// Size of |message_size| bytes once SHA-256 padding has been appended.
+size_t PaddedSize(size_t message_size) {
+  return (message_size + 9 + kBlockSize - 1) / kBlockSize * kBlockSize;
+}
+
+
+// Writes |prefix| || |data| followed by the SHA-256 padding to |out|,
+// which must be PaddedSize(size + 1) bytes long.
+void PadMessage(char prefix, const char* data, size_t size,
+                unsigned char* out) {
+  const size_t message_size(size + 1);
+  const size_t padded_size(PaddedSize(message_size));
+  out[0] = static_cast<unsigned char>(prefix);
+  memcpy(out + 1, data, size);
+  out[message_size] = 0x80;
+  memset(out + message_size + 1, 0, padded_size - message_size - 1);
+  const uint64_t bits(static_cast<uint64_t>(message_size) * 8);
+  for (int i = 0; i < 8; ++i) {
+    out[padded_size - 1 - i] = static_cast<unsigned char>(bits >> (8 * i));
+  }
+}
+
+
+inline uint32_t LoadBigEndian32(const unsigned char* p) {
+  return (static_cast<uint32_t>(p[0]) << 24) |
+         (static_cast<uint32_t>(p[1]) << 16) |
+         (static_cast<uint32_t>(p[2]) << 8) | static_cast<uint32_t>(p[3]);
+}
+
+
+inline void StoreBigEndian32(uint32_t v, char* p) {
+  p[0] = static_cast<char>(v >> 24);
+  p[1] = static_cast<char>(v >> 16);
+  p[2] = static_cast<char>(v >> 8);
+  p[3] = static_cast<char>(v);
+}
+
+
+#ifdef HAVE_SHA256_AVX2
+
+#define MB_TARGET __attribute__((target("avx2")))
+
+MB_TARGET inline __m256i Rotr(__m256i x, int n) {
+  return _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - n));
+}
+
+
+MB_TARGET inline __m256i Add(__m256i a, __m256i b) {
+  return _mm256_add_epi32(a, b);
+}
+
+
+MB_TARGET inline __m256i Xor3(__m256i a, __m256i b, __m256i c) {
+  return _mm256_xor_si256(_mm256_xor_si256(a, b), c);
+}
+
+
+// Hashes the padded messages at |lanes|, |blocks[i]| blocks each, and
+// writes the kLanes digests to |out|. Lanes with zero blocks are
+// ignored (and their digest left unwritten).
+MB_TARGET void HashLanesAvx2(const unsigned char* const* lanes,
+                             const size_t* blocks, char* out) {
+  size_t max_blocks(0);
+  for (size_t lane = 0; lane < Sha256MultiBuffer::kLanes; ++lane) {
+    if (blocks[lane] > max_blocks)
+      max_blocks = blocks[lane];
+  }
+
+  __m256i state[8];
+  for (int i = 0; i < 8; ++i) {
+    state[i] = _mm256_set1_epi32(kInitialState[i]);
+  }
+  const __m256i lane_blocks(_mm256_setr_epi32(
+      static_cast<int>(blocks[0]), static_cast<int>(blocks[1]),
+      static_cast<int>(blocks[2]), static_cast<int>(blocks[3]),
+      static_cast<int>(blocks[4]), static_cast<int>(blocks[5]),
+      static_cast<int>(blocks[6]), static_cast<int>(blocks[7])));
+
+  for (size_t block = 0; block < max_blocks; ++block) {
+    // Lanes whose message is shorter read their last block again, and
+    // have the result discarded below.
+    const unsigned char* p[Sha256MultiBuffer::kLanes];
+    for (size_t lane = 0; lane < Sha256MultiBuffer::kLanes; ++lane) {
+      const size_t b(block < blocks[lane] ? block
+                                          : (blocks[lane] ? blocks[lane] - 1
+                                                          : 0));
+      p[lane] = lanes[lane] + b * kBlockSize;
+    }
+
+    __m256i w[16];
+    for (int t = 0; t < 16; ++t) {
+      w[t] = _mm256_setr_epi32(LoadBigEndian32(p[0] + 4 * t),
+                               LoadBigEndian32(p[1] + 4 * t),
+                               LoadBigEndian32(p[2] + 4 * t),
+                               LoadBigEndian32(p[3] + 4 * t),
+                               LoadBigEndian32(p[4] + 4 * t),
+                               LoadBigEndian32(p[5] + 4 * t),
+                               LoadBigEndian32(p[6] + 4 * t),
+                               LoadBigEndian32(p[7] + 4 * t));
+    }
+
+    __m256i a(state[0]), b(state[1]), c(state[2]), d(state[3]);
+    __m256i e(state[4]), f(state[5]), g(state[6]), h(state[7]);
+    for (int t = 0; t < 64; ++t) {
+      if (t >= 16) {
+        const __m256i w15(w[(t - 15) & 15]);
+        const __m256i w2(w[(t - 2) & 15]);
+        const __m256i s0(
+            Xor3(Rotr(w15, 7), Rotr(w15, 18), _mm256_srli_epi32(w15, 3)));
+        const __m256i s1(
+            Xor3(Rotr(w2, 17), Rotr(w2, 19), _mm256_srli_epi32(w2, 10)));
+        w[t & 15] = Add(Add(w[t & 15], s0), Add(w[(t - 7) & 15], s1));
+      }
+      const __m256i s1(Xor3(Rotr(e, 6), Rotr(e, 11), Rotr(e, 25)));
+      const __m256i ch(
+          _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g)));
+      const __m256i t1(
+          Add(Add(Add(h, s1), Add(ch, _mm256_set1_epi32(kRoundConstants[t]))),
+              w[t & 15]));
+      const __m256i s0(Xor3(Rotr(a, 2), Rotr(a, 13), Rotr(a, 22)));
+      const __m256i maj(Xor3(_mm256_and_si256(a, b), _mm256_and_si256(a, c),
+                             _mm256_and_si256(b, c)));
+      const __m256i t2(Add(s0, maj));
+      h = g;
+      g = f;
+      f = e;
+      e = Add(d, t1);
+      d = c;
+      c = b;
+      b = a;
+      a = Add(t1, t2);
+    }
+
+    // Only update the lanes which still had a block to process.
+    const __m256i active(
+        _mm256_cmpgt_epi32(lane_blocks,
+                           _mm256_set1_epi32(static_cast<int>(block))));
+    const __m256i rounds[8] = {a, b, c, d, e, f, g, h};
+    for (int i = 0; i < 8; ++i) {
+      state[i] = _mm256_blendv_epi8(state[i], Add(state[i], rounds[i]),
+                                    active);
+    }
+  }
+
+  uint32_t words[8][Sha256MultiBuffer::kLanes];
+  for (int i = 0; i < 8; ++i) {
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(words[i]), state[i]);
+  }
+  for (size_t lane = 0; lane < Sha256MultiBuffer::kLanes; ++lane) {
+    if (blocks[lane] == 0)
+      continue;
+    for (int i = 0; i < 8; ++i) {
+      StoreBigEndian32(words[i][lane], out + lane * kDigestSize + 4 * i);
+    }
+  }
+}
+
+#undef MB_TARGET
+
+#endif  // HAVE_SHA256_AVX2
+
+
+}  // namespace
+
+
+// static
+bool Sha256MultiBuffer::Supported() {
+#ifdef HAVE_SHA256_AVX2
+  static const bool supported(__builtin_cpu_supports("avx2"));
+  return supported;
+#else
+  return false;
+#endif
+}
+
+
+// static
+void Sha256MultiBuffer::HashBatch(char prefix, const char* const* data,
+                                  const size_t* sizes, size_t count,
+                                  char* out) {
+  assert(Supported());
+#ifdef HAVE_SHA256_AVX2
+  vector<unsigned char> scratch;
+  for (size_t first = 0; first < count; first += kLanes) {
+    const size_t group(count - first < kLanes ? count - first : kLanes);
+
+    size_t offsets[kLanes];
+    size_t total(0);
+    for (size_t lane = 0; lane < group; ++lane) {
+      offsets[lane] = total;
+      total += PaddedSize(sizes[first + lane] + 1);
+    }
+    scratch.resize(total);
+    for (size_t lane = 0; lane < group; ++lane) {
+      PadMessage(prefix, data[first + lane], sizes[first + lane],
+                 scratch.data() + offsets[lane]);
+    }
+
+    const unsigned char* lanes[kLanes];
+    size_t blocks[kLanes];
+    for (size_t lane = 0; lane < kLanes; ++lane) {
+      if (lane < group) {
+        lanes[lane] = scratch.data() + offsets[lane];
+        blocks[lane] = PaddedSize(sizes[first + lane] + 1) / kBlockSize;
+      } else {
+        lanes[lane] = scratch.data();
+        blocks[lane] = 0;
+      }
+    }
+    HashLanesAvx2(lanes, blocks, out + first * kDigestSize);
+  }
+#else
+  (void)prefix;
+  (void)data;
+  (void)sizes;
+  (void)count;
+  (void)out;
+#endif
+}
@@ -0,0 +1,32 @@
+#ifndef CERT_TRANS_MERKLETREE_SHA256_MULTIBUFFER_H_
+#define CERT_TRANS_MERKLETREE_SHA256_MULTIBUFFER_H_
+
+#include <stddef.h>
+
+// Multi-buffer SHA-256: computes the digests of several independent
+// messages at once, one message per 32-bit SIMD lane, which is much
+// faster than hashing them one by one when the messages are short (as
+// Merkle tree nodes are).
+class Sha256MultiBuffer {
+ public:
+  // Number of messages hashed in parallel.
+  static const size_t kLanes = 8;
+
+  // True if the CPU supports the multi-buffer implementation (i.e., it
+  // is an x86-64 CPU with AVX2). If this returns false, HashBatch()
+  // must not be called.
+  static bool Supported();
+
+  // Computes the SHA-256 digests of |count| messages, where the i-th
+  // message is |prefix| followed by the |sizes[i]| bytes at |data[i]|.
+  // Writes 32 bytes per digest, back to back, starting at |out|.
+  // Messages need not be of the same length, but lanes are busy for as
+  // many blocks as the longest message of the group they are hashed in.
+  static void HashBatch(char prefix, const char* const* data,
+                        const size_t* sizes, size_t count, char* out);
+
+ private:
+  Sha256MultiBuffer() = delete;
+};
+
+#endif  // CERT_TRANS_MERKLETREE_SHA256_MULTIBUFFER_H_
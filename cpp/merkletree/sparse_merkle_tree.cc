@@ -1,14 +1,19 @@
 #include "cpp/merkletree/sparse_merkle_tree.h"
 
 #include <stddef.h>
+#include <string.h>
 #include <algorithm>
+#include <numeric>
 #include <vector>
 
 #include "merkletree/merkle_tree_math.h"
+#include "merkletree/serial_hasher.h"
+#include "util/parallel_for.h"
 #include "util/util.h"
 
 using std::make_pair;
 using std::ostream;
+using std::pair;
 using std::ostringstream;
 using std::reverse;
 using std::string;
@@ -17,25 +22,72 @@ using std::unordered_map;
 using std::vector;
 
 
-const vector<string>* GetNullHashes(const TreeHasher& hasher) {
-  static unique_ptr<const vector<string>> null_hashes;
-  if (!null_hashes) {
-    vector<string> r{hasher.HashLeaf("")};
-    const int end(hasher.DigestSize() * 8);
-    CHECK_LT(0, end);
-    for (int i(1); i < end; ++i) {
-      r.emplace_back(hasher.HashChildren(r.back(), r.back()));
+namespace {
+
+
+// The number of leading bits |a| and |b| have in common.
+size_t CommonPrefixBits(const SparseMerkleTree::Path& a,
+                        const SparseMerkleTree::Path& b) {
+  for (size_t i = 0; i < a.size(); ++i) {
+    if (a[i] != b[i]) {
+      return i * 8 + __builtin_clz(a[i] ^ b[i]) - 24;
     }
-    reverse(r.begin(), r.end());
-    null_hashes.reset(new vector<string>(std::move(r)));
   }
-  return null_hashes.get();
+  return a.size() * 8;
+}
+
+
+// The index of the node at the |depth|th level along |path|, as
+// SparseMerkleTree::SetLeafHash() numbers them.
+uint64_t PathIndex(const SparseMerkleTree::Path& path, size_t depth) {
+  uint64_t index(0);
+  for (size_t bit = 0; bit <= depth; ++bit) {
+    index = (index << 1) + PathBit(path, bit);
+  }
+  return index;
+}
+
+
+}  // namespace
+
+
+vector<string> CalculateNullHashes(const TreeHasher& hasher) {
+  vector<string> r{hasher.HashLeaf("")};
+  const int end(hasher.DigestSize() * 8);
+  CHECK_LT(0, end);
+  for (int i(1); i < end; ++i) {
+    r.emplace_back(hasher.HashChildren(r.back(), r.back()));
+  }
+  reverse(r.begin(), r.end());
+  return r;
 }
 
 
 SparseMerkleTree::SparseMerkleTree(SerialHasher* hasher)
+    : SparseMerkleTree(hasher, nullptr, 0) {
+}
+
+
+SparseMerkleTree::SparseMerkleTree(SerialHasher* hasher,
+                                   SparseMerkleTreeStore* store,
+                                   size_t cache_nodes)
     : treehasher_(unique_ptr<SerialHasher>(hasher)),
-      null_hashes_(GetNullHashes(treehasher_)) {
+      executor_(nullptr),
+      store_(store),
+      cache_nodes_(cache_nodes),
+      resident_depth_(kDigestSizeBits + 1) {
+  CHECK_EQ(sizeof(Digest), treehasher_.DigestSize());
+  const vector<string> null_hashes(CalculateNullHashes(treehasher_));
+  null_hashes_.resize(null_hashes.size());
+  for (size_t i = 0; i < null_hashes.size(); ++i) {
+    memcpy(null_hashes_[i].data(), null_hashes[i].data(), sizeof(Digest));
+  }
+
+  if (store_ && store_->GetRoot(&root_hash_)) {
+    CHECK_EQ(NodeSize(), root_hash_.size());
+    // All the nodes are in the store only.
+    resident_depth_ = 0;
+  }
 }
 
 
@@ -47,28 +99,78 @@ void SparseMerkleTree::EnsureHaveLevel(size_t level) {
 
 
 void SparseMerkleTree::SetLeaf(const Path& path, const string& data) {
-  CHECK_EQ(treehasher_.DigestSize(), path.size());
+  Digest leaf_hash;
+  treehasher_.HashLeaf(data.data(), data.size(), leaf_hash.data());
+  SetLeafHash(path, leaf_hash);
+}
+
+
+void SparseMerkleTree::SetLeaves(const vector<pair<Path, string>>& leaves) {
+  // Sort the updates by path, keeping only the last one for each path.
+  vector<size_t> order(leaves.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&leaves](size_t a, size_t b) {
+    return leaves[a].first < leaves[b].first;
+  });
+  vector<size_t> updates;
+  updates.reserve(order.size());
+  for (const size_t i : order) {
+    if (!updates.empty() && leaves[updates.back()].first == leaves[i].first) {
+      updates.back() = i;
+    } else {
+      updates.push_back(i);
+    }
+  }
+
+  vector<Digest> leaf_hashes(updates.size());
+  const auto hash_leaf([&](const TreeHasher& hasher, size_t i) {
+    const string& data(leaves[updates[i]].second);
+    hasher.HashLeaf(data.data(), data.size(), leaf_hashes[i].data());
+  });
+  if (executor_) {
+    util::ParallelFor(executor_, updates.size(), [&](size_t i) {
+      hash_leaf(TreeHasher(treehasher_.CreateSerialHasher()), i);
+    });
+  } else {
+    for (size_t i = 0; i < updates.size(); ++i) {
+      hash_leaf(treehasher_, i);
+    }
+  }
+
+  for (size_t i = 0; i < updates.size(); ++i) {
+    SetLeafHash(leaves[updates[i]].first, leaf_hashes[i]);
+  }
+}
+
+
+void SparseMerkleTree::SetLeafHash(const Path& path,
+                                   const Digest& leaf_hash) {
   // Mark the tree dirty:
   root_hash_.clear();
-  string leaf_hash(treehasher_.HashLeaf(data));
 
   IndexType node_index(0);
   for (int depth(0); depth <= kDigestSizeBits; ++depth) {
     node_index += PathBit(path, depth);
-    EnsureHaveLevel(depth);
-    auto it(tree_[depth].find(node_index));
-    if (it == tree_[depth].end()) {
+    if (store_) {
+      // Hashing the parent will need the sibling too.
+      FindNode(depth, node_index ^ 1);
+    }
+    TreeNode* const node(FindNode(depth, node_index));
+    MarkUnsaved(depth, node_index);
+    if (!node) {
+      EnsureHaveLevel(depth);
       CHECK(tree_[depth]
                 .emplace(make_pair(node_index, TreeNode(path, leaf_hash)))
                 .second);
       return;
-    } else if (it->second.type_ == TreeNode::INTERNAL) {
+    } else if (node->type_ == TreeNode::INTERNAL) {
       // Mark the internal node hash dirty
-      it->second.hash_.clear();
-    } else if (*it->second.path_ == path) {
+      node->dirty_ = true;
+    } else if (node->leaf_->path == path) {
       // replacement
-      CHECK_EQ(TreeNode::LEAF, it->second.type_);
-      it->second.hash_ = std::move(leaf_hash);
+      CHECK_EQ(TreeNode::LEAF, node->type_);
+      node->leaf_->leaf_hash = leaf_hash;
+      node->dirty_ = true;
       return;
     } else {
       // restructure: push the existing node down a level and replace this one
@@ -76,16 +178,114 @@ void SparseMerkleTree::SetLeaf(const Path& path, const string& data) {
       CHECK_LT(depth, kDigestSizeBits);
       EnsureHaveLevel(depth + 1);
       IndexType child_index((node_index << 1) +
-                            PathBit(*it->second.path_, depth + 1));
+                            PathBit(node->leaf_->path, depth + 1));
+      // The leaf subtree hash depends on the depth the leaf is stored at.
+      node->dirty_ = true;
       CHECK(tree_[depth + 1]
-                .emplace(make_pair(child_index, std::move(it->second)))
+                .emplace(make_pair(child_index, std::move(*node)))
                 .second);
-      it->second.type_ = TreeNode::INTERNAL;
-      it->second.hash_.clear();
+      MarkUnsaved(depth + 1, child_index);
+      *node = TreeNode();
     }
     node_index <<= 1;
   }
-  LOG(FATAL) << "Failed to set " << path << " to " << data;
+  LOG(FATAL) << "Failed to set " << path;
+}
+
+
+SparseMerkleTree::TreeNode* SparseMerkleTree::FindNode(size_t depth,
+                                                       IndexType index) {
+  if (depth < tree_.size()) {
+    auto it(tree_[depth].find(index));
+    if (it != tree_[depth].end()) {
+      return &it->second;
+    }
+  }
+
+  string data;
+  if (!store_ || depth < resident_depth_ ||
+      !store_->GetNode(depth, index, &data)) {
+    return nullptr;
+  }
+  EnsureHaveLevel(depth);
+  auto loaded(tree_[depth].emplace(index, DeserializeNode(data)));
+  CHECK(loaded.second);
+  return &loaded.first->second;
+}
+
+
+void SparseMerkleTree::Flush(const vector<pair<string, string>>& values) {
+  CHECK(store_) << "Flushing a tree without a store";
+  const string root(CurrentRoot());
+
+  std::sort(unsaved_.begin(), unsaved_.end());
+  unsaved_.erase(std::unique(unsaved_.begin(), unsaved_.end()),
+                 unsaved_.end());
+  vector<SparseMerkleTreeStore::Node> nodes;
+  nodes.reserve(unsaved_.size());
+  for (const auto& unsaved : unsaved_) {
+    nodes.push_back(SparseMerkleTreeStore::Node{
+        unsaved.first, unsaved.second,
+        SerializeNode(tree_[unsaved.first].at(unsaved.second))});
+  }
+  store_->Write(nodes, values, root);
+  unsaved_.clear();
+
+  // Every update goes through the top of the tree, so evict whole levels
+  // from the bottom up.
+  size_t cached(CachedNodes());
+  for (size_t depth = tree_.size(); depth > 0 && cached > cache_nodes_;
+       --depth) {
+    cached -= tree_[depth - 1].size();
+    unordered_map<IndexType, TreeNode>().swap(tree_[depth - 1]);
+    resident_depth_ = std::min(resident_depth_, depth - 1);
+  }
+}
+
+
+size_t SparseMerkleTree::CachedNodes() const {
+  size_t count(0);
+  for (const auto& level : tree_) {
+    count += level.size();
+  }
+  return count;
+}
+
+
+string SparseMerkleTree::SerializeNode(const TreeNode& node) {
+  CHECK(!node.dirty_);
+  string data(1, node.type_ == TreeNode::LEAF ? 'L' : 'I');
+  data.append(node.hash_.data(), node.hash_.size());
+  if (node.type_ == TreeNode::LEAF) {
+    data.append(reinterpret_cast<const char*>(node.leaf_->path.data()),
+                node.leaf_->path.size());
+    data.append(node.leaf_->leaf_hash.data(), node.leaf_->leaf_hash.size());
+  }
+  return data;
+}
+
+
+SparseMerkleTree::TreeNode SparseMerkleTree::DeserializeNode(
+    const string& data) {
+  const size_t internal_size(1 + sizeof(Digest));
+  const size_t leaf_size(internal_size + sizeof(Path) + sizeof(Digest));
+  CHECK(!data.empty());
+  TreeNode node;
+  if (data[0] == 'L') {
+    CHECK_EQ(leaf_size, data.size());
+    Path path;
+    Digest leaf_hash;
+    memcpy(path.data(), data.data() + internal_size, sizeof(Path));
+    memcpy(leaf_hash.data(), data.data() + internal_size + sizeof(Path),
+           sizeof(Digest));
+    node = TreeNode(path, leaf_hash);
+  } else {
+    CHECK_EQ('I', data[0]) << "Unknown node type";
+    CHECK_EQ(internal_size, data.size());
+  }
+  memcpy(node.hash_.data(), data.data() + 1, sizeof(Digest));
+  node.dirty_ = false;
+  return node;
 }
 
 
@@ -115,60 +315,187 @@ string SparseMerkleTree::Dump() const {
 }
 
 
-string SparseMerkleTree::CalculateSubtreeHash(size_t depth, IndexType index) {
+void SparseMerkleTree::CalculateSubtreeHash(const TreeHasher& hasher,
+                                            size_t depth, IndexType index,
+                                            char* out) {
+  const size_t node_size(NodeSize());
   if (tree_.size() <= depth) {
-    return null_hashes_->at(depth);
+    memcpy(out, null_hashes_.at(depth).data(), node_size);
+    return;
   }
 
   auto it(tree_[depth].find(index));
-  if (it != tree_[depth].end()) {
-    switch (it->second.type_) {
+  if (it == tree_[depth].end()) {
+    memcpy(out, null_hashes_.at(depth).data(), node_size);
+    return;
+  }
+
+  TreeNode* const node(&it->second);
+  if (node->dirty_) {
+    char* const hash(node->hash_.data());
+    switch (node->type_) {
       case TreeNode::INTERNAL: {
-        if (!it->second.hash_.empty()) {
-          return it->second.hash_;
-        }
         IndexType left_child_index(index << 1);
-        const string left(CalculateSubtreeHash(depth + 1, left_child_index));
-        const string right(
-            CalculateSubtreeHash(depth + 1, left_child_index + 1));
-        it->second.hash_.assign(treehasher_.HashChildren(left, right));
-        return it->second.hash_;
+        char left[SerialHasher::kMaxDigestSize];
+        char right[SerialHasher::kMaxDigestSize];
+        CalculateSubtreeHash(hasher, depth + 1, left_child_index, left);
+        CalculateSubtreeHash(hasher, depth + 1, left_child_index + 1, right);
+        hasher.HashChildren(left, right, hash);
+        break;
       }
 
-      case TreeNode::LEAF: {
-        string ret(it->second.hash_);
-        const int64_t signed_depth(depth);
-        CHECK_LE(0, signed_depth);
-        for (int i(kDigestSizeBits - 1); i > signed_depth; --i) {
-          if (PathBit(*(it->second.path_), i) == 0) {
-            ret = treehasher_.HashChildren(ret, null_hashes_->at(i));
-          } else {
-            ret = treehasher_.HashChildren(null_hashes_->at(i), ret);
-          }
-        }
-        // TODO(alcutter): maybe cache this?
-        return ret;
+      case TreeNode::LEAF:
+        CalculateLeafSubtreeHash(hasher, *node->leaf_, depth, hash);
+        break;
+
+      default:
+        LOG(FATAL) << "Unknown node type " << static_cast<int>(node->type_)
+                   << " !";
+    }
+    node->dirty_ = false;
+  }
+  memcpy(out, node->hash_.data(), node_size);
+}
+
+
+void SparseMerkleTree::CalculateLeafSubtreeHash(
+    const TreeHasher& hasher, const TreeNode::LeafData& leaf, size_t depth,
+    char* out) const {
+  memcpy(out, leaf.leaf_hash.data(), NodeSize());
+  const int64_t signed_depth(depth);
+  CHECK_LE(0, signed_depth);
+  for (int i(kDigestSizeBits - 1); i > signed_depth; --i) {
+    if (PathBit(leaf.path, i) == 0) {
+      hasher.HashChildren(out, null_hashes_[i].data(), out);
+    } else {
+      hasher.HashChildren(null_hashes_[i].data(), out, out);
+    }
+  }
+}
+
+
+string SparseMerkleTree::NodeHash(size_t depth, IndexType index) {
+  const TreeNode* const node(FindNode(depth, index));
+  if (!node) {
+    return string(null_hashes_[depth].data(), NodeSize());
+  }
+  CHECK(!node->dirty_);
+  return string(node->hash_.data(), NodeSize());
+}
+
+
+void SparseMerkleTree::CalculateDirtySubtreesInParallel() {
+  // Collect the dirty nodes first: the hashing does not change the
+  // structure of the tree, so the threads can then look up nodes
+  // concurrently, and each of them only writes to its own subtree.
+  vector<pair<size_t, IndexType>> dirty;
+  for (size_t depth = 0; depth <= kParallelDepth && depth < tree_.size();
+       ++depth) {
+    for (const auto& node : tree_[depth]) {
+      if (node.second.dirty_ &&
+          (node.second.type_ == TreeNode::LEAF || depth == kParallelDepth)) {
+        dirty.emplace_back(depth, node.first);
       }
     }
-    LOG(FATAL) << "Unknown node type " << it->second.type_ << " !";
+  }
+  if (dirty.size() < 2) {
+    return;
   }
 
-  return null_hashes_->at(depth);
+  util::ParallelFor(executor_, dirty.size(), [&](size_t i) {
+    const TreeHasher hasher(treehasher_.CreateSerialHasher());
+    char hash[SerialHasher::kMaxDigestSize];
+    CalculateSubtreeHash(hasher, dirty[i].first, dirty[i].second, hash);
+  });
 }
 
 
 string SparseMerkleTree::CurrentRoot() {
   if (root_hash_.empty()) {
-    root_hash_ = treehasher_.HashChildren(CalculateSubtreeHash(0, 0),
-                                          CalculateSubtreeHash(0, 1));
+    if (executor_) {
+      CalculateDirtySubtreesInParallel();
+    }
+    char left[SerialHasher::kMaxDigestSize];
+    char right[SerialHasher::kMaxDigestSize];
+    CalculateSubtreeHash(treehasher_, 0, 0, left);
+    CalculateSubtreeHash(treehasher_, 0, 1, right);
+    treehasher_.HashChildren(left, right, left);
+    root_hash_.assign(left, NodeSize());
   }
   return root_hash_;
 }
 
 
-std::vector<string> SparseMerkleTree::InclusionProof(const Path& path) {
-  // TODO(alcutter): implement
-  LOG(FATAL) << "Not implemented.";
+vector<string> SparseMerkleTree::InclusionProof(const Path& path) {
+  return InclusionProofs({path}).front();
+}
+
+
+vector<vector<string>> SparseMerkleTree::InclusionProofs(
+    const vector<Path>& paths) {
+  // Every node has its hash from then on.
+  CurrentRoot();
+
+  vector<size_t> order(paths.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::sort(order.begin(), order.end(), [&paths](size_t a, size_t b) {
+    return paths[a] < paths[b];
+  });
+
+  vector<vector<string>> proofs(paths.size());
+  // The siblings along the previous path, from the top down.
+  vector<string> siblings;
+  const Path* previous(nullptr);
+  // Where the walk down the previous path ended, at an empty subtree
+  // or at a leaf, and that leaf if any (copied, as loading nodes may
+  // move them).
+  size_t end_depth(kDigestSizeBits);
+  bool end_is_leaf(false);
+  TreeNode::LeafData end_leaf;
+  for (const size_t i : order) {
+    const Path& path(paths[i]);
+    // The siblings above the first bit where the paths part are the
+    // same, and so is the end of the walk if it is above it too.
+    const size_t common(previous ? CommonPrefixBits(*previous, path) : 0);
+    siblings.resize(std::min<size_t>(siblings.size(), common));
+    if (end_depth >= common) {
+      end_depth = kDigestSizeBits;
+      end_is_leaf = false;
+    }
+    // Below the end of the walk, the only sibling which is not empty is
+    // where |path| parts from the leaf there, if any.
+    size_t leaf_depth(end_is_leaf ? CommonPrefixBits(end_leaf.path, path)
+                                  : kDigestSizeBits);
+
+    for (size_t depth = siblings.size(); depth < kDigestSizeBits; ++depth) {
+      if (depth > end_depth) {
+        if (depth == leaf_depth) {
+          char hash[SerialHasher::kMaxDigestSize];
+          CalculateLeafSubtreeHash(treehasher_, end_leaf, depth, hash);
+          siblings.emplace_back(hash, NodeSize());
+        } else {
+          siblings.emplace_back(null_hashes_[depth].data(), NodeSize());
+        }
+        continue;
+      }
+
+      const IndexType index(PathIndex(path, depth));
+      siblings.push_back(NodeHash(depth, index ^ 1));
+      const TreeNode* const node(FindNode(depth, index));
+      if (!node || node->type_ == TreeNode::LEAF) {
+        end_depth = depth;
+        end_is_leaf = node != nullptr;
+        if (end_is_leaf) {
+          end_leaf = *node->leaf_;
+          leaf_depth = CommonPrefixBits(end_leaf.path, path);
+        }
+      }
+    }
+
+    proofs[i].assign(siblings.rbegin(), siblings.rend());
+    previous = &path;
+  }
+  return proofs;
 }
 
 
@@ -185,15 +512,15 @@ string SparseMerkleTree::TreeNode::DebugString() const {
   }
 
   os << " hash: ";
-  if (!hash_.empty()) {
-    os << util::ToBase64(hash_);
+  if (!dirty_) {
+    os << util::ToBase64(string(hash_.data(), hash_.size()));
   } else {
     os << "(unset)";
   }
 
-  if (path_) {
+  if (leaf_) {
     os << " path: ";
-    os << *path_;
+    os << leaf_->path;
   }
   os << "]";
   return os.str();
@@ -3,9 +3,11 @@
 
 #include <glog/logging.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <array>
 #include <string>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include "merkletree/merkle_tree_interface.h"
@@ -13,12 +15,59 @@
 
 class SerialHasher;
 
+namespace util {
+class Executor;
+}  // namespace util
 
-// Calculates the set of "null" hashes:
+
+// Calculates the set of "null" hashes with |hasher|:
 // ...H(H(H("")||H(""))||H("")||(H(""))||...)...
+// indexed by the depth of the empty subtree they are the root of, from
+// just below the root of the tree (0) to the leaves.
 //
 // Visible out here because it's useful for testing too.
-const std::vector<std::string>* GetNullHashes(const TreeHasher& hasher);
+std::vector<std::string> CalculateNullHashes(const TreeHasher& hasher);
+
+
+// Persistent storage for the nodes of a SparseMerkleTree.
+//
+// A node is identified by its depth and index (see SparseMerkleTree),
+// and stored in the tree's own serialization. Stores also keep the root
+// of the tree, and opaque values that users of the tree (such as
+// VerifiableMap) write along with the nodes, so that both stay
+// consistent.
+class SparseMerkleTreeStore {
+ public:
+  struct Node {
+    size_t depth;
+    uint64_t index;
+    std::string data;
+  };
+
+  virtual ~SparseMerkleTreeStore() = default;
+
+  // Fills |data| with the node at |depth| and |index| and returns true,
+  // or returns false if there is no such node.
+  virtual bool GetNode(size_t depth, uint64_t index, std::string* data) = 0;
+
+  // Fills |root| with the last root written and returns true, or
+  // returns false if nothing was written yet.
+  virtual bool GetRoot(std::string* root) = 0;
+
+  // Fills |value| with the value for |key| and returns true, or returns
+  // false if there is no such value.
+  virtual bool GetValue(const std::string& key, std::string* value) = 0;
+
+  // Writes (or overwrites) |nodes| and |values|, and sets the root to
+  // |root|, atomically.
+  virtual void Write(
+      const std::vector<Node>& nodes,
+      const std::vector<std::pair<std::string, std::string>>& values,
+      const std::string& root) = 0;
+
+ protected:
+  SparseMerkleTreeStore() = default;
+};
 
 
 /* Implementation of a Sparse Merkle Tree.
@@ -102,8 +151,22 @@ const std::vector<std::string>* GetNullHashes(const TreeHasher& hasher);
  *
  * * Calculating the root hash
  * Calculating the root of the tree is similar to a regular MerkleTree, but is
- * optimised by cribbing the value of "missing" nodes from a simple cache. This
- * removes the need to calculate the vast majority of nodes from scratch.
+ * optimised by cribbing the value of "missing" nodes from a table of the
+ * empty subtree hashes, built when the tree is constructed. This removes the
+ * need to calculate the vast majority of nodes from scratch.
+ *
+ * * Memory use
+ * Nodes keep their hash in a fixed size array; leaves keep their path and
+ * leaf hash in a separate allocation, so that internal nodes do not pay for
+ * them.
+ *
+ * * Persistence
+ * A tree may be backed by a SparseMerkleTreeStore: Flush() writes the nodes
+ * changed since the previous Flush() to it, and then evicts whole levels
+ * from the bottom of the tree until at most |cache_nodes| nodes are left in
+ * memory. Nodes that are not in memory are loaded from the store as the
+ * updates reach them, along with their siblings, so that every node needed
+ * to recompute the root is in memory by the time CurrentRoot() is called.
  *
  * TODO(alcutter): LOTS!
  *
@@ -137,6 +200,24 @@ class SparseMerkleTree {
   // Takes ownership of the hasher.
   explicit SparseMerkleTree(SerialHasher* hasher);
 
+  // Default number of nodes kept in memory after a Flush() (about 100 MB).
+  static const size_t kDefaultCacheNodes = 1 << 20;
+
+  // A tree backed by |store|, starting from what was last flushed to
+  // it, or kept in memory only if |store| is NULL. Takes ownership of
+  // the hasher, but not of |store|, which must outlive the tree.
+  SparseMerkleTree(SerialHasher* hasher, SparseMerkleTreeStore* store,
+                   size_t cache_nodes = kDefaultCacheNodes);
+
+  // Hash the leaves of SetLeaves() batches, and the dirty subtrees below
+  // the top levels of the tree in CurrentRoot(), in parallel on
+  // |executor|, which must outlive the tree (or be reset with nullptr
+  // first). The results are identical to serial evaluation. Passing
+  // nullptr (the default) hashes everything on the calling thread.
+  void SetExecutor(util::Executor* executor) {
+    executor_ = executor;
+  }
+
   // Length of a node (i.e., a hash), in bytes.
   virtual size_t NodeSize() const {
     return treehasher_.DigestSize();
@@ -154,6 +235,13 @@ class SparseMerkleTree {
   // @param path Binary path of node to set.
   virtual void SetLeaf(const Path& path, const std::string& data);
 
+  // Same as calling SetLeaf() for each of |leaves| in turn (so if a path
+  // is set more than once, the last value wins), but sorts the updates
+  // by path first, and hashes the leaves on the executor, if any.
+  // Like SetLeaf(), this only marks the touched nodes dirty: each of
+  // them is hashed once, by the next CurrentRoot().
+  void SetLeaves(const std::vector<std::pair<Path, std::string>>& leaves);
+
   // Get the current root of the tree.
   // Update the root to reflect the current shape of the tree,
   // and return the tree digest.
@@ -166,13 +254,28 @@ class SparseMerkleTree {
   //
   // Returns a vector of node hashes, ordered by levels from leaf to root.
   // The first element is the sibling of the leaf hash, and the last element
-  // is one below the root.
-  // Returns an empty vector if the tree is not large enough
-  // or the leaf index is 0.
+  // is one below the root, so there are always kDigestSizeBits of them,
+  // mostly null hashes. If |path| is not set, this proves that the leaf
+  // there is empty, i.e. that its hash is LeafHash("").
   //
   // @param path the path of the leaf whose inclusion proof to return.
   std::vector<std::string> InclusionProof(const Path& path);
 
+  // Same as calling InclusionProof() for each of |paths|, but goes
+  // through them in order, so that the nodes at the top of the tree,
+  // which the paths have in common, are only looked up once.
+  std::vector<std::vector<std::string>> InclusionProofs(
+      const std::vector<Path>& paths);
+
+  // Writes the current root, the nodes changed since the previous call
+  // and |values| to the store, at once, then trims the nodes kept in
+  // memory. The tree must have a store.
+  void Flush(const std::vector<std::pair<std::string, std::string>>& values =
+                 std::vector<std::pair<std::string, std::string>>());
+
+  // Number of nodes currently in memory.
+  size_t CachedNodes() const;
+
   std::string Dump() const;
 
  private:
@@ -182,22 +285,78 @@ class SparseMerkleTree {
   // TODO(alcutter): BIGNUM probably.
   typedef uint64_t IndexType;
 
+  typedef std::array<char, kDigestSizeBits / 8> Digest;
+
   struct TreeNode {
-    TreeNode(const std::string& hash) : type_(INTERNAL), hash_(hash) {
+    // A dirty INTERNAL node.
+    TreeNode() : type_(INTERNAL), dirty_(true) {
     }
 
-    TreeNode(const Path& path, const std::string& leaf_hash)
-        : type_(LEAF), path_(new Path(path)), hash_(leaf_hash) {
+    // A dirty LEAF node.
+    TreeNode(const Path& path, const Digest& leaf_hash)
+        : type_(LEAF), dirty_(true), leaf_(new LeafData{path, leaf_hash}) {
     }
 
     std::string DebugString() const;
 
-    enum { INTERNAL, LEAF } type_;
-    std::unique_ptr<Path> path_;
-    std::string hash_;
+    struct LeafData {
+      Path path;
+      Digest leaf_hash;
+    };
+
+    enum : uint8_t { INTERNAL, LEAF } type_;
+    // True if |hash_| has to be recalculated.
+    bool dirty_;
+    // The hash of the subtree rooted at this node. For LEAF nodes, that
+    // is the leaf hash hashed up with the null hashes of the levels
+    // below the node.
+    Digest hash_;
+    // Only set for LEAF nodes.
+    std::unique_ptr<LeafData> leaf_;
   };
 
-  std::string CalculateSubtreeHash(size_t depth, IndexType index);
+  // Levels at the top of the tree are hashed serially, the dirty
+  // subtrees and leaves from this level up in parallel.
+  static const size_t kParallelDepth = 8;
+
+  // Stores |leaf_hash| at |path|, and marks the nodes above it dirty.
+  void SetLeafHash(const Path& path, const Digest& leaf_hash);
+
+  // The node at |index| of the |depth|th level, loading it from the
+  // store if need be, or NULL if there is none.
+  TreeNode* FindNode(size_t depth, IndexType index);
+
+  // Notes that the node at |index| of the |depth|th level must be
+  // written by the next Flush().
+  void MarkUnsaved(size_t depth, IndexType index) {
+    if (store_) {
+      unsaved_.emplace_back(depth, index);
+    }
+  }
+
+  static std::string SerializeNode(const TreeNode& node);
+  static TreeNode DeserializeNode(const std::string& data);
+
+  // Writes the hash of the subtree at the |depth|th level which only
+  // holds |leaf| to |out|, using |hasher|.
+  void CalculateLeafSubtreeHash(const TreeHasher& hasher,
+                                const TreeNode::LeafData& leaf,
+                                size_t depth, char* out) const;
+
+  // The hash of the subtree at |index| of the |depth|th level, which
+  // must have been calculated already.
+  std::string NodeHash(size_t depth, IndexType index);
+
+  // Writes the hash of the subtree at |index| of the |depth|th level to
+  // |out|, using |hasher|. Dirty nodes of the subtree are hashed and
+  // cached along the way, so this may be called concurrently for
+  // disjoint subtrees, with different hashers.
+  void CalculateSubtreeHash(const TreeHasher& hasher, size_t depth,
+                            IndexType index, char* out);
+
+  // Hashes the dirty subtrees of level kParallelDepth, and the dirty
+  // leaves above it, on |executor_|.
+  void CalculateDirtySubtreesInParallel();
 
   void DumpTree(std::ostream* os, size_t depth, IndexType index) const;
 
@@ -209,10 +368,22 @@ class SparseMerkleTree {
   void EnsureHaveLevel(size_t n);
 
   TreeHasher treehasher_;
-  const std::vector<std::string>* const null_hashes_;
+  // The hashes of the empty subtrees at each depth, see
+  // CalculateNullHashes().
+  std::vector<Digest> null_hashes_;
   // TODO(alcutter): investigate other structures
   std::vector<std::unordered_map<IndexType, TreeNode>> tree_;
   std::string root_hash_;
+  // If not NULL, used to hash large updates in parallel.
+  util::Executor* executor_;
+  // If not NULL, where the nodes are persisted.
+  SparseMerkleTreeStore* const store_;
+  const size_t cache_nodes_;
+  // The levels above this one are all in memory, the others may be
+  // partly in the store only.
+  size_t resident_depth_;
+  // The nodes changed since the last Flush(), possibly more than once.
+  std::vector<std::pair<size_t, IndexType>> unsaved_;
 };
 
 
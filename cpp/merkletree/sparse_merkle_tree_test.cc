@@ -10,6 +10,7 @@
 #include "merkletree/sparse_merkle_tree.h"
 #include "util/openssl_scoped_types.h"
 #include "util/testing.h"
+#include "util/thread_pool.h"
 #include "util/util.h"
 
 namespace {
@@ -34,6 +35,61 @@ const char kEmptyRootHashB64[] =
     "xmifEIEqCYCXbZUz2Dh1KCFmFZVn7DUVVxbBQTr1PWo=";
 
 
+class MemoryStore : public SparseMerkleTreeStore {
+ public:
+  MemoryStore() : gets_(0) {
+  }
+
+  bool GetNode(size_t depth, uint64_t index, string* data) override {
+    ++gets_;
+    return Get(nodes_, std::make_pair(depth, index), data);
+  }
+
+  bool GetRoot(string* root) override {
+    if (root_.empty())
+      return false;
+    *root = root_;
+    return true;
+  }
+
+  bool GetValue(const string& key, string* value) override {
+    return Get(values_, key, value);
+  }
+
+  void Write(const vector<Node>& nodes,
+             const vector<pair<string, string>>& values,
+             const string& root) override {
+    for (const auto& node : nodes) {
+      nodes_[std::make_pair(node.depth, node.index)] = node.data;
+    }
+    for (const auto& value : values) {
+      values_[value.first] = value.second;
+    }
+    root_ = root;
+  }
+
+  size_t NodeCount() const {
+    return nodes_.size();
+  }
+
+  int gets_;
+
+ private:
+  template <class Key>
+  static bool Get(const map<Key, string>& m, const Key& key, string* value) {
+    const auto it(m.find(key));
+    if (it == m.end())
+      return false;
+    *value = it->second;
+    return true;
+  }
+
+  map<pair<size_t, uint64_t>, string> nodes_;
+  map<string, string> values_;
+  string root_;
+};
+
+
 struct KeyComp {
   const BIGNUM* AsBN(const ScopedBIGNUM& a) const {
     return a.get();
@@ -341,6 +397,148 @@ TEST_F(SparseMerkleTreeTest, TestSetLeaf) {
 }
 
 
+// Batched updates must produce exactly the same trees as setting the
+// leaves one at a time, in the same order.
+TEST_F(SparseMerkleTreeTest, SetLeavesMatchesSetLeaf) {
+  cert_trans::ThreadPool pool(4);
+  SparseMerkleTree serial(new Sha256Hasher);
+  SparseMerkleTree parallel(new Sha256Hasher);
+  parallel.SetExecutor(&pool);
+
+  vector<SparseMerkleTree::Path> paths;
+  for (const size_t update : {1, 3, 1000, 1, 5000}) {
+    vector<pair<SparseMerkleTree::Path, string>> leaves;
+    for (size_t i = 0; i < update; ++i) {
+      // Overwrite some existing leaves, and some of the new ones twice.
+      if (!paths.empty() && rand_() % 4 == 0) {
+        leaves.emplace_back(paths[rand_() % paths.size()], to_string(i));
+      } else {
+        paths.push_back(i % 2 ? RandomPath() : PathLow(rand_()));
+        leaves.emplace_back(paths.back(), to_string(i));
+      }
+      tree_.SetLeaf(leaves.back().first, leaves.back().second);
+    }
+    serial.SetLeaves(leaves);
+    parallel.SetLeaves(leaves);
+    const string root(ToBase64(tree_.CurrentRoot()));
+    EXPECT_EQ(root, ToBase64(serial.CurrentRoot()));
+    EXPECT_EQ(root, ToBase64(parallel.CurrentRoot()));
+  }
+}
+
+
+TEST_F(SparseMerkleTreeTest, FlushAndReload) {
+  MemoryStore store;
+  vector<pair<SparseMerkleTree::Path, string>> leaves;
+  {
+    SparseMerkleTree stored(new Sha256Hasher, &store, 0);
+    for (int i = 0; i < 1000; ++i) {
+      leaves.emplace_back(i % 2 ? RandomPath() : PathLow(rand_()),
+                          to_string(i));
+      tree_.SetLeaf(leaves.back().first, leaves.back().second);
+      stored.SetLeaf(leaves.back().first, leaves.back().second);
+      if (i % 100 == 0) {
+        stored.Flush();
+        // Everything was evicted.
+        EXPECT_EQ(0U, stored.CachedNodes());
+      }
+    }
+    EXPECT_EQ(ToBase64(tree_.CurrentRoot()), ToBase64(stored.CurrentRoot()));
+    stored.Flush();
+  }
+  EXPECT_LT(1000U, store.NodeCount());
+  store.gets_ = 0;
+
+  // A new tree picks up where the previous one stopped, loading nodes
+  // as it needs them.
+  SparseMerkleTree reloaded(new Sha256Hasher, &store, 100);
+  EXPECT_EQ(0U, reloaded.CachedNodes());
+  EXPECT_EQ(ToBase64(tree_.CurrentRoot()), ToBase64(reloaded.CurrentRoot()));
+  EXPECT_EQ(0, store.gets_);
+
+  for (int i = 0; i < 200; ++i) {
+    const SparseMerkleTree::Path path(
+        i % 2 ? leaves[rand_() % leaves.size()].first : RandomPath());
+    tree_.SetLeaf(path, "new " + to_string(i));
+    reloaded.SetLeaf(path, "new " + to_string(i));
+  }
+  EXPECT_EQ(ToBase64(tree_.CurrentRoot()), ToBase64(reloaded.CurrentRoot()));
+  reloaded.Flush();
+  EXPECT_GE(100U, reloaded.CachedNodes());
+  EXPECT_EQ(ToBase64(tree_.CurrentRoot()),
+            ToBase64(SparseMerkleTree(new Sha256Hasher, &store).CurrentRoot()));
+}
+
+
+// The root which |proof| leads to from |leaf_hash| at |path|.
+string RootFromProof(const TreeHasher& hasher,
+                     const SparseMerkleTree::Path& path,
+                     const string& leaf_hash, const vector<string>& proof) {
+  CHECK_EQ(static_cast<size_t>(SparseMerkleTree::kDigestSizeBits),
+           proof.size());
+  string hash(leaf_hash);
+  for (size_t i = 0; i < proof.size(); ++i) {
+    const int bit(PathBit(path, proof.size() - 1 - i));
+    hash = bit == 0 ? hasher.HashChildren(hash, proof[i])
+                    : hasher.HashChildren(proof[i], hash);
+  }
+  return hash;
+}
+
+
+TEST_F(SparseMerkleTreeTest, InclusionProof) {
+  const string empty_leaf(tree_hasher_.HashLeaf(""));
+  const SparseMerkleTree::Path unset(RandomPath());
+  EXPECT_EQ(ToBase64(tree_.CurrentRoot()),
+            ToBase64(RootFromProof(tree_hasher_, unset, empty_leaf,
+                                   tree_.InclusionProof(unset))));
+
+  vector<SparseMerkleTree::Path> paths;
+  for (int i = 0; i < 100; ++i) {
+    paths.push_back(RandomPath());
+    tree_.SetLeaf(paths.back(), to_string(i));
+  }
+  const string root(ToBase64(tree_.CurrentRoot()));
+  for (int i = 0; i < 100; ++i) {
+    EXPECT_EQ(root, ToBase64(RootFromProof(
+                        tree_hasher_, paths[i], tree_hasher_.HashLeaf(
+                                                    to_string(i)),
+                        tree_.InclusionProof(paths[i]))));
+  }
+
+  // Paths which are not set, including ones which part from a leaf
+  // below where it is stored.
+  SparseMerkleTree::Path near(paths[0]);
+  near.back() ^= 1;
+  for (const SparseMerkleTree::Path& path : {unset, near}) {
+    EXPECT_EQ(root, ToBase64(RootFromProof(tree_hasher_, path, empty_leaf,
+                                           tree_.InclusionProof(path))));
+  }
+}
+
+
+TEST_F(SparseMerkleTreeTest, InclusionProofsMatchInclusionProof) {
+  vector<SparseMerkleTree::Path> paths;
+  for (int i = 0; i < 1000; ++i) {
+    paths.push_back(RandomPath());
+    tree_.SetLeaf(paths.back(), to_string(i));
+  }
+  // Not set, some twice, and out of order.
+  vector<SparseMerkleTree::Path> asked{paths[10], RandomPath(), paths[3],
+                                      paths[10]};
+  asked[1][0] = paths[3][0];
+  for (int i = 0; i < 100; ++i) {
+    asked.push_back(paths[rand_() % paths.size()]);
+  }
+
+  const vector<vector<string>> proofs(tree_.InclusionProofs(asked));
+  ASSERT_EQ(asked.size(), proofs.size());
+  for (size_t i = 0; i < asked.size(); ++i) {
+    EXPECT_EQ(tree_.InclusionProof(asked[i]), proofs[i]) << i;
+  }
+}
+
+
 // TODO(alcutter): Lots and lots more tests.
 
 
@@ -0,0 +1,300 @@
+#include "merkletree/tiled_merkle_tree.h"
+
+#include <assert.h>
+#include <glog/logging.h>
+
+#include "merkletree/merkle_tree_math.h"
+#include "merkletree/serial_hasher.h"
+
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+const size_t TiledMerkleTree::kTileHeight;
+const size_t TiledMerkleTree::kTileWidth;
+const size_t TiledMerkleTree::kDefaultCacheTiles;
+
+namespace {
+
+// Tile indices are well below 2^56 for any tree that fits in 64 bits.
+const int kCacheKeyLevelShift = 56;
+
+
+uint64_t CacheKey(size_t tile_level, size_t index) {
+  return (static_cast<uint64_t>(tile_level) << kCacheKeyLevelShift) | index;
+}
+
+
+// Offset, in nodes, of row |row| in an expanded tile.
+size_t RowOffset(size_t row) {
+  return 2 * TiledMerkleTree::kTileWidth -
+         (2 * TiledMerkleTree::kTileWidth >> row);
+}
+
+
+}  // namespace
+
+
+TiledMerkleTree::TiledMerkleTree(unique_ptr<SerialHasher> hasher,
+                                 MerkleTileStore* store, size_t cache_tiles)
+    : treehasher_(std::move(hasher)),
+      store_(store),
+      cache_tiles_(cache_tiles),
+      leaf_count_(0) {
+  assert(store_);
+  assert(cache_tiles_ > 0);
+}
+
+
+TiledMerkleTree::~TiledMerkleTree() {
+}
+
+
+size_t TiledMerkleTree::LevelCount() const {
+  if (leaf_count_ == 0)
+    return 0;
+  size_t levels(1);
+  while ((static_cast<size_t>(1) << (levels - 1)) < leaf_count_)
+    ++levels;
+  return levels;
+}
+
+
+size_t TiledMerkleTree::AddLeaf(const string& data) {
+  return AddLeafHash(treehasher_.HashLeaf(data));
+}
+
+
+size_t TiledMerkleTree::AddLeaves(const vector<string>& data) {
+  for (const string& hash : treehasher_.HashLeaves(data)) {
+    AddLeafHash(hash);
+  }
+  return leaf_count_;
+}
+
+
+size_t TiledMerkleTree::AddLeafHash(const string& hash) {
+  assert(hash.size() == NodeSize());
+  ++leaf_count_;
+  AppendToTile(0, hash.data());
+  return leaf_count_;
+}
+
+
+string TiledMerkleTree::CurrentRoot() {
+  return RootAtSnapshot(leaf_count_);
+}
+
+
+void TiledMerkleTree::Flush() {
+  for (size_t level = 0; level < edge_.size(); ++level) {
+    if (!edge_[level].empty()) {
+      store_->PutTile(level, TileLevelNodeCount(level) / kTileWidth,
+                      edge_[level]);
+    }
+  }
+}
+
+
+bool TiledMerkleTree::LoadFromStore(size_t leaf_count) {
+  const size_t node_size(NodeSize());
+  vector<string> edge;
+  for (size_t level = 0; (leaf_count >> (level * kTileHeight)) > 0;
+       ++level) {
+    const size_t nodes(leaf_count >> (level * kTileHeight));
+    const size_t width(nodes % kTileWidth);
+    edge.emplace_back();
+    if (width == 0)
+      continue;
+    if (!store_->GetTile(level, nodes / kTileWidth, &edge.back()) ||
+        edge.back().size() < width * node_size) {
+      return false;
+    }
+    edge.back().resize(width * node_size);
+  }
+
+  edge_.swap(edge);
+  leaf_count_ = leaf_count;
+  return true;
+}
+
+
+string TiledMerkleTree::RootAtSnapshot(size_t snapshot) {
+  if (snapshot > leaf_count_)
+    return string();
+  if (snapshot == 0)
+    return treehasher_.HashEmpty();
+  return SubtreeHash(0, snapshot);
+}
+
+
+vector<string> TiledMerkleTree::PathToCurrentRoot(size_t leaf) {
+  return PathToRootAtSnapshot(leaf, leaf_count_);
+}
+
+
+vector<string> TiledMerkleTree::PathToRootAtSnapshot(size_t leaf,
+                                                     size_t snapshot) {
+  vector<string> path;
+  if (leaf == 0 || leaf > snapshot || snapshot > leaf_count_)
+    return path;
+  AppendPath(leaf - 1, 0, snapshot, &path);
+  return path;
+}
+
+
+vector<string> TiledMerkleTree::SnapshotConsistency(size_t snapshot1,
+                                                    size_t snapshot2) {
+  vector<string> proof;
+  if (snapshot1 == 0 || snapshot1 >= snapshot2 || snapshot2 > leaf_count_)
+    return proof;
+  AppendSubproof(snapshot1, 0, snapshot2, true, &proof);
+  return proof;
+}
+
+
+void TiledMerkleTree::AppendToTile(size_t tile_level, const char* node) {
+  if (edge_.size() <= tile_level)
+    edge_.resize(tile_level + 1);
+  string* const tile(&edge_[tile_level]);
+  tile->append(node, NodeSize());
+  if (tile->size() < kTileWidth * NodeSize())
+    return;
+
+  // The tile is full: it will not change anymore.
+  const size_t index(TileLevelNodeCount(tile_level) / kTileWidth - 1);
+  store_->PutTile(tile_level, index, *tile);
+  const string root(
+      CacheTile(tile_level, index, *tile)
+          .substr(RowOffset(kTileHeight) * NodeSize(), NodeSize()));
+  tile->clear();
+  AppendToTile(tile_level + 1, root.data());
+}
+
+
+string TiledMerkleTree::ExpandTile(const string& bottom) const {
+  const size_t node_size(NodeSize());
+  assert(bottom.size() == kTileWidth * node_size);
+  string nodes(RowOffset(kTileHeight + 1) * node_size, '\0');
+  nodes.replace(0, bottom.size(), bottom);
+  for (size_t row = 0; row < kTileHeight; ++row) {
+    treehasher_.HashChildrenBatch(&nodes[RowOffset(row) * node_size],
+                                  kTileWidth >> (row + 1),
+                                  &nodes[RowOffset(row + 1) * node_size]);
+  }
+  return nodes;
+}
+
+
+const string& TiledMerkleTree::FullTile(size_t tile_level, size_t index) {
+  const auto it(cache_.find(CacheKey(tile_level, index)));
+  if (it != cache_.end()) {
+    lru_.splice(lru_.begin(), lru_, it->second.lru_position);
+    return it->second.nodes;
+  }
+
+  // Full tiles are written before anything refers to them, so a missing
+  // one means the store has lost data.
+  string bottom;
+  CHECK(store_->GetTile(tile_level, index, &bottom))
+      << "Missing Merkle tile " << tile_level << "/" << index;
+  CHECK_GE(bottom.size(), kTileWidth * NodeSize())
+      << "Truncated Merkle tile " << tile_level << "/" << index;
+  bottom.resize(kTileWidth * NodeSize());
+  return CacheTile(tile_level, index, bottom);
+}
+
+
+const string& TiledMerkleTree::CacheTile(size_t tile_level, size_t index,
+                                         const string& bottom) {
+  while (cache_.size() >= cache_tiles_) {
+    cache_.erase(lru_.back());
+    lru_.pop_back();
+  }
+
+  const uint64_t key(CacheKey(tile_level, index));
+  lru_.push_front(key);
+  CachedTile* const cached(&cache_[key]);
+  cached->nodes = ExpandTile(bottom);
+  cached->lru_position = lru_.begin();
+  return cached->nodes;
+}
+
+
+string TiledMerkleTree::NodeHash(size_t level, size_t index) {
+  const size_t node_size(NodeSize());
+  assert(((index + 1) << level) <= leaf_count_);
+  const size_t tile_level(level / kTileHeight);
+  const size_t row(level % kTileHeight);
+  // Position of the leftmost descendant in the bottom row of the tile.
+  const size_t first(index << row);
+  const size_t tile_index(first / kTileWidth);
+  const size_t offset(first % kTileWidth);
+
+  if (tile_index < TileLevelNodeCount(tile_level) / kTileWidth) {
+    return FullTile(tile_level, tile_index)
+        .substr((RowOffset(row) + (offset >> row)) * node_size, node_size);
+  }
+
+  // The node is in the partial tile at the right edge: compute it from
+  // its descendants in the bottom row.
+  const string& edge(edge_[tile_level]);
+  assert((offset + (1 << row)) * node_size <= edge.size());
+  string nodes(edge, offset * node_size, (1 << row) * node_size);
+  string parents;
+  for (size_t count = 1 << row; count > 1; count /= 2) {
+    parents.resize(count / 2 * node_size);
+    treehasher_.HashChildrenBatch(nodes.data(), count / 2, &parents[0]);
+    nodes.swap(parents);
+  }
+  return nodes;
+}
+
+
+string TiledMerkleTree::SubtreeHash(size_t start, size_t size) {
+  assert(size > 0);
+  const int level(MerkleTreeMath::Log2IfPowerOfTwo(size));
+  if (level >= 0) {
+    assert(start % size == 0);
+    return NodeHash(level, start >> level);
+  }
+  const size_t k(MerkleTreeMath::SplitPoint(size));
+  return treehasher_.HashChildren(SubtreeHash(start, k),
+                                  SubtreeHash(start + k, size - k));
+}
+
+
+// PATH(m, D[start:start + size]) from RFC 6962, section 2.1.1.
+void TiledMerkleTree::AppendPath(size_t leaf, size_t start, size_t size,
+                                 vector<string>* path) {
+  if (size <= 1)
+    return;
+  const size_t k(MerkleTreeMath::SplitPoint(size));
+  if (leaf < k) {
+    AppendPath(leaf, start, k, path);
+    path->push_back(SubtreeHash(start + k, size - k));
+  } else {
+    AppendPath(leaf - k, start + k, size - k, path);
+    path->push_back(SubtreeHash(start, k));
+  }
+}
+
+
+// SUBPROOF(m, D[start:start + size], b) from RFC 6962, section 2.1.2.
+void TiledMerkleTree::AppendSubproof(size_t snapshot, size_t start,
+                                     size_t size, bool complete,
+                                     vector<string>* proof) {
+  if (snapshot == size) {
+    if (!complete)
+      proof->push_back(SubtreeHash(start, size));
+    return;
+  }
+  const size_t k(MerkleTreeMath::SplitPoint(size));
+  if (snapshot <= k) {
+    AppendSubproof(snapshot, start, k, complete, proof);
+    proof->push_back(SubtreeHash(start + k, size - k));
+  } else {
+    AppendSubproof(snapshot - k, start + k, size - k, false, proof);
+    proof->push_back(SubtreeHash(start, k));
+  }
+}
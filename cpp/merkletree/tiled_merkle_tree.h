@@ -0,0 +1,160 @@
+#ifndef CERT_TRANS_MERKLETREE_TILED_MERKLE_TREE_H_
+#define CERT_TRANS_MERKLETREE_TILED_MERKLE_TREE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "merkletree/merkle_tree_interface.h"
+#include "merkletree/tree_hasher.h"
+
+class SerialHasher;
+
+// Storage for the tiles of a TiledMerkleTree.
+//
+// A tile is identified by its tile level and index, and holds the node
+// hashes of one row of its subtree, back to back (see TiledMerkleTree).
+// Tiles at the right edge of the tree are written again as they grow,
+// so stores must keep the most recently written version of each tile.
+class MerkleTileStore {
+ public:
+  virtual ~MerkleTileStore() = default;
+
+  // Fills |hashes| with the tile at |level| and |index| and returns
+  // true, or returns false if there is no such tile.
+  virtual bool GetTile(size_t level, size_t index, std::string* hashes) = 0;
+
+  // Writes (or overwrites) the tile at |level| and |index|.
+  virtual void PutTile(size_t level, size_t index,
+                       const std::string& hashes) = 0;
+
+ protected:
+  MerkleTileStore() = default;
+};
+
+
+// A Merkle tree (see merkletree/merkle_tree.h) that keeps its nodes in a
+// MerkleTileStore rather than in memory, so that it can serve paths and
+// consistency proofs for very large trees with bounded memory.
+//
+// The tree is cut into subtrees of height kTileHeight. The tile at tile
+// level L and index i holds the (up to) kTileWidth nodes of tree level
+// L * kTileHeight from index i * kTileWidth on; the other nodes of the
+// subtree are recomputed from them. Only the partial tiles at the right
+// edge of the tree are kept in memory. Full tiles are immutable: they
+// are written to the store once, and read back through an LRU cache of
+// bounded size when computing proofs, which touch O(log n) tiles.
+//
+// A writer adds leaves and calls Flush() to make the partial tiles
+// visible to readers, which follow the tree with LoadFromStore().
+//
+// This class is thread-compatible, but not thread-safe.
+class TiledMerkleTree : public cert_trans::MerkleTreeInterface {
+ public:
+  // Height of the subtree covered by each tile.
+  static const size_t kTileHeight = 8;
+  // Maximum number of nodes in a tile.
+  static const size_t kTileWidth = 1 << kTileHeight;
+  // Default number of full tiles kept in memory (about 16 MB with
+  // SHA-256).
+  static const size_t kDefaultCacheTiles = 1024;
+
+  // Does not take ownership of |store|, which must outlive the tree.
+  TiledMerkleTree(std::unique_ptr<SerialHasher> hasher, MerkleTileStore* store,
+                  size_t cache_tiles = kDefaultCacheTiles);
+  virtual ~TiledMerkleTree();
+
+  virtual size_t NodeSize() const {
+    return treehasher_.DigestSize();
+  }
+
+  virtual size_t LeafCount() const {
+    return leaf_count_;
+  }
+
+  virtual std::string LeafHash(const std::string& data) const {
+    return treehasher_.HashLeaf(data);
+  }
+
+  virtual std::vector<std::string> LeafHashes(
+      const std::vector<std::string>& data) const {
+    return treehasher_.HashLeaves(data);
+  }
+
+  virtual size_t LevelCount() const;
+
+  // Leaves are written to the store as the tiles they are in fill up.
+  virtual size_t AddLeaf(const std::string& data);
+  virtual size_t AddLeaves(const std::vector<std::string>& data);
+  virtual size_t AddLeafHash(const std::string& hash);
+
+  virtual std::string CurrentRoot();
+
+  // Writes the partial tiles at the right edge of the tree to the store.
+  void Flush();
+
+  // Sets the tree to its first |leaf_count| leaves, as last flushed to
+  // the store by a writer. Returns false, leaving the tree unchanged,
+  // if the store does not have them.
+  bool LoadFromStore(size_t leaf_count);
+
+  // Number of full tiles currently cached in memory.
+  size_t CachedTiles() const {
+    return cache_.size();
+  }
+
+  // The following behave like their MerkleTree equivalents.
+  std::string RootAtSnapshot(size_t snapshot);
+  std::vector<std::string> PathToCurrentRoot(size_t leaf);
+  std::vector<std::string> PathToRootAtSnapshot(size_t leaf, size_t snapshot);
+  std::vector<std::string> SnapshotConsistency(size_t snapshot1,
+                                               size_t snapshot2);
+
+ private:
+  typedef std::list<uint64_t> LruList;
+
+  struct CachedTile {
+    // All the nodes of the subtree, row by row from the bottom.
+    std::string nodes;
+    LruList::iterator lru_position;
+  };
+
+  // Number of nodes at tree level |tile_level| * kTileHeight.
+  size_t TileLevelNodeCount(size_t tile_level) const {
+    return leaf_count_ >> (tile_level * kTileHeight);
+  }
+
+  void AppendToTile(size_t tile_level, const char* node);
+  // Computes all the nodes of the subtree of a full tile.
+  std::string ExpandTile(const std::string& bottom) const;
+  // The expanded full tile at |tile_level| and |index|. The reference
+  // is valid until the next call.
+  const std::string& FullTile(size_t tile_level, size_t index);
+  const std::string& CacheTile(size_t tile_level, size_t index,
+                               const std::string& bottom);
+
+  // The hash of the complete subtree at |level| and |index|.
+  std::string NodeHash(size_t level, size_t index);
+  // The hash of the |size| leaves starting at |start|.
+  std::string SubtreeHash(size_t start, size_t size);
+  void AppendPath(size_t leaf, size_t start, size_t size,
+                  std::vector<std::string>* path);
+  void AppendSubproof(size_t snapshot, size_t start, size_t size,
+                      bool complete, std::vector<std::string>* proof);
+
+  TreeHasher treehasher_;
+  MerkleTileStore* const store_;
+  const size_t cache_tiles_;
+  size_t leaf_count_;
+  // The partial tile at the right edge of each tile level.
+  std::vector<std::string> edge_;
+  std::unordered_map<uint64_t, CachedTile> cache_;
+  // Most recently used first.
+  LruList lru_;
+};
+
+#endif  // CERT_TRANS_MERKLETREE_TILED_MERKLE_TREE_H_
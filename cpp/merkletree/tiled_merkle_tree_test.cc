@@ -0,0 +1,187 @@
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "merkletree/merkle_tree.h"
+#include "merkletree/serial_hasher.h"
+#include "merkletree/tiled_merkle_tree.h"
+#include "util/testing.h"
+
+namespace {
+
+using std::map;
+using std::pair;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+
+class MemoryTileStore : public MerkleTileStore {
+ public:
+  MemoryTileStore() : gets_(0) {
+  }
+
+  bool GetTile(size_t level, size_t index, string* hashes) override {
+    ++gets_;
+    const auto it(tiles_.find(std::make_pair(level, index)));
+    if (it == tiles_.end())
+      return false;
+    *hashes = it->second;
+    return true;
+  }
+
+  void PutTile(size_t level, size_t index, const string& hashes) override {
+    tiles_[std::make_pair(level, index)] = hashes;
+  }
+
+  size_t TileCount() const {
+    return tiles_.size();
+  }
+
+  int gets_;
+
+ private:
+  map<pair<size_t, size_t>, string> tiles_;
+};
+
+
+string Leaf(int i) {
+  return "leaf " + std::to_string(i);
+}
+
+
+class TiledMerkleTreeTest : public ::testing::Test {
+ protected:
+  TiledMerkleTreeTest()
+      : reference_(unique_ptr<Sha256Hasher>(new Sha256Hasher)),
+        tree_(unique_ptr<Sha256Hasher>(new Sha256Hasher), &store_) {
+  }
+
+  void AddLeaves(int count) {
+    for (int i = 0; i < count; ++i) {
+      const string leaf(Leaf(reference_.LeafCount()));
+      reference_.AddLeaf(leaf);
+      tree_.AddLeaf(leaf);
+    }
+  }
+
+  MemoryTileStore store_;
+  MerkleTree reference_;
+  TiledMerkleTree tree_;
+};
+
+
+TEST_F(TiledMerkleTreeTest, MatchesMerkleTree) {
+  EXPECT_EQ(0U, tree_.LevelCount());
+  EXPECT_EQ(reference_.CurrentRoot(), tree_.CurrentRoot());
+
+  // Cover several partial and full tiles on the first two tile levels.
+  const size_t kSizes[] = {1, 2, 3, 7, 255, 256, 257, 300, 511, 512, 1000};
+  for (size_t size : kSizes) {
+    AddLeaves(size - tree_.LeafCount());
+    ASSERT_EQ(size, tree_.LeafCount());
+    EXPECT_EQ(reference_.LevelCount(), tree_.LevelCount());
+    EXPECT_EQ(reference_.CurrentRoot(), tree_.CurrentRoot()) << size;
+
+    for (size_t snapshot = 1; snapshot <= size; snapshot += 13) {
+      EXPECT_EQ(reference_.RootAtSnapshot(snapshot),
+                tree_.RootAtSnapshot(snapshot));
+      for (size_t leaf = 1; leaf <= snapshot; leaf += 17) {
+        EXPECT_EQ(reference_.PathToRootAtSnapshot(leaf, snapshot),
+                  tree_.PathToRootAtSnapshot(leaf, snapshot))
+            << leaf << " " << snapshot;
+      }
+      EXPECT_EQ(reference_.SnapshotConsistency(snapshot, size),
+                tree_.SnapshotConsistency(snapshot, size))
+          << snapshot << " " << size;
+    }
+    EXPECT_EQ(reference_.PathToCurrentRoot(size),
+              tree_.PathToCurrentRoot(size));
+  }
+
+  // Out of range requests.
+  EXPECT_EQ(string(), tree_.RootAtSnapshot(1001));
+  EXPECT_TRUE(tree_.PathToCurrentRoot(0).empty());
+  EXPECT_TRUE(tree_.PathToRootAtSnapshot(10, 9).empty());
+  EXPECT_TRUE(tree_.SnapshotConsistency(0, 10).empty());
+  EXPECT_TRUE(tree_.SnapshotConsistency(10, 10).empty());
+  EXPECT_TRUE(tree_.SnapshotConsistency(10, 1001).empty());
+}
+
+
+TEST_F(TiledMerkleTreeTest, SpansTileLevels) {
+  // Three tile levels: 2^16 leaves fill a whole tile on level 1.
+  const int kLeaves = (1 << 16) + 300;
+  AddLeaves(kLeaves);
+  EXPECT_EQ(reference_.CurrentRoot(), tree_.CurrentRoot());
+  const size_t kLeavesToCheck[] = {1, 256, 257, 40000, 65536, 65537, kLeaves};
+  for (size_t leaf : kLeavesToCheck) {
+    EXPECT_EQ(reference_.PathToCurrentRoot(leaf),
+              tree_.PathToCurrentRoot(leaf));
+    EXPECT_EQ(reference_.SnapshotConsistency(leaf, kLeaves),
+              tree_.SnapshotConsistency(leaf, kLeaves));
+  }
+}
+
+
+TEST_F(TiledMerkleTreeTest, BoundedCache) {
+  TiledMerkleTree tree(unique_ptr<Sha256Hasher>(new Sha256Hasher), &store_,
+                       2);
+  for (int i = 0; i < 10 * 256; ++i) {
+    const string leaf(Leaf(i));
+    reference_.AddLeaf(leaf);
+    tree.AddLeaf(leaf);
+  }
+  EXPECT_EQ(10U, store_.TileCount());
+  EXPECT_EQ(2U, tree.CachedTiles());
+
+  // Paths through evicted tiles are read back from the store.
+  store_.gets_ = 0;
+  for (size_t leaf = 1; leaf <= 10 * 256; leaf += 256) {
+    EXPECT_EQ(reference_.PathToCurrentRoot(leaf),
+              tree.PathToCurrentRoot(leaf));
+  }
+  EXPECT_LT(0, store_.gets_);
+  EXPECT_EQ(2U, tree.CachedTiles());
+}
+
+
+TEST_F(TiledMerkleTreeTest, LoadFromStore) {
+  AddLeaves(700);
+  TiledMerkleTree reader(unique_ptr<Sha256Hasher>(new Sha256Hasher),
+                         &store_);
+  // The partial tiles have not been flushed yet.
+  EXPECT_FALSE(reader.LoadFromStore(700));
+  EXPECT_EQ(0U, reader.LeafCount());
+
+  tree_.Flush();
+  ASSERT_TRUE(reader.LoadFromStore(700));
+  EXPECT_EQ(700U, reader.LeafCount());
+  EXPECT_EQ(reference_.CurrentRoot(), reader.CurrentRoot());
+  EXPECT_EQ(reference_.PathToCurrentRoot(650),
+            reader.PathToCurrentRoot(650));
+
+  // A reader can also load an older tree, from the same partial tiles.
+  ASSERT_TRUE(reader.LoadFromStore(600));
+  EXPECT_EQ(reference_.RootAtSnapshot(600), reader.CurrentRoot());
+  EXPECT_EQ(reference_.SnapshotConsistency(100, 600),
+            reader.SnapshotConsistency(100, 600));
+
+  // But not a newer one.
+  EXPECT_FALSE(reader.LoadFromStore(701));
+  EXPECT_EQ(600U, reader.LeafCount());
+}
+
+
+}  // namespace
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -1,6 +1,7 @@
 #include "merkletree/tree_hasher.h"
 
 #include <assert.h>
+#include <algorithm>
 
 #include "merkletree/serial_hasher.h"
 
@@ -9,12 +10,17 @@ using std::move;
 using std::mutex;
 using std::string;
 using std::unique_ptr;
+using std::vector;
 
 namespace {
 
 const char kLeafPrefix('\x00');
 const char kNodePrefix('\x01');
 
+// Maximum number of pairs passed to SerialHasher::HashBatch() at once
+// by HashChildrenBatch().
+const size_t kMaxChildrenBatch = 64;
+
 std::string EmptyHash(SerialHasher* hasher) {
   hasher->Reset();
   return hasher->Final();
@@ -25,22 +31,88 @@ std::string EmptyHash(SerialHasher* hasher) {
 TreeHasher::TreeHasher(unique_ptr<SerialHasher> hasher)
     : hasher_(move(hasher)), empty_hash_(EmptyHash(hasher_.get())) {
   assert(hasher_);
+  assert(hasher_->DigestSize() <= SerialHasher::kMaxDigestSize);
 }
 
 string TreeHasher::HashLeaf(const string& data) const {
-  lock_guard<mutex> lock(lock_);
-  hasher_->Reset();
-  hasher_->Update(string(1, kLeafPrefix));
-  hasher_->Update(data);
-  return hasher_->Final();
+  char digest[SerialHasher::kMaxDigestSize];
+  HashLeaf(data.data(), data.size(), digest);
+  return string(digest, DigestSize());
 }
 
 string TreeHasher::HashChildren(const string& left_child,
                                 const string& right_child) const {
   lock_guard<mutex> lock(lock_);
   hasher_->Reset();
-  hasher_->Update(string(1, kNodePrefix));
+  hasher_->Update(&kNodePrefix, 1);
   hasher_->Update(left_child);
   hasher_->Update(right_child);
   return hasher_->Final();
 }
+
+void TreeHasher::HashLeaf(const char* data, size_t size, char* out) const {
+  lock_guard<mutex> lock(lock_);
+  hasher_->Reset();
+  hasher_->Update(&kLeafPrefix, 1);
+  hasher_->Update(data, size);
+  hasher_->Final(out);
+}
+
+void TreeHasher::HashChildren(const char* left_child, const char* right_child,
+                              char* out) const {
+  const size_t digest_size(DigestSize());
+  lock_guard<mutex> lock(lock_);
+  hasher_->Reset();
+  hasher_->Update(&kNodePrefix, 1);
+  hasher_->Update(left_child, digest_size);
+  hasher_->Update(right_child, digest_size);
+  hasher_->Final(out);
+}
+
+vector<string> TreeHasher::HashLeaves(const vector<string>& data) const {
+  const size_t digest_size(DigestSize());
+  string digests(data.size() * digest_size, '\0');
+  HashLeaves(data.data(), data.size(), &digests[0]);
+
+  vector<string> ret;
+  ret.reserve(data.size());
+  for (size_t i = 0; i < data.size(); ++i) {
+    ret.emplace_back(digests, i * digest_size, digest_size);
+  }
+  return ret;
+}
+
+void TreeHasher::HashLeaves(const string* data, size_t count,
+                            char* out) const {
+  vector<const char*> inputs;
+  vector<size_t> sizes;
+  inputs.reserve(count);
+  sizes.reserve(count);
+  for (size_t i = 0; i < count; ++i) {
+    inputs.push_back(data[i].data());
+    sizes.push_back(data[i].size());
+  }
+  lock_guard<mutex> lock(lock_);
+  hasher_->HashBatch(kLeafPrefix, inputs.data(), sizes.data(), count, out);
+}
+
+void TreeHasher::HashChildrenBatch(const char* nodes, size_t count,
+                                   char* out) const {
+  const size_t digest_size(DigestSize());
+  const size_t pair_size(2 * digest_size);
+  // Hand the pairs to the hasher a bounded number at a time, so that
+  // the argument arrays can live on the stack.
+  const char* inputs[kMaxChildrenBatch];
+  size_t sizes[kMaxChildrenBatch];
+  std::fill(sizes, sizes + kMaxChildrenBatch, pair_size);
+
+  lock_guard<mutex> lock(lock_);
+  for (size_t first = 0; first < count; first += kMaxChildrenBatch) {
+    const size_t batch(std::min(count - first, kMaxChildrenBatch));
+    for (size_t i = 0; i < batch; ++i) {
+      inputs[i] = nodes + (first + i) * pair_size;
+    }
+    hasher_->HashBatch(kNodePrefix, inputs, sizes, batch,
+                       out + first * digest_size);
+  }
+}
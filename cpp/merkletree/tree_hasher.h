@@ -5,6 +5,7 @@
 #include <memory>
 #include <mutex>
 #include <string>
+#include <vector>
 
 #include "merkletree/serial_hasher.h"
 
@@ -22,6 +23,12 @@ class TreeHasher {
     return empty_hash_;
   }
 
+  // Returns a new instance of the underlying SerialHasher, e.g. to build
+  // another TreeHasher that can hash concurrently with this one.
+  std::unique_ptr<SerialHasher> CreateSerialHasher() const {
+    return hasher_->Create();
+  }
+
   std::string HashLeaf(const std::string& data) const;
 
   // Accepts arbitrary strings as children. When hashing digests, it
@@ -30,6 +37,32 @@ class TreeHasher {
   std::string HashChildren(const std::string& left_child,
                            const std::string& right_child) const;
 
+  // Allocation-free versions of HashLeaf() and HashChildren(), which
+  // write their DigestSize() bytes (at most SerialHasher::kMaxDigestSize)
+  // to |out|. The children of HashChildren() are DigestSize() bytes
+  // each. |out| may point to one of the inputs.
+  void HashLeaf(const char* data, size_t size, char* out) const;
+  void HashChildren(const char* left_child, const char* right_child,
+                    char* out) const;
+
+  // Batch versions of HashLeaf() and HashChildren(). They take the lock
+  // once for the whole batch and, if the SerialHasher supports it, hash
+  // several inputs in parallel (see SerialHasher::HashBatch()).
+
+  // Returns the leaf hashes of |data|, in the same order.
+  std::vector<std::string> HashLeaves(
+      const std::vector<std::string>& data) const;
+
+  // Hashes the |count| leaves starting at |data|, and writes their
+  // hashes back to back starting at |out|.
+  void HashLeaves(const std::string* data, size_t count, char* out) const;
+
+  // Hashes |count| pairs of children of DigestSize() bytes each, laid
+  // out back to back starting at |nodes| (i.e., left0 right0 left1
+  // right1 ...). Writes the |count| parent hashes back to back starting
+  // at |out|.
+  void HashChildrenBatch(const char* nodes, size_t count, char* out) const;
+
  private:
   mutable std::mutex lock_;
   const std::unique_ptr<SerialHasher> hasher_;
@@ -1,6 +1,7 @@
 #include <gtest/gtest.h>
 #include <stddef.h>
 #include <string>
+#include <vector>
 
 #include "merkletree/serial_hasher.h"
 #include "merkletree/tree_hasher.h"
@@ -149,6 +150,32 @@ TYPED_TEST(TreeHasherTest, TestVectors) {
   }
 }
 
+TYPED_TEST(TreeHasherTest, BatchHashing) {
+  std::vector<string> leaves;
+  for (int i = 0; i < 37; ++i)
+    leaves.push_back(string(i * 11, static_cast<char>(i)));
+
+  const std::vector<string> leaf_hashes(
+      this->tree_hasher_.HashLeaves(leaves));
+  ASSERT_EQ(leaves.size(), leaf_hashes.size());
+  for (size_t i = 0; i < leaves.size(); ++i)
+    EXPECT_EQ(H(this->tree_hasher_.HashLeaf(leaves[i])), H(leaf_hashes[i]));
+
+  string nodes;
+  for (const auto& hash : leaf_hashes)
+    nodes.append(hash);
+  const size_t digest_size(this->tree_hasher_.DigestSize());
+  const size_t pairs(leaf_hashes.size() / 2);
+  string parents(pairs * digest_size, '\0');
+  this->tree_hasher_.HashChildrenBatch(nodes.data(), pairs, &parents[0]);
+  for (size_t i = 0; i < pairs; ++i)
+    EXPECT_EQ(H(this->tree_hasher_.HashChildren(leaf_hashes[2 * i],
+                                                leaf_hashes[2 * i + 1])),
+              H(parents.substr(i * digest_size, digest_size)));
+
+  EXPECT_TRUE(this->tree_hasher_.HashLeaves(std::vector<string>()).empty());
+}
+
 #undef S
 #undef H
 
@@ -4,8 +4,10 @@
 #include "merkletree/verifiable_map.h"
 
 
+using std::pair;
 using std::string;
 using std::unique_ptr;
+using std::unordered_map;
 using std::vector;
 using util::Status;
 using util::StatusOr;
@@ -14,8 +16,32 @@ using util::StatusOr;
 namespace cert_trans {
 
 
+namespace {
+
+
+// The maximum number of inclusion proofs kept between updates, of
+// kDigestSizeBits hashes each (8 kB with SHA-256).
+const size_t kMaxCachedProofs = 4096;
+
+
+string ValueKey(const SparseMerkleTree::Path& path) {
+  return string(reinterpret_cast<const char*>(path.data()), path.size());
+}
+
+
+}  // namespace
+
+
 VerifiableMap::VerifiableMap(SerialHasher* hasher)
-    : hasher_model_(CHECK_NOTNULL(hasher)->Create()), merkle_tree_(hasher) {
+    : VerifiableMap(hasher, nullptr) {
+}
+
+
+VerifiableMap::VerifiableMap(SerialHasher* hasher,
+                             SparseMerkleTreeStore* store, size_t cache_nodes)
+    : hasher_model_(CHECK_NOTNULL(hasher)->Create()),
+      store_(store),
+      merkle_tree_(hasher, store, cache_nodes) {
 }
 
 
@@ -23,21 +49,95 @@ void VerifiableMap::Set(const string& key, const string& value) {
   const SparseMerkleTree::Path path(PathFromKey(key));
   merkle_tree_.SetLeaf(path, value);
   values_[path] = value;
+  proofs_.clear();
+}
+
+
+void VerifiableMap::SetEntries(const vector<pair<string, string>>& entries) {
+  vector<pair<SparseMerkleTree::Path, string>> leaves;
+  leaves.reserve(entries.size());
+  for (const auto& entry : entries) {
+    leaves.emplace_back(PathFromKey(entry.first), entry.second);
+  }
+  merkle_tree_.SetLeaves(leaves);
+  for (auto& leaf : leaves) {
+    values_[leaf.first] = std::move(leaf.second);
+  }
+  proofs_.clear();
 }
 
 
 StatusOr<string> VerifiableMap::Get(const string& key) const {
   const SparseMerkleTree::Path path(PathFromKey(key));
   const auto it(values_.find(path));
-  if (it == values_.end()) {
-    return Status(util::error::NOT_FOUND, "No such entry.");
+  if (it != values_.end()) {
+    return it->second;
   }
-  return it->second;
+  string value;
+  if (store_ && store_->GetValue(ValueKey(path), &value)) {
+    return value;
+  }
+  return Status(util::error::NOT_FOUND, "No such entry.");
+}
+
+
+vector<StatusOr<string>> VerifiableMap::GetEntries(
+    const vector<string>& keys) const {
+  vector<StatusOr<string>> values;
+  values.reserve(keys.size());
+  for (const string& key : keys) {
+    values.push_back(Get(key));
+  }
+  return values;
 }
 
 
 vector<string> VerifiableMap::InclusionProof(const string& key) {
-  return merkle_tree_.InclusionProof(PathFromKey(key));
+  return InclusionProofs({key}).front();
+}
+
+
+vector<vector<string>> VerifiableMap::InclusionProofs(
+    const vector<string>& keys) {
+  vector<SparseMerkleTree::Path> paths;
+  paths.reserve(keys.size());
+  vector<SparseMerkleTree::Path> missing;
+  for (const string& key : keys) {
+    paths.push_back(PathFromKey(key));
+    if (proofs_.find(paths.back()) == proofs_.end()) {
+      missing.push_back(paths.back());
+    }
+  }
+
+  // The proofs not cached yet are only kept if there is room for them.
+  const vector<vector<string>> proven(merkle_tree_.InclusionProofs(missing));
+  unordered_map<SparseMerkleTree::Path, const vector<string>*, PathHasher>
+      fresh;
+  for (size_t i = 0; i < missing.size(); ++i) {
+    if (proofs_.size() < kMaxCachedProofs) {
+      proofs_.emplace(missing[i], proven[i]);
+    }
+    fresh.emplace(missing[i], &proven[i]);
+  }
+
+  vector<vector<string>> proofs;
+  proofs.reserve(paths.size());
+  for (const SparseMerkleTree::Path& path : paths) {
+    const auto it(fresh.find(path));
+    proofs.push_back(it != fresh.end() ? *it->second : proofs_.at(path));
+  }
+  return proofs;
+}
+
+
+void VerifiableMap::Flush() {
+  vector<pair<string, string>> values;
+  values.reserve(values_.size());
+  for (auto& value : values_) {
+    values.emplace_back(ValueKey(value.first), std::move(value.second));
+  }
+  merkle_tree_.Flush(values);
+  values_.clear();
 }
 
 
@@ -3,6 +3,7 @@
 
 #include <string>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include "merkletree/sparse_merkle_tree.h"
@@ -15,6 +16,11 @@ namespace cert_trans {
 class VerifiableMap {
  public:
   VerifiableMap(SerialHasher* hasher);
+  // A map backed by |store|, starting from what was last flushed to it
+  // (see SparseMerkleTree). Does not take ownership of |store|, which
+  // must outlive the map.
+  VerifiableMap(SerialHasher* hasher, SparseMerkleTreeStore* store,
+                size_t cache_nodes = SparseMerkleTree::kDefaultCacheNodes);
   VerifiableMap(const VerifiableMap&) = delete;
   VerifiableMap& operator=(const VerifiableMap&) = delete;
 
@@ -22,20 +28,52 @@ class VerifiableMap {
     return merkle_tree_.CurrentRoot();
   }
 
+  // Hash updates in parallel on |executor|, see
+  // SparseMerkleTree::SetExecutor().
+  void SetExecutor(util::Executor* executor) {
+    merkle_tree_.SetExecutor(executor);
+  }
+
   void Set(const std::string& key, const std::string& value);
 
+  // Same as calling Set() for each of |entries| in turn, but cheaper for
+  // large batches (see SparseMerkleTree::SetLeaves()).
+  void SetEntries(
+      const std::vector<std::pair<std::string, std::string>>& entries);
+
   util::StatusOr<std::string> Get(const std::string& key) const;
 
+  // Same as calling Get() for each of |keys|.
+  std::vector<util::StatusOr<std::string>> GetEntries(
+      const std::vector<std::string>& keys) const;
+
+  // The proofs are kept until the next update of the map, so that
+  // asking again for the same keys is cheap.
   std::vector<std::string> InclusionProof(const std::string& key);
 
+  // Same as calling InclusionProof() for each of |keys|, but cheaper for
+  // large batches (see SparseMerkleTree::InclusionProofs()).
+  std::vector<std::vector<std::string>> InclusionProofs(
+      const std::vector<std::string>& keys);
+
+  // Writes the entries set since the previous call, and the tree nodes
+  // they changed, to the store. The map must have a store.
+  void Flush();
+
  private:
   SparseMerkleTree::Path PathFromKey(const std::string& key) const;
 
   std::unique_ptr<SerialHasher> hasher_model_;
+  SparseMerkleTreeStore* const store_;
   SparseMerkleTree merkle_tree_;
 
-  // TODO(alcutter): allow arbitrary stores here.
+  // All the entries, or with a store, those not flushed yet.
   std::unordered_map<SparseMerkleTree::Path, std::string, PathHasher> values_;
+  // The inclusion proofs given out since the map was last updated,
+  // which are all for its current root.
+  std::unordered_map<SparseMerkleTree::Path, std::vector<std::string>,
+                     PathHasher>
+      proofs_;
 };
 
 
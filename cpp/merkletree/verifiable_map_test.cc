@@ -12,8 +12,10 @@ namespace cert_trans {
 namespace {
 
 using std::array;
+using std::pair;
 using std::string;
 using std::unique_ptr;
+using std::vector;
 using util::StatusOr;
 using util::testing::StatusIs;
 using util::ToBase64;
@@ -46,6 +48,53 @@ TEST_F(VerifiableMapTest, TestSetGet) {
   EXPECT_EQ(kValue, retrieved.ValueOrDie());
 }
 
+TEST_F(VerifiableMapTest, TestSetEntries) {
+  VerifiableMap one_by_one(new Sha256Hasher());
+  const vector<pair<string, string>> entries{
+      {"a", "1"}, {"b", "2"}, {"a", "3"}, {"c", "4"}};
+  for (const auto& entry : entries) {
+    one_by_one.Set(entry.first, entry.second);
+  }
+  map_.SetEntries(entries);
+
+  EXPECT_EQ(ToBase64(one_by_one.CurrentRoot()), ToBase64(map_.CurrentRoot()));
+  const StatusOr<string> retrieved(map_.Get("a"));
+  EXPECT_OK(retrieved);
+  EXPECT_EQ("3", retrieved.ValueOrDie());
+}
+
+
+TEST_F(VerifiableMapTest, TestGetEntries) {
+  map_.SetEntries({{"a", "1"}, {"b", "2"}});
+
+  const vector<StatusOr<string>> values(map_.GetEntries({"b", "c", "a"}));
+  ASSERT_EQ(3U, values.size());
+  EXPECT_EQ("2", values[0].ValueOrDie());
+  EXPECT_THAT(values[1].status(), StatusIs(util::error::NOT_FOUND));
+  EXPECT_EQ("1", values[2].ValueOrDie());
+}
+
+
+TEST_F(VerifiableMapTest, TestInclusionProofs) {
+  VerifiableMap other(new Sha256Hasher());
+  map_.SetEntries({{"a", "1"}, {"b", "2"}, {"c", "3"}});
+  other.SetEntries({{"a", "1"}, {"b", "2"}, {"c", "3"}});
+
+  const vector<vector<string>> proofs(map_.InclusionProofs({"c", "a", "d"}));
+  ASSERT_EQ(3U, proofs.size());
+  EXPECT_EQ(other.InclusionProof("c"), proofs[0]);
+  EXPECT_EQ(other.InclusionProof("a"), proofs[1]);
+  EXPECT_EQ(other.InclusionProof("d"), proofs[2]);
+  // Again, as kept.
+  EXPECT_EQ(proofs[1], map_.InclusionProof("a"));
+
+  // Updates change the proofs of the other keys too.
+  map_.Set("b", "4");
+  other.Set("b", "4");
+  EXPECT_NE(proofs[1], map_.InclusionProof("a"));
+  EXPECT_EQ(other.InclusionProof("a"), map_.InclusionProof("a"));
+}
+
 
 // TODO(alcutter): Lots and lots more tests.
 
@@ -30,6 +30,10 @@ class Counter : public Metric {
 
   double Get(const LabelTypes&... labels) const;
 
+  // Returns the cell for |labels|, which can be kept and incremented
+  // directly to save looking up the labels on every update.
+  LabelledValueCell* GetCell(const LabelTypes&... labels);
+
   std::map<std::vector<std::string>, Metric::TimestampedValue> CurrentValues()
       const override;
 
@@ -81,6 +85,13 @@ double Counter<LabelTypes...>::Get(const LabelTypes&... labels) const {
 }
 
 
+template <class... LabelTypes>
+LabelledValueCell* Counter<LabelTypes...>::GetCell(
+    const LabelTypes&... labels) {
+  return values_.GetCell(labels...);
+}
+
+
 template <class... LabelTypes>
 std::map<std::vector<std::string>, Metric::TimestampedValue>
 Counter<LabelTypes...>::CurrentValues() const {
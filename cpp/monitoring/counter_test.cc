@@ -4,12 +4,14 @@
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 #include <memory>
+#include <thread>
 
 #include "util/testing.h"
 
 namespace cert_trans {
 
 using std::string;
+using std::thread;
 using std::vector;
 using testing::ElementsAre;
 
@@ -91,6 +93,39 @@ TEST_F(CounterTest, TestCounterWithLabelsMultiValues) {
 }
 
 
+TEST_F(CounterTest, TestCounterCell) {
+  std::unique_ptr<Counter<std::string>> counter(
+      Counter<std::string>::New("name", "a string", "help"));
+  LabelledValueCell* const cell(counter->GetCell("hi"));
+  EXPECT_EQ(cell, counter->GetCell("hi"));
+  cell->Increment();
+  cell->IncrementBy(2);
+  counter->Increment("hi");
+  EXPECT_EQ(4, counter->Get("hi"));
+  EXPECT_EQ(4, counter->CurrentValues()[{"hi"}].second);
+}
+
+
+TEST_F(CounterTest, TestCounterConcurrentIncrements) {
+  const int kNumThreads(8);
+  const int kNumIncrements(10000);
+  std::unique_ptr<Counter<std::string>> counter(
+      Counter<std::string>::New("name", "a string", "help"));
+  vector<thread> threads;
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads.emplace_back([&counter, kNumIncrements]() {
+      for (int j = 0; j < kNumIncrements; ++j) {
+        counter->Increment("hi");
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  EXPECT_EQ(kNumThreads * kNumIncrements, counter->Get("hi"));
+}
+
+
 }  // namespace cert_trans
 
 
@@ -2,7 +2,6 @@
 #define CERT_TRANS_MONITORING_EVENT_METRIC_H_
 
 #include <memory>
-#include <mutex>
 #include <string>
 
 #include "monitoring/counter.h"
@@ -33,7 +32,6 @@ class EventMetric {
   void RecordEvent(const LabelTypes&... labels, double amount);
 
  private:
-  std::mutex mutex_;
   std::unique_ptr<Counter<LabelTypes...>> totals_;
   std::unique_ptr<Counter<LabelTypes...>> counts_;
 };
@@ -54,7 +52,6 @@ EventMetric<LabelTypes...>::EventMetric(
 template <class... LabelTypes>
 void EventMetric<LabelTypes...>::RecordEvent(const LabelTypes&... labels,
                                              double amount) {
-  std::lock_guard<std::mutex> lock(mutex_);
   totals_->IncrementBy(labels..., amount);
   counts_->Increment(labels...);
 }
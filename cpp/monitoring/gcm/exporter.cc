@@ -2,8 +2,10 @@
 
 #include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <algorithm>
 #include <sstream>
 
+#include "monitoring/histogram.h"
 #include "monitoring/monitoring.h"
 #include "monitoring/registry.h"
 #include "net/url.h"
@@ -24,6 +26,17 @@ DEFINE_int32(google_compute_monitoring_credentials_refresh_interval_minutes,
              "GCM.");
 DEFINE_int32(google_compute_monitoring_retry_delay_seconds, 5,
              "Seconds between retrying failed GCM requests.");
+DEFINE_int32(google_compute_monitoring_resend_interval_seconds, 120,
+             "Seconds after which timeseries are pushed to GCM again even "
+             "if their value has not changed. 0 pushes every timeseries "
+             "every time.");
+DEFINE_int32(google_compute_monitoring_max_timeseries_per_request, 200,
+             "Maximum number of timeseries written by each request to GCM.");
+DEFINE_int32(google_compute_monitoring_max_outstanding_requests, 4,
+             "Maximum number of write requests to GCM in flight at once.");
+DEFINE_int32(google_compute_monitoring_max_queued_requests, 64,
+             "Maximum number of write requests to GCM waiting to be sent, "
+             "beyond which the oldest are dropped.");
 
 
 namespace cert_trans {
@@ -32,14 +45,20 @@ using std::bind;
 using std::chrono::minutes;
 using std::chrono::seconds;
 using std::chrono::system_clock;
+using std::lock_guard;
 using std::make_pair;
+using std::make_shared;
+using std::map;
+using std::move;
 using std::mutex;
 using std::ostringstream;
 using std::placeholders::_1;
+using std::shared_ptr;
 using std::string;
 using std::thread;
 using std::unique_lock;
 using std::unique_ptr;
+using std::vector;
 using util::Executor;
 using util::SyncTask;
 using util::Task;
@@ -56,6 +75,15 @@ Counter<>* num_gcm_token_fetch_failures =
     Counter<>::New("num_gcm_token_fetch_failures",
                    "Number of failures to fetch GCM auth token");
 
+Counter<>* num_gcm_dropped_requests =
+    Counter<>::New("num_gcm_dropped_requests",
+                   "Number of requests to push metric data to GCM dropped "
+                   "because too many were queued.");
+
+Counter<>* num_gcm_pushed_timeseries =
+    Counter<>::New("num_gcm_pushed_timeseries",
+                   "Number of timeseries pushed to GCM.");
+
 namespace {
 
 
@@ -71,6 +99,18 @@ inline std::string RFC3339Time(const system_clock::time_point& when) {
 }
 
 
+void AddLabel(const string& key, const string& value, JsonObject* labels) {
+  CHECK_NOTNULL(labels)->Add((kCloudPrefix + key).c_str(), value);
+}
+
+
+string CommonLabels(const string& instance_name) {
+  JsonObject common_labels;
+  AddLabel("instance", instance_name, &common_labels);
+  return common_labels.ToString();
+}
+
+
 }  // namespace
 
 
@@ -80,7 +120,9 @@ GCMExporter::GCMExporter(const string& instance_name, UrlFetcher* fetcher,
       fetcher_(CHECK_NOTNULL(fetcher)),
       executor_(CHECK_NOTNULL(executor)),
       task_(executor_),
-      metrics_created_(false) {
+      metrics_created_(false),
+      common_labels_(CommonLabels(instance_name_)),
+      outstanding_(0) {
   executor_->Add(bind(&GCMExporter::PushMetrics, this));
 }
 
@@ -168,14 +210,19 @@ void GCMExporter::CreateMetrics() {
         // only gauge type metrics are supported for custom metrics currently:
         // https://cloud.google.com/monitoring/api/metrics#metric-types
         desc.Add("metricType", "gauge");
+        desc.Add("valueType", "double");
         break;
       case Metric::GAUGE:
         desc.Add("metricType", "gauge");
+        desc.Add("valueType", "double");
+        break;
+      case Metric::HISTOGRAM:
+        desc.Add("metricType", "gauge");
+        desc.Add("valueType", "distribution");
         break;
       default:
         LOG(FATAL) << "Unknown type: " << m->Type();
     }
-    desc.Add("valueType", "double");
 
     JsonObject metric;
     metric.Add("name", kCloudPrefix + m->Name());
@@ -219,8 +266,36 @@ void GCMExporter::CreateMetrics() {
 namespace {
 
 
-void AddLabel(const string& key, const string& value, JsonObject* labels) {
-  CHECK_NOTNULL(labels)->Add((kCloudPrefix + key).c_str(), value);
+// See
+// https://cloud.google.com/monitoring/v2beta2/timeseries#distribution
+// for the structure built here. Empty buckets are left out.
+void AddDistribution(const Metric::Distribution& dist, JsonObject* point) {
+  JsonObject value;
+  JsonArray buckets;
+  const size_t last(dist.bucket_counts.size() - 1);
+  for (size_t i(0); i <= last; ++i) {
+    const int64_t count(dist.bucket_counts[i]);
+    if (count == 0) {
+      continue;
+    }
+    JsonObject bucket;
+    if (i > 0) {
+      bucket.AddDouble("lowerBound", HistogramBuckets::UpperBound(i - 1));
+    }
+    if (i < last) {
+      bucket.AddDouble("upperBound", HistogramBuckets::UpperBound(i));
+    }
+    bucket.Add("count", count);
+    if (i == 0) {
+      value.Add("underflowBucket", bucket);
+    } else if (i == last) {
+      value.Add("overflowBucket", bucket);
+    } else {
+      buckets.Add(&bucket);
+    }
+  }
+  value.Add("buckets", buckets);
+  CHECK_NOTNULL(point)->Add("distributionValue", value);
 }
 
 
@@ -246,79 +321,215 @@ void GCMExporter::PushMetrics() {
     CreateMetrics();
   }
 
-  // Build up the JSON write request into this object:
-  JsonObject metric_write;
-  metric_write.Add("kind", "cloudmonitoring#writeTimeseriesRequest");
+  QueueBatches(BuildBatches());
+
+  // The next push does not wait for this one to complete, so that a
+  // slow response does not hold the others up.
+  executor_->Delay(
+      seconds(FLAGS_google_compute_monitoring_push_interval_seconds),
+      task_.task()->AddChild(bind(&GCMExporter::PushMetrics, this)));
+}
+
+
+const string& GCMExporter::SeriesDescription(const Metric& metric,
+                                             const SeriesKey& key) {
+  string& description(series_descriptions_[key]);
+  if (description.empty()) {
+    JsonObject labels;
+    for (size_t i(0); i < key.second.size(); ++i) {
+      AddLabel(metric.LabelName(i), key.second[i], &labels);
+    }
+    JsonObject desc;
+    desc.Add("labels", labels);
+    desc.Add("metric", kCloudPrefix + metric.Name());
+    description = desc.ToString();
+  }
+  return description;
+}
 
-  JsonObject common_labels;
-  AddLabel("instance", instance_name_, &common_labels);
-  metric_write.Add("commonLabels", common_labels);
 
+vector<shared_ptr<GCMExporter::Batch>> GCMExporter::BuildBatches() {
+  const size_t max_timeseries(
+      std::max(FLAGS_google_compute_monitoring_max_timeseries_per_request, 1));
+  const seconds resend_interval(
+      FLAGS_google_compute_monitoring_resend_interval_seconds);
+  // According to
+  // https://cloud.google.com/monitoring/v2beta2/timeseries/write
+  // GAUGE types should have a zero size timerange here
+  // Which implies we need to use the current time rather than the time the
+  // value was set because there's a [short ~5m] horizon over which GCM
+  // won't accept samples.
+  const system_clock::time_point now(system_clock::now());
+  const string now_str(RFC3339Time(now));
+
+  vector<shared_ptr<Batch>> batches;
+  string timeseries;
+  vector<SeriesKey> series;
+  const auto finish_batch([&]() {
+    if (series.empty()) {
+      return;
+    }
+    // The request is put together from the cached pieces, rather than
+    // built and serialised as a whole each time.
+    const shared_ptr<Batch> batch(make_shared<Batch>());
+    batch->request.url =
+        URL(FLAGS_google_compute_monitoring_base_url + "/timeseries:write");
+    batch->request.verb = UrlFetcher::Verb::POST;
+    batch->request.headers.insert(
+        make_pair("Content-Type", "application/json"));
+    batch->request.headers.insert(
+        make_pair("Authorization", "Bearer " + bearer_token_));
+    batch->request.body =
+        "{\"kind\":\"cloudmonitoring#writeTimeseriesRequest\","
+        "\"commonLabels\":" +
+        common_labels_ + ",\"timeseries\":[" + timeseries + "]}";
+    batch->series.swap(series);
+    batches.emplace_back(move(batch));
+    timeseries.clear();
+  });
+
+  lock_guard<mutex> lock(lock_);
   const std::set<const Metric*> metrics(Registry::Instance()->GetMetrics());
-  JsonArray timeseries;
   for (auto& m : metrics) {
     CHECK_NOTNULL(m);
+    const std::map<std::vector<string>, Metric::Distribution> distributions(
+        m->CurrentDistributions());
     for (auto& p : m->CurrentValues()) {
-      JsonObject labels;
-      for (size_t i(0); i < p.first.size(); ++i) {
-        AddLabel(m->LabelName(i), p.first[i], &labels);
+      SeriesKey key(m->Name(), p.first);
+      SentValue value{p.second.second, 0, now};
+      const Metric::Distribution* dist(nullptr);
+      if (m->Type() == Metric::HISTOGRAM) {
+        const auto it(distributions.find(p.first));
+        if (it == distributions.end()) {
+          // Only appeared since the distributions were read.
+          continue;
+        }
+        dist = &it->second;
+        value.value = dist->sum;
+        value.count = dist->count;
       }
 
-      JsonObject desc;
-      desc.Add("labels", labels);
-      desc.Add("metric", kCloudPrefix + m->Name());
-
-      JsonObject ts;
-      ts.Add("timeseriesDesc", desc);
+      const auto sent(sent_.find(key));
+      if (sent != sent_.end()) {
+        if (sent->second.value == value.value &&
+            sent->second.count == value.count &&
+            now - sent->second.sent_at < resend_interval) {
+          continue;
+        }
+        sent->second = value;
+      } else {
+        sent_.insert(make_pair(key, value));
+      }
 
       JsonObject point;
-      // According to
-      // https://cloud.google.com/monitoring/v2beta2/timeseries/write
-      // GAUGE types should have a zero size timerange here
-      // Which implies we need to use the current time rather than the time the
-      // value was set because there's a [short ~5m] horizon over which GCM
-      // won't accept samples.
-      const auto now(system_clock::now());
-      point.Add("start", RFC3339Time(now));
-      point.Add("end", RFC3339Time(now));
-      point.Add("doubleValue", p.second.second);
-      ts.Add("point", point);
-
-      timeseries.Add(&ts);
+      point.Add("start", now_str);
+      point.Add("end", now_str);
+      if (dist) {
+        AddDistribution(*dist, &point);
+      } else {
+        point.Add("doubleValue", value.value);
+      }
+
+      if (!timeseries.empty()) {
+        timeseries += ',';
+      }
+      timeseries += "{\"timeseriesDesc\":";
+      timeseries += SeriesDescription(*m, key);
+      timeseries += ",\"point\":";
+      timeseries += point.ToString();
+      timeseries += '}';
+      series.emplace_back(move(key));
+      if (series.size() >= max_timeseries) {
+        finish_batch();
+      }
+    }
+  }
+  finish_batch();
+  return batches;
+}
+
+
+void GCMExporter::QueueBatches(vector<shared_ptr<Batch>> batches) {
+  vector<shared_ptr<Batch>> to_send;
+  {
+    lock_guard<mutex> lock(lock_);
+    for (auto& batch : batches) {
+      queued_.emplace_back(move(batch));
     }
+    const size_t max_queued(
+        std::max(FLAGS_google_compute_monitoring_max_queued_requests, 0));
+    while (queued_.size() > max_queued) {
+      LOG_EVERY_N(WARNING, 100) << "Too many requests to GCM queued, "
+                                << "dropping the oldest";
+      num_gcm_dropped_requests->Increment();
+      ForgetSentLocked(queued_.front()->series);
+      queued_.pop_front();
+    }
+    to_send = TakeBatchesToSendLocked();
   }
-  metric_write.Add("timeseries", timeseries);
+  SendBatches(to_send);
+}
 
-  UrlFetcher::Request req(
-      (URL(FLAGS_google_compute_monitoring_base_url + "/timeseries:write")));
-  req.verb = UrlFetcher::Verb::POST;
-  req.headers.insert(make_pair("Content-Type", "application/json"));
-  req.headers.insert(make_pair("Authorization", "Bearer " + bearer_token_));
-  req.body = metric_write.ToString();
-
-  UrlFetcher::Response* resp(new UrlFetcher::Response);
-  VLOG(1) << "Pushing metrics...";
-  VLOG(2) << req.body;
-  fetcher_->Fetch(req, resp,
-                  task_.task()->AddChild(
-                      bind(&GCMExporter::PushMetricsDone, this, resp, _1)));
+
+vector<shared_ptr<GCMExporter::Batch>> GCMExporter::TakeBatchesToSendLocked() {
+  const int max_outstanding(
+      std::max(FLAGS_google_compute_monitoring_max_outstanding_requests, 1));
+  vector<shared_ptr<Batch>> ret;
+  while (!queued_.empty() && outstanding_ < max_outstanding) {
+    ret.emplace_back(move(queued_.front()));
+    queued_.pop_front();
+    ++outstanding_;
+  }
+  return ret;
+}
+
+
+void GCMExporter::ForgetSentLocked(const vector<SeriesKey>& series) {
+  // So that they are sent again with the next push.
+  for (const auto& key : series) {
+    sent_.erase(key);
+  }
+}
+
+
+void GCMExporter::SendBatches(const vector<shared_ptr<Batch>>& batches) {
+  for (const auto& batch : batches) {
+    UrlFetcher::Response* const resp(new UrlFetcher::Response);
+    VLOG(1) << "Pushing " << batch->series.size() << " timeseries...";
+    VLOG(2) << batch->request.body;
+    fetcher_->Fetch(batch->request, resp,
+                    task_.task()->AddChild(bind(&GCMExporter::PushBatchDone,
+                                                this, batch, resp, _1)));
+  }
 }
 
 
-void GCMExporter::PushMetricsDone(UrlFetcher::Response* resp, Task* task) {
+void GCMExporter::PushBatchDone(const shared_ptr<Batch>& batch,
+                                UrlFetcher::Response* resp, Task* task) {
   unique_ptr<UrlFetcher::Response> resp_deleter(resp);
-  if (!task->status().ok() || resp->status_code != 200) {
+  const bool ok(task->status().ok() && resp->status_code == 200);
+  if (!ok) {
     num_gcm_push_failures->Increment();
     LOG(WARNING) << "Failed to push metrics to GCM, status: " << task->status()
                  << ", reponse code: " << resp->status_code;
   } else {
+    num_gcm_pushed_timeseries->IncrementBy(batch->series.size());
     VLOG(1) << "Metrics pushed.";
     VLOG(2) << resp->body;
   }
 
-  executor_->Delay(
-      seconds(FLAGS_google_compute_monitoring_push_interval_seconds),
-      task_.task()->AddChild(bind(&GCMExporter::PushMetrics, this)));
+  vector<shared_ptr<Batch>> to_send;
+  {
+    lock_guard<mutex> lock(lock_);
+    if (!ok) {
+      ForgetSentLocked(batch->series);
+    }
+    --outstanding_;
+    to_send = TakeBatchesToSendLocked();
+  }
+  if (!task_.task()->CancelRequested()) {
+    SendBatches(to_send);
+  }
 }
 
 
@@ -3,9 +3,16 @@
 
 #include <chrono>
 #include <condition_variable>
+#include <deque>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <string>
 #include <thread>
+#include <utility>
+#include <vector>
 
+#include "monitoring/metric.h"
 #include "net/url_fetcher.h"
 #include "util/executor.h"
 #include "util/sync_task.h"
@@ -13,6 +20,17 @@
 namespace cert_trans {
 
 
+// Pushes the metrics to GCM every
+// --google_compute_monitoring_push_interval_seconds, whether or not the
+// previous push has completed.
+//
+// Only the timeseries which changed since they were last pushed are
+// sent, along with those not sent for
+// --google_compute_monitoring_resend_interval_seconds, in requests of
+// at most --google_compute_monitoring_max_timeseries_per_request
+// timeseries. Requests are queued, and a bounded number of them are in
+// flight at a time; when the queue is full, the oldest are dropped, and
+// their timeseries are sent again with the next push.
 class GCMExporter {
  public:
   GCMExporter(const std::string& instance_name, UrlFetcher* fetcher,
@@ -25,8 +43,35 @@ class GCMExporter {
 
   void CreateMetrics();
 
+  // A timeseries, by metric name and label values.
+  typedef std::pair<std::string, std::vector<std::string>> SeriesKey;
+
+  struct SentValue {
+    double value;
+    // Only for distributions.
+    int64_t count;
+    std::chrono::system_clock::time_point sent_at;
+  };
+
+  struct Batch {
+    UrlFetcher::Request request;
+    std::vector<SeriesKey> series;
+  };
+
   void PushMetrics();
-  void PushMetricsDone(UrlFetcher::Response* resp, util::Task* task);
+  // Returns the write requests for the changed timeseries, and notes
+  // them as sent.
+  std::vector<std::shared_ptr<Batch>> BuildBatches();
+  // Returns the cached "timeseriesDesc" JSON for a timeseries.
+  const std::string& SeriesDescription(const Metric& metric,
+                                       const SeriesKey& key);
+  void QueueBatches(std::vector<std::shared_ptr<Batch>> batches);
+  void SendBatches(const std::vector<std::shared_ptr<Batch>>& batches);
+  // Takes as many queued batches as can be sent now.
+  std::vector<std::shared_ptr<Batch>> TakeBatchesToSendLocked();
+  void ForgetSentLocked(const std::vector<SeriesKey>& series);
+  void PushBatchDone(const std::shared_ptr<Batch>& batch,
+                     UrlFetcher::Response* resp, util::Task* task);
 
   const std::string instance_name_;
   UrlFetcher* const fetcher_;
@@ -35,6 +80,14 @@ class GCMExporter {
   bool metrics_created_;
   std::chrono::system_clock::time_point token_refreshed_at_;
   std::string bearer_token_;
+  // The "commonLabels" of the write requests, as JSON.
+  const std::string common_labels_;
+
+  std::mutex lock_;
+  std::map<SeriesKey, std::string> series_descriptions_;
+  std::map<SeriesKey, SentValue> sent_;
+  std::deque<std::shared_ptr<Batch>> queued_;
+  int outstanding_;
 
   friend class GCMExporterTest;
 };
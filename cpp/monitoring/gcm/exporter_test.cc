@@ -16,6 +16,7 @@ DECLARE_string(google_compute_monitoring_base_url);
 DECLARE_int32(google_compute_monitoring_push_interval_seconds);
 DECLARE_string(google_compute_monitoring_service_account);
 DECLARE_int32(google_compute_monitoring_retry_delay_seconds);
+DECLARE_int32(google_compute_monitoring_resend_interval_seconds);
 
 namespace cert_trans {
 
@@ -49,6 +50,7 @@ using testing::InSequence;
 using testing::Invoke;
 using testing::InvokeWithoutArgs;
 using testing::IsEmpty;
+using testing::Not;
 using util::Status;
 using util::SyncTask;
 using util::Task;
@@ -85,6 +87,8 @@ class GCMExporterTest : public ::testing::Test {
     FLAGS_google_compute_monitoring_push_interval_seconds = kPushInterval;
     FLAGS_google_compute_metadata_url = kMetadataUrl;
     FLAGS_google_compute_monitoring_service_account = kServiceAccount;
+    // Push everything every time, unless a test says otherwise.
+    FLAGS_google_compute_monitoring_resend_interval_seconds = 0;
 
     ON_CALL(fetcher_, Fetch(_, _, _))
         .WillByDefault(Invoke(bind(&HandleFetch, ::util::OkStatus(), 200,
@@ -295,6 +299,68 @@ TEST_F(GCMExporterTest, TestPushesMetrics) {
 }
 
 
+TEST_F(GCMExporterTest, TestOnlyPushesChangedMetrics) {
+  FLAGS_google_compute_monitoring_resend_interval_seconds = 3600;
+  std::unique_ptr<Counter<>> one(Counter<>::New("one", "help1"));
+  one->Increment();
+  std::unique_ptr<Gauge<>> two(Gauge<>::New("two", "help2"));
+  two->Set(2);
+
+  SyncTask sync(&pool_);
+
+  EXPECT_CALL(
+      fetcher_,
+      Fetch(IsUrlFetchRequest(
+                UrlFetcher::Verb::GET,
+                URL(string(kMetadataUrl) + "/" + kServiceAccount + "/token"),
+                UrlFetcher::Headers{make_pair("Metadata-Flavor", "Google")},
+                ""),
+            _, _))
+      .WillRepeatedly(
+          Invoke(bind(&HandleFetch, ::util::OkStatus(), 200,
+                      UrlFetcher::Headers{}, kCredentialsJson, _1, _2, _3)));
+  EXPECT_CALL(fetcher_,
+              Fetch(IsUrlFetchRequest(
+                        UrlFetcher::Verb::POST, URL(string(metrics_url_)),
+                        UrlFetcher::Headers{
+                            make_pair("Content-Type", "application/json"),
+                            make_pair("Authorization", "Bearer token")},
+                        _),
+                    _, _))
+      .WillRepeatedly(Invoke(bind(&HandleFetch, ::util::OkStatus(), 200,
+                                  UrlFetcher::Headers{}, "", _1, _2, _3)));
+  {
+    InSequence s;
+    EXPECT_CALL(fetcher_,
+                Fetch(IsUrlFetchRequest(
+                          UrlFetcher::Verb::POST, URL(push_url_),
+                          UrlFetcher::Headers{
+                              make_pair("Content-Type", "application/json"),
+                              make_pair("Authorization", "Bearer token")},
+                          AllOf(HasSubstr("ct/one\""), HasSubstr("ct/two\""))),
+                      _, _))
+        .WillOnce(DoAll(InvokeWithoutArgs([&one] { one->Increment(); }),
+                        Invoke(bind(&HandleFetch, ::util::OkStatus(), 200,
+                                    UrlFetcher::Headers{}, "", _1, _2, _3))));
+    // Only "one" changed since.
+    EXPECT_CALL(fetcher_,
+                Fetch(IsUrlFetchRequest(
+                          UrlFetcher::Verb::POST, URL(push_url_),
+                          UrlFetcher::Headers{
+                              make_pair("Content-Type", "application/json"),
+                              make_pair("Authorization", "Bearer token")},
+                          AllOf(HasSubstr("ct/one\""),
+                                Not(HasSubstr("ct/two\"")))),
+                      _, _))
+        .WillOnce(DoAll(InvokeWithoutArgs([&sync] { sync.task()->Return(); }),
+                        Invoke(bind(&HandleFetch, ::util::OkStatus(), 200,
+                                    UrlFetcher::Headers{}, "", _1, _2, _3))));
+  }
+  GCMExporter exporter("instance", &fetcher_, &pool_);
+  sync.Wait();
+}
+
+
 TEST_F(GCMExporterTest, TestRetriesWhenPushingMetricsFails) {
   std::unique_ptr<Counter<>> one(Counter<>::New("one", "help1"));
   one->Increment();
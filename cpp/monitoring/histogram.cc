@@ -0,0 +1,76 @@
+#include "monitoring/histogram.h"
+
+#include <glog/logging.h>
+#include <cmath>
+#include <limits>
+
+using std::frexp;
+using std::isnan;
+using std::ldexp;
+using std::memory_order_relaxed;
+using std::numeric_limits;
+using std::vector;
+
+namespace cert_trans {
+
+
+// static
+int HistogramBuckets::BucketIndex(double value) {
+  if (isnan(value) || value < 1) {
+    return 0;
+  }
+  int exponent;
+  // |value| is |fraction| * 2^|exponent|, with |fraction| in [0.5, 1).
+  const double fraction(frexp(value, &exponent));
+  const int octave(exponent - 1);
+  if (octave >= kOctaves) {
+    return kNumBuckets - 1;
+  }
+  const int sub_bucket(static_cast<int>((fraction * 2 - 1) * kSubBuckets));
+  return 1 + octave * kSubBuckets + sub_bucket;
+}
+
+
+// static
+double HistogramBuckets::UpperBound(int index) {
+  CHECK_GE(index, 0);
+  CHECK_LT(index, kNumBuckets);
+  if (index == 0) {
+    return 1;
+  }
+  if (index == kNumBuckets - 1) {
+    return numeric_limits<double>::infinity();
+  }
+  const int octave((index - 1) / kSubBuckets);
+  const int sub_bucket((index - 1) % kSubBuckets);
+  return ldexp(1 + static_cast<double>(sub_bucket + 1) / kSubBuckets, octave);
+}
+
+
+HistogramCell::HistogramCell() {
+  for (auto& bucket : buckets_) {
+    bucket.store(0, memory_order_relaxed);
+  }
+}
+
+
+void HistogramCell::Record(double value) {
+  buckets_[HistogramBuckets::BucketIndex(value)].fetch_add(
+      1, memory_order_relaxed);
+  sum_.IncrementBy(value);
+}
+
+
+void HistogramCell::Snapshot(double* sum,
+                             vector<uint64_t>* bucket_counts) const {
+  CHECK_NOTNULL(sum);
+  CHECK_NOTNULL(bucket_counts)->clear();
+  bucket_counts->reserve(HistogramBuckets::kNumBuckets);
+  for (const auto& bucket : buckets_) {
+    bucket_counts->push_back(bucket.load(memory_order_relaxed));
+  }
+  *sum = sum_.Get();
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,189 @@
+#ifndef CERT_TRANS_MONITORING_HISTOGRAM_H_
+#define CERT_TRANS_MONITORING_HISTOGRAM_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "base/read_write_mutex.h"
+#include "monitoring/labelled_values.h"
+#include "monitoring/metric.h"
+
+namespace cert_trans {
+
+
+// The bucket boundaries shared by all histograms.
+//
+// Buckets are log-linear: every power of two is split into
+// kSubBuckets equal parts, so that the relative error of any recorded
+// value is at most 1/kSubBuckets, whatever its scale. The first
+// bucket holds everything below 1, and the last one everything above
+// the largest bound.
+//
+// As the boundaries do not depend on the values recorded, the
+// distributions of the same metric from different servers (or over
+// different periods) can be merged by adding up their buckets.
+class HistogramBuckets {
+ public:
+  static const int kSubBuckets = 8;
+  static const int kOctaves = 40;
+  static const int kNumBuckets = 1 + kOctaves * kSubBuckets + 1;
+
+  // Returns the index of the bucket holding |value|.
+  static int BucketIndex(double value);
+
+  // Returns the (exclusive) upper bound of bucket |index|, which is
+  // infinity for the last bucket.
+  static double UpperBound(int index);
+};
+
+
+// The value of a histogram for one set of labels. Recording a value
+// does not take any lock.
+//
+// This class is thread-safe.
+class HistogramCell {
+ public:
+  HistogramCell();
+  HistogramCell(const HistogramCell&) = delete;
+  HistogramCell& operator=(const HistogramCell&) = delete;
+
+  void Record(double value);
+
+  // Fills in the sum of all the values recorded, and the number of
+  // values in each bucket (which is *not* cumulative).
+  void Snapshot(double* sum, std::vector<uint64_t>* bucket_counts) const;
+
+  std::chrono::system_clock::time_point LastUpdated() const {
+    return sum_.LastUpdated();
+  }
+
+ private:
+  LabelledValueCell sum_;
+  std::atomic<uint64_t> buckets_[HistogramBuckets::kNumBuckets];
+};
+
+
+// A metric recording the distribution of a value (e.g. the latency of
+// requests), so that percentiles can be computed from it.
+//
+// CurrentValues() returns the number of values recorded for each set
+// of labels, CurrentDistributions() the whole distribution.
+template <class... LabelTypes>
+class Histogram : public Metric {
+ public:
+  static Histogram<LabelTypes...>* New(
+      const std::string& name,
+      const typename NameType<LabelTypes>::name&... label_names,
+      const std::string& help);
+
+  Histogram(const Histogram&) = delete;
+  Histogram& operator=(const Histogram&) = delete;
+
+  void Record(const LabelTypes&... labels, double value);
+
+  // Returns the cell for |labels|, which can be kept and recorded into
+  // directly to save looking up the labels every time.
+  HistogramCell* GetCell(const LabelTypes&... labels);
+
+  std::map<std::vector<std::string>, Metric::TimestampedValue> CurrentValues()
+      const override;
+
+  std::map<std::vector<std::string>, Metric::Distribution>
+  CurrentDistributions() const override;
+
+ private:
+  Histogram(const std::string& name,
+            const typename NameType<LabelTypes>::name&... label_names,
+            const std::string& help);
+
+  mutable ReadWriteMutex mutex_;
+  std::map<std::tuple<LabelTypes...>, std::unique_ptr<HistogramCell>> cells_;
+};
+
+
+// static
+template <class... LabelTypes>
+Histogram<LabelTypes...>* Histogram<LabelTypes...>::New(
+    const std::string& name,
+    const typename NameType<LabelTypes>::name&... label_names,
+    const std::string& help) {
+  return new Histogram(name, label_names..., help);
+}
+
+
+template <class... LabelTypes>
+Histogram<LabelTypes...>::Histogram(
+    const std::string& name,
+    const typename NameType<LabelTypes>::name&... label_names,
+    const std::string& help)
+    : Metric(HISTOGRAM, name, {label_names...}, help) {
+}
+
+
+template <class... LabelTypes>
+void Histogram<LabelTypes...>::Record(const LabelTypes&... labels,
+                                      double value) {
+  GetCell(labels...)->Record(value);
+}
+
+
+template <class... LabelTypes>
+HistogramCell* Histogram<LabelTypes...>::GetCell(const LabelTypes&... labels) {
+  const std::tuple<LabelTypes...> key(labels...);
+  {
+    ReaderLock lock(&mutex_);
+    const auto it(cells_.find(key));
+    if (it != cells_.end()) {
+      return it->second.get();
+    }
+  }
+
+  std::lock_guard<ReadWriteMutex> lock(mutex_);
+  std::unique_ptr<HistogramCell>& cell(cells_[key]);
+  if (!cell) {
+    cell.reset(new HistogramCell);
+  }
+  return cell.get();
+}
+
+
+template <class... LabelTypes>
+std::map<std::vector<std::string>, Metric::TimestampedValue>
+Histogram<LabelTypes...>::CurrentValues() const {
+  std::map<std::vector<std::string>, Metric::TimestampedValue> ret;
+  for (const auto& d : CurrentDistributions()) {
+    ret[d.first] = Metric::TimestampedValue(d.second.updated, d.second.count);
+  }
+  return ret;
+}
+
+
+template <class... LabelTypes>
+std::map<std::vector<std::string>, Metric::Distribution>
+Histogram<LabelTypes...>::CurrentDistributions() const {
+  ReaderLock lock(&mutex_);
+  std::map<std::vector<std::string>, Metric::Distribution> ret;
+
+  for (const auto& c : cells_) {
+    Metric::Distribution* const dist(&ret[label_values(c.first)]);
+    dist->updated = c.second->LastUpdated();
+    c.second->Snapshot(&dist->sum, &dist->bucket_counts);
+    dist->count = 0;
+    for (const uint64_t n : dist->bucket_counts) {
+      dist->count += n;
+    }
+  }
+  return ret;
+}
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_MONITORING_HISTOGRAM_H_
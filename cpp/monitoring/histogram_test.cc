@@ -0,0 +1,74 @@
+#include "monitoring/histogram.h"
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <memory>
+
+#include "util/testing.h"
+
+namespace cert_trans {
+
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+
+TEST(HistogramBucketsTest, ValuesFallBelowTheirUpperBound) {
+  for (double value = 0.5; value < 1e9; value *= 1.07) {
+    const int index(HistogramBuckets::BucketIndex(value));
+    EXPECT_LT(value, HistogramBuckets::UpperBound(index)) << value;
+    if (index > 0) {
+      EXPECT_GE(value, HistogramBuckets::UpperBound(index - 1)) << value;
+    }
+  }
+}
+
+
+TEST(HistogramBucketsTest, RelativeError) {
+  for (int index = 1; index < HistogramBuckets::kNumBuckets - 1; ++index) {
+    const double lower(HistogramBuckets::UpperBound(index - 1));
+    const double upper(HistogramBuckets::UpperBound(index));
+    EXPECT_LE((upper - lower) / lower,
+              1.0 / HistogramBuckets::kSubBuckets + 1e-9);
+  }
+}
+
+
+TEST(HistogramBucketsTest, OutOfRange) {
+  EXPECT_EQ(0, HistogramBuckets::BucketIndex(-1));
+  EXPECT_EQ(0, HistogramBuckets::BucketIndex(0));
+  EXPECT_EQ(HistogramBuckets::kNumBuckets - 1,
+            HistogramBuckets::BucketIndex(1e300));
+}
+
+
+TEST(HistogramTest, RecordsDistribution) {
+  unique_ptr<Histogram<string>> histogram(
+      Histogram<string>::New("name", "a string", "help"));
+  histogram->Record("a", 10);
+  histogram->Record("a", 10);
+  histogram->Record("a", 1000);
+  histogram->GetCell("b")->Record(3);
+
+  const auto dists(histogram->CurrentDistributions());
+  ASSERT_EQ(2U, dists.size());
+  const Metric::Distribution& a(dists.at(vector<string>{"a"}));
+  EXPECT_EQ(3U, a.count);
+  EXPECT_EQ(1020, a.sum);
+  ASSERT_EQ(static_cast<size_t>(HistogramBuckets::kNumBuckets),
+            a.bucket_counts.size());
+  EXPECT_EQ(2U, a.bucket_counts[HistogramBuckets::BucketIndex(10)]);
+  EXPECT_EQ(1U, a.bucket_counts[HistogramBuckets::BucketIndex(1000)]);
+  EXPECT_EQ(1U, dists.at(vector<string>{"b"}).count);
+
+  EXPECT_EQ(3, histogram->CurrentValues()[vector<string>{"a"}].second);
+}
+
+
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
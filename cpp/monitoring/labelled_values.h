@@ -2,15 +2,73 @@
 #define CERT_TRANS_MONITORING_LABELLED_VALUES_H_
 
 #include <glog/logging.h>
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <functional>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <thread>
 
+#include "base/lock_contention.h"
+#include "base/read_write_mutex.h"
 #include "monitoring/metric.h"
 
 namespace cert_trans {
 
 
+// The value of a metric for one set of labels.
+//
+// Updates are spread over a number of shards, each on its own cache
+// line, picked by the calling thread, so that threads updating the
+// same value do not contend with each other. The shards are only
+// added up when the value is read, which is rare (typically when the
+// metrics are exported).
+//
+// Set() is not atomic with respect to concurrent calls to
+// IncrementBy(); metrics are either set (gauges) or incremented
+// (counters), not both.
+//
+// This class is thread-safe.
+class LabelledValueCell {
+ public:
+  LabelledValueCell();
+  LabelledValueCell(const LabelledValueCell&) = delete;
+  LabelledValueCell& operator=(const LabelledValueCell&) = delete;
+
+  double Get() const;
+
+  // The time of the most recent update.
+  std::chrono::system_clock::time_point LastUpdated() const;
+
+  void Set(double value);
+
+  void Increment() {
+    IncrementBy(1);
+  }
+
+  void IncrementBy(double amount);
+
+ private:
+  static const int kNumShards = 16;
+
+  struct Shard {
+    std::atomic<double> value;
+    // In std::chrono::system_clock::duration units since the epoch.
+    std::atomic<int64_t> updated;
+    char padding[64 - sizeof(std::atomic<double>) -
+                 sizeof(std::atomic<int64_t>)];
+  };
+
+  static int ThisThreadShard();
+  static int64_t Now();
+
+  Shard shards_[kNumShards];
+};
+
+
 template <class... LabelTypes>
 class LabelledValues {
  public:
@@ -21,6 +79,11 @@ class LabelledValues {
 
   double Get(const LabelTypes&...) const;
 
+  // Returns the cell holding the value for |labels|, creating it if
+  // needed. The cell lives as long as this object, so callers on hot
+  // paths can keep it to skip looking up the labels on every update.
+  LabelledValueCell* GetCell(const LabelTypes&... labels);
+
   void Set(const LabelTypes&... labels, double value);
 
   void Increment(const LabelTypes&...);
@@ -33,12 +96,76 @@ class LabelledValues {
  private:
   const std::string name_;
   const std::vector<std::string> label_names_;
-  mutable std::mutex mutex_;
-  std::map<std::tuple<LabelTypes...>,
-           std::pair<std::chrono::system_clock::time_point, double>> values_;
+  // Only guards the map itself, the cells are updated without it.
+  mutable ReadWriteMutex mutex_;
+  std::map<std::tuple<LabelTypes...>, std::unique_ptr<LabelledValueCell>>
+      cells_;
 };
 
 
+inline LabelledValueCell::LabelledValueCell() {
+  const int64_t now(Now());
+  for (int i = 0; i < kNumShards; ++i) {
+    shards_[i].value.store(0, std::memory_order_relaxed);
+    shards_[i].updated.store(now, std::memory_order_relaxed);
+  }
+}
+
+
+inline double LabelledValueCell::Get() const {
+  double ret(0);
+  for (int i = 0; i < kNumShards; ++i) {
+    ret += shards_[i].value.load(std::memory_order_relaxed);
+  }
+  return ret;
+}
+
+
+inline std::chrono::system_clock::time_point LabelledValueCell::LastUpdated()
+    const {
+  int64_t ret(0);
+  for (int i = 0; i < kNumShards; ++i) {
+    ret = std::max(ret, shards_[i].updated.load(std::memory_order_relaxed));
+  }
+  return std::chrono::system_clock::time_point(
+      std::chrono::system_clock::duration(ret));
+}
+
+
+inline void LabelledValueCell::Set(double value) {
+  const int64_t now(Now());
+  for (int i = 1; i < kNumShards; ++i) {
+    shards_[i].value.store(0, std::memory_order_relaxed);
+  }
+  shards_[0].value.store(value, std::memory_order_relaxed);
+  shards_[0].updated.store(now, std::memory_order_relaxed);
+}
+
+
+inline void LabelledValueCell::IncrementBy(double amount) {
+  Shard* const shard(&shards_[ThisThreadShard()]);
+  double old_value(shard->value.load(std::memory_order_relaxed));
+  while (!shard->value.compare_exchange_weak(old_value, old_value + amount,
+                                             std::memory_order_relaxed)) {
+  }
+  shard->updated.store(Now(), std::memory_order_relaxed);
+}
+
+
+// static
+inline int LabelledValueCell::ThisThreadShard() {
+  static thread_local const int shard(
+      std::hash<std::thread::id>()(std::this_thread::get_id()) % kNumShards);
+  return shard;
+}
+
+
+// static
+inline int64_t LabelledValueCell::Now() {
+  return std::chrono::system_clock::now().time_since_epoch().count();
+}
+
+
 namespace {
 
 
@@ -75,28 +202,48 @@ template <class... LabelTypes>
 LabelledValues<LabelTypes...>::LabelledValues(
     const std::string& name,
     const typename NameType<LabelTypes>::name&... label_names)
-    : name_(name), label_names_{label_names...} {
+    : name_(name),
+      label_names_{label_names...},
+      mutex_(LockContention::Get("labelled_values")) {
 }
 
 
 template <class... LabelTypes>
 double LabelledValues<LabelTypes...>::Get(const LabelTypes&... labels) const {
-  std::lock_guard<std::mutex> lock(mutex_);
-  const std::tuple<LabelTypes...> key(labels...);
-  const auto it(values_.find(key));
-  if (it == values_.end()) {
+  ReaderLock lock(&mutex_);
+  const auto it(cells_.find(std::tuple<LabelTypes...>(labels...)));
+  if (it == cells_.end()) {
     return 0;
   }
-  return it->second.second;
+  return it->second->Get();
+}
+
+
+template <class... LabelTypes>
+LabelledValueCell* LabelledValues<LabelTypes...>::GetCell(
+    const LabelTypes&... labels) {
+  const std::tuple<LabelTypes...> key(labels...);
+  {
+    ReaderLock lock(&mutex_);
+    const auto it(cells_.find(key));
+    if (it != cells_.end()) {
+      return it->second.get();
+    }
+  }
+
+  std::lock_guard<ReadWriteMutex> lock(mutex_);
+  std::unique_ptr<LabelledValueCell>& cell(cells_[key]);
+  if (!cell) {
+    cell.reset(new LabelledValueCell);
+  }
+  return cell.get();
 }
 
 
 template <class... LabelTypes>
 void LabelledValues<LabelTypes...>::Set(const LabelTypes&... labels,
                                         double value) {
-  std::lock_guard<std::mutex> lock(mutex_);
-  values_[std::tuple<LabelTypes...>(labels...)] =
-      make_pair(std::chrono::system_clock::now(), value);
+  GetCell(labels...)->Set(value);
 }
 
 
@@ -109,26 +256,19 @@ void LabelledValues<LabelTypes...>::Increment(const LabelTypes&... labels) {
 template <class... LabelTypes>
 void LabelledValues<LabelTypes...>::IncrementBy(const LabelTypes&... labels,
                                                 double amount) {
-  std::lock_guard<std::mutex> lock(mutex_);
-  const std::tuple<LabelTypes...> key(labels...);
-  const auto it(values_.find(key));
-  if (it == values_.end()) {
-    values_[key] = make_pair(std::chrono::system_clock::now(), amount);
-    return;
-  }
-  values_[key] = make_pair(std::chrono::system_clock::now(),
-                           values_[key].second + amount);
+  GetCell(labels...)->IncrementBy(amount);
 }
 
 
 template <class... LabelTypes>
 std::map<std::vector<std::string>, Metric::TimestampedValue>
 LabelledValues<LabelTypes...>::CurrentValues() const {
-  std::lock_guard<std::mutex> lock(mutex_);
+  ReaderLock lock(&mutex_);
   std::map<std::vector<std::string>, Metric::TimestampedValue> ret;
 
-  for (const auto& v : values_) {
-    ret[label_values(v.first)] = v.second;
+  for (const auto& c : cells_) {
+    ret[label_values(c.first)] =
+        Metric::TimestampedValue(c.second->LastUpdated(), c.second->Get());
   }
   return ret;
 }
@@ -1,11 +1,18 @@
 #ifndef CERT_TRANS_MONITORING_LATENCY_H_
 #define CERT_TRANS_MONITORING_LATENCY_H_
 
+#include <functional>
+#include <memory>
 #include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
 
 #include "monitoring/counter.h"
 #include "monitoring/event_metric.h"
+#include "monitoring/histogram.h"
 #include "monitoring/monitoring.h"
+#include "util/trace.h"
 
 namespace cert_trans {
 
@@ -18,6 +25,14 @@ class ScopedLatency;
 // called "|base_name|_count" which contains the number of latency measurements
 // taken, also broken down by labels.
 //
+// It also creates a Histogram metric called "|base_name|_distribution",
+// from which percentiles of the latency can be computed.
+//
+// ScopedLatency objects are also trace spans (see util/trace.h), named
+// after |base_name| and the label values (e.g.
+// "leveldb_latency_by_operation_ms:lookup_by_hash"), and current for
+// their lifetime.
+//
 // To actually measure latency, you can either call RecordLatency() directly
 // with a latency sample, or use the ScopedLatency() method to return an object
 // which will automatically add a latency measurement consisting of the
@@ -67,7 +82,10 @@ class Latency {
   ScopedLatency GetScopedLatency(const LabelTypes&... labels);
 
  private:
+  const std::string base_name_;
+  const std::vector<std::string> label_names_;
   EventMetric<LabelTypes...> metric_;
+  const std::unique_ptr<Histogram<LabelTypes...>> histogram_;
 };
 
 
@@ -86,13 +104,16 @@ class ScopedLatency {
 
  private:
   ScopedLatency(
-      const std::function<void(std::chrono::duration<double>)>& record_latency)
+      const std::function<void(std::chrono::duration<double>)>& record_latency,
+      util::ScopedSpan&& span)
       : record_latency_(record_latency),
-        start_(std::chrono::steady_clock::now()) {
+        start_(std::chrono::steady_clock::now()),
+        span_(std::move(span)) {
   }
 
   const std::function<void(std::chrono::duration<double>)> record_latency_;
   const std::chrono::steady_clock::time_point start_;
+  util::ScopedSpan span_;
 
   template <class TimeUnit, class... LabelTypes>
   friend class Latency;
@@ -104,24 +125,42 @@ Latency<TimeUnit, LabelTypes...>::Latency(
     const std::string& base_name,
     const typename NameType<LabelTypes>::name&... label_names,
     const std::string& help)
-    : metric_(base_name, label_names..., help) {
+    : base_name_(base_name),
+      label_names_{label_names...},
+      metric_(base_name, label_names..., help),
+      histogram_(Histogram<LabelTypes...>::New(base_name + "_distribution",
+                                               label_names...,
+                                               help + " (distribution)")) {
 }
 
 
 template <class TimeUnit, class... LabelTypes>
 void Latency<TimeUnit, LabelTypes...>::RecordLatency(
     const LabelTypes&... labels, std::chrono::duration<double> latency) {
-  metric_.RecordEvent(labels...,
-                      std::chrono::duration_cast<TimeUnit>(latency).count());
+  const double value(std::chrono::duration_cast<TimeUnit>(latency).count());
+  metric_.RecordEvent(labels..., value);
+  histogram_->Record(labels..., value);
 }
 
 
 template <class TimeUnit, class... LabelTypes>
 ScopedLatency Latency<TimeUnit, LabelTypes...>::GetScopedLatency(
     const LabelTypes&... labels) {
+  util::ScopedSpan span(base_name_);
+  if (span.span()->sampled()) {
+    const std::vector<std::string> values(
+        label_values(std::tuple<LabelTypes...>(labels...)));
+    std::string name(base_name_);
+    for (size_t i = 0; i < values.size(); ++i) {
+      name += (i == 0 ? ":" : ",") + values[i];
+      span.span()->SetAttribute(label_names_[i], values[i]);
+    }
+    span.span()->SetName(name);
+  }
   return cert_trans::ScopedLatency(
       std::bind(&Latency<TimeUnit, LabelTypes...>::RecordLatency, this,
-                labels..., std::placeholders::_1));
+                labels..., std::placeholders::_1),
+      std::move(span));
 }
 
 
@@ -0,0 +1,134 @@
+#include "monitoring/memory.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <unistd.h>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+
+#include "monitoring/monitoring.h"
+
+DEFINE_int32(memory_estimate_interval_secs, 60,
+             "How often the memory estimates of the subsystems are "
+             "exported, 0 not to export them.");
+
+using std::lock_guard;
+using std::map;
+using std::mutex;
+using std::set;
+using std::string;
+
+namespace cert_trans {
+namespace {
+
+
+static Gauge<string>* memory_estimate_bytes(
+    Gauge<string>::New("memory_estimate_bytes", "subsystem",
+                       "Estimate of the memory held by each subsystem, in "
+                       "bytes."));
+
+static Gauge<>* memory_resident_bytes(
+    Gauge<>::New("memory_resident_bytes",
+                 "Resident set size of the process, in bytes."));
+
+
+// The estimates, by subsystem. Never destroyed, as the thread updating
+// the gauges may still be running at exit.
+struct Estimates {
+  // Held while calling the estimators, so that they are not destroyed
+  // meanwhile.
+  mutex lock;
+  map<string, set<const MemoryEstimate*>> by_subsystem;
+  bool updating = false;
+};
+
+
+Estimates* GetEstimates() {
+  static Estimates* const estimates(new Estimates);
+  return estimates;
+}
+
+
+// Returns the resident set size of the process, or 0 if it is not
+// known.
+size_t ResidentBytes() {
+  std::ifstream statm("/proc/self/statm");
+  size_t size, resident;
+  if (!(statm >> size >> resident)) {
+    return 0;
+  }
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+
+void UpdatePeriodically() {
+  while (true) {
+    std::this_thread::sleep_for(
+        std::chrono::seconds(FLAGS_memory_estimate_interval_secs));
+    MemoryEstimate::UpdateGauges();
+  }
+}
+
+
+}  // namespace
+
+
+MemoryEstimate::MemoryEstimate(const string& subsystem,
+                               const Estimator& estimator)
+    : subsystem_(subsystem), estimator_(estimator) {
+  CHECK(estimator_);
+  Estimates* const estimates(GetEstimates());
+  lock_guard<mutex> lock(estimates->lock);
+  CHECK(estimates->by_subsystem[subsystem_].insert(this).second);
+  if (!estimates->updating && FLAGS_memory_estimate_interval_secs > 0) {
+    estimates->updating = true;
+    std::thread(&UpdatePeriodically).detach();
+  }
+}
+
+
+MemoryEstimate::~MemoryEstimate() {
+  Estimates* const estimates(GetEstimates());
+  lock_guard<mutex> lock(estimates->lock);
+  // The subsystem is kept, so that its gauge drops to 0.
+  CHECK_EQ(1U, estimates->by_subsystem[subsystem_].erase(this));
+}
+
+
+// static
+size_t MemoryEstimate::Total(const string& subsystem) {
+  Estimates* const estimates(GetEstimates());
+  lock_guard<mutex> lock(estimates->lock);
+  size_t total(0);
+  const auto it(estimates->by_subsystem.find(subsystem));
+  if (it != estimates->by_subsystem.end()) {
+    for (const MemoryEstimate* const estimate : it->second) {
+      total += estimate->estimator_();
+    }
+  }
+  return total;
+}
+
+
+// static
+void MemoryEstimate::UpdateGauges() {
+  Estimates* const estimates(GetEstimates());
+  {
+    lock_guard<mutex> lock(estimates->lock);
+    for (const auto& subsystem : estimates->by_subsystem) {
+      size_t total(0);
+      for (const MemoryEstimate* const estimate : subsystem.second) {
+        total += estimate->estimator_();
+      }
+      memory_estimate_bytes->Set(subsystem.first, total);
+    }
+  }
+  memory_resident_bytes->Set(ResidentBytes());
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,50 @@
+#ifndef CERT_TRANS_MONITORING_MEMORY_H_
+#define CERT_TRANS_MONITORING_MEMORY_H_
+
+#include <stddef.h>
+#include <functional>
+#include <string>
+
+namespace cert_trans {
+
+
+// An estimate of the memory held by part of a subsystem of a server
+// (e.g. the Merkle tree of a LogLookup), for the time this instance
+// lives. The estimates of each subsystem are added up, and exported as
+// the "memory_estimate_bytes" gauge, labelled by subsystem, along with
+// the resident set size of the process as "memory_resident_bytes", so
+// that the growth of the latter can be attributed.
+//
+// The gauges are updated every --memory_estimate_interval_secs, by a
+// thread started along with the first estimate, which calls the
+// estimators in turn. An estimator should be cheap (e.g. the sizes of
+// containers, or counters kept up to date as they change, rather than
+// walks over them), and may take the locks of its subsystem, as long as
+// they are not held when it is destroyed.
+//
+// This class is thread-safe.
+class MemoryEstimate {
+ public:
+  typedef std::function<size_t()> Estimator;
+
+  MemoryEstimate(const std::string& subsystem, const Estimator& estimator);
+  // Waits for |estimator| to return if it is running.
+  ~MemoryEstimate();
+  MemoryEstimate(const MemoryEstimate&) = delete;
+  MemoryEstimate& operator=(const MemoryEstimate&) = delete;
+
+  // Returns the sum of the estimates of |subsystem| now.
+  static size_t Total(const std::string& subsystem);
+
+  // Updates the gauges now.
+  static void UpdateGauges();
+
+ private:
+  const std::string subsystem_;
+  const Estimator estimator_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_MONITORING_MEMORY_H_
@@ -0,0 +1,43 @@
+#include "monitoring/memory.h"
+
+#include <gflags/gflags.h>
+#include <gtest/gtest.h>
+
+#include "util/testing.h"
+
+DECLARE_int32(memory_estimate_interval_secs);
+
+namespace cert_trans {
+namespace {
+
+
+TEST(MemoryEstimateTest, AddsUpSubsystem) {
+  size_t first(100), second(20);
+  const MemoryEstimate a("subsystem", [&first]() { return first; });
+  {
+    const MemoryEstimate b("subsystem", [&second]() { return second; });
+    const MemoryEstimate other("other", []() { return size_t(1); });
+    EXPECT_EQ(120U, MemoryEstimate::Total("subsystem"));
+    EXPECT_EQ(1U, MemoryEstimate::Total("other"));
+
+    first = 300;
+    EXPECT_EQ(320U, MemoryEstimate::Total("subsystem"));
+    MemoryEstimate::UpdateGauges();
+  }
+
+  // Gone with their estimates.
+  EXPECT_EQ(300U, MemoryEstimate::Total("subsystem"));
+  EXPECT_EQ(0U, MemoryEstimate::Total("other"));
+  EXPECT_EQ(0U, MemoryEstimate::Total("unknown"));
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  FLAGS_memory_estimate_interval_secs = 0;
+  return RUN_ALL_TESTS();
+}
@@ -1,6 +1,8 @@
 #ifndef CERT_TRANS_MONITORING_METRIC_H_
 #define CERT_TRANS_MONITORING_METRIC_H_
 
+#include <stdint.h>
+#include <chrono>
 #include <map>
 #include <ostream>
 #include <set>
@@ -26,9 +28,19 @@ class Metric {
   typedef std::pair<std::chrono::system_clock::time_point, double>
       TimestampedValue;
 
+  // The values recorded by a histogram, see monitoring/histogram.h.
+  struct Distribution {
+    std::chrono::system_clock::time_point updated;
+    uint64_t count = 0;
+    double sum = 0;
+    // The number of values in each of the HistogramBuckets.
+    std::vector<uint64_t> bucket_counts;
+  };
+
   enum Type {
     COUNTER,
     GAUGE,
+    HISTOGRAM,
   };
 
   Type Type() const {
@@ -65,6 +77,12 @@ class Metric {
   virtual std::map<std::vector<std::string>, TimestampedValue> CurrentValues()
       const = 0;
 
+  // Only returns anything for HISTOGRAM metrics.
+  virtual std::map<std::vector<std::string>, Distribution>
+  CurrentDistributions() const {
+    return std::map<std::vector<std::string>, Distribution>();
+  }
+
  protected:
   Metric(enum Type type, const std::string& name,
          const std::vector<std::string>& label_names, const std::string& help)
@@ -1,12 +1,32 @@
 #include "monitoring/prometheus/exporter.h"
+
+#include <gflags/gflags.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+
+#include "monitoring/histogram.h"
 #include "monitoring/metric.h"
 #include "monitoring/prometheus/metrics.pb.h"
 #include "monitoring/registry.h"
 
+DEFINE_int32(prometheus_snapshot_cache_ms, 1000,
+             "How long a snapshot of the metrics is served to Prometheus "
+             "scrapes for, in milliseconds. Zero takes a new snapshot for "
+             "every scrape.");
+
+using google::protobuf::io::StringOutputStream;
 using std::chrono::duration_cast;
 using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+using std::lock_guard;
+using std::make_shared;
 using std::map;
+using std::mutex;
 using std::set;
+using std::shared_ptr;
+using std::sort;
 using std::string;
 using std::vector;
 
@@ -26,6 +46,35 @@ void AddLabelTypes(::io::prometheus::client::Metric* metric,
 }
 
 
+void PopulateHistograms(const Metric& metric,
+                        ::io::prometheus::client::MetricFamily* family) {
+  const vector<string> label_names(metric.LabelNames());
+  for (const auto& d : metric.CurrentDistributions()) {
+    io::prometheus::client::Metric* m(family->add_metric());
+    AddLabelTypes(m, label_names, d.first);
+    m->set_timestamp_ms(
+        duration_cast<milliseconds>(d.second.updated.time_since_epoch())
+            .count());
+    io::prometheus::client::Histogram* const histogram(
+        m->mutable_histogram());
+    histogram->set_sample_count(d.second.count);
+    histogram->set_sample_sum(d.second.sum);
+    // Only export the buckets holding something, the others can be
+    // inferred from the cumulative counts.
+    uint64_t cumulative_count(0);
+    for (size_t i(0); i < d.second.bucket_counts.size(); ++i) {
+      if (d.second.bucket_counts[i] == 0) {
+        continue;
+      }
+      cumulative_count += d.second.bucket_counts[i];
+      io::prometheus::client::Bucket* const bucket(histogram->add_bucket());
+      bucket->set_cumulative_count(cumulative_count);
+      bucket->set_upper_bound(HistogramBuckets::UpperBound(i));
+    }
+  }
+}
+
+
 ::io::prometheus::client::MetricFamily PopulateMetricFamily(
     const Metric& metric) {
   ::io::prometheus::client::MetricFamily family;
@@ -38,6 +87,10 @@ void AddLabelTypes(::io::prometheus::client::Metric* metric,
     case Metric::GAUGE:
       family.set_type(io::prometheus::client::MetricType::GAUGE);
       break;
+    case Metric::HISTOGRAM:
+      family.set_type(io::prometheus::client::MetricType::HISTOGRAM);
+      PopulateHistograms(metric, &family);
+      return family;
     default:
       LOG(FATAL) << "Unknown metric type: " << metric.Type();
   }
@@ -66,21 +119,59 @@ void AddLabelTypes(::io::prometheus::client::Metric* metric,
 }
 
 
+// The registry orders the metrics by address, sort them by name so
+// that the output is stable.
+vector<const Metric*> MetricsByName() {
+  const set<const Metric*> metrics(Registry::Instance()->GetMetrics());
+  vector<const Metric*> ret(metrics.begin(), metrics.end());
+  sort(ret.begin(), ret.end(), [](const Metric* a, const Metric* b) {
+    return a->Name() < b->Name();
+  });
+  return ret;
+}
+
+
+shared_ptr<const string> TakeSnapshot() {
+  const shared_ptr<string> ret(make_shared<string>());
+  {
+    StringOutputStream output(ret.get());
+    for (const Metric* m : MetricsByName()) {
+      CHECK(WriteDelimitedTo(PopulateMetricFamily(*m), &output));
+    }
+  }
+  return ret;
+}
+
+
 }  // namespace
 
+
 void ExportMetricsToPrometheus(std::ostream* os) {
-  const set<const Metric*> metrics(Registry::Instance()->GetMetrics());
+  *CHECK_NOTNULL(os) << *PrometheusMetricsSnapshot();
+}
 
-  for (auto it(metrics.begin()); it != metrics.end(); ++it) {
-    const ::io::prometheus::client::MetricFamily family(
-        PopulateMetricFamily(**it));
-    CHECK(WriteDelimitedToOstream(family, os));
+
+shared_ptr<const string> PrometheusMetricsSnapshot() {
+  static mutex* const snapshot_lock(new mutex);
+  static shared_ptr<const string>* const snapshot(
+      new shared_ptr<const string>);
+  static steady_clock::time_point snapshot_time;
+
+  // Holding the lock while taking the snapshot makes concurrent
+  // scrapes wait for it rather than take their own.
+  lock_guard<mutex> lock(*snapshot_lock);
+  const steady_clock::time_point now(steady_clock::now());
+  if (!*snapshot || now - snapshot_time >=
+                        milliseconds(FLAGS_prometheus_snapshot_cache_ms)) {
+    *snapshot = TakeSnapshot();
+    snapshot_time = now;
   }
+  return *snapshot;
 }
 
 
 void ExportMetricsToHtml(std::ostream* os) {
-  const set<const Metric*> metrics(Registry::Instance()->GetMetrics());
+  const vector<const Metric*> metrics(MetricsByName());
   *os << "<html>\n"
       << "<body>\n"
       << "  <h1>Metrics</h1>\n";
@@ -2,6 +2,8 @@
 #define CERT_TRANS_MONITORING_PROMETHEUS_H_
 
 #include <glog/logging.h>
+#include <memory>
+#include <string>
 
 #include "util/protobuf_util.h"
 
@@ -10,6 +12,14 @@ namespace cert_trans {
 void ExportMetricsToPrometheus(std::ostream* os);
 
 
+// Returns all the metrics, ordered by name and labels, as a stream of
+// length-delimited MetricFamily messages (see metrics.proto). The
+// result is kept for --prometheus_snapshot_cache_ms, so that
+// concurrent scrapes share one snapshot rather than each walking all
+// the metrics.
+std::shared_ptr<const std::string> PrometheusMetricsSnapshot();
+
+
 void ExportMetricsToHtml(std::ostream* os);
 
 
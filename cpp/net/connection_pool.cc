@@ -3,8 +3,13 @@
 #include <event2/event.h>
 #include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <stdlib.h>
+#include <algorithm>
 #include <chrono>
+#include <sstream>
+#include <vector>
 
+#include "monitoring/latency.h"
 #include "monitoring/monitoring.h"
 #include "util/openssl_util.h"
 
@@ -16,8 +21,11 @@ extern "C" {
 
 using std::bind;
 using std::chrono::duration_cast;
+using std::chrono::microseconds;
 using std::chrono::seconds;
+using std::chrono::steady_clock;
 using std::chrono::system_clock;
+using std::getline;
 using std::lock_guard;
 using std::make_pair;
 using std::map;
@@ -27,10 +35,12 @@ using std::pair;
 using std::placeholders::_1;
 using std::placeholders::_2;
 using std::string;
+using std::stringstream;
 using std::to_string;
 using std::unique_lock;
 using std::unique_ptr;
 using std::shared_ptr;
+using std::vector;
 using util::ClearOpenSSLErrors;
 using util::DumpOpenSSLErrorStack;
 
@@ -50,6 +60,21 @@ DEFINE_string(trusted_root_certs, "",
               "connections.");
 DEFINE_int32(url_fetcher_max_conn_per_host_port, 4,
              "maximum number of URL fetcher connections per host:port");
+DEFINE_string(url_fetcher_max_conn_overrides, "",
+              "Comma-separated host:port=N pairs overriding "
+              "--url_fetcher_max_conn_per_host_port for some destinations, "
+              "e.g. the etcd servers.");
+DEFINE_int32(url_fetcher_warm_conns_per_host_port, 0,
+             "Number of idle URL fetcher connections to a host:port which "
+             "are opened ahead of need, once it has been fetched from (at "
+             "most its maximum number of connections).");
+DEFINE_bool(tls_client_session_resumption, true,
+            "Resume the last TLS session with each host:port when opening "
+            "new outgoing HTTPS connections, rather than doing a full "
+            "handshake.");
+DEFINE_int32(connection_pool_cleanup_interval_seconds, 30,
+             "How often idle URL fetcher connections are checked for "
+             "breakage and age.");
 
 DEFINE_string(tls_client_minimum_protocol, "tlsv12",
               "Minimum acceptable TLS "
@@ -76,10 +101,33 @@ namespace internal {
 
 const int kZeroMillis = 0;
 
+// A rough estimate of the memory held by an idle connection: its
+// libevent buffers, and its TLS state if any.
+const size_t kIdleConnectionBytes = 16 * 1024;
+
 
 static Gauge<string>* connections_per_host_port(
     Gauge<string>::New("connections_per_host_port", "host_port",
                        "Number of cached connections port host:port"));
+static Counter<string, string>* connection_pool_gets(
+    Counter<string, string>::New("connection_pool_gets", "host_port",
+                                 "result",
+                                 "Number of connections taken from the pool, "
+                                 "by host:port and whether a cached one was "
+                                 "reused (\"hit\") or not (\"miss\")."));
+static Counter<string>* connection_pool_warm_connections(
+    Counter<string>::New("connection_pool_warm_connections", "host_port",
+                         "Number of connections opened ahead of need, by "
+                         "host:port."));
+static Counter<string, string>* tls_client_handshakes(
+    Counter<string, string>::New("tls_client_handshakes", "host_port", "type",
+                                 "Number of outgoing TLS handshakes, by "
+                                 "host:port and whether a session was "
+                                 "\"resumed\" or a \"full\" one done."));
+static Latency<microseconds, string> connection_pool_wait_us(
+    "connection_pool_wait_us", "host_port",
+    "Time taken to get a connection from the pool in us, including opening "
+    "a new one, by host:port.");
 
 
 namespace {
@@ -92,14 +140,90 @@ int GetSSLConnectionIndex() {
 }
 
 
+int GetSSLCtxSessionCacheIndex() {
+  static const int ssl_ctx_session_cache_index(
+      SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr));
+  return ssl_ctx_session_cache_index;
+}
+
+
 string HostPortString(const HostPortPair& pair) {
   return pair.first + ":" + to_string(pair.second);
 }
 
 
+// Parses --url_fetcher_max_conn_overrides.
+map<HostPortPair, size_t> ParseMaxIdle(const string& overrides) {
+  map<HostPortPair, size_t> max_idle;
+  stringstream ss(overrides);
+  string item;
+  while (getline(ss, item, ',')) {
+    if (item.empty()) {
+      continue;
+    }
+    const size_t equals(item.find('='));
+    const size_t colon(item.rfind(':', equals));
+    char* end;
+    const unsigned long port(
+        colon == string::npos ? 0 : strtoul(&item[colon + 1], &end, 10));
+    if (colon == string::npos || equals == string::npos || colon == 0 ||
+        *end != '=' || port == 0 || port > UINT16_MAX) {
+      LOG(FATAL) << "bad --url_fetcher_max_conn_overrides entry: " << item;
+    }
+    const unsigned long max(strtoul(&item[equals + 1], &end, 10));
+    if (equals + 1 == item.size() || *end != '\0') {
+      LOG(FATAL) << "bad --url_fetcher_max_conn_overrides entry: " << item;
+    }
+    max_idle[make_pair(item.substr(0, colon), port)] = max;
+  }
+  return max_idle;
+}
+
+
 }  // namespace
 
 
+// Keeps the latest TLS session established with each host:port, so
+// that new connections to it can resume it rather than do a full
+// handshake.
+class TlsSessionCache {
+ public:
+  TlsSessionCache() = default;
+  TlsSessionCache(const TlsSessionCache&) = delete;
+  TlsSessionCache& operator=(const TlsSessionCache&) = delete;
+
+  ~TlsSessionCache() {
+    for (const auto& session : sessions_) {
+      SSL_SESSION_free(session.second);
+    }
+  }
+
+  // Takes over the reference to |session|.
+  void Put(const HostPortPair& key, SSL_SESSION* session) {
+    lock_guard<mutex> lock(lock_);
+    SSL_SESSION*& entry(sessions_[key]);
+    if (entry) {
+      SSL_SESSION_free(entry);
+    }
+    entry = session;
+  }
+
+  // Has |ssl| offer the session of |key| to the server, if there is
+  // one. The server may still decline it.
+  void Resume(const HostPortPair& key, SSL* ssl) {
+    lock_guard<mutex> lock(lock_);
+    const auto it(sessions_.find(key));
+    if (it != sessions_.end()) {
+      CHECK_EQ(SSL_set_session(ssl, it->second), 1);
+    }
+  }
+
+ private:
+  mutex lock_;
+  map<HostPortPair, SSL_SESSION*> sessions_;
+};
+
+
 // This class wraps the evhtp_connection_t* and associated data which need to
 // hang around for at least the lifetime that structure.
 class EvConnection {
@@ -115,9 +239,17 @@ class EvConnection {
   // delete it.
   static evhtp_res ConnectionFinishedHook(evhtp_connection_t* conn, void* arg);
 
+  // Called by OpenSSL with each session the server gives us, which
+  // (with TLS 1.3) can come after the handshake.
+  static int NewSessionCallback(SSL* ssl, SSL_SESSION* session);
+
+  // Called by OpenSSL as the state of a connection changes.
+  static void InfoCallback(const SSL* ssl, int where, int ret);
+
   EvConnection(evhtp_connection_t* conn, HostPortPair&& other_end)
       : ev_conn_(CHECK_NOTNULL(conn)),
         other_end_(move(other_end)),
+        handshake_done_(false),
         errored_(false) {
     if (ev_conn_->ssl) {
       SSL_set_ex_data(ev_conn_->ssl, GetSSLConnectionIndex(),
@@ -148,6 +280,8 @@ class EvConnection {
   // We never really own this, evhtp does, as it likes to remind us.
   evhtp_connection_t* ev_conn_;
   const HostPortPair other_end_;
+  // Only used on the libevent dispatch thread.
+  bool handshake_done_;
 
   mutable std::mutex lock_;
   bool errored_;
@@ -224,6 +358,43 @@ int EvConnection::SSLVerifyCallback(const int preverify_ok,
 }
 
 
+// static
+int EvConnection::NewSessionCallback(SSL* ssl, SSL_SESSION* session) {
+  CHECK_NOTNULL(ssl);
+  TlsSessionCache* const cache(static_cast<TlsSessionCache*>(
+      SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl),
+                          GetSSLCtxSessionCacheIndex())));
+  const EvConnection* const connection(static_cast<const EvConnection*>(
+      SSL_get_ex_data(ssl, GetSSLConnectionIndex())));
+  if (!cache || !connection) {
+    // Not keeping it, OpenSSL will free it.
+    return 0;
+  }
+
+  cache->Put(connection->other_end_, session);
+  return 1;
+}
+
+
+// static
+void EvConnection::InfoCallback(const SSL* ssl, int where, int ret) {
+  if (!(where & SSL_CB_HANDSHAKE_DONE)) {
+    return;
+  }
+  EvConnection* const connection(static_cast<EvConnection*>(
+      SSL_get_ex_data(ssl, GetSSLConnectionIndex())));
+  // With TLS 1.3, later session tickets are also reported as
+  // handshakes.
+  if (!connection || connection->handshake_done_) {
+    return;
+  }
+  connection->handshake_done_ = true;
+  tls_client_handshakes->Increment(
+      HostPortString(connection->other_end_),
+      SSL_session_reused(const_cast<SSL*>(ssl)) ? "resumed" : "full");
+}
+
+
 ConnectionPool::Connection::Connection(const shared_ptr<EvConnection>& conn)
     : connection_(conn) {
 }
@@ -283,8 +454,20 @@ SSL_CTX* CreateSSLCTXFromFlags() {
 
 ConnectionPool::ConnectionPool(libevent::Base* base)
     : base_(CHECK_NOTNULL(base)),
+      max_idle_(ParseMaxIdle(FLAGS_url_fetcher_max_conn_overrides)),
+      sessions_(new TlsSessionCache),
       cleanup_scheduled_(false),
-      ssl_ctx_(CreateSSLCTXFromFlags(), SSL_CTX_free) {
+      ssl_ctx_(CreateSSLCTXFromFlags(), SSL_CTX_free),
+      cleanup_timer_(*base_, -1, 0, bind(&ConnectionPool::Cleanup, this)),
+      memory_("connection_pool", [this]() {
+        lock_guard<mutex> lock(lock_);
+        size_t idle(0);
+        for (const auto& conns : conns_) {
+          idle += conns.second.size();
+        }
+        return idle * kIdleConnectionBytes;
+      }) {
+  CHECK_GT(FLAGS_connection_pool_cleanup_interval_seconds, 0);
   CHECK(ssl_ctx_) << "could not build SSL context: "
                   << DumpOpenSSLErrorStack();
 
@@ -309,6 +492,29 @@ ConnectionPool::ConnectionPool(libevent::Base* base)
 
   SSL_CTX_set_verify(ssl_ctx_.get(), SSL_VERIFY_PEER,
                      EvConnection::SSLVerifyCallback);
+  SSL_CTX_set_info_callback(ssl_ctx_.get(), EvConnection::InfoCallback);
+
+  if (FLAGS_tls_client_session_resumption) {
+    // The sessions are only kept in |sessions_|, by host:port: OpenSSL
+    // does not look sessions up by itself on the client side.
+    SSL_CTX_set_session_cache_mode(
+        ssl_ctx_.get(),
+        SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    CHECK_EQ(SSL_CTX_set_ex_data(ssl_ctx_.get(), GetSSLCtxSessionCacheIndex(),
+                                 sessions_.get()),
+             1);
+    SSL_CTX_sess_set_new_cb(ssl_ctx_.get(), EvConnection::NewSessionCallback);
+  }
+
+  cleanup_timer_.Add(seconds(FLAGS_connection_pool_cleanup_interval_seconds));
+}
+
+
+ConnectionPool::~ConnectionPool() {
+  // Connections can outlive the pool, and still be given sessions.
+  CHECK_EQ(SSL_CTX_set_ex_data(ssl_ctx_.get(), GetSSLCtxSessionCacheIndex(),
+                               nullptr),
+           1);
 }
 
 
@@ -404,10 +610,11 @@ void ConnectionPool::RemoveDeadConnectionsFromDeque(
   CHECK(lock.owns_lock());
   CHECK(deque);
 
-  // Do a sweep and remove any dead connections
+  // Do a sweep and remove any dead connections, or ones which broke
+  // while idle (e.g. closed by the other end).
   for (auto deque_it(deque->begin()); deque_it != deque->end();) {
     CHECK(deque_it->second);
-    if (!deque_it->second->connection()) {
+    if (!deque_it->second->connection() || deque_it->second->GetErrored()) {
       VLOG(1) << "Removing dead connection to "
               << deque_it->second->other_end().first << ":"
               << deque_it->second->other_end().second;
@@ -419,64 +626,135 @@ void ConnectionPool::RemoveDeadConnectionsFromDeque(
 }
 
 
+unique_ptr<ConnectionPool::Connection> ConnectionPool::NewConnection(
+    const URL& url, HostPortPair key) {
+  // This EvConnection has a slightly complicated lifetime; it needs to hang
+  // around until libevhtp/libevent have entirely finished with the
+  // evhtp_connection_t it references, and for at least as long as the life
+  // of the Connection we return from this method.
+  //
+  // This is accomplished through the use of a couple of shared_ptrs;
+  // this one, which goes inside the returned Connection object, and another
+  // created further below which gets passed in to the
+  // ConnectionFinishedHook.
+  auto conn(std::make_shared<EvConnection>(
+      url.Protocol() == "https"
+          ? base_->HttpsConnectionNew(key.first, key.second, ssl_ctx_.get())
+          : base_->HttpConnectionNew(key.first, key.second),
+      move(key)));
+  unique_ptr<ConnectionPool::Connection> handle(new Connection(conn));
+  struct timeval read_timeout = {FLAGS_connection_read_timeout_seconds,
+                                 kZeroMillis};
+  struct timeval write_timeout = {FLAGS_connection_write_timeout_seconds,
+                                  kZeroMillis};
+  evhtp_connection_set_timeouts(handle->connection(), &read_timeout,
+                                &write_timeout);
+  evhtp_set_hook(&handle->connection()->hooks, evhtp_hook_on_conn_error,
+                 reinterpret_cast<evhtp_hook>(
+                     EvConnection::ConnectionErrorHook),
+                 reinterpret_cast<void*>(conn.get()));
+  evhtp_set_hook(
+      &handle->connection()->hooks, evhtp_hook_on_connection_fini,
+      reinterpret_cast<evhtp_hook>(EvConnection::ConnectionFinishedHook),
+      // We'll hold on to another shared_ptr to the Connection
+      // until evhtp tells us that it's finished with the cnxn.
+      reinterpret_cast<void*>(new shared_ptr<EvConnection>(conn)));
+  if (FLAGS_tls_client_session_resumption && handle->connection()->ssl) {
+    // Not started yet: the handshake only begins once connected.
+    sessions_->Resume(conn->other_end(), handle->connection()->ssl);
+  }
+  return handle;
+}
+
+
 unique_ptr<ConnectionPool::Connection> ConnectionPool::Get(const URL& url) {
   CHECK(url.Protocol() == "http" || url.Protocol() == "https");
+  const steady_clock::time_point started(steady_clock::now());
   const uint16_t default_port(url.Protocol() == "https" ? 443 : 80);
-  HostPortPair key(url.Host(), url.Port() != 0 ? url.Port() : default_port);
-  unique_lock<mutex> lock(lock_);
+  const HostPortPair key(url.Host(),
+                         url.Port() != 0 ? url.Port() : default_port);
+  const string hostport(HostPortString(key));
 
-  auto it(conns_.find(key));
-
-  if (it != conns_.end() && !it->second.empty()) {
-    RemoveDeadConnectionsFromDeque(lock, &it->second);
-  }
-
-  if (it == conns_.end() || it->second.empty()) {
-    VLOG(1) << "new evhtp_connection for " << key.first << ":" << key.second;
-    // This EvConnection has a slightly complicated lifetime; it needs to hang
-    // around until libevhtp/libevent have entirely finished with the
-    // evhtp_connection_t it references, and for at least as long as the life
-    // of the Connection we return from this method.
-    //
-    // This is accomplished through the use of a couple of shared_ptrs;
-    // this one, which goes inside the returned Connection object, and another
-    // created further below which gets passed in to the
-    // ConnectionFinishedHook.
-    auto conn(std::make_shared<EvConnection>(
-        url.Protocol() == "https"
-            ? base_->HttpsConnectionNew(key.first, key.second, ssl_ctx_.get())
-            : base_->HttpConnectionNew(key.first, key.second),
-        move(key)));
-    unique_ptr<ConnectionPool::Connection> handle(new Connection(conn));
-    struct timeval read_timeout = {FLAGS_connection_read_timeout_seconds,
-                                   kZeroMillis};
-    struct timeval write_timeout = {FLAGS_connection_write_timeout_seconds,
-                                    kZeroMillis};
-    evhtp_connection_set_timeouts(handle->connection(), &read_timeout,
-                                  &write_timeout);
-    evhtp_set_hook(&handle->connection()->hooks, evhtp_hook_on_conn_error,
-                   reinterpret_cast<evhtp_hook>(
-                       EvConnection::ConnectionErrorHook),
-                   reinterpret_cast<void*>(conn.get()));
-    evhtp_set_hook(
-        &handle->connection()->hooks, evhtp_hook_on_connection_fini,
-        reinterpret_cast<evhtp_hook>(EvConnection::ConnectionFinishedHook),
-        // We'll hold on to another shared_ptr to the Connection
-        // until evhtp tells us that it's finished with the cnxn.
-        reinterpret_cast<void*>(new shared_ptr<EvConnection>(conn)));
-    return handle;
-  }
-
-  VLOG(1) << "cached evhtp_connection for " << key.first << ":" << key.second;
-  unique_ptr<ConnectionPool::Connection> retval(
-      move(it->second.back().second));
-  it->second.pop_back();
-  CHECK_NOTNULL(retval->connection());
+  unique_ptr<ConnectionPool::Connection> retval;
+  {
+    unique_lock<mutex> lock(lock_);
+    const auto it(conns_.find(key));
+    if (it != conns_.end() && !it->second.empty()) {
+      RemoveDeadConnectionsFromDeque(lock, &it->second);
+    }
+    if (it != conns_.end() && !it->second.empty()) {
+      VLOG(1) << "cached evhtp_connection for " << hostport;
+      retval = move(it->second.back().second);
+      it->second.pop_back();
+      CHECK_NOTNULL(retval->connection());
+      connections_per_host_port->Set(hostport, it->second.size());
+    }
+  }
+
+  connection_pool_gets->Increment(hostport, retval ? "hit" : "miss");
+  if (!retval) {
+    // Opened without holding |lock_|, as this may resolve the host
+    // name.
+    VLOG(1) << "new evhtp_connection for " << hostport;
+    retval = NewConnection(url, key);
+  }
+  connection_pool_wait_us.RecordLatency(hostport,
+                                        steady_clock::now() - started);
+
+  if (FLAGS_url_fetcher_warm_conns_per_host_port > 0) {
+    WarmUp(url, key);
+  }
 
   return retval;
 }
 
 
+void ConnectionPool::WarmUp(const URL& url, const HostPortPair& key) {
+  const size_t target(
+      std::min(static_cast<size_t>(FLAGS_url_fetcher_warm_conns_per_host_port),
+               MaxIdle(key)));
+  size_t missing;
+  {
+    lock_guard<mutex> lock(lock_);
+    const auto it(conns_.find(key));
+    const size_t idle(it != conns_.end() ? it->second.size() : 0);
+    // Concurrent callers leave it to the first one.
+    if (idle >= target || !warming_.insert(key).second) {
+      return;
+    }
+    missing = target - idle;
+  }
+
+  // These connect (and do their TLS handshake) in the background.
+  vector<unique_ptr<Connection>> warm;
+  for (size_t i = 0; i < missing; ++i) {
+    warm.emplace_back(NewConnection(url, key));
+  }
+  const string hostport(HostPortString(key));
+  connection_pool_warm_connections->IncrementBy(hostport, missing);
+
+  lock_guard<mutex> lock(lock_);
+  warming_.erase(key);
+  auto& entry(conns_[key]);
+  // At the front, so that the connections which are known to work
+  // are used first.
+  for (auto& conn : warm) {
+    entry.emplace_front(make_pair(system_clock::now(), move(conn)));
+  }
+  connections_per_host_port->Set(hostport, entry.size());
+}
+
+
+size_t ConnectionPool::MaxIdle(const HostPortPair& key) const {
+  const auto it(max_idle_.find(key));
+  if (it != max_idle_.end()) {
+    return it->second;
+  }
+  CHECK_GE(FLAGS_url_fetcher_max_conn_per_host_port, 0);
+  return FLAGS_url_fetcher_max_conn_per_host_port;
+}
+
+
 void ConnectionPool::Put(unique_ptr<ConnectionPool::Connection> handle) {
   if (!handle) {
     VLOG(1) << "returned null Connection";
@@ -497,17 +775,15 @@ void ConnectionPool::Put(unique_ptr<ConnectionPool::Connection> handle) {
 
   const HostPortPair& key(handle->other_end());
   VLOG(1) << "returned Connection for " << key.first << ":" << key.second;
+  const size_t max_idle(MaxIdle(key));
   lock_guard<mutex> lock(lock_);
   auto& entry(conns_[key]);
 
-  CHECK_GE(FLAGS_url_fetcher_max_conn_per_host_port, 0);
   entry.emplace_back(make_pair(system_clock::now(), move(handle)));
   const string hostport(HostPortString(key));
   VLOG(1) << "ConnectionPool for " << hostport << " size : " << entry.size();
   connections_per_host_port->Set(hostport, entry.size());
-  if (!cleanup_scheduled_ &&
-      entry.size() >
-          static_cast<uint>(FLAGS_url_fetcher_max_conn_per_host_port)) {
+  if (!cleanup_scheduled_ && entry.size() > max_idle) {
     cleanup_scheduled_ = true;
     base_->Add(bind(&ConnectionPool::Cleanup, this));
   }
@@ -515,6 +791,7 @@ void ConnectionPool::Put(unique_ptr<ConnectionPool::Connection> handle) {
 
 
 void ConnectionPool::Cleanup() {
+  CHECK(libevent::Base::OnEventThread());
   unique_lock<mutex> lock(lock_);
   cleanup_scheduled_ = false;
   const system_clock::time_point cutoff(
@@ -524,16 +801,24 @@ void ConnectionPool::Cleanup() {
   // conns_ is a std::map<HostPortPair, std::deque<TimestampedConnection>>
   for (auto& entry : conns_) {
     RemoveDeadConnectionsFromDeque(lock, &entry.second);
-    while (entry.second.front().first < cutoff &&
-           entry.second.size() >
-               static_cast<uint>(FLAGS_url_fetcher_max_conn_per_host_port)) {
-      entry.second.pop_front();
+    const size_t max_idle(MaxIdle(entry.first));
+    for (auto it(entry.second.begin());
+         it != entry.second.end() && entry.second.size() > max_idle;) {
+      if (it->first < cutoff) {
+        // Closed here (on the event thread), as nothing else would.
+        evhtp_connection_free(it->second->connection());
+        it = entry.second.erase(it);
+      } else {
+        ++it;
+      }
     }
     const string hostport(HostPortString(entry.first));
     VLOG(1) << "ConnectionPool for " << hostport
             << " size : " << entry.second.size();
     connections_per_host_port->Set(hostport, entry.second.size());
   }
+
+  cleanup_timer_.Add(seconds(FLAGS_connection_pool_cleanup_interval_seconds));
 }
 
 
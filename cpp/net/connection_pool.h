@@ -7,8 +7,10 @@
 #include <map>
 #include <memory>
 #include <mutex>
+#include <set>
 #include <string>
 
+#include "monitoring/memory.h"
 #include "net/url.h"
 #include "util/libevent_wrapper.h"
 
@@ -37,6 +39,7 @@ struct evhtp_connection_deleter {
 
 typedef std::pair<std::string, uint16_t> HostPortPair;
 class EvConnection;
+class TlsSessionCache;
 
 
 class ConnectionPool {
@@ -59,9 +62,14 @@ class ConnectionPool {
   };
 
   ConnectionPool(libevent::Base* base);
+  ~ConnectionPool();
   ConnectionPool(const ConnectionPool&) = delete;
   ConnectionPool& operator=(const ConnectionPool&) = delete;
 
+  // Returns the most recently used idle connection to the host:port of
+  // |url|, or a new one. If there are then fewer idle connections to
+  // it than --url_fetcher_warm_conns_per_host_port, new ones are also
+  // opened ahead of need.
   std::unique_ptr<Connection> Get(const URL& url);
   void Put(std::unique_ptr<Connection> conn);
 
@@ -73,17 +81,32 @@ class ConnectionPool {
       const std::unique_lock<std::mutex>& lock,
       std::deque<TimestampedConnection>* deque);
 
+  std::unique_ptr<Connection> NewConnection(const URL& url, HostPortPair key);
+  // Opens idle connections to |key| until there are enough of them.
+  void WarmUp(const URL& url, const HostPortPair& key);
+  // How many idle connections to |key| are kept.
+  size_t MaxIdle(const HostPortPair& key) const;
   void Cleanup();
 
   libevent::Base* const base_;
+  // Overrides of --url_fetcher_max_conn_per_host_port.
+  const std::map<HostPortPair, size_t> max_idle_;
+  const std::unique_ptr<TlsSessionCache> sessions_;
 
   std::mutex lock_;
   // We get and put connections from the back of the deque, and when
   // there are too many, we prune them from the front (LIFO).
   std::map<HostPortPair, std::deque<TimestampedConnection>> conns_;
+  // The host:port pairs for which WarmUp() is running.
+  std::set<HostPortPair> warming_;
   bool cleanup_scheduled_;
 
   std::unique_ptr<evhtp_ssl_ctx_t, void (*)(evhtp_ssl_ctx_t*)> ssl_ctx_;
+  // Runs Cleanup() every --connection_pool_cleanup_interval_seconds,
+  // so that idle connections which broke are not handed out.
+  libevent::Event cleanup_timer_;
+
+  const MemoryEstimate memory_;
 };
 
 
@@ -8,6 +8,7 @@
 
 #include "net/connection_pool.h"
 #include "util/thread_pool.h"
+#include "util/trace.h"
 
 using cert_trans::internal::ConnectionPool;
 using std::bind;
@@ -74,7 +75,9 @@ struct State {
   // The following methods must only be called on the libevent
   // dispatch thread.
   void RunRequest();
+  void BodyChunk(evhtp_request_t* req, evbuffer* chunk);
   void RequestDone(evhtp_request_t* req);
+  void SetStatusAndHeaders(evhtp_request_t* req);
 
   libevent::Base* const base_;
   ConnectionPool* const pool_;
@@ -83,6 +86,9 @@ struct State {
   Task* const task_;
 
   unique_ptr<ConnectionPool::Connection> conn_;
+  // Whether the response status and headers have been set yet, when
+  // streaming the body.
+  bool got_headers_;
 };
 
 
@@ -91,6 +97,13 @@ void RequestCallback(evhtp_request_t* req, void* userdata) {
 }
 
 
+evhtp_res BodyChunkHook(evhtp_request_t* req, evbuffer* chunk,
+                        void* userdata) {
+  static_cast<State*>(CHECK_NOTNULL(userdata))->BodyChunk(req, chunk);
+  return EVHTP_RES_OK;
+}
+
+
 UrlFetcher::Request NormaliseRequest(UrlFetcher::Request req) {
   if (req.url.Path().empty()) {
     req.url.SetPath("/");
@@ -111,7 +124,8 @@ State::State(libevent::Base* base, ConnectionPool* pool,
       pool_(CHECK_NOTNULL(pool)),
       request_(NormaliseRequest(request)),
       response_(CHECK_NOTNULL(response)),
-      task_(CHECK_NOTNULL(task)) {
+      task_(CHECK_NOTNULL(task)),
+      got_headers_(false) {
   if (request_.url.Protocol() != "http" &&
       request_.url.Protocol() != "https") {
     VLOG(1) << "unsupported protocol: " << request_.url.Protocol();
@@ -125,6 +139,12 @@ State::State(libevent::Base* base, ConnectionPool* pool,
 
 void State::MakeRequest() {
   CHECK(!libevent::Base::OnEventThread());
+  // The request may have waited for a thread: don't start it if the
+  // caller has given up on it meanwhile (e.g. its deadline passed).
+  if (task_->CancelRequested()) {
+    task_->Return(Status::CANCELLED);
+    return;
+  }
   conn_ = pool_->Get(request_.url);
   base_->Add(bind(&State::RunRequest, this));
 }
@@ -132,8 +152,18 @@ void State::MakeRequest() {
 
 void State::RunRequest() {
   CHECK(libevent::Base::OnEventThread());
+  if (task_->CancelRequested()) {
+    pool_->Put(move(conn_));
+    task_->Return(Status::CANCELLED);
+    return;
+  }
+
   evhtp_request_t* const http_req(
       CHECK_NOTNULL(evhtp_request_new(&RequestCallback, this)));
+  if (response_->body_chunk) {
+    evhtp_set_hook(&http_req->hooks, evhtp_hook_on_read,
+                   reinterpret_cast<evhtp_hook>(BodyChunkHook), this);
+  }
   if (!request_.body.empty() &&
       request_.headers.find("Content-Length") == request_.headers.end()) {
     evhtp_headers_add_header(
@@ -184,6 +214,29 @@ void State::RunRequest() {
 }
 
 
+void State::BodyChunk(evhtp_request_t* req, evbuffer* chunk) {
+  CHECK(libevent::Base::OnEventThread());
+  if (!got_headers_) {
+    SetStatusAndHeaders(req);
+    got_headers_ = true;
+  }
+  response_->body_chunk(chunk);
+  // Whatever is left would otherwise be added to |req->buffer_in|.
+  CHECK_EQ(evbuffer_drain(chunk, evbuffer_get_length(chunk)), 0);
+}
+
+
+void State::SetStatusAndHeaders(evhtp_request_t* req) {
+  // Use evhtp_request_status, as req->status is not set correctly. Related to https://github.com/ellzey/libevhtp/issues/78
+  response_->status_code = evhtp_request_status(req);
+  response_->headers.clear();
+  for (evhtp_kv_s* ptr = req->headers_in->tqh_first; ptr;
+       ptr = ptr->next.tqe_next) {
+    response_->headers.insert(make_pair(ptr->key, ptr->val));
+  }
+}
+
+
 struct evhtp_request_deleter {
   void operator()(evhtp_request_t* r) const {
     evhtp_request_free(r);
@@ -209,8 +262,7 @@ void State::RequestDone(evhtp_request_t* req) {
     return;
   }
 
-  // Use evhtp_request_status, as req->status is not set correctly. Related to https://github.com/ellzey/libevhtp/issues/78
-  response_->status_code = evhtp_request_status(req);
+  SetStatusAndHeaders(req);
   if (response_->status_code < 100) {
     util::Status status;
     switch (response_->status_code) {
@@ -235,18 +287,16 @@ void State::RequestDone(evhtp_request_t* req) {
     return;
   }
 
-  response_->headers.clear();
-  for (evhtp_kv_s* ptr = req->headers_in->tqh_first; ptr;
-       ptr = ptr->next.tqe_next) {
-    response_->headers.insert(make_pair(ptr->key, ptr->val));
+  if (!response_->body_chunk) {
+    // Copied out of the buffer's chunks as they are, rather than made
+    // contiguous first.
+    const size_t body_length(evbuffer_get_length(req->buffer_in));
+    response_->body.resize(body_length);
+    CHECK_EQ(evbuffer_remove(req->buffer_in, &response_->body[0],
+                             body_length),
+             static_cast<int>(body_length));
   }
 
-  const size_t body_length(evbuffer_get_length(req->buffer_in));
-  string body(reinterpret_cast<const char*>(
-                  evbuffer_pullup(req->buffer_in, body_length)),
-              body_length);
-  response_->body.swap(body);
-
   VLOG(2) << *response_;
 
   task_->Return();
@@ -274,6 +324,15 @@ UrlFetcher::~UrlFetcher() {
 void UrlFetcher::Fetch(const Request& req, Response* resp, Task* task) {
   TaskHold hold(task);
 
+  // The span ends with the task, which is when the response is in.
+  if (task->trace_context().sampled) {
+    util::Span* const span(new util::Span("UrlFetcher::Fetch",
+                                          task->trace_context()));
+    span->SetAttribute("server.address", req.url.Host());
+    span->SetAttribute("url.path", req.url.PathQuery());
+    task->DeleteWhenDone(span);
+  }
+
   State* const state(new State(impl_->base_, &impl_->pool_, req, resp, task));
   task->DeleteWhenDone(state);
 
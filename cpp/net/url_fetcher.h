@@ -2,6 +2,7 @@
 #define CERT_TRANS_NET_URL_FETCHER_H_
 
 #include <chrono>
+#include <functional>
 #include <map>
 #include <memory>
 #include <ostream>
@@ -11,6 +12,8 @@
 #include "util/compare.h"
 #include "util/task.h"
 
+struct evbuffer;
+
 namespace cert_trans {
 
 namespace libevent {
@@ -51,6 +54,12 @@ class UrlFetcher {
     int status_code;
     Headers headers;
     std::string body;
+    // If set, the body is not gathered into |body|, but handed to this
+    // in parts as they arrive, on the libevent dispatch thread, with
+    // |status_code| and |headers| already set. It can take what it
+    // wants to keep out of |chunk| (evbuffer_add_buffer() does so
+    // without copying), the rest is discarded.
+    std::function<void(evbuffer* chunk)> body_chunk;
   };
 
   UrlFetcher(libevent::Base* base, ThreadPool* thread_pool);
@@ -4,6 +4,7 @@
 #ifdef HAVE_ARPA_NAMESER_H
 #include <arpa/nameser.h> /* DNS HEADER struct */
 #endif
+#include <event2/buffer.h>
 #include <fcntl.h>
 #include <gflags/gflags.h>
 #include <glog/logging.h>
@@ -134,6 +135,29 @@ TEST_F(UrlFetcherTest, TestCertMatchesHost) {
 }
 
 
+TEST_F(UrlFetcherTest, TestStreamsBody) {
+  UrlFetcher::Request req(
+      URL("https://localhost:" + to_string(kLocalHostPort)));
+  UrlFetcher::Response resp;
+  string body;
+  resp.body_chunk = [&resp, &body](evbuffer* chunk) {
+    EXPECT_EQ(200, resp.status_code);
+    const size_t length(evbuffer_get_length(chunk));
+    body.append(reinterpret_cast<const char*>(evbuffer_pullup(chunk, length)),
+                length);
+    evbuffer_drain(chunk, length);
+  };
+
+  SyncTask task(&pool_);
+  fetcher_->Fetch(req, &resp, task.task());
+  task.Wait();
+  EXPECT_OK(task.status());
+  EXPECT_EQ(200, resp.status_code);
+  EXPECT_TRUE(resp.body.empty());
+  EXPECT_NE(string::npos, body.find("</HTML>")) << body;
+}
+
+
 TEST_F(UrlFetcherTest, TestCertDoesNotMatchHost) {
   UrlFetcher::Request req(
       URL("https://localhost:" + to_string(kNonLocalHostPort)));
@@ -10,10 +10,15 @@
 
 using cert_trans::serialization::SerializeResult;
 using cert_trans::serialization::DeserializeResult;
+using cert_trans::serialization::ExtensionsField;
+using cert_trans::serialization::LogEntryTypeField;
+using cert_trans::serialization::MerkleLeafTypeField;
+using cert_trans::serialization::MerkleTreeLeafHeader;
+using cert_trans::serialization::SCTSignatureInputHeader;
+using cert_trans::serialization::TimestampField;
+using cert_trans::serialization::VersionField;
 using cert_trans::serialization::WriteFixedBytes;
 using cert_trans::serialization::WriteList;
-using cert_trans::serialization::WriteUint;
-using cert_trans::serialization::WriteVarBytes;
 using ct::DigitallySigned;
 using ct::LogEntry;
 using ct::LogEntryType_IsValid;
@@ -31,6 +36,24 @@ using std::string;
 const size_t kMaxCertificateLength = (1 << 24) - 1;
 const size_t kMaxCertificateChainLength = (1 << 24) - 1;
 
+typedef cert_trans::serialization::VarBytesField<kMaxCertificateLength>
+    ASN1CertField;
+
+
+// The length of a V1 SCT signature input or Merkle tree leaf (whose
+// headers have the same length), for an entry with |issuer_key_hash|
+// (empty for certificates) and |certificate|.
+size_t V1TimestampedEntryLength(const string& issuer_key_hash,
+                                const string& certificate,
+                                const string& extensions) {
+  static_assert(SCTSignatureInputHeader::kLength ==
+                    MerkleTreeLeafHeader::kLength,
+                "V1 headers differ in length");
+  return SCTSignatureInputHeader::kLength + issuer_key_hash.size() +
+         ASN1CertField::Length(certificate) +
+         ExtensionsField::Length(extensions);
+}
+
 
 SerializeResult CheckCertificateFormat(const string& cert) {
   if (cert.empty()) {
@@ -80,13 +103,12 @@ SerializeResult SerializeV1CertSCTSignatureInput(uint64_t timestamp,
   if (res != SerializeResult::OK) {
     return res;
   }
-  WriteUint(ct::V1, Serializer::kVersionLengthInBytes, result);
-  WriteUint(ct::CERTIFICATE_TIMESTAMP, Serializer::kSignatureTypeLengthInBytes,
-            result);
-  WriteUint(timestamp, Serializer::kTimestampLengthInBytes, result);
-  WriteUint(ct::X509_ENTRY, Serializer::kLogEntryTypeLengthInBytes, result);
-  WriteVarBytes(certificate, kMaxCertificateLength, result);
-  WriteVarBytes(extensions, Serializer::kMaxExtensionsLength, result);
+  result->reserve(result->size() +
+                  V1TimestampedEntryLength(string(), certificate, extensions));
+  SCTSignatureInputHeader::Append(result, ct::V1, ct::CERTIFICATE_TIMESTAMP,
+                                  timestamp, ct::X509_ENTRY);
+  ASN1CertField::Write(certificate, result);
+  ExtensionsField::Write(extensions, result);
   return SerializeResult::OK;
 }
 
@@ -107,14 +129,13 @@ SerializeResult SerializeV1PrecertSCTSignatureInput(
     return res;
   }
   result->clear();
-  WriteUint(ct::V1, Serializer::kVersionLengthInBytes, result);
-  WriteUint(ct::CERTIFICATE_TIMESTAMP, Serializer::kSignatureTypeLengthInBytes,
-            result);
-  WriteUint(timestamp, Serializer::kTimestampLengthInBytes, result);
-  WriteUint(ct::PRECERT_ENTRY, Serializer::kLogEntryTypeLengthInBytes, result);
+  result->reserve(V1TimestampedEntryLength(issuer_key_hash, tbs_certificate,
+                                           extensions));
+  SCTSignatureInputHeader::Append(result, ct::V1, ct::CERTIFICATE_TIMESTAMP,
+                                  timestamp, ct::PRECERT_ENTRY);
   WriteFixedBytes(issuer_key_hash, result);
-  WriteVarBytes(tbs_certificate, kMaxCertificateLength, result);
-  WriteVarBytes(extensions, Serializer::kMaxExtensionsLength, result);
+  ASN1CertField::Write(tbs_certificate, result);
+  ExtensionsField::Write(extensions, result);
   return SerializeResult::OK;
 }
 
@@ -155,13 +176,11 @@ SerializeResult SerializeV1CertSCTMerkleTreeLeaf(uint64_t timestamp,
     return res;
   }
   result->clear();
-  WriteUint(ct::V1, Serializer::kVersionLengthInBytes, result);
-  WriteUint(ct::TIMESTAMPED_ENTRY, Serializer::kMerkleLeafTypeLengthInBytes,
-            result);
-  WriteUint(timestamp, Serializer::kTimestampLengthInBytes, result);
-  WriteUint(ct::X509_ENTRY, Serializer::kLogEntryTypeLengthInBytes, result);
-  WriteVarBytes(certificate, kMaxCertificateLength, result);
-  WriteVarBytes(extensions, Serializer::kMaxExtensionsLength, result);
+  result->reserve(V1TimestampedEntryLength(string(), certificate, extensions));
+  MerkleTreeLeafHeader::Append(result, ct::V1, ct::TIMESTAMPED_ENTRY, timestamp,
+                               ct::X509_ENTRY);
+  ASN1CertField::Write(certificate, result);
+  ExtensionsField::Write(extensions, result);
   return SerializeResult::OK;
 }
 
@@ -182,14 +201,13 @@ SerializeResult SerializeV1PrecertSCTMerkleTreeLeaf(
     return res;
   }
   result->clear();
-  WriteUint(ct::V1, Serializer::kVersionLengthInBytes, result);
-  WriteUint(ct::TIMESTAMPED_ENTRY, Serializer::kMerkleLeafTypeLengthInBytes,
-            result);
-  WriteUint(timestamp, Serializer::kTimestampLengthInBytes, result);
-  WriteUint(ct::PRECERT_ENTRY, Serializer::kLogEntryTypeLengthInBytes, result);
+  result->reserve(V1TimestampedEntryLength(issuer_key_hash, tbs_certificate,
+                                           extensions));
+  MerkleTreeLeafHeader::Append(result, ct::V1, ct::TIMESTAMPED_ENTRY, timestamp,
+                               ct::PRECERT_ENTRY);
   WriteFixedBytes(issuer_key_hash, result);
-  WriteVarBytes(tbs_certificate, kMaxCertificateLength, result);
-  WriteVarBytes(extensions, Serializer::kMaxExtensionsLength, result);
+  ASN1CertField::Write(tbs_certificate, result);
+  ExtensionsField::Write(extensions, result);
   return SerializeResult::OK;
 }
 
@@ -224,7 +242,7 @@ DeserializeResult DeserializeV1SCTMerkleTreeLeaf(TLSDeserializer* des,
   CHECK_NOTNULL(leaf);
 
   unsigned int version;
-  if (!des->ReadUint(Serializer::kVersionLengthInBytes, &version)) {
+  if (!VersionField::Read(des, &version)) {
     return DeserializeResult::INPUT_TOO_SHORT;
   }
 
@@ -234,7 +252,7 @@ DeserializeResult DeserializeV1SCTMerkleTreeLeaf(TLSDeserializer* des,
   leaf->set_version(ct::V1);
 
   unsigned int type;
-  if (!des->ReadUint(Serializer::kMerkleLeafTypeLengthInBytes, &type)) {
+  if (!MerkleLeafTypeField::Read(des, &type)) {
     return DeserializeResult::INPUT_TOO_SHORT;
   }
   if (type != ct::TIMESTAMPED_ENTRY) {
@@ -245,13 +263,13 @@ DeserializeResult DeserializeV1SCTMerkleTreeLeaf(TLSDeserializer* des,
   ct::TimestampedEntry* const entry = leaf->mutable_timestamped_entry();
 
   uint64_t timestamp;
-  if (!des->ReadUint(Serializer::kTimestampLengthInBytes, &timestamp)) {
+  if (!TimestampField::Read(des, &timestamp)) {
     return DeserializeResult::INPUT_TOO_SHORT;
   }
   entry->set_timestamp(timestamp);
 
   unsigned int entry_type;
-  if (!des->ReadUint(Serializer::kLogEntryTypeLengthInBytes, &entry_type)) {
+  if (!LogEntryTypeField::Read(des, &entry_type)) {
     return DeserializeResult::INPUT_TOO_SHORT;
   }
 
@@ -260,27 +278,27 @@ DeserializeResult DeserializeV1SCTMerkleTreeLeaf(TLSDeserializer* des,
 
   switch (entry_type) {
     case ct::X509_ENTRY: {
-      string x509;
-      if (!des->ReadVarBytes(kMaxCertificateLength, &x509)) {
+      TLSBytes x509;
+      if (!ASN1CertField::Read(des, &x509)) {
         return DeserializeResult::INPUT_TOO_SHORT;
       }
-      entry->mutable_signed_entry()->set_x509(x509);
+      entry->mutable_signed_entry()->set_x509(x509.data(), x509.size());
       return ReadExtensionsV1(des, entry);
     }
 
     case ct::PRECERT_ENTRY: {
-      string issuer_key_hash;
+      TLSBytes issuer_key_hash;
       if (!des->ReadFixedBytes(32, &issuer_key_hash)) {
         return DeserializeResult::INPUT_TOO_SHORT;
       }
       entry->mutable_signed_entry()->mutable_precert()->set_issuer_key_hash(
-          issuer_key_hash);
-      string tbs_certificate;
-      if (!des->ReadVarBytes(kMaxCertificateLength, &tbs_certificate)) {
+          issuer_key_hash.data(), issuer_key_hash.size());
+      TLSBytes tbs_certificate;
+      if (!ASN1CertField::Read(des, &tbs_certificate)) {
         return DeserializeResult::INPUT_TOO_SHORT;
       }
       entry->mutable_signed_entry()->mutable_precert()->set_tbs_certificate(
-          tbs_certificate);
+          tbs_certificate.data(), tbs_certificate.size());
       return ReadExtensionsV1(des, entry);
     }
   }
@@ -331,13 +349,10 @@ SerializeResult SerializeV2CertSCTSignatureInput(
     return res;
   }
   result->clear();
-  WriteUint(ct::V2, Serializer::kVersionLengthInBytes, result);
-  WriteUint(ct::CERTIFICATE_TIMESTAMP, Serializer::kSignatureTypeLengthInBytes,
-            result);
-  WriteUint(timestamp, Serializer::kTimestampLengthInBytes, result);
-  WriteUint(ct::X509_ENTRY, Serializer::kLogEntryTypeLengthInBytes, result);
+  SCTSignatureInputHeader::Append(result, ct::V2, ct::CERTIFICATE_TIMESTAMP,
+                                  timestamp, ct::X509_ENTRY);
   WriteFixedBytes(issuer_key_hash, result);
-  WriteVarBytes(tbs_certificate, kMaxCertificateLength, result);
+  ASN1CertField::Write(tbs_certificate, result);
   WriteSctExtension(sct_extension, result);
   return SerializeResult::OK;
 }
@@ -357,14 +372,10 @@ SerializeResult SerializeV2PrecertSCTSignatureInput(
     return res;
   }
   result->clear();
-  WriteUint(ct::V2, Serializer::kVersionLengthInBytes, result);
-  WriteUint(ct::CERTIFICATE_TIMESTAMP, Serializer::kSignatureTypeLengthInBytes,
-            result);
-  WriteUint(timestamp, Serializer::kTimestampLengthInBytes, result);
-  WriteUint(ct::PRECERT_ENTRY_V2, Serializer::kLogEntryTypeLengthInBytes,
-            result);
+  SCTSignatureInputHeader::Append(result, ct::V2, ct::CERTIFICATE_TIMESTAMP,
+                                  timestamp, ct::PRECERT_ENTRY_V2);
   WriteFixedBytes(issuer_key_hash, result);
-  WriteVarBytes(tbs_certificate, kMaxCertificateLength, result);
+  ASN1CertField::Write(tbs_certificate, result);
   WriteSctExtension(sct_extension, result);
   return SerializeResult::OK;
 }
@@ -408,13 +419,10 @@ SerializeResult SerializeV2CertSCTMerkleTreeLeaf(
     return res;
   }
   result->clear();
-  WriteUint(ct::V2, Serializer::kVersionLengthInBytes, result);
-  WriteUint(ct::TIMESTAMPED_ENTRY, Serializer::kMerkleLeafTypeLengthInBytes,
-            result);
-  WriteUint(timestamp, Serializer::kTimestampLengthInBytes, result);
-  WriteUint(ct::X509_ENTRY, Serializer::kLogEntryTypeLengthInBytes, result);
+  MerkleTreeLeafHeader::Append(result, ct::V2, ct::TIMESTAMPED_ENTRY, timestamp,
+                               ct::X509_ENTRY);
   WriteFixedBytes(issuer_key_hash, result);
-  WriteVarBytes(tbs_certificate, kMaxCertificateLength, result);
+  ASN1CertField::Write(tbs_certificate, result);
   WriteSctExtension(sct_extension, result);
   return SerializeResult::OK;
 }
@@ -438,14 +446,10 @@ SerializeResult SerializeV2PrecertSCTMerkleTreeLeaf(
     return res;
   }
   result->clear();
-  WriteUint(ct::V2, Serializer::kVersionLengthInBytes, result);
-  WriteUint(ct::TIMESTAMPED_ENTRY, Serializer::kMerkleLeafTypeLengthInBytes,
-            result);
-  WriteUint(timestamp, Serializer::kTimestampLengthInBytes, result);
-  WriteUint(ct::PRECERT_ENTRY_V2, Serializer::kLogEntryTypeLengthInBytes,
-            result);
+  MerkleTreeLeafHeader::Append(result, ct::V2, ct::TIMESTAMPED_ENTRY, timestamp,
+                               ct::PRECERT_ENTRY_V2);
   WriteFixedBytes(issuer_key_hash, result);
-  WriteVarBytes(tbs_certificate, kMaxCertificateLength, result);
+  ASN1CertField::Write(tbs_certificate, result);
   WriteSctExtension(sct_extension, result);
   return SerializeResult::OK;
 }
@@ -480,7 +484,7 @@ DeserializeResult DeserializeV2SCTMerkleTreeLeaf(TLSDeserializer* des,
   CHECK_NOTNULL(leaf);
 
   unsigned int version;
-  if (!des->ReadUint(Serializer::kVersionLengthInBytes, &version)) {
+  if (!VersionField::Read(des, &version)) {
     return DeserializeResult::INPUT_TOO_SHORT;
   }
 
@@ -490,7 +494,7 @@ DeserializeResult DeserializeV2SCTMerkleTreeLeaf(TLSDeserializer* des,
   leaf->set_version(ct::V2);
 
   unsigned int type;
-  if (!des->ReadUint(Serializer::kMerkleLeafTypeLengthInBytes, &type)) {
+  if (!MerkleLeafTypeField::Read(des, &type)) {
     return DeserializeResult::INPUT_TOO_SHORT;
   }
   if (type != ct::TIMESTAMPED_ENTRY) {
@@ -501,13 +505,13 @@ DeserializeResult DeserializeV2SCTMerkleTreeLeaf(TLSDeserializer* des,
   ct::TimestampedEntry* const entry = leaf->mutable_timestamped_entry();
 
   uint64_t timestamp;
-  if (!des->ReadUint(Serializer::kTimestampLengthInBytes, &timestamp)) {
+  if (!TimestampField::Read(des, &timestamp)) {
     return DeserializeResult::INPUT_TOO_SHORT;
   }
   entry->set_timestamp(timestamp);
 
   unsigned int entry_type;
-  if (!des->ReadUint(Serializer::kLogEntryTypeLengthInBytes, &entry_type)) {
+  if (!LogEntryTypeField::Read(des, &entry_type)) {
     return DeserializeResult::INPUT_TOO_SHORT;
   }
 
@@ -518,18 +522,18 @@ DeserializeResult DeserializeV2SCTMerkleTreeLeaf(TLSDeserializer* des,
     // In V2 both X509 and Precert entries use CertInfo
     case ct::X509_ENTRY:
     case ct::PRECERT_ENTRY_V2: {
-      string issuer_key_hash;
+      TLSBytes issuer_key_hash;
       if (!des->ReadFixedBytes(32, &issuer_key_hash)) {
         return DeserializeResult::INPUT_TOO_SHORT;
       }
       entry->mutable_signed_entry()->mutable_cert_info()->set_issuer_key_hash(
-          issuer_key_hash);
-      string tbs_certificate;
-      if (!des->ReadVarBytes(kMaxCertificateLength, &tbs_certificate)) {
+          issuer_key_hash.data(), issuer_key_hash.size());
+      TLSBytes tbs_certificate;
+      if (!ASN1CertField::Read(des, &tbs_certificate)) {
         return DeserializeResult::INPUT_TOO_SHORT;
       }
       entry->mutable_signed_entry()->mutable_cert_info()->set_tbs_certificate(
-          tbs_certificate);
+          tbs_certificate.data(), tbs_certificate.size());
       // TODO(eranm): This is wrong, V2 Extensions should be read using
       // ReadSctExtensions
       return ReadExtensionsV1(des, entry);
@@ -590,7 +594,9 @@ SerializeResult SerializePrecertChainEntry(
   }
 
   result->clear();
-  WriteVarBytes(pre_certificate, kMaxCertificateLength, result);
+  // WriteList() reserves the rest.
+  result->reserve(ASN1CertField::Length(pre_certificate));
+  ASN1CertField::Write(pre_certificate, result);
 
   SerializeResult res = WriteList(precertificate_chain, kMaxCertificateLength,
                                   kMaxCertificateChainLength, result);
@@ -609,8 +615,10 @@ SerializeResult SerializeV1SignedCertEntryWithType(
     return res;
   }
   result->clear();
-  WriteUint(ct::X509_ENTRY, Serializer::kLogEntryTypeLengthInBytes, result);
-  WriteVarBytes(leaf_certificate, kMaxCertificateLength, result);
+  result->reserve(LogEntryTypeField::kLength +
+                  ASN1CertField::Length(leaf_certificate));
+  LogEntryTypeField::Write(ct::X509_ENTRY, result);
+  ASN1CertField::Write(leaf_certificate, result);
   return SerializeResult::OK;
 }
 
@@ -627,9 +635,11 @@ SerializeResult SerializeV1SignedPrecertEntryWithType(
     return res;
   }
   result->clear();
-  WriteUint(ct::PRECERT_ENTRY, Serializer::kLogEntryTypeLengthInBytes, result);
+  result->reserve(LogEntryTypeField::kLength + issuer_key_hash.size() +
+                  ASN1CertField::Length(tbs_certificate));
+  LogEntryTypeField::Write(ct::PRECERT_ENTRY, result);
   WriteFixedBytes(issuer_key_hash, result);
-  WriteVarBytes(tbs_certificate, kMaxCertificateLength, result);
+  ASN1CertField::Write(tbs_certificate, result);
   return SerializeResult::OK;
 }
 
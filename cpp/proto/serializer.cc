@@ -11,10 +11,20 @@
 using cert_trans::serialization::internal::PrefixLength;
 using cert_trans::serialization::SerializeResult;
 using cert_trans::serialization::DeserializeResult;
+using cert_trans::serialization::DigitallySignedLength;
+using cert_trans::serialization::ExtensionCountField;
+using cert_trans::serialization::ExtensionTypeField;
+using cert_trans::serialization::ExtensionsField;
+using cert_trans::serialization::FixedFields;
+using cert_trans::serialization::LogEntryTypeField;
+using cert_trans::serialization::MerkleLeafTypeField;
+using cert_trans::serialization::STHSignatureInputHeader;
+using cert_trans::serialization::SignatureTypeField;
+using cert_trans::serialization::TimestampField;
+using cert_trans::serialization::TreeSizeField;
+using cert_trans::serialization::VersionField;
 using cert_trans::serialization::WriteDigitallySigned;
 using cert_trans::serialization::WriteFixedBytes;
-using cert_trans::serialization::WriteUint;
-using cert_trans::serialization::WriteVarBytes;
 using cert_trans::serialization::constants::kMaxSignatureLength;
 using cert_trans::serialization::constants::kHashAlgorithmLengthInBytes;
 using cert_trans::serialization::constants::kSigAlgorithmLengthInBytes;
@@ -36,17 +46,20 @@ using std::string;
 
 const size_t Serializer::kMaxV2ExtensionType = (1 << 16) - 1;
 const size_t Serializer::kMaxV2ExtensionsCount = (1 << 16) - 2;
-const size_t Serializer::kMaxExtensionsLength = (1 << 16) - 1;
+const size_t Serializer::kMaxExtensionsLength = ExtensionsField::kMaxLength;
 const size_t Serializer::kMaxSerializedSCTLength = (1 << 16) - 1;
 const size_t Serializer::kMaxSCTListLength = (1 << 16) - 1;
 
-const size_t Serializer::kLogEntryTypeLengthInBytes = 2;
-const size_t Serializer::kSignatureTypeLengthInBytes = 1;
-const size_t Serializer::kVersionLengthInBytes = 1;
+const size_t Serializer::kLogEntryTypeLengthInBytes =
+    LogEntryTypeField::kLength;
+const size_t Serializer::kSignatureTypeLengthInBytes =
+    SignatureTypeField::kLength;
+const size_t Serializer::kVersionLengthInBytes = VersionField::kLength;
 const size_t Serializer::kKeyIDLengthInBytes = 32;
-const size_t Serializer::kMerkleLeafTypeLengthInBytes = 1;
+const size_t Serializer::kMerkleLeafTypeLengthInBytes =
+    MerkleLeafTypeField::kLength;
 const size_t Serializer::kKeyHashLengthInBytes = 32;
-const size_t Serializer::kTimestampLengthInBytes = 8;
+const size_t Serializer::kTimestampLengthInBytes = TimestampField::kLength;
 
 DEFINE_bool(allow_reconfigure_serializer_test_only, false,
             "Allow tests to reconfigure the serializer multiple times.");
@@ -114,10 +127,9 @@ static SerializeResult SerializeV1STHSignatureInput(uint64_t timestamp,
   result->clear();
   if (root_hash.size() != 32)
     return SerializeResult::INVALID_HASH_LENGTH;
-  WriteUint(ct::V1, Serializer::kVersionLengthInBytes, result);
-  WriteUint(ct::TREE_HEAD, Serializer::kSignatureTypeLengthInBytes, result);
-  WriteUint(timestamp, Serializer::kTimestampLengthInBytes, result);
-  WriteUint(tree_size, 8, result);
+  result->reserve(STHSignatureInputHeader::kLength + root_hash.size());
+  STHSignatureInputHeader::Append(result, ct::V1, ct::TREE_HEAD, timestamp,
+                                  tree_size);
   WriteFixedBytes(root_hash, result);
   return SerializeResult::OK;
 }
@@ -152,19 +164,18 @@ static SerializeResult SerializeV2STHSignatureInput(
     return SerializeResult::INVALID_KEYID_LENGTH;
   }
 
-  WriteUint(ct::V2, Serializer::kVersionLengthInBytes, result);
-  WriteUint(ct::TREE_HEAD, Serializer::kSignatureTypeLengthInBytes, result);
+  FixedFields<VersionField, SignatureTypeField>::Append(result, ct::V2,
+                                                        ct::TREE_HEAD);
   // TODO(eranm): This is wrong, V2 Log IDs are OIDs.
   WriteFixedBytes(log_id, result);
-  WriteUint(timestamp, Serializer::kTimestampLengthInBytes, result);
-  WriteUint(tree_size, 8, result);
+  FixedFields<TimestampField, TreeSizeField>::Append(result, timestamp,
+                                                     tree_size);
   WriteFixedBytes(root_hash, result);
   // V2 STH can have multiple extensions
-  WriteUint(sth_extension.size(), 2, result);
+  ExtensionCountField::Write(sth_extension.size(), result);
   for (auto it = sth_extension.begin(); it != sth_extension.end(); ++it) {
-    WriteUint(it->sth_extension_type(), 2, result);
-    WriteVarBytes(it->sth_extension_data(), Serializer::kMaxExtensionsLength,
-                  result);
+    ExtensionTypeField::Write(it->sth_extension_type(), result);
+    ExtensionsField::Write(it->sth_extension_data(), result);
   }
 
   return SerializeResult::OK;
@@ -225,20 +236,23 @@ SerializeResult WriteSCTV1(const SignedCertificateTimestamp& sct,
   if (sct.id().key_id().size() != Serializer::kKeyIDLengthInBytes) {
     return SerializeResult::INVALID_KEYID_LENGTH;
   }
-  WriteUint(sct.version(), Serializer::kVersionLengthInBytes, output);
+  output->reserve(
+      output->size() + VersionField::kLength + sct.id().key_id().size() +
+      TimestampField::kLength + ExtensionsField::Length(sct.extensions()) +
+      DigitallySignedLength(sct.signature()));
+  VersionField::Write(sct.version(), output);
   WriteFixedBytes(sct.id().key_id(), output);
-  WriteUint(sct.timestamp(), Serializer::kTimestampLengthInBytes, output);
-  WriteVarBytes(sct.extensions(), Serializer::kMaxExtensionsLength, output);
+  TimestampField::Write(sct.timestamp(), output);
+  ExtensionsField::Write(sct.extensions(), output);
   return WriteDigitallySigned(sct.signature(), output);
 }
 
 void WriteSctExtension(const RepeatedPtrField<SctExtension>& extension,
                        std::string* output) {
-  WriteUint(extension.size(), 2, output);
+  ExtensionCountField::Write(extension.size(), output);
   for (auto it = extension.begin(); it != extension.end(); ++it) {
-    WriteUint(it->sct_extension_type(), 2, output);
-    WriteVarBytes(it->sct_extension_data(), Serializer::kMaxExtensionsLength,
-                  output);
+    ExtensionTypeField::Write(it->sct_extension_type(), output);
+    ExtensionsField::Write(it->sct_extension_data(), output);
   }
 }
 
@@ -253,9 +267,9 @@ SerializeResult WriteSCTV2(const SignedCertificateTimestamp& sct,
   if (sct.id().key_id().size() != Serializer::kKeyIDLengthInBytes) {
     return SerializeResult::INVALID_KEYID_LENGTH;
   }
-  WriteUint(sct.version(), Serializer::kVersionLengthInBytes, output);
+  VersionField::Write(sct.version(), output);
   WriteFixedBytes(sct.id().key_id(), output);
-  WriteUint(sct.timestamp(), Serializer::kTimestampLengthInBytes, output);
+  TimestampField::Write(sct.timestamp(), output);
   // V2 SCT can have a number of extensions. They must be ordered by type
   // but we already checked that above.
   WriteSctExtension(sct.sct_extension(), output);
@@ -300,6 +314,7 @@ SerializeResult Serializer::SerializeSCTList(
 SerializeResult Serializer::SerializeDigitallySigned(
     const DigitallySigned& sig, string* result) {
   result->clear();
+  result->reserve(DigitallySignedLength(sig));
   return WriteDigitallySigned(sig, result);
 }
 
@@ -314,7 +329,7 @@ SerializeResult Serializer::SerializeList(const repeated_string& in,
                                            max_total_length, &output);
   if (res != SerializeResult::OK)
     return res;
-  result->assign(output);
+  result->swap(output);
   return SerializeResult::OK;
 }
 
@@ -407,14 +422,12 @@ DeserializeResult ReadSCTV1(TLSDeserializer* deserializer,
   }
   // V1 encoding.
   uint64_t timestamp = 0;
-  if (!deserializer->ReadUint(Serializer::kTimestampLengthInBytes,
-                              &timestamp)) {
+  if (!TimestampField::Read(deserializer, &timestamp)) {
     return DeserializeResult::INPUT_TOO_SHORT;
   }
   sct->set_timestamp(timestamp);
-  string extensions;
-  if (!deserializer->ReadVarBytes(Serializer::kMaxExtensionsLength,
-                                  &extensions)) {
+  TLSBytes extensions;
+  if (!ExtensionsField::Read(deserializer, &extensions)) {
     // In theory, could also be an invalid length prefix, but not if
     // length limits follow byte boundaries.
     return DeserializeResult::INPUT_TOO_SHORT;
@@ -422,13 +435,10 @@ DeserializeResult ReadSCTV1(TLSDeserializer* deserializer,
   return deserializer->ReadDigitallySigned(sct->mutable_signature());
 }
 
-const size_t kV2ExtensionCountLengthInBytes = 2;
-const size_t kV2ExtensionTypeLengthInBytes = 2;
-
 DeserializeResult ReadSctExtension(TLSDeserializer* deserializer,
                                    RepeatedPtrField<SctExtension>* extension) {
   uint32_t ext_count;
-  if (!deserializer->ReadUint(kV2ExtensionCountLengthInBytes, &ext_count)) {
+  if (!ExtensionCountField::Read(deserializer, &ext_count)) {
     return DeserializeResult::INPUT_TOO_SHORT;
   }
 
@@ -438,19 +448,18 @@ DeserializeResult ReadSctExtension(TLSDeserializer* deserializer,
 
   for (uint32_t ext = 0; ext < ext_count; ++ext) {
     uint32_t ext_type;
-    if (!deserializer->ReadUint(kV2ExtensionTypeLengthInBytes, &ext_type)) {
+    if (!ExtensionTypeField::Read(deserializer, &ext_type)) {
       return DeserializeResult::INPUT_TOO_SHORT;
     }
 
-    string ext_data;
-    if (!deserializer->ReadVarBytes(Serializer::kMaxExtensionsLength,
-                                    &ext_data)) {
+    TLSBytes ext_data;
+    if (!ExtensionsField::Read(deserializer, &ext_data)) {
       return DeserializeResult::INPUT_TOO_SHORT;
     }
 
     SctExtension* new_ext = extension->Add();
     new_ext->set_sct_extension_type(ext_type);
-    new_ext->set_sct_extension_data(ext_data);
+    new_ext->set_sct_extension_data(ext_data.data(), ext_data.size());
   }
 
   // This makes sure they're correctly ordered (See RFC section 5.3)
@@ -468,8 +477,7 @@ DeserializeResult ReadSCTV2(TLSDeserializer* deserializer,
   }
   // V2 encoding.
   uint64_t timestamp = 0;
-  if (!deserializer->ReadUint(Serializer::kTimestampLengthInBytes,
-                              &timestamp)) {
+  if (!TimestampField::Read(deserializer, &timestamp)) {
     return DeserializeResult::INPUT_TOO_SHORT;
   }
   sct->set_timestamp(timestamp);
@@ -488,12 +496,11 @@ DeserializeResult ReadSCTV2(TLSDeserializer* deserializer,
 DeserializeResult ReadExtensionsV1(TLSDeserializer* deserializer,
                                    ct::TimestampedEntry* entry) {
   CHECK_NOTNULL(deserializer);
-  string extensions;
-  if (!deserializer->ReadVarBytes(Serializer::kMaxExtensionsLength,
-                                  &extensions)) {
+  TLSBytes extensions;
+  if (!ExtensionsField::Read(deserializer, &extensions)) {
     return DeserializeResult::INPUT_TOO_SHORT;
   }
-  CHECK_NOTNULL(entry)->set_extensions(extensions);
+  CHECK_NOTNULL(entry)->set_extensions(extensions.data(), extensions.size());
   return DeserializeResult::OK;
 }
 
@@ -501,7 +508,7 @@ DeserializeResult ReadExtensionsV1(TLSDeserializer* deserializer,
 DeserializeResult ReadSCT(TLSDeserializer* deserializer,
                           SignedCertificateTimestamp* sct) {
   int version;
-  if (!deserializer->ReadUint(Serializer::kVersionLengthInBytes, &version)) {
+  if (!VersionField::Read(deserializer, &version)) {
     return DeserializeResult::INPUT_TOO_SHORT;
   }
   if (!Version_IsValid(version) || (version != ct::V1 && version != ct::V2)) {
@@ -15,6 +15,34 @@ typedef google::protobuf::RepeatedPtrField<ct::SthExtension>
 typedef google::protobuf::RepeatedPtrField<ct::SctExtension>
     repeated_sct_extension;
 
+namespace cert_trans {
+
+namespace serialization {
+
+// The fixed-width fields of the CT structures (RFC 6962, section 3).
+typedef UintField<1> VersionField;
+typedef UintField<1> SignatureTypeField;
+typedef UintField<1> MerkleLeafTypeField;
+typedef UintField<2> LogEntryTypeField;
+typedef UintField<8> TimestampField;
+typedef UintField<8> TreeSizeField;
+typedef UintField<2> ExtensionCountField;
+typedef UintField<2> ExtensionTypeField;
+typedef VarBytesField<(1 << 16) - 1> ExtensionsField;
+
+// The leading fields of the signature input of an SCT, for both V1 and
+// V2, and of a V1 STH, and of a MerkleTreeLeaf.
+typedef FixedFields<VersionField, SignatureTypeField, TimestampField,
+                    LogEntryTypeField> SCTSignatureInputHeader;
+typedef FixedFields<VersionField, SignatureTypeField, TimestampField,
+                    TreeSizeField> STHSignatureInputHeader;
+typedef FixedFields<VersionField, MerkleLeafTypeField, TimestampField,
+                    LogEntryTypeField> MerkleTreeLeafHeader;
+
+}  // namespace serialization
+
+}  // namespace cert_trans
+
 cert_trans::serialization::SerializeResult CheckExtensionsFormat(
     const std::string& extensions);
 cert_trans::serialization::SerializeResult CheckKeyHashFormat(
@@ -0,0 +1,203 @@
+// Benchmarks for the TLS encoding of the CT structures, comparing the
+// fixed-width field templates to the generic WriteUint(). Run with
+// --help for the options of the benchmark library, e.g.
+// --benchmark_filter=<regex>.
+#include <benchmark/benchmark.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+#include "proto/cert_serializer.h"
+#include "proto/ct.pb.h"
+#include "proto/serializer.h"
+#include "proto/tls_encoding.h"
+
+using cert_trans::serialization::DeserializeResult;
+using cert_trans::serialization::LogEntryTypeField;
+using cert_trans::serialization::SCTSignatureInputHeader;
+using cert_trans::serialization::SerializeResult;
+using cert_trans::serialization::SignatureTypeField;
+using cert_trans::serialization::TimestampField;
+using cert_trans::serialization::VersionField;
+using cert_trans::serialization::WriteUint;
+using std::string;
+
+namespace {
+
+
+// Typical size of a leaf certificate.
+const size_t kCertificateSize = 1024;
+const uint64_t kTimestamp = 1469196130123;
+
+
+ct::LogEntry X509Entry() {
+  ct::LogEntry entry;
+  entry.set_type(ct::X509_ENTRY);
+  entry.mutable_x509_entry()->set_leaf_certificate(
+      string(kCertificateSize, 'c'));
+  return entry;
+}
+
+
+ct::SignedCertificateTimestamp SCT() {
+  ct::SignedCertificateTimestamp sct;
+  sct.set_version(ct::V1);
+  sct.mutable_id()->set_key_id(string(32, 'k'));
+  sct.set_timestamp(kTimestamp);
+  sct.mutable_signature()->set_hash_algorithm(ct::DigitallySigned::SHA256);
+  sct.mutable_signature()->set_sig_algorithm(ct::DigitallySigned::ECDSA);
+  sct.mutable_signature()->set_signature(string(71, 's'));
+  return sct;
+}
+
+
+// The header of an SCT signature input, a field at a time.
+void BM_WriteHeaderGeneric(benchmark::State& state) {
+  string out;
+  for (auto _ : state) {
+    out.clear();
+    WriteUint(ct::V1, Serializer::kVersionLengthInBytes, &out);
+    WriteUint(ct::CERTIFICATE_TIMESTAMP,
+              Serializer::kSignatureTypeLengthInBytes, &out);
+    WriteUint(kTimestamp, Serializer::kTimestampLengthInBytes, &out);
+    WriteUint(ct::X509_ENTRY, Serializer::kLogEntryTypeLengthInBytes, &out);
+    benchmark::DoNotOptimize(out.data());
+  }
+}
+BENCHMARK(BM_WriteHeaderGeneric);
+
+
+void BM_WriteHeaderFields(benchmark::State& state) {
+  string out;
+  for (auto _ : state) {
+    out.clear();
+    VersionField::Write(ct::V1, &out);
+    SignatureTypeField::Write(ct::CERTIFICATE_TIMESTAMP, &out);
+    TimestampField::Write(kTimestamp, &out);
+    LogEntryTypeField::Write(ct::X509_ENTRY, &out);
+    benchmark::DoNotOptimize(out.data());
+  }
+}
+BENCHMARK(BM_WriteHeaderFields);
+
+
+void BM_WriteHeaderFixedFields(benchmark::State& state) {
+  string out;
+  for (auto _ : state) {
+    out.clear();
+    SCTSignatureInputHeader::Append(&out, ct::V1, ct::CERTIFICATE_TIMESTAMP,
+                                    kTimestamp, ct::X509_ENTRY);
+    benchmark::DoNotOptimize(out.data());
+  }
+}
+BENCHMARK(BM_WriteHeaderFixedFields);
+
+
+void BM_ReadTimestampGeneric(benchmark::State& state) {
+  string in;
+  WriteUint(kTimestamp, Serializer::kTimestampLengthInBytes, &in);
+  uint64_t timestamp;
+  for (auto _ : state) {
+    TLSDeserializer deserializer(in);
+    CHECK(deserializer.ReadUint(Serializer::kTimestampLengthInBytes,
+                                &timestamp));
+    benchmark::DoNotOptimize(timestamp);
+  }
+}
+BENCHMARK(BM_ReadTimestampGeneric);
+
+
+void BM_ReadTimestampField(benchmark::State& state) {
+  string in;
+  TimestampField::Write(kTimestamp, &in);
+  uint64_t timestamp;
+  for (auto _ : state) {
+    TLSDeserializer deserializer(in);
+    CHECK(TimestampField::Read(&deserializer, &timestamp));
+    benchmark::DoNotOptimize(timestamp);
+  }
+}
+BENCHMARK(BM_ReadTimestampField);
+
+
+// The whole structures, as the log signs and stores them.
+void BM_SerializeSCTSignatureInput(benchmark::State& state) {
+  const ct::SignedCertificateTimestamp sct(SCT());
+  const ct::LogEntry entry(X509Entry());
+  string out;
+  for (auto _ : state) {
+    CHECK_EQ(SerializeResult::OK,
+             Serializer::SerializeSCTSignatureInput(sct, entry, &out));
+    benchmark::DoNotOptimize(out.data());
+  }
+}
+BENCHMARK(BM_SerializeSCTSignatureInput);
+
+
+void BM_SerializeSCTMerkleTreeLeaf(benchmark::State& state) {
+  const ct::SignedCertificateTimestamp sct(SCT());
+  const ct::LogEntry entry(X509Entry());
+  string out;
+  for (auto _ : state) {
+    CHECK_EQ(SerializeResult::OK,
+             Serializer::SerializeSCTMerkleTreeLeaf(sct, entry, &out));
+    benchmark::DoNotOptimize(out.data());
+  }
+}
+BENCHMARK(BM_SerializeSCTMerkleTreeLeaf);
+
+
+void BM_DeserializeMerkleTreeLeaf(benchmark::State& state) {
+  string in;
+  CHECK_EQ(SerializeResult::OK,
+           Serializer::SerializeSCTMerkleTreeLeaf(SCT(), X509Entry(), &in));
+  for (auto _ : state) {
+    ct::MerkleTreeLeaf leaf;
+    CHECK_EQ(DeserializeResult::OK,
+             Deserializer::DeserializeMerkleTreeLeaf(in, &leaf));
+    benchmark::DoNotOptimize(&leaf);
+  }
+}
+BENCHMARK(BM_DeserializeMerkleTreeLeaf);
+
+
+void BM_SerializeSTHSignatureInput(benchmark::State& state) {
+  ct::SignedTreeHead sth;
+  sth.set_version(ct::V1);
+  sth.set_timestamp(kTimestamp);
+  sth.set_tree_size(123456789);
+  sth.set_sha256_root_hash(string(32, 'r'));
+  string out;
+  for (auto _ : state) {
+    CHECK_EQ(SerializeResult::OK,
+             Serializer::SerializeSTHSignatureInput(sth, &out));
+    benchmark::DoNotOptimize(out.data());
+  }
+}
+BENCHMARK(BM_SerializeSTHSignatureInput);
+
+
+void BM_SerializeSCT(benchmark::State& state) {
+  const ct::SignedCertificateTimestamp sct(SCT());
+  string out;
+  for (auto _ : state) {
+    CHECK_EQ(SerializeResult::OK, Serializer::SerializeSCT(sct, &out));
+    benchmark::DoNotOptimize(out.data());
+  }
+}
+BENCHMARK(BM_SerializeSCT);
+
+
+}  // namespace
+
+
+int main(int argc, char** argv) {
+  benchmark::Initialize(&argc, argv);
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  ConfigureSerializerForV1CT();
+  benchmark::RunSpecifiedBenchmarks();
+  return 0;
+}
@@ -4,6 +4,7 @@
 #include <google/protobuf/repeated_field.h>
 #include <gtest/gtest.h>
 #include <string>
+#include <vector>
 
 #include "proto/cert_serializer.h"
 #include "proto/ct.pb.h"
@@ -713,6 +714,111 @@ class SerializerTestV2 : public SerializerTest {
 };
 
 
+TEST_F(SerializerTestV1, PrefixLength) {
+  using cert_trans::serialization::internal::PrefixLength;
+  EXPECT_EQ(0U, PrefixLength(1));
+  EXPECT_EQ(1U, PrefixLength(2));
+  EXPECT_EQ(1U, PrefixLength(255));
+  EXPECT_EQ(1U, PrefixLength(256));
+  EXPECT_EQ(2U, PrefixLength(257));
+  EXPECT_EQ(2U, PrefixLength((1 << 16) - 1));
+  EXPECT_EQ(3U, PrefixLength((1 << 24) - 1));
+  EXPECT_EQ(4U, PrefixLength((1 << 24) + 1));
+}
+
+// The lengths used to reserve the output are exact.
+TEST_F(SerializerTestV1, EncodedLengths) {
+  using cert_trans::serialization::DigitallySignedLength;
+  using cert_trans::serialization::VarBytesLength;
+  using cert_trans::serialization::WriteVarBytes;
+  string result;
+  WriteVarBytes("abc", 1 << 16, &result);
+  EXPECT_EQ(result.size(), VarBytesLength("abc", 1 << 16));
+
+  EXPECT_EQ(SerializeResult::OK,
+            Serializer::SerializeDigitallySigned(DefaultSCTSignature(),
+                                                 &result));
+  EXPECT_EQ(result.size(), DigitallySignedLength(DefaultSCTSignature()));
+}
+
+TEST_F(SerializerTestV1, FixedWidthFields) {
+  using cert_trans::serialization::SCTSignatureInputHeader;
+  using cert_trans::serialization::TimestampField;
+  using cert_trans::serialization::VarBytesField;
+  using cert_trans::serialization::WriteUint;
+  using cert_trans::serialization::internal::ConstPrefixLength;
+  using cert_trans::serialization::internal::PrefixLength;
+  for (const size_t max_length : {1, 255, 256, 257, 65535, 65536, 16777215})
+    EXPECT_EQ(PrefixLength(max_length), ConstPrefixLength(max_length));
+
+  const uint64_t timestamp(1469196130123);
+  string generic;
+  WriteUint(ct::V1, Serializer::kVersionLengthInBytes, &generic);
+  WriteUint(ct::CERTIFICATE_TIMESTAMP, Serializer::kSignatureTypeLengthInBytes,
+            &generic);
+  WriteUint(timestamp, Serializer::kTimestampLengthInBytes, &generic);
+  WriteUint(ct::X509_ENTRY, Serializer::kLogEntryTypeLengthInBytes, &generic);
+  string fixed;
+  SCTSignatureInputHeader::Append(&fixed, ct::V1, ct::CERTIFICATE_TIMESTAMP,
+                                  timestamp, ct::X509_ENTRY);
+  EXPECT_EQ(H(generic), H(fixed));
+  EXPECT_EQ(SCTSignatureInputHeader::kLength, fixed.size());
+
+  string var_bytes;
+  VarBytesField<(1 << 24) - 1>::Write("abc", &var_bytes);
+  EXPECT_EQ(VarBytesField<(1 << 24) - 1>::Length("abc"), var_bytes.size());
+  TimestampField::Write(timestamp, &var_bytes);
+  TLSDeserializer deserializer(var_bytes);
+  TLSBytes read_bytes;
+  ASSERT_TRUE(VarBytesField<(1 << 24) - 1>::Read(&deserializer, &read_bytes));
+  EXPECT_EQ("abc", read_bytes.ToString());
+  uint64_t read_timestamp;
+  ASSERT_TRUE(TimestampField::Read(&deserializer, &read_timestamp));
+  EXPECT_EQ(timestamp, read_timestamp);
+  EXPECT_TRUE(deserializer.ReachedEnd());
+}
+
+TEST_F(SerializerTestV1, ReadBytesWithoutCopying) {
+  using cert_trans::serialization::WriteVarBytes;
+  string input;
+  WriteVarBytes("abc", 255, &input);
+  input.append("de");
+
+  TLSDeserializer deserializer(input);
+  TLSBytes var_bytes;
+  ASSERT_TRUE(deserializer.ReadVarBytes(255, &var_bytes));
+  EXPECT_EQ(input.data() + 1, var_bytes.data());
+  EXPECT_EQ("abc", var_bytes.ToString());
+  TLSBytes fixed_bytes;
+  EXPECT_FALSE(deserializer.ReadFixedBytes(3, &fixed_bytes));
+  ASSERT_TRUE(deserializer.ReadFixedBytes(2, &fixed_bytes));
+  EXPECT_EQ("de", fixed_bytes.ToString());
+  EXPECT_TRUE(deserializer.ReachedEnd());
+}
+
+TEST_F(SerializerTestV1, ReadListWithoutCopying) {
+  using cert_trans::serialization::WriteList;
+  repeated_string in;
+  in.Add()->assign("abc");
+  in.Add()->assign("defg");
+  string input;
+  ASSERT_EQ(SerializeResult::OK, WriteList(in, 255, 255, &input));
+
+  std::vector<TLSBytes> elems;
+  TLSDeserializer deserializer(input);
+  ASSERT_EQ(DeserializeResult::OK, deserializer.ReadList(255, 255, &elems));
+  ASSERT_EQ(2U, elems.size());
+  EXPECT_EQ("abc", elems[0].ToString());
+  EXPECT_EQ("defg", elems[1].ToString());
+
+  repeated_string out;
+  EXPECT_EQ(DeserializeResult::OK,
+            Deserializer::DeserializeList(input, 255, 255, &out));
+  ASSERT_EQ(2, out.size());
+  EXPECT_EQ("abc", out.Get(0));
+  EXPECT_EQ("defg", out.Get(1));
+}
+
 TEST_F(SerializerTestV1, SerializeDigitallySignedKatTest) {
   string result;
   EXPECT_EQ(SerializeResult::OK,
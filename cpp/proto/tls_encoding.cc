@@ -1,7 +1,6 @@
 /* -*- indent-tabs-mode: nil -*- */
 #include "proto/tls_encoding.h"
 
-#include <math.h>
 #include <ostream>
 #include <string>
 
@@ -145,6 +144,7 @@ SerializeResult WriteList(const repeated_string& in, size_t max_elem_length,
   size_t prefix_length = internal::PrefixLength(max_total_length);
   CHECK_GE(length, prefix_length);
 
+  output->reserve(output->size() + length);
   WriteUint(length - prefix_length, prefix_length, output);
 
   for (int i = 0; i < in.size(); ++i)
@@ -165,11 +165,29 @@ SerializeResult WriteDigitallySigned(const DigitallySigned& sig,
   return SerializeResult::OK;
 }
 
+size_t VarBytesLength(const std::string& in, size_t max_length) {
+  return internal::PrefixLength(max_length) + in.size();
+}
+
+size_t DigitallySignedLength(const DigitallySigned& sig) {
+  return constants::kHashAlgorithmLengthInBytes +
+         constants::kSigAlgorithmLengthInBytes +
+         VarBytesLength(sig.signature(), constants::kMaxSignatureLength);
+}
+
+const size_t FixedFields<>::kLength;
+
 namespace internal {
 
 size_t PrefixLength(size_t max_length) {
   CHECK_GT(max_length, 0U);
-  return ceil(log2(max_length) / float(8));
+  // The number of bytes of ceil(log2(max_length)) bits, without the
+  // floating point: this is on the path of every variable-length field.
+  size_t bits = 0;
+  while (bits < sizeof(size_t) * 8 &&
+         (static_cast<size_t>(1) << bits) < max_length)
+    ++bits;
+  return (bits + 7) / 8;
 }
 
 }  // namespace internal
@@ -192,16 +210,30 @@ TLSDeserializer::TLSDeserializer(const std::string& input)
 }
 
 
-bool TLSDeserializer::ReadFixedBytes(size_t bytes, std::string* result) {
+TLSDeserializer::TLSDeserializer(const TLSBytes& input)
+    : current_pos_(input.data()), bytes_remaining_(input.size()) {
+}
+
+
+bool TLSDeserializer::ReadFixedBytes(size_t bytes, TLSBytes* result) {
   if (bytes_remaining_ < bytes)
     return false;
-  result->assign(current_pos_, bytes);
+  *result = TLSBytes(current_pos_, bytes);
   current_pos_ += bytes;
   bytes_remaining_ -= bytes;
   return true;
 }
 
 
+bool TLSDeserializer::ReadFixedBytes(size_t bytes, std::string* result) {
+  TLSBytes bytes_read;
+  if (!ReadFixedBytes(bytes, &bytes_read))
+    return false;
+  result->assign(bytes_read.data(), bytes_read.size());
+  return true;
+}
+
+
 bool TLSDeserializer::ReadLengthPrefix(size_t max_length, size_t* result) {
   size_t prefix_length = cert_trans::serialization::internal::PrefixLength(max_length);
   size_t length;
@@ -212,17 +244,28 @@ bool TLSDeserializer::ReadLengthPrefix(size_t max_length, size_t* result) {
 }
 
 
-bool TLSDeserializer::ReadVarBytes(size_t max_length, std::string* result) {
+bool TLSDeserializer::ReadVarBytes(size_t max_length, TLSBytes* result) {
   size_t length;
   if (!ReadLengthPrefix(max_length, &length))
     return false;
   return ReadFixedBytes(length, result);
 }
 
+
+bool TLSDeserializer::ReadVarBytes(size_t max_length, std::string* result) {
+  TLSBytes bytes_read;
+  if (!ReadVarBytes(max_length, &bytes_read))
+    return false;
+  result->assign(bytes_read.data(), bytes_read.size());
+  return true;
+}
+
+
 DeserializeResult TLSDeserializer::ReadList(size_t max_total_length,
                                             size_t max_elem_length,
-                                            repeated_string* out) {
-  std::string serialized_list;
+                                            std::vector<TLSBytes>* out) {
+  CHECK(out->empty());
+  TLSBytes serialized_list;
   if (!ReadVarBytes(max_total_length, &serialized_list))
     // TODO(ekasper): could also be a length that's too large, if
     // length limits don't follow byte boundaries.
@@ -232,17 +275,32 @@ DeserializeResult TLSDeserializer::ReadList(size_t max_total_length,
 
   TLSDeserializer list_reader(serialized_list);
   while (!list_reader.ReachedEnd()) {
-    std::string elem;
+    TLSBytes elem;
     if (!list_reader.ReadVarBytes(max_elem_length, &elem))
       return DeserializeResult::INVALID_LIST_ENCODING;
     if (elem.empty())
       return DeserializeResult::EMPTY_ELEM_IN_LIST;
-    *(out->Add()) = elem;
+    out->push_back(elem);
   }
   return DeserializeResult::OK;
 }
 
 
+DeserializeResult TLSDeserializer::ReadList(size_t max_total_length,
+                                            size_t max_elem_length,
+                                            repeated_string* out) {
+  std::vector<TLSBytes> elems;
+  const DeserializeResult res(
+      ReadList(max_total_length, max_elem_length, &elems));
+  if (res != DeserializeResult::OK)
+    return res;
+  out->Reserve(out->size() + elems.size());
+  for (const TLSBytes& elem : elems)
+    out->Add()->assign(elem.data(), elem.size());
+  return DeserializeResult::OK;
+}
+
+
 DeserializeResult TLSDeserializer::ReadDigitallySigned(DigitallySigned* sig) {
   int hash_algo = -1, sig_algo = -1;
   if (!ReadUint(constants::kHashAlgorithmLengthInBytes, &hash_algo))
@@ -254,13 +312,13 @@ DeserializeResult TLSDeserializer::ReadDigitallySigned(DigitallySigned* sig) {
   if (!ct::DigitallySigned_SignatureAlgorithm_IsValid(sig_algo))
     return DeserializeResult::INVALID_SIGNATURE_ALGORITHM;
 
-  std::string sig_string;
-  if (!ReadVarBytes(constants::kMaxSignatureLength, &sig_string))
+  TLSBytes sig_bytes;
+  if (!ReadVarBytes(constants::kMaxSignatureLength, &sig_bytes))
     return DeserializeResult::INPUT_TOO_SHORT;
   sig->set_hash_algorithm(
       static_cast<DigitallySigned::HashAlgorithm>(hash_algo));
   sig->set_sig_algorithm(
       static_cast<DigitallySigned::SignatureAlgorithm>(sig_algo));
-  sig->set_signature(sig_string);
+  sig->set_signature(sig_bytes.data(), sig_bytes.size());
   return DeserializeResult::OK;
 }
@@ -2,7 +2,9 @@
 #define CERT_TRANS_PROTO_TLS_ENCODING_H_
 
 #include <glog/logging.h>
+#include <stdint.h>
 #include <string>
+#include <vector>
 
 #include "proto/ct.pb.h"
 
@@ -59,13 +61,18 @@ std::ostream& operator<<(std::ostream& stream, const DeserializeResult& r);
 ///////////////////////////////////////////////////////////////////////////////
 // Basic serialization functions.                                            //
 ///////////////////////////////////////////////////////////////////////////////
+//
+// The encoders append to |output|. To avoid growing it several times,
+// callers compute the encoded length first, with the *Length()
+// functions below, and reserve it all at once.
 template <class T>
 void WriteUint(T in, size_t bytes, std::string* output) {
   CHECK_LE(bytes, sizeof(in));
   CHECK(bytes == sizeof(in) || in >> (bytes * 8) == 0);
-  for (; bytes > 0; --bytes)
-    output->push_back(((in & (static_cast<T>(0xff) << ((bytes - 1) * 8))) >>
-                       ((bytes - 1) * 8)));
+  char buf[sizeof(T)];
+  for (size_t i = 0; i < bytes; ++i)
+    buf[i] = static_cast<char>(in >> ((bytes - 1 - i) * 8));
+  output->append(buf, bytes);
 }
 
 // Fixed-length byte array.
@@ -83,6 +90,13 @@ SerializeResult WriteList(const repeated_string& in, size_t max_elem_length,
 SerializeResult WriteDigitallySigned(const ct::DigitallySigned& sig,
                                      std::string* output);
 
+// The number of bytes WriteVarBytes() writes for |in|.
+size_t VarBytesLength(const std::string& in, size_t max_length);
+
+// The number of bytes WriteDigitallySigned() writes for |sig|, if it is
+// valid.
+size_t DigitallySignedLength(const ct::DigitallySigned& sig);
+
 namespace constants {
 static const size_t kMaxSignatureLength = (1 << 16) - 1;
 static const size_t kHashAlgorithmLengthInBytes = 1;
@@ -94,12 +108,56 @@ namespace internal {
 // Returns the number of bytes needed to store a value up to max_length.
 size_t PrefixLength(size_t max_length);
 
+// The same, for use in templates.
+constexpr size_t PrefixBits(size_t max_length, size_t bits = 0) {
+  return (bits < sizeof(size_t) * 8 &&
+          (static_cast<size_t>(1) << bits) < max_length)
+             ? PrefixBits(max_length, bits + 1)
+             : bits;
+}
+constexpr size_t ConstPrefixLength(size_t max_length) {
+  return (PrefixBits(max_length) + 7) / 8;
+}
+
 }  // namespace internal
 
 }  // namespace serializer
 
 }  // namespace cert_trans
 
+// A range of bytes in the input of a TLSDeserializer, which is only
+// valid as long as that input is. Use ToString() (or the set_*(data,
+// size) protobuf setters) to keep a field beyond that.
+class TLSBytes {
+ public:
+  TLSBytes() : data_(nullptr), size_(0) {
+  }
+  TLSBytes(const char* data, size_t size) : data_(data), size_(size) {
+  }
+  explicit TLSBytes(const std::string& str)
+      : data_(str.data()), size_(str.size()) {
+  }
+
+  const char* data() const {
+    return data_;
+  }
+  size_t size() const {
+    return size_;
+  }
+  bool empty() const {
+    return size_ == 0;
+  }
+
+  std::string ToString() const {
+    return std::string(data_, size_);
+  }
+
+ private:
+  const char* data_;
+  size_t size_;
+};
+
+
 class TLSDeserializer {
  public:
   // We do not make a copy, so input must remain valid.
@@ -107,13 +165,22 @@ class TLSDeserializer {
   // (which could be to a temporary, and not valid once the
   // constructor returns).
   explicit TLSDeserializer(const std::string& input);
+  explicit TLSDeserializer(const TLSBytes& input);
   TLSDeserializer(const TLSDeserializer&) = delete;
   TLSDeserializer& operator=(const TLSDeserializer&) = delete;
 
+  // The Read*() methods taking a TLSBytes set it to the field within
+  // the input, without copying it.
+  bool ReadFixedBytes(size_t bytes, TLSBytes* result);
   bool ReadFixedBytes(size_t bytes, std::string* result);
 
+  bool ReadVarBytes(size_t max_length, TLSBytes* result);
   bool ReadVarBytes(size_t max_length, std::string* result);
 
+  // Appends the elements to |out|, which must be empty.
+  cert_trans::serialization::DeserializeResult ReadList(
+      size_t max_total_length, size_t max_elem_length,
+      std::vector<TLSBytes>* out);
   cert_trans::serialization::DeserializeResult ReadList(
       size_t max_total_length, size_t max_elem_length, repeated_string* out);
 
@@ -145,5 +212,131 @@ class TLSDeserializer {
   size_t bytes_remaining_;
 };
 
+namespace cert_trans {
+
+namespace serialization {
+
+///////////////////////////////////////////////////////////////////////////////
+// Fixed-layout fields.                                                      //
+///////////////////////////////////////////////////////////////////////////////
+//
+// Fields whose width is a template parameter, so that their encoders
+// and decoders are specialized at compile time: the byte loops unroll
+// into plain stores and loads, and a width that cannot hold the value
+// type is a compile error. FixedFields<> describes a run of them, such
+// as the header of a structure, and writes it with a single append:
+//
+//   typedef FixedFields<UintField<1>, UintField<8>> Header;
+//   Header::Append(&output, ct::V1, timestamp);
+
+template <size_t kBytes>
+struct UintField {
+  static_assert(kBytes > 0 && kBytes <= sizeof(uint64_t),
+                "unsupported integer width");
+  static const size_t kLength = kBytes;
+
+  static void Store(uint64_t in, char* output) {
+    // Shifting by 64 bits would be undefined, hence the two steps.
+    CHECK_EQ(0U, in >> (kBytes * 8 - 1) >> 1);
+    for (size_t i = 0; i < kBytes; ++i)
+      output[i] = static_cast<char>(in >> ((kBytes - 1 - i) * 8));
+  }
+
+  static uint64_t Load(const char* input) {
+    uint64_t res = 0;
+    for (size_t i = 0; i < kBytes; ++i)
+      res = (res << 8) | static_cast<unsigned char>(input[i]);
+    return res;
+  }
+
+  static void Write(uint64_t in, std::string* output) {
+    char buf[kBytes];
+    Store(in, buf);
+    output->append(buf, kBytes);
+  }
+
+  template <class T>
+  static bool Read(TLSDeserializer* input, T* result) {
+    static_assert(sizeof(T) >= kBytes, "field does not fit the result");
+    TLSBytes bytes;
+    if (!input->ReadFixedBytes(kBytes, &bytes))
+      return false;
+    *result = static_cast<T>(Load(bytes.data()));
+    return true;
+  }
+};
+
+
+// Variable-length byte array of at most kMaxLength bytes.
+template <size_t kMax>
+struct VarBytesField {
+  static const size_t kMaxLength = kMax;
+  typedef UintField<internal::ConstPrefixLength(kMax)> Prefix;
+
+  static size_t Length(const std::string& in) {
+    return Prefix::kLength + in.size();
+  }
+
+  // Caller is responsible for checking |in| <= kMaxLength.
+  static void Write(const std::string& in, std::string* output) {
+    CHECK_LE(in.size(), kMax);
+    Prefix::Write(in.size(), output);
+    output->append(in);
+  }
+
+  static bool Read(TLSDeserializer* input, TLSBytes* result) {
+    size_t length;
+    if (!Prefix::Read(input, &length) || length > kMax)
+      return false;
+    return input->ReadFixedBytes(length, result);
+  }
+};
+
+template <size_t kBytes>
+const size_t UintField<kBytes>::kLength;
+
+template <size_t kMax>
+const size_t VarBytesField<kMax>::kMaxLength;
+
+
+template <class... Fields>
+struct FixedFields;
+
+template <>
+struct FixedFields<> {
+  static const size_t kLength = 0;
+
+  static void Store(char*) {
+  }
+};
+
+template <class Field, class... Rest>
+struct FixedFields<Field, Rest...> {
+  static const size_t kLength = Field::kLength + FixedFields<Rest...>::kLength;
+
+  // Takes one value per field, in order.
+  template <class... Values>
+  static void Store(char* output, uint64_t value, Values... rest) {
+    static_assert(sizeof...(Values) == sizeof...(Rest),
+                  "need one value per field");
+    Field::Store(value, output);
+    FixedFields<Rest...>::Store(output + Field::kLength, rest...);
+  }
+
+  template <class... Values>
+  static void Append(std::string* output, Values... values) {
+    char buf[kLength];
+    Store(buf, values...);
+    output->append(buf, kLength);
+  }
+};
+
+template <class Field, class... Rest>
+const size_t FixedFields<Field, Rest...>::kLength;
+
+}  // namespace serialization
+
+}  // namespace cert_trans
+
 
 #endif
@@ -1,50 +1,140 @@
+#include <event2/buffer.h>
+#include <event2/http.h>
+#include <event2/keyvalq_struct.h>
+#include <gflags/gflags.h>
 #include <functional>
+#include <memory>
+#include <vector>
 
+#include "log/cluster_state_controller.h"
 #include "log/frontend.h"
+#include "merkletree/serial_hasher.h"
+#include "monitoring/monitoring.h"
 #include "server/certificate_handler.h"
 #include "server/json_output.h"
+#include "server/proxy.h"
 #include "util/json_wrapper.h"
+#include "util/parallel_for.h"
 #include "util/status.h"
+#include "util/task.h"
 #include "util/thread_pool.h"
+#include "util/trace.h"
+#include "util/util.h"
+
+DEFINE_int32(max_pending_add_chain_requests, 0,
+             "Maximum number of add-chain and add-pre-chain requests "
+             "waiting for, or being processed by, the worker threads; "
+             "further ones are answered with 503. 0 means no limit.");
+DEFINE_bool(async_add_chain, false,
+            "Whether add-chain and add-pre-chain requests release their "
+            "worker thread while the entry is added to the consistent "
+            "store, rather than waiting for it there. The number of "
+            "requests in flight is then only limited by "
+            "--max_pending_add_chain_requests. The entries are not batched "
+            "(see --frontend_batch_window_ms).");
+DEFINE_int32(max_add_chains_batch_size, 1000,
+             "Maximum number of chains in one add-chains or add-pre-chains "
+             "request.");
+DEFINE_int32(add_chain_max_body_bytes, 16384,
+             "Maximum size of the body of an add-chain or add-pre-chain "
+             "request, larger ones being rejected with 413 before they are "
+             "parsed. 0 leaves it to --http_max_body_bytes.");
+DEFINE_bool(route_add_chain_to_owner, false,
+            "Proxy each add-chain and add-pre-chain request to the node "
+            "which owns its chain, picked among the fresh nodes by "
+            "rendezvous hashing of the request body, so that the "
+            "duplicate submissions of a chain meet the same caches.");
 
 namespace cert_trans {
 
 using ct::LogEntry;
 using ct::SignedCertificateTimestamp;
 using std::bind;
-using std::make_shared;
 using std::move;
 using std::multimap;
 using std::placeholders::_1;
-using std::shared_ptr;
 using std::string;
 using std::unique_ptr;
+using std::vector;
 using util::Status;
 
 
 namespace {
 
 
-bool ExtractChain(libevent::Base* base, evhttp_request* req,
-                  CertChain* chain) {
-  if (evhttp_request_get_command(req) != EVHTTP_REQ_POST) {
-    SendJsonError(base, req, HTTP_BADMETHOD, "Method not allowed.");
-    return false;
+// Set on the requests proxied to the owner of their chain, which
+// handles them whatever its view of the cluster, so that they are never
+// proxied again.
+const char kOwnerRoutedHeader[] = "X-CT-Owner-Routed";
+
+
+static Counter<string>* add_chain_owner_routing(
+    Counter<string>::New("add_chain_owner_routing", "result",
+                         "Number of add-chain and add-pre-chain requests "
+                         "routed by --route_add_chain_to_owner, by result "
+                         "(local or forwarded)."));
+
+
+// The finalizer of SplitMix64, as in LeafHashIndex.
+uint64_t Mix(uint64_t key) {
+  key = (key ^ (key >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+  key = (key ^ (key >> 27)) * UINT64_C(0x94d049bb133111eb);
+  return key ^ (key >> 31);
+}
+
+
+uint64_t Fnv1a(const char* data, size_t size,
+               uint64_t hash = UINT64_C(14695981039346656037)) {
+  for (size_t i = 0; i < size; ++i) {
+    hash = (hash ^ static_cast<unsigned char>(data[i])) *
+           UINT64_C(1099511628211);
   }
+  return hash;
+}
 
-  // TODO(pphaneuf): Should we check that Content-Type says
-  // "application/json", as recommended by RFC4627?
-  JsonObject json_body(evhttp_request_get_input_buffer(req));
-  if (!json_body.Ok() || !json_body.IsType(json_type_object)) {
-    SendJsonError(base, req, HTTP_BADREQUEST,
-                  "Unable to parse provided JSON.");
-    return false;
+
+// The fingerprint of the chain of an add-chain request: a hash of its
+// body, read in place. The resubmissions of a chain are usually the
+// same request again, which is cheaper to hash than to parse.
+uint64_t ChainFingerprint(evhttp_request* req) {
+  evbuffer* const body(evhttp_request_get_input_buffer(req));
+  const int num_chunks(evbuffer_peek(body, -1, nullptr, nullptr, 0));
+  vector<evbuffer_iovec> chunks(num_chunks);
+  CHECK_EQ(evbuffer_peek(body, -1, nullptr, chunks.data(), num_chunks),
+           num_chunks);
+  uint64_t hash(UINT64_C(14695981039346656037));
+  for (const evbuffer_iovec& chunk : chunks) {
+    hash = Fnv1a(static_cast<const char*>(chunk.iov_base), chunk.iov_len,
+                 hash);
+  }
+  return Mix(hash);
+}
+
+
+// The node, among |nodes|, which owns the chain of |fingerprint|: the
+// one with the highest score for it (rendezvous hashing), so that only
+// the chains of a node which leaves or joins change owners.
+const ct::ClusterNodeState* ChainOwner(
+    uint64_t fingerprint, const vector<ct::ClusterNodeState>& nodes) {
+  const ct::ClusterNodeState* owner(nullptr);
+  uint64_t owner_score(0);
+  for (const ct::ClusterNodeState& node : nodes) {
+    const string address(node.hostname() + ":" +
+                         std::to_string(node.log_port()));
+    const uint64_t score(
+        Mix(fingerprint ^ Fnv1a(address.data(), address.size())));
+    if (!owner || score > owner_score) {
+      owner = &node;
+      owner_score = score;
+    }
   }
+  return owner;
+}
+
 
-  JsonArray json_chain(json_body, "chain");
+// Sets |ders| to the decoded certificates of |json_chain|.
+bool ExtractDerChain(const JsonArray& json_chain, vector<string>* ders) {
   if (!json_chain.Ok()) {
-    SendJsonError(base, req, HTTP_BADREQUEST,
-                  "Unable to parse provided JSON.");
     return false;
   }
 
@@ -53,15 +143,19 @@ bool ExtractChain(libevent::Base* base, evhttp_request* req,
   for (int i = 0; i < json_chain.Length(); ++i) {
     JsonString json_cert(json_chain, i);
     if (!json_cert.Ok()) {
-      SendJsonError(base, req, HTTP_BADREQUEST,
-                    "Unable to parse provided JSON.");
       return false;
     }
+    ders->push_back(json_cert.FromBase64());
+  }
+
+  return true;
+}
 
-    unique_ptr<Cert> cert(Cert::FromDerString(json_cert.FromBase64()));
+
+bool ParseChain(const vector<string>& ders, CertChain* chain) {
+  for (const string& der : ders) {
+    unique_ptr<Cert> cert(Cert::FromDerString(der));
     if (!cert) {
-      SendJsonError(base, req, HTTP_BADREQUEST,
-                    "Unable to parse provided chain.");
       return false;
     }
 
@@ -72,6 +166,36 @@ bool ExtractChain(libevent::Base* base, evhttp_request* req,
 }
 
 
+// Runs on the worker threads, the request having been handed over
+// once complete: the event thread does not touch its input buffer.
+bool ExtractChain(libevent::Base* base, evhttp_request* req,
+                  CertChain* chain) {
+  // TODO(pphaneuf): Should we check that Content-Type says
+  // "application/json", as recommended by RFC4627?
+  JsonObject json_body(evhttp_request_get_input_buffer(req));
+  if (!json_body.Ok() || !json_body.IsType(json_type_object)) {
+    SendJsonError(base, req, HTTP_BADREQUEST,
+                  "Unable to parse provided JSON.");
+    return false;
+  }
+
+  vector<string> ders;
+  if (!ExtractDerChain(JsonArray(json_body, "chain"), &ders)) {
+    SendJsonError(base, req, HTTP_BADREQUEST,
+                  "Unable to parse provided JSON.");
+    return false;
+  }
+
+  if (!ParseChain(ders, chain)) {
+    SendJsonError(base, req, HTTP_BADREQUEST,
+                  "Unable to parse provided chain.");
+    return false;
+  }
+
+  return true;
+}
+
+
 CertSubmissionHandler* MaybeCreateSubmissionHandler(
     const CertChecker* checker) {
   if (checker != nullptr) {
@@ -88,12 +212,13 @@ CertificateHttpHandler::CertificateHttpHandler(
     LogLookup* log_lookup, const ReadOnlyDatabase* db,
     const ClusterStateController* controller, const CertChecker* cert_checker,
     Frontend* frontend, ThreadPool* pool, libevent::Base* event_base,
-    StalenessTracker* staleness_tracker)
+    StalenessTracker* staleness_tracker, ThreadPool* read_pool)
     : HttpHandler(log_lookup, db, controller, pool, event_base,
-                  staleness_tracker),
+                  staleness_tracker, read_pool),
       cert_checker_(cert_checker),
       submission_handler_(MaybeCreateSubmissionHandler(cert_checker_)),
-      frontend_(frontend) {
+      frontend_(frontend),
+      pending_adds_(0) {
 }
 
 
@@ -109,10 +234,20 @@ void CertificateHttpHandler::AddHandlers(libevent::HttpServer* server) {
     // Proxy the add-* calls too, technically we could serve them, but a
     // more up-to-date node will have a better chance of handling dupes
     // correctly, rather than bloating the tree.
+    CHECK_LE(0, FLAGS_add_chain_max_body_bytes);
     AddProxyWrappedHandler(server, "/ct/v1/add-chain",
-                           bind(&CertificateHttpHandler::AddChain, this, _1));
+                           bind(&CertificateHttpHandler::AddChain, this, _1),
+                           FLAGS_add_chain_max_body_bytes);
     AddProxyWrappedHandler(server, "/ct/v1/add-pre-chain",
                            bind(&CertificateHttpHandler::AddPreChain, this,
+                                _1),
+                           FLAGS_add_chain_max_body_bytes);
+    // Not part of RFC 6962: several chains in one request.
+    AddProxyWrappedHandler(server, "/ct/v1/add-chains",
+                           bind(&CertificateHttpHandler::AddChains, this,
+                                _1));
+    AddProxyWrappedHandler(server, "/ct/v1/add-pre-chains",
+                           bind(&CertificateHttpHandler::AddPreChains, this,
                                 _1));
   }
 }
@@ -124,13 +259,24 @@ void CertificateHttpHandler::GetRoots(evhttp_request* req) const {
                          "Method not allowed.");
   }
 
+  std::call_once(roots_reply_once_,
+                 bind(&CertificateHttpHandler::PrepareRootsReply, this));
+  if (!roots_reply_) {
+    return SendJsonError(event_base_, req, HTTP_INTERNAL,
+                         "Serialisation failed.");
+  }
+
+  SendCachedReply(req, roots_reply_);
+}
+
+
+void CertificateHttpHandler::PrepareRootsReply() const {
   JsonArray roots;
   for (const auto& trusted_cert : cert_checker_->GetTrustedCertificates()) {
     string cert;
     if (trusted_cert.second->DerEncoding(&cert) != ::util::OkStatus()) {
       LOG(ERROR) << "Cert encoding failed";
-      return SendJsonError(event_base_, req, HTTP_INTERNAL,
-                           "Serialisation failed.");
+      return;
     }
     roots.AddBase64(cert);
   }
@@ -138,55 +284,229 @@ void CertificateHttpHandler::GetRoots(evhttp_request* req) const {
   JsonObject json_reply;
   json_reply.Add("certificates", roots);
 
-  SendJsonReply(event_base_, req, HTTP_OK, json_reply);
+  const string body(json_reply.ToString());
+  roots_reply_ = std::make_shared<ServingCache::Reply>(
+      body,
+      "\"roots-" + util::HexString(Sha256Hasher::Sha256Digest(body)) + "\"");
 }
 
 
 void CertificateHttpHandler::AddChain(evhttp_request* req) {
-  const shared_ptr<CertChain> chain(make_shared<CertChain>());
-  if (!ExtractChain(event_base_, req, chain.get())) {
-    return;
+  StartAdd(req, bind(&CertificateHttpHandler::BlockingAddChain, this, req));
+}
+
+
+void CertificateHttpHandler::AddPreChain(evhttp_request* req) {
+  StartAdd(req,
+           bind(&CertificateHttpHandler::BlockingAddPreChain, this, req));
+}
+
+
+void CertificateHttpHandler::AddChains(evhttp_request* req) {
+  StartAdd(req, bind(&CertificateHttpHandler::BlockingAddChains, this, req,
+                     false));
+}
+
+
+void CertificateHttpHandler::AddPreChains(evhttp_request* req) {
+  StartAdd(req,
+           bind(&CertificateHttpHandler::BlockingAddChains, this, req, true));
+}
+
+
+void CertificateHttpHandler::StartAdd(
+    evhttp_request* req, const std::function<void()>& blocking_add) {
+  if (evhttp_request_get_command(req) != EVHTTP_REQ_POST) {
+    return SendJsonError(event_base_, req, HTTP_BADMETHOD,
+                         "Method not allowed.");
   }
 
-  pool_->Add(
-      bind(&CertificateHttpHandler::BlockingAddChain, this, req, chain));
+  if (++pending_adds_ > FLAGS_max_pending_add_chain_requests &&
+      FLAGS_max_pending_add_chain_requests > 0) {
+    --pending_adds_;
+    return SendJsonError(event_base_, req, HTTP_SERVUNAVAIL,
+                         "Too many pending requests.");
+  }
+
+  if (!AddWork(pool_, submission_class_, req, blocking_add)) {
+    --pending_adds_;
+  }
 }
 
 
-void CertificateHttpHandler::AddPreChain(evhttp_request* req) {
-  const shared_ptr<PreCertChain> chain(make_shared<PreCertChain>());
-  if (!ExtractChain(event_base_, req, chain.get())) {
-    return;
+bool CertificateHttpHandler::ForwardToOwner(evhttp_request* req) const {
+  if (!FLAGS_route_add_chain_to_owner || !proxy_ || !controller_) {
+    return false;
+  }
+  evkeyvalq* const headers(evhttp_request_get_input_headers(req));
+  if (evhttp_find_header(headers, kOwnerRoutedHeader)) {
+    return false;
   }
 
-  pool_->Add(
-      bind(&CertificateHttpHandler::BlockingAddPreChain, this, req, chain));
+  // This node is not among the fresh nodes, but it is fresh enough to
+  // be handling the request.
+  vector<ct::ClusterNodeState> nodes(controller_->GetFreshNodes());
+  nodes.emplace_back();
+  controller_->GetLocalNodeState(&nodes.back());
+  const ct::ClusterNodeState* const owner(
+      ChainOwner(ChainFingerprint(req), nodes));
+  if (owner == &nodes.back()) {
+    add_chain_owner_routing->Increment("local");
+    return false;
+  }
+
+  add_chain_owner_routing->Increment("forwarded");
+  CHECK_EQ(evhttp_add_header(headers, kOwnerRoutedHeader, "1"), 0);
+  proxy_->ProxyRequestTo(req, *owner);
+  return true;
 }
 
 
-void CertificateHttpHandler::BlockingAddChain(
-    evhttp_request* req, const shared_ptr<CertChain>& chain) const {
-  SignedCertificateTimestamp sct;
+void CertificateHttpHandler::BlockingAddChain(evhttp_request* req) const {
+  if (ForwardToOwner(req)) {
+    --pending_adds_;
+    return;
+  }
+  CertChain chain;
+  if (!ExtractChain(event_base_, req, &chain)) {
+    --pending_adds_;
+    return;
+  }
+  LogEntry entry;
+  Status status;
+  {
+    util::ScopedSpan span("CertSubmissionHandler::ProcessX509Submission");
+    status = submission_handler_->ProcessX509Submission(&chain, &entry);
+  }
+  QueueEntry(req, status, entry);
+}
+
 
+void CertificateHttpHandler::BlockingAddPreChain(evhttp_request* req) const {
+  if (ForwardToOwner(req)) {
+    --pending_adds_;
+    return;
+  }
+  PreCertChain chain;
+  if (!ExtractChain(event_base_, req, &chain)) {
+    --pending_adds_;
+    return;
+  }
   LogEntry entry;
-  const Status status(frontend_->QueueProcessedEntry(
-      submission_handler_->ProcessX509Submission(chain.get(), &entry), entry,
-      &sct));
+  Status status;
+  {
+    util::ScopedSpan span("CertSubmissionHandler::ProcessPreCertSubmission");
+    status = submission_handler_->ProcessPreCertSubmission(&chain, &entry);
+  }
+  QueueEntry(req, status, entry);
+}
+
+
+void CertificateHttpHandler::QueueEntry(evhttp_request* req,
+                                        const Status& pre_status,
+                                        const LogEntry& entry) const {
+  if (!FLAGS_async_add_chain) {
+    SignedCertificateTimestamp sct;
+    const Status status(
+        frontend_->QueueProcessedEntry(pre_status, entry, &sct));
+    AddEntryReply(req, status, sct);
+    --pending_adds_;
+    return;
+  }
 
-  AddEntryReply(req, status, sct);
+  SignedCertificateTimestamp* const sct(new SignedCertificateTimestamp);
+  util::Task* const task(new util::Task(
+      [this, req, sct](util::Task* done) {
+        AddEntryReply(req, done->status(), *sct);
+        delete sct;
+        delete done;
+        --pending_adds_;
+      },
+      pool_));
+  frontend_->QueueProcessedEntryAsync(pre_status, entry, sct, task);
 }
 
 
-void CertificateHttpHandler::BlockingAddPreChain(
-    evhttp_request* req, const shared_ptr<PreCertChain>& chain) const {
-  SignedCertificateTimestamp sct;
+void CertificateHttpHandler::BlockingAddChains(evhttp_request* req,
+                                               bool precert) const {
+  BlockingAddChainsInternal(req, precert);
+  --pending_adds_;
+}
 
-  LogEntry entry;
-  const Status status(frontend_->QueueProcessedEntry(
-      submission_handler_->ProcessPreCertSubmission(chain.get(), &entry),
-      entry, &sct));
 
-  AddEntryReply(req, status, sct);
+void CertificateHttpHandler::BlockingAddChainsInternal(evhttp_request* req,
+                                                       bool precert) const {
+  JsonObject json_body(evhttp_request_get_input_buffer(req));
+  if (!json_body.Ok() || !json_body.IsType(json_type_object)) {
+    return SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                         "Unable to parse provided JSON.");
+  }
+
+  JsonArray json_chains(json_body, "chains");
+  if (!json_chains.Ok()) {
+    return SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                         "Unable to parse provided JSON.");
+  }
+  if (json_chains.Length() > FLAGS_max_add_chains_batch_size) {
+    return SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                         "Too many chains.");
+  }
+
+  // The JSON is only looked at on this thread, the certificates are
+  // parsed and checked in parallel.
+  vector<vector<string>> ders(json_chains.Length());
+  for (int i = 0; i < json_chains.Length(); ++i) {
+    JsonObject json_entry(json_chains, i);
+    if (!json_entry.Ok() ||
+        !ExtractDerChain(JsonArray(json_entry, "chain"), &ders[i])) {
+      return SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                           "Unable to parse provided JSON.");
+    }
+  }
+
+  // The entries are added concurrently, so that the frontend signer
+  // can write them to the consistent store together.
+  vector<Status> statuses(ders.size());
+  vector<SignedCertificateTimestamp> scts(ders.size());
+  util::ParallelFor(pool_, ders.size(), [&](size_t i) {
+    LogEntry entry;
+    Status status;
+    if (precert) {
+      PreCertChain chain;
+      status = ParseChain(ders[i], &chain)
+                   ? submission_handler_->ProcessPreCertSubmission(&chain,
+                                                                   &entry)
+                   : Status(util::error::INVALID_ARGUMENT,
+                            "Unable to parse provided chain.");
+    } else {
+      CertChain chain;
+      status = ParseChain(ders[i], &chain)
+                   ? submission_handler_->ProcessX509Submission(&chain,
+                                                                &entry)
+                   : Status(util::error::INVALID_ARGUMENT,
+                            "Unable to parse provided chain.");
+    }
+    statuses[i] = frontend_->QueueProcessedEntry(status, entry, &scts[i]);
+  });
+
+  // Each result is what add-chain would have replied.
+  JsonArray json_results;
+  for (size_t i = 0; i < ders.size(); ++i) {
+    JsonObject json_result;
+    if (statuses[i].ok() ||
+        statuses[i].CanonicalCode() == util::error::ALREADY_EXISTS) {
+      AddSctFields(scts[i], &json_result);
+    } else {
+      VLOG(1) << "error adding chain: " << statuses[i];
+      json_result.Add("error_message", statuses[i].error_message());
+      json_result.AddBoolean("success", false);
+    }
+    json_results.Add(&json_result);
+  }
+
+  JsonObject json_reply;
+  json_reply.Add("results", json_results);
+  SendJsonReply(event_base_, req, HTTP_OK, json_reply);
 }
 
 
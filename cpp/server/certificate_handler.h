@@ -1,6 +1,11 @@
 #ifndef CERT_TRANS_SERVER_CERTIFICATE_HANDLER_H_
 #define CERT_TRANS_SERVER_CERTIFICATE_HANDLER_H_
 
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+
 #include "log/cert_submission_handler.h"
 #include "log/database.h"
 #include "log/logged_entry.h"
@@ -15,12 +20,13 @@ class CertificateHttpHandler : public HttpHandler {
   // Does not take ownership of its parameters, which must outlive
   // this instance. The |frontend| and |cert_checker| parameters can be NULL,
   // in which case this server will not accept "add-chain" and "add-pre-chain"
-  // requests.
+  // requests. See HttpHandler for |read_pool|.
   CertificateHttpHandler(LogLookup* log_lookup, const ReadOnlyDatabase* db,
                          const ClusterStateController* controller,
                          const CertChecker* cert_checker, Frontend* frontend,
                          ThreadPool* pool, libevent::Base* event_base,
-                         StalenessTracker* staleness_tracker);
+                         StalenessTracker* staleness_tracker,
+                         ThreadPool* read_pool = nullptr);
 
   ~CertificateHttpHandler() = default;
   CertificateHttpHandler(const CertificateHttpHandler&) = delete;
@@ -33,15 +39,47 @@ class CertificateHttpHandler : public HttpHandler {
   const CertChecker* const cert_checker_;
   const std::unique_ptr<CertSubmissionHandler> submission_handler_;
   Frontend* const frontend_;
+  // The add-chain and add-pre-chain requests handed to |pool_| and not
+  // yet answered.
+  mutable std::atomic<int64_t> pending_adds_;
+  // The trusted certificates do not change, so the get-roots reply is
+  // made once, with the digest of its body as ETag, or is null if they
+  // could not be encoded.
+  mutable std::once_flag roots_reply_once_;
+  mutable std::shared_ptr<const ServingCache::Reply> roots_reply_;
 
   void GetRoots(evhttp_request* req) const;
+  void PrepareRootsReply() const;
+  // These only check the method of |req| on the event thread: the
+  // chain is extracted from the body, parsed and checked in |pool_|.
   void AddChain(evhttp_request* req);
   void AddPreChain(evhttp_request* req);
+  // As above, but for several chains at once: the request has a
+  // "chains" array of objects as add-chain (or add-pre-chain) takes,
+  // and the reply a "results" array of what add-chain would have
+  // replied for each. The chains are checked in parallel.
+  void AddChains(evhttp_request* req);
+  void AddPreChains(evhttp_request* req);
+  // Hands |blocking_add| to |pool_|, unless there are too many
+  // requests pending, in which case it replies to |req| itself.
+  void StartAdd(evhttp_request* req,
+                const std::function<void()>& blocking_add);
+
+  // With --route_add_chain_to_owner, proxies |req| to the node which
+  // owns its chain, and returns true, unless that is this node (see
+  // ChainOwner() in the .cc). Runs in |pool_|, as it reads the cluster
+  // state.
+  bool ForwardToOwner(evhttp_request* req) const;
 
-  void BlockingAddChain(evhttp_request* req,
-                        const std::shared_ptr<CertChain>& chain) const;
-  void BlockingAddPreChain(evhttp_request* req,
-                           const std::shared_ptr<PreCertChain>& chain) const;
+  void BlockingAddChain(evhttp_request* req) const;
+  void BlockingAddPreChain(evhttp_request* req) const;
+  // Adds the processed |entry| to the log and replies to |req|, either
+  // on this thread or, with --async_add_chain, once the consistent
+  // store is done with it.
+  void QueueEntry(evhttp_request* req, const util::Status& pre_status,
+                  const ct::LogEntry& entry) const;
+  void BlockingAddChains(evhttp_request* req, bool precert) const;
+  void BlockingAddChainsInternal(evhttp_request* req, bool precert) const;
 };
 
 
@@ -0,0 +1,673 @@
+// A benchmark of a whole log cluster in one process: it starts
+// --cluster_bench_nodes nodes, each with the stack of a ct-server (the
+// Server with its LogLookup, ClusterStateController and
+// ContinuousFetcher, a Frontend, a TreeSigner and the sequencing,
+// signing and cleanup threads), in front of a FakeEtcdClient, submits
+// --cluster_bench_entries synthetic entries spread over the nodes,
+// sends get-sth and get-entries requests to them meanwhile, and waits
+// until all the entries are served by all the nodes. It then reports:
+//
+//   sct_latency_ms        The time taken to return each SCT.
+//   inclusion_ms          From the SCT of each entry to the first
+//                         serving STH including it.
+//   replication_lag_ms    From each tree size reached by the database
+//                         of the master (node 0, which bootstraps the
+//                         cluster) to that size being reached by each
+//                         of the other nodes.
+//   get_*_latency_ms      The latency of the get-* requests.
+//   cpu_seconds           The CPU time used by the threads of each
+//                         component of each node, e.g. "n0-internal"
+//                         for the internal pool of node 0, or
+//                         "n1-sequencer". Threads not started by a
+//                         component are counted under the node which
+//                         started them (e.g. "n0" for its event loops).
+//
+// The entries are queued to the Frontends directly, with a made up
+// certificate: there is no chain to check. The get-* requests go
+// over HTTP, to the ports from --cluster_bench_base_port, as do the
+// fetches between the nodes.
+//
+// The production defaults of the sequencing and signing periods are
+// made for a steady flow of entries over hours. For a short run, use
+// e.g.:
+//
+//   cluster_bench --sequencing_frequency_seconds=1
+//       --tree_signing_frequency_seconds=1 --node_state_refresh_seconds=1
+//
+// --cluster_bench_etcd_latency_ms and --cluster_bench_etcd_max_qps
+// make the fake etcd as slow as a real one (see
+// FakeEtcdClient::SetSimulatedLimits()).
+//
+// The nodes keep running until the process exits, as in ct-server, so
+// it exits as soon as the report is written.
+#include <dirent.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "log/cluster_state_controller.h"
+#include "log/frontend.h"
+#include "log/frontend_signer.h"
+#include "log/leveldb_db.h"
+#include "log/log_lookup.h"
+#include "log/log_signer.h"
+#include "log/log_verifier.h"
+#include "log/logged_entry.h"
+#include "log/tree_signer.h"
+#include "merkletree/merkle_verifier.h"
+#include "merkletree/serial_hasher.h"
+#include "net/url.h"
+#include "net/url_fetcher.h"
+#include "proto/cert_serializer.h"
+#include "server/certificate_handler.h"
+#include "server/log_processes.h"
+#include "server/server.h"
+#include "util/etcd.h"
+#include "util/fake_etcd.h"
+#include "util/init.h"
+#include "util/libevent_wrapper.h"
+#include "util/read_key.h"
+#include "util/status.h"
+#include "util/sync_task.h"
+#include "util/thread_pool.h"
+
+DEFINE_int32(cluster_bench_nodes, 3, "Number of nodes of the cluster.");
+DEFINE_int32(cluster_bench_base_port, 28080,
+             "HTTP port of the first node, the others using the next "
+             "ports.");
+DEFINE_string(cluster_bench_dir, "",
+              "Directory the databases of the nodes are created in, which "
+              "must not hold those of a previous run. A new temporary "
+              "directory if empty.");
+DEFINE_string(cluster_bench_key, "test/testdata/ct-server-key.pem",
+              "PEM-encoded private key of the log.");
+DEFINE_int32(cluster_bench_pool_threads, 4,
+             "Number of threads of each of the thread pools of each node.");
+DEFINE_int32(cluster_bench_entries, 10000, "Number of entries to submit.");
+DEFINE_int32(cluster_bench_entry_bytes, 1000,
+             "Size of the certificate of each submitted entry.");
+DEFINE_int32(cluster_bench_submit_threads, 16,
+             "Number of threads submitting entries, each waiting for an "
+             "SCT before submitting the next one.");
+DEFINE_int32(cluster_bench_get_threads, 4,
+             "Number of threads sending get-sth and get-entries requests "
+             "to the nodes until all the entries are served, each waiting "
+             "for the reply before sending the next one. 0 for none.");
+DEFINE_double(cluster_bench_guard_window_seconds, 0,
+              "Entries newer than this are not sequenced yet, as "
+              "--guard_window_seconds of ct-server.");
+DEFINE_double(cluster_bench_minimum_serving_fraction, 0.5,
+              "Fraction of the nodes which must have a tree head for it "
+              "to be served.");
+DEFINE_int32(cluster_bench_etcd_latency_ms, 0,
+             "Simulated latency of each etcd operation.");
+DEFINE_double(cluster_bench_etcd_max_qps, 0,
+              "Simulated maximum rate of etcd operations, 0 for no limit.");
+DEFINE_int32(cluster_bench_timeout_seconds, 600,
+             "How long to wait for all the entries to be served by all "
+             "the nodes, after which the report covers those which are.");
+
+DECLARE_string(etcd_root);
+
+namespace libevent = cert_trans::libevent;
+
+using cert_trans::CertificateHttpHandler;
+using cert_trans::CleanUpEntries;
+using cert_trans::Database;
+using cert_trans::EtcdClient;
+using cert_trans::FakeEtcdClient;
+using cert_trans::LevelDB;
+using cert_trans::LoggedEntry;
+using cert_trans::ReadPrivateKey;
+using cert_trans::SequenceEntries;
+using cert_trans::Server;
+using cert_trans::SignMerkleTree;
+using cert_trans::ThreadPool;
+using cert_trans::TreeSigner;
+using cert_trans::UrlFetcher;
+using std::atomic;
+using std::bind;
+using std::chrono::duration;
+using std::chrono::milliseconds;
+using std::chrono::seconds;
+using std::chrono::steady_clock;
+using std::function;
+using std::lock_guard;
+using std::make_pair;
+using std::make_shared;
+using std::map;
+using std::mutex;
+using std::pair;
+using std::shared_ptr;
+using std::string;
+using std::thread;
+using std::to_string;
+using std::unique_ptr;
+using std::vector;
+using util::SyncTask;
+
+namespace {
+
+
+// How often the tree sizes of the nodes are sampled.
+const milliseconds kPollPeriod(5);
+
+// The number of entries asked for by each get-entries request.
+const int64_t kGetEntriesBatch(32);
+
+
+// Names the calling thread, and the threads it starts from then on,
+// for the CPU usage report. Linux limits thread names to 15 characters.
+void SetThreadName(const string& name) {
+  pthread_setname_np(pthread_self(), name.substr(0, 15).c_str());
+}
+
+
+thread NamedThread(const string& name, const function<void()>& body) {
+  return thread([name, body]() {
+    SetThreadName(name);
+    body();
+  });
+}
+
+
+// The sizes reached by a tree over time, as sampled.
+class Timeline {
+ public:
+  void Record(const steady_clock::time_point& when, int64_t size) {
+    if (samples_.empty() || size > samples_.back().second) {
+      samples_.emplace_back(when, size);
+    }
+  }
+
+  // Returns when |size| was first reached, or time_point::max() if it
+  // never was.
+  steady_clock::time_point Reached(int64_t size) const {
+    const auto it(std::lower_bound(
+        samples_.begin(), samples_.end(), size,
+        [](const pair<steady_clock::time_point, int64_t>& sample,
+           int64_t size) { return sample.second < size; }));
+    return it == samples_.end() ? steady_clock::time_point::max()
+                                : it->first;
+  }
+
+  int64_t size() const {
+    return samples_.empty() ? 0 : samples_.back().second;
+  }
+
+  const vector<pair<steady_clock::time_point, int64_t>>& samples() const {
+    return samples_;
+  }
+
+ private:
+  vector<pair<steady_clock::time_point, int64_t>> samples_;
+};
+
+
+double Milliseconds(const steady_clock::duration& elapsed) {
+  return duration<double, std::milli>(elapsed).count();
+}
+
+
+void ReportLatencies(const string& name, vector<double>* latencies_ms) {
+  std::cout << name << ": count=" << latencies_ms->size();
+  if (!latencies_ms->empty()) {
+    std::sort(latencies_ms->begin(), latencies_ms->end());
+    for (const double percentile : {0.5, 0.99, 0.999}) {
+      const size_t index(std::min(
+          latencies_ms->size() - 1,
+          static_cast<size_t>(percentile * latencies_ms->size())));
+      std::cout << " p" << percentile * 100 << "=" << (*latencies_ms)[index];
+    }
+    std::cout << " max=" << latencies_ms->back();
+  }
+  std::cout << std::endl;
+}
+
+
+// Returns the name and CPU time in seconds of each thread of this
+// process, by thread ID.
+map<string, pair<string, double>> ThreadCpuSeconds() {
+  map<string, pair<string, double>> cpu;
+  const double ticks_per_second(sysconf(_SC_CLK_TCK));
+  DIR* const dir(opendir("/proc/self/task"));
+  PCHECK(dir) << "Cannot list the threads";
+  while (const dirent* const tid = readdir(dir)) {
+    if (tid->d_name[0] == '.') {
+      continue;
+    }
+    std::ifstream stat_file(string("/proc/self/task/") + tid->d_name +
+                            "/stat");
+    string stat;
+    if (!std::getline(stat_file, stat)) {
+      // The thread has exited meanwhile.
+      continue;
+    }
+    // "<tid> (<name>) <state> ...", where the name can have spaces
+    // and parentheses, and the user and system times are the 14th and
+    // 15th fields.
+    const size_t name_start(stat.find('(') + 1);
+    const size_t name_end(stat.rfind(')'));
+    std::istringstream fields(stat.substr(name_end + 1));
+    string field;
+    for (int i = 3; i < 14; ++i) {
+      fields >> field;
+    }
+    int64_t user_ticks(0), system_ticks(0);
+    fields >> user_ticks >> system_ticks;
+    cpu[tid->d_name] =
+        make_pair(stat.substr(name_start, name_end - name_start),
+                  (user_ticks + system_ticks) / ticks_per_second);
+  }
+  closedir(dir);
+  return cpu;
+}
+
+
+struct Node {
+  Node(int index, EtcdClient* etcd_client, UrlFetcher* url_fetcher,
+       LogSigner* log_signer, const LogVerifier* log_verifier);
+
+  static Server::Options ServerOptions(int port);
+
+  // Sets up the cluster from its first node, as ct-server does in
+  // stand-alone mode.
+  void Bootstrap(EtcdClient* etcd_client, libevent::Base* event_base);
+
+  // Starts the processes of the node, and its event loop.
+  void Start();
+
+  const string name;
+  const int port;
+  const unique_ptr<Database> db;
+  const shared_ptr<libevent::Base> event_base;
+  ThreadPool internal_pool;
+  ThreadPool io_pool;
+  ThreadPool serve_pool;
+  Server server;
+  unique_ptr<Frontend> frontend;
+  unique_ptr<CertificateHttpHandler> handler;
+  unique_ptr<TreeSigner> tree_signer;
+  vector<thread> threads;
+};
+
+
+Node::Node(int index, EtcdClient* etcd_client, UrlFetcher* url_fetcher,
+           LogSigner* log_signer, const LogVerifier* log_verifier)
+    : name("n" + to_string(index)),
+      port(FLAGS_cluster_bench_base_port + index),
+      db(new LevelDB(FLAGS_cluster_bench_dir + "/" + name)),
+      event_base(make_shared<libevent::Base>()),
+      internal_pool(name + "-internal", FLAGS_cluster_bench_pool_threads,
+                    vector<int>()),
+      io_pool(name + "-io", FLAGS_cluster_bench_pool_threads, vector<int>()),
+      serve_pool(name + "-serve", FLAGS_cluster_bench_pool_threads,
+                 vector<int>()),
+      server(event_base, &internal_pool, &serve_pool, db.get(), etcd_client,
+             url_fetcher, log_verifier, ServerOptions(port)) {
+  server.Initialise(false /* is_mirror */);
+
+  frontend.reset(new Frontend(
+      new FrontendSigner(db.get(), server.consistent_store(), log_signer)));
+  // The entries are queued to |frontend| directly.
+  handler.reset(new CertificateHttpHandler(
+      server.log_lookup(), db.get(), server.cluster_state_controller(),
+      nullptr /* checker */, nullptr /* Frontend */, &io_pool,
+      event_base.get(), nullptr /* staleness_tracker */, &io_pool));
+  handler->SetProxy(server.proxy());
+  handler->Add(server.http_server());
+
+  tree_signer.reset(new TreeSigner(
+      duration<double>(FLAGS_cluster_bench_guard_window_seconds), db.get(),
+      server.log_lookup()->GetCompactMerkleTree(new Sha256Hasher),
+      server.consistent_store(), log_signer, nullptr /* node_file */,
+      &internal_pool));
+}
+
+
+// static
+Server::Options Node::ServerOptions(int port) {
+  Server::Options options;
+  options.server = "localhost";
+  options.port = port;
+  options.merkle_node_file.clear();
+  options.hot_restart_socket.clear();
+  // The nodes share the FakeEtcdClient, which holds the cluster state.
+  options.local_consistent_store = false;
+  return options;
+}
+
+
+void Node::Bootstrap(EtcdClient* etcd_client, libevent::Base* event_base) {
+  ct::ClusterConfig config;
+  config.set_minimum_serving_nodes(1);
+  config.set_minimum_serving_fraction(
+      FLAGS_cluster_bench_minimum_serving_fraction);
+  CHECK_EQ(::util::OkStatus(),
+           server.consistent_store()->SetClusterConfig(config));
+
+  // The election was started by |server|, before there were others.
+  CHECK(server.election()->WaitToBecomeMaster());
+
+  {
+    EtcdClient::Response resp;
+    SyncTask task(event_base);
+    etcd_client->Create(FLAGS_etcd_root + "/sequence_mapping", "", &resp,
+                        task.task());
+    task.Wait();
+    CHECK_EQ(::util::OkStatus(), task.status());
+  }
+
+  CHECK_EQ(TreeSigner::OK, tree_signer->UpdateTree());
+  CHECK_EQ(::util::OkStatus(), server.consistent_store()->SetServingSTH(
+                                   tree_signer->LatestSTH()));
+}
+
+
+void Node::Start() {
+  server.WaitForReplication();
+
+  const function<bool()> is_master(bind(&Server::IsMaster, &server));
+  threads.emplace_back(
+      NamedThread(name + "-sequencer",
+                  bind(&SequenceEntries, tree_signer.get(), is_master)));
+  threads.emplace_back(
+      NamedThread(name + "-cleanup", bind(&CleanUpEntries,
+                                          server.consistent_store(),
+                                          is_master)));
+  threads.emplace_back(NamedThread(
+      name + "-signer",
+      bind(&SignMerkleTree, tree_signer.get(), server.consistent_store(),
+           server.cluster_state_controller())));
+  threads.emplace_back(NamedThread(name, bind(&Server::Run, &server)));
+}
+
+
+struct Submission {
+  string hash;
+  steady_clock::time_point sct_time;
+  double latency_ms;
+};
+
+
+// Submits the entries from |*next|, round robin over the nodes, until
+// all are.
+void Submit(const vector<unique_ptr<Node>>* nodes, atomic<int64_t>* next,
+            vector<Submission>* submissions) {
+  while (true) {
+    const int64_t id((*next)++);
+    if (id >= static_cast<int64_t>(submissions->size())) {
+      return;
+    }
+
+    LoggedEntry entry;
+    entry.mutable_entry()->set_type(ct::X509_ENTRY);
+    string certificate(to_string(id) + ":");
+    certificate.resize(
+        std::max<size_t>(certificate.size(), FLAGS_cluster_bench_entry_bytes),
+        'x');
+    entry.mutable_entry()->mutable_x509_entry()->set_leaf_certificate(
+        certificate);
+
+    Submission* const submission(&(*submissions)[id]);
+    submission->hash = entry.Hash();
+    ct::SignedCertificateTimestamp sct;
+    const steady_clock::time_point start(steady_clock::now());
+    const util::Status status(
+        (*nodes)[id % nodes->size()]->frontend->QueueProcessedEntry(
+            ::util::OkStatus(), entry.entry(), &sct));
+    CHECK_EQ(::util::OkStatus(), status) << "Submitting entry " << id;
+    submission->sct_time = steady_clock::now();
+    submission->latency_ms = Milliseconds(submission->sct_time - start);
+  }
+}
+
+
+struct GetLatencies {
+  mutex lock;
+  vector<double> sth_ms;
+  vector<double> entries_ms;
+  int64_t errors = 0;
+};
+
+
+// Sends get-sth and get-entries requests, in turn, to a random node,
+// until |*done|. The get-entries requests are for random entries
+// under |*served_size|.
+void Get(const vector<unique_ptr<Node>>* nodes, UrlFetcher* fetcher,
+         libevent::Base* event_base, const atomic<int64_t>* served_size,
+         const atomic<bool>* done, GetLatencies* latencies) {
+  std::mt19937_64 random(std::random_device{}());
+  vector<double> sth_ms;
+  vector<double> entries_ms;
+  int64_t errors(0);
+
+  for (bool get_sth = true; !*done; get_sth = !get_sth) {
+    const Node& node(*(*nodes)[random() % nodes->size()]);
+    string path("/ct/v1/get-sth");
+    const int64_t size(*served_size);
+    if (!get_sth && size > 0) {
+      const int64_t start(random() % size);
+      path = "/ct/v1/get-entries?start=" + to_string(start) + "&end=" +
+             to_string(std::min(size, start + kGetEntriesBatch) - 1);
+    }
+
+    UrlFetcher::Response resp;
+    SyncTask task(event_base);
+    const steady_clock::time_point begin(steady_clock::now());
+    fetcher->Fetch(UrlFetcher::Request(cert_trans::URL(
+                       "http://localhost:" + to_string(node.port) + path)),
+                   &resp, task.task());
+    task.Wait();
+    if (!task.status().ok() || resp.status_code != 200) {
+      ++errors;
+      continue;
+    }
+    (get_sth ? sth_ms : entries_ms)
+        .push_back(Milliseconds(steady_clock::now() - begin));
+  }
+
+  lock_guard<mutex> lock(latencies->lock);
+  latencies->sth_ms.insert(latencies->sth_ms.end(), sth_ms.begin(),
+                           sth_ms.end());
+  latencies->entries_ms.insert(latencies->entries_ms.end(),
+                               entries_ms.begin(), entries_ms.end());
+  latencies->errors += errors;
+}
+
+
+}  // namespace
+
+
+int main(int argc, char* argv[]) {
+  ConfigureSerializerForV1CT();
+  util::InitCT(&argc, &argv);
+  Server::StaticInit();
+
+  CHECK_GT(FLAGS_cluster_bench_nodes, 0);
+  CHECK_GT(FLAGS_cluster_bench_pool_threads, 0);
+  CHECK_GT(FLAGS_cluster_bench_entries, 0);
+  CHECK_GT(FLAGS_cluster_bench_submit_threads, 0);
+  CHECK_GE(FLAGS_cluster_bench_get_threads, 0);
+
+  if (FLAGS_cluster_bench_dir.empty()) {
+    char dir[] = "/tmp/cluster_bench.XXXXXX";
+    PCHECK(mkdtemp(dir)) << "Cannot create a temporary directory";
+    FLAGS_cluster_bench_dir = dir;
+  }
+  LOG(INFO) << "Creating the databases under " << FLAGS_cluster_bench_dir;
+
+  util::StatusOr<EVP_PKEY*> pkey(ReadPrivateKey(FLAGS_cluster_bench_key));
+  CHECK_EQ(pkey.status(), ::util::OkStatus());
+  LogSigner log_signer(pkey.ValueOrDie());
+  const LogVerifier log_verifier(new LogSigVerifier(pkey.ValueOrDie()),
+                                 new MerkleVerifier(unique_ptr<Sha256Hasher>(
+                                     new Sha256Hasher)));
+
+  // Shared by the nodes, and the get-* requests.
+  SetThreadName("etcd");
+  const shared_ptr<libevent::Base> event_base(make_shared<libevent::Base>());
+  const libevent::EventPumpThread pump(event_base);
+  ThreadPool fetcher_pool("fetcher", FLAGS_cluster_bench_pool_threads,
+                          vector<int>());
+  UrlFetcher url_fetcher(event_base.get(), &fetcher_pool);
+  FakeEtcdClient etcd_client(event_base.get());
+  etcd_client.SetSimulatedLimits(
+      milliseconds(FLAGS_cluster_bench_etcd_latency_ms),
+      FLAGS_cluster_bench_etcd_max_qps);
+
+  vector<unique_ptr<Node>> nodes;
+  for (int i = 0; i < FLAGS_cluster_bench_nodes; ++i) {
+    SetThreadName("n" + to_string(i));
+    nodes.emplace_back(new Node(i, &etcd_client, &url_fetcher, &log_signer,
+                                &log_verifier));
+    if (i == 0) {
+      nodes.front()->Bootstrap(&etcd_client, event_base.get());
+    }
+  }
+  for (const unique_ptr<Node>& node : nodes) {
+    SetThreadName(node->name);
+    node->Start();
+  }
+  SetThreadName("main");
+  LOG(INFO) << "Started " << nodes.size() << " nodes.";
+
+  const map<string, pair<string, double>> start_cpu(ThreadCpuSeconds());
+  const steady_clock::time_point start(steady_clock::now());
+
+  vector<Submission> submissions(FLAGS_cluster_bench_entries);
+  atomic<int64_t> next_submission(0);
+  vector<thread> submitters;
+  for (int i = 0; i < FLAGS_cluster_bench_submit_threads; ++i) {
+    submitters.emplace_back(NamedThread(
+        "submit", bind(&Submit, &nodes, &next_submission, &submissions)));
+  }
+
+  atomic<int64_t> served_size(0);
+  atomic<bool> done(false);
+  GetLatencies get_latencies;
+  vector<thread> getters;
+  for (int i = 0; i < FLAGS_cluster_bench_get_threads; ++i) {
+    getters.emplace_back(NamedThread(
+        "get", bind(&Get, &nodes, &url_fetcher, event_base.get(),
+                    &served_size, &done, &get_latencies)));
+  }
+
+  // Sample the tree sizes until all the entries are served by all the
+  // nodes. The bootstrap tree head is empty.
+  const int64_t total(FLAGS_cluster_bench_entries);
+  const steady_clock::time_point deadline(
+      start + seconds(FLAGS_cluster_bench_timeout_seconds));
+  Timeline serving;
+  vector<Timeline> trees(nodes.size());
+  while (true) {
+    const steady_clock::time_point now(steady_clock::now());
+    const util::StatusOr<ct::SignedTreeHead> serving_sth(
+        nodes.front()->server.consistent_store()->GetServingSTH());
+    if (serving_sth.ok()) {
+      serving.Record(now, serving_sth.ValueOrDie().tree_size());
+      served_size = serving.size();
+    }
+    bool all_served(serving.size() >= total);
+    for (size_t i = 0; i < nodes.size(); ++i) {
+      trees[i].Record(now, nodes[i]->db->TreeSize());
+      all_served = all_served && trees[i].size() >= total;
+    }
+    if (all_served) {
+      break;
+    }
+    if (now > deadline) {
+      LOG(WARNING) << "Timed out with " << serving.size() << " of " << total
+                   << " entries served.";
+      break;
+    }
+    std::this_thread::sleep_for(kPollPeriod);
+  }
+  const steady_clock::time_point end(steady_clock::now());
+  const map<string, pair<string, double>> end_cpu(ThreadCpuSeconds());
+
+  done = true;
+  for (thread& getter : getters) {
+    getter.join();
+  }
+  // They are done if the entries were served.
+  for (thread& submitter : submitters) {
+    submitter.join();
+  }
+
+  std::cout << "nodes: " << nodes.size() << "\nentries: " << total
+            << "\nelapsed_seconds: "
+            << duration<double>(end - start).count()
+            << "\nentries_per_second: "
+            << serving.size() / duration<double>(end - start).count()
+            << std::endl;
+
+  vector<double> sct_ms;
+  vector<double> inclusion_ms;
+  for (const Submission& submission : submissions) {
+    sct_ms.push_back(submission.latency_ms);
+    LoggedEntry logged;
+    if (nodes.front()->db->LookupByHash(submission.hash, &logged) !=
+        Database::LOOKUP_OK) {
+      continue;
+    }
+    const steady_clock::time_point included(
+        serving.Reached(logged.sequence_number() + 1));
+    if (included != steady_clock::time_point::max()) {
+      inclusion_ms.push_back(Milliseconds(included - submission.sct_time));
+    }
+  }
+  ReportLatencies("sct_latency_ms", &sct_ms);
+  ReportLatencies("inclusion_ms", &inclusion_ms);
+
+  vector<double> replication_ms;
+  for (const pair<steady_clock::time_point, int64_t>& sample :
+       trees.front().samples()) {
+    for (size_t i = 1; i < trees.size(); ++i) {
+      const steady_clock::time_point reached(trees[i].Reached(sample.second));
+      if (reached != steady_clock::time_point::max()) {
+        replication_ms.push_back(
+            Milliseconds(std::max(reached, sample.first) - sample.first));
+      }
+    }
+  }
+  ReportLatencies("replication_lag_ms", &replication_ms);
+
+  ReportLatencies("get_sth_latency_ms", &get_latencies.sth_ms);
+  ReportLatencies("get_entries_latency_ms", &get_latencies.entries_ms);
+  std::cout << "get_errors: " << get_latencies.errors << std::endl;
+
+  map<string, double> cpu_seconds;
+  for (const auto& thread_cpu : end_cpu) {
+    const auto it(start_cpu.find(thread_cpu.first));
+    cpu_seconds[thread_cpu.second.first] +=
+        thread_cpu.second.second -
+        (it == start_cpu.end() ? 0 : it->second.second);
+  }
+  for (const pair<const string, double>& component : cpu_seconds) {
+    std::cout << "cpu_seconds{thread=\"" << component.first
+              << "\"}: " << component.second << "\n";
+  }
+  std::cout.flush();
+
+  // The node threads never return, see the top of this file.
+  _exit(0);
+}
@@ -1,9 +1,19 @@
 #include <gflags/gflags.h>
 #include <ldns/ldns.h>
+#include <algorithm>
+#include <atomic>
 #include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
+#include "log/caching_database.h"
+#include "log/leveldb_db.h"
 #include "log/log_lookup.h"
 #include "log/logged_entry.h"
 #include "log/sqlite_db.h"
@@ -13,17 +23,48 @@
 #include "util/init.h"
 #include "util/util.h"
 
+using cert_trans::CachingDatabase;
+using cert_trans::LevelDB;
 using cert_trans::LogLookup;
 using cert_trans::LoggedEntry;
+using cert_trans::ReadOnlyDatabase;
 using cert_trans::SQLiteDB;
 using ct::SignedTreeHead;
 using google::RegisterFlagValidator;
+using std::atomic;
+using std::list;
+using std::lock_guard;
+using std::mutex;
 using std::string;
 using std::stringstream;
+using std::thread;
+using std::unique_ptr;
+using std::unordered_map;
+using std::vector;
 
 DEFINE_int32(port, 0, "Server port");
 DEFINE_string(domain, "", "Domain");
 DEFINE_string(db, "", "Database for certificate and tree storage");
+DEFINE_string(leveldb_db, "",
+              "LevelDB database to serve from, instead of the SQLite --db. "
+              "LevelDB only lets one process open it, so this must be a "
+              "database no server is writing to, such as one kept by the "
+              "'ct monitor' command while it is not running.");
+DEFINE_int32(threads, 1,
+             "Number of threads answering queries. Each has its own socket "
+             "bound to --port with SO_REUSEPORT, and the kernel spreads the "
+             "queries between them.");
+DEFINE_int32(answer_cache_size, 100000,
+             "Number of answers kept in memory, by question. Only answers "
+             "which cannot change are cached, not the STH or failed "
+             "lookups. 0 disables the cache.");
+DEFINE_int32(entry_cache_size, 10000,
+             "Number of log entries kept in memory, by index and by hash, "
+             "for the questions about recently used entries which are not "
+             "in the answer cache. 0 disables the cache.");
+DEFINE_int32(sth_refresh_ms, 1000,
+             "Minimum time between checks of the SQLite database for a new "
+             "STH, when answering queries which need the latest one.");
 
 // Basic sanity checks on flag values.
 static bool ValidatePort(const char*, int32_t port) {
@@ -40,111 +81,119 @@ static bool NonEmptyString(const char*, const string& str) {
 static const bool domain_dummy =
     RegisterFlagValidator(&FLAGS_domain, &NonEmptyString);
 
-class CTUDPDNSServer : public UDPServer {
- public:
-  CTUDPDNSServer(const string& domain, SQLiteDB* db, EventLoop* loop, int fd)
-      : UDPServer(loop, fd), domain_(domain), lookup_(db), db_(db) {
-  }
+namespace {
 
-  virtual void PacketRead(const sockaddr_in& from, const char* buf,
-                          size_t len) {
-    ldns_pkt* packet = NULL;
 
-    ldns_status ret = ldns_wire2pkt(&packet, (const uint8_t*)buf, len);
-    if (ret != LDNS_STATUS_OK) {
-      LOG(INFO) << "Bad DNS packet";
-      return;
-    }
+// Number of separately locked parts of the AnswerCache, so that the
+// threads rarely wait on each other.
+const size_t kNumCacheShards = 16;
 
-    // ldns_pkt_print(stdout, packet);
 
-    if (ldns_pkt_qr(packet) != 0) {
-      LOG(INFO) << "Packet is not a query";
-      return;
+// The answers to recent questions. Entries are never invalidated, the
+// least recently used are dropped to make room.
+//
+// This class is thread-safe.
+class AnswerCache {
+ public:
+  explicit AnswerCache(size_t max_entries)
+      : max_entries_per_shard_((max_entries + kNumCacheShards - 1) /
+                               kNumCacheShards),
+        shards_(new Shard[kNumCacheShards]) {
+  }
+  AnswerCache(const AnswerCache&) = delete;
+  AnswerCache& operator=(const AnswerCache&) = delete;
+
+  bool Lookup(const string& question, string* answer) {
+    Shard* const shard(ShardFor(question));
+    lock_guard<mutex> lock(shard->lock);
+    const auto it(shard->answers.find(question));
+    if (it == shard->answers.end()) {
+      return false;
     }
+    shard->lru.splice(shard->lru.begin(), shard->lru, it->second.lru_position);
+    *answer = it->second.answer;
+    return true;
+  }
 
-    if (ldns_pkt_get_opcode(packet) != LDNS_PACKET_QUERY) {
-      LOG(INFO) << "Packet has bad opcode";
+  void Insert(const string& question, const string& answer) {
+    if (max_entries_per_shard_ == 0) {
       return;
     }
+    Shard* const shard(ShardFor(question));
+    lock_guard<mutex> lock(shard->lock);
+    if (shard->answers.count(question) > 0) {
+      return;
+    }
+    if (shard->answers.size() >= max_entries_per_shard_) {
+      shard->answers.erase(shard->lru.back());
+      shard->lru.pop_back();
+    }
+    shard->lru.push_front(question);
+    CachedAnswer* const cached(&shard->answers[question]);
+    cached->answer = answer;
+    cached->lru_position = shard->lru.begin();
+  }
 
-    ldns_pkt* answers = ldns_pkt_new();
-    ldns_pkt_set_id(answers, ldns_pkt_id(packet));
-    ldns_pkt_set_qr(answers, true);
-
-    ldns_rr_list* questions = ldns_pkt_question(packet);
-
-    ldns_pkt_safe_push_rr_list(answers, LDNS_SECTION_QUESTION,
-                               ldns_rr_list_clone(questions));
-
-    for (size_t n = 0; n < ldns_rr_list_rr_count(questions); ++n) {
-      ldns_rr* question = ldns_rr_list_rr(questions, n);
-
-      if (ldns_rr_get_type(question) != LDNS_RR_TYPE_TXT) {
-        LOG(INFO) << "Question is not TXT";
-        // FIXME(benl): set error response?
-        continue;
-      }
-
-      ldns_rdf* owner = ldns_rr_owner(question);
-      if (ldns_rdf_get_type(owner) != LDNS_RDF_TYPE_DNAME) {
-        LOG(INFO) << "Owner is not a dname";
-        continue;
-      }
-
-      ldns_buffer* dname = ldns_buffer_new(512);
-      if (ldns_rdf2buffer_str_dname(dname, owner) != LDNS_STATUS_OK) {
-        LOG(INFO) << "Can't decode owner";
-        continue;
-      }
-
-      char* owner_name_raw = ldns_buffer2str(dname);
-      std::string owner_name(owner_name_raw);
-      free(owner_name_raw);
-      owner_name_raw = NULL;
-      ldns_buffer_free(dname);
-      dname = NULL;
+ private:
+  typedef list<string> LruList;
+
+  struct CachedAnswer {
+    string answer;
+    LruList::iterator lru_position;
+  };
+
+  struct Shard {
+    mutex lock;
+    unordered_map<string, CachedAnswer> answers;
+    // The keys of |answers|, most recently used first.
+    LruList lru;
+  };
+
+  Shard* ShardFor(const string& question) {
+    return &shards_[std::hash<string>()(question) % kNumCacheShards];
+  }
 
-      LOG(INFO) << "Question is TXT of " << owner_name;
+  const size_t max_entries_per_shard_;
+  const unique_ptr<Shard[]> shards_;
+};
 
-      if (owner_name.length() <= domain_.length() ||
-          owner_name.compare(owner_name.length() - domain_.length(),
-                             domain_.length(), domain_) != 0) {
-        LOG(INFO) << "Question is not for our domain";
-        continue;
-      }
 
-      std::string response = Response(
-          owner_name.substr(0, owner_name.length() - domain_.length() - 1));
+// Answers the questions (the query names without the domain), for all
+// the server threads.
+//
+// This class is thread-safe.
+class CTDNSResponder {
+ public:
+  // |sqlite_db| is |db| if it is an SQLiteDB, which is shared with a
+  // ct-server, and so must be checked for new STHs. Otherwise it is
+  // NULL, and |db| does not change.
+  CTDNSResponder(ReadOnlyDatabase* db, SQLiteDB* sqlite_db,
+                 size_t cache_size)
+      : db_(db),
+        sqlite_db_(sqlite_db),
+        lookup_(db),
+        cache_(cache_size),
+        last_sth_refresh_ms_(0) {
+  }
+  CTDNSResponder(const CTDNSResponder&) = delete;
+  CTDNSResponder& operator=(const CTDNSResponder&) = delete;
 
-      ldns_rr* answer = ldns_rr_new();
-      ldns_rr_set_owner(answer, ldns_rdf_new_frm_str(LDNS_RDF_TYPE_DNAME,
-                                                     owner_name.c_str()));
-      ldns_rr_set_type(answer, LDNS_RR_TYPE_TXT);
-      ldns_rr_set_ttl(answer, 123);
-      ldns_rr_push_rdf(answer, ldns_rdf_new_frm_str(LDNS_RDF_TYPE_STR,
-                                                    response.c_str()));
-      ldns_pkt_safe_push_rr(answers, LDNS_SECTION_ANSWER, answer);
+  string Response(const string& question) {
+    string answer;
+    if (cache_.Lookup(question, &answer)) {
+      return answer;
     }
-    ldns_pkt_free(packet);
-
-    char* answer_str = ldns_pkt2str(answers);
-    LOG(INFO) << "Answer is " << answer_str;
-    free(answer_str);
-
-    uint8_t* wire_answer;
-    size_t answer_size;
-    if (ldns_pkt2wire(&wire_answer, answers, &answer_size) != LDNS_STATUS_OK) {
-      LOG(ERROR) << "Can't make wire answer";
-      return;
+    bool cacheable(false);
+    answer = Respond(question, &cacheable);
+    if (cacheable) {
+      cache_.Insert(question, answer);
     }
-    QueuePacket(from, wire_answer, answer_size);
-    free(wire_answer);
-    ldns_pkt_free(answers);
+    return answer;
   }
 
  private:
-  string Response(string question) {
+  // Sets |*cacheable| if the answer will never change.
+  string Respond(const string& question, bool* cacheable) {
     if (question == "sth")
       return STH();
 
@@ -154,39 +203,56 @@ class CTUDPDNSServer : public UDPServer {
 
     string head = question.substr(0, dot);
     string tail = question.substr(dot + 1);
-    LOG(INFO) << "head = " << head << ", tail = " << tail;
+    VLOG(1) << "head = " << head << ", tail = " << tail;
     if (tail == "tree")
-      return Tree(head);
+      return Tree(head, cacheable);
     else if (tail == "hash")
-      return Hash(head);
+      return Hash(head, cacheable);
     else if (tail == "leafhash")
-      return LeafHash(head);
+      return LeafHash(head, cacheable);
 
     return question + " is the question.";
   }
 
-  string LeafHash(const string& index_str) const {
+  // Lets the LogLookup know of a new STH in the SQLite database, at
+  // most once per --sth_refresh_ms across all threads.
+  void MaybeRefreshSTH() {
+    if (!sqlite_db_) {
+      return;
+    }
+    const int64_t now(util::TimeInMilliseconds());
+    int64_t last(last_sth_refresh_ms_.load());
+    if (now - last < FLAGS_sth_refresh_ms ||
+        !last_sth_refresh_ms_.compare_exchange_strong(last, now)) {
+      return;
+    }
+    sqlite_db_->ForceNotifySTH();
+  }
+
+  string LeafHash(const string& index_str, bool* cacheable) const {
     int index = atoi(index_str.c_str());
     LoggedEntry cert;
     if (db_->LookupByIndex(index, &cert) != db_->LOOKUP_OK)
       return "No such index";
+    *cacheable = true;
     return util::ToBase64(lookup_.LeafHash(cert));
   }
 
-  string Hash(const string& hash) {
-    db_->ForceNotifySTH();
+  string Hash(const string& hash, bool* cacheable) {
+    MaybeRefreshSTH();
 
     // FIXME: decode hash!
     int64_t index;
     if (lookup_.GetIndex(hash, &index) != lookup_.OK)
       return "No such hash";
 
+    *cacheable = true;
     stringstream ss;
     ss << index;
     return ss.str();
   }
 
-  string Tree(const string& question) {
+  string Tree(const string& question, bool* cacheable) {
     size_t dot = question.find_first_of('.');
     if (dot == string::npos)
       return question + " not understood";
@@ -199,8 +265,8 @@ class CTUDPDNSServer : public UDPServer {
     string index = question.substr(dot + 1, dot2 - dot - 1);
     string size = question.substr(dot2 + 1);
 
-    LOG(INFO) << "level = " << level << ", index = " << index
-              << ", size = " << size;
+    VLOG(1) << "level = " << level << ", index = " << index
+            << ", size = " << size;
 
     ct::ShortMerkleAuditProof proof;
     if (lookup_.AuditProof(atoi(index.c_str()), atoi(size.c_str()), &proof) !=
@@ -211,14 +277,15 @@ class CTUDPDNSServer : public UDPServer {
     if (l < 0 || l >= proof.path_node_size())
       return "Level " + level + " is out of range";
 
+    *cacheable = true;
     string b64 = util::ToBase64(proof.path_node(l));
     return b64;
   }
 
   string STH() {
-    db_->ForceNotifySTH();
+    MaybeRefreshSTH();
 
-    const SignedTreeHead& sth = lookup_.GetSTH();
+    const SignedTreeHead sth(lookup_.GetSTH());
 
     std::string signature;
     CHECK_EQ(Serializer::SerializeDigitallySigned(sth.signature(), &signature),
@@ -232,14 +299,137 @@ class CTUDPDNSServer : public UDPServer {
     return ss.str();
   }
 
-  string domain_;
+  ReadOnlyDatabase* const db_;
+  SQLiteDB* const sqlite_db_;
   LogLookup lookup_;
-  SQLiteDB* const db_;
+  AnswerCache cache_;
+  atomic<int64_t> last_sth_refresh_ms_;
+};
+
+
+}  // namespace
+
+
+// Answers the queries received on one socket, on one thread.
+class CTUDPDNSServer : public UDPServer {
+ public:
+  CTUDPDNSServer(const string& domain, CTDNSResponder* responder,
+                 EventLoop* loop, int fd)
+      : UDPServer(loop, fd), domain_(domain), responder_(responder) {
+  }
+
+  virtual void PacketRead(const sockaddr_in& from, const char* buf,
+                          size_t len) {
+    ldns_pkt* packet = NULL;
+
+    ldns_status ret = ldns_wire2pkt(&packet, (const uint8_t*)buf, len);
+    if (ret != LDNS_STATUS_OK) {
+      VLOG(1) << "Bad DNS packet";
+      return;
+    }
+
+    // ldns_pkt_print(stdout, packet);
+
+    if (ldns_pkt_qr(packet) != 0) {
+      VLOG(1) << "Packet is not a query";
+      ldns_pkt_free(packet);
+      return;
+    }
+
+    if (ldns_pkt_get_opcode(packet) != LDNS_PACKET_QUERY) {
+      VLOG(1) << "Packet has bad opcode";
+      ldns_pkt_free(packet);
+      return;
+    }
+
+    ldns_pkt* answers = ldns_pkt_new();
+    ldns_pkt_set_id(answers, ldns_pkt_id(packet));
+    ldns_pkt_set_qr(answers, true);
+
+    ldns_rr_list* questions = ldns_pkt_question(packet);
+
+    ldns_pkt_safe_push_rr_list(answers, LDNS_SECTION_QUESTION,
+                               ldns_rr_list_clone(questions));
+
+    for (size_t n = 0; n < ldns_rr_list_rr_count(questions); ++n) {
+      ldns_rr* question = ldns_rr_list_rr(questions, n);
+
+      if (ldns_rr_get_type(question) != LDNS_RR_TYPE_TXT) {
+        VLOG(1) << "Question is not TXT";
+        // FIXME(benl): set error response?
+        continue;
+      }
+
+      ldns_rdf* owner = ldns_rr_owner(question);
+      if (ldns_rdf_get_type(owner) != LDNS_RDF_TYPE_DNAME) {
+        VLOG(1) << "Owner is not a dname";
+        continue;
+      }
+
+      ldns_buffer* dname = ldns_buffer_new(512);
+      if (ldns_rdf2buffer_str_dname(dname, owner) != LDNS_STATUS_OK) {
+        VLOG(1) << "Can't decode owner";
+        continue;
+      }
+
+      char* owner_name_raw = ldns_buffer2str(dname);
+      std::string owner_name(owner_name_raw);
+      free(owner_name_raw);
+      owner_name_raw = NULL;
+      ldns_buffer_free(dname);
+      dname = NULL;
+
+      VLOG(1) << "Question is TXT of " << owner_name;
+
+      if (owner_name.length() <= domain_.length() ||
+          owner_name.compare(owner_name.length() - domain_.length(),
+                             domain_.length(), domain_) != 0) {
+        VLOG(1) << "Question is not for our domain";
+        continue;
+      }
+
+      std::string response = responder_->Response(
+          owner_name.substr(0, owner_name.length() - domain_.length() - 1));
+
+      ldns_rr* answer = ldns_rr_new();
+      ldns_rr_set_owner(answer, ldns_rdf_new_frm_str(LDNS_RDF_TYPE_DNAME,
+                                                     owner_name.c_str()));
+      ldns_rr_set_type(answer, LDNS_RR_TYPE_TXT);
+      ldns_rr_set_ttl(answer, 123);
+      ldns_rr_push_rdf(answer, ldns_rdf_new_frm_str(LDNS_RDF_TYPE_STR,
+                                                    response.c_str()));
+      ldns_pkt_safe_push_rr(answers, LDNS_SECTION_ANSWER, answer);
+    }
+    ldns_pkt_free(packet);
+
+    if (VLOG_IS_ON(1)) {
+      char* answer_str = ldns_pkt2str(answers);
+      VLOG(1) << "Answer is " << answer_str;
+      free(answer_str);
+    }
+
+    uint8_t* wire_answer;
+    size_t answer_size;
+    if (ldns_pkt2wire(&wire_answer, answers, &answer_size) != LDNS_STATUS_OK) {
+      LOG(ERROR) << "Can't make wire answer";
+      ldns_pkt_free(answers);
+      return;
+    }
+    QueuePacket(from, wire_answer, answer_size);
+    free(wire_answer);
+    ldns_pkt_free(answers);
+  }
+
+ private:
+  string domain_;
+  CTDNSResponder* const responder_;
 };
 
+// Runs on the first of |loops|, and stops them all on 'q'.
 class Keyboard : public Server {
  public:
-  Keyboard(EventLoop* loop) : Server(loop, 0) {
+  Keyboard(const vector<EventLoop*>& loops)
+      : Server(loops.front(), 0), loops_(loops) {
   }
 
   void BytesRead(std::string* rbuffer) {
@@ -253,7 +443,9 @@ class Keyboard : public Server {
   void ProcessKey(char key) {
     switch (key) {
       case 'q':
-        loop()->Stop();
+        for (EventLoop* loop : loops_) {
+          loop->Stop();
+        }
         break;
 
       case '\n':
@@ -264,26 +456,59 @@ class Keyboard : public Server {
         break;
     }
   }
+
+  const vector<EventLoop*> loops_;
 };
 
 int main(int argc, char* argv[]) {
   util::InitCT(&argc, &argv);
   ConfigureSerializerForV1CT();
 
-  // TODO(pphaneuf): This current *has* to be SQLite, because it
-  // depends on sharing the database with a ct-server that will
-  // populate it (which FileDB does not support).
-  SQLiteDB db(FLAGS_db);
-
-  EventLoop loop;
+  // TODO(pphaneuf): The database has to be SQLite to follow a live
+  // log, because it depends on sharing the database with a ct-server
+  // that will populate it (which FileDB does not support). LevelDB can
+  // only serve a copy.
+  unique_ptr<ReadOnlyDatabase> db;
+  SQLiteDB* sqlite_db(nullptr);
+  if (!FLAGS_leveldb_db.empty()) {
+    CHECK(FLAGS_db.empty()) << "Only one of --db and --leveldb_db can be set";
+    db.reset(new LevelDB(FLAGS_leveldb_db));
+  } else {
+    sqlite_db = new SQLiteDB(FLAGS_db);
+    db.reset(sqlite_db);
+  }
+  CachingDatabase cached_db(db.get(), std::max(FLAGS_entry_cache_size, 0));
+  CTDNSResponder responder(&cached_db, sqlite_db,
+                           std::max(FLAGS_answer_cache_size, 0));
+
+  const int num_threads(std::max(FLAGS_threads, 1));
+  vector<unique_ptr<EventLoop>> loops;
+  vector<EventLoop*> loop_ptrs;
+  for (int i = 0; i < num_threads; ++i) {
+    loops.emplace_back(new EventLoop);
+    loop_ptrs.push_back(loops.back().get());
+  }
 
   // Mostly so we can have a clean exit for valgrind etc.
-  Keyboard keyboard(&loop);
-
-  int dns_fd;
-  CHECK(Services::InitServer(&dns_fd, FLAGS_port, NULL, SOCK_DGRAM));
-  CTUDPDNSServer dns(FLAGS_domain, &db, &loop, dns_fd);
+  Keyboard keyboard(loop_ptrs);
+
+  vector<unique_ptr<CTUDPDNSServer>> servers;
+  for (int i = 0; i < num_threads; ++i) {
+    int dns_fd;
+    CHECK(Services::InitServer(&dns_fd, FLAGS_port, NULL, SOCK_DGRAM,
+                               num_threads > 1));
+    servers.emplace_back(new CTUDPDNSServer(FLAGS_domain, &responder,
+                                            loops[i].get(), dns_fd));
+  }
 
-  LOG(INFO) << "Server listening on port " << FLAGS_port;
-  loop.Forever();
+  LOG(INFO) << "Server listening on port " << FLAGS_port << " with "
+            << num_threads << " threads";
+  vector<thread> threads;
+  for (int i = 1; i < num_threads; ++i) {
+    threads.emplace_back(&EventLoop::Forever, loops[i].get());
+  }
+  loops[0]->Forever();
+  for (thread& t : threads) {
+    t.join();
+  }
 }
@@ -7,13 +7,16 @@
 #include <openssl/err.h>
 #include <signal.h>
 #include <unistd.h>
+#include <algorithm>
 #include <chrono>
 #include <csignal>
 #include <cstring>
+#include <fstream>
 #include <functional>
 #include <iostream>
 #include <memory>
 #include <mutex>
+#include <sstream>
 #include <string>
 #include <utility>
 
@@ -26,6 +29,7 @@
 #include "log/ct_extensions.h"
 #include "log/database.h"
 #include "log/etcd_consistent_store.h"
+#include "log/leveldb_db.h"
 #include "log/log_lookup.h"
 #include "log/strict_consistent_store.h"
 #include "merkletree/compact_merkle_tree.h"
@@ -67,6 +71,15 @@ DEFINE_string(
     "PEM-encoded server public key file of the log we're mirroring.");
 DEFINE_int32(local_sth_update_frequency_seconds, 30,
              "Number of seconds between local checks for updated tree data.");
+DEFINE_string(mirror_config, "",
+              "File listing several logs to mirror in this process, one per "
+              "line: <target_log_uri> <target_public_key> <leveldb_db> "
+              "<port> <etcd_root>; lines starting with # are ignored. The "
+              "logs share the thread pools and connections. When set, "
+              "--target_log_uri, --target_public_key, the database flags, "
+              "--port and --etcd_root are not used.");
+DECLARE_string(leveldb_archive_dir);
+DECLARE_string(leveldb_snapshot_dir);
 
 namespace libevent = cert_trans::libevent;
 
@@ -82,6 +95,7 @@ using cert_trans::EtcdConsistentStore;
 using cert_trans::Gauge;
 using cert_trans::HttpHandler;
 using cert_trans::Latency;
+using cert_trans::LevelDB;
 using cert_trans::LogLookup;
 using cert_trans::LoggedEntry;
 using cert_trans::MasterElection;
@@ -116,6 +130,7 @@ using std::shared_ptr;
 using std::string;
 using std::thread;
 using std::unique_ptr;
+using std::vector;
 using util::HexString;
 using util::StatusOr;
 using util::SyncTask;
@@ -134,9 +149,17 @@ Counter<>* inconsistent_sths_received =
                    "Number of STHs received from the mirror target whose root "
                    "hash does not match the locally built tree.");
 
+// How many leaves to add to the tree at once when catching it up. The
+// tree hashes large batches on several threads.
+const size_t kLeafBatchSize = 1 << 16;
+
 
 // Basic sanity checks on flag values.
 static bool ValidateRead(const char* flagname, const string& path) {
+  // Only needed without --mirror_config, which main() checks.
+  if (path.empty()) {
+    return true;
+  }
   if (access(path.c_str(), R_OK) != 0) {
     std::cout << "Cannot access " << flagname << " at " << path << std::endl;
     return false;
@@ -187,35 +210,44 @@ void STHUpdater(Database* db, ClusterStateController* cluster_state_controller,
     // update it to the STH sizes we're checking.
     unique_ptr<CompactMerkleTree> new_tree(
         log_lookup->GetCompactMerkleTree(new Sha256Hasher));
+    new_tree->SetExecutor(task->executor());
 
     {
       lock_guard<mutex> lock(*queue_mutex);
+      Database::ScanOptions scan_options;
+      scan_options.readahead = kLeafBatchSize;
+      scan_options.fill_cache = false;
       unique_ptr<Database::Iterator> entries(
-          db->ScanEntries(new_tree->LeafCount()));
+          db->ScanEntries(new_tree->LeafCount(), local_size, scan_options));
+      vector<LoggedEntry> entry_batch;
+      vector<string> leaves;
       while (!queue->empty() &&
              queue->begin()->second.tree_size() <= local_size) {
         const SignedTreeHead next_sth(queue->begin()->second);
         queue->erase(queue->begin());
 
         // First, if necessary, catch our local compact tree up to the
-        // candidate STH size:
+        // candidate STH size, a batch of leaves at a time:
         {
-          LoggedEntry entry;
           CHECK_LE(next_sth.tree_size(), local_size);
           CHECK_GE(next_sth.tree_size(), 0);
           const uint64_t next_sth_tree_size(
               static_cast<uint64_t>(next_sth.tree_size()));
           while (new_tree->LeafCount() < next_sth_tree_size) {
-            CHECK(entries->GetNextEntry(&entry));
-            CHECK(entry.has_sequence_number());
-            CHECK_GE(entry.sequence_number(), 0);
-            const uint64_t entry_sequence_number(
-                static_cast<uint64_t>(entry.sequence_number()));
-            CHECK_EQ(new_tree->LeafCount(), entry_sequence_number);
-            string serialized_leaf;
-            CHECK(entry.SerializeForLeaf(&serialized_leaf));
-            CHECK_EQ(entry_sequence_number + 1,
-                     new_tree->AddLeaf(serialized_leaf));
+            const uint64_t leaf_count(new_tree->LeafCount());
+            const size_t batch_size(std::min<uint64_t>(
+                kLeafBatchSize, next_sth_tree_size - leaf_count));
+            CHECK_EQ(batch_size,
+                     entries->GetNextEntries(batch_size, &entry_batch));
+            leaves.resize(batch_size);
+            for (size_t i = 0; i < batch_size; ++i) {
+              CHECK(entry_batch[i].has_sequence_number());
+              CHECK_GE(entry_batch[i].sequence_number(), 0);
+              CHECK_EQ(leaf_count + i, static_cast<uint64_t>(
+                                           entry_batch[i].sequence_number()));
+              CHECK(entry_batch[i].SerializeForLeaf(&leaves[i]));
+            }
+            CHECK_EQ(leaf_count + batch_size, new_tree->AddLeaves(leaves));
           }
         }
 
@@ -251,77 +283,131 @@ void STHUpdater(Database* db, ClusterStateController* cluster_state_controller,
 }
 
 
-shared_ptr<RemotePeer> createTargetPeerFromFlags(
-    ThreadPool* pool, UrlFetcher* url_fetcher, EVP_PKEY* pubkey, Task* task,
-    function<void(const ct::SignedTreeHead&)> new_sth) {
-  if (FLAGS_target_log_uri.empty()) {
-    LOG(WARNING) << "Empty target_log_uri flag; mirroring DISABLED";
-    return shared_ptr<RemotePeer>();
+// What differs between the logs mirrored by this process.
+struct MirrorConfig {
+  string target_log_uri;
+  string target_public_key;
+  // Empty to use the database flags.
+  string leveldb_db;
+  Server::Options server_options;
+};
+
+
+vector<MirrorConfig> ReadMirrorConfig(const string& path) {
+  CHECK(FLAGS_leveldb_archive_dir.empty() && FLAGS_leveldb_snapshot_dir.empty())
+      << "--leveldb_archive_dir and --leveldb_snapshot_dir would be shared "
+      << "by the logs of --mirror_config";
+  std::ifstream in(path);
+  CHECK(in) << "Cannot open " << path;
+  vector<MirrorConfig> configs;
+  string line;
+  while (getline(in, line)) {
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    std::istringstream fields(line);
+    MirrorConfig config;
+    CHECK(fields >> config.target_log_uri >> config.target_public_key >>
+          config.leveldb_db >> config.server_options.port >>
+          config.server_options.etcd_root)
+        << "Invalid line in " << path << ": " << line;
+    // --merkle_node_file and --hot_restart_socket would be shared too.
+    config.server_options.merkle_node_file.clear();
+    config.server_options.hot_restart_socket.clear();
+    configs.emplace_back(config);
   }
-
-  return make_shared<RemotePeer>(
-      unique_ptr<AsyncLogClient>(new AsyncLogClient(CHECK_NOTNULL(pool),
-                                                    CHECK_NOTNULL(url_fetcher),
-                                                    FLAGS_target_log_uri)),
-      unique_ptr<LogVerifier>(new LogVerifier(
-          new LogSigVerifier(CHECK_NOTNULL(pubkey)),
-          new MerkleVerifier(unique_ptr<Sha256Hasher>(new Sha256Hasher)))),
-      new_sth, CHECK_NOTNULL(task)->AddChild(
-                   [](Task*) { LOG(INFO) << "RemotePeer exited."; }));
+  CHECK(!configs.empty()) << "No logs to mirror in " << path;
+  return configs;
 }
 
-int main(int argc, char* argv[]) {
-  // Ignore various signals whilst we start up.
-  signal(SIGHUP, SIG_IGN);
-  signal(SIGINT, SIG_IGN);
-  signal(SIGTERM, SIG_IGN);
-
-  util::InitCT(&argc, &argv);
-  ConfigureSerializerForV1CT();
-
-  Server::StaticInit();
-
-  cert_trans::EnsureValidatorsRegistered();
-  const unique_ptr<Database> db(cert_trans::ProvideDatabase());
-  CHECK(db) << "No database instance created, check flag settings";
-
-  const bool stand_alone_mode(cert_trans::IsStandalone(false));
-  const shared_ptr<libevent::Base> event_base(make_shared<libevent::Base>());
-  ThreadPool internal_pool(8);
-  UrlFetcher url_fetcher(event_base.get(), &internal_pool);
 
-  const unique_ptr<EtcdClient> etcd_client(
-      cert_trans::ProvideEtcdClient(event_base.get(), &internal_pool,
-                                    &url_fetcher));
+// A log mirrored by this process, with its own database, event loop and
+// Server, but sharing the thread pools, etcd client and URL fetcher
+// (with its connections) with the other logs of the process.
+class MirroredLog {
+ public:
+  MirroredLog(const MirrorConfig& config,
+              const shared_ptr<libevent::Base>& event_base,
+              ThreadPool* internal_pool, ThreadPool* http_pool,
+              ThreadPool* fetch_pool, EtcdClient* etcd_client,
+              UrlFetcher* url_fetcher, bool stand_alone_mode, Task* task);
+  // REQUIRES: |task| is done.
+  ~MirroredLog();
+  MirroredLog(const MirroredLog&) = delete;
+  MirroredLog& operator=(const MirroredLog&) = delete;
+
+  Server* server() {
+    return &server_;
+  }
 
-  CHECK(!FLAGS_target_public_key.empty());
-  const StatusOr<EVP_PKEY*> pubkey(ReadPublicKey(FLAGS_target_public_key));
-  CHECK(pubkey.ok()) << "Failed to read target log's public key file: "
-                     << pubkey.status();
+  // Waits for the database to catch up with the cluster, and starts
+  // checking the STHs of the target against it.
+  void Start();
+
+ private:
+  void NewSTH(const SignedTreeHead& sth);
+
+  const MirrorConfig config_;
+  const unique_ptr<Database> db_;
+  EVP_PKEY* const pubkey_;
+  const LogVerifier log_verifier_;
+  Server server_;
+  unique_ptr<StalenessTracker> staleness_tracker_;
+  unique_ptr<CertificateHttpHandler> handler_;
+  Task* const task_;
+  mutex queue_mutex_;
+  map<int64_t, SignedTreeHead> queue_;
+  thread sth_updater_;
+};
+
+
+unique_ptr<Database> ProvideMirrorDatabase(const MirrorConfig& config) {
+  if (config.leveldb_db.empty()) {
+    return cert_trans::ProvideDatabase();
+  }
+  return unique_ptr<Database>(new LevelDB(config.leveldb_db));
+}
 
-  const LogVerifier log_verifier(new LogSigVerifier(pubkey.ValueOrDie()),
-                                 new MerkleVerifier(unique_ptr<Sha256Hasher>(
-                                     new Sha256Hasher)));
 
-  ThreadPool http_pool(FLAGS_num_http_server_threads);
+EVP_PKEY* ReadTargetPublicKey(const string& path) {
+  CHECK(!path.empty());
+  const StatusOr<EVP_PKEY*> pubkey(ReadPublicKey(path));
+  CHECK(pubkey.ok()) << "Failed to read target log's public key file "
+                     << path << ": " << pubkey.status();
+  return pubkey.ValueOrDie();
+}
 
-  Server server(event_base, &internal_pool, &http_pool, db.get(),
-                etcd_client.get(), &url_fetcher, &log_verifier);
-  server.Initialise(true /* is_mirror */);
 
-  unique_ptr<StalenessTracker> staleness_tracker(
-      new StalenessTracker(server.cluster_state_controller(), &internal_pool,
+MirroredLog::MirroredLog(const MirrorConfig& config,
+                         const shared_ptr<libevent::Base>& event_base,
+                         ThreadPool* internal_pool, ThreadPool* http_pool,
+                         ThreadPool* fetch_pool, EtcdClient* etcd_client,
+                         UrlFetcher* url_fetcher, bool stand_alone_mode,
+                         Task* task)
+    : config_(config),
+      db_(ProvideMirrorDatabase(config_)),
+      pubkey_(ReadTargetPublicKey(config_.target_public_key)),
+      log_verifier_(new LogSigVerifier(pubkey_),
+                    new MerkleVerifier(
+                        unique_ptr<Sha256Hasher>(new Sha256Hasher))),
+      server_(event_base, internal_pool, http_pool,
+              CHECK_NOTNULL(db_.get()), etcd_client, url_fetcher,
+              &log_verifier_, config_.server_options),
+      task_(CHECK_NOTNULL(task)) {
+  server_.Initialise(true /* is_mirror */);
+
+  staleness_tracker_.reset(
+      new StalenessTracker(server_.cluster_state_controller(), internal_pool,
                            event_base.get()));
 
-  CertificateHttpHandler handler(server.log_lookup(), db.get(),
-                                 server.cluster_state_controller(),
-                                 nullptr /* checker */, nullptr /* Frontend */,
-                                 &internal_pool, event_base.get(),
-                                 staleness_tracker.get());
+  handler_.reset(new CertificateHttpHandler(
+      server_.log_lookup(), db_.get(), server_.cluster_state_controller(),
+      nullptr /* checker */, nullptr /* Frontend */, internal_pool,
+      event_base.get(), staleness_tracker_.get()));
 
   // Connect the handler, proxy and server together
-  handler.SetProxy(server.proxy());
-  handler.Add(server.http_server());
+  handler_->SetProxy(server_.proxy());
+  handler_->Add(server_.http_server());
 
   if (stand_alone_mode) {
     // Set up a simple single-node mirror environment for testing.
@@ -334,60 +420,128 @@ int main(int argc, char* argv[]) {
     // TODO(alcutter): Note that we're currently broken wrt to restarting the
     // log server when there's data in the log.  It's a temporary thing though,
     // so fear ye not.
-    ct::ClusterConfig config;
-    config.set_minimum_serving_nodes(1);
-    config.set_minimum_serving_fraction(1);
+    ct::ClusterConfig cluster_config;
+    cluster_config.set_minimum_serving_nodes(1);
+    cluster_config.set_minimum_serving_fraction(1);
     LOG(INFO) << "Setting default single-node ClusterConfig:\n"
-              << config.DebugString();
-    server.consistent_store()->SetClusterConfig(config);
+              << cluster_config.DebugString();
+    server_.consistent_store()->SetClusterConfig(cluster_config);
 
     // Since we're a single node cluster, we'll settle that we're the
     // master here, so that we can populate the initial STH
     // (StrictConsistentStore won't allow us to do so unless we're master.)
-    server.election()->StartElection();
-    server.election()->WaitToBecomeMaster();
+    server_.election()->StartElection();
+    server_.election()->WaitToBecomeMaster();
   }
 
+  if (config_.target_log_uri.empty()) {
+    LOG(WARNING) << "Empty target_log_uri flag; mirroring DISABLED";
+    return;
+  }
 
-  ThreadPool pool(16);
-  SyncTask fetcher_task(&pool);
+  LOG(INFO) << "Adding remote peer for target log " << config_.target_log_uri;
+  server_.continuous_fetcher()->AddPeer(
+      "target",
+      make_shared<RemotePeer>(
+          unique_ptr<AsyncLogClient>(
+              new AsyncLogClient(CHECK_NOTNULL(fetch_pool), url_fetcher,
+                                 config_.target_log_uri)),
+          unique_ptr<LogVerifier>(new LogVerifier(
+              new LogSigVerifier(pubkey_),
+              new MerkleVerifier(
+                  unique_ptr<Sha256Hasher>(new Sha256Hasher)))),
+          bind(&MirroredLog::NewSTH, this, _1),
+          task_->AddChild(
+              [](Task*) { LOG(INFO) << "RemotePeer exited."; })));
+}
 
-  mutex queue_mutex;
-  map<int64_t, ct::SignedTreeHead> queue;
-
-  const function<void(const ct::SignedTreeHead&)> new_sth(
-      [&queue_mutex, &queue](const ct::SignedTreeHead& sth) {
-        lock_guard<mutex> lock(queue_mutex);
-        const auto it(queue.find(sth.tree_size()));
-        if (it != queue.end() && sth.timestamp() < it->second.timestamp()) {
-          LOG(WARNING) << "Received older STH:\nHad:\n"
-                       << it->second.DebugString() << "\nGot:\n"
-                       << sth.DebugString();
-          return;
-        }
-        queue.insert(make_pair(sth.tree_size(), sth));
-      });
-
-  const shared_ptr<RemotePeer> peer(
-      createTargetPeerFromFlags(&pool, &url_fetcher, pubkey.ValueOrDie(),
-                                fetcher_task.task(), new_sth));
-  if (peer) {
-    LOG(INFO) << "Adding remote peer for target log.";
-    server.continuous_fetcher()->AddPeer("target", peer);
+
+MirroredLog::~MirroredLog() {
+  if (sth_updater_.joinable()) {
+    sth_updater_.join();
+  }
+}
+
+
+void MirroredLog::Start() {
+  server_.WaitForReplication();
+
+  sth_updater_ = thread(&STHUpdater, db_.get(),
+                        server_.cluster_state_controller(), &queue_mutex_,
+                        &queue_, server_.log_lookup(),
+                        task_->AddChild([](Task*) {
+                          LOG(INFO) << "STHUpdater exited.";
+                        }));
+}
+
+
+void MirroredLog::NewSTH(const SignedTreeHead& sth) {
+  lock_guard<mutex> lock(queue_mutex_);
+  const auto it(queue_.find(sth.tree_size()));
+  if (it != queue_.end() && sth.timestamp() < it->second.timestamp()) {
+    LOG(WARNING) << "Received older STH:\nHad:\n"
+                 << it->second.DebugString() << "\nGot:\n"
+                 << sth.DebugString();
+    return;
+  }
+  queue_.insert(make_pair(sth.tree_size(), sth));
+}
+
+
+int main(int argc, char* argv[]) {
+  // Ignore various signals whilst we start up.
+  signal(SIGHUP, SIG_IGN);
+  signal(SIGINT, SIG_IGN);
+  signal(SIGTERM, SIG_IGN);
+
+  util::InitCT(&argc, &argv);
+  ConfigureSerializerForV1CT();
+
+  Server::StaticInit();
+
+  cert_trans::EnsureValidatorsRegistered();
+
+  vector<MirrorConfig> configs;
+  if (FLAGS_mirror_config.empty()) {
+    MirrorConfig config;
+    config.target_log_uri = FLAGS_target_log_uri;
+    config.target_public_key = FLAGS_target_public_key;
+    configs.emplace_back(config);
+  } else {
+    configs = ReadMirrorConfig(FLAGS_mirror_config);
   }
 
-  server.WaitForReplication();
+  const bool stand_alone_mode(cert_trans::IsStandalone(false));
+  const shared_ptr<libevent::Base> event_base(make_shared<libevent::Base>());
+  ThreadPool internal_pool(8);
+  UrlFetcher url_fetcher(event_base.get(), &internal_pool);
 
-  thread sth_updater(&STHUpdater, db.get(), server.cluster_state_controller(),
-                     &queue_mutex, &queue, server.log_lookup(),
-                     fetcher_task.task()->AddChild(
-                         [](Task*) { LOG(INFO) << "STHUpdater exited."; }));
+  const unique_ptr<EtcdClient> etcd_client(
+      cert_trans::ProvideEtcdClient(event_base.get(), &internal_pool,
+                                    &url_fetcher));
+
+  ThreadPool http_pool(FLAGS_num_http_server_threads);
+  ThreadPool pool(16);
+  SyncTask fetcher_task(&pool);
+
+  // The first log is served from the main event loop, the others each
+  // get one of their own.
+  vector<unique_ptr<MirroredLog>> logs;
+  for (const MirrorConfig& config : configs) {
+    logs.emplace_back(new MirroredLog(
+        config, logs.empty() ? event_base : make_shared<libevent::Base>(),
+        &internal_pool, &http_pool, &pool, etcd_client.get(), &url_fetcher,
+        stand_alone_mode, fetcher_task.task()));
+  }
+  for (const auto& log : logs) {
+    log->Start();
+  }
 
-  server.Run();
+  logs.front()->server()->Run();
 
   fetcher_task.task()->Return();
   fetcher_task.Wait();
-  sth_updater.join();
+  logs.clear();
 
   return 0;
 }
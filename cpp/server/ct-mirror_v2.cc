@@ -3,6 +3,7 @@
 #include <gflags/gflags.h>
 #include <signal.h>
 #include <unistd.h>
+#include <algorithm>
 #include <iostream>
 #include <string>
 #include <utility>
@@ -109,6 +110,7 @@ using std::shared_ptr;
 using std::string;
 using std::thread;
 using std::unique_ptr;
+using std::vector;
 using util::HexString;
 using util::StatusOr;
 using util::SyncTask;
@@ -127,6 +129,10 @@ Counter<>* inconsistent_sths_received =
                    "Number of STHs received from the mirror target whose root "
                    "hash does not match the locally built tree.");
 
+// How many leaves to add to the tree at once when catching it up. The
+// tree hashes large batches on several threads.
+const size_t kLeafBatchSize = 1 << 16;
+
 
 // Basic sanity checks on flag values.
 static bool ValidateRead(const char* flagname, const string& path) {
@@ -180,35 +186,44 @@ void STHUpdater(Database* db, ClusterStateController* cluster_state_controller,
     // update it to the STH sizes we're checking.
     unique_ptr<CompactMerkleTree> new_tree(
         log_lookup->GetCompactMerkleTree(new Sha256Hasher));
+    new_tree->SetExecutor(task->executor());
 
     {
       lock_guard<mutex> lock(*queue_mutex);
+      Database::ScanOptions scan_options;
+      scan_options.readahead = kLeafBatchSize;
+      scan_options.fill_cache = false;
       unique_ptr<Database::Iterator> entries(
-          db->ScanEntries(new_tree->LeafCount()));
+          db->ScanEntries(new_tree->LeafCount(), local_size, scan_options));
+      vector<LoggedEntry> entry_batch;
+      vector<string> leaves;
       while (!queue->empty() &&
              queue->begin()->second.tree_size() <= local_size) {
         const SignedTreeHead next_sth(queue->begin()->second);
         queue->erase(queue->begin());
 
         // First, if necessary, catch our local compact tree up to the
-        // candidate STH size:
+        // candidate STH size, a batch of leaves at a time:
         {
-          LoggedEntry entry;
           CHECK_LE(next_sth.tree_size(), local_size);
           CHECK_GE(next_sth.tree_size(), 0);
           const uint64_t next_sth_tree_size(
               static_cast<uint64_t>(next_sth.tree_size()));
           while (new_tree->LeafCount() < next_sth_tree_size) {
-            CHECK(entries->GetNextEntry(&entry));
-            CHECK(entry.has_sequence_number());
-            CHECK_GE(entry.sequence_number(), 0);
-            const uint64_t entry_sequence_number(
-                static_cast<uint64_t>(entry.sequence_number()));
-            CHECK_EQ(new_tree->LeafCount(), entry_sequence_number);
-            string serialized_leaf;
-            CHECK(entry.SerializeForLeaf(&serialized_leaf));
-            CHECK_EQ(entry_sequence_number + 1,
-                     new_tree->AddLeaf(serialized_leaf));
+            const uint64_t leaf_count(new_tree->LeafCount());
+            const size_t batch_size(std::min<uint64_t>(
+                kLeafBatchSize, next_sth_tree_size - leaf_count));
+            CHECK_EQ(batch_size,
+                     entries->GetNextEntries(batch_size, &entry_batch));
+            leaves.resize(batch_size);
+            for (size_t i = 0; i < batch_size; ++i) {
+              CHECK(entry_batch[i].has_sequence_number());
+              CHECK_GE(entry_batch[i].sequence_number(), 0);
+              CHECK_EQ(leaf_count + i, static_cast<uint64_t>(
+                                           entry_batch[i].sequence_number()));
+              CHECK(entry_batch[i].SerializeForLeaf(&leaves[i]));
+            }
+            CHECK_EQ(leaf_count + batch_size, new_tree->AddLeaves(leaves));
           }
         }
 
@@ -7,41 +7,131 @@
 #include <unistd.h>
 #include <iostream>
 #include <string>
+#include <vector>
 
 #include "config.h"
 #include "log/cert_checker.h"
 #include "log/cert_submission_handler.h"
 #include "log/cluster_state_controller.h"
+#include "log/entry_journal.h"
 #include "log/etcd_consistent_store.h"
 #include "log/frontend.h"
 #include "log/frontend_signer.h"
+#include "log/leveldb_db.h"
 #include "log/log_lookup.h"
 #include "log/log_signer.h"
 #include "log/log_verifier.h"
+#include "log/merkle_node_file.h"
 #include "log/strict_consistent_store.h"
 #include "log/tree_signer.h"
 #include "merkletree/merkle_verifier.h"
+#include "monitoring/memory.h"
 #include "proto/cert_serializer.h"
 #include "server/certificate_handler.h"
 #include "server/log_processes.h"
+#include "server/read_replica.h"
+#include "server/request_log.h"
 #include "server/server.h"
 #include "server/server_helper.h"
 #include "server/staleness_tracker.h"
+#include "server/startup_phases.h"
+#include "server/static_exporter.h"
+#include "util/cpu_topology.h"
 #include "util/etcd.h"
 #include "util/init.h"
 #include "util/libevent_wrapper.h"
 #include "util/read_key.h"
 #include "util/status.h"
+#include "util/util.h"
 #include "util/uuid.h"
 
 DEFINE_string(key, "", "PEM-encoded server private key file");
+DEFINE_string(key_engine, "",
+              "If set, the OpenSSL engine to load the server private key "
+              "from, instead of --key, e.g. pkcs11 for a key held by an HSM "
+              "through libp11. See --key_engine_key_id.");
+DEFINE_string(key_engine_key_id, "",
+              "ID of the server private key in --key_engine, e.g. a PKCS#11 "
+              "URI, which can include the PIN.");
+DEFINE_int32(signer_threads, 0,
+             "If not 0, the SCTs of the add-chain requests are signed by a "
+             "\"sign\" pool of this many threads, while the \"crypto\" "
+             "threads go on with other requests: with --key_engine, this "
+             "many signatures are in flight at once, typically one per HSM "
+             "session.");
+DEFINE_string(signer_cpus, "",
+              "Comma separated list of the CPUs the threads of the \"sign\" "
+              "pool run on, any of them if empty, as for --serve_cpus.");
 DEFINE_string(trusted_cert_file, "",
               "File for trusted CA certificates, in concatenated PEM format");
 DEFINE_double(guard_window_seconds, 60,
               "Unsequenced entries newer than this "
               "number of seconds will not be sequenced.");
+DECLARE_string(merkle_node_file);
+DECLARE_int32(signer_precomputed_nonces);
+
 DEFINE_int32(num_http_server_threads, 16,
-             "Number of threads for servicing the incoming HTTP requests.");
+             "Number of threads of the \"serve\" pool, which proxies the "
+             "requests to the other nodes.");
+DEFINE_string(serve_cpus, "",
+              "Comma separated list of the CPUs the threads of the "
+              "\"serve\" pool run on, any of them if empty. Ranges such "
+              "as 8-15, and nodeN for the CPUs of NUMA node N, can be "
+              "listed too.");
+DEFINE_int32(io_threads, 16,
+             "Number of threads of the \"io\" pool, which answers the "
+             "requests reading entries and proofs from the database.");
+DEFINE_string(io_cpus, "",
+              "Comma separated list of the CPUs the threads of the \"io\" "
+              "pool run on, any of them if empty, as for --serve_cpus.");
+DEFINE_int32(crypto_threads, 8,
+             "Number of threads of the \"crypto\" pool, which checks the "
+             "submitted chains and signs their SCTs.");
+DEFINE_string(crypto_cpus, "",
+              "Comma separated list of the CPUs the threads of the "
+              "\"crypto\" pool run on, any of them if empty, as for "
+              "--serve_cpus.");
+DEFINE_int32(startup_threads, 4,
+             "Number of threads of the \"startup\" pool, which runs the "
+             "phases of the start up which do not depend on each other at "
+             "the same time.");
+DEFINE_string(read_replica_of, "",
+              "URI of a server of this log to follow as a read replica, "
+              "serving only the get-* requests, from the local database, "
+              "without joining the cluster in etcd. --key and "
+              "--trusted_cert_file are not used then.");
+DEFINE_string(read_replica_public_key, "",
+              "PEM-encoded public key of the log, for --read_replica_of.");
+DEFINE_string(frontend_journal_dir, "",
+              "If set, directory of a local journal the new entries are "
+              "written to before returning their SCTs, without waiting for "
+              "etcd. They are added to etcd in the background, so the time "
+              "this takes counts against the MMD and --guard_window_seconds.");
+DEFINE_string(static_export_dir, "",
+              "If set, directory the entries, Merkle tiles and tree heads "
+              "which no longer change are written to as static files, for "
+              "a CDN to serve. See server/static_exporter.h.");
+DEFINE_string(http_request_log, "",
+              "If set, file the HTTP requests are recorded in, for "
+              "tools/replay_requests. See server/request_log.h.");
+DEFINE_bool(http_request_log_bodies, false,
+            "Record the bodies of the requests in --http_request_log too, "
+            "so that the submissions can be replayed.");
+DEFINE_string(http_path_prefix, "",
+              "If set, prefix of the paths this log is served under, e.g. "
+              "/2021 for /2021/ct/v1/get-sth, so that it can share the "
+              "process with --frozen_shards.");
+DEFINE_string(frozen_shards, "",
+              "Comma separated list of frozen (temporal) shards of the "
+              "log to serve too, read-only, each as <path prefix>="
+              "<leveldb directory>[=<archive directory>], e.g. "
+              "/2019=/data/2019. They share the thread pools, HTTP server "
+              "and roots of this log, and use neither etcd nor a signer.");
+DEFINE_int32(frozen_shard_block_cache_mb, 64,
+             "Size of the leveldb block cache shared by the "
+             "--frozen_shards, in MB.");
+DEFINE_int32(frozen_shard_max_open_files, 64,
+             "Number of files each of the --frozen_shards keeps open.");
 
 namespace libevent = cert_trans::libevent;
 
@@ -51,14 +141,23 @@ using cert_trans::CleanUpEntries;
 using cert_trans::ClusterStateController;
 using cert_trans::ConsistentStore;
 using cert_trans::Database;
+using cert_trans::ReadPublicKey;
+using cert_trans::ReadReplica;
+using cert_trans::RequestLog;
 using cert_trans::EtcdClient;
 using cert_trans::EtcdConsistentStore;
+using cert_trans::LevelDB;
+using cert_trans::LogLookup;
 using cert_trans::LoggedEntry;
+using cert_trans::MemoryEstimate;
+using cert_trans::ReadEnginePrivateKey;
 using cert_trans::ReadPrivateKey;
 using cert_trans::SequenceEntries;
 using cert_trans::Server;
 using cert_trans::SignMerkleTree;
 using cert_trans::StalenessTracker;
+using cert_trans::StartupPhases;
+using cert_trans::StaticExporter;
 using cert_trans::ThreadPool;
 using cert_trans::TreeSigner;
 using cert_trans::UrlFetcher;
@@ -68,16 +167,22 @@ using google::RegisterFlagValidator;
 using std::bind;
 using std::function;
 using std::make_shared;
+using std::placeholders::_1;
 using std::shared_ptr;
 using std::string;
 using std::thread;
 using std::unique_ptr;
+using std::vector;
 
 
 namespace {
 
 // Basic sanity checks on flag values.
 static bool ValidateRead(const char* flagname, const string& path) {
+  // Not needed with --read_replica_of, main() checks them otherwise.
+  if (path.empty()) {
+    return true;
+  }
   if (access(path.c_str(), R_OK) != 0) {
     std::cout << "Cannot access " << flagname << " at " << path << std::endl;
     return false;
@@ -90,6 +195,119 @@ static const bool key_dummy = RegisterFlagValidator(&FLAGS_key, &ValidateRead);
 static const bool cert_dummy =
     RegisterFlagValidator(&FLAGS_trusted_cert_file, &ValidateRead);
 
+
+// The pools of the HTTP requests are kept apart, so that requests
+// waiting on the database (in "io") do not hold up those only needing
+// CPU (in "crypto"), nor the proxying of requests (in "serve").
+unique_ptr<ThreadPool> NewThreadPool(const string& name, int num_threads,
+                                     const string& cpu_list) {
+  CHECK_GT(num_threads, 0) << "The \"" << name
+                           << "\" pool needs at least one thread.";
+  const util::StatusOr<std::vector<int>> cpus(
+      cert_trans::ParseCpuList(cpu_list, cert_trans::NumaNodeCpus()));
+  CHECK(cpus.ok()) << "The CPUs of the \"" << name
+                   << "\" pool: " << cpus.status();
+  return unique_ptr<ThreadPool>(
+      new ThreadPool(name, num_threads, cpus.ValueOrDie()));
+}
+
+
+unique_ptr<RequestLog> NewRequestLog() {
+  if (FLAGS_http_request_log.empty()) {
+    return nullptr;
+  }
+  return unique_ptr<RequestLog>(
+      new RequestLog(FLAGS_http_request_log, FLAGS_http_request_log_bodies));
+}
+
+
+// A frozen shard of the log, which only serves the reads from its
+// database, as of its last tree head.
+struct FrozenShard {
+  unique_ptr<Database> db;
+  unique_ptr<LogLookup> log_lookup;
+  unique_ptr<CertificateHttpHandler> handler;
+};
+
+
+// Opens the --frozen_shards, and adds their handlers to |server|.
+vector<unique_ptr<FrozenShard>> AddFrozenShards(
+    libevent::HttpServer* server, leveldb::Cache* block_cache,
+    CertChecker* checker, ThreadPool* pool, ThreadPool* io_pool,
+    libevent::Base* event_base, RequestLog* request_log) {
+  vector<unique_ptr<FrozenShard>> shards;
+  for (const string& spec : util::split(FLAGS_frozen_shards)) {
+    const vector<string> fields(util::split(spec, '='));
+    CHECK(fields.size() == 2 || fields.size() == 3)
+        << "Invalid --frozen_shards entry: " << spec;
+    LOG(INFO) << "Serving the frozen shard in " << fields[1] << " under "
+              << fields[0];
+    unique_ptr<FrozenShard> shard(new FrozenShard);
+    shard->db.reset(new LevelDB(fields[1],
+                                fields.size() == 3 ? fields[2] : "",
+                                block_cache,
+                                FLAGS_frozen_shard_max_open_files));
+    shard->log_lookup.reset(new LogLookup(shard->db.get()));
+    CHECK_GT(shard->log_lookup->GetSTH().tree_size(), 0)
+        << "The frozen shard in " << fields[1] << " has no tree head.";
+    shard->handler.reset(new CertificateHttpHandler(
+        shard->log_lookup.get(), shard->db.get(), nullptr /* controller */,
+        checker, nullptr /* Frontend */, pool, event_base,
+        nullptr /* staleness_tracker */, io_pool));
+    if (request_log) {
+      shard->handler->SetRequestLog(request_log);
+    }
+    shard->handler->Add(server, fields[0]);
+    shards.push_back(std::move(shard));
+  }
+  return shards;
+}
+
+
+int RunReadReplica() {
+  const util::StatusOr<EVP_PKEY*> pubkey(
+      ReadPublicKey(FLAGS_read_replica_public_key));
+  CHECK(pubkey.ok()) << "Failed to read the log's public key file "
+                     << FLAGS_read_replica_public_key << ": "
+                     << pubkey.status();
+
+  cert_trans::EnsureValidatorsRegistered();
+  const unique_ptr<Database> db(cert_trans::ProvideDatabase());
+  CHECK(db) << "No database instance created, check flag settings";
+
+  shared_ptr<libevent::Base> event_base(make_shared<libevent::Base>());
+  ThreadPool internal_pool(8);
+  UrlFetcher url_fetcher(event_base.get(), &internal_pool);
+
+  ReadReplica replica(event_base, &internal_pool, &internal_pool, db.get(),
+                      &url_fetcher, FLAGS_read_replica_of,
+                      pubkey.ValueOrDie());
+  unique_ptr<StaticExporter> exporter;
+  if (!FLAGS_static_export_dir.empty()) {
+    exporter.reset(
+        new StaticExporter(FLAGS_static_export_dir, db.get(), &internal_pool));
+  }
+  CertificateHttpHandler handler(replica.log_lookup(), db.get(),
+                                 nullptr /* controller */,
+                                 nullptr /* checker */,
+                                 nullptr /* Frontend */, &internal_pool,
+                                 event_base.get(),
+                                 nullptr /* staleness_tracker */);
+  const unique_ptr<RequestLog> request_log(NewRequestLog());
+  if (request_log) {
+    handler.SetRequestLog(request_log.get());
+  }
+  if (exporter) {
+    handler.SetStaticExporter(exporter.get());
+  }
+  handler.Add(replica.http_server());
+
+  replica.Run();
+
+  return 0;
+}
+
+
 }  // namespace
 
 
@@ -102,19 +320,24 @@ int main(int argc, char* argv[]) {
   ConfigureSerializerForV1CT();
   util::InitCT(&argc, &argv);
 
-  Server::StaticInit();
-
-  util::StatusOr<EVP_PKEY*> pkey(ReadPrivateKey(FLAGS_key));
-  CHECK_EQ(pkey.status(), ::util::OkStatus());
-  LogSigner log_signer(pkey.ValueOrDie());
+  if (!FLAGS_read_replica_of.empty()) {
+    return RunReadReplica();
+  }
 
-  CertChecker checker;
-  CHECK(checker.LoadTrustedCertificates(FLAGS_trusted_cert_file))
-      << "Could not load CA certs from " << FLAGS_trusted_cert_file;
+  Server::StaticInit();
 
-  cert_trans::EnsureValidatorsRegistered();
-  const unique_ptr<Database> db(cert_trans::ProvideDatabase());
-  CHECK(db) << "No database instance created, check flag settings";
+  CHECK(!FLAGS_key.empty() || !FLAGS_key_engine.empty())
+      << "--key or --key_engine is required";
+  CHECK(!FLAGS_trusted_cert_file.empty())
+      << "--trusted_cert_file is required";
+  if (!FLAGS_key_engine.empty()) {
+    // The private key never leaves the engine, so the nonces cannot be
+    // precomputed here.
+    CHECK_EQ(0, FLAGS_signer_precomputed_nonces)
+        << "--signer_precomputed_nonces cannot be used with --key_engine";
+    CHECK(!FLAGS_key_engine_key_id.empty())
+        << "--key_engine_key_id is required with --key_engine";
+  }
 
   shared_ptr<libevent::Base> event_base(make_shared<libevent::Base>());
   ThreadPool internal_pool(8);
@@ -128,89 +351,214 @@ int main(int argc, char* argv[]) {
       cert_trans::ProvideEtcdClient(event_base.get(), &internal_pool,
                                     &url_fetcher));
 
-  const LogVerifier log_verifier(new LogSigVerifier(pkey.ValueOrDie()),
-                                 new MerkleVerifier(unique_ptr<Sha256Hasher>(
-                                     new Sha256Hasher)));
+  const unique_ptr<ThreadPool> serve_pool(NewThreadPool(
+      "serve", FLAGS_num_http_server_threads, FLAGS_serve_cpus));
+  const unique_ptr<ThreadPool> io_pool(
+      NewThreadPool("io", FLAGS_io_threads, FLAGS_io_cpus));
+  const unique_ptr<ThreadPool> crypto_pool(
+      NewThreadPool("crypto", FLAGS_crypto_threads, FLAGS_crypto_cpus));
+  unique_ptr<ThreadPool> sign_pool;
+  if (FLAGS_signer_threads > 0) {
+    sign_pool = NewThreadPool("sign", FLAGS_signer_threads, FLAGS_signer_cpus);
+  }
+  const unique_ptr<RequestLog> request_log(NewRequestLog());
+  const unique_ptr<leveldb::Cache> frozen_shard_cache(
+      FLAGS_frozen_shards.empty()
+          ? nullptr
+          : leveldb::NewLRUCache(
+                static_cast<size_t>(FLAGS_frozen_shard_block_cache_mb) << 20));
+  // Shared by the frozen shards, which leave it out of their estimates.
+  const MemoryEstimate frozen_shard_cache_memory(
+      "leveldb", [&frozen_shard_cache]() {
+        return frozen_shard_cache ? frozen_shard_cache->TotalCharge() : 0;
+      });
+
+  // The steps of the start up which do not depend on each other (reading
+  // the key, loading the roots, opening the database...) run at the same
+  // time, each as soon as what it needs is there.
+  const unique_ptr<ThreadPool> startup_pool(
+      NewThreadPool("startup", FLAGS_startup_threads, ""));
+  StartupPhases startup(startup_pool.get());
+
+  EVP_PKEY* pkey(nullptr);
+  unique_ptr<LogSigner> log_signer;
+  startup.Add("signing_key", {}, [&pkey, &log_signer, &sign_pool]() {
+    const util::StatusOr<EVP_PKEY*> read(
+        FLAGS_key_engine.empty()
+            ? ReadPrivateKey(FLAGS_key)
+            : ReadEnginePrivateKey(FLAGS_key_engine,
+                                   FLAGS_key_engine_key_id));
+    CHECK_EQ(read.status(), ::util::OkStatus());
+    pkey = read.ValueOrDie();
+    log_signer.reset(new LogSigner(pkey));
+    if (sign_pool) {
+      log_signer->SetAsyncExecutor(sign_pool.get());
+    }
+  });
 
-  ThreadPool http_pool(FLAGS_num_http_server_threads);
+  CertChecker checker;
+  startup.Add("trusted_certs", {}, [&checker]() {
+    CHECK(checker.LoadTrustedCertificates(FLAGS_trusted_cert_file))
+        << "Could not load CA certs from " << FLAGS_trusted_cert_file;
+  });
+
+  unique_ptr<Database> db;
+  startup.Add("database", {}, [&db]() {
+    cert_trans::EnsureValidatorsRegistered();
+    db = cert_trans::ProvideDatabase();
+    CHECK(db) << "No database instance created, check flag settings";
+  });
+
+  unique_ptr<cert_trans::EntryJournal> journal;
+  startup.Add("frontend_journal", {}, [&journal]() {
+    if (FLAGS_frontend_journal_dir.empty()) {
+      return;
+    }
+    util::StatusOr<unique_ptr<cert_trans::EntryJournal>> opened(
+        cert_trans::EntryJournal::Open(FLAGS_frontend_journal_dir));
+    CHECK(opened.ok()) << "Cannot open frontend journal: " << opened.status();
+    journal = std::move(opened.ValueOrDie());
+  });
+
+  unique_ptr<cert_trans::MerkleNodeFile> node_file;
+  startup.Add("merkle_node_file", {}, [&node_file]() {
+    if (FLAGS_merkle_node_file.empty()) {
+      return;
+    }
+    util::StatusOr<unique_ptr<cert_trans::MerkleNodeFile>> opened(
+        cert_trans::MerkleNodeFile::Open(FLAGS_merkle_node_file,
+                                         Sha256Hasher().DigestSize()));
+    CHECK(opened.ok()) << "Cannot open Merkle node file: " << opened.status();
+    node_file = std::move(opened.ValueOrDie());
+  });
+
+  unique_ptr<LogVerifier> log_verifier;
+  unique_ptr<Server> server;
+  startup.Add("server", {"signing_key", "database"}, [&]() {
+    log_verifier.reset(
+        new LogVerifier(new LogSigVerifier(pkey),
+                        new MerkleVerifier(unique_ptr<Sha256Hasher>(
+                            new Sha256Hasher))));
+    server.reset(new Server(event_base, &internal_pool, serve_pool.get(),
+                            db.get(), etcd_client.get(), &url_fetcher,
+                            log_verifier.get()));
+    // The HTTP server is up from here on, so the rest of the start up
+    // can be followed there.
+    CHECK(server->http_server()->AddHandler(
+        "/ready", bind(&StartupPhases::HandleReady, &startup, _1)));
+    server->Initialise(false /* is_mirror */);
+  });
+
+  vector<unique_ptr<FrozenShard>> frozen_shards;
+  startup.Add("frozen_shards", {"trusted_certs", "server"}, [&]() {
+    frozen_shards = AddFrozenShards(server->http_server(),
+                                    frozen_shard_cache.get(), &checker,
+                                    crypto_pool.get(), io_pool.get(),
+                                    event_base.get(), request_log.get());
+  });
+
+  // Pick up from the frontier written by the previous signer if there is
+  // one, which does not depend on the size of the log.
+  unique_ptr<CompactMerkleTree> signer_tree;
+  startup.Add("signer_tree", {"server"}, [&signer_tree, &db, &server]() {
+    signer_tree = TreeSigner::LoadCompactMerkleTree(db.get(), new Sha256Hasher);
+    if (!signer_tree) {
+      signer_tree =
+          server->log_lookup()->GetCompactMerkleTree(new Sha256Hasher);
+    }
+  });
 
-  Server server(event_base, &internal_pool, &http_pool, db.get(),
-                etcd_client.get(), &url_fetcher, &log_verifier);
-  server.Initialise(false /* is_mirror */);
+  startup.WaitAll();
 
-  Frontend frontend(
-      new FrontendSigner(db.get(), server.consistent_store(), &log_signer));
+  Frontend frontend(new FrontendSigner(db.get(), server->consistent_store(),
+                                       log_signer.get(), journal.get(),
+                                       &internal_pool));
   unique_ptr<StalenessTracker> staleness_tracker(
-      new StalenessTracker(server.cluster_state_controller(), &internal_pool,
+      new StalenessTracker(server->cluster_state_controller(), &internal_pool,
                            event_base.get()));
-  CertificateHttpHandler handler(server.log_lookup(), db.get(),
-                                 server.cluster_state_controller(), &checker,
-                                 &frontend, &internal_pool, event_base.get(),
-                                 staleness_tracker.get());
+  unique_ptr<StaticExporter> exporter;
+  if (!FLAGS_static_export_dir.empty()) {
+    exporter.reset(
+        new StaticExporter(FLAGS_static_export_dir, db.get(), io_pool.get()));
+  }
+  CertificateHttpHandler handler(server->log_lookup(), db.get(),
+                                 server->cluster_state_controller(), &checker,
+                                 &frontend, crypto_pool.get(),
+                                 event_base.get(), staleness_tracker.get(),
+                                 io_pool.get());
 
   // Connect the handler, proxy and server together
-  handler.SetProxy(server.proxy());
-  handler.Add(server.http_server());
+  handler.SetProxy(server->proxy());
+  if (request_log) {
+    handler.SetRequestLog(request_log.get());
+  }
+  if (exporter) {
+    handler.SetStaticExporter(exporter.get());
+  }
+  if (server->pending_entry_store()) {
+    handler.SetPendingEntryStore(server->pending_entry_store());
+  }
+  handler.Add(server->http_server(), FLAGS_http_path_prefix);
 
   TreeSigner tree_signer(
       std::chrono::duration<double>(FLAGS_guard_window_seconds), db.get(),
-      server.log_lookup()->GetCompactMerkleTree(new Sha256Hasher),
-      server.consistent_store(), &log_signer);
+      std::move(signer_tree), server->consistent_store(), log_signer.get(),
+      node_file.get(), &internal_pool);
+  if (server->pending_entry_fetcher()) {
+    tree_signer.SetPendingEntryFetcher(server->pending_entry_fetcher());
+  }
 
   if (stand_alone_mode) {
-    // Set up a simple single-node environment.
-    //
-    // Put a sensible single-node config into FakeEtcd. For a real clustered
-    // log
-    // we'd expect a ClusterConfig already to be present within etcd as part of
-    // the provisioning of the log.
-    //
-    // TODO(alcutter): Note that we're currently broken wrt to restarting the
-    // log server when there's data in the log.  It's a temporary thing though,
-    // so fear ye not.
-    ct::ClusterConfig config;
-    config.set_minimum_serving_nodes(1);
-    config.set_minimum_serving_fraction(1);
-    LOG(INFO) << "Setting default single-node ClusterConfig:\n"
-              << config.DebugString();
-    server.consistent_store()->SetClusterConfig(config);
-
-    // Since we're a single node cluster, we'll settle that we're the
-    // master here, so that we can populate the initial STH
-    // (StrictConsistentStore won't allow us to do so unless we're master.)
-    server.election()->StartElection();
-    server.election()->WaitToBecomeMaster();
-
-    {
-      EtcdClient::Response resp;
-      util::SyncTask task(event_base.get());
-      etcd_client->Create("/root/sequence_mapping", "", &resp, task.task());
-      task.Wait();
-      CHECK_EQ(::util::OkStatus(), task.status());
-    }
-
-    // Do an initial signing run to get the initial STH, again this is
-    // temporary until we re-populate FakeEtcd from the DB.
-    CHECK_EQ(tree_signer.UpdateTree(), TreeSigner::OK);
-
-    // Need to boot-strap the Serving STH too because we consider it an error
-    // if it's not set, which in turn causes us to not attempt to become
-    // master:
-    server.consistent_store()->SetServingSTH(tree_signer.LatestSTH());
+    startup.Run("standalone_cluster", {}, [&server, &tree_signer]() {
+      // Set up a simple single-node environment.
+      //
+      // Put a sensible single-node config into the local consistent
+      // store. For a real clustered log we'd expect a ClusterConfig
+      // already to be present within etcd as part of the provisioning of
+      // the log.
+      //
+      // TODO(alcutter): Note that we're currently broken wrt to
+      // restarting the log server when there's data in the log.  It's a
+      // temporary thing though, so fear ye not.
+      ct::ClusterConfig config;
+      config.set_minimum_serving_nodes(1);
+      config.set_minimum_serving_fraction(1);
+      LOG(INFO) << "Setting default single-node ClusterConfig:\n"
+                << config.DebugString();
+      server->consistent_store()->SetClusterConfig(config);
+
+      // Since we're a single node cluster, we'll settle that we're the
+      // master here, so that we can populate the initial STH
+      // (StrictConsistentStore won't allow us to do so unless we're
+      // master.)
+      server->election()->StartElection();
+      server->election()->WaitToBecomeMaster();
+
+      // Do an initial signing run to get the initial STH, again this is
+      // temporary until we re-populate the consistent store from the DB.
+      CHECK_EQ(tree_signer.UpdateTree(), TreeSigner::OK);
+
+      // Need to boot-strap the Serving STH too because we consider it an
+      // error if it's not set, which in turn causes us to not attempt to
+      // become master:
+      server->consistent_store()->SetServingSTH(tree_signer.LatestSTH());
+    });
   }
 
-  server.WaitForReplication();
+  startup.Run("replication", {},
+              bind(&Server::WaitForReplication, server.get()));
+  startup.Finish();
 
   // TODO(pphaneuf): We should be remaining in an "unhealthy state"
   // (either not accepting any requests, or returning some internal
   // server error) until we have an STH to serve.
-  const function<bool()> is_master(bind(&Server::IsMaster, &server));
+  const function<bool()> is_master(bind(&Server::IsMaster, server.get()));
   thread sequencer(&SequenceEntries, &tree_signer, is_master);
-  thread cleanup(&CleanUpEntries, server.consistent_store(), is_master);
-  thread signer(&SignMerkleTree, &tree_signer, server.consistent_store(),
-                server.cluster_state_controller());
+  thread cleanup(&CleanUpEntries, server->consistent_store(), is_master);
+  thread signer(&SignMerkleTree, &tree_signer, server->consistent_store(),
+                server->cluster_state_controller());
 
-  server.Run();
+  server->Run();
 
   return 0;
 }
@@ -16,6 +16,7 @@
 #include "log/log_lookup.h"
 #include "log/log_signer.h"
 #include "log/log_verifier.h"
+#include "log/merkle_node_file.h"
 #include "log/strict_consistent_store.h"
 #include "log/tree_signer.h"
 #include "merkletree/merkle_verifier.h"
@@ -38,6 +39,8 @@ DEFINE_string(trusted_cert_file, "",
 DEFINE_double(guard_window_seconds, 60,
               "Unsequenced entries newer than this "
               "number of seconds will not be sequenced.");
+DECLARE_string(merkle_node_file);
+
 DEFINE_int32(num_http_server_threads, 16,
              "Number of threads for servicing the incoming HTTP requests.");
 // TODO(mhs): Remove this flag when V2 is complete
@@ -159,18 +162,33 @@ int main(int argc, char* argv[]) {
   handler.SetProxy(server.proxy());
   handler.Add(server.http_server());
 
+  unique_ptr<cert_trans::MerkleNodeFile> node_file;
+  if (!FLAGS_merkle_node_file.empty()) {
+    util::StatusOr<unique_ptr<cert_trans::MerkleNodeFile>> opened(
+        cert_trans::MerkleNodeFile::Open(FLAGS_merkle_node_file,
+                                         Sha256Hasher().DigestSize()));
+    CHECK(opened.ok()) << "Cannot open Merkle node file: " << opened.status();
+    node_file = std::move(opened.ValueOrDie());
+  }
+
+  // Pick up from the frontier written by the previous signer if there is
+  // one, which does not depend on the size of the log.
+  unique_ptr<CompactMerkleTree> signer_tree(
+      TreeSigner::LoadCompactMerkleTree(db.get(), new Sha256Hasher));
+  if (!signer_tree) {
+    signer_tree = server.log_lookup()->GetCompactMerkleTree(new Sha256Hasher);
+  }
   TreeSigner tree_signer(
       std::chrono::duration<double>(FLAGS_guard_window_seconds), db.get(),
-      server.log_lookup()->GetCompactMerkleTree(new Sha256Hasher),
-      server.consistent_store(), &log_signer);
+      std::move(signer_tree), server.consistent_store(), &log_signer,
+      node_file.get(), &internal_pool);
 
   if (stand_alone_mode) {
     // Set up a simple single-node environment.
     //
-    // Put a sensible single-node config into FakeEtcd. For a real clustered
-    // log
-    // we'd expect a ClusterConfig already to be present within etcd as part of
-    // the provisioning of the log.
+    // Put a sensible single-node config into the local consistent store.
+    // For a real clustered log we'd expect a ClusterConfig already to be
+    // present within etcd as part of the provisioning of the log.
     //
     // TODO(alcutter): Note that we're currently broken wrt to restarting the
     // log server when there's data in the log.  It's a temporary thing though,
@@ -188,16 +206,8 @@ int main(int argc, char* argv[]) {
     server.election()->StartElection();
     server.election()->WaitToBecomeMaster();
 
-    {
-      EtcdClient::Response resp;
-      util::SyncTask task(event_base.get());
-      etcd_client->Create("/root/sequence_mapping", "", &resp, task.task());
-      task.Wait();
-      CHECK_EQ(::util::OkStatus(), task.status());
-    }
-
     // Do an initial signing run to get the initial STH, again this is
-    // temporary until we re-populate FakeEtcd from the DB.
+    // temporary until we re-populate the consistent store from the DB.
     CHECK_EQ(tree_signer.UpdateTree(), TreeSigner::OK);
 
     // Need to boot-strap the Serving STH too because we consider it an error
@@ -5,7 +5,7 @@
 #include <openssl/evp.h>
 #include <openssl/pem.h>
 
-time_t Services::rough_time_;
+thread_local time_t Services::rough_time_;
 
 FD::FD(EventLoop* loop, int fd, CanDelete deletable)
     : fd_(fd), loop_(loop), wants_erase_(false), deletable_(deletable) {
@@ -242,7 +242,8 @@ void UDPServer::QueuePacket(const sockaddr_in& to, const char* buf,
   write_queue_.push_back(wbuf);
 }
 
-bool Services::InitServer(int* sock, int port, const char* ip, int type) {
+bool Services::InitServer(int* sock, int port, const char* ip, int type,
+                          bool reuse_port) {
   bool ret = false;
   struct sockaddr_in server;
   int s = -1;
@@ -265,6 +266,17 @@ bool Services::InitServer(int* sock, int port, const char* ip, int type) {
   {
     int j = 1;
     setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &j, sizeof j);
+    if (reuse_port) {
+#ifdef SO_REUSEPORT
+      if (setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &j, sizeof j) == -1) {
+        perror("setsockopt(SO_REUSEPORT)");
+        goto err;
+      }
+#else
+      LOG(ERROR) << "SO_REUSEPORT is not supported";
+      goto err;
+#endif
+    }
   }
 
   if (bind(s, (struct sockaddr*)&server, sizeof(server)) == -1) {
@@ -7,6 +7,7 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <time.h>
+#include <atomic>
 #include <deque>
 #include <string>
 
@@ -25,7 +26,11 @@ class Services {
     rough_time_ = 0;
   }
 
-  static bool InitServer(int* sock, int port, const char* ip, int type);
+  // With |reuse_port|, several sockets can be bound to the same port
+  // (with SO_REUSEPORT), and the kernel spreads the traffic between
+  // them.
+  static bool InitServer(int* sock, int port, const char* ip, int type,
+                         bool reuse_port = false);
 
  private:
   // This class is only used as a namespace, it should never be
@@ -33,7 +38,8 @@ class Services {
   // TODO(pphaneuf): Make this into normal functions in a namespace.
   Services();
 
-  static time_t rough_time_;
+  // Per thread, as each event loop samples its own.
+  static thread_local time_t rough_time_;
 };
 
 class EventLoop;
@@ -171,6 +177,8 @@ class EventLoop {
 
   void MaybeDropOne();
 
+  // Can be called from any thread, but a loop running on another one
+  // only notices once its current select() returns.
   void Stop();
 
  private:
@@ -186,7 +194,8 @@ class EventLoop {
   // 0: maybe no-one ever gets a chance to speak.
   static const time_t kIdleTime = 20;
 
-  bool go_;
+  // Can be cleared from another thread, see Stop().
+  std::atomic<bool> go_;
 };
 
 class Server : public FD {
@@ -3,13 +3,21 @@
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <stdint.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+#include <fcntl.h>
 #include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
 #include <algorithm>
-#include <algorithm>
+#include <chrono>
 #include <functional>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "log/cert.h"
@@ -17,12 +25,19 @@
 #include "log/cluster_state_controller.h"
 #include "log/log_lookup.h"
 #include "log/logged_entry.h"
+#include "log/pending_entry_store.h"
 #include "monitoring/latency.h"
 #include "monitoring/monitoring.h"
 #include "server/json_output.h"
+#include "server/pprof.h"
 #include "server/proxy.h"
+#include "server/rate_limiter.h"
+#include "server/request_log.h"
+#include "server/static_exporter.h"
 #include "util/json_wrapper.h"
+#include "util/protobuf_util.h"
 #include "util/thread_pool.h"
+#include "util/util.h"
 
 namespace libevent = cert_trans::libevent;
 
@@ -30,27 +45,101 @@ using cert_trans::Counter;
 using cert_trans::HttpHandler;
 using cert_trans::Latency;
 using cert_trans::LoggedEntry;
+using cert_trans::PreparedJsonReply;
 using cert_trans::Proxy;
+using cert_trans::RateLimiter;
+using cert_trans::RequestLog;
 using cert_trans::ScopedLatency;
+using cert_trans::ServingCache;
+using cert_trans::WriteDelimitedTo;
+using ct::LoggedEntryPB;
 using ct::ShortMerkleAuditProof;
 using ct::SignedCertificateTimestamp;
 using ct::SignedTreeHead;
 using std::bind;
 using std::chrono::milliseconds;
 using std::chrono::seconds;
+using std::chrono::steady_clock;
+using std::function;
 using std::lock_guard;
 using std::make_shared;
+using std::map;
 using std::multimap;
 using std::min;
+using std::move;
 using std::mutex;
 using std::placeholders::_1;
+using std::shared_ptr;
 using std::string;
+using std::unique_lock;
 using std::unique_ptr;
 using std::vector;
 
 DEFINE_int32(max_leaf_entries_per_response, 1000,
              "maximum number of entries to put in the response of a "
              "get-entries request");
+DEFINE_int32(max_get_entries_response_bytes, 0,
+             "size in bytes past which get-entries responses are cut "
+             "short, at the next page boundary (see "
+             "--get_entries_page_alignment). Clients may ask for less "
+             "with the non-standard \"max_bytes\" parameter. 0 means no "
+             "limit other than --max_leaf_entries_per_response");
+DEFINE_int32(get_entries_page_alignment, 64,
+             "number of entries, counted from the start of each range of "
+             "max_leaf_entries_per_response entries, at multiples of "
+             "which get-entries responses cut short by their size end, so "
+             "that the next ones start at the same places, and can be "
+             "cached");
+DEFINE_int32(get_entries_readahead, 64,
+             "number of entries that get-entries requests read from the "
+             "database ahead of encoding them, on a separate thread. 0 "
+             "reads them on the request thread");
+DEFINE_int32(submission_work_weight, 4,
+             "share of the request threads given to add-chain and the "
+             "other requests adding entries when they compete with "
+             "get-entries requests, relative to --read_work_weight");
+DEFINE_int32(read_work_weight, 1,
+             "share of the request threads given to get-entries requests "
+             "when they compete with the requests adding entries");
+DEFINE_int32(max_queued_submissions, 0,
+             "maximum number of requests adding entries waiting for a "
+             "request thread; further ones are answered with 503. 0 means "
+             "no limit");
+DEFINE_int32(max_queued_reads, 256,
+             "maximum number of get-entries requests waiting for a "
+             "request thread; further ones are answered with 503. 0 means "
+             "no limit");
+DEFINE_int32(max_proofs_per_request, 1000,
+             "maximum number of leaf hashes in a get-proofs-by-hash "
+             "request");
+DEFINE_int32(get_sth_consistency_cache_size, 256,
+             "number of get-sth-consistency responses to keep in memory. "
+             "0 disables the cache");
+DEFINE_int32(http_request_deadline_ms, 0,
+             "time after which get-entries and get-proofs-by-hash requests "
+             "still waiting for, or being processed by, a request thread "
+             "are given up on and answered with 503. Requests whose client "
+             "disconnects are given up on regardless. 0 means no deadline");
+DEFINE_string(http_rate_limits, "",
+              "comma-separated per-client request rate limits, as "
+              "<path>=<requests per second>[:<burst>], e.g. "
+              "/ct/v1/get-entries=10:50. Clients over their rate are "
+              "answered with 429");
+DEFINE_string(rate_limit_client_header, "",
+              "request header identifying the client (e.g. an API key) "
+              "for --http_rate_limits. Requests without it, or all of "
+              "them if empty, are told apart by peer address");
+DEFINE_int32(get_entries_cache_size, 16,
+             "number of get-entries responses for whole ranges of "
+             "max_leaf_entries_per_response entries, aligned on that "
+             "number, to keep in memory. 0 disables the cache");
+DEFINE_int32(get_entries_prefetch_ranges, 1,
+             "number of whole ranges of entries read into the get-entries "
+             "response cache ahead of a client asking for the ranges of "
+             "the log one after the other. 0 disables prefetching");
+DEFINE_int32(max_get_entries_prefetches, 4,
+             "maximum number of get-entries ranges being prefetched or "
+             "waiting to be; further ones are not prefetched");
 
 namespace {
 
@@ -59,6 +148,229 @@ static Latency<milliseconds, string> http_server_request_latency_ms(
     "total_http_server_request_latency_ms", "path",
     "Total request latency in ms broken down by path");
 
+static Counter<string>* http_server_throttled_requests(
+    Counter<string>::New("http_server_throttled_requests", "path",
+                         "Number of requests answered with 429 because their "
+                         "client was over its rate limit, by path."));
+
+static Counter<string>* http_server_proxied_requests(
+    Counter<string>::New("http_server_proxied_requests", "path",
+                         "Number of requests proxied to another node "
+                         "because this one was stale, by path."));
+
+static Counter<string>* http_server_stale_local_requests(
+    Counter<string>::New("http_server_stale_local_requests", "path",
+                         "Number of requests answered by this node while it "
+                         "was stale, as it had all they need, by path."));
+
+static Counter<string>* http_server_tree_loading_requests(
+    Counter<string>::New("http_server_tree_loading_requests", "path",
+                         "Number of requests needing the Merkle tree which "
+                         "were proxied to another node, or refused, because "
+                         "this one was still loading it, by path."));
+
+static Counter<string>* http_server_abandoned_requests(
+    Counter<string>::New("http_server_abandoned_requests", "reason",
+                         "Number of requests given up on before they were "
+                         "done, broken down by reason (disconnected or "
+                         "deadline)."));
+
+static Counter<string>* http_server_get_entries_cache_lookups(
+    Counter<string>::New("http_server_get_entries_cache_lookups", "result",
+                         "Number of lookups of whole ranges in the "
+                         "get-entries response cache, broken down by hit or "
+                         "miss, or served from the \"file\" of a bundle "
+                         "exported by --static_export_dir."));
+
+
+static Counter<string>* http_server_get_entries_prefetches(
+    Counter<string>::New("http_server_get_entries_prefetches", "result",
+                         "Number of whole ranges of get-entries considered "
+                         "for prefetching, broken down by result (started, "
+                         "or over_budget)."));
+
+
+// The number of entries get-entries reads from the database at a time.
+const int64_t kGetEntriesBatchSize = 64;
+// The number of whole get-entries ranges asked for which are
+// remembered, to tell when a client goes through them in order.
+const size_t kMaxRecentRanges = 1024;
+
+
+// Appends |prefix| and the base 64 encoding of |value| to |out|.
+void AppendBase64Field(const char* prefix, const string& value,
+                       string* out) {
+  out->append(prefix);
+  util::AppendBase64(value, out);
+}
+
+
+// Compresses |data| in the zlib format, which is what HTTP calls
+// "deflate". The replies go between nodes of the same cluster, so the
+// fastest level is used, which gets most of the gain.
+string Deflate(const string& data) {
+  uLongf size(compressBound(data.size()));
+  string result(size, '\0');
+  CHECK_EQ(Z_OK,
+           compress2(reinterpret_cast<Bytef*>(&result[0]), &size,
+                     reinterpret_cast<const Bytef*>(data.data()),
+                     data.size(), Z_BEST_SPEED));
+  result.resize(size);
+  return result;
+}
+
+
+// Parses --http_rate_limits.
+map<string, unique_ptr<RateLimiter>> ParseRateLimits(const string& limits) {
+  map<string, unique_ptr<RateLimiter>> ret;
+  for (const string& limit : util::split(limits, ',')) {
+    const vector<string> path_rate(util::split(limit, '='));
+    CHECK_EQ(2U, path_rate.size()) << "Invalid rate limit: " << limit;
+    const vector<string> rate_burst(util::split(path_rate[1], ':'));
+    CHECK(rate_burst.size() == 1 || rate_burst.size() == 2)
+        << "Invalid rate limit: " << limit;
+    const double rate(std::stod(rate_burst[0]));
+    CHECK_GT(rate, 0) << "Invalid rate limit: " << limit;
+    const double burst(rate_burst.size() > 1 ? std::stod(rate_burst[1])
+                                             : rate);
+    ret[path_rate[0]].reset(new RateLimiter(rate, burst));
+  }
+  return ret;
+}
+
+
+// The client a request counts against for the rate limits.
+string RateLimitClient(evhttp_request* req) {
+  if (!FLAGS_rate_limit_client_header.empty()) {
+    const char* const client(
+        evhttp_find_header(evhttp_request_get_input_headers(req),
+                           FLAGS_rate_limit_client_header.c_str()));
+    if (client) {
+      return string("key:") + client;
+    }
+  }
+  char* peer_addr;
+  ev_uint16_t peer_port;
+  evhttp_connection_get_peer(evhttp_request_get_connection(req), &peer_addr,
+                             &peer_port);
+  return peer_addr;
+}
+
+
+// The size get-entries responses are cut at, for a client which asked
+// for |client_max_bytes| at most (or -1 if it did not say), or 0 if
+// there is no limit. Clients may only lower the server's.
+int64_t GetEntriesByteBudget(int64_t client_max_bytes) {
+  const int64_t server_max_bytes(
+      std::max(FLAGS_max_get_entries_response_bytes, 0));
+  if (client_max_bytes <= 0) {
+    return server_max_bytes;
+  }
+  return server_max_bytes > 0 ? min(server_max_bytes, client_max_bytes)
+                              : client_max_bytes;
+}
+
+
+// The last entry of the whole aligned range which |start| is in.
+int64_t RangeEnd(int64_t start) {
+  const int64_t range_size(FLAGS_max_leaf_entries_per_response);
+  return start - start % range_size + range_size - 1;
+}
+
+
+// Whether a get-entries response cut short by its size may end before
+// entry |next|. Pages are aligned from the start of their range, so
+// that their boundaries don't depend on where the client started.
+bool IsPageBoundary(int64_t next) {
+  const int64_t range_size(FLAGS_max_leaf_entries_per_response);
+  return next % range_size % std::max(FLAGS_get_entries_page_alignment, 1) ==
+         0;
+}
+
+
+// Whether the rendering of a page of entries as far as |end|, stopped
+// before entry |next| with |size| bytes, has all of the page: it stops
+// at the first missing entry, and is only cut short by |max_bytes| at
+// a page boundary.
+bool IsWholePage(int64_t next, int64_t end, int64_t max_bytes,
+                 size_t size) {
+  return next == end + 1 ||
+         (max_bytes > 0 && static_cast<int64_t>(size) >= max_bytes &&
+          IsPageBoundary(next));
+}
+
+
+// Only whole aligned ranges are cached, as these are what clients
+// fetching the log go through, and the last range of the log is
+// left out until it fills up. With a budget of |max_bytes|, the
+// ranges are cut into pages, which are cached as long as the budget
+// is the server's: each starts at a page boundary, and they are told
+// apart by their start.
+bool IsCacheableRange(int64_t start, int64_t end, int64_t max_bytes) {
+  const int64_t range_size(FLAGS_max_leaf_entries_per_response);
+  if (FLAGS_get_entries_cache_size <= 0 || range_size <= 0) {
+    return false;
+  }
+  if (max_bytes == 0) {
+    return start % range_size == 0 && end == start + range_size - 1;
+  }
+  return max_bytes == FLAGS_max_get_entries_response_bytes &&
+         IsPageBoundary(start) && end == RangeEnd(start);
+}
+
+
+string EntriesCacheKey(int64_t start, bool include_scts) {
+  return "v1/json/entries/" + std::to_string(start) +
+         (include_scts ? "+scts" : "");
+}
+
+
+// The strong validator of the cached page of entries at |start|:
+// logged entries never change, so a page is known by where it starts,
+// and by the server's sizes it is cut at, without being rendered.
+string EntriesETag(int64_t start, bool include_scts) {
+  return "\"entries-" + std::to_string(start) +
+         (include_scts ? "-scts-" : "-") +
+         std::to_string(FLAGS_max_leaf_entries_per_response) + "-" +
+         std::to_string(GetEntriesByteBudget(-1)) + "-" +
+         std::to_string(FLAGS_get_entries_page_alignment) + "\"";
+}
+
+
+shared_ptr<const ServingCache::Reply> NewEntriesReply(int64_t start,
+                                                      bool include_scts,
+                                                      string body) {
+  return make_shared<ServingCache::Reply>(move(body),
+                                          EntriesETag(start, include_scts));
+}
+
+
+// The strong validator of the get-sth reply for |sth|: the log signs
+// no two STHs with the same timestamp.
+string STHETag(const SignedTreeHead& sth) {
+  return "\"sth-" + std::to_string(sth.timestamp()) + "-" +
+         std::to_string(sth.tree_size()) + "-" +
+         util::HexString(sth.sha256_root_hash()) + "\"";
+}
+
+
+string HttpDate(time_t time) {
+  struct tm tm;
+  CHECK_NOTNULL(gmtime_r(&time, &tm));
+  char date[64];
+  CHECK_GT(strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm),
+           0U);
+  return date;
+}
+
+
+// Returns -1 if |date| is not an HTTP date in the preferred format.
+time_t ParseHttpDate(const char* date) {
+  struct tm tm = {};
+  const char* const end(strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm));
+  return end && *end == '\0' ? timegm(&tm) : -1;
+}
+
 
 }  // namespace
 
@@ -66,18 +378,39 @@ static Latency<milliseconds, string> http_server_request_latency_ms(
 HttpHandler::HttpHandler(LogLookup* log_lookup, const ReadOnlyDatabase* db,
                          const ClusterStateController* controller,
                          ThreadPool* pool, libevent::Base* event_base,
-                         StalenessTracker* staleness_tracker)
+                         StalenessTracker* staleness_tracker,
+                         ThreadPool* read_pool)
     : log_lookup_(CHECK_NOTNULL(log_lookup)),
       db_(CHECK_NOTNULL(db)),
-      controller_(CHECK_NOTNULL(controller)),
+      controller_(controller),
       proxy_(nullptr),
+      request_log_(nullptr),
+      static_exporter_(nullptr),
+      pending_entry_store_(nullptr),
+      server_(nullptr),
       pool_(CHECK_NOTNULL(pool)),
+      read_pool_(read_pool ? read_pool : pool_),
       event_base_(CHECK_NOTNULL(event_base)),
-      staleness_tracker_(CHECK_NOTNULL(staleness_tracker)) {
+      staleness_tracker_(staleness_tracker),
+      submission_class_(pool_->AddWorkClass(
+          "submission", FLAGS_submission_work_weight,
+          std::max(FLAGS_max_queued_submissions, 0))),
+      read_class_(read_pool_->AddWorkClass(
+          "read", FLAGS_read_work_weight,
+          std::max(FLAGS_max_queued_reads, 0))),
+      prefetch_class_(read_pool_->AddWorkClass(
+          "prefetch", 1, std::max(FLAGS_max_get_entries_prefetches, 1))),
+      rate_limiters_(ParseRateLimits(FLAGS_http_rate_limits)),
+      sth_reply_timestamp_(0),
+      serving_cache_(std::max(FLAGS_get_entries_cache_size, 0),
+                     std::max(FLAGS_get_sth_consistency_cache_size, 0)) {
 }
 
 
 HttpHandler::~HttpHandler() {
+  // The prefetches refer to this instance.
+  unique_lock<mutex> lock(prefetch_lock_);
+  prefetch_done_.wait(lock, [this]() { return prefetching_.empty(); });
 }
 
 
@@ -91,6 +424,14 @@ void StatsHandlerInterceptor(const string& path,
 }
 
 
+void RequestLogInterceptor(RequestLog* request_log,
+                           const libevent::HttpServer::HandlerCallback& cb,
+                           evhttp_request* req) {
+  request_log->RequestStarted(req);
+  cb(req);
+}
+
+
 void HttpHandler::AddEntryReply(evhttp_request* req,
                                 const util::Status& add_status,
                                 const SignedCertificateTimestamp& sct) const {
@@ -106,23 +447,82 @@ void HttpHandler::AddEntryReply(evhttp_request* req,
   }
 
   JsonObject json_reply;
-  json_reply.Add("sct_version", static_cast<int64_t>(0));
-  json_reply.AddBase64("id", sct.id().key_id());
-  json_reply.Add("timestamp", sct.timestamp());
-  json_reply.Add("extensions", "");
-  json_reply.Add("signature", sct.signature());
+  AddSctFields(sct, &json_reply);
 
   SendJsonReply(event_base_, req, HTTP_OK, json_reply);
 }
 
+// static
+void HttpHandler::AddSctFields(const SignedCertificateTimestamp& sct,
+                               JsonObject* reply) {
+  reply->Add("sct_version", static_cast<int64_t>(0));
+  reply->AddBase64("id", sct.id().key_id());
+  reply->Add("timestamp", sct.timestamp());
+  reply->Add("extensions", "");
+  reply->Add("signature", sct.signature());
+}
+
+bool HttpHandler::AddWork(ThreadPool* pool, int work_class,
+                          evhttp_request* req,
+                          const std::function<void()>& closure) const {
+  if (!pool->TryAdd(work_class, closure)) {
+    SendJsonError(event_base_, req, HTTP_SERVUNAVAIL,
+                  "Too many pending requests.");
+    return false;
+  }
+  return true;
+}
+
+
+bool HttpHandler::RequestLiveness::Abandoned() const {
+  return (connection_closed && connection_closed->load()) ||
+         steady_clock::now() > deadline;
+}
+
+
+HttpHandler::RequestLiveness HttpHandler::Liveness(
+    evhttp_request* req) const {
+  RequestLiveness liveness;
+  liveness.deadline =
+      FLAGS_http_request_deadline_ms > 0
+          ? steady_clock::now() +
+                milliseconds(FLAGS_http_request_deadline_ms)
+          : steady_clock::time_point::max();
+
+  liveness.connection_closed = CHECK_NOTNULL(server_)->ConnectionClosed(req);
+
+  return liveness;
+}
+
+
+bool HttpHandler::StopIfAbandoned(evhttp_request* req,
+                                  const RequestLiveness& liveness) const {
+  if (!liveness.Abandoned()) {
+    return false;
+  }
+
+  const bool disconnected(liveness.connection_closed &&
+                          liveness.connection_closed->load());
+  http_server_abandoned_requests->Increment(disconnected ? "disconnected"
+                                                         : "deadline");
+  SendJsonError(event_base_, req, HTTP_SERVUNAVAIL, "Request abandoned.");
+  return true;
+}
+
+
 void HttpHandler::ProxyInterceptor(
+    const string& path, const AnswerableWhenStale& answerable,
     const libevent::HttpServer::HandlerCallback& local_handler,
     evhttp_request* request) {
   VLOG(2) << "Running proxy interceptor...";
-  // TODO(alcutter): We can be a bit smarter about when to proxy off
-  // the request - being stale wrt to the current serving STH doesn't
-  // automatically mean we're unable to answer this request.
-  if (staleness_tracker_->IsNodeStale()) {
+  if (staleness_tracker_ && staleness_tracker_->IsNodeStale()) {
+    // Being stale with respect to the serving STH does not mean that
+    // this node lacks what this request needs.
+    if (answerable && answerable(request)) {
+      http_server_stale_local_requests->Increment(path);
+      return local_handler(request);
+    }
+    http_server_proxied_requests->Increment(path);
     // Can't do this on the libevent thread since it can block on the lock in
     // ClusterStatusController::GetFreshNodes().
     pool_->Add(bind(&Proxy::ProxyRequest, proxy_, request));
@@ -132,29 +532,144 @@ void HttpHandler::ProxyInterceptor(
 }
 
 
+void HttpHandler::TreeLoadingInterceptor(
+    const string& path,
+    const libevent::HttpServer::HandlerCallback& local_handler,
+    evhttp_request* request) {
+  if (log_lookup_->Loaded()) {
+    return local_handler(request);
+  }
+
+  http_server_tree_loading_requests->Increment(path);
+  if (!proxy_) {
+    return SendJsonError(event_base_, request, HTTP_SERVUNAVAIL,
+                         "Merkle tree still loading.");
+  }
+  pool_->Add(bind(&Proxy::ProxyRequest, proxy_, request));
+}
+
+
+void HttpHandler::RateLimitInterceptor(
+    RateLimiter* limiter, const string& path,
+    const libevent::HttpServer::HandlerCallback& local_handler,
+    evhttp_request* request) const {
+  seconds retry_after;
+  if (limiter->Allow(RateLimitClient(request), &retry_after)) {
+    return local_handler(request);
+  }
+
+  http_server_throttled_requests->Increment(path);
+  CHECK_EQ(evhttp_add_header(evhttp_request_get_output_headers(request),
+                             "Retry-After",
+                             std::to_string(retry_after.count()).c_str()),
+           0);
+  SendJsonError(event_base_, request, 429, "Too many requests.");
+}
+
+
 void HttpHandler::AddProxyWrappedHandler(
     libevent::HttpServer* server, const string& path,
-    const libevent::HttpServer::HandlerCallback& local_handler) {
+    const libevent::HttpServer::HandlerCallback& local_handler,
+    size_t max_body_size, const AnswerableWhenStale& answerable) {
+  const string full_path(path_prefix_ + path);
   const libevent::HttpServer::HandlerCallback stats_handler(
-      bind(&StatsHandlerInterceptor, path, local_handler, _1));
-  CHECK(server->AddHandler(path, bind(&HttpHandler::ProxyInterceptor, this,
-                                      stats_handler, _1)));
+      bind(&StatsHandlerInterceptor, full_path, local_handler, _1));
+  libevent::HttpServer::HandlerCallback handler(
+      bind(&HttpHandler::ProxyInterceptor, this, full_path, answerable,
+           stats_handler, _1));
+  // Proxied requests count against the limits too. The limits of a
+  // path apply to it under any prefix, each log on its own.
+  const auto limiter(rate_limiters_.find(path));
+  if (limiter != rate_limiters_.end()) {
+    handler = bind(&HttpHandler::RateLimitInterceptor, this,
+                   limiter->second.get(), full_path, handler, _1);
+  }
+  // Throttled requests are logged too, being part of the load.
+  if (request_log_) {
+    handler = bind(&RequestLogInterceptor, request_log_, handler, _1);
+  }
+  CHECK(server->AddHandler(full_path, handler, max_body_size));
 }
 
 
-void HttpHandler::Add(libevent::HttpServer* server) {
+void HttpHandler::AddTreeProxyWrappedHandler(
+    libevent::HttpServer* server, const string& path,
+    const libevent::HttpServer::HandlerCallback& local_handler,
+    const AnswerableWhenStale& answerable) {
+  AddProxyWrappedHandler(server, path,
+                         bind(&HttpHandler::TreeLoadingInterceptor, this,
+                              path_prefix_ + path, local_handler, _1),
+                         0 /* max_body_size */, answerable);
+}
+
+
+bool HttpHandler::HasEntries(evhttp_request* req) const {
+  const libevent::QueryParams query(libevent::ParseQuery(req));
+  const int64_t start(libevent::GetIntParam(query, "start"));
+  const int64_t end(libevent::GetIntParam(query, "end"));
+  // Invalid ranges are refused just the same by any node.
+  if (start < 0 || end < start) {
+    return true;
+  }
+  return std::min(end, start + FLAGS_max_leaf_entries_per_response) <
+         db_->TreeSize();
+}
+
+
+bool HttpHandler::HasTreeSize(const string& param, evhttp_request* req) const {
+  const int64_t tree_size(
+      libevent::GetIntParam(libevent::ParseQuery(req), param));
+  return tree_size >= 0 && tree_size <= log_lookup_->GetSTH().tree_size();
+}
+
+
+void HttpHandler::Add(libevent::HttpServer* server,
+                      const string& path_prefix) {
   CHECK_NOTNULL(server);
-  // TODO(pphaneuf): An optional prefix might be nice?
+  CHECK(path_prefix.empty() ||
+        (path_prefix[0] == '/' && path_prefix.back() != '/'))
+      << "Invalid path prefix: " << path_prefix;
+  CHECK(!server_ || server_ == server) << "Added to several servers";
+  server_ = server;
+  path_prefix_ = path_prefix;
   // TODO(pphaneuf): Find out which methods are CPU intensive enough
   // that they should be spun off to the thread pool.
+  // The entries and the STH only need the database, so they are served
+  // while the tree loads, unlike the proofs. A stale node still answers
+  // the requests for the entries and tree sizes it has.
+  const AnswerableWhenStale has_entries(
+      bind(&HttpHandler::HasEntries, this, _1));
   AddProxyWrappedHandler(server, "/ct/v1/get-entries",
-                         bind(&HttpHandler::GetEntries, this, _1));
-  AddProxyWrappedHandler(server, "/ct/v1/get-proof-by-hash",
-                         bind(&HttpHandler::GetProof, this, _1));
+                         bind(&HttpHandler::GetEntries, this, _1),
+                         0 /* max_body_size */, has_entries);
+  AddProxyWrappedHandler(server, "/ct/v1/get-entries-binary",
+                         bind(&HttpHandler::GetEntriesBinary, this, _1),
+                         0 /* max_body_size */, has_entries);
+  AddTreeProxyWrappedHandler(
+      server, "/ct/v1/get-proof-by-hash",
+      bind(&HttpHandler::GetProof, this, _1),
+      bind(&HttpHandler::HasTreeSize, this, "tree_size", _1));
+  AddTreeProxyWrappedHandler(server, "/ct/v1/get-proofs-by-hash",
+                             bind(&HttpHandler::GetProofs, this, _1));
   AddProxyWrappedHandler(server, "/ct/v1/get-sth",
                          bind(&HttpHandler::GetSTH, this, _1));
-  AddProxyWrappedHandler(server, "/ct/v1/get-sth-consistency",
-                         bind(&HttpHandler::GetConsistency, this, _1));
+  AddTreeProxyWrappedHandler(
+      server, "/ct/v1/get-sth-consistency",
+      bind(&HttpHandler::GetConsistency, this, _1),
+      bind(&HttpHandler::HasTreeSize, this, "second", _1));
+  if (pending_entry_store_) {
+    // Where the other nodes look for it, whatever the prefix.
+    const string path("/ct/v1/x-get-pending-entry");
+    CHECK(server->AddHandler(
+        path,
+        bind(&StatsHandlerInterceptor, path,
+             libevent::HttpServer::HandlerCallback(
+                 bind(&HttpHandler::GetPendingEntry, this, _1)),
+             _1)));
+  }
+  if (path_prefix_.empty()) {
+    AddPprofHandlers(server, event_base_);
+  }
 
   // Now add any sub-class handlers.
   AddHandlers(server);
@@ -167,6 +682,21 @@ void HttpHandler::SetProxy(Proxy* proxy) {
 }
 
 
+void HttpHandler::SetRequestLog(RequestLog* request_log) {
+  request_log_ = CHECK_NOTNULL(request_log);
+}
+
+
+void HttpHandler::SetStaticExporter(const StaticExporter* exporter) {
+  static_exporter_ = CHECK_NOTNULL(exporter);
+}
+
+
+void HttpHandler::SetPendingEntryStore(const PendingEntryStore* store) {
+  pending_entry_store_ = CHECK_NOTNULL(store);
+}
+
+
 void HttpHandler::GetEntries(evhttp_request* req) const {
   if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
     return SendJsonError(event_base_, req, HTTP_BADMETHOD,
@@ -175,27 +705,80 @@ void HttpHandler::GetEntries(evhttp_request* req) const {
 
   const libevent::QueryParams query(libevent::ParseQuery(req));
 
-  const int64_t start(libevent::GetIntParam(query, "start"));
-  if (start < 0) {
-    return SendJsonError(event_base_, req, HTTP_BADREQUEST,
-                         "Missing or invalid \"start\" parameter.");
-  }
-
-  int64_t end(libevent::GetIntParam(query, "end"));
-  if (end < start) {
-    return SendJsonError(event_base_, req, HTTP_BADREQUEST,
-                         "Missing or invalid \"end\" parameter.");
+  int64_t start, end, max_bytes;
+  if (!GetEntriesRange(req, query, &start, &end, &max_bytes)) {
+    return;
   }
 
-  // Limit the number of entries returned in a single request.
-  end = std::min(end, start + FLAGS_max_leaf_entries_per_response);
-
   // Sekrit parameter to indicate that SCTs should be included too.
   // This is non-standard, and is only used internally by other log nodes when
   // "following" nodes with more data.
   const bool include_scts(libevent::GetBoolParam(query, "include_scts"));
 
-  BlockingGetEntries(req, start, end, include_scts);
+  // Clients going through the log again ask for the pages they have,
+  // which can be answered without reading them.
+  if (IsCacheableRange(start, end, max_bytes) && end < db_->TreeSize() &&
+      SendNotModified(req, EntriesETag(start, include_scts))) {
+    return;
+  }
+
+  AddWork(read_pool_, read_class_, req,
+          bind(&HttpHandler::BlockingGetEntries, this, req, Liveness(req),
+               start, end, include_scts, max_bytes));
+}
+
+
+void HttpHandler::GetEntriesBinary(evhttp_request* req) const {
+  if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
+    return SendJsonError(event_base_, req, HTTP_BADMETHOD,
+                         "Method not allowed.");
+  }
+
+  const libevent::QueryParams query(libevent::ParseQuery(req));
+
+  int64_t start, end, max_bytes;
+  if (!GetEntriesRange(req, query, &start, &end, &max_bytes)) {
+    return;
+  }
+
+  AddWork(read_pool_, read_class_, req,
+          bind(&HttpHandler::BlockingGetEntriesBinary, this, req,
+               Liveness(req), start, end, max_bytes,
+               libevent::GetBoolParam(query, "include_scts"),
+               libevent::GetBoolParam(query, "compress")));
+}
+
+
+bool HttpHandler::GetEntriesRange(evhttp_request* req,
+                                  const libevent::QueryParams& query,
+                                  int64_t* start, int64_t* end,
+                                  int64_t* max_bytes) const {
+  *start = libevent::GetIntParam(query, "start");
+  if (*start < 0) {
+    SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                  "Missing or invalid \"start\" parameter.");
+    return false;
+  }
+
+  *end = libevent::GetIntParam(query, "end");
+  if (*end < *start) {
+    SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                  "Missing or invalid \"end\" parameter.");
+    return false;
+  }
+
+  // Limit the number of entries returned in a single request.
+  *end = std::min(*end, *start + FLAGS_max_leaf_entries_per_response);
+
+  // Non-standard: clients which can't take large responses may ask for
+  // smaller ones. Those cut short by their size don't go past the end
+  // of the range, so that the next one starts on a page boundary.
+  *max_bytes = GetEntriesByteBudget(libevent::GetIntParam(query, "max_bytes"));
+  if (*max_bytes > 0) {
+    *end = std::min(*end, RangeEnd(*start));
+  }
+
+  return true;
 }
 
 
@@ -245,25 +828,169 @@ void HttpHandler::GetProof(evhttp_request* req) const {
 }
 
 
+void HttpHandler::GetProofs(evhttp_request* req) const {
+  if (evhttp_request_get_command(req) != EVHTTP_REQ_POST) {
+    return SendJsonError(event_base_, req, HTTP_BADMETHOD,
+                         "Method not allowed.");
+  }
+
+  AddWork(read_pool_, read_class_, req,
+          bind(&HttpHandler::BlockingGetProofs, this, req, Liveness(req)));
+}
+
+
+void HttpHandler::BlockingGetProofs(evhttp_request* req,
+                                    const RequestLiveness& liveness) const {
+  if (StopIfAbandoned(req, liveness)) {
+    return;
+  }
+
+  JsonObject json_body(evhttp_request_get_input_buffer(req));
+  if (!json_body.Ok() || !json_body.IsType(json_type_object)) {
+    return SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                         "Unable to parse provided JSON.");
+  }
+
+  JsonInt json_tree_size(json_body, "tree_size");
+  if (!json_tree_size.Ok() || json_tree_size.Value() < 0 ||
+      json_tree_size.Value() > log_lookup_->GetSTH().tree_size()) {
+    return SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                         "Missing or invalid \"tree_size\" parameter.");
+  }
+
+  JsonArray json_hashes(json_body, "hashes");
+  if (!json_hashes.Ok()) {
+    return SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                         "Missing or invalid \"hashes\" parameter.");
+  }
+  if (json_hashes.Length() > FLAGS_max_proofs_per_request) {
+    return SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                         "Too many hashes.");
+  }
+
+  vector<string> hashes;
+  for (int i = 0; i < json_hashes.Length(); ++i) {
+    JsonString json_hash(json_hashes, i);
+    hashes.push_back(json_hash.Ok() ? json_hash.FromBase64() : "");
+    if (hashes.back().empty()) {
+      return SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                           "Invalid \"hashes\" parameter.");
+    }
+  }
+
+  vector<ShortMerkleAuditProof> proofs;
+  const vector<LogLookup::LookupResult> results(log_lookup_->AuditProofs(
+      hashes, json_tree_size.Value(), &proofs));
+
+  // The paths of leaves near each other share most of their nodes, so
+  // each node is sent once, in "nodes", and the paths are made of
+  // indices into it.
+  std::unordered_map<string, int64_t> node_indices;
+  JsonArray json_nodes;
+  JsonArray json_proofs;
+  for (size_t i = 0; i < proofs.size(); ++i) {
+    JsonObject json_proof;
+    if (results[i] != LogLookup::OK) {
+      json_proof.Add("error_message", "Couldn't find hash.");
+      json_proofs.Add(&json_proof);
+      continue;
+    }
+
+    JsonArray json_path;
+    for (const string& node : proofs[i].path_node()) {
+      const auto inserted(node_indices.emplace(node, node_indices.size()));
+      if (inserted.second) {
+        json_nodes.AddBase64(node);
+      }
+      json_path.Add(inserted.first->second);
+    }
+    json_proof.Add("leaf_index", proofs[i].leaf_index());
+    json_proof.Add("audit_path", json_path);
+    json_proofs.Add(&json_proof);
+  }
+
+  JsonObject json_reply;
+  json_reply.Add("nodes", json_nodes);
+  json_reply.Add("proofs", json_proofs);
+
+  SendJsonReply(event_base_, req, HTTP_OK, json_reply);
+}
+
+
 void HttpHandler::GetSTH(evhttp_request* req) const {
   if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
     return SendJsonError(event_base_, req, HTTP_BADMETHOD,
                          "Method not allowed.");
   }
 
-  const SignedTreeHead& sth(log_lookup_->GetSTH());
+  // While the tree loads, the database already has the STH it is for.
+  SignedTreeHead sth(log_lookup_->GetSTH());
+  SignedTreeHead db_sth;
+  if (!log_lookup_->Loaded() &&
+      db_->LatestTreeHead(&db_sth) == ReadOnlyDatabase::LOOKUP_OK) {
+    sth.Swap(&db_sth);
+  }
 
   VLOG(2) << "SignedTreeHead:\n" << sth.DebugString();
 
-  JsonObject json_reply;
-  json_reply.Add("tree_size", sth.tree_size());
-  json_reply.Add("timestamp", sth.timestamp());
-  json_reply.AddBase64("sha256_root_hash", sth.sha256_root_hash());
-  json_reply.Add("tree_head_signature", sth.signature());
+  // Monitors poll for new STHs, and mostly get the one they have.
+  const string etag(STHETag(sth));
+  const time_t last_modified(sth.timestamp() / 1000);
+  CHECK_EQ(evhttp_add_header(evhttp_request_get_output_headers(req),
+                             "Last-Modified",
+                             HttpDate(last_modified).c_str()),
+           0);
+  if (SendNotModified(req, etag, last_modified)) {
+    return;
+  }
 
-  VLOG(2) << "GetSTH:\n" << json_reply.DebugString();
+  shared_ptr<const ServingCache::Reply> reply;
+  {
+    lock_guard<mutex> lock(sth_reply_lock_);
+    // Every new STH has a later timestamp.
+    if (!sth_reply_ || sth_reply_timestamp_ != sth.timestamp()) {
+      JsonObject json_reply;
+      json_reply.Add("tree_size", sth.tree_size());
+      json_reply.Add("timestamp", sth.timestamp());
+      json_reply.AddBase64("sha256_root_hash", sth.sha256_root_hash());
+      json_reply.Add("tree_head_signature", sth.signature());
+
+      VLOG(2) << "GetSTH:\n" << json_reply.DebugString();
+
+      sth_reply_ = make_shared<ServingCache::Reply>(json_reply.ToString(),
+                                                    etag);
+      sth_reply_timestamp_ = sth.timestamp();
+    }
+    reply = sth_reply_;
+  }
 
-  SendJsonReply(event_base_, req, HTTP_OK, json_reply);
+  SendCachedReply(req, reply);
+}
+
+
+void HttpHandler::GetPendingEntry(evhttp_request* req) const {
+  if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
+    return SendJsonError(event_base_, req, HTTP_BADMETHOD,
+                         "Method not allowed.");
+  }
+
+  const libevent::QueryParams query(libevent::ParseQuery(req));
+  string b64_hash;
+  if (!libevent::GetParam(query, "hash", &b64_hash)) {
+    return SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                         "Missing or invalid \"hash\" parameter.");
+  }
+
+  const shared_ptr<const LoggedEntry> entry(
+      pending_entry_store_->Lookup(util::FromBase64(b64_hash.c_str())));
+  if (!entry) {
+    return SendJsonError(event_base_, req, HTTP_NOTFOUND,
+                         "Pending entry not found.");
+  }
+
+  string body;
+  CHECK(entry->SerializeToString(&body));
+  SendReply(event_base_, req, HTTP_OK, "application/octet-stream", body);
 }
 
 
@@ -287,66 +1014,405 @@ void HttpHandler::GetConsistency(evhttp_request* req) const {
                          "Missing or invalid \"second\" parameter.");
   }
 
-  const vector<string> consistency(
-      log_lookup_->ConsistencyProof(first, second));
-  JsonArray json_cons;
-  for (vector<string>::const_iterator it = consistency.begin();
-       it != consistency.end(); ++it) {
-    json_cons.AddBase64(*it);
-  }
+  // The proofs between sizes the tree has reached never change, so
+  // the replies for these are kept.
+  const bool cacheable(FLAGS_get_sth_consistency_cache_size > 0 &&
+                       second <= log_lookup_->GetSTH().tree_size());
+  const string cache_key("v1/json/consistency/" + std::to_string(first) +
+                         "," + std::to_string(second));
+  shared_ptr<const ServingCache::Reply> reply(
+      cacheable ? serving_cache_.GetProof(cache_key) : nullptr);
+
+  if (!reply) {
+    const vector<string> consistency(
+        log_lookup_->ConsistencyProof(first, second));
+    JsonArray json_cons;
+    for (vector<string>::const_iterator it = consistency.begin();
+         it != consistency.end(); ++it) {
+      json_cons.AddBase64(*it);
+    }
 
-  JsonObject json_reply;
-  json_reply.Add("consistency", json_cons);
+    JsonObject json_reply;
+    json_reply.Add("consistency", json_cons);
 
-  SendJsonReply(event_base_, req, HTTP_OK, json_reply);
+    reply = make_shared<ServingCache::Reply>(json_reply.ToString(), "");
+    if (cacheable) {
+      serving_cache_.AddProof(cache_key, reply);
+    }
+  }
+
+  SendJsonReply(event_base_, req, HTTP_OK,
+                shared_ptr<const PreparedJsonReply>(reply, &reply->prepared));
 }
 
 
-void HttpHandler::BlockingGetEntries(evhttp_request* req, int64_t start,
-                                     int64_t end, bool include_scts) const {
-  JsonArray json_entries;
-  auto it(db_->ScanEntries(start));
-  for (int64_t i = start; i <= end; ++i) {
-    LoggedEntry entry;
+void HttpHandler::BlockingGetEntries(evhttp_request* req,
+                                     const RequestLiveness& liveness,
+                                     int64_t start, int64_t end,
+                                     bool include_scts,
+                                     int64_t max_bytes) const {
+  if (StopIfAbandoned(req, liveness)) {
+    return;
+  }
+
+  // The exported bundles are without the SCTs, and are whole ranges.
+  if (!include_scts && max_bytes == 0 &&
+      SendStaticEntries(req, start, end)) {
+    return;
+  }
 
-    if (!it->GetNextEntry(&entry) || entry.sequence_number() != i) {
-      break;
+  const bool cacheable(IsCacheableRange(start, end, max_bytes));
+  const string cache_key(cacheable ? EntriesCacheKey(start, include_scts)
+                                   : "");
+  if (cacheable) {
+    // Ranges are prefetched as far as their first page.
+    if (start % FLAGS_max_leaf_entries_per_response == 0) {
+      PrefetchEntriesAfter(start, include_scts);
     }
+    const shared_ptr<const ServingCache::Reply> cached(
+        serving_cache_.GetEntries(cache_key));
+    http_server_get_entries_cache_lookups->Increment(cached ? "hit"
+                                                            : "miss");
+    if (cached) {
+      return SendCachedReply(req, cached);
+    }
+  }
+
+  string body;
+  int64_t next;
+  const util::Status status(RenderEntries(
+      start, end, include_scts, max_bytes,
+      [this, req, &liveness]() { return StopIfAbandoned(req, liveness); },
+      &body, &next));
+  if (status.CanonicalCode() == util::error::CANCELLED) {
+    return;
+  }
+  if (!status.ok()) {
+    return SendJsonError(event_base_, req, HTTP_INTERNAL,
+                         "Serialization failed.");
+  }
+
+  if (next == start) {
+    return SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                         "Entry not found.");
+  }
 
-    string leaf_input;
-    string extra_data;
-    string sct_data;
-    if (!entry.SerializeForLeaf(&leaf_input) ||
-        !entry.SerializeExtraData(&extra_data) ||
-        (include_scts &&
-         Serializer::SerializeSCT(entry.sct(), &sct_data) !=
-             cert_trans::serialization::SerializeResult::OK)) {
-      LOG(WARNING) << "Failed to serialize entry @ " << i << ":\n"
-                   << entry.DebugString();
-      return SendJsonError(event_base_, req, HTTP_INTERNAL,
-                           "Serialization failed.");
+  if (cacheable && IsWholePage(next, end, max_bytes, body.size())) {
+    const shared_ptr<const ServingCache::Reply> cached(
+        NewEntriesReply(start, include_scts, move(body)));
+    serving_cache_.AddEntries(cache_key, cached);
+    return SendCachedReply(req, cached);
+  }
+
+  SendJsonReply(event_base_, req, HTTP_OK, body);
+}
+
+
+util::Status HttpHandler::RenderEntries(int64_t start, int64_t end,
+                                        bool include_scts, int64_t max_bytes,
+                                        const function<bool()>& stop,
+                                        string* body, int64_t* next) const {
+  ReadOnlyDatabase::ScanOptions scan_options;
+  scan_options.readahead = std::max(FLAGS_get_entries_readahead, 0);
+  auto it(db_->ScanEntries(start, end + 1, scan_options));
+
+  // The reply is written out as the entries are read, rather than
+  // through a JSON object tree, which would hold a few copies of it.
+  body->append("{\"entries\":[");
+  string leaf_input;
+  string extra_data;
+  string sct_data;
+  vector<LoggedEntry> entries;
+  int64_t i(start);
+  bool contiguous(true);
+  bool full(false);
+  while (contiguous && !full && i <= end &&
+         it->GetNextEntries(std::min<int64_t>(end - i + 1,
+                                              kGetEntriesBatchSize),
+                            &entries) > 0) {
+    if (stop()) {
+      return util::Status::CANCELLED;
     }
+    for (const LoggedEntry& entry : entries) {
+      if (entry.sequence_number() != i) {
+        contiguous = false;
+        break;
+      }
+
+      // Cleared rather than declared here, to reuse their buffers.
+      leaf_input.clear();
+      extra_data.clear();
+      sct_data.clear();
+      if (!entry.SerializeForServing(&leaf_input, &extra_data,
+                                     include_scts ? &sct_data : nullptr)) {
+        LOG(WARNING) << "Failed to serialize entry @ " << i << ":\n"
+                     << entry.DebugString();
+        return util::Status(util::error::INTERNAL, "Serialization failed.");
+      }
+
+      if (i > start) {
+        body->push_back(',');
+      }
+      AppendBase64Field("{\"leaf_input\":\"", leaf_input, body);
+      AppendBase64Field("\",\"extra_data\":\"", extra_data, body);
+      if (include_scts) {
+        // This is non-standard for this implementation, and is currently
+        // only used by other nodes when "following" to fetch data from
+        // each other:
+        AppendBase64Field("\",\"sct\":\"", sct_data, body);
+      }
+      body->append("\"}");
+      ++i;
+
+      // Counting the closing "]}".
+      if (max_bytes > 0 &&
+          static_cast<int64_t>(body->size()) + 2 >= max_bytes &&
+          IsPageBoundary(i)) {
+        full = true;
+        break;
+      }
+    }
+  }
+  body->append("]}");
+  *next = i;
+  return ::util::OkStatus();
+}
 
-    JsonObject json_entry;
-    json_entry.AddBase64("leaf_input", leaf_input);
-    json_entry.AddBase64("extra_data", extra_data);
 
-    if (include_scts) {
-      // This is non-standard for this implementation, and is currently only
-      // used by other nodes when "following" to fetch data from each other:
-      json_entry.AddBase64("sct", sct_data);
+void HttpHandler::PrefetchEntriesAfter(int64_t start,
+                                       bool include_scts) const {
+  if (FLAGS_get_entries_prefetch_ranges <= 0) {
+    return;
+  }
+  const int64_t range_size(FLAGS_max_leaf_entries_per_response);
+  {
+    lock_guard<mutex> lock(prefetch_lock_);
+    const string key(EntriesCacheKey(start, include_scts));
+    const bool sequential(recent_ranges_set_.count(EntriesCacheKey(
+                              start - range_size, include_scts)) > 0);
+    if (recent_ranges_set_.insert(key).second) {
+      recent_ranges_.push_back(key);
+      if (recent_ranges_.size() > kMaxRecentRanges) {
+        recent_ranges_set_.erase(recent_ranges_.front());
+        recent_ranges_.pop_front();
+      }
     }
+    if (!sequential) {
+      return;
+    }
+  }
 
-    json_entries.Add(&json_entry);
+  const int64_t tree_size(db_->TreeSize());
+  for (int64_t range = 1; range <= FLAGS_get_entries_prefetch_ranges;
+       ++range) {
+    const int64_t range_start(start + range * range_size);
+    // Only whole ranges are cached.
+    if (range_start + range_size > tree_size) {
+      return;
+    }
+    const string key(EntriesCacheKey(range_start, include_scts));
+    if (serving_cache_.GetEntries(key)) {
+      continue;
+    }
+    {
+      lock_guard<mutex> lock(prefetch_lock_);
+      if (!prefetching_.insert(key).second) {
+        continue;
+      }
+    }
+    if (!read_pool_->TryAdd(prefetch_class_,
+                            bind(&HttpHandler::PrefetchEntries, this,
+                                 range_start, include_scts, key))) {
+      http_server_get_entries_prefetches->Increment("over_budget");
+      lock_guard<mutex> lock(prefetch_lock_);
+      prefetching_.erase(key);
+      prefetch_done_.notify_all();
+      return;
+    }
+    http_server_get_entries_prefetches->Increment("started");
   }
+}
+
 
-  if (json_entries.Length() < 1) {
+void HttpHandler::PrefetchEntries(int64_t start, bool include_scts,
+                                  const string& cache_key) const {
+  const int64_t end(start + FLAGS_max_leaf_entries_per_response - 1);
+  // Pages are only cached for the server's budget.
+  const int64_t max_bytes(GetEntriesByteBudget(-1));
+  string body;
+  int64_t next;
+  if (RenderEntries(start, end, include_scts, max_bytes,
+                    []() { return false; }, &body, &next)
+          .ok() &&
+      IsWholePage(next, end, max_bytes, body.size())) {
+    serving_cache_.AddEntries(cache_key,
+                              NewEntriesReply(start, include_scts,
+                                              move(body)));
+  }
+
+  lock_guard<mutex> lock(prefetch_lock_);
+  prefetching_.erase(cache_key);
+  prefetch_done_.notify_all();
+}
+
+
+void HttpHandler::BlockingGetEntriesBinary(evhttp_request* req,
+                                           const RequestLiveness& liveness,
+                                           int64_t start, int64_t end,
+                                           int64_t max_bytes,
+                                           bool include_scts,
+                                           bool compress) const {
+  if (StopIfAbandoned(req, liveness)) {
+    return;
+  }
+
+  ReadOnlyDatabase::ScanOptions scan_options;
+  scan_options.readahead = std::max(FLAGS_get_entries_readahead, 0);
+  auto it(db_->ScanEntries(start, end + 1, scan_options));
+
+  string body;
+  vector<LoggedEntry> entries;
+  LoggedEntryPB::Serialized serialized;
+  int64_t i(start);
+  {
+    // Each WriteDelimitedTo() trims |body| back to what it wrote, but
+    // it must not be touched until |output| is gone.
+    google::protobuf::io::StringOutputStream output(&body);
+    bool contiguous(true);
+    bool full(false);
+    while (contiguous && !full && i <= end &&
+           it->GetNextEntries(std::min<int64_t>(end - i + 1,
+                                                kGetEntriesBatchSize),
+                              &entries) > 0) {
+      if (StopIfAbandoned(req, liveness)) {
+        return;
+      }
+      for (const LoggedEntry& entry : entries) {
+        if (entry.sequence_number() != i) {
+          contiguous = false;
+          break;
+        }
+
+        serialized.Clear();
+        if (!entry.SerializeForServing(serialized.mutable_leaf_input(),
+                                       serialized.mutable_extra_data(),
+                                       include_scts
+                                           ? serialized.mutable_sct()
+                                           : nullptr)) {
+          LOG(WARNING) << "Failed to serialize entry @ " << i << ":\n"
+                       << entry.DebugString();
+          return SendJsonError(event_base_, req, HTTP_INTERNAL,
+                               "Serialization failed.");
+        }
+        CHECK(WriteDelimitedTo(serialized, &output));
+        ++i;
+
+        // The size before compression.
+        if (max_bytes > 0 && output.ByteCount() >= max_bytes &&
+            IsPageBoundary(i)) {
+          full = true;
+          break;
+        }
+      }
+    }
+  }
+
+  if (i == start) {
     return SendJsonError(event_base_, req, HTTP_BADREQUEST,
                          "Entry not found.");
   }
 
-  JsonObject json_reply;
-  json_reply.Add("entries", json_entries);
+  if (compress) {
+    body = Deflate(body);
+    CHECK_EQ(evhttp_add_header(evhttp_request_get_output_headers(req),
+                               "Content-Encoding", "deflate"),
+             0);
+  }
+  SendReply(event_base_, req, HTTP_OK, "application/octet-stream", body);
+}
 
-  SendJsonReply(event_base_, req, HTTP_OK, json_reply);
+
+bool HttpHandler::SendStaticEntries(evhttp_request* req, int64_t start,
+                                    int64_t end) const {
+  if (!static_exporter_ || !AcceptsGzip(req)) {
+    return false;
+  }
+  const string path(static_exporter_->EntriesPath(start, end));
+  if (path.empty()) {
+    return false;
+  }
+  const int fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+  if (fd < 0) {
+    // Not exported yet.
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    PLOG(WARNING) << "Cannot stat " << path;
+    close(fd);
+    return false;
+  }
+
+  http_server_get_entries_cache_lookups->Increment("file");
+  SendGzippedJsonFile(event_base_, req, fd, st.st_size);
+  return true;
+}
+
+
+void HttpHandler::SendCachedReply(
+    evhttp_request* req,
+    const shared_ptr<const ServingCache::Reply>& reply) const {
+  CHECK(!reply->etag.empty());
+  const bool gzipped(!reply->prepared.gzipped_body.empty() &&
+                     AcceptsGzip(req));
+  const string etag(gzipped ? GzipETag(reply->etag) : reply->etag);
+  evkeyvalq* const output_headers(evhttp_request_get_output_headers(req));
+  CHECK_EQ(evhttp_add_header(output_headers, "ETag", etag.c_str()), 0);
+
+  if (MatchesIfNoneMatch(req, etag)) {
+    if (!reply->prepared.gzipped_body.empty()) {
+      CHECK_EQ(evhttp_add_header(output_headers, "Vary", "Accept-Encoding"),
+               0);
+    }
+    return SendJsonReply(event_base_, req, HTTP_NOTMODIFIED, string());
+  }
+
+  SendJsonReply(event_base_, req, HTTP_OK,
+                shared_ptr<const PreparedJsonReply>(reply, &reply->prepared));
+}
+
+
+bool HttpHandler::SendNotModified(evhttp_request* req, const string& etag,
+                                  time_t last_modified) const {
+  evkeyvalq* const input_headers(evhttp_request_get_input_headers(req));
+  string matched;
+  if (evhttp_find_header(input_headers, "If-None-Match")) {
+    // Whether the body is compressed is not known here, but the client
+    // got the encoding it has in the same way as it would now.
+    if (MatchesIfNoneMatch(req, etag)) {
+      matched = etag;
+    } else if (AcceptsGzip(req) && MatchesIfNoneMatch(req, GzipETag(etag))) {
+      matched = GzipETag(etag);
+    } else {
+      return false;
+    }
+  } else {
+    // Only for the clients without an ETag, as RFC 7232 has it. Dates
+    // are to the second, so these clients may miss a reply changed
+    // within the second of the one they have, until it changes again.
+    const char* const if_modified_since(
+        evhttp_find_header(input_headers, "If-Modified-Since"));
+    if (last_modified < 0 || !if_modified_since ||
+        ParseHttpDate(if_modified_since) < last_modified) {
+      return false;
+    }
+    matched = etag;
+  }
+
+  evkeyvalq* const output_headers(evhttp_request_get_output_headers(req));
+  CHECK_EQ(evhttp_add_header(output_headers, "ETag", matched.c_str()), 0);
+  // As the reply it stands for may have had.
+  CHECK_EQ(evhttp_add_header(output_headers, "Vary", "Accept-Encoding"), 0);
+  SendJsonReply(event_base_, req, HTTP_NOTMODIFIED, string());
+  return true;
 }
@@ -2,17 +2,27 @@
 #define CERT_TRANS_SERVER_HANDLER_H_
 
 #include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <string>
+#include <unordered_set>
 
 #include "proto/ct.pb.h"
+#include "server/serving_cache.h"
 #include "server/staleness_tracker.h"
 #include "util/libevent_wrapper.h"
 #include "util/sync_task.h"
 #include "util/task.h"
 
 class Frontend;
+class JsonObject;
 
 namespace cert_trans {
 
@@ -21,27 +31,56 @@ class CertChecker;
 class ClusterStateController;
 class LogLookup;
 class LoggedEntry;
+class PendingEntryStore;
 class PreCertChain;
+struct PreparedJsonReply;
 class Proxy;
+class RateLimiter;
 class ReadOnlyDatabase;
+class RequestLog;
+class StaticExporter;
 class ThreadPool;
 
 
 class HttpHandler {
  public:
   // Does not take ownership of its parameters, which must outlive
-  // this instance.
+  // this instance. |controller| and |staleness_tracker| are null on a
+  // read replica (see ReadReplica), which always answers requests
+  // itself. The requests reading entries from the database run in
+  // |read_pool| if it is not null, so that a stalled database does
+  // not hold up the other requests, and in |pool| otherwise.
   HttpHandler(LogLookup* log_lookup, const ReadOnlyDatabase* db,
               const ClusterStateController* controller, ThreadPool* pool,
-              libevent::Base* event_base, StalenessTracker* staleness_tracker);
+              libevent::Base* event_base, StalenessTracker* staleness_tracker,
+              ThreadPool* read_pool = nullptr);
   virtual ~HttpHandler();
   HttpHandler(const HttpHandler&) = delete;
   HttpHandler& operator=(const HttpHandler&) = delete;
 
-  void Add(libevent::HttpServer* server);
+  // Adds the handlers under |path_prefix| (e.g. "/2019" serves
+  // "/2019/ct/v1/get-sth"), so that several logs can share |server|.
+  // The pprof handlers are only added without a prefix.
+  void Add(libevent::HttpServer* server, const std::string& path_prefix = "");
 
   void SetProxy(Proxy* proxy);
 
+  // Records the requests to the handlers added from then on in
+  // |request_log|, which must outlive them. Call before Add().
+  void SetRequestLog(RequestLog* request_log);
+
+  // Serves the get-entries requests for the whole bundles exported by
+  // |exporter|, which must outlive this instance, from their files to
+  // the clients which accept gzip, without reading the database or
+  // copying the replies. Call before Add().
+  void SetStaticExporter(const StaticExporter* exporter);
+
+  // Serves the whole pending entries kept in |store|, which must outlive
+  // this instance, to the other nodes which sequence them, at
+  // "/ct/v1/x-get-pending-entry" whatever the path prefix. This is never
+  // proxied. Call before Add().
+  void SetPendingEntryStore(const PendingEntryStore* store);
+
  protected:
   // Implemented by subclasses which want to add their own extra http handlers.
   virtual void AddHandlers(libevent::HttpServer* server) = 0;
@@ -49,29 +88,203 @@ class HttpHandler {
   void AddEntryReply(evhttp_request* req, const util::Status& add_status,
                      const ct::SignedCertificateTimestamp& sct) const;
 
+  // Adds the fields of an add-chain reply for |sct| to |reply|.
+  static void AddSctFields(const ct::SignedCertificateTimestamp& sct,
+                           JsonObject* reply);
+
+  // Whether there is any point in finishing the work for a request:
+  // not once its client has disconnected, or once it is past its
+  // deadline (see --http_request_deadline_ms). Copied to the worker
+  // threads, which check it between steps of long requests.
+  struct RequestLiveness {
+    bool Abandoned() const;
+
+    std::shared_ptr<const std::atomic<bool>> connection_closed;
+    std::chrono::steady_clock::time_point deadline;
+  };
+
+  // Must be called on the event thread of |req|.
+  RequestLiveness Liveness(evhttp_request* req) const;
+  // If |liveness| says the work for |req| can stop, replies to it (as
+  // even abandoned requests must be) and returns true.
+  bool StopIfAbandoned(evhttp_request* req,
+                       const RequestLiveness& liveness) const;
+
+  // Sends |reply|, which has an ETag, with the validator of the
+  // encoding sent, or replies with 304 if the client has that already.
+  void SendCachedReply(
+      evhttp_request* req,
+      const std::shared_ptr<const ServingCache::Reply>& reply) const;
+  // Replies with 304 and returns true if the client has the reply to
+  // |req| already, |etag| being that of its body, in either encoding
+  // the client accepts, or, without If-None-Match, if the reply was
+  // last modified at |last_modified| (if not -1) or before the
+  // If-Modified-Since date. Only looks at the headers, so that the
+  // event thread can answer the polling clients before any work is
+  // done.
+  bool SendNotModified(evhttp_request* req, const std::string& etag,
+                       time_t last_modified = -1) const;
+
+  // Hands |closure|, which replies to |req|, to |pool| in
+  // |work_class|. Replies with 503 instead, and returns false, if that
+  // class has too many requests waiting already.
+  bool AddWork(ThreadPool* pool, int work_class, evhttp_request* req,
+               const std::function<void()>& closure) const;
+
+  // Whether a stale node has all it needs to answer a request itself.
+  typedef std::function<bool(evhttp_request*)> AnswerableWhenStale;
+
+  // Proxies |request|, to |path|, to a fresh node if this one is stale
+  // and |answerable| (if set) says it cannot answer it, and has
+  // |local_handler| answer it otherwise.
   void ProxyInterceptor(
+      const std::string& path, const AnswerableWhenStale& answerable,
+      const libevent::HttpServer::HandlerCallback& local_handler,
+      evhttp_request* request);
+
+  // Proxies |request|, to |path|, to another node while |log_lookup_|
+  // is loading its tree, and has |local_handler| answer it otherwise.
+  // Without a proxy, replies with 503 instead.
+  void TreeLoadingInterceptor(
+      const std::string& path,
       const libevent::HttpServer::HandlerCallback& local_handler,
       evhttp_request* request);
 
+  // Runs on the event thread, before any work is handed to |pool_|:
+  // replies with 429 to the clients over their rate for |path|.
+  void RateLimitInterceptor(
+      RateLimiter* limiter, const std::string& path,
+      const libevent::HttpServer::HandlerCallback& local_handler,
+      evhttp_request* request) const;
+
+  // A non-zero |max_body_size| limits the requests to |path| further
+  // than the server does (see HttpServer::AddHandler()).
   void AddProxyWrappedHandler(
       libevent::HttpServer* server, const std::string& path,
-      const libevent::HttpServer::HandlerCallback& local_handler);
+      const libevent::HttpServer::HandlerCallback& local_handler,
+      size_t max_body_size = 0,
+      const AnswerableWhenStale& answerable = AnswerableWhenStale());
+  // AddProxyWrappedHandler() for the requests which need the Merkle
+  // tree, rather than only the database, to be answered.
+  void AddTreeProxyWrappedHandler(
+      libevent::HttpServer* server, const std::string& path,
+      const libevent::HttpServer::HandlerCallback& local_handler,
+      const AnswerableWhenStale& answerable = AnswerableWhenStale());
+
+  // AnswerableWhenStale for get-entries: whether the database has all
+  // the entries asked for.
+  bool HasEntries(evhttp_request* req) const;
+  // AnswerableWhenStale for the proofs: whether the tree size in the
+  // query parameter |param| is within the tree of |log_lookup_|.
+  bool HasTreeSize(const std::string& param, evhttp_request* req) const;
 
   void GetEntries(evhttp_request* req) const;
+  // Not part of RFC 6962: the entries as length-delimited
+  // ct::LoggedEntryPB::Serialized messages, for the other nodes.
+  void GetEntriesBinary(evhttp_request* req) const;
   void GetProof(evhttp_request* req) const;
+  // Not part of RFC 6962: the proofs for several leaf hashes in one
+  // tree size, with the nodes of their audit paths sent only once.
+  void GetProofs(evhttp_request* req) const;
   void GetSTH(evhttp_request* req) const;
   void GetConsistency(evhttp_request* req) const;
+  // Not part of RFC 6962: the pending entry of the "hash" parameter from
+  // |pending_entry_store_|, as a serialized ct::LoggedEntryPB, for the
+  // node which sequences it.
+  void GetPendingEntry(evhttp_request* req) const;
+
+  // Sets |start| and |end| from the parameters of a get-entries
+  // request, limited to --max_leaf_entries_per_response entries, and
+  // |max_bytes| to the size its response is cut at, or 0 (see
+  // --max_get_entries_response_bytes). Replies with an error and
+  // returns false if they are invalid.
+  bool GetEntriesRange(evhttp_request* req, const libevent::QueryParams& query,
+                       int64_t* start, int64_t* end,
+                       int64_t* max_bytes) const;
 
-  void BlockingGetEntries(evhttp_request* req, int64_t start, int64_t end,
-                          bool include_scts) const;
+  void BlockingGetEntries(evhttp_request* req,
+                          const RequestLiveness& liveness, int64_t start,
+                          int64_t end, bool include_scts,
+                          int64_t max_bytes) const;
+  void BlockingGetProofs(evhttp_request* req,
+                         const RequestLiveness& liveness) const;
+  void BlockingGetEntriesBinary(evhttp_request* req,
+                                const RequestLiveness& liveness,
+                                int64_t start, int64_t end,
+                                int64_t max_bytes, bool include_scts,
+                                bool compress) const;
+
+  // Appends the get-entries reply body for the entries from |start| to
+  // |end| to |body|, as far as the first missing one, and sets |*next|
+  // to the one after the last written. If |max_bytes| is not 0, stops
+  // at the first page boundary once |body| is that large. Returns
+  // CANCELLED as soon as |stop| returns true, and INTERNAL if an entry
+  // can't be serialized.
+  util::Status RenderEntries(int64_t start, int64_t end, bool include_scts,
+                             int64_t max_bytes,
+                             const std::function<bool()>& stop,
+                             std::string* body, int64_t* next) const;
+
+  // Notes a request for the whole range at |start|, and if the range
+  // before it was asked for recently, as when a monitor goes through
+  // the log, has the next ones read into |serving_cache_| in the
+  // background (see --get_entries_prefetch_ranges).
+  void PrefetchEntriesAfter(int64_t start, bool include_scts) const;
+  void PrefetchEntries(int64_t start, bool include_scts,
+                       const std::string& cache_key) const;
+
+  // Sends the file of the bundle of entries |start| to |end| exported
+  // by |static_exporter_|, and returns true, if there is one and the
+  // client accepts it.
+  bool SendStaticEntries(evhttp_request* req, int64_t start,
+                         int64_t end) const;
 
   LogLookup* const log_lookup_;
   const ReadOnlyDatabase* const db_;
   const ClusterStateController* const controller_;
   Proxy* proxy_;
+  RequestLog* request_log_;
+  const StaticExporter* static_exporter_;
+  const PendingEntryStore* pending_entry_store_;
+  // Set by Add().
+  libevent::HttpServer* server_;
+  std::string path_prefix_;
   ThreadPool* const pool_;
+  // Either |pool_|, or a pool of its own.
+  ThreadPool* const read_pool_;
   libevent::Base* const event_base_;
   StalenessTracker* const staleness_tracker_;
+  // The classes of work of |pool_| for the requests adding entries, and
+  // of |read_pool_| for those reading entries from the database, so
+  // that either can be kept from starving the other.
+  const int submission_class_;
+  const int read_class_;
+  // The class of work of |read_pool_| for the prefetching of entries,
+  // whose queue bounds how many ranges are being prefetched.
+  const int prefetch_class_;
+  // The limits of --http_rate_limits, by path.
+  const std::map<std::string, std::unique_ptr<RateLimiter>> rate_limiters_;
+
+  // The get-sth reply, which is serialised (and compressed) again only
+  // when the STH changes: this is the STH of |sth_reply_timestamp_|.
+  // Its ETag is that of the STH (see GetSTH()).
+  mutable std::mutex sth_reply_lock_;
+  mutable uint64_t sth_reply_timestamp_;
+  mutable std::shared_ptr<const ServingCache::Reply> sth_reply_;
+
+  // Logged entries never change, so the replies for whole aligned
+  // ranges of them (see BlockingGetEntries()) are kept and sent again
+  // as is, and so are those for consistency proofs between tree sizes
+  // the log has reached.
+  mutable ServingCache serving_cache_;
+
+  mutable std::mutex prefetch_lock_;
+  mutable std::condition_variable prefetch_done_;
+  // The cache keys of the whole ranges recently asked for, oldest
+  // first, and of those being prefetched.
+  mutable std::deque<std::string> recent_ranges_;
+  mutable std::unordered_set<std::string> recent_ranges_set_;
+  mutable std::unordered_set<std::string> prefetching_;
 };
 
 
@@ -0,0 +1,587 @@
+#include "server/http2_server.h"
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/bufferevent_ssl.h>
+#include <event2/listener.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <nghttp2/nghttp2.h>
+#include <ctype.h>
+#include <string.h>
+#include <strings.h>
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+#include "monitoring/monitoring.h"
+#include "util/libevent_wrapper.h"
+#include "util/task.h"
+
+using std::bind;
+using std::enable_shared_from_this;
+using std::make_pair;
+using std::make_shared;
+using std::placeholders::_1;
+using std::shared_ptr;
+using std::string;
+using std::to_string;
+using std::unique_ptr;
+using std::unordered_map;
+using std::vector;
+using std::weak_ptr;
+using util::Task;
+
+DEFINE_int32(http2_max_concurrent_streams, 100,
+             "maximum number of requests a client may have in flight on "
+             "each HTTP/2 connection");
+
+namespace cert_trans {
+namespace {
+
+
+static Counter<string>* http2_server_streams =
+    Counter<string>::New("http2_server_streams", "result",
+                         "Number of HTTP/2 requests, broken down by result "
+                         "(proxied, failed, or refused).");
+
+
+// How much of the replies is buffered for a connection at most, past
+// which nghttp2 waits for it to drain before sending more. nghttp2 then
+// picks what to send next by priority.
+const size_t kMaxOutputBuffer = 256 * 1024;
+
+
+// The headers which are about the connection they came on, which are
+// not passed on in either direction (see RFC 7540, 8.1.2.2).
+bool IsConnectionHeader(const string& name) {
+  static const char* const kHeaders[] = {"connection", "keep-alive",
+                                         "proxy-connection",
+                                         "transfer-encoding", "upgrade",
+                                         "te", "content-length", "host"};
+  for (const char* header : kHeaders) {
+    if (strcasecmp(name.c_str(), header) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+
+nghttp2_nv MakeHeader(const string& name, const string& value) {
+  return nghttp2_nv{reinterpret_cast<uint8_t*>(const_cast<char*>(name.data())),
+                    reinterpret_cast<uint8_t*>(
+                        const_cast<char*>(value.data())),
+                    name.size(), value.size(), NGHTTP2_NV_FLAG_NONE};
+}
+
+
+// Picks "h2" out of the protocols offered through ALPN, and turns away
+// the clients which do not offer it.
+int SelectProtocol(SSL*, const unsigned char** out, unsigned char* outlen,
+                   const unsigned char* in, unsigned int inlen, void*) {
+  if (nghttp2_select_next_protocol(const_cast<unsigned char**>(out), outlen,
+                                   in, inlen) != 1) {
+    return SSL_TLSEXT_ERR_NOACK;
+  }
+  return SSL_TLSEXT_ERR_OK;
+}
+
+
+SSL_CTX* CreateServerSSLCTX(const string& cert_file, const string& key_file) {
+  if (cert_file.empty()) {
+    return nullptr;
+  }
+  SSL_CTX* const ctx(CHECK_NOTNULL(SSL_CTX_new(SSLv23_server_method())));
+  // RFC 7540 asks for TLS 1.2 at least.
+  SSL_CTX_set_options(ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3 |
+                               SSL_OP_NO_TLSv1 | SSL_OP_NO_TLSv1_1 |
+                               SSL_OP_NO_COMPRESSION);
+  CHECK_EQ(1, SSL_CTX_use_certificate_chain_file(ctx, cert_file.c_str()))
+      << "Cannot load the certificate chain from " << cert_file;
+  CHECK_EQ(1, SSL_CTX_use_PrivateKey_file(ctx, key_file.c_str(),
+                                          SSL_FILETYPE_PEM))
+      << "Cannot load the private key from " << key_file;
+  SSL_CTX_set_alpn_select_cb(ctx, &SelectProtocol, nullptr);
+  return ctx;
+}
+
+
+void FreeSSLCTX(SSL_CTX* ctx) {
+  if (ctx) {
+    SSL_CTX_free(ctx);
+  }
+}
+
+
+}  // namespace
+
+
+class Http2Server::Connection : public enable_shared_from_this<Connection> {
+ public:
+  Connection(Http2Server* server, bufferevent* bev);
+  ~Connection();
+  Connection(const Connection&) = delete;
+  Connection& operator=(const Connection&) = delete;
+
+  // Sends the settings of the server, and starts reading requests.
+  void Start();
+
+ private:
+  struct Stream {
+    explicit Stream(int32_t theid) : id(theid), too_large(false), sent(0) {
+    }
+
+    const int32_t id;
+    string method;
+    string path;
+    UrlFetcher::Request request;
+    // Set once the body is over the limit, which is then dropped.
+    bool too_large;
+    UrlFetcher::Response response;
+    // How much of |response.body| nghttp2 has taken.
+    size_t sent;
+  };
+
+  static ssize_t Send(nghttp2_session* session, const uint8_t* data,
+                      size_t length, int flags, void* connection);
+  static int OnBeginHeaders(nghttp2_session* session,
+                            const nghttp2_frame* frame, void* connection);
+  static int OnHeader(nghttp2_session* session, const nghttp2_frame* frame,
+                      const uint8_t* name, size_t namelen,
+                      const uint8_t* value, size_t valuelen, uint8_t flags,
+                      void* connection);
+  static int OnDataChunk(nghttp2_session* session, uint8_t flags,
+                         int32_t stream_id, const uint8_t* data, size_t len,
+                         void* connection);
+  static int OnFrame(nghttp2_session* session, const nghttp2_frame* frame,
+                     void* connection);
+  static int OnStreamClose(nghttp2_session* session, int32_t stream_id,
+                           uint32_t error_code, void* connection);
+  static ssize_t ReadBody(nghttp2_session* session, int32_t stream_id,
+                          uint8_t* buf, size_t length, uint32_t* data_flags,
+                          nghttp2_data_source* source, void* connection);
+
+  static void ReadCallback(bufferevent* bev, void* connection);
+  static void WriteCallback(bufferevent* bev, void* connection);
+  static void EventCallback(bufferevent* bev, short events, void* connection);
+
+  // Sends the request of |stream| on, once it is all there.
+  void Forward(const shared_ptr<Stream>& stream);
+  static void ForwardDone(const weak_ptr<Connection>& connection,
+                          const shared_ptr<Stream>& stream, Task* task);
+  // Replies to |stream| without passing it on.
+  void Refuse(Stream* stream, int status_code, const string& message);
+  // Submits |stream->response| to nghttp2.
+  void Respond(Stream* stream);
+
+  // Has nghttp2 write out what it can. Returns false if the connection
+  // is done with, or broken, and must be closed.
+  bool Flush();
+  // Deletes this instance.
+  void Close();
+
+  Http2Server* const server_;
+  bufferevent* const bev_;
+  nghttp2_session* session_;
+  // The streams which are open, by ID.
+  unordered_map<int32_t, shared_ptr<Stream>> streams_;
+};
+
+
+Http2Server::Connection::Connection(Http2Server* server, bufferevent* bev)
+    : server_(CHECK_NOTNULL(server)),
+      bev_(CHECK_NOTNULL(bev)),
+      session_(nullptr) {
+}
+
+
+Http2Server::Connection::~Connection() {
+  if (session_) {
+    nghttp2_session_del(session_);
+  }
+  bufferevent_free(bev_);
+}
+
+
+void Http2Server::Connection::Start() {
+  nghttp2_session_callbacks* callbacks;
+  CHECK_EQ(0, nghttp2_session_callbacks_new(&callbacks));
+  nghttp2_session_callbacks_set_send_callback(callbacks, &Send);
+  nghttp2_session_callbacks_set_on_begin_headers_callback(callbacks,
+                                                          &OnBeginHeaders);
+  nghttp2_session_callbacks_set_on_header_callback(callbacks, &OnHeader);
+  nghttp2_session_callbacks_set_on_data_chunk_recv_callback(callbacks,
+                                                            &OnDataChunk);
+  nghttp2_session_callbacks_set_on_frame_recv_callback(callbacks, &OnFrame);
+  nghttp2_session_callbacks_set_on_stream_close_callback(callbacks,
+                                                         &OnStreamClose);
+  CHECK_EQ(0, nghttp2_session_server_new(&session_, callbacks, this));
+  nghttp2_session_callbacks_del(callbacks);
+
+  const nghttp2_settings_entry settings[] = {
+      {NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS,
+       static_cast<uint32_t>(std::max(FLAGS_http2_max_concurrent_streams, 1))},
+  };
+  CHECK_EQ(0, nghttp2_submit_settings(session_, NGHTTP2_FLAG_NONE, settings,
+                                      sizeof(settings) / sizeof(settings[0])));
+
+  // The write callback runs once the output is down to half of what is
+  // buffered at most.
+  bufferevent_setwatermark(bev_, EV_WRITE, kMaxOutputBuffer / 2, 0);
+  bufferevent_setcb(bev_, &ReadCallback, &WriteCallback, &EventCallback,
+                    this);
+  bufferevent_enable(bev_, EV_READ | EV_WRITE);
+  if (!Flush()) {
+    Close();
+  }
+}
+
+
+// static
+ssize_t Http2Server::Connection::Send(nghttp2_session*, const uint8_t* data,
+                                      size_t length, int,
+                                      void* connection) {
+  Connection* const self(static_cast<Connection*>(connection));
+  evbuffer* const output(bufferevent_get_output(self->bev_));
+  if (evbuffer_get_length(output) >= kMaxOutputBuffer) {
+    return NGHTTP2_ERR_WOULDBLOCK;
+  }
+  if (bufferevent_write(self->bev_, data, length) != 0) {
+    return NGHTTP2_ERR_CALLBACK_FAILURE;
+  }
+  return length;
+}
+
+
+// static
+int Http2Server::Connection::OnBeginHeaders(nghttp2_session*,
+                                            const nghttp2_frame* frame,
+                                            void* connection) {
+  if (frame->hd.type != NGHTTP2_HEADERS ||
+      frame->headers.cat != NGHTTP2_HCAT_REQUEST) {
+    return 0;
+  }
+  Connection* const self(static_cast<Connection*>(connection));
+  self->streams_[frame->hd.stream_id] =
+      make_shared<Stream>(frame->hd.stream_id);
+  return 0;
+}
+
+
+// static
+int Http2Server::Connection::OnHeader(nghttp2_session*,
+                                      const nghttp2_frame* frame,
+                                      const uint8_t* name, size_t namelen,
+                                      const uint8_t* value, size_t valuelen,
+                                      uint8_t, void* connection) {
+  if (frame->hd.type != NGHTTP2_HEADERS ||
+      frame->headers.cat != NGHTTP2_HCAT_REQUEST) {
+    return 0;
+  }
+  Connection* const self(static_cast<Connection*>(connection));
+  const auto it(self->streams_.find(frame->hd.stream_id));
+  if (it == self->streams_.end()) {
+    return 0;
+  }
+  Stream* const stream(it->second.get());
+  const string header(reinterpret_cast<const char*>(name), namelen);
+  const string header_value(reinterpret_cast<const char*>(value), valuelen);
+  if (header == ":method") {
+    stream->method = header_value;
+  } else if (header == ":path") {
+    stream->path = header_value;
+  } else if (header == ":authority") {
+    stream->request.headers.insert(make_pair("Host", header_value));
+  } else if (header[0] != ':' && !IsConnectionHeader(header)) {
+    stream->request.headers.insert(make_pair(header, header_value));
+  }
+  return 0;
+}
+
+
+// static
+int Http2Server::Connection::OnDataChunk(nghttp2_session*, uint8_t,
+                                         int32_t stream_id,
+                                         const uint8_t* data, size_t len,
+                                         void* connection) {
+  Connection* const self(static_cast<Connection*>(connection));
+  const auto it(self->streams_.find(stream_id));
+  if (it == self->streams_.end()) {
+    return 0;
+  }
+  Stream* const stream(it->second.get());
+  if (stream->too_large ||
+      stream->request.body.size() + len > self->server_->max_body_size_) {
+    stream->too_large = true;
+    stream->request.body.clear();
+    return 0;
+  }
+  stream->request.body.append(reinterpret_cast<const char*>(data), len);
+  return 0;
+}
+
+
+// static
+int Http2Server::Connection::OnFrame(nghttp2_session*,
+                                     const nghttp2_frame* frame,
+                                     void* connection) {
+  if ((frame->hd.type != NGHTTP2_HEADERS && frame->hd.type != NGHTTP2_DATA) ||
+      !(frame->hd.flags & NGHTTP2_FLAG_END_STREAM)) {
+    return 0;
+  }
+  Connection* const self(static_cast<Connection*>(connection));
+  const auto it(self->streams_.find(frame->hd.stream_id));
+  if (it != self->streams_.end()) {
+    self->Forward(it->second);
+  }
+  return 0;
+}
+
+
+// static
+int Http2Server::Connection::OnStreamClose(nghttp2_session*,
+                                           int32_t stream_id, uint32_t,
+                                           void* connection) {
+  // A reply still being fetched keeps the stream, and is dropped.
+  static_cast<Connection*>(connection)->streams_.erase(stream_id);
+  return 0;
+}
+
+
+// static
+ssize_t Http2Server::Connection::ReadBody(nghttp2_session*, int32_t,
+                                          uint8_t* buf, size_t length,
+                                          uint32_t* data_flags,
+                                          nghttp2_data_source* source,
+                                          void*) {
+  Stream* const stream(static_cast<Stream*>(source->ptr));
+  const string& body(stream->response.body);
+  const size_t size(std::min(length, body.size() - stream->sent));
+  memcpy(buf, body.data() + stream->sent, size);
+  stream->sent += size;
+  if (stream->sent == body.size()) {
+    *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+  }
+  return size;
+}
+
+
+// static
+void Http2Server::Connection::ReadCallback(bufferevent* bev,
+                                           void* connection) {
+  Connection* const self(static_cast<Connection*>(connection));
+  evbuffer* const input(bufferevent_get_input(bev));
+  const size_t length(evbuffer_get_length(input));
+  const ssize_t read(nghttp2_session_mem_recv(
+      self->session_, evbuffer_pullup(input, -1), length));
+  if (read < 0) {
+    VLOG(1) << "Bad HTTP/2 input: " << nghttp2_strerror(read);
+    return self->Close();
+  }
+  CHECK_EQ(0, evbuffer_drain(input, length));
+  if (!self->Flush()) {
+    self->Close();
+  }
+}
+
+
+// static
+void Http2Server::Connection::WriteCallback(bufferevent*, void* connection) {
+  Connection* const self(static_cast<Connection*>(connection));
+  if (!self->Flush()) {
+    self->Close();
+  }
+}
+
+
+// static
+void Http2Server::Connection::EventCallback(bufferevent* bev, short events,
+                                            void* connection) {
+  Connection* const self(static_cast<Connection*>(connection));
+  if (events & BEV_EVENT_CONNECTED) {
+    // The TLS handshake is done, which must have settled on HTTP/2.
+    const unsigned char* protocol(nullptr);
+    unsigned int length(0);
+    SSL_get0_alpn_selected(bufferevent_openssl_get_ssl(bev), &protocol,
+                           &length);
+    if (length != NGHTTP2_PROTO_VERSION_ID_LEN ||
+        memcmp(protocol, NGHTTP2_PROTO_VERSION_ID, length) != 0) {
+      VLOG(1) << "HTTP/2 client without ALPN";
+      self->Close();
+    }
+    return;
+  }
+  if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR | BEV_EVENT_TIMEOUT)) {
+    self->Close();
+  }
+}
+
+
+void Http2Server::Connection::Forward(const shared_ptr<Stream>& stream) {
+  if (stream->too_large) {
+    http2_server_streams->Increment("refused");
+    return Refuse(stream.get(), 413, "Request body too large.");
+  }
+
+  UrlFetcher::Request* const request(&stream->request);
+  if (stream->method == "GET") {
+    request->verb = UrlFetcher::Verb::GET;
+  } else if (stream->method == "POST") {
+    request->verb = UrlFetcher::Verb::POST;
+  } else if (stream->method == "PUT") {
+    request->verb = UrlFetcher::Verb::PUT;
+  } else if (stream->method == "DELETE") {
+    request->verb = UrlFetcher::Verb::DELETE;
+  } else {
+    http2_server_streams->Increment("refused");
+    return Refuse(stream.get(), 405, "Method not allowed.");
+  }
+  if (stream->path.empty() || stream->path[0] != '/') {
+    http2_server_streams->Increment("refused");
+    return Refuse(stream.get(), 400, "Bad path.");
+  }
+  request->url = URL(server_->backend_ + stream->path);
+
+  server_->fetcher_->Fetch(
+      *request, &stream->response,
+      new Task(bind(&Connection::ForwardDone,
+                    weak_ptr<Connection>(shared_from_this()), stream, _1),
+               server_->base_));
+}
+
+
+// static
+void Http2Server::Connection::ForwardDone(
+    const weak_ptr<Connection>& connection, const shared_ptr<Stream>& stream,
+    Task* task) {
+  const unique_ptr<Task> task_deleter(CHECK_NOTNULL(task));
+  const shared_ptr<Connection> self(connection.lock());
+  // The connection, or the stream, may have been closed meanwhile.
+  if (!self || self->streams_.count(stream->id) == 0) {
+    return;
+  }
+
+  if (!task->status().ok()) {
+    VLOG(1) << "HTTP/2 request failed: " << task->status();
+    self->Refuse(stream.get(), 502, "Request failed.");
+    http2_server_streams->Increment("failed");
+  } else {
+    self->Respond(stream.get());
+    http2_server_streams->Increment("proxied");
+  }
+  if (!self->Flush()) {
+    self->Close();
+  }
+}
+
+
+void Http2Server::Connection::Refuse(Stream* stream, int status_code,
+                                     const string& message) {
+  stream->response = UrlFetcher::Response();
+  stream->response.status_code = status_code;
+  stream->response.headers.insert(make_pair("Content-Type", "text/plain"));
+  stream->response.body = message + "\n";
+  Respond(stream);
+}
+
+
+void Http2Server::Connection::Respond(Stream* stream) {
+  const string status(to_string(stream->response.status_code));
+  const string content_length(to_string(stream->response.body.size()));
+  // The names must be lower case in HTTP/2.
+  vector<string> names;
+  names.reserve(stream->response.headers.size());
+  vector<nghttp2_nv> headers{MakeHeader(":status", status),
+                             MakeHeader("content-length", content_length)};
+  for (const auto& header : stream->response.headers) {
+    if (IsConnectionHeader(header.first)) {
+      continue;
+    }
+    names.push_back(header.first);
+    std::transform(names.back().begin(), names.back().end(),
+                   names.back().begin(), ::tolower);
+    headers.push_back(MakeHeader(names.back(), header.second));
+  }
+
+  nghttp2_data_provider body;
+  body.source.ptr = stream;
+  body.read_callback = &ReadBody;
+  // nghttp2 copies the headers, and the stream stays in |streams_| until
+  // its body is all sent.
+  const int ret(nghttp2_submit_response(session_, stream->id, headers.data(),
+                                        headers.size(), &body));
+  LOG_IF(WARNING, ret != 0) << "Cannot reply to HTTP/2 stream "
+                            << stream->id << ": " << nghttp2_strerror(ret);
+}
+
+
+bool Http2Server::Connection::Flush() {
+  if (nghttp2_session_send(session_) != 0) {
+    return false;
+  }
+  return nghttp2_session_want_read(session_) ||
+         nghttp2_session_want_write(session_) ||
+         evbuffer_get_length(bufferevent_get_output(bev_)) > 0;
+}
+
+
+void Http2Server::Connection::Close() {
+  server_->connections_.erase(this);
+}
+
+
+Http2Server::Http2Server(libevent::Base* base, UrlFetcher* fetcher,
+                         const string& backend, size_t max_body_size,
+                         const string& tls_cert_file,
+                         const string& tls_key_file)
+    : base_(CHECK_NOTNULL(base)),
+      fetcher_(CHECK_NOTNULL(fetcher)),
+      backend_(backend),
+      max_body_size_(max_body_size),
+      ssl_ctx_(CreateServerSSLCTX(tls_cert_file, tls_key_file), &FreeSSLCTX),
+      listener_(nullptr) {
+}
+
+
+Http2Server::~Http2Server() {
+  if (listener_) {
+    evconnlistener_free(listener_);
+  }
+}
+
+
+void Http2Server::Bind(unsigned short port) {
+  CHECK(!listener_);
+  listener_ = base_->ListenerNew(port, &Http2Server::Accept, this);
+  LOG(INFO) << "Serving HTTP/2 " << (ssl_ctx_ ? "over TLS" : "in cleartext")
+            << " on port " << port;
+}
+
+
+void Http2Server::StopAccepting() {
+  if (listener_) {
+    evconnlistener_free(listener_);
+    listener_ = nullptr;
+  }
+}
+
+
+// static
+void Http2Server::Accept(evconnlistener*, int fd, sockaddr*, int,
+                         void* server) {
+  Http2Server* const self(static_cast<Http2Server*>(server));
+  const int one(1);
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  SSL* const ssl(self->ssl_ctx_ ? CHECK_NOTNULL(SSL_new(self->ssl_ctx_.get()))
+                                : nullptr);
+  const shared_ptr<Connection> connection(
+      make_shared<Connection>(self, self->base_->BufferEventNew(fd, ssl)));
+  self->connections_.emplace(connection.get(), connection);
+  connection->Start();
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,81 @@
+#ifndef CERT_TRANS_SERVER_HTTP2_SERVER_H_
+#define CERT_TRANS_SERVER_HTTP2_SERVER_H_
+
+#include <openssl/ssl.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include "net/url_fetcher.h"
+
+struct evconnlistener;
+
+namespace cert_trans {
+
+namespace libevent {
+class Base;
+}
+
+
+// Serves HTTP/2 on a port of its own, next to the HTTP/1.1
+// libevent::HttpServer, so that clients such as monitors can have many
+// requests in flight on a few connections: in cleartext ("h2c", with
+// prior knowledge, as the upgrade from HTTP/1.1 is not supported), or
+// over TLS ("h2", negotiated with ALPN).
+//
+// evhttp only speaks HTTP/1.1, so the requests of the streams are sent
+// on through |fetcher| to the HttpServer of this process, over loopback
+// connections which the fetcher keeps open, and so reach the same
+// handlers, with the same limits. nghttp2 gives each stream its own
+// flow control, and sends the replies ready at once in the order of the
+// priorities the client gave them.
+//
+// Everything but the constructor runs on the event loop of |base|.
+class Http2Server {
+ public:
+  // Passes the requests on to |backend| (e.g. "http://127.0.0.1:8080"),
+  // refusing the ones with a body over |max_body_size| with 413. If
+  // |tls_cert_file| is not empty, connections are over TLS, with the
+  // PEM certificate chain in it and the private key in |tls_key_file|.
+  // Does not take ownership of |base| or |fetcher|, which must outlive
+  // this instance.
+  Http2Server(libevent::Base* base, UrlFetcher* fetcher,
+              const std::string& backend, size_t max_body_size,
+              const std::string& tls_cert_file,
+              const std::string& tls_key_file);
+  // Must be called on the event loop, or once it is not running.
+  ~Http2Server();
+  Http2Server(const Http2Server&) = delete;
+  Http2Server& operator=(const Http2Server&) = delete;
+
+  // Starts accepting connections on |port|.
+  void Bind(unsigned short port);
+
+  // Stops accepting connections; the ones already accepted are still
+  // served. Must be called on the event loop.
+  void StopAccepting();
+
+ private:
+  class Connection;
+
+  static void Accept(evconnlistener* listener, int fd, sockaddr* addr,
+                     int addrlen, void* server);
+
+  libevent::Base* const base_;
+  UrlFetcher* const fetcher_;
+  const std::string backend_;
+  const size_t max_body_size_;
+  // NULL for cleartext.
+  const std::unique_ptr<SSL_CTX, void (*)(SSL_CTX*)> ssl_ctx_;
+  evconnlistener* listener_;
+  // The open connections, which remove themselves once closed. The
+  // replies being fetched only hold on to them weakly.
+  std::unordered_map<Connection*, std::shared_ptr<Connection>> connections_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_SERVER_HTTP2_SERVER_H_
@@ -1,6 +1,12 @@
 #include "server/json_output.h"
 
+#include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <zlib.h>
+#include <memory>
 #include <string>
 
 #include "monitoring/latency.h"
@@ -8,8 +14,15 @@
 #include "util/json_wrapper.h"
 #include "util/libevent_wrapper.h"
 
+using std::move;
+using std::shared_ptr;
 using std::string;
 
+DEFINE_int32(http_compression_min_size, 1024,
+             "JSON replies of at least this many bytes are gzipped for the "
+             "clients which accept it. A negative value disables "
+             "compression.");
+
 namespace cert_trans {
 namespace {
 
@@ -27,6 +40,19 @@ static Counter<string, int>* total_http_server_response_codes(
 static const char kJsonContentType[] = "application/json; charset=utf-8";
 
 
+bool ShouldCompress(const string& body) {
+  return FLAGS_http_compression_min_size >= 0 &&
+         body.size() >= static_cast<size_t>(FLAGS_http_compression_min_size);
+}
+
+
+void AddHeader(evhttp_request* req, const char* name, const char* value) {
+  CHECK_EQ(evhttp_add_header(evhttp_request_get_output_headers(req), name,
+                             value),
+           0);
+}
+
+
 string LogRequest(evhttp_request* req, int http_status, int resp_body_length) {
   evhttp_connection* conn = evhttp_request_get_connection(req);
   char* peer_addr;
@@ -65,41 +91,238 @@ string LogRequest(evhttp_request* req, int http_status, int resp_body_length) {
 }
 
 
-}  // namespace
+void ReleaseBody(const void* /*data*/, size_t /*size*/, void* owner) {
+  delete static_cast<shared_ptr<const void>*>(owner);
+}
 
 
-void SendJsonReply(libevent::Base* base, evhttp_request* req, int http_status,
-                   const JsonObject& json) {
+// Sends the reply to |req|, whose body of |size| bytes is already in
+// its output buffer.
+void SendBufferedReply(libevent::Base* base, evhttp_request* req,
+                       int http_status, const char* content_type,
+                       size_t size) {
   CHECK_NOTNULL(base);
   CHECK_NOTNULL(req);
-  CHECK_EQ(evhttp_add_header(evhttp_request_get_output_headers(req),
-                             "Content-Type", kJsonContentType),
-           0);
+  AddHeader(req, "Content-Type", content_type);
   if (http_status == HTTP_SERVUNAVAIL) {
-    CHECK_EQ(evhttp_add_header(evhttp_request_get_output_headers(req),
-                               "Retry-After", "10"),
-             0);
+    AddHeader(req, "Retry-After", "10");
   }
-  const string resp_body(json.ToString());
-  CHECK_GT(evbuffer_add_printf(evhttp_request_get_output_buffer(req), "%s",
-                               resp_body.c_str()),
-           0);
 
-  const string logstr(LogRequest(req, http_status, resp_body.size()));
+  const string logstr(LogRequest(req, http_status, size));
   const auto send_reply([req, http_status, logstr]() {
     evhttp_send_reply(req, http_status, /*reason*/ NULL, /*databuf*/ NULL);
 
     VLOG(1) << logstr;
   });
 
-  if (!libevent::Base::OnEventThread()) {
-    base->Add(send_reply);
+  // With several event loops, |base| may not be the one of |req|.
+  libevent::Base* const reply_base(libevent::Base::ForRequest(req, base));
+  if (!reply_base->OnOwnEventThread()) {
+    reply_base->Add(send_reply);
   } else {
     send_reply();
   }
 }
 
 
+// Adds the |size| bytes at |data| to the reply to |req| and sends it.
+// If |owner| is set, it keeps |data| alive, and |data| is referenced
+// rather than copied.
+void SendReplyInternal(libevent::Base* base, evhttp_request* req,
+                       int http_status, const char* content_type,
+                       const char* data, size_t size,
+                       const shared_ptr<const void>& owner) {
+  CHECK_NOTNULL(req);
+  if (size > 0 && owner) {
+    CHECK_EQ(evbuffer_add_reference(evhttp_request_get_output_buffer(req),
+                                    data, size, &ReleaseBody,
+                                    new shared_ptr<const void>(owner)),
+             0);
+  } else if (size > 0) {
+    CHECK_EQ(evbuffer_add(evhttp_request_get_output_buffer(req), data, size),
+             0);
+  }
+  SendBufferedReply(base, req, http_status, content_type, size);
+}
+
+
+}  // namespace
+
+
+string Gzip(const string& data, int level) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  // 16 more window bits ask for the gzip header and trailer.
+  CHECK_EQ(Z_OK, deflateInit2(&stream, level, Z_DEFLATED, MAX_WBITS + 16, 8,
+                              Z_DEFAULT_STRATEGY));
+
+  string result(deflateBound(&stream, data.size()), '\0');
+  stream.next_in =
+      reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+  stream.avail_in = data.size();
+  stream.next_out = reinterpret_cast<Bytef*>(&result[0]);
+  stream.avail_out = result.size();
+  CHECK_EQ(Z_STREAM_END, deflate(&stream, Z_FINISH));
+  result.resize(stream.total_out);
+  CHECK_EQ(Z_OK, deflateEnd(&stream));
+
+  return result;
+}
+
+
+PreparedJsonReply::PreparedJsonReply(string body)
+    : body(move(body)),
+      // Compressed once, so as well as possible.
+      gzipped_body(ShouldCompress(this->body)
+                       ? Gzip(this->body, Z_BEST_COMPRESSION)
+                       : string()) {
+}
+
+
+void SendJsonReply(libevent::Base* base, evhttp_request* req, int http_status,
+                   const JsonObject& json) {
+  SendJsonReply(base, req, http_status, json.ToString());
+}
+
+
+void SendJsonReply(libevent::Base* base, evhttp_request* req, int http_status,
+                   const string& resp_body) {
+  if (ShouldCompress(resp_body)) {
+    AddHeader(req, "Vary", "Accept-Encoding");
+    if (AcceptsGzip(req)) {
+      AddHeader(req, "Content-Encoding", "gzip");
+      return SendReply(base, req, http_status, kJsonContentType,
+                       Gzip(resp_body, Z_DEFAULT_COMPRESSION));
+    }
+  }
+  SendReply(base, req, http_status, kJsonContentType, resp_body);
+}
+
+
+void SendJsonReply(libevent::Base* base, evhttp_request* req, int http_status,
+                   const shared_ptr<const PreparedJsonReply>& reply) {
+  CHECK_NOTNULL(reply.get());
+  const string* body(&reply->body);
+  if (!reply->gzipped_body.empty()) {
+    AddHeader(req, "Vary", "Accept-Encoding");
+    if (AcceptsGzip(req)) {
+      AddHeader(req, "Content-Encoding", "gzip");
+      body = &reply->gzipped_body;
+    }
+  }
+  SendReplyInternal(base, req, http_status, kJsonContentType, body->data(),
+                    body->size(), reply);
+}
+
+
+void SendGzippedJsonFile(libevent::Base* base, evhttp_request* req, int fd,
+                         size_t size) {
+  CHECK_NOTNULL(req);
+  AddHeader(req, "Vary", "Accept-Encoding");
+  AddHeader(req, "Content-Encoding", "gzip");
+  // The evbuffer only keeps a reference to the file, which it writes
+  // with sendfile() (or mmap()) and closes once sent.
+  CHECK_EQ(evbuffer_add_file(evhttp_request_get_output_buffer(req), fd, 0,
+                             size),
+           0);
+  SendBufferedReply(base, req, HTTP_OK, kJsonContentType, size);
+}
+
+
+bool AcceptsGzip(evhttp_request* req) {
+  const char* const accept_encoding(evhttp_find_header(
+      evhttp_request_get_input_headers(req), "Accept-Encoding"));
+  if (!accept_encoding) {
+    return false;
+  }
+
+  // A list of codings, each with optional parameters, like
+  // "gzip;q=0.8, br". A quality of 0 means "not acceptable", and "*"
+  // stands for the codings which are not listed.
+  const string header(accept_encoding);
+  bool wildcard(false);
+  size_t pos(0);
+  while (pos < header.size()) {
+    size_t end(header.find(',', pos));
+    if (end == string::npos) {
+      end = header.size();
+    }
+    const string element(header.substr(pos, end - pos));
+    pos = end + 1;
+
+    const size_t coding_begin(element.find_first_not_of(" \t"));
+    if (coding_begin == string::npos) {
+      continue;
+    }
+    const size_t coding_end(element.find_first_of(" \t;", coding_begin));
+    const string coding(element.substr(coding_begin,
+                                       coding_end == string::npos
+                                           ? string::npos
+                                           : coding_end - coding_begin));
+    const size_t quality(element.find("q=", coding_end));
+    const bool acceptable(quality == string::npos ||
+                          strtod(element.c_str() + quality + 2, nullptr) > 0);
+    if (strcasecmp(coding.c_str(), "gzip") == 0 ||
+        strcasecmp(coding.c_str(), "x-gzip") == 0) {
+      return acceptable;
+    }
+    if (coding == "*") {
+      wildcard = acceptable;
+    }
+  }
+
+  return wildcard;
+}
+
+
+string GzipETag(const string& etag) {
+  CHECK_GE(etag.size(), 2U);
+  return etag.substr(0, etag.size() - 1) + "-gzip\"";
+}
+
+
+bool MatchesIfNoneMatch(evhttp_request* req, const string& etag) {
+  const char* const if_none_match(evhttp_find_header(
+      evhttp_request_get_input_headers(req), "If-None-Match"));
+  if (!if_none_match) {
+    return false;
+  }
+
+  // Either "*", or a list of entity tags like "\"a\", W/\"b\"", which
+  // may have commas within their quotes.
+  const string header(if_none_match);
+  size_t pos(header.find_first_not_of(" \t"));
+  if (pos != string::npos && header[pos] == '*') {
+    return true;
+  }
+  while (pos != string::npos && pos < header.size()) {
+    if (header.compare(pos, 2, "W/") == 0) {
+      pos += 2;
+    }
+    if (pos >= header.size() || header[pos] != '"') {
+      return false;
+    }
+    const size_t close(header.find('"', pos + 1));
+    if (close == string::npos) {
+      return false;
+    }
+    if (header.compare(pos, close + 1 - pos, etag) == 0) {
+      return true;
+    }
+    pos = header.find_first_not_of(" \t,", close + 1);
+  }
+
+  return false;
+}
+
+
+void SendReply(libevent::Base* base, evhttp_request* req, int http_status,
+               const string& content_type, const string& resp_body) {
+  SendReplyInternal(base, req, http_status, content_type.c_str(),
+                    resp_body.data(), resp_body.size(), nullptr);
+}
+
+
 void SendJsonError(libevent::Base* base, evhttp_request* req, int http_status,
                    const string& error_msg) {
   JsonObject json_reply;
@@ -1,6 +1,8 @@
 #ifndef CERT_TRANS_SERVER_JSON_OUTPUT_H_
 #define CERT_TRANS_SERVER_JSON_OUTPUT_H_
 
+#include <stddef.h>
+#include <memory>
 #include <string>
 
 struct evhttp_request;
@@ -12,10 +14,68 @@ class Base;
 }  // namespace libevent
 
 
+// A JSON reply body, along with its gzip encoding when it is large
+// enough for that to be worthwhile (see --http_compression_min_size),
+// for replies which are sent many times and compressed only once.
+struct PreparedJsonReply {
+  explicit PreparedJsonReply(std::string body);
+
+  const std::string body;
+  // Empty if |body| is not compressed.
+  const std::string gzipped_body;
+};
+
+
+// The JSON replies are gzipped for the clients which accept it, if
+// they are large enough.
 void SendJsonReply(libevent::Base* base, evhttp_request* req, int http_status,
                    const JsonObject& json);
 
 
+// As above, with |body| already serialised. The caller may have added
+// headers of its own to the request.
+void SendJsonReply(libevent::Base* base, evhttp_request* req, int http_status,
+                   const std::string& body);
+
+
+// As above, without compressing anything again, and without copying
+// the body either: |reply| is kept until the reply has been sent.
+void SendJsonReply(libevent::Base* base, evhttp_request* req, int http_status,
+                   const std::shared_ptr<const PreparedJsonReply>& reply);
+
+
+// Sends the |size| bytes of the open file |fd|, a gzipped JSON body,
+// to a client which accepts gzip, from the page cache rather than
+// through user space where the system allows it. Takes ownership of
+// |fd|.
+void SendGzippedJsonFile(libevent::Base* base, evhttp_request* req, int fd,
+                         size_t size);
+
+
+// Returns |data| in the gzip format, compressed at zlib |level|.
+std::string Gzip(const std::string& data, int level);
+
+
+// Whether the Accept-Encoding of |req| allows gzip.
+bool AcceptsGzip(evhttp_request* req);
+
+
+// The strong validator of the gzip encoding of a body whose own is
+// |etag| (quoted): the encodings are different representations.
+std::string GzipETag(const std::string& etag);
+
+
+// Whether the If-None-Match of |req| is "*", or lists |etag|. As for
+// any If-None-Match, the entity tags are compared weakly.
+bool MatchesIfNoneMatch(evhttp_request* req, const std::string& etag);
+
+
+// Sends |body| with the given Content-Type, for the few replies which
+// are not JSON.
+void SendReply(libevent::Base* base, evhttp_request* req, int http_status,
+               const std::string& content_type, const std::string& body);
+
+
 void SendJsonError(libevent::Base* base, evhttp_request* req, int http_status,
                    const std::string& error_msg);
 
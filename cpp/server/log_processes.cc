@@ -1,7 +1,11 @@
 #include "server/log_processes.h"
 
 #include <gflags/gflags.h>
+#include <algorithm>
+#include <chrono>
 #include <iostream>
+#include <string>
+#include <thread>
 
 #include "monitoring/latency.h"
 #include "monitoring/monitoring.h"
@@ -13,9 +17,28 @@ DEFINE_int32(tree_signing_frequency_seconds, 600,
              "server select loop, at least this period has elapsed since the "
              "last signing. Set this well below the MMD to ensure we sign in "
              "a timely manner. Must be greater than 0.");
+DEFINE_int32(tree_signing_batch_size, 10000,
+             "Issue a new signed tree head early, as soon as this many "
+             "sequenced entries are not covered by the latest one. 0 "
+             "disables this.");
 DEFINE_int32(sequencing_frequency_seconds, 10,
              "How often should new entries be sequenced. The sequencing runs "
-             "in parallel with the tree signing and cleanup.");
+             "in parallel with the tree signing and cleanup. When the pending "
+             "entries are watched, this is rather how long a new entry can "
+             "wait, once out of the guard window, before being sequenced.");
+DEFINE_int32(sequencing_batch_size, 1000,
+             "When the pending entries are watched, sequence as soon as this "
+             "many new entries are pending, rather than waiting for "
+             "sequencing_frequency_seconds.");
+DEFINE_int32(sequencing_max_idle_seconds, 300,
+             "When the pending entries are watched and none are new, the "
+             "sequencing backs off, running at most this rarely.");
+DEFINE_int32(sequencing_min_interval_ms, 100,
+             "Minimum time between two sequencing runs, bounding the load on "
+             "etcd under heavy traffic.");
+DEFINE_int32(maximum_merge_delay_seconds, 86400,
+             "The maximum merge delay of the log. The sequencing and signing "
+             "periods are capped to a fraction of it.");
 DEFINE_int32(cleanup_frequency_seconds, 10,
              "How often should new entries be cleanedup. The cleanup runs in "
              "in parallel with the tree signing and sequencing.");
@@ -26,6 +49,9 @@ using cert_trans::Latency;
 using google::RegisterFlagValidator;
 using ct::SignedTreeHead;
 using std::function;
+using std::max;
+using std::min;
+using std::string;
 using std::chrono::milliseconds;
 using std::chrono::seconds;
 using std::chrono::steady_clock;
@@ -40,6 +66,10 @@ Counter<bool>* sequencer_total_runs = Counter<bool>::New(
     "sequencer_total_runs", "successful",
     "Total number of sequencer runs broken out by success.");
 
+Counter<string>* sequencer_triggers = Counter<string>::New(
+    "sequencer_triggers", "reason",
+    "Number of sequencer runs broken out by what triggered them.");
+
 Latency<milliseconds> sequencer_sequence_latency_ms(
     "sequencer_sequence_latency_ms",
     "Total time spent sequencing entries by sequencer");
@@ -51,6 +81,10 @@ Counter<bool>* signer_total_runs =
 Latency<milliseconds> signer_run_latency_ms("signer_run_latency_ms",
                                             "Total runtime of signer");
 
+Latency<milliseconds> signer_publish_latency_ms(
+    "signer_publish_latency_ms",
+    "Time spent publishing the tree heads signed by the signer");
+
 static bool ValidateIsPositive(const char* flagname, int value) {
   if (value <= 0) {
     std::cout << flagname << " must be greater than 0" << std::endl;
@@ -62,6 +96,25 @@ static bool ValidateIsPositive(const char* flagname, int value) {
 static const bool sign_dummy =
     RegisterFlagValidator(&FLAGS_tree_signing_frequency_seconds,
                           &ValidateIsPositive);
+
+static const bool mmd_dummy =
+    RegisterFlagValidator(&FLAGS_maximum_merge_delay_seconds,
+                          &ValidateIsPositive);
+
+
+// An entry goes through the sequencing and the signing before being
+// merged, and either can fail and be retried: each gets at most this
+// fraction of the MMD.
+const int kMergeDelayFraction = 4;
+
+
+steady_clock::duration CapToMergeDelay(const steady_clock::duration& period) {
+  return min<steady_clock::duration>(
+      period,
+      seconds(FLAGS_maximum_merge_delay_seconds) / kMergeDelayFraction);
+}
+
+
 }
 
 namespace cert_trans {
@@ -72,7 +125,7 @@ void SignMerkleTree(TreeSigner* tree_signer, ConsistentStore* store,
   CHECK_NOTNULL(store);
   CHECK_NOTNULL(controller);
   const steady_clock::duration period(
-      (seconds(FLAGS_tree_signing_frequency_seconds)));
+      CapToMergeDelay(seconds(FLAGS_tree_signing_frequency_seconds)));
   steady_clock::time_point target_run_time(steady_clock::now());
 
   while (true) {
@@ -84,6 +137,8 @@ void SignMerkleTree(TreeSigner* tree_signer, ConsistentStore* store,
         case TreeSigner::OK: {
           const SignedTreeHead latest_sth(tree_signer->LatestSTH());
           latest_local_tree_size_gauge->Set(latest_sth.tree_size());
+          const ScopedLatency signer_publish_latency(
+              signer_publish_latency_ms.GetScopedLatency());
           controller->NewTreeHead(latest_sth);
           signer_total_runs->Increment(true /* successful */);
           break;
@@ -102,7 +157,13 @@ void SignMerkleTree(TreeSigner* tree_signer, ConsistentStore* store,
     while (target_run_time <= now) {
       target_run_time += period;
     }
-    std::this_thread::sleep_for(target_run_time - now);
+    if (FLAGS_tree_signing_batch_size > 0) {
+      // Sign early if enough entries were sequenced in the meantime.
+      tree_signer->WaitForUnsignedEntries(FLAGS_tree_signing_batch_size,
+                                          target_run_time);
+    } else {
+      std::this_thread::sleep_for(target_run_time - now);
+    }
   }
 }
 
@@ -142,31 +203,60 @@ void CleanUpEntries(ConsistentStore* store,
 }
 
 
+// When the pending entries are watched, runs as soon as enough new
+// entries are pending or the oldest of them has waited long enough, and
+// backs off when none are, so as to sequence new entries sooner under
+// load without polling etcd when idle.
 void SequenceEntries(TreeSigner* tree_signer,
                      const function<bool()>& is_master) {
   CHECK_NOTNULL(tree_signer);
   CHECK(is_master);
-  const steady_clock::duration period(
-      (seconds(FLAGS_sequencing_frequency_seconds)));
-  steady_clock::time_point target_run_time(steady_clock::now());
+  const steady_clock::duration max_delay(
+      CapToMergeDelay(seconds(FLAGS_sequencing_frequency_seconds)));
+  const steady_clock::duration max_idle(
+      max<steady_clock::duration>(
+          max_delay, seconds(FLAGS_sequencing_max_idle_seconds)));
+  const steady_clock::duration min_interval(
+      (milliseconds(FLAGS_sequencing_min_interval_ms)));
+  steady_clock::duration idle_period(max_delay);
 
   while (true) {
-    if (is_master()) {
+    const steady_clock::time_point run_time(steady_clock::now());
+    if (!is_master()) {
+      std::this_thread::sleep_for(max_delay);
+      continue;
+    }
+
+    util::Status status;
+    {
       const ScopedLatency sequencer_sequence_latency(
           sequencer_sequence_latency_ms.GetScopedLatency());
-      util::Status status(tree_signer->SequenceNewEntries());
+      status = tree_signer->SequenceNewEntries();
       if (!status.ok()) {
         LOG(WARNING) << "Problem sequencing new entries: " << status;
       }
       sequencer_total_runs->Increment(status.ok());
     }
-
-    const steady_clock::time_point now(steady_clock::now());
-    while (target_run_time <= now) {
-      target_run_time += period;
+    if (!status.ok()) {
+      // Don't retry right away, whatever is pending.
+      std::this_thread::sleep_until(run_time + max_delay);
+      continue;
     }
+    std::this_thread::sleep_until(run_time + min_interval);
 
-    std::this_thread::sleep_for(target_run_time - now);
+    const int64_t new_pending(tree_signer->WaitForPendingEntries(
+        FLAGS_sequencing_batch_size, max_delay,
+        steady_clock::now() + idle_period));
+    if (new_pending < 0) {
+      sequencer_triggers->Increment("period");
+    } else if (new_pending == 0) {
+      sequencer_triggers->Increment("idle");
+      idle_period = min(idle_period * 2, max_idle);
+    } else {
+      sequencer_triggers->Increment(
+          new_pending >= FLAGS_sequencing_batch_size ? "batch" : "deadline");
+      idle_period = max_delay;
+    }
   }
 }
 
@@ -2,12 +2,17 @@
 
 #include <event2/buffer.h>
 #include <event2/http.h>
+#include <glog/logging.h>
 #include <cstring>
+#include <memory>
 #include <sstream>
+#include <string>
 
 #include "monitoring/prometheus/exporter.h"
 
 using std::ostringstream;
+using std::shared_ptr;
+using std::string;
 using std::strncmp;
 
 namespace cert_trans {
@@ -19,6 +24,12 @@ const char kPrometheusProtoContentType[] =
 const size_t kPrometheusProtoContentTypeLen =
     std::strlen(kPrometheusProtoContentType);
 
+
+void ReleaseSnapshot(const void* /*data*/, size_t /*size*/, void* owner) {
+  delete static_cast<shared_ptr<const string>*>(owner);
+}
+
+
 }  // namespace
 
 
@@ -36,15 +47,24 @@ void ExportPrometheusMetrics(evhttp_request* req) {
                    kPrometheusProtoContentTypeLen) == 0) {
     evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type",
                       kPrometheusProtoContentType);
-    ExportMetricsToPrometheus(&oss);
+    // The snapshot is shared with other scrapes, reference it rather
+    // than copy it.
+    const shared_ptr<const string> snapshot(PrometheusMetricsSnapshot());
+    if (!snapshot->empty()) {
+      CHECK_EQ(evbuffer_add_reference(evhttp_request_get_output_buffer(req),
+                                      snapshot->data(), snapshot->size(),
+                                      &ReleaseSnapshot,
+                                      new shared_ptr<const string>(snapshot)),
+               0);
+    }
   } else {
     evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type",
                       "text/html");
     ExportMetricsToHtml(&oss);
+    evbuffer_add(evhttp_request_get_output_buffer(req), oss.str().data(),
+                 oss.str().size());
   }
 
-  evbuffer_add(evhttp_request_get_output_buffer(req), oss.str().data(),
-               oss.str().size());
   evhttp_send_reply(req, HTTP_OK, /*reason*/ nullptr, /*databuf*/ nullptr);
 }
 
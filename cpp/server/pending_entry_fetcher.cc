@@ -0,0 +1,111 @@
+#include "server/pending_entry_fetcher.h"
+
+#include <event2/http.h>
+#include <glog/logging.h>
+#include <stdlib.h>
+
+#include "log/cluster_state_controller.h"
+#include "monitoring/monitoring.h"
+#include "net/url.h"
+#include "net/url_fetcher.h"
+#include "util/sync_task.h"
+#include "util/util.h"
+
+using std::make_shared;
+using std::shared_ptr;
+using std::string;
+using std::to_string;
+using std::unique_ptr;
+using std::vector;
+using util::SyncTask;
+
+namespace cert_trans {
+namespace {
+
+
+static Counter<string>* pending_entry_fetches(
+    Counter<string>::New("pending_entry_fetches", "result",
+                         "Number of pending entries fetched for their "
+                         "references, by result (local, remote, "
+                         "unknown_node or failed)."));
+
+
+string UriEncode(const string& input) {
+  const unique_ptr<char, void (*)(void*)> output(
+      evhttp_uriencode(input.data(), input.size(), false), &free);
+
+  return output.get();
+}
+
+
+}  // namespace
+
+
+HttpPendingEntryFetcher::HttpPendingEntryFetcher(
+    UrlFetcher* url_fetcher, util::Executor* executor,
+    const ClusterStateController* controller,
+    const PendingEntryStore* local_store, const string& node_id)
+    : url_fetcher_(CHECK_NOTNULL(url_fetcher)),
+      executor_(CHECK_NOTNULL(executor)),
+      controller_(CHECK_NOTNULL(controller)),
+      local_store_(CHECK_NOTNULL(local_store)),
+      node_id_(node_id) {
+}
+
+
+vector<shared_ptr<const LoggedEntry>> HttpPendingEntryFetcher::Fetch(
+    const vector<shared_ptr<const LoggedEntry>>& references) {
+  vector<shared_ptr<const LoggedEntry>> entries(references.size());
+  vector<UrlFetcher::Response> resps(references.size());
+  vector<unique_ptr<SyncTask>> tasks(references.size());
+
+  for (size_t i = 0; i < references.size(); ++i) {
+    CHECK(references[i]->IsReference());
+    const string hash(references[i]->Hash());
+    if (references[i]->origin_node_id() == node_id_) {
+      entries[i] = local_store_->Lookup(hash);
+      pending_entry_fetches->Increment(entries[i] ? "local" : "failed");
+      continue;
+    }
+
+    ct::ClusterNodeState node;
+    if (!controller_->GetNodeState(references[i]->origin_node_id(), &node) ||
+        !node.has_hostname()) {
+      VLOG(1) << "Unknown node " << references[i]->origin_node_id()
+              << " for pending entry " << util::ToBase64(hash);
+      pending_entry_fetches->Increment("unknown_node");
+      continue;
+    }
+    URL url("http://" + node.hostname() + ":" + to_string(node.log_port()) +
+            "/ct/v1/x-get-pending-entry");
+    url.SetQuery("hash=" + UriEncode(util::ToBase64(hash)));
+    tasks[i].reset(new SyncTask(executor_));
+    url_fetcher_->Fetch(UrlFetcher::Request(url), &resps[i],
+                        tasks[i]->task());
+  }
+
+  for (size_t i = 0; i < references.size(); ++i) {
+    if (!tasks[i]) {
+      continue;
+    }
+    tasks[i]->Wait();
+    shared_ptr<LoggedEntry> entry(make_shared<LoggedEntry>());
+    // The entry must be the one the reference was made for.
+    if (!tasks[i]->status().ok() || resps[i].status_code != HTTP_OK ||
+        !entry->ParseFromString(resps[i].body) || entry->IsReference() ||
+        entry->Hash() != references[i]->Hash()) {
+      LOG(WARNING) << "Could not fetch pending entry "
+                   << util::ToBase64(references[i]->Hash()) << " from "
+                   << references[i]->origin_node_id() << ": "
+                   << tasks[i]->status() << " " << resps[i].status_code;
+      pending_entry_fetches->Increment("failed");
+      continue;
+    }
+    entries[i] = entry;
+    pending_entry_fetches->Increment("remote");
+  }
+  return entries;
+}
+
+
+}  // namespace cert_trans
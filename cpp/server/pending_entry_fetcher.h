@@ -0,0 +1,48 @@
+#ifndef CERT_TRANS_SERVER_PENDING_ENTRY_FETCHER_H_
+#define CERT_TRANS_SERVER_PENDING_ENTRY_FETCHER_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "log/pending_entry_store.h"
+
+namespace util {
+class Executor;
+}  // namespace util
+
+namespace cert_trans {
+
+class ClusterStateController;
+class UrlFetcher;
+
+
+// Fetches the entries of references from the PendingEntryStore of the
+// node which took them: that of this node directly, and those of the
+// others from their "x-get-pending-entry" handler, all at once.
+class HttpPendingEntryFetcher : public PendingEntryFetcher {
+ public:
+  // No ownership is taken, and all must outlive this instance.
+  HttpPendingEntryFetcher(UrlFetcher* url_fetcher, util::Executor* executor,
+                          const ClusterStateController* controller,
+                          const PendingEntryStore* local_store,
+                          const std::string& node_id);
+  HttpPendingEntryFetcher(const HttpPendingEntryFetcher&) = delete;
+  HttpPendingEntryFetcher& operator=(const HttpPendingEntryFetcher&) = delete;
+
+  std::vector<std::shared_ptr<const LoggedEntry>> Fetch(
+      const std::vector<std::shared_ptr<const LoggedEntry>>& references)
+      override;
+
+ private:
+  UrlFetcher* const url_fetcher_;
+  util::Executor* const executor_;
+  const ClusterStateController* const controller_;
+  const PendingEntryStore* const local_store_;
+  const std::string node_id_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_SERVER_PENDING_ENTRY_FETCHER_H_
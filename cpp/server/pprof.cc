@@ -0,0 +1,170 @@
+#include "server/pprof.h"
+
+#include <event2/http.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include "base/lock_contention.h"
+#include "config.h"
+#include "server/json_output.h"
+#include "util/libevent_wrapper.h"
+
+#ifdef HAVE_LIBPROFILER
+#include <gperftools/profiler.h>
+#endif
+#if defined(HAVE_LIBTCMALLOC) && defined(HAVE_GPERFTOOLS_MALLOC_EXTENSION_H)
+#include <gperftools/malloc_extension.h>
+#define PPROF_HAVE_HEAP_SAMPLE 1
+#endif
+
+DEFINE_bool(enable_pprof_handlers, false,
+            "Serve CPU and heap profiles, and lock contention statistics, "
+            "under /debug/pprof/. Only enable this where the HTTP port is "
+            "not reachable by the public.");
+DEFINE_int32(pprof_max_profile_seconds, 120,
+             "Longest CPU profile which can be asked for with "
+             "/debug/pprof/profile.");
+
+namespace libevent = cert_trans::libevent;
+
+using std::atomic;
+using std::bind;
+using std::chrono::seconds;
+using std::ifstream;
+using std::max;
+using std::min;
+using std::ostringstream;
+using std::placeholders::_1;
+using std::string;
+using std::thread;
+
+namespace cert_trans {
+namespace {
+
+const int kDefaultProfileSeconds = 30;
+
+
+// Only one CPU profile can be taken at a time, by the process.
+atomic<bool> profiling(false);
+
+
+bool CheckGet(libevent::Base* base, evhttp_request* req) {
+  if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
+    SendReply(base, req, HTTP_BADMETHOD, "text/plain", "Method not allowed.\n");
+    return false;
+  }
+  return true;
+}
+
+
+#ifdef HAVE_LIBPROFILER
+void RunProfile(libevent::Base* base, evhttp_request* req, int secs) {
+  char path[] = "/tmp/ct-cpu-profile-XXXXXX";
+  const int fd(mkstemp(path));
+  if (fd < 0) {
+    PLOG(WARNING) << "mkstemp";
+    profiling.store(false);
+    SendReply(base, req, HTTP_INTERNAL, "text/plain",
+              "Could not create profile file.\n");
+    return;
+  }
+  close(fd);
+
+  LOG(INFO) << "Starting " << secs << "s CPU profile into " << path;
+  if (!ProfilerStart(path)) {
+    unlink(path);
+    profiling.store(false);
+    SendReply(base, req, HTTP_INTERNAL, "text/plain",
+              "Could not start the profiler.\n");
+    return;
+  }
+  std::this_thread::sleep_for(seconds(secs));
+  ProfilerStop();
+  profiling.store(false);
+
+  ifstream in(path, std::ios::binary);
+  ostringstream profile;
+  profile << in.rdbuf();
+  unlink(path);
+  SendReply(base, req, HTTP_OK, "application/octet-stream", profile.str());
+}
+#endif
+
+
+void HandleProfile(libevent::Base* base, evhttp_request* req) {
+  if (!CheckGet(base, req)) {
+    return;
+  }
+#ifdef HAVE_LIBPROFILER
+  const libevent::QueryParams query(libevent::ParseQuery(req));
+  int64_t secs(libevent::GetIntParam(query, "seconds"));
+  if (secs <= 0) {
+    secs = kDefaultProfileSeconds;
+  }
+  secs = min<int64_t>(secs, max(1, FLAGS_pprof_max_profile_seconds));
+
+  bool expected(false);
+  if (!profiling.compare_exchange_strong(expected, true)) {
+    SendReply(base, req, HTTP_SERVUNAVAIL, "text/plain",
+              "A CPU profile is already being taken.\n");
+    return;
+  }
+  // The profile takes a while, do not hold up the event loop (or a
+  // thread of the pool) for it.
+  thread(&RunProfile, base, req, static_cast<int>(secs)).detach();
+#else
+  SendReply(base, req, 501, "text/plain",
+            "Not built with the gperftools CPU profiler.\n");
+#endif
+}
+
+
+void HandleHeap(libevent::Base* base, evhttp_request* req) {
+  if (!CheckGet(base, req)) {
+    return;
+  }
+#ifdef PPROF_HAVE_HEAP_SAMPLE
+  string sample;
+  MallocExtension::instance()->GetHeapSample(&sample);
+  SendReply(base, req, HTTP_OK, "application/octet-stream", sample);
+#else
+  SendReply(base, req, 501, "text/plain", "Not built with tcmalloc.\n");
+#endif
+}
+
+
+void HandleContention(libevent::Base* base, evhttp_request* req) {
+  if (!CheckGet(base, req)) {
+    return;
+  }
+  SendReply(base, req, HTTP_OK, "text/plain", LockContention::Report());
+}
+
+
+}  // namespace
+
+
+void AddPprofHandlers(libevent::HttpServer* server, libevent::Base* base) {
+  CHECK_NOTNULL(server);
+  CHECK_NOTNULL(base);
+  if (!FLAGS_enable_pprof_handlers) {
+    return;
+  }
+  CHECK(server->AddHandler("/debug/pprof/profile",
+                           bind(&HandleProfile, base, _1)));
+  CHECK(server->AddHandler("/debug/pprof/heap", bind(&HandleHeap, base, _1)));
+  CHECK(server->AddHandler("/debug/pprof/contention",
+                           bind(&HandleContention, base, _1)));
+}
+
+
+}  // namespace cert_trans
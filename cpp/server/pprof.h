@@ -0,0 +1,28 @@
+#ifndef CERT_TRANS_SERVER_PPROF_H_
+#define CERT_TRANS_SERVER_PPROF_H_
+
+namespace cert_trans {
+namespace libevent {
+class Base;
+class HttpServer;
+}  // namespace libevent
+
+
+// Adds the /debug/pprof/ handlers to |server|, if
+// --enable_pprof_handlers is set:
+//
+//   /debug/pprof/profile?seconds=N  CPU profile, in the gperftools
+//                                   format read by "pprof".
+//   /debug/pprof/heap               Heap sample from tcmalloc (needs
+//                                   TCMALLOC_SAMPLE_PARAMETER to be set
+//                                   in the environment).
+//   /debug/pprof/contention         How long threads waited for the
+//                                   main locks (see LockContention).
+//
+// Replies are sent through |base|.
+void AddPprofHandlers(libevent::HttpServer* server, libevent::Base* base);
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_SERVER_PPROF_H_
@@ -4,8 +4,11 @@
 #include <event2/http.h>
 #include <event2/http_compat.h>
 #include <event2/keyvalq_struct.h>
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <algorithm>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <unordered_set>
 #include <vector>
@@ -16,13 +19,24 @@
 #include "util/libevent_wrapper.h"
 
 
+DEFINE_bool(proxy_coalesce_requests, true,
+            "Send identical concurrent GET requests proxied to another "
+            "node only once, and give the same reply to all of them.");
+DEFINE_int32(proxy_request_deadline_ms, 0,
+             "time after which requests proxied to another node are given "
+             "up on if they have not been sent yet. 0 means no deadline");
+
 using ct::ClusterNodeState;
 using std::bind;
 using std::getline;
+using std::lock_guard;
 using std::make_pair;
+using std::mutex;
 using std::pair;
 using std::placeholders::_1;
 using std::rand;
+using std::shared_ptr;
+using std::swap;
 using std::string;
 using std::stringstream;
 using std::unique_ptr;
@@ -42,44 +56,60 @@ static Counter<string, int>* total_proxied_responses(
     Counter<string, int>::New("total_proxied_responses", "path", "status_code",
                               "Number of proxied API requests by path "
                               "and status code."));
+static Counter<string>* total_coalesced_proxied_requests(
+    Counter<string>::New("total_coalesced_proxied_requests", "path",
+                         "Number of proxied API requests which were given "
+                         "the reply to an identical one, by path."));
 
 
-void ProxyRequestDone(libevent::Base* base, evhttp_request* request,
-                      const string& path, UrlFetcher::Response* response,
-                      Task* task) {
+// Replies to |request| with |response|, whose body is in |body|. The
+// body is moved out of |body| if |take_body|, and copied otherwise.
+void SendProxiedReply(libevent::Base* base, evhttp_request* request,
+                      const UrlFetcher::Response& response, evbuffer* body,
+                      bool take_body) {
   CHECK_NOTNULL(request);
-  CHECK_NOTNULL(task);
-  unique_ptr<UrlFetcher::Response> response_deleter(CHECK_NOTNULL(response));
-
-  total_proxied_requests->Increment(path);
-  total_proxied_responses->Increment(path, response->status_code);
-
-  if (!task->status().ok()) {
-    return SendJsonError(base, request, HTTP_INTERNAL,
-                         "Proxied request failed.");
-  }
-
-  // TODO(alcutter): Consider retrying the proxied request some number of times
-  // in the case where the request fails.
-  FilterHeaders(&response->headers);
-  for (auto it(response->headers.begin()); it != response->headers.end();
+  for (auto it(response.headers.begin()); it != response.headers.end();
        ++it) {
     CHECK_EQ(evhttp_add_header(evhttp_request_get_output_headers(request),
                                it->first.c_str(), it->second.c_str()),
              0);
   }
-  CHECK_GT(evbuffer_add_printf(evhttp_request_get_output_buffer(request), "%s",
-                               response->body.c_str()),
-           -1);
+  evbuffer* const output(evhttp_request_get_output_buffer(request));
+  if (take_body) {
+    CHECK_EQ(evbuffer_add_buffer(output, body), 0);
+  } else {
+    const int num_chunks(evbuffer_peek(body, -1, nullptr, nullptr, 0));
+    vector<evbuffer_iovec> chunks(num_chunks);
+    CHECK_EQ(evbuffer_peek(body, -1, nullptr, chunks.data(), num_chunks),
+             num_chunks);
+    for (const evbuffer_iovec& chunk : chunks) {
+      CHECK_EQ(evbuffer_add(output, chunk.iov_base, chunk.iov_len), 0);
+    }
+  }
 
-  const int response_code(response->status_code);
-  base->Add([request, response_code]() {
+  const int response_code(response.status_code);
+  libevent::Base::ForRequest(request, base)->Add([request, response_code]() {
     evhttp_send_reply(request, response_code, /*reason*/ NULL,
                       /*databuf*/ NULL);
   });
 }
 
 
+// The key under which identical GET requests are coalesced: whatever
+// the reply depends on.
+string CoalescingKey(evhttp_request* req) {
+  const evkeyvalq* const headers(evhttp_request_get_input_headers(req));
+  string key(evhttp_request_get_uri(req));
+  for (const char* header :
+       {"Accept-Encoding", "If-None-Match", "If-Modified-Since"}) {
+    const char* const value(
+        evhttp_find_header(const_cast<evkeyvalq*>(headers), header));
+    key.append(1, '\n').append(value ? value : "");
+  }
+  return key;
+}
+
+
 }  // namespace
 
 
@@ -122,16 +152,89 @@ Proxy::Proxy(libevent::Base* base,
 }
 
 
+vector<evhttp_request*> Proxy::TakeWaiting(const string& key,
+                                           evhttp_request* req) const {
+  vector<evhttp_request*> requests;
+  if (key.empty()) {
+    requests.push_back(CHECK_NOTNULL(req));
+  } else {
+    lock_guard<mutex> lock(in_flight_lock_);
+    const auto it(in_flight_.find(key));
+    CHECK(it != in_flight_.end());
+    swap(requests, it->second);
+    in_flight_.erase(it);
+  }
+  return requests;
+}
+
+
+void Proxy::ProxyRequestDone(const string& key, evhttp_request* req,
+                             const string& path,
+                             UrlFetcher::Response* response,
+                             const shared_ptr<evbuffer>& body,
+                             Task* task) const {
+  const unique_ptr<Task> task_deleter(CHECK_NOTNULL(task));
+  unique_ptr<UrlFetcher::Response> response_deleter(CHECK_NOTNULL(response));
+
+  const vector<evhttp_request*> requests(TakeWaiting(key, req));
+  total_proxied_requests->Increment(path);
+  total_proxied_responses->Increment(path, response->status_code);
+
+  if (!task->status().ok()) {
+    for (evhttp_request* request : requests) {
+      SendJsonError(base_, request, HTTP_INTERNAL, "Proxied request failed.");
+    }
+    return;
+  }
+
+  // TODO(alcutter): Consider retrying the proxied request some number of times
+  // in the case where the request fails.
+  FilterHeaders(&response->headers);
+  for (size_t i = 0; i < requests.size(); ++i) {
+    // The last one gets the body itself.
+    SendProxiedReply(base_, requests[i], *response, body.get(),
+                     i + 1 == requests.size());
+  }
+}
+
+
 void Proxy::ProxyRequest(evhttp_request* req) const {
   CHECK_NOTNULL(req);
 
+  string key;
+  if (FLAGS_proxy_coalesce_requests &&
+      evhttp_request_get_command(req) == EVHTTP_REQ_GET) {
+    key = CoalescingKey(req);
+    lock_guard<mutex> lock(in_flight_lock_);
+    vector<evhttp_request*>* const waiting(&in_flight_[key]);
+    waiting->push_back(req);
+    if (waiting->size() > 1) {
+      total_coalesced_proxied_requests->Increment(
+          evhttp_uri_get_path(evhttp_request_get_evhttp_uri(req)));
+      return;
+    }
+  }
+
   const vector<ClusterNodeState> fresh_nodes(get_fresh_nodes_());
   if (fresh_nodes.empty()) {
-    return SendJsonError(base_, req, HTTP_SERVUNAVAIL,
-                         "No node able to serve request.");
+    for (evhttp_request* request : TakeWaiting(key, req)) {
+      SendJsonError(base_, request, HTTP_SERVUNAVAIL,
+                    "No node able to serve request.");
+    }
+    return;
   }
-  const ClusterNodeState& target(fresh_nodes[rand() % fresh_nodes.size()]);
+  SendRequest(key, req, fresh_nodes[rand() % fresh_nodes.size()]);
+}
+
+
+void Proxy::ProxyRequestTo(evhttp_request* req,
+                           const ClusterNodeState& target) const {
+  SendRequest("", CHECK_NOTNULL(req), target);
+}
+
 
+void Proxy::SendRequest(const string& key, evhttp_request* req,
+                        const ClusterNodeState& target) const {
   URL url(evhttp_request_uri(req));
   url.SetProtocol("http");
   url.SetHost(target.hostname());
@@ -177,9 +280,21 @@ void Proxy::ProxyRequest(evhttp_request* req) const {
   VLOG(1) << "Proxying request to " << url.Host() << ":" << url.Port()
           << url.PathQuery();
   UrlFetcher::Response* resp(new UrlFetcher::Response);
-  fetcher_->Fetch(fetcher_req, resp, new Task(bind(&ProxyRequestDone, base_,
-                                                   req, url.Path(), resp, _1),
-                                              executor_));
+  // The body is gathered as the chunks it arrives in, which are then
+  // handed over to the reply rather than copied.
+  const shared_ptr<evbuffer> body(CHECK_NOTNULL(evbuffer_new()),
+                                  evbuffer_free);
+  resp->body_chunk = [body](evbuffer* chunk) {
+    CHECK_EQ(evbuffer_add_buffer(body.get(), chunk), 0);
+  };
+  Task* const task(new Task(bind(&Proxy::ProxyRequestDone, this, key, req,
+                                 url.Path(), resp, body, _1),
+                            executor_));
+  if (FLAGS_proxy_request_deadline_ms > 0) {
+    task->CancelAfter(
+        std::chrono::milliseconds(FLAGS_proxy_request_deadline_ms));
+  }
+  fetcher_->Fetch(fetcher_req, resp, task);
 }
 
 
@@ -2,11 +2,16 @@
 #define CERT_TRANS_SERVER_PROXY_H_
 
 #include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
 #include <vector>
 
 #include "net/url_fetcher.h"
 
 
+struct evbuffer;
 struct evhttp_request;
 
 namespace ct {
@@ -41,13 +46,42 @@ class Proxy {
   Proxy(const Proxy&) = delete;
   Proxy& operator=(const Proxy&) = delete;
 
+  // Identical concurrent GET requests are only sent upstream once, and
+  // all get the same reply.
   virtual void ProxyRequest(evhttp_request* req) const;
 
+  // Proxies |req| to |target| rather than to any fresh node, without
+  // coalescing it.
+  void ProxyRequestTo(evhttp_request* req,
+                      const ct::ClusterNodeState& target) const;
+
  private:
+  // Sends |req| to |target|, for the requests waiting under |key| (see
+  // TakeWaiting()).
+  void SendRequest(const std::string& key, evhttp_request* req,
+                   const ct::ClusterNodeState& target) const;
+  // Removes and returns the requests waiting for the reply to the GET
+  // for |key|, or just |req| if |key| is empty.
+  std::vector<evhttp_request*> TakeWaiting(const std::string& key,
+                                           evhttp_request* req) const;
+  // Replies to the requests waiting for |response|, the reply to the
+  // GET for |key|, or to |req| alone if |key| is empty. The body of
+  // |response| is in |body|.
+  void ProxyRequestDone(const std::string& key, evhttp_request* req,
+                        const std::string& path,
+                        UrlFetcher::Response* response,
+                        const std::shared_ptr<evbuffer>& body,
+                        util::Task* task) const;
+
   libevent::Base* const base_;
   const GetFreshNodesFunction get_fresh_nodes_;
   UrlFetcher* const fetcher_;
   util::Executor* const executor_;
+
+  mutable std::mutex in_flight_lock_;
+  // The requests waiting for the reply to a GET which has been sent
+  // upstream, by key (see ProxyRequest()).
+  mutable std::map<std::string, std::vector<evhttp_request*>> in_flight_;
 };
 
 
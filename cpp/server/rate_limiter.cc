@@ -0,0 +1,77 @@
+#include "server/rate_limiter.h"
+
+#include <glog/logging.h>
+#include <algorithm>
+#include <cmath>
+#include <functional>
+
+using std::chrono::duration;
+using std::chrono::seconds;
+using std::hash;
+using std::lock_guard;
+using std::min;
+using std::mutex;
+using std::string;
+
+namespace cert_trans {
+namespace {
+
+
+// The number of buckets a shard keeps before the full ones are
+// dropped.
+const size_t kMaxBucketsPerShard = 4096;
+
+
+}  // namespace
+
+
+RateLimiter::RateLimiter(double rate, double burst)
+    : rate_(rate), burst_(std::max(burst, 1.0)) {
+  CHECK_GT(rate_, 0);
+}
+
+
+bool RateLimiter::Allow(const string& client, Clock::time_point now,
+                        seconds* retry_after) {
+  Shard* const shard(&shards_[hash<string>()(client) % kNumShards]);
+  lock_guard<mutex> lock(shard->lock);
+
+  if (shard->buckets.size() >= kMaxBucketsPerShard) {
+    DropFullBuckets(now, shard);
+  }
+
+  // New clients start with a full bucket.
+  const auto inserted(shard->buckets.emplace(client, Bucket{burst_, now}));
+  Bucket* const bucket(&inserted.first->second);
+  if (!inserted.second && now > bucket->updated) {
+    const double elapsed(duration<double>(now - bucket->updated).count());
+    bucket->tokens = min(burst_, bucket->tokens + elapsed * rate_);
+    bucket->updated = now;
+  }
+
+  if (bucket->tokens >= 1) {
+    bucket->tokens -= 1;
+    return true;
+  }
+
+  if (retry_after) {
+    *retry_after = seconds(static_cast<seconds::rep>(
+        std::ceil((1 - bucket->tokens) / rate_)));
+  }
+  return false;
+}
+
+
+void RateLimiter::DropFullBuckets(Clock::time_point now, Shard* shard) const {
+  for (auto it(shard->buckets.begin()); it != shard->buckets.end();) {
+    const double elapsed(duration<double>(now - it->second.updated).count());
+    if (it->second.tokens + elapsed * rate_ >= burst_) {
+      it = shard->buckets.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,61 @@
+#ifndef CERT_TRANS_SERVER_RATE_LIMITER_H_
+#define CERT_TRANS_SERVER_RATE_LIMITER_H_
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+
+namespace cert_trans {
+
+
+// Token buckets per client: each client (an address, an API key...)
+// can make |rate| requests per second, and up to |burst| at once after
+// having been idle. Thread-safe; the buckets are split over several
+// locks, so that the event threads rarely wait on each other.
+class RateLimiter {
+ public:
+  typedef std::chrono::steady_clock Clock;
+
+  RateLimiter(double rate, double burst);
+  RateLimiter(const RateLimiter&) = delete;
+  RateLimiter& operator=(const RateLimiter&) = delete;
+
+  // Takes a token from the bucket of |client| and returns true, or
+  // returns false and sets |retry_after| to the time until there is
+  // one.
+  bool Allow(const std::string& client, std::chrono::seconds* retry_after) {
+    return Allow(client, Clock::now(), retry_after);
+  }
+
+  // As above, at |now|. For testing.
+  bool Allow(const std::string& client, Clock::time_point now,
+             std::chrono::seconds* retry_after);
+
+ private:
+  struct Bucket {
+    double tokens;
+    Clock::time_point updated;
+  };
+
+  struct Shard {
+    std::mutex lock;
+    std::unordered_map<std::string, Bucket> buckets;
+  };
+
+  static const int kNumShards = 16;
+
+  // Drops the buckets of |shard| which have filled up again, as they
+  // are the same as new ones.
+  void DropFullBuckets(Clock::time_point now, Shard* shard) const;
+
+  const double rate_;
+  const double burst_;
+  Shard shards_[kNumShards];
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_SERVER_RATE_LIMITER_H_
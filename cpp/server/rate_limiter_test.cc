@@ -0,0 +1,64 @@
+#include "server/rate_limiter.h"
+
+#include <gtest/gtest.h>
+
+#include "util/testing.h"
+
+namespace cert_trans {
+namespace {
+
+using std::chrono::milliseconds;
+using std::chrono::seconds;
+
+
+TEST(RateLimiterTest, AllowsBurstThenRate) {
+  RateLimiter limiter(2, 3);
+  const RateLimiter::Clock::time_point start(RateLimiter::Clock::now());
+  seconds retry_after(0);
+
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_TRUE(limiter.Allow("client", start, &retry_after)) << i;
+  }
+  EXPECT_FALSE(limiter.Allow("client", start, &retry_after));
+  EXPECT_EQ(seconds(1), retry_after);
+
+  // Other clients have their own buckets.
+  EXPECT_TRUE(limiter.Allow("other", start, &retry_after));
+
+  // Two tokens a second.
+  EXPECT_TRUE(limiter.Allow("client", start + milliseconds(500),
+                            &retry_after));
+  EXPECT_FALSE(limiter.Allow("client", start + milliseconds(500),
+                             &retry_after));
+  EXPECT_TRUE(limiter.Allow("client", start + milliseconds(1000),
+                            &retry_after));
+
+  // No more than the burst is saved up.
+  const RateLimiter::Clock::time_point later(start + seconds(60));
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_TRUE(limiter.Allow("client", later, &retry_after)) << i;
+  }
+  EXPECT_FALSE(limiter.Allow("client", later, &retry_after));
+}
+
+
+TEST(RateLimiterTest, RetryAfterRoundsUp) {
+  RateLimiter limiter(0.25, 1);
+  const RateLimiter::Clock::time_point start(RateLimiter::Clock::now());
+  seconds retry_after(0);
+
+  EXPECT_TRUE(limiter.Allow("client", start, &retry_after));
+  EXPECT_FALSE(limiter.Allow("client", start + milliseconds(500),
+                             &retry_after));
+  EXPECT_EQ(seconds(4), retry_after);
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,213 @@
+#include "server/read_replica.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <chrono>
+#include <functional>
+#include <vector>
+
+#include "client/async_log_client.h"
+#include "fetcher/continuous_fetcher.h"
+#include "fetcher/remote_peer.h"
+#include "log/database.h"
+#include "log/log_lookup.h"
+#include "log/log_verifier.h"
+#include "merkletree/compact_merkle_tree.h"
+#include "merkletree/merkle_verifier.h"
+#include "monitoring/counter.h"
+#include "monitoring/monitoring.h"
+#include "server/metrics.h"
+#include "util/thread_pool.h"
+#include "util/util.h"
+
+DECLARE_int32(http_server_reactors);
+DECLARE_bool(pin_http_server_reactors);
+DEFINE_int32(read_replica_sth_check_seconds, 5,
+             "How often a read replica checks whether its entries have "
+             "caught up with the tree heads of its peer.");
+
+using ct::SignedTreeHead;
+using std::bind;
+using std::chrono::seconds;
+using std::lock_guard;
+using std::make_shared;
+using std::map;
+using std::mutex;
+using std::placeholders::_1;
+using std::shared_ptr;
+using std::string;
+using std::thread;
+using std::unique_ptr;
+using std::vector;
+using util::HexString;
+
+namespace cert_trans {
+namespace {
+
+
+Counter<>* replica_inconsistent_sths =
+    Counter<>::New("replica_inconsistent_sths",
+                   "Number of STHs received by a read replica from its peer "
+                   "whose root hash does not match the local entries.");
+
+// How many leaves to add to the tree at once when catching it up.
+const size_t kLeafBatchSize = 1 << 16;
+
+
+LogVerifier* NewLogVerifier(EVP_PKEY* key) {
+  return new LogVerifier(new LogSigVerifier(key),
+                         new MerkleVerifier(
+                             unique_ptr<Sha256Hasher>(new Sha256Hasher)));
+}
+
+
+}  // namespace
+
+
+ReadReplica::ReadReplica(const shared_ptr<libevent::Base>& event_base,
+                         ThreadPool* internal_pool, ThreadPool* fetch_pool,
+                         Database* db, UrlFetcher* url_fetcher,
+                         const string& peer_uri, EVP_PKEY* peer_key,
+                         const Server::Options& options)
+    : options_(options),
+      event_base_(event_base),
+      event_pump_(new libevent::EventPumpThread(event_base_)),
+      http_server_(*event_base_, FLAGS_http_server_reactors,
+                   FLAGS_pin_http_server_reactors),
+      db_(CHECK_NOTNULL(db)),
+      log_verifier_(NewLogVerifier(CHECK_NOTNULL(peer_key))),
+      task_(CHECK_NOTNULL(internal_pool)),
+      fetcher_(ContinuousFetcher::New(event_base_.get(), internal_pool, db_,
+                                      log_verifier_.get(),
+                                      true /* fetch_scts */)),
+      log_lookup_(
+          new LogLookup(db_, internal_pool, options_.merkle_node_file)),
+      tree_(log_lookup_->GetCompactMerkleTree(new Sha256Hasher)) {
+  CHECK_LT(0, options_.port);
+  CHECK(!peer_uri.empty());
+
+  if (FLAGS_monitoring == kPrometheus) {
+    http_server_.AddHandler("/metrics", ExportPrometheusMetrics);
+  }
+  http_server_.Bind(nullptr, options_.port);
+
+  LOG(INFO) << "Following " << peer_uri << " as a read replica";
+  fetcher_->AddPeer(
+      "peer",
+      make_shared<RemotePeer>(
+          unique_ptr<AsyncLogClient>(new AsyncLogClient(
+              CHECK_NOTNULL(fetch_pool), CHECK_NOTNULL(url_fetcher),
+              peer_uri)),
+          unique_ptr<LogVerifier>(NewLogVerifier(peer_key)),
+          bind(&ReadReplica::NewSTH, this, _1),
+          task_.task()->AddChild(
+              [](util::Task*) { LOG(INFO) << "RemotePeer exited."; })));
+
+  updater_ = thread(&ReadReplica::UpdateTreeHeads, this,
+                    task_.task()->AddChild([](util::Task*) {
+                      LOG(INFO) << "Tree head updater exited.";
+                    }));
+}
+
+
+ReadReplica::~ReadReplica() {
+  task_.Cancel();
+  updater_.join();
+  task_.Wait();
+}
+
+
+void ReadReplica::Run() {
+  // Ding the temporary event pump because we're about to enter the event loop
+  event_pump_.reset();
+  event_base_->Dispatch();
+}
+
+
+void ReadReplica::NewSTH(const SignedTreeHead& sth) {
+  lock_guard<mutex> lock(lock_);
+  const auto it(pending_sths_.find(sth.tree_size()));
+  if (it != pending_sths_.end() &&
+      sth.timestamp() <= it->second.timestamp()) {
+    return;
+  }
+  pending_sths_[sth.tree_size()] = sth;
+}
+
+
+void ReadReplica::UpdateTreeHeads(util::Task* task) {
+  while (!task->CancelRequested()) {
+    const int64_t local_size(db_->TreeSize());
+    map<int64_t, SignedTreeHead> ready;
+    {
+      lock_guard<mutex> lock(lock_);
+      while (!pending_sths_.empty() &&
+             pending_sths_.begin()->first <= local_size) {
+        ready.insert(*pending_sths_.begin());
+        pending_sths_.erase(pending_sths_.begin());
+      }
+    }
+
+    for (const auto& entry : ready) {
+      const SignedTreeHead& sth(entry.second);
+      if (!MatchesLocalTree(sth)) {
+        LOG(WARNING) << "STH of size " << sth.tree_size() << " with root "
+                     << HexString(sth.sha256_root_hash())
+                     << " does not match the local entries";
+        replica_inconsistent_sths->Increment();
+        continue;
+      }
+      if (sth.timestamp() <= log_lookup_->GetSTH().timestamp()) {
+        continue;
+      }
+      // LogLookup picks it up from the database.
+      const Database::WriteResult result(db_->WriteTreeHead(sth));
+      if (result != Database::OK) {
+        LOG(WARNING) << "Failed to write STH of size " << sth.tree_size()
+                     << ": " << result;
+        continue;
+      }
+      LOG(INFO) << "Serving STH of size " << sth.tree_size();
+    }
+
+    std::this_thread::sleep_for(seconds(FLAGS_read_replica_sth_check_seconds));
+  }
+  task->Return(util::Status::CANCELLED);
+}
+
+
+bool ReadReplica::MatchesLocalTree(const SignedTreeHead& sth) {
+  const uint64_t tree_size(sth.tree_size());
+  if (tree_size < tree_->LeafCount()) {
+    // Past the tree served, this would only be after an inconsistent
+    // STH, with which the peer is not to be trusted anyway.
+    return tree_size <= static_cast<uint64_t>(
+                            log_lookup_->GetSTH().tree_size()) &&
+           log_lookup_->RootAtSnapshot(tree_size) == sth.sha256_root_hash();
+  }
+
+  Database::ScanOptions scan_options;
+  scan_options.readahead = kLeafBatchSize;
+  scan_options.fill_cache = false;
+  unique_ptr<Database::Iterator> entries(
+      db_->ScanEntries(tree_->LeafCount(), tree_size, scan_options));
+  vector<LoggedEntry> entry_batch;
+  vector<string> leaves;
+  while (tree_->LeafCount() < tree_size) {
+    const uint64_t leaf_count(tree_->LeafCount());
+    const size_t batch_size(
+        std::min<uint64_t>(kLeafBatchSize, tree_size - leaf_count));
+    CHECK_EQ(batch_size, entries->GetNextEntries(batch_size, &entry_batch));
+    leaves.resize(batch_size);
+    for (size_t i = 0; i < batch_size; ++i) {
+      CHECK_EQ(leaf_count + i,
+               static_cast<uint64_t>(entry_batch[i].sequence_number()));
+      CHECK(entry_batch[i].SerializeForLeaf(&leaves[i]));
+    }
+    CHECK_EQ(leaf_count + batch_size, tree_->AddLeaves(leaves));
+  }
+  return tree_->CurrentRoot() == sth.sha256_root_hash();
+}
+
+
+}  // namespace cert_trans
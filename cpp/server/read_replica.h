@@ -0,0 +1,89 @@
+#ifndef CERT_TRANS_SERVER_READ_REPLICA_H_
+#define CERT_TRANS_SERVER_READ_REPLICA_H_
+
+#include <openssl/evp.h>
+#include <stdint.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "proto/ct.pb.h"
+#include "server/server.h"
+#include "util/libevent_wrapper.h"
+#include "util/sync_task.h"
+
+class CompactMerkleTree;
+class LogVerifier;
+
+namespace cert_trans {
+
+class ContinuousFetcher;
+class Database;
+class LogLookup;
+class ThreadPool;
+class UrlFetcher;
+
+
+// Serves the read-only part of a log (get-sth, get-entries and the
+// proofs) from a local database, which it keeps up to date from a peer
+// rather than as a member of the cluster: the entries are fetched from
+// the peer by a ContinuousFetcher, and the tree heads of the peer are
+// written to the database, and so served, once the local entries match
+// them. It does not use etcd at all, so adding replicas does not add to
+// the load on it.
+class ReadReplica {
+ public:
+  // Doesn't take ownership of anything. |peer_key| is the public key of
+  // the log. Only Options::server, port and merkle_node_file are used.
+  ReadReplica(const std::shared_ptr<libevent::Base>& event_base,
+              ThreadPool* internal_pool, ThreadPool* fetch_pool, Database* db,
+              UrlFetcher* url_fetcher, const std::string& peer_uri,
+              EVP_PKEY* peer_key,
+              const Server::Options& options = Server::Options());
+  ~ReadReplica();
+  ReadReplica(const ReadReplica&) = delete;
+  ReadReplica& operator=(const ReadReplica&) = delete;
+
+  LogLookup* log_lookup() {
+    return log_lookup_.get();
+  }
+
+  libevent::HttpServer* http_server() {
+    return &http_server_;
+  }
+
+  void Run();
+
+ private:
+  void NewSTH(const ct::SignedTreeHead& sth);
+  void UpdateTreeHeads(util::Task* task);
+  // Returns whether |sth| matches the local entries, adding those it
+  // covers to |tree_| as needed.
+  bool MatchesLocalTree(const ct::SignedTreeHead& sth);
+
+  const Server::Options options_;
+  const std::shared_ptr<libevent::Base> event_base_;
+  std::unique_ptr<libevent::EventPumpThread> event_pump_;
+  libevent::HttpServer http_server_;
+  Database* const db_;
+  const std::unique_ptr<LogVerifier> log_verifier_;
+  util::SyncTask task_;
+  std::unique_ptr<ContinuousFetcher> fetcher_;
+  std::unique_ptr<LogLookup> log_lookup_;
+  // Only used by the thread of UpdateTreeHeads().
+  std::unique_ptr<CompactMerkleTree> tree_;
+
+  std::mutex lock_;
+  // The tree heads received from the peer and not served yet, by tree
+  // size.
+  std::map<int64_t, ct::SignedTreeHead> pending_sths_;
+
+  std::thread updater_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_SERVER_READ_REPLICA_H_
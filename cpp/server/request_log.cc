@@ -0,0 +1,202 @@
+#include "server/request_log.h"
+
+#include <event2/buffer.h>
+#include <event2/http.h>
+#include <glog/logging.h>
+#include <stdlib.h>
+#include <vector>
+
+#include "monitoring/monitoring.h"
+#include "util/util.h"
+
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+using std::chrono::system_clock;
+using std::lock_guard;
+using std::mutex;
+using std::string;
+using std::unique_lock;
+using std::vector;
+
+namespace cert_trans {
+namespace {
+
+
+static Counter<>* http_request_log_write_errors(
+    Counter<>::New("http_request_log_write_errors",
+                   "Number of failures to write out the request log."));
+
+
+// How often the requests are written out.
+const milliseconds kWritePeriod(100);
+
+
+const char* MethodName(evhttp_cmd_type command) {
+  switch (command) {
+    case EVHTTP_REQ_GET:
+      return "GET";
+    case EVHTTP_REQ_POST:
+      return "POST";
+    case EVHTTP_REQ_PUT:
+      return "PUT";
+    case EVHTTP_REQ_DELETE:
+      return "DELETE";
+    default:
+      return "OTHER";
+  }
+}
+
+
+// Unlike util::split(), keeps the empty fields.
+vector<string> SplitFields(const string& line) {
+  vector<string> fields;
+  size_t start(0);
+  while (true) {
+    const size_t end(line.find('\t', start));
+    fields.push_back(line.substr(start, end - start));
+    if (end == string::npos) {
+      return fields;
+    }
+    start = end + 1;
+  }
+}
+
+
+}  // namespace
+
+
+RequestLog::RequestLog(const string& path, bool log_bodies)
+    : log_bodies_(log_bodies),
+      file_(fopen(path.c_str(), "a")),
+      exiting_(false) {
+  PCHECK(file_) << "Cannot open the request log " << path;
+  writer_ = std::thread(&RequestLog::Writer, this);
+}
+
+
+RequestLog::~RequestLog() {
+  {
+    lock_guard<mutex> lock(lock_);
+    exiting_ = true;
+  }
+  wake_writer_.notify_one();
+  writer_.join();
+  PCHECK(fclose(file_) == 0) << "Cannot close the request log";
+}
+
+
+void RequestLog::RequestStarted(evhttp_request* req) {
+  Pending pending;
+  pending.start = steady_clock::now();
+  pending.record.arrival_us =
+      duration_cast<microseconds>(system_clock::now().time_since_epoch())
+          .count();
+  pending.record.method = MethodName(evhttp_request_get_command(req));
+  pending.record.uri = evhttp_request_get_uri(req);
+  if (log_bodies_) {
+    evbuffer* const input(evhttp_request_get_input_buffer(req));
+    string body(evbuffer_get_length(input), '\0');
+    evbuffer_copyout(input, &body[0], body.size());
+    pending.record.body = util::ToBase64(body);
+  }
+  evhttp_request_set_on_complete_cb(req, &RequestLog::RequestDone, this);
+
+  lock_guard<mutex> lock(lock_);
+  const auto it(pending_.find(req));
+  if (it != pending_.end()) {
+    // The previous request at this address was freed without a reply.
+    Append(it->second.record);
+    it->second = std::move(pending);
+  } else {
+    pending_.emplace(req, std::move(pending));
+  }
+}
+
+
+// static
+void RequestLog::RequestDone(evhttp_request* req, void* log) {
+  RequestLog* const self(static_cast<RequestLog*>(log));
+  const steady_clock::time_point now(steady_clock::now());
+  lock_guard<mutex> lock(self->lock_);
+  const auto it(self->pending_.find(req));
+  if (it == self->pending_.end()) {
+    return;
+  }
+  Record* const record(&it->second.record);
+  record->latency_us =
+      duration_cast<microseconds>(now - it->second.start).count();
+  record->status = evhttp_request_get_response_code(req);
+  self->Append(*record);
+  self->pending_.erase(it);
+}
+
+
+void RequestLog::Append(const Record& record) {
+  buffer_.append(FormatRecord(record));
+  buffer_.push_back('\n');
+}
+
+
+void RequestLog::Writer() {
+  string lines;
+  unique_lock<mutex> lock(lock_);
+  while (true) {
+    wake_writer_.wait_for(lock, kWritePeriod);
+    lines.swap(buffer_);
+    const bool exiting(exiting_);
+    lock.unlock();
+
+    if (!lines.empty() &&
+        (fwrite(lines.data(), 1, lines.size(), file_) != lines.size() ||
+         fflush(file_) != 0)) {
+      PLOG(WARNING) << "Cannot write the request log";
+      http_request_log_write_errors->Increment();
+    }
+    lines.clear();
+
+    if (exiting) {
+      return;
+    }
+    lock.lock();
+  }
+}
+
+
+// static
+string RequestLog::FormatRecord(const Record& record) {
+  return std::to_string(record.arrival_us) + "\t" +
+         std::to_string(record.latency_us) + "\t" +
+         std::to_string(record.status) + "\t" + record.method + "\t" +
+         record.uri + "\t" + record.body;
+}
+
+
+// static
+bool RequestLog::ParseRecord(const string& line, Record* record) {
+  const vector<string> fields(SplitFields(line));
+  if (fields.size() != 6) {
+    return false;
+  }
+  char* end;
+  record->arrival_us = strtoll(fields[0].c_str(), &end, 10);
+  if (fields[0].empty() || *end != '\0') {
+    return false;
+  }
+  record->latency_us = strtoll(fields[1].c_str(), &end, 10);
+  if (fields[1].empty() || *end != '\0') {
+    return false;
+  }
+  record->status = strtol(fields[2].c_str(), &end, 10);
+  if (fields[2].empty() || *end != '\0') {
+    return false;
+  }
+  record->method = fields[3];
+  record->uri = fields[4];
+  record->body = util::FromBase64(fields[5].c_str());
+  return !record->method.empty() && !record->uri.empty();
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,90 @@
+#ifndef CERT_TRANS_SERVER_REQUEST_LOG_H_
+#define CERT_TRANS_SERVER_REQUEST_LOG_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include "util/libevent_wrapper.h"
+
+namespace cert_trans {
+
+
+// Records the requests to a server in a file, with their timing and
+// outcome, so that they can be replayed against another server (see
+// tools/replay_requests.cc). Each request is a line of tab-separated
+// fields:
+//
+//   <arrival> <latency> <status> <method> <uri> <body>
+//
+// where <arrival> is when the request came in, in microseconds since
+// the epoch, <latency> the time in microseconds until its reply was
+// sent, <status> the HTTP status of the reply, or 0 if none was sent
+// (e.g. the client went away first), and <body> the request body in
+// base64, if the bodies are logged, and empty otherwise.
+//
+// The lines are written out by a thread of its own, so that the event
+// loops do not wait for the disk. An instance must outlive the HTTP
+// servers whose requests it logs.
+class RequestLog {
+ public:
+  struct Record {
+    int64_t arrival_us = 0;
+    int64_t latency_us = 0;
+    int status = 0;
+    std::string method;
+    std::string uri;
+    std::string body;
+  };
+
+  // Appends to the file at |path|. With |log_bodies|, the request
+  // bodies are logged too, so that the submissions can be replayed.
+  RequestLog(const std::string& path, bool log_bodies);
+  // Writes out the requests done so far.
+  ~RequestLog();
+  RequestLog(const RequestLog&) = delete;
+  RequestLog& operator=(const RequestLog&) = delete;
+
+  // Must be called on the event thread of |req|, as it comes in. It is
+  // logged once its reply is sent.
+  void RequestStarted(evhttp_request* req);
+
+  static std::string FormatRecord(const Record& record);
+  // Returns false if |line| is not a valid record.
+  static bool ParseRecord(const std::string& line, Record* record);
+
+ private:
+  struct Pending {
+    std::chrono::steady_clock::time_point start;
+    Record record;
+  };
+
+  static void RequestDone(evhttp_request* req, void* log);
+  // Queues |record| for writing. Must be called with |lock_| held.
+  void Append(const Record& record);
+  void Writer();
+
+  const bool log_bodies_;
+  FILE* const file_;
+
+  std::mutex lock_;
+  std::condition_variable wake_writer_;
+  // The requests waiting for their reply. Requests whose client went
+  // away are freed without a reply: they stay here until a new request
+  // is at the same address, and are logged with a status of 0 then.
+  std::unordered_map<evhttp_request*, Pending> pending_;
+  // The lines not written out yet.
+  std::string buffer_;
+  bool exiting_;
+  std::thread writer_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_SERVER_REQUEST_LOG_H_
@@ -0,0 +1,69 @@
+#include "server/request_log.h"
+
+#include <gtest/gtest.h>
+
+#include "util/testing.h"
+
+namespace cert_trans {
+namespace {
+
+
+TEST(RequestLogTest, RoundTrip) {
+  RequestLog::Record record;
+  record.arrival_us = 1444000000123456;
+  record.latency_us = 2500;
+  record.status = 200;
+  record.method = "POST";
+  record.uri = "/ct/v1/add-chain";
+  record.body = "{\"chain\": []}";
+
+  RequestLog::Record parsed;
+  ASSERT_TRUE(
+      RequestLog::ParseRecord(RequestLog::FormatRecord(record), &parsed));
+  EXPECT_EQ(record.arrival_us, parsed.arrival_us);
+  EXPECT_EQ(record.latency_us, parsed.latency_us);
+  EXPECT_EQ(record.status, parsed.status);
+  EXPECT_EQ(record.method, parsed.method);
+  EXPECT_EQ(record.uri, parsed.uri);
+  EXPECT_EQ(record.body, parsed.body);
+}
+
+
+TEST(RequestLogTest, RoundTripWithoutBody) {
+  RequestLog::Record record;
+  record.arrival_us = 1;
+  record.status = 0;
+  record.method = "GET";
+  record.uri = "/ct/v1/get-entries?start=0&end=9";
+
+  RequestLog::Record parsed;
+  ASSERT_TRUE(
+      RequestLog::ParseRecord(RequestLog::FormatRecord(record), &parsed));
+  EXPECT_EQ(0, parsed.status);
+  EXPECT_EQ(record.uri, parsed.uri);
+  EXPECT_EQ("", parsed.body);
+}
+
+
+TEST(RequestLogTest, RejectsMalformedLines) {
+  RequestLog::Record parsed;
+  EXPECT_FALSE(RequestLog::ParseRecord("", &parsed));
+  EXPECT_FALSE(RequestLog::ParseRecord("garbage", &parsed));
+  EXPECT_FALSE(
+      RequestLog::ParseRecord("1\t2\t200\tGET\t/ct/v1/get-sth", &parsed));
+  EXPECT_FALSE(
+      RequestLog::ParseRecord("x\t2\t200\tGET\t/ct/v1/get-sth\t", &parsed));
+  EXPECT_FALSE(
+      RequestLog::ParseRecord("1\t2\t\tGET\t/ct/v1/get-sth\t", &parsed));
+  EXPECT_FALSE(RequestLog::ParseRecord("1\t2\t200\tGET\t\t", &parsed));
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -1,19 +1,28 @@
 #include "server/server.h"
 
 #include <gflags/gflags.h>
+#include <unistd.h>
 #include <chrono>
 #include <csignal>
 #include <functional>
+#include <future>
 
+#include "config.h"
+#include "log/caching_consistent_store.h"
 #include "log/cluster_state_controller.h"
 #include "log/etcd_consistent_store.h"
 #include "log/frontend.h"
+#include "log/local_consistent_store.h"
 #include "log/log_lookup.h"
 #include "log/log_verifier.h"
+#include "log/pending_entry_store.h"
 #include "monitoring/gcm/exporter.h"
 #include "monitoring/monitoring.h"
+#include "server/http2_server.h"
 #include "server/metrics.h"
+#include "server/pending_entry_fetcher.h"
 #include "server/proxy.h"
+#include "util/socket_handoff.h"
 #include "util/thread_pool.h"
 #include "util/uuid.h"
 
@@ -21,17 +30,22 @@ using std::bind;
 using std::chrono::seconds;
 using std::chrono::steady_clock;
 using std::placeholders::_1;
+using std::promise;
 using std::shared_ptr;
 using std::signal;
 using std::string;
 using std::this_thread::sleep_for;
 using std::thread;
+using util::StatusOr;
 
 // These flags are DEFINEd in server_helper to keep the validation logic
 // related to server startup options in one place.
 DECLARE_string(server);
 DECLARE_int32(port);
 DECLARE_string(etcd_root);
+DECLARE_string(merkle_node_file);
+DECLARE_string(hot_restart_socket);
+DECLARE_string(etcd_servers);
 
 DEFINE_int32(node_state_refresh_seconds, 10,
              "How often to refresh the ClusterNodeState entry for this node.");
@@ -40,6 +54,57 @@ DEFINE_int32(watchdog_seconds, 120,
              "before firing the watchdog timer.");
 DEFINE_bool(watchdog_timeout_is_fatal, true,
             "Exit if the watchdog timer fires.");
+DEFINE_int32(http_server_reactors, 0,
+             "Number of event loops serving HTTP requests besides the main "
+             "one, each on its own thread and listening socket (with "
+             "SO_REUSEPORT). 0 serves them all from the main event loop.");
+DEFINE_bool(pin_http_server_reactors, false,
+            "Pin the threads of the --http_server_reactors event loops to "
+            "a CPU each, spread over the NUMA nodes, and have each accept "
+            "the connections arriving on its CPU.");
+DEFINE_int32(http_max_body_bytes, 32768,
+             "Maximum size of the body of any HTTP request, which bounds "
+             "what is buffered per connection. Larger ones are rejected "
+             "with 413 as soon as their size is known.");
+DEFINE_int32(http_request_timeout_secs, 30,
+             "How long a client has to send its HTTP request, and to read "
+             "the reply, before its connection is closed.");
+DEFINE_int32(http_max_connections, 0,
+             "Maximum number of HTTP connections open at once, over which "
+             "requests are refused with 503 and their connection closed. "
+             "0 for no limit.");
+DEFINE_int32(http_max_connections_per_address, 0,
+             "Maximum number of HTTP connections open at once from any one "
+             "client address. 0 for no limit.");
+DEFINE_int32(http_idle_timeout_secs, 0,
+             "How long an HTTP connection may stay idle between requests "
+             "before it is closed. 0 for --http_request_timeout_secs.");
+DEFINE_bool(etcd_pending_entry_references, false,
+            "Write only references to the pending entries to etcd, and "
+            "keep the entries themselves in the memory of the node which "
+            "took them until they are sequenced, for the master to fetch. "
+            "This keeps the etcd writes small whatever the chains, but the "
+            "entries taken by a node which restarts before they are "
+            "sequenced are lost until they are submitted again. All the "
+            "nodes must run a version which understands references.");
+DEFINE_int32(hot_restart_drain_seconds, 30,
+             "After handing its listening sockets over to a new process "
+             "through --hot_restart_socket, how long to keep serving the "
+             "connections already accepted before exiting.");
+
+DEFINE_int32(http2_port, 0,
+             "Port to also serve HTTP/2 on, in cleartext with prior "
+             "knowledge unless --http2_tls_cert_file is given. The requests "
+             "are passed on to the HTTP/1.1 server of this process over "
+             "loopback connections, so --url_fetcher_max_conn_overrides "
+             "should allow enough of them to 127.0.0.1:<--port>, and the "
+             "limits per client address need --rate_limit_client_header. "
+             "0 to only serve HTTP/1.1.");
+DEFINE_string(http2_tls_cert_file, "",
+              "PEM certificate chain to serve HTTP/2 over TLS with, which "
+              "clients negotiate with ALPN.");
+DEFINE_string(http2_tls_key_file, "",
+              "PEM private key of --http2_tls_cert_file.");
 
 namespace cert_trans {
 
@@ -107,6 +172,16 @@ string GetNodeId(Database* db) {
 }  // namespace
 
 
+Server::Options::Options()
+    : server(FLAGS_server),
+      port(FLAGS_port),
+      etcd_root(FLAGS_etcd_root),
+      merkle_node_file(FLAGS_merkle_node_file),
+      hot_restart_socket(FLAGS_hot_restart_socket),
+      local_consistent_store(FLAGS_etcd_servers.empty()) {
+}
+
+
 // static
 void Server::StaticInit() {
   CHECK_NE(SIG_ERR, signal(SIGALRM, &WatchdogTimeout));
@@ -116,38 +191,89 @@ void Server::StaticInit() {
 Server::Server(const shared_ptr<libevent::Base>& event_base,
                ThreadPool* internal_pool, ThreadPool* http_pool, Database* db,
                EtcdClient* etcd_client, UrlFetcher* url_fetcher,
-               const LogVerifier* log_verifier)
-    : event_base_(event_base),
+               const LogVerifier* log_verifier, const Options& options)
+    : options_(options),
+      event_base_(event_base),
       event_pump_(new libevent::EventPumpThread(event_base_)),
-      http_server_(*event_base_),
+      http_server_(*event_base_, FLAGS_http_server_reactors,
+                   FLAGS_pin_http_server_reactors),
       db_(CHECK_NOTNULL(db)),
       log_verifier_(CHECK_NOTNULL(log_verifier)),
       node_id_(GetNodeId(db_)),
       url_fetcher_(CHECK_NOTNULL(url_fetcher)),
       etcd_client_(CHECK_NOTNULL(etcd_client)),
-      election_(event_base_, etcd_client_, FLAGS_etcd_root + "/election",
+      election_(event_base_, etcd_client_, options_.etcd_root + "/election",
                 node_id_),
       internal_pool_(CHECK_NOTNULL(internal_pool)),
       server_task_(internal_pool_),
-      consistent_store_(&election_,
-                        new EtcdConsistentStore(event_base_.get(),
-                                                internal_pool_, etcd_client_,
-                                                &election_, FLAGS_etcd_root,
-                                                node_id_)),
+      pending_entry_store_(FLAGS_etcd_pending_entry_references &&
+                                   !options_.local_consistent_store
+                               ? new PendingEntryStore(db_, internal_pool_)
+                               : nullptr),
+      consistent_store_(
+          &election_,
+          options_.local_consistent_store
+              ? static_cast<ConsistentStore*>(
+                    new LocalConsistentStore(&election_, node_id_))
+              : new CachingConsistentStore(new EtcdConsistentStore(
+                    event_base_.get(), internal_pool_, etcd_client_,
+                    &election_, options_.etcd_root, node_id_,
+                    pending_entry_store_.get()))),
       http_pool_(CHECK_NOTNULL(http_pool)) {
-  CHECK_LT(0, FLAGS_port);
+  CHECK_LT(0, options_.port);
+  CHECK_LT(0, FLAGS_http_max_body_bytes);
+  CHECK_LT(0, FLAGS_http_request_timeout_secs);
+  CHECK_LE(0, FLAGS_hot_restart_drain_seconds);
+  http_server_.SetLimits(FLAGS_http_max_body_bytes,
+                         FLAGS_http_request_timeout_secs);
+  http_server_.SetConnectionLimits(FLAGS_http_max_connections,
+                                   FLAGS_http_max_connections_per_address,
+                                   FLAGS_http_idle_timeout_secs);
 
   if (FLAGS_monitoring == kPrometheus) {
     http_server_.AddHandler("/metrics", ExportPrometheusMetrics);
   } else if (FLAGS_monitoring == kGcm) {
     gcm_exporter_.reset(
-        new GCMExporter(FLAGS_server, url_fetcher_, internal_pool_));
+        new GCMExporter(options_.server, url_fetcher_, internal_pool_));
   } else {
     LOG(FATAL) << "Please set --monitoring to one of the supported values.";
   }
 
-  http_server_.Bind(nullptr, FLAGS_port);
-  election_.StartElection();
+  if (FLAGS_http2_port > 0) {
+#ifdef HAVE_NGHTTP2
+    CHECK_EQ(FLAGS_http2_tls_cert_file.empty(),
+             FLAGS_http2_tls_key_file.empty())
+        << "--http2_tls_cert_file and --http2_tls_key_file go together";
+    http2_server_.reset(new Http2Server(
+        event_base_.get(), url_fetcher_,
+        "http://127.0.0.1:" + std::to_string(options_.port),
+        FLAGS_http_max_body_bytes, FLAGS_http2_tls_cert_file,
+        FLAGS_http2_tls_key_file));
+#else
+    LOG(FATAL) << "--http2_port given, but not built with nghttp2";
+#endif
+  }
+
+  if (!options_.hot_restart_socket.empty()) {
+    StatusOr<std::unique_ptr<ReceivedSockets>> received(
+        ReceiveSockets(options_.hot_restart_socket));
+    if (received.ok()) {
+      received_sockets_ = std::move(received.ValueOrDie());
+    } else if (received.status().CanonicalCode() != util::error::NOT_FOUND) {
+      LOG(FATAL) << "Cannot take over the listening sockets: "
+                 << received.status();
+    }
+  }
+  if (received_sockets_) {
+    // The previous process keeps serving, and stays in the election
+    // with the same node ID, until this one is ready and takes over in
+    // Run().
+    LOG(INFO) << "Listening sockets received, taking over once ready";
+  } else {
+    http_server_.Bind(nullptr, options_.port);
+    BindHttp2();
+    election_.StartElection();
+  }
 }
 
 
@@ -188,6 +314,16 @@ ContinuousFetcher* Server::continuous_fetcher() {
 }
 
 
+PendingEntryStore* Server::pending_entry_store() {
+  return pending_entry_store_.get();
+}
+
+
+PendingEntryFetcher* Server::pending_entry_fetcher() {
+  return pending_entry_fetcher_.get();
+}
+
+
 Proxy* Server::proxy() {
   return proxy_.get();
 }
@@ -219,7 +355,11 @@ void Server::Initialise(bool is_mirror) {
   fetcher_ = ContinuousFetcher::New(event_base_.get(), internal_pool_, db_,
                                     log_verifier_, !is_mirror);
 
-  log_lookup_.reset(new LogLookup(db_));
+  // The tree only matters to the proofs, which are proxied to other
+  // nodes until it is loaded: everything else is served meanwhile.
+  log_lookup_.reset(new LogLookup(db_, internal_pool_,
+                                  options_.merkle_node_file,
+                                  LogLookup::LOAD_IN_BACKGROUND));
 
   cluster_controller_.reset(
       new ClusterStateController(internal_pool_, event_base_, url_fetcher_,
@@ -227,7 +367,12 @@ void Server::Initialise(bool is_mirror) {
                                  fetcher_.get()));
 
   // Publish this node's hostname:port info
-  cluster_controller_->SetNodeHostPort(FLAGS_server, FLAGS_port);
+  cluster_controller_->SetNodeHostPort(options_.server, options_.port);
+  if (pending_entry_store_) {
+    pending_entry_fetcher_.reset(new HttpPendingEntryFetcher(
+        url_fetcher_, internal_pool_, cluster_controller_.get(),
+        pending_entry_store_.get(), node_id_));
+  }
   {
     ct::SignedTreeHead db_sth;
     if (db_->LatestTreeHead(&db_sth) == Database::LOOKUP_OK) {
@@ -253,10 +398,65 @@ void Server::Initialise(bool is_mirror) {
 
 
 void Server::Run() {
+  if (received_sockets_) {
+    http_server_.Bind(received_sockets_->sockets());
+    const util::Status status(received_sockets_->TakeOver());
+    LOG_IF(WARNING, !status.ok()) << status;
+    received_sockets_.reset();
+    // The HTTP/2 socket is not handed over, but the previous process
+    // has closed it by now.
+    BindHttp2();
+    election_.StartElection();
+    LOG(INFO) << "Took over the listening sockets";
+  }
+  if (!options_.hot_restart_socket.empty()) {
+    socket_handoff_.reset(new SocketHandoff(
+        options_.hot_restart_socket,
+        bind(&libevent::HttpServer::ListeningSockets, &http_server_),
+        bind(&Server::HandOff, this)));
+  }
+
   // Ding the temporary event pump because we're about to enter the event loop
   event_pump_.reset();
   event_base_->Dispatch();
 }
 
 
+void Server::BindHttp2() {
+#ifdef HAVE_NGHTTP2
+  if (http2_server_) {
+    http2_server_->Bind(FLAGS_http2_port);
+  }
+#endif
+}
+
+
+void Server::HandOff() {
+  promise<void> stopped;
+  event_base_->Add([this, &stopped]() {
+    http_server_.StopAccepting();
+#ifdef HAVE_NGHTTP2
+    if (http2_server_) {
+      http2_server_->StopAccepting();
+    }
+#endif
+    stopped.set_value();
+  });
+  stopped.get_future().get();
+  // Leaves the election to the new process, which shares the node ID.
+  election_.StopElection();
+
+  LOG(INFO) << "Handed off the listening sockets, exiting in "
+            << FLAGS_hot_restart_drain_seconds << " seconds";
+  thread([]() {
+    sleep_for(seconds(FLAGS_hot_restart_drain_seconds));
+    LOG(INFO) << "Exiting after the hot restart";
+    google::FlushLogFiles(google::INFO);
+    // Without running the destructors, as the other threads of the
+    // server never stop.
+    _exit(0);
+  }).detach();
+}
+
+
 }  // namespace cert_trans
@@ -24,10 +24,15 @@ class ContinuousFetcher;
 class Database;
 class EtcdClient;
 class GCMExporter;
+class Http2Server;
 class LogLookup;
 class LogSigner;
 class LoggedEntry;
+class PendingEntryFetcher;
+class PendingEntryStore;
 class Proxy;
+class ReceivedSockets;
+class SocketHandoff;
 class ThreadPool;
 class UrlFetcher;
 
@@ -37,13 +42,35 @@ Gauge<>* latest_local_tree_size_gauge();
 
 class Server {
  public:
+  // What differs between the servers of a process serving several logs
+  // (see ct-mirror). The defaults come from the flags of the same names.
+  struct Options {
+    Options();
+
+    std::string server;
+    int port;
+    std::string etcd_root;
+    std::string merkle_node_file;
+    // The Unix socket through which the listening sockets are handed
+    // over to the process restarting this one, or empty.
+    std::string hot_restart_socket;
+    // Whether the cluster state is kept in this process, by a
+    // LocalConsistentStore, rather than in etcd: true by default for a
+    // stand-alone server (with no --etcd_servers). The EtcdClient is
+    // then only used for the election.
+    bool local_consistent_store;
+  };
+
   static void StaticInit();
 
-  // Doesn't take ownership of anything.
+  // Doesn't take ownership of anything. Several servers can share the
+  // pools, |etcd_client| and |url_fetcher|, but each needs its own
+  // |event_base|, |db|, and Options::port and Options::etcd_root.
   Server(const std::shared_ptr<libevent::Base>& event_base,
          ThreadPool* internal_pool, ThreadPool* http_pool, Database* db,
          EtcdClient* etcd_client, UrlFetcher* url_fetcher,
-         const LogVerifier* log_verifier);
+         const LogVerifier* log_verifier,
+         const Options& options = Options());
   ~Server();
   Server(const Server&) = delete;
   Server& operator=(const Server&) = delete;
@@ -54,17 +81,32 @@ class Server {
   ClusterStateController* cluster_state_controller();
   LogLookup* log_lookup();
   ContinuousFetcher* continuous_fetcher();
+  // Both null unless --etcd_pending_entry_references is set, and the
+  // fetcher until Initialise().
+  PendingEntryStore* pending_entry_store();
+  PendingEntryFetcher* pending_entry_fetcher();
   Proxy* proxy();
   libevent::HttpServer* http_server();
 
   void Initialise(bool is_mirror);
   void WaitForReplication() const;
+  // If this process took over the listening sockets of another, starts
+  // accepting connections on them and tells the other to stop.
   void Run();
 
  private:
+  // Starts serving HTTP/2, if --http2_port is given.
+  void BindHttp2();
+  // Called when another process takes over the listening sockets.
+  void HandOff();
+
+  const Options options_;
   const std::shared_ptr<libevent::Base> event_base_;
   std::unique_ptr<libevent::EventPumpThread> event_pump_;
   libevent::HttpServer http_server_;
+  // NULL without --http2_port. Not a unique_ptr, which would need
+  // ~Http2Server() even when built without nghttp2.
+  std::shared_ptr<Http2Server> http2_server_;
   Database* const db_;
   const LogVerifier* const log_verifier_;
   const std::string node_id_;
@@ -73,15 +115,20 @@ class Server {
   MasterElection election_;
   ThreadPool* const internal_pool_;
   util::SyncTask server_task_;
+  const std::unique_ptr<PendingEntryStore> pending_entry_store_;
   StrictConsistentStore consistent_store_;
   const std::unique_ptr<Frontend> frontend_;
   std::unique_ptr<LogLookup> log_lookup_;
   std::unique_ptr<ClusterStateController> cluster_controller_;
   std::unique_ptr<ContinuousFetcher> fetcher_;
+  std::unique_ptr<PendingEntryFetcher> pending_entry_fetcher_;
   ThreadPool* const http_pool_;
   std::unique_ptr<Proxy> proxy_;
   std::unique_ptr<std::thread> node_refresh_thread_;
   std::unique_ptr<GCMExporter> gcm_exporter_;
+  // Set until Run() if the sockets were handed over by another process.
+  std::unique_ptr<ReceivedSockets> received_sockets_;
+  std::unique_ptr<SocketHandoff> socket_handoff_;
 };
 
 
@@ -1,6 +1,8 @@
+#include "log/segment_storage.h"
 #include "log/strict_consistent_store.h"
 #include "server/server.h"
 #include "server/server_helper.h"
+#include "util/etcd_v3.h"
 #include "util/fake_etcd.h"
 
 using cert_trans::Server;
@@ -14,6 +16,14 @@ DEFINE_int32(port, 6962, "Server port");
 DEFINE_string(etcd_root, "/root", "Root of cluster entries in etcd.");
 DEFINE_string(etcd_servers, "",
               "Comma separated list of 'hostname:port' of the etcd server(s)");
+DEFINE_int32(etcd_api_version, 2,
+             "Version of the etcd API to use, 2 or 3 (through the v3 JSON "
+             "gateway).");
+DEFINE_string(hot_restart_socket, "",
+              "Unix socket through which a restarting server takes over the "
+              "listening sockets of the running one, which stops accepting "
+              "connections once the new one is ready and then exits. Needs "
+              "a cluster.");
 DEFINE_bool(i_know_stand_alone_mode_can_lose_data, false,
             "Set this to allow stand-alone mode, even though it will lose "
             "submissions in the case of a crash.");
@@ -27,6 +37,13 @@ DEFINE_string(sqlite_db, "",
               "SQLite database for certificate and tree storage");
 DEFINE_string(leveldb_db, "",
               "LevelDB database for certificate and tree storage");
+DEFINE_string(rocksdb_db, "",
+              "RocksDB database for certificate and tree storage, if built "
+              "with RocksDB");
+DEFINE_string(merkle_node_file, "",
+              "File in which the tree signer records the Merkle tree leaf "
+              "hashes, so that the tree can be reloaded without rehashing "
+              "every entry at startup");
 // TODO(ekasper): sanity-check these against the directory structure.
 DEFINE_int32(cert_storage_depth, 0,
              "Subdirectory depth for certificates; if the directory is not "
@@ -34,6 +51,19 @@ DEFINE_int32(cert_storage_depth, 0,
 DEFINE_int32(tree_storage_depth, 0,
              "Subdirectory depth for tree signatures; if the directory is not "
              "empty, must match the existing depth");
+DEFINE_bool(file_db_segments, false,
+            "Store the entries of the --cert_dir, --tree_dir and --meta_dir "
+            "file database in a few append-only segment files, rather than "
+            "a file per entry. Existing per-entry files are imported on the "
+            "first start.");
+DEFINE_bool(file_db_index_snapshot, true,
+            "Save the index of the file database in --meta_dir, and load it "
+            "at startup instead of reading every certificate if "
+            "--cert_dir has not changed since.");
+DEFINE_int32(segment_sync_interval, 256,
+             "With --file_db_segments, number of entries after which writes "
+             "are synced to disk; they are also synced before each new tree "
+             "head is stored. 0 syncs only then.");
 
 // Basic sanity checks on flag values.
 static bool ValidateWrite(const char* flagname, const string& path) {
@@ -75,14 +105,40 @@ static const bool c_st_dummy =
 static const bool t_st_dummy =
     RegisterFlagValidator(&FLAGS_tree_storage_depth, &ValidateIsNonNegative);
 
+static const bool s_si_dummy =
+    RegisterFlagValidator(&FLAGS_segment_sync_interval,
+                          &ValidateIsNonNegative);
+
 namespace cert_trans {
 
 void EnsureValidatorsRegistered() {
   CHECK(cert_dir_dummy && tree_dir_dummy && c_st_dummy && t_st_dummy &&
-        port_dummy);
+        s_si_dummy && port_dummy);
 }
 
 
+namespace {
+
+
+EntryStorage* ProvideEntryStorage(const string& dir, int storage_depth) {
+  if (!FLAGS_file_db_segments) {
+    return new FileStorage(dir, storage_depth);
+  }
+
+  SegmentStorage* const storage(
+      new SegmentStorage(dir, FLAGS_segment_sync_interval));
+  if (storage->EntryCount() == 0 &&
+      access((dir + "/storage").c_str(), F_OK) == 0) {
+    LOG(INFO) << "Importing the entries of " << dir << " into segments";
+    storage->Import(FileStorage(dir, storage_depth));
+  }
+  return storage;
+}
+
+
+}  // namespace
+
+
 bool IsStandalone(bool warn_data_loss) {
   const bool stand_alone_mode(FLAGS_etcd_servers.empty());
   if (stand_alone_mode && warn_data_loss &&
@@ -91,6 +147,11 @@ bool IsStandalone(bool warn_data_loss) {
                   "--i_know_stand_alone_mode_can_lose_data flag";
   }
 
+  // The cluster state of a stand-alone server lives and dies with it.
+  if (stand_alone_mode && !FLAGS_hot_restart_socket.empty()) {
+    LOG(FATAL) << "--hot_restart_socket cannot be used in stand-alone mode";
+  }
+
   if (!stand_alone_mode && FLAGS_server.empty()) {
     // Part of a cluster so server must be set
     LOG(FATAL) << "not in stand-alone mode but --server is empty";
@@ -102,12 +163,14 @@ bool IsStandalone(bool warn_data_loss) {
 
 unique_ptr<Database> ProvideDatabase() {
   if (!FLAGS_sqlite_db.empty() + !FLAGS_leveldb_db.empty() +
+          !FLAGS_rocksdb_db.empty() +
           (!FLAGS_cert_dir.empty() | !FLAGS_tree_dir.empty()) !=
       1) {
     LOG(FATAL) << "Must specify exactly one database type. Check flags.";
   }
 
-  if (FLAGS_sqlite_db.empty() && FLAGS_leveldb_db.empty()) {
+  if (FLAGS_sqlite_db.empty() && FLAGS_leveldb_db.empty() &&
+      FLAGS_rocksdb_db.empty()) {
     CHECK_NE(FLAGS_cert_dir, FLAGS_tree_dir)
         << "Certificate directory and tree directory must differ";
   }
@@ -116,11 +179,22 @@ unique_ptr<Database> ProvideDatabase() {
     return unique_ptr<Database>(new SQLiteDB(FLAGS_sqlite_db));
   } else if (!FLAGS_leveldb_db.empty()) {
     return unique_ptr<Database>(new LevelDB(FLAGS_leveldb_db));
+  } else if (!FLAGS_rocksdb_db.empty()) {
+#ifdef HAVE_ROCKSDB
+    return unique_ptr<Database>(new RocksDB(FLAGS_rocksdb_db));
+#else
+    LOG(FATAL) << "--rocksdb_db given, but not built with RocksDB";
+#endif
   } else {
     return unique_ptr<Database>(
-        new FileDB(new FileStorage(FLAGS_cert_dir, FLAGS_cert_storage_depth),
-                   new FileStorage(FLAGS_tree_dir, FLAGS_tree_storage_depth),
-                   new FileStorage(FLAGS_meta_dir, 0)));
+        new FileDB(ProvideEntryStorage(FLAGS_cert_dir,
+                                       FLAGS_cert_storage_depth),
+                   ProvideEntryStorage(FLAGS_tree_dir,
+                                       FLAGS_tree_storage_depth),
+                   ProvideEntryStorage(FLAGS_meta_dir, 0),
+                   FLAGS_file_db_index_snapshot
+                       ? FLAGS_meta_dir + "/index_snapshot"
+                       : string()));
   }
 
   LOG(FATAL) << "No usable database is configured by flags";
@@ -132,9 +206,16 @@ unique_ptr<EtcdClient> ProvideEtcdClient(libevent::Base* event_base,
                                          UrlFetcher* fetcher) {
   // No need to enforce --warn-data-loss here as it will already have been
   // done if required
+  if (IsStandalone(false)) {
+    return unique_ptr<EtcdClient>(new FakeEtcdClient(event_base));
+  }
+  CHECK(FLAGS_etcd_api_version == 2 || FLAGS_etcd_api_version == 3)
+      << "Unsupported --etcd_api_version: " << FLAGS_etcd_api_version;
+  if (FLAGS_etcd_api_version == 3) {
+    return unique_ptr<EtcdClient>(
+        new EtcdV3Client(pool, fetcher, SplitHosts(FLAGS_etcd_servers)));
+  }
   return unique_ptr<EtcdClient>(
-      IsStandalone(false)
-          ? new FakeEtcdClient(event_base)
-          : new EtcdClient(pool, fetcher, SplitHosts(FLAGS_etcd_servers)));
+      new EtcdClient(pool, fetcher, SplitHosts(FLAGS_etcd_servers)));
 }
 }  // namespace cert_trans
@@ -15,6 +15,9 @@
 #include "log/file_db.h"
 #include "log/file_storage.h"
 #include "log/leveldb_db.h"
+#ifdef HAVE_ROCKSDB
+#include "log/rocksdb_db.h"
+#endif
 #include "log/sqlite_db.h"
 #include "util/etcd.h"
 #include "util/executor.h"
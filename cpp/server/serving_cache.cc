@@ -0,0 +1,95 @@
+#include "server/serving_cache.h"
+
+#include <utility>
+
+using std::lock_guard;
+using std::move;
+using std::mutex;
+using std::shared_ptr;
+using std::string;
+
+namespace cert_trans {
+
+
+ServingCache::Reply::Reply(string body, string etag)
+    : prepared(move(body)), etag(move(etag)) {
+}
+
+
+ServingCache::ServingCache(size_t max_entries_replies,
+                           size_t max_proof_replies)
+    : entries_(max_entries_replies),
+      proofs_(max_proof_replies),
+      memory_("http_reply_caches", [this]() { return MemoryUsage(); }) {
+}
+
+
+shared_ptr<const ServingCache::Reply> ServingCache::GetEntries(
+    const string& key) const {
+  return Get(entries_, key);
+}
+
+
+shared_ptr<const ServingCache::Reply> ServingCache::GetProof(
+    const string& key) const {
+  return Get(proofs_, key);
+}
+
+
+void ServingCache::AddEntries(const string& key,
+                              const shared_ptr<const Reply>& reply) {
+  Add(key, reply, &entries_);
+}
+
+
+void ServingCache::AddProof(const string& key,
+                            const shared_ptr<const Reply>& reply) {
+  Add(key, reply, &proofs_);
+}
+
+
+size_t ServingCache::MemoryUsage() const {
+  return MemoryUsage(entries_) + MemoryUsage(proofs_);
+}
+
+
+// static
+shared_ptr<const ServingCache::Reply> ServingCache::Get(
+    const Replies& replies, const string& key) {
+  lock_guard<mutex> lock(replies.lock);
+  const auto it(replies.by_key.find(key));
+  return it == replies.by_key.end() ? nullptr : it->second;
+}
+
+
+// static
+void ServingCache::Add(const string& key, const shared_ptr<const Reply>& reply,
+                       Replies* replies) {
+  lock_guard<mutex> lock(replies->lock);
+  if (replies->max_size == 0 || !replies->by_key.emplace(key, reply).second) {
+    return;
+  }
+  replies->order.push_back(key);
+  while (replies->order.size() > replies->max_size) {
+    replies->by_key.erase(replies->order.front());
+    replies->order.pop_front();
+  }
+}
+
+
+// static
+size_t ServingCache::MemoryUsage(const Replies& replies) {
+  // The caches are small enough for their replies to be added up each
+  // time.
+  lock_guard<mutex> lock(replies.lock);
+  size_t bytes(0);
+  for (const auto& cached : replies.by_key) {
+    bytes += 2 * cached.first.size() + cached.second->prepared.body.size() +
+             cached.second->prepared.gzipped_body.size() +
+             cached.second->etag.size();
+  }
+  return bytes;
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,83 @@
+#ifndef CERT_TRANS_SERVER_SERVING_CACHE_H_
+#define CERT_TRANS_SERVER_SERVING_CACHE_H_
+
+#include <stddef.h>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "monitoring/memory.h"
+#include "server/json_output.h"
+
+namespace cert_trans {
+
+
+// The encoded replies which never change, kept to be sent again as
+// they are: those for whole ranges of logged entries, and those for
+// proofs between tree sizes the log has reached. Each kind is kept up
+// to a number of replies, the oldest being dropped first.
+//
+// Nothing here depends on the protocol: the keys are the caller's,
+// and say which protocol version and encoding a reply is in, so that
+// the handlers of several versions can go through one instance and
+// share its bounds.
+//
+// This class is thread-safe.
+class ServingCache {
+ public:
+  struct Reply {
+    Reply(std::string body, std::string etag);
+
+    const PreparedJsonReply prepared;
+    // A strong validator of |prepared.body|, or empty.
+    const std::string etag;
+  };
+
+  ServingCache(size_t max_entries_replies, size_t max_proof_replies);
+  ServingCache(const ServingCache&) = delete;
+  ServingCache& operator=(const ServingCache&) = delete;
+
+  // Return null if there is no reply for |key|.
+  std::shared_ptr<const Reply> GetEntries(const std::string& key) const;
+  std::shared_ptr<const Reply> GetProof(const std::string& key) const;
+
+  // Keep |reply| for |key|, unless there is one already.
+  void AddEntries(const std::string& key,
+                  const std::shared_ptr<const Reply>& reply);
+  void AddProof(const std::string& key,
+                const std::shared_ptr<const Reply>& reply);
+
+  // Returns the size of the replies kept.
+  size_t MemoryUsage() const;
+
+ private:
+  struct Replies {
+    explicit Replies(size_t max_size) : max_size(max_size) {
+    }
+
+    const size_t max_size;
+    mutable std::mutex lock;
+    std::unordered_map<std::string, std::shared_ptr<const Reply>> by_key;
+    // The keys of |by_key|, oldest first.
+    std::deque<std::string> order;
+  };
+
+  static std::shared_ptr<const Reply> Get(const Replies& replies,
+                                          const std::string& key);
+  static void Add(const std::string& key,
+                  const std::shared_ptr<const Reply>& reply,
+                  Replies* replies);
+  static size_t MemoryUsage(const Replies& replies);
+
+  Replies entries_;
+  Replies proofs_;
+
+  const MemoryEstimate memory_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_SERVER_SERVING_CACHE_H_
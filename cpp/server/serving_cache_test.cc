@@ -0,0 +1,55 @@
+#include "server/serving_cache.h"
+
+#include <gtest/gtest.h>
+#include <memory>
+#include <string>
+
+#include "util/testing.h"
+
+namespace cert_trans {
+namespace {
+
+using std::make_shared;
+using std::shared_ptr;
+using std::string;
+
+typedef ServingCache::Reply Reply;
+
+
+TEST(ServingCacheTest, KeepsNewestReplies) {
+  ServingCache cache(2, 1);
+  const shared_ptr<const Reply> first(make_shared<Reply>("first", "\"1\""));
+  cache.AddEntries("v1/0", first);
+  cache.AddEntries("v1/1", make_shared<Reply>("second", "\"2\""));
+  EXPECT_EQ(first, cache.GetEntries("v1/0"));
+  // The kinds of replies have keys and bounds of their own.
+  EXPECT_EQ(nullptr, cache.GetProof("v1/0"));
+
+  // Added already: kept as it was.
+  cache.AddEntries("v1/0", make_shared<Reply>("other", ""));
+  EXPECT_EQ("first", cache.GetEntries("v1/0")->prepared.body);
+
+  cache.AddEntries("v1/2", make_shared<Reply>("third", ""));
+  EXPECT_EQ(nullptr, cache.GetEntries("v1/0"));
+  EXPECT_EQ("second", cache.GetEntries("v1/1")->prepared.body);
+  EXPECT_EQ("third", cache.GetEntries("v1/2")->prepared.body);
+  EXPECT_LT(0U, cache.MemoryUsage());
+}
+
+
+TEST(ServingCacheTest, ZeroSizeKeepsNothing) {
+  ServingCache cache(1, 0);
+  cache.AddProof("v1/1,2", make_shared<Reply>("proof", ""));
+  EXPECT_EQ(nullptr, cache.GetProof("v1/1,2"));
+  EXPECT_EQ(0U, cache.MemoryUsage());
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -6,11 +6,13 @@
 
 #include "log/cluster_state_controller.h"
 #include "log/logged_entry.h"
+#include "monitoring/gauge.h"
 #include "server/staleness_tracker.h"
 #include "util/thread_pool.h"
 
 namespace libevent = cert_trans::libevent;
 
+using cert_trans::Gauge;
 using cert_trans::StalenessTracker;
 using cert_trans::LoggedEntry;
 using std::bind;
@@ -19,17 +21,38 @@ using std::lock_guard;
 using std::mutex;
 
 DEFINE_int32(staleness_check_delay_secs, 5,
-             "number of seconds between node staleness checks");
+             "number of seconds between node staleness checks, besides "
+             "those done whenever the serving STH or the local tree "
+             "changes");
+DEFINE_int32(staleness_max_lag_entries, 0,
+             "number of entries of the serving STH a fresh node may lack "
+             "before it is considered stale; a stale node is fresh again "
+             "once it has them all");
 
+namespace {
 
-StalenessTracker::StalenessTracker(const ClusterStateController* controller,
+
+Gauge<>* node_is_stale_gauge(
+    Gauge<>::New("node_is_stale",
+                 "Whether this node proxies requests to fresh nodes, for "
+                 "lack of the entries of the serving STH."));
+
+
+}  // namespace
+
+
+StalenessTracker::StalenessTracker(ClusterStateController* controller,
                                    ThreadPool* pool,
                                    libevent::Base* event_base)
     : controller_(CHECK_NOTNULL(controller)),
       pool_(CHECK_NOTNULL(pool)),
       event_base_(CHECK_NOTNULL(event_base)),
       task_(pool_),
-      node_is_stale_(controller_->NodeIsStale()) {
+      node_is_stale_(controller_->NodeIsStale()),
+      staleness_callback_(bind(&StalenessTracker::Recompute, this)) {
+  CHECK_LE(0, FLAGS_staleness_max_lag_entries);
+  node_is_stale_gauge->Set(node_is_stale_);
+  controller_->AddStalenessCallback(&staleness_callback_);
   event_base_->Delay(seconds(FLAGS_staleness_check_delay_secs),
                      task_.task()->AddChild(
                          bind(&StalenessTracker::UpdateNodeStaleness, this)));
@@ -37,6 +60,7 @@ StalenessTracker::StalenessTracker(const ClusterStateController* controller,
 
 
 StalenessTracker::~StalenessTracker() {
+  controller_->RemoveStalenessCallback(&staleness_callback_);
   task_.task()->Return();
   task_.Wait();
 }
@@ -54,13 +78,23 @@ void StalenessTracker::UpdateNodeStaleness() {
     return;
   }
 
-  const bool node_is_stale(controller_->NodeIsStale());
-  {
-    lock_guard<mutex> lock(mutex_);
-    node_is_stale_ = node_is_stale;
-  }
+  Recompute();
 
   event_base_->Delay(seconds(FLAGS_staleness_check_delay_secs),
                      task_.task()->AddChild(
                          bind(&StalenessTracker::UpdateNodeStaleness, this)));
 }
+
+
+void StalenessTracker::Recompute() {
+  const int64_t lag(controller_->NodeLag());
+  lock_guard<mutex> lock(mutex_);
+  const bool node_is_stale(
+      lag < 0 || lag > (node_is_stale_ ? 0 : FLAGS_staleness_max_lag_entries));
+  if (node_is_stale != node_is_stale_) {
+    LOG(INFO) << "Node is now " << (node_is_stale ? "stale" : "fresh")
+              << ", " << lag << " entries behind the serving STH";
+    node_is_stale_ = node_is_stale;
+    node_is_stale_gauge->Set(node_is_stale);
+  }
+}
@@ -1,6 +1,7 @@
 #ifndef CERT_TRANS_SERVER_STALENESS_TRACKER_H_
 #define CERT_TRANS_SERVER_STALENESS_TRACKER_H_
 
+#include <functional>
 #include <memory>
 #include <mutex>
 #include <string>
@@ -16,11 +17,21 @@ class ClusterStateController;
 class ThreadPool;
 
 
+// Whether this node is too far behind the serving STH of the cluster
+// to answer requests itself, rather than proxying them to a fresh
+// node. It is recomputed as soon as the serving STH or the local tree
+// changes, and every --staleness_check_delay_secs as well in case
+// something was missed.
+//
+// A fresh node only turns stale once it lacks more than
+// --staleness_max_lag_entries entries of the serving STH, but a stale
+// one only turns fresh once it has them all, so that a node hovering
+// around the limit does not flip between the two.
 class StalenessTracker {
  public:
   // Does not take ownership of its parameters, which must outlive
   // this instance.
-  StalenessTracker(const ClusterStateController* controller, ThreadPool* pool,
+  StalenessTracker(ClusterStateController* controller, ThreadPool* pool,
                    libevent::Base* event_base);
   virtual ~StalenessTracker();
   StalenessTracker(const StalenessTracker&) = delete;
@@ -33,13 +44,17 @@ class StalenessTracker {
   void UpdateNodeStaleness();
 
  private:
-  const ClusterStateController* const controller_;
+  // Updates |node_is_stale_| from the controller.
+  void Recompute();
+
+  ClusterStateController* const controller_;
   ThreadPool* const pool_;
   libevent::Base* const event_base_;
 
   util::SyncTask task_;
   mutable std::mutex mutex_;
   bool node_is_stale_;
+  const std::function<void()> staleness_callback_;
 };
 
 
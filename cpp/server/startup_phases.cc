@@ -0,0 +1,222 @@
+#include "server/startup_phases.h"
+
+#include <event2/buffer.h>
+#include <event2/http.h>
+#include <glog/logging.h>
+
+#include "monitoring/monitoring.h"
+
+using std::bind;
+using std::chrono::duration;
+using std::chrono::steady_clock;
+using std::function;
+using std::lock_guard;
+using std::mutex;
+using std::string;
+using std::unique_lock;
+using std::vector;
+
+namespace cert_trans {
+namespace {
+
+
+static Gauge<string>* startup_phase_seconds =
+    Gauge<string>::New("startup_phase_seconds", "phase",
+                       "Time taken by each phase of the start up, in "
+                       "seconds.");
+
+static Gauge<string>* startup_phase_done_seconds =
+    Gauge<string>::New("startup_phase_done_seconds", "phase",
+                       "Time from the beginning of the start up to the end "
+                       "of each of its phases, in seconds.");
+
+
+}  // namespace
+
+
+StartupPhases::StartupPhases(util::Executor* executor)
+    : executor_(CHECK_NOTNULL(executor)),
+      start_(steady_clock::now()),
+      running_(0),
+      finished_(false) {
+}
+
+
+StartupPhases::~StartupPhases() {
+  unique_lock<mutex> lock(lock_);
+  phase_done_.wait(lock, [this]() { return running_ == 0; });
+}
+
+
+void StartupPhases::Add(const string& name, const vector<string>& deps,
+                        const function<void()>& phase) {
+  CHECK(phase);
+  unique_lock<mutex> lock(lock_);
+  AddLocked(lock, name, deps, phase);
+  StartPhasesLocked(lock);
+}
+
+
+void StartupPhases::Run(const string& name, const vector<string>& deps,
+                        const function<void()>& phase) {
+  CHECK(phase);
+  Phase* added;
+  {
+    unique_lock<mutex> lock(lock_);
+    added = AddLocked(lock, name, deps, nullptr);
+    phase_done_.wait(lock, [this, &lock, added]() {
+      return DepsDoneLocked(lock, *added);
+    });
+    added->started = true;
+    ++running_;
+  }
+  TimePhase(name, added, phase);
+}
+
+
+void StartupPhases::Wait(const string& name) const {
+  unique_lock<mutex> lock(lock_);
+  const auto it(phases_.find(name));
+  CHECK(it != phases_.end()) << "Unknown startup phase " << name;
+  phase_done_.wait(lock, [it]() { return it->second.done; });
+}
+
+
+void StartupPhases::WaitAll() const {
+  unique_lock<mutex> lock(lock_);
+  phase_done_.wait(lock, [this]() {
+    for (const auto& phase : phases_) {
+      if (!phase.second.done) {
+        return false;
+      }
+    }
+    return true;
+  });
+}
+
+
+void StartupPhases::Finish() {
+  lock_guard<mutex> lock(lock_);
+  finished_ = true;
+}
+
+
+bool StartupPhases::Ready() const {
+  lock_guard<mutex> lock(lock_);
+  if (!finished_) {
+    return false;
+  }
+  for (const auto& phase : phases_) {
+    if (!phase.second.done) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+vector<string> StartupPhases::Pending() const {
+  lock_guard<mutex> lock(lock_);
+  vector<string> pending;
+  for (const string& name : order_) {
+    if (!phases_.find(name)->second.done) {
+      pending.push_back(name);
+    }
+  }
+  return pending;
+}
+
+
+void StartupPhases::HandleReady(evhttp_request* req) const {
+  if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
+    evhttp_send_reply(req, HTTP_BADMETHOD, /*reason*/ nullptr,
+                      /*databuf*/ nullptr);
+    return;
+  }
+
+  evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type",
+                    "text/plain");
+  evbuffer* const body(evhttp_request_get_output_buffer(req));
+  if (Ready()) {
+    evbuffer_add_printf(body, "ready\n");
+    evhttp_send_reply(req, HTTP_OK, /*reason*/ nullptr, /*databuf*/ nullptr);
+    return;
+  }
+
+  // The phases still to be added, if any, are not listed.
+  evbuffer_add_printf(body, "starting up, pending:\n");
+  for (const string& name : Pending()) {
+    evbuffer_add_printf(body, "%s\n", name.c_str());
+  }
+  evhttp_send_reply(req, HTTP_SERVUNAVAIL, /*reason*/ nullptr,
+                    /*databuf*/ nullptr);
+}
+
+
+StartupPhases::Phase* StartupPhases::AddLocked(
+    const unique_lock<mutex>& lock, const string& name,
+    const vector<string>& deps, const function<void()>& phase) {
+  CHECK(lock.owns_lock());
+  for (const string& dep : deps) {
+    CHECK(phases_.find(dep) != phases_.end())
+        << "Startup phase " << name << " depends on unknown phase " << dep;
+  }
+  const auto inserted(phases_.emplace(name, Phase(deps, phase)));
+  CHECK(inserted.second) << "Duplicate startup phase " << name;
+  order_.push_back(name);
+  return &inserted.first->second;
+}
+
+
+bool StartupPhases::DepsDoneLocked(const unique_lock<mutex>& lock,
+                                   const Phase& phase) const {
+  CHECK(lock.owns_lock());
+  for (const string& dep : phase.deps) {
+    if (!phases_.find(dep)->second.done) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+void StartupPhases::StartPhasesLocked(const unique_lock<mutex>& lock) {
+  CHECK(lock.owns_lock());
+  for (auto& phase : phases_) {
+    if (phase.second.run && !phase.second.started &&
+        DepsDoneLocked(lock, phase.second)) {
+      phase.second.started = true;
+      ++running_;
+      executor_->Add(
+          bind(&StartupPhases::RunPhase, this, phase.first, &phase.second));
+    }
+  }
+}
+
+
+void StartupPhases::RunPhase(const string& name, Phase* phase) {
+  TimePhase(name, phase, phase->run);
+}
+
+
+void StartupPhases::TimePhase(const string& name, Phase* phase,
+                              const function<void()>& run) {
+  VLOG(1) << "Starting up: " << name;
+  const steady_clock::time_point started(steady_clock::now());
+  run();
+  const steady_clock::time_point done(steady_clock::now());
+  const double seconds(duration<double>(done - started).count());
+  LOG(INFO) << "Startup phase " << name << " took " << seconds << " seconds";
+  startup_phase_seconds->Set(name, seconds);
+  startup_phase_done_seconds->Set(name,
+                                  duration<double>(done - start_).count());
+
+  unique_lock<mutex> lock(lock_);
+  phase->done = true;
+  --running_;
+  StartPhasesLocked(lock);
+  phase_done_.notify_all();
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,112 @@
+#ifndef CERT_TRANS_SERVER_STARTUP_PHASES_H_
+#define CERT_TRANS_SERVER_STARTUP_PHASES_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "util/executor.h"
+
+struct evhttp_request;
+
+namespace cert_trans {
+
+
+// The phases of the start up of a server, each of which runs once the
+// phases it depends on are done, so that the independent ones overlap:
+// starting up takes as long as the longest chain of dependencies,
+// rather than as all of the phases one after the other.
+//
+// How long each phase took is exported, as is when it was done since
+// the start up began, and HandleReady() serves the phases still to be
+// done, for "/ready".
+//
+// This class is thread-safe.
+class StartupPhases {
+ public:
+  // Does not take ownership of |executor|, which must outlive this
+  // instance.
+  explicit StartupPhases(util::Executor* executor);
+  // Waits for the phases which have started.
+  ~StartupPhases();
+  StartupPhases(const StartupPhases&) = delete;
+  StartupPhases& operator=(const StartupPhases&) = delete;
+
+  // Adds the phase |name|, which is run on the executor once all of
+  // |deps| are done. They must have been added already.
+  void Add(const std::string& name, const std::vector<std::string>& deps,
+           const std::function<void()>& phase);
+
+  // Like Add(), but runs the phase in the calling thread, and returns
+  // once it is done, e.g. for what has to be done on the main thread.
+  void Run(const std::string& name, const std::vector<std::string>& deps,
+           const std::function<void()>& phase);
+
+  // Blocks until the phase |name| is done.
+  void Wait(const std::string& name) const;
+
+  // Blocks until all of the phases added so far are done.
+  void WaitAll() const;
+
+  // To be called once all of the phases have been added: the server is
+  // only ready from then on, once they are done.
+  void Finish();
+
+  // Whether Finish() was called, and all of the phases are done.
+  bool Ready() const;
+
+  // The phases which are not done yet, in the order they were added.
+  std::vector<std::string> Pending() const;
+
+  // Replies with 200 once Ready(), and with 503 and the phases still to
+  // be done meanwhile.
+  void HandleReady(evhttp_request* req) const;
+
+ private:
+  struct Phase {
+    Phase(const std::vector<std::string>& thedeps,
+          const std::function<void()>& therun)
+        : deps(thedeps), run(therun), started(false), done(false) {
+    }
+
+    const std::vector<std::string> deps;
+    // Empty for the phases of Run().
+    const std::function<void()> run;
+    bool started;
+    bool done;
+  };
+
+  // Adds |name|, and returns it.
+  Phase* AddLocked(const std::unique_lock<std::mutex>& lock,
+                   const std::string& name,
+                   const std::vector<std::string>& deps,
+                   const std::function<void()>& phase);
+  bool DepsDoneLocked(const std::unique_lock<std::mutex>& lock,
+                      const Phase& phase) const;
+  // Starts the phases of Add() whose dependencies are done.
+  void StartPhasesLocked(const std::unique_lock<std::mutex>& lock);
+  void RunPhase(const std::string& name, Phase* phase);
+  // Runs |phase|, and marks it done.
+  void TimePhase(const std::string& name, Phase* phase,
+                 const std::function<void()>& run);
+
+  util::Executor* const executor_;
+  const std::chrono::steady_clock::time_point start_;
+
+  mutable std::mutex lock_;
+  mutable std::condition_variable phase_done_;
+  std::map<std::string, Phase> phases_;
+  // The names of |phases_|, in the order they were added.
+  std::vector<std::string> order_;
+  int running_;
+  bool finished_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_SERVER_STARTUP_PHASES_H_
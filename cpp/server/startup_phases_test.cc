@@ -0,0 +1,126 @@
+#include "server/startup_phases.h"
+
+#include <gtest/gtest.h>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "base/notification.h"
+#include "util/testing.h"
+#include "util/thread_pool.h"
+
+namespace cert_trans {
+namespace {
+
+using std::chrono::seconds;
+using std::lock_guard;
+using std::mutex;
+using std::string;
+using std::thread;
+using std::vector;
+
+
+class StartupPhasesTest : public ::testing::Test {
+ protected:
+  StartupPhasesTest() : pool_(4) {
+  }
+
+  // Returns a phase which records that |name| ran.
+  std::function<void()> Record(const string& name) {
+    return [this, name]() {
+      lock_guard<mutex> lock(lock_);
+      ran_.push_back(name);
+    };
+  }
+
+  ThreadPool pool_;
+  mutex lock_;
+  vector<string> ran_;
+};
+
+
+TEST_F(StartupPhasesTest, RunsAfterDependencies) {
+  StartupPhases startup(&pool_);
+  Notification release;
+  startup.Add("a", {}, [this, &release]() {
+    release.WaitForNotification();
+    Record("a")();
+  });
+  startup.Add("b", {}, Record("b"));
+  startup.Add("c", {"a", "b"}, Record("c"));
+
+  // "b" does not wait for "a", but "c" waits for both.
+  startup.Wait("b");
+  EXPECT_EQ(vector<string>({"a", "c"}), startup.Pending());
+  release.Notify();
+  startup.WaitAll();
+  EXPECT_EQ(vector<string>({"b", "a", "c"}), ran_);
+  EXPECT_TRUE(startup.Pending().empty());
+}
+
+
+TEST_F(StartupPhasesTest, RunsInCallingThread) {
+  StartupPhases startup(&pool_);
+  startup.Add("a", {}, Record("a"));
+  const thread::id caller(std::this_thread::get_id());
+  thread::id ran_in;
+  startup.Run("b", {"a"}, [this, &ran_in]() {
+    ran_in = std::this_thread::get_id();
+    Record("b")();
+  });
+  EXPECT_EQ(caller, ran_in);
+  EXPECT_EQ(vector<string>({"a", "b"}), ran_);
+}
+
+
+TEST_F(StartupPhasesTest, ReadyOnceFinished) {
+  StartupPhases startup(&pool_);
+  Notification release;
+  startup.Add("a", {}, [&release]() { release.WaitForNotification(); });
+  startup.Finish();
+  EXPECT_FALSE(startup.Ready());
+  release.Notify();
+  startup.WaitAll();
+  EXPECT_TRUE(startup.Ready());
+
+  StartupPhases unfinished(&pool_);
+  unfinished.Add("a", {}, Record("a"));
+  unfinished.WaitAll();
+  EXPECT_FALSE(unfinished.Ready());
+}
+
+
+TEST_F(StartupPhasesTest, IndependentPhasesOverlap) {
+  StartupPhases startup(&pool_);
+  Notification a_started;
+  Notification b_started;
+  startup.Add("a", {}, [&a_started, &b_started]() {
+    a_started.Notify();
+    EXPECT_TRUE(b_started.WaitForNotificationWithTimeout(seconds(5)));
+  });
+  startup.Add("b", {}, [&a_started, &b_started]() {
+    b_started.Notify();
+    EXPECT_TRUE(a_started.WaitForNotificationWithTimeout(seconds(5)));
+  });
+  startup.WaitAll();
+}
+
+
+TEST(StartupPhasesDeathTest, UnknownDependency) {
+  ThreadPool pool(1);
+  StartupPhases startup(&pool);
+  EXPECT_DEATH(startup.Add("a", {"b"}, []() {}), "unknown phase b");
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
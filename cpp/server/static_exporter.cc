@@ -0,0 +1,297 @@
+#include "server/static_exporter.h"
+
+#include <errno.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <functional>
+
+#include "log/filesystem_ops.h"
+#include "log/logged_entry.h"
+#include "merkletree/tiled_merkle_tree.h"
+#include "monitoring/monitoring.h"
+#include "server/json_output.h"
+#include "util/json_wrapper.h"
+#include "util/util.h"
+
+DEFINE_int32(static_export_bundle_size, 1000,
+             "Number of entries in each entry bundle written by "
+             "--static_export_dir. Changing it starts the bundles over.");
+
+using ct::SignedTreeHead;
+using std::bind;
+using std::function;
+using std::lock_guard;
+using std::mutex;
+using std::placeholders::_1;
+using std::string;
+using std::unique_lock;
+
+namespace cert_trans {
+namespace {
+
+
+static Counter<string>* static_export_files_written(
+    Counter<string>::New("static_export_files_written", "type",
+                         "Number of files written by the static exporter, "
+                         "by type (entries, tile or sth)."));
+
+static Counter<>* static_export_errors(
+    Counter<>::New("static_export_errors",
+                   "Number of files the static exporter failed to write."));
+
+
+const size_t kTileSize(TiledMerkleTree::kTileWidth * 32);
+
+
+void CreateMissingDirectory(FilesystemOps* file_ops, const string& dir) {
+  if (file_ops->mkdir(dir, 0700) != 0) {
+    PCHECK(errno == EEXIST) << "Cannot create " << dir;
+  }
+}
+
+
+// Returns the first index for which |exists| is false, assuming that
+// it is true for all the indexes before that one, in a logarithmic
+// number of calls.
+int64_t FirstMissing(const function<bool(int64_t)>& exists) {
+  int64_t missing(0);
+  while (exists(missing)) {
+    missing = missing * 2 + 1;
+  }
+  // |missing| is missing and, unless it is 0, |missing / 2| is not.
+  int64_t present(missing > 0 ? missing / 2 : -1);
+  while (missing - present > 1) {
+    const int64_t middle(present + (missing - present) / 2);
+    if (exists(middle)) {
+      present = middle;
+    } else {
+      missing = middle;
+    }
+  }
+  return missing;
+}
+
+
+}  // namespace
+
+
+StaticExporter::StaticExporter(const string& dir, ReadOnlyDatabase* db,
+                               util::Executor* executor)
+    : dir_(dir),
+      bundle_size_(FLAGS_static_export_bundle_size),
+      db_(CHECK_NOTNULL(db)),
+      executor_(CHECK_NOTNULL(executor)),
+      file_ops_(NewDefaultFilesystemOps()),
+      callback_(bind(&StaticExporter::OnNewSTH, this, _1)),
+      next_bundle_(0),
+      has_pending_(false),
+      running_(false) {
+  CHECK_GT(bundle_size_, 0) << "--static_export_bundle_size must be > 0";
+  for (const char* subdir : {"", "/entries", "/tiles", "/sth", "/tmp"}) {
+    CreateMissingDirectory(file_ops_.get(), dir_ + subdir);
+  }
+
+  next_bundle_ = FirstMissing([this](int64_t bundle) {
+    return file_ops_->access(BundlePath(bundle), F_OK) == 0;
+  });
+  for (int level = 0;; ++level) {
+    if (file_ops_->access(TilePath(level, 0), F_OK) != 0) {
+      break;
+    }
+    next_tiles_.push_back(FirstMissing([this, level](int64_t index) {
+      return file_ops_->access(TilePath(level, index), F_OK) == 0;
+    }));
+  }
+  LOG(INFO) << "Exporting to " << dir_ << " from bundle " << next_bundle_
+            << " and " << next_tiles_.size() << " levels of tiles.";
+
+  db_->AddNotifySTHCallback(&callback_);
+}
+
+
+StaticExporter::~StaticExporter() {
+  db_->RemoveNotifySTHCallback(&callback_);
+
+  unique_lock<mutex> lock(lock_);
+  has_pending_ = false;
+  done_cv_.wait(lock, [this]() { return !running_; });
+}
+
+
+void StaticExporter::OnNewSTH(const SignedTreeHead& sth) {
+  lock_guard<mutex> lock(lock_);
+  pending_sth_ = sth;
+  has_pending_ = true;
+  // A run in progress picks up the new tree head once it is done.
+  if (!running_) {
+    running_ = true;
+    executor_->Add(bind(&StaticExporter::Run, this));
+  }
+}
+
+
+void StaticExporter::Run() {
+  unique_lock<mutex> lock(lock_);
+  while (has_pending_) {
+    const SignedTreeHead sth(pending_sth_);
+    has_pending_ = false;
+    lock.unlock();
+    Export(sth);
+    lock.lock();
+  }
+  running_ = false;
+  done_cv_.notify_all();
+}
+
+
+void StaticExporter::Export(const SignedTreeHead& sth) {
+  const int64_t tree_size(sth.tree_size());
+
+  while ((next_bundle_ + 1) * bundle_size_ <= tree_size &&
+         ExportBundle(next_bundle_)) {
+    ++next_bundle_;
+  }
+
+  for (int level = 0;; ++level) {
+    // The number of nodes at the tree level of the tiles of |level|.
+    const int64_t width(tree_size >> (level * TiledMerkleTree::kTileHeight));
+    if (width < static_cast<int64_t>(TiledMerkleTree::kTileWidth)) {
+      break;
+    }
+    if (level == static_cast<int>(next_tiles_.size())) {
+      CreateMissingDirectory(file_ops_.get(),
+                             dir_ + "/tiles/" + std::to_string(level));
+      next_tiles_.push_back(0);
+    }
+    int64_t& next(next_tiles_[level]);
+    while ((next + 1) * static_cast<int64_t>(TiledMerkleTree::kTileWidth) <=
+               width &&
+           ExportTile(level, next)) {
+      ++next;
+    }
+  }
+
+  ExportSTH(sth);
+}
+
+
+bool StaticExporter::ExportBundle(int64_t bundle) {
+  const int64_t start(bundle * bundle_size_);
+  const int64_t end(start + bundle_size_ - 1);
+
+  ReadOnlyDatabase::ScanOptions scan_options;
+  // Written once, and then served from the files.
+  scan_options.fill_cache = false;
+  const std::unique_ptr<ReadOnlyDatabase::Iterator> it(
+      db_->ScanEntries(start, end + 1, scan_options));
+
+  // As get-entries replies, without the SCTs.
+  string body("{\"entries\":[");
+  string leaf_input;
+  string extra_data;
+  LoggedEntry entry;
+  for (int64_t i = start; i <= end; ++i) {
+    if (!it->GetNextEntry(&entry) || entry.sequence_number() != i) {
+      VLOG(1) << "Entry " << i << " is not in the database yet.";
+      return false;
+    }
+    leaf_input.clear();
+    extra_data.clear();
+    if (!entry.SerializeForServing(&leaf_input, &extra_data, nullptr)) {
+      LOG(WARNING) << "Failed to serialize entry @ " << i << ":\n"
+                   << entry.DebugString();
+      static_export_errors->Increment();
+      return false;
+    }
+
+    if (i > start) {
+      body.push_back(',');
+    }
+    body.append("{\"leaf_input\":\"");
+    util::AppendBase64(leaf_input, &body);
+    body.append("\",\"extra_data\":\"");
+    util::AppendBase64(extra_data, &body);
+    body.append("\"}");
+  }
+  body.append("]}");
+
+  if (!Write(BundlePath(bundle), Gzip(body, Z_BEST_COMPRESSION))) {
+    return false;
+  }
+  static_export_files_written->Increment("entries");
+  return true;
+}
+
+
+bool StaticExporter::ExportTile(int level, int64_t index) {
+  string hashes;
+  if (db_->LookupTile(level, index, &hashes) != ReadOnlyDatabase::LOOKUP_OK ||
+      hashes.size() != kTileSize) {
+    // The tiles are written by the signer shortly after the tree head.
+    VLOG(1) << "Tile " << level << "/" << index
+            << " is not in the database yet.";
+    return false;
+  }
+
+  if (!Write(TilePath(level, index), hashes)) {
+    return false;
+  }
+  static_export_files_written->Increment("tile");
+  return true;
+}
+
+
+void StaticExporter::ExportSTH(const SignedTreeHead& sth) {
+  const string path(dir_ + "/sth/" + std::to_string(sth.tree_size()) +
+                    ".json");
+  // The first tree head of a given size is the one kept.
+  if (file_ops_->access(path, F_OK) == 0) {
+    return;
+  }
+
+  JsonObject json;
+  json.Add("tree_size", sth.tree_size());
+  json.Add("timestamp", sth.timestamp());
+  json.AddBase64("sha256_root_hash", sth.sha256_root_hash());
+  json.Add("tree_head_signature", sth.signature());
+
+  if (Write(path, json.ToString())) {
+    static_export_files_written->Increment("sth");
+  }
+}
+
+
+string StaticExporter::EntriesPath(int64_t start, int64_t end) const {
+  if (start % bundle_size_ != 0 || end != start + bundle_size_ - 1) {
+    return string();
+  }
+  return BundlePath(start / bundle_size_);
+}
+
+
+string StaticExporter::BundlePath(int64_t bundle) const {
+  return dir_ + "/entries/" + std::to_string(bundle * bundle_size_) + "-" +
+         std::to_string((bundle + 1) * bundle_size_ - 1) + ".json.gz";
+}
+
+
+string StaticExporter::TilePath(int level, int64_t index) const {
+  return dir_ + "/tiles/" + std::to_string(level) + "/" +
+         std::to_string(index);
+}
+
+
+bool StaticExporter::Write(const string& path, const string& data) {
+  if (file_ops_->atomic_write(dir_ + "/tmp/tmpXXXXXX", path, data) != 0) {
+    PLOG(WARNING) << "Cannot write " << path;
+    static_export_errors->Increment();
+    return false;
+  }
+  return true;
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,96 @@
+#ifndef CERT_TRANS_SERVER_STATIC_EXPORTER_H_
+#define CERT_TRANS_SERVER_STATIC_EXPORTER_H_
+
+#include <stdint.h>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "log/database.h"
+#include "proto/ct.pb.h"
+#include "util/executor.h"
+
+namespace cert_trans {
+
+class FilesystemOps;
+
+
+// Writes out the parts of the log which never change as static files
+// under a directory, so that a CDN, or any plain web server, can serve
+// most of the reads in front of the log servers:
+//
+//   entries/<start>-<end>.json.gz  The get-entries reply for entries
+//                                  start to end (inclusive), gzipped,
+//                                  for each whole bundle of
+//                                  --static_export_bundle_size entries.
+//   tiles/<level>/<index>          Each full tile of Merkle tree node
+//                                  hashes (see merkletree/
+//                                  tiled_merkle_tree.h), as written in
+//                                  the database.
+//   sth/<tree_size>.json           The get-sth reply for each tree head.
+//
+// Files are only written once complete, under a temporary name renamed
+// into place, and what is at a given path never changes, so that they
+// can be cached forever.
+//
+// The export runs on |executor| after each new tree head, one run at a
+// time, and picks up from the files already there after a restart.
+class StaticExporter {
+ public:
+  // Does not take ownership of |db| or |executor|, which must outlive
+  // this instance.
+  StaticExporter(const std::string& dir, ReadOnlyDatabase* db,
+                 util::Executor* executor);
+  // Waits for the export in progress, if any.
+  ~StaticExporter();
+  StaticExporter(const StaticExporter&) = delete;
+  StaticExporter& operator=(const StaticExporter&) = delete;
+
+  // The file of the get-entries reply for entries |start| to |end|, if
+  // they make a whole bundle, or an empty string. The file may not
+  // have been exported yet. Thread-safe.
+  std::string EntriesPath(int64_t start, int64_t end) const;
+
+ private:
+  void OnNewSTH(const ct::SignedTreeHead& sth);
+  // Exports up to the latest tree head, until there is no newer one.
+  void Run();
+  void Export(const ct::SignedTreeHead& sth);
+
+  // These return false if the export should stop there for now, e.g.
+  // because the database does not have the data yet.
+  bool ExportBundle(int64_t bundle);
+  bool ExportTile(int level, int64_t index);
+
+  void ExportSTH(const ct::SignedTreeHead& sth);
+
+  std::string BundlePath(int64_t bundle) const;
+  std::string TilePath(int level, int64_t index) const;
+  bool Write(const std::string& path, const std::string& data);
+
+  const std::string dir_;
+  const int64_t bundle_size_;
+  ReadOnlyDatabase* const db_;
+  util::Executor* const executor_;
+  const std::unique_ptr<FilesystemOps> file_ops_;
+  const ReadOnlyDatabase::NotifySTHCallback callback_;
+
+  // Only used by Run(), one at a time.
+  int64_t next_bundle_;
+  // The next tile to export, by tile level.
+  std::vector<int64_t> next_tiles_;
+
+  std::mutex lock_;
+  std::condition_variable done_cv_;
+  // The tree head to export next, if |has_pending_|.
+  ct::SignedTreeHead pending_sth_;
+  bool has_pending_;
+  bool running_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_SERVER_STATIC_EXPORTER_H_
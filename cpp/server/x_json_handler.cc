@@ -13,30 +13,28 @@ using ct::LogEntry;
 using ct::SignedCertificateTimestamp;
 using ct::X_JSON_ENTRY;
 using std::bind;
-using std::make_shared;
 using std::move;
 using std::multimap;
 using std::placeholders::_1;
-using std::shared_ptr;
 using std::string;
+using std::unique_ptr;
 using util::Status;
 
 
 namespace {
 
 
-shared_ptr<JsonObject> ExtractJson(libevent::Base* base, evhttp_request* req) {
+// Runs on the worker threads, the request having been handed over
+// once complete: parsing large documents does not hold up the event
+// thread, and several submissions are parsed at once.
+unique_ptr<JsonObject> ExtractJson(libevent::Base* base, evhttp_request* req) {
   CHECK_NOTNULL(base);
   CHECK_NOTNULL(req);
-  if (evhttp_request_get_command(req) != EVHTTP_REQ_POST) {
-    SendJsonError(base, req, HTTP_BADMETHOD, "Method not allowed.");
-    return nullptr;
-  }
 
   // TODO(pphaneuf): Should we check that Content-Type says
   // "application/json", as recommended by RFC4627?
-  shared_ptr<JsonObject> json_body(
-      make_shared<JsonObject>(evhttp_request_get_input_buffer(req)));
+  unique_ptr<JsonObject> json_body(
+      new JsonObject(evhttp_request_get_input_buffer(req)));
   if (!json_body->Ok() || !json_body->IsType(json_type_object)) {
     SendJsonError(base, req, HTTP_BADREQUEST,
                   "Unable to parse provided JSON.");
@@ -75,17 +73,22 @@ void XJsonHttpHandler::AddHandlers(libevent::HttpServer* server) {
 
 
 void XJsonHttpHandler::AddJson(evhttp_request* req) {
-  shared_ptr<JsonObject> json(ExtractJson(event_base_, req));
-  if (!json) {
-    return;
+  if (evhttp_request_get_command(req) != EVHTTP_REQ_POST) {
+    return SendJsonError(event_base_, req, HTTP_BADMETHOD,
+                         "Method not allowed.");
   }
 
-  pool_->Add(bind(&XJsonHttpHandler::BlockingAddJson, this, req, json));
+  AddWork(pool_, submission_class_, req,
+          bind(&XJsonHttpHandler::BlockingAddJson, this, req));
 }
 
 
-void XJsonHttpHandler::BlockingAddJson(evhttp_request* req,
-                                       shared_ptr<JsonObject> json) const {
+void XJsonHttpHandler::BlockingAddJson(evhttp_request* req) const {
+  const unique_ptr<JsonObject> json(ExtractJson(event_base_, req));
+  if (!json) {
+    return;
+  }
+
   SignedCertificateTimestamp sct;
 
   LogEntry entry;
@@ -33,8 +33,7 @@ class XJsonHttpHandler : public HttpHandler {
 
   void AddJson(evhttp_request* req);
 
-  void BlockingAddJson(evhttp_request* req,
-                       std::shared_ptr<JsonObject> json) const;
+  void BlockingAddJson(evhttp_request* req) const;
 };
 
 
@@ -144,15 +144,14 @@ int main(int argc, char* argv[]) {
   handler.SetProxy(server.proxy());
   handler.Add(server.http_server());
 
-  TreeSigner tree_signer(std::chrono::duration<double>(FLAGS_guard_window_seconds), db.get(), server.log_lookup()->GetCompactMerkleTree(new Sha256Hasher), server.consistent_store(), &log_signer);
+  TreeSigner tree_signer(std::chrono::duration<double>(FLAGS_guard_window_seconds), db.get(), server.log_lookup()->GetCompactMerkleTree(new Sha256Hasher), server.consistent_store(), &log_signer, nullptr, &internal_pool);
 
   if (stand_alone_mode) {
     // Set up a simple single-node environment.
     //
-    // Put a sensible single-node config into FakeEtcd. For a real clustered
-    // log
-    // we'd expect a ClusterConfig already to be present within etcd as part of
-    // the provisioning of the log.
+    // Put a sensible single-node config into the local consistent store.
+    // For a real clustered log we'd expect a ClusterConfig already to be
+    // present within etcd as part of the provisioning of the log.
     //
     // TODO(alcutter): Note that we're currently broken wrt to restarting the
     // log server when there's data in the log.  It's a temporary thing though,
@@ -170,16 +169,8 @@ int main(int argc, char* argv[]) {
     server.election()->StartElection();
     server.election()->WaitToBecomeMaster();
 
-    {
-      EtcdClient::Response resp;
-      util::SyncTask task(event_base.get());
-      etcd_client->Create("/root/sequence_mapping", "", &resp, task.task());
-      task.Wait();
-      CHECK_EQ(::util::OkStatus(), task.status());
-    }
-
     // Do an initial signing run to get the initial STH, again this is
-    // temporary until we re-populate FakeEtcd from the DB.
+    // temporary until we re-populate the consistent store from the DB.
     CHECK_EQ(tree_signer.UpdateTree(), TreeSigner::OK);
 
     // Need to boot-strap the Serving STH too because we consider it an error
@@ -0,0 +1,59 @@
+// Compiles a bundle of PEM trusted roots into a RootStore (see
+// log/root_store.h), which ct-server and the other tools taking
+// --trusted_cert_file load faster, and which the processes on a host
+// share. The store is replaced atomically, so it can be compiled in
+// place while servers are reading it.
+//
+// e.g. compile_roots --roots=roots.pem --output=roots.store
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "log/cert.h"
+#include "log/cert_checker.h"
+#include "log/root_store.h"
+#include "util/init.h"
+#include "util/status.h"
+#include "util/statusor.h"
+
+DEFINE_string(roots, "", "File of concatenated PEM trusted roots.");
+DEFINE_string(output, "", "Where to write the root store.");
+
+using cert_trans::Cert;
+using cert_trans::CertChecker;
+using cert_trans::RootStore;
+using std::unique_ptr;
+using std::vector;
+using util::Status;
+using util::StatusOr;
+
+int main(int argc, char* argv[]) {
+  util::InitCT(&argc, &argv);
+
+  CHECK(!FLAGS_roots.empty()) << "--roots is required";
+  CHECK(!FLAGS_output.empty()) << "--output is required";
+
+  // Parsed as ct-server would, which also drops the duplicates.
+  CertChecker checker;
+  CHECK(checker.LoadTrustedCertificates(FLAGS_roots))
+      << "Cannot load the roots from " << FLAGS_roots;
+  vector<const Cert*> roots;
+  for (const auto& root : checker.GetTrustedCertificates()) {
+    roots.push_back(root.second.get());
+  }
+
+  const Status status(RootStore::Write(FLAGS_output, roots));
+  CHECK(status.ok()) << "Cannot write " << FLAGS_output << ": " << status;
+
+  // Check that it reads back.
+  StatusOr<unique_ptr<RootStore>> store(RootStore::Open(FLAGS_output));
+  CHECK(store.ok()) << store.status();
+  CHECK_EQ(roots.size(), store.ValueOrDie()->size());
+  std::cout << "Wrote " << roots.size() << " roots to " << FLAGS_output
+            << std::endl;
+
+  return 0;
+}
@@ -1,18 +1,35 @@
 #include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
 #include <limits.h>
+#include <algorithm>
+#include <deque>
 #include <functional>
+#include <future>
 #include <iostream>
+#include <limits>
 #include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
 
 #include "log/database.h"
 #include "log/file_db.h"
 #include "log/file_storage.h"
 #include "log/leveldb_db.h"
+#include "log/log_signer.h"
+#include "log/log_verifier.h"
 #include "log/logged_entry.h"
 #include "log/sqlite_db.h"
+#include "merkletree/compact_merkle_tree.h"
+#include "merkletree/merkle_verifier.h"
+#include "merkletree/serial_hasher.h"
 #include "proto/serializer.h"
 #include "util/init.h"
+#include "util/parallel_for.h"
+#include "util/protobuf_util.h"
+#include "util/read_key.h"
+#include "util/thread_pool.h"
 #include "util/util.h"
 
 DEFINE_string(cert_dir, "", "Storage directory for certificates");
@@ -32,60 +49,478 @@ DEFINE_string(leveldb_db, "",
 DEFINE_int64(start, 0, "Starting sequence number (inclusive).");
 DEFINE_int64(end, std::numeric_limits<int64_t>::max(),
              "Ending sequence number (inclusive).");
+DEFINE_string(log_public_key, "",
+              "PEM-encoded public key of the log, to verify the tree head "
+              "of a snapshot with");
+DEFINE_string(dest_sqlite_db, "",
+              "SQLite database to migrate the entries to");
+DEFINE_string(dest_leveldb_db, "",
+              "LevelDB database to migrate the entries to");
+DEFINE_int32(threads, 0,
+             "Number of threads scanning the database, each over a range "
+             "of entries of its own; 0 means one per core.");
 
+using cert_trans::Database;
 using cert_trans::FileDB;
 using cert_trans::FileStorage;
 using cert_trans::LevelDB;
 using cert_trans::LoggedEntry;
 using cert_trans::ReadOnlyDatabase;
+using cert_trans::ReadPublicKey;
 using cert_trans::SQLiteDB;
+using cert_trans::ThreadPool;
+using cert_trans::WriteDelimitedTo;
 using cert_trans::serialization::SerializeResult;
+using ct::LoggedEntryPB;
+using ct::SignedTreeHead;
+using google::protobuf::io::StringOutputStream;
 using std::cerr;
 using std::cout;
+using std::deque;
 using std::function;
+using std::future;
+using std::max;
+using std::min;
+using std::move;
+using std::pair;
+using std::sort;
 using std::string;
 using std::unique_ptr;
+using std::vector;
 using util::InitCT;
+using util::ParallelFor;
+using util::StatusOr;
 using util::ToBase64;
 
+namespace {
+
+
+// Entries per range scanned by a thread. It is a power of two, so that
+// the ranges starting at 0 are whole subtrees of the Merkle tree.
+const int64_t kBlockSize = 1 << 16;
+
 
 void Usage() {
   cerr << "Usage: db_tool [flags] <command>\n"
        << "Where <command> is one of:\n"
-       << "  dump_leaf_inputs\n";
+       << "  dump_leaf_inputs\n"
+       << "  export_entries (as get-entries-binary records, from --start)\n"
+       << "  find_duplicates\n"
+       << "  merkle_root\n"
+       << "  migrate (to --dest_leveldb_db or --dest_sqlite_db)\n"
+       << "  verify_snapshot\n";
+}
+
+
+size_t NumThreads() {
+  if (FLAGS_threads > 0) {
+    return FLAGS_threads;
+  }
+  return max(std::thread::hardware_concurrency(), 1U);
+}
+
+
+// The range [start, end) of --start and --end, bounded by the entries
+// actually stored.
+pair<int64_t, int64_t> FlagsRange(const ReadOnlyDatabase* db) {
+  int64_t stored(db->TreeSize());
+  const vector<pair<int64_t, int64_t>> sparse(db->SparseRanges());
+  if (!sparse.empty()) {
+    stored = max(stored, sparse.back().second);
+  }
+  // FLAGS_end is inclusive.
+  const int64_t end(FLAGS_end < stored ? FLAGS_end + 1 : stored);
+  return pair<int64_t, int64_t>(FLAGS_start, max(FLAGS_start, end));
 }
 
 
-void ForEachLeaf(const ReadOnlyDatabase* db,
-                 const function<void(const LoggedEntry& cert)>& f) {
-  unique_ptr<ReadOnlyDatabase::Iterator> it(db->ScanEntries(FLAGS_start));
-  LoggedEntry cert;
-  while (it->GetNextEntry(&cert)) {
-    if (cert.sequence_number() > FLAGS_end) {
-      break;
+// Splits [start, end) into blocks of kBlockSize entries (aligned on
+// multiples of it), and scans NumThreads() blocks at a time in
+// parallel, each with an iterator of its own, calling |add| for each
+// of their entries in order. |collect| is then called on this thread
+// with the Result of each block, in order, so that the output stays
+// ordered and only a round of blocks is held in memory.
+template <class Result>
+void ScanInBlocks(const ReadOnlyDatabase* db, int64_t start, int64_t end,
+                  const function<void(const LoggedEntry&, Result*)>& add,
+                  const function<void(int64_t block_start, int64_t block_end,
+                                      Result*)>& collect) {
+  const size_t num_threads(NumThreads());
+  ThreadPool pool(num_threads);
+  ReadOnlyDatabase::ScanOptions scan_options;
+  scan_options.readahead = 1024;
+  scan_options.fill_cache = false;
+
+  vector<pair<int64_t, int64_t>> blocks;
+  for (int64_t block_start = start; block_start < end;) {
+    const int64_t block_end(
+        min(end, (block_start / kBlockSize + 1) * kBlockSize));
+    blocks.emplace_back(block_start, block_end);
+    block_start = block_end;
+  }
+
+  for (size_t round = 0; round < blocks.size(); round += num_threads) {
+    const size_t count(min(num_threads, blocks.size() - round));
+    unique_ptr<Result[]> results(new Result[count]);
+    ParallelFor(&pool, count, [&](size_t i) {
+      const pair<int64_t, int64_t>& block(blocks[round + i]);
+      unique_ptr<ReadOnlyDatabase::Iterator> it(
+          db->ScanEntries(block.first, block.second, scan_options));
+      vector<LoggedEntry> certs;
+      while (it->GetNextEntries(scan_options.readahead, &certs) > 0) {
+        for (const LoggedEntry& cert : certs) {
+          add(cert, &results[i]);
+        }
+      }
+    });
+    for (size_t i = 0; i < count; ++i) {
+      collect(blocks[round + i].first, blocks[round + i].second,
+              &results[i]);
     }
-    f(cert);
   }
 }
 
 
 int DumpLeafInputs(const ReadOnlyDatabase* db) {
   CHECK_NOTNULL(db);
-  ForEachLeaf(db, [](const LoggedEntry& cert) {
-    string serialized;
-    const SerializeResult r(Serializer::SerializeSCTSignatureInput(
-        cert.contents().sct(), cert.contents().entry(), &serialized));
-    if (r != SerializeResult::OK) {
-      LOG(FATAL) << "Failed to serialize entry with seq# "
-                 << cert.sequence_number() << " : " << r;
+  const pair<int64_t, int64_t> range(FlagsRange(db));
+  ScanInBlocks<string>(db, range.first, range.second,
+                       [](const LoggedEntry& cert, string* out) {
+                         string serialized;
+                         const SerializeResult r(
+                             Serializer::SerializeSCTSignatureInput(
+                                 cert.contents().sct(),
+                                 cert.contents().entry(), &serialized));
+                         if (r != SerializeResult::OK) {
+                           LOG(FATAL) << "Failed to serialize entry with seq# "
+                                      << cert.sequence_number() << " : " << r;
+                         }
+
+                         *out += std::to_string(cert.sequence_number());
+                         *out += " ";
+                         *out += ToBase64(serialized);
+                         *out += "\n";
+                       },
+                       [](int64_t, int64_t, string* out) { cout << *out; });
+  return 0;
+}
+
+
+// Writes the entries in the format of the get-entries-binary replies
+// (length-delimited LoggedEntryPB::Serialized records), which keeps
+// their encodings as served, and can be read back in order with
+// ReadDelimitedFrom(). Stops at the first missing entry, since the
+// records do not carry their sequence numbers.
+int ExportEntries(const ReadOnlyDatabase* db) {
+  CHECK_NOTNULL(db);
+  const pair<int64_t, int64_t> range(FlagsRange(db));
+  struct Block {
+    Block() : first(-1), next(-1) {
+    }
+
+    // The records of the entries [first, next), the contiguous ones
+    // from the start of the block.
+    string records;
+    int64_t first;
+    int64_t next;
+  };
+  int64_t next(range.first);
+  ScanInBlocks<Block>(
+      db, range.first, range.second,
+      [](const LoggedEntry& cert, Block* block) {
+        if (block->first < 0) {
+          block->first = block->next = cert.sequence_number();
+        }
+        if (cert.sequence_number() != block->next) {
+          return;
+        }
+        LoggedEntryPB::Serialized serialized;
+        CHECK(cert.SerializeForServing(serialized.mutable_leaf_input(),
+                                       serialized.mutable_extra_data(),
+                                       serialized.mutable_sct()))
+            << "Failed to serialize entry with seq# "
+            << cert.sequence_number();
+        StringOutputStream output(&block->records);
+        CHECK(WriteDelimitedTo(serialized, &output));
+        ++block->next;
+      },
+      [&next](int64_t block_start, int64_t, Block* block) {
+        if (next != block_start || block->first != block_start) {
+          return;
+        }
+        cout << block->records;
+        next = block->next;
+      });
+  cerr << "Exported entries [" << range.first << ", " << next << ")\n";
+  if (next != range.second) {
+    LOG(ERROR) << "Entry " << next << " is missing";
+    return 1;
+  }
+  return 0;
+}
+
+
+// Reports the certificates logged at more than one sequence number.
+int FindDuplicates(const ReadOnlyDatabase* db) {
+  CHECK_NOTNULL(db);
+  const pair<int64_t, int64_t> range(FlagsRange(db));
+  // Pairs of hash and sequence number.
+  typedef vector<pair<string, int64_t>> Hashes;
+  Hashes hashes;
+  ScanInBlocks<Hashes>(db, range.first, range.second,
+                       [](const LoggedEntry& cert, Hashes* block) {
+                         block->emplace_back(cert.Hash(),
+                                             cert.sequence_number());
+                       },
+                       [&hashes](int64_t, int64_t, Hashes* block) {
+                         hashes.insert(hashes.end(), block->begin(),
+                                       block->end());
+                       });
+
+  sort(hashes.begin(), hashes.end());
+  int64_t duplicates(0);
+  for (size_t i = 1; i < hashes.size(); ++i) {
+    if (hashes[i].first == hashes[i - 1].first) {
+      ++duplicates;
+      cout << ToBase64(hashes[i].first) << " " << hashes[i - 1].second << " "
+           << hashes[i].second << "\n";
+    }
+  }
+  cerr << duplicates << " duplicates in " << hashes.size() << " entries\n";
+  return duplicates > 0 ? 1 : 0;
+}
+
+
+struct SubtreeRoot {
+  SubtreeRoot()
+      : tree(unique_ptr<Sha256Hasher>(new Sha256Hasher)), first(-1) {
+  }
+
+  CompactMerkleTree tree;
+  // The sequence number of the first entry, or -1 if there is none.
+  int64_t first;
+};
+
+
+// The root of the tree whose leaves have the subtree roots
+// [begin, end) of |roots|, each of a complete subtree of kBlockSize
+// leaves but for the last one. As the blocks are a power of two, the
+// RFC 6962 split of the whole tree falls on a block boundary, and the
+// tree of blocks splits the same way.
+string MergeRoots(const TreeHasher& hasher, const vector<string>& roots,
+                  size_t begin, size_t end) {
+  CHECK_LT(begin, end);
+  if (end - begin == 1) {
+    return roots[begin];
+  }
+  size_t split(1);
+  while (split * 2 < end - begin) {
+    split *= 2;
+  }
+  return hasher.HashChildren(MergeRoots(hasher, roots, begin, begin + split),
+                             MergeRoots(hasher, roots, begin + split, end));
+}
+
+
+// Computes the root of the first |tree_size| entries, hashing blocks
+// of them on several threads. Returns false if some are missing.
+bool ComputeRoot(const ReadOnlyDatabase* db, int64_t tree_size,
+                 string* root) {
+  const TreeHasher hasher(unique_ptr<Sha256Hasher>(new Sha256Hasher));
+  vector<string> roots;
+  bool complete(true);
+  ScanInBlocks<SubtreeRoot>(
+      db, 0, tree_size,
+      [](const LoggedEntry& cert, SubtreeRoot* subtree) {
+        if (subtree->first < 0) {
+          subtree->first = cert.sequence_number();
+        }
+        string serialized_leaf;
+        CHECK(cert.SerializeForLeaf(&serialized_leaf))
+            << "Failed to serialize entry with seq# "
+            << cert.sequence_number();
+        subtree->tree.AddLeaf(serialized_leaf);
+      },
+      [&](int64_t block_start, int64_t block_end, SubtreeRoot* subtree) {
+        if (subtree->first != block_start ||
+            static_cast<int64_t>(subtree->tree.LeafCount()) !=
+                block_end - block_start) {
+          LOG(ERROR) << "Entries missing in [" << block_start << ", "
+                     << block_end << ")";
+          complete = false;
+          return;
+        }
+        roots.emplace_back(subtree->tree.CurrentRoot());
+      });
+  if (!complete) {
+    return false;
+  }
+  *root = roots.empty() ? hasher.HashEmpty()
+                        : MergeRoots(hasher, roots, 0, roots.size());
+  return true;
+}
+
+
+// Prints the root of the tree of the entries up to --end (inclusive),
+// or of all the contiguous ones.
+int MerkleRoot(const ReadOnlyDatabase* db) {
+  CHECK_NOTNULL(db);
+  const int64_t tree_size(
+      FLAGS_end < db->TreeSize() ? FLAGS_end + 1 : db->TreeSize());
+  string root;
+  if (!ComputeRoot(db, tree_size, &root)) {
+    return 1;
+  }
+  cout << tree_size << " " << ToBase64(root) << "\n";
+  return 0;
+}
+
+
+// Checks that the entries of a database (e.g. a snapshot written by
+// LevelDB::WriteSnapshot()) match its latest tree head, signed by the
+// log if --log_public_key is set.
+int VerifySnapshot(const ReadOnlyDatabase* db) {
+  CHECK_NOTNULL(db);
+  SignedTreeHead sth;
+  if (db->LatestTreeHead(&sth) != ReadOnlyDatabase::LOOKUP_OK) {
+    LOG(ERROR) << "No tree head to verify the entries against";
+    return 1;
+  }
+
+  if (!FLAGS_log_public_key.empty()) {
+    const StatusOr<EVP_PKEY*> pubkey(ReadPublicKey(FLAGS_log_public_key));
+    CHECK(pubkey.ok()) << "Failed to read the log's public key file: "
+                       << pubkey.status();
+    const LogVerifier verifier(new LogSigVerifier(pubkey.ValueOrDie()),
+                               new MerkleVerifier(unique_ptr<Sha256Hasher>(
+                                   new Sha256Hasher)));
+    const LogVerifier::LogVerifyResult result(
+        verifier.VerifySignedTreeHead(sth));
+    if (result != LogVerifier::VERIFY_OK) {
+      LOG(ERROR) << "Invalid tree head: "
+                 << LogVerifier::VerifyResultString(result);
+      return 1;
     }
+  } else {
+    LOG(WARNING) << "--log_public_key not set, not verifying the signature "
+                 << "of the tree head";
+  }
+
+  if (db->TreeSize() < sth.tree_size()) {
+    LOG(ERROR) << "Only " << db->TreeSize() << " contiguous entries for a "
+               << "tree head of size " << sth.tree_size();
+    return 1;
+  }
+
+  string root;
+  if (!ComputeRoot(db, sth.tree_size(), &root)) {
+    return 1;
+  }
+
+  if (root != sth.sha256_root_hash()) {
+    LOG(ERROR) << "The entries do not match the tree head of size "
+               << sth.tree_size();
+    return 1;
+  }
 
-    cout << cert.sequence_number() << " " << ToBase64(serialized) << "\n";
-  });
+  cout << "Verified " << sth.tree_size() << " entries against the tree "
+       << "head with timestamp " << sth.timestamp() << "\n";
   return 0;
 }
 
 
+// Copies the entries and the latest tree head to another database,
+// in blocks read on several threads and written as whole batches,
+// while the next blocks are read. The contiguous entries of the
+// destination are where an interrupted migration resumes: they are
+// written in order, so all the entries before them were written.
+// Finally checks the entries of the destination against the tree
+// head.
+int Migrate(const ReadOnlyDatabase* db) {
+  CHECK_NOTNULL(db);
+  if (FLAGS_dest_sqlite_db.empty() == FLAGS_dest_leveldb_db.empty()) {
+    LOG(ERROR) << "Must specify one of --dest_sqlite_db and "
+               << "--dest_leveldb_db";
+    return 1;
+  }
+  unique_ptr<Database> dest;
+  if (!FLAGS_dest_sqlite_db.empty()) {
+    dest.reset(new SQLiteDB(FLAGS_dest_sqlite_db));
+  } else {
+    dest.reset(new LevelDB(FLAGS_dest_leveldb_db));
+  }
+
+  SignedTreeHead sth;
+  if (db->LatestTreeHead(&sth) != ReadOnlyDatabase::LOOKUP_OK) {
+    LOG(ERROR) << "No tree head to migrate";
+    return 1;
+  }
+
+  const int64_t resume_at(dest->TreeSize());
+  // Entries past those may have been written too, before the
+  // interruption.
+  const vector<pair<int64_t, int64_t>> written(dest->SparseRanges());
+  int64_t end(db->TreeSize());
+  const vector<pair<int64_t, int64_t>> sparse(db->SparseRanges());
+  if (!sparse.empty()) {
+    end = max(end, sparse.back().second);
+  }
+  LOG(INFO) << "Migrating entries [" << resume_at << ", " << end << ")";
+
+  // At most two batches are written while the next ones are read.
+  const size_t kMaxPendingWrites = 2;
+  deque<future<vector<Database::WriteResult>>> pending;
+  const auto check_write = [&pending]() {
+    for (const Database::WriteResult result : pending.front().get()) {
+      CHECK_EQ(Database::OK, result) << "Failed to write an entry";
+    }
+    pending.pop_front();
+  };
+  ScanInBlocks<vector<LoggedEntry>>(
+      db, resume_at, end,
+      [&written](const LoggedEntry& cert, vector<LoggedEntry>* block) {
+        for (const auto& range : written) {
+          if (cert.sequence_number() >= range.first &&
+              cert.sequence_number() < range.second) {
+            return;
+          }
+        }
+        block->push_back(cert);
+      },
+      [&](int64_t, int64_t block_end, vector<LoggedEntry>* block) {
+        if (pending.size() >= kMaxPendingWrites) {
+          check_write();
+        }
+        pending.emplace_back(
+            dest->CreateSequencedEntriesAsync(move(*block)));
+        LOG(INFO) << "Read entries up to " << block_end;
+      });
+  while (!pending.empty()) {
+    check_write();
+  }
+
+  SignedTreeHead dest_sth;
+  if (dest->LatestTreeHead(&dest_sth) != ReadOnlyDatabase::LOOKUP_OK ||
+      dest_sth.timestamp() < sth.timestamp()) {
+    CHECK_EQ(Database::OK, dest->WriteTreeHead(sth));
+  }
+
+  string root;
+  if (!ComputeRoot(dest.get(), sth.tree_size(), &root) ||
+      root != sth.sha256_root_hash()) {
+    LOG(ERROR) << "The migrated entries do not match the tree head of size "
+               << sth.tree_size();
+    return 1;
+  }
+  cout << "Migrated " << end << " entries, verified against the tree head "
+       << "of size " << sth.tree_size() << "\n";
+  return 0;
+}
+
+
+}  // namespace
+
+
 int main(int argc, char* argv[]) {
   InitCT(&argc, &argv);
 
@@ -124,6 +559,16 @@ int main(int argc, char* argv[]) {
 
   if (strcmp(argv[1], "dump_leaf_inputs") == 0) {
     return DumpLeafInputs(db.get());
+  } else if (strcmp(argv[1], "export_entries") == 0) {
+    return ExportEntries(db.get());
+  } else if (strcmp(argv[1], "find_duplicates") == 0) {
+    return FindDuplicates(db.get());
+  } else if (strcmp(argv[1], "merkle_root") == 0) {
+    return MerkleRoot(db.get());
+  } else if (strcmp(argv[1], "migrate") == 0) {
+    return Migrate(db.get());
+  } else if (strcmp(argv[1], "verify_snapshot") == 0) {
+    return VerifySnapshot(db.get());
   } else {
     Usage();
     return 1;
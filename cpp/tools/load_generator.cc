@@ -0,0 +1,612 @@
+// Sends a synthetic load to a log server, for capacity planning: new
+// certificate and precertificate chains issued by a test CA, mixed
+// with get-sth, get-entries, get-proof-by-hash and get-sth-consistency
+// requests, in the proportions of the --*_weight flags. It then prints
+// the latency distribution of each endpoint.
+//
+// With --rate, the requests are sent open loop, at that constant rate
+// whatever the latency of the server, and their latency counts from
+// when they were due to be sent: a slow server does not slow down the
+// load, and hide its own latency (coordinated omission). Requests due
+// while --concurrency are already in flight are skipped, and counted.
+// Without --rate, --concurrency requests are kept in flight at all
+// times, which measures the maximum throughput, but not the latency
+// under a given load.
+//
+// The chains are made before the load starts, so that making them
+// does not hold it up. The server must trust --ca_cert (the test CA
+// is trusted by the test servers). The proofs are asked for entries
+// already in the log when it starts, and there is no proof request if
+// it is empty.
+//
+// e.g. load_generator --ct_server=http://localhost:8888 --rate=500
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <openssl/bn.h>
+#include <openssl/ec.h>
+#include <openssl/evp.h>
+#include <openssl/obj_mac.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "client/async_log_client.h"
+#include "log/cert.h"
+#include "log/ct_extensions.h"
+#include "merkletree/serial_hasher.h"
+#include "merkletree/tree_hasher.h"
+#include "monitoring/histogram.h"
+#include "net/url_fetcher.h"
+#include "proto/cert_serializer.h"
+#include "proto/ct.pb.h"
+#include "proto/serializer.h"
+#include "util/init.h"
+#include "util/libevent_wrapper.h"
+#include "util/openssl_scoped_types.h"
+#include "util/sync_task.h"
+#include "util/thread_pool.h"
+#include "util/util.h"
+
+DEFINE_string(ct_server, "", "URI of the log server, e.g. "
+                             "http://localhost:8888");
+DEFINE_string(ca_cert, "test/testdata/ca-cert.pem",
+              "PEM-encoded certificate of the CA issuing the submitted "
+              "(pre)certificates.");
+DEFINE_string(ca_key, "test/testdata/ca-key.pem",
+              "PEM-encoded private key of --ca_cert.");
+DEFINE_string(ca_key_password, "password1",
+              "Password of --ca_key, if it is encrypted.");
+DEFINE_int32(requests, 10000, "Number of requests to send.");
+DEFINE_double(rate, 0,
+              "Requests per second to send, open loop. 0 to send them "
+              "closed loop, --concurrency at a time.");
+DEFINE_int32(concurrency, 64,
+             "Number of requests in flight (the maximum number, with "
+             "--rate).");
+DEFINE_int32(threads, 4,
+             "Number of threads making the chains, and handling the "
+             "replies.");
+DEFINE_int32(add_chain_weight, 10, "Weight of add-chain requests.");
+DEFINE_int32(add_pre_chain_weight, 2, "Weight of add-pre-chain requests.");
+DEFINE_int32(get_sth_weight, 10, "Weight of get-sth requests.");
+DEFINE_int32(get_entries_weight, 10, "Weight of get-entries requests.");
+DEFINE_int32(get_entries_count, 32,
+             "Number of entries asked for by each get-entries request.");
+DEFINE_int32(get_proof_weight, 5, "Weight of get-proof-by-hash requests.");
+DEFINE_int32(get_consistency_weight, 5,
+             "Weight of get-sth-consistency requests.");
+DEFINE_int32(proof_sample_size, 256,
+             "Number of entries of the log whose inclusion proofs are "
+             "asked for.");
+DEFINE_bool(print_histograms, true,
+            "Print the whole latency histogram of each endpoint, besides "
+            "its percentiles.");
+
+namespace libevent = cert_trans::libevent;
+
+using cert_trans::AsyncLogClient;
+using cert_trans::Cert;
+using cert_trans::CertChain;
+using cert_trans::HistogramBuckets;
+using cert_trans::HistogramCell;
+using cert_trans::PreCertChain;
+using cert_trans::ScopedASN1_OCTET_STRING;
+using cert_trans::ScopedBIGNUM;
+using cert_trans::ScopedBIO;
+using cert_trans::ScopedEVP_PKEY;
+using cert_trans::ScopedX509;
+using cert_trans::ThreadPool;
+using cert_trans::UrlFetcher;
+using std::atomic;
+using std::bind;
+using std::chrono::duration;
+using std::chrono::steady_clock;
+using std::condition_variable;
+using std::lock_guard;
+using std::make_shared;
+using std::mutex;
+using std::shared_ptr;
+using std::string;
+using std::unique_lock;
+using std::unique_ptr;
+using std::vector;
+using util::SyncTask;
+
+namespace {
+
+
+enum Endpoint {
+  ADD_CHAIN,
+  ADD_PRE_CHAIN,
+  GET_STH,
+  GET_ENTRIES,
+  GET_PROOF,
+  GET_CONSISTENCY,
+  NUM_ENDPOINTS,
+};
+
+
+const char* const kEndpointNames[NUM_ENDPOINTS] = {
+    "add-chain",   "add-pre-chain",      "get-sth",
+    "get-entries", "get-proof-by-hash", "get-sth-consistency",
+};
+
+
+struct EndpointStats {
+  // In microseconds.
+  HistogramCell latencies;
+  atomic<int64_t> errors{0};
+  atomic<int64_t> skipped{0};
+};
+
+
+ScopedX509 ReadCert(const string& file) {
+  string pem;
+  PCHECK(util::ReadTextFile(file, &pem)) << "Cannot read " << file;
+  ScopedBIO bio(BIO_new_mem_buf(const_cast<char*>(pem.data()), pem.size()));
+  ScopedX509 cert(PEM_read_bio_X509(bio.get(), nullptr, nullptr, nullptr));
+  CHECK(cert) << "Cannot parse the certificate in " << file;
+  return cert;
+}
+
+
+ScopedEVP_PKEY ReadKey(const string& file, const string& password) {
+  string pem;
+  PCHECK(util::ReadTextFile(file, &pem)) << "Cannot read " << file;
+  ScopedBIO bio(BIO_new_mem_buf(const_cast<char*>(pem.data()), pem.size()));
+  ScopedEVP_PKEY key(PEM_read_bio_PrivateKey(
+      bio.get(), nullptr, nullptr, const_cast<char*>(password.c_str())));
+  CHECK(key) << "Cannot parse the private key in " << file;
+  return key;
+}
+
+
+ScopedEVP_PKEY NewKey() {
+  EC_KEY* const ec_key(EC_KEY_new_by_curve_name(NID_X9_62_prime256v1));
+  CHECK_NOTNULL(ec_key);
+  CHECK_EQ(1, EC_KEY_generate_key(ec_key));
+  ScopedEVP_PKEY key(EVP_PKEY_new());
+  CHECK_EQ(1, EVP_PKEY_assign_EC_KEY(key.get(), ec_key));
+  return key;
+}
+
+
+string DerEncoding(X509* cert) {
+  unsigned char* der(nullptr);
+  const int der_size(i2d_X509(cert, &der));
+  CHECK_GT(der_size, 0);
+  const string der_string(reinterpret_cast<char*>(der), der_size);
+  OPENSSL_free(der);
+  return der_string;
+}
+
+
+// Issues a new certificate, for a name of its own, with the poison
+// extension if |precert|.
+unique_ptr<Cert> IssueCert(X509* ca_cert, EVP_PKEY* ca_key, EVP_PKEY* key,
+                           bool precert) {
+  ScopedX509 cert(X509_new());
+  CHECK_EQ(1, X509_set_version(cert.get(), 2));
+
+  ScopedBIGNUM serial(BN_new());
+  CHECK_EQ(1, BN_rand(serial.get(), 128, 0, 0));
+  CHECK_NOTNULL(
+      BN_to_ASN1_INTEGER(serial.get(), X509_get_serialNumber(cert.get())));
+
+  CHECK_EQ(1, X509_set_issuer_name(cert.get(),
+                                   X509_get_subject_name(ca_cert)));
+  char* const serial_hex(BN_bn2hex(serial.get()));
+  const string name(string(serial_hex) + ".load.example.com");
+  OPENSSL_free(serial_hex);
+  CHECK_EQ(1, X509_NAME_add_entry_by_txt(
+                  X509_get_subject_name(cert.get()), "CN", MBSTRING_ASC,
+                  reinterpret_cast<const unsigned char*>(name.c_str()), -1,
+                  -1, 0));
+
+  X509_gmtime_adj(X509_get_notBefore(cert.get()), 0);
+  X509_gmtime_adj(X509_get_notAfter(cert.get()), 90 * 24 * 3600);
+  CHECK_EQ(1, X509_set_pubkey(cert.get(), key));
+
+  if (precert) {
+    // The poison extension holds an ASN.1 NULL.
+    static const unsigned char kNull[] = {0x05, 0x00};
+    ScopedASN1_OCTET_STRING value(ASN1_OCTET_STRING_new());
+    CHECK_EQ(1, ASN1_OCTET_STRING_set(value.get(), kNull, sizeof(kNull)));
+    X509_EXTENSION* const poison(X509_EXTENSION_create_by_NID(
+        nullptr, cert_trans::NID_ctPoison, 1 /* critical */, value.get()));
+    CHECK_NOTNULL(poison);
+    CHECK_EQ(1, X509_add_ext(cert.get(), poison, -1));
+    X509_EXTENSION_free(poison);
+  }
+
+  CHECK_GT(X509_sign(cert.get(), ca_key, EVP_sha256()), 0);
+  return Cert::FromDerString(DerEncoding(cert.get()));
+}
+
+
+// Returns the leaf hashes of up to |count| entries of the tree of
+// |sth|, for get-proof-by-hash requests.
+vector<string> SampleLeafHashes(AsyncLogClient* client, ThreadPool* pool,
+                                const ct::SignedTreeHead& sth, int count) {
+  vector<string> hashes;
+  if (sth.tree_size() == 0 || count <= 0) {
+    return hashes;
+  }
+  std::mt19937_64 random(std::random_device{}());
+  const int64_t size(std::min<int64_t>(count, sth.tree_size()));
+  const int64_t first(random() % (sth.tree_size() - size + 1));
+
+  vector<AsyncLogClient::Entry> entries;
+  AsyncLogClient::Status status(AsyncLogClient::UNKNOWN_ERROR);
+  SyncTask task(pool);
+  client->GetEntriesAndSCTs(first, first + size - 1, &entries,
+                            [&status, &task](AsyncLogClient::Status s) {
+                              status = s;
+                              task.task()->Return();
+                            });
+  task.Wait();
+  if (status != AsyncLogClient::OK) {
+    LOG(WARNING) << "Cannot get entries " << first << " to "
+                 << first + size - 1 << " for the proof requests: "
+                 << status;
+    return hashes;
+  }
+
+  const TreeHasher hasher(
+      unique_ptr<Sha256Hasher>(new Sha256Hasher));
+  for (const AsyncLogClient::Entry& entry : entries) {
+    string leaf;
+    if (!entry.sct ||
+        Serializer::SerializeSCTMerkleTreeLeaf(*entry.sct, entry.entry,
+                                               &leaf) !=
+            cert_trans::serialization::SerializeResult::OK) {
+      continue;
+    }
+    hashes.push_back(hasher.HashLeaf(leaf));
+  }
+  return hashes;
+}
+
+
+class LoadGenerator {
+ public:
+  LoadGenerator(AsyncLogClient* client, ThreadPool* pool)
+      : client_(CHECK_NOTNULL(client)),
+        pool_(CHECK_NOTNULL(pool)),
+        random_(std::random_device{}()),
+        issued_(0),
+        in_flight_(0) {
+  }
+
+  // Gets the latest tree head, which the read requests are about,
+  // picks the endpoint of each request and makes the chains.
+  void Prepare();
+
+  void Run();
+
+  void Report() const;
+
+ private:
+  // A request in flight.
+  struct Request {
+    Endpoint endpoint;
+    // When the latency counts from.
+    steady_clock::time_point start;
+    ct::SignedCertificateTimestamp sct;
+    ct::SignedTreeHead sth;
+    vector<AsyncLogClient::Entry> entries;
+    ct::MerkleAuditProof proof;
+    vector<string> consistency_proof;
+  };
+
+  // Sends request |index|, which was due at |start|.
+  void Send(int64_t index, const steady_clock::time_point& start);
+  void Done(Request* request, AsyncLogClient::Status status);
+
+  AsyncLogClient* const client_;
+  ThreadPool* const pool_;
+  std::mt19937_64 random_;
+
+  ct::SignedTreeHead sth_;
+  vector<string> leaf_hashes_;
+  vector<Endpoint> endpoints_;
+  // The chains of the add-chain and add-pre-chain requests, by index.
+  vector<unique_ptr<CertChain>> chains_;
+
+  EndpointStats stats_[NUM_ENDPOINTS];
+  steady_clock::duration elapsed_;
+
+  mutex lock_;
+  condition_variable done_cv_;
+  int64_t issued_;
+  int64_t in_flight_;
+};
+
+
+void LoadGenerator::Prepare() {
+  AsyncLogClient::Status status(AsyncLogClient::UNKNOWN_ERROR);
+  {
+    SyncTask task(pool_);
+    client_->GetSTH(&sth_, [&status, &task](AsyncLogClient::Status s) {
+      status = s;
+      task.task()->Return();
+    });
+    task.Wait();
+  }
+  CHECK_EQ(AsyncLogClient::OK, status) << "Cannot get the tree head of "
+                                       << client_->server_url();
+  LOG(INFO) << "The log has " << sth_.tree_size() << " entries.";
+
+  leaf_hashes_ =
+      SampleLeafHashes(client_, pool_, sth_, FLAGS_proof_sample_size);
+
+  vector<int> weights(NUM_ENDPOINTS);
+  weights[ADD_CHAIN] = FLAGS_add_chain_weight;
+  weights[ADD_PRE_CHAIN] = FLAGS_add_pre_chain_weight;
+  weights[GET_STH] = FLAGS_get_sth_weight;
+  // Requests about entries need some.
+  const bool has_entries(sth_.tree_size() > 0);
+  weights[GET_ENTRIES] = has_entries ? FLAGS_get_entries_weight : 0;
+  weights[GET_PROOF] = leaf_hashes_.empty() ? 0 : FLAGS_get_proof_weight;
+  weights[GET_CONSISTENCY] =
+      sth_.tree_size() > 1 ? FLAGS_get_consistency_weight : 0;
+  for (const int weight : weights) {
+    CHECK_GE(weight, 0) << "The weights cannot be negative.";
+  }
+  CHECK_GT(std::accumulate(weights.begin(), weights.end(), 0), 0)
+      << "No requests to send.";
+  std::discrete_distribution<int> pick(weights.begin(), weights.end());
+  for (int i = 0; i < FLAGS_requests; ++i) {
+    endpoints_.push_back(static_cast<Endpoint>(pick(random_)));
+  }
+
+  ScopedX509 ca_cert(ReadCert(FLAGS_ca_cert));
+  const string ca_der(DerEncoding(ca_cert.get()));
+  ScopedEVP_PKEY ca_key(ReadKey(FLAGS_ca_key, FLAGS_ca_key_password));
+  // All the certificates can share a key.
+  ScopedEVP_PKEY key(NewKey());
+  chains_.resize(FLAGS_requests);
+  LOG(INFO) << "Making the chains...";
+  {
+    SyncTask task(pool_);
+    for (int i = 0; i < FLAGS_requests; ++i) {
+      if (endpoints_[i] != ADD_CHAIN && endpoints_[i] != ADD_PRE_CHAIN) {
+        continue;
+      }
+      util::Task* const child(task.task()->AddChild([](util::Task*) {}));
+      pool_->Add([this, i, &ca_cert, &ca_der, &ca_key, &key, child]() {
+        const bool precert(endpoints_[i] == ADD_PRE_CHAIN);
+        unique_ptr<CertChain> chain(precert ? new PreCertChain
+                                            : new CertChain);
+        CHECK(chain->AddCert(
+            IssueCert(ca_cert.get(), ca_key.get(), key.get(), precert)));
+        CHECK(chain->AddCert(Cert::FromDerString(ca_der)));
+        chains_[i] = std::move(chain);
+        child->Return();
+      });
+    }
+    task.task()->Return();
+    task.Wait();
+  }
+  LOG(INFO) << "Ready.";
+}
+
+
+void LoadGenerator::Run() {
+  const steady_clock::time_point start(steady_clock::now());
+  const int64_t total(endpoints_.size());
+
+  if (FLAGS_rate > 0) {
+    const duration<double> interval(1 / FLAGS_rate);
+    for (int64_t i = 0; i < total; ++i) {
+      const steady_clock::time_point due(
+          start +
+          std::chrono::duration_cast<steady_clock::duration>(interval * i));
+      std::this_thread::sleep_until(due);
+      {
+        lock_guard<mutex> lock(lock_);
+        ++issued_;
+        if (in_flight_ >= FLAGS_concurrency) {
+          stats_[endpoints_[i]].skipped++;
+          continue;
+        }
+        ++in_flight_;
+      }
+      Send(i, due);
+    }
+  } else {
+    // The others are sent as these complete.
+    const int64_t first(std::min<int64_t>(FLAGS_concurrency, total));
+    {
+      lock_guard<mutex> lock(lock_);
+      issued_ = first;
+      in_flight_ = first;
+    }
+    for (int64_t i = 0; i < first; ++i) {
+      Send(i, steady_clock::now());
+    }
+  }
+
+  unique_lock<mutex> lock(lock_);
+  done_cv_.wait(lock, [this, total]() {
+    return issued_ == total && in_flight_ == 0;
+  });
+  elapsed_ = steady_clock::now() - start;
+}
+
+
+void LoadGenerator::Send(int64_t index, const steady_clock::time_point& start) {
+  Request* const request(new Request);
+  request->endpoint = endpoints_[index];
+  request->start = start;
+  const AsyncLogClient::Callback done(
+      bind(&LoadGenerator::Done, this, request, std::placeholders::_1));
+
+  switch (request->endpoint) {
+    case ADD_CHAIN:
+      client_->AddCertChain(*chains_[index], &request->sct, done);
+      break;
+    case ADD_PRE_CHAIN:
+      client_->AddPreCertChain(
+          *static_cast<const PreCertChain*>(chains_[index].get()),
+          &request->sct, done);
+      break;
+    case GET_STH:
+      client_->GetSTH(&request->sth, done);
+      break;
+    case GET_ENTRIES: {
+      const int64_t first(index % sth_.tree_size());
+      const int64_t last(std::min<int64_t>(
+          sth_.tree_size(), first + FLAGS_get_entries_count) - 1);
+      client_->GetEntries(first, last, &request->entries, done);
+      break;
+    }
+    case GET_PROOF:
+      client_->QueryInclusionProof(sth_,
+                                   leaf_hashes_[index % leaf_hashes_.size()],
+                                   &request->proof, done);
+      break;
+    case GET_CONSISTENCY:
+      client_->GetSTHConsistency(1 + index % (sth_.tree_size() - 1),
+                                 sth_.tree_size(),
+                                 &request->consistency_proof, done);
+      break;
+    case NUM_ENDPOINTS:
+      LOG(FATAL) << "Not an endpoint";
+  }
+}
+
+
+void LoadGenerator::Done(Request* request, AsyncLogClient::Status status) {
+  const unique_ptr<Request> deleter(request);
+  EndpointStats* const stats(&stats_[request->endpoint]);
+  if (status == AsyncLogClient::OK) {
+    stats->latencies.Record(
+        duration<double, std::micro>(steady_clock::now() - request->start)
+            .count());
+  } else {
+    stats->errors++;
+  }
+
+  int64_t next(-1);
+  {
+    lock_guard<mutex> lock(lock_);
+    --in_flight_;
+    if (FLAGS_rate <= 0 &&
+        issued_ < static_cast<int64_t>(endpoints_.size())) {
+      next = issued_++;
+      ++in_flight_;
+    }
+    if (in_flight_ == 0) {
+      done_cv_.notify_all();
+    }
+  }
+  if (next >= 0) {
+    Send(next, steady_clock::now());
+  }
+}
+
+
+// Returns the upper bound of the bucket of the value at |percentile|,
+// in milliseconds.
+double Percentile(const vector<uint64_t>& buckets, uint64_t count,
+                  double percentile) {
+  uint64_t seen(0);
+  for (size_t i = 0; i < buckets.size(); ++i) {
+    seen += buckets[i];
+    if (seen > 0 && seen >= percentile * count) {
+      return HistogramBuckets::UpperBound(i) / 1000;
+    }
+  }
+  return 0;
+}
+
+
+void LoadGenerator::Report() const {
+  const double seconds(duration<double>(elapsed_).count());
+  std::cout << "elapsed_seconds: " << seconds << std::endl;
+  for (int endpoint = 0; endpoint < NUM_ENDPOINTS; ++endpoint) {
+    const EndpointStats& stats(stats_[endpoint]);
+    double sum(0);
+    vector<uint64_t> buckets;
+    stats.latencies.Snapshot(&sum, &buckets);
+    const uint64_t count(
+        std::accumulate(buckets.begin(), buckets.end(), uint64_t(0)));
+    if (count == 0 && stats.errors == 0 && stats.skipped == 0) {
+      continue;
+    }
+
+    std::cout << kEndpointNames[endpoint] << ": ok=" << count
+              << " errors=" << stats.errors << " skipped=" << stats.skipped
+              << " per_second=" << count / seconds;
+    if (count > 0) {
+      std::cout << " mean_ms=" << sum / count / 1000;
+      for (const double percentile : {0.5, 0.9, 0.99, 0.999}) {
+        std::cout << " p" << percentile * 100 << "_ms<="
+                  << Percentile(buckets, count, percentile);
+      }
+    }
+    std::cout << std::endl;
+
+    if (!FLAGS_print_histograms) {
+      continue;
+    }
+    uint64_t seen(0);
+    for (size_t i = 0; i < buckets.size(); ++i) {
+      if (buckets[i] == 0) {
+        continue;
+      }
+      seen += buckets[i];
+      std::cout << "  <" << std::setw(10)
+                << HistogramBuckets::UpperBound(i) / 1000 << " ms "
+                << std::setw(8) << buckets[i] << " " << std::setw(7)
+                << std::fixed << std::setprecision(3)
+                << 100.0 * seen / count << "%" << std::endl;
+      std::cout.unsetf(std::ios::floatfield);
+      std::cout << std::setprecision(6);
+    }
+  }
+}
+
+
+}  // namespace
+
+
+int main(int argc, char* argv[]) {
+  ConfigureSerializerForV1CT();
+  util::InitCT(&argc, &argv);
+
+  CHECK(!FLAGS_ct_server.empty()) << "--ct_server is required";
+  CHECK_GT(FLAGS_requests, 0);
+  CHECK_GT(FLAGS_concurrency, 0);
+  CHECK_GT(FLAGS_threads, 0);
+  CHECK_GT(FLAGS_get_entries_count, 0);
+
+  const shared_ptr<libevent::Base> event_base(make_shared<libevent::Base>());
+  const libevent::EventPumpThread pump(event_base);
+  ThreadPool pool("load_generator", FLAGS_threads, vector<int>());
+  UrlFetcher fetcher(event_base.get(), &pool);
+  AsyncLogClient client(&pool, &fetcher, FLAGS_ct_server);
+
+  LoadGenerator generator(&client, &pool);
+  generator.Prepare();
+  generator.Run();
+  generator.Report();
+
+  return 0;
+}
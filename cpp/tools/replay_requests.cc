@@ -0,0 +1,321 @@
+// Replays the requests recorded by a log server with
+// --http_request_log (see server/request_log.h) against another one,
+// with the same timing, to compare how a new build or configuration
+// copes with a real load. It then prints, for each path, the latency
+// of the requests in the log next to their latency when replayed.
+//
+// The requests are sent open loop: each is sent when it is due (at
+// the time it arrived at in the log, scaled by --speed), whatever the
+// latency of the server, and its latency counts from then. Requests
+// due while --concurrency are already in flight are skipped, and
+// counted. Submissions can only be replayed if the log was recorded
+// with --http_request_log_bodies, and the server only accepts them
+// again if their chains are not in its log yet.
+//
+// e.g. replay_requests --request_log=requests.log \
+//        --ct_server=http://localhost:8888 --speed=2
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "monitoring/histogram.h"
+#include "net/url.h"
+#include "net/url_fetcher.h"
+#include "server/request_log.h"
+#include "util/init.h"
+#include "util/libevent_wrapper.h"
+#include "util/task.h"
+#include "util/thread_pool.h"
+
+DEFINE_string(request_log, "",
+              "Request log to replay, recorded by ct-server with "
+              "--http_request_log.");
+DEFINE_string(ct_server, "", "URI of the log server, e.g. "
+                             "http://localhost:8888");
+DEFINE_double(speed, 1,
+              "How much faster than recorded to send the requests. 0 to "
+              "send them as fast as --concurrency allows.");
+DEFINE_int32(concurrency, 256, "Maximum number of requests in flight.");
+DEFINE_int32(threads, 4, "Number of threads handling the replies.");
+
+namespace libevent = cert_trans::libevent;
+
+using cert_trans::HistogramBuckets;
+using cert_trans::HistogramCell;
+using cert_trans::RequestLog;
+using cert_trans::ThreadPool;
+using cert_trans::URL;
+using cert_trans::UrlFetcher;
+using std::atomic;
+using std::chrono::duration;
+using std::chrono::microseconds;
+using std::chrono::steady_clock;
+using std::condition_variable;
+using std::lock_guard;
+using std::make_shared;
+using std::map;
+using std::mutex;
+using std::shared_ptr;
+using std::string;
+using std::unique_lock;
+using std::unique_ptr;
+using std::vector;
+
+namespace {
+
+
+struct PathStats {
+  // In microseconds.
+  HistogramCell recorded;
+  HistogramCell replayed;
+  atomic<int64_t> errors{0};
+  atomic<int64_t> status_mismatches{0};
+  atomic<int64_t> skipped{0};
+};
+
+
+// The path of |uri|, without its query.
+string PathOf(const string& uri) {
+  return uri.substr(0, uri.find('?'));
+}
+
+
+class Replayer {
+ public:
+  Replayer(UrlFetcher* fetcher, ThreadPool* pool, const string& server)
+      : fetcher_(CHECK_NOTNULL(fetcher)),
+        pool_(CHECK_NOTNULL(pool)),
+        server_(server),
+        in_flight_(0),
+        unreplayable_(0),
+        malformed_(0) {
+  }
+
+  // Sends the requests of |log| as they fall due, and waits for them.
+  void Run(std::istream* log);
+
+  void Report() const;
+
+ private:
+  // A request in flight.
+  struct Request {
+    PathStats* stats;
+    int recorded_status;
+    steady_clock::time_point start;
+    UrlFetcher::Request request;
+    UrlFetcher::Response response;
+  };
+
+  PathStats* StatsFor(const string& path);
+  void Send(const RequestLog::Record& record, PathStats* stats,
+            const steady_clock::time_point& start);
+  void Done(Request* request, util::Task* task);
+
+  UrlFetcher* const fetcher_;
+  ThreadPool* const pool_;
+  const string server_;
+
+  // Only touched by Run() and Report().
+  map<string, unique_ptr<PathStats>> stats_;
+  steady_clock::duration elapsed_;
+
+  mutex lock_;
+  condition_variable done_cv_;
+  int64_t in_flight_;
+
+  int64_t unreplayable_;
+  int64_t malformed_;
+};
+
+
+void Replayer::Run(std::istream* log) {
+  const steady_clock::time_point start(steady_clock::now());
+  int64_t first_arrival_us(-1);
+  string line;
+  while (std::getline(*log, line)) {
+    RequestLog::Record record;
+    if (!RequestLog::ParseRecord(line, &record)) {
+      ++malformed_;
+      continue;
+    }
+    if (record.method != "GET" && record.method != "POST") {
+      ++unreplayable_;
+      continue;
+    }
+    if (record.method == "POST" && record.body.empty()) {
+      // The log was recorded without the bodies.
+      ++unreplayable_;
+      continue;
+    }
+    PathStats* const stats(StatsFor(PathOf(record.uri)));
+
+    steady_clock::time_point due(steady_clock::now());
+    if (first_arrival_us < 0) {
+      first_arrival_us = record.arrival_us;
+    }
+    if (FLAGS_speed > 0) {
+      due = start + std::chrono::duration_cast<steady_clock::duration>(
+                        microseconds(record.arrival_us - first_arrival_us) /
+                        FLAGS_speed);
+      std::this_thread::sleep_until(due);
+    } else {
+      // As fast as possible, but no more than --concurrency at a time.
+      unique_lock<mutex> lock(lock_);
+      done_cv_.wait(lock,
+                    [this]() { return in_flight_ < FLAGS_concurrency; });
+    }
+
+    {
+      lock_guard<mutex> lock(lock_);
+      if (in_flight_ >= FLAGS_concurrency) {
+        stats->skipped++;
+        continue;
+      }
+      ++in_flight_;
+    }
+    Send(record, stats, due);
+  }
+
+  unique_lock<mutex> lock(lock_);
+  done_cv_.wait(lock, [this]() { return in_flight_ == 0; });
+  elapsed_ = steady_clock::now() - start;
+}
+
+
+PathStats* Replayer::StatsFor(const string& path) {
+  unique_ptr<PathStats>& stats(stats_[path]);
+  if (!stats) {
+    stats.reset(new PathStats);
+  }
+  return stats.get();
+}
+
+
+void Replayer::Send(const RequestLog::Record& record, PathStats* stats,
+                    const steady_clock::time_point& start) {
+  Request* const request(new Request);
+  request->stats = stats;
+  request->recorded_status = record.status;
+  request->start = start;
+  request->request.url = URL(server_ + record.uri);
+  if (record.method == "POST") {
+    request->request.verb = UrlFetcher::Verb::POST;
+    request->request.body = record.body;
+  }
+  // Only the requests which were answered have a latency to compare
+  // with.
+  if (record.status != 0) {
+    stats->recorded.Record(record.latency_us);
+  }
+  fetcher_->Fetch(request->request, &request->response,
+                  new util::Task(std::bind(&Replayer::Done, this, request,
+                                           std::placeholders::_1),
+                                 pool_));
+}
+
+
+void Replayer::Done(Request* request, util::Task* task) {
+  const unique_ptr<Request> request_deleter(request);
+  const unique_ptr<util::Task> task_deleter(task);
+  PathStats* const stats(request->stats);
+  if (task->status().ok()) {
+    stats->replayed.Record(
+        duration<double, std::micro>(steady_clock::now() - request->start)
+            .count());
+    if (request->response.status_code != request->recorded_status) {
+      stats->status_mismatches++;
+    }
+  } else {
+    stats->errors++;
+  }
+
+  lock_guard<mutex> lock(lock_);
+  --in_flight_;
+  done_cv_.notify_all();
+}
+
+
+// Returns the upper bound of the bucket of the value at |percentile|
+// of |latencies|, in milliseconds, and the number of values in
+// |count|.
+double Percentile(const HistogramCell& latencies, double percentile,
+                  uint64_t* count) {
+  double sum(0);
+  vector<uint64_t> buckets;
+  latencies.Snapshot(&sum, &buckets);
+  *count = std::accumulate(buckets.begin(), buckets.end(), uint64_t(0));
+  uint64_t seen(0);
+  for (size_t i = 0; i < buckets.size(); ++i) {
+    seen += buckets[i];
+    if (seen > 0 && seen >= percentile * *count) {
+      return HistogramBuckets::UpperBound(i) / 1000;
+    }
+  }
+  return 0;
+}
+
+
+void Replayer::Report() const {
+  std::cout << "elapsed_seconds: " << duration<double>(elapsed_).count()
+            << " malformed=" << malformed_
+            << " unreplayable=" << unreplayable_ << std::endl;
+  for (const auto& path : stats_) {
+    const PathStats& stats(*path.second);
+    uint64_t recorded_count, replayed_count;
+    Percentile(stats.recorded, 0, &recorded_count);
+    Percentile(stats.replayed, 0, &replayed_count);
+    std::cout << path.first << ": recorded=" << recorded_count
+              << " replayed=" << replayed_count
+              << " errors=" << stats.errors << " skipped=" << stats.skipped
+              << " status_mismatches=" << stats.status_mismatches;
+    for (const double percentile : {0.5, 0.99}) {
+      uint64_t count;
+      const double recorded(Percentile(stats.recorded, percentile, &count));
+      const double replayed(Percentile(stats.replayed, percentile, &count));
+      std::cout << " p" << percentile * 100 << "_ms<=" << recorded << "->"
+                << replayed << " (" << (replayed >= recorded ? "+" : "")
+                << replayed - recorded << ")";
+    }
+    std::cout << std::endl;
+  }
+}
+
+
+}  // namespace
+
+
+int main(int argc, char* argv[]) {
+  util::InitCT(&argc, &argv);
+
+  CHECK(!FLAGS_request_log.empty()) << "--request_log is required";
+  CHECK(!FLAGS_ct_server.empty()) << "--ct_server is required";
+  CHECK_GE(FLAGS_speed, 0);
+  CHECK_GT(FLAGS_concurrency, 0);
+  CHECK_GT(FLAGS_threads, 0);
+
+  std::ifstream log(FLAGS_request_log);
+  PCHECK(log.is_open()) << "Cannot open " << FLAGS_request_log;
+
+  const shared_ptr<libevent::Base> event_base(make_shared<libevent::Base>());
+  const libevent::EventPumpThread pump(event_base);
+  ThreadPool pool("replay_requests", FLAGS_threads, vector<int>());
+  UrlFetcher fetcher(event_base.get(), &pool);
+
+  Replayer replayer(&fetcher, &pool, FLAGS_ct_server);
+  replayer.Run(&log);
+  replayer.Report();
+
+  return 0;
+}
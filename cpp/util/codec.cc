@@ -0,0 +1,551 @@
+#include "util/codec.h"
+
+#include <stdint.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_CODEC_SSSE3 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__GNUC__)
+#define HAVE_CODEC_NEON 1
+#include <arm_neon.h>
+#endif
+
+namespace util {
+namespace {
+
+
+const char kBase64Alphabet[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+const char kHexDigits[] = "0123456789abcdef";
+
+
+// The values of the base 64 characters and hex digits, -1 for any
+// other byte.
+struct DecodeTables {
+  DecodeTables() {
+    for (int i = 0; i < 256; ++i) {
+      base64[i] = -1;
+      hex[i] = -1;
+    }
+    for (int i = 0; i < 64; ++i) {
+      base64[static_cast<unsigned char>(kBase64Alphabet[i])] = i;
+    }
+    for (int i = 0; i < 16; ++i) {
+      hex[static_cast<unsigned char>(kHexDigits[i])] = i;
+      hex[static_cast<unsigned char>(kHexDigits[i] & ~0x20)] = i;
+    }
+  }
+
+  int8_t base64[256];
+  int8_t hex[256];
+};
+
+
+const DecodeTables& Tables() {
+  static const DecodeTables tables;
+  return tables;
+}
+
+
+// The vector versions of the codecs. Each one processes as much of
+// its input as it handles in whole steps, and returns how much that
+// was (in bytes of input, except for the hex decoder which counts
+// bytes of output), leaving the rest to the scalar versions. The
+// decoders also stop at the first step with anything but plain
+// alphabet characters, so that the scalar versions deal with padding
+// and errors.
+struct Backend {
+  const char* name;
+  size_t (*base64_encode)(const unsigned char* in, size_t size, char* out);
+  size_t (*base64_decode)(const unsigned char* in, size_t size,
+                          unsigned char* out);
+  size_t (*hex_encode)(const unsigned char* in, size_t size, char* out);
+  size_t (*hex_decode)(const unsigned char* in, size_t size,
+                       unsigned char* out);
+};
+
+
+#ifdef HAVE_CODEC_SSSE3
+
+#define SSSE3_TARGET __attribute__((target("ssse3")))
+
+bool CpuHasSsse3() {
+  unsigned int eax, ebx, ecx, edx;
+  return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSSE3) != 0;
+}
+
+
+// 0xff for the bytes of |v| in [lo, hi], 0 for the others (including
+// those with the top bit set, which compare as negative).
+SSSE3_TARGET inline __m128i Ssse3InRange(__m128i v, char lo, char hi) {
+  return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1)),
+                       _mm_cmpgt_epi8(_mm_set1_epi8(hi + 1), v));
+}
+
+
+// 12 bytes to 16 characters at a time, as described in "Faster Base64
+// Encoding and Decoding Using AVX2 Instructions" (Muła and Lemire).
+SSSE3_TARGET size_t Ssse3Base64Encode(const unsigned char* in, size_t size,
+                                      char* out) {
+  size_t i(0);
+  // Each step loads 16 bytes, but only encodes 12 of them.
+  for (; i + 16 <= size; i += 12, out += 16) {
+    __m128i v(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i)));
+    // Each 32 bit lane gets the 3 bytes of a group as [b1 b0 b2 b1],
+    // so that the 4 indices are picked out with two multiplications.
+    v = _mm_shuffle_epi8(v, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3,
+                                         4, 1, 2, 0, 1));
+    const __m128i high(
+        _mm_mulhi_epu16(_mm_and_si128(v, _mm_set1_epi32(0x0fc0fc00)),
+                        _mm_set1_epi32(0x04000040)));
+    const __m128i low(
+        _mm_mullo_epi16(_mm_and_si128(v, _mm_set1_epi32(0x003f03f0)),
+                        _mm_set1_epi32(0x01000010)));
+    const __m128i indices(_mm_or_si128(high, low));
+
+    // Map the indices to the offset to add for their range: 13 for
+    // A-Z, 0 for a-z, 1 to 10 for 0-9, 11 for + and 12 for /.
+    __m128i range(_mm_subs_epu8(indices, _mm_set1_epi8(51)));
+    range = _mm_or_si128(
+        range, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), indices),
+                             _mm_set1_epi8(13)));
+    const __m128i offsets(_mm_setr_epi8(
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0,
+        0));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out),
+                     _mm_add_epi8(indices,
+                                  _mm_shuffle_epi8(offsets, range)));
+  }
+  return i;
+}
+
+
+// 16 characters to 12 bytes at a time.
+SSSE3_TARGET size_t Ssse3Base64Decode(const unsigned char* in, size_t size,
+                                      unsigned char* out) {
+  size_t i(0);
+  // Each step stores 16 bytes, but only decodes 12 of them, hence the
+  // margin.
+  for (; i + 24 <= size; i += 16, out += 12) {
+    const __m128i v(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i)));
+    const __m128i upper(Ssse3InRange(v, 'A', 'Z'));
+    const __m128i lower(Ssse3InRange(v, 'a', 'z'));
+    const __m128i digit(Ssse3InRange(v, '0', '9'));
+    const __m128i plus(_mm_cmpeq_epi8(v, _mm_set1_epi8('+')));
+    const __m128i slash(_mm_cmpeq_epi8(v, _mm_set1_epi8('/')));
+    const __m128i valid(_mm_or_si128(
+        _mm_or_si128(_mm_or_si128(upper, lower), _mm_or_si128(digit, plus)),
+        slash));
+    if (_mm_movemask_epi8(valid) != 0xffff) {
+      break;
+    }
+
+    __m128i shift(_mm_and_si128(upper, _mm_set1_epi8(-'A')));
+    shift = _mm_or_si128(shift,
+                         _mm_and_si128(lower, _mm_set1_epi8(26 - 'a')));
+    shift = _mm_or_si128(shift,
+                         _mm_and_si128(digit, _mm_set1_epi8(52 - '0')));
+    shift = _mm_or_si128(shift, _mm_and_si128(plus, _mm_set1_epi8(62 - '+')));
+    shift =
+        _mm_or_si128(shift, _mm_and_si128(slash, _mm_set1_epi8(63 - '/')));
+    const __m128i values(_mm_add_epi8(v, shift));
+
+    // Merge the 4 values of each 32 bit lane into 24 bits, then put
+    // the 3 bytes of each lane next to each other, in big endian order.
+    const __m128i pairs(
+        _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140)));
+    const __m128i groups(_mm_madd_epi16(pairs, _mm_set1_epi32(0x00011000)));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out),
+                     _mm_shuffle_epi8(groups,
+                                      _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9,
+                                                    8, 14, 13, 12, -1, -1, -1,
+                                                    -1)));
+  }
+  return i;
+}
+
+
+SSSE3_TARGET size_t Ssse3HexEncode(const unsigned char* in, size_t size,
+                                   char* out) {
+  const __m128i digits(
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(kHexDigits)));
+  const __m128i nibble_mask(_mm_set1_epi8(0x0f));
+  size_t i(0);
+  for (; i + 16 <= size; i += 16, out += 32) {
+    const __m128i v(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i)));
+    const __m128i high(_mm_shuffle_epi8(
+        digits, _mm_and_si128(_mm_srli_epi16(v, 4), nibble_mask)));
+    const __m128i low(
+        _mm_shuffle_epi8(digits, _mm_and_si128(v, nibble_mask)));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out),
+                     _mm_unpacklo_epi8(high, low));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 16),
+                     _mm_unpackhi_epi8(high, low));
+  }
+  return i;
+}
+
+
+// The values of the hex digits of |v|, clearing the bytes of |valid|
+// for those which are not.
+SSSE3_TARGET inline __m128i Ssse3HexValues(__m128i v, __m128i* valid) {
+  const __m128i digit(Ssse3InRange(v, '0', '9'));
+  const __m128i lowered(_mm_or_si128(v, _mm_set1_epi8(0x20)));
+  const __m128i letter(Ssse3InRange(lowered, 'a', 'f'));
+  *valid = _mm_and_si128(*valid, _mm_or_si128(digit, letter));
+  return _mm_or_si128(
+      _mm_and_si128(digit, _mm_sub_epi8(v, _mm_set1_epi8('0'))),
+      _mm_and_si128(letter, _mm_sub_epi8(lowered, _mm_set1_epi8('a' - 10))));
+}
+
+
+// 32 digits to 16 bytes at a time.
+SSSE3_TARGET size_t Ssse3HexDecode(const unsigned char* in, size_t size,
+                                   unsigned char* out) {
+  size_t i(0);
+  for (; i + 16 <= size; i += 16) {
+    __m128i valid(_mm_set1_epi8(-1));
+    const __m128i first(Ssse3HexValues(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 2 * i)),
+        &valid));
+    const __m128i second(Ssse3HexValues(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 2 * i + 16)),
+        &valid));
+    if (_mm_movemask_epi8(valid) != 0xffff) {
+      break;
+    }
+    // high * 16 + low for each pair of digits.
+    const __m128i multipliers(_mm_set1_epi16(0x0110));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i),
+                     _mm_packus_epi16(_mm_maddubs_epi16(first, multipliers),
+                                      _mm_maddubs_epi16(second,
+                                                        multipliers)));
+  }
+  return i;
+}
+
+#undef SSSE3_TARGET
+
+#endif  // HAVE_CODEC_SSSE3
+
+
+#ifdef HAVE_CODEC_NEON
+
+// 48 bytes to 64 characters at a time, the structured loads and stores
+// doing the (de)interleaving.
+size_t NeonBase64Encode(const unsigned char* in, size_t size, char* out) {
+  const unsigned char* const alphabet(
+      reinterpret_cast<const unsigned char*>(kBase64Alphabet));
+  uint8x16x4_t table;
+  for (int k = 0; k < 4; ++k) {
+    table.val[k] = vld1q_u8(alphabet + 16 * k);
+  }
+  const uint8x16_t mask(vdupq_n_u8(0x3f));
+  size_t i(0);
+  for (; i + 48 <= size; i += 48, out += 64) {
+    const uint8x16x3_t v(vld3q_u8(in + i));
+    uint8x16x4_t indices;
+    indices.val[0] = vshrq_n_u8(v.val[0], 2);
+    indices.val[1] = vandq_u8(
+        vorrq_u8(vshlq_n_u8(v.val[0], 4), vshrq_n_u8(v.val[1], 4)), mask);
+    indices.val[2] = vandq_u8(
+        vorrq_u8(vshlq_n_u8(v.val[1], 2), vshrq_n_u8(v.val[2], 6)), mask);
+    indices.val[3] = vandq_u8(v.val[2], mask);
+    uint8x16x4_t chars;
+    for (int k = 0; k < 4; ++k) {
+      chars.val[k] = vqtbl4q_u8(table, indices.val[k]);
+    }
+    vst4q_u8(reinterpret_cast<unsigned char*>(out), chars);
+  }
+  return i;
+}
+
+
+inline uint8x16_t NeonInRange(uint8x16_t v, unsigned char lo,
+                              unsigned char hi) {
+  return vandq_u8(vcgeq_u8(v, vdupq_n_u8(lo)), vcleq_u8(v, vdupq_n_u8(hi)));
+}
+
+
+// The values of the base 64 characters of |v|, clearing the bytes of
+// |valid| for those which are not.
+inline uint8x16_t NeonBase64Values(uint8x16_t v, uint8x16_t* valid) {
+  const uint8x16_t upper(NeonInRange(v, 'A', 'Z'));
+  const uint8x16_t lower(NeonInRange(v, 'a', 'z'));
+  const uint8x16_t digit(NeonInRange(v, '0', '9'));
+  const uint8x16_t plus(vceqq_u8(v, vdupq_n_u8('+')));
+  const uint8x16_t slash(vceqq_u8(v, vdupq_n_u8('/')));
+  *valid = vandq_u8(*valid, vorrq_u8(vorrq_u8(vorrq_u8(upper, lower),
+                                              vorrq_u8(digit, plus)),
+                                     slash));
+  uint8x16_t shift(vandq_u8(upper, vdupq_n_u8(-'A')));
+  shift = vorrq_u8(shift, vandq_u8(lower, vdupq_n_u8(26 - 'a')));
+  shift = vorrq_u8(shift, vandq_u8(digit, vdupq_n_u8(52 - '0')));
+  shift = vorrq_u8(shift, vandq_u8(plus, vdupq_n_u8(62 - '+')));
+  shift = vorrq_u8(shift, vandq_u8(slash, vdupq_n_u8(63 - '/')));
+  return vaddq_u8(v, shift);
+}
+
+
+// 64 characters to 48 bytes at a time.
+size_t NeonBase64Decode(const unsigned char* in, size_t size,
+                        unsigned char* out) {
+  size_t i(0);
+  for (; i + 64 <= size; i += 64, out += 48) {
+    const uint8x16x4_t v(vld4q_u8(in + i));
+    uint8x16_t valid(vdupq_n_u8(0xff));
+    uint8x16_t values[4];
+    for (int k = 0; k < 4; ++k) {
+      values[k] = NeonBase64Values(v.val[k], &valid);
+    }
+    if (vminvq_u8(valid) == 0) {
+      break;
+    }
+    uint8x16x3_t bytes;
+    bytes.val[0] =
+        vorrq_u8(vshlq_n_u8(values[0], 2), vshrq_n_u8(values[1], 4));
+    bytes.val[1] =
+        vorrq_u8(vshlq_n_u8(values[1], 4), vshrq_n_u8(values[2], 2));
+    bytes.val[2] = vorrq_u8(vshlq_n_u8(values[2], 6), values[3]);
+    vst3q_u8(out, bytes);
+  }
+  return i;
+}
+
+
+size_t NeonHexEncode(const unsigned char* in, size_t size, char* out) {
+  const uint8x16_t digits(
+      vld1q_u8(reinterpret_cast<const unsigned char*>(kHexDigits)));
+  size_t i(0);
+  for (; i + 16 <= size; i += 16, out += 32) {
+    const uint8x16_t v(vld1q_u8(in + i));
+    uint8x16x2_t chars;
+    chars.val[0] = vqtbl1q_u8(digits, vshrq_n_u8(v, 4));
+    chars.val[1] = vqtbl1q_u8(digits, vandq_u8(v, vdupq_n_u8(0x0f)));
+    vst2q_u8(reinterpret_cast<unsigned char*>(out), chars);
+  }
+  return i;
+}
+
+
+// The values of the hex digits of |v|, clearing the bytes of |valid|
+// for those which are not.
+inline uint8x16_t NeonHexValues(uint8x16_t v, uint8x16_t* valid) {
+  const uint8x16_t digit(NeonInRange(v, '0', '9'));
+  const uint8x16_t lowered(vorrq_u8(v, vdupq_n_u8(0x20)));
+  const uint8x16_t letter(NeonInRange(lowered, 'a', 'f'));
+  *valid = vandq_u8(*valid, vorrq_u8(digit, letter));
+  return vorrq_u8(vandq_u8(digit, vsubq_u8(v, vdupq_n_u8('0'))),
+                  vandq_u8(letter,
+                           vsubq_u8(lowered, vdupq_n_u8('a' - 10))));
+}
+
+
+// 32 digits to 16 bytes at a time.
+size_t NeonHexDecode(const unsigned char* in, size_t size,
+                     unsigned char* out) {
+  size_t i(0);
+  for (; i + 16 <= size; i += 16) {
+    const uint8x16x2_t v(vld2q_u8(in + 2 * i));
+    uint8x16_t valid(vdupq_n_u8(0xff));
+    const uint8x16_t high(NeonHexValues(v.val[0], &valid));
+    const uint8x16_t low(NeonHexValues(v.val[1], &valid));
+    if (vminvq_u8(valid) == 0) {
+      break;
+    }
+    vst1q_u8(out + i, vorrq_u8(vshlq_n_u8(high, 4), low));
+  }
+  return i;
+}
+
+#endif  // HAVE_CODEC_NEON
+
+
+Backend DetectBackend() {
+#ifdef HAVE_CODEC_SSSE3
+  if (CpuHasSsse3()) {
+    return Backend{"ssse3", Ssse3Base64Encode, Ssse3Base64Decode,
+                   Ssse3HexEncode, Ssse3HexDecode};
+  }
+#endif
+#ifdef HAVE_CODEC_NEON
+  // Advanced SIMD is part of the base AArch64 architecture.
+  return Backend{"neon", NeonBase64Encode, NeonBase64Decode, NeonHexEncode,
+                 NeonHexDecode};
+#endif
+  return Backend{"none", nullptr, nullptr, nullptr, nullptr};
+}
+
+
+const Backend& ActiveBackend() {
+  static const Backend backend(DetectBackend());
+  return backend;
+}
+
+
+}  // namespace
+
+
+size_t Base64Encode(const char* data, size_t size, char* out) {
+  const Backend& backend(ActiveBackend());
+  const size_t done(
+      backend.base64_encode
+          ? backend.base64_encode(
+                reinterpret_cast<const unsigned char*>(data), size, out)
+          : 0);
+  const size_t written(done / 3 * 4);
+  return written + internal::ScalarBase64Encode(data + done, size - done,
+                                                out + written);
+}
+
+
+bool Base64Decode(const char* data, size_t size, char* out,
+                  size_t* out_size) {
+  if (size % 4 != 0) {
+    return false;
+  }
+  const Backend& backend(ActiveBackend());
+  const size_t done(
+      backend.base64_decode
+          ? backend.base64_decode(
+                reinterpret_cast<const unsigned char*>(data), size,
+                reinterpret_cast<unsigned char*>(out))
+          : 0);
+  const size_t written(done / 4 * 3);
+  size_t rest;
+  if (!internal::ScalarBase64Decode(data + done, size - done, out + written,
+                                    &rest)) {
+    return false;
+  }
+  *out_size = written + rest;
+  return true;
+}
+
+
+void HexEncode(const char* data, size_t size, char* out) {
+  const Backend& backend(ActiveBackend());
+  const size_t done(
+      backend.hex_encode
+          ? backend.hex_encode(reinterpret_cast<const unsigned char*>(data),
+                               size, out)
+          : 0);
+  internal::ScalarHexEncode(data + done, size - done, out + 2 * done);
+}
+
+
+bool HexDecode(const char* data, size_t size, char* out) {
+  const Backend& backend(ActiveBackend());
+  const size_t done(
+      backend.hex_decode
+          ? backend.hex_decode(reinterpret_cast<const unsigned char*>(data),
+                               size, reinterpret_cast<unsigned char*>(out))
+          : 0);
+  return internal::ScalarHexDecode(data + 2 * done, size - done, out + done);
+}
+
+
+const char* CodecBackendName() {
+  return ActiveBackend().name;
+}
+
+
+namespace internal {
+
+
+size_t ScalarBase64Encode(const char* data, size_t size, char* out) {
+  const unsigned char* const in(reinterpret_cast<const unsigned char*>(data));
+  char* const start(out);
+  size_t i(0);
+  for (; i + 3 <= size; i += 3) {
+    const uint32_t group(in[i] << 16 | in[i + 1] << 8 | in[i + 2]);
+    *out++ = kBase64Alphabet[group >> 18];
+    *out++ = kBase64Alphabet[(group >> 12) & 0x3f];
+    *out++ = kBase64Alphabet[(group >> 6) & 0x3f];
+    *out++ = kBase64Alphabet[group & 0x3f];
+  }
+  if (i < size) {
+    const uint32_t group(in[i] << 16 | (i + 1 < size ? in[i + 1] << 8 : 0));
+    *out++ = kBase64Alphabet[group >> 18];
+    *out++ = kBase64Alphabet[(group >> 12) & 0x3f];
+    *out++ = i + 1 < size ? kBase64Alphabet[(group >> 6) & 0x3f] : '=';
+    *out++ = '=';
+  }
+  return out - start;
+}
+
+
+bool ScalarBase64Decode(const char* data, size_t size, char* out,
+                        size_t* out_size) {
+  if (size % 4 != 0) {
+    return false;
+  }
+  const unsigned char* const in(reinterpret_cast<const unsigned char*>(data));
+  const int8_t* const values(Tables().base64);
+  char* const start(out);
+  for (size_t i = 0; i < size; i += 4) {
+    const int a(values[in[i]]);
+    const int b(values[in[i + 1]]);
+    const int c(values[in[i + 2]]);
+    const int d(values[in[i + 3]]);
+    if ((a | b | c | d) >= 0) {
+      *out++ = static_cast<char>(a << 2 | b >> 4);
+      *out++ = static_cast<char>(b << 4 | c >> 2);
+      *out++ = static_cast<char>(c << 6 | d);
+      continue;
+    }
+
+    // Only the last group may be padded, and the bits which do not
+    // make up a whole byte must be zero.
+    if (i + 4 != size || a < 0 || b < 0 || in[i + 3] != '=') {
+      return false;
+    }
+    if (in[i + 2] == '=') {
+      if ((b & 0x0f) != 0) {
+        return false;
+      }
+      *out++ = static_cast<char>(a << 2 | b >> 4);
+    } else {
+      if (c < 0 || (c & 0x03) != 0) {
+        return false;
+      }
+      *out++ = static_cast<char>(a << 2 | b >> 4);
+      *out++ = static_cast<char>(b << 4 | c >> 2);
+    }
+  }
+  *out_size = out - start;
+  return true;
+}
+
+
+void ScalarHexEncode(const char* data, size_t size, char* out) {
+  for (size_t i = 0; i < size; ++i) {
+    const unsigned char byte(data[i]);
+    *out++ = kHexDigits[byte >> 4];
+    *out++ = kHexDigits[byte & 0x0f];
+  }
+}
+
+
+bool ScalarHexDecode(const char* data, size_t size, char* out) {
+  const unsigned char* const in(reinterpret_cast<const unsigned char*>(data));
+  const int8_t* const values(Tables().hex);
+  for (size_t i = 0; i < size; ++i) {
+    const int high(values[in[2 * i]]);
+    const int low(values[in[2 * i + 1]]);
+    if ((high | low) < 0) {
+      return false;
+    }
+    out[i] = static_cast<char>(high << 4 | low);
+  }
+  return true;
+}
+
+
+}  // namespace internal
+}  // namespace util
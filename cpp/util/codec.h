@@ -0,0 +1,66 @@
+#ifndef CERT_TRANS_UTIL_CODEC_H_
+#define CERT_TRANS_UTIL_CODEC_H_
+
+#include <stddef.h>
+
+namespace util {
+
+// Base 64 (the standard alphabet of RFC 4648, with padding) and hex
+// encoders and decoders, which write into buffers provided by the
+// caller. They process 12 to 48 bytes at a time with the SSSE3 or NEON
+// instructions when the CPU has them, and go through lookup tables
+// otherwise; both give the same results.
+
+// The size of the base 64 encoding of |size| bytes.
+inline size_t Base64EncodedSize(size_t size) {
+  return (size + 2) / 3 * 4;
+}
+
+// Writes the base 64 encoding of the |size| bytes at |data| to |out|,
+// which must have room for Base64EncodedSize(|size|) bytes, and
+// returns that size.
+size_t Base64Encode(const char* data, size_t size, char* out);
+
+// An upper bound of the size of the data decoded from |size| bytes of
+// base 64.
+inline size_t Base64MaxDecodedSize(size_t size) {
+  return size / 4 * 3;
+}
+
+// Decodes the |size| bytes of base 64 at |data| into |out|, which must
+// have room for Base64MaxDecodedSize(|size|) bytes, and sets
+// |out_size| to the number of bytes written. Returns false if |data|
+// is not strictly base 64: anything outside of the alphabet (including
+// whitespace), missing padding, or non-zero bits at the end are
+// errors.
+bool Base64Decode(const char* data, size_t size, char* out,
+                  size_t* out_size);
+
+// Writes the 2 * |size| lowercase hex digits of the |size| bytes at
+// |data| to |out|.
+void HexEncode(const char* data, size_t size, char* out);
+
+// Decodes the 2 * |size| hex digits (in either case) at |data| into
+// the |size| bytes at |out|. Returns false if any of them is not a hex
+// digit.
+bool HexDecode(const char* data, size_t size, char* out);
+
+// The instructions used, "none" if only the lookup tables are: for
+// logs and benchmarks.
+const char* CodecBackendName();
+
+
+// The lookup table versions of the above, whatever the CPU has. For
+// tests and benchmarks.
+namespace internal {
+
+size_t ScalarBase64Encode(const char* data, size_t size, char* out);
+bool ScalarBase64Decode(const char* data, size_t size, char* out,
+                        size_t* out_size);
+void ScalarHexEncode(const char* data, size_t size, char* out);
+bool ScalarHexDecode(const char* data, size_t size, char* out);
+
+}  // namespace internal
+}  // namespace util
+
+#endif  // CERT_TRANS_UTIL_CODEC_H_
@@ -0,0 +1,171 @@
+// Benchmarks for the base 64 and hex codecs, comparing the vector
+// versions (if the CPU has them) to the lookup table ones. Run with
+// --help for the options of the benchmark library, e.g.
+// --benchmark_filter=<regex>.
+#include <benchmark/benchmark.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+#include "util/codec.h"
+#include "util/util.h"
+
+using std::string;
+using std::vector;
+
+namespace {
+
+
+string Data(size_t size) {
+  string data(size, 0);
+  for (size_t i = 0; i < size; ++i) {
+    data[i] = static_cast<char>(i * 131 + 7);
+  }
+  return data;
+}
+
+
+string Base64(size_t size) {
+  const string data(Data(size));
+  string encoded(util::Base64EncodedSize(size), 0);
+  util::Base64Encode(data.data(), data.size(), &encoded[0]);
+  return encoded;
+}
+
+
+string Hex(size_t size) {
+  const string data(Data(size));
+  string encoded(2 * size, 0);
+  util::HexEncode(data.data(), data.size(), &encoded[0]);
+  return encoded;
+}
+
+
+void BM_Base64Encode(benchmark::State& state) {
+  const string data(Data(state.range(0)));
+  vector<char> out(util::Base64EncodedSize(data.size()));
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(
+        util::Base64Encode(data.data(), data.size(), out.data()));
+  }
+  state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_Base64Encode)->Range(16, 64 << 10);
+
+
+void BM_ScalarBase64Encode(benchmark::State& state) {
+  const string data(Data(state.range(0)));
+  vector<char> out(util::Base64EncodedSize(data.size()));
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(util::internal::ScalarBase64Encode(
+        data.data(), data.size(), out.data()));
+  }
+  state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_ScalarBase64Encode)->Range(16, 64 << 10);
+
+
+// Through the std::string helper get-entries uses.
+void BM_AppendBase64(benchmark::State& state) {
+  const string data(Data(state.range(0)));
+  string out;
+  for (auto _ : state) {
+    out.clear();
+    util::AppendBase64(data, &out);
+    benchmark::DoNotOptimize(out.data());
+  }
+  state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_AppendBase64)->Range(16, 64 << 10);
+
+
+void BM_Base64Decode(benchmark::State& state) {
+  const string encoded(Base64(state.range(0)));
+  vector<char> out(util::Base64MaxDecodedSize(encoded.size()));
+  size_t size;
+  for (auto _ : state) {
+    CHECK(util::Base64Decode(encoded.data(), encoded.size(), out.data(),
+                             &size));
+    benchmark::DoNotOptimize(out.data());
+  }
+  state.SetBytesProcessed(state.iterations() * encoded.size());
+}
+BENCHMARK(BM_Base64Decode)->Range(16, 64 << 10);
+
+
+void BM_ScalarBase64Decode(benchmark::State& state) {
+  const string encoded(Base64(state.range(0)));
+  vector<char> out(util::Base64MaxDecodedSize(encoded.size()));
+  size_t size;
+  for (auto _ : state) {
+    CHECK(util::internal::ScalarBase64Decode(encoded.data(), encoded.size(),
+                                             out.data(), &size));
+    benchmark::DoNotOptimize(out.data());
+  }
+  state.SetBytesProcessed(state.iterations() * encoded.size());
+}
+BENCHMARK(BM_ScalarBase64Decode)->Range(16, 64 << 10);
+
+
+void BM_HexEncode(benchmark::State& state) {
+  const string data(Data(state.range(0)));
+  vector<char> out(2 * data.size());
+  for (auto _ : state) {
+    util::HexEncode(data.data(), data.size(), out.data());
+    benchmark::DoNotOptimize(out.data());
+  }
+  state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_HexEncode)->Range(16, 64 << 10);
+
+
+void BM_ScalarHexEncode(benchmark::State& state) {
+  const string data(Data(state.range(0)));
+  vector<char> out(2 * data.size());
+  for (auto _ : state) {
+    util::internal::ScalarHexEncode(data.data(), data.size(), out.data());
+    benchmark::DoNotOptimize(out.data());
+  }
+  state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_ScalarHexEncode)->Range(16, 64 << 10);
+
+
+void BM_HexDecode(benchmark::State& state) {
+  const string encoded(Hex(state.range(0)));
+  vector<char> out(encoded.size() / 2);
+  for (auto _ : state) {
+    CHECK(util::HexDecode(encoded.data(), out.size(), out.data()));
+    benchmark::DoNotOptimize(out.data());
+  }
+  state.SetBytesProcessed(state.iterations() * encoded.size());
+}
+BENCHMARK(BM_HexDecode)->Range(16, 64 << 10);
+
+
+void BM_ScalarHexDecode(benchmark::State& state) {
+  const string encoded(Hex(state.range(0)));
+  vector<char> out(encoded.size() / 2);
+  for (auto _ : state) {
+    CHECK(util::internal::ScalarHexDecode(encoded.data(), out.size(),
+                                          out.data()));
+    benchmark::DoNotOptimize(out.data());
+  }
+  state.SetBytesProcessed(state.iterations() * encoded.size());
+}
+BENCHMARK(BM_ScalarHexDecode)->Range(16, 64 << 10);
+
+
+}  // namespace
+
+
+int main(int argc, char** argv) {
+  benchmark::Initialize(&argc, argv);
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  LOG(INFO) << "Codec backend: " << util::CodecBackendName();
+  benchmark::RunSpecifiedBenchmarks();
+  return 0;
+}
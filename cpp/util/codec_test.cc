@@ -0,0 +1,173 @@
+#include "util/codec.h"
+
+#include <gtest/gtest.h>
+#include <stddef.h>
+#include <string>
+
+#include "util/testing.h"
+
+namespace util {
+namespace {
+
+using std::string;
+
+
+// The lengths tested cover the tails left to the lookup tables after
+// any number of vector steps.
+const size_t kMaxLength = 300;
+
+
+string Data(size_t size, unsigned seed) {
+  string data(size, 0);
+  for (size_t i = 0; i < size; ++i) {
+    seed = seed * 1103515245 + 12345;
+    data[i] = static_cast<char>(seed >> 16);
+  }
+  return data;
+}
+
+
+string Encode(const string& data) {
+  string encoded(Base64EncodedSize(data.size()), 0);
+  encoded.resize(Base64Encode(data.data(), data.size(), &encoded[0]));
+  return encoded;
+}
+
+
+bool Decode(const string& encoded, string* data) {
+  data->assign(Base64MaxDecodedSize(encoded.size()), 0);
+  size_t size;
+  if (!Base64Decode(encoded.data(), encoded.size(), &(*data)[0], &size)) {
+    return false;
+  }
+  data->resize(size);
+  return true;
+}
+
+
+bool ScalarDecode(const string& encoded, string* data) {
+  data->assign(Base64MaxDecodedSize(encoded.size()), 0);
+  size_t size;
+  if (!internal::ScalarBase64Decode(encoded.data(), encoded.size(),
+                                    &(*data)[0], &size)) {
+    return false;
+  }
+  data->resize(size);
+  return true;
+}
+
+
+string HexEncoded(const string& data) {
+  string encoded(2 * data.size(), 0);
+  HexEncode(data.data(), data.size(), &encoded[0]);
+  return encoded;
+}
+
+
+TEST(CodecTest, Base64Vectors) {
+  // From RFC 4648.
+  const char* const kVectors[][2] = {{"", ""},
+                                     {"f", "Zg=="},
+                                     {"fo", "Zm8="},
+                                     {"foo", "Zm9v"},
+                                     {"foob", "Zm9vYg=="},
+                                     {"fooba", "Zm9vYmE="},
+                                     {"foobar", "Zm9vYmFy"}};
+  for (const auto& vector : kVectors) {
+    EXPECT_EQ(vector[1], Encode(vector[0]));
+    string decoded;
+    EXPECT_TRUE(Decode(vector[1], &decoded));
+    EXPECT_EQ(vector[0], decoded);
+  }
+}
+
+
+TEST(CodecTest, Base64RoundTrip) {
+  for (size_t length = 0; length <= kMaxLength; ++length) {
+    const string data(Data(length, length));
+    const string encoded(Encode(data));
+    string scalar_encoded(Base64EncodedSize(length), 0);
+    internal::ScalarBase64Encode(data.data(), data.size(),
+                                 &scalar_encoded[0]);
+    EXPECT_EQ(scalar_encoded, encoded) << length;
+
+    string decoded;
+    EXPECT_TRUE(Decode(encoded, &decoded)) << length;
+    EXPECT_EQ(data, decoded) << length;
+  }
+}
+
+
+TEST(CodecTest, Base64RejectsInvalid) {
+  string decoded;
+  EXPECT_FALSE(Decode("Zm9", &decoded));
+  EXPECT_FALSE(Decode("Z===", &decoded));
+  EXPECT_FALSE(Decode("Zg==Zg==", &decoded));
+  EXPECT_FALSE(Decode("Zm9 ", &decoded));
+  // Non-zero bits after the last byte.
+  EXPECT_FALSE(Decode("Zh==", &decoded));
+  EXPECT_FALSE(Decode("Zm9=", &decoded));
+}
+
+
+TEST(CodecTest, Base64RejectsInvalidAnywhere) {
+  const string encoded(Encode(Data(kMaxLength, 1)));
+  for (size_t pos = 0; pos < encoded.size(); ++pos) {
+    for (const char c : {'\0', ' ', '-', '=', '\x80', '\xff'}) {
+      string corrupt(encoded);
+      corrupt[pos] = c;
+      string decoded, scalar_decoded;
+      EXPECT_FALSE(Decode(corrupt, &decoded)) << pos << " " << int(c);
+      EXPECT_FALSE(ScalarDecode(corrupt, &scalar_decoded));
+    }
+  }
+}
+
+
+TEST(CodecTest, HexVectors) {
+  EXPECT_EQ("", HexEncoded(""));
+  EXPECT_EQ("00017f80ff", HexEncoded(string("\x00\x01\x7f\x80\xff", 5)));
+
+  char decoded[5];
+  EXPECT_TRUE(HexDecode("00017F80fF", 5, decoded));
+  EXPECT_EQ(string("\x00\x01\x7f\x80\xff", 5), string(decoded, 5));
+}
+
+
+TEST(CodecTest, HexRoundTrip) {
+  for (size_t length = 0; length <= kMaxLength; ++length) {
+    const string data(Data(length, length));
+    const string encoded(HexEncoded(data));
+    string scalar_encoded(2 * length, 0);
+    internal::ScalarHexEncode(data.data(), data.size(), &scalar_encoded[0]);
+    EXPECT_EQ(scalar_encoded, encoded) << length;
+
+    string decoded(length, 0);
+    EXPECT_TRUE(HexDecode(encoded.data(), length, &decoded[0])) << length;
+    EXPECT_EQ(data, decoded) << length;
+  }
+}
+
+
+TEST(CodecTest, HexRejectsInvalidAnywhere) {
+  const string encoded(HexEncoded(Data(kMaxLength, 1)));
+  string decoded(kMaxLength, 0);
+  for (size_t pos = 0; pos < encoded.size(); ++pos) {
+    for (const char c : {'\0', '/', ':', '@', 'G', '`', 'g', '\xc1'}) {
+      string corrupt(encoded);
+      corrupt[pos] = c;
+      EXPECT_FALSE(HexDecode(corrupt.data(), kMaxLength, &decoded[0]))
+          << pos << " " << int(c);
+    }
+  }
+}
+
+
+}  // namespace
+}  // namespace util
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
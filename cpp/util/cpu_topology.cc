@@ -0,0 +1,130 @@
+#include "util/cpu_topology.h"
+
+#include <glog/logging.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdlib>
+
+#include "util/util.h"
+
+using std::string;
+using std::vector;
+using util::Status;
+using util::StatusOr;
+
+namespace cert_trans {
+namespace {
+
+
+const char kNodePrefix[] = "node";
+// More than any host has.
+const int kMaxCpu = 4096;
+
+
+// Parses |number| into |*value|, in [0, kMaxCpu).
+bool ParseCpu(const string& number, int* value) {
+  if (number.empty() ||
+      number.find_first_not_of("0123456789") != string::npos ||
+      number.size() > 4) {
+    return false;
+  }
+  *value = std::atoi(number.c_str());
+  return *value < kMaxCpu;
+}
+
+
+}  // namespace
+
+
+vector<vector<int>> NumaNodeCpus() {
+  vector<vector<int>> nodes;
+  for (int node = 0;; ++node) {
+    string cpulist;
+    if (!util::ReadTextFile("/sys/devices/system/node/node" +
+                                std::to_string(node) + "/cpulist",
+                            &cpulist)) {
+      break;
+    }
+    cpulist.erase(cpulist.find_last_not_of(" \n") + 1);
+    StatusOr<vector<int>> cpus(ParseCpuList(cpulist, {}));
+    if (!cpus.ok()) {
+      LOG(WARNING) << "Ignoring the NUMA nodes: " << cpus.status();
+      nodes.clear();
+      break;
+    }
+    // Nodes with only memory are kept, to keep the numbering.
+    nodes.push_back(cpus.ValueOrDie());
+  }
+
+  if (InterleaveCpus(nodes).empty()) {
+    nodes.clear();
+    const long num_cpus(std::max(1L, sysconf(_SC_NPROCESSORS_ONLN)));
+    nodes.emplace_back();
+    for (int cpu = 0; cpu < num_cpus; ++cpu) {
+      nodes.back().push_back(cpu);
+    }
+  }
+  return nodes;
+}
+
+
+vector<int> InterleaveCpus(const vector<vector<int>>& nodes) {
+  vector<int> cpus;
+  for (size_t i = 0;; ++i) {
+    const size_t before(cpus.size());
+    for (const vector<int>& node : nodes) {
+      if (i < node.size()) {
+        cpus.push_back(node[i]);
+      }
+    }
+    if (cpus.size() == before) {
+      return cpus;
+    }
+  }
+}
+
+
+StatusOr<vector<int>> ParseCpuList(const string& list,
+                                   const vector<vector<int>>& nodes) {
+  vector<int> cpus;
+  for (const string& item : util::split(list)) {
+    if (item.empty()) {
+      continue;
+    }
+    const Status invalid(util::error::INVALID_ARGUMENT,
+                         "invalid CPU \"" + item + "\" in \"" + list + "\"");
+
+    if (item.compare(0, strlen(kNodePrefix), kNodePrefix) == 0) {
+      int node;
+      if (!ParseCpu(item.substr(strlen(kNodePrefix)), &node)) {
+        return invalid;
+      }
+      if (static_cast<size_t>(node) >= nodes.size() || nodes[node].empty()) {
+        return Status(util::error::INVALID_ARGUMENT,
+                      "no NUMA node " + item.substr(strlen(kNodePrefix)) +
+                          " with CPUs");
+      }
+      cpus.insert(cpus.end(), nodes[node].begin(), nodes[node].end());
+      continue;
+    }
+
+    const size_t dash(item.find('-'));
+    int first, last;
+    if (!ParseCpu(item.substr(0, dash), &first)) {
+      return invalid;
+    }
+    last = first;
+    if (dash != string::npos &&
+        (!ParseCpu(item.substr(dash + 1), &last) || last < first)) {
+      return invalid;
+    }
+    for (int cpu = first; cpu <= last; ++cpu) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+
+}  // namespace cert_trans
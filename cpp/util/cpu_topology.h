@@ -0,0 +1,30 @@
+#ifndef CERT_TRANS_UTIL_CPU_TOPOLOGY_H_
+#define CERT_TRANS_UTIL_CPU_TOPOLOGY_H_
+
+#include <string>
+#include <vector>
+
+#include "util/statusor.h"
+
+namespace cert_trans {
+
+
+// Returns the CPUs of each NUMA node, as listed in sysfs (with none
+// for the nodes which only have memory), or all the online CPUs as the
+// one node where that is not available.
+std::vector<std::vector<int>> NumaNodeCpus();
+
+// Returns the CPUs of |nodes| taking one from each node in turn, so
+// that the first CPUs of the list are spread evenly over the nodes.
+std::vector<int> InterleaveCpus(const std::vector<std::vector<int>>& nodes);
+
+// Parses a comma separated list of CPUs, each of which is a number, a
+// range such as "8-15" (as in sysfs), or "nodeN" for all the CPUs of
+// the NUMA node N in |nodes|. Returns the CPUs in the order listed.
+util::StatusOr<std::vector<int>> ParseCpuList(
+    const std::string& list, const std::vector<std::vector<int>>& nodes);
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_UTIL_CPU_TOPOLOGY_H_
@@ -0,0 +1,61 @@
+#include "util/cpu_topology.h"
+
+#include <gtest/gtest.h>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "util/status_test_util.h"
+#include "util/testing.h"
+
+namespace cert_trans {
+namespace {
+
+using std::set;
+using std::vector;
+using util::testing::StatusIs;
+
+
+TEST(CpuTopologyTest, ParsesCpuList) {
+  const vector<vector<int>> nodes{{0, 1, 2, 3}, {}, {4, 5}};
+
+  EXPECT_EQ(vector<int>(), ParseCpuList("", nodes).ValueOrDie());
+  EXPECT_EQ(vector<int>({3, 1}), ParseCpuList("3,1", nodes).ValueOrDie());
+  EXPECT_EQ(vector<int>({0, 8, 9, 10}),
+            ParseCpuList("0,8-10", nodes).ValueOrDie());
+  EXPECT_EQ(vector<int>({4, 5, 7}),
+            ParseCpuList("node2,7", nodes).ValueOrDie());
+
+  for (const char* invalid : {"x", "-1", "3-1", "1-", "node", "node1",
+                              "node3", "99999"}) {
+    EXPECT_THAT(ParseCpuList(invalid, nodes).status(),
+                StatusIs(util::error::INVALID_ARGUMENT))
+        << invalid;
+  }
+}
+
+
+TEST(CpuTopologyTest, InterleavesNodes) {
+  EXPECT_EQ(vector<int>({0, 4, 1, 5, 2, 3}),
+            InterleaveCpus({{0, 1, 2, 3}, {}, {4, 5}}));
+  EXPECT_EQ(vector<int>(), InterleaveCpus({}));
+}
+
+
+TEST(CpuTopologyTest, ListsEachCpuOnce) {
+  const vector<int> cpus(InterleaveCpus(NumaNodeCpus()));
+  ASSERT_FALSE(cpus.empty());
+  EXPECT_EQ(cpus.size(), set<int>(cpus.begin(), cpus.end()).size());
+  EXPECT_EQ(NumaNodeCpus()[0], ParseCpuList("node0", NumaNodeCpus())
+                                   .ValueOrDie());
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
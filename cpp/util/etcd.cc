@@ -3,10 +3,13 @@
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <ctime>
+#include <unordered_map>
 #include <utility>
 #include <event2/http.h>
 
-#include "util/json_wrapper.h"
+#include "monitoring/latency.h"
+#include "monitoring/monitoring.h"
+#include "util/json_reader.h"
 #include "util/libevent_wrapper.h"
 #include "util/statusor.h"
 
@@ -14,7 +17,9 @@ namespace libevent = cert_trans::libevent;
 
 using std::atoll;
 using std::bind;
+using std::chrono::milliseconds;
 using std::chrono::seconds;
+using std::chrono::steady_clock;
 using std::chrono::system_clock;
 using std::ctime;
 using std::list;
@@ -32,9 +37,11 @@ using std::stoi;
 using std::string;
 using std::time_t;
 using std::to_string;
+using std::unordered_map;
 using std::unique_ptr;
 using std::vector;
 using util::Executor;
+using util::JsonReader;
 using util::Status;
 using util::StatusOr;
 using util::SyncTask;
@@ -50,6 +57,14 @@ DEFINE_bool(etcd_quorum, true,
             "unless you *know* what you're doing.");
 DEFINE_int32(etcd_connection_timeout_seconds, 10,
              "Number of seconds after which to timeout etcd connections.");
+DEFINE_int32(etcd_read_hedge_delay_ms, 100,
+             "When reading without quorum=true, send the read to a second "
+             "etcd server if the first has not replied after this many "
+             "milliseconds, and take whichever reply comes first. 0 "
+             "disables this.");
+DEFINE_int32(etcd_endpoint_failure_backoff_seconds, 5,
+             "Number of seconds during which reads avoid an etcd server "
+             "which failed to answer.");
 
 namespace cert_trans {
 
@@ -78,6 +93,32 @@ const char kStatsSpace[] = "/v2/stats";
 const char kStoreStatsKey[] = "/store";
 
 
+static Latency<milliseconds, string> etcd_endpoint_latency_ms(
+    "etcd_endpoint_latency_ms", "endpoint",
+    "Latency of the etcd requests in ms (other than watches), by etcd "
+    "server.");
+
+static Counter<string>* etcd_endpoint_failures =
+    Counter<string>::New("etcd_endpoint_failures", "endpoint",
+                         "Number of etcd requests which could not reach "
+                         "their etcd server, by etcd server.");
+
+static Counter<string>* etcd_hedged_reads =
+    Counter<string>::New("etcd_hedged_reads", "result",
+                         "Number of reads sent to a second etcd server "
+                         "(\"sent\"), and of those where it replied first "
+                         "(\"won\").");
+
+// The weight of each new sample in the latency averages.
+const double kLatencyEwmaWeight = 0.2;
+
+static Gauge<string>* etcd_watch_index_lag =
+    Gauge<string>::New("etcd_watch_index_lag", "key",
+                       "How far behind the etcd index the last update "
+                       "received by a watch was, broken down by watched "
+                       "key.");
+
+
 util::error::Code ErrorCodeForHttpResponseCode(int response_code) {
   switch (response_code) {
     case 200:
@@ -132,95 +173,181 @@ util::error::Code StatusCodeFromEtcdErrorCode(int etcd_code) {
 }
 
 
-string EtcdErrorMessage(const JsonObject& json) {
-  const JsonString message(json, "message");
-  const JsonString cause(json, "cause");
+// The parts of an etcd reply the client looks at, read from the body
+// in a single pass: directory listings can be megabytes, and building
+// a json-c tree of them used to be most of the cost of handling them.
+struct EtcdReply {
+  EtcdReply() : valid(false), has_node(false), error_code(-1) {
+  }
+
+  bool valid;
+  bool has_node;
+  StatusOr<EtcdClient::Node> node;
+  // Set to -1 if there was no "errorCode".
+  int64_t error_code;
+  string message;
+  string cause;
+  map<string, int64_t> stats;
+};
+
 
-  string ret("Etcd message: ");
-  if (message.Ok()) {
-    ret += message.Value();
-    if (cause.Ok()) {
-      ret += ", cause: " + string(cause.Value());
+bool IsStoreStat(const string& name) {
+  for (const char* stat : kStoreStats) {
+    if (name == stat) {
+      return true;
     }
-  } else {
-    ret = json.DebugString();
   }
-  return ret;
+  return false;
 }
 
 
-Status StatusFromResponse(int response_code, const JsonObject& json) {
-  // Prefer the etcd errorCode if there is one:
-  if (json.Ok()) {
-    const JsonInt error_code(json, "errorCode");
-    if (error_code.Ok()) {
-      return Status(StatusCodeFromEtcdErrorCode(error_code.Value()),
-                    EtcdErrorMessage(json));
+// Reads the node object at the current position of |reader|.
+StatusOr<EtcdClient::Node> ReadNode(JsonReader* reader) {
+  bool has_created_index(false);
+  int64_t created_index(0);
+  bool has_modified_index(false);
+  int64_t modified_index(0);
+  bool has_key(false);
+  string key;
+  bool has_value(false);
+  string value;
+  bool is_dir(false);
+  vector<EtcdClient::Node> nodes;
+  // The first problem with the sub-nodes, only reported for
+  // directories.
+  Status nodes_status;
+  bool deleted_sub_node(false);
+
+  string name;
+  reader->EnterObject();
+  while (reader->NextMember(&name)) {
+    const JsonReader::Type type(reader->PeekType());
+    if (name == "createdIndex" && type == JsonReader::Type::NUMBER) {
+      has_created_index = reader->ReadInt64(&created_index);
+    } else if (name == "modifiedIndex" && type == JsonReader::Type::NUMBER) {
+      has_modified_index = reader->ReadInt64(&modified_index);
+    } else if (name == "key" && type == JsonReader::Type::STRING) {
+      has_key = reader->ReadString(&key);
+    } else if (name == "value" && type == JsonReader::Type::STRING) {
+      has_value = reader->ReadString(&value);
+    } else if (name == "dir" && type == JsonReader::Type::BOOLEAN) {
+      reader->ReadBool(&is_dir);
+    } else if (name == "nodes" && type == JsonReader::Type::ARRAY) {
+      reader->EnterArray();
+      while (reader->NextElement()) {
+        if (reader->PeekType() != JsonReader::Type::OBJECT) {
+          if (nodes_status.ok()) {
+            nodes_status = Status(util::error::FAILED_PRECONDITION,
+                                  "Invalid JSON: Couldn't get 'nodes' index " +
+                                      to_string(nodes.size()));
+          }
+          reader->Skip();
+          continue;
+        }
+        StatusOr<EtcdClient::Node> entry(ReadNode(reader));
+        if (!entry.ok()) {
+          if (nodes_status.ok()) {
+            nodes_status = entry.status();
+          }
+          continue;
+        }
+        deleted_sub_node |= entry.ValueOrDie().deleted_;
+        nodes.emplace_back(move(entry.ValueOrDie()));
+      }
+    } else {
+      reader->Skip();
     }
   }
-  // Otherwise use the HTTP code:
-  const util::error::Code error_code(
-      ErrorCodeForHttpResponseCode(response_code));
-  const string error_message(
-      error_code == util::error::OK ? "" : json.DebugString());
-  return Status(error_code, error_message);
-}
 
-
-StatusOr<EtcdClient::Node> ParseNodeFromJson(const JsonObject& json_node) {
-  const JsonInt createdIndex(json_node, "createdIndex");
-  if (!createdIndex.Ok()) {
+  if (!reader->ok()) {
+    return Status(util::error::FAILED_PRECONDITION, "Invalid JSON");
+  }
+  if (!has_created_index) {
     return Status(util::error::FAILED_PRECONDITION,
                   "Invalid JSON: Couldn't find 'createdIndex'");
   }
-
-  const JsonInt modifiedIndex(json_node, "modifiedIndex");
-  if (!modifiedIndex.Ok()) {
+  if (!has_modified_index) {
     return Status(util::error::FAILED_PRECONDITION,
                   "Invalid JSON: Couldn't find 'modifiedIndex'");
   }
-
-  const JsonString key(json_node, "key");
-  if (!key.Ok()) {
+  if (!has_key) {
     return Status(util::error::FAILED_PRECONDITION,
                   "Invalid JSON: Couldn't find 'key'");
   }
 
-  const JsonString value(json_node, "value");
-  const JsonBoolean isDir(json_node, "dir");
-  const bool is_dir(isDir.Ok() && isDir.Value());
-  const bool deleted(!value.Ok() && !is_dir);
-  vector<EtcdClient::Node> nodes;
+  const bool deleted(!has_value && !is_dir);
   if (is_dir && !deleted) {
-    const JsonArray json_nodes(json_node, "nodes");
-    if (json_nodes.Ok()) {
-      for (int i = 0; i < json_nodes.Length(); ++i) {
-        const JsonObject json_entry(json_nodes, i);
-        if (!json_entry.Ok()) {
-          return Status(util::error::FAILED_PRECONDITION,
-                        "Invalid JSON: Couldn't get 'nodes' index " +
-                            to_string(i));
-        }
+    if (!nodes_status.ok()) {
+      return nodes_status;
+    }
+    if (deleted_sub_node) {
+      return Status(util::error::FAILED_PRECONDITION,
+                    "Deleted sub-node " + key);
+    }
+  } else {
+    nodes.clear();
+  }
 
-        StatusOr<EtcdClient::Node> entry(ParseNodeFromJson(json_entry));
-        if (!entry.status().ok()) {
-          return entry.status();
-        }
+  return EtcdClient::Node(created_index, modified_index, key, is_dir,
+                          (deleted || is_dir) ? "" : value, move(nodes),
+                          deleted);
+}
 
-        if (entry.ValueOrDie().deleted_) {
-          return Status(util::error::FAILED_PRECONDITION,
-                        "Deleted sub-node " + string(key.Value()));
-        }
 
-        nodes.emplace_back(entry.ValueOrDie());
+EtcdReply ParseEtcdReply(const string& body) {
+  EtcdReply reply;
+  JsonReader reader(body);
+  if (reader.PeekType() != JsonReader::Type::OBJECT) {
+    return reply;
+  }
+
+  string name;
+  reader.EnterObject();
+  while (reader.NextMember(&name)) {
+    const JsonReader::Type type(reader.PeekType());
+    if (name == "node" && type == JsonReader::Type::OBJECT) {
+      reply.has_node = true;
+      reply.node = ReadNode(&reader);
+    } else if (name == "errorCode" && type == JsonReader::Type::NUMBER) {
+      reader.ReadInt64(&reply.error_code);
+    } else if (name == "message" && type == JsonReader::Type::STRING) {
+      reader.ReadString(&reply.message);
+    } else if (name == "cause" && type == JsonReader::Type::STRING) {
+      reader.ReadString(&reply.cause);
+    } else if (type == JsonReader::Type::NUMBER && IsStoreStat(name)) {
+      int64_t stat;
+      if (reader.ReadInt64(&stat)) {
+        reply.stats[name] = stat;
       }
+    } else {
+      reader.Skip();
     }
   }
+  reply.valid = reader.Finish();
+  return reply;
+}
+
 
-  return EtcdClient::Node(createdIndex.Value(), modifiedIndex.Value(),
-                          key.Value(), is_dir,
-                          (deleted || is_dir) ? "" : value.Value(),
-                          move(nodes), deleted);
+Status StatusFromResponse(int response_code, const EtcdReply& reply,
+                          const string& body) {
+  // Prefer the etcd errorCode if there is one:
+  if (reply.valid && reply.error_code >= 0) {
+    string message("Etcd message: ");
+    if (!reply.message.empty()) {
+      message += reply.message;
+      if (!reply.cause.empty()) {
+        message += ", cause: " + reply.cause;
+      }
+    } else {
+      message = body;
+    }
+    return Status(StatusCodeFromEtcdErrorCode(reply.error_code), message);
+  }
+  // Otherwise use the HTTP code:
+  const util::error::Code error_code(
+      ErrorCodeForHttpResponseCode(response_code));
+  const string error_message(error_code == util::error::OK ? "" : body);
+  return Status(error_code, error_message);
 }
 
 
@@ -239,36 +366,23 @@ void GetRequestDone(const string& keyname, EtcdClient::GetResponse* resp,
     return;
   }
 
-  const JsonObject json_node(*gen_resp->json_body, "node");
-  if (!json_node.Ok()) {
+  if (!gen_resp->has_node) {
     parent_task->Return(Status(util::error::FAILED_PRECONDITION,
                                "Invalid JSON: Couldn't find 'node'"));
     return;
   }
 
-  StatusOr<EtcdClient::Node> node(ParseNodeFromJson(json_node));
+  StatusOr<EtcdClient::Node>& node(gen_resp->node);
   if (!node.status().ok()) {
     parent_task->Return(node.status());
     return;
   }
 
-  resp->node = node.ValueOrDie();
+  resp->node = move(node.ValueOrDie());
   parent_task->Return();
 }
 
 
-void CopyStat(const string& key, const JsonObject& from,
-              map<string, int64_t>* to) {
-  CHECK_NOTNULL(to);
-  const JsonInt stat(from, key.c_str());
-  if (!stat.Ok()) {
-    LOG(WARNING) << "Failed to find stat " << key;
-    return;
-  }
-  (*to)[key] = stat.Value();
-}
-
-
 void GetStoreStatsRequestDone(EtcdClient::StatsResponse* resp,
                               Task* parent_task,
                               EtcdClient::GenericResponse* gen_resp,
@@ -280,15 +394,18 @@ void GetStoreStatsRequestDone(EtcdClient::StatsResponse* resp,
     return;
   }
 
-  if (!gen_resp->json_body->Ok()) {
+  if (!gen_resp->valid_json) {
     parent_task->Return(Status(util::error::FAILED_PRECONDITION,
                                "Invalid JSON: json_body not Ok."));
     return;
   }
 
-  for (const auto& stat : kStoreStats) {
-    CopyStat(stat, *gen_resp->json_body, &resp->stats);
+  for (const char* stat : kStoreStats) {
+    if (gen_resp->stats.find(stat) == gen_resp->stats.end()) {
+      LOG(WARNING) << "Failed to find stat " << stat;
+    }
   }
+  resp->stats = move(gen_resp->stats);
   parent_task->Return();
 }
 
@@ -300,14 +417,13 @@ void CreateRequestDone(EtcdClient::Response* resp, Task* parent_task,
     return;
   }
 
-  const JsonObject json_node(*gen_resp->json_body, "node");
-  if (!json_node.Ok()) {
+  if (!gen_resp->has_node) {
     parent_task->Return(Status(util::error::FAILED_PRECONDITION,
                                "Invalid JSON: Couldn't find 'node'"));
     return;
   }
 
-  StatusOr<EtcdClient::Node> node(ParseNodeFromJson(json_node));
+  StatusOr<EtcdClient::Node>& node(gen_resp->node);
   if (!node.status().ok()) {
     parent_task->Return(node.status());
     return;
@@ -328,14 +444,13 @@ void UpdateRequestDone(EtcdClient::Response* resp, Task* parent_task,
     return;
   }
 
-  const JsonObject json_node(*gen_resp->json_body, "node");
-  if (!json_node.Ok()) {
+  if (!gen_resp->has_node) {
     parent_task->Return(Status(util::error::FAILED_PRECONDITION,
                                "Invalid JSON: Couldn't find 'node'"));
     return;
   }
 
-  StatusOr<EtcdClient::Node> node(ParseNodeFromJson(json_node));
+  StatusOr<EtcdClient::Node>& node(gen_resp->node);
   if (!node.status().ok()) {
     parent_task->Return(node.status());
     return;
@@ -354,14 +469,13 @@ void ForceSetRequestDone(EtcdClient::Response* resp, Task* parent_task,
     return;
   }
 
-  const JsonObject json_node(*gen_resp->json_body, "node");
-  if (!json_node.Ok()) {
+  if (!gen_resp->has_node) {
     parent_task->Return(Status(util::error::FAILED_PRECONDITION,
                                "Invalid JSON: Couldn't find 'node'"));
     return;
   }
 
-  StatusOr<EtcdClient::Node> node(ParseNodeFromJson(json_node));
+  StatusOr<EtcdClient::Node>& node(gen_resp->node);
   if (!node.status().ok()) {
     parent_task->Return(node.status());
     return;
@@ -400,16 +514,102 @@ string UrlEscapeAndJoinParams(const map<string, string>& params) {
 static const EtcdClient::Node kInvalidNode(-1, -1, "", false, "", {}, true);
 
 
+// Gathers the updates of a watch for a while before passing them on,
+// keeping only the latest for each key. Runs on the executor of the
+// watch task, like the watch callback.
+class WatchCoalescer {
+ public:
+  WatchCoalescer(const EtcdClient::WatchCallback& cb,
+                 const milliseconds& window, Task* task)
+      : cb_(cb),
+        window_(window),
+        task_(CHECK_NOTNULL(task)),
+        initial_done_(false),
+        flush_scheduled_(false) {
+  }
+
+  void OnUpdates(const vector<EtcdClient::Node>& updates) {
+    if (!initial_done_) {
+      initial_done_ = true;
+      cb_(updates);
+      return;
+    }
+
+    lock_guard<mutex> lock(lock_);
+    for (const auto& update : updates) {
+      const auto it(positions_.find(update.key_));
+      if (it == positions_.end()) {
+        positions_.emplace(update.key_, pending_.size());
+        pending_.emplace_back(update);
+      } else {
+        pending_[it->second] = update;
+      }
+    }
+    if (!flush_scheduled_ && !pending_.empty()) {
+      flush_scheduled_ = true;
+      ScheduleFlush();
+    }
+  }
+
+ private:
+  void ScheduleFlush() {
+    task_->executor()->Delay(window_, task_->AddChild(
+                                          bind(&WatchCoalescer::Flush, this,
+                                               _1)));
+  }
+
+  void Flush(Task* child_task) {
+    vector<EtcdClient::Node> updates;
+    {
+      lock_guard<mutex> lock(lock_);
+      updates.swap(pending_);
+      positions_.clear();
+    }
+    // Nothing to do if the watch has been cancelled.
+    if (child_task->status().ok()) {
+      cb_(updates);
+    }
+
+    // The updates which came in meanwhile wait for a window of their
+    // own, and the callback is never called concurrently.
+    lock_guard<mutex> lock(lock_);
+    if (!pending_.empty() && child_task->status().ok()) {
+      ScheduleFlush();
+    } else {
+      flush_scheduled_ = false;
+    }
+  }
+
+  const EtcdClient::WatchCallback cb_;
+  const milliseconds window_;
+  Task* const task_;
+  bool initial_done_;
+
+  mutex lock_;
+  vector<EtcdClient::Node> pending_;
+  // The position of each key in |pending_|.
+  unordered_map<string, size_t> positions_;
+  bool flush_scheduled_;
+};
+
+
+string EndpointString(const EtcdClient::HostPortPair& endpoint) {
+  return endpoint.first + ":" + to_string(endpoint.second);
+}
+
+
 }  // namespace
 
 
 struct EtcdClient::RequestState {
   RequestState(UrlFetcher::Verb verb, const string& key,
                const string& key_space, map<string, string> params,
-               const HostPortPair& host_port, GenericResponse* gen_resp,
-               Task* parent_task)
+               const HostPortPair& host_port, bool read,
+               GenericResponse* gen_resp, Task* parent_task)
       : gen_resp_(CHECK_NOTNULL(gen_resp)),
-        parent_task_(CHECK_NOTNULL(parent_task)) {
+        parent_task_(CHECK_NOTNULL(parent_task)),
+        long_poll_(params.count("wait") > 0),
+        read_(read) {
     CHECK(!key.empty());
     CHECK_EQ(key[0], '/');
 
@@ -453,6 +653,7 @@ struct EtcdClient::RequestState {
   void SetHostPort(const HostPortPair& host_port) {
     CHECK(!host_port.first.empty());
     CHECK_GT(host_port.second, 0);
+    host_port_ = host_port;
     req_.url.SetProtocol("http");
     req_.url.SetHost(host_port.first);
     req_.url.SetPort(host_port.second);
@@ -460,18 +661,51 @@ struct EtcdClient::RequestState {
 
   GenericResponse* const gen_resp_;
   Task* const parent_task_;
+  // Waiting requests are left out of the latency averages.
+  const bool long_poll_;
+  // Quorum-free reads, which can go to any etcd server.
+  const bool read_;
 
+  HostPortPair host_port_;
+  steady_clock::time_point started_;
   UrlFetcher::Request req_;
   UrlFetcher::Response resp_;
 };
 
 
+struct EtcdClient::HedgedRead {
+  HedgedRead(const string& key, const string& key_space,
+             const map<string, string>& params, GenericResponse* resp,
+             Task* task)
+      : key_(key),
+        key_space_(key_space),
+        params_(params),
+        resp_(resp),
+        task_(task),
+        outstanding_(0),
+        done_(false) {
+  }
+
+  const string key_;
+  const string key_space_;
+  const map<string, string> params_;
+  GenericResponse* const resp_;
+  Task* const task_;
+
+  mutex lock_;
+  HostPortPair first_endpoint_;
+  int outstanding_;
+  bool done_;
+};
+
+
 struct EtcdClient::WatchState {
   WatchState(const string& key, const WatchCallback& cb, Task* task)
       : key_(key),
         cb_(cb),
         task_(CHECK_NOTNULL(task)),
-        highest_index_seen_(-1) {
+        highest_index_seen_(-1),
+        consecutive_errors_(0) {
   }
 
   ~WatchState() {
@@ -484,6 +718,7 @@ struct EtcdClient::WatchState {
 
   int64_t highest_index_seen_;
   map<string, int64_t> known_keys_;
+  int consecutive_errors_;
 };
 
 
@@ -597,9 +832,24 @@ void EtcdClient::WatchRequestDone(WatchState* state, GetResponse* get_resp,
 
   if (!child_task->status().ok()) {
     VLOG(1) << "Watch request errored: " << child_task->status();
-    StartWatchRequest(state);
+    // The watch resumes from the last index seen, without getting
+    // everything again; but not in a tight loop if etcd keeps failing.
+    if (++state->consecutive_errors_ > 1) {
+      state->task_->executor()->Delay(
+          seconds(FLAGS_etcd_watch_error_retry_delay_seconds),
+          state->task_->AddChild(
+              [this, state](Task*) { this->StartWatchRequest(state); }));
+    } else {
+      StartWatchRequest(state);
+    }
     return;
   }
+  state->consecutive_errors_ = 0;
+
+  if (get_resp->etcd_index >= get_resp->node.modified_index_) {
+    etcd_watch_index_lag->Set(
+        state->key_, get_resp->etcd_index - get_resp->node.modified_index_);
+  }
 
   vector<Node> updates;
   state->highest_index_seen_ =
@@ -700,7 +950,7 @@ EtcdClient::EtcdClient(Executor* executor, UrlFetcher* fetcher,
 EtcdClient::EtcdClient(Executor* executor, UrlFetcher* fetcher,
                        const list<HostPortPair>& etcds)
     : executor_(CHECK_NOTNULL(executor)),
-      log_version_task_(new SyncTask(executor_)),
+      background_task_(new SyncTask(executor_)),
       fetcher_(CHECK_NOTNULL(fetcher)),
       etcds_(etcds),
       logged_version_(false) {
@@ -727,15 +977,15 @@ EtcdClient::HostPortPair EtcdClient::ChooseNextServer() {
 
 
 EtcdClient::EtcdClient()
-    : executor_(nullptr), log_version_task_(nullptr), fetcher_(nullptr) {
+    : executor_(nullptr), background_task_(nullptr), fetcher_(nullptr) {
 }
 
 
 EtcdClient::~EtcdClient() {
   VLOG(1) << "~EtcdClient: " << this;
-  if (log_version_task_) {
-    log_version_task_->task()->Return();
-    log_version_task_->Wait();
+  if (background_task_) {
+    background_task_->task()->Return();
+    background_task_->Wait();
   }
 }
 
@@ -748,10 +998,13 @@ void EtcdClient::FetchDone(RequestState* etcd_req, Task* task) {
       // Seems etcd wasn't available; pick a new etcd server and retry
       LOG(WARNING) << "Etcd fetch failed: " << task->status() << ", retrying "
                    << "on next etcd server.";
-      etcd_req->SetHostPort(ChooseNextServer());
-      fetcher_->Fetch(etcd_req->req_, &etcd_req->resp_,
-                      etcd_req->parent_task_->AddChild(
-                          bind(&EtcdClient::FetchDone, this, etcd_req, _1)));
+      MarkFailed(etcd_req->host_port_);
+      if (etcd_req->host_port_ == GetEndpoint()) {
+        ChooseNextServer();
+      }
+      etcd_req->SetHostPort(etcd_req->read_ ? GetReadEndpoint(nullptr)
+                                            : GetEndpoint());
+      StartFetch(etcd_req);
       return;
     }
     // Otherwise just let the requestor know.
@@ -760,6 +1013,10 @@ void EtcdClient::FetchDone(RequestState* etcd_req, Task* task) {
   }
 
   VLOG(2) << "response:\n" << etcd_req->resp_;
+  if (!etcd_req->long_poll_) {
+    RecordLatency(etcd_req->host_port_,
+                  steady_clock::now() - etcd_req->started_);
+  }
 
   if (etcd_req->resp_.status_code == 307) {
     UrlFetcher::Headers::const_iterator it(
@@ -785,18 +1042,18 @@ void EtcdClient::FetchDone(RequestState* etcd_req, Task* task) {
 
     MaybeLogEtcdVersion();
 
-    fetcher_->Fetch(etcd_req->req_, &etcd_req->resp_,
-                    etcd_req->parent_task_->AddChild(
-                        bind(&EtcdClient::FetchDone, this, etcd_req, _1)));
+    StartFetch(etcd_req);
     return;
   }
 
-  etcd_req->gen_resp_->json_body =
-      make_shared<JsonObject>(etcd_req->resp_.body);
-  CHECK_NOTNULL(etcd_req->gen_resp_->json_body.get());
-  if (!etcd_req->gen_resp_->json_body->Ok()) {
+  EtcdReply reply(ParseEtcdReply(etcd_req->resp_.body));
+  if (!reply.valid) {
     LOG(WARNING) << "Got invalid JSON: " << etcd_req->resp_.body;
   }
+  etcd_req->gen_resp_->valid_json = reply.valid;
+  etcd_req->gen_resp_->has_node = reply.valid && reply.has_node;
+  etcd_req->gen_resp_->node = move(reply.node);
+  etcd_req->gen_resp_->stats = move(reply.stats);
 
   etcd_req->gen_resp_->etcd_index = -1;
 
@@ -806,9 +1063,8 @@ void EtcdClient::FetchDone(RequestState* etcd_req, Task* task) {
     etcd_req->gen_resp_->etcd_index = atoll(it->second.c_str());
   }
 
-  etcd_req->parent_task_->Return(
-      StatusFromResponse(etcd_req->resp_.status_code,
-                         *etcd_req->gen_resp_->json_body));
+  etcd_req->parent_task_->Return(StatusFromResponse(
+      etcd_req->resp_.status_code, reply, etcd_req->resp_.body));
 }
 
 
@@ -818,6 +1074,66 @@ EtcdClient::HostPortPair EtcdClient::GetEndpoint() const {
 }
 
 
+EtcdClient::HostPortPair EtcdClient::GetReadEndpoint(
+    const HostPortPair* exclude) const {
+  lock_guard<mutex> lock(lock_);
+  const steady_clock::time_point now(steady_clock::now());
+  const HostPortPair* best(nullptr);
+  double best_latency(0);
+  for (const auto& endpoint : etcds_) {
+    if (exclude && endpoint == *exclude) {
+      continue;
+    }
+    double latency(0);
+    const auto it(endpoint_stats_.find(endpoint));
+    if (it != endpoint_stats_.end()) {
+      if (it->second.failed_until > now) {
+        continue;
+      }
+      // The ones without a sample yet get one.
+      latency = max(it->second.latency_ewma_ms, 0.0);
+    }
+    if (!best || latency < best_latency) {
+      best = &endpoint;
+      best_latency = latency;
+    }
+  }
+
+  if (best) {
+    return *best;
+  }
+  // They have all failed recently, fall back on the leader (or the
+  // next one).
+  if (exclude && etcds_.size() > 1 && etcds_.front() == *exclude) {
+    return *++etcds_.begin();
+  }
+  return etcds_.front();
+}
+
+
+void EtcdClient::RecordLatency(const HostPortPair& endpoint,
+                               const std::chrono::duration<double>& latency) {
+  etcd_endpoint_latency_ms.RecordLatency(EndpointString(endpoint), latency);
+  const double latency_ms(latency.count() * 1000);
+  lock_guard<mutex> lock(lock_);
+  EndpointStats* const stats(&endpoint_stats_[endpoint]);
+  stats->latency_ewma_ms =
+      stats->latency_ewma_ms < 0
+          ? latency_ms
+          : kLatencyEwmaWeight * latency_ms +
+                (1 - kLatencyEwmaWeight) * stats->latency_ewma_ms;
+}
+
+
+void EtcdClient::MarkFailed(const HostPortPair& endpoint) {
+  etcd_endpoint_failures->Increment(EndpointString(endpoint));
+  lock_guard<mutex> lock(lock_);
+  endpoint_stats_[endpoint].failed_until =
+      steady_clock::now() +
+      seconds(FLAGS_etcd_endpoint_failure_backoff_seconds);
+}
+
+
 EtcdClient::HostPortPair EtcdClient::UpdateEndpoint(
     HostPortPair&& new_endpoint) {
   lock_guard<mutex> lock(lock_);
@@ -940,6 +1256,19 @@ void EtcdClient::ForceSetWithTTL(const string& key, const string& value,
 }
 
 
+void EtcdClient::RefreshTTL(const string& key, const seconds& ttl,
+                            Response* resp, Task* task) {
+  map<string, string> params;
+  params["ttl"] = to_string(ttl.count());
+  params["refresh"] = "true";
+  params["prevExist"] = "true";
+  GenericResponse* const gen_resp(new GenericResponse);
+  task->DeleteWhenDone(gen_resp);
+  Generic(key, kKeysSpace, params, UrlFetcher::Verb::PUT, gen_resp,
+          task->AddChild(bind(&UpdateRequestDone, resp, task, gen_resp, _1)));
+}
+
+
 void EtcdClient::Delete(const string& key, const int64_t current_index,
                         Task* task) {
   map<string, string> params;
@@ -960,6 +1289,12 @@ void EtcdClient::ForceDelete(const string& key, Task* task) {
 }
 
 
+void EtcdClient::ForceDeleteKeys(const vector<string>& keys, Task* task) {
+  CHECK_EQ(keys.size(), 1U);
+  ForceDelete(keys.front(), task);
+}
+
+
 void EtcdClient::GetStoreStats(StatsResponse* resp, Task* task) {
   map<string, string> params;
   GenericResponse* const gen_resp(new GenericResponse);
@@ -983,20 +1318,124 @@ void EtcdClient::Watch(const string& key, const WatchCallback& cb,
 }
 
 
+void EtcdClient::CoalescedWatch(const string& key, const WatchCallback& cb,
+                                const milliseconds& window, Task* task) {
+  if (window <= milliseconds::zero()) {
+    Watch(key, cb, task);
+    return;
+  }
+
+  WatchCoalescer* const coalescer(new WatchCoalescer(cb, window, task));
+  task->DeleteWhenDone(coalescer);
+  Watch(key, bind(&WatchCoalescer::OnUpdates, coalescer, _1), task);
+}
+
+
 void EtcdClient::Generic(const string& key, const string& key_space,
                          const map<string, string>& params,
                          UrlFetcher::Verb verb, GenericResponse* resp,
                          Task* task) {
   MaybeLogEtcdVersion();
-  RequestState* const etcd_req(new RequestState(verb, key, key_space, params,
-                                                GetEndpoint(), resp, task));
+  // Without a quorum, reads can be served by any etcd server, not just
+  // the leader.
+  const bool read(verb == UrlFetcher::Verb::GET && !FLAGS_etcd_quorum &&
+                  params.count("wait") == 0);
+  bool several_etcds;
+  {
+    lock_guard<mutex> lock(lock_);
+    several_etcds = etcds_.size() > 1;
+  }
+  if (read && several_etcds && FLAGS_etcd_read_hedge_delay_ms > 0) {
+    HedgedGeneric(key, key_space, params, resp, task);
+    return;
+  }
+
+  RequestState* const etcd_req(
+      new RequestState(verb, key, key_space, params,
+                       read ? GetReadEndpoint(nullptr) : GetEndpoint(), read,
+                       resp, task));
   task->DeleteWhenDone(etcd_req);
+  StartFetch(etcd_req);
+}
+
 
+void EtcdClient::StartFetch(RequestState* etcd_req) {
+  etcd_req->started_ = steady_clock::now();
   fetcher_->Fetch(etcd_req->req_, &etcd_req->resp_,
                   etcd_req->parent_task_->AddChild(
                       bind(&EtcdClient::FetchDone, this, etcd_req, _1)));
 }
 
+
+// The read goes to the fastest etcd server, and if it is slow to
+// reply, to the next fastest one too. The requests are children of
+// |background_task_| rather than of |task|, so that the latter can
+// return with the first reply without waiting for the other.
+void EtcdClient::HedgedGeneric(const string& key, const string& key_space,
+                               const map<string, string>& params,
+                               GenericResponse* resp, Task* task) {
+  const shared_ptr<HedgedRead> hedge(
+      make_shared<HedgedRead>(key, key_space, params, resp, task));
+  hedge->first_endpoint_ = GetReadEndpoint(nullptr);
+  StartHedgedAttempt(hedge, hedge->first_endpoint_, false);
+
+  executor_->Delay(
+      milliseconds(FLAGS_etcd_read_hedge_delay_ms),
+      background_task_->task()->AddChild([this, hedge](Task* delay_task) {
+        if (!delay_task->status().ok()) {
+          return;
+        }
+        {
+          lock_guard<mutex> lock(hedge->lock_);
+          if (hedge->done_) {
+            return;
+          }
+        }
+        etcd_hedged_reads->Increment("sent");
+        StartHedgedAttempt(hedge, GetReadEndpoint(&hedge->first_endpoint_),
+                           true);
+      }));
+}
+
+
+void EtcdClient::StartHedgedAttempt(const shared_ptr<HedgedRead>& hedge,
+                                    const HostPortPair& endpoint,
+                                    bool hedged) {
+  {
+    lock_guard<mutex> lock(hedge->lock_);
+    ++hedge->outstanding_;
+  }
+
+  // Cleaned up before the done callback runs, so kept by it instead.
+  const shared_ptr<GenericResponse> attempt_resp(
+      make_shared<GenericResponse>());
+  Task* const attempt_task(background_task_->task()->AddChild(
+      [hedge, attempt_resp, hedged](Task* task) {
+        {
+          lock_guard<mutex> lock(hedge->lock_);
+          --hedge->outstanding_;
+          // An error only counts once the other attempt has failed
+          // too.
+          if (hedge->done_ ||
+              (!task->status().ok() && hedge->outstanding_ > 0)) {
+            return;
+          }
+          hedge->done_ = true;
+        }
+        if (hedged && task->status().ok()) {
+          etcd_hedged_reads->Increment("won");
+        }
+        *hedge->resp_ = move(*attempt_resp);
+        hedge->task_->Return(task->status());
+      }));
+
+  RequestState* const etcd_req(new RequestState(
+      UrlFetcher::Verb::GET, hedge->key_, hedge->key_space_, hedge->params_,
+      endpoint, true, attempt_resp.get(), attempt_task));
+  attempt_task->DeleteWhenDone(etcd_req);
+  StartFetch(etcd_req);
+}
+
 list<EtcdClient::HostPortPair> SplitHosts(const string& hosts_string) {
   vector<string> hosts(util::split(hosts_string, ','));
 
@@ -1033,7 +1472,7 @@ void EtcdClient::MaybeLogEtcdVersion() {
                                     to_string(etcds_.front().second) +
                                     "/version"));
   UrlFetcher::Response* const resp(new UrlFetcher::Response);
-  fetcher_->Fetch(req, resp, log_version_task_->task()->AddChild([this, resp](
+  fetcher_->Fetch(req, resp, background_task_->task()->AddChild([this, resp](
                                  Task* child_task) {
     unique_ptr<UrlFetcher::Response> resp_deleter(resp);
     if (!child_task->status().ok()) {
@@ -13,12 +13,11 @@
 
 #include "net/url_fetcher.h"
 #include "util/status.h"
+#include "util/statusor.h"
 #include "util/sync_task.h"
 #include "util/task.h"
 #include "util/util.h"
 
-class JsonObject;
-
 namespace cert_trans {
 
 
@@ -71,8 +70,18 @@ class EtcdClient {
     Node node;
   };
 
+  // The parts of a reply the client uses, read from its body as it
+  // arrives.
   struct GenericResponse : public Response {
-    std::shared_ptr<JsonObject> json_body;
+    GenericResponse() : valid_json(false), has_node(false) {
+    }
+
+    bool valid_json;
+    // If has_node, the "node" of the reply, or why it is invalid.
+    bool has_node;
+    util::StatusOr<Node> node;
+    // The store statistics, for GetStoreStats().
+    std::map<std::string, int64_t> stats;
   };
 
   struct StatsResponse : public Response {
@@ -117,11 +126,30 @@ class EtcdClient {
                                const std::chrono::seconds& ttl, Response* resp,
                                util::Task* task);
 
+  // Restarts the TTL of |key|, which must exist, without changing its
+  // value, so that the watchers are not told about it. Returns
+  // NOT_FOUND if |key| is gone, e.g. because it expired. Needs etcd
+  // 2.3 or later.
+  virtual void RefreshTTL(const std::string& key,
+                          const std::chrono::seconds& ttl, Response* resp,
+                          util::Task* task);
+
   virtual void Delete(const std::string& key, const int64_t current_index,
                       util::Task* task);
 
   virtual void ForceDelete(const std::string& key, util::Task* task);
 
+  // The most keys ForceDeleteKeys() can delete in a single request.
+  // The v2 API deletes one key at a time.
+  virtual size_t MaxKeysPerDelete() const {
+    return 1;
+  }
+
+  // Deletes all of |keys| (at most MaxKeysPerDelete() of them) in a
+  // single request.
+  virtual void ForceDeleteKeys(const std::vector<std::string>& keys,
+                               util::Task* task);
+
   virtual void GetStoreStats(StatsResponse* resp, util::Task* task);
 
   // The "cb" will be called on the "task" executor. Also, only one
@@ -131,21 +159,53 @@ class EtcdClient {
   virtual void Watch(const std::string& key, const WatchCallback& cb,
                      util::Task* task);
 
+  // Like Watch(), but the updates arriving within |window| of each
+  // other are passed to "cb" together, with only the latest for each
+  // key, so that a watcher of keys which change often is not called
+  // for every change. The initial updates are passed right away.
+  void CoalescedWatch(const std::string& key, const WatchCallback& cb,
+                      const std::chrono::milliseconds& window,
+                      util::Task* task);
+
  protected:
-  // Testing only
+  // For testing, and for the implementations of other versions of the
+  // API (which override all of the above).
   EtcdClient();
 
  private:
   struct RequestState;
   struct WatchState;
+  struct HedgedRead;
+
+  struct EndpointStats {
+    EndpointStats() : latency_ewma_ms(-1) {
+    }
+
+    // Negative until there is a first sample.
+    double latency_ewma_ms;
+    std::chrono::steady_clock::time_point failed_until;
+  };
 
   HostPortPair ChooseNextServer();
+  // The leader (as far as we know), for writes and quorum reads.
   HostPortPair GetEndpoint() const;
+  // The endpoint with the lowest latency (other than |*exclude|, if
+  // not NULL) which has not failed recently, for quorum-free reads.
+  HostPortPair GetReadEndpoint(const HostPortPair* exclude) const;
   HostPortPair UpdateEndpoint(HostPortPair&& new_endpoint);
+  void RecordLatency(const HostPortPair& endpoint,
+                     const std::chrono::duration<double>& latency);
+  void MarkFailed(const HostPortPair& endpoint);
+  void StartFetch(RequestState* etcd_req);
   void FetchDone(RequestState* etcd_req, util::Task* task);
   void Generic(const std::string& key, const std::string& key_space,
                const std::map<std::string, std::string>& params,
                UrlFetcher::Verb verb, GenericResponse* resp, util::Task* task);
+  void HedgedGeneric(const std::string& key, const std::string& key_space,
+                     const std::map<std::string, std::string>& params,
+                     GenericResponse* resp, util::Task* task);
+  void StartHedgedAttempt(const std::shared_ptr<HedgedRead>& hedge,
+                          const HostPortPair& endpoint, bool hedged);
 
   void WatchInitialGetDone(WatchState* state, GetResponse* resp,
                            util::Task* task);
@@ -157,11 +217,15 @@ class EtcdClient {
   void MaybeLogEtcdVersion();
 
   util::Executor* const executor_;
-  std::unique_ptr<util::SyncTask> log_version_task_;
+  // The parent of the requests made on behalf of no caller in
+  // particular (the version logging, hedged reads).
+  std::unique_ptr<util::SyncTask> background_task_;
   UrlFetcher* const fetcher_;
 
   mutable std::mutex lock_;
+  // The first one is the leader.
   std::list<HostPortPair> etcds_;
+  std::map<HostPortPair, EndpointStats> endpoint_stats_;
   bool logged_version_;
 };
 
@@ -2,10 +2,16 @@
 
 #include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <algorithm>
+#include <chrono>
 #include <functional>
 #include <mutex>
 
+#include "monitoring/monitoring.h"
+
 using std::bind;
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
 using std::move;
 using std::mutex;
 using std::placeholders::_1;
@@ -17,17 +23,32 @@ using util::Task;
 using util::TaskHold;
 
 DEFINE_int32(etcd_delete_concurrency, 4,
-             "number of etcd keys to delete at a time");
+             "number of etcd delete requests to start with at a time, "
+             "adjusted from there with --etcd_delete_target_latency_ms");
+DEFINE_int32(etcd_delete_max_concurrency, 64,
+             "most etcd delete requests to have outstanding at a time");
+DEFINE_int32(etcd_delete_target_latency_ms, 100,
+             "the number of concurrent etcd delete requests grows while "
+             "they take less than this, and is halved when they take more. "
+             "0 keeps it at --etcd_delete_concurrency.");
 
 namespace cert_trans {
 namespace {
 
 
+static Gauge<>* etcd_delete_window =
+    Gauge<>::New("etcd_delete_window",
+                 "Number of concurrent etcd delete requests allowed by the "
+                 "latest bulk delete.");
+
+
 class DeleteState {
  public:
   DeleteState(EtcdClient* client, vector<string>&& keys, Task* task)
       : client_(CHECK_NOTNULL(client)),
         task_(CHECK_NOTNULL(task)),
+        keys_per_request_(std::max<size_t>(client_->MaxKeysPerDelete(), 1)),
+        window_(FLAGS_etcd_delete_concurrency),
         outstanding_(0),
         keys_(move(keys)),
         it_(keys_.begin()) {
@@ -46,19 +67,29 @@ class DeleteState {
   }
 
  private:
-  void RequestDone(Task* child_task);
+  void RequestDone(steady_clock::time_point started, Task* child_task);
+  // Additive increase, multiplicative decrease of |window_|, as TCP
+  // does with its congestion window, with the latency as the signal.
+  void UpdateWindow(steady_clock::time_point started);
   void StartNextRequest(unique_lock<mutex>&& lock);
 
   EtcdClient* const client_;
   Task* const task_;
+  const size_t keys_per_request_;
   mutex mutex_;
+  // The number of requests allowed to be outstanding.
+  double window_;
+  // When |window_| was last halved: the requests started before then
+  // do not halve it again.
+  steady_clock::time_point last_decrease_;
   int outstanding_;
   const vector<string> keys_;
   vector<string>::const_iterator it_;
 };
 
 
-void DeleteState::RequestDone(Task* child_task) {
+void DeleteState::RequestDone(steady_clock::time_point started,
+                              Task* child_task) {
   unique_lock<mutex> lock(mutex_);
   --outstanding_;
 
@@ -72,6 +103,7 @@ void DeleteState::RequestDone(Task* child_task) {
     return;
   }
 
+  UpdateWindow(started);
   if (it_ != keys_.end()) {
     StartNextRequest(move(lock));
   } else {
@@ -84,6 +116,28 @@ void DeleteState::RequestDone(Task* child_task) {
 }
 
 
+void DeleteState::UpdateWindow(steady_clock::time_point started) {
+  if (FLAGS_etcd_delete_target_latency_ms <= 0) {
+    return;
+  }
+
+  const steady_clock::time_point now(steady_clock::now());
+  if (now - started > milliseconds(FLAGS_etcd_delete_target_latency_ms)) {
+    if (started > last_decrease_) {
+      window_ = std::max(window_ / 2, 1.0);
+      last_decrease_ = now;
+    }
+  } else {
+    // About one more request per round trip.
+    window_ = std::min(window_ + 1 / window_,
+                       static_cast<double>(std::max(
+                           FLAGS_etcd_delete_max_concurrency,
+                           FLAGS_etcd_delete_concurrency)));
+  }
+  etcd_delete_window->Set(window_);
+}
+
+
 void DeleteState::StartNextRequest(unique_lock<mutex>&& lock) {
   CHECK(lock.owns_lock());
 
@@ -94,18 +148,24 @@ void DeleteState::StartNextRequest(unique_lock<mutex>&& lock) {
     return;
   }
 
-  while (outstanding_ < FLAGS_etcd_delete_concurrency && it_ != keys_.end() &&
+  while (outstanding_ < static_cast<int>(window_) && it_ != keys_.end() &&
          task_->IsActive()) {
     CHECK(lock.owns_lock());
-    const string& key(*it_);
-    ++it_;
+    const vector<string>::const_iterator begin(it_);
+    it_ += std::min<size_t>(keys_per_request_, keys_.end() - it_);
+    const vector<string>::const_iterator end(it_);
     ++outstanding_;
 
     // In case the task uses an inline executor.
     lock.unlock();
 
-    client_->ForceDelete(key, task_->AddChild(
-                                  bind(&DeleteState::RequestDone, this, _1)));
+    Task* const child(task_->AddChild(
+        bind(&DeleteState::RequestDone, this, steady_clock::now(), _1)));
+    if (end - begin == 1) {
+      client_->ForceDelete(*begin, child);
+    } else {
+      client_->ForceDeleteKeys(vector<string>(begin, end), child);
+    }
 
     // We must be holding the lock to evaluate the loop condition.
     lock.lock();
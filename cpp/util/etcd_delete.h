@@ -10,8 +10,10 @@
 namespace cert_trans {
 
 
-// Force delete keys in batches (implemented using concurrent
-// requests). The "keys" argument are pairs of key and modified index.
+// Force delete keys with concurrent requests, each deleting up to
+// client->MaxKeysPerDelete() keys. The number of concurrent requests
+// starts at --etcd_delete_concurrency, and adapts to the latency of
+// etcd (see --etcd_delete_target_latency_ms).
 void EtcdForceDeleteKeys(EtcdClient* client, std::vector<std::string>&& keys,
                          util::Task* task);
 
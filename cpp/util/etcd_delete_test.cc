@@ -51,6 +51,23 @@ class EtcdDeleteTest : public ::testing::Test {
 typedef EtcdDeleteTest EtcdDeleteDeathTest;
 
 
+// Like the etcd v3 client, deletes several keys per request.
+class BatchingMockEtcdClient : public MockEtcdClient {
+ public:
+  size_t MaxKeysPerDelete() const override {
+    return 2;
+  }
+
+  MOCK_METHOD2(ForceDeleteKeys,
+               void(const vector<string>& keys, util::Task* task));
+};
+
+
+void ReturnTask(Task* task) {
+  task->Return();
+}
+
+
 TEST_F(EtcdDeleteDeathTest, ConcurrencyTooLow) {
   FLAGS_etcd_delete_concurrency = 0;
   SyncTask sync(&pool_);
@@ -179,6 +196,24 @@ TEST_F(EtcdDeleteTest, WithinConcurrency) {
 }
 
 
+TEST_F(EtcdDeleteTest, Batches) {
+  StrictMock<BatchingMockEtcdClient> client;
+  SyncTask sync(&pool_);
+
+  EXPECT_CALL(client, ForceDeleteKeys(vector<string>{"/one", "/two"}, _))
+      .WillOnce(Invoke(bind(&ReturnTask, _2)));
+  EXPECT_CALL(client, ForceDeleteKeys(vector<string>{"/three", "/four"}, _))
+      .WillOnce(Invoke(bind(&ReturnTask, _2)));
+  EXPECT_CALL(client, ForceDelete("/five", _))
+      .WillOnce(Invoke(bind(&ReturnTask, _2)));
+  EtcdForceDeleteKeys(&client, {"/one", "/two", "/three", "/four", "/five"},
+                      sync.task());
+
+  sync.Wait();
+  EXPECT_OK(sync.status());
+}
+
+
 TEST_F(EtcdDeleteTest, ErrorHandling) {
   vector<string> keys{"/one", "/two", "/three"};
   ASSERT_LT(static_cast<size_t>(FLAGS_etcd_delete_concurrency), keys.size());
@@ -12,6 +12,8 @@
 #include "util/sync_task.h"
 #include "util/testing.h"
 
+DECLARE_bool(etcd_quorum);
+DECLARE_int32(etcd_read_hedge_delay_ms);
 DECLARE_int32(etcd_watch_error_retry_delay_seconds);
 
 namespace cert_trans {
@@ -897,6 +899,51 @@ TEST_F(EtcdTest, UnavailableEtcdRetriesOnNewServer) {
 }
 
 
+TEST_F(EtcdTest, QuorumFreeReadIsHedged) {
+  FLAGS_etcd_quorum = false;
+  FLAGS_etcd_read_hedge_delay_ms = 10;
+  EtcdClient multi_client(base_.get(), &url_fetcher_,
+                          {EtcdClient::HostPortPair(kEtcdHost, kEtcdPort),
+                           EtcdClient::HostPortPair(kEtcdHost2, kEtcdPort2)});
+
+  // The first server does not reply until the end of the test.
+  Task* slow_task(nullptr);
+  EXPECT_CALL(url_fetcher_,
+              Fetch(IsUrlFetchRequest(UrlFetcher::Verb::GET,
+                                      URL(GetEtcdUrl(kEntryKey) +
+                                          "?consistent=true"),
+                                      IsEmpty(), ""),
+                    _, _))
+      .WillOnce(Invoke([&slow_task](const UrlFetcher::Request&,
+                                    UrlFetcher::Response*, Task* task) {
+        slow_task = task;
+      }));
+  EXPECT_CALL(url_fetcher_,
+              Fetch(IsUrlFetchRequest(UrlFetcher::Verb::GET,
+                                      URL(GetEtcdUrl(kEntryKey, kDefaultSpace,
+                                                     kEtcdHost2, kEtcdPort2) +
+                                          "?consistent=true"),
+                                      IsEmpty(), ""),
+                    _, _))
+      .WillOnce(
+          Invoke(bind(HandleFetch, ::util::OkStatus(), 200,
+                      UrlFetcher::Headers{make_pair("x-etcd-index", "11")},
+                      kGetJson, _1, _2, _3)));
+
+  SyncTask task(base_.get());
+  EtcdClient::GetResponse resp;
+  multi_client.Get(string(kEntryKey), &resp, task.task());
+  task.Wait();
+  EXPECT_OK(task);
+  EXPECT_EQ(11, resp.etcd_index);
+  EXPECT_EQ("123", resp.node.value_);
+
+  ASSERT_NE(nullptr, slow_task);
+  slow_task->Return(Status(util::error::DEADLINE_EXCEEDED, ""));
+  FLAGS_etcd_quorum = true;
+}
+
+
 TEST_F(EtcdTest, FollowsMasterChangeRedirectToNewHost) {
   // Excludes kEtcdHost3:
   EtcdClient multi_client(base_.get(), &url_fetcher_,
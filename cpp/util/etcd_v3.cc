@@ -0,0 +1,901 @@
+#include "util/etcd_v3.h"
+
+#include <event2/buffer.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <utility>
+
+#include "util/json_wrapper.h"
+
+using std::bind;
+using std::chrono::seconds;
+using std::deque;
+using std::list;
+using std::lock_guard;
+using std::make_pair;
+using std::make_shared;
+using std::map;
+using std::max;
+using std::min;
+using std::move;
+using std::mutex;
+using std::placeholders::_1;
+using std::shared_ptr;
+using std::string;
+using std::to_string;
+using std::unique_ptr;
+using std::vector;
+using util::Executor;
+using util::Status;
+using util::Task;
+
+DEFINE_string(etcd_v3_api_prefix, "/v3",
+              "Path prefix of the etcd v3 JSON gateway (\"/v3beta\" or "
+              "\"/v3alpha\" with older etcd releases).");
+DEFINE_int32(etcd_v3_max_txn_ops, 128,
+             "Most operations in a transaction, which must not be more than "
+             "the --max-txn-ops of the etcd servers.");
+DECLARE_int32(etcd_watch_error_retry_delay_seconds);
+
+namespace cert_trans {
+
+namespace {
+
+
+struct KeyValue {
+  string key;
+  string value;
+  int64_t create_revision;
+  int64_t mod_revision;
+};
+
+
+// The v3 gateway encodes the 64-bit integers as strings, and leaves
+// out the fields that are zero.
+int64_t Int64Field(const JsonObject& json, const char* field) {
+  const JsonString str(json, field);
+  return str.Ok() ? strtoll(str.Value(), nullptr, 10) : 0;
+}
+
+
+int64_t HeaderRevision(const JsonObject& reply) {
+  const JsonObject header(reply, "header");
+  return header.Ok() ? Int64Field(header, "revision") : -1;
+}
+
+
+string StripTrailingSlash(const string& key) {
+  return !key.empty() && key.back() == '/' ? key.substr(0, key.size() - 1)
+                                           : key;
+}
+
+
+// The end of the range of the keys under the directory |dir_key|:
+// '0' follows '/'.
+string DirRangeEnd(const string& dir_key) {
+  return dir_key + "0";
+}
+
+
+bool IsUnder(const string& key, const string& dir_key) {
+  return key.size() > dir_key.size() + 1 &&
+         key.compare(0, dir_key.size(), dir_key) == 0 &&
+         key[dir_key.size()] == '/';
+}
+
+
+bool ParseKeyValue(const JsonObject& json, KeyValue* kv) {
+  const JsonString key(json, "key");
+  if (!key.Ok()) {
+    return false;
+  }
+  kv->key = util::FromBase64(key.Value());
+  const JsonString value(json, "value");
+  kv->value = value.Ok() ? util::FromBase64(value.Value()) : "";
+  kv->create_revision = Int64Field(json, "create_revision");
+  kv->mod_revision = Int64Field(json, "mod_revision");
+  return true;
+}
+
+
+// Appends the "kvs" of a range response to |kvs|.
+bool ParseRange(const JsonObject& range, vector<KeyValue>* kvs) {
+  const JsonArray json_kvs(range, "kvs");
+  if (!json_kvs.Ok()) {
+    return true;
+  }
+  for (int i = 0; i < json_kvs.Length(); ++i) {
+    const JsonObject json_kv(json_kvs, i);
+    KeyValue kv;
+    if (!json_kv.Ok() || !ParseKeyValue(json_kv, &kv)) {
+      return false;
+    }
+    kvs->emplace_back(move(kv));
+  }
+  return true;
+}
+
+
+EtcdClient::Node FileNode(const KeyValue& kv) {
+  return EtcdClient::Node(kv.create_revision, kv.mod_revision, kv.key, false,
+                          kv.value, {}, false);
+}
+
+
+// Makes the v2 directory |dir_key| out of the keys under it, [begin,
+// end) in order. The subdirectories only get their children if
+// |recursive|. A directory's revisions are the earliest creation and
+// the latest modification of the keys under it.
+EtcdClient::Node DirNode(const string& dir_key,
+                         vector<KeyValue>::const_iterator begin,
+                         vector<KeyValue>::const_iterator end,
+                         bool recursive) {
+  int64_t created(INT64_MAX), modified(0);
+  vector<EtcdClient::Node> nodes;
+  const size_t prefix_size(dir_key.size() + 1);
+  for (auto it(begin); it != end;) {
+    created = min(created, it->create_revision);
+    const size_t slash(it->key.find('/', prefix_size));
+    if (slash == string::npos) {
+      modified = max(modified, it->mod_revision);
+      nodes.emplace_back(FileNode(*it));
+      ++it;
+      continue;
+    }
+
+    const string subdir_key(it->key.substr(0, slash));
+    int64_t subdir_created(INT64_MAX), subdir_modified(0);
+    auto subdir_end(it);
+    while (subdir_end != end && IsUnder(subdir_end->key, subdir_key)) {
+      subdir_created = min(subdir_created, subdir_end->create_revision);
+      subdir_modified = max(subdir_modified, subdir_end->mod_revision);
+      ++subdir_end;
+    }
+    modified = max(modified, subdir_modified);
+    if (recursive) {
+      nodes.emplace_back(DirNode(subdir_key, it, subdir_end, true));
+    } else {
+      nodes.emplace_back(subdir_created, subdir_modified, subdir_key, true,
+                         "", vector<EtcdClient::Node>(), false);
+    }
+    it = subdir_end;
+  }
+  return EtcdClient::Node(created, modified, dir_key, true, "", move(nodes),
+                          false);
+}
+
+
+void AddRangeOp(const string& key, const string& range_end,
+                JsonArray* ops) {
+  JsonObject range;
+  range.AddBase64("key", key);
+  if (!range_end.empty()) {
+    range.AddBase64("range_end", range_end);
+  }
+  JsonObject json_op;
+  json_op.Add("request_range", range);
+  ops->Add(&json_op);
+}
+
+
+void AddTxnOp(const EtcdV3Client::Op& op, int64_t lease, JsonArray* ops) {
+  JsonObject request;
+  request.AddBase64("key", op.key);
+  JsonObject json_op;
+  switch (op.type) {
+    case EtcdV3Client::Op::Type::PUT:
+      request.AddBase64("value", op.value);
+      if (lease != 0) {
+        request.Add("lease", lease);
+      }
+      json_op.Add("request_put", request);
+      break;
+    case EtcdV3Client::Op::Type::DELETE:
+      json_op.Add("request_delete_range", request);
+      break;
+  }
+  ops->Add(&json_op);
+}
+
+
+void AddCompares(const vector<EtcdV3Client::Compare>& compares,
+                 JsonObject* body) {
+  JsonArray json_compares;
+  for (const auto& compare : compares) {
+    JsonObject json_compare;
+    json_compare.AddBase64("key", compare.key);
+    json_compare.Add("result", string("EQUAL"));
+    switch (compare.target) {
+      case EtcdV3Client::Compare::Target::CREATE:
+        json_compare.Add("target", string("CREATE"));
+        json_compare.Add("create_revision", compare.revision);
+        break;
+      case EtcdV3Client::Compare::Target::MOD:
+        json_compare.Add("target", string("MOD"));
+        json_compare.Add("mod_revision", compare.revision);
+        break;
+    }
+    json_compares.Add(&json_compare);
+  }
+  body->Add("compare", json_compares);
+}
+
+
+void TxnDone(EtcdClient::Response* resp, Task* parent_task,
+             shared_ptr<JsonObject>* reply, Task* task) {
+  if (!task->status().ok()) {
+    parent_task->Return(task->status());
+    return;
+  }
+
+  const JsonBoolean succeeded(**reply, "succeeded");
+  if (!succeeded.Ok() || !succeeded.Value()) {
+    parent_task->Return(
+        Status(util::error::FAILED_PRECONDITION, "Compare failed"));
+    return;
+  }
+
+  if (resp) {
+    resp->etcd_index = HeaderRevision(**reply);
+  }
+  parent_task->Return();
+}
+
+
+void GetDone(const string& key, bool recursive, EtcdClient::GetResponse* resp,
+             Task* parent_task, shared_ptr<JsonObject>* reply, Task* task) {
+  *resp = EtcdClient::GetResponse();
+  if (!task->status().ok()) {
+    parent_task->Return(
+        Status(task->status().CanonicalCode(),
+               task->status().error_message() + " (" + key + ")"));
+    return;
+  }
+
+  resp->etcd_index = HeaderRevision(**reply);
+  // The replies to the range of the key itself, and of the keys under
+  // it.
+  const JsonArray responses(**reply, "responses");
+  vector<KeyValue> file, dir;
+  if (!responses.Ok() || responses.Length() != 2 ||
+      !ParseRange(JsonObject(JsonObject(responses, 0), "response_range"),
+                  &file) ||
+      !ParseRange(JsonObject(JsonObject(responses, 1), "response_range"),
+                  &dir)) {
+    parent_task->Return(Status(util::error::FAILED_PRECONDITION,
+                               "Invalid JSON: Couldn't parse 'responses'"));
+    return;
+  }
+
+  if (!file.empty()) {
+    resp->node = FileNode(file.front());
+  } else if (!dir.empty()) {
+    resp->node = DirNode(StripTrailingSlash(key), dir.begin(), dir.end(),
+                         recursive);
+  } else {
+    parent_task->Return(
+        Status(util::error::NOT_FOUND, "Key not found (" + key + ")"));
+    return;
+  }
+  parent_task->Return();
+}
+
+
+}  // namespace
+
+
+struct EtcdV3Client::CallState {
+  CallState(const string& method, const JsonObject& body,
+            const HostPortPair& host_port, shared_ptr<JsonObject>* reply,
+            Task* parent_task, int attempts)
+      : reply_(CHECK_NOTNULL(reply)),
+        parent_task_(CHECK_NOTNULL(parent_task)),
+        attempts_left_(attempts) {
+    req_.verb = UrlFetcher::Verb::POST;
+    req_.url.SetPath(FLAGS_etcd_v3_api_prefix + method);
+    req_.headers.insert(make_pair("Content-Type", "application/json"));
+    req_.body = body.ToJson();
+    SetHostPort(host_port);
+  }
+
+  void SetHostPort(const HostPortPair& host_port) {
+    req_.url.SetProtocol("http");
+    req_.url.SetHost(host_port.first);
+    req_.url.SetPort(host_port.second);
+  }
+
+  shared_ptr<JsonObject>* const reply_;
+  Task* const parent_task_;
+  int attempts_left_;
+
+  UrlFetcher::Request req_;
+  UrlFetcher::Response resp_;
+};
+
+
+struct EtcdV3Client::WatchState {
+  WatchState(const string& key, const WatchCallback& cb, Task* task)
+      : dir_key_(StripTrailingSlash(key)),
+        cb_(cb),
+        task_(CHECK_NOTNULL(task)),
+        revision_(-1),
+        resync_(true),
+        stream_alive_(false),
+        buffer_(CHECK_NOTNULL(evbuffer_new()), evbuffer_free),
+        sending_(false) {
+  }
+
+  ~WatchState() {
+    VLOG(1) << "EtcdV3Client::Watch: no longer watching " << dir_key_;
+  }
+
+  bool Matches(const string& key) const {
+    return key == dir_key_ || IsUnder(key, dir_key_);
+  }
+
+  const string dir_key_;
+  const WatchCallback cb_;
+  Task* const task_;
+
+  // Only used by whichever of the initial get and the watch stream is
+  // in progress, one at a time.
+  int64_t revision_;
+  map<string, int64_t> known_keys_;
+  // Set when the watch stream can no longer continue from |revision_|
+  // (it was compacted away), and has to start over with a get.
+  bool resync_;
+  bool stream_alive_;
+  const unique_ptr<evbuffer, void (*)(evbuffer*)> buffer_;
+
+  // The updates waiting to be passed to |cb_|, one batch at a time.
+  mutex lock_;
+  deque<vector<Node>> pending_;
+  bool sending_;
+};
+
+
+EtcdV3Client::EtcdV3Client(Executor* executor, UrlFetcher* fetcher,
+                           const list<HostPortPair>& etcds)
+    : executor_(CHECK_NOTNULL(executor)),
+      fetcher_(CHECK_NOTNULL(fetcher)),
+      etcds_(etcds) {
+  CHECK(!etcds_.empty()) << "No etcd hosts provided.";
+  for (const auto& e : etcds_) {
+    CHECK(!e.first.empty()) << "Empty host specified";
+    CHECK_GT(e.second, 0) << "Invalid port specified";
+  }
+}
+
+
+EtcdV3Client::~EtcdV3Client() {
+}
+
+
+EtcdClient::HostPortPair EtcdV3Client::GetEndpoint() const {
+  lock_guard<mutex> lock(lock_);
+  return etcds_.front();
+}
+
+
+EtcdClient::HostPortPair EtcdV3Client::NextEndpoint() {
+  lock_guard<mutex> lock(lock_);
+  etcds_.emplace_back(etcds_.front());
+  etcds_.pop_front();
+
+  LOG(INFO) << "Selected new etcd server: " << etcds_.front().first << ":"
+            << etcds_.front().second;
+  return etcds_.front();
+}
+
+
+void EtcdV3Client::Call(const string& method, const JsonObject& body,
+                        shared_ptr<JsonObject>* reply, Task* task) {
+  int attempts;
+  {
+    lock_guard<mutex> lock(lock_);
+    attempts = etcds_.size();
+  }
+  CallState* const state(
+      new CallState(method, body, GetEndpoint(), reply, task, attempts));
+  task->DeleteWhenDone(state);
+  VLOG(2) << "EtcdV3Client::Call " << method << ": " << state->req_.body;
+
+  fetcher_->Fetch(state->req_, &state->resp_,
+                  task->AddChild(bind(&EtcdV3Client::CallDone, this, state,
+                                      _1)));
+}
+
+
+void EtcdV3Client::CallDone(CallState* state, Task* task) {
+  Status status(task->status());
+  if (status.ok()) {
+    VLOG(2) << "response:\n" << state->resp_;
+    *state->reply_ = make_shared<JsonObject>(state->resp_.body);
+    const JsonObject& reply(**state->reply_);
+    if (state->resp_.status_code != 200) {
+      // The gateway passes the gRPC status along, whose codes are
+      // those of util::error.
+      const JsonInt code(reply, "code");
+      const JsonString message(reply, "error");
+      util::error::Code error_code(state->resp_.status_code >= 500
+                                       ? util::error::UNAVAILABLE
+                                       : util::error::UNKNOWN);
+      if (code.Ok() && code.Value() > 0 &&
+          code.Value() <= util::error::DATA_LOSS) {
+        error_code = static_cast<util::error::Code>(code.Value());
+      }
+      status = Status(error_code,
+                      message.Ok() ? message.Value() : state->resp_.body);
+    } else if (!reply.Ok()) {
+      status = Status(util::error::FAILED_PRECONDITION,
+                      "Invalid JSON: " + state->resp_.body);
+    }
+  }
+
+  // An unreachable etcd, or one without a leader, might not be the
+  // only one.
+  if (status.CanonicalCode() == util::error::UNAVAILABLE &&
+      --state->attempts_left_ > 0) {
+    LOG(WARNING) << "Etcd call failed: " << status << ", retrying on next "
+                 << "etcd server.";
+    state->SetHostPort(NextEndpoint());
+    state->resp_ = UrlFetcher::Response();
+    fetcher_->Fetch(state->req_, &state->resp_,
+                    state->parent_task_->AddChild(
+                        bind(&EtcdV3Client::CallDone, this, state, _1)));
+    return;
+  }
+
+  state->parent_task_->Return(status);
+}
+
+
+void EtcdV3Client::Get(const Request& req, GetResponse* resp, Task* task) {
+  if (req.wait_index > 0) {
+    task->Return(Status(util::error::UNIMPLEMENTED,
+                        "Waiting gets are done with Watch() in etcd v3"));
+    return;
+  }
+
+  // Both ranges are read at the same revision.
+  const string dir_key(StripTrailingSlash(req.key));
+  JsonArray success;
+  AddRangeOp(dir_key, "", &success);
+  AddRangeOp(dir_key + "/", DirRangeEnd(dir_key), &success);
+  JsonObject body;
+  body.Add("success", success);
+
+  shared_ptr<JsonObject>* const reply(new shared_ptr<JsonObject>);
+  task->DeleteWhenDone(reply);
+  Call("/kv/txn", body, reply,
+       task->AddChild(
+           bind(&GetDone, req.key, req.recursive, resp, task, reply, _1)));
+}
+
+
+void EtcdV3Client::Create(const string& key, const string& value,
+                          Response* resp, Task* task) {
+  Txn({Compare(key, Compare::Target::CREATE, 0)}, {Op::Put(key, value)}, resp,
+      task);
+}
+
+
+void EtcdV3Client::CreateWithTTL(const string& key, const string& value,
+                                 const seconds& ttl, Response* resp,
+                                 Task* task) {
+  TxnWithTTL({Compare(key, Compare::Target::CREATE, 0)}, Op::Put(key, value),
+             ttl, resp, task);
+}
+
+
+void EtcdV3Client::Update(const string& key, const string& value,
+                          const int64_t previous_index, Response* resp,
+                          Task* task) {
+  Txn({Compare(key, Compare::Target::MOD, previous_index)},
+      {Op::Put(key, value)}, resp, task);
+}
+
+
+void EtcdV3Client::UpdateWithTTL(const string& key, const string& value,
+                                 const seconds& ttl,
+                                 const int64_t previous_index, Response* resp,
+                                 Task* task) {
+  TxnWithTTL({Compare(key, Compare::Target::MOD, previous_index)},
+             Op::Put(key, value), ttl, resp, task);
+}
+
+
+void EtcdV3Client::ForceSet(const string& key, const string& value,
+                            Response* resp, Task* task) {
+  Txn({}, {Op::Put(key, value)}, resp, task);
+}
+
+
+void EtcdV3Client::ForceSetWithTTL(const string& key, const string& value,
+                                   const seconds& ttl, Response* resp,
+                                   Task* task) {
+  TxnWithTTL({}, Op::Put(key, value), ttl, resp, task);
+}
+
+
+void EtcdV3Client::RefreshTTL(const string& key, const seconds& ttl,
+                              Response* resp, Task* task) {
+  JsonObject range;
+  range.AddBase64("key", key);
+
+  shared_ptr<JsonObject>* const reply(new shared_ptr<JsonObject>);
+  task->DeleteWhenDone(reply);
+  Call("/kv/range", range, reply,
+       task->AddChild([this, key, resp, task, reply](Task* child) {
+         if (!child->status().ok()) {
+           task->Return(child->status());
+           return;
+         }
+
+         const JsonArray kvs(**reply, "kvs");
+         if (!kvs.Ok() || kvs.Length() == 0) {
+           task->Return(Status(util::error::NOT_FOUND, key + " not found"));
+           return;
+         }
+         const JsonObject kv(kvs, 0);
+         const int64_t lease(Int64Field(kv, "lease"));
+         if (lease == 0) {
+           task->Return(Status(util::error::FAILED_PRECONDITION,
+                               key + " has no TTL"));
+           return;
+         }
+         resp->etcd_index = Int64Field(kv, "mod_revision");
+
+         JsonObject keepalive;
+         keepalive.Add("ID", lease);
+         Call("/lease/keepalive", keepalive, reply,
+              task->AddChild([key, task, reply](Task* child) {
+                if (!child->status().ok()) {
+                  task->Return(child->status());
+                  return;
+                }
+                // The gateway streams the replies, as "result"s. An
+                // expired lease comes back without a TTL.
+                const JsonObject result(**reply, "result");
+                if (!result.Ok() || Int64Field(result, "TTL") <= 0) {
+                  task->Return(
+                      Status(util::error::NOT_FOUND, key + " expired"));
+                  return;
+                }
+                task->Return();
+              }));
+       }));
+}
+
+
+void EtcdV3Client::Delete(const string& key, const int64_t current_index,
+                          Task* task) {
+  Txn({Compare(key, Compare::Target::MOD, current_index)}, {Op::Delete(key)},
+      nullptr, task);
+}
+
+
+void EtcdV3Client::ForceDelete(const string& key, Task* task) {
+  Txn({}, {Op::Delete(key)}, nullptr, task);
+}
+
+
+size_t EtcdV3Client::MaxKeysPerDelete() const {
+  return std::max(FLAGS_etcd_v3_max_txn_ops, 1);
+}
+
+
+void EtcdV3Client::ForceDeleteKeys(const vector<string>& keys, Task* task) {
+  CHECK_LE(keys.size(), MaxKeysPerDelete());
+  vector<Op> ops;
+  ops.reserve(keys.size());
+  for (const auto& key : keys) {
+    ops.push_back(Op::Delete(key));
+  }
+  Txn({}, ops, nullptr, task);
+}
+
+
+void EtcdV3Client::GetStoreStats(StatsResponse* resp, Task* task) {
+  *resp = StatsResponse();
+  task->Return(Status(util::error::UNIMPLEMENTED,
+                      "etcd v3 has no store statistics"));
+}
+
+
+void EtcdV3Client::Txn(const vector<Compare>& compares,
+                       const vector<Op>& ops, Response* resp, Task* task) {
+  JsonObject body;
+  AddCompares(compares, &body);
+  JsonArray success;
+  for (const auto& op : ops) {
+    AddTxnOp(op, 0, &success);
+  }
+  body.Add("success", success);
+
+  shared_ptr<JsonObject>* const reply(new shared_ptr<JsonObject>);
+  task->DeleteWhenDone(reply);
+  Call("/kv/txn", body, reply,
+       task->AddChild(bind(&TxnDone, resp, task, reply, _1)));
+}
+
+
+// A lease is granted first, the transaction puts the key with it.
+void EtcdV3Client::TxnWithTTL(const vector<Compare>& compares, const Op& op,
+                              const seconds& ttl, Response* resp,
+                              Task* task) {
+  JsonObject grant;
+  grant.Add("TTL", static_cast<int64_t>(ttl.count()));
+
+  shared_ptr<JsonObject>* const reply(new shared_ptr<JsonObject>);
+  task->DeleteWhenDone(reply);
+  Call("/lease/grant", grant, reply,
+       task->AddChild([this, compares, op, resp, task, reply](Task* child) {
+         if (!child->status().ok()) {
+           task->Return(child->status());
+           return;
+         }
+
+         JsonObject body;
+         AddCompares(compares, &body);
+         JsonArray success;
+         AddTxnOp(op, Int64Field(**reply, "ID"), &success);
+         body.Add("success", success);
+         Call("/kv/txn", body, reply,
+              task->AddChild(bind(&TxnDone, resp, task, reply, _1)));
+       }));
+}
+
+
+void EtcdV3Client::Watch(const string& key, const WatchCallback& cb,
+                         Task* task) {
+  VLOG(1) << "EtcdV3Client::Watch: " << key;
+
+  WatchState* const state(new WatchState(key, cb, task));
+  task->DeleteWhenDone(state);
+
+  StartWatch(state);
+}
+
+
+void EtcdV3Client::StartWatch(WatchState* state) {
+  if (state->task_->CancelRequested()) {
+    state->task_->Return(Status::CANCELLED);
+    return;
+  }
+
+  GetResponse* const resp(new GetResponse);
+  Get(Request(state->dir_key_), resp,
+      state->task_->AddChild(
+          bind(&EtcdV3Client::WatchInitialGetDone, this, state, resp, _1)));
+}
+
+
+void EtcdV3Client::WatchInitialGetDone(WatchState* state, GetResponse* resp,
+                                       Task* task) {
+  unique_ptr<GetResponse> resp_deleter(resp);
+  if (state->task_->CancelRequested()) {
+    state->task_->Return(Status::CANCELLED);
+    return;
+  }
+
+  vector<Node> nodes;
+  if (task->status().ok()) {
+    if (resp->node.is_dir_) {
+      nodes = move(resp->node.nodes_);
+    } else {
+      nodes.push_back(resp->node);
+    }
+  } else if (task->status().CanonicalCode() != util::error::NOT_FOUND) {
+    LOG(WARNING) << "Initial get error: " << task->status() << ", will retry "
+                 << "in " << FLAGS_etcd_watch_error_retry_delay_seconds
+                 << " second(s)";
+    state->task_->executor()->Delay(
+        seconds(FLAGS_etcd_watch_error_retry_delay_seconds),
+        state->task_->AddChild(
+            [this, state](Task*) { this->StartWatch(state); }));
+    return;
+  }
+
+  const bool first(state->revision_ < 0);
+  state->revision_ = max(state->revision_, resp->etcd_index);
+
+  // As in EtcdClient::WatchInitialGetDone(), report what changed
+  // since the last time, including the keys which have gone.
+  vector<Node> updates;
+  map<string, int64_t> new_known_keys;
+  for (auto& node : nodes) {
+    const auto it(state->known_keys_.find(node.key_));
+    if (it == state->known_keys_.end() || it->second < node.modified_index_) {
+      updates.emplace_back(node);
+    }
+    new_known_keys[node.key_] = node.modified_index_;
+    if (it != state->known_keys_.end()) {
+      state->known_keys_.erase(it);
+    }
+  }
+  for (const auto& key : state->known_keys_) {
+    updates.emplace_back(Node(-1, -1, key.first, false, "", {}, true));
+  }
+  state->known_keys_.swap(new_known_keys);
+
+  if (first || !updates.empty()) {
+    SendWatchUpdates(state, move(updates));
+  }
+  state->resync_ = false;
+  StartWatchStream(state);
+}
+
+
+void EtcdV3Client::StartWatchStream(WatchState* state) {
+  if (state->task_->CancelRequested()) {
+    state->task_->Return(Status::CANCELLED);
+    return;
+  }
+
+  JsonObject create;
+  create.AddBase64("key", state->dir_key_);
+  create.AddBase64("range_end", DirRangeEnd(state->dir_key_));
+  create.Add("start_revision", state->revision_ + 1);
+  JsonObject body;
+  body.Add("create_request", create);
+
+  evbuffer_drain(state->buffer_.get(),
+                 evbuffer_get_length(state->buffer_.get()));
+  state->stream_alive_ = false;
+
+  // TODO: Several watches could share a stream, but the gateway only
+  // takes the requests at the start of it.
+  const HostPortPair endpoint(GetEndpoint());
+  UrlFetcher::Request req(
+      URL("http://" + endpoint.first + ":" + to_string(endpoint.second) +
+          FLAGS_etcd_v3_api_prefix + "/watch"));
+  req.verb = UrlFetcher::Verb::POST;
+  req.headers.insert(make_pair("Content-Type", "application/json"));
+  req.body = body.ToJson();
+
+  UrlFetcher::Response* const resp(new UrlFetcher::Response);
+  resp->body_chunk = bind(&EtcdV3Client::WatchChunk, this, state, _1);
+  fetcher_->Fetch(req, resp,
+                  state->task_->AddChild(bind(&EtcdV3Client::WatchStreamDone,
+                                              this, state, resp, _1)));
+}
+
+
+// Runs on the libevent dispatch thread, for each part of the stream of
+// watch responses.
+void EtcdV3Client::WatchChunk(WatchState* state, evbuffer* chunk) {
+  if (state->task_->CancelRequested()) {
+    return;
+  }
+  evbuffer_add_buffer(state->buffer_.get(), chunk);
+
+  while (true) {
+    const JsonObject message(state->buffer_.get());
+    if (!message.Ok()) {
+      break;
+    }
+    state->stream_alive_ = true;
+
+    const JsonObject result(message, "result");
+    if (!result.Ok()) {
+      LOG(WARNING) << "Watch error: " << message.ToJson();
+      continue;
+    }
+    const JsonBoolean canceled(result, "canceled");
+    if (Int64Field(result, "compact_revision") > 0 ||
+        (canceled.Ok() && canceled.Value())) {
+      VLOG(1) << "Watch of " << state->dir_key_ << " cancelled, "
+              << "resyncing: " << result.ToJson();
+      state->resync_ = true;
+      continue;
+    }
+
+    vector<Node> updates;
+    const JsonArray events(result, "events");
+    for (int i = 0; events.Ok() && i < events.Length(); ++i) {
+      const JsonObject event(events, i);
+      const JsonObject json_kv(event, "kv");
+      KeyValue kv;
+      if (!json_kv.Ok() || !ParseKeyValue(json_kv, &kv)) {
+        LOG(WARNING) << "Invalid watch event: " << event.ToJson();
+        continue;
+      }
+      state->revision_ = max(state->revision_, kv.mod_revision);
+      if (!state->Matches(kv.key)) {
+        continue;
+      }
+
+      const JsonString type(event, "type");
+      if (type.Ok() && string(type.Value()) == "DELETE") {
+        state->known_keys_.erase(kv.key);
+        updates.emplace_back(Node(kv.create_revision, kv.mod_revision, kv.key,
+                                  false, "", {}, true));
+      } else {
+        state->known_keys_[kv.key] = kv.mod_revision;
+        updates.emplace_back(FileNode(kv));
+      }
+    }
+    state->revision_ = max(state->revision_, HeaderRevision(result));
+
+    if (!updates.empty()) {
+      SendWatchUpdates(state, move(updates));
+    }
+  }
+}
+
+
+// Hands |updates| over to the executor of |state->task_|, after the
+// ones before them have been through |state->cb_|.
+void EtcdV3Client::SendWatchUpdates(WatchState* state,
+                                    vector<Node>&& updates) {
+  {
+    lock_guard<mutex> lock(state->lock_);
+    state->pending_.emplace_back(move(updates));
+    if (state->sending_) {
+      return;
+    }
+    state->sending_ = true;
+  }
+
+  Task* const send_task(state->task_->AddChild([](Task*) {}));
+  state->task_->executor()->Add([state, send_task]() {
+    while (true) {
+      vector<Node> next;
+      {
+        lock_guard<mutex> lock(state->lock_);
+        if (state->pending_.empty()) {
+          state->sending_ = false;
+          break;
+        }
+        next = move(state->pending_.front());
+        state->pending_.pop_front();
+      }
+      state->cb_(next);
+    }
+    send_task->Return();
+  });
+}
+
+
+void EtcdV3Client::WatchStreamDone(WatchState* state,
+                                   UrlFetcher::Response* resp, Task* task) {
+  unique_ptr<UrlFetcher::Response> resp_deleter(resp);
+  if (state->task_->CancelRequested()) {
+    state->task_->Return(Status::CANCELLED);
+    return;
+  }
+
+  if (state->resync_) {
+    StartWatch(state);
+    return;
+  }
+
+  if (!state->stream_alive_ &&
+      (!task->status().ok() || resp->status_code != 200)) {
+    LOG(WARNING) << "Watch stream error: " << task->status() << " ("
+                 << resp->status_code << "), will retry in "
+                 << FLAGS_etcd_watch_error_retry_delay_seconds
+                 << " second(s)";
+    if (task->status().CanonicalCode() == util::error::UNAVAILABLE) {
+      NextEndpoint();
+    }
+    state->task_->executor()->Delay(
+        seconds(FLAGS_etcd_watch_error_retry_delay_seconds),
+        state->task_->AddChild(
+            [this, state](Task*) { this->StartWatchStream(state); }));
+    return;
+  }
+
+  // The stream was working until it ended (e.g. timed out), carry on
+  // from where it stopped.
+  VLOG(1) << "Watch stream ended: " << task->status();
+  StartWatchStream(state);
+}
+
+
+}  // namespace cert_trans
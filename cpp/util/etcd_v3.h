@@ -0,0 +1,167 @@
+#ifndef CERT_TRANS_UTIL_ETCD_V3_H_
+#define CERT_TRANS_UTIL_ETCD_V3_H_
+
+#include <stdint.h>
+#include <chrono>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "util/etcd.h"
+
+class JsonObject;
+struct evbuffer;
+
+namespace cert_trans {
+
+
+// An EtcdClient talking to the etcd v3 API, through the JSON gateway
+// etcd serves next to its gRPC endpoint. The v2 directories are
+// mapped onto key prefixes ("/a/b" is a directory if there are keys
+// starting with "/a/b/"), the v2 indices onto the v3 revisions, and
+// TTLs onto leases. Compare-and-swap operations are transactions,
+// which Txn() also offers directly, for changes spanning several keys.
+class EtcdV3Client : public EtcdClient {
+ public:
+  // Holds if the revision of |key| (its creation or last modification
+  // one) is |revision|. A creation revision of 0 means the key does
+  // not exist.
+  struct Compare {
+    enum class Target {
+      CREATE,
+      MOD,
+    };
+
+    Compare(const std::string& thekey, Target thetarget, int64_t therevision)
+        : key(thekey), target(thetarget), revision(therevision) {
+    }
+
+    std::string key;
+    Target target;
+    int64_t revision;
+  };
+
+  struct Op {
+    enum class Type {
+      PUT,
+      DELETE,
+    };
+
+    static Op Put(const std::string& key, const std::string& value) {
+      return Op(Type::PUT, key, value);
+    }
+
+    static Op Delete(const std::string& key) {
+      return Op(Type::DELETE, key, "");
+    }
+
+    Type type;
+    std::string key;
+    std::string value;
+
+   private:
+    Op(Type thetype, const std::string& thekey, const std::string& thevalue)
+        : type(thetype), key(thekey), value(thevalue) {
+    }
+  };
+
+  EtcdV3Client(util::Executor* executor, UrlFetcher* fetcher,
+               const std::list<HostPortPair>& etcds);
+
+  ~EtcdV3Client() override;
+
+  void Get(const Request& req, GetResponse* resp, util::Task* task) override;
+
+  void Create(const std::string& key, const std::string& value,
+              Response* resp, util::Task* task) override;
+
+  void CreateWithTTL(const std::string& key, const std::string& value,
+                     const std::chrono::seconds& ttl, Response* resp,
+                     util::Task* task) override;
+
+  void Update(const std::string& key, const std::string& value,
+              const int64_t previous_index, Response* resp,
+              util::Task* task) override;
+
+  void UpdateWithTTL(const std::string& key, const std::string& value,
+                     const std::chrono::seconds& ttl,
+                     const int64_t previous_index, Response* resp,
+                     util::Task* task) override;
+
+  void ForceSet(const std::string& key, const std::string& value,
+                Response* resp, util::Task* task) override;
+
+  void ForceSetWithTTL(const std::string& key, const std::string& value,
+                       const std::chrono::seconds& ttl, Response* resp,
+                       util::Task* task) override;
+
+  // Keeps the lease of |key| alive, which restarts it with the TTL it
+  // was granted: |ttl| is not used.
+  void RefreshTTL(const std::string& key, const std::chrono::seconds& ttl,
+                  Response* resp, util::Task* task) override;
+
+  void Delete(const std::string& key, const int64_t current_index,
+              util::Task* task) override;
+
+  void ForceDelete(const std::string& key, util::Task* task) override;
+
+  // Up to --etcd_v3_max_txn_ops keys, in a single transaction.
+  size_t MaxKeysPerDelete() const override;
+  void ForceDeleteKeys(const std::vector<std::string>& keys,
+                       util::Task* task) override;
+
+  // The v3 API has no equivalent of the v2 store statistics, this
+  // returns UNIMPLEMENTED.
+  void GetStoreStats(StatsResponse* resp, util::Task* task) override;
+
+  // Watching a key also watches the keys under it, as for a
+  // directory. The changes come from a single streaming request,
+  // restarted from the last revision seen if it fails.
+  void Watch(const std::string& key, const WatchCallback& cb,
+             util::Task* task) override;
+
+  // Applies all of |ops| in a single revision if all of |compares|
+  // hold, and returns FAILED_PRECONDITION (changing nothing)
+  // otherwise. |resp->etcd_index| is set to the revision of the
+  // changes.
+  void Txn(const std::vector<Compare>& compares, const std::vector<Op>& ops,
+           Response* resp, util::Task* task);
+
+ private:
+  struct CallState;
+  struct WatchState;
+
+  // POSTs |body| to the API method |method| (e.g. "/kv/range"), and
+  // sets |reply| to what it returns.
+  void Call(const std::string& method, const JsonObject& body,
+            std::shared_ptr<JsonObject>* reply, util::Task* task);
+  void CallDone(CallState* state, util::Task* task);
+  void TxnWithTTL(const std::vector<Compare>& compares, const Op& op,
+                  const std::chrono::seconds& ttl, Response* resp,
+                  util::Task* task);
+
+  void StartWatch(WatchState* state);
+  void WatchInitialGetDone(WatchState* state, GetResponse* resp,
+                           util::Task* task);
+  void StartWatchStream(WatchState* state);
+  void WatchChunk(WatchState* state, evbuffer* chunk);
+  void SendWatchUpdates(WatchState* state, std::vector<Node>&& updates);
+  void WatchStreamDone(WatchState* state, UrlFetcher::Response* resp,
+                       util::Task* task);
+
+  HostPortPair GetEndpoint() const;
+  HostPortPair NextEndpoint();
+
+  util::Executor* const executor_;
+  UrlFetcher* const fetcher_;
+
+  mutable std::mutex lock_;
+  std::list<HostPortPair> etcds_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_UTIL_ETCD_V3_H_
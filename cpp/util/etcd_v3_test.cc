@@ -0,0 +1,245 @@
+#include "util/etcd_v3.h"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <list>
+#include <memory>
+#include <string>
+
+#include "net/mock_url_fetcher.h"
+#include "util/json_wrapper.h"
+#include "util/libevent_wrapper.h"
+#include "util/status_test_util.h"
+#include "util/sync_task.h"
+#include "util/testing.h"
+#include "util/util.h"
+
+namespace cert_trans {
+
+using std::bind;
+using std::chrono::seconds;
+using std::list;
+using std::make_shared;
+using std::placeholders::_1;
+using std::placeholders::_2;
+using std::placeholders::_3;
+using std::shared_ptr;
+using std::string;
+using std::to_string;
+using testing::HasSubstr;
+using testing::InSequence;
+using testing::Invoke;
+using testing::_;
+using util::SyncTask;
+using util::Task;
+using util::ToBase64;
+using util::testing::StatusIs;
+
+namespace {
+
+const char kEtcdHost[] = "etcd.example.net";
+const int kEtcdPort = 4242;
+
+
+string GetEtcdUrl(const string& method) {
+  return "http://" + string(kEtcdHost) + ":" + to_string(kEtcdPort) + "/v3" +
+         method;
+}
+
+
+string KvJson(const string& key, const string& value, int create, int mod) {
+  return "{\"key\": \"" + ToBase64(key) + "\", \"value\": \"" +
+         ToBase64(value) + "\", \"create_revision\": \"" + to_string(create) +
+         "\", \"mod_revision\": \"" + to_string(mod) + "\"}";
+}
+
+
+// Replies with |body|, after checking that the request contains all
+// of |expected|.
+void HandleFetch(const std::vector<string>& expected, int status_code,
+                 const string& body, const UrlFetcher::Request& req,
+                 UrlFetcher::Response* resp, Task* task) {
+  for (const auto& part : expected) {
+    EXPECT_THAT(req.body, HasSubstr(part));
+  }
+  resp->status_code = status_code;
+  resp->body = body;
+  task->Return();
+}
+
+
+class EtcdV3Test : public ::testing::Test {
+ public:
+  EtcdV3Test()
+      : base_(make_shared<libevent::Base>()),
+        pump_(base_),
+        client_(base_.get(), &url_fetcher_,
+                list<EtcdClient::HostPortPair>{
+                    EtcdClient::HostPortPair(kEtcdHost, kEtcdPort)}) {
+  }
+
+ protected:
+  void ExpectCall(const string& method, const std::vector<string>& expected,
+                  int status_code, const string& body) {
+    EXPECT_CALL(url_fetcher_,
+                Fetch(IsUrlFetchRequest(UrlFetcher::Verb::POST,
+                                        URL(GetEtcdUrl(method)), _, _),
+                      _, _))
+        .WillOnce(Invoke(
+            bind(HandleFetch, expected, status_code, body, _1, _2, _3)));
+  }
+
+  const shared_ptr<libevent::Base> base_;
+  MockUrlFetcher url_fetcher_;
+  libevent::EventPumpThread pump_;
+  EtcdV3Client client_;
+};
+
+
+TEST_F(EtcdV3Test, Get) {
+  ExpectCall("/kv/txn", {ToBase64("/some/key")}, 200,
+             "{\"header\": {\"revision\": \"11\"}, \"succeeded\": true, "
+             "\"responses\": [{\"response_range\": {\"kvs\": [" +
+                 KvJson("/some/key", "123", 6, 9) +
+                 "]}}, {\"response_range\": {}}]}");
+
+  SyncTask task(base_.get());
+  EtcdClient::GetResponse resp;
+  client_.Get(EtcdClient::Request("/some/key"), &resp, task.task());
+  task.Wait();
+  ASSERT_OK(task);
+  EXPECT_EQ(11, resp.etcd_index);
+  EXPECT_FALSE(resp.node.is_dir_);
+  EXPECT_EQ(6, resp.node.created_index_);
+  EXPECT_EQ(9, resp.node.modified_index_);
+  EXPECT_EQ("123", resp.node.value_);
+}
+
+
+TEST_F(EtcdV3Test, GetDir) {
+  ExpectCall("/kv/txn", {ToBase64("/some/"), ToBase64("/some0")}, 200,
+             "{\"header\": {\"revision\": \"20\"}, \"succeeded\": true, "
+             "\"responses\": [{\"response_range\": {}}, "
+             "{\"response_range\": {\"kvs\": [" +
+                 KvJson("/some/key1", "123", 6, 9) + ", " +
+                 KvJson("/some/sub/a", "456", 7, 7) + ", " +
+                 KvJson("/some/sub/b", "789", 8, 12) + "]}}]}");
+
+  SyncTask task(base_.get());
+  EtcdClient::GetResponse resp;
+  client_.Get(EtcdClient::Request("/some/"), &resp, task.task());
+  task.Wait();
+  ASSERT_OK(task);
+  EXPECT_EQ(20, resp.etcd_index);
+  EXPECT_TRUE(resp.node.is_dir_);
+  EXPECT_EQ("/some", resp.node.key_);
+  EXPECT_EQ(6, resp.node.created_index_);
+  EXPECT_EQ(12, resp.node.modified_index_);
+  ASSERT_EQ(static_cast<size_t>(2), resp.node.nodes_.size());
+  EXPECT_EQ("/some/key1", resp.node.nodes_[0].key_);
+  EXPECT_EQ("123", resp.node.nodes_[0].value_);
+  // Not recursive: the subdirectory is there, without its children.
+  EXPECT_EQ("/some/sub", resp.node.nodes_[1].key_);
+  EXPECT_TRUE(resp.node.nodes_[1].is_dir_);
+  EXPECT_TRUE(resp.node.nodes_[1].nodes_.empty());
+  EXPECT_EQ(12, resp.node.nodes_[1].modified_index_);
+}
+
+
+TEST_F(EtcdV3Test, GetNotFound) {
+  ExpectCall("/kv/txn", {}, 200,
+             "{\"header\": {\"revision\": \"17\"}, \"succeeded\": true, "
+             "\"responses\": [{\"response_range\": {}}, "
+             "{\"response_range\": {}}]}");
+
+  SyncTask task(base_.get());
+  EtcdClient::GetResponse resp;
+  client_.Get(EtcdClient::Request("/some/key"), &resp, task.task());
+  task.Wait();
+  EXPECT_THAT(task.status(),
+              StatusIs(util::error::NOT_FOUND, HasSubstr("/some/key")));
+  EXPECT_EQ(17, resp.etcd_index);
+}
+
+
+TEST_F(EtcdV3Test, Create) {
+  ExpectCall("/kv/txn", {"\"target\": \"CREATE\"", ToBase64("123")}, 200,
+             "{\"header\": {\"revision\": \"7\"}, \"succeeded\": true}");
+
+  SyncTask task(base_.get());
+  EtcdClient::Response resp;
+  client_.Create("/some/key", "123", &resp, task.task());
+  task.Wait();
+  EXPECT_OK(task);
+  EXPECT_EQ(7, resp.etcd_index);
+}
+
+
+TEST_F(EtcdV3Test, CreateFails) {
+  ExpectCall("/kv/txn", {"\"target\": \"CREATE\""}, 200,
+             "{\"header\": {\"revision\": \"7\"}}");
+
+  SyncTask task(base_.get());
+  EtcdClient::Response resp;
+  client_.Create("/some/key", "123", &resp, task.task());
+  task.Wait();
+  EXPECT_THAT(task.status(), StatusIs(util::error::FAILED_PRECONDITION));
+}
+
+
+TEST_F(EtcdV3Test, UpdateWithTTL) {
+  InSequence seq;
+  ExpectCall("/lease/grant", {"\"TTL\": 100"}, 200,
+             "{\"ID\": \"1234\", \"TTL\": \"100\"}");
+  ExpectCall("/kv/txn", {"\"mod_revision\": 5", "\"lease\": 1234"}, 200,
+             "{\"header\": {\"revision\": \"8\"}, \"succeeded\": true}");
+
+  SyncTask task(base_.get());
+  EtcdClient::Response resp;
+  client_.UpdateWithTTL("/some/key", "123", seconds(100), 5, &resp,
+                        task.task());
+  task.Wait();
+  EXPECT_OK(task);
+  EXPECT_EQ(8, resp.etcd_index);
+}
+
+
+TEST_F(EtcdV3Test, Txn) {
+  ExpectCall("/kv/txn", {ToBase64("/a"), ToBase64("/b"), ToBase64("/c"),
+                         "request_put", "request_delete_range"},
+             200, "{\"header\": {\"revision\": \"9\"}, \"succeeded\": true}");
+
+  SyncTask task(base_.get());
+  EtcdClient::Response resp;
+  client_.Txn({EtcdV3Client::Compare("/a", EtcdV3Client::Compare::Target::MOD,
+                                     3)},
+              {EtcdV3Client::Op::Put("/b", "x"),
+               EtcdV3Client::Op::Delete("/c")},
+              &resp, task.task());
+  task.Wait();
+  EXPECT_OK(task);
+  EXPECT_EQ(9, resp.etcd_index);
+}
+
+
+TEST_F(EtcdV3Test, ErrorFromGateway) {
+  ExpectCall("/kv/txn", {}, 400,
+             "{\"error\": \"etcdserver: too many operations in txn\", "
+             "\"code\": 3}");
+
+  SyncTask task(base_.get());
+  client_.ForceDelete("/some/key", task.task());
+  task.Wait();
+  EXPECT_THAT(task.status(), StatusIs(util::error::INVALID_ARGUMENT,
+                                      HasSubstr("too many operations")));
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -1,11 +1,16 @@
 #include "util/fake_etcd.h"
 
 #include <glog/logging.h>
+#include <algorithm>
 
 #include "util/json_wrapper.h"
 
 using std::bind;
+using std::chrono::duration;
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
 using std::chrono::seconds;
+using std::chrono::steady_clock;
 using std::chrono::system_clock;
 using std::function;
 using std::get;
@@ -67,18 +72,61 @@ string NormalizeKey(const string& input) {
 }
 
 
-bool WatchMatchesKey(const string& watch_key, const string& notify_key,
-                     bool recursive) {
-  if (watch_key == notify_key) {
-    return true;
-  }
+// The prefix of the keys under |key|, if it is a directory.
+string ChildrenPrefix(const string& key) {
+  return key == "/" ? key : key + "/";
+}
+
+
+bool HasPrefix(const string& key, const string& prefix) {
+  return key.compare(0, prefix.size(), prefix) == 0;
+}
 
-  if (!recursive) {
-    return false;
+
+// The first key after those starting with |prefix|, which ends with a
+// '/': the next character sorts right after it.
+string PrefixEnd(string prefix) {
+  CHECK_EQ(prefix.back(), '/');
+  prefix.back() = '/' + 1;
+  return prefix;
+}
+
+
+// Adds the children of the directory |node| to it, and theirs if
+// |recursive|, skipping over the entries under the children otherwise.
+void AddChildren(const map<string, EtcdClient::Node>& entries,
+                 bool recursive, EtcdClient::Node* node) {
+  CHECK(node->is_dir_);
+  const string key_prefix(ChildrenPrefix(node->key_));
+  auto it(entries.lower_bound(key_prefix));
+  while (it != entries.end() && HasPrefix(it->first, key_prefix)) {
+    const string::size_type slash(it->first.find('/', key_prefix.size()));
+    if (slash != string::npos) {
+      // Under a child directory (whose entries need not follow it, as
+      // "/a/b-c" sorts between "/a/b" and "/a/b/c").
+      it = entries.lower_bound(PrefixEnd(it->first.substr(0, slash + 1)));
+      continue;
+    }
+    node->nodes_.emplace_back(it->second);
+    if (recursive && it->second.is_dir_) {
+      AddChildren(entries, recursive, &node->nodes_.back());
+    }
+    ++it;
   }
+}
+
 
-  const string dir(watch_key + "/");
-  return watch_key == "/" || notify_key.compare(0, dir.size(), dir) == 0;
+// Returns "/", "/a", "/a/b" for "/a/b".
+vector<string> KeyAndParents(const string& key) {
+  vector<string> keys{"/"};
+  for (string::size_type slash = key.find('/', 1); slash != string::npos;
+       slash = key.find('/', slash + 1)) {
+    keys.emplace_back(key, 0, slash);
+  }
+  if (key != "/") {
+    keys.emplace_back(key);
+  }
+  return keys;
 }
 
 
@@ -105,7 +153,11 @@ const char* kStoreStats[] = {"setsFail",
 
 
 FakeEtcdClient::FakeEtcdClient(libevent::Base* base)
-    : base_(CHECK_NOTNULL(base)), parent_task_(base_), index_(1) {
+    : base_(CHECK_NOTNULL(base)),
+      parent_task_(base_),
+      index_(1),
+      simulated_latency_(steady_clock::duration::zero()),
+      max_ops_per_second_(0) {
   for (const auto& s : kStoreStats) {
     stats_[s] = 0;
   }
@@ -119,8 +171,49 @@ FakeEtcdClient::~FakeEtcdClient() {
 }
 
 
+void FakeEtcdClient::SetSimulatedLimits(const milliseconds& latency,
+                                        double max_ops_per_second) {
+  lock_guard<mutex> lock(mutex_);
+  simulated_latency_ = latency;
+  max_ops_per_second_ = max_ops_per_second;
+}
+
+
+void FakeEtcdClient::Schedule(Task* task, const function<void()>& op) {
+  steady_clock::duration delay(steady_clock::duration::zero());
+  {
+    lock_guard<mutex> lock(mutex_);
+    const steady_clock::time_point now(steady_clock::now());
+    steady_clock::time_point start(now + simulated_latency_);
+    if (max_ops_per_second_ > 0) {
+      start = std::max(start, next_op_start_);
+      next_op_start_ =
+          start + duration_cast<steady_clock::duration>(
+                      duration<double>(1 / max_ops_per_second_));
+    }
+    delay = start - now;
+  }
+
+  if (delay <= steady_clock::duration::zero()) {
+    op();
+    return;
+  }
+  base_->Delay(delay, task->AddChild([task, op](Task* timer) {
+    if (!timer->status().ok()) {
+      task->Return(timer->status());
+      return;
+    }
+    op();
+  }));
+}
+
+
 void FakeEtcdClient::DumpEntries(const unique_lock<mutex>& lock) const {
   CHECK(lock.owns_lock());
+  // Not even looked at otherwise, which matters with many entries.
+  if (!VLOG_IS_ON(1)) {
+    return;
+  }
   for (const auto& pair : entries_) {
     VLOG(1) << pair.second.ToString();
   }
@@ -135,10 +228,9 @@ void FakeEtcdClient::Watch(const string& rawkey, const WatchCallback& cb,
   map<string, Node>::const_iterator it(entries_.find(key));
   if (it != entries_.end()) {
     if (it->second.is_dir_) {
-      const string key_prefix(key + "/");
-      for (++it; it != entries_.end() &&
-                 it->first.compare(0, key_prefix.size(), key_prefix) == 0;
-           ++it) {
+      const string key_prefix(ChildrenPrefix(key));
+      for (it = entries_.lower_bound(key_prefix);
+           it != entries_.end() && HasPrefix(it->first, key_prefix); ++it) {
         CHECK(!it->second.deleted_);
         initial_updates.emplace_back(it->second);
       }
@@ -157,16 +249,18 @@ void FakeEtcdClient::Watch(const string& rawkey, const WatchCallback& cb,
 void FakeEtcdClient::PurgeExpiredEntriesWithLock(
     const unique_lock<mutex>& lock) {
   CHECK(lock.owns_lock());
-  for (auto it = entries_.begin(); it != entries_.end();) {
-    if (it->second.expires_ < system_clock::now()) {
+  const system_clock::time_point now(system_clock::now());
+  while (!expiries_.empty() && expiries_.begin()->first < now) {
+    const auto expiry(expiries_.begin());
+    const map<string, Node>::iterator it(entries_.find(expiry->second));
+    if (it != entries_.end() && it->second.expires_ == expiry->first) {
       VLOG(1) << "Deleting expired entry " << it->first;
       it->second.deleted_ = true;
       NotifyForPath(lock, it->first);
-      it = entries_.erase(it);
+      entries_.erase(it);
       ++stats_["expireCount"];
-    } else {
-      ++it;
     }
+    expiries_.erase(expiry);
   }
 }
 
@@ -185,22 +279,24 @@ void FakeEtcdClient::NotifyForPath(const unique_lock<mutex>& lock,
   CHECK(node_it != entries_.end());
   const Node& node(node_it->second);
 
-  const multimap<string, tuple<bool, GetResponse*, Task*>>::iterator last(
-      waiting_gets_.upper_bound(path));
-  multimap<string, tuple<bool, GetResponse*, Task*>>::iterator it;
-  for (it = waiting_gets_.begin(); it != last;) {
-    if (WatchMatchesKey(it->first, node.key_, get<0>(it->second))) {
-      get<1>(it->second)->node = node;
-      get<2>(it->second)->Return();
-      it = waiting_gets_.erase(it);
-    } else {
-      ++it;
+  // Only the waiting gets and watches of the path and of its parent
+  // directories can match.
+  for (const string& key : KeyAndParents(path)) {
+    const auto gets(waiting_gets_.equal_range(key));
+    for (auto it(gets.first); it != gets.second;) {
+      // The gets of a parent directory only match if recursive.
+      if (key == path || get<0>(it->second)) {
+        get<1>(it->second)->node = node;
+        get<2>(it->second)->Return();
+        it = waiting_gets_.erase(it);
+      } else {
+        ++it;
+      }
     }
-  }
 
-  for (const auto& pair : watches_) {
-    if (path.find(pair.first) == 0) {
-      for (const auto& cb_cookie : pair.second) {
+    const auto watches(watches_.find(key));
+    if (watches != watches_.end()) {
+      for (const auto& cb_cookie : watches->second) {
         ScheduleWatchCallback(lock, cb_cookie.second,
                               bind(cb_cookie.first, vector<Node>{node}));
       }
@@ -211,13 +307,17 @@ void FakeEtcdClient::NotifyForPath(const unique_lock<mutex>& lock,
 
 void FakeEtcdClient::Get(const Request& req, GetResponse* resp, Task* task) {
   VLOG(1) << "GET " << req.key;
-  const string key(NormalizeKey(req.key));
-
-  CHECK_NE(key, "/") << "not implemented";
+  CHECK_NE(NormalizeKey(req.key), "/") << "not implemented";
 
   task->CleanupWhenDone(
       bind(&FakeEtcdClient::UpdateOperationStats, this, "gets", task));
+  Schedule(task, bind(&FakeEtcdClient::InternalGet, this, req, resp, task));
+}
 
+
+void FakeEtcdClient::InternalGet(const Request& req, GetResponse* resp,
+                                 Task* task) {
+  const string key(NormalizeKey(req.key));
   unique_lock<mutex> lock(mutex_);
   PurgeExpiredEntriesWithLock(lock);
   resp->etcd_index = index_;
@@ -244,30 +344,8 @@ void FakeEtcdClient::Get(const Request& req, GetResponse* resp, Task* task) {
     return;
   }
   resp->node = it->second;
-  ++it;
-
-  vector<Node*> parent_nodes{&resp->node};
-  while (!parent_nodes.empty() && it != entries_.end()) {
-    const string key_prefix(parent_nodes.back()->key_ + "/");
-    if (it->first.compare(0, key_prefix.size(), key_prefix) > 0) {
-      parent_nodes.pop_back();
-      continue;
-    }
-
-    if (req.recursive) {
-      parent_nodes.back()->nodes_.emplace_back(it->second);
-
-      if (it->second.is_dir_) {
-        // The node we just added is now the current parent node.
-        parent_nodes.push_back(&parent_nodes.back()->nodes_.back());
-      }
-    } else {
-      if (it->first.find_first_of('/', key_prefix.size()) == string::npos) {
-        resp->node.nodes_.emplace_back(it->second);
-      }
-    }
-
-    ++it;
+  if (resp->node.is_dir_) {
+    AddChildren(entries_, req.recursive, &resp->node);
   }
   task->Return();
 }
@@ -343,6 +421,9 @@ void FakeEtcdClient::InternalPut(const string& rawkey, const string& value,
   }
 
   entries_[key] = node;
+  if (expires < system_clock::time_point::max()) {
+    expiries_.emplace(expires, key);
+  }
   resp->etcd_index = new_index;
   index_ = new_index;
   task->Return();
@@ -356,6 +437,35 @@ void FakeEtcdClient::InternalPut(const string& rawkey, const string& value,
 }
 
 
+void FakeEtcdClient::InternalRefresh(const string& rawkey,
+                                     const system_clock::time_point& expires,
+                                     Response* resp, Task* task) {
+  const string key(NormalizeKey(rawkey));
+  *resp = EtcdClient::Response();
+  unique_lock<mutex> lock(mutex_);
+  PurgeExpiredEntriesWithLock(lock);
+  const map<string, Node>::iterator entry(entries_.find(key));
+  if (entry == entries_.end() || entry->second.is_dir_) {
+    task->Return(Status(util::error::NOT_FOUND, "Node doesn't exist: " + key));
+    return;
+  }
+  if (entry->second.expires_ == system_clock::time_point::max()) {
+    task->Return(
+        Status(util::error::FAILED_PRECONDITION, key + " has no TTL"));
+    return;
+  }
+
+  // As with etcd, the watchers are not told.
+  entry->second.expires_ = expires;
+  expiries_.emplace(expires, key);
+  resp->etcd_index = entry->second.modified_index_;
+  task->Return();
+  const std::chrono::duration<double> delay(expires - system_clock::now());
+  base_->Delay(delay, parent_task_.task()->AddChild(
+                          bind(&FakeEtcdClient::PurgeExpiredEntries, this)));
+}
+
+
 void FakeEtcdClient::InternalDelete(const string& key,
                                     const int64_t current_index, Task* task) {
   VLOG(1) << "DELETE " << key;
@@ -405,8 +515,8 @@ void FakeEtcdClient::Create(const string& key, const string& value,
                             Response* resp, Task* task) {
   task->CleanupWhenDone(
       bind(&FakeEtcdClient::UpdateOperationStats, this, "create", task));
-  InternalPut(key, value, system_clock::time_point::max(), true, -1, resp,
-              task);
+  Schedule(task, bind(&FakeEtcdClient::InternalPut, this, key, value,
+                      system_clock::time_point::max(), true, -1, resp, task));
 }
 
 
@@ -415,7 +525,8 @@ void FakeEtcdClient::CreateWithTTL(const string& key, const string& value,
                                    Task* task) {
   task->CleanupWhenDone(
       bind(&FakeEtcdClient::UpdateOperationStats, this, "create", task));
-  InternalPut(key, value, system_clock::now() + ttl, true, -1, resp, task);
+  Schedule(task, bind(&FakeEtcdClient::InternalPut, this, key, value,
+                      system_clock::now() + ttl, true, -1, resp, task));
 }
 
 
@@ -424,8 +535,9 @@ void FakeEtcdClient::Update(const string& key, const string& value,
                             Task* task) {
   task->CleanupWhenDone(bind(&FakeEtcdClient::UpdateOperationStats, this,
                              "compareAndSwap", task));
-  InternalPut(key, value, system_clock::time_point::max(), false,
-              previous_index, resp, task);
+  Schedule(task, bind(&FakeEtcdClient::InternalPut, this, key, value,
+                      system_clock::time_point::max(), false, previous_index,
+                      resp, task));
 }
 
 
@@ -435,8 +547,9 @@ void FakeEtcdClient::UpdateWithTTL(const string& key, const string& value,
                                    Response* resp, Task* task) {
   task->CleanupWhenDone(bind(&FakeEtcdClient::UpdateOperationStats, this,
                              "compareAndSwap", task));
-  InternalPut(key, value, system_clock::now() + ttl, false, previous_index,
-              resp, task);
+  Schedule(task, bind(&FakeEtcdClient::InternalPut, this, key, value,
+                      system_clock::now() + ttl, false, previous_index, resp,
+                      task));
 }
 
 
@@ -444,8 +557,8 @@ void FakeEtcdClient::ForceSet(const string& key, const string& value,
                               Response* resp, Task* task) {
   task->CleanupWhenDone(
       bind(&FakeEtcdClient::UpdateOperationStats, this, "sets", task));
-  InternalPut(key, value, system_clock::time_point::max(), false, -1, resp,
-              task);
+  Schedule(task, bind(&FakeEtcdClient::InternalPut, this, key, value,
+                      system_clock::time_point::max(), false, -1, resp, task));
 }
 
 
@@ -455,19 +568,30 @@ void FakeEtcdClient::ForceSetWithTTL(const std::string& key,
                                      Response* resp, util::Task* task) {
   task->CleanupWhenDone(
       bind(&FakeEtcdClient::UpdateOperationStats, this, "sets", task));
-  InternalPut(key, value, system_clock::now() + ttl, false, -1, resp, task);
+  Schedule(task, bind(&FakeEtcdClient::InternalPut, this, key, value,
+                      system_clock::now() + ttl, false, -1, resp, task));
+}
+
+
+void FakeEtcdClient::RefreshTTL(const string& key, const seconds& ttl,
+                                Response* resp, Task* task) {
+  task->CleanupWhenDone(
+      bind(&FakeEtcdClient::UpdateOperationStats, this, "refresh", task));
+  Schedule(task, bind(&FakeEtcdClient::InternalRefresh, this, key,
+                      system_clock::now() + ttl, resp, task));
 }
 
 
 void FakeEtcdClient::Delete(const string& key, const int64_t current_index,
                             Task* task) {
   CHECK_GT(current_index, 0);
-  InternalDelete(key, current_index, task);
+  Schedule(task, bind(&FakeEtcdClient::InternalDelete, this, key,
+                      current_index, task));
 }
 
 
 void FakeEtcdClient::ForceDelete(const string& key, Task* task) {
-  InternalDelete(key, 0, task);
+  Schedule(task, bind(&FakeEtcdClient::InternalDelete, this, key, 0, task));
 }
 
 
@@ -1,11 +1,14 @@
 #ifndef CERT_TRANS_UTIL_FAKE_ETCD_H_
 #define CERT_TRANS_UTIL_FAKE_ETCD_H_
 
+#include <chrono>
 #include <deque>
+#include <functional>
 #include <map>
 #include <queue>
 #include <string>
 #include <tuple>
+#include <vector>
 
 #include "util/etcd.h"
 #include "util/libevent_wrapper.h"
@@ -16,12 +19,26 @@
 namespace cert_trans {
 
 
+// An in-memory etcd, for tests and benchmarks. The keys are kept in
+// order, so that the keys under a directory are next to each other: a
+// listing only visits the children of the directory (skipping their
+// own children, unless recursive), and a change is only matched
+// against the watches and waiting gets of its key and of the
+// directories above it.
 class FakeEtcdClient : public EtcdClient {
  public:
   explicit FakeEtcdClient(libevent::Base* base);
 
   virtual ~FakeEtcdClient();
 
+  // Simulates the time taken by a real etcd: each operation (other
+  // than Watch() and GetStoreStats()) starts |latency| after it is
+  // requested, and, if |max_ops_per_second| is positive, no sooner
+  // than 1 / |max_ops_per_second| after the previous one. Both are off
+  // by default, so that the operations are done right away.
+  void SetSimulatedLimits(const std::chrono::milliseconds& latency,
+                          double max_ops_per_second);
+
   void Get(const Request& req, GetResponse* resp, util::Task* task) override;
 
   void Create(const std::string& key, const std::string& value, Response* resp,
@@ -47,6 +64,9 @@ class FakeEtcdClient : public EtcdClient {
                        const std::chrono::seconds& ttl, Response* resp,
                        util::Task* task) override;
 
+  void RefreshTTL(const std::string& key, const std::chrono::seconds& ttl,
+                  Response* resp, util::Task* task) override;
+
   void Delete(const std::string& key, const int64_t current_index,
               util::Task* task) override;
 
@@ -61,6 +81,9 @@ class FakeEtcdClient : public EtcdClient {
              util::Task* task) override;
 
  private:
+  // Runs |op| for |task| now, or once the simulated limits allow it.
+  void Schedule(util::Task* task, const std::function<void()>& op);
+
   void DumpEntries(const std::unique_lock<std::mutex>& lock) const;
 
   void PurgeExpiredEntriesWithLock(const std::unique_lock<std::mutex>& lock);
@@ -69,11 +92,17 @@ class FakeEtcdClient : public EtcdClient {
   void NotifyForPath(const std::unique_lock<std::mutex>& lock,
                      const std::string& path);
 
+  void InternalGet(const Request& req, GetResponse* resp, util::Task* task);
+
   void InternalPut(const std::string& rawkey, const std::string& value,
                    const std::chrono::system_clock::time_point& expires,
                    bool create, int64_t prev_index, Response* resp,
                    util::Task* task);
 
+  void InternalRefresh(const std::string& rawkey,
+                       const std::chrono::system_clock::time_point& expires,
+                       Response* resp, util::Task* task);
+
   void InternalDelete(const std::string& key, const int64_t current_index,
                       util::Task* task);
 
@@ -94,6 +123,10 @@ class FakeEtcdClient : public EtcdClient {
   std::mutex mutex_;
   int64_t index_;
   std::map<std::string, Node> entries_;
+  // The keys of |entries_| which expire, by expiry time. A key can also
+  // be here with the time it had before an update, or after it was
+  // deleted, which is ignored.
+  std::multimap<std::chrono::system_clock::time_point, std::string> expiries_;
   std::multimap<std::string, std::tuple<bool, GetResponse*, util::Task*>>
       waiting_gets_;
   std::map<std::string, std::vector<std::pair<WatchCallback, util::Task*>>>
@@ -101,6 +134,11 @@ class FakeEtcdClient : public EtcdClient {
   std::deque<std::pair<util::Task*, std::function<void()>>> watches_callbacks_;
   std::map<std::string, int64_t> stats_;
 
+  std::chrono::steady_clock::duration simulated_latency_;
+  double max_ops_per_second_;
+  // When the next operation may start, with |max_ops_per_second_|.
+  std::chrono::steady_clock::time_point next_op_start_;
+
   friend class ElectionTest;
 };
 
@@ -27,7 +27,9 @@ namespace cert_trans {
 
 using std::bind;
 using std::chrono::duration;
+using std::chrono::milliseconds;
 using std::chrono::seconds;
+using std::chrono::steady_clock;
 using std::deque;
 using std::function;
 using std::lock_guard;
@@ -151,6 +153,14 @@ class FakeEtcdTest : public ::testing::Test {
     return task.status();
   }
 
+  Status BlockingRefreshTTL(const string& key, const seconds& ttl) {
+    SyncTask task(base_.get());
+    EtcdClient::Response resp;
+    client_->RefreshTTL(key, ttl, &resp, task.task());
+    task.Wait();
+    return task.status();
+  }
+
   Status BlockingDelete(const string& key, int64_t previous_index) {
     SyncTask task(base_.get());
     client_->Delete(key, previous_index, task.task());
@@ -684,6 +694,95 @@ TEST_F(FakeEtcdTest, WatcherWithTTLExpires) {
 }
 
 
+TEST_F(FakeEtcdTest, RefreshTTL) {
+  const string kDir(key_prefix_);
+  const string kPath(kDir + "/subkey");
+  const seconds kTtl(3);
+  EXPECT_THAT(BlockingRefreshTTL(kPath, kTtl),
+              StatusIs(util::error::NOT_FOUND));
+  int64_t created_index;
+  EXPECT_OK(BlockingCreateWithTTL(kPath, kValue, kTtl, &created_index));
+
+  StrictMock<MockFunction<void(const vector<EtcdClient::Node>&)>> watcher;
+  Notification initial;
+  EXPECT_CALL(watcher,
+              Call(ElementsAre(EtcdClientNodeIs(kPath, "value", false))))
+      .WillOnce(InvokeWithoutArgs(&initial, &Notification::Notify));
+
+  util::SyncTask watch_task(base_.get());
+  client_->Watch(
+      kDir, bind(&MockFunction<void(const vector<EtcdClient::Node>&)>::Call,
+                 &watcher, _1),
+      watch_task.task());
+
+  ASSERT_TRUE(initial.WaitForNotificationWithTimeout(seconds(1)));
+  Mock::VerifyAndClearExpectations(&watcher);
+
+  // The refreshes keep the key past its first TTL, and the watcher is
+  // not told about them.
+  sleep_for(seconds(2));
+  EXPECT_OK(BlockingRefreshTTL(kPath, kTtl));
+  sleep_for(seconds(2));
+  EtcdClient::Node node;
+  EXPECT_OK(BlockingGet(kPath, &node));
+  EXPECT_EQ(kValue, node.value_);
+  EXPECT_EQ(created_index, node.modified_index_);
+
+  Notification expired;
+  EXPECT_CALL(watcher, Call(ElementsAre(EtcdClientNodeIs(kPath, _, true))))
+      .WillOnce(InvokeWithoutArgs(&expired, &Notification::Notify));
+
+  EXPECT_TRUE(expired.WaitForNotificationWithTimeout(kTtl + seconds(1)));
+
+  watch_task.Cancel();
+  watch_task.Wait();
+  EXPECT_THAT(watch_task.status(), StatusIs(util::error::CANCELLED));
+}
+
+
+TEST_F(FakeEtcdTest, CoalescedWatcher) {
+  const string kDir(key_prefix_);
+  const string kPath1(kDir + "/1");
+  const string kPath2(kDir + "/2");
+  int64_t index1;
+  EXPECT_OK(BlockingCreate(kPath1, kValue, &index1));
+
+  StrictMock<MockFunction<void(const vector<EtcdClient::Node>&)>> watcher;
+  Notification initial;
+  EXPECT_CALL(watcher,
+              Call(ElementsAre(EtcdClientNodeIs(kPath1, kValue, false))))
+      .WillOnce(InvokeWithoutArgs(&initial, &Notification::Notify));
+
+  util::SyncTask watch_task(base_.get());
+  client_->CoalescedWatch(
+      kDir, bind(&MockFunction<void(const vector<EtcdClient::Node>&)>::Call,
+                 &watcher, _1),
+      milliseconds(500), watch_task.task());
+
+  ASSERT_TRUE(initial.WaitForNotificationWithTimeout(seconds(1)));
+  Mock::VerifyAndClearExpectations(&watcher);
+
+  // The changes within the window come together, the latest for each
+  // key only.
+  Notification second;
+  EXPECT_CALL(watcher,
+              Call(ElementsAre(EtcdClientNodeIs(kPath1, kValue2, false),
+                               EtcdClientNodeIs(kPath2, kValue, false))))
+      .WillOnce(InvokeWithoutArgs(&second, &Notification::Notify));
+
+  EXPECT_OK(BlockingUpdate(kPath1, "intermediate", index1, &index1));
+  int64_t index2;
+  EXPECT_OK(BlockingCreate(kPath2, kValue, &index2));
+  EXPECT_OK(BlockingUpdate(kPath1, kValue2, index1, &index1));
+
+  EXPECT_TRUE(second.WaitForNotificationWithTimeout(seconds(2)));
+
+  watch_task.Cancel();
+  watch_task.Wait();
+  EXPECT_THAT(watch_task.status(), StatusIs(util::error::CANCELLED));
+}
+
+
 TEST_F(FakeEtcdTest, PutUnderNonDir) {
   const string kPath1(key_prefix_);
   const string kPath2(kPath1 + "/subkey");
@@ -755,6 +854,104 @@ TEST_F(FakeEtcdTest, GetDirRecursive) {
 }
 
 
+TEST_F(FakeEtcdTest, GetDirWithSimilarKeys) {
+  const string kDir(key_prefix_);
+  int64_t created_index;
+  // "/b-c" sorts between "/b" and "/b/x".
+  EXPECT_OK(BlockingCreate(kDir + "/b/x", kValue, &created_index));
+  EXPECT_OK(BlockingCreate(kDir + "/b-c/y", kValue, &created_index));
+  EXPECT_OK(BlockingCreate(kDir + "/b0", kValue, &created_index));
+
+  SyncTask task(base_.get());
+  EtcdClient::Request req(kDir);
+  EtcdClient::GetResponse resp;
+  client_->Get(req, &resp, task.task());
+  task.Wait();
+  EXPECT_OK(task);
+  ASSERT_EQ(static_cast<size_t>(3), resp.node.nodes_.size());
+  EXPECT_EQ(kDir + "/b", resp.node.nodes_[0].key_);
+  EXPECT_EQ(kDir + "/b-c", resp.node.nodes_[1].key_);
+  EXPECT_EQ(kDir + "/b0", resp.node.nodes_[2].key_);
+
+  SyncTask recursive_task(base_.get());
+  req.recursive = true;
+  client_->Get(req, &resp, recursive_task.task());
+  recursive_task.Wait();
+  EXPECT_OK(recursive_task);
+  ASSERT_EQ(static_cast<size_t>(3), resp.node.nodes_.size());
+  ASSERT_EQ(static_cast<size_t>(1), resp.node.nodes_[0].nodes_.size());
+  EXPECT_EQ(kDir + "/b/x", resp.node.nodes_[0].nodes_[0].key_);
+  ASSERT_EQ(static_cast<size_t>(1), resp.node.nodes_[1].nodes_.size());
+  EXPECT_EQ(kDir + "/b-c/y", resp.node.nodes_[1].nodes_[0].key_);
+  EXPECT_TRUE(resp.node.nodes_[2].nodes_.empty());
+}
+
+
+TEST_F(FakeEtcdTest, WatcherIgnoresSimilarKeys) {
+  const string kDir(key_prefix_ + "/dir");
+  const string kPath(kDir + "/1");
+
+  StrictMock<MockFunction<void(const vector<EtcdClient::Node>&)>> watcher;
+  Notification initial;
+  EXPECT_CALL(watcher, Call(ElementsAre()))
+      .WillOnce(InvokeWithoutArgs(&initial, &Notification::Notify));
+
+  util::SyncTask watch_task(base_.get());
+  client_->Watch(
+      kDir, bind(&MockFunction<void(const vector<EtcdClient::Node>&)>::Call,
+                 &watcher, _1),
+      watch_task.task());
+
+  ASSERT_TRUE(initial.WaitForNotificationWithTimeout(seconds(1)));
+  Mock::VerifyAndClearExpectations(&watcher);
+
+  Notification second;
+  EXPECT_CALL(watcher,
+              Call(ElementsAre(EtcdClientNodeIs(kPath, kValue, false))))
+      .WillOnce(InvokeWithoutArgs(&second, &Notification::Notify));
+
+  // Not under |kDir|, even though it starts with it.
+  int64_t created_index;
+  EXPECT_OK(BlockingCreate(kDir + "ectory", kValue2, &created_index));
+  EXPECT_OK(BlockingCreate(kPath, kValue, &created_index));
+
+  EXPECT_TRUE(second.WaitForNotificationWithTimeout(seconds(1)));
+
+  watch_task.Cancel();
+  watch_task.Wait();
+  EXPECT_THAT(watch_task.status(), StatusIs(util::error::CANCELLED));
+}
+
+
+// This test is not expected to pass with the real etcd, it tests an
+// aspect specific to the fake implementation.
+TEST_F(FakeEtcdTest, SimulatedLimits) {
+  FakeEtcdClient client(base_.get());
+  client.SetSimulatedLimits(milliseconds(100), 20);
+
+  const steady_clock::time_point start(steady_clock::now());
+  const int kNumOps(5);
+  vector<unique_ptr<SyncTask>> tasks;
+  vector<EtcdClient::Response> resps(kNumOps);
+  for (int i = 0; i < kNumOps; ++i) {
+    tasks.emplace_back(new SyncTask(base_.get()));
+    client.Create(key_prefix_ + "/" + std::to_string(i), kValue, &resps[i],
+                  tasks.back()->task());
+  }
+  for (const auto& task : tasks) {
+    task->Wait();
+    EXPECT_OK(task->status());
+  }
+
+  // The latency, and then one operation every 50ms.
+  EXPECT_GE(steady_clock::now() - start,
+            milliseconds(100 + (kNumOps - 1) * 50));
+  for (int i = 1; i < kNumOps; ++i) {
+    EXPECT_EQ(resps[i - 1].etcd_index + 1, resps[i].etcd_index);
+  }
+}
+
+
 // This test is not expected to pass with the real etcd, it tests an
 // aspect specific to the fake implementation.
 TEST_F(FakeEtcdTest, GetWaitOldIndex) {
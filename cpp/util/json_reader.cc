@@ -0,0 +1,403 @@
+#include "util/json_reader.h"
+
+#include <glog/logging.h>
+#include <string.h>
+
+using std::string;
+
+namespace util {
+namespace {
+
+
+const uint64_t kMaxInt64 = 0x7fffffffffffffffULL;
+
+
+bool IsWhitespace(char c) {
+  return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+
+bool IsDigit(char c) {
+  return c >= '0' && c <= '9';
+}
+
+
+int HexValue(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+
+void AppendUtf8(uint32_t code_point, string* out) {
+  if (code_point < 0x80) {
+    out->push_back(static_cast<char>(code_point));
+  } else if (code_point < 0x800) {
+    out->push_back(static_cast<char>(0xc0 | (code_point >> 6)));
+    out->push_back(static_cast<char>(0x80 | (code_point & 0x3f)));
+  } else if (code_point < 0x10000) {
+    out->push_back(static_cast<char>(0xe0 | (code_point >> 12)));
+    out->push_back(static_cast<char>(0x80 | ((code_point >> 6) & 0x3f)));
+    out->push_back(static_cast<char>(0x80 | (code_point & 0x3f)));
+  } else {
+    out->push_back(static_cast<char>(0xf0 | (code_point >> 18)));
+    out->push_back(static_cast<char>(0x80 | ((code_point >> 12) & 0x3f)));
+    out->push_back(static_cast<char>(0x80 | ((code_point >> 6) & 0x3f)));
+    out->push_back(static_cast<char>(0x80 | (code_point & 0x3f)));
+  }
+}
+
+
+}  // namespace
+
+
+JsonReader::JsonReader(const char* data, size_t size)
+    : pos_(data), end_(data + size), ok_(true) {
+}
+
+
+JsonReader::Type JsonReader::PeekType() {
+  SkipWhitespace();
+  if (!ok_ || pos_ == end_) {
+    return Type::INVALID;
+  }
+  switch (*pos_) {
+    case '{':
+      return Type::OBJECT;
+    case '[':
+      return Type::ARRAY;
+    case '"':
+      return Type::STRING;
+    case 't':
+    case 'f':
+      return Type::BOOLEAN;
+    case 'n':
+      return Type::NUL;
+    default:
+      return *pos_ == '-' || IsDigit(*pos_) ? Type::NUMBER : Type::INVALID;
+  }
+}
+
+
+bool JsonReader::EnterObject() {
+  if (!Expect('{')) {
+    return false;
+  }
+  first_.push_back(true);
+  return true;
+}
+
+
+bool JsonReader::NextMember(string* name) {
+  CHECK(!first_.empty());
+  SkipWhitespace();
+  if (!ok_) {
+    return false;
+  }
+  if (pos_ != end_ && *pos_ == '}') {
+    ++pos_;
+    first_.pop_back();
+    return false;
+  }
+  if (!first_.back() && !Expect(',')) {
+    return false;
+  }
+  first_.back() = false;
+  return ReadString(name) && Expect(':');
+}
+
+
+bool JsonReader::EnterArray() {
+  if (!Expect('[')) {
+    return false;
+  }
+  first_.push_back(true);
+  return true;
+}
+
+
+bool JsonReader::NextElement() {
+  CHECK(!first_.empty());
+  SkipWhitespace();
+  if (!ok_) {
+    return false;
+  }
+  if (pos_ != end_ && *pos_ == ']') {
+    ++pos_;
+    first_.pop_back();
+    return false;
+  }
+  if (!first_.back() && !Expect(',')) {
+    return false;
+  }
+  first_.back() = false;
+  return true;
+}
+
+
+bool JsonReader::ReadString(string* value) {
+  if (!Expect('"')) {
+    return false;
+  }
+  value->clear();
+  while (true) {
+    // Copy the run of plain characters in one go.
+    const char* run(pos_);
+    while (pos_ != end_ && *pos_ != '"' && *pos_ != '\\' &&
+           static_cast<unsigned char>(*pos_) >= 0x20) {
+      ++pos_;
+    }
+    value->append(run, pos_ - run);
+
+    if (pos_ == end_) {
+      return Fail();
+    }
+    if (*pos_ == '"') {
+      ++pos_;
+      return true;
+    }
+    if (*pos_ != '\\') {
+      // Unescaped control character.
+      return Fail();
+    }
+
+    ++pos_;
+    if (pos_ == end_) {
+      return Fail();
+    }
+    const char escaped(*pos_++);
+    switch (escaped) {
+      case '"':
+      case '\\':
+      case '/':
+        value->push_back(escaped);
+        break;
+      case 'b':
+        value->push_back('\b');
+        break;
+      case 'f':
+        value->push_back('\f');
+        break;
+      case 'n':
+        value->push_back('\n');
+        break;
+      case 'r':
+        value->push_back('\r');
+        break;
+      case 't':
+        value->push_back('\t');
+        break;
+      case 'u': {
+        uint32_t code_point;
+        if (!ReadHex4(&code_point)) {
+          return false;
+        }
+        if (code_point >= 0xd800 && code_point < 0xdc00) {
+          // A UTF-16 surrogate pair.
+          uint32_t low;
+          if (!ExpectLiteral("\\u", 2) || !ReadHex4(&low) || low < 0xdc00 ||
+              low >= 0xe000) {
+            return Fail();
+          }
+          code_point =
+              0x10000 + ((code_point - 0xd800) << 10) + (low - 0xdc00);
+        } else if (code_point >= 0xdc00 && code_point < 0xe000) {
+          return Fail();
+        }
+        AppendUtf8(code_point, value);
+        break;
+      }
+      default:
+        return Fail();
+    }
+  }
+}
+
+
+bool JsonReader::ReadInt64(int64_t* value) {
+  if (PeekType() != Type::NUMBER) {
+    return Fail();
+  }
+  const bool negative(*pos_ == '-');
+  if (negative) {
+    ++pos_;
+  }
+  if (pos_ == end_ || !IsDigit(*pos_) ||
+      (*pos_ == '0' && pos_ + 1 != end_ && IsDigit(pos_[1]))) {
+    return Fail();
+  }
+
+  const uint64_t limit(negative ? kMaxInt64 + 1 : kMaxInt64);
+  uint64_t result(0);
+  while (pos_ != end_ && IsDigit(*pos_)) {
+    const uint64_t digit(*pos_ - '0');
+    if (result > (limit - digit) / 10) {
+      return Fail();
+    }
+    result = result * 10 + digit;
+    ++pos_;
+  }
+  if (pos_ != end_ && (*pos_ == '.' || *pos_ == 'e' || *pos_ == 'E')) {
+    // Not an integer.
+    return Fail();
+  }
+
+  *value = negative ? static_cast<int64_t>(0 - result)
+                    : static_cast<int64_t>(result);
+  return true;
+}
+
+
+bool JsonReader::ReadBool(bool* value) {
+  if (PeekType() != Type::BOOLEAN) {
+    return Fail();
+  }
+  *value = *pos_ == 't';
+  return *value ? ExpectLiteral("true", 4) : ExpectLiteral("false", 5);
+}
+
+
+bool JsonReader::ReadNull() {
+  if (PeekType() != Type::NUL) {
+    return Fail();
+  }
+  return ExpectLiteral("null", 4);
+}
+
+
+bool JsonReader::Skip() {
+  switch (PeekType()) {
+    case Type::OBJECT:
+    case Type::ARRAY:
+      return SkipContainer();
+    case Type::STRING: {
+      // Only the end of the string is needed, not its value.
+      ++pos_;
+      while (pos_ != end_ && *pos_ != '"') {
+        if (*pos_ == '\\') {
+          ++pos_;
+          if (pos_ == end_) {
+            break;
+          }
+        }
+        ++pos_;
+      }
+      return Expect('"');
+    }
+    case Type::NUMBER:
+      return SkipNumber();
+    case Type::BOOLEAN: {
+      bool unused;
+      return ReadBool(&unused);
+    }
+    case Type::NUL:
+      return ReadNull();
+    case Type::INVALID:
+      break;
+  }
+  return Fail();
+}
+
+
+bool JsonReader::Finish() {
+  SkipWhitespace();
+  if (!ok_ || !first_.empty() || pos_ != end_) {
+    return Fail();
+  }
+  return true;
+}
+
+
+void JsonReader::SkipWhitespace() {
+  while (pos_ != end_ && IsWhitespace(*pos_)) {
+    ++pos_;
+  }
+}
+
+
+bool JsonReader::Fail() {
+  ok_ = false;
+  return false;
+}
+
+
+bool JsonReader::Expect(char c) {
+  SkipWhitespace();
+  if (!ok_ || pos_ == end_ || *pos_ != c) {
+    return Fail();
+  }
+  ++pos_;
+  return true;
+}
+
+
+bool JsonReader::ExpectLiteral(const char* literal, size_t size) {
+  if (!ok_ || static_cast<size_t>(end_ - pos_) < size ||
+      memcmp(pos_, literal, size) != 0) {
+    return Fail();
+  }
+  pos_ += size;
+  return true;
+}
+
+
+bool JsonReader::ReadHex4(uint32_t* value) {
+  if (end_ - pos_ < 4) {
+    return Fail();
+  }
+  uint32_t result(0);
+  for (int i = 0; i < 4; ++i) {
+    const int digit(HexValue(*pos_++));
+    if (digit < 0) {
+      return Fail();
+    }
+    result = (result << 4) | digit;
+  }
+  *value = result;
+  return true;
+}
+
+
+bool JsonReader::SkipNumber() {
+  const char* const start(pos_);
+  while (pos_ != end_ && (IsDigit(*pos_) || *pos_ == '-' || *pos_ == '+' ||
+                          *pos_ == '.' || *pos_ == 'e' || *pos_ == 'E')) {
+    ++pos_;
+  }
+  return pos_ != start || Fail();
+}
+
+
+// Skipped objects and arrays are only checked for balanced brackets
+// outside of strings, which is enough to find where they end.
+bool JsonReader::SkipContainer() {
+  int depth(0);
+  while (pos_ != end_) {
+    const char c(*pos_);
+    if (c == '"') {
+      if (!Skip()) {
+        return false;
+      }
+      continue;
+    }
+    ++pos_;
+    if (c == '{' || c == '[') {
+      ++depth;
+    } else if (c == '}' || c == ']') {
+      if (--depth == 0) {
+        return true;
+      }
+    }
+  }
+  return Fail();
+}
+
+
+}  // namespace util
@@ -0,0 +1,116 @@
+#ifndef CERT_TRANS_UTIL_JSON_READER_H_
+#define CERT_TRANS_UTIL_JSON_READER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace util {
+
+
+// A pull parser for JSON, which reads values straight from the buffer
+// as the caller asks for them, without building a tree. It is meant for
+// large responses of which only some fields are needed (etcd directory
+// listings, get-entries pages): members the caller is not interested
+// in are skipped over with Skip().
+//
+// Typical use, for {"entries": [{"leaf_input": "..."}, ...]}:
+//
+//   JsonReader reader(body);
+//   string name;
+//   if (!reader.EnterObject()) return error;
+//   while (reader.NextMember(&name)) {
+//     if (name != "entries") {
+//       reader.Skip();
+//       continue;
+//     }
+//     if (!reader.EnterArray()) return error;
+//     while (reader.NextElement()) {
+//       ...
+//     }
+//   }
+//   if (!reader.Finish()) return error;
+//
+// Once anything fails, including on malformed input, the reader stays
+// in error and all the calls return false, so errors need only be
+// checked with ok() or Finish() at the end. The buffer must outlive
+// the reader.
+//
+// This class is not thread-safe.
+class JsonReader {
+ public:
+  enum class Type {
+    INVALID,
+    OBJECT,
+    ARRAY,
+    STRING,
+    NUMBER,
+    BOOLEAN,
+    NUL,
+  };
+
+  JsonReader(const char* data, size_t size);
+  explicit JsonReader(const std::string& data)
+      : JsonReader(data.data(), data.size()) {
+  }
+  // The reader does not copy its input, which would not outlive it.
+  explicit JsonReader(std::string&& data) = delete;
+  JsonReader(const JsonReader&) = delete;
+  JsonReader& operator=(const JsonReader&) = delete;
+
+  bool ok() const {
+    return ok_;
+  }
+
+  // The type of the next value, INVALID in error or at the end of an
+  // object or array.
+  Type PeekType();
+
+  // Enters an object. NextMember() then returns true with the name of
+  // each member, whose value must be read (or skipped) before the next
+  // call, and false once the object is done.
+  bool EnterObject();
+  bool NextMember(std::string* name);
+
+  // Enters an array. NextElement() then returns true before each
+  // element, which must be read (or skipped) before the next call, and
+  // false once the array is done.
+  bool EnterArray();
+  bool NextElement();
+
+  // These fail, and put the reader in error, if the next value is not
+  // of the right type. ReadInt64() only accepts integers.
+  bool ReadString(std::string* value);
+  bool ReadInt64(int64_t* value);
+  bool ReadBool(bool* value);
+  bool ReadNull();
+
+  // Skips the next value, whatever its type.
+  bool Skip();
+
+  // Returns true if the input was well-formed up to here, and all that
+  // is left is whitespace.
+  bool Finish();
+
+ private:
+  void SkipWhitespace();
+  bool Fail();
+  bool Expect(char c);
+  bool ExpectLiteral(const char* literal, size_t size);
+  bool ReadHex4(uint32_t* value);
+  bool SkipNumber();
+  bool SkipContainer();
+
+  const char* pos_;
+  const char* const end_;
+  bool ok_;
+  // For each object or array entered, whether no member or element has
+  // been read yet (and so no comma is expected).
+  std::vector<bool> first_;
+};
+
+
+}  // namespace util
+
+#endif  // CERT_TRANS_UTIL_JSON_READER_H_
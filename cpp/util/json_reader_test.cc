@@ -0,0 +1,210 @@
+#include "util/json_reader.h"
+
+#include <gtest/gtest.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "util/testing.h"
+
+using std::string;
+using std::vector;
+
+namespace util {
+namespace {
+
+
+TEST(JsonReaderTest, ReadsObject) {
+  const string json(
+      " {\"key\": \"/a\", \"index\": 42, \"dir\": true, \"ttl\": null,"
+      " \"nodes\": [{\"key\": \"/a/b\"}, {\"key\": \"/a/c\"}]} ");
+  JsonReader reader(json);
+  string key;
+  int64_t index(0);
+  bool dir(false);
+  vector<string> sub_keys;
+
+  string name;
+  ASSERT_TRUE(reader.EnterObject());
+  while (reader.NextMember(&name)) {
+    if (name == "key") {
+      EXPECT_TRUE(reader.ReadString(&key));
+    } else if (name == "index") {
+      EXPECT_TRUE(reader.ReadInt64(&index));
+    } else if (name == "dir") {
+      EXPECT_TRUE(reader.ReadBool(&dir));
+    } else if (name == "ttl") {
+      EXPECT_EQ(JsonReader::Type::NUL, reader.PeekType());
+      EXPECT_TRUE(reader.ReadNull());
+    } else if (name == "nodes") {
+      ASSERT_TRUE(reader.EnterArray());
+      while (reader.NextElement()) {
+        ASSERT_TRUE(reader.EnterObject());
+        ASSERT_TRUE(reader.NextMember(&name));
+        EXPECT_EQ("key", name);
+        sub_keys.emplace_back();
+        EXPECT_TRUE(reader.ReadString(&sub_keys.back()));
+        EXPECT_FALSE(reader.NextMember(&name));
+      }
+    } else {
+      ADD_FAILURE() << "unexpected member " << name;
+    }
+  }
+  EXPECT_TRUE(reader.Finish());
+
+  EXPECT_EQ("/a", key);
+  EXPECT_EQ(42, index);
+  EXPECT_TRUE(dir);
+  EXPECT_EQ((vector<string>{"/a/b", "/a/c"}), sub_keys);
+}
+
+
+TEST(JsonReaderTest, EmptyContainers) {
+  const string json("{\"a\": [], \"b\": {}}");
+  JsonReader reader(json);
+  string name;
+  ASSERT_TRUE(reader.EnterObject());
+  ASSERT_TRUE(reader.NextMember(&name));
+  EXPECT_EQ("a", name);
+  ASSERT_TRUE(reader.EnterArray());
+  EXPECT_FALSE(reader.NextElement());
+  ASSERT_TRUE(reader.NextMember(&name));
+  EXPECT_EQ("b", name);
+  ASSERT_TRUE(reader.EnterObject());
+  EXPECT_FALSE(reader.NextMember(&name));
+  EXPECT_FALSE(reader.NextMember(&name));
+  EXPECT_TRUE(reader.Finish());
+}
+
+
+TEST(JsonReaderTest, Skip) {
+  const string json(
+      "{\"skip\": {\"x\": [1, -2.5e3, \"]}\\\"\", {\"y\": false}], \"z\": {}},"
+      " \"also\": \"str\", \"num\": 1.5E-2, \"t\": true, \"n\": null,"
+      " \"want\": 7}");
+  JsonReader reader(json);
+  int64_t want(0);
+  string name;
+  ASSERT_TRUE(reader.EnterObject());
+  while (reader.NextMember(&name)) {
+    if (name == "want") {
+      EXPECT_TRUE(reader.ReadInt64(&want));
+    } else {
+      EXPECT_TRUE(reader.Skip()) << name;
+    }
+  }
+  EXPECT_TRUE(reader.Finish());
+  EXPECT_EQ(7, want);
+}
+
+
+TEST(JsonReaderTest, Escapes) {
+  const string json(
+      "[\"a\\\"b\\\\c\\/d\\b\\f\\n\\r\\t\", \"\\u0041\\u00e9\\u20ac\","
+      " \"\\ud83d\\ude00\"]");
+  JsonReader reader(json);
+  string value;
+  ASSERT_TRUE(reader.EnterArray());
+  ASSERT_TRUE(reader.NextElement());
+  ASSERT_TRUE(reader.ReadString(&value));
+  EXPECT_EQ("a\"b\\c/d\b\f\n\r\t", value);
+  ASSERT_TRUE(reader.NextElement());
+  ASSERT_TRUE(reader.ReadString(&value));
+  EXPECT_EQ("A\xc3\xa9\xe2\x82\xac", value);
+  ASSERT_TRUE(reader.NextElement());
+  ASSERT_TRUE(reader.ReadString(&value));
+  EXPECT_EQ("\xf0\x9f\x98\x80", value);
+  EXPECT_FALSE(reader.NextElement());
+  EXPECT_TRUE(reader.Finish());
+}
+
+
+TEST(JsonReaderTest, Int64Limits) {
+  int64_t value;
+  const string max_json("9223372036854775807");
+  JsonReader max(max_json);
+  EXPECT_TRUE(max.ReadInt64(&value));
+  EXPECT_EQ(INT64_MAX, value);
+
+  const string min_json("-9223372036854775808");
+  JsonReader min(min_json);
+  EXPECT_TRUE(min.ReadInt64(&value));
+  EXPECT_EQ(INT64_MIN, value);
+
+  const string too_big_json("9223372036854775808");
+  JsonReader too_big(too_big_json);
+  EXPECT_FALSE(too_big.ReadInt64(&value));
+
+  const string too_small_json("-9223372036854775809");
+  JsonReader too_small(too_small_json);
+  EXPECT_FALSE(too_small.ReadInt64(&value));
+
+  const string fraction_json("1.5");
+  JsonReader fraction(fraction_json);
+  EXPECT_FALSE(fraction.ReadInt64(&value));
+
+  const string leading_zero_json("01");
+  JsonReader leading_zero(leading_zero_json);
+  EXPECT_FALSE(leading_zero.ReadInt64(&value));
+}
+
+
+TEST(JsonReaderTest, WrongType) {
+  const string json("{\"a\": 1}");
+  JsonReader reader(json);
+  string name;
+  string value;
+  ASSERT_TRUE(reader.EnterObject());
+  ASSERT_TRUE(reader.NextMember(&name));
+  EXPECT_EQ(JsonReader::Type::NUMBER, reader.PeekType());
+  EXPECT_FALSE(reader.ReadString(&value));
+  EXPECT_FALSE(reader.ok());
+  // The reader stays in error.
+  EXPECT_FALSE(reader.Skip());
+  EXPECT_FALSE(reader.NextMember(&name));
+  EXPECT_FALSE(reader.Finish());
+}
+
+
+TEST(JsonReaderTest, Malformed) {
+  const vector<string> inputs{
+      "",
+      "{",
+      "{\"a\" 1}",
+      "{\"a\": 1,}",
+      "{\"a\": 1 \"b\": 2}",
+      "{\"a\": \"unterminated}",
+      "{\"a\": \"bad \\x escape\"}",
+      "{\"a\": \"\\ud83d alone\"}",
+      "{\"a\": \"\\ude00\"}",
+      "{\"a\": tru}",
+      "{\"a\": [1, 2}",
+      "{\"a\": 1} trailing",
+      "{\"a\": \"control\tcharacter\"}",
+  };
+  for (const string& input : inputs) {
+    JsonReader reader(input);
+    string name;
+    if (reader.EnterObject()) {
+      string value;
+      while (reader.NextMember(&name)) {
+        if (reader.PeekType() == JsonReader::Type::STRING) {
+          reader.ReadString(&value);
+        } else {
+          reader.Skip();
+        }
+      }
+    }
+    EXPECT_FALSE(reader.Finish()) << input;
+  }
+}
+
+
+}  // namespace
+}  // namespace util
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -102,6 +102,10 @@ class JsonObject {
     Add(name, json_object_new_boolean(b));
   }
 
+  void AddDouble(const char* name, double value) {
+    Add(name, json_object_new_double(value));
+  }
+
   const char* ToString() const {
     return json_object_to_json_string(obj_);
   }
@@ -200,6 +204,10 @@ class JsonArray : public JsonObject {
     Add(json_object_new_string(addand.c_str()));
   }
 
+  void Add(int64_t addand) {
+    Add(json_object_new_int64(addand));
+  }
+
   void Add(JsonObject* addand) {
     Add(addand->Extract());
   }
@@ -6,12 +6,19 @@
 #ifdef HAVE_ARPA_NAMESER_H
 #include <arpa/nameser.h> /* DNS HEADER struct */
 #endif
+#include <event2/bufferevent.h>
+#include <event2/bufferevent_ssl.h>
 #include <event2/keyvalq_struct.h>
 #include <event2/thread.h>
 #include <evhtp.h>
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <math.h>
+#include <algorithm>
 #include <climits>
+#include <cstring>
+#include <future>
+#include <unordered_map>
 #ifdef HAVE_NETDB_H
 #include <netdb.h>
 #endif
@@ -25,13 +32,37 @@
 #include <sys/types.h>
 #endif
 #include <signal.h>
-
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+#include <unistd.h>
+
+#include "monitoring/counter.h"
+#include "monitoring/gauge.h"
+#include "monitoring/latency.h"
+#include "util/cpu_topology.h"
+
+DEFINE_int32(dns_cache_ttl_seconds, 60,
+             "How long the addresses of the hosts outgoing connections are "
+             "made to are used for before being resolved again (in the "
+             "background).");
+DEFINE_int32(dns_cache_negative_ttl_seconds, 5,
+             "How long a failure to resolve a host is remembered for.");
+DEFINE_int32(libevent_lag_probe_interval_ms, 1000,
+             "How often event loops time how late they run a timer, which "
+             "is exported as libevent_loop_lag_us. 0 disables it.");
+
+using cert_trans::Counter;
+using cert_trans::Gauge;
+using cert_trans::Latency;
 using std::bind;
 using std::chrono::duration;
 using std::chrono::duration_cast;
 using std::chrono::microseconds;
 using std::chrono::milliseconds;
 using std::chrono::seconds;
+using std::chrono::steady_clock;
 using std::chrono::system_clock;
 using std::function;
 using std::lock_guard;
@@ -39,15 +70,56 @@ using std::make_pair;
 using std::multimap;
 using std::mutex;
 using std::placeholders::_1;
+using std::promise;
 using std::recursive_mutex;
 using std::shared_ptr;
 using std::string;
+using std::thread;
+using std::unique_lock;
 using std::unique_ptr;
+using std::unordered_map;
 using std::vector;
 using util::TaskHold;
 
 namespace {
 
+
+Gauge<>* libevent_closure_batch_size(
+    Gauge<>::New("libevent_closure_batch_size",
+                 "Number of closures an event loop found waiting the last "
+                 "time it ran them."));
+
+Counter<string>* dns_cache_lookups(
+    Counter<string>::New("dns_cache_lookups", "result",
+                         "Number of host name lookups, by whether the "
+                         "address was cached (\"hit\"), had expired "
+                         "(\"stale\"), had to be resolved (\"miss\"), or "
+                         "was known not to resolve (\"negative\")."));
+
+Gauge<>* http_server_open_connections(
+    Gauge<>::New("http_server_open_connections",
+                 "Number of connections open to the HTTP server which "
+                 "have sent a request."));
+
+Counter<string>* http_server_connections(
+    Counter<string>::New("http_server_connections", "event",
+                         "Number of connections to the HTTP server which "
+                         "\"opened\" (on their first request), \"closed\", "
+                         "or were refused for being over the limit of "
+                         "connections in all (\"refused_total\") or from "
+                         "their address (\"refused_per_address\")."));
+
+Latency<microseconds> libevent_closure_wait_us(
+    "libevent_closure_wait_us",
+    "Time the oldest closure of each batch run by an event loop waited "
+    "in us.");
+
+Latency<microseconds> libevent_loop_lag_us(
+    "libevent_loop_lag_us",
+    "How late event loops ran a timer every "
+    "--libevent_lag_probe_interval_ms, in us.");
+
+
 void FreeEvDns(evdns_base* dns) {
   if (dns) {
     evdns_base_free(dns, true);
@@ -69,6 +141,47 @@ void SetExitLoopHandler(event_base* base, int signum) {
 }
 
 
+// Times how late the event loop of |base| runs a timer, for as long as
+// it exists: anything else the loop has to do is held up as much.
+class LoopLagProbe {
+ public:
+  explicit LoopLagProbe(event_base* base)
+      : interval_(FLAGS_libevent_lag_probe_interval_ms),
+        timer_(interval_ > milliseconds::zero()
+                   ? CHECK_NOTNULL(evtimer_new(base, &LoopLagProbe::Fire,
+                                               this))
+                   : nullptr,
+               &event_free) {
+    if (timer_) {
+      Schedule();
+    }
+  }
+
+ private:
+  static void Fire(evutil_socket_t, short, void* userdata) {
+    LoopLagProbe* const probe(static_cast<LoopLagProbe*>(userdata));
+    // libevent schedules from the time it cached at the start of the
+    // loop iteration, which can make it run the timer a bit early.
+    libevent_loop_lag_us.RecordLatency(
+        std::max(steady_clock::duration::zero(),
+                 steady_clock::now() - probe->due_));
+    probe->Schedule();
+  }
+
+  void Schedule() {
+    due_ = steady_clock::now() + interval_;
+    timeval tv;
+    tv.tv_sec = interval_.count() / 1000;
+    tv.tv_usec = (interval_.count() % 1000) * 1000;
+    CHECK_EQ(evtimer_add(timer_.get(), &tv), 0);
+  }
+
+  const milliseconds interval_;
+  const unique_ptr<event, void (*)(event*)> timer_;
+  steady_clock::time_point due_;
+};
+
+
 void DelayCancel(event* timer, util::Task* task) {
   event_del(timer);
   task->Return(util::Status::CANCELLED);
@@ -82,26 +195,107 @@ void DelayDispatch(evutil_socket_t, short, void* userdata) {
 
 #ifdef HAVE_THREAD_LOCAL
 thread_local bool on_event_thread = false;
+thread_local const cert_trans::libevent::Base* dispatching_base = nullptr;
 #elif HAVE___THREAD
 __thread bool on_event_thread = false;
+__thread const cert_trans::libevent::Base* dispatching_base = nullptr;
 #else
 #error No suitable thread local storage available
 #endif
 
 
+// The Base instances, by their event_base, for Base::ForRequest().
+mutex bases_lock;
+unordered_map<const event_base*, cert_trans::libevent::Base*>* bases(
+    new unordered_map<const event_base*, cert_trans::libevent::Base*>);
+
+
+// Returns a listening socket for |address| and |port| with
+// SO_REUSEPORT set, so that several event loops can accept connections
+// on it each with its own socket.
+evutil_socket_t ReusePortSocket(const char* address, ev_uint16_t port) {
+  addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  addrinfo* info;
+  const string port_str(std::to_string(port));
+  const int resolved(getaddrinfo(address, port_str.c_str(), &hints, &info));
+  CHECK_EQ(resolved, 0) << gai_strerror(resolved);
+
+  const evutil_socket_t sock(
+      socket(info->ai_family, info->ai_socktype, info->ai_protocol));
+  PCHECK(sock >= 0) << "socket";
+  const int one(1);
+  PCHECK(setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == 0)
+      << "setsockopt(SO_REUSEADDR)";
+  PCHECK(setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == 0)
+      << "setsockopt(SO_REUSEPORT)";
+  CHECK_EQ(evutil_make_socket_nonblocking(sock), 0);
+  CHECK_EQ(evutil_make_socket_closeonexec(sock), 0);
+  PCHECK(bind(sock, info->ai_addr, info->ai_addrlen) == 0)
+      << "bind to port " << port;
+  PCHECK(listen(sock, SOMAXCONN) == 0) << "listen";
+  freeaddrinfo(info);
+  return sock;
+}
+
+
+// Runs the thread of |handle| on CPU |cpu| only, where supported.
+void PinThread(thread* handle, int cpu) {
+#ifdef __linux__
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu, &cpus);
+  const int error(
+      pthread_setaffinity_np(handle->native_handle(), sizeof(cpus), &cpus));
+  LOG_IF(WARNING, error != 0) << "Could not pin event loop thread to CPU "
+                              << cpu << ": " << strerror(error);
+#else
+  LOG(WARNING) << "Pinning event loop threads is not supported.";
+#endif
+}
+
+
+// Prefers |sock| for the connections whose packets are processed on
+// CPU |cpu|, among the SO_REUSEPORT sockets of the same port, where
+// supported.
+void SetIncomingCpu(evutil_socket_t sock, int cpu) {
+#ifdef SO_INCOMING_CPU
+  PLOG_IF(WARNING, setsockopt(sock, SOL_SOCKET, SO_INCOMING_CPU, &cpu,
+                              sizeof(cpu)) != 0)
+      << "setsockopt(SO_INCOMING_CPU)";
+#endif
+}
+
+
 }  // namespace
 
 namespace cert_trans {
 namespace libevent {
 
 
+struct HttpServer::Connection {
+  HttpServer* server;
+  // Those of its event loop, which own it.
+  Connections* connections;
+  string address;
+  shared_ptr<std::atomic<bool>> closed;
+};
+
+
 struct HttpServer::Handler {
-  Handler(const string& _path, const HandlerCallback& _cb)
-      : path(_path), cb(_cb) {
+  Handler(HttpServer* _server, const string& _path, const HandlerCallback& _cb,
+          size_t _max_body_size)
+      : server(_server), path(_path), cb(_cb), max_body_size(_max_body_size) {
   }
 
+  HttpServer* const server;
   const string path;
   const HandlerCallback cb;
+  // Zero for the limit of the server.
+  const size_t max_body_size;
 };
 
 
@@ -118,9 +312,9 @@ class ResolverImpl : public Base::Resolver {
     hints.ai_socktype = SOCK_STREAM;
     const int resolved(getaddrinfo(host.c_str(), AF_UNSPEC, &hints, &info));
     if (resolved != 0) {
-      LOG(WARNING) << "Failed to resolve HTTPS hostname " << host << ": "
+      LOG(WARNING) << "Failed to resolve hostname " << host << ": "
                    << gai_strerror(resolved);
-      return nullptr;
+      return "";
     }
 
     struct addrinfo* res(info);
@@ -144,7 +338,8 @@ class ResolverImpl : public Base::Resolver {
 
     if (!addr) {
       LOG(WARNING) << "Got no usable address for " << host;
-      return nullptr;
+      freeaddrinfo(info);
+      return "";
     }
 
     char addr_str[INET6_ADDRSTRLEN];
@@ -155,7 +350,139 @@ class ResolverImpl : public Base::Resolver {
 };
 
 
-Base::Base() : Base(unique_ptr<Resolver>(new ResolverImpl)) {
+struct Base::Closure {
+  function<void()> cb;
+  steady_clock::time_point added;
+  Closure* next;
+};
+
+
+CachingResolver::CachingResolver(unique_ptr<Base::Resolver> resolver,
+                                 const Clock::duration& ttl,
+                                 const Clock::duration& negative_ttl)
+    : resolver_(std::move(resolver)),
+      ttl_(ttl),
+      negative_ttl_(negative_ttl),
+      exiting_(false) {
+  CHECK(resolver_);
+}
+
+
+CachingResolver::~CachingResolver() {
+  {
+    lock_guard<mutex> lock(lock_);
+    exiting_ = true;
+  }
+  wake_refresher_.notify_one();
+  if (refresher_.joinable()) {
+    refresher_.join();
+  }
+}
+
+
+string CachingResolver::Resolve(const string& host) {
+  {
+    lock_guard<mutex> lock(lock_);
+    string address;
+    if (LookupLocked(host, &address)) {
+      return address;
+    }
+  }
+
+  dns_cache_lookups->Increment("miss");
+  const string address(resolver_->Resolve(host));
+  Store(host, address);
+  return address;
+}
+
+
+bool CachingResolver::ResolveCached(const string& host, string* address) {
+  lock_guard<mutex> lock(lock_);
+  if (LookupLocked(host, address)) {
+    return !address->empty();
+  }
+
+  // Resolve it in the background, for the next time.
+  Entry* const entry(&entries_[host]);
+  if (!entry->refreshing) {
+    dns_cache_lookups->Increment("miss");
+    entry->refreshing = true;
+    to_refresh_.push_back(host);
+    if (!refresher_.joinable()) {
+      refresher_ = thread(&CachingResolver::Refresh, this);
+    }
+    wake_refresher_.notify_one();
+  }
+  return false;
+}
+
+
+bool CachingResolver::LookupLocked(const string& host, string* address) {
+  const auto it(entries_.find(host));
+  if (it == entries_.end()) {
+    return false;
+  }
+  Entry* const entry(&it->second);
+  if (Clock::now() < entry->expiry) {
+    dns_cache_lookups->Increment(entry->address.empty() ? "negative" : "hit");
+    *address = entry->address;
+    return true;
+  }
+  if (entry->address.empty()) {
+    return false;
+  }
+
+  dns_cache_lookups->Increment("stale");
+  if (!entry->refreshing) {
+    entry->refreshing = true;
+    to_refresh_.push_back(host);
+    if (!refresher_.joinable()) {
+      refresher_ = thread(&CachingResolver::Refresh, this);
+    }
+    wake_refresher_.notify_one();
+  }
+  *address = entry->address;
+  return true;
+}
+
+
+void CachingResolver::Store(const string& host, const string& address) {
+  lock_guard<mutex> lock(lock_);
+  Entry* const entry(&entries_[host]);
+  entry->refreshing = false;
+  if (address.empty() && !entry->address.empty()) {
+    // Keep using the address it had until then, and try again later.
+    entry->expiry = Clock::now() + negative_ttl_;
+    return;
+  }
+  entry->address = address;
+  entry->expiry = Clock::now() + (address.empty() ? negative_ttl_ : ttl_);
+}
+
+
+void CachingResolver::Refresh() {
+  unique_lock<mutex> lock(lock_);
+  while (true) {
+    wake_refresher_.wait(lock,
+                         [this] { return exiting_ || !to_refresh_.empty(); });
+    if (exiting_) {
+      return;
+    }
+    const string host(std::move(to_refresh_.front()));
+    to_refresh_.pop_front();
+
+    lock.unlock();
+    Store(host, resolver_->Resolve(host));
+    lock.lock();
+  }
+}
+
+
+Base::Base()
+    : Base(unique_ptr<Resolver>(
+          new CachingResolver(unique_ptr<Resolver>(new ResolverImpl),
+                              seconds(FLAGS_dns_cache_ttl_seconds),
+                              seconds(FLAGS_dns_cache_negative_ttl_seconds)))) {
 }
 
 
@@ -164,8 +491,13 @@ Base::Base(unique_ptr<Resolver> resolver)
       dns_(nullptr, FreeEvDns),
       wake_closures_(event_new(base_.get(), -1, 0, &Base::RunClosures, this),
                      &event_free),
+      closures_(nullptr),
       resolver_(std::move(resolver)) {
   evthread_make_base_notifiable(base_.get());
+  {
+    lock_guard<mutex> lock(bases_lock);
+    (*bases)[base_.get()] = this;
+  }
 
   // So much stuff breaks if there's not a Dns client around to keep the
   // event loop doing stuff that we may as well just have one from the get go.
@@ -174,6 +506,18 @@ Base::Base(unique_ptr<Resolver> resolver)
 
 
 Base::~Base() {
+  {
+    lock_guard<mutex> lock(bases_lock);
+    bases->erase(base_.get());
+  }
+
+  // The closures which never got to run.
+  Closure* closure(closures_.exchange(nullptr));
+  while (closure) {
+    Closure* const next(closure->next);
+    delete closure;
+    closure = next;
+  }
 }
 
 
@@ -189,10 +533,37 @@ void Base::CheckNotOnEventThread() {
 }
 
 
+// static
+Base* Base::ForRequest(evhttp_request* req, Base* fallback) {
+  evhttp_connection* const conn(evhttp_request_get_connection(req));
+  if (!conn) {
+    return fallback;
+  }
+  lock_guard<mutex> lock(bases_lock);
+  const auto it(bases->find(evhttp_connection_get_base(conn)));
+  return it == bases->end() ? fallback : it->second;
+}
+
+
+bool Base::OnOwnEventThread() const {
+  return dispatching_base == this;
+}
+
+
 void Base::Add(const function<void()>& cb) {
-  lock_guard<mutex> lock(closures_lock_);
-  closures_.push_back(cb);
-  event_active(wake_closures_.get(), 0, 0);
+  Closure* const closure(new Closure{cb, steady_clock::now(), nullptr});
+  Closure* head(closures_.load(std::memory_order_relaxed));
+  do {
+    closure->next = head;
+  } while (!closures_.compare_exchange_weak(head, closure,
+                                            std::memory_order_release,
+                                            std::memory_order_relaxed));
+
+  // Only the first closure since RunClosures() last took them has to
+  // wake up the loop: it will run the others too.
+  if (!head) {
+    event_active(wake_closures_.get(), 0, 0);
+  }
 }
 
 
@@ -234,15 +605,31 @@ void Base::Dispatch() {
   SetExitLoopHandler(base_.get(), SIGINT);
   SetExitLoopHandler(base_.get(), SIGTERM);
 
+  RunLoop();
+}
+
+
+void Base::DispatchWithoutSignals() {
+  RunLoop();
+}
+
+
+void Base::RunLoop() {
   // There should /never/ be more than 1 thread trying to call Dispatch(), so
   // we should expect to always own the lock here.
   CHECK(dispatch_lock_.try_lock());
   LOG_IF(WARNING, on_event_thread)
       << "Huh?, Are you calling Dispatch() from a libevent thread?";
   const bool old_on_event_thread(on_event_thread);
+  const Base* const old_dispatching_base(dispatching_base);
   on_event_thread = true;
-  CHECK_EQ(event_base_dispatch(base_.get()), 0);
+  dispatching_base = this;
+  {
+    const LoopLagProbe lag_probe(base_.get());
+    CHECK_EQ(event_base_dispatch(base_.get()), 0);
+  }
   on_event_thread = old_on_event_thread;
+  dispatching_base = old_dispatching_base;
   dispatch_lock_.unlock();
 }
 
@@ -253,9 +640,12 @@ void Base::DispatchOnce() {
   LOG_IF(WARNING, on_event_thread)
       << "Huh?, Are you calling Dispatch() from a libevent thread?";
   const bool old_on_event_thread(on_event_thread);
+  const Base* const old_dispatching_base(dispatching_base);
   on_event_thread = true;
+  dispatching_base = this;
   CHECK_EQ(event_base_loop(base_.get(), EVLOOP_ONCE), 0);
   on_event_thread = old_on_event_thread;
+  dispatching_base = old_dispatching_base;
 }
 
 
@@ -281,6 +671,34 @@ evhttp* Base::HttpNew() const {
 }
 
 
+evconnlistener* Base::ListenerNew(unsigned short port, evconnlistener_cb cb,
+                                  void* arg) const {
+  // Like HttpServer::Bind() without an address.
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+  evconnlistener* const listener(evconnlistener_new_bind(
+      base_.get(), cb, arg,
+      LEV_OPT_CLOSE_ON_FREE | LEV_OPT_CLOSE_ON_EXEC | LEV_OPT_REUSEABLE,
+      /*backlog*/ -1, reinterpret_cast<const sockaddr*>(&addr),
+      sizeof(addr)));
+  PCHECK(listener) << "Cannot listen on port " << port;
+  return listener;
+}
+
+
+bufferevent* Base::BufferEventNew(evutil_socket_t fd, SSL* ssl) const {
+  const int options(BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS);
+  if (ssl) {
+    return CHECK_NOTNULL(bufferevent_openssl_socket_new(
+        base_.get(), fd, ssl, BUFFEREVENT_SSL_ACCEPTING, options));
+  }
+  return CHECK_NOTNULL(bufferevent_socket_new(base_.get(), fd, options));
+}
+
+
 evdns_base* Base::GetDns() {
   lock_guard<mutex> lock(dns_lock_);
 
@@ -294,6 +712,12 @@ evdns_base* Base::GetDns() {
 
 evhtp_connection_t* Base::HttpConnectionNew(const string& host,
                                             unsigned short port) {
+  // Resolving with evdns does not block, but it is not cached.
+  string address;
+  if (resolver_->ResolveCached(host, &address)) {
+    return CHECK_NOTNULL(
+        evhtp_connection_new(base_.get(), address.c_str(), port));
+  }
   return CHECK_NOTNULL(
       evhtp_connection_new_dns(base_.get(), GetDns(), host.c_str(), port));
 }
@@ -317,14 +741,28 @@ evhtp_connection_t* Base::HttpsConnectionNew(const string& host,
 void Base::RunClosures(evutil_socket_t, short, void* userdata) {
   Base* self(static_cast<Base*>(CHECK_NOTNULL(userdata)));
 
-  vector<function<void()>> closures;
-  {
-    lock_guard<mutex> lock(self->closures_lock_);
-    closures.swap(self->closures_);
+  // Reverse them, to run them in the order they were added.
+  Closure* closure(self->closures_.exchange(nullptr,
+                                            std::memory_order_acquire));
+  Closure* first(nullptr);
+  int64_t count(0);
+  while (closure) {
+    Closure* const next(closure->next);
+    closure->next = first;
+    first = closure;
+    closure = next;
+    ++count;
+  }
+  if (!first) {
+    return;
   }
 
-  for (const auto& closure : closures) {
-    closure();
+  libevent_closure_batch_size->Set(count);
+  libevent_closure_wait_us.RecordLatency(steady_clock::now() - first->added);
+  while (first) {
+    const unique_ptr<Closure> current(first);
+    first = first->next;
+    current->cb();
   }
 }
 
@@ -360,11 +798,48 @@ void Event::Dispatch(evutil_socket_t sock, short events, void* userdata) {
 }
 
 
-HttpServer::HttpServer(const Base& base) : http_(base.HttpNew()) {
+struct HttpServer::Reactor {
+  Reactor() : base(std::make_shared<Base>()), http(base->HttpNew()) {
+  }
+
+  const shared_ptr<Base> base;
+  evhttp* const http;
+  evhttp_bound_socket* bound = nullptr;
+  thread loop;
+};
+
+
+HttpServer::HttpServer(const Base& base) : HttpServer(base, 0, false) {
+}
+
+
+HttpServer::HttpServer(const Base& base, int extra_reactors,
+                       bool pin_reactors)
+    : http_(base.HttpNew()),
+      bound_(nullptr),
+      pin_reactors_(pin_reactors),
+      reactors_running_(false),
+      timeout_secs_(0),
+      max_connections_(0),
+      max_connections_per_address_(0),
+      idle_timeout_secs_(0),
+      open_connections_(0) {
+  connections_[http_];
+  for (int i = 0; i < extra_reactors; ++i) {
+    reactors_.emplace_back(new Reactor);
+    connections_[reactors_.back()->http];
+  }
 }
 
 
 HttpServer::~HttpServer() {
+  for (const auto& reactor : reactors_) {
+    if (reactor->loop.joinable()) {
+      reactor->base->LoopExit();
+      reactor->loop.join();
+    }
+    evhttp_free(reactor->http);
+  }
   evhttp_free(http_);
   for (vector<Handler*>::iterator it = handlers_.begin();
        it != handlers_.end(); ++it) {
@@ -373,21 +848,242 @@ HttpServer::~HttpServer() {
 }
 
 
+void HttpServer::SetLimits(size_t max_body_size, int timeout_secs) {
+  CHECK(!reactors_running_);
+  CHECK_GT(timeout_secs, 0);
+  timeout_secs_ = timeout_secs;
+  evhttp_set_max_body_size(http_, max_body_size);
+  evhttp_set_timeout(http_, timeout_secs);
+  for (const auto& reactor : reactors_) {
+    evhttp_set_max_body_size(reactor->http, max_body_size);
+    evhttp_set_timeout(reactor->http, timeout_secs);
+  }
+}
+
+
+void HttpServer::SetConnectionLimits(int max_connections, int max_per_address,
+                                     int idle_timeout_secs) {
+  CHECK(!reactors_running_);
+  CHECK_LE(0, max_connections);
+  CHECK_LE(0, max_per_address);
+  CHECK_LE(0, idle_timeout_secs);
+  CHECK(idle_timeout_secs == 0 || timeout_secs_ > 0)
+      << "SetLimits() must be called first";
+  max_connections_ = max_connections;
+  max_connections_per_address_ = max_per_address;
+  idle_timeout_secs_ = idle_timeout_secs;
+}
+
+
 void HttpServer::Bind(const char* address, ev_uint16_t port) {
-  CHECK_EQ(evhttp_bind_socket(http_, address, port), 0);
+  if (reactors_.empty()) {
+    bound_ = evhttp_bind_socket_with_handle(http_, address, port);
+    CHECK(bound_) << "bind to port " << port;
+    return;
+  }
+
+  // All the sockets need SO_REUSEPORT, including the first one.
+  vector<int> sockets;
+  for (size_t i = 0; i <= reactors_.size(); ++i) {
+    sockets.push_back(ReusePortSocket(address, port));
+  }
+  Bind(sockets);
+}
+
+
+void HttpServer::Bind(const vector<int>& sockets) {
+  CHECK(!bound_);
+  CHECK_EQ(reactors_.size() + 1, sockets.size())
+      << "the number of event loops must match the listening sockets";
+  bound_ = CHECK_NOTNULL(evhttp_accept_socket_with_handle(http_, sockets[0]));
+  // Taking a CPU from each NUMA node in turn, so that the reactors are
+  // spread over the nodes, each near the memory it allocates.
+  const vector<int> cpus(pin_reactors_ ? InterleaveCpus(NumaNodeCpus())
+                                       : vector<int>());
+  for (size_t i = 0; i < reactors_.size(); ++i) {
+    Reactor* const reactor(reactors_[i].get());
+    // The main event loop is left alone, presumably on the first CPU.
+    const int cpu(pin_reactors_ ? cpus[(i + 1) % cpus.size()] : -1);
+    if (cpu >= 0) {
+      // The connections are then accepted near the NIC queue
+      // interrupts handled by this CPU.
+      SetIncomingCpu(sockets[i + 1], cpu);
+    }
+    reactor->bound = CHECK_NOTNULL(
+        evhttp_accept_socket_with_handle(reactor->http, sockets[i + 1]));
+    reactor->loop =
+        thread(bind(&Base::DispatchWithoutSignals, reactor->base.get()));
+    if (cpu >= 0) {
+      PinThread(&reactor->loop, cpu);
+    }
+  }
+  reactors_running_ = !reactors_.empty();
+}
+
+
+vector<int> HttpServer::ListeningSockets() const {
+  CHECK(bound_) << "not bound";
+  vector<int> sockets{evhttp_bound_socket_get_fd(bound_)};
+  for (const auto& reactor : reactors_) {
+    sockets.push_back(evhttp_bound_socket_get_fd(reactor->bound));
+  }
+  return sockets;
 }
 
 
-bool HttpServer::AddHandler(const string& path, const HandlerCallback& cb) {
-  Handler* handler(new Handler(path, cb));
+void HttpServer::StopAccepting() {
+  CHECK(bound_) << "not bound";
+  evhttp_del_accept_socket(http_, bound_);
+  bound_ = nullptr;
+  for (const auto& reactor : reactors_) {
+    // From the reactor's own event loop, which may be accepting.
+    promise<void> stopped;
+    Reactor* const r(reactor.get());
+    r->base->Add([r, &stopped]() {
+      evhttp_del_accept_socket(r->http, r->bound);
+      r->bound = nullptr;
+      stopped.set_value();
+    });
+    stopped.get_future().get();
+  }
+}
+
+
+bool HttpServer::AddHandler(const string& path, const HandlerCallback& cb,
+                            size_t max_body_size) {
+  Handler* handler(new Handler(this, path, cb, max_body_size));
   handlers_.push_back(handler);
 
-  return evhttp_set_cb(http_, path.c_str(), &HandleRequest, handler) == 0;
+  bool added(evhttp_set_cb(http_, path.c_str(), &HandleRequest, handler) ==
+             0);
+  for (const auto& reactor : reactors_) {
+    evhttp* const http(reactor->http);
+    if (!reactors_running_) {
+      added &= evhttp_set_cb(http, path.c_str(), &HandleRequest, handler) == 0;
+      continue;
+    }
+    // The reactor may already be serving requests, so its callbacks
+    // are changed from its own event loop.
+    promise<bool> reactor_added;
+    reactor->base->Add([http, &path, handler, &reactor_added]() {
+      reactor_added.set_value(
+          evhttp_set_cb(http, path.c_str(), &HandleRequest, handler) == 0);
+    });
+    added &= reactor_added.get_future().get();
+  }
+  return added;
+}
+
+
+shared_ptr<const std::atomic<bool>> HttpServer::ConnectionClosed(
+    evhttp_request* req) const {
+  evhttp_connection* const conn(evhttp_request_get_connection(req));
+  if (!conn) {
+    return nullptr;
+  }
+  const auto loop(connections_.find(evhttp_connection_get_server(conn)));
+  if (loop == connections_.end()) {
+    return nullptr;
+  }
+  const auto it(loop->second.find(conn));
+  return it != loop->second.end() ? it->second->closed : nullptr;
+}
+
+
+bool HttpServer::TrackConnection(evhttp_request* req) {
+  evhttp_connection* const conn(evhttp_request_get_connection(req));
+  if (!conn) {
+    return true;
+  }
+  Connections* const connections(
+      &connections_.at(evhttp_connection_get_server(conn)));
+  if (connections->count(conn) > 0) {
+    return true;
+  }
+
+  char* address(nullptr);
+  ev_uint16_t port(0);
+  evhttp_connection_get_peer(conn, &address, &port);
+  unique_ptr<Connection> connection(new Connection);
+  connection->server = this;
+  connection->connections = connections;
+  connection->address = address ? address : "";
+  connection->closed = std::make_shared<std::atomic<bool>>(false);
+  {
+    lock_guard<mutex> lock(addresses_lock_);
+    if (max_connections_ > 0 && open_connections_ >= max_connections_) {
+      http_server_connections->Increment("refused_total");
+      return false;
+    }
+    int* const from_address(&addresses_[connection->address]);
+    if (max_connections_per_address_ > 0 &&
+        *from_address >= max_connections_per_address_) {
+      http_server_connections->Increment("refused_per_address");
+      return false;
+    }
+    ++*from_address;
+    ++open_connections_;
+    http_server_open_connections->Set(open_connections_);
+  }
+  http_server_connections->Increment("opened");
+
+  if (idle_timeout_secs_ > 0) {
+    // The read timeout only runs while a request is awaited, and the
+    // write timeout while a reply is sent.
+    const timeval idle{idle_timeout_secs_, 0};
+    const timeval write{timeout_secs_, 0};
+    bufferevent_set_timeouts(evhttp_connection_get_bufferevent(conn), &idle,
+                             &write);
+  }
+  evhttp_connection_set_closecb(conn, &HttpServer::ConnectionClosedCallback,
+                                connection.get());
+  connections->emplace(conn, std::move(connection));
+  return true;
+}
+
+
+// static
+void HttpServer::ConnectionClosedCallback(evhttp_connection* conn,
+                                          void* connection) {
+  Connection* const closed(static_cast<Connection*>(CHECK_NOTNULL(connection)));
+  HttpServer* const self(closed->server);
+  *closed->closed = true;
+  {
+    lock_guard<mutex> lock(self->addresses_lock_);
+    const auto it(self->addresses_.find(closed->address));
+    CHECK(it != self->addresses_.end());
+    if (--it->second == 0) {
+      self->addresses_.erase(it);
+    }
+    --self->open_connections_;
+    http_server_open_connections->Set(self->open_connections_);
+  }
+  http_server_connections->Increment("closed");
+  evhttp_connection_set_closecb(conn, nullptr, nullptr);
+  closed->connections->erase(conn);
 }
 
 
 void HttpServer::HandleRequest(evhttp_request* req, void* userdata) {
-  static_cast<Handler*>(userdata)->cb(req);
+  const Handler* const handler(static_cast<Handler*>(userdata));
+  if (!handler->server->TrackConnection(req)) {
+    VLOG(1) << "Too many connections, refusing a request to "
+            << handler->path;
+    evhttp_add_header(evhttp_request_get_output_headers(req), "Connection",
+                      "close");
+    evhttp_send_error(req, HTTP_SERVUNAVAIL, "Too Many Connections");
+    return;
+  }
+  // Checked before the request goes anywhere, so that the handler
+  // neither parses nor queues it.
+  if (handler->max_body_size > 0 &&
+      evbuffer_get_length(evhttp_request_get_input_buffer(req)) >
+          handler->max_body_size) {
+    VLOG(1) << "Request body too large for " << handler->path;
+    evhttp_send_error(req, 413, "Request Entity Too Large");
+    return;
+  }
+  handler->cb(req);
 }
 
 
@@ -3,8 +3,11 @@
 
 #include <event2/dns.h>
 #include <event2/event.h>
+#include <event2/listener.h>
 #include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <deque>
 // TODO(alcutter): Use evhtp for the HttpServer too.
 #include <event2/http.h>
 #include <evhtp.h>
@@ -14,6 +17,7 @@
 #include <mutex>
 #include <string>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include "util/executor.h"
@@ -30,12 +34,28 @@ class Base : public util::Executor {
  public:
   class Resolver {
    public:
+    virtual ~Resolver() = default;
+
+    // Returns an address of |host|, or an empty string if it cannot be
+    // resolved. May block.
     virtual std::string Resolve(const std::string& host) = 0;
+
+    // Sets |address| to an address of |host| and returns true if one
+    // is known without blocking.
+    virtual bool ResolveCached(const std::string& host,
+                               std::string* address) {
+      return false;
+    }
   };
 
   static bool OnEventThread();
   static void CheckNotOnEventThread();
 
+  // The Base whose event loop |req| came in on, or |fallback| if that
+  // event loop is not run by a Base. Replies to |req| must be sent
+  // from that event loop.
+  static Base* ForRequest(evhttp_request* req, Base* fallback);
+
   Base();
   Base(std::unique_ptr<Resolver> resolver);
   ~Base();
@@ -49,11 +69,26 @@ class Base : public util::Executor {
              util::Task* task) override;
 
   void Dispatch();
+  // As Dispatch(), but the loop does not exit on SIGHUP, SIGINT and
+  // SIGTERM: only one event loop of a process can handle signals.
+  void DispatchWithoutSignals();
   void DispatchOnce();
   void LoopExit();
 
+  // True if called from the thread running the event loop of this
+  // instance.
+  bool OnOwnEventThread() const;
+
   event* EventNew(evutil_socket_t& sock, short events, Event* event) const;
   evhttp* HttpNew() const;
+  // Listens on |port| of all addresses, calling |cb| with |arg| on the
+  // event loop for each connection accepted.
+  evconnlistener* ListenerNew(unsigned short port, evconnlistener_cb cb,
+                              void* arg) const;
+  // A bufferevent over the socket |fd|, which it closes when freed. If
+  // |ssl| is not NULL, it is the server side of a TLS connection with
+  // it, which it also frees.
+  bufferevent* BufferEventNew(evutil_socket_t fd, SSL* ssl) const;
   evdns_base* GetDns();
   evhtp_connection_t* HttpConnectionNew(const std::string& host,
                                         unsigned short port);
@@ -64,6 +99,8 @@ class Base : public util::Executor {
  private:
   static void RunClosures(evutil_socket_t sock, short flag, void* userdata);
 
+  void RunLoop();
+
   const std::unique_ptr<event_base, void (*)(event_base*)> base_;
   std::mutex dispatch_lock_;
 
@@ -71,15 +108,69 @@ class Base : public util::Executor {
   // "dns_" should be after base_, so that it gets destroyed first.
   std::unique_ptr<evdns_base, void (*)(evdns_base*)> dns_;
 
-  std::mutex closures_lock_;
   // "wake_closures_" should be after base_, so that it gets destroyed
   // first.
   const std::unique_ptr<event, void (*)(event*)> wake_closures_;
-  std::vector<std::function<void()>> closures_;
+  // The closures given to Add(), most recent first. Add() pushes onto
+  // it without a lock, and RunClosures() takes them all at once.
+  struct Closure;
+  std::atomic<Closure*> closures_;
   std::unique_ptr<Resolver> resolver_;
 };
 
 
+// Keeps the addresses another resolver gives for |ttl| (and its
+// failures for |negative_ttl|). Expired addresses are still used while
+// a thread of its own resolves them again, so that only the first
+// connection to a host waits for its resolution.
+//
+// The resolver the Base creates by default is one of these, over
+// getaddrinfo(3), which does not give the TTL of the DNS records:
+// |ttl| is set by --dns_cache_ttl_seconds.
+class CachingResolver : public Base::Resolver {
+ public:
+  typedef std::chrono::steady_clock Clock;
+
+  CachingResolver(std::unique_ptr<Base::Resolver> resolver,
+                  const Clock::duration& ttl,
+                  const Clock::duration& negative_ttl);
+  ~CachingResolver() override;
+  CachingResolver(const CachingResolver&) = delete;
+  CachingResolver& operator=(const CachingResolver&) = delete;
+
+  // Only blocks if |host| has not been resolved yet, or its failure
+  // to resolve has expired.
+  std::string Resolve(const std::string& host) override;
+  bool ResolveCached(const std::string& host, std::string* address) override;
+
+ private:
+  struct Entry {
+    // Empty if |host| could not be resolved.
+    std::string address;
+    Clock::time_point expiry;
+    bool refreshing;
+  };
+
+  // Returns the cached address of |host| in |address|, arranging for
+  // it to be refreshed if it has expired. Must be called with |lock_|.
+  bool LookupLocked(const std::string& host, std::string* address);
+  void Store(const std::string& host, const std::string& address);
+  void Refresh();
+
+  const std::unique_ptr<Base::Resolver> resolver_;
+  const Clock::duration ttl_;
+  const Clock::duration negative_ttl_;
+
+  std::mutex lock_;
+  std::condition_variable wake_refresher_;
+  std::map<std::string, Entry> entries_;
+  std::deque<std::string> to_refresh_;
+  bool exiting_;
+  // Started on the first refresh.
+  std::thread refresher_;
+};
+
+
 class Event {
  public:
   typedef std::function<void(evutil_socket_t, short)> Callback;
@@ -105,24 +196,110 @@ class HttpServer {
   typedef std::function<void(evhttp_request*)> HandlerCallback;
 
   explicit HttpServer(const Base& base);
+  // Also serves requests from |extra_reactors| event loops of its own,
+  // each running on its own thread and accepting connections on its
+  // own listening socket, the kernel spreading the connections over
+  // all of them with SO_REUSEPORT. If |pin_reactors|, each is pinned to
+  // a CPU of its own, taken from each NUMA node in turn, and is given
+  // the connections arriving on that CPU first (SO_INCOMING_CPU). The
+  // handlers are then called on any of these threads, and must reply
+  // from the event loop of the request (see Base::ForRequest()).
+  HttpServer(const Base& base, int extra_reactors, bool pin_reactors);
   ~HttpServer();
   HttpServer(const HttpServer&) = delete;
   HttpServer& operator=(const HttpServer&) = delete;
 
+  // Limits the bodies of the requests to |max_body_size| bytes, and
+  // the time to read a request and write its reply to |timeout_secs|
+  // (so that slow clients do not hold on to their connection and
+  // buffers), on all the event loops. Requests over the limit are
+  // rejected with 413 as soon as their Content-Length is read, or as
+  // their chunks arrive. Must be called before Bind().
+  void SetLimits(size_t max_body_size, int timeout_secs);
+
+  // Limits the connections open at once to |max_connections| in all,
+  // and to |max_per_address| from any one client address (0 for no
+  // limit), so that a large fleet of clients keeping their connections
+  // open cannot run the server out of descriptors and memory. The
+  // requests arriving on a connection over a limit are refused with
+  // 503, and the connection closed. Connections are only counted from
+  // their first request, before which the timeout of SetLimits()
+  // bounds how long they stay open.
+  //
+  // A non-zero |idle_timeout_secs| closes the connections from which
+  // nothing arrives for that long while a request is awaited, such as
+  // idle keep-alive ones, instead of after the timeout of SetLimits(),
+  // which must have been called and still bounds writing the replies.
+  // Requests being handled are not affected. Must be called before
+  // Bind().
+  void SetConnectionLimits(int max_connections, int max_per_address,
+                           int idle_timeout_secs);
+
+  // Starts the event loops of the extra reactors, if any.
   void Bind(const char* address, ev_uint16_t port);
-
-  // Returns false if there was an error adding the handler.
-  bool AddHandler(const std::string& path, const HandlerCallback& cb);
+  // Like the above, but accepts connections on |sockets|, the
+  // ListeningSockets() of a previous process (see SocketHandoff), which
+  // must have had as many event loops.
+  void Bind(const std::vector<int>& sockets);
+
+  // Returns the listening socket of each event loop, once bound.
+  std::vector<int> ListeningSockets() const;
+
+  // Stops accepting connections, closing the descriptors of the
+  // listening sockets of this process, which leaves them to any other
+  // process sharing them. The connections already accepted are still
+  // served. Must be called from the event loop of |base|.
+  void StopAccepting();
+
+  // Returns false if there was an error adding the handler. If
+  // |max_body_size| is not zero, requests to |path| with a larger body
+  // are rejected with 413 on the event loop, without calling |cb|. It
+  // can only be lower than the limit of the server, which bounds what
+  // is buffered.
+  bool AddHandler(const std::string& path, const HandlerCallback& cb,
+                  size_t max_body_size = 0);
+
+  // Returns a flag set once the connection of |req|, a request to one
+  // of the handlers of this server, closes, or null if there is none.
+  // Must be called from the event loop of |req|.
+  std::shared_ptr<const std::atomic<bool>> ConnectionClosed(
+      evhttp_request* req) const;
 
  private:
+  struct Connection;
   struct Handler;
+  struct Reactor;
+  // The connections of an event loop, which only it uses.
+  typedef std::unordered_map<evhttp_connection*, std::unique_ptr<Connection>>
+      Connections;
 
   static void HandleRequest(evhttp_request* req, void* userdata);
+  static void ConnectionClosedCallback(evhttp_connection* conn,
+                                       void* connection);
+
+  // Finds or adds the connection of |req|, or returns false if it is
+  // over the limits of SetConnectionLimits(). Called on its event loop.
+  bool TrackConnection(evhttp_request* req);
 
   evhttp* const http_;
+  evhttp_bound_socket* bound_;
+  const bool pin_reactors_;
+  std::vector<std::unique_ptr<Reactor>> reactors_;
+  bool reactors_running_;
   // Could have been a vector<Handler>, but it is important that
   // pointers to entries remain valid.
   std::vector<Handler*> handlers_;
+
+  int timeout_secs_;
+  int max_connections_;
+  int max_connections_per_address_;
+  int idle_timeout_secs_;
+  // By evhttp of each event loop, set up by the constructor.
+  std::unordered_map<evhttp*, Connections> connections_;
+  std::mutex addresses_lock_;
+  int open_connections_;
+  // The number of open connections by client address.
+  std::unordered_map<std::string, int> addresses_;
 };
 
 typedef std::multimap<std::string, std::string> QueryParams;
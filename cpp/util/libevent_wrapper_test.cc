@@ -1,15 +1,53 @@
 #include "util/libevent_wrapper.h"
 
 #include <gtest/gtest.h>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
 
 #include "util/testing.h"
 
 namespace cert_trans {
 namespace libevent {
 
+using std::chrono::hours;
+using std::chrono::milliseconds;
+using std::lock_guard;
+using std::mutex;
+using std::string;
+using std::unique_ptr;
+
 void DoNothing() {
 }
 
+
+// Answers from |addresses|, counting the lookups.
+class FakeResolver : public Base::Resolver {
+ public:
+  string Resolve(const string& host) override {
+    lock_guard<mutex> lock(lock_);
+    ++lookups_;
+    return addresses_[host];
+  }
+
+  void Set(const string& host, const string& address) {
+    lock_guard<mutex> lock(lock_);
+    addresses_[host] = address;
+  }
+
+  int lookups() {
+    lock_guard<mutex> lock(lock_);
+    return lookups_;
+  }
+
+ private:
+  mutex lock_;
+  std::map<string, string> addresses_;
+  int lookups_ = 0;
+};
+
 class LibEventWrapperTest : public ::testing::Test {
  public:
   void ExpectToBeOnEventThread(const bool expect) {
@@ -43,6 +81,19 @@ TEST_F(LibEventWrapperTest, TestTurtlesAllTheWayDown) {
 }
 
 
+TEST_F(LibEventWrapperTest, TestOnOwnEventThread) {
+  std::shared_ptr<Base> base(std::make_shared<Base>());
+  std::shared_ptr<Base> other(std::make_shared<Base>());
+  EXPECT_FALSE(base->OnOwnEventThread());
+  base->Add([base, other]() {
+    EXPECT_TRUE(base->OnOwnEventThread());
+    EXPECT_FALSE(other->OnOwnEventThread());
+  });
+  base->DispatchOnce();
+  EXPECT_FALSE(base->OnOwnEventThread());
+}
+
+
 TEST_F(LibEventWrapperDeathTest, TestCheckNotOnEventThread) {
   // Should be fine:
   Base::CheckNotOnEventThread();
@@ -57,6 +108,75 @@ TEST_F(LibEventWrapperDeathTest, TestCheckNotOnEventThread) {
 }
 
 
+class CachingResolverTest : public ::testing::Test {
+ protected:
+  CachingResolverTest() : fake_(new FakeResolver) {
+    fake_->Set("a.example.com", "192.0.2.1");
+  }
+
+  unique_ptr<CachingResolver> NewResolver(
+      const CachingResolver::Clock::duration& ttl) {
+    return unique_ptr<CachingResolver>(
+        new CachingResolver(unique_ptr<Base::Resolver>(fake_), ttl, hours(1)));
+  }
+
+  // Owned by the resolver.
+  FakeResolver* const fake_;
+};
+
+
+TEST_F(CachingResolverTest, CachesAddresses) {
+  const unique_ptr<CachingResolver> resolver(NewResolver(hours(1)));
+  EXPECT_EQ("192.0.2.1", resolver->Resolve("a.example.com"));
+  fake_->Set("a.example.com", "192.0.2.2");
+  EXPECT_EQ("192.0.2.1", resolver->Resolve("a.example.com"));
+  string address;
+  EXPECT_TRUE(resolver->ResolveCached("a.example.com", &address));
+  EXPECT_EQ("192.0.2.1", address);
+  EXPECT_EQ(1, fake_->lookups());
+}
+
+
+TEST_F(CachingResolverTest, CachesFailures) {
+  const unique_ptr<CachingResolver> resolver(NewResolver(hours(1)));
+  EXPECT_EQ("", resolver->Resolve("b.example.com"));
+  fake_->Set("b.example.com", "192.0.2.2");
+  EXPECT_EQ("", resolver->Resolve("b.example.com"));
+  EXPECT_EQ(1, fake_->lookups());
+}
+
+
+TEST_F(CachingResolverTest, RefreshesExpiredAddressesInTheBackground) {
+  const unique_ptr<CachingResolver> resolver(NewResolver(milliseconds(0)));
+  EXPECT_EQ("192.0.2.1", resolver->Resolve("a.example.com"));
+  fake_->Set("a.example.com", "192.0.2.2");
+  // The expired address is used until the new one is known.
+  string address(resolver->Resolve("a.example.com"));
+  for (int i = 0; i < 1000 && address == "192.0.2.1"; ++i) {
+    std::this_thread::sleep_for(milliseconds(5));
+    address = resolver->Resolve("a.example.com");
+  }
+  EXPECT_EQ("192.0.2.2", address);
+}
+
+
+TEST_F(CachingResolverTest, ResolveCachedResolvesInTheBackground) {
+  const unique_ptr<CachingResolver> resolver(NewResolver(hours(1)));
+  string address;
+  EXPECT_FALSE(resolver->ResolveCached("a.example.com", &address));
+  for (int i = 0; i < 1000 && fake_->lookups() == 0; ++i) {
+    std::this_thread::sleep_for(milliseconds(5));
+  }
+  for (int i = 0; i < 1000 &&
+                  !resolver->ResolveCached("a.example.com", &address);
+       ++i) {
+    std::this_thread::sleep_for(milliseconds(5));
+  }
+  EXPECT_EQ("192.0.2.1", address);
+  EXPECT_EQ(1, fake_->lookups());
+}
+
+
 }  // namespace libevent
 }  // namespace cert_trans
 
@@ -13,6 +13,7 @@ namespace cert_trans {
 using cert_trans::Gauge;
 using std::bind;
 using std::chrono::seconds;
+using std::chrono::steady_clock;
 using std::mutex;
 using std::placeholders::_1;
 using std::placeholders::_2;
@@ -28,6 +29,11 @@ DEFINE_int32(master_keepalive_interval_seconds, 60,
 DEFINE_int32(masterelection_retry_delay_seconds, 5,
              "Seconds to delay before retrying a failed attempt to create a "
              "proposal file.");
+DEFINE_int32(masterelection_proposal_ttl_seconds, 0,
+             "TTL of the mastership proposal, which bounds how long it takes "
+             "to notice that the master is gone. Must be greater than "
+             "--master_keepalive_interval_seconds. 0 means twice the "
+             "keep-alive interval.");
 
 namespace {
 
@@ -45,11 +51,24 @@ static Counter<>* proposal_creation_failures(
                    "Total number of failures to create an election "
                    "proposal."));
 
+static Counter<>* proposal_update_failures(
+    Counter<>::New("election_proposal_update_failures",
+                   "Total number of failures to update an election "
+                   "proposal."));
+
 
 // Special backing string which indicates that we're not backing any proposal.
 const char kNoBacking[] = "";
 
 
+seconds ProposalTTL() {
+  if (FLAGS_masterelection_proposal_ttl_seconds > 0) {
+    return seconds(FLAGS_masterelection_proposal_ttl_seconds);
+  }
+  return seconds(FLAGS_master_keepalive_interval_seconds * 2);
+}
+
+
 // Returns |s| with a '/' appended if the last char is not already a '/'
 string EnsureEndsWithSlash(const string& s) {
   if (s.empty() || s.back() != '/') {
@@ -108,6 +127,7 @@ MasterElection::MasterElection(const shared_ptr<libevent::Base>& base,
       backed_proposal_(kNoBacking),
       is_master_(false) {
   CHECK_NE(kNoBacking, node_id);
+  CHECK_GT(ProposalTTL(), seconds(FLAGS_master_keepalive_interval_seconds));
   is_master_gauge->Set(0);
   participating_in_election_gauge->Set(0);
 }
@@ -208,9 +228,17 @@ bool MasterElection::IsMaster() const {
 }
 
 
+int64_t MasterElection::FencingToken() const {
+  unique_lock<mutex> lock(mutex_);
+  // The winning proposal has the lowest creation index of all the live
+  // ones, so any later master's proposal was created after it.
+  return IsMaster(lock) ? my_proposal_create_index_ : -1;
+}
+
+
 bool MasterElection::IsMaster(const unique_lock<mutex>& lock) const {
   CHECK(lock.owns_lock());
-  return is_master_;
+  return is_master_ && steady_clock::now() < lease_expiry_;
 }
 
 
@@ -265,9 +293,9 @@ void MasterElection::CreateProposal() {
   // Technically this could already exist if we had mastership before, crashed,
   // and then restarted before the TTL expired.
   EtcdClient::Response* const resp(new EtcdClient::Response);
+  proposal_sent_at_ = steady_clock::now();
   client_->CreateWithTTL(
-      my_proposal_path_, kNoBacking,
-      seconds(FLAGS_master_keepalive_interval_seconds * 2), resp,
+      my_proposal_path_, kNoBacking, ProposalTTL(), resp,
       new Task(bind(&MasterElection::ProposalCreateDone, this, resp, _1),
                base_.get()));
 }
@@ -296,6 +324,7 @@ void MasterElection::ProposalCreateDone(EtcdClient::Response* resp,
           << resp->etcd_index;
 
   my_proposal_modified_index_ = my_proposal_create_index_ = resp->etcd_index;
+  lease_expiry_ = proposal_sent_at_ + ProposalTTL();
   // Start a periodic callback to keep our proposal from being garbage
   // collected
   CHECK(!proposal_refresh_callback_);
@@ -345,8 +374,8 @@ void MasterElection::UpdateProposal(const string& backed) {
 
   // TODO(alcutter): Set the HTTP timeout inside here to something sensible.
   EtcdClient::Response* const resp(new EtcdClient::Response);
-  client_->UpdateWithTTL(my_proposal_path_, backed,
-                         seconds(FLAGS_master_keepalive_interval_seconds * 2),
+  proposal_sent_at_ = steady_clock::now();
+  client_->UpdateWithTTL(my_proposal_path_, backed, ProposalTTL(),
                          my_proposal_modified_index_, resp,
                          new Task(bind(&MasterElection::ProposalUpdateDone,
                                        this, resp, _1),
@@ -358,15 +387,34 @@ void MasterElection::ProposalUpdateDone(EtcdClient::Response* resp,
                                         Task* task) {
   unique_ptr<EtcdClient::Response> resp_deleter(resp);
   unique_lock<mutex> lock(mutex_);
-  // TODO(alcutter): Handle this
-  CHECK(task->status().ok()) << my_proposal_path_ << ": " << task->status();
+  if (!task->status().ok()) {
+    // TODO(alcutter): Handle losing the proposal altogether.
+    CHECK_NE(util::error::FAILED_PRECONDITION,
+             task->status().CanonicalCode())
+        << my_proposal_path_ << ": " << task->status();
+    CHECK_NE(util::error::NOT_FOUND, task->status().CanonicalCode())
+        << my_proposal_path_ << ": " << task->status();
+    // Otherwise, etcd is probably just unreachable for now. The next
+    // keep-alive will try again, and until then the lease is not extended,
+    // so that we stop being master if this goes on for too long.
+    proposal_update_failures->Increment();
+    LOG(WARNING) << my_proposal_path_
+                 << ": Problem updating proposal: " << task->status();
+    Transition(lock, ProposalState::UP_TO_DATE);
+    return;
+  }
   Transition(lock, ProposalState::UP_TO_DATE);
 
   // Keep a note of the current modification index of our proposal since
   // we'll need it in order to update or delete the proposal
   my_proposal_modified_index_ = resp->etcd_index;
+  lease_expiry_ = proposal_sent_at_ + ProposalTTL();
   VLOG(1) << my_proposal_path_ << ": Proposal refreshed @ "
           << resp->etcd_index;
+  if (is_master_) {
+    // Wake up anyone who saw the lease as expired.
+    is_master_cv_.notify_all();
+  }
 }
 
 
@@ -543,7 +591,8 @@ void MasterElection::OnProposalUpdate(
                (apparent_master.key_ == my_proposal_path_ &&
                 apparent_master.created_index_ == my_proposal_create_index_);
   if (is_master_) {
-    LOG(INFO) << my_proposal_path_ << ": Became master";
+    LOG(INFO) << my_proposal_path_ << ": Became master with fencing token "
+              << my_proposal_create_index_;
     is_master_gauge->Set(1);
     is_master_cv_.notify_all();
   }
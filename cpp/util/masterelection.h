@@ -2,6 +2,7 @@
 #define CERT_TRANS_UTIL_MASTERELECTION_H_
 
 #include <stdint.h>
+#include <chrono>
 #include <condition_variable>
 #include <memory>
 #include <mutex>
@@ -37,6 +38,15 @@ class PeriodicClosure;
 // maintains a periodic callback whose sole job is to update the TTL on its
 // proposal file.
 //
+// Mastership is also held as a lease: a master only considers itself master
+// until the TTL of its last successful proposal refresh, counted from when
+// the refresh was sent, runs out. Since etcd can only expire the proposal
+// later than that, a master which cannot reach etcd steps down before
+// another participant can be elected. Lowering
+// --masterelection_proposal_ttl_seconds (together with
+// --master_keepalive_interval_seconds) makes failover correspondingly
+// faster.
+//
 // TODO(alcutter): Some enhancements:
 //   - Recover gracefully from a crash where an old proposal exists for this
 //     node (e.g. recover and continue, or delete it, or wait, ...)
@@ -65,6 +75,12 @@ class MasterElection {
   // call.
   virtual bool IsMaster() const;
 
+  // Returns a token identifying the current term of mastership if this
+  // instance is master, or -1 otherwise. Tokens of successive masters are
+  // strictly increasing, so that writes carrying an older token can be
+  // recognised as coming from a deposed master.
+  virtual int64_t FencingToken() const;
+
  protected:
   MasterElection();
 
@@ -129,7 +145,8 @@ class MasterElection {
   // more of the proposal files.
   void OnProposalUpdate(const std::vector<EtcdClient::Node>& updates);
 
-  // Internal non-locking accessor for is_master_
+  // Internal non-locking accessor for is_master_, which also checks that
+  // the lease has not expired.
   bool IsMaster(const std::unique_lock<std::mutex>& lock) const;
 
   const std::shared_ptr<libevent::Base> base_;
@@ -153,6 +170,10 @@ class MasterElection {
 
   int64_t my_proposal_create_index_;
   int64_t my_proposal_modified_index_;
+  // When the in-flight proposal create or update was sent.
+  std::chrono::steady_clock::time_point proposal_sent_at_;
+  // When the TTL of our last successfully written proposal runs out.
+  std::chrono::steady_clock::time_point lease_expiry_;
 
   std::string backed_proposal_;
 
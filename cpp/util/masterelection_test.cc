@@ -53,6 +53,7 @@ DEFINE_string(etcd, "", "etcd server address");
 DEFINE_int32(etcd_port, 4001, "etcd server port");
 DECLARE_int32(master_keepalive_interval_seconds);
 DECLARE_int32(masterelection_retry_delay_seconds);
+DECLARE_int32(masterelection_proposal_ttl_seconds);
 
 
 // Simple helper class, represents a thread of interest in participating in
@@ -100,6 +101,10 @@ struct Participant {
     return election_->IsMaster();
   }
 
+  int64_t FencingToken() {
+    return election_->FencingToken();
+  }
+
   void ElectionMania(int num_rounds,
                      const vector<unique_ptr<Participant>>* all_participants) {
     notification_.reset(new Notification);
@@ -299,6 +304,50 @@ TEST_F(ElectionTest, RetresCreatingProposal) {
 }
 
 
+TEST_F(ElectionTest, FencingTokenIncreases) {
+  Participant one(kProposalDir, "1", base_, client_.get());
+  EXPECT_EQ(-1, one.FencingToken());
+  one.ElectLikeABoss();
+  const int64_t first_token(one.FencingToken());
+  EXPECT_GT(first_token, 0);
+
+  Participant two(kProposalDir, "2", base_, client_.get());
+  two.StartElection();
+  sleep(1);
+  EXPECT_EQ(-1, two.FencingToken());
+
+  one.StopElection();
+  EXPECT_EQ(-1, one.FencingToken());
+  EXPECT_TRUE(two.WaitToBecomeMaster());
+  EXPECT_GT(two.FencingToken(), first_token);
+  two.StopElection();
+}
+
+
+TEST_F(ElectionTest, MasterStepsDownWhenLeaseExpires) {
+  const int old_keepalive(FLAGS_master_keepalive_interval_seconds);
+  const int old_ttl(FLAGS_masterelection_proposal_ttl_seconds);
+  FLAGS_master_keepalive_interval_seconds = 1;
+  FLAGS_masterelection_proposal_ttl_seconds = 2;
+  Participant one(kProposalDir, "1", base_, client_.get());
+  one.ElectLikeABoss();
+
+  // Keeps the proposal alive for longer than its TTL.
+  sleep(3);
+  EXPECT_TRUE(one.IsMaster());
+
+  // Without refreshes, the lease runs out.
+  KillProposalRefresh(&one);
+  sleep(3);
+  EXPECT_FALSE(one.IsMaster());
+  EXPECT_EQ(-1, one.FencingToken());
+
+  one.StopElection();
+  FLAGS_master_keepalive_interval_seconds = old_keepalive;
+  FLAGS_masterelection_proposal_ttl_seconds = old_ttl;
+}
+
+
 TEST_F(ElectionTest, ElectionMania) {
   const int kNumRounds(20);
   const int kNumParticipants(20);
@@ -15,6 +15,7 @@ class MockMasterElection : public MasterElection {
   MOCK_METHOD0(StopElection, void());
   MOCK_CONST_METHOD0(WaitToBecomeMaster, bool());
   MOCK_CONST_METHOD0(IsMaster, bool());
+  MOCK_CONST_METHOD0(FencingToken, int64_t());
 };
 
 }  // namespace cert_trans
@@ -126,6 +126,8 @@ class ScopedOpenSSLContext {
 
 using ScopedASN1_OCTET_STRING =
     ScopedOpenSSLType<ASN1_OCTET_STRING, ASN1_OCTET_STRING_free>;
+using ScopedAUTHORITY_KEYID =
+    ScopedOpenSSLType<AUTHORITY_KEYID, AUTHORITY_KEYID_free>;
 using ScopedBASIC_CONSTRAINTS =
     ScopedOpenSSLType<BASIC_CONSTRAINTS, BASIC_CONSTRAINTS_free>;
 using ScopedBIO = ScopedOpenSSLType<BIO, BIO_vfree>;
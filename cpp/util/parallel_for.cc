@@ -0,0 +1,95 @@
+#include "util/parallel_for.h"
+
+#include <glog/logging.h>
+#include <algorithm>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "util/executor.h"
+
+using std::condition_variable;
+using std::function;
+using std::lock_guard;
+using std::make_shared;
+using std::min;
+using std::mutex;
+using std::shared_ptr;
+using std::thread;
+using std::unique_lock;
+
+namespace util {
+
+namespace {
+
+
+struct ParallelForState {
+  ParallelForState(size_t count, const function<void(size_t)>& fn)
+      : count_(count), fn_(fn), next_(0), running_(0) {
+  }
+
+  // Runs |fn_| on indices until there are none left.
+  void Run() {
+    while (true) {
+      size_t index;
+      {
+        lock_guard<mutex> lock(lock_);
+        if (next_ >= count_) {
+          return;
+        }
+        index = next_++;
+        ++running_;
+      }
+
+      fn_(index);
+
+      lock_guard<mutex> lock(lock_);
+      if (--running_ == 0 && next_ >= count_) {
+        done_.notify_all();
+      }
+    }
+  }
+
+  const size_t count_;
+  // Only used while there are indices left, so the caller's function
+  // (and what it refers to) does not have to outlive ParallelFor().
+  const function<void(size_t)>& fn_;
+
+  mutex lock_;
+  condition_variable done_;
+  size_t next_;
+  size_t running_;
+};
+
+
+}  // namespace
+
+
+void ParallelFor(Executor* executor, size_t count,
+                 const function<void(size_t)>& fn) {
+  CHECK_NOTNULL(executor);
+  if (count == 0) {
+    return;
+  }
+
+  // Helpers that the executor gets to late find nothing left to do, but
+  // still need the state, hence the shared_ptr.
+  const shared_ptr<ParallelForState> state(
+      make_shared<ParallelForState>(count, fn));
+  const size_t helpers(
+      min<size_t>(count, std::max(1U, thread::hardware_concurrency())) - 1);
+  for (size_t i = 0; i < helpers; ++i) {
+    executor->Add([state]() { state->Run(); });
+  }
+
+  state->Run();
+
+  unique_lock<mutex> lock(state->lock_);
+  state->done_.wait(lock, [&state]() {
+    return state->running_ == 0 && state->next_ >= state->count_;
+  });
+}
+
+
+}  // namespace util
@@ -0,0 +1,26 @@
+#ifndef CERT_TRANS_UTIL_PARALLEL_FOR_H_
+#define CERT_TRANS_UTIL_PARALLEL_FOR_H_
+
+#include <stddef.h>
+#include <functional>
+
+namespace util {
+class Executor;
+
+
+// Calls |fn| once for each index in [0, |count|), spreading the calls
+// over |executor| and the calling thread, and returns once all of them
+// have returned. Indices are handed out in increasing order, but may
+// complete in any order.
+//
+// The calling thread takes part in the work, so it is safe to call this
+// from a thread of |executor| itself, even if all the other threads of
+// |executor| are busy: in the worst case, everything runs on the
+// calling thread.
+void ParallelFor(Executor* executor, size_t count,
+                 const std::function<void(size_t)>& fn);
+
+
+}  // namespace util
+
+#endif  // CERT_TRANS_UTIL_PARALLEL_FOR_H_
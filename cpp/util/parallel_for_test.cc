@@ -0,0 +1,62 @@
+#include "util/parallel_for.h"
+
+#include <gtest/gtest.h>
+#include <atomic>
+#include <vector>
+
+#include "base/notification.h"
+#include "util/testing.h"
+#include "util/thread_pool.h"
+
+namespace util {
+namespace {
+
+using cert_trans::Notification;
+using cert_trans::ThreadPool;
+using std::atomic;
+using std::vector;
+
+
+TEST(ParallelForTest, RunsEachIndexOnce) {
+  ThreadPool pool(4);
+  vector<atomic<int>> runs(1000);
+  for (auto& r : runs) {
+    r = 0;
+  }
+
+  ParallelFor(&pool, runs.size(), [&runs](size_t i) { ++runs[i]; });
+
+  for (size_t i = 0; i < runs.size(); ++i) {
+    EXPECT_EQ(1, runs[i]) << "index " << i;
+  }
+}
+
+
+TEST(ParallelForTest, NothingToDo) {
+  ThreadPool pool(1);
+  ParallelFor(&pool, 0, [](size_t) { ADD_FAILURE() << "should not run"; });
+}
+
+
+// Calling ParallelFor() from the only thread of the executor must not
+// deadlock, since the calling thread does the work itself.
+TEST(ParallelForTest, FromExecutorThread) {
+  ThreadPool pool(1);
+  atomic<int> sum(0);
+  Notification done;
+  pool.Add([&pool, &sum, &done]() {
+    ParallelFor(&pool, 10, [&sum](size_t i) { sum += i; });
+    done.Notify();
+  });
+  done.WaitForNotification();
+  EXPECT_EQ(45, sum);
+}
+
+
+}  // namespace
+}  // namespace util
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
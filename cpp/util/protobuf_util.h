@@ -6,6 +6,7 @@
 namespace google {
 namespace protobuf {
 namespace io {
+class ZeroCopyInputStream;
 class ZeroCopyOutputStream;
 }  // namespace io
 
@@ -29,6 +30,14 @@ bool WriteDelimitedToOstream(const google::protobuf::MessageLite& message,
                              std::ostream* os);
 
 
+// The reverse of WriteDelimitedTo(), from the same source. Sets
+// |clean_eof| to true (and returns false) if |rawInput| was at its end
+// before the message started, rather than in the middle of it.
+bool ReadDelimitedFrom(google::protobuf::io::ZeroCopyInputStream* rawInput,
+                       google::protobuf::MessageLite* message,
+                       bool* clean_eof);
+
+
 }  // namespace cert_trans
 
 
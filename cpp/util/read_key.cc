@@ -1,5 +1,6 @@
 #include "util/read_key.h"
 
+#include <openssl/engine.h>
 #include <openssl/pem.h>
 #include <memory>
 
@@ -56,4 +57,35 @@ util::StatusOr<EVP_PKEY*> ReadPublicKey(const std::string& file) {
 }
 
 
+util::StatusOr<EVP_PKEY*> ReadEnginePrivateKey(const std::string& engine_id,
+                                               const std::string& key_id) {
+  ENGINE_load_builtin_engines();
+  ENGINE* const engine(ENGINE_by_id(engine_id.c_str()));
+  if (!engine) {
+    return util::Status(util::error::NOT_FOUND,
+                        "OpenSSL engine not found: " + engine_id);
+  }
+  const int initialised(ENGINE_init(engine));
+  // ENGINE_init() took its own reference, if it succeeded.
+  ENGINE_free(engine);
+  if (initialised != 1) {
+    return util::Status(util::error::FAILED_PRECONDITION,
+                        "cannot initialise OpenSSL engine: " + engine_id);
+  }
+
+  // No password, the engine gets the PIN if any from |key_id| or its
+  // configuration.
+  EVP_PKEY* const retval(
+      ENGINE_load_private_key(engine, key_id.c_str(), nullptr, nullptr));
+  if (!retval) {
+    ENGINE_finish(engine);
+    return util::Status(util::error::FAILED_PRECONDITION,
+                        "cannot load key " + key_id + " from OpenSSL engine " +
+                            engine_id);
+  }
+
+  return retval;
+}
+
+
 }  // namespace cert_trans
@@ -13,6 +13,13 @@ util::StatusOr<EVP_PKEY*> ReadPrivateKey(const std::string& file);
 
 util::StatusOr<EVP_PKEY*> ReadPublicKey(const std::string& file);
 
+// Loads the private key |key_id| through the OpenSSL engine |engine_id|,
+// such as the "pkcs11" engine of libp11 with a PKCS#11 URI, for a key
+// held by an HSM. The engine stays initialised for as long as the
+// process runs, since the key signs through it.
+util::StatusOr<EVP_PKEY*> ReadEnginePrivateKey(const std::string& engine_id,
+                                               const std::string& key_id);
+
 
 }  // namespace cert_trans
 
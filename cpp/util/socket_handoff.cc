@@ -0,0 +1,233 @@
+#include "util/socket_handoff.h"
+
+#include <errno.h>
+#include <glog/logging.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cstdint>
+
+using std::function;
+using std::move;
+using std::string;
+using std::thread;
+using std::unique_ptr;
+using std::vector;
+using util::Status;
+using util::StatusOr;
+
+namespace cert_trans {
+namespace {
+
+
+// More than there are event loops in a server.
+const size_t kMaxSockets = 256;
+const char kTakeOver = 'T';
+const char kStopped = 'S';
+
+
+sockaddr_un UnixAddress(const string& path) {
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  CHECK_LT(path.size(), sizeof(addr.sun_path)) << "path too long: " << path;
+  memcpy(addr.sun_path, path.data(), path.size());
+  return addr;
+}
+
+
+int Listen(const string& path) {
+  const sockaddr_un addr(UnixAddress(path));
+  const int sock(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+  PCHECK(sock >= 0) << "socket";
+  // Left behind by a previous process, which has handed off already or
+  // has gone away.
+  PCHECK(unlink(path.c_str()) == 0 || errno == ENOENT) << "unlink " << path;
+  PCHECK(bind(sock, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) ==
+         0)
+      << "bind to " << path;
+  PCHECK(listen(sock, 1) == 0) << "listen";
+  return sock;
+}
+
+
+bool SendByte(int conn, char byte) {
+  return send(conn, &byte, 1, MSG_NOSIGNAL) == 1;
+}
+
+
+bool ReceiveByte(int conn, char expected) {
+  char byte;
+  ssize_t received;
+  do {
+    received = recv(conn, &byte, 1, 0);
+  } while (received < 0 && errno == EINTR);
+  return received == 1 && byte == expected;
+}
+
+
+}  // namespace
+
+
+SocketHandoff::SocketHandoff(const string& path,
+                             const function<vector<int>()>& get_sockets,
+                             const function<void()>& stop_accepting)
+    : get_sockets_(get_sockets),
+      stop_accepting_(stop_accepting),
+      listener_(Listen(path)),
+      thread_(&SocketHandoff::Serve, this) {
+  LOG(INFO) << "Offering the listening sockets at " << path;
+}
+
+
+SocketHandoff::~SocketHandoff() {
+  // Makes a blocked accept() return.
+  shutdown(listener_, SHUT_RDWR);
+  thread_.join();
+  close(listener_);
+}
+
+
+void SocketHandoff::Serve() {
+  while (true) {
+    const int conn(accept4(listener_, nullptr, nullptr, SOCK_CLOEXEC));
+    if (conn < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      // Shut down by the destructor.
+      return;
+    }
+    const bool handed_off(HandOff(conn));
+    close(conn);
+    if (handed_off) {
+      return;
+    }
+    LOG(WARNING) << "The new process went away without taking over";
+  }
+}
+
+
+bool SocketHandoff::HandOff(int conn) {
+  const vector<int> sockets(get_sockets_());
+  CHECK(!sockets.empty());
+  CHECK_LE(sockets.size(), kMaxSockets);
+
+  uint32_t count(sockets.size());
+  iovec iov;
+  iov.iov_base = &count;
+  iov.iov_len = sizeof(count);
+  vector<char> control(CMSG_SPACE(sizeof(int) * sockets.size()));
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.data();
+  msg.msg_controllen = control.size();
+  cmsghdr* const cmsg(CMSG_FIRSTHDR(&msg));
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * sockets.size());
+  memcpy(CMSG_DATA(cmsg), sockets.data(), sizeof(int) * sockets.size());
+  if (sendmsg(conn, &msg, MSG_NOSIGNAL) != sizeof(count)) {
+    PLOG(WARNING) << "sendmsg";
+    return false;
+  }
+  LOG(INFO) << "Sent " << sockets.size() << " listening sockets";
+
+  if (!ReceiveByte(conn, kTakeOver)) {
+    return false;
+  }
+  LOG(INFO) << "The new process is taking over, no longer accepting "
+            << "connections";
+  stop_accepting_();
+  // Even if the new process is gone by now, it was accepting
+  // connections, so it is too late to go back.
+  SendByte(conn, kStopped);
+  return true;
+}
+
+
+ReceivedSockets::ReceivedSockets(int conn, vector<int> sockets)
+    : conn_(conn), sockets_(move(sockets)) {
+}
+
+
+ReceivedSockets::~ReceivedSockets() {
+  if (conn_ >= 0) {
+    close(conn_);
+  }
+}
+
+
+Status ReceivedSockets::TakeOver() {
+  CHECK_GE(conn_, 0) << "already taken over";
+  const bool stopped(SendByte(conn_, kTakeOver) &&
+                     ReceiveByte(conn_, kStopped));
+  close(conn_);
+  conn_ = -1;
+  if (!stopped) {
+    // It will not be accepting connections for much longer either way.
+    return Status(util::error::UNAVAILABLE,
+                  "previous process went away during the handoff");
+  }
+  return ::util::OkStatus();
+}
+
+
+StatusOr<unique_ptr<ReceivedSockets>> ReceiveSockets(const string& path) {
+  const sockaddr_un addr(UnixAddress(path));
+  const int conn(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+  PCHECK(conn >= 0) << "socket";
+  if (connect(conn, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) !=
+      0) {
+    const int error(errno);
+    close(conn);
+    if (error == ENOENT || error == ECONNREFUSED) {
+      return Status(util::error::NOT_FOUND, "no sockets offered at " + path);
+    }
+    return Status(util::error::INTERNAL,
+                  "cannot connect to " + path + ": " + strerror(error));
+  }
+
+  uint32_t count(0);
+  iovec iov;
+  iov.iov_base = &count;
+  iov.iov_len = sizeof(count);
+  vector<char> control(CMSG_SPACE(sizeof(int) * kMaxSockets));
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.data();
+  msg.msg_controllen = control.size();
+  ssize_t received;
+  do {
+    received = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+  } while (received < 0 && errno == EINTR);
+
+  vector<int> sockets;
+  const cmsghdr* const cmsg(received == sizeof(count) ? CMSG_FIRSTHDR(&msg)
+                                                       : nullptr);
+  if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+      cmsg->cmsg_type == SCM_RIGHTS) {
+    sockets.resize((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+    memcpy(sockets.data(), CMSG_DATA(cmsg), sizeof(int) * sockets.size());
+  }
+  if (sockets.empty() || sockets.size() != count ||
+      (msg.msg_flags & MSG_CTRUNC)) {
+    for (int sock : sockets) {
+      close(sock);
+    }
+    close(conn);
+    return Status(util::error::INTERNAL,
+                  "bad listening sockets received from " + path);
+  }
+  LOG(INFO) << "Received " << sockets.size() << " listening sockets from "
+            << path;
+  return unique_ptr<ReceivedSockets>(new ReceivedSockets(conn, move(sockets)));
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,93 @@
+#ifndef CERT_TRANS_UTIL_SOCKET_HANDOFF_H_
+#define CERT_TRANS_UTIL_SOCKET_HANDOFF_H_
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "util/statusor.h"
+
+namespace cert_trans {
+
+
+// Hands the listening sockets of a server over to the process replacing
+// it, through a Unix socket at an agreed path, so that no connection is
+// refused while one process takes over from the other:
+//
+//  1. The new process connects and receives the sockets, on which the
+//     old one keeps accepting connections (see ReceiveSockets()).
+//  2. Once ready to serve, the new process accepts connections on them
+//     too, and says so (see ReceivedSockets::TakeOver()).
+//  3. The old process stops accepting connections, acknowledges, and
+//     drains the ones it has. The new one then serves the path for the
+//     process after it.
+//
+// If the new process goes away before taking over, the old one carries
+// on and waits for another.
+class SocketHandoff {
+ public:
+  // Offers the sockets returned by |get_sockets| at |path|, from a
+  // thread of its own, replacing any stale Unix socket there. Calls
+  // |stop_accepting| once a new process takes over, which must return
+  // once this one has stopped accepting connections, then stops
+  // serving |path|.
+  SocketHandoff(const std::string& path,
+                const std::function<std::vector<int>()>& get_sockets,
+                const std::function<void()>& stop_accepting);
+  ~SocketHandoff();
+  SocketHandoff(const SocketHandoff&) = delete;
+  SocketHandoff& operator=(const SocketHandoff&) = delete;
+
+ private:
+  void Serve();
+  // Returns true if the process connected on |conn| took over.
+  bool HandOff(int conn);
+
+  const std::function<std::vector<int>()> get_sockets_;
+  const std::function<void()> stop_accepting_;
+  const int listener_;
+  std::thread thread_;
+};
+
+
+// The sockets received from a previous process, which accepts
+// connections on them until TakeOver() is called. Destroying this
+// before that leaves them with it.
+class ReceivedSockets {
+ public:
+  ~ReceivedSockets();
+  ReceivedSockets(const ReceivedSockets&) = delete;
+  ReceivedSockets& operator=(const ReceivedSockets&) = delete;
+
+  // The caller owns them.
+  const std::vector<int>& sockets() const {
+    return sockets_;
+  }
+
+  // Tells the previous process to stop accepting connections, and waits
+  // until it has. Should only be called once connections are accepted
+  // on sockets().
+  util::Status TakeOver();
+
+ private:
+  friend util::StatusOr<std::unique_ptr<ReceivedSockets>> ReceiveSockets(
+      const std::string& path);
+
+  ReceivedSockets(int conn, std::vector<int> sockets);
+
+  int conn_;
+  const std::vector<int> sockets_;
+};
+
+
+// Receives the listening sockets offered at |path| by a SocketHandoff.
+// Returns NOT_FOUND if no process offers any there.
+util::StatusOr<std::unique_ptr<ReceivedSockets>> ReceiveSockets(
+    const std::string& path);
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_UTIL_SOCKET_HANDOFF_H_
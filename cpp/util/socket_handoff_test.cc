@@ -0,0 +1,135 @@
+#include "util/socket_handoff.h"
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <atomic>
+#include <memory>
+#include <string>
+
+#include "util/status_test_util.h"
+#include "util/test_db.h"
+#include "util/testing.h"
+
+namespace cert_trans {
+namespace {
+
+using std::atomic;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+using util::StatusOr;
+using util::testing::StatusIs;
+
+
+// Returns the port |sock| is bound to.
+int Port(int sock) {
+  sockaddr_in addr;
+  socklen_t len(sizeof(addr));
+  CHECK_EQ(0, getsockname(sock, reinterpret_cast<sockaddr*>(&addr), &len));
+  return ntohs(addr.sin_port);
+}
+
+
+class SocketHandoffTest : public ::testing::Test {
+ protected:
+  SocketHandoffTest()
+      : path_(tmp_.TmpStorageDir() + "/handoff"), stopped_(false) {
+    for (int i = 0; i < 2; ++i) {
+      const int sock(socket(AF_INET, SOCK_STREAM, 0));
+      CHECK_GE(sock, 0);
+      sockaddr_in addr;
+      memset(&addr, 0, sizeof(addr));
+      addr.sin_family = AF_INET;
+      addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      CHECK_EQ(0,
+               bind(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)));
+      CHECK_EQ(0, listen(sock, 1));
+      sockets_.push_back(sock);
+    }
+  }
+
+  ~SocketHandoffTest() {
+    for (int sock : sockets_) {
+      close(sock);
+    }
+  }
+
+  unique_ptr<SocketHandoff> Offer() {
+    return unique_ptr<SocketHandoff>(new SocketHandoff(
+        path_, [this]() { return sockets_; }, [this]() { stopped_ = true; }));
+  }
+
+  TmpStorage tmp_;
+  const string path_;
+  vector<int> sockets_;
+  atomic<bool> stopped_;
+};
+
+
+TEST_F(SocketHandoffTest, HandsOver) {
+  const unique_ptr<SocketHandoff> handoff(Offer());
+
+  StatusOr<unique_ptr<ReceivedSockets>> received(ReceiveSockets(path_));
+  ASSERT_OK(received);
+  const vector<int>& sockets(received.ValueOrDie()->sockets());
+  ASSERT_EQ(sockets_.size(), sockets.size());
+  for (size_t i = 0; i < sockets.size(); ++i) {
+    // Other descriptors, for the same sockets.
+    EXPECT_NE(sockets_[i], sockets[i]);
+    EXPECT_EQ(Port(sockets_[i]), Port(sockets[i]));
+  }
+  EXPECT_FALSE(stopped_);
+
+  EXPECT_OK(received.ValueOrDie()->TakeOver());
+  EXPECT_TRUE(stopped_);
+  for (int sock : sockets) {
+    close(sock);
+  }
+}
+
+
+TEST_F(SocketHandoffTest, KeepsOfferingUntilTakenOver) {
+  const unique_ptr<SocketHandoff> handoff(Offer());
+
+  {
+    StatusOr<unique_ptr<ReceivedSockets>> received(ReceiveSockets(path_));
+    ASSERT_OK(received);
+    for (int sock : received.ValueOrDie()->sockets()) {
+      close(sock);
+    }
+  }
+  EXPECT_FALSE(stopped_);
+
+  StatusOr<unique_ptr<ReceivedSockets>> received(ReceiveSockets(path_));
+  ASSERT_OK(received);
+  EXPECT_OK(received.ValueOrDie()->TakeOver());
+  EXPECT_TRUE(stopped_);
+  for (int sock : received.ValueOrDie()->sockets()) {
+    close(sock);
+  }
+}
+
+
+TEST_F(SocketHandoffTest, NothingOffered) {
+  EXPECT_THAT(ReceiveSockets(path_).status(),
+              StatusIs(util::error::NOT_FOUND));
+
+  // Nor once the process which offered them is gone.
+  Offer().reset();
+  EXPECT_THAT(ReceiveSockets(path_).status(),
+              StatusIs(util::error::NOT_FOUND));
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
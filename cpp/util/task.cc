@@ -6,9 +6,9 @@ using std::bind;
 using std::function;
 using std::lock_guard;
 using std::make_shared;
+using std::move;
 using std::mutex;
 using std::ostream;
-using std::placeholders::_1;
 using std::shared_ptr;
 using std::unique_lock;
 using std::vector;
@@ -16,9 +16,11 @@ using std::vector;
 namespace util {
 
 
-Task::Task(const function<void(Task*)>& done_callback, Executor* executor)
-    : done_callback_(done_callback),
+Task::Task(function<void(Task*)> done_callback, Executor* executor)
+    : done_callback_(move(done_callback)),
       executor_(CHECK_NOTNULL(executor)),
+      parent_(nullptr),
+      trace_context_(CurrentTraceContext()),
       state_(ACTIVE),
       cancelled_(false),
       holds_(0) {
@@ -165,11 +167,26 @@ void Task::WhenCancelled(const std::function<void()>& cancel_cb) {
 }
 
 
-Task* Task::AddChildWithExecutor(const function<void(Task*)>& done_callback,
+void Task::CancelAfter(const std::chrono::duration<double>& timeout) {
+  Task* const timer(AddChild([this](Task* timer) {
+    // The timer is cancelled along with the other children when this
+    // task returns.
+    if (timer->status().ok()) {
+      Cancel();
+    }
+  }));
+  executor_->Delay(timeout, timer);
+}
+
+
+Task* Task::AddChildWithExecutor(function<void(Task*)> done_callback,
                                  Executor* executor) {
-  const shared_ptr<Task> child_task(make_shared<Task>(
-      bind(&Task::RunChildDoneCallback, this, done_callback, _1),
-      CHECK_NOTNULL(executor)));
+  const shared_ptr<Task> child_task(
+      make_shared<Task>(move(done_callback), CHECK_NOTNULL(executor)));
+  child_task->parent_ = this;
+  if (!child_task->trace_context_.traced) {
+    child_task->trace_context_ = trace_context_;
+  }
   bool cancel;
 
   {
@@ -219,13 +236,18 @@ void Task::TryDoneTransition(unique_lock<mutex>* lock) {
   // executor is synchronous.
   lock->unlock();
 
-  // Once this is called, the task might get deleted.
-  executor_->Add(bind(&Task::RunCleanupAndDoneCallbacks, this));
+  // Once this is called, the task might get deleted. A lambda only
+  // capturing |this| fits in std::function without an allocation,
+  // unlike the equivalent std::bind.
+  executor_->Add([this]() { RunCleanupAndDoneCallbacks(); });
 }
 
 
 void Task::RunCancelCallback(const std::function<void()>& cb) {
-  cb();
+  {
+    ScopedTraceContext scope(trace_context_);
+    cb();
+  }
   RemoveHold();
 }
 
@@ -247,15 +269,19 @@ void Task::RunCleanupAndDoneCallbacks() {
     cb();
   }
 
-  // Once this is called, the task might get deleted.
+  // Once this is called, the task might get deleted (|scope| keeps a
+  // copy of the context). Child tasks are only deleted by their
+  // parent, in ChildDone().
+  ScopedTraceContext scope(trace_context_);
+  Task* const parent(parent_);
   done_callback_(this);
+  if (parent) {
+    parent->ChildDone(this);
+  }
 }
 
 
-void Task::RunChildDoneCallback(const function<void(Task*)>& done_callback,
-                                Task* child_task) {
-  done_callback(child_task);
-
+void Task::ChildDone(Task* child_task) {
   unique_lock<mutex> lock(lock_);
   vector<shared_ptr<Task>>::iterator it;
   for (it = child_tasks_.begin(); it != child_tasks_.end(); ++it) {
@@ -22,13 +22,16 @@
 #ifndef CERT_TRANS_UTIL_TASK_H_
 #define CERT_TRANS_UTIL_TASK_H_
 
+#include <chrono>
 #include <functional>
 #include <memory>
 #include <mutex>
+#include <utility>
 #include <vector>
 
 #include "util/executor.h"
 #include "util/status.h"
+#include "util/trace.h"
 
 namespace util {
 
@@ -47,7 +50,9 @@ namespace util {
 //
 class Task {
  public:
-  Task(const std::function<void(Task*)>& done_callback, Executor* executor);
+  // |done_callback| is taken by value, so that a temporary (such as
+  // the result of std::bind) is moved in rather than copied.
+  Task(std::function<void(Task*)> done_callback, Executor* executor);
   Task(const Task&) = delete;
   Task& operator=(const Task&) = delete;
 
@@ -61,6 +66,13 @@ class Task {
     return executor_;
   }
 
+  // The trace context current when the task was created (or that of
+  // its parent task), which is made current while running its
+  // callbacks.
+  const TraceContext& trace_context() const {
+    return trace_context_;
+  }
+
   // Requests that the asynchronous operation (and all its
   // descendants) be cancelled. There is no guarantee that the task is
   // PREPARED or DONE by the time this method returns. Also, the
@@ -72,6 +84,13 @@ class Task {
   // calling IsActive().
   Status status() const;
 
+  // Arranges for Cancel() to be called after |timeout|, if the task is
+  // still ACTIVE then: this is how a deadline is put on an
+  // asynchronous operation. The timer goes through Delay() on the
+  // executor, as a child task, so the task only enters the DONE state
+  // once the executor has cancelled it (or it has expired).
+  void CancelAfter(const std::chrono::duration<double>& timeout);
+
   // Methods used by the implementer of an asynchronous operation (the
   // callee).
 
@@ -133,12 +152,12 @@ class Task {
   // not reach the DONE state until all of its child tasks have
   // finished running. The executor of the child task is the same as
   // that of the parent.
-  Task* AddChild(const std::function<void(Task*)>& done_callback) {
-    return AddChildWithExecutor(done_callback, executor_);
+  Task* AddChild(std::function<void(Task*)> done_callback) {
+    return AddChildWithExecutor(std::move(done_callback), executor_);
   }
 
   // Variant of AddChild() that allows setting a different executor.
-  Task* AddChildWithExecutor(const std::function<void(Task*)>& done_callback,
+  Task* AddChildWithExecutor(std::function<void(Task*)> done_callback,
                              Executor* executor);
 
   // Functions to call once the task is DONE. This could be called
@@ -166,11 +185,18 @@ class Task {
   void TryDoneTransition(std::unique_lock<std::mutex>* lock);
   void RunCancelCallback(const std::function<void()>& cb);
   void RunCleanupAndDoneCallbacks();
-  void RunChildDoneCallback(const std::function<void(Task*)>& done_callback,
-                            Task* child_task);
+  // Called once the done callback of |child_task| has returned, to
+  // release it.
+  void ChildDone(Task* child_task);
 
   const std::function<void(Task*)> done_callback_;
   Executor* const executor_;
+  // The task this is a child of, which owns it, if any. Its done
+  // callback is run directly, rather than wrapped in another
+  // std::function, as child tasks are created for every step of an
+  // asynchronous operation.
+  Task* parent_;
+  TraceContext trace_context_;
 
   mutable std::mutex lock_;
   State state_;
@@ -8,6 +8,7 @@
 #include "base/notification.h"
 #include "util/executor.h"
 #include "util/status_test_util.h"
+#include "util/sync_task.h"
 #include "util/task.h"
 #include "util/testing.h"
 #include "util/thread_pool.h"
@@ -456,6 +457,38 @@ TYPED_TEST(TaskTest, ChildReturn) {
 }
 
 
+TEST(TaskCancelAfterTest, Cancels) {
+  ThreadPool pool;
+  util::SyncTask s(&pool);
+
+  s.task()->WhenCancelled(
+      [&s]() { s.task()->Return(util::Status::CANCELLED); });
+  s.task()->CancelAfter(milliseconds(FLAGS_task_test_jiffy_ms / 10));
+
+  s.Wait();
+  EXPECT_TRUE(s.task()->CancelRequested());
+  EXPECT_EQ(util::Status::CANCELLED, s.status());
+}
+
+
+TEST(TaskCancelAfterTest, DoesNotCancelOnceReturned) {
+  ThreadPool pool;
+  util::SyncTask s(&pool);
+
+  const std::chrono::steady_clock::time_point start(
+      std::chrono::steady_clock::now());
+  s.task()->CancelAfter(std::chrono::seconds(60));
+  s.task()->Return();
+
+  // The timer is cancelled, rather than holding the task for a minute.
+  s.Wait();
+  EXPECT_LT(std::chrono::steady_clock::now() - start,
+            std::chrono::seconds(10));
+  EXPECT_FALSE(s.task()->CancelRequested());
+  EXPECT_OK(s.status());
+}
+
+
 }  // namespace
 
 
@@ -2,39 +2,118 @@
 #include "util/task.h"
 
 #include <glog/logging.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
 #include <condition_variable>
+#include <deque>
 #include <mutex>
-#include <queue>
+#include <string>
 #include <thread>
+#include <utility>
 #include <vector>
 
+#include "base/lock_contention.h"
+#include "monitoring/counter.h"
+#include "monitoring/gauge.h"
+#include "monitoring/latency.h"
+#include "util/timer_wheel.h"
+#include "util/trace.h"
+
+using std::bind;
 using std::chrono::duration;
 using std::chrono::duration_cast;
+using std::chrono::milliseconds;
 using std::chrono::seconds;
 using std::chrono::steady_clock;
 using std::condition_variable;
+using std::deque;
 using std::function;
-using std::get;
 using std::lock_guard;
+using std::max;
 using std::mutex;
-using std::priority_queue;
+using std::pair;
+using std::string;
 using std::thread;
-using std::tuple;
 using std::unique_lock;
+using std::unique_ptr;
 using std::vector;
 
 namespace cert_trans {
 namespace {
 
-typedef tuple<steady_clock::time_point, function<void()>, util::Task*>
-    QueueEntry;
 
+Gauge<string>* thread_pool_queued_closures(
+    Gauge<string>::New("thread_pool_queued_closures", "work_class",
+                       "Number of closures waiting for a thread, broken "
+                       "down by class of work."));
+
+Gauge<string>* thread_pool_threads(
+    Gauge<string>::New("thread_pool_threads", "pool",
+                       "Number of threads of each named thread pool."));
+
+Latency<milliseconds, string> thread_pool_queue_wait_ms(
+    "thread_pool_queue_wait_ms", "work_class",
+    "Time closures waited for a thread in ms, broken down by class of "
+    "work.");
+
+Gauge<string>* thread_pool_oldest_closure_age_ms(
+    Gauge<string>::New("thread_pool_oldest_closure_age_ms", "work_class",
+                       "Time the oldest closure waiting for a thread had "
+                       "waited in ms, as of the last closure queued or "
+                       "taken, broken down by class of work."));
+
+Counter<string>* thread_pool_busy_ms(
+    Counter<string>::New("thread_pool_busy_ms", "pool",
+                         "Time the threads of each named thread pool spent "
+                         "running closures in ms: its rate over "
+                         "thread_pool_threads is how busy the pool is."));
+
+// Only for adding closures, which is what request handlers wait for.
+LockContention* const thread_pool_queue_contention(
+    LockContention::Get("thread_pool_queue"));
 
-struct QueueOrdering {
-  bool operator()(const QueueEntry& lhs, const QueueEntry& rhs) const {
-    return get<0>(lhs) > get<0>(rhs);
+
+// The work of a class of weight W advances its virtual time by
+// kStride / W, and the class furthest behind goes next.
+const uint64_t kStride = 1 << 20;
+
+// The resolution of Delay(), and the number of ticks in a turn of the
+// timer wheel: longer delays take several turns.
+const milliseconds kTimerTick(1);
+const size_t kTimerSlots = 4096;
+
+
+// Runs the thread of |handle| on |cpus| only, where supported.
+void PinThread(thread* handle, const vector<int>& cpus) {
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (const int cpu : cpus) {
+    CPU_SET(cpu, &set);
   }
-};
+  const int error(
+      pthread_setaffinity_np(handle->native_handle(), sizeof(set), &set));
+  LOG_IF(WARNING, error != 0) << "Could not pin thread pool thread: "
+                              << strerror(error);
+#else
+  LOG(WARNING) << "Pinning thread pool threads is not supported.";
+#endif
+}
+
+
+// Names the thread of |handle| after its pool, as seen in top -H, gdb,
+// or /proc/<pid>/task/*/comm, where supported.
+void NameThread(thread* handle, const string& name) {
+#ifdef __linux__
+  // Linux limits thread names to 15 characters.
+  const int error(pthread_setname_np(handle->native_handle(),
+                                     name.substr(0, 15).c_str()));
+  LOG_IF(WARNING, error != 0) << "Could not name thread pool thread: "
+                              << strerror(error);
+#endif
+}
 
 
 }  // namespace
@@ -46,28 +125,114 @@ class ThreadPool::Impl {
 
   void Worker();
 
+  // Closures with the time they were queued.
+  typedef deque<pair<steady_clock::time_point, function<void()>>> Queue;
+
+  struct WorkClass {
+    WorkClass(const string& name, int weight, size_t max_queued)
+        : name(name), stride(kStride / weight), max_queued(max_queued),
+          pass(0) {
+    }
+
+    const string name;
+    const uint64_t stride;
+    const size_t max_queued;
+    uint64_t pass;
+    Queue queue;
+  };
+
+  // A worker thread waiting for something to do. Each has a condition
+  // variable of its own, so that a new closure wakes up exactly one
+  // of them.
+  struct IdleWorker {
+    condition_variable cond_var;
+    bool woken = false;
+  };
+
+  explicit Impl(const string& name)
+      : name_(name), timers_(kTimerTick, kTimerSlots, steady_clock::now()) {
+  }
+
+  // The name of a class of work, as exported.
+  string MetricName(const string& work_class) const {
+    return name_.empty() ? work_class : name_ + "/" + work_class;
+  }
+
+  // Exports the length of |queue| and the age of its oldest closure
+  // as of |now|, under |metric_name|. Must be called with
+  // |queue_lock_|.
+  static void ExportQueue(const string& metric_name, const Queue& queue,
+                          steady_clock::time_point now) {
+    thread_pool_queued_closures->Set(metric_name, queue.size());
+    thread_pool_oldest_closure_age_ms->Set(
+        metric_name,
+        queue.empty()
+            ? 0
+            : duration_cast<milliseconds>(now - queue.front().first).count());
+  }
+
+  // Same for the default queue, for a named pool.
+  void ExportDefaultQueue(steady_clock::time_point now) const {
+    if (!name_.empty()) {
+      ExportQueue(name_, queue_, now);
+    }
+  }
+
+  // Picks the class with the lowest pass among those with a closure
+  // ready, the timers which are due having been added to the default
+  // class, and takes its next closure. Returns false if there is
+  // none. Must be called with |queue_lock_|.
+  bool TakeNextClosure(function<void()>* closure);
+
+  // Cancels the Delay() of |task|, unless it is already due.
+  void CancelTimer(util::TimerWheel<util::Task*>::Id id, util::Task* task);
+
+  // Wakes up an idle worker, if there is one, for a new closure. Must
+  // be called with |queue_lock_|.
+  void WakeOne();
+
   // TODO(pphaneuf): I'd like this to be const, but it required
   // jumping through a few more hoops, keeping it simple for now.
   vector<thread> threads_;
 
+  const string name_;
   mutex queue_lock_;
-  condition_variable queue_cond_var_;
-  priority_queue<QueueEntry, vector<QueueEntry>, QueueOrdering> queue_;
+  // The default class of work.
+  Queue queue_;
+  uint64_t default_pass_ = 0;
+  // Class N is at index N - 1.
+  vector<unique_ptr<WorkClass>> classes_;
+  // The pass of the last closure taken. A class which was idle starts
+  // from there, rather than catching up with what it did not use.
+  uint64_t current_pass_ = 0;
+  // The tasks given to Delay(), which go in the default class when
+  // they are due.
+  util::TimerWheel<util::Task*> timers_;
+  // The idle workers, the one idle the least time last: it is the
+  // most likely to still have its stack in the caches.
+  vector<IdleWorker*> idle_;
+  // The idle worker waiting for the next timer, if any. Only it has a
+  // deadline, the others sleep until they are woken up.
+  IdleWorker* timer_waiter_ = nullptr;
+  bool exiting_ = false;
 };
 
 
 ThreadPool::Impl::~Impl() {
-  // Start by sending an empty closure to every thread (and notify
-  // them), to have them exit cleanly.
+  // Have every thread exit once there is nothing left to do.
   {
     lock_guard<mutex> lock(queue_lock_);
-    for (int i = threads_.size(); i > 0; --i)
-      queue_.emplace(
-          make_tuple(steady_clock::time_point(), function<void()>(), nullptr));
+    exiting_ = true;
+    for (IdleWorker* idle : idle_) {
+      idle->woken = true;
+      idle->cond_var.notify_one();
+    }
+    idle_.clear();
+    if (timer_waiter_) {
+      timer_waiter_->cond_var.notify_one();
+      timer_waiter_ = nullptr;
+    }
   }
-  // Notify all the threads *after* adding all the empty closures, to
-  // avoid any races.
-  queue_cond_var_.notify_all();
 
   // Wait for the threads to exit.
   for (auto& thread : threads_) {
@@ -76,60 +241,153 @@ ThreadPool::Impl::~Impl() {
 
   // Workers should've drained everything from the queue.
   CHECK(queue_.empty());
+  for (const auto& work_class : classes_) {
+    CHECK(work_class->queue.empty());
+  }
+  CHECK(timers_.empty());
+}
+
+
+bool ThreadPool::Impl::TakeNextClosure(function<void()>* closure) {
+  const steady_clock::time_point now(steady_clock::now());
+  if (!timers_.empty()) {
+    vector<util::Task*> due;
+    timers_.Expire(now, &due);
+    for (util::Task* task : due) {
+      queue_.emplace_back(now, [task]() { task->Return(); });
+    }
+  }
+
+  WorkClass* next(nullptr);
+  for (const auto& work_class : classes_) {
+    if (!work_class->queue.empty() &&
+        (!next || work_class->pass < next->pass)) {
+      next = work_class.get();
+    }
+  }
+
+  if (!queue_.empty() &&
+      (!next || max(default_pass_, current_pass_) <=
+                    max(next->pass, current_pass_))) {
+    current_pass_ = max(default_pass_, current_pass_);
+    default_pass_ = current_pass_ + kStride;
+    if (!name_.empty()) {
+      thread_pool_queue_wait_ms.RecordLatency(name_,
+                                              now - queue_.front().first);
+    }
+    *closure = move(queue_.front().second);
+    queue_.pop_front();
+    ExportDefaultQueue(now);
+    return true;
+  }
+  if (!next) {
+    return false;
+  }
+
+  current_pass_ = max(next->pass, current_pass_);
+  next->pass = current_pass_ + next->stride;
+  thread_pool_queue_wait_ms.RecordLatency(
+      MetricName(next->name), now - next->queue.front().first);
+  *closure = move(next->queue.front().second);
+  next->queue.pop_front();
+  ExportQueue(MetricName(next->name), next->queue, now);
+  return true;
+}
+
+
+void ThreadPool::Impl::CancelTimer(util::TimerWheel<util::Task*>::Id id,
+                                   util::Task* task) {
+  {
+    lock_guard<mutex> lock(queue_lock_);
+    if (!timers_.Cancel(id, nullptr)) {
+      // It is due, and will return by itself.
+      return;
+    }
+  }
+  task->Return(util::Status::CANCELLED);
+}
+
+
+void ThreadPool::Impl::WakeOne() {
+  if (!idle_.empty()) {
+    IdleWorker* const idle(idle_.back());
+    idle_.pop_back();
+    idle->woken = true;
+    idle->cond_var.notify_one();
+  } else if (timer_waiter_) {
+    // Another idle worker will wait for the timers, if need be.
+    timer_waiter_->cond_var.notify_one();
+    timer_waiter_ = nullptr;
+  }
 }
 
 
 void ThreadPool::Impl::Worker() {
+  IdleWorker self;
+  unique_lock<mutex> lock(queue_lock_);
   while (true) {
-    QueueEntry entry;
-
-    {
-      unique_lock<mutex> lock(queue_lock_);
-      while (queue_.empty() || get<0>(queue_.top()) > steady_clock::now()) {
-        if (queue_.empty()) {
-          // If there's nothing to do, wait until there is.
-          queue_cond_var_.wait(lock);
-        } else {
-          // Otherwise, wait until the next thing we currently know about is
-          // ready.
-          const steady_clock::duration duration(get<0>(queue_.top()) -
-                                                steady_clock::now());
-          queue_cond_var_.wait_for(lock, duration);
-        }
+    function<void()> closure;
+    if (TakeNextClosure(&closure)) {
+      // Several timers may have come due at once, pass on what this
+      // thread cannot take.
+      if (!queue_.empty() ||
+          std::any_of(classes_.begin(), classes_.end(),
+                      [](const unique_ptr<WorkClass>& work_class) {
+                        return !work_class->queue.empty();
+                      })) {
+        WakeOne();
       }
 
-      entry = queue_.top();
-      queue_.pop();
-
-      // If we received an empty entry, exit cleanly.
-      if (!get<1>(entry)) {
-        // Anything left in the queue must be either other exit sentinels, or
-        // future (delayed) tasks, so we'll cancel anything we find, up until
-        // either the next exit sentinel, or the end of the queue.
-        VLOG(1) << "Cancelling delayed tasks...";
-        vector<util::Task*> to_be_cancelled;
-        while (!queue_.empty() && get<2>(queue_.top())) {
-          to_be_cancelled.push_back(CHECK_NOTNULL(get<2>(queue_.top())));
-          queue_.pop();
-        }
-
-        // Cancel the callbacks below outside of the lock to avoid deadlocking
-        // anyone who tries to Add() more stuff when they're cancelled.
-        // Anyone who does that is going to cause a CHECK fail in the d'tor of
-        // the pool anyway, but at least they'll know about it that way.
-        lock.unlock();
-
-        for (const auto& t : to_be_cancelled) {
-          t->Return(util::Status::CANCELLED);
-        }
-
-        VLOG(1) << "Cancelled " << to_be_cancelled.size() << " delayed tasks.";
-        return;
+      // Make sure not to hold the lock while calling the closure.
+      lock.unlock();
+      const steady_clock::time_point started(steady_clock::now());
+      closure();
+      if (!name_.empty()) {
+        thread_pool_busy_ms->IncrementBy(
+            name_, duration<double, std::milli>(steady_clock::now() - started)
+                       .count());
       }
+      lock.lock();
+      continue;
     }
 
-    // Make sure not to hold the lock while calling the closure.
-    get<1>(entry)();
+    if (exiting_) {
+      // Anything left is delayed tasks which are not due yet, cancel
+      // them.
+      VLOG(1) << "Cancelling delayed tasks...";
+      vector<util::Task*> to_be_cancelled;
+      timers_.Clear(&to_be_cancelled);
+
+      // Cancel the callbacks below outside of the lock to avoid deadlocking
+      // anyone who tries to Add() more stuff when they're cancelled.
+      // Anyone who does that is going to cause a CHECK fail in the d'tor of
+      // the pool anyway, but at least they'll know about it that way.
+      lock.unlock();
+
+      for (const auto& t : to_be_cancelled) {
+        t->Return(util::Status::CANCELLED);
+      }
+
+      VLOG(1) << "Cancelled " << to_be_cancelled.size() << " delayed tasks.";
+      return;
+    }
+
+    if (!timers_.empty() && !timer_waiter_) {
+      // Wait until the next timer is due, or until woken up for
+      // something else.
+      timer_waiter_ = &self;
+      self.cond_var.wait_until(lock, timers_.NextExpiry());
+      if (timer_waiter_ == &self) {
+        timer_waiter_ = nullptr;
+      }
+    } else {
+      // If there's nothing to do, wait until there is.
+      self.woken = false;
+      idle_.push_back(&self);
+      while (!self.woken) {
+        self.cond_var.wait(lock);
+      }
+    }
   }
 }
 
@@ -141,11 +399,29 @@ ThreadPool::ThreadPool()
 }
 
 
-ThreadPool::ThreadPool(size_t num_threads) : impl_(new Impl) {
+ThreadPool::ThreadPool(size_t num_threads)
+    : ThreadPool("", num_threads, vector<int>()) {
+}
+
+
+ThreadPool::ThreadPool(const string& name, size_t num_threads,
+                       const vector<int>& cpus)
+    : impl_(new Impl(name)) {
   CHECK_GT(num_threads, static_cast<size_t>(0));
-  LOG(INFO) << "ThreadPool starting with " << num_threads << " threads";
-  for (int i = 0; i < static_cast<int64_t>(num_threads); ++i)
+  LOG(INFO) << "ThreadPool " << name << " starting with " << num_threads
+            << " threads";
+  for (int i = 0; i < static_cast<int64_t>(num_threads); ++i) {
     impl_->threads_.emplace_back(thread(&Impl::Worker, impl_.get()));
+    if (!name.empty()) {
+      NameThread(&impl_->threads_.back(), name);
+    }
+    if (!cpus.empty()) {
+      PinThread(&impl_->threads_.back(), cpus);
+    }
+  }
+  if (!name.empty()) {
+    thread_pool_threads->Set(name, num_threads);
+  }
 }
 
 
@@ -162,23 +438,78 @@ void ThreadPool::Add(const function<void()>& closure) {
     return;
   }
 
-  {
-    lock_guard<mutex> lock(impl_->queue_lock_);
-    impl_->queue_.emplace(make_tuple(steady_clock::now(), closure, nullptr));
-  }
-  impl_->queue_cond_var_.notify_one();
+  const function<void()> traced(util::TracedClosure("thread_pool", closure));
+  const steady_clock::time_point now(steady_clock::now());
+  const unique_lock<mutex> lock(
+      ContendedLock(&impl_->queue_lock_, thread_pool_queue_contention));
+  impl_->queue_.emplace_back(now, traced);
+  impl_->ExportDefaultQueue(now);
+  impl_->WakeOne();
 }
 
 
 void ThreadPool::Delay(const duration<double>& delay, util::Task* task) {
   CHECK_NOTNULL(task);
+  const steady_clock::time_point deadline(
+      steady_clock::now() + duration_cast<std::chrono::microseconds>(delay));
+  // Keep the task from being done (and deleted) before it is set up
+  // for cancellation.
+  util::TaskHold hold(task);
+
+  util::TimerWheel<util::Task*>::Id id;
   {
     lock_guard<mutex> lock(impl_->queue_lock_);
-    impl_->queue_.emplace(make_tuple(
-        steady_clock::now() + duration_cast<std::chrono::microseconds>(delay),
-        [task]() { task->Return(); }, task));
+    const bool earliest(impl_->timer_waiter_ &&
+                        deadline < impl_->timers_.NextExpiry());
+    id = impl_->timers_.Add(deadline, task);
+    if (!impl_->timer_waiter_) {
+      // An idle worker will become the one waiting for the timers.
+      impl_->WakeOne();
+    } else if (earliest) {
+      // Have it wait for this one instead.
+      impl_->timer_waiter_->cond_var.notify_one();
+    }
+  }
+
+  task->WhenCancelled(bind(&Impl::CancelTimer, impl_.get(), id, task));
+}
+
+
+int ThreadPool::AddWorkClass(const string& name, int weight,
+                             size_t max_queued) {
+  CHECK_GT(weight, 0);
+  lock_guard<mutex> lock(impl_->queue_lock_);
+  for (size_t i = 0; i < impl_->classes_.size(); ++i) {
+    if (impl_->classes_[i]->name == name) {
+      return i + 1;
+    }
+  }
+  impl_->classes_.emplace_back(new Impl::WorkClass(name, weight, max_queued));
+  return impl_->classes_.size();
+}
+
+
+bool ThreadPool::TryAdd(int work_class, const function<void()>& closure) {
+  if (!closure) {
+    return true;
+  }
+
+  const function<void()> traced(util::TracedClosure("thread_pool", closure));
+  {
+    const unique_lock<mutex> lock(
+        ContendedLock(&impl_->queue_lock_, thread_pool_queue_contention));
+    CHECK_GT(work_class, 0);
+    CHECK_LE(static_cast<size_t>(work_class), impl_->classes_.size());
+    Impl::WorkClass* const wc(impl_->classes_[work_class - 1].get());
+    if (wc->max_queued > 0 && wc->queue.size() >= wc->max_queued) {
+      return false;
+    }
+    const steady_clock::time_point now(steady_clock::now());
+    wc->queue.emplace_back(now, traced);
+    Impl::ExportQueue(impl_->MetricName(wc->name), wc->queue, now);
+    impl_->WakeOne();
   }
-  impl_->queue_cond_var_.notify_one();
+  return true;
 }
 
 
@@ -5,6 +5,8 @@
 #include <functional>
 #include <map>
 #include <memory>
+#include <string>
+#include <vector>
 
 #include "util/executor.h"
 
@@ -13,6 +15,12 @@ namespace cert_trans {
 
 // Provides a fixed size thread pool to run closures on. The pool is
 // sized according to the number of cores in the system.
+//
+// Closures can also be put in classes of work, each with a queue of
+// its own, so that a flood of one kind of work does not hold up the
+// others: when several classes have closures waiting, the threads
+// share their time between them in proportion to their weights. The
+// closures of Add() and Delay() are in a default class of weight 1.
 class ThreadPool : public util::Executor {
  public:
   // Creates the threads.
@@ -21,6 +29,13 @@ class ThreadPool : public util::Executor {
   // Creates the threads.
   ThreadPool(size_t num_threads);
 
+  // Creates the threads, which only run on |cpus| if it is not empty.
+  // The queues of the pool are exported as metrics under |name|, and
+  // those of its classes of work under "|name|/<class>", and its
+  // threads are named after it.
+  ThreadPool(const std::string& name, size_t num_threads,
+             const std::vector<int>& cpus);
+
   // The destructor will wait for any outstanding closures to finish.
   ~ThreadPool();
 
@@ -31,9 +46,21 @@ class ThreadPool : public util::Executor {
   // function must not be empty.
   void Add(const std::function<void()>& closure) override;
 
+  // Returns |task| once |delay| has passed, to the millisecond, or
+  // with util::Status::CANCELLED as soon as it is cancelled.
   void Delay(const std::chrono::duration<double>& delay,
              util::Task* task) override;
 
+  // Returns the class of work called |name|, adding it with |weight|
+  // (which must be positive) and |max_queued| if there is none yet.
+  // |max_queued| is the most closures of that class which may wait
+  // for a thread, 0 meaning no limit.
+  int AddWorkClass(const std::string& name, int weight, size_t max_queued);
+
+  // Like Add(), for a class returned by AddWorkClass(). Returns false,
+  // without queueing |closure|, if the queue of that class is full.
+  bool TryAdd(int work_class, const std::function<void()>& closure);
+
  private:
   class Impl;
   const std::unique_ptr<Impl> impl_;
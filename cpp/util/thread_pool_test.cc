@@ -2,8 +2,11 @@
 
 #include <glog/logging.h>
 #include <gtest/gtest.h>
+#include <sched.h>
 #include <atomic>
 #include <memory>
+#include <mutex>
+#include <string>
 
 #include "base/notification.h"
 #include "util/sync_task.h"
@@ -13,6 +16,9 @@ namespace cert_trans {
 
 using std::chrono::milliseconds;
 using std::chrono::system_clock;
+using std::lock_guard;
+using std::mutex;
+using std::string;
 using std::unique_ptr;
 using util::SyncTask;
 
@@ -89,6 +95,122 @@ TEST_F(ThreadPoolTest, CancelsDelayTasks) {
 }
 
 
+TEST_F(ThreadPoolTest, DelayCanBeCancelled) {
+  SyncTask task(&pool_of_one_);
+  pool_of_one_.Delay(std::chrono::seconds(60), task.task());
+  task.Cancel();
+  task.Wait();
+  EXPECT_EQ(util::Status::CANCELLED, task.status());
+}
+
+
+TEST_F(ThreadPoolTest, RunsEverythingBeforeExiting) {
+  std::atomic<int> runs(0);
+  {
+    ThreadPool pool(4);
+    const int kClosures(1000);
+    for (int i = 0; i < kClosures; ++i) {
+      // Half of them add the other half from the pool's own threads.
+      pool.Add([&pool, &runs]() {
+        ++runs;
+        pool.Add([&runs]() { ++runs; });
+      });
+    }
+    for (int i = 0; i < 10; ++i) {
+      SyncTask task(&pool);
+      pool.Delay(milliseconds(i), task.task());
+      task.Wait();
+      EXPECT_TRUE(task.status().ok());
+    }
+  }
+  EXPECT_EQ(2000, runs.load());
+}
+
+
+#ifdef __linux__
+TEST_F(ThreadPoolTest, NamedPoolRunsOnItsCpus) {
+  ThreadPool pool("pinned", 2, {0});
+  std::atomic<int> elsewhere(0);
+  for (int i = 0; i < 100; ++i) {
+    SyncTask task(&pool);
+    pool.Add([&elsewhere, &task]() {
+      if (sched_getcpu() != 0) {
+        ++elsewhere;
+      }
+      task.task()->Return();
+    });
+    task.Wait();
+  }
+  EXPECT_EQ(0, elsewhere.load());
+}
+#endif
+
+
+TEST_F(ThreadPoolTest, TryAddRejectsWhenClassIsFull) {
+  const int work_class(pool_of_one_.AddWorkClass("full", 1, 2));
+  EXPECT_EQ(work_class, pool_of_one_.AddWorkClass("full", 5, 10));
+
+  // Keep the only thread busy while queueing.
+  Notification started, release;
+  pool_of_one_.Add([&started, &release]() {
+    started.Notify();
+    release.WaitForNotification();
+  });
+  started.WaitForNotification();
+
+  std::atomic<int> runs(0);
+  Notification done;
+  EXPECT_TRUE(pool_of_one_.TryAdd(work_class, [&runs]() { ++runs; }));
+  EXPECT_TRUE(pool_of_one_.TryAdd(work_class, [&runs, &done]() {
+    ++runs;
+    done.Notify();
+  }));
+  EXPECT_FALSE(pool_of_one_.TryAdd(work_class, [&runs]() { ++runs; }));
+
+  release.Notify();
+  done.WaitForNotification();
+  EXPECT_EQ(2, runs.load());
+}
+
+
+TEST_F(ThreadPoolTest, ClassesShareByWeight) {
+  const int heavy(pool_of_one_.AddWorkClass("heavy", 3, 0));
+  const int light(pool_of_one_.AddWorkClass("light", 1, 0));
+
+  Notification started, release;
+  pool_of_one_.Add([&started, &release]() {
+    started.Notify();
+    release.WaitForNotification();
+  });
+  started.WaitForNotification();
+
+  mutex order_lock;
+  string order;
+  const int kClosures(8);
+  for (int i = 0; i < kClosures; ++i) {
+    EXPECT_TRUE(pool_of_one_.TryAdd(heavy, [&order_lock, &order]() {
+      lock_guard<mutex> lock(order_lock);
+      order.push_back('h');
+    }));
+    EXPECT_TRUE(pool_of_one_.TryAdd(light, [&order_lock, &order]() {
+      lock_guard<mutex> lock(order_lock);
+      order.push_back('l');
+    }));
+  }
+  Notification done;
+  EXPECT_TRUE(pool_of_one_.TryAdd(light, [&done]() { done.Notify(); }));
+
+  release.Notify();
+  done.WaitForNotification();
+
+  lock_guard<mutex> lock(order_lock);
+  ASSERT_EQ(static_cast<size_t>(2 * kClosures), order.size());
+  // While both have closures waiting, three go to "heavy" for every
+  // one of "light".
+  EXPECT_EQ("hlhhhlhh", order.substr(0, 8));
+}
+
+
 }  // namespace cert_trans
 
 
@@ -0,0 +1,178 @@
+#ifndef CERT_TRANS_UTIL_TIMER_WHEEL_H_
+#define CERT_TRANS_UTIL_TIMER_WHEEL_H_
+
+#include <glog/logging.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <algorithm>
+#include <chrono>
+#include <list>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace util {
+
+
+// A hashed timer wheel: values added with a deadline are kept in one
+// of |num_slots| slots, by the tick (of |tick| long) in which their
+// deadline falls, wrapping around, so that adding and cancelling are
+// O(1) however many there are. Expiring goes through the slots of the
+// ticks which have passed, and leaves the values whose deadline is a
+// later turn of the wheel away.
+//
+// Deadlines are rounded up to the next tick, so that values never
+// expire early. Not thread-safe.
+template <class T>
+class TimerWheel {
+ public:
+  typedef std::chrono::steady_clock Clock;
+  // Identifies a value for Cancel(). Never 0.
+  typedef uint64_t Id;
+
+  TimerWheel(Clock::duration tick, size_t num_slots, Clock::time_point start)
+      : tick_(tick), start_(start), slots_(num_slots), current_tick_(0),
+        last_id_(0) {
+    CHECK_GT(tick_.count(), 0);
+    CHECK_GT(num_slots, static_cast<size_t>(0));
+  }
+
+  TimerWheel(const TimerWheel&) = delete;
+  TimerWheel& operator=(const TimerWheel&) = delete;
+
+  bool empty() const {
+    return entries_.empty();
+  }
+
+  size_t size() const {
+    return entries_.size();
+  }
+
+  Id Add(Clock::time_point deadline, const T& value) {
+    const uint64_t tick(std::max(TickOf(deadline), current_tick_));
+    const size_t slot(tick % slots_.size());
+    const Id id(++last_id_);
+    slots_[slot].push_back(Entry{id, tick, value});
+    entries_.emplace(id, std::make_pair(slot, --slots_[slot].end()));
+    return id;
+  }
+
+  // Removes the value of |id| and sets |value| (if not NULL) to it.
+  // Returns false if it has expired or been cancelled already.
+  bool Cancel(Id id, T* value) {
+    const auto it(entries_.find(id));
+    if (it == entries_.end()) {
+      return false;
+    }
+    if (value) {
+      *value = it->second.second->value;
+    }
+    slots_[it->second.first].erase(it->second.second);
+    entries_.erase(it);
+    return true;
+  }
+
+  // Removes the values whose deadline is at or before |now|, and
+  // appends them to |expired|, earliest first.
+  void Expire(Clock::time_point now, std::vector<T>* expired) {
+    if (now < start_) {
+      return;
+    }
+    const uint64_t now_tick(
+        static_cast<uint64_t>((now - start_) / tick_));
+    if (now_tick < current_tick_) {
+      return;
+    }
+
+    std::vector<std::pair<uint64_t, T>> due;
+    const uint64_t num_ticks(
+        std::min<uint64_t>(now_tick - current_tick_ + 1, slots_.size()));
+    for (uint64_t i = 0; i < num_ticks; ++i) {
+      std::list<Entry>* const slot(
+          &slots_[(current_tick_ + i) % slots_.size()]);
+      for (auto it(slot->begin()); it != slot->end();) {
+        if (it->tick <= now_tick) {
+          due.emplace_back(it->tick, it->value);
+          entries_.erase(it->id);
+          it = slot->erase(it);
+        } else {
+          ++it;
+        }
+      }
+    }
+    current_tick_ = now_tick + 1;
+
+    // Only a whole turn of the wheel gathers them out of order.
+    std::stable_sort(due.begin(), due.end(),
+                     [](const std::pair<uint64_t, T>& lhs,
+                        const std::pair<uint64_t, T>& rhs) {
+                       return lhs.first < rhs.first;
+                     });
+    for (auto& value : due) {
+      expired->push_back(std::move(value.second));
+    }
+  }
+
+  // The earliest time at which Expire() will have something to
+  // return, Clock::time_point::max() if the wheel is empty.
+  Clock::time_point NextExpiry() const {
+    if (entries_.empty()) {
+      return Clock::time_point::max();
+    }
+
+    uint64_t next(UINT64_MAX);
+    for (size_t i = 0; i < slots_.size(); ++i) {
+      for (const Entry& entry :
+           slots_[(current_tick_ + i) % slots_.size()]) {
+        next = std::min(next, entry.tick);
+      }
+      // Nothing in the following slots can come earlier.
+      if (next <= current_tick_ + i) {
+        break;
+      }
+    }
+    return start_ + tick_ * next;
+  }
+
+  // Removes all the values, appending them to |values|.
+  void Clear(std::vector<T>* values) {
+    for (auto& slot : slots_) {
+      for (Entry& entry : slot) {
+        values->push_back(std::move(entry.value));
+      }
+      slot.clear();
+    }
+    entries_.clear();
+  }
+
+ private:
+  struct Entry {
+    Id id;
+    uint64_t tick;
+    T value;
+  };
+
+  // The first tick starting at or after |time|.
+  uint64_t TickOf(Clock::time_point time) const {
+    if (time <= start_) {
+      return 0;
+    }
+    return static_cast<uint64_t>((time - start_ + tick_ - Clock::duration(1)) /
+                                 tick_);
+  }
+
+  const Clock::duration tick_;
+  const Clock::time_point start_;
+  std::vector<std::list<Entry>> slots_;
+  // The slot and position of each value, for Cancel().
+  std::unordered_map<Id, std::pair<size_t, typename std::list<Entry>::iterator>>
+      entries_;
+  // The first tick which has not been expired yet.
+  uint64_t current_tick_;
+  Id last_id_;
+};
+
+
+}  // namespace util
+
+#endif  // CERT_TRANS_UTIL_TIMER_WHEEL_H_
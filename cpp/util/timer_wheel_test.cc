@@ -0,0 +1,114 @@
+#include "util/timer_wheel.h"
+
+#include <gtest/gtest.h>
+#include <chrono>
+#include <vector>
+
+#include "util/testing.h"
+
+namespace util {
+namespace {
+
+using std::chrono::milliseconds;
+using std::vector;
+
+typedef TimerWheel<int> Wheel;
+
+
+class TimerWheelTest : public ::testing::Test {
+ protected:
+  TimerWheelTest()
+      : start_(Wheel::Clock::now()), wheel_(milliseconds(10), 8, start_) {
+  }
+
+  Wheel::Clock::time_point At(int ms) const {
+    return start_ + milliseconds(ms);
+  }
+
+  vector<int> Expire(int ms) {
+    vector<int> expired;
+    wheel_.Expire(At(ms), &expired);
+    return expired;
+  }
+
+  const Wheel::Clock::time_point start_;
+  Wheel wheel_;
+};
+
+
+TEST_F(TimerWheelTest, ExpiresInOrder) {
+  wheel_.Add(At(30), 3);
+  wheel_.Add(At(10), 1);
+  wheel_.Add(At(20), 2);
+  EXPECT_EQ(3U, wheel_.size());
+  EXPECT_EQ(At(10), wheel_.NextExpiry());
+
+  EXPECT_EQ(vector<int>(), Expire(9));
+  EXPECT_EQ(vector<int>({1, 2}), Expire(25));
+  EXPECT_EQ(At(30), wheel_.NextExpiry());
+  EXPECT_EQ(vector<int>({3}), Expire(30));
+  EXPECT_TRUE(wheel_.empty());
+  EXPECT_EQ(Wheel::Clock::time_point::max(), wheel_.NextExpiry());
+}
+
+
+TEST_F(TimerWheelTest, NeverExpiresEarly) {
+  // Rounded up to the next tick.
+  wheel_.Add(At(11), 1);
+  EXPECT_EQ(At(20), wheel_.NextExpiry());
+  EXPECT_EQ(vector<int>(), Expire(15));
+  EXPECT_EQ(vector<int>({1}), Expire(20));
+}
+
+
+TEST_F(TimerWheelTest, LaterTurnsOfTheWheel) {
+  // 8 slots of 10ms: these share a slot.
+  wheel_.Add(At(250), 2);
+  wheel_.Add(At(10), 1);
+  wheel_.Add(At(170), 3);
+  EXPECT_EQ(vector<int>({1}), Expire(10));
+  EXPECT_EQ(At(170), wheel_.NextExpiry());
+  EXPECT_EQ(vector<int>(), Expire(90));
+  // Several turns at once.
+  EXPECT_EQ(vector<int>({3, 2}), Expire(1000));
+}
+
+
+TEST_F(TimerWheelTest, PastDeadlinesExpireNext) {
+  EXPECT_EQ(vector<int>(), Expire(100));
+  wheel_.Add(At(50), 1);
+  EXPECT_EQ(vector<int>({1}), Expire(110));
+}
+
+
+TEST_F(TimerWheelTest, Cancel) {
+  const Wheel::Id one(wheel_.Add(At(10), 1));
+  const Wheel::Id two(wheel_.Add(At(10), 2));
+  int value(0);
+  EXPECT_TRUE(wheel_.Cancel(two, &value));
+  EXPECT_EQ(2, value);
+  EXPECT_FALSE(wheel_.Cancel(two, &value));
+
+  EXPECT_EQ(vector<int>({1}), Expire(10));
+  EXPECT_FALSE(wheel_.Cancel(one, nullptr));
+}
+
+
+TEST_F(TimerWheelTest, Clear) {
+  wheel_.Add(At(10), 1);
+  wheel_.Add(At(1000), 2);
+  vector<int> values;
+  wheel_.Clear(&values);
+  EXPECT_EQ(2U, values.size());
+  EXPECT_TRUE(wheel_.empty());
+}
+
+
+}  // namespace
+}  // namespace util
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
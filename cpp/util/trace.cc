@@ -0,0 +1,319 @@
+#include "util/trace.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <thread>
+
+DEFINE_double(trace_sample_rate, 0,
+              "Fraction of requests (and background operations) to record "
+              "traces for, between 0 and 1.");
+DEFINE_string(trace_output_file, "",
+              "File to append the sampled traces to, in OpenTelemetry JSON "
+              "format. Traces are dropped if this is not set.");
+
+using std::call_once;
+using std::chrono::duration_cast;
+using std::chrono::nanoseconds;
+using std::chrono::seconds;
+using std::chrono::system_clock;
+using std::function;
+using std::lock_guard;
+using std::make_shared;
+using std::move;
+using std::mt19937_64;
+using std::mutex;
+using std::ofstream;
+using std::once_flag;
+using std::ostringstream;
+using std::pair;
+using std::random_device;
+using std::shared_ptr;
+using std::string;
+using std::thread;
+using std::vector;
+
+namespace util {
+namespace {
+
+
+// Sampled spans waiting to be written out. More than this are dropped
+// if the writer falls behind.
+const size_t kMaxBufferedSpans = 100000;
+
+
+thread_local TraceContext current_context;
+
+
+uint64_t RandomId() {
+  static thread_local mt19937_64 rng(random_device{}());
+  uint64_t ret;
+  do {
+    ret = rng();
+  } while (ret == 0);
+  return ret;
+}
+
+
+bool SampleRoot() {
+  if (FLAGS_trace_sample_rate <= 0) {
+    return false;
+  }
+  static thread_local mt19937_64 rng(random_device{}());
+  return std::uniform_real_distribution<double>()(rng) <
+         FLAGS_trace_sample_rate;
+}
+
+
+struct FinishedSpan {
+  TraceContext context;
+  uint64_t parent_span_id;
+  string name;
+  system_clock::time_point start;
+  system_clock::time_point end;
+  vector<pair<string, string>> attributes;
+};
+
+
+string Hex(uint64_t n) {
+  char buf[17];
+  snprintf(buf, sizeof(buf), "%016llx", static_cast<unsigned long long>(n));
+  return buf;
+}
+
+
+string JsonString(const string& s) {
+  ostringstream out;
+  out << '"';
+  for (const char c : s) {
+    if (c == '"' || c == '\\') {
+      out << '\\' << c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      char buf[7];
+      snprintf(buf, sizeof(buf), "\\u%04x", c);
+      out << buf;
+    } else {
+      out << c;
+    }
+  }
+  out << '"';
+  return out.str();
+}
+
+
+string UnixNanos(const system_clock::time_point& t) {
+  // OTLP JSON encodes 64-bit integers as strings.
+  const int64_t nanos(
+      duration_cast<nanoseconds>(t.time_since_epoch()).count());
+  return JsonString(std::to_string(nanos));
+}
+
+
+// Writes |spans| as one OTLP ExportTraceServiceRequest.
+void WriteSpans(const vector<FinishedSpan>& spans, std::ostream* out) {
+  *out << "{\"resourceSpans\":[{\"resource\":{\"attributes\":["
+       << "{\"key\":\"service.name\",\"value\":{\"stringValue\":"
+       << JsonString(google::ProgramInvocationShortName()) << "}}]},"
+       << "\"scopeSpans\":[{\"scope\":{\"name\":\"certificate-transparency\"},"
+       << "\"spans\":[";
+  for (size_t i = 0; i < spans.size(); ++i) {
+    const FinishedSpan& span(spans[i]);
+    if (i > 0) {
+      *out << ",";
+    }
+    *out << "{\"traceId\":\"" << Hex(span.context.trace_id_high)
+         << Hex(span.context.trace_id_low) << "\",\"spanId\":\""
+         << Hex(span.context.span_id) << "\"";
+    if (span.parent_span_id != 0) {
+      *out << ",\"parentSpanId\":\"" << Hex(span.parent_span_id) << "\"";
+    }
+    *out << ",\"name\":" << JsonString(span.name)
+         << ",\"startTimeUnixNano\":" << UnixNanos(span.start)
+         << ",\"endTimeUnixNano\":" << UnixNanos(span.end)
+         << ",\"attributes\":[";
+    for (size_t j = 0; j < span.attributes.size(); ++j) {
+      if (j > 0) {
+        *out << ",";
+      }
+      *out << "{\"key\":" << JsonString(span.attributes[j].first)
+           << ",\"value\":{\"stringValue\":"
+           << JsonString(span.attributes[j].second) << "}}";
+    }
+    *out << "]}";
+  }
+  *out << "]}]}]}\n";
+}
+
+
+class SpanWriter {
+ public:
+  void Add(FinishedSpan&& span) {
+    if (FLAGS_trace_output_file.empty()) {
+      LOG_FIRST_N(WARNING, 1)
+          << "Dropping sampled traces, --trace_output_file is not set";
+      return;
+    }
+    call_once(started_, [this]() { thread(&SpanWriter::Run, this).detach(); });
+    lock_guard<mutex> lock(lock_);
+    if (spans_.size() >= kMaxBufferedSpans) {
+      LOG_EVERY_N(WARNING, 1000) << "Dropping sampled spans, too many queued";
+      return;
+    }
+    spans_.emplace_back(move(span));
+  }
+
+ private:
+  void Run() {
+    ofstream out(FLAGS_trace_output_file, std::ios::app);
+    PCHECK(out.good()) << "Could not open " << FLAGS_trace_output_file;
+    while (true) {
+      std::this_thread::sleep_for(seconds(1));
+      vector<FinishedSpan> spans;
+      {
+        lock_guard<mutex> lock(lock_);
+        spans.swap(spans_);
+      }
+      if (!spans.empty()) {
+        WriteSpans(spans, &out);
+        out.flush();
+      }
+    }
+  }
+
+  once_flag started_;
+  mutex lock_;
+  vector<FinishedSpan> spans_;
+};
+
+
+SpanWriter* Writer() {
+  static SpanWriter* const writer(new SpanWriter);
+  return writer;
+}
+
+
+}  // namespace
+
+
+const TraceContext& CurrentTraceContext() {
+  return current_context;
+}
+
+
+ScopedTraceContext::ScopedTraceContext(const TraceContext& context)
+    : previous_(current_context), restore_(true) {
+  current_context = context;
+}
+
+
+ScopedTraceContext::ScopedTraceContext(ScopedTraceContext&& other)
+    : previous_(other.previous_), restore_(other.restore_) {
+  other.restore_ = false;
+}
+
+
+ScopedTraceContext::~ScopedTraceContext() {
+  if (restore_) {
+    current_context = previous_;
+  }
+}
+
+
+Span::Span(const string& name) : Span(name, current_context) {
+}
+
+
+Span::Span(const string& name, const TraceContext& parent)
+    : context_(parent), parent_span_id_(parent.span_id) {
+  if (!parent.traced) {
+    // This is the root of a new trace. If tracing is off altogether,
+    // leave it untraced, so that there is nothing to propagate.
+    context_.traced = FLAGS_trace_sample_rate > 0;
+    context_.sampled = SampleRoot();
+    if (context_.sampled) {
+      context_.trace_id_high = RandomId();
+      context_.trace_id_low = RandomId();
+    }
+  }
+  if (context_.sampled) {
+    context_.span_id = RandomId();
+    name_ = name;
+    start_ = system_clock::now();
+  }
+}
+
+
+Span::Span(Span&& other)
+    : context_(other.context_),
+      parent_span_id_(other.parent_span_id_),
+      name_(move(other.name_)),
+      start_(other.start_),
+      attributes_(move(other.attributes_)) {
+  other.context_.sampled = false;
+}
+
+
+Span::~Span() {
+  End();
+}
+
+
+void Span::SetName(const string& name) {
+  if (context_.sampled) {
+    name_ = name;
+  }
+}
+
+
+void Span::SetAttribute(const string& key, const string& value) {
+  if (context_.sampled) {
+    attributes_.emplace_back(key, value);
+  }
+}
+
+
+void Span::End() {
+  if (!context_.sampled) {
+    return;
+  }
+  // So that further calls do nothing.
+  context_.sampled = false;
+
+  FinishedSpan span;
+  span.context = context_;
+  span.parent_span_id = parent_span_id_;
+  span.name = move(name_);
+  span.start = start_;
+  span.end = system_clock::now();
+  span.attributes = move(attributes_);
+  Writer()->Add(move(span));
+}
+
+
+function<void()> TracedClosure(const string& queue_name,
+                               const function<void()>& closure) {
+  const TraceContext context(current_context);
+  if (!context.traced) {
+    return closure;
+  }
+  if (!context.sampled) {
+    return [context, closure]() {
+      ScopedTraceContext scope(context);
+      closure();
+    };
+  }
+  const shared_ptr<Span> queued(make_shared<Span>(queue_name, context));
+  return [context, queued, closure]() {
+    queued->End();
+    ScopedTraceContext scope(context);
+    closure();
+  };
+}
+
+
+}  // namespace util
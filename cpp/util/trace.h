@@ -0,0 +1,128 @@
+#ifndef CERT_TRANS_UTIL_TRACE_H_
+#define CERT_TRANS_UTIL_TRACE_H_
+
+#include <stdint.h>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace util {
+
+
+// Lightweight request tracing.
+//
+// A trace is a tree of spans, each timing a piece of work done for the
+// same request. Whether a trace is recorded is decided once, when its
+// root span starts, with probability --trace_sample_rate. Spans of a
+// trace which is not sampled cost a couple of thread-local accesses.
+//
+// The current span is kept per thread (see ScopedTraceContext), and
+// carried across threads by util::Task and ThreadPool. Sampled spans
+// are written to --trace_output_file in the OpenTelemetry (OTLP) JSON
+// format, one export request per line, which the OpenTelemetry
+// collector can read with its "otlpjsonfile" receiver.
+
+
+struct TraceContext {
+  // Whether this is part of a trace at all: spans started outside of
+  // one are roots of a new trace.
+  bool traced = false;
+  // Whether the trace is being recorded. If not, the ids are zero.
+  bool sampled = false;
+  uint64_t trace_id_high = 0;
+  uint64_t trace_id_low = 0;
+  uint64_t span_id = 0;
+};
+
+
+// Returns the context of the current span on this thread.
+const TraceContext& CurrentTraceContext();
+
+
+// Makes |context| the current one on this thread for its lifetime.
+class ScopedTraceContext {
+ public:
+  explicit ScopedTraceContext(const TraceContext& context);
+  ScopedTraceContext(ScopedTraceContext&& other);
+  ~ScopedTraceContext();
+  ScopedTraceContext(const ScopedTraceContext&) = delete;
+  ScopedTraceContext& operator=(const ScopedTraceContext&) = delete;
+
+ private:
+  TraceContext previous_;
+  bool restore_;
+};
+
+
+// A span, which starts when constructed and ends when End() is
+// called, or it is destroyed. It does not change the current context
+// on the thread, see ScopedSpan for that.
+class Span {
+ public:
+  // Starts a child of the current span on this thread.
+  explicit Span(const std::string& name);
+  // Starts a child of |parent|.
+  Span(const std::string& name, const TraceContext& parent);
+  Span(Span&& other);
+  ~Span();
+  Span(const Span&) = delete;
+  Span& operator=(const Span&) = delete;
+
+  const TraceContext& context() const {
+    return context_;
+  }
+
+  // Attributes are only kept for sampled spans, so check sampled() to
+  // avoid computing them for nothing.
+  bool sampled() const {
+    return context_.sampled;
+  }
+  void SetName(const std::string& name);
+  void SetAttribute(const std::string& key, const std::string& value);
+
+  void End();
+
+ private:
+  TraceContext context_;
+  uint64_t parent_span_id_;
+  std::string name_;
+  std::chrono::system_clock::time_point start_;
+  std::vector<std::pair<std::string, std::string>> attributes_;
+};
+
+
+// A span which is the current one on this thread for its lifetime.
+class ScopedSpan {
+ public:
+  explicit ScopedSpan(const std::string& name)
+      : span_(name), scope_(span_.context()) {
+  }
+  ScopedSpan(ScopedSpan&& other) = default;
+  ScopedSpan(const ScopedSpan&) = delete;
+  ScopedSpan& operator=(const ScopedSpan&) = delete;
+
+  Span* span() {
+    return &span_;
+  }
+
+ private:
+  // Destroyed in reverse order: the previous context is restored
+  // before the span ends.
+  Span span_;
+  ScopedTraceContext scope_;
+};
+
+
+// Returns a closure running |closure| in the current context, for
+// work to be run on another thread. If the trace is sampled, the time
+// until it starts is recorded as a span named |queue_name|. If there
+// is no trace, |closure| is returned unchanged.
+std::function<void()> TracedClosure(const std::string& queue_name,
+                                    const std::function<void()>& closure);
+
+
+}  // namespace util
+
+#endif  // CERT_TRANS_UTIL_TRACE_H_
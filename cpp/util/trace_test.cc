@@ -0,0 +1,113 @@
+#include "util/trace.h"
+
+#include <gflags/gflags.h>
+#include <gtest/gtest.h>
+
+#include "util/sync_task.h"
+#include "util/testing.h"
+#include "util/thread_pool.h"
+
+DECLARE_double(trace_sample_rate);
+
+namespace util {
+namespace {
+
+
+class TraceTest : public ::testing::Test {
+ protected:
+  TraceTest() : old_sample_rate_(FLAGS_trace_sample_rate) {
+  }
+
+  ~TraceTest() {
+    FLAGS_trace_sample_rate = old_sample_rate_;
+  }
+
+  const double old_sample_rate_;
+};
+
+
+TEST_F(TraceTest, DisabledByDefault) {
+  FLAGS_trace_sample_rate = 0;
+  ScopedSpan span("root");
+  EXPECT_FALSE(CurrentTraceContext().traced);
+  EXPECT_FALSE(span.span()->sampled());
+}
+
+
+TEST_F(TraceTest, ChildrenShareTheTrace) {
+  FLAGS_trace_sample_rate = 1;
+  ScopedSpan root("root");
+  const TraceContext root_context(CurrentTraceContext());
+  EXPECT_TRUE(root_context.sampled);
+  {
+    ScopedSpan child("child");
+    const TraceContext& child_context(CurrentTraceContext());
+    EXPECT_TRUE(child_context.sampled);
+    EXPECT_EQ(root_context.trace_id_high, child_context.trace_id_high);
+    EXPECT_EQ(root_context.trace_id_low, child_context.trace_id_low);
+    EXPECT_NE(root_context.span_id, child_context.span_id);
+  }
+  EXPECT_EQ(root_context.span_id, CurrentTraceContext().span_id);
+}
+
+
+TEST_F(TraceTest, UnsampledTracesStayUnsampled) {
+  FLAGS_trace_sample_rate = 1e-300;
+  ScopedSpan root("root");
+  EXPECT_TRUE(CurrentTraceContext().traced);
+  EXPECT_FALSE(CurrentTraceContext().sampled);
+
+  FLAGS_trace_sample_rate = 1;
+  ScopedSpan child("child");
+  EXPECT_FALSE(child.span()->sampled());
+}
+
+
+TEST_F(TraceTest, PropagatesThroughThreadPool) {
+  FLAGS_trace_sample_rate = 1;
+  cert_trans::ThreadPool pool(1);
+  ScopedSpan root("root");
+  const TraceContext root_context(CurrentTraceContext());
+
+  TraceContext seen;
+  SyncTask task(&pool);
+  pool.Add([&seen, &task]() {
+    seen = CurrentTraceContext();
+    task.task()->Return();
+  });
+  task.Wait();
+  EXPECT_EQ(root_context.span_id, seen.span_id);
+}
+
+
+TEST_F(TraceTest, PropagatesThroughTasks) {
+  FLAGS_trace_sample_rate = 1;
+  cert_trans::ThreadPool pool(1);
+  ScopedSpan root("root");
+  const TraceContext root_context(CurrentTraceContext());
+
+  TraceContext seen;
+  SyncTask task(&pool);
+  Task* const child(task.task()->AddChild([&seen, &task](Task*) {
+    seen = CurrentTraceContext();
+    task.task()->Return();
+  }));
+  {
+    // The callback runs in the context of the task, not of whoever
+    // completes it.
+    ScopedTraceContext other((TraceContext()));
+    child->Return();
+  }
+  task.Wait();
+  EXPECT_EQ(root_context.span_id, seen.span_id);
+}
+
+
+}  // namespace
+}  // namespace util
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -2,7 +2,7 @@
 
 #include <glog/logging.h>
 #include <netinet/in.h>  // for resolv.h
-#include <resolv.h>      // for b64_ntop
+#include <resolv.h>      // for b64_pton
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -16,6 +16,7 @@
 #include <vector>
 
 #include "log/ct_extensions.h"
+#include "util/codec.h"
 #include "version.h"
 
 using std::getline;
@@ -28,29 +29,11 @@ namespace util {
 
 namespace {
 const char nibble[] = "0123456789abcdef";
-
-char ByteValue(char high, char low) {
-  CHECK(('0' <= high && high <= '9') || ('a' <= high && high <= 'f'));
-  char ret;
-  if (high <= '9')
-    ret = (high - '0') << 4;
-  else
-    ret = (high - 'W') << 4;  // 'a' - 'W' = 0x61 - 0x57 = 0x0a
-  if (low <= '9')
-    ret += low - '0';
-  else
-    ret += low - 'W';
-  return ret;
-}
-
 }  // namespace
 
 string HexString(const string& data) {
-  string ret;
-  for (unsigned int i = 0; i < data.size(); ++i) {
-    ret.push_back(nibble[(data[i] >> 4) & 0xf]);
-    ret.push_back(nibble[data[i] & 0xf]);
-  }
+  string ret(2 * data.size(), 0);
+  HexEncode(data.data(), data.size(), &ret[0]);
   return ret;
 }
 
@@ -68,10 +51,9 @@ string HexString(const string& data, char byte_delimiter) {
 }
 
 string BinaryString(const string& hex_string) {
-  string ret;
   CHECK(!(hex_string.size() % 2));
-  for (size_t i = 0; i < hex_string.size(); i += 2)
-    ret.push_back(ByteValue(hex_string[i], hex_string[i + 1]));
+  string ret(hex_string.size() / 2, 0);
+  CHECK(HexDecode(hex_string.data(), ret.size(), &ret[0]));
   return ret;
 }
 
@@ -179,27 +161,35 @@ string FromBase64(const char* b64) {
   size_t length = strlen(b64);
   // Lazy: base 64 encoding is always >= in length to decoded value
   // (equality occurs for zero length).
-  u_char* buf = new u_char[length];
-  int rlength = b64_pton(b64, buf, length);
+  string ret(length, 0);
+  size_t rlength;
+  if (Base64Decode(b64, length, &ret[0], &rlength)) {
+    ret.resize(rlength);
+    return ret;
+  }
+  // Not strictly base 64, which b64_pton() may still take (for
+  // instance, with whitespace).
+  int plength =
+      b64_pton(b64, reinterpret_cast<u_char*>(&ret[0]), ret.size());
   // Treat decode errors as empty strings.
-  if (rlength < 0)
-    rlength = 0;
-  string ret(reinterpret_cast<char*>(buf), rlength);
-  delete[] buf;
+  if (plength < 0)
+    plength = 0;
+  ret.resize(plength);
   return ret;
 }
 
 string ToBase64(const string& from) {
-  // base 64 is 4 output bytes for every 3 input bytes (rounded up).
-  size_t length = ((from.size() + 2) / 3) * 4;
-  char* buf = new char[length + 1];
-  length =
-      b64_ntop((const u_char*)from.data(), from.length(), buf, length + 1);
-  string ret(buf, length);
-  delete[] buf;
+  string ret;
+  AppendBase64(from, &ret);
   return ret;
 }
 
+void AppendBase64(const string& from, string* to) {
+  const size_t offset = to->size();
+  to->resize(offset + Base64EncodedSize(from.size()));
+  Base64Encode(from.data(), from.size(), &(*to)[offset]);
+}
+
 vector<string> split(const string& in, char delim) {
   vector<string> ret;
   string item;
@@ -36,6 +36,9 @@ std::string FromBase64(const char* b64);
 
 std::string ToBase64(const std::string& from);
 
+// Appends the base 64 encoding of |from| to |to|.
+void AppendBase64(const std::string& from, std::string* to);
+
 std::vector<std::string> split(const std::string& in, char delim = ',');
 
 }  // namespace util